@@ -21,11 +21,19 @@
  */
 
 #include <ipset/ipset.h>
+#include <uv.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
 
 #include "rule.h"
+#include "ip_range.h"
 #include "ssrutils.h"
 #include "cache.h"
+#include "geo_data.h"
 #include "acl.h"
 
 /*
@@ -33,22 +41,129 @@
  * white list: you can connect directly
  * black list: you have to connect via proxy, or which has been blocked
  */
-static struct ip_set white_list_ipv4;
-static struct ip_set white_list_ipv6;
+enum acl_section {
+    ACL_BLACK_LIST_SECTION,
+    ACL_WHITE_LIST_SECTION,
+    ACL_OUTBOUND_BLOCK_SECTION,
+    ACL_SECTIONS,
+};
+
+/*
+ * The geoip:CC and geosite:name lines of a section. The countries are
+ * looked up in the snapshot's geoip_db, the categories in its geosite_db,
+ * both mapped, so a country is one line and not its thousands of ranges.
+ */
+struct acl_geo {
+    char **lines;  /* As written, for acl_compile(). */
+    size_t count;
+    char (*countries)[3];
+    size_t country_count;
+    int *sites;
+    size_t site_count;
+};
 
-static struct ip_set black_list_ipv4;
-static struct ip_set black_list_ipv6;
+/*
+ * Everything read from one ACL file. A reload builds a whole new one on
+ * the thread pool and the loop swaps current_acl over, see acl_reload().
+ */
+struct acl_snapshot {
+    struct ip_set ipv4[ACL_SECTIONS];
+    struct ip_set ipv6[ACL_SECTIONS];
+    rule_set_t rules[ACL_SECTIONS];
+    /* What the matches look up, the ipsets above keep the BDD form. */
+    struct ip_range_set *ranges[ACL_SECTIONS];
+    struct acl_geo geo[ACL_SECTIONS];
+    char *geoip_file;  /* Of the geoip_file: and geosite_file: lines, relative to the ACL's directory. */
+    char *geosite_file;
+    struct geoip_db *geoip;
+    struct geosite_db *geosite;
+    int mode;
+    void *map;  /* The binary ACL read, the rules and ranges borrow from it. */
+    size_t map_size;
+};
+
+static struct acl_snapshot *current_acl;
+static char *acl_path;  /* Of the last init_acl(), read again on reload. */
+static int acl_reloading;
 
-static struct cork_dllist black_list_rules;
-static struct cork_dllist white_list_rules;
+/*
+ * Failed attempts by source address in a fixed table, BLOCK_LIST_WAYS
+ * slots per bucket. A full bucket gives up its least offending entry,
+ * nothing is allocated per address however many of them scan at once.
+ * The workers of ssr-server share it under block_list_lock.
+ */
+#define BLOCK_LIST_BUCKETS 1024
+#define BLOCK_LIST_WAYS    4
+#define BLOCK_LIST_TTL     3600  /* Seconds an address is kept after its last failure. */
+
+struct block_entry {
+    uint8_t addr[16];
+    uint8_t version;  /* 0 for a free slot. */
+    uint8_t blocked;  /* Over MAX_TRIES, the firewall drops it if there is one. */
+    int count;
+    time_t seen;
+};
+
+static struct block_entry *block_list;
+static uv_mutex_t block_list_lock;
+static uv_once_t block_list_once = UV_ONCE_INIT;
 
-static int acl_mode = BLACK_LIST;
+/*
+ * The answers of acl_match_host() and outbound_block_match_host() by host.
+ * Any change to the lists or of current_acl bumps acl_generation, older answers are
+ * recomputed on their next lookup.
+ */
+struct acl_decision {
+    int result;
+    unsigned int generation;
+};
+
+static struct cache *acl_decisions;
+static struct cache *outbound_decisions;
+static unsigned int acl_generation;
+static struct acl_cache_stats acl_stats;
+/* Over the caches and acl_stats, the libuv binaries match from several loops. */
+static uv_mutex_t acl_decisions_lock;
+static uv_once_t acl_decisions_once = UV_ONCE_INIT;
 
-static struct cache *block_list;
+/*
+ * The ACL pre-compiled by acl_compile(), in host byte order: a header,
+ * per section the sorted ranges of ip_range.h, the rules and the offsets
+ * of the geo lines, then the NUL-terminated strings. The ranges and
+ * strings are used where they are mapped, nothing is parsed at start.
+ * The last byte of the magic is the version.
+ */
+#define ACL_BINARY_MAGIC      "SSRACL\0\2"
+#define ACL_BINARY_BYTE_ORDER 0x01020304
+
+struct acl_binary_section {
+    uint64_t v4_offset;
+    uint64_t v4_count;
+    uint64_t v6_offset;
+    uint64_t v6_count;
+    uint64_t rules_offset;
+    uint64_t rules_count;
+    uint64_t geo_offset;
+    uint64_t geo_count;
+};
+
+struct acl_binary_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t mode;
+    uint64_t size;
+    uint64_t geoip_file;  /* Offsets of strings, 0 for none. */
+    uint64_t geosite_file;
+    struct acl_binary_section sections[ACL_SECTIONS];
+};
+
+struct acl_binary_rule {
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t pattern;  /* Offsets of strings, 0 for no literal. */
+    uint64_t literal;
+};
 
-static struct ip_set outbound_block_list_ipv4;
-static struct ip_set outbound_block_list_ipv6;
-static struct cork_dllist outbound_block_list_rules;
 
 #ifdef __linux__
 
@@ -228,96 +343,187 @@ set_firewall_rule(char *addr, int add)
     return 0;
 }
 
+#endif
+
 static void
-free_firewall_rule(void *key, void *element)
+block_entry_firewall(const struct block_entry *entry, int add)
 {
-    if (key == NULL)
+#ifdef __linux__
+    char name[INET6_ADDRSTRLEN];
+
+    if (mode == NO_FIREWALL_MODE)
         return;
-    char *addr = (char *)key;
-    set_firewall_rule(addr, 0);
-    safe_free(element);
+    uv_inet_ntop(entry->version == 4 ? AF_INET : AF_INET6, entry->addr, name, sizeof(name));
+    set_firewall_rule(name, add);
+#else
+    (void)entry;
+    (void)add;
+#endif
 }
 
-#endif
+static void
+block_entry_release(struct block_entry *entry)
+{
+    if (entry->blocked)
+        block_entry_firewall(entry, 0);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Which slot of a full bucket goes first: free ones, then the fewest failures. */
+static int
+block_entry_weight(const struct block_entry *entry)
+{
+    if (entry->version == 0)
+        return -1;
+    return entry->blocked ? INT_MAX : entry->count;
+}
+
+/* The slot of |addr|, a new one if |create|, NULL if not there. */
+static struct block_entry *
+block_list_find(const char *addr, int create, time_t now)
+{
+    struct block_entry *bucket, *victim = NULL;
+    uint8_t key[16] = { 0 };
+    uint32_t hash = 2166136261u;
+    struct cork_ip ip;
+    int i;
+
+    if (block_list == NULL || cork_ip_init(&ip, addr))
+        return NULL;
+    if (ip.version == 4)
+        memcpy(key, ip.ip.v4._.u8, 4);
+    else
+        memcpy(key, ip.ip.v6._.u8, 16);
+
+    for (i = 0; i < 16; i++)
+        hash = (hash ^ key[i]) * 16777619u;  // FNV-1a
+    hash ^= (uint32_t)ip.version;
+    bucket = &block_list[(hash % BLOCK_LIST_BUCKETS) * BLOCK_LIST_WAYS];
+
+    for (i = 0; i < BLOCK_LIST_WAYS; i++) {
+        struct block_entry *entry = &bucket[i];
+        if (entry->version != 0 && now - entry->seen > BLOCK_LIST_TTL)
+            block_entry_release(entry);
+        if (entry->version == ip.version && memcmp(entry->addr, key, sizeof(key)) == 0)
+            return entry;
+        if (victim == NULL || block_entry_weight(entry) < block_entry_weight(victim))
+            victim = entry;
+    }
+    if (!create)
+        return NULL;
+
+    block_entry_release(victim);
+    memcpy(victim->addr, key, sizeof(key));
+    victim->version = (uint8_t)ip.version;
+    victim->seen    = now;
+    return victim;
+}
+
+static void
+block_list_lock_init(void)
+{
+    uv_mutex_init(&block_list_lock);
+}
 
 void
 init_block_list(int firewall)
 {
-    // Initialize cache
 #ifdef __linux__
     if (firewall)
         init_firewall();
     else
         mode = NO_FIREWALL_MODE;
-    cache_create(&block_list, 256, free_firewall_rule);
-#else
-    cache_create(&block_list, 256, NULL);
 #endif
+    uv_once(&block_list_once, block_list_lock_init);
+    if (block_list == NULL)
+        block_list = calloc(BLOCK_LIST_BUCKETS * BLOCK_LIST_WAYS, sizeof(*block_list));
 }
 
 void
 free_block_list()
 {
 #ifdef __linux__
+    // Drops the whole chain, not rule by rule.
     if (mode != NO_FIREWALL_MODE)
         reset_firewall();
 #endif
-    cache_clear(block_list, 0); // Remove all items
+    free(block_list);
+    block_list = NULL;
 }
 
 int
 remove_from_block_list(char *addr)
 {
-    size_t addr_len = strlen(addr);
-    return cache_remove(block_list, addr, addr_len);
+    struct block_entry *entry;
+
+    if (block_list == NULL)
+        return -1;
+    uv_mutex_lock(&block_list_lock);
+    entry = block_list_find(addr, 0, time(NULL));
+    if (entry != NULL)
+        block_entry_release(entry);
+    uv_mutex_unlock(&block_list_lock);
+    return entry != NULL ? 0 : -1;
 }
 
 void
 clear_block_list()
 {
-    cache_clear(block_list, 3600); // Clear items older than 1 hour
+    time_t now = time(NULL);
+    int i;
+
+    if (block_list == NULL)
+        return;
+    uv_mutex_lock(&block_list_lock);
+    for (i = 0; i < BLOCK_LIST_BUCKETS * BLOCK_LIST_WAYS; i++) {
+        if (block_list[i].version != 0 && now - block_list[i].seen > BLOCK_LIST_TTL)
+            block_entry_release(&block_list[i]);
+    }
+    uv_mutex_unlock(&block_list_lock);
 }
 
 int
 check_block_list(char *addr)
 {
-    size_t addr_len = strlen(addr);
-
-    if (cache_key_exist(block_list, addr, addr_len)) {
-        int *count = NULL;
-        cache_lookup(block_list, addr, addr_len, &count);
-
-        if (count != NULL && *count > MAX_TRIES)
-            return 1;
-    }
-
-    return 0;
+    struct block_entry *entry;
+    int blocked;
+
+    if (block_list == NULL)
+        return 0;
+    uv_mutex_lock(&block_list_lock);
+    entry   = block_list_find(addr, 0, time(NULL));
+    blocked = (entry != NULL && entry->count > MAX_TRIES) ? 1 : 0;
+    uv_mutex_unlock(&block_list_lock);
+    return blocked;
 }
 
 int
 update_block_list(char *addr, int err_level)
 {
-    size_t addr_len = strlen(addr);
-
-    if (cache_key_exist(block_list, addr, addr_len)) {
-        int *count = NULL;
-        cache_lookup(block_list, addr, addr_len, &count);
-        if (count != NULL) {
-            if (*count > MAX_TRIES)
-                return 1;
-            (*count) += err_level;
+    time_t now = time(NULL);
+    struct block_entry *entry;
+    int blocked = 0;
+
+    if (block_list == NULL)
+        return 0;
+    uv_mutex_lock(&block_list_lock);
+    entry = block_list_find(addr, err_level > 0, now);
+    if (entry == NULL || err_level <= 0) {
+        blocked = (entry != NULL && entry->count > MAX_TRIES) ? 1 : 0;
+    } else if (entry->count > MAX_TRIES) {
+        blocked = 1;
+    } else {
+        entry->count = entry->count ? entry->count + err_level : 1;
+        entry->seen  = now;
+        if (entry->count > MAX_TRIES && !entry->blocked) {
+            // Only confirmed offenders cost a firewall rule.
+            entry->blocked = 1;
+            block_entry_firewall(entry, 1);
         }
-    } else if (err_level > 0) {
-        int *count = (int *)calloc(1, sizeof(int));
-        *count = 1;
-        cache_insert(block_list, addr, addr_len, count);
-#ifdef __linux__
-        if (mode != NO_FIREWALL_MODE)
-            set_firewall_rule(addr, 1);
-#endif
     }
+    uv_mutex_unlock(&block_list_lock);
 
-    return 0;
+    return blocked;
 }
 
 static void
@@ -365,38 +571,518 @@ trimwhitespace(char *str)
     return str;
 }
 
-int
-init_acl(const char *path)
+
+static void
+snapshot_unmap(struct acl_snapshot *snapshot)
 {
-    struct ip_set *list_ipv4;
-    struct ip_set *list_ipv6;
-    struct cork_dllist *rules;
-    FILE *f;
-    char buf[257];
+    if (snapshot->map == NULL) {
+        return;
+    }
+#if defined(_WIN32)
+    free(snapshot->map);
+#else
+    munmap(snapshot->map, snapshot->map_size);
+#endif
+    snapshot->map      = NULL;
+    snapshot->map_size = 0;
+}
 
-    // initialize ipset
-    ipset_init_library();
+static struct acl_snapshot *
+snapshot_new(void)
+{
+    struct acl_snapshot *snapshot = calloc(1, sizeof(*snapshot));
+    int i;
+
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < ACL_SECTIONS; i++) {
+        ipset_init(&snapshot->ipv4[i]);
+        ipset_init(&snapshot->ipv6[i]);
+        init_rule_set(&snapshot->rules[i]);
+        snapshot->ranges[i] = ip_range_set_create();
+    }
+    snapshot->mode = BLACK_LIST;
+    return snapshot;
+}
+
+static void
+snapshot_free(struct acl_snapshot *snapshot)
+{
+    int i;
+
+    if (snapshot == NULL) {
+        return;
+    }
+    for (i = 0; i < ACL_SECTIONS; i++) {
+        struct acl_geo *geo = &snapshot->geo[i];
+        ipset_done(&snapshot->ipv4[i]);
+        ipset_done(&snapshot->ipv6[i]);
+        free_rule_set(&snapshot->rules[i]);
+        ip_range_set_destroy(snapshot->ranges[i]);
+        while (geo->count > 0) {
+            free(geo->lines[--geo->count]);
+        }
+        free(geo->lines);
+        free(geo->countries);
+        free(geo->sites);
+    }
+    geoip_db_close(snapshot->geoip);
+    geosite_db_close(snapshot->geosite);
+    free(snapshot->geoip_file);
+    free(snapshot->geosite_file);
+    // Last, the rules and ranges above read from it.
+    snapshot_unmap(snapshot);
+    free(snapshot);
+}
+
+static int
+acl_geo_add(struct acl_geo *geo, const char *line)
+{
+    char **lines = realloc(geo->lines, (geo->count + 1) * sizeof(*lines));
+
+    if (lines == NULL) {
+        return -1;
+    }
+    geo->lines = lines;
+    if ((geo->lines[geo->count] = ss_strdup(line)) == NULL) {
+        return -1;
+    }
+    geo->count++;
+    return 0;
+}
+
+/* |file| as written in the ACL at |path|, a relative one is next to it. */
+static char *
+acl_geo_path(const char *path, const char *file)
+{
+    const char *slash = strrchr(path, '/');
+    char *joined;
+    size_t dir_len;
+
+#if defined(_WIN32)
+    const char *backslash = strrchr(path, '\\');
+    if (backslash != NULL && (slash == NULL || backslash > slash)) {
+        slash = backslash;
+    }
+    if (file[0] == '\\' || (file[0] != '\0' && file[1] == ':')) {
+        return ss_strdup(file);
+    }
+#endif
+    if (file[0] == '/' || slash == NULL) {
+        return ss_strdup(file);
+    }
+    dir_len = (size_t)(slash - path) + 1;
+    joined  = malloc(dir_len + strlen(file) + 1);
+    if (joined != NULL) {
+        memcpy(joined, path, dir_len);
+        strcpy(joined + dir_len, file);
+    }
+    return joined;
+}
+
+/* Opens the geo files and looks up what the geo lines name, in place of a range or rule each. */
+static int
+acl_geo_resolve(struct acl_snapshot *snapshot)
+{
+    int i;
+
+    if (snapshot->geoip_file != NULL
+        && (snapshot->geoip = geoip_db_open(snapshot->geoip_file)) == NULL) {
+        return -1;
+    }
+    if (snapshot->geosite_file != NULL
+        && (snapshot->geosite = geosite_db_open(snapshot->geosite_file)) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < ACL_SECTIONS; i++) {
+        struct acl_geo *geo = &snapshot->geo[i];
+        size_t j;
+
+        if (geo->count == 0) {
+            continue;
+        }
+        geo->countries = calloc(geo->count, sizeof(*geo->countries));
+        geo->sites     = calloc(geo->count, sizeof(*geo->sites));
+        if (geo->countries == NULL || geo->sites == NULL) {
+            return -1;
+        }
+        for (j = 0; j < geo->count; j++) {
+            const char *line = geo->lines[j];
+            if (strncmp(line, "geoip:", 6) == 0) {
+                const char *code = line + 6;
+                if (snapshot->geoip == NULL || strlen(code) != 2) {
+                    LOGE("%s: %s", line, snapshot->geoip ? "not a country code" : "no geoip_file");
+                    continue;
+                }
+                geo->countries[geo->country_count][0] = (char)toupper((unsigned char)code[0]);
+                geo->countries[geo->country_count][1] = (char)toupper((unsigned char)code[1]);
+                geo->country_count++;
+            } else {
+                int site = geosite_db_category(snapshot->geosite, line + 8);
+                if (site < 0) {
+                    LOGE("%s: %s", line, snapshot->geosite ? "no such category" : "no geosite_file");
+                    continue;
+                }
+                geo->sites[geo->site_count++] = site;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Whether the address with |country|, "" for none, is in a geoip: line of |section|. */
+static int
+acl_geo_match_country(const struct acl_snapshot *acl, int section, const char *country)
+{
+    const struct acl_geo *geo = &acl->geo[section];
+    size_t i;
+
+    for (i = 0; i < geo->country_count && country[0] != '\0'; i++) {
+        if (memcmp(geo->countries[i], country, 2) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether |host|, lower case, is in a category of a geosite: line of |section|. */
+static int
+acl_geo_match_site(const struct acl_snapshot *acl, int section, const char *host, size_t host_len)
+{
+    const struct acl_geo *geo = &acl->geo[section];
+    size_t i;
+
+    for (i = 0; i < geo->site_count; i++) {
+        if (geosite_db_match(acl->geosite, geo->sites[i], host, host_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* The country of |addr| into |country|, "" unless a geoip: line could want it. */
+static void
+acl_geo_country(const struct acl_snapshot *acl, const struct cork_ip *addr, char country[3])
+{
+    int i, wanted = 0;
+
+    country[0] = '\0';
+    for (i = 0; i < ACL_SECTIONS; i++) {
+        wanted |= (acl->geo[i].country_count > 0);
+    }
+    if (!wanted || acl->geoip == NULL) {
+        return;
+    }
+    if (!geoip_db_country(acl->geoip, addr->version, addr->version == 4 ? addr->ip.v4._.u8 : addr->ip.v6._.u8, country)) {
+        country[0] = '\0';
+    }
+}
+
+/* |host| lower case into |lower|, 0 when it's too long for any name a geosite holds. */
+static size_t
+acl_geo_lower(const char *host, size_t host_len, char *lower, size_t size)
+{
+    size_t i;
+
+    if (host_len >= size) {
+        return 0;
+    }
+    for (i = 0; i < host_len; i++) {
+        lower[i] = (char)tolower((unsigned char)host[i]);
+    }
+    lower[host_len] = '\0';
+    return host_len;
+}
+
+static int
+acl_binary_array(size_t size, uint64_t offset, uint64_t count, size_t item)
+{
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / item;
+}
+
+static int
+acl_binary_string(const uint8_t *base, size_t size, uint64_t offset)
+{
+    return offset >= sizeof(struct acl_binary_header) && offset < size
+           && memchr(base + offset, '\0', size - (size_t)offset) != NULL;
+}
+
+static int
+acl_binary_valid(const uint8_t *base, size_t size)
+{
+    const struct acl_binary_header *header = (const struct acl_binary_header *)base;
+    int i;
+
+    if (size < sizeof(*header) || memcmp(header->magic, ACL_BINARY_MAGIC, sizeof(header->magic)) != 0
+        || header->byte_order != ACL_BINARY_BYTE_ORDER || header->size != size
+        || (header->mode != BLACK_LIST && header->mode != WHITE_LIST)
+        || (header->geoip_file != 0 && !acl_binary_string(base, size, header->geoip_file))
+        || (header->geosite_file != 0 && !acl_binary_string(base, size, header->geosite_file))) {
+        return 0;
+    }
+    for (i = 0; i < ACL_SECTIONS; i++) {
+        const struct acl_binary_section *section = &header->sections[i];
+        const struct acl_binary_rule *rules;
+        const uint64_t *geo;
+        uint64_t j;
+
+        if (!acl_binary_array(size, section->v4_offset, section->v4_count, IP_RANGE_IPV4_SIZE)
+            || !acl_binary_array(size, section->v6_offset, section->v6_count, IP_RANGE_IPV6_SIZE)
+            || !acl_binary_array(size, section->rules_offset, section->rules_count, sizeof(*rules))
+            || !acl_binary_array(size, section->geo_offset, section->geo_count, sizeof(*geo))) {
+            return 0;
+        }
+        geo = (const uint64_t *)(base + section->geo_offset);
+        for (j = 0; j < section->geo_count; j++) {
+            if (!acl_binary_string(base, size, geo[j])) {
+                return 0;
+            }
+        }
+        rules = (const struct acl_binary_rule *)(base + section->rules_offset);
+        for (j = 0; j < section->rules_count; j++) {
+            if (rules[j].kind > RULE_KEYWORD || !acl_binary_string(base, size, rules[j].pattern)
+                || (rules[j].literal != 0 && !acl_binary_string(base, size, rules[j].literal))
+                || ((rules[j].kind == RULE_REGEX) != (rules[j].literal == 0))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* |f| is past the magic. The snapshot keeps the mapping, loaded or not. */
+static int
+load_acl_binary(struct acl_snapshot *snapshot, FILE *f)
+{
+    const struct acl_binary_header *header;
+    const uint8_t *base;
+    long size;
+    void *map;
+    int i;
+
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < (long)sizeof(*header)) {
+        LOGE("Invalid binary acl.");
+        return -1;
+    }
+#if defined(_WIN32)
+    map = malloc((size_t)size);
+    if (map != NULL && (fseek(f, 0, SEEK_SET) != 0 || fread(map, 1, (size_t)size, f) != (size_t)size)) {
+        free(map);
+        map = NULL;
+    }
+    if (map == NULL) {
+#else
+    map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (map == MAP_FAILED) {
+#endif
+        LOGE("Failed to map the binary acl.");
+        return -1;
+    }
+    snapshot->map      = map;
+    snapshot->map_size = (size_t)size;
+    base               = (const uint8_t *)map;
+
+    if (!acl_binary_valid(base, snapshot->map_size)) {
+        LOGE("Invalid binary acl.");
+        return -1;
+    }
+    header         = (const struct acl_binary_header *)base;
+    snapshot->mode = (int)header->mode;
+    if (header->geoip_file != 0) {
+        snapshot->geoip_file = ss_strdup((const char *)(base + header->geoip_file));
+    }
+    if (header->geosite_file != 0) {
+        snapshot->geosite_file = ss_strdup((const char *)(base + header->geosite_file));
+    }
+
+    for (i = 0; i < ACL_SECTIONS; i++) {
+        const struct acl_binary_section *section = &header->sections[i];
+        const struct acl_binary_rule *rules = (const struct acl_binary_rule *)(base + section->rules_offset);
+        const uint64_t *geo = (const uint64_t *)(base + section->geo_offset);
+        uint64_t j;
+
+        for (j = 0; j < section->geo_count; j++) {
+            if (acl_geo_add(&snapshot->geo[i], (const char *)(base + geo[j])) != 0) {
+                return -1;
+            }
+        }
+
+        ip_range_set_destroy(snapshot->ranges[i]);
+        snapshot->ranges[i] = ip_range_set_create_static(base + section->v4_offset, (size_t)section->v4_count,
+                                                         base + section->v6_offset, (size_t)section->v6_count);
+        // The domain tables are on the heap, only they and the regexes are built here.
+        for (j = 0; j < section->rules_count; j++) {
+            rule_t *rule = new_rule();
+            if (rule == NULL) {
+                break;
+            }
+            rule->pattern  = (char *)(base + rules[j].pattern);
+            rule->literal  = rules[j].literal ? (char *)(base + rules[j].literal) : NULL;
+            rule->kind     = (enum rule_kind)rules[j].kind;
+            rule->borrowed = 1;
+            init_rule(rule);
+            add_rule(&snapshot->rules[i], rule);
+        }
+    }
+    compile_rule_sets(snapshot->rules, ACL_SECTIONS);
+    return acl_geo_resolve(snapshot);
+}
+
+struct acl_writer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* Offset of |len| bytes, |data| or zeroes, at the next multiple of |align|; 0 when out of memory. */
+static uint64_t
+acl_writer_put(struct acl_writer *w, const void *data, size_t len, size_t align)
+{
+    size_t offset = (w->size + align - 1) / align * align;
+
+    if (offset + len > w->capacity) {
+        size_t capacity = w->capacity ? w->capacity : 4096;
+        uint8_t *grown;
+        while (capacity < offset + len) {
+            capacity *= 2;
+        }
+        grown = realloc(w->data, capacity);
+        if (grown == NULL) {
+            return 0;
+        }
+        w->data     = grown;
+        w->capacity = capacity;
+    }
+    memset(w->data + w->size, 0, offset - w->size);
+    if (data != NULL) {
+        memcpy(w->data + offset, data, len);
+    } else {
+        memset(w->data + offset, 0, len);
+    }
+    w->size = offset + len;
+    return offset;
+}
 
-    ipset_init(&white_list_ipv4);
-    ipset_init(&white_list_ipv6);
-    ipset_init(&black_list_ipv4);
-    ipset_init(&black_list_ipv6);
-    ipset_init(&outbound_block_list_ipv4);
-    ipset_init(&outbound_block_list_ipv6);
+static int
+write_acl_binary(struct acl_snapshot *snapshot, FILE *f)
+{
+    struct acl_writer w = { NULL, 0, 0 };
+    struct acl_binary_header header;
+    struct acl_binary_rule *records;
+    int i, ok = 1;
+
+    memset(&header, 0, sizeof(header));
+    acl_writer_put(&w, NULL, sizeof(header), 8);
+    if (w.data == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < ACL_SECTIONS && ok; i++) {
+        struct acl_binary_section *section = &header.sections[i];
+        struct cork_dllist_item *curr, *next;
+        const void *ranges;
+        size_t j = 0;
+
+        section->v4_count  = ip_range_set_ipv4(snapshot->ranges[i], &ranges);
+        section->v4_offset = acl_writer_put(&w, ranges, (size_t)section->v4_count * IP_RANGE_IPV4_SIZE, 8);
+        section->v6_count  = ip_range_set_ipv6(snapshot->ranges[i], &ranges);
+        section->v6_offset = acl_writer_put(&w, ranges, (size_t)section->v6_count * IP_RANGE_IPV6_SIZE, 8);
+
+        section->rules_count  = (uint64_t)cork_dllist_size(&snapshot->rules[i].rules);
+        section->rules_offset = acl_writer_put(&w, NULL, (size_t)section->rules_count * sizeof(*records), 8);
+        ok = (section->v4_offset && section->v6_offset && section->rules_offset);
+
+        if (ok && snapshot->geo[i].count > 0) {
+            uint64_t *geo = calloc(snapshot->geo[i].count, sizeof(*geo));
+            size_t k;
+            ok = (geo != NULL);
+            for (k = 0; ok && k < snapshot->geo[i].count; k++) {
+                const char *line = snapshot->geo[i].lines[k];
+                ok = ((geo[k] = acl_writer_put(&w, line, strlen(line) + 1, 1)) != 0);
+            }
+            section->geo_count  = snapshot->geo[i].count;
+            section->geo_offset = ok ? acl_writer_put(&w, geo, (size_t)section->geo_count * sizeof(*geo), 8) : 0;
+            ok = ok && section->geo_offset;
+            free(geo);
+        }
 
-    cork_dllist_init(&black_list_rules);
-    cork_dllist_init(&white_list_rules);
-    cork_dllist_init(&outbound_block_list_rules);
+        cork_dllist_foreach_void(&snapshot->rules[i].rules, curr, next) {
+            rule_t *rule = cork_container_of(curr, rule_t, entries);
+            struct acl_binary_rule record;
 
-    list_ipv4  = &black_list_ipv4;
-    list_ipv6  = &black_list_ipv6;
-    rules = &black_list_rules;
+            memset(&record, 0, sizeof(record));
+            record.kind    = (uint32_t)rule->kind;
+            record.pattern = acl_writer_put(&w, rule->pattern, strlen(rule->pattern) + 1, 1);
+            if (rule->kind != RULE_REGEX) {
+                record.literal = acl_writer_put(&w, rule->literal, strlen(rule->literal) + 1, 1);
+            }
+            if (!ok || record.pattern == 0 || (rule->kind != RULE_REGEX && record.literal == 0)) {
+                ok = 0;
+                break;
+            }
+            // The buffer may have moved, address the record by offset.
+            records = (struct acl_binary_rule *)(w.data + section->rules_offset);
+            records[j++] = record;
+        }
+    }
 
-    f = fopen(path, "r");
+    if (ok && snapshot->geoip_file != NULL) {
+        ok = ((header.geoip_file = acl_writer_put(&w, snapshot->geoip_file, strlen(snapshot->geoip_file) + 1, 1)) != 0);
+    }
+    if (ok && snapshot->geosite_file != NULL) {
+        ok = ((header.geosite_file = acl_writer_put(&w, snapshot->geosite_file, strlen(snapshot->geosite_file) + 1, 1)) != 0);
+    }
+    if (ok) {
+        memcpy(header.magic, ACL_BINARY_MAGIC, sizeof(header.magic));
+        header.byte_order = ACL_BINARY_BYTE_ORDER;
+        header.mode       = (uint32_t)snapshot->mode;
+        header.size       = w.size;
+        memcpy(w.data, &header, sizeof(header));
+        ok = (fwrite(w.data, 1, w.size, f) == w.size);
+    }
+    free(w.data);
+    return ok ? 0 : -1;
+}
+
+/* Reads |path| into a new snapshot. Touches no global state, any thread may run it. */
+static struct acl_snapshot *
+load_acl(const char *path)
+{
+    struct acl_snapshot *snapshot;
+    int section = ACL_BLACK_LIST_SECTION;
+    FILE *f;
+    char buf[257];
+    char magic[8];
+    int i;
+
+    f = fopen(path, "rb");
     if (f == NULL) {
         LOGE("Invalid acl path.");
-        return -1;
+        return NULL;
+    }
+    snapshot = snapshot_new();
+    if (snapshot == NULL) {
+        fclose(f);
+        return NULL;
+    }
+
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+        && memcmp(magic, ACL_BINARY_MAGIC, sizeof(magic) - 1) == 0) {
+        int ret = -1;
+        if (memcmp(magic, ACL_BINARY_MAGIC, sizeof(magic)) != 0) {
+            LOGE("Binary acl of another version, compile it again.");
+        } else {
+            ret = load_acl_binary(snapshot, f);
+        }
+        fclose(f);
+        if (ret != 0) {
+            snapshot_free(snapshot);
+            return NULL;
+        }
+        return snapshot;
     }
+    rewind(f);
 
     while (!feof(f))
         if (fgets(buf, 256, f)) {
@@ -424,142 +1110,393 @@ init_acl(const char *path)
             }
 
             if (strcmp(line, "[outbound_block_list]") == 0) {
-                list_ipv4 = &outbound_block_list_ipv4;
-                list_ipv6 = &outbound_block_list_ipv6;
-                rules     = &outbound_block_list_rules;
+                section = ACL_OUTBOUND_BLOCK_SECTION;
                 continue;
             } else if (strcmp(line, "[white_list]") == 0
                        || strcmp(line, "[proxy_list]") == 0) {
-                list_ipv4 = &black_list_ipv4;
-                list_ipv6 = &black_list_ipv6;
-                rules     = &black_list_rules;
+                section = ACL_BLACK_LIST_SECTION;
                 continue;
             } else if (strcmp(line, "[black_list]") == 0
                        || strcmp(line, "[bypass_list]") == 0) {
-                list_ipv4 = &white_list_ipv4;
-                list_ipv6 = &white_list_ipv6;
-                rules     = &white_list_rules;
+                section = ACL_WHITE_LIST_SECTION;
                 continue;
             } else if (strcmp(line, "[reject_all]") == 0
                        || strcmp(line, "[bypass_all]") == 0) {
-                acl_mode = BLACK_LIST;
+                snapshot->mode = BLACK_LIST;
                 continue;
             } else if (strcmp(line, "[accept_all]") == 0
                        || strcmp(line, "[proxy_all]") == 0) {
-                acl_mode = WHITE_LIST;
+                snapshot->mode = WHITE_LIST;
                 continue;
             } else if (strcmp(line, "[remote_dns]") == 0) {
                 continue;
             }
 
+            if (strncmp(line, "geoip_file:", 11) == 0 || strncmp(line, "geosite_file:", 13) == 0) {
+                char **file = (line[3] == 'i') ? &snapshot->geoip_file : &snapshot->geosite_file;
+                free(*file);
+                *file = acl_geo_path(path, trimwhitespace(strchr(line, ':') + 1));
+                continue;
+            }
+            if (strncmp(line, "geoip:", 6) == 0 || strncmp(line, "geosite:", 8) == 0) {
+                acl_geo_add(&snapshot->geo[section], line);
+                continue;
+            }
+
             parse_addr_cidr(line, host, &cidr);
 
             err = cork_ip_init(&addr, host);
             if (!err) {
                 if (addr.version == 4) {
                     if (cidr >= 0) {
-                        ipset_ipv4_add_network(list_ipv4, &(addr.ip.v4), cidr);
+                        ipset_ipv4_add_network(&snapshot->ipv4[section], &(addr.ip.v4), cidr);
                     } else {
-                        ipset_ipv4_add(list_ipv4, &(addr.ip.v4));
+                        ipset_ipv4_add(&snapshot->ipv4[section], &(addr.ip.v4));
                     }
+                    ip_range_set_add_ipv4(snapshot->ranges[section], addr.ip.v4._.u8, cidr);
                 } else if (addr.version == 6) {
                     if (cidr >= 0) {
-                        ipset_ipv6_add_network(list_ipv6, &(addr.ip.v6), cidr);
+                        ipset_ipv6_add_network(&snapshot->ipv6[section], &(addr.ip.v6), cidr);
                     } else {
-                        ipset_ipv6_add(list_ipv6, &(addr.ip.v6));
+                        ipset_ipv6_add(&snapshot->ipv6[section], &(addr.ip.v6));
                     }
+                    ip_range_set_add_ipv6(snapshot->ranges[section], addr.ip.v6._.u8, cidr);
                 }
             } else {
                 rule_t *rule = new_rule();
                 accept_rule_arg(rule, line);
                 init_rule(rule);
-                add_rule(rules, rule);
+                add_rule(&snapshot->rules[section], rule);
             }
         }
 
     fclose(f);
 
-    return 0;
+    compile_rule_sets(snapshot->rules, ACL_SECTIONS);
+    for (i = 0; i < ACL_SECTIONS; i++) {
+        // Sorted before it is shared, the loops of ssr-client and ssr-server only read it.
+        ip_range_set_compile(snapshot->ranges[i]);
+    }
+    if (acl_geo_resolve(snapshot) != 0) {
+        snapshot_free(snapshot);
+        return NULL;
+    }
+
+    return snapshot;
 }
 
-void
-free_rules(struct cork_dllist *rules)
+/* Returns the snapshot replaced. */
+static struct acl_snapshot *
+swap_acl(struct acl_snapshot *snapshot)
+{
+    struct acl_snapshot *old = current_acl;
+
+    current_acl = snapshot;
+    acl_generation++;
+    return old;
+}
+
+int
+acl_compile(const char *path, const char *output)
 {
-    struct cork_dllist_item *iter;
-    while ((iter = cork_dllist_head(rules)) != NULL) {
-        rule_t *rule = cork_container_of(iter, rule_t, entries);
-        remove_rule(rule);
+    struct acl_snapshot *snapshot;
+    FILE *f;
+    int ret;
+
+    ipset_init_library();
+
+    snapshot = load_acl(path);
+    if (snapshot == NULL) {
+        return -1;
     }
+    f = fopen(output, "wb");
+    if (f == NULL) {
+        LOGE("Invalid output path.");
+        snapshot_free(snapshot);
+        return -1;
+    }
+    ret = write_acl_binary(snapshot, f);
+    if (fclose(f) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        LOGE("Failed to write the binary acl.");
+    }
+    snapshot_free(snapshot);
+    return ret;
+}
+
+static void
+acl_decisions_lock_init(void)
+{
+    uv_mutex_init(&acl_decisions_lock);
+}
+
+int
+init_acl(const char *path)
+{
+    struct acl_snapshot *snapshot;
+
+    // initialize ipset
+    ipset_init_library();
+
+    uv_once(&acl_decisions_once, acl_decisions_lock_init);
+    if (acl_decisions == NULL) {
+        cache_create(&acl_decisions, ACL_DECISION_CACHE_SIZE, NULL);
+    }
+    if (outbound_decisions == NULL) {
+        cache_create(&outbound_decisions, ACL_DECISION_CACHE_SIZE, NULL);
+    }
+
+    snapshot = load_acl(path);
+    if (snapshot == NULL) {
+        return -1;
+    }
+    snapshot_free(swap_acl(snapshot));
+
+    if (acl_path != path) {
+        free(acl_path);
+        acl_path = ss_strdup(path);
+    }
+
+    return 0;
 }
 
 void
 free_acl(void)
 {
-    ipset_done(&black_list_ipv4);
-    ipset_done(&black_list_ipv6);
-    ipset_done(&white_list_ipv4);
-    ipset_done(&white_list_ipv6);
+    snapshot_free(swap_acl(NULL));
+    free(acl_path);
+    acl_path = NULL;
 
-    free_rules(&black_list_rules);
-    free_rules(&white_list_rules);
+    if (acl_decisions != NULL) {
+        cache_delete(acl_decisions, 0);
+        acl_decisions = NULL;
+    }
+    if (outbound_decisions != NULL) {
+        cache_delete(outbound_decisions, 0);
+        outbound_decisions = NULL;
+    }
+}
+
+struct acl_reload {
+    uv_work_t req;
+    uv_loop_t *loop;
+    char *path;
+    struct acl_snapshot *snapshot;  /* The one built, then the one it replaced. */
+    int replaced;
+};
+
+static void
+acl_reload_work_cb(uv_work_t *req)
+{
+    struct acl_reload *reload = cork_container_of(req, struct acl_reload, req);
+
+    if (reload->replaced) {
+        snapshot_free(reload->snapshot);
+        reload->snapshot = NULL;
+    } else {
+        reload->snapshot = load_acl(reload->path);
+    }
+}
+
+static void
+acl_reload_done_cb(uv_work_t *req, int status)
+{
+    struct acl_reload *reload = cork_container_of(req, struct acl_reload, req);
+
+    if (reload->replaced == 0 && reload->snapshot != NULL) {
+        if (status == 0 && acl_path != NULL && strcmp(acl_path, reload->path) == 0) {
+            // Every lookup runs on this loop and is done within the call,
+            // nothing holds on to the old snapshot past this point.
+            reload->snapshot = swap_acl(reload->snapshot);
+            LOGI("acl reloaded from %s", reload->path);
+        }
+        // Freed on the thread pool as well, the loop only swapped a pointer.
+        reload->replaced = 1;
+        if (reload->snapshot != NULL
+            && uv_queue_work(reload->loop, &reload->req, acl_reload_work_cb, acl_reload_done_cb) == 0) {
+            return;
+        }
+    } else if (reload->replaced == 0) {
+        LOGE("acl reload failed, keeping the current one");
+    }
+    acl_reloading = 0;
+    snapshot_free(reload->snapshot);  // NULL once the work above ran.
+    free(reload->path);
+    free(reload);
 }
 
 int
-get_acl_mode(void)
+acl_reload(struct uv_loop_s *loop)
 {
-    return acl_mode;
+    struct acl_reload *reload;
+
+    if (acl_path == NULL) {
+        return -1;
+    }
+    if (acl_reloading) {
+        return 0;
+    }
+    reload = calloc(1, sizeof(*reload));
+    if (reload == NULL) {
+        return -1;
+    }
+    reload->loop = loop;
+    reload->path = ss_strdup(acl_path);
+    if (reload->path == NULL
+        || uv_queue_work(loop, &reload->req, acl_reload_work_cb, acl_reload_done_cb) != 0) {
+        free(reload->path);
+        free(reload);
+        return -1;
+    }
+    acl_reloading = 1;
+    return 0;
 }
 
-/*
- * Return 0,  if not match.
- * Return 1,  if match black list.
- * Return -1, if match white list.
- */
 int
-acl_match_host(const char *host)
+get_acl_mode(void)
 {
+    return current_acl ? current_acl->mode : BLACK_LIST;
+}
+
+static int
+cached_decision(struct cache *decisions, const char *host, int (*decide)(const char *))
+{
+    struct acl_decision *decision = NULL;
+    size_t host_len = strlen(host);
+    unsigned int generation;
+    int result;
+
+    if (decisions == NULL) {
+        return decide(host);
+    }
+    uv_mutex_lock(&acl_decisions_lock);
+    cache_lookup(decisions, (char *)host, host_len, &decision);
+    if (decision != NULL && decision->generation == acl_generation) {
+        acl_stats.hits++;
+        result = decision->result;
+        uv_mutex_unlock(&acl_decisions_lock);
+        return result;
+    }
+    acl_stats.misses++;
+    generation = acl_generation;
+    uv_mutex_unlock(&acl_decisions_lock);
+
+    // Unlocked, a slow regex doesn't hold up the other loops.
+    result = decide(host);
+
+    uv_mutex_lock(&acl_decisions_lock);
+    // Looked up again, another loop may have stored or evicted it meanwhile.
+    decision = NULL;
+    cache_lookup(decisions, (char *)host, host_len, &decision);
+    if (decision == NULL) {
+        decision = malloc(sizeof(*decision));
+        if (decision != NULL) {
+            decision->result     = result;
+            decision->generation = generation;
+            cache_insert(decisions, (char *)host, host_len, decision);
+        }
+    } else {
+        decision->result     = result;
+        decision->generation = generation;
+    }
+    uv_mutex_unlock(&acl_decisions_lock);
+    return result;
+}
+
+void
+acl_get_cache_stats(struct acl_cache_stats *stats)
+{
+    if (acl_decisions == NULL) {
+        *stats = acl_stats;
+        return;
+    }
+    uv_mutex_lock(&acl_decisions_lock);
+    *stats = acl_stats;
+    uv_mutex_unlock(&acl_decisions_lock);
+}
+
+static int
+match_host(const char *host)
+{
+    struct acl_snapshot *acl = current_acl;
+    struct ip_range_set *black_list_ranges, *white_list_ranges;
     struct cork_ip addr;
+    char country[3];
     int ret = 0;
-    int err = cork_ip_init(&addr, host);
+    int err;
+
+    if (acl == NULL) {
+        return 0;
+    }
+    black_list_ranges = acl->ranges[ACL_BLACK_LIST_SECTION];
+    white_list_ranges = acl->ranges[ACL_WHITE_LIST_SECTION];
 
+    err = cork_ip_init(&addr, host);
     if (err) {
         size_t host_len = strlen(host);
-        if (lookup_rule(&black_list_rules, host, host_len) != NULL)
+        char lower[257];
+        size_t lower_len = acl->geosite ? acl_geo_lower(host, host_len, lower, sizeof(lower)) : 0;
+        if (lookup_rule(&acl->rules[ACL_BLACK_LIST_SECTION], host, host_len) != NULL
+            || (lower_len && acl_geo_match_site(acl, ACL_BLACK_LIST_SECTION, lower, lower_len)))
             ret = 1;
-        else if (lookup_rule(&white_list_rules, host, host_len) != NULL)
+        else if (lookup_rule(&acl->rules[ACL_WHITE_LIST_SECTION], host, host_len) != NULL
+                 || (lower_len && acl_geo_match_site(acl, ACL_WHITE_LIST_SECTION, lower, lower_len)))
             ret = -1;
         return ret;
     }
 
+    acl_geo_country(acl, &addr, country);
     if (addr.version == 4) {
-        if (ipset_contains_ipv4(&black_list_ipv4, &(addr.ip.v4)))
+        if (ip_range_set_contains_ipv4(black_list_ranges, addr.ip.v4._.u8)
+            || acl_geo_match_country(acl, ACL_BLACK_LIST_SECTION, country))
             ret = 1;
-        else if (ipset_contains_ipv4(&white_list_ipv4, &(addr.ip.v4)))
+        else if (ip_range_set_contains_ipv4(white_list_ranges, addr.ip.v4._.u8)
+                 || acl_geo_match_country(acl, ACL_WHITE_LIST_SECTION, country))
             ret = -1;
     } else if (addr.version == 6) {
-        if (ipset_contains_ipv6(&black_list_ipv6, &(addr.ip.v6)))
+        if (ip_range_set_contains_ipv6(black_list_ranges, addr.ip.v6._.u8)
+            || acl_geo_match_country(acl, ACL_BLACK_LIST_SECTION, country))
             ret = 1;
-        else if (ipset_contains_ipv6(&white_list_ipv6, &(addr.ip.v6)))
+        else if (ip_range_set_contains_ipv6(white_list_ranges, addr.ip.v6._.u8)
+                 || acl_geo_match_country(acl, ACL_WHITE_LIST_SECTION, country))
             ret = -1;
     }
 
     return ret;
 }
 
+/*
+ * Return 0,  if not match.
+ * Return 1,  if match black list.
+ * Return -1, if match white list.
+ */
+int
+acl_match_host(const char *host)
+{
+    return cached_decision(acl_decisions, host, match_host);
+}
+
 int
 acl_add_ip(const char *ip)
 {
+    struct acl_snapshot *acl = current_acl;
     struct cork_ip addr;
     int err = cork_ip_init(&addr, ip);
-    if (err) {
+    if (err || acl == NULL) {
         return -1;
     }
 
+    // Into the current snapshot, a reload starts over from the file.
     if (addr.version == 4) {
-        ipset_ipv4_add(&black_list_ipv4, &(addr.ip.v4));
+        ipset_ipv4_add(&acl->ipv4[ACL_BLACK_LIST_SECTION], &(addr.ip.v4));
+        ip_range_set_add_ipv4(acl->ranges[ACL_BLACK_LIST_SECTION], addr.ip.v4._.u8, -1);
     } else if (addr.version == 6) {
-        ipset_ipv6_add(&black_list_ipv6, &(addr.ip.v6));
+        ipset_ipv6_add(&acl->ipv6[ACL_BLACK_LIST_SECTION], &(addr.ip.v6));
+        ip_range_set_add_ipv6(acl->ranges[ACL_BLACK_LIST_SECTION], addr.ip.v6._.u8, -1);
     }
+    acl_generation++;
 
     return 0;
 }
@@ -567,46 +1504,70 @@ acl_add_ip(const char *ip)
 int
 acl_remove_ip(const char *ip)
 {
+    struct acl_snapshot *acl = current_acl;
     struct cork_ip addr;
     int err = cork_ip_init(&addr, ip);
-    if (err) {
+    if (err || acl == NULL) {
         return -1;
     }
 
+    // Into the current snapshot, a reload starts over from the file.
     if (addr.version == 4) {
-        ipset_ipv4_remove(&black_list_ipv4, &(addr.ip.v4));
+        ipset_ipv4_remove(&acl->ipv4[ACL_BLACK_LIST_SECTION], &(addr.ip.v4));
+        ip_range_set_remove_ipv4(acl->ranges[ACL_BLACK_LIST_SECTION], addr.ip.v4._.u8);
     } else if (addr.version == 6) {
-        ipset_ipv6_remove(&black_list_ipv6, &(addr.ip.v6));
+        ipset_ipv6_remove(&acl->ipv6[ACL_BLACK_LIST_SECTION], &(addr.ip.v6));
+        ip_range_set_remove_ipv6(acl->ranges[ACL_BLACK_LIST_SECTION], addr.ip.v6._.u8);
     }
+    acl_generation++;
 
     return 0;
 }
 
-/*
- * Return 0,  if not match.
- * Return 1,  if match black list.
- */
-int
-outbound_block_match_host(const char *host)
+static int
+match_outbound_block(const char *host)
 {
+    struct acl_snapshot *acl = current_acl;
     struct cork_ip addr;
+    char country[3];
     int ret = 0;
-    int err = cork_ip_init(&addr, host);
+    int err;
 
+    if (acl == NULL) {
+        return 0;
+    }
+
+    err = cork_ip_init(&addr, host);
     if (err) {
         size_t host_len = strlen(host);
-        if (lookup_rule(&outbound_block_list_rules, host, host_len) != NULL)
+        char lower[257];
+        size_t lower_len = acl->geosite ? acl_geo_lower(host, host_len, lower, sizeof(lower)) : 0;
+        if (lookup_rule(&acl->rules[ACL_OUTBOUND_BLOCK_SECTION], host, host_len) != NULL
+            || (lower_len && acl_geo_match_site(acl, ACL_OUTBOUND_BLOCK_SECTION, lower, lower_len)))
             ret = 1;
         return ret;
     }
 
+    acl_geo_country(acl, &addr, country);
     if (addr.version == 4) {
-        if (ipset_contains_ipv4(&outbound_block_list_ipv4, &(addr.ip.v4)))
+        if (ip_range_set_contains_ipv4(acl->ranges[ACL_OUTBOUND_BLOCK_SECTION], addr.ip.v4._.u8)
+            || acl_geo_match_country(acl, ACL_OUTBOUND_BLOCK_SECTION, country))
             ret = 1;
     } else if (addr.version == 6) {
-        if (ipset_contains_ipv6(&outbound_block_list_ipv6, &(addr.ip.v6)))
+        if (ip_range_set_contains_ipv6(acl->ranges[ACL_OUTBOUND_BLOCK_SECTION], addr.ip.v6._.u8)
+            || acl_geo_match_country(acl, ACL_OUTBOUND_BLOCK_SECTION, country))
             ret = 1;
     }
 
     return ret;
 }
+
+/*
+ * Return 0,  if not match.
+ * Return 1,  if match black list.
+ */
+int
+outbound_block_match_host(const char *host)
+{
+    return cached_decision(outbound_decisions, host, match_outbound_block);
+}
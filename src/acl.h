@@ -23,6 +23,8 @@
 #ifndef _ACL_H
 #define _ACL_H
 
+#include <stdint.h>
+
 #define BLACK_LIST 0
 #define WHITE_LIST 1
 
@@ -32,10 +34,37 @@
 #define BAD        2
 #define MALFORMED  1
 
+#define ACL_DECISION_CACHE_SIZE 1024  /* Hosts whose answer is remembered, CLOCK evicted. */
+
+struct uv_loop_s;
+
+struct acl_cache_stats {
+    uint64_t hits;
+    uint64_t misses;  /* Including answers gone stale by an ACL change. */
+};
+
+/*
+ * |path| is an ACL as text or as written by acl_compile(), told apart by
+ * its first bytes. Besides addresses and domains, a list may hold
+ * geoip:CC lines, looked up in the MaxMind DB of a geoip_file:<path>
+ * line, and geosite:name lines, looked up in what "ssr-acl-compile
+ * --geosite" made of a geosite.dat, named by a geosite_file:<path> line.
+ * Both files are mapped and read in place, a relative path is next to
+ * the ACL.
+ */
 int init_acl(const char *path);
 void free_acl(void);
+/* Writes the ACL at |path| pre-compiled to |output|, see init_acl(). */
+int acl_compile(const char *path, const char *output);
+/*
+ * Reads the file of init_acl() again on the thread pool of |loop| and
+ * swaps it in once built, lookups meanwhile answer from the old one.
+ * Changes by acl_add_ip() and acl_remove_ip() are lost.
+ */
+int acl_reload(struct uv_loop_s *loop);
 void clear_block_list(void);
 
+/* acl_match_host() and outbound_block_match_host() may be called from any thread. */
 int acl_match_host(const char *ip);
 int acl_add_ip(const char *ip);
 int acl_remove_ip(const char *ip);
@@ -50,4 +79,6 @@ int remove_from_block_list(char *addr);
 
 int outbound_block_match_host(const char *host);
 
+void acl_get_cache_stats(struct acl_cache_stats *stats);
+
 #endif // _ACL_H
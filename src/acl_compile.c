@@ -0,0 +1,25 @@
+/*
+ * Pre-compiles an ACL for init_acl(): the ranges sorted and merged, the
+ * rules classified, so ssr-local maps the result instead of parsing it.
+ * With --geosite, turns a V2Ray geosite.dat into the file the geosite:
+ * rules of an ACL look up, see geo_data.h.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "acl.h"
+#include "geo_data.h"
+
+int main(int argc, char **argv) {
+    if (argc == 4 && strcmp(argv[1], "--geosite") == 0) {
+        return (geosite_compile(argv[2], argv[3]) != 0) ? 1 : 0;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <acl file> <output file>\n", argv[0]);
+        fprintf(stderr, "       %s --geosite <geosite.dat> <output file>\n", argv[0]);
+        return 1;
+    }
+    if (acl_compile(argv[1], argv[2]) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+#include "admission.h"
+#include "ssr_executive.h"
+#include "tunnel.h"
+#include "tunnel_stats.h"
+#include "common.h"
+#include "dump_info.h"
+
+struct admission {
+    const struct server_config *config;  // __weak_ptr
+    struct tunnel_stats *stats;  // __weak_ptr, may be NULL
+    void(*resume_cb)(uv_stream_t *listener);
+    uv_prepare_t prepare;  /* Starts each loop turn's batch, before the poll. */
+    uv_timer_t probe;
+    uint64_t probe_due;
+    bool overloaded;
+    bool closed;
+    unsigned int accepted;  /* In this turn. */
+    unsigned int tunnels;
+    unsigned int handshakes;
+    struct admission_entry *oldest;  /* The handshake list, oldest first. */
+    struct admission_entry *newest;
+    uv_stream_t **deferred;  /* Listeners holding a connection back. */
+    size_t deferred_count;
+    size_t deferred_capacity;
+};
+
+/* Resident bytes of the process, 0 where unknown. On Apple's systems the
+ * footprint, what an iOS network extension is killed for. */
+static size_t admission_resident_memory(void) {
+#if defined(__APPLE__)
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return (size_t)info.phys_footprint;
+#elif defined(__linux__)
+    unsigned long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (fscanf(f, "%lu %lu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+static void admission_shed(struct admission *adm) {
+    int n = ADMISSION_SHED_BATCH;
+    while (adm->oldest && n-- > 0) {
+        struct tunnel_ctx *tunnel = adm->oldest->tunnel;
+        // Off the list first, the tunnel may be released later.
+        admission_tunnel_authenticated(adm, adm->oldest);
+        if (adm->stats) {
+            adm->stats->tunnels_shed++;
+        }
+        tunnel_shutdown(tunnel);
+    }
+}
+
+static void admission_probe_cb(uv_timer_t *handle) {
+    struct admission *adm = CONTAINER_OF(handle, struct admission, probe);
+    uint64_t now = uv_now(handle->loop);
+    uint64_t lag = (now > adm->probe_due) ? now - adm->probe_due : 0;
+    bool overloaded = false;
+
+    adm->probe_due = now + ADMISSION_PROBE_MS;
+    if (adm->config->admission_max_loop_lag && lag > adm->config->admission_max_loop_lag) {
+        overloaded = true;
+    }
+    if (adm->config->admission_max_memory && admission_resident_memory() > adm->config->admission_max_memory) {
+        overloaded = true;
+    }
+    if (overloaded != adm->overloaded) {
+        adm->overloaded = overloaded;
+        pr_warn(overloaded ? "overloaded, loop lag %llu ms, shedding handshakes" : "load back to normal, loop lag %llu ms",
+            (unsigned long long)lag);
+    }
+    if (overloaded) {
+        admission_shed(adm);
+    }
+}
+
+static void admission_prepare_cb(uv_prepare_t *handle) {
+    struct admission *adm = CONTAINER_OF(handle, struct admission, prepare);
+    size_t count = adm->deferred_count, i;
+
+    adm->accepted = 0;
+    adm->deferred_count = 0;
+    for (i = 0; i < count; ++i) {
+        // May defer it again, into the emptied array.
+        adm->resume_cb(adm->deferred[i]);
+    }
+}
+
+struct admission * admission_create(uv_loop_t *loop, const struct server_config *config, struct tunnel_stats *stats,
+                                    void(*resume_cb)(uv_stream_t *listener))
+{
+    struct admission *adm;
+    if (config->admission_max_tunnels == 0 && config->admission_max_handshakes == 0 &&
+        config->admission_accept_batch == 0 && config->admission_max_loop_lag == 0 &&
+        config->admission_max_memory == 0)
+    {
+        return NULL;
+    }
+    adm = (struct admission *) calloc(1, sizeof(*adm));
+    adm->config = config;
+    adm->stats = stats;
+    adm->resume_cb = resume_cb;
+    VERIFY(0 == uv_prepare_init(loop, &adm->prepare));
+    VERIFY(0 == uv_prepare_start(&adm->prepare, admission_prepare_cb));
+    uv_unref((uv_handle_t *)&adm->prepare);
+    VERIFY(0 == uv_timer_init(loop, &adm->probe));
+    if (config->admission_max_loop_lag || config->admission_max_memory) {
+        adm->probe_due = uv_now(loop) + ADMISSION_PROBE_MS;
+        VERIFY(0 == uv_timer_start(&adm->probe, admission_probe_cb, ADMISSION_PROBE_MS, ADMISSION_PROBE_MS));
+    }
+    uv_unref((uv_handle_t *)&adm->probe);
+    return adm;
+}
+
+void admission_shutdown(struct admission *adm) {
+    if (adm == NULL || adm->closed) {
+        return;
+    }
+    adm->closed = true;
+    adm->deferred_count = 0;
+    uv_close((uv_handle_t *)&adm->prepare, NULL);
+    uv_close((uv_handle_t *)&adm->probe, NULL);
+}
+
+void admission_destroy(struct admission *adm) {
+    if (adm == NULL) {
+        return;
+    }
+    free(adm->deferred);
+    free(adm);
+}
+
+/* Counts the rejection when it's full or overloaded. */
+static bool admission_full(struct admission *adm) {
+    const struct server_config *config = adm->config;
+
+    if (adm->overloaded ||
+        (config->admission_max_tunnels && adm->tunnels >= config->admission_max_tunnels) ||
+        (config->admission_max_handshakes && adm->handshakes >= config->admission_max_handshakes))
+    {
+        if (adm->stats) {
+            adm->stats->tunnels_rejected++;
+        }
+        return true;
+    }
+    return false;
+}
+
+enum admission_verdict admission_check(struct admission *adm, uv_stream_t *listener) {
+    const struct server_config *config = adm->config;
+
+    if (admission_full(adm)) {
+        return admission_reject;
+    }
+    if (config->admission_accept_batch && adm->accepted >= config->admission_accept_batch && adm->closed == false) {
+        if (adm->deferred_count == adm->deferred_capacity) {
+            adm->deferred_capacity = adm->deferred_capacity ? adm->deferred_capacity * 2 : 4;
+            adm->deferred = (uv_stream_t **) realloc(adm->deferred, adm->deferred_capacity * sizeof(adm->deferred[0]));
+        }
+        adm->deferred[adm->deferred_count++] = listener;
+        if (adm->stats) {
+            adm->stats->accepts_deferred++;
+        }
+        return admission_defer;
+    }
+    adm->accepted++;
+    return admission_admit;
+}
+
+bool admission_check_accepted(struct admission *adm) {
+    return admission_full(adm) == false;
+}
+
+void admission_forget_listener(struct admission *adm, uv_stream_t *listener) {
+    size_t i = 0;
+    if (adm == NULL) {
+        return;
+    }
+    while (i < adm->deferred_count) {
+        if (adm->deferred[i] == listener) {
+            adm->deferred[i] = adm->deferred[--adm->deferred_count];
+        } else {
+            ++i;
+        }
+    }
+}
+
+static void admission_turn_away_close_cb(uv_handle_t *handle) {
+    free(handle);
+}
+
+void admission_turn_away(uv_stream_t *listener) {
+    uv_tcp_t *tcp = (uv_tcp_t *) calloc(1, sizeof(*tcp));
+    VERIFY(0 == uv_tcp_init(listener->loop, tcp));
+    (void)uv_accept(listener, (uv_stream_t *)tcp);
+    uv_close((uv_handle_t *)tcp, admission_turn_away_close_cb);
+}
+
+void admission_tunnel_opened(struct admission *adm, struct admission_entry *entry, struct tunnel_ctx *tunnel) {
+    entry->tunnel = tunnel;
+    entry->counted = true;
+    entry->handshaking = true;
+    entry->next = NULL;
+    entry->prev = adm->newest;
+    if (adm->newest) {
+        adm->newest->next = entry;
+    } else {
+        adm->oldest = entry;
+    }
+    adm->newest = entry;
+    adm->tunnels++;
+    adm->handshakes++;
+}
+
+void admission_tunnel_authenticated(struct admission *adm, struct admission_entry *entry) {
+    if (entry->handshaking == false) {
+        return;
+    }
+    entry->handshaking = false;
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        adm->oldest = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        adm->newest = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    adm->handshakes--;
+}
+
+void admission_tunnel_closed(struct admission *adm, struct admission_entry *entry) {
+    if (entry->counted == false) {
+        return;
+    }
+    admission_tunnel_authenticated(adm, entry);
+    entry->counted = false;
+    adm->tunnels--;
+}
@@ -0,0 +1,67 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+struct tunnel_ctx;
+struct tunnel_stats;
+struct server_config;
+
+/*
+ * Admission control of one loop, for all its listeners: an ssr-server
+ * worker, or an ssr-client loop whose handshakes last until the tunnel
+ * streams. A new connection is turned away while the loop holds
+ * max_tunnels tunnels or max_handshakes ones that haven't passed the
+ * handshake yet, and past accept_batch connections in one loop turn the
+ * listener waits for the next. A probe every ADMISSION_PROBE_MS measures
+ * the loop's lag and the process's memory, over a threshold the oldest
+ * handshakes are shut down and new connections turned away until it's
+ * back under. Not thread safe: one per uv_loop_t.
+ */
+
+#define ADMISSION_PROBE_MS   100
+#define ADMISSION_SHED_BATCH 64  /* Handshakes shut down per probe while overloaded. */
+
+enum admission_verdict {
+    admission_admit,
+    admission_reject,  /* Accept and close it. */
+    admission_defer,   /* Leave it to the kernel's queue until the next turn. */
+};
+
+/* Lives in the tunnel's context, on the handshake list until authenticated. */
+struct admission_entry {
+    struct admission_entry *prev;
+    struct admission_entry *next;
+    struct tunnel_ctx *tunnel;
+    bool counted;
+    bool handshaking;
+};
+
+struct admission;
+
+/* NULL where |config| sets no limit. */
+struct admission * admission_create(uv_loop_t *loop, const struct server_config *config, struct tunnel_stats *stats,
+                                    void(*resume_cb)(uv_stream_t *listener));
+/* Closes the handles, they're gone once the loop has run. */
+void admission_shutdown(struct admission *adm);
+/* After the loop has ended. */
+void admission_destroy(struct admission *adm);
+
+/* For a connection waiting on |listener|, resume_cb is called for it later on admission_defer. */
+enum admission_verdict admission_check(struct admission *adm, uv_stream_t *listener);
+/* For a connection accepted elsewhere, as another worker's: the limits
+ * without the batch, false when it's to be closed. */
+bool admission_check_accepted(struct admission *adm);
+/* |listener| is closing, no resume_cb for it. */
+void admission_forget_listener(struct admission *adm, uv_stream_t *listener);
+/* Accepts the pending connection and closes it at once. */
+void admission_turn_away(uv_stream_t *listener);
+
+void admission_tunnel_opened(struct admission *adm, struct admission_entry *entry, struct tunnel_ctx *tunnel);
+void admission_tunnel_authenticated(struct admission *adm, struct admission_entry *entry);
+void admission_tunnel_closed(struct admission *adm, struct admission_entry *entry);
+
+#endif // __ADMISSION_H__
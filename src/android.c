@@ -35,6 +35,9 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <sys/un.h>
 #include <ancillary.h>
 
@@ -43,7 +46,9 @@
 #endif
 
 #include "netutils.h"
-#include "utils.h"
+#include "ssrutils.h"
+#include "common.h"
+#include "android.h"
 
 extern char *prefix;
 
@@ -80,7 +85,7 @@ protect_socket(int fd)
     }
 
     if (ancil_send_fd(sock, fd)) {
-        ERROR("[android] ancil_send_fd");
+        SS_ERROR("[android] ancil_send_fd");
         close(sock);
         return -1;
     }
@@ -88,7 +93,7 @@ protect_socket(int fd)
     char ret = 0;
 
     if (recv(sock, &ret, 1, 0) == -1) {
-        ERROR("[android] recv");
+        SS_ERROR("[android] recv");
         close(sock);
         return -1;
     }
@@ -132,7 +137,7 @@ send_traffic_stat(uint64_t tx, uint64_t rx)
     uint64_t stat[2] = { tx, rx };
 
     if (send(sock, stat, sizeof(stat), 0) == -1) {
-        ERROR("[android] send");
+        SS_ERROR("[android] send");
         close(sock);
         return -1;
     }
@@ -140,7 +145,7 @@ send_traffic_stat(uint64_t tx, uint64_t rx)
     char ret = 0;
 
     if (recv(sock, &ret, 1, 0) == -1) {
-        ERROR("[android] recv");
+        SS_ERROR("[android] recv");
         close(sock);
         return -1;
     }
@@ -148,3 +153,387 @@ send_traffic_stat(uint64_t tx, uint64_t rx)
     close(sock);
     return ret;
 }
+
+struct protect_request {
+    struct protect_request *next;
+    int fd;
+    int tries;                 /* Connections lost with it first and nothing answered. */
+    protect_done_cb done_cb;   /* NULL once cancelled. */
+    void *p;
+};
+
+struct protect_conn {
+    uv_poll_t poll;
+    int sock;
+    unsigned int sent;
+    unsigned int answered;
+    struct protect_channel *pc;  // __weak_ptr
+};
+
+struct protect_channel {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    uv_loop_t *loop;
+    uv_timer_t timer;
+    struct protect_conn *conn;    /* NULL until a request needs it. */
+    struct protect_request *sent_first;   /* Sent, answered in this order. */
+    struct protect_request *sent_last;
+    unsigned int sent_count;
+    struct protect_request *queue_first;  /* Not sent yet. */
+    struct protect_request *queue_last;
+    unsigned int per_conn;        /* Requests a connection takes, 1 for a service that hangs up after each. */
+    uint64_t answers;
+    uint64_t answers_at_tick;
+    bool released;
+};
+
+#define PROTECT_MAX_TRIES 2
+
+static void protect_channel_kick(struct protect_channel *pc);
+static void protect_channel_fail_queue(struct protect_channel *pc, int status);
+static void protect_conn_poll_cb(uv_poll_t *handle, int status, int events);
+static void protect_channel_timer_cb(uv_timer_t *handle);
+
+/* ancil_send_fd() without SIGPIPE, the service may have hung up. */
+static int
+protect_send_fd(int sock, int fd)
+{
+    char byte = 0;
+    struct iovec iov;
+    struct msghdr msg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return (sendmsg(sock, &msg, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
+
+static void
+protect_request_done(struct protect_request *req, int status)
+{
+    if (req->done_cb) {
+        req->done_cb(req->p, status);
+    }
+    free(req);
+}
+
+static void
+protect_conn_close_done_cb(uv_handle_t *handle)
+{
+    struct protect_conn *conn = (struct protect_conn *)handle->data;
+    close(conn->sock);
+    free(conn);
+}
+
+static void
+protect_conn_close(struct protect_channel *pc)
+{
+    struct protect_conn *conn = pc->conn;
+    if (conn == NULL) {
+        return;
+    }
+    pc->conn = NULL;
+    uv_poll_stop(&conn->poll);
+    uv_close((uv_handle_t *)&conn->poll, protect_conn_close_done_cb);
+}
+
+/* Fails the requests with |status|, or queues those in flight again when it's 0. */
+static void
+protect_conn_lost(struct protect_channel *pc, int status)
+{
+    struct protect_request *sent = pc->sent_first, *req;
+    unsigned int answered = pc->conn ? pc->conn->answered : 0;
+    bool blame = (sent != NULL && pc->per_conn == 1);
+
+    if (status == 0 && sent) {
+        // It hung up on the ones it had, it takes that many per connection.
+        pc->per_conn = answered ? answered : 1;
+    }
+    protect_conn_close(pc);
+    pc->sent_first = pc->sent_last = NULL;
+    pc->sent_count = 0;
+
+    if (status == 0 && blame && answered == 0 && ++sent->tries >= PROTECT_MAX_TRIES) {
+        req = sent;
+        sent = sent->next;
+        protect_request_done(req, UV_EOF);
+    }
+    if (status == 0 && sent) {
+        struct protect_request *last = sent;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = pc->queue_first;
+        if (pc->queue_first == NULL) {
+            pc->queue_last = last;
+        }
+        pc->queue_first = sent;
+        sent = NULL;
+    }
+    while (sent) {
+        req = sent;
+        sent = sent->next;
+        protect_request_done(req, status);
+    }
+    if (status != 0) {
+        // Those waiting behind them would only time out in turn.
+        protect_channel_fail_queue(pc, status);
+    }
+    protect_channel_kick(pc);
+}
+
+static void
+protect_conn_flush(struct protect_channel *pc)
+{
+    struct protect_conn *conn = pc->conn;
+    int events = UV_READABLE;
+
+    while (pc->queue_first && pc->sent_count < PROTECT_PIPELINE && conn->sent < pc->per_conn) {
+        struct protect_request *req = pc->queue_first;
+        if (req->done_cb == NULL) {
+            pc->queue_first = req->next;
+            free(req);
+            continue;
+        }
+        if (protect_send_fd(conn->sock, req->fd)) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                events |= UV_WRITABLE;
+                break;
+            }
+            protect_conn_lost(pc, 0);
+            return;
+        }
+        conn->sent++;
+        pc->queue_first = req->next;
+        req->next = NULL;
+        if (pc->sent_last) {
+            pc->sent_last->next = req;
+        } else {
+            pc->sent_first = req;
+        }
+        pc->sent_last = req;
+        pc->sent_count++;
+    }
+    if (pc->queue_first == NULL) {
+        pc->queue_last = NULL;
+    }
+    uv_poll_start(&conn->poll, events, protect_conn_poll_cb);
+}
+
+static void
+protect_conn_poll_cb(uv_poll_t *handle, int status, int events)
+{
+    struct protect_conn *conn = (struct protect_conn *)handle->data;
+    struct protect_channel *pc = conn->pc;
+
+    if (status < 0) {
+        protect_conn_lost(pc, 0);
+        return;
+    }
+    if (events & UV_READABLE) {
+        char answers[PROTECT_PIPELINE];
+        ssize_t n = recv(conn->sock, answers, sizeof(answers), 0);
+        ssize_t i;
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            protect_conn_lost(pc, 0);
+            return;
+        }
+        for (i = 0; i < n && pc->sent_first; ++i) {
+            struct protect_request *req = pc->sent_first;
+            pc->sent_first = req->next;
+            if (pc->sent_first == NULL) {
+                pc->sent_last = NULL;
+            }
+            pc->sent_count--;
+            conn->answered++;
+            pc->answers++;
+            protect_request_done(req, answers[i]);
+        }
+        if (pc->conn != conn) {
+            return;  // A callback released the channel.
+        }
+        if (conn->answered >= pc->per_conn && pc->queue_first) {
+            protect_conn_lost(pc, 0);  // Done with, the rest go on a new one.
+            return;
+        }
+    }
+    protect_conn_flush(pc);
+}
+
+static bool
+protect_conn_open(struct protect_channel *pc)
+{
+    struct protect_conn *conn;
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sock == -1) {
+        LOGE("[android] socket() failed: %s\n", strerror(errno));
+        return false;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, pc->path, sizeof(addr.sun_path) - 1);
+
+    // A UNIX socket connects at once, or not at all when the backlog is
+    // full, and a kept channel is the only one that connects.
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        LOGE("[android] connect() failed: %s, path: %s\n", strerror(errno), pc->path);
+        close(sock);
+        return false;
+    }
+    conn = (struct protect_conn *) calloc(1, sizeof(*conn));
+    conn->sock = sock;
+    conn->pc = pc;
+    uv_poll_init(pc->loop, &conn->poll, sock);
+    conn->poll.data = conn;
+    pc->conn = conn;
+    return true;
+}
+
+static void
+protect_channel_fail_queue(struct protect_channel *pc, int status)
+{
+    struct protect_request *req = pc->queue_first;
+    pc->queue_first = pc->queue_last = NULL;
+    while (req) {
+        struct protect_request *next = req->next;
+        protect_request_done(req, status);
+        req = next;
+    }
+}
+
+/* Runs the timer while anything is outstanding, it spots a stalled service. */
+static void
+protect_channel_watch(struct protect_channel *pc)
+{
+    if (pc->sent_first || pc->queue_first) {
+        if (uv_is_active((uv_handle_t *)&pc->timer) == 0) {
+            pc->answers_at_tick = pc->answers;
+            uv_timer_start(&pc->timer, protect_channel_timer_cb, PROTECT_TIMEOUT_MS, PROTECT_TIMEOUT_MS);
+        }
+    } else {
+        uv_timer_stop(&pc->timer);
+    }
+}
+
+/* From the loop's callbacks only, it may call requests back. */
+static void
+protect_channel_kick(struct protect_channel *pc)
+{
+    if (pc->released) {
+        return;
+    }
+    if (pc->conn == NULL && pc->queue_first) {
+        if (protect_conn_open(pc) == false) {
+            protect_channel_fail_queue(pc, UV_ECONNREFUSED);
+        }
+    }
+    if (pc->conn) {
+        protect_conn_flush(pc);
+    }
+    protect_channel_watch(pc);
+}
+
+static void
+protect_channel_timer_cb(uv_timer_t *handle)
+{
+    struct protect_channel *pc = CONTAINER_OF(handle, struct protect_channel, timer);
+    if (pc->conn == NULL) {
+        // The connect in protect_channel_submit() failed, once more.
+        protect_channel_kick(pc);
+        return;
+    }
+    if (pc->answers == pc->answers_at_tick && pc->sent_first) {
+        LOGE("[android] protect timed out, path: %s\n", pc->path);
+        protect_conn_lost(pc, UV_ETIMEDOUT);
+        return;
+    }
+    pc->answers_at_tick = pc->answers;
+}
+
+static void
+protect_channel_close_done_cb(uv_handle_t *handle)
+{
+    free(CONTAINER_OF(handle, struct protect_channel, timer));
+}
+
+struct protect_channel *
+protect_channel_create(uv_loop_t *loop, const char *path)
+{
+    struct protect_channel *pc = (struct protect_channel *) calloc(1, sizeof(*pc));
+    strncpy(pc->path, path, sizeof(pc->path) - 1);
+    pc->loop = loop;
+    pc->per_conn = UINT_MAX;
+    uv_timer_init(loop, &pc->timer);
+    return pc;
+}
+
+void
+protect_channel_release(struct protect_channel *pc)
+{
+    struct protect_request *lists[2], *req;
+    int i;
+    if (pc == NULL) {
+        return;
+    }
+    lists[0] = pc->sent_first;
+    lists[1] = pc->queue_first;
+    for (i = 0; i < 2; ++i) {
+        while ((req = lists[i]) != NULL) {
+            lists[i] = req->next;
+            free(req);
+        }
+    }
+    pc->sent_first = pc->sent_last = pc->queue_first = pc->queue_last = NULL;
+    pc->released = true;
+    protect_conn_close(pc);
+    uv_timer_stop(&pc->timer);
+    uv_close((uv_handle_t *)&pc->timer, protect_channel_close_done_cb);
+}
+
+struct protect_request *
+protect_channel_submit(struct protect_channel *pc, int fd, protect_done_cb done_cb, void *p)
+{
+    struct protect_request *req = (struct protect_request *) calloc(1, sizeof(*req));
+    req->fd = fd;
+    req->done_cb = done_cb;
+    req->p = p;
+    if (pc->queue_last) {
+        pc->queue_last->next = req;
+    } else {
+        pc->queue_first = req;
+    }
+    pc->queue_last = req;
+    // Nothing is called back from here, the poll and the timer callbacks do that.
+    if (pc->conn == NULL && protect_conn_open(pc) == false) {
+        uv_timer_start(&pc->timer, protect_channel_timer_cb, 0, PROTECT_TIMEOUT_MS);
+        return req;
+    }
+    uv_poll_start(&pc->conn->poll, UV_READABLE | UV_WRITABLE, protect_conn_poll_cb);
+    protect_channel_watch(pc);
+    return req;
+}
+
+void
+protect_channel_cancel(struct protect_request *req)
+{
+    if (req) {
+        req->done_cb = NULL;
+    }
+}
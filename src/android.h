@@ -0,0 +1,32 @@
+#if !defined(__android_h__)
+#define __android_h__ 1
+
+#include <uv.h>
+
+/*
+ * The VpnService's protect_path, kept connected. Each request sends a
+ * socket's fd with SCM_RIGHTS and the service answers one byte per fd, in
+ * order, so requests are pipelined and nothing blocks the loop: the
+ * caller connects from done_cb. A service that answers one request per
+ * connection is reconnected for the next, one at a time. Not thread safe:
+ * one per uv_loop_t.
+ */
+
+#define PROTECT_TIMEOUT_MS  1000  /* Without an answer, the outstanding requests fail. */
+#define PROTECT_PIPELINE    64    /* Requests sent ahead of their answers. */
+
+struct protect_channel;
+struct protect_request;
+
+/* |status| is the service's answer, 0 once protected, or a negative UV error. */
+typedef void(*protect_done_cb)(void *p, int status);
+
+struct protect_channel * protect_channel_create(uv_loop_t *loop, const char *path);
+/* Drops the requests still pending without calling them back. */
+void protect_channel_release(struct protect_channel *pc);
+/* |fd| must stay open until done_cb, or protect_channel_cancel(). */
+struct protect_request * protect_channel_submit(struct protect_channel *pc, int fd, protect_done_cb done_cb, void *p);
+/* done_cb won't be called, and |fd| isn't sent if it wasn't yet. */
+void protect_channel_cancel(struct protect_request *req);
+
+#endif // !defined(__android_h__)
@@ -0,0 +1,331 @@
+/*
+ * ssr-acl-bench: loads ACL files with init_acl() and replays a trace of
+ * hosts through acl_match_host() and outbound_block_match_host(), the two
+ * lookups every tunnel makes. Reported per file: load time, and per
+ * lookup lookups/s, p50 and p99 time and how many matched, with the
+ * decision cache's hits and misses over the replay.
+ *
+ * The trace is one host per line from -f, or made up from each ACL
+ * itself: hostnames its rules match, hostnames none do, addresses inside
+ * its ranges and random ones, -d distinct hosts in all. With more of them
+ * than ACL_DECISION_CACHE_SIZE most lookups miss the cache and walk the
+ * rules; the acl/ files (gfwlist.acl, chn.acl, server_block_chn.acl) give
+ * numbers comparable between builds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <uv.h>
+
+#include "acl.h"
+
+#define BENCH_ACL_FILES_MAX         16
+#define BENCH_ACL_DEFAULT_LOOKUPS   200000
+#define BENCH_ACL_DEFAULT_DISTINCT  50000
+#define BENCH_ACL_HOST_MAX          256
+#define BENCH_ACL_RULE_PREFIX       "^(.*\\.)?"
+
+struct bench_options {
+    const char *files[BENCH_ACL_FILES_MAX];
+    size_t files_count;
+    const char *trace_file;
+    unsigned int lookups;
+    unsigned int distinct;
+};
+
+/* What the made up trace draws on, from one ACL's text. */
+struct bench_acl_source {
+    char **domains;
+    size_t domains_count;
+    uint32_t *nets;  /* Pairs of network and host mask, IPv4. */
+    size_t nets_count;
+};
+
+struct bench_trace {
+    char **hosts;
+    size_t count;
+};
+
+static uint64_t bench_seed = 0x9E3779B97F4A7C15ULL;
+
+/* xorshift64*, fixed seed: the same trace for the same ACL every run. */
+static uint64_t bench_random(void) {
+    bench_seed ^= bench_seed >> 12;
+    bench_seed ^= bench_seed << 25;
+    bench_seed ^= bench_seed >> 27;
+    return bench_seed * 2685821657736338717ULL;
+}
+
+static int uint64_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void trace_add(struct bench_trace *trace, const char *host, size_t *capacity) {
+    if (trace->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        trace->hosts = (char **) realloc(trace->hosts, *capacity * sizeof(char *));
+    }
+    trace->hosts[trace->count++] = strdup(host);
+}
+
+static void trace_free(struct bench_trace *trace) {
+    size_t i;
+    for (i = 0; i < trace->count; ++i) {
+        free(trace->hosts[i]);
+    }
+    free(trace->hosts);
+    memset(trace, 0, sizeof(*trace));
+}
+
+static bool trace_load(struct bench_trace *trace, const char *path) {
+    char line[BENCH_ACL_HOST_MAX];
+    size_t capacity = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n \t")] = '\0';
+        if (line[0] && line[0] != '#') {
+            trace_add(trace, line, &capacity);
+        }
+    }
+    fclose(file);
+    return trace->count > 0;
+}
+
+/* "^(.*\.)?example\.com$" to "example.com", NULL for a rule that isn't a plain domain. */
+static char * rule_domain(const char *rule) {
+    char domain[BENCH_ACL_HOST_MAX];
+    size_t len = 0;
+    const char *p;
+
+    if (strncmp(rule, BENCH_ACL_RULE_PREFIX, sizeof(BENCH_ACL_RULE_PREFIX) - 1) != 0) {
+        return NULL;
+    }
+    for (p = rule + sizeof(BENCH_ACL_RULE_PREFIX) - 1; *p && *p != '$'; ++p) {
+        if (*p == '\\') {
+            continue;
+        }
+        if ((isalnum((unsigned char)*p) == 0 && *p != '.' && *p != '-') || len + 1 == sizeof(domain)) {
+            return NULL;
+        }
+        domain[len++] = *p;
+    }
+    domain[len] = '\0';
+    return len ? strdup(domain) : NULL;
+}
+
+static bool source_load(struct bench_acl_source *source, const char *path) {
+    char line[BENCH_ACL_HOST_MAX];
+    size_t domains_capacity = 0, nets_capacity = 0;
+    FILE *file = fopen(path, "r");
+
+    memset(source, 0, sizeof(*source));
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        unsigned int a, b, c, d, prefix = 32;
+        char *domain;
+
+        line[strcspn(line, "\r\n \t")] = '\0';
+        if ((domain = rule_domain(line)) != NULL) {
+            if (source->domains_count == domains_capacity) {
+                domains_capacity = domains_capacity ? domains_capacity * 2 : 256;
+                source->domains = (char **) realloc(source->domains, domains_capacity * sizeof(char *));
+            }
+            source->domains[source->domains_count++] = domain;
+        } else if (sscanf(line, "%u.%u.%u.%u/%u", &a, &b, &c, &d, &prefix) >= 4 &&
+                   a < 256 && b < 256 && c < 256 && d < 256 && prefix <= 32) {
+            uint32_t mask = prefix ? (uint32_t)(0xFFFFFFFFu << (32 - prefix)) : 0;
+            if (source->nets_count == nets_capacity) {
+                nets_capacity = nets_capacity ? nets_capacity * 2 : 256;
+                source->nets = (uint32_t *) realloc(source->nets, nets_capacity * 2 * sizeof(uint32_t));
+            }
+            source->nets[source->nets_count * 2] = ((a << 24) | (b << 16) | (c << 8) | d) & mask;
+            source->nets[source->nets_count * 2 + 1] = ~mask;
+            source->nets_count++;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+static void source_free(struct bench_acl_source *source) {
+    size_t i;
+    for (i = 0; i < source->domains_count; ++i) {
+        free(source->domains[i]);
+    }
+    free(source->domains);
+    free(source->nets);
+    memset(source, 0, sizeof(*source));
+}
+
+/* Four kinds in turn: a ruled domain, an unknown one, an address in a range, any address. */
+static void trace_make(struct bench_trace *trace, const struct bench_acl_source *source, unsigned int distinct) {
+    char host[BENCH_ACL_HOST_MAX];
+    size_t capacity = 0;
+    unsigned int i;
+
+    for (i = 0; i < distinct; ++i) {
+        uint64_t r = bench_random();
+        uint32_t ip;
+        switch (i % 4) {
+        case 0:
+            if (source->domains_count) {
+                snprintf(host, sizeof(host), "%s%s", (r & 1) ? "www." : "",
+                    source->domains[(r >> 1) % source->domains_count]);
+                break;
+            }
+            // fall through
+        case 1:
+            snprintf(host, sizeof(host), "h%u.site%u.example.net", (unsigned int)(r & 0xFFFF), (unsigned int)(r >> 48));
+            break;
+        case 2:
+            if (source->nets_count) {
+                const uint32_t *net = &source->nets[((r >> 32) % source->nets_count) * 2];
+                ip = net[0] | ((uint32_t)r & net[1]);
+                snprintf(host, sizeof(host), "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+                break;
+            }
+            // fall through
+        default:
+            ip = (uint32_t)r;
+            snprintf(host, sizeof(host), "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+            break;
+        }
+        trace_add(trace, host, &capacity);
+    }
+}
+
+static void bench_replay(const char *name, const struct bench_trace *trace, unsigned int lookups,
+    int (*lookup)(const char *), uint64_t *times)
+{
+    struct acl_cache_stats before, after;
+    uint64_t total = 0;
+    unsigned int i, matched = 0;
+
+    acl_get_cache_stats(&before);
+    for (i = 0; i < lookups; ++i) {
+        const char *host = trace->hosts[bench_random() % trace->count];
+        uint64_t start = uv_hrtime();
+        matched += lookup(host) != 0;
+        times[i] = uv_hrtime() - start;
+        total += times[i];
+    }
+    acl_get_cache_stats(&after);
+    qsort(times, lookups, sizeof(uint64_t), uint64_compare);
+    printf("  %-22s %12.0f %9llu %9llu %9u %9llu %9llu\n", name,
+        total ? (double)lookups / ((double)total / 1e9) : 0.0,
+        (unsigned long long)times[(lookups - 1) / 2], (unsigned long long)times[(lookups - 1) * 99 / 100],
+        matched, (unsigned long long)(after.hits - before.hits), (unsigned long long)(after.misses - before.misses));
+}
+
+static void bench_run_one(const struct bench_options *opts, const char *path, uint64_t *times) {
+    struct bench_acl_source source;
+    struct bench_trace trace = { NULL, 0 };
+    uint64_t start, load;
+
+    start = uv_hrtime();
+    if (init_acl(path) != 0) {
+        fprintf(stderr, "%s: init_acl failed\n", path);
+        return;
+    }
+    load = uv_hrtime() - start;
+
+    if (opts->trace_file) {
+        trace_load(&trace, opts->trace_file);
+        source_load(&source, path);
+    } else if (source_load(&source, path)) {
+        trace_make(&trace, &source, opts->distinct);
+    }
+    printf("%s: loaded in %.1f ms, %zu domain rules, %zu IPv4 ranges, %zu hosts in the trace\n",
+        path, (double)load / 1e6, source.domains_count, source.nets_count, trace.count);
+    if (trace.count) {
+        bench_replay("acl_match_host", &trace, opts->lookups, acl_match_host, times);
+        bench_replay("outbound_block_match", &trace, opts->lookups, outbound_block_match_host, times);
+    }
+    trace_free(&trace);
+    source_free(&source);
+    free_acl();
+}
+
+static void usage(const char *exe) {
+    printf("Usage:\n"
+        "  %s -a acl[,acl...] [-f trace] [-n lookups] [-d distinct]\n"
+        "\n"
+        "  Without -f the trace is made from each ACL, %d distinct hosts by default.\n"
+        "  %d lookups per function by default. Times are in ns.\n",
+        exe, BENCH_ACL_DEFAULT_DISTINCT, BENCH_ACL_DEFAULT_LOOKUPS);
+}
+
+static bool parse_files(struct bench_options *opts, char *text) {
+    char *token, *saveptr = NULL;
+    opts->files_count = 0;
+    for (token = strtok_r(text, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        if (opts->files_count == BENCH_ACL_FILES_MAX) {
+            return false;
+        }
+        opts->files[opts->files_count++] = token;
+    }
+    return opts->files_count > 0;
+}
+
+int main(int argc, char * const argv[]) {
+    struct bench_options opts;
+    uint64_t *times;
+    size_t i;
+    int opt;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.lookups = BENCH_ACL_DEFAULT_LOOKUPS;
+    opts.distinct = BENCH_ACL_DEFAULT_DISTINCT;
+
+    while (-1 != (opt = getopt(argc, argv, "a:f:n:d:h"))) {
+        switch (opt) {
+        case 'a':
+            if (parse_files(&opts, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'f':
+            opts.trace_file = optarg;
+            break;
+        case 'n':
+            opts.lookups = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            opts.distinct = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if (opts.files_count == 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    opts.lookups = opts.lookups ? opts.lookups : 1;
+    opts.distinct = opts.distinct ? opts.distinct : 1;
+
+    times = (uint64_t *) malloc(opts.lookups * sizeof(uint64_t));
+    printf("  %-22s %12s %9s %9s %9s %9s %9s\n", "lookup", "lookups/s", "p50", "p99", "matched", "hits", "misses");
+    for (i = 0; i < opts.files_count; ++i) {
+        bench_run_one(&opts, opts.files[i], times);
+    }
+    free(times);
+    return 0;
+}
@@ -0,0 +1,672 @@
+/*
+ * ssr-bench: drives the client and the server halves of tunnel_cipher_ctx
+ * against each other in memory, for every method x protocol x obfs
+ * combination and a list of payload sizes. No socket is involved: the
+ * plaintext is fed in SSR_BUFF_SIZE reads, the way ssr-client reads it,
+ * and whatever one side emits (data, receipt, confirm, feedback) is
+ * handed straight to the other side.
+ *
+ * One op is one payload sent client -> server plus one sent back.
+ *
+ * With -r the client -> server stream of each combination is recorded
+ * once, handshake included, and then replayed into a fresh server cut
+ * at every -c split size. 1 byte splits and MSS splits are where the
+ * plugins' recv_buffer reassembly hurts; the replay reports decode
+ * throughput, allocations per recorded frame and the slowest single
+ * tunnel_cipher_server_decrypt call.
+ *
+ * With -b it checks obfs/base64.c against a plain reference encoder, both
+ * alphabets and every length up to a few blocks of the widest kernel,
+ * then reports encode and decode throughput at each size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <uv.h>
+
+#include "common.h"
+#include "encrypt.h"
+#include "obfs.h"
+#include "obfsutil.h"
+#include "ssrbuffer.h"
+#include "ssr_executive.h"
+#include "ssr_cipher_names.h"
+#include "base64.h"
+
+#define BENCH_SIZES_MAX             16
+#define BENCH_SPLITS_MAX            16
+#define BENCH_DEFAULT_ITERATIONS    2000
+#define BENCH_CORPUS_ITERATIONS     64
+#define BENCH_TCP_MSS               1452
+#define BENCH_DEFAULT_PASSWORD      "ssr-bench"
+#define BENCH_BASE64_CHECK_MAX      256  /* Every length up to it is checked, a few blocks of the widest kernel. */
+
+#if defined(SSR_BENCH_WRAP_MALLOC)
+/* Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, see CMakeLists.txt. */
+static size_t bench_alloc_count = 0;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t nmemb, size_t size);
+void * __real_realloc(void *ptr, size_t size);
+
+void * __wrap_malloc(size_t size) {
+    bench_alloc_count++;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t nmemb, size_t size) {
+    bench_alloc_count++;
+    return __real_calloc(nmemb, size);
+}
+
+void * __wrap_realloc(void *ptr, size_t size) {
+    bench_alloc_count++;
+    return __real_realloc(ptr, size);
+}
+#define BENCH_ALLOC_COUNT() (bench_alloc_count)
+#else
+#define BENCH_ALLOC_COUNT() ((size_t)0)
+#endif // defined(SSR_BENCH_WRAP_MALLOC)
+
+static const char *bench_methods[] = {
+#define BENCH_CIPHER_NAME(code, name, text, iv_size, key_size) text,
+    SS_CIPHER_MAP(BENCH_CIPHER_NAME)
+#undef BENCH_CIPHER_NAME
+};
+
+static const char *bench_protocols[] = {
+#define BENCH_PROTOCOL_NAME(code, name, text) text,
+    SSR_PROTOCOL_MAP(BENCH_PROTOCOL_NAME)
+#undef BENCH_PROTOCOL_NAME
+};
+
+static const char *bench_obfses[] = {
+#define BENCH_OBFS_NAME(code, name, text) text,
+    SSR_OBFS_MAP(BENCH_OBFS_NAME)
+#undef BENCH_OBFS_NAME
+};
+
+#define BENCH_COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+struct bench_options {
+    size_t sizes[BENCH_SIZES_MAX];
+    size_t sizes_count;
+    size_t splits[BENCH_SPLITS_MAX];
+    size_t splits_count;
+    bool corpus;
+    bool base64;
+    unsigned int iterations;
+    const char *password;
+    const char *method;    /* NULL runs them all. */
+    const char *protocol;
+    const char *obfs;
+};
+
+struct bench_peer {
+    struct server_config *config;
+    struct server_env_t *env;
+    struct tunnel_cipher_ctx *cipher;
+};
+
+struct bench_session {
+    struct bench_peer client;
+    struct bench_peer server;
+    size_t to_server;  /* Plaintext bytes that came out of the server side. */
+    size_t to_client;
+    size_t frames;     /* Client writes, feedback included. */
+    struct buffer_t *capture;  /* When set, collects everything sent to the server. */
+    bool failed;
+};
+
+static void deliver_to_client(struct bench_session *s, const uint8_t *data, size_t len);
+
+static void deliver_to_server(struct bench_session *s, const uint8_t *data, size_t len) {
+    struct buffer_t *receipt = NULL;
+    struct buffer_t *confirm = NULL;
+    struct buffer_t *result;
+    BUFFER_CONSTANT_INSTANCE(buf, data, len);
+
+    if (s->capture) {
+        buffer_concatenate(s->capture, data, len);
+    }
+    s->frames++;
+    result = tunnel_cipher_server_decrypt(s->server.cipher, buf, &receipt, &confirm);
+    if (result == NULL) {
+        s->failed = true;
+    } else {
+        s->to_server += result->len;
+    }
+    if (receipt) {
+        deliver_to_client(s, receipt->buffer, receipt->len);
+    }
+    if (confirm) {
+        deliver_to_client(s, confirm->buffer, confirm->len);
+    }
+    buffer_release(receipt);
+    buffer_release(confirm);
+    buffer_release(result);
+}
+
+static void deliver_to_client(struct bench_session *s, const uint8_t *data, size_t len) {
+    size_t offset = 0;
+    do {
+        /* ssr-client never reads more than SSR_BUFF_SIZE at once. */
+        size_t n = min(len - offset, (size_t)SSR_BUFF_SIZE);
+        struct buffer_t *feedback = NULL;
+        struct buffer_t *buf = buffer_create_from(data + offset, n);
+        if (tunnel_cipher_client_decrypt(s->client.cipher, buf, &feedback) != ssr_ok) {
+            s->failed = true;
+        } else {
+            s->to_client += buf->len;
+        }
+        buffer_release(buf);
+        if (feedback) {
+            deliver_to_server(s, feedback->buffer, feedback->len);
+            buffer_release(feedback);
+        }
+        offset += n;
+    } while (offset < len && s->failed == false);
+}
+
+static void client_send(struct bench_session *s, const uint8_t *data, size_t len) {
+    size_t offset = 0;
+    do {
+        size_t n = min(len - offset, (size_t)SSR_BUFF_SIZE);
+        struct buffer_t *buf = buffer_create(SSR_BUFF_SIZE);
+        buffer_store(buf, data + offset, n);
+        if (tunnel_cipher_client_encrypt(s->client.cipher, buf) != ssr_ok) {
+            s->failed = true;
+        } else {
+            deliver_to_server(s, buf->buffer, buf->len);
+        }
+        buffer_release(buf);
+        offset += n;
+    } while (offset < len && s->failed == false);
+}
+
+static void server_send(struct bench_session *s, const uint8_t *data, size_t len) {
+    size_t offset = 0;
+    do {
+        size_t n = min(len - offset, (size_t)SSR_BUFF_SIZE);
+        struct buffer_t *result;
+        BUFFER_CONSTANT_INSTANCE(buf, data + offset, n);
+        result = tunnel_cipher_server_encrypt(s->server.cipher, buf);
+        if (result == NULL) {
+            s->failed = true;
+        } else {
+            deliver_to_client(s, result->buffer, result->len);
+        }
+        buffer_release(result);
+        offset += n;
+    } while (offset < len && s->failed == false);
+}
+
+static void set_head_len(struct tunnel_cipher_ctx *tc, const struct buffer_t *init_pkg) {
+    struct obfs_t *protocol = tc->protocol;
+    struct obfs_t *obfs = tc->obfs;
+    struct server_info_t *info;
+    info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
+    if (info) {
+        info->buffer_size = SSR_BUFF_SIZE;
+        info->head_len = (int) get_s5_head_size(init_pkg->buffer, init_pkg->len, 30);
+    }
+}
+
+static void bench_peer_init(struct bench_peer *peer, const struct bench_options *opts,
+    const char *method, const char *protocol, const char *obfs, bool server)
+{
+    struct server_config *config = config_create();
+    string_safe_assign(&config->password, opts->password);
+    string_safe_assign(&config->method, method);
+    string_safe_assign(&config->protocol, protocol);
+    string_safe_assign(&config->obfs, obfs);
+    string_safe_assign(&config->remote_host, "127.0.0.1");
+    config->remote_port = 443;
+    if (server) {
+        config_change_for_server(config);
+    }
+    peer->config = config;
+    peer->env = ssr_cipher_env_create(config, NULL);
+    peer->cipher = tunnel_cipher_create(peer->env, BENCH_TCP_MSS);
+}
+
+static void bench_peer_free(struct bench_peer *peer) {
+    tunnel_cipher_release(peer->cipher);
+    ssr_cipher_env_release(peer->env);
+    config_release(peer->config);
+}
+
+/* Sends the SOCKS5 style address header and lets both sides finish their handshakes. */
+static bool bench_session_open(struct bench_session *s) {
+    static const uint8_t header[] = { 0x01, 127, 0, 0, 1, 0x00, 0x50 };
+    BUFFER_CONSTANT_INSTANCE(init_pkg, header, sizeof(header));
+
+    set_head_len(s->client.cipher, init_pkg);
+    client_send(s, header, sizeof(header));
+    if (s->failed || s->to_server != sizeof(header)) {
+        return false;
+    }
+    set_head_len(s->server.cipher, init_pkg);
+    s->to_server = 0;
+    s->to_client = 0;
+    return true;
+}
+
+static void bench_run_one(const struct bench_options *opts, const uint8_t *payload,
+    const char *method, const char *protocol, const char *obfs)
+{
+    size_t i;
+    for (i = 0; i < opts->sizes_count; ++i) {
+        struct bench_session s;
+        size_t size = opts->sizes[i];
+        size_t allocs_before;
+        uint64_t begin, elapsed;
+        unsigned int n;
+
+        memset(&s, 0, sizeof(s));
+        bench_peer_init(&s.client, opts, method, protocol, obfs, false);
+        bench_peer_init(&s.server, opts, method, protocol, obfs, true);
+
+        if (bench_session_open(&s) == false) {
+            printf("%-18s %-16s %-24s %7u  handshake failed\n",
+                method, protocol, obfs, (unsigned int)size);
+            bench_peer_free(&s.client);
+            bench_peer_free(&s.server);
+            continue;
+        }
+
+        allocs_before = BENCH_ALLOC_COUNT();
+        begin = uv_hrtime();
+        for (n = 0; n < opts->iterations && s.failed == false; ++n) {
+            client_send(&s, payload, size);
+            server_send(&s, payload, size);
+        }
+        elapsed = uv_hrtime() - begin;
+
+        if (s.failed || s.to_server != (size_t)n * size || s.to_client != (size_t)n * size) {
+            printf("%-18s %-16s %-24s %7u  round trip failed after %u ops\n",
+                method, protocol, obfs, (unsigned int)size, n);
+        } else {
+            double seconds = (double)elapsed / 1e9;
+            double mb = (double)size * 2.0 * n / (1024.0 * 1024.0);
+            printf("%-18s %-16s %-24s %7u  %9.2f MB/s %10.0f ns/op",
+                method, protocol, obfs, (unsigned int)size,
+                seconds > 0 ? mb / seconds : 0.0, (double)elapsed / n);
+#if defined(SSR_BENCH_WRAP_MALLOC)
+            printf(" %8.2f allocs/op", (double)(BENCH_ALLOC_COUNT() - allocs_before) / n);
+#else
+            (void)allocs_before;
+#endif
+            printf("\n");
+        }
+        fflush(stdout);
+
+        bench_peer_free(&s.client);
+        bench_peer_free(&s.server);
+    }
+}
+
+/* Records what the client sends for |iterations| payloads of |size|, handshake included. */
+static bool bench_corpus_record(const struct bench_options *opts, const uint8_t *payload, size_t size,
+    const char *method, const char *protocol, const char *obfs, struct buffer_t *corpus,
+    size_t *plaintext, size_t *frames)
+{
+    struct bench_session s;
+    unsigned int n;
+    bool ok;
+
+    memset(&s, 0, sizeof(s));
+    bench_peer_init(&s.client, opts, method, protocol, obfs, false);
+    bench_peer_init(&s.server, opts, method, protocol, obfs, true);
+    s.capture = corpus;
+
+    ok = bench_session_open(&s);
+    for (n = 0; ok && n < opts->iterations && s.failed == false; ++n) {
+        client_send(&s, payload, size);
+    }
+    ok = ok && s.failed == false && s.to_server == (size_t)opts->iterations * size;
+    *plaintext = s.to_server;
+    *frames = s.frames;
+
+    bench_peer_free(&s.client);
+    bench_peer_free(&s.server);
+    return ok;
+}
+
+static void bench_corpus_replay(const struct bench_options *opts, const struct buffer_t *corpus,
+    size_t plaintext, size_t frames, size_t size, size_t split,
+    const char *method, const char *protocol, const char *obfs)
+{
+    static const uint8_t header[] = { 0x01, 127, 0, 0, 1, 0x00, 0x50 };
+    BUFFER_CONSTANT_INSTANCE(init_pkg, header, sizeof(header));
+    struct bench_peer server;
+    size_t offset = 0;
+    size_t decoded = 0;
+    size_t allocs_before;
+    uint64_t elapsed = 0;
+    uint64_t worst = 0;
+    bool failed = false;
+
+    bench_peer_init(&server, opts, method, protocol, obfs, true);
+    set_head_len(server.cipher, init_pkg);
+
+    allocs_before = BENCH_ALLOC_COUNT();
+    while (offset < corpus->len && failed == false) {
+        size_t n = min(corpus->len - offset, split);
+        struct buffer_t *receipt = NULL;
+        struct buffer_t *confirm = NULL;
+        struct buffer_t *result;
+        uint64_t begin, spent;
+        BUFFER_CONSTANT_INSTANCE(buf, corpus->buffer + offset, n);
+
+        begin = uv_hrtime();
+        result = tunnel_cipher_server_decrypt(server.cipher, buf, &receipt, &confirm);
+        spent = uv_hrtime() - begin;
+
+        elapsed += spent;
+        worst = max(worst, spent);
+        if (result == NULL) {
+            failed = true;
+        } else {
+            decoded += result->len;
+        }
+        buffer_release(receipt);
+        buffer_release(confirm);
+        buffer_release(result);
+        offset += n;
+    }
+
+    /* The address header opens the stream, the payloads follow it. */
+    if (failed || decoded != plaintext + sizeof(header)) {
+        printf("%-18s %-16s %-24s %7u %6u  replay failed at offset %u\n",
+            method, protocol, obfs, (unsigned int)size, (unsigned int)split, (unsigned int)offset);
+    } else {
+        double seconds = (double)elapsed / 1e9;
+        double mb = (double)corpus->len / (1024.0 * 1024.0);
+        printf("%-18s %-16s %-24s %7u %6u  %9.2f MB/s %10.0f ns worst",
+            method, protocol, obfs, (unsigned int)size, (unsigned int)split,
+            seconds > 0 ? mb / seconds : 0.0, (double)worst);
+#if defined(SSR_BENCH_WRAP_MALLOC)
+        printf(" %8.2f allocs/frame", (double)(BENCH_ALLOC_COUNT() - allocs_before) / frames);
+#else
+        (void)allocs_before;
+        (void)frames;
+#endif
+        printf("\n");
+    }
+    fflush(stdout);
+
+    bench_peer_free(&server);
+}
+
+static void bench_corpus_one(const struct bench_options *opts, const uint8_t *payload,
+    const char *method, const char *protocol, const char *obfs)
+{
+    size_t i, j;
+    for (i = 0; i < opts->sizes_count; ++i) {
+        struct buffer_t *corpus = buffer_create(SSR_BUFF_SIZE);
+        size_t size = opts->sizes[i];
+        size_t plaintext = 0;
+        size_t frames = 0;
+
+        if (bench_corpus_record(opts, payload, size, method, protocol, obfs, corpus, &plaintext, &frames) == false) {
+            printf("%-18s %-16s %-24s %7u  record failed\n",
+                method, protocol, obfs, (unsigned int)size);
+            fflush(stdout);
+        } else {
+            for (j = 0; j < opts->splits_count; ++j) {
+                bench_corpus_replay(opts, corpus, plaintext, frames, size, opts->splits[j], method, protocol, obfs);
+            }
+        }
+        buffer_release(corpus);
+    }
+}
+
+static const char bench_base64_std[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* One sextet at a time, what the vector kernels have to agree with. */
+static size_t bench_base64_reference(const uint8_t *src, size_t len, char *dst, bool url_safe) {
+    char basis[sizeof(bench_base64_std)];
+    size_t i, n = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    memcpy(basis, bench_base64_std, sizeof(basis));
+    if (url_safe) {
+        basis[62] = '-';
+        basis[63] = '_';
+    }
+    for (i = 0; i < len; ++i) {
+        acc = (acc << 8) | src[i];
+        bits += 8;
+        while (bits >= 6) {
+            bits -= 6;
+            dst[n++] = basis[(acc >> bits) & 0x3F];
+        }
+    }
+    if (bits > 0) {
+        dst[n++] = basis[(acc << (6 - bits)) & 0x3F];
+    }
+    while (url_safe == false && (n % 4) != 0) {
+        dst[n++] = '=';
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+static bool bench_base64_check(const uint8_t *payload, size_t max_size) {
+    size_t cap = max_size;
+    char *expect = (char *) malloc(cap * 2 + 8);
+    unsigned char *coded = (unsigned char *) malloc(cap * 2 + 8);
+    unsigned char *plain = (unsigned char *) malloc(cap + 8);
+    bool ok = true;
+    size_t len;
+    int url_safe;
+
+    for (url_safe = 0; url_safe < 2 && ok; ++url_safe) {
+        for (len = 0; len <= cap && ok; len = (len < BENCH_BASE64_CHECK_MAX) ? len + 1 : len * 2) {
+            size_t n = bench_base64_reference(payload, len, expect, url_safe != 0);
+            int coded_len = url_safe ? url_safe_base64_encode(payload, (int)len, coded)
+                                     : std_base64_encode(payload, (int)len, coded);
+            int plain_len;
+            if ((size_t)coded_len != n || strcmp((const char *)coded, expect) != 0) {
+                printf("base64 %s encode of %u bytes differs\n", url_safe ? "url safe" : "std", (unsigned int)len);
+                ok = false;
+                break;
+            }
+            plain_len = url_safe ? url_safe_base64_decode(coded, plain) : std_base64_decode(coded, plain);
+            if ((size_t)plain_len != len || memcmp(plain, payload, len) != 0 ||
+                any_base64_decode(coded, coded_len, plain) != (int)len || memcmp(plain, payload, len) != 0)
+            {
+                printf("base64 %s decode of %u bytes differs\n", url_safe ? "url safe" : "std", (unsigned int)len);
+                ok = false;
+            }
+        }
+    }
+    free(expect);
+    free(coded);
+    free(plain);
+    return ok;
+}
+
+static void bench_base64(const struct bench_options *opts, const uint8_t *payload, size_t max_size) {
+    unsigned char *coded = (unsigned char *) malloc(max_size * 2 + 8);
+    unsigned char *plain = (unsigned char *) malloc(max_size + 8);
+    size_t i;
+
+    if (bench_base64_check(payload, max_size)) {
+        printf("base64 matches the reference\n");
+    }
+    printf("%-18s %7s %12s %12s\n", "base64", "size", "encode", "decode");
+    for (i = 0; i < opts->sizes_count; ++i) {
+        size_t size = opts->sizes[i];
+        uint64_t begin, encode, decode;
+        unsigned int n;
+        double mb = (double)size * opts->iterations / (1024.0 * 1024.0);
+
+        begin = uv_hrtime();
+        for (n = 0; n < opts->iterations; ++n) {
+            std_base64_encode(payload, (int)size, coded);
+        }
+        encode = uv_hrtime() - begin;
+        begin = uv_hrtime();
+        for (n = 0; n < opts->iterations; ++n) {
+            std_base64_decode(coded, plain);
+        }
+        decode = uv_hrtime() - begin;
+        printf("%-18s %7u %7.0f MB/s %7.0f MB/s\n", "", (unsigned int)size,
+            encode ? mb / ((double)encode / 1e9) : 0.0, decode ? mb / ((double)decode / 1e9) : 0.0);
+    }
+    free(coded);
+    free(plain);
+}
+
+static void usage(const char *exe) {
+    printf("Usage:\n"
+        "  %s [-n iterations] [-s size[,size...]] [-m method] [-O protocol] [-o obfs] [-k password]\n"
+        "  %s -r [-c split[,split...]] [-n iterations] [-s size[,size...]] [-m method] [-O protocol] [-o obfs]\n"
+        "  %s -b [-n iterations] [-s size[,size...]]\n"
+        "\n"
+        "  Without -m, -O or -o every known method, protocol or obfs is run.\n"
+        "  Default sizes are 64,1024,16384, default iterations %d (%d with -r).\n"
+        "  -r records the client stream and replays it into a fresh server cut\n"
+        "  into -c sized reads, default splits are 1,%d.\n"
+        "  -b checks base64 against a reference, then times it.\n",
+        exe, exe, exe, BENCH_DEFAULT_ITERATIONS, BENCH_CORPUS_ITERATIONS, BENCH_TCP_MSS);
+}
+
+static bool parse_list(size_t *list, size_t *count, size_t count_max, const char *text) {
+    char *end = NULL;
+    *count = 0;
+    while (*text && *count < count_max) {
+        unsigned long value = strtoul(text, &end, 10);
+        if (end == text || value == 0) {
+            return false;
+        }
+        list[(*count)++] = (size_t)value;
+        text = (*end == ',') ? end + 1 : end;
+    }
+    return *count > 0;
+}
+
+static bool parse_sizes(struct bench_options *opts, const char *text) {
+    return parse_list(opts->sizes, &opts->sizes_count, BENCH_SIZES_MAX, text);
+}
+
+static bool parse_splits(struct bench_options *opts, const char *text) {
+    return parse_list(opts->splits, &opts->splits_count, BENCH_SPLITS_MAX, text);
+}
+
+int main(int argc, char * const argv[]) {
+    struct bench_options opts;
+    uint8_t *payload;
+    size_t max_size = 0;
+    size_t m, p, o, i;
+    bool iterations_set = false;
+    char splits[32];
+    int opt;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.iterations = BENCH_DEFAULT_ITERATIONS;
+    opts.password = BENCH_DEFAULT_PASSWORD;
+    parse_sizes(&opts, "64,1024,16384");
+    snprintf(splits, sizeof(splits), "1,%d", BENCH_TCP_MSS);
+    parse_splits(&opts, splits);
+
+    while (-1 != (opt = getopt(argc, argv, "n:s:c:rbm:O:o:k:h"))) {
+        switch (opt) {
+        case 'n':
+            opts.iterations = (unsigned int)strtoul(optarg, NULL, 10);
+            iterations_set = true;
+            break;
+        case 'c':
+            if (parse_splits(&opts, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'r':
+            opts.corpus = true;
+            break;
+        case 'b':
+            opts.base64 = true;
+            break;
+        case 's':
+            if (parse_sizes(&opts, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'm':
+            opts.method = optarg;
+            break;
+        case 'O':
+            opts.protocol = optarg;
+            break;
+        case 'o':
+            opts.obfs = optarg;
+            break;
+        case 'k':
+            opts.password = optarg;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if (opts.corpus && iterations_set == false) {
+        opts.iterations = BENCH_CORPUS_ITERATIONS;
+    }
+    if (opts.iterations == 0) {
+        opts.iterations = 1;
+    }
+
+    for (i = 0; i < opts.sizes_count; ++i) {
+        max_size = max(max_size, opts.sizes[i]);
+    }
+    if (opts.base64) {
+        max_size = max(max_size, (size_t)BENCH_BASE64_CHECK_MAX);
+    }
+    payload = (uint8_t *) malloc(max_size);
+    for (i = 0; i < max_size; ++i) {
+        payload[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    if (opts.base64) {
+        bench_base64(&opts, payload, max_size);
+        free(payload);
+        return 0;
+    }
+
+    if (opts.corpus) {
+        printf("%-18s %-16s %-24s %7s %6s\n", "method", "protocol", "obfs", "size", "split");
+    } else {
+        printf("%-18s %-16s %-24s %7s\n", "method", "protocol", "obfs", "size");
+    }
+    for (m = 0; m < BENCH_COUNT_OF(bench_methods); ++m) {
+        if (opts.method && strcmp(opts.method, bench_methods[m]) != 0) {
+            continue;
+        }
+        for (p = 0; p < BENCH_COUNT_OF(bench_protocols); ++p) {
+            if (opts.protocol && strcmp(opts.protocol, bench_protocols[p]) != 0) {
+                continue;
+            }
+            for (o = 0; o < BENCH_COUNT_OF(bench_obfses); ++o) {
+                if (opts.obfs && strcmp(opts.obfs, bench_obfses[o]) != 0) {
+                    continue;
+                }
+                if (opts.corpus) {
+                    bench_corpus_one(&opts, payload, bench_methods[m], bench_protocols[p], bench_obfses[o]);
+                } else {
+                    bench_run_one(&opts, payload, bench_methods[m], bench_protocols[p], bench_obfses[o]);
+                }
+            }
+        }
+    }
+
+    free(payload);
+    return 0;
+}
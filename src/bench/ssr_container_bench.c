@@ -0,0 +1,444 @@
+/*
+ * ssr-container-bench: times the primitives the data path leans on,
+ * buffer_t as the protocol and obfs plugins use it and the containers of
+ * obfs/cstl_lib.c and cache.c, with the allocations each operation costs
+ * through ssr_alloc.
+ *
+ * buffer: a stream of -r reads of -s bytes each, cut into frames of
+ * random sizes the way a recv_buffer is, once with buffer_consume() and
+ * a buffer_drop_head() per read and once with the buffer_shorten() per
+ * frame it replaced; then a header put in front of a read's payload, with
+ * buffer_insert() at 0 and with buffer_prepend() into headroom.
+ *
+ * containers: per size from -n, keys in random order inserted, looked up
+ * and deleted in cstl_set, cstl_map, cstl_deque and cache.c. cstl_list
+ * walks itself for a push_back or a find, so it's timed over
+ * BENCH_LIST_OPS operations on a list of that size rather than filled.
+ * Times are ns per operation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <uv.h>
+
+#include "ssrbuffer.h"
+#include "cstl_lib.h"
+#include "cache.h"
+#include "ssr_alloc.h"
+
+#define BENCH_SIZES_MAX             8
+#define BENCH_DEFAULT_SIZES         "1000,10000,100000,1000000"
+#define BENCH_DEFAULT_READS         100000
+#define BENCH_DEFAULT_READ_SIZE     1452
+#define BENCH_FRAME_MIN             64
+#define BENCH_HEADER_SIZE           16  /* An IV's worth, as encrypt.c prepends. */
+#define BENCH_LIST_OPS              100
+#define BENCH_CACHE_KEY_MAX         32
+
+struct bench_options {
+    bool buffer;
+    bool containers;
+    size_t sizes[BENCH_SIZES_MAX];
+    size_t sizes_count;
+    unsigned int reads;
+    size_t read_size;
+};
+
+/* One container at one size, ns per operation. */
+struct bench_result {
+    double insert;
+    double lookup;
+    double remove;
+    double allocations;  /* Per insert. */
+    size_t missed;  /* Lookups that didn't find a key they should have. */
+};
+
+static uint64_t bench_seed = 0x9E3779B97F4A7C15ULL;
+
+/* xorshift64*, fixed seed: the same keys and frames every run. */
+static uint64_t bench_random(void) {
+    bench_seed ^= bench_seed >> 12;
+    bench_seed ^= bench_seed << 25;
+    bench_seed ^= bench_seed >> 27;
+    return bench_seed * 2685821657736338717ULL;
+}
+
+static uint64_t bench_allocations(void) {
+    struct ssr_alloc_stats stats[ssr_alloc_kind_max];
+    uint64_t total = 0;
+    int kind;
+    ssr_alloc_get_stats(stats);
+    for (kind = 0; kind < ssr_alloc_kind_max; ++kind) {
+        total += stats[kind].allocations;
+    }
+    return total;
+}
+
+static double per_op(uint64_t elapsed, size_t ops) {
+    return ops ? (double)elapsed / (double)ops : 0.0;
+}
+
+static int uint64_key_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* The keys in another order, for lookups and deletes that don't follow the inserts. */
+static void shuffle(uint64_t *keys, size_t count) {
+    size_t i;
+    for (i = count; i > 1; --i) {
+        size_t j = (size_t)(bench_random() % i);
+        uint64_t tmp = keys[i - 1];
+        keys[i - 1] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static size_t next_frame(size_t read_size) {
+    return BENCH_FRAME_MIN + (size_t)(bench_random() % (read_size - BENCH_FRAME_MIN + 1));
+}
+
+static void print_buffer_row(const char *name, size_t ops, size_t bytes, uint64_t elapsed, uint64_t allocations) {
+    printf("  %-18s %10zu %10.1f %10.1f %10.2f\n", name, ops, per_op(elapsed, ops),
+        elapsed ? (double)bytes / ((double)elapsed / 1e9) / (1024.0 * 1024.0) : 0.0,
+        ops ? (double)allocations / (double)ops : 0.0);
+}
+
+/* The recv_buffer pattern: whole frames taken off the front of what the reads left. */
+static void bench_recv(const struct bench_options *opts, const uint8_t *read, bool consume) {
+    struct buffer_t *buf = buffer_create(opts->read_size * 2);
+    uint64_t start, allocations = bench_allocations();
+    size_t frames = 0, frame = next_frame(opts->read_size);
+    unsigned int i;
+
+    start = uv_hrtime();
+    for (i = 0; i < opts->reads; ++i) {
+        buffer_concatenate(buf, read, opts->read_size);
+        while (buf->len >= frame) {
+            if (consume) {
+                buffer_consume(buf, frame);
+            } else {
+                buffer_shorten(buf, frame, buf->len - frame);
+            }
+            frame = next_frame(opts->read_size);
+            frames++;
+        }
+        if (consume) {
+            buffer_drop_head(buf);
+        }
+    }
+    print_buffer_row(consume ? "recv consume" : "recv shorten", frames, (size_t)opts->reads * opts->read_size,
+        uv_hrtime() - start, bench_allocations() - allocations);
+    buffer_release(buf);
+}
+
+/* A header in front of a read's payload, in a buffer of its own as the ciphers get it. */
+static void bench_header(const struct bench_options *opts, const uint8_t *read, bool prepend) {
+    uint8_t header[BENCH_HEADER_SIZE] = { 0 };
+    uint64_t start, allocations = bench_allocations();
+    unsigned int i;
+
+    start = uv_hrtime();
+    for (i = 0; i < opts->reads; ++i) {
+        struct buffer_t *buf;
+        if (prepend) {
+            buf = buffer_create_with_headroom(sizeof(header), opts->read_size);
+            buffer_store(buf, read, opts->read_size);
+            buffer_prepend(buf, header, sizeof(header));
+        } else {
+            buf = buffer_create(opts->read_size);
+            buffer_store(buf, read, opts->read_size);
+            buffer_insert(buf, 0, header, sizeof(header));
+        }
+        buffer_release(buf);
+    }
+    print_buffer_row(prepend ? "header prepend" : "header insert", opts->reads, (size_t)opts->reads * opts->read_size,
+        uv_hrtime() - start, bench_allocations() - allocations);
+}
+
+static void bench_buffer(const struct bench_options *opts) {
+    uint8_t *read = (uint8_t *) malloc(opts->read_size);
+    size_t i;
+
+    for (i = 0; i < opts->read_size; ++i) {
+        read[i] = (uint8_t)bench_random();
+    }
+    printf("buffer_t: %u reads of %zu bytes\n", opts->reads, opts->read_size);
+    printf("  %-18s %10s %10s %10s %10s\n", "pattern", "ops", "ns/op", "MB/s", "allocs/op");
+    bench_recv(opts, read, true);
+    bench_recv(opts, read, false);
+    bench_header(opts, read, true);
+    bench_header(opts, read, false);
+    free(read);
+}
+
+static void bench_set(const uint64_t *keys, uint64_t *order, size_t count, struct bench_result *r) {
+    struct cstl_set *set = cstl_set_new(uint64_key_compare, NULL);
+    uint64_t start, allocations = bench_allocations();
+    size_t i;
+
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        cstl_set_insert(set, (void *)&keys[i], sizeof(keys[i]));
+    }
+    r->insert = per_op(uv_hrtime() - start, count);
+    r->allocations = per_op(bench_allocations() - allocations, count);
+    shuffle(order, count);
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        r->missed += cstl_set_exists(set, &order[i]) ? 0 : 1;
+    }
+    r->lookup = per_op(uv_hrtime() - start, count);
+    shuffle(order, count);
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        cstl_set_remove(set, &order[i]);
+    }
+    r->remove = per_op(uv_hrtime() - start, count);
+    cstl_set_delete(set);
+}
+
+static void bench_map(const uint64_t *keys, uint64_t *order, size_t count, struct bench_result *r) {
+    struct cstl_map *map = cstl_map_new(uint64_key_compare, NULL, NULL);
+    uint64_t start, allocations = bench_allocations();
+    size_t i;
+
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        cstl_map_insert(map, &keys[i], sizeof(keys[i]), &i, sizeof(i));
+    }
+    r->insert = per_op(uv_hrtime() - start, count);
+    r->allocations = per_op(bench_allocations() - allocations, count);
+    shuffle(order, count);
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        r->missed += cstl_map_find(map, &order[i]) ? 0 : 1;
+    }
+    r->lookup = per_op(uv_hrtime() - start, count);
+    shuffle(order, count);
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        cstl_map_remove(map, &order[i]);
+    }
+    r->remove = per_op(uv_hrtime() - start, count);
+    cstl_map_delete(map);
+}
+
+/* Pushed at the back, read at random indexes, popped from the front: a queue. */
+static void bench_deque(const uint64_t *keys, size_t count, struct bench_result *r) {
+    struct cstl_deque *deque = cstl_deque_new(16, uint64_key_compare, NULL);
+    uint64_t start, allocations = bench_allocations();
+    size_t i;
+
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        cstl_deque_push_back(deque, (void *)&keys[i], sizeof(keys[i]));
+    }
+    r->insert = per_op(uv_hrtime() - start, count);
+    r->allocations = per_op(bench_allocations() - allocations, count);
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        size_t at = (size_t)(bench_random() % count);
+        const uint64_t *key = (const uint64_t *) cstl_deque_element_at(deque, at);
+        r->missed += (key && *key == keys[at]) ? 0 : 1;
+    }
+    r->lookup = per_op(uv_hrtime() - start, count);
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        cstl_deque_pop_front(deque);
+    }
+    r->remove = per_op(uv_hrtime() - start, count);
+    cstl_deque_delete(deque);
+}
+
+/* Filled untimed from the head, then BENCH_LIST_OPS of each at that size. */
+static void bench_list(const uint64_t *keys, size_t count, struct bench_result *r) {
+    struct cstl_list *list = cstl_list_new(NULL, uint64_key_compare);
+    size_t ops = (count < BENCH_LIST_OPS) ? count : BENCH_LIST_OPS;
+    uint64_t start, allocations;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        cstl_list_insert(list, 0, (void *)&keys[i], sizeof(keys[i]));
+    }
+    allocations = bench_allocations();
+    start = uv_hrtime();
+    for (i = 0; i < ops; ++i) {
+        cstl_list_push_back(list, (void *)&keys[i], sizeof(keys[i]));
+    }
+    r->insert = per_op(uv_hrtime() - start, ops);
+    r->allocations = per_op(bench_allocations() - allocations, ops);
+    start = uv_hrtime();
+    for (i = 0; i < ops; ++i) {
+        r->missed += cstl_list_find(list, (void *)&keys[bench_random() % count]) ? 0 : 1;
+    }
+    r->lookup = per_op(uv_hrtime() - start, ops);
+    start = uv_hrtime();
+    for (i = 0; i < ops; ++i) {
+        cstl_list_remove(list, cstl_list_size(list) - 1);
+    }
+    r->remove = per_op(uv_hrtime() - start, ops);
+    cstl_list_destroy(list);
+}
+
+/* String keys, as the DNS caches use it, sized to hold all of them. */
+static void bench_cache(uint64_t *order, size_t count, struct bench_result *r) {
+    char key[BENCH_CACHE_KEY_MAX];
+    struct cache *cache = NULL;
+    uint64_t start, allocations;
+    size_t i;
+
+    if (cache_create(&cache, count, NULL) != 0) {
+        r->missed = count;
+        return;
+    }
+    allocations = bench_allocations();
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        int len = snprintf(key, sizeof(key), "%016llx", (unsigned long long)order[i]);
+        cache_insert(cache, key, (size_t)len, NULL);
+    }
+    r->insert = per_op(uv_hrtime() - start, count);
+    r->allocations = per_op(bench_allocations() - allocations, count);
+    shuffle(order, count);
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        int len = snprintf(key, sizeof(key), "%016llx", (unsigned long long)order[i]);
+        r->missed += cache_key_exist(cache, key, (size_t)len) ? 0 : 1;
+    }
+    r->lookup = per_op(uv_hrtime() - start, count);
+    shuffle(order, count);
+    start = uv_hrtime();
+    for (i = 0; i < count; ++i) {
+        int len = snprintf(key, sizeof(key), "%016llx", (unsigned long long)order[i]);
+        cache_remove(cache, key, (size_t)len);
+    }
+    r->remove = per_op(uv_hrtime() - start, count);
+    cache_delete(cache, 0);
+}
+
+static void print_container_row(const char *name, size_t count, const struct bench_result *r) {
+    printf("  %-18s %10zu %10.1f %10.1f %10.1f %10.2f", name, count, r->insert, r->lookup, r->remove, r->allocations);
+    if (r->missed) {
+        printf("  %zu missed!", r->missed);
+    }
+    printf("\n");
+}
+
+static void bench_containers(const struct bench_options *opts) {
+    size_t s, i;
+
+    printf("containers: ns/op, cstl_list over %d ops at each size\n", BENCH_LIST_OPS);
+    printf("  %-18s %10s %10s %10s %10s %10s\n", "container", "size", "insert", "lookup", "delete", "allocs/ins");
+    for (s = 0; s < opts->sizes_count; ++s) {
+        size_t count = opts->sizes[s];
+        uint64_t *keys = (uint64_t *) malloc(count * sizeof(uint64_t));
+        uint64_t *order = (uint64_t *) malloc(count * sizeof(uint64_t));
+        struct bench_result r;
+
+        for (i = 0; i < count; ++i) {
+            keys[i] = bench_random();
+        }
+        memcpy(order, keys, count * sizeof(uint64_t));
+
+        memset(&r, 0, sizeof(r));
+        bench_set(keys, order, count, &r);
+        print_container_row("cstl_set", count, &r);
+        memset(&r, 0, sizeof(r));
+        bench_map(keys, order, count, &r);
+        print_container_row("cstl_map", count, &r);
+        memset(&r, 0, sizeof(r));
+        bench_deque(keys, count, &r);
+        print_container_row("cstl_deque", count, &r);
+        memset(&r, 0, sizeof(r));
+        bench_list(keys, count, &r);
+        print_container_row("cstl_list", count, &r);
+        memset(&r, 0, sizeof(r));
+        bench_cache(order, count, &r);
+        print_container_row("cache", count, &r);
+
+        free(keys);
+        free(order);
+    }
+}
+
+static void usage(const char *exe) {
+    printf("Usage:\n"
+        "  %s [-o buffer|containers] [-n size[,size...]] [-r reads] [-s read_size]\n"
+        "\n"
+        "  Both sections without -o. Container sizes %s by default,\n"
+        "  %d reads of %d bytes for buffer_t.\n",
+        exe, BENCH_DEFAULT_SIZES, BENCH_DEFAULT_READS, BENCH_DEFAULT_READ_SIZE);
+}
+
+static bool parse_sizes(struct bench_options *opts, char *text) {
+    char *token, *saveptr = NULL;
+    opts->sizes_count = 0;
+    for (token = strtok_r(text, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        size_t size = (size_t)strtoull(token, NULL, 10);
+        if (opts->sizes_count == BENCH_SIZES_MAX || size == 0) {
+            return false;
+        }
+        opts->sizes[opts->sizes_count++] = size;
+    }
+    return opts->sizes_count > 0;
+}
+
+int main(int argc, char * const argv[]) {
+    char default_sizes[] = BENCH_DEFAULT_SIZES;
+    struct bench_options opts;
+    int opt;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.reads = BENCH_DEFAULT_READS;
+    opts.read_size = BENCH_DEFAULT_READ_SIZE;
+    parse_sizes(&opts, default_sizes);
+
+    while (-1 != (opt = getopt(argc, argv, "o:n:r:s:h"))) {
+        switch (opt) {
+        case 'o':
+            if (strcmp(optarg, "buffer") == 0) {
+                opts.buffer = true;
+            } else if (strcmp(optarg, "containers") == 0) {
+                opts.containers = true;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'n':
+            if (parse_sizes(&opts, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'r':
+            opts.reads = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            opts.read_size = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if (opts.buffer == false && opts.containers == false) {
+        opts.buffer = opts.containers = true;
+    }
+    opts.reads = opts.reads ? opts.reads : 1;
+    opts.read_size = (opts.read_size > BENCH_FRAME_MIN) ? opts.read_size : BENCH_FRAME_MIN;
+
+    if (opts.buffer) {
+        bench_buffer(&opts);
+    }
+    if (opts.containers) {
+        bench_containers(&opts);
+    }
+    return 0;
+}
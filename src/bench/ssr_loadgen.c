@@ -0,0 +1,1565 @@
+/*
+ * ssr-loadgen: runs ssr-server and ssr-client from one config.json on
+ * loopback and drives tunnels through them to a sink of its own, the
+ * whole path a user's connection takes: SOCKS5, the client's encryption,
+ * the server's decryption and its connection to the destination.
+ *
+ * The config's method, protocol, obfs and every tuning key are kept; the
+ * addresses are rewritten to 127.0.0.1 and free ports, and what would
+ * listen elsewhere or send the tunnels around the server (acl, metrics,
+ * tunnel_address, ...) is dropped. The rewritten copy goes to a temporary
+ * file both children are started with.
+ *
+ * Each tunnel makes -r requests to the sink. A request is a 16 byte header
+ * (request and response length, big endian) and the request body; the
+ * sink answers with the response body. With -B a share of the tunnels
+ * are bulk instead, one request for -b bytes. Sizes are a fixed N, a
+ * uniform A-B or an exponential ~N around a mean N.
+ *
+ * Reported: tunnels per second, time to first response byte (p50, p99,
+ * p999), Gbps through the tunnels both ways, and CPU seconds per Gbps of
+ * the two children and of the load generator itself. For a network
+ * namespace, run it under `ip netns exec`.
+ *
+ * With -I K it measures footprint instead: K tunnels are opened and held,
+ * the sink never answers, and each child's resident set (/proc, Linux) and
+ * heap by subsystem (its ssr_alloc_bytes and ssr_allocations_total, read
+ * from a metrics_address of its own) are compared with before they were
+ * opened. -x runs that per protocol/obfs pair, "+tls" adding over_tls on
+ * top of the config's own TLS settings, a fresh pair of children for each.
+ * With -L the run fails when a side grows more than that many bytes of
+ * RSS per tunnel, for CI to catch tunnel_ctx, obfs_t or TLS context growth.
+ *
+ * With -R it plays back what ssr-server's shape_file recorded instead of
+ * the sizes above. Each recorded tunnel is a run of exchanges: the client
+ * reads up to the target's next answer become one request, the target
+ * reads up to the client's next one its response, and the next request
+ * waits the time that separated them. Tunnel i plays shape i mod N, so
+ * two runs of one file send the same traffic. Sizes are as the server
+ * read them, the tunnel's own overhead included, which ssr-client adds
+ * again on the way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <uv.h>
+#include <json-c/json.h>
+
+#define LOADGEN_DEFAULT_TUNNELS      1000
+#define LOADGEN_DEFAULT_CONCURRENCY  64
+#define LOADGEN_DEFAULT_REQUESTS     10
+#define LOADGEN_DEFAULT_BULK_SIZE    (16 * 1024 * 1024)
+#define LOADGEN_HEADER_SIZE          16
+#define LOADGEN_CHUNK_SIZE           (64 * 1024)
+#define LOADGEN_READY_INTERVAL       50    /* ms between probes of the children's ports, */
+#define LOADGEN_READY_TIMEOUT        5000  /* and how long they get to open them. */
+#define LOADGEN_EXIT_TIMEOUT         5000  /* ms after SIGTERM before SIGKILL. */
+#define LOADGEN_LOCALHOST            "127.0.0.1"
+#define LOADGEN_COMBOS_MAX           32
+#define LOADGEN_SUBSYSTEMS_MAX       8
+#define LOADGEN_SETTLE_MS            500   /* After the last idle tunnel, before the children are measured. */
+#define LOADGEN_EXCHANGES_MAX        4096  /* Of one played back tunnel, as tunnel_shape.h keeps reads. */
+
+/* Keys that would open listeners of their own or route around the server. */
+static const char *loadgen_dropped_keys[] = {
+    "servers", "subscription", "acl", "metrics_address", "manager_address",
+    "upgrade_socket", "tunnel_address", "transparent_proxy", "kcp_port",
+    "fake_dns_port", "trace_file", "shape_file", "flow_export",
+};
+
+enum loadgen_size_kind {
+    loadgen_size_fixed,
+    loadgen_size_uniform,
+    loadgen_size_exponential,
+};
+
+struct loadgen_size {
+    enum loadgen_size_kind kind;
+    uint64_t a;  /* The size, the low end or the mean. */
+    uint64_t b;  /* The high end of a uniform one. */
+};
+
+/* One request and its response of a -R tunnel, |delay_us| after the previous response. */
+struct loadgen_exchange {
+    uint64_t delay_us;
+    uint64_t request;
+    uint64_t response;
+};
+
+struct loadgen_shape {
+    struct loadgen_exchange *exchanges;
+    size_t count;
+};
+
+/* A protocol/obfs pair for -x, on top of the config. */
+struct loadgen_combo {
+    char protocol[32];
+    char obfs[32];
+    bool tls;
+};
+
+struct loadgen_options {
+    const char *config_file;
+    char server_exe[PATH_MAX];
+    char client_exe[PATH_MAX];
+    unsigned int tunnels;
+    unsigned int concurrency;
+    unsigned int requests;
+    struct loadgen_size request_size;
+    struct loadgen_size response_size;
+    unsigned int bulk_percent;
+    uint64_t bulk_size;
+    unsigned int idle;     /* -I, tunnels held open instead of the load. */
+    uint64_t rss_budget;   /* -L, bytes per idle tunnel, 0 for none. */
+    struct loadgen_combo combos[LOADGEN_COMBOS_MAX];
+    size_t combos_count;   /* 0 runs the config as it is. */
+    const char *shapes_file;  /* -R, played back instead of the sizes. */
+    struct loadgen_shape *shapes;
+    size_t shapes_count;
+    bool verbose;
+};
+
+/* One child's resident set and heap by subsystem, at one moment. */
+struct loadgen_footprint {
+    uint64_t rss;
+    char names[LOADGEN_SUBSYSTEMS_MAX][16];
+    int64_t bytes[LOADGEN_SUBSYSTEMS_MAX];
+    uint64_t allocations[LOADGEN_SUBSYSTEMS_MAX];
+    size_t count;
+};
+
+enum loadgen_side {
+    loadgen_side_server,
+    loadgen_side_client,
+    loadgen_side_max,
+};
+
+struct loadgen_samples {
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+};
+
+struct loadgen {
+    uv_loop_t *loop;
+    struct loadgen_options *opts;
+    size_t combo_index;
+    char config_path[loadgen_side_max][64];
+
+    uv_process_t server_proc;
+    uv_process_t client_proc;
+    int children_running;
+    uv_timer_t timer;  /* The readiness probes, then the children's exit. */
+    uint64_t ready_deadline;
+    int probes_pending;
+    int probes_ok;
+
+    uv_tcp_t sink;
+    struct sockaddr_in sink_addr;
+    struct sockaddr_in socks_addr;
+    struct sockaddr_in server_addr;
+    struct sockaddr_in metrics_addr[loadgen_side_max];
+
+    uint64_t seed;
+    unsigned int target;  /* Tunnels this run, -n or -I. */
+    unsigned int started;
+    unsigned int active;
+    unsigned int connected;
+    unsigned int completed;
+    unsigned int failed;
+    uint64_t bytes;
+    uint64_t begin;
+    uint64_t end;
+    struct loadgen_samples ttfb;
+    double children_cpu_begin;
+    double self_cpu_begin;
+
+    struct loadgen_tunnel **held;  /* The idle tunnels, NULL where one failed. */
+    struct loadgen_footprint footprint[loadgen_side_max][2];  /* Before and after them. */
+    int scrapes_pending;
+    int scrape_phase;
+    unsigned int idle_held;
+    int probes_wanted;
+    unsigned int failed_total;
+    bool over_budget;
+
+    bool finishing;
+    int exit_code;
+};
+
+enum loadgen_tunnel_state {
+    tunnel_state_connecting,
+    tunnel_state_greeting,  /* Waits for the method choice, 2 bytes, */
+    tunnel_state_reply,     /* then for the CONNECT reply, 10 for an IPv4 bind address. */
+    tunnel_state_response,
+    tunnel_state_idle,
+};
+
+struct loadgen_tunnel {
+    struct loadgen *lg;
+    uv_tcp_t tcp;
+    uv_connect_t connect_req;
+    enum loadgen_tunnel_state state;
+    uint8_t reply[10];
+    size_t reply_size;
+    unsigned int requests_left;
+    bool bulk;
+    uint64_t response_left;
+    uint64_t request_sent_at;
+    bool first_byte_seen;
+    size_t held_index;
+    const struct loadgen_shape *shape;  /* With -R. */
+    size_t exchange;  /* The next one of |shape| to send. */
+    uv_timer_t delay;  /* Before it, with |shape|. */
+    int open_handles;
+};
+
+struct loadgen_sink_conn {
+    uv_tcp_t tcp;
+    uint8_t header[LOADGEN_HEADER_SIZE];
+    size_t header_size;
+    uint64_t request_left;
+    uint64_t response_left;
+    bool responding;
+};
+
+struct loadgen_write {
+    uv_write_t req;
+    uint8_t *data;
+};
+
+static uint8_t loadgen_read_buffer[LOADGEN_CHUNK_SIZE];
+static uint8_t loadgen_zeroes[LOADGEN_CHUNK_SIZE];
+
+/* xorshift64*, the sizes only need to be spread, not unpredictable. */
+static uint64_t loadgen_random(struct loadgen *lg) {
+    lg->seed ^= lg->seed >> 12;
+    lg->seed ^= lg->seed << 25;
+    lg->seed ^= lg->seed >> 27;
+    return lg->seed * 2685821657736338717ULL;
+}
+
+static uint64_t loadgen_size_pick(struct loadgen *lg, const struct loadgen_size *size) {
+    double u;
+    switch (size->kind) {
+    case loadgen_size_uniform:
+        return size->a + loadgen_random(lg) % (size->b - size->a + 1);
+    case loadgen_size_exponential:
+        u = (double)((loadgen_random(lg) >> 11) + 1) / 9007199254740993.0;
+        return (uint64_t)(-log(u) * (double)size->a);
+    case loadgen_size_fixed:
+    default:
+        return size->a;
+    }
+}
+
+static void put_be64(uint8_t *p, uint64_t value) {
+    int i;
+    for (i = 7; i >= 0; --i) {
+        p[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < 8; ++i) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void samples_add(struct loadgen_samples *samples, uint64_t value) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->values = (uint64_t *) realloc(samples->values, samples->capacity * sizeof(uint64_t));
+    }
+    samples->values[samples->count++] = value;
+}
+
+static int samples_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank, on values already sorted. */
+static double samples_percentile_ms(const struct loadgen_samples *samples, double percentile) {
+    size_t rank;
+    if (samples->count == 0) {
+        return 0.0;
+    }
+    rank = (size_t)ceil(percentile / 100.0 * (double)samples->count);
+    rank = rank ? rank - 1 : 0;
+    return (double)samples->values[rank] / 1e6;
+}
+
+static void loadgen_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    // One loop, each read is consumed before the next is asked for.
+    (void)handle; (void)suggested_size;
+    *buf = uv_buf_init((char *)loadgen_read_buffer, sizeof(loadgen_read_buffer));
+}
+
+static void loadgen_write_cb(uv_write_t *req, int status) {
+    struct loadgen_write *write = (struct loadgen_write *) req;
+    (void)status;
+    free(write->data);
+    free(write);
+}
+
+/* Copies |size| bytes of |data|, zeroes when NULL, onto |stream|. */
+static int loadgen_write(uv_stream_t *stream, const uint8_t *data, size_t size, uv_write_cb cb) {
+    struct loadgen_write *write = (struct loadgen_write *) calloc(1, sizeof(*write));
+    uv_buf_t buf;
+    int error;
+
+    write->data = (uint8_t *) malloc(size ? size : 1);
+    memcpy(write->data, data ? data : loadgen_zeroes, size);
+    buf = uv_buf_init((char *)write->data, (unsigned int)size);
+    if ((error = uv_write(&write->req, stream, &buf, 1, cb ? cb : loadgen_write_cb)) != 0) {
+        free(write->data);
+        free(write);
+    }
+    return error;
+}
+
+/* ---- The sink, the destination every tunnel connects to. ---- */
+
+static void sink_close_cb(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void sink_respond(struct loadgen_sink_conn *conn);
+
+static void sink_response_write_cb(uv_write_t *req, int status) {
+    struct loadgen_sink_conn *conn = (struct loadgen_sink_conn *) req->handle->data;
+    loadgen_write_cb(req, status);
+    if (status == 0) {
+        sink_respond(conn);
+    }
+}
+
+/* One chunk in flight at a time, the bulk responses don't pile up in memory. */
+static void sink_respond(struct loadgen_sink_conn *conn) {
+    size_t size;
+    if (conn->response_left == 0) {
+        conn->responding = false;
+        return;
+    }
+    size = (size_t)((conn->response_left < LOADGEN_CHUNK_SIZE) ? conn->response_left : LOADGEN_CHUNK_SIZE);
+    conn->response_left -= size;
+    if (loadgen_write((uv_stream_t *)&conn->tcp, NULL, size, sink_response_write_cb) != 0) {
+        conn->responding = false;
+    }
+}
+
+static void sink_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct loadgen_sink_conn *conn = (struct loadgen_sink_conn *) stream->data;
+    const uint8_t *data = (const uint8_t *)buf->base;
+    size_t left = (nread > 0) ? (size_t)nread : 0;
+
+    if (nread < 0) {
+        uv_close((uv_handle_t *)stream, sink_close_cb);
+        return;
+    }
+    while (left > 0) {
+        size_t take;
+        if (conn->header_size < LOADGEN_HEADER_SIZE) {
+            take = LOADGEN_HEADER_SIZE - conn->header_size;
+            take = (take < left) ? take : left;
+            memcpy(conn->header + conn->header_size, data, take);
+            conn->header_size += take;
+            if (conn->header_size == LOADGEN_HEADER_SIZE) {
+                conn->request_left = get_be64(conn->header);
+                conn->response_left = get_be64(conn->header + 8);
+            }
+        } else {
+            take = (size_t)((conn->request_left < left) ? conn->request_left : left);
+            conn->request_left -= take;
+        }
+        data += take;
+        left -= take;
+        if (conn->header_size == LOADGEN_HEADER_SIZE && conn->request_left == 0) {
+            // The next request comes after the whole response, never during it.
+            conn->header_size = 0;
+            conn->responding = true;
+            sink_respond(conn);
+        }
+    }
+}
+
+static void sink_connection_cb(uv_stream_t *server, int status) {
+    struct loadgen_sink_conn *conn;
+    if (status != 0) {
+        return;
+    }
+    conn = (struct loadgen_sink_conn *) calloc(1, sizeof(*conn));
+    uv_tcp_init(server->loop, &conn->tcp);
+    conn->tcp.data = conn;
+    if (uv_accept(server, (uv_stream_t *)&conn->tcp) != 0) {
+        uv_close((uv_handle_t *)&conn->tcp, sink_close_cb);
+        return;
+    }
+    uv_tcp_nodelay(&conn->tcp, 1);
+    uv_read_start((uv_stream_t *)&conn->tcp, loadgen_alloc_cb, sink_read_cb);
+}
+
+/* ---- The tunnels, SOCKS5 through ssr-client. ---- */
+
+static void tunnel_start(struct loadgen *lg);
+static void loadgen_finish(struct loadgen *lg);
+static void loadgen_idle_check(struct loadgen *lg);
+
+static void tunnel_close_cb(uv_handle_t *handle) {
+    struct loadgen_tunnel *tunnel = (struct loadgen_tunnel *) handle->data;
+    struct loadgen *lg = tunnel->lg;
+    if (--tunnel->open_handles > 0) {
+        return;
+    }
+    free(tunnel);
+    lg->active--;
+    if (lg->finishing == false && lg->started < lg->target) {
+        tunnel_start(lg);
+    } else if (lg->active == 0) {
+        loadgen_finish(lg);
+    }
+}
+
+static void tunnel_done(struct loadgen_tunnel *tunnel, bool ok) {
+    struct loadgen *lg = tunnel->lg;
+    if (ok) {
+        lg->completed++;
+    } else {
+        lg->failed++;
+    }
+    lg->end = uv_hrtime();
+    if (lg->held) {
+        lg->held[tunnel->held_index] = NULL;
+    }
+    uv_close((uv_handle_t *)&tunnel->tcp, tunnel_close_cb);
+    if (tunnel->shape) {
+        uv_close((uv_handle_t *)&tunnel->delay, tunnel_close_cb);
+    }
+    loadgen_idle_check(lg);
+}
+
+static void tunnel_send_request(struct loadgen_tunnel *tunnel) {
+    struct loadgen *lg = tunnel->lg;
+    uint64_t request_size, response_size;
+    uint8_t *data;
+    size_t size;
+    struct loadgen_write *write;
+    uv_buf_t buf;
+
+    if (tunnel->shape) {
+        const struct loadgen_exchange *exchange = &tunnel->shape->exchanges[tunnel->exchange++];
+        request_size = exchange->request;
+        response_size = exchange->response;
+    } else if (tunnel->bulk) {
+        request_size = 0;
+        response_size = lg->opts->bulk_size;
+    } else {
+        request_size = loadgen_size_pick(lg, &lg->opts->request_size);
+        response_size = loadgen_size_pick(lg, &lg->opts->response_size);
+    }
+    // An empty response has no first byte to time, it gets one.
+    response_size = response_size ? response_size : 1;
+
+    size = LOADGEN_HEADER_SIZE + (size_t)request_size;
+    data = (uint8_t *) calloc(1, size);
+    put_be64(data, request_size);
+    put_be64(data + 8, response_size);
+
+    write = (struct loadgen_write *) calloc(1, sizeof(*write));
+    write->data = data;
+    buf = uv_buf_init((char *)data, (unsigned int)size);
+    tunnel->state = tunnel_state_response;
+    tunnel->response_left = response_size;
+    tunnel->first_byte_seen = false;
+    tunnel->request_sent_at = uv_hrtime();
+    lg->bytes += size;
+    if (uv_write(&write->req, (uv_stream_t *)&tunnel->tcp, &buf, 1, loadgen_write_cb) != 0) {
+        free(data);
+        free(write);
+        tunnel_done(tunnel, false);
+    }
+}
+
+static void tunnel_delay_cb(uv_timer_t *timer) {
+    tunnel_send_request((struct loadgen_tunnel *) timer->data);
+}
+
+/* The next request, after its recorded pause when played back. */
+static void tunnel_next_request(struct loadgen_tunnel *tunnel) {
+    uint64_t delay_ms = 0;
+    if (tunnel->shape) {
+        delay_ms = (tunnel->shape->exchanges[tunnel->exchange].delay_us + 500) / 1000;
+    }
+    if (delay_ms) {
+        uv_timer_start(&tunnel->delay, tunnel_delay_cb, delay_ms, 0);
+    } else {
+        tunnel_send_request(tunnel);
+    }
+}
+
+static void tunnel_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct loadgen_tunnel *tunnel = (struct loadgen_tunnel *) stream->data;
+    struct loadgen *lg = tunnel->lg;
+    const uint8_t *data = (const uint8_t *)buf->base;
+    size_t left = (nread > 0) ? (size_t)nread : 0;
+    static const uint8_t connect_head[] = { 0x05, 0x01, 0x00, 0x01 };
+
+    if (nread < 0) {
+        if (lg->opts->verbose) {
+            fprintf(stderr, "tunnel: %s\n", uv_strerror((int)nread));
+        }
+        tunnel_done(tunnel, false);
+        return;
+    }
+    while (left > 0) {
+        size_t want, take;
+        switch (tunnel->state) {
+        case tunnel_state_greeting:
+        case tunnel_state_reply:
+            want = (tunnel->state == tunnel_state_greeting) ? 2 : sizeof(tunnel->reply);
+            take = want - tunnel->reply_size;
+            take = (take < left) ? take : left;
+            memcpy(tunnel->reply + tunnel->reply_size, data, take);
+            tunnel->reply_size += take;
+            data += take;
+            left -= take;
+            if (tunnel->reply_size < want) {
+                break;
+            }
+            tunnel->reply_size = 0;
+            if (tunnel->state == tunnel_state_greeting) {
+                uint8_t request[10];
+                if (tunnel->reply[0] != 0x05 || tunnel->reply[1] != 0x00) {
+                    tunnel_done(tunnel, false);
+                    return;
+                }
+                memcpy(request, connect_head, sizeof(connect_head));
+                memcpy(request + 4, &lg->sink_addr.sin_addr, 4);
+                memcpy(request + 8, &lg->sink_addr.sin_port, 2);
+                tunnel->state = tunnel_state_reply;
+                if (loadgen_write(stream, request, sizeof(request), NULL) != 0) {
+                    tunnel_done(tunnel, false);
+                    return;
+                }
+            } else {
+                if (tunnel->reply[0] != 0x05 || tunnel->reply[1] != 0x00 || tunnel->reply[3] != 0x01) {
+                    tunnel_done(tunnel, false);
+                    return;
+                }
+                lg->connected++;
+                if (lg->opts->idle) {
+                    // Held as it is; the handshake slot goes to the next one.
+                    tunnel->state = tunnel_state_idle;
+                    lg->held[tunnel->held_index] = tunnel;
+                    if (lg->started < lg->target) {
+                        tunnel_start(lg);
+                    }
+                    loadgen_idle_check(lg);
+                    return;
+                }
+                tunnel_next_request(tunnel);
+            }
+            break;
+        case tunnel_state_response:
+            if (tunnel->first_byte_seen == false) {
+                tunnel->first_byte_seen = true;
+                samples_add(&lg->ttfb, uv_hrtime() - tunnel->request_sent_at);
+            }
+            take = (size_t)((tunnel->response_left < left) ? tunnel->response_left : left);
+            tunnel->response_left -= take;
+            lg->bytes += take;
+            data += take;
+            left -= take;
+            if (tunnel->response_left == 0) {
+                if (--tunnel->requests_left == 0) {
+                    tunnel_done(tunnel, true);
+                    return;
+                }
+                tunnel_next_request(tunnel);
+            }
+            break;
+        case tunnel_state_idle:
+            return;  // The sink sends nothing, whatever comes is dropped.
+        case tunnel_state_connecting:
+        default:
+            tunnel_done(tunnel, false);
+            return;
+        }
+    }
+}
+
+static void tunnel_connect_cb(uv_connect_t *req, int status) {
+    struct loadgen_tunnel *tunnel = (struct loadgen_tunnel *) req->data;
+    static const uint8_t greeting[] = { 0x05, 0x01, 0x00 };
+
+    if (status != 0) {
+        if (tunnel->lg->opts->verbose) {
+            fprintf(stderr, "connect: %s\n", uv_strerror(status));
+        }
+        tunnel_done(tunnel, false);
+        return;
+    }
+    uv_tcp_nodelay(&tunnel->tcp, 1);
+    tunnel->state = tunnel_state_greeting;
+    if (loadgen_write((uv_stream_t *)&tunnel->tcp, greeting, sizeof(greeting), NULL) != 0 ||
+        uv_read_start((uv_stream_t *)&tunnel->tcp, loadgen_alloc_cb, tunnel_read_cb) != 0) {
+        tunnel_done(tunnel, false);
+    }
+}
+
+static void tunnel_start(struct loadgen *lg) {
+    struct loadgen_tunnel *tunnel = (struct loadgen_tunnel *) calloc(1, sizeof(*tunnel));
+    const struct loadgen_options *opts = lg->opts;
+
+    tunnel->lg = lg;
+    tunnel->state = tunnel_state_connecting;
+    if (opts->shapes_count && opts->idle == 0) {
+        tunnel->shape = &opts->shapes[lg->started % opts->shapes_count];
+        tunnel->requests_left = (unsigned int)tunnel->shape->count;
+        uv_timer_init(lg->loop, &tunnel->delay);
+        tunnel->delay.data = tunnel;
+        tunnel->open_handles++;
+    } else {
+        tunnel->bulk = opts->bulk_percent && (loadgen_random(lg) % 100) < opts->bulk_percent;
+        tunnel->requests_left = tunnel->bulk ? 1 : opts->requests;
+    }
+    uv_tcp_init(lg->loop, &tunnel->tcp);
+    tunnel->tcp.data = tunnel;
+    tunnel->open_handles++;
+    tunnel->connect_req.data = tunnel;
+    tunnel->held_index = lg->started;
+    lg->started++;
+    lg->active++;
+    if (uv_tcp_connect(&tunnel->connect_req, &tunnel->tcp, (const struct sockaddr *)&lg->socks_addr, tunnel_connect_cb) != 0) {
+        tunnel_done(tunnel, false);
+    }
+}
+
+/* ---- Footprint, from /proc and the children's metrics. ---- */
+
+static double cpu_seconds(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+        (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+/* VmRSS in bytes, 0 where there is no /proc. */
+static uint64_t process_rss(int pid) {
+    char path[64], line[256];
+    uint64_t rss = 0;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((file = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            rss = strtoull(line + 6, NULL, 10) * 1024;
+            break;
+        }
+    }
+    fclose(file);
+    return rss;
+}
+
+static size_t footprint_index(struct loadgen_footprint *footprint, const char *name, size_t len) {
+    size_t index;
+    for (index = 0; index < footprint->count; ++index) {
+        if (strlen(footprint->names[index]) == len && memcmp(footprint->names[index], name, len) == 0) {
+            return index;
+        }
+    }
+    if (footprint->count == LOADGEN_SUBSYSTEMS_MAX || len >= sizeof(footprint->names[0])) {
+        return LOADGEN_SUBSYSTEMS_MAX;
+    }
+    memcpy(footprint->names[footprint->count], name, len);
+    footprint->names[footprint->count][len] = '\0';
+    return footprint->count++;
+}
+
+/* The ssr_alloc_bytes and ssr_allocations_total samples of a scrape. */
+static void footprint_parse(struct loadgen_footprint *footprint, char *text) {
+    static const char bytes_prefix[] = "ssr_alloc_bytes{subsystem=\"";
+    static const char allocations_prefix[] = "ssr_allocations_total{subsystem=\"";
+    char *line, *saveptr = NULL;
+
+    for (line = strtok_r(text, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        bool bytes = strncmp(line, bytes_prefix, sizeof(bytes_prefix) - 1) == 0;
+        const char *name, *end, *value;
+        size_t index;
+
+        if (bytes == false && strncmp(line, allocations_prefix, sizeof(allocations_prefix) - 1) != 0) {
+            continue;
+        }
+        name = line + (bytes ? sizeof(bytes_prefix) : sizeof(allocations_prefix)) - 1;
+        if ((end = strchr(name, '"')) == NULL || (value = strchr(end, ' ')) == NULL) {
+            continue;
+        }
+        if ((index = footprint_index(footprint, name, (size_t)(end - name))) == LOADGEN_SUBSYSTEMS_MAX) {
+            continue;
+        }
+        if (bytes) {
+            footprint->bytes[index] = strtoll(value + 1, NULL, 10);
+        } else {
+            footprint->allocations[index] = strtoull(value + 1, NULL, 10);
+        }
+    }
+}
+
+struct loadgen_scrape {
+    struct loadgen *lg;
+    struct loadgen_footprint *footprint;
+    uv_tcp_t tcp;
+    uv_connect_t connect_req;
+    uv_write_t write_req;
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+static void loadgen_scraped(struct loadgen *lg);
+
+static void scrape_close_cb(uv_handle_t *handle) {
+    struct loadgen_scrape *scrape = (struct loadgen_scrape *) handle->data;
+    struct loadgen *lg = scrape->lg;
+
+    if (scrape->data) {
+        scrape->data[scrape->len] = '\0';
+        footprint_parse(scrape->footprint, scrape->data);
+        free(scrape->data);
+    }
+    free(scrape);
+    if (--lg->scrapes_pending == 0) {
+        loadgen_scraped(lg);
+    }
+}
+
+static void scrape_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct loadgen_scrape *scrape = (struct loadgen_scrape *) handle->data;
+    (void)suggested_size;
+    // One byte stays free for the terminator.
+    if (scrape->capacity - scrape->len < LOADGEN_CHUNK_SIZE + 1) {
+        scrape->capacity += LOADGEN_CHUNK_SIZE + 1;
+        scrape->data = (char *) realloc(scrape->data, scrape->capacity);
+    }
+    *buf = uv_buf_init(scrape->data + scrape->len, (unsigned int)(scrape->capacity - scrape->len - 1));
+}
+
+static void scrape_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct loadgen_scrape *scrape = (struct loadgen_scrape *) stream->data;
+    (void)buf;
+    if (nread > 0) {
+        scrape->len += (size_t)nread;
+    } else if (nread < 0) {
+        // HTTP/1.0, the reply ends with the connection.
+        uv_close((uv_handle_t *)stream, scrape_close_cb);
+    }
+}
+
+static void scrape_connect_cb(uv_connect_t *req, int status) {
+    struct loadgen_scrape *scrape = (struct loadgen_scrape *) req->data;
+    static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    uv_buf_t buf = uv_buf_init((char *)request, sizeof(request) - 1);
+
+    if (status != 0 ||
+        uv_write(&scrape->write_req, (uv_stream_t *)&scrape->tcp, &buf, 1, NULL) != 0 ||
+        uv_read_start((uv_stream_t *)&scrape->tcp, scrape_alloc_cb, scrape_read_cb) != 0) {
+        fprintf(stderr, "metrics: %s\n", uv_strerror(status ? status : UV_EIO));
+        uv_close((uv_handle_t *)&scrape->tcp, scrape_close_cb);
+    }
+}
+
+/* Both children's RSS now and their heap as their metrics have it, |phase| 0 before the tunnels, 1 after. */
+static void loadgen_scrape(struct loadgen *lg, int phase) {
+    uv_process_t *procs[loadgen_side_max] = { &lg->server_proc, &lg->client_proc };
+    int side;
+
+    lg->scrape_phase = phase;
+    for (side = 0; side < loadgen_side_max; ++side) {
+        struct loadgen_scrape *scrape = (struct loadgen_scrape *) calloc(1, sizeof(*scrape));
+        scrape->lg = lg;
+        scrape->footprint = &lg->footprint[side][phase];
+        memset(scrape->footprint, 0, sizeof(*scrape->footprint));
+        scrape->footprint->rss = process_rss(procs[side]->pid);
+        uv_tcp_init(lg->loop, &scrape->tcp);
+        scrape->tcp.data = scrape;
+        scrape->connect_req.data = scrape;
+        lg->scrapes_pending++;
+        if (uv_tcp_connect(&scrape->connect_req, &scrape->tcp, (const struct sockaddr *)&lg->metrics_addr[side], scrape_connect_cb) != 0) {
+            uv_close((uv_handle_t *)&scrape->tcp, scrape_close_cb);
+        }
+    }
+}
+
+static void loadgen_settle_cb(uv_timer_t *timer) {
+    loadgen_scrape((struct loadgen *) timer->data, 1);
+}
+
+/* With -I, once every tunnel is held or failed, the children settle and are measured again. */
+static void loadgen_idle_check(struct loadgen *lg) {
+    if (lg->opts->idle == 0 || lg->finishing || lg->scrape_phase != 0 || lg->scrapes_pending ||
+        lg->connected + lg->failed < lg->target) {
+        return;
+    }
+    lg->scrape_phase = 1;
+    uv_timer_start(&lg->timer, loadgen_settle_cb, LOADGEN_SETTLE_MS, 0);
+}
+
+static void loadgen_start_tunnels(struct loadgen *lg) {
+    unsigned int i;
+    lg->begin = uv_hrtime();
+    for (i = 0; i < lg->opts->concurrency && lg->started < lg->target; ++i) {
+        tunnel_start(lg);
+    }
+}
+
+static void loadgen_scraped(struct loadgen *lg) {
+    size_t i;
+
+    if (lg->finishing) {
+        return;
+    }
+    if (lg->scrape_phase == 0) {
+        loadgen_start_tunnels(lg);
+        return;
+    }
+    for (i = 0; i < lg->target; ++i) {
+        if (lg->held[i]) {
+            lg->idle_held++;
+            tunnel_done(lg->held[i], true);
+        }
+    }
+    if (lg->active == 0) {
+        loadgen_finish(lg);
+    }
+}
+
+/* ---- Reports. ---- */
+
+static void combo_label(const struct loadgen *lg, char *label, size_t size) {
+    const struct loadgen_combo *combo;
+    if (lg->opts->combos_count == 0) {
+        snprintf(label, size, "%s", lg->opts->config_file);
+        return;
+    }
+    combo = &lg->opts->combos[lg->combo_index];
+    snprintf(label, size, "%s/%s%s", combo->protocol, combo->obfs, combo->tls ? "+tls" : "");
+}
+
+static void loadgen_report_load(struct loadgen *lg) {
+    const struct loadgen_options *opts = lg->opts;
+    double seconds = (lg->end > lg->begin) ? (double)(lg->end - lg->begin) / 1e9 : 0.0;
+    double gbps = seconds > 0.0 ? (double)lg->bytes * 8.0 / seconds / 1e9 : 0.0;
+    double children_cpu = cpu_seconds(RUSAGE_CHILDREN) - lg->children_cpu_begin;
+    double self_cpu = cpu_seconds(RUSAGE_SELF) - lg->self_cpu_begin;
+    char label[128];
+
+    combo_label(lg, label, sizeof(label));
+    qsort(lg->ttfb.values, lg->ttfb.count, sizeof(uint64_t), samples_compare);
+    printf("config           %s\n", label);
+    if (opts->shapes_count) {
+        printf("tunnels          %u ok, %u failed, %u concurrent, %zu shapes from %s\n",
+            lg->completed, lg->failed, opts->concurrency, opts->shapes_count, opts->shapes_file);
+    } else {
+        printf("tunnels          %u ok, %u failed, %u concurrent, %u requests each, %u%% bulk\n",
+            lg->completed, lg->failed, opts->concurrency, opts->requests, opts->bulk_percent);
+    }
+    printf("elapsed          %.3f s\n", seconds);
+    printf("connections/s    %.1f\n", seconds > 0.0 ? (double)lg->connected / seconds : 0.0);
+    printf("ttfb             p50 %.3f ms, p99 %.3f ms, p999 %.3f ms (%zu samples)\n",
+        samples_percentile_ms(&lg->ttfb, 50.0), samples_percentile_ms(&lg->ttfb, 99.0),
+        samples_percentile_ms(&lg->ttfb, 99.9), lg->ttfb.count);
+    printf("throughput       %.3f Gbps (%llu bytes)\n", gbps, (unsigned long long)lg->bytes);
+    printf("cpu              server+client %.2f s, loadgen %.2f s\n", children_cpu, self_cpu);
+    if (gbps > 0.0 && seconds > 0.0) {
+        printf("cpu per Gbps     server+client %.3f cores, loadgen %.3f cores\n",
+            children_cpu / seconds / gbps, self_cpu / seconds / gbps);
+    }
+}
+
+static void loadgen_report_idle(struct loadgen *lg) {
+    static const char *side_names[loadgen_side_max] = { "server", "client" };
+    double tunnels = lg->idle_held ? (double)lg->idle_held : 1.0;
+    char label[128];
+    int side;
+
+    combo_label(lg, label, sizeof(label));
+    printf("config           %s\n", label);
+    printf("idle tunnels     %u held, %u failed\n", lg->idle_held, lg->failed);
+    for (side = 0; side < loadgen_side_max; ++side) {
+        const struct loadgen_footprint *before = &lg->footprint[side][0];
+        const struct loadgen_footprint *after = &lg->footprint[side][1];
+        double rss = ((double)after->rss - (double)before->rss) / tunnels;
+        int64_t heap = 0;
+        uint64_t allocations = 0;
+        size_t i, j;
+
+        for (i = 0; i < after->count; ++i) {
+            heap += after->bytes[i];
+            allocations += after->allocations[i];
+        }
+        for (i = 0; i < before->count; ++i) {
+            heap -= before->bytes[i];
+            allocations -= before->allocations[i];
+        }
+        printf("%-16s rss %.0f B/tunnel, heap %.0f B/tunnel, %.1f allocations/tunnel\n",
+            side_names[side], rss, (double)heap / tunnels, (double)allocations / tunnels);
+        for (i = 0; i < after->count; ++i) {
+            int64_t bytes = after->bytes[i];
+            uint64_t count = after->allocations[i];
+            for (j = 0; j < before->count; ++j) {
+                if (strcmp(before->names[j], after->names[i]) == 0) {
+                    bytes -= before->bytes[j];
+                    count -= before->allocations[j];
+                }
+            }
+            printf("  %-14s %.0f B/tunnel, %.1f allocations/tunnel\n",
+                after->names[i], (double)bytes / tunnels, (double)count / tunnels);
+        }
+        if (lg->opts->rss_budget && lg->idle_held && rss > (double)lg->opts->rss_budget) {
+            fflush(stdout);
+            fprintf(stderr, "%s %s: %.0f B of RSS per tunnel, over the %llu B budget\n",
+                label, side_names[side], rss, (unsigned long long)lg->opts->rss_budget);
+            lg->over_budget = true;
+        }
+    }
+}
+
+/* ---- The children. ---- */
+
+static void loadgen_close(uv_handle_t *handle) {
+    if (uv_is_closing(handle) == 0) {
+        uv_close(handle, NULL);
+    }
+}
+
+static void loadgen_exit_timeout_cb(uv_timer_t *timer) {
+    struct loadgen *lg = (struct loadgen *) timer->data;
+    fprintf(stderr, "children did not exit after SIGTERM, killing them\n");
+    if (lg->server_proc.pid) {
+        uv_process_kill(&lg->server_proc, SIGKILL);
+    }
+    if (lg->client_proc.pid) {
+        uv_process_kill(&lg->client_proc, SIGKILL);
+    }
+}
+
+static int loadgen_session_start(struct loadgen *lg);
+
+/* Both children reaped: the report, then the next combination or the end. */
+static void loadgen_session_end(struct loadgen *lg) {
+    size_t combos = lg->opts->combos_count ? lg->opts->combos_count : 1;
+    int side;
+
+    uv_timer_stop(&lg->timer);
+    if (lg->exit_code == 0) {
+        if (lg->opts->idle) {
+            loadgen_report_idle(lg);
+        } else {
+            loadgen_report_load(lg);
+        }
+    }
+    lg->failed_total += lg->failed;
+    for (side = 0; side < loadgen_side_max; ++side) {
+        unlink(lg->config_path[side]);
+    }
+    free(lg->held);
+    lg->held = NULL;
+    if (lg->exit_code == 0 && ++lg->combo_index < combos) {
+        printf("\n");
+        if (loadgen_session_start(lg) == 0) {
+            return;
+        }
+    }
+    loadgen_close((uv_handle_t *)&lg->timer);
+    loadgen_close((uv_handle_t *)&lg->sink);
+}
+
+/* Once a run, when the tunnels are done or something went wrong. */
+static void loadgen_finish(struct loadgen *lg) {
+    if (lg->finishing) {
+        return;
+    }
+    lg->finishing = true;
+    uv_timer_stop(&lg->timer);
+    if (lg->children_running == 0) {
+        loadgen_session_end(lg);
+        return;
+    }
+    if (lg->server_proc.pid) {
+        uv_process_kill(&lg->server_proc, SIGTERM);
+    }
+    if (lg->client_proc.pid) {
+        uv_process_kill(&lg->client_proc, SIGTERM);
+    }
+    uv_timer_start(&lg->timer, loadgen_exit_timeout_cb, LOADGEN_EXIT_TIMEOUT, 0);
+}
+
+static void process_close_cb(uv_handle_t *handle) {
+    struct loadgen *lg = (struct loadgen *) handle->data;
+    if (--lg->children_running == 0) {
+        // Both reaped, RUSAGE_CHILDREN has them now.
+        loadgen_session_end(lg);
+    }
+}
+
+static void process_exit_cb(uv_process_t *process, int64_t exit_status, int term_signal) {
+    struct loadgen *lg = (struct loadgen *) process->data;
+    const char *name = (process == &lg->server_proc) ? "ssr-server" : "ssr-client";
+
+    process->pid = 0;
+    uv_close((uv_handle_t *)process, process_close_cb);
+    if (lg->finishing == false) {
+        // The tunnels under way fail with it, no new ones are started.
+        fprintf(stderr, "%s exited early, status %d, signal %d\n", name, (int)exit_status, term_signal);
+        lg->exit_code = -1;
+        loadgen_finish(lg);
+    }
+}
+
+static int loadgen_spawn(struct loadgen *lg, uv_process_t *process, const char *exe, const char *config_path) {
+    uv_process_options_t options;
+    uv_stdio_container_t stdio[3];
+    char *args[4];
+    int error;
+
+    args[0] = (char *)exe;
+    args[1] = (char *)"-c";
+    args[2] = (char *)config_path;
+    args[3] = NULL;
+
+    memset(stdio, 0, sizeof(stdio));
+    stdio[0].flags = UV_IGNORE;
+    stdio[1].flags = lg->opts->verbose ? UV_INHERIT_FD : UV_IGNORE;
+    stdio[1].data.fd = 1;
+    stdio[2].flags = lg->opts->verbose ? UV_INHERIT_FD : UV_IGNORE;
+    stdio[2].data.fd = 2;
+
+    memset(&options, 0, sizeof(options));
+    options.file = exe;
+    options.args = args;
+    options.exit_cb = process_exit_cb;
+    options.stdio = stdio;
+    options.stdio_count = 3;
+
+    memset(process, 0, sizeof(*process));
+    process->data = lg;
+    if ((error = uv_spawn(lg->loop, process, &options)) != 0) {
+        fprintf(stderr, "spawning %s: %s\n", exe, uv_strerror(error));
+        return error;
+    }
+    lg->children_running++;
+    return 0;
+}
+
+/* ---- Waiting for both children to listen. ---- */
+
+static void loadgen_probe_cb(uv_timer_t *timer);
+
+static void probe_close_cb(uv_handle_t *handle) {
+    struct loadgen *lg = (struct loadgen *) handle->loop->data;
+
+    free(handle);
+    if (--lg->probes_pending != 0 || lg->finishing) {
+        return;
+    }
+    if (lg->probes_ok == lg->probes_wanted) {
+        if (lg->opts->idle) {
+            loadgen_scrape(lg, 0);
+        } else {
+            loadgen_start_tunnels(lg);
+        }
+    } else if (uv_now(lg->loop) < lg->ready_deadline) {
+        uv_timer_start(&lg->timer, loadgen_probe_cb, LOADGEN_READY_INTERVAL, 0);
+    } else {
+        fprintf(stderr, "ssr-server or ssr-client not listening after %d ms\n", LOADGEN_READY_TIMEOUT);
+        lg->exit_code = -1;
+        loadgen_finish(lg);
+    }
+}
+
+static void probe_connect_cb(uv_connect_t *req, int status) {
+    struct loadgen *lg = (struct loadgen *) req->handle->loop->data;
+    if (status == 0) {
+        lg->probes_ok++;
+    }
+    uv_close((uv_handle_t *)req->handle, probe_close_cb);
+    free(req);
+}
+
+static void loadgen_probe_one(struct loadgen *lg, const struct sockaddr_in *addr) {
+    uv_tcp_t *tcp = (uv_tcp_t *) calloc(1, sizeof(*tcp));
+    uv_connect_t *req = (uv_connect_t *) calloc(1, sizeof(*req));
+
+    uv_tcp_init(lg->loop, tcp);
+    lg->probes_pending++;
+    if (uv_tcp_connect(req, tcp, (const struct sockaddr *)addr, probe_connect_cb) != 0) {
+        free(req);
+        uv_close((uv_handle_t *)tcp, probe_close_cb);
+    }
+}
+
+static void loadgen_probe_cb(uv_timer_t *timer) {
+    struct loadgen *lg = (struct loadgen *) timer->data;
+    int side;
+
+    lg->probes_ok = 0;
+    lg->probes_wanted = 2;
+    loadgen_probe_one(lg, &lg->socks_addr);
+    loadgen_probe_one(lg, &lg->server_addr);
+    if (lg->opts->idle) {
+        // Their metrics listeners too, the heap is read from them.
+        for (side = 0; side < loadgen_side_max; ++side) {
+            lg->probes_wanted++;
+            loadgen_probe_one(lg, &lg->metrics_addr[side]);
+        }
+    }
+}
+
+/* ---- Setup. ---- */
+
+/* A port nothing listens on now. The children bind it a moment later. */
+static int loadgen_free_port(struct sockaddr_in *addr) {
+    struct sockaddr_in bound;
+    socklen_t size = sizeof(bound);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int error = -1;
+
+    uv_ip4_addr(LOADGEN_LOCALHOST, 0, addr);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&bound, &size) == 0) {
+        addr->sin_port = bound.sin_port;
+        error = 0;
+    }
+    close(fd);
+    return error;
+}
+
+/* The config for |side|, the two differing only in their metrics_address. */
+static int loadgen_write_config(struct loadgen *lg, int side) {
+    json_object *root = json_object_from_file(lg->opts->config_file);
+    char *path = lg->config_path[side];
+    size_t i;
+    int fd;
+
+    if (root == NULL || json_object_is_type(root, json_type_object) == false) {
+        fprintf(stderr, "%s: not a JSON object\n", lg->opts->config_file);
+        if (root) {
+            json_object_put(root);
+        }
+        return -1;
+    }
+    for (i = 0; i < sizeof(loadgen_dropped_keys) / sizeof(loadgen_dropped_keys[0]); ++i) {
+        json_object_object_del(root, loadgen_dropped_keys[i]);
+    }
+    json_object_object_add(root, "server", json_object_new_string(LOADGEN_LOCALHOST));
+    json_object_object_add(root, "server_port", json_object_new_int(ntohs(lg->server_addr.sin_port)));
+    json_object_object_add(root, "local_address", json_object_new_string(LOADGEN_LOCALHOST));
+    json_object_object_add(root, "local_port", json_object_new_int(ntohs(lg->socks_addr.sin_port)));
+    if (lg->opts->combos_count) {
+        const struct loadgen_combo *combo = &lg->opts->combos[lg->combo_index];
+        json_object_object_add(root, "protocol", json_object_new_string(combo->protocol));
+        json_object_object_add(root, "obfs", json_object_new_string(combo->obfs));
+        json_object_object_add(root, "over_tls_enable", json_object_new_boolean(combo->tls));
+    }
+    if (lg->opts->idle) {
+        char address[32];
+        snprintf(address, sizeof(address), "%s:%d", LOADGEN_LOCALHOST, ntohs(lg->metrics_addr[side].sin_port));
+        json_object_object_add(root, "metrics_address", json_object_new_string(address));
+    }
+
+    snprintf(path, sizeof(lg->config_path[side]), "/tmp/ssr-loadgen-XXXXXX");
+    if ((fd = mkstemp(path)) < 0) {
+        perror("mkstemp");
+        json_object_put(root);
+        return -1;
+    }
+    close(fd);
+    if (json_object_to_file(path, root) != 0) {
+        fprintf(stderr, "writing %s failed\n", path);
+        unlink(path);
+        json_object_put(root);
+        return -1;
+    }
+    json_object_put(root);
+    return 0;
+}
+
+static int loadgen_start_sink(struct loadgen *lg) {
+    int size = sizeof(lg->sink_addr);
+    int error;
+
+    uv_ip4_addr(LOADGEN_LOCALHOST, 0, &lg->sink_addr);
+    uv_tcp_init(lg->loop, &lg->sink);
+    if ((error = uv_tcp_bind(&lg->sink, (const struct sockaddr *)&lg->sink_addr, 0)) != 0 ||
+        (error = uv_listen((uv_stream_t *)&lg->sink, SOMAXCONN, sink_connection_cb)) != 0 ||
+        (error = uv_tcp_getsockname(&lg->sink, (struct sockaddr *)&lg->sink_addr, &size)) != 0) {
+        fprintf(stderr, "sink: %s\n", uv_strerror(error));
+        return error;
+    }
+    return 0;
+}
+
+/* Fresh ports, configs and children for the combination at |combo_index|. */
+static int loadgen_session_start(struct loadgen *lg) {
+    const struct loadgen_options *opts = lg->opts;
+    int side;
+
+    lg->target = opts->idle ? opts->idle : opts->tunnels;
+    lg->started = lg->active = lg->connected = lg->completed = lg->failed = 0;
+    lg->bytes = lg->begin = lg->end = 0;
+    lg->ttfb.count = 0;
+    lg->scrape_phase = 0;
+    lg->idle_held = 0;
+    lg->finishing = false;
+    memset(lg->footprint, 0, sizeof(lg->footprint));
+    memset(lg->config_path, 0, sizeof(lg->config_path));
+    if (opts->idle) {
+        lg->held = (struct loadgen_tunnel **) calloc(lg->target, sizeof(lg->held[0]));
+    }
+
+    if (loadgen_free_port(&lg->server_addr) != 0 || loadgen_free_port(&lg->socks_addr) != 0 ||
+        (opts->idle && (loadgen_free_port(&lg->metrics_addr[loadgen_side_server]) != 0 ||
+                        loadgen_free_port(&lg->metrics_addr[loadgen_side_client]) != 0))) {
+        fprintf(stderr, "no free port on %s\n", LOADGEN_LOCALHOST);
+        lg->exit_code = -1;
+        return -1;
+    }
+    for (side = 0; side < loadgen_side_max; ++side) {
+        if (loadgen_write_config(lg, side) != 0) {
+            unlink(lg->config_path[loadgen_side_server]);
+            lg->exit_code = -1;
+            return -1;
+        }
+    }
+
+    // Earlier runs' children are reaped, their CPU is in already.
+    lg->children_cpu_begin = cpu_seconds(RUSAGE_CHILDREN);
+    lg->self_cpu_begin = cpu_seconds(RUSAGE_SELF);
+    if (loadgen_spawn(lg, &lg->server_proc, opts->server_exe, lg->config_path[loadgen_side_server]) != 0 ||
+        loadgen_spawn(lg, &lg->client_proc, opts->client_exe, lg->config_path[loadgen_side_client]) != 0) {
+        lg->exit_code = -1;
+        loadgen_finish(lg);
+        return 0;
+    }
+    lg->ready_deadline = uv_now(lg->loop) + LOADGEN_READY_TIMEOUT;
+    uv_timer_start(&lg->timer, loadgen_probe_cb, LOADGEN_READY_INTERVAL, 0);
+    return 0;
+}
+
+/* ---- Options. ---- */
+
+static void usage(const char *exe) {
+    printf("Usage:\n"
+        "  %s -c config.json [-n tunnels] [-t concurrency] [-r requests] [-q size] [-p size]\n"
+        "     [-B bulk-percent] [-b bulk-bytes] [-x protocol/obfs[+tls][,...]]\n"
+        "     [-S ssr-server] [-C ssr-client] [-v]\n"
+        "  %s -c config.json -R shapes.jsonl [-n tunnels] [-t concurrency]\n"
+        "  %s -c config.json -I tunnels [-L bytes] [-t concurrency] [-x protocol/obfs[+tls][,...]]\n"
+        "\n"
+        "  Defaults: %d tunnels, %d at a time, %d requests of 64 bytes answered\n"
+        "  with 1024 each, no bulk tunnels, %d bytes for one that is.\n"
+        "  A size is N, A-B for uniform between A and B, or ~N for exponential\n"
+        "  with mean N. -x runs each protocol/obfs pair in turn instead of the\n"
+        "  config's own. -I holds that many idle tunnels and reports the memory\n"
+        "  they take on each side, -L fails past that much RSS per tunnel.\n"
+        "  -R plays back the tunnels ssr-server's shape_file recorded, one each\n"
+        "  unless -n asks for more or fewer.\n"
+        "  ssr-server and ssr-client are looked for next to this binary unless\n"
+        "  -S and -C name them. -v shows their output.\n",
+        exe, exe, exe, LOADGEN_DEFAULT_TUNNELS, LOADGEN_DEFAULT_CONCURRENCY, LOADGEN_DEFAULT_REQUESTS,
+        LOADGEN_DEFAULT_BULK_SIZE);
+}
+
+static bool parse_size(struct loadgen_size *size, const char *text) {
+    char *end = NULL;
+    memset(size, 0, sizeof(*size));
+    if (text[0] == '~') {
+        size->kind = loadgen_size_exponential;
+        size->a = strtoull(text + 1, &end, 10);
+        return end != text + 1 && *end == '\0';
+    }
+    size->a = strtoull(text, &end, 10);
+    if (end == text) {
+        return false;
+    }
+    if (*end == '-') {
+        const char *high = end + 1;
+        size->kind = loadgen_size_uniform;
+        size->b = strtoull(high, &end, 10);
+        return end != high && *end == '\0' && size->b >= size->a;
+    }
+    size->kind = loadgen_size_fixed;
+    return *end == '\0';
+}
+
+/* "protocol/obfs[+tls]", comma separated. */
+static bool parse_combos(struct loadgen_options *opts, const char *text) {
+    char list[1024], *item, *saveptr = NULL;
+
+    snprintf(list, sizeof(list), "%s", text);
+    opts->combos_count = 0;
+    for (item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        struct loadgen_combo *combo = &opts->combos[opts->combos_count];
+        char *slash = strchr(item, '/');
+        char *plus;
+        if (opts->combos_count == LOADGEN_COMBOS_MAX || slash == NULL) {
+            return false;
+        }
+        *slash = '\0';
+        if ((plus = strchr(slash + 1, '+')) != NULL) {
+            if (strcmp(plus, "+tls") != 0) {
+                return false;
+            }
+            *plus = '\0';
+            combo->tls = true;
+        }
+        if (item[0] == '\0' || slash[1] == '\0' ||
+            strlen(item) >= sizeof(combo->protocol) || strlen(slash + 1) >= sizeof(combo->obfs)) {
+            return false;
+        }
+        strcpy(combo->protocol, item);
+        strcpy(combo->obfs, slash + 1);
+        opts->combos_count++;
+    }
+    return opts->combos_count > 0;
+}
+
+/* One line of a shape_file into exchanges, false for one without reads. */
+static bool parse_shape(struct loadgen_shape *shape, json_object *line) {
+    json_object *reads;
+    size_t index, count;
+    uint64_t last_usec = 0;
+    bool answered = true;  /* The current exchange has its response, a client read starts the next. */
+
+    memset(shape, 0, sizeof(*shape));
+    if (json_object_object_get_ex(line, "reads", &reads) == false || json_object_is_type(reads, json_type_array) == false) {
+        return false;
+    }
+    count = json_object_array_length(reads);
+    shape->exchanges = (struct loadgen_exchange *) calloc(count ? count : 1, sizeof(shape->exchanges[0]));
+    for (index = 0; index < count; ++index) {
+        json_object *read = json_object_array_get_idx(reads, index);
+        struct loadgen_exchange *exchange;
+        int dir;
+        uint64_t usec, bytes;
+        if (json_object_is_type(read, json_type_array) == false || json_object_array_length(read) != 3) {
+            continue;
+        }
+        dir = json_object_get_int(json_object_array_get_idx(read, 0));
+        usec = (uint64_t)json_object_get_int64(json_object_array_get_idx(read, 1));
+        bytes = (uint64_t)json_object_get_int64(json_object_array_get_idx(read, 2));
+        if (shape->count == 0 || (dir == 0 && answered)) {
+            if (shape->count == LOADGEN_EXCHANGES_MAX) {
+                break;
+            }
+            exchange = &shape->exchanges[shape->count];
+            exchange->delay_us = (shape->count && usec > last_usec) ? usec - last_usec : 0;
+            shape->count++;
+            answered = false;
+        }
+        exchange = &shape->exchanges[shape->count - 1];
+        if (dir == 0) {
+            exchange->request += bytes;
+        } else {
+            exchange->response += bytes;
+            answered = true;
+        }
+        last_usec = usec;
+    }
+    if (shape->count == 0) {
+        free(shape->exchanges);
+        shape->exchanges = NULL;
+    }
+    return shape->count > 0;
+}
+
+static bool load_shapes(struct loadgen_options *opts) {
+    FILE *file = fopen(opts->shapes_file, "r");
+    char *text = NULL;
+    size_t text_size = 0;
+    size_t capacity = 0;
+
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", opts->shapes_file, strerror(errno));
+        return false;
+    }
+    while (getline(&text, &text_size, file) > 0) {
+        json_object *line = json_tokener_parse(text);
+        if (line == NULL) {
+            continue;
+        }
+        if (opts->shapes_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            opts->shapes = (struct loadgen_shape *) realloc(opts->shapes, capacity * sizeof(opts->shapes[0]));
+        }
+        if (parse_shape(&opts->shapes[opts->shapes_count], line)) {
+            opts->shapes_count++;
+        }
+        json_object_put(line);
+    }
+    free(text);
+    fclose(file);
+    if (opts->shapes_count == 0) {
+        fprintf(stderr, "%s: no tunnels with reads\n", opts->shapes_file);
+        return false;
+    }
+    return true;
+}
+
+static void default_exe(char *path, size_t path_size, const char *name) {
+    char exe[PATH_MAX];
+    size_t size = sizeof(exe);
+    char *slash;
+
+    if (uv_exepath(exe, &size) == 0 && (slash = strrchr(exe, '/')) != NULL) {
+        *slash = '\0';
+        snprintf(path, path_size, "%s/%s", exe, name);
+    } else {
+        snprintf(path, path_size, "%s", name);
+    }
+}
+
+int main(int argc, char * const argv[]) {
+    struct loadgen_options opts;
+    struct loadgen lg;
+    bool tunnels_given = false;
+    size_t index;
+    int opt;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.tunnels = LOADGEN_DEFAULT_TUNNELS;
+    opts.concurrency = LOADGEN_DEFAULT_CONCURRENCY;
+    opts.requests = LOADGEN_DEFAULT_REQUESTS;
+    opts.bulk_size = LOADGEN_DEFAULT_BULK_SIZE;
+    parse_size(&opts.request_size, "64");
+    parse_size(&opts.response_size, "1024");
+    default_exe(opts.server_exe, sizeof(opts.server_exe), "ssr-server");
+    default_exe(opts.client_exe, sizeof(opts.client_exe), "ssr-client");
+
+    while (-1 != (opt = getopt(argc, argv, "c:n:t:r:q:p:B:b:I:L:x:R:S:C:vh"))) {
+        switch (opt) {
+        case 'c':
+            opts.config_file = optarg;
+            break;
+        case 'n':
+            opts.tunnels = (unsigned int)strtoul(optarg, NULL, 10);
+            tunnels_given = true;
+            break;
+        case 't':
+            opts.concurrency = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            opts.requests = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            if (parse_size(&opts.request_size, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'p':
+            if (parse_size(&opts.response_size, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'B':
+            opts.bulk_percent = (unsigned int)strtoul(optarg, NULL, 10);
+            opts.bulk_percent = (opts.bulk_percent > 100) ? 100 : opts.bulk_percent;
+            break;
+        case 'b':
+            opts.bulk_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'I':
+            opts.idle = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            opts.rss_budget = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            if (parse_combos(&opts, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'R':
+            opts.shapes_file = optarg;
+            break;
+        case 'S':
+            snprintf(opts.server_exe, sizeof(opts.server_exe), "%s", optarg);
+            break;
+        case 'C':
+            snprintf(opts.client_exe, sizeof(opts.client_exe), "%s", optarg);
+            break;
+        case 'v':
+            opts.verbose = true;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if (opts.config_file == NULL) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (opts.shapes_file) {
+        if (load_shapes(&opts) == false) {
+            return -1;
+        }
+        if (tunnels_given == false) {
+            opts.tunnels = (unsigned int)opts.shapes_count;
+        }
+    }
+    opts.tunnels = opts.tunnels ? opts.tunnels : 1;
+    opts.concurrency = opts.concurrency ? opts.concurrency : 1;
+    opts.requests = opts.requests ? opts.requests : 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&lg, 0, sizeof(lg));
+    lg.opts = &opts;
+    lg.loop = uv_default_loop();
+    lg.loop->data = &lg;
+    lg.seed = uv_hrtime() | 1;
+
+    if (loadgen_start_sink(&lg) != 0) {
+        return -1;
+    }
+    uv_timer_init(lg.loop, &lg.timer);
+    lg.timer.data = &lg;
+    if (loadgen_session_start(&lg) != 0) {
+        loadgen_close((uv_handle_t *)&lg.timer);
+        loadgen_close((uv_handle_t *)&lg.sink);
+    }
+
+    uv_run(lg.loop, UV_RUN_DEFAULT);
+    free(lg.ttfb.values);
+    for (index = 0; index < opts.shapes_count; ++index) {
+        free(opts.shapes[index].exchanges);
+    }
+    free(opts.shapes);
+    return (lg.exit_code == 0 && lg.failed_total == 0 && lg.over_budget == false) ? 0 : -1;
+}
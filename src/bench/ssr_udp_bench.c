@@ -0,0 +1,552 @@
+/*
+ * ssr-udp-bench: SOCKS5 UDP datagrams through the client's udprelay.c, on
+ * one loop with everything else on loopback. Each association is a socket
+ * of its own sending SOCKS5 UDP requests for an echo to the relay's
+ * listener; the relay encrypts them to the server side and opens its
+ * socket for the association; the reply comes back the same way.
+ *
+ * The MODULE_REMOTE half of udprelay.c is ssr-server's, so the server
+ * side is a stand-in here: it decrypts with ss_decrypt_all(),
+ * forwards the payload to the echo from a socket per association and
+ * encrypts the echo's answer back, what the remote relay does per packet.
+ * Only the origin protocol, the server side of the others' UDP is a no-op.
+ *
+ * Every association keeps -w datagrams in flight; one not answered within
+ * BENCH_UDP_LOSS_MS counts as lost. For each association count x payload
+ * size it reports packets per second, the round trip against the same
+ * traffic sent to the echo directly, and the allocations per packet on the
+ * client relay's side, the stand-in's own subtracted (Linux, see
+ * CMakeLists.txt).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <uv.h>
+
+#include "common.h"
+#include "encrypt.h"
+#include "ssrbuffer.h"
+#include "sockaddr_universal.h"
+#include "udprelay.h"
+
+#define BENCH_UDP_SIZES_MAX         16
+#define BENCH_UDP_ASSOCS_MAX        512
+#define BENCH_UDP_DEFAULT_PACKETS   20000
+#define BENCH_UDP_DEFAULT_WINDOW    4
+#define BENCH_UDP_DEFAULT_METHOD    "aes-256-cfb"
+#define BENCH_UDP_DEFAULT_PASSWORD  "ssr-udp-bench"
+#define BENCH_UDP_TIMEOUT           60000  /* ms, the relay's idle timeout, past any run. */
+#define BENCH_UDP_LOSS_MS           200
+#define BENCH_UDP_CHECK_MS          20
+#define BENCH_UDP_SOCKS_HEAD        10     /* RSV, FRAG, ATYP 1, IPv4, port. */
+#define BENCH_UDP_ADDR_HEAD         7      /* ATYP 1, IPv4, port. */
+#define BENCH_UDP_STANDIN_SLOTS     2048   /* Open addressing on the relay's source port. */
+#define BENCH_UDP_BUFFER_SIZE       (64 * 1024)
+#define BENCH_UDP_SIZE_MAX          65000  /* Payload, under the largest datagram with the headers. */
+#define BENCH_UDP_LOCALHOST         "127.0.0.1"
+
+#if defined(SSR_BENCH_WRAP_MALLOC)
+/* Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, see CMakeLists.txt. */
+static size_t bench_alloc_count = 0;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t nmemb, size_t size);
+void * __real_realloc(void *ptr, size_t size);
+
+void * __wrap_malloc(size_t size) {
+    bench_alloc_count++;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t nmemb, size_t size) {
+    bench_alloc_count++;
+    return __real_calloc(nmemb, size);
+}
+
+void * __wrap_realloc(void *ptr, size_t size) {
+    bench_alloc_count++;
+    return __real_realloc(ptr, size);
+}
+#define BENCH_ALLOC_COUNT() (bench_alloc_count)
+#else
+#define BENCH_ALLOC_COUNT() ((size_t)0)
+#endif // defined(SSR_BENCH_WRAP_MALLOC)
+
+struct bench_options {
+    size_t sizes[BENCH_UDP_SIZES_MAX];
+    size_t sizes_count;
+    size_t assocs[BENCH_UDP_SIZES_MAX];
+    size_t assocs_count;
+    unsigned int packets;
+    unsigned int window;
+    const char *method;
+    const char *password;
+};
+
+struct bench_assoc {
+    struct udp_bench *bench;
+    uv_udp_t udp;
+    unsigned int in_flight;
+    unsigned int sent;
+    unsigned int quota;
+    uint64_t last_activity;
+};
+
+/* The server side of one of the relay's associations. */
+struct standin_assoc {
+    struct udp_bench *bench;
+    struct sockaddr_in client;
+    uv_udp_t out;
+};
+
+/* One association count x payload size, relayed or direct. */
+struct bench_run {
+    size_t assocs_count;
+    size_t size;
+    bool direct;
+    struct bench_assoc *assocs[BENCH_UDP_ASSOCS_MAX];
+    unsigned int target;
+    unsigned int received;
+    unsigned int lost;
+    uint64_t *rtts;
+    uint64_t begin;
+    size_t allocs_begin;
+    size_t standin_allocs;
+    bool done;
+};
+
+struct udp_bench {
+    uv_loop_t *loop;
+    struct bench_options *opts;
+    struct cipher_env_t *cipher;
+    struct udp_listener_ctx_t *relay;
+    struct sockaddr_in relay_addr;
+    uv_udp_t standin;
+    struct sockaddr_in standin_addr;
+    struct standin_assoc *standin_assocs[BENCH_UDP_STANDIN_SLOTS];
+    struct buffer_t *standin_buf;
+    uv_udp_t echo;
+    struct sockaddr_in echo_addr;
+    uv_timer_t check;
+    struct bench_run run;
+    size_t next_assocs;
+    size_t next_size;
+    double direct_rtt_us;  /* Of the current size, for the relayed runs after it. */
+    uint8_t packet[BENCH_UDP_BUFFER_SIZE];
+};
+
+static uint8_t bench_recv_buffer[BENCH_UDP_BUFFER_SIZE];
+
+static void bench_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    // One loop, each datagram is consumed before the next is asked for.
+    (void)handle; (void)suggested_size;
+    *buf = uv_buf_init((char *)bench_recv_buffer, sizeof(bench_recv_buffer));
+}
+
+static void bench_close_free_cb(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static int bench_udp_open(uv_loop_t *loop, uv_udp_t *udp, struct sockaddr_in *addr) {
+    int size = sizeof(*addr);
+    int error;
+
+    uv_ip4_addr(BENCH_UDP_LOCALHOST, 0, addr);
+    uv_udp_init(loop, udp);
+    if ((error = uv_udp_bind(udp, (const struct sockaddr *)addr, 0)) == 0) {
+        error = uv_udp_getsockname(udp, (struct sockaddr *)addr, &size);
+    }
+    return error;
+}
+
+static int bench_udp_send(uv_udp_t *udp, const uint8_t *data, size_t len, const struct sockaddr *addr) {
+    uv_buf_t buf = uv_buf_init((char *)data, (unsigned int)len);
+    int sent = uv_udp_try_send(udp, &buf, 1, addr);
+    return (sent == (int)len) ? 0 : -1;
+}
+
+static int uint64_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* ---- The echo. ---- */
+
+static void echo_recv_cb(uv_udp_t *udp, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+    (void)flags;
+    if (nread > 0 && addr) {
+        bench_udp_send(udp, (const uint8_t *)buf->base, (size_t)nread, addr);
+    }
+}
+
+/* ---- The stand-in for the server's relay. ---- */
+
+static struct standin_assoc ** standin_slot(struct udp_bench *bench, const struct sockaddr_in *client) {
+    size_t index = ntohs(client->sin_port) % BENCH_UDP_STANDIN_SLOTS;
+    size_t probe;
+    for (probe = 0; probe < BENCH_UDP_STANDIN_SLOTS; ++probe) {
+        struct standin_assoc **slot = &bench->standin_assocs[(index + probe) % BENCH_UDP_STANDIN_SLOTS];
+        if (*slot == NULL || memcmp(&(*slot)->client, client, sizeof(*client)) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static void standin_reply_cb(uv_udp_t *udp, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+    struct standin_assoc *assoc = (struct standin_assoc *) udp->data;
+    struct udp_bench *bench = assoc->bench;
+    struct buffer_t *out = bench->standin_buf;
+    size_t allocs = BENCH_ALLOC_COUNT();
+    (void)addr; (void)flags;
+
+    if (nread <= 0) {
+        return;
+    }
+    out->buffer[0] = 1;
+    memcpy(out->buffer + 1, &bench->echo_addr.sin_addr, 4);
+    memcpy(out->buffer + 5, &bench->echo_addr.sin_port, 2);
+    memcpy(out->buffer + BENCH_UDP_ADDR_HEAD, buf->base, (size_t)nread);
+    out->len = BENCH_UDP_ADDR_HEAD + (size_t)nread;
+    if (ss_encrypt_all(bench->cipher, out, out->capacity) == 0) {
+        bench_udp_send(&bench->standin, out->buffer, out->len, (const struct sockaddr *)&assoc->client);
+    }
+    bench->run.standin_allocs += BENCH_ALLOC_COUNT() - allocs;
+}
+
+static void standin_recv_cb(uv_udp_t *udp, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+    struct udp_bench *bench = (struct udp_bench *) udp->data;
+    struct buffer_t *in = bench->standin_buf;
+    struct standin_assoc **slot;
+    struct sockaddr_in client;
+    size_t allocs = BENCH_ALLOC_COUNT();
+    (void)flags;
+
+    if (nread <= 0 || addr == NULL || addr->sa_family != AF_INET) {
+        return;
+    }
+    memcpy(&client, addr, sizeof(client));
+    buffer_store(in, (const uint8_t *)buf->base, (size_t)nread);
+    if (ss_decrypt_all(bench->cipher, in, in->capacity) != 0 ||
+        in->len <= BENCH_UDP_ADDR_HEAD || in->buffer[0] != 1) {
+        goto done;
+    }
+    if ((slot = standin_slot(bench, &client)) == NULL) {
+        goto done;
+    }
+    if (*slot == NULL) {
+        struct standin_assoc *assoc = (struct standin_assoc *) calloc(1, sizeof(*assoc));
+        struct sockaddr_in bound;
+        assoc->bench = bench;
+        assoc->client = client;
+        assoc->out.data = assoc;
+        bench_udp_open(bench->loop, &assoc->out, &bound);
+        uv_udp_recv_start(&assoc->out, bench_alloc_cb, standin_reply_cb);
+        *slot = assoc;
+    }
+    bench_udp_send(&(*slot)->out, in->buffer + BENCH_UDP_ADDR_HEAD, in->len - BENCH_UDP_ADDR_HEAD,
+        (const struct sockaddr *)&bench->echo_addr);
+done:
+    bench->run.standin_allocs += BENCH_ALLOC_COUNT() - allocs;
+}
+
+static void standin_reset(struct udp_bench *bench) {
+    size_t i;
+    for (i = 0; i < BENCH_UDP_STANDIN_SLOTS; ++i) {
+        if (bench->standin_assocs[i]) {
+            uv_close((uv_handle_t *)&bench->standin_assocs[i]->out, bench_close_free_cb);
+            bench->standin_assocs[i] = NULL;
+        }
+    }
+}
+
+/* ---- The associations. ---- */
+
+static void bench_run_next(struct udp_bench *bench);
+
+static void assoc_fill(struct bench_assoc *assoc) {
+    struct udp_bench *bench = assoc->bench;
+    struct bench_run *run = &bench->run;
+    const struct sockaddr *to = (const struct sockaddr *)(run->direct ? &bench->echo_addr : &bench->relay_addr);
+    size_t head = run->direct ? 0 : BENCH_UDP_SOCKS_HEAD;
+
+    while (assoc->in_flight < bench->opts->window && assoc->sent < assoc->quota) {
+        uint64_t now = uv_hrtime();
+        memcpy(bench->packet + head, &now, sizeof(now));
+        assoc->sent++;
+        if (bench_udp_send(&assoc->udp, bench->packet, head + run->size, to) != 0) {
+            run->lost++;
+            continue;
+        }
+        assoc->in_flight++;
+    }
+}
+
+static void bench_run_check_done(struct udp_bench *bench) {
+    struct bench_run *run = &bench->run;
+    double seconds, rtt_us, p99_us, allocs;
+    size_t i;
+
+    if (run->done || run->received + run->lost < run->target) {
+        return;
+    }
+    run->done = true;
+    seconds = (double)(uv_hrtime() - run->begin) / 1e9;
+    qsort(run->rtts, run->received, sizeof(uint64_t), uint64_compare);
+    rtt_us = 0.0;
+    for (i = 0; i < run->received; ++i) {
+        rtt_us += (double)run->rtts[i] / 1e3;
+    }
+    rtt_us = run->received ? rtt_us / (double)run->received : 0.0;
+    p99_us = run->received ? (double)run->rtts[(run->received - 1) * 99 / 100] / 1e3 : 0.0;
+
+    if (run->direct) {
+        bench->direct_rtt_us = rtt_us;
+    } else {
+        allocs = (double)(BENCH_ALLOC_COUNT() - run->allocs_begin - run->standin_allocs);
+        printf("%6zu %7zu %12.0f %10.1f %10.1f %10.1f %8u %10.2f\n",
+            run->assocs_count, run->size, seconds > 0.0 ? (double)run->received / seconds : 0.0,
+            rtt_us, p99_us, rtt_us - bench->direct_rtt_us, run->lost,
+            run->received ? allocs / (double)run->received : 0.0);
+    }
+
+    for (i = 0; i < run->assocs_count; ++i) {
+        uv_close((uv_handle_t *)&run->assocs[i]->udp, bench_close_free_cb);
+        run->assocs[i] = NULL;
+    }
+    free(run->rtts);
+    run->rtts = NULL;
+    standin_reset(bench);
+    bench_run_next(bench);
+}
+
+static void assoc_recv_cb(uv_udp_t *udp, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+    struct bench_assoc *assoc = (struct bench_assoc *) udp->data;
+    struct udp_bench *bench = assoc->bench;
+    struct bench_run *run = &bench->run;
+    size_t head = run->direct ? 0 : BENCH_UDP_SOCKS_HEAD;
+    uint64_t sent_at;
+    (void)addr; (void)flags;
+
+    if (nread < (ssize_t)(head + sizeof(sent_at)) || run->done) {
+        return;
+    }
+    if (assoc->in_flight == 0) {
+        return;  // Already counted as lost.
+    }
+    memcpy(&sent_at, buf->base + head, sizeof(sent_at));
+    assoc->in_flight--;
+    assoc->last_activity = uv_now(bench->loop);
+    run->rtts[run->received++] = uv_hrtime() - sent_at;
+    assoc_fill(assoc);
+    bench_run_check_done(bench);
+}
+
+static void bench_check_cb(uv_timer_t *timer) {
+    struct udp_bench *bench = (struct udp_bench *) timer->data;
+    struct bench_run *run = &bench->run;
+    uint64_t now = uv_now(bench->loop);
+    size_t i;
+
+    if (run->done) {
+        return;
+    }
+    for (i = 0; i < run->assocs_count; ++i) {
+        struct bench_assoc *assoc = run->assocs[i];
+        if (assoc->in_flight && now - assoc->last_activity > BENCH_UDP_LOSS_MS) {
+            run->lost += assoc->in_flight;
+            assoc->in_flight = 0;
+            assoc->last_activity = now;
+            assoc_fill(assoc);
+        }
+    }
+    bench_run_check_done(bench);
+}
+
+static void bench_run_start(struct udp_bench *bench, size_t assocs_count, size_t size, bool direct) {
+    struct bench_run *run = &bench->run;
+    unsigned int quota = (bench->opts->packets + (unsigned int)assocs_count - 1) / (unsigned int)assocs_count;
+    size_t i;
+
+    memset(run, 0, sizeof(*run));
+    run->assocs_count = assocs_count;
+    run->size = size;
+    run->direct = direct;
+    run->target = quota * (unsigned int)assocs_count;
+    run->rtts = (uint64_t *) calloc(run->target, sizeof(uint64_t));
+    for (i = 0; i < assocs_count; ++i) {
+        struct bench_assoc *assoc = (struct bench_assoc *) calloc(1, sizeof(*assoc));
+        struct sockaddr_in bound;
+        assoc->bench = bench;
+        assoc->quota = quota;
+        assoc->udp.data = assoc;
+        bench_udp_open(bench->loop, &assoc->udp, &bound);
+        uv_udp_recv_start(&assoc->udp, bench_alloc_cb, assoc_recv_cb);
+        run->assocs[i] = assoc;
+    }
+    run->allocs_begin = BENCH_ALLOC_COUNT();
+    run->begin = uv_hrtime();
+    for (i = 0; i < assocs_count; ++i) {
+        run->assocs[i]->last_activity = uv_now(bench->loop);
+        assoc_fill(run->assocs[i]);
+    }
+}
+
+/* Sizes outer, association counts inner; each size is sent direct first. */
+static void bench_run_next(struct udp_bench *bench) {
+    const struct bench_options *opts = bench->opts;
+
+    if (bench->next_size == opts->sizes_count) {
+        uv_timer_stop(&bench->check);
+        uv_close((uv_handle_t *)&bench->check, NULL);
+        uv_close((uv_handle_t *)&bench->echo, NULL);
+        uv_close((uv_handle_t *)&bench->standin, NULL);
+        udprelay_shutdown(bench->relay);
+        return;
+    }
+    if (bench->next_assocs == 0 && bench->run.direct == false) {
+        bench_run_start(bench, 1, opts->sizes[bench->next_size], true);
+        return;
+    }
+    bench_run_start(bench, opts->assocs[bench->next_assocs], opts->sizes[bench->next_size], false);
+    if (++bench->next_assocs == opts->assocs_count) {
+        bench->next_assocs = 0;
+        bench->next_size++;
+    }
+}
+
+/* ---- Setup. ---- */
+
+static void usage(const char *exe) {
+    printf("Usage:\n"
+        "  %s [-s size[,size...]] [-a associations[,associations...]] [-n packets] [-w window]\n"
+        "     [-m method] [-k password]\n"
+        "\n"
+        "  Default sizes are 64,512,1400, associations 1,16,128, %d packets a run,\n"
+        "  %d in flight per association, method %s. At most %d associations.\n",
+        exe, BENCH_UDP_DEFAULT_PACKETS, BENCH_UDP_DEFAULT_WINDOW, BENCH_UDP_DEFAULT_METHOD, BENCH_UDP_ASSOCS_MAX);
+}
+
+static bool parse_list(size_t *list, size_t *count, size_t count_max, size_t value_max, const char *text) {
+    char *end = NULL;
+    *count = 0;
+    while (*text && *count < count_max) {
+        unsigned long value = strtoul(text, &end, 10);
+        if (end == text || value == 0 || value > value_max) {
+            return false;
+        }
+        list[(*count)++] = (size_t)value;
+        text = (*end == ',') ? end + 1 : end;
+    }
+    return *count > 0;
+}
+
+/* A port nothing holds now, for the relay's listener. */
+static int bench_free_port(uv_loop_t *loop, struct sockaddr_in *addr) {
+    uv_udp_t udp;
+    int error = bench_udp_open(loop, &udp, addr);
+    uv_close((uv_handle_t *)&udp, NULL);
+    uv_run(loop, UV_RUN_NOWAIT);
+    return error;
+}
+
+int main(int argc, char * const argv[]) {
+    struct bench_options opts;
+    struct udp_bench *bench;
+    union sockaddr_universal standin_addr = { 0 };
+    size_t i;
+    int opt;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.packets = BENCH_UDP_DEFAULT_PACKETS;
+    opts.window = BENCH_UDP_DEFAULT_WINDOW;
+    opts.method = BENCH_UDP_DEFAULT_METHOD;
+    opts.password = BENCH_UDP_DEFAULT_PASSWORD;
+    parse_list(opts.sizes, &opts.sizes_count, BENCH_UDP_SIZES_MAX, BENCH_UDP_SIZE_MAX, "64,512,1400");
+    parse_list(opts.assocs, &opts.assocs_count, BENCH_UDP_SIZES_MAX, BENCH_UDP_ASSOCS_MAX, "1,16,128");
+
+    while (-1 != (opt = getopt(argc, argv, "s:a:n:w:m:k:h"))) {
+        switch (opt) {
+        case 's':
+            if (parse_list(opts.sizes, &opts.sizes_count, BENCH_UDP_SIZES_MAX, BENCH_UDP_SIZE_MAX, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'a':
+            if (parse_list(opts.assocs, &opts.assocs_count, BENCH_UDP_SIZES_MAX, BENCH_UDP_ASSOCS_MAX, optarg) == false) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'n':
+            opts.packets = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts.window = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            opts.method = optarg;
+            break;
+        case 'k':
+            opts.password = optarg;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    opts.packets = opts.packets ? opts.packets : 1;
+    opts.window = opts.window ? opts.window : 1;
+    for (i = 0; i < opts.sizes_count; ++i) {
+        // Room for the send time in every payload.
+        opts.sizes[i] = max(opts.sizes[i], sizeof(uint64_t));
+    }
+
+    bench = (struct udp_bench *) calloc(1, sizeof(*bench));
+    bench->opts = &opts;
+    bench->loop = uv_default_loop();
+    bench->cipher = cipher_env_new_instance(opts.password, opts.method);
+    if (bench->cipher == NULL) {
+        fprintf(stderr, "unknown method %s\n", opts.method);
+        return -1;
+    }
+    bench->standin_buf = buffer_create(BENCH_UDP_BUFFER_SIZE);
+
+    if (bench_udp_open(bench->loop, &bench->echo, &bench->echo_addr) != 0 ||
+        bench_udp_open(bench->loop, &bench->standin, &bench->standin_addr) != 0 ||
+        bench_free_port(bench->loop, &bench->relay_addr) != 0) {
+        fprintf(stderr, "no UDP port on %s\n", BENCH_UDP_LOCALHOST);
+        return -1;
+    }
+    bench->standin.data = bench;
+    uv_udp_recv_start(&bench->echo, bench_alloc_cb, echo_recv_cb);
+    uv_udp_recv_start(&bench->standin, bench_alloc_cb, standin_recv_cb);
+
+    standin_addr.addr4 = bench->standin_addr;
+    bench->relay = udprelay_begin(bench->loop, BENCH_UDP_LOCALHOST, ntohs(bench->relay_addr.sin_port),
+        &standin_addr, NULL, 0, BENCH_UDP_TIMEOUT, bench->cipher, NULL, NULL);
+
+    // Every request goes to the echo, through the relay the SOCKS5 UDP header says so.
+    bench->packet[3] = 1;
+    memcpy(bench->packet + 4, &bench->echo_addr.sin_addr, 4);
+    memcpy(bench->packet + 8, &bench->echo_addr.sin_port, 2);
+
+    uv_timer_init(bench->loop, &bench->check);
+    bench->check.data = bench;
+    uv_timer_start(&bench->check, bench_check_cb, BENCH_UDP_CHECK_MS, BENCH_UDP_CHECK_MS);
+
+    printf("method %s, %u packets a run, %u in flight per association\n", opts.method, opts.packets, opts.window);
+    printf("%6s %7s %12s %10s %10s %10s %8s %10s\n",
+        "assocs", "size", "pps", "rtt us", "p99 us", "added us", "lost", "allocs/pkt");
+    bench_run_next(bench);
+    uv_run(bench->loop, UV_RUN_DEFAULT);
+
+    buffer_release(bench->standin_buf);
+    cipher_env_release(bench->cipher);
+    free(bench);
+    return 0;
+}
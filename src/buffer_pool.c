@@ -0,0 +1,364 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "buffer_pool.h"
+#include "ssr_alloc.h"
+
+#define BUFFER_POOL_MIN_SHIFT   11  /* 2 KiB, SSR_BUFF_SIZE.       */
+#define BUFFER_POOL_MAX_SHIFT   18  /* 256 KiB, TCP_READ_SIZE_MAX. */
+#define BUFFER_POOL_LARGE_SHIFT 16  /* Classes above 64 KiB cache fewer blocks. */
+#define BUFFER_POOL_LARGE_CACHED_DIVISOR 32
+#define BUFFER_POOL_CLASSES     (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_OVERSIZED   (-1)
+#define BUFFER_POOL_SCRATCH     (-2)
+#define BUFFER_POOL_SLAB_SIZE   (2 * 1024 * 1024)  /* One hugepage. */
+
+#if defined(__linux__) && !defined(MPOL_PREFERRED)
+#define MPOL_PREFERRED 1  /* <numaif.h> is libnuma's, the syscall needs none of it. */
+#endif
+
+/* Prepended to every block so that buffer_pool_free() needs only the pointer. */
+struct pool_block {
+    struct pool_block *next;
+    int size_class;
+    bool slab;  /* Carved out of a slab, never free()d. */
+    size_t size;
+    /* Keep the payload aligned for any type. */
+    union { long long ll; double d; void *p; } payload[1];
+};
+
+#define BLOCK_OF(ptr) \
+    ((struct pool_block *)((char *)(ptr) - offsetof(struct pool_block, payload)))
+
+struct pool_slab {
+    struct pool_slab *next;
+    void *base;  /* BUFFER_POOL_SLAB_SIZE bytes mapped. */
+};
+
+struct buffer_pool {
+    struct pool_block *free_list[BUFFER_POOL_CLASSES];
+    size_t free_count[BUFFER_POOL_CLASSES];
+    size_t max_cached_per_class;
+    struct buffer_pool_stats stats;
+    bool scratch_enabled;
+    bool scratch_lent;
+    struct pool_block *scratch;  /* Grown to the biggest read asked for. */
+    bool slabs_enabled;
+    bool hugepages;
+    int node;  /* Of the slabs, -1 for wherever they're first touched. */
+    struct pool_slab *slabs;
+};
+
+static int size_class_of(size_t size) {
+    int cls = 0;
+    size_t class_size = ((size_t)1) << BUFFER_POOL_MIN_SHIFT;
+    while (class_size < size) {
+        class_size <<= 1;
+        cls++;
+        if (cls >= BUFFER_POOL_CLASSES) {
+            return BUFFER_POOL_OVERSIZED;
+        }
+    }
+    return cls;
+}
+
+static size_t class_size_of(int cls) {
+    return ((size_t)1) << (BUFFER_POOL_MIN_SHIFT + cls);
+}
+
+/* Only the bulk streams read that big, a few idle blocks serve them. */
+static size_t class_cached_max(const struct buffer_pool *pool, int cls) {
+    if (BUFFER_POOL_MIN_SHIFT + cls > BUFFER_POOL_LARGE_SHIFT) {
+        return pool->max_cached_per_class / BUFFER_POOL_LARGE_CACHED_DIVISOR + 1;
+    }
+    return pool->max_cached_per_class;
+}
+
+static bool class_uses_slab(const struct buffer_pool *pool, int cls) {
+    return pool && pool->slabs_enabled && cls >= 0 && BUFFER_POOL_MIN_SHIFT + cls > BUFFER_POOL_LARGE_SHIFT;
+}
+
+static void * slab_map(const struct buffer_pool *pool) {
+#if defined(__linux__)
+    void *base = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    if (pool->hugepages) {
+        // Only where the admin reserved some, vm.nr_hugepages.
+        base = mmap(NULL, BUFFER_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif // defined(MAP_HUGETLB)
+    if (base == MAP_FAILED) {
+        // Twice the size trimmed to a 2 MiB boundary, what a transparent hugepage needs.
+        char *raw = (char *) mmap(NULL, 2 * BUFFER_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        char *aligned;
+        if (raw == (char *)MAP_FAILED) {
+            return NULL;
+        }
+        aligned = (char *)(((uintptr_t)raw + BUFFER_POOL_SLAB_SIZE - 1) & ~(uintptr_t)(BUFFER_POOL_SLAB_SIZE - 1));
+        if (aligned > raw) {
+            munmap(raw, (size_t)(aligned - raw));
+        }
+        munmap(aligned + BUFFER_POOL_SLAB_SIZE, (size_t)(raw + BUFFER_POOL_SLAB_SIZE - aligned));
+        base = aligned;
+#if defined(MADV_HUGEPAGE)
+        if (pool->hugepages) {
+            (void)madvise(base, BUFFER_POOL_SLAB_SIZE, MADV_HUGEPAGE);
+        }
+#endif // defined(MADV_HUGEPAGE)
+    }
+#if defined(SYS_mbind)
+    if (pool->node >= 0 && pool->node < (int)(sizeof(unsigned long) * 8)) {
+        // Preferred, not bound: a full node still serves from the other one.
+        unsigned long mask = 1UL << pool->node;
+        (void)syscall(SYS_mbind, base, BUFFER_POOL_SLAB_SIZE, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
+#endif // defined(SYS_mbind)
+    return base;
+#else
+    (void)pool;
+    return NULL;
+#endif // defined(__linux__)
+}
+
+static void slab_unmap(void *base) {
+#if defined(__linux__)
+    munmap(base, BUFFER_POOL_SLAB_SIZE);
+#else
+    (void)base;
+#endif
+}
+
+/* A new slab cut into blocks of |cls| on its free list, false if none could be mapped. */
+static bool slab_fill(struct buffer_pool *pool, int cls) {
+    size_t block_size = class_size_of(cls);
+    size_t stride = (offsetof(struct pool_block, payload) + block_size + 1 + 63) & ~(size_t)63;
+    struct pool_slab *slab;
+    char *base, *at;
+
+    if (stride > BUFFER_POOL_SLAB_SIZE || (base = (char *) slab_map(pool)) == NULL) {
+        return false;
+    }
+    slab = (struct pool_slab *) ssr_calloc(ssr_alloc_buffers, 1, sizeof(*slab));
+    slab->base = base;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    for (at = base; at + stride <= base + BUFFER_POOL_SLAB_SIZE; at += stride) {
+        struct pool_block *block = (struct pool_block *)at;
+        block->size_class = cls;
+        block->slab = true;
+        block->size = block_size;
+        block->next = pool->free_list[cls];
+        pool->free_list[cls] = block;
+        pool->free_count[cls]++;
+        pool->stats.cached++;
+        ssr_census_add(ssr_census_pool_blocks, block_size);
+    }
+    return true;
+}
+
+struct buffer_pool * buffer_pool_create(size_t max_cached_per_class) {
+    struct buffer_pool *pool = (struct buffer_pool *) ssr_calloc(ssr_alloc_buffers, 1, sizeof(*pool));
+    pool->max_cached_per_class = max_cached_per_class;
+    pool->node = -1;
+    return pool;
+}
+
+void buffer_pool_use_slabs(struct buffer_pool *pool, bool hugepages, int node) {
+#if defined(__linux__)
+    if (pool) {
+        pool->slabs_enabled = true;
+        pool->hugepages = hugepages;
+        pool->node = node;
+    }
+#else
+    (void)pool; (void)hugepages; (void)node;
+#endif
+}
+
+void buffer_pool_destroy(struct buffer_pool *pool) {
+    int cls;
+    if (pool == NULL) {
+        return;
+    }
+    for (cls = 0; cls < BUFFER_POOL_CLASSES; ++cls) {
+        struct pool_block *block = pool->free_list[cls];
+        while (block) {
+            struct pool_block *next = block->next;
+            ssr_census_remove(ssr_census_pool_blocks, block->size);
+            if (block->slab == false) {
+                ssr_free(ssr_alloc_buffers, block);
+            }
+            block = next;
+        }
+    }
+    while (pool->slabs) {
+        struct pool_slab *next = pool->slabs->next;
+        slab_unmap(pool->slabs->base);
+        ssr_free(ssr_alloc_buffers, pool->slabs);
+        pool->slabs = next;
+    }
+    ssr_free(ssr_alloc_buffers, pool->scratch);
+    ssr_free(ssr_alloc_buffers, pool);
+}
+
+void * buffer_pool_alloc(struct buffer_pool *pool, size_t size) {
+    struct pool_block *block = NULL;
+    int cls = size_class_of(size);
+    size_t block_size = (cls == BUFFER_POOL_OVERSIZED) ? size : class_size_of(cls);
+    bool filled = class_uses_slab(pool, cls) && pool->free_list[cls] == NULL && slab_fill(pool, cls);
+
+    if (pool && cls != BUFFER_POOL_OVERSIZED && pool->free_list[cls]) {
+        block = pool->free_list[cls];
+        pool->free_list[cls] = block->next;
+        pool->free_count[cls]--;
+        pool->stats.cached--;
+        if (filled) {
+            pool->stats.misses++;
+        } else {
+            pool->stats.hits++;
+        }
+    } else {
+        block = (struct pool_block *) ssr_malloc(ssr_alloc_buffers, offsetof(struct pool_block, payload) + block_size + 1);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size_class = cls;
+        block->slab = false;
+        block->size = block_size;
+        ssr_census_add(ssr_census_pool_blocks, block_size);
+        if (pool) {
+            if (cls == BUFFER_POOL_OVERSIZED) {
+                pool->stats.oversized++;
+            }
+            pool->stats.misses++;
+        }
+    }
+    block->next = NULL;
+    if (pool) {
+        pool->stats.outstanding++;
+    }
+    return block->payload;
+}
+
+void buffer_pool_free(struct buffer_pool *pool, void *ptr) {
+    struct pool_block *block;
+    int cls;
+    if (ptr == NULL) {
+        return;
+    }
+    block = BLOCK_OF(ptr);
+    cls = block->size_class;
+    if (cls == BUFFER_POOL_SCRATCH) {
+        pool->scratch_lent = false;
+        return;
+    }
+    if (pool == NULL) {
+        if (block->slab == false) {
+            ssr_census_remove(ssr_census_pool_blocks, block->size);
+            ssr_free(ssr_alloc_buffers, block);
+        }
+        return;
+    }
+    pool->stats.outstanding--;
+    if (block->slab == false && (cls == BUFFER_POOL_OVERSIZED || pool->free_count[cls] >= class_cached_max(pool, cls))) {
+        ssr_census_remove(ssr_census_pool_blocks, block->size);
+        ssr_free(ssr_alloc_buffers, block);
+        return;
+    }
+    block->next = pool->free_list[cls];
+    pool->free_list[cls] = block;
+    pool->free_count[cls]++;
+    pool->stats.cached++;
+}
+
+size_t buffer_pool_trim(struct buffer_pool *pool) {
+    size_t freed = 0;
+    int cls;
+    if (pool == NULL) {
+        return 0;
+    }
+    for (cls = 0; cls < BUFFER_POOL_CLASSES; ++cls) {
+        struct pool_block **link = &pool->free_list[cls];
+        while (*link) {
+            struct pool_block *block = *link;
+            if (block->slab) {
+                link = &block->next;
+                continue;
+            }
+            *link = block->next;
+            pool->free_count[cls]--;
+            pool->stats.cached--;
+            freed += block->size;
+            ssr_census_remove(ssr_census_pool_blocks, block->size);
+            ssr_free(ssr_alloc_buffers, block);
+        }
+    }
+    return freed;
+}
+
+size_t buffer_pool_block_size(const void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    return BLOCK_OF(ptr)->size;
+}
+
+void buffer_pool_enable_scratch(struct buffer_pool *pool) {
+    if (pool) {
+        pool->scratch_enabled = true;
+    }
+}
+
+void * buffer_pool_alloc_scratch(struct buffer_pool *pool, size_t size) {
+    struct pool_block *block;
+    if (pool == NULL || pool->scratch_enabled == false || pool->scratch_lent) {
+        return buffer_pool_alloc(pool, size);
+    }
+    block = pool->scratch;
+    if (block == NULL || block->size < size) {
+        int cls = size_class_of(size);
+        size_t block_size = (cls == BUFFER_POOL_OVERSIZED) ? size : class_size_of(cls);
+        ssr_free(ssr_alloc_buffers, block);
+        pool->scratch = block = (struct pool_block *) ssr_malloc(ssr_alloc_buffers, offsetof(struct pool_block, payload) + block_size + 1);
+        if (block == NULL) {
+            return buffer_pool_alloc(pool, size);
+        }
+        block->next = NULL;
+        block->size_class = BUFFER_POOL_SCRATCH;
+        block->slab = false;
+        block->size = block_size;
+    }
+    pool->scratch_lent = true;
+    pool->stats.scratch++;
+    return block->payload;
+}
+
+void * buffer_pool_detach(struct buffer_pool *pool, void *ptr, size_t len) {
+    void *copy;
+    if (ptr == NULL || BLOCK_OF(ptr)->size_class != BUFFER_POOL_SCRATCH) {
+        return ptr;
+    }
+    copy = buffer_pool_alloc(pool, len);
+    if (copy) {
+        memcpy(copy, ptr, len);
+        pool->stats.detached++;
+    }
+    pool->scratch_lent = false;
+    return copy;
+}
+
+void buffer_pool_get_stats(const struct buffer_pool *pool, struct buffer_pool_stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    if (pool == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = pool->stats;
+}
@@ -0,0 +1,65 @@
+#if !defined(__buffer_pool_h__)
+#define __buffer_pool_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A per-loop cache of raw read buffers. Blocks are grouped in power-of-two
+ * size classes, so every `tunnel_get_alloc_size` answer lands in a class
+ * and a block released by one tunnel is reused by the next read of any
+ * tunnel on the same loop. Not thread safe: one pool per uv_loop_t.
+ */
+
+struct buffer_pool;
+
+struct buffer_pool_stats {
+    uint64_t hits;        /* Requests served from a free list. */
+    uint64_t misses;      /* Requests that had to call malloc(). */
+    uint64_t oversized;   /* Requests larger than the biggest class. */
+    size_t outstanding;   /* Blocks currently handed out. */
+    size_t cached;        /* Blocks sitting in the free lists. */
+    uint64_t scratch;     /* Reads that went to the scratch block. */
+    uint64_t detached;    /* Of those, copied out to be kept. */
+};
+
+struct buffer_pool * buffer_pool_create(size_t max_cached_per_class);
+void buffer_pool_destroy(struct buffer_pool *pool);
+void * buffer_pool_alloc(struct buffer_pool *pool, size_t size);
+void buffer_pool_free(struct buffer_pool *pool, void *ptr);
+size_t buffer_pool_block_size(const void *ptr);
+
+/*
+ * With the scratch block enabled, a read borrows the one block of the loop
+ * and gives it back before the next read's alloc, so tunnels that wait for
+ * data hold nothing and a burst of reads doesn't fill the free lists with
+ * blocks of the biggest read. buffer_pool_free() takes it back like any
+ * block. While it's lent, as when reads are posted ahead of the data on
+ * Windows, the next one gets a block of its own.
+ */
+void buffer_pool_enable_scratch(struct buffer_pool *pool);
+/* The scratch block when enabled and not lent, else buffer_pool_alloc(). */
+void * buffer_pool_alloc_scratch(struct buffer_pool *pool, size_t size);
+/* |ptr| unless it's the scratch block, then a block of |len| bytes with
+ * its first |len| and the scratch block is given back. For a read that
+ * waits past its callback. */
+void * buffer_pool_detach(struct buffer_pool *pool, void *ptr, size_t len);
+void buffer_pool_get_stats(const struct buffer_pool *pool, struct buffer_pool_stats *stats);
+/* Frees the cached blocks, but the slabs' which stay cached, for when
+ * memory runs short. The bytes given back. */
+size_t buffer_pool_trim(struct buffer_pool *pool);
+
+/*
+ * The classes above 64 KiB, what the bulk streams read into and cipher
+ * from, are carved out of 2 MiB slabs instead of malloc(): on hugepages
+ * with |hugepages|, MAP_HUGETLB where some are reserved and transparent
+ * ones otherwise, so a read buffer costs one TLB entry, and placed on NUMA
+ * |node| when it's 0 or more, for a loop pinned to that node's CPUs.
+ * Their blocks go back to the free lists whatever the cap, the slabs are
+ * only given back by buffer_pool_destroy(). Linux only, elsewhere it's
+ * malloc() as before. Call before the first alloc.
+ */
+void buffer_pool_use_slabs(struct buffer_pool *pool, bool hugepages, int node);
+
+#endif // !defined(__buffer_pool_h__)
@@ -26,11 +26,14 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cache.h"
+#include "ssr_alloc.h"
 #include "ssrutils.h"
-#include "uthash.h"
 
 #ifdef __MINGW32__
 #include "win32.h"
@@ -42,14 +45,29 @@
 
 ev_tstamp _ev_time(void);
 
+/*
+ * All slots are allocated with the cache and found through an open
+ * addressed index of slot numbers, so an insert allocates nothing unless
+ * its key is longer than CACHE_KEY_INLINE. Eviction is CLOCK: a hit only
+ * sets the slot's referenced bit, the hand clears the bits it passes and
+ * takes the first slot found clear. Hits are O(1) and don't reorder
+ * anything, an entry used since the hand last came by survives a round.
+ */
+
+#define CACHE_KEY_INLINE 56  /* Keys shorter than this live in the slot. */
+
 /**
  * A cache entry
  */
 struct cache_entry {
-    char *key;         /**<The key */
+    char *key;         /**<The key, NUL terminated, key_inline or malloced */
+    size_t key_len;
     void *data;        /**<Payload */
-    ev_tstamp ts;    /**<Timestamp */
-    UT_hash_handle hh; /**<Hash Handle for uthash */
+    ev_tstamp ts;      /**<Insertion time */
+    uint32_t hash;
+    bool used;
+    bool referenced;   /**<Hit since the hand last passed */
+    char key_inline[CACHE_KEY_INLINE];
 };
 
 /**
@@ -57,10 +75,138 @@ struct cache_entry {
  */
 struct cache {
     size_t max_entries;              /**<Amount of entries this cache object can hold */
-    struct cache_entry *entries;     /**<Head pointer for uthash */
+    size_t count;
+    struct cache_entry *entries;     /**<max_entries slots */
+    uint32_t *free_slots;            /**<Stack of unused slot numbers */
+    size_t free_count;
+    uint32_t *index;                 /**<Slot number plus one per bucket, 0 if empty */
+    size_t index_mask;               /**<Buckets less one, at least twice max_entries */
+    size_t hand;                     /**<The CLOCK hand, a slot number */
     void (*free_cb) (void *key, void *element); /**<Callback function to free cache entries */
 };
 
+static uint32_t
+cache_hash(const char *key, size_t key_len)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ key_len;
+    while (key_len >= 8) {
+        uint64_t w;
+        memcpy(&w, key, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+        key += 8;
+        key_len -= 8;
+    }
+    if (key_len) {
+        uint64_t w = 0;
+        memcpy(&w, key, key_len);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+    }
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+/* The bucket holding |key|, or the empty bucket that ends its probe run. */
+static size_t
+cache_bucket(const struct cache *cache, const char *key, size_t key_len, uint32_t hash)
+{
+    size_t bucket = hash & cache->index_mask;
+    uint32_t at;
+    while ((at = cache->index[bucket]) != 0) {
+        const struct cache_entry *entry = &cache->entries[at - 1];
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            break;
+        }
+        bucket = (bucket + 1) & cache->index_mask;
+    }
+    return bucket;
+}
+
+static struct cache_entry *
+cache_find(const struct cache *cache, const char *key, size_t key_len)
+{
+    size_t bucket = cache_bucket(cache, key, key_len, cache_hash(key, key_len));
+    uint32_t at = cache->index[bucket];
+    return at ? &cache->entries[at - 1] : NULL;
+}
+
+/* Empties |bucket| and moves back the entries of the run after it that would be cut off. */
+static void
+cache_unindex(struct cache *cache, size_t bucket)
+{
+    size_t next = bucket;
+    for (;;) {
+        uint32_t at;
+        size_t home;
+        next = (next + 1) & cache->index_mask;
+        if ((at = cache->index[next]) == 0) {
+            break;
+        }
+        home = cache->entries[at - 1].hash & cache->index_mask;
+        // Stays if its home lies cyclically in (bucket, next].
+        if (((next - home) & cache->index_mask) < ((next - bucket) & cache->index_mask)) {
+            continue;
+        }
+        cache->index[bucket] = at;
+        bucket = next;
+    }
+    cache->index[bucket] = 0;
+}
+
+/* The slot, and the key when it didn't fit in it. */
+static size_t
+cache_entry_bytes(const struct cache_entry *entry)
+{
+    return sizeof(*entry) + ((entry->key != entry->key_inline) ? entry->key_len + 1 : 0);
+}
+
+/* Takes |entry| out of the cache, then hands its data to free_cb. The slot
+ * is reused only after the callback, which may call into the cache. */
+static void
+cache_evict(struct cache *cache, struct cache_entry *entry, int keep_data)
+{
+    if (entry->used == false) {
+        return;
+    }
+    cache_unindex(cache, cache_bucket(cache, entry->key, entry->key_len, entry->hash));
+    entry->used = false;
+    cache->count--;
+    ssr_census_remove(ssr_census_cache_entries, cache_entry_bytes(entry));
+    if (keep_data == 0 && entry->data != NULL) {
+        if (cache->free_cb) {
+            cache->free_cb(entry->key, entry->data);
+        } else {
+            safe_free(entry->data);
+        }
+    }
+    if (entry->key != entry->key_inline) {
+        safe_free(entry->key);
+    }
+    entry->key = NULL;
+    entry->data = NULL;
+    cache->free_slots[cache->free_count++] = (uint32_t)(entry - cache->entries);
+}
+
+/* The CLOCK hand's pick: the first slot without a hit since it last came by. */
+static struct cache_entry *
+cache_victim(struct cache *cache)
+{
+    for (;;) {
+        struct cache_entry *entry = &cache->entries[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->max_entries;
+        if (entry->used == false) {
+            continue;
+        }
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+        return entry;
+    }
+}
+
 /** Creates a new cache object
  *
  *  @param dst
@@ -76,17 +222,42 @@ cache_create(struct cache **dst, size_t capacity,
              void (*free_cb)(void *key, void *element))
 {
     struct cache *newObj = NULL;
+    size_t buckets = 2;
+    size_t i;
 
     if (!dst) {
         return EINVAL;
     }
+    if (capacity == 0) {
+        capacity = 1;
+    }
+    if (capacity > UINT32_MAX / 2) {
+        return EINVAL;
+    }
+    while (buckets < capacity * 2) {
+        buckets *= 2;
+    }
 
-    if ((newObj = malloc(sizeof(*newObj))) == NULL) {
+    if ((newObj = calloc(1, sizeof(*newObj))) == NULL) {
         return ENOMEM;
     }
-
+    newObj->entries    = calloc(capacity, sizeof(struct cache_entry));
+    newObj->free_slots = malloc(capacity * sizeof(uint32_t));
+    newObj->index      = calloc(buckets, sizeof(uint32_t));
+    if (newObj->entries == NULL || newObj->free_slots == NULL || newObj->index == NULL) {
+        safe_free(newObj->entries);
+        safe_free(newObj->free_slots);
+        safe_free(newObj->index);
+        safe_free(newObj);
+        return ENOMEM;
+    }
+    // Handed out from slot 0 up.
+    for (i = 0; i < capacity; ++i) {
+        newObj->free_slots[i] = (uint32_t)(capacity - 1 - i);
+    }
+    newObj->free_count  = capacity;
     newObj->max_entries = capacity;
-    newObj->entries     = NULL;
+    newObj->index_mask  = buckets - 1;
     newObj->free_cb     = free_cb;
     *dst             = newObj;
     return 0;
@@ -105,29 +276,19 @@ cache_create(struct cache **dst, size_t capacity,
 int
 cache_delete(struct cache *cache, int keep_data)
 {
-    struct cache_entry *entry, *tmp;
+    size_t i;
 
     if (!cache) {
         return EINVAL;
     }
 
-    if (keep_data) {
-        HASH_CLEAR(hh, cache->entries);
-    } else {
-        HASH_ITER(hh, cache->entries, entry, tmp){
-            HASH_DEL(cache->entries, entry);
-            if (entry->data != NULL) {
-                if (cache->free_cb) {
-                    cache->free_cb(entry->key, entry->data);
-                } else {
-                    safe_free(entry->data);
-                }
-            }
-            safe_free(entry->key);
-            safe_free(entry);
-        }
+    for (i = 0; i < cache->max_entries; ++i) {
+        cache_evict(cache, &cache->entries[i], keep_data);
     }
 
+    safe_free(cache->entries);
+    safe_free(cache->free_slots);
+    safe_free(cache->index);
     safe_free(cache);
     return 0;
 }
@@ -138,33 +299,25 @@ cache_delete(struct cache *cache, int keep_data)
  *  The cache object to clear
  *
  *  @param age
- *  Clear only objects older than the age (sec)
+ *  Clear only objects inserted longer ago than the age (sec)
  *
  *  @return EINVAL if cache is NULL, 0 otherwise
  */
 int
 cache_clear(struct cache *cache, ev_tstamp age)
 {
-    struct cache_entry *entry, *tmp;
     ev_tstamp now;
+    size_t i;
     if (!cache) {
         return EINVAL;
     }
 
     now = _ev_time();
 
-    HASH_ITER(hh, cache->entries, entry, tmp){
-        if (now - entry->ts > age) {
-            HASH_DEL(cache->entries, entry);
-            if (entry->data != NULL) {
-                if (cache->free_cb) {
-                    cache->free_cb(entry->key, entry->data);
-                } else {
-                    safe_free(entry->data);
-                }
-            }
-            safe_free(entry->key);
-            safe_free(entry);
+    for (i = 0; i < cache->max_entries; ++i) {
+        struct cache_entry *entry = &cache->entries[i];
+        if (entry->used && now - entry->ts > age) {
+            cache_evict(cache, entry, 0);
         }
     }
 
@@ -193,19 +346,9 @@ cache_remove(struct cache *cache, char *key, size_t key_len)
         return EINVAL;
     }
 
-    HASH_FIND(hh, cache->entries, key, key_len, tmp);
-
+    tmp = cache_find(cache, key, key_len);
     if (tmp) {
-        HASH_DEL(cache->entries, tmp);
-        if (tmp->data != NULL) {
-            if (cache->free_cb) {
-                cache->free_cb(tmp->key, tmp->data);
-            } else {
-                safe_free(tmp->data);
-            }
-        }
-        safe_free(tmp->key);
-        safe_free(tmp);
+        cache_evict(cache, tmp, 0);
     }
 
     return 0;
@@ -241,11 +384,9 @@ cache_lookup(struct cache *cache, char *key, size_t key_len, void *result)
         return EINVAL;
     }
 
-    HASH_FIND(hh, cache->entries, key, key_len, tmp);
+    tmp = cache_find(cache, key, key_len);
     if (tmp) {
-        HASH_DELETE(hh, cache->entries, tmp);
-        tmp->ts = _ev_time();
-        HASH_ADD_KEYPTR(hh, cache->entries, tmp->key, key_len, tmp);
+        tmp->referenced = true;
         *dirty_hack = tmp->data;
     } else {
         *dirty_hack = result = NULL;
@@ -263,20 +404,18 @@ cache_key_exist(struct cache *cache, char *key, size_t key_len)
         return 0;
     }
 
-    HASH_FIND(hh, cache->entries, key, key_len, tmp);
+    tmp = cache_find(cache, key, key_len);
     if (tmp) {
-        HASH_DELETE(hh, cache->entries, tmp);
-        tmp->ts = _ev_time();
-        HASH_ADD_KEYPTR(hh, cache->entries, tmp->key, key_len, tmp);
+        tmp->referenced = true;
         return 1;
-    } else {
-        return 0;
     }
-
     return 0;
 }
 
 /** Inserts a given <key, value> pair into the cache
+ *
+ *  An entry already under <key> is removed first. When the cache is full
+ *  the entry the CLOCK hand picks is evicted.
  *
  *  @param cache
  *  The cache object
@@ -295,40 +434,47 @@ cache_key_exist(struct cache *cache, char *key, size_t key_len)
 int
 cache_insert(struct cache *cache, char *key, size_t key_len, void *data)
 {
-    struct cache_entry *entry     = NULL;
-    struct cache_entry *tmp_entry = NULL;
+    struct cache_entry *entry = NULL;
+    uint32_t hash;
+    size_t bucket;
+    uint32_t slot;
 
-    if (!cache) {
+    if (!cache || !key) {
         return EINVAL;
     }
 
-    if ((entry = malloc(sizeof(*entry))) == NULL) {
-        return ENOMEM;
+    // Looped, the callback of an evicted entry may call back into the cache.
+    for (;;) {
+        if ((entry = cache_find(cache, key, key_len)) != NULL) {
+            cache_evict(cache, entry, 0);
+        } else if (cache->free_count == 0) {
+            cache_evict(cache, cache_victim(cache), 0);
+        } else {
+            break;
+        }
     }
 
-    entry->key = (char *) calloc(key_len + 1, sizeof(char));
+    slot  = cache->free_slots[cache->free_count - 1];
+    entry = &cache->entries[slot];
+    if (key_len < CACHE_KEY_INLINE) {
+        entry->key = entry->key_inline;
+    } else if ((entry->key = malloc(key_len + 1)) == NULL) {
+        return ENOMEM;
+    }
+    cache->free_count--;
     memcpy(entry->key, key, key_len);
     entry->key[key_len] = 0;
-
-    entry->data = data;
-    entry->ts   = _ev_time();
-    HASH_ADD_KEYPTR(hh, cache->entries, entry->key, key_len, entry);
-
-    if (HASH_COUNT(cache->entries) >= cache->max_entries) {
-        HASH_ITER(hh, cache->entries, entry, tmp_entry){
-            HASH_DELETE(hh, cache->entries, entry);
-            if (entry->data != NULL) {
-                if (cache->free_cb) {
-                    cache->free_cb(entry->key, entry->data);
-                } else {
-                    safe_free(entry->data);
-                }
-            }
-            safe_free(entry->key);
-            safe_free(entry);
-            break;
-        }
-    }
+    entry->key_len    = key_len;
+    entry->data       = data;
+    entry->ts         = _ev_time();
+    entry->hash       = hash = cache_hash(key, key_len);
+    entry->used       = true;
+    entry->referenced = false;
+
+    bucket = cache_bucket(cache, key, key_len, hash);
+    cache->index[bucket] = slot + 1;
+    cache->count++;
+    ssr_census_add(ssr_census_cache_entries, cache_entry_bytes(entry));
 
     return 0;
 }
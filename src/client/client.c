@@ -9,6 +9,26 @@
 #include "tunnel.h"
 #include "obfsutil.h"
 #include "tls_cli.h"
+#include "resolv.h"
+#include "remote_pool.h"
+#include "server_group.h"
+#include "server_probe.h"
+#include "mux_cli.h"
+#include "warm_pool.h"
+#include "timer_wheel.h"
+#include "admission.h"
+#include "acl.h"
+#include "sniff.h"
+#include "fake_dns.h"
+#if defined(__linux__)
+#include <linux/netfilter_ipv4.h>  /* SO_ORIGINAL_DST */
+#include <linux/netfilter_ipv6/ip6_tables.h>  /* IP6T_SO_ORIGINAL_DST */
+#endif
+
+/* How long an optimistic reply waits for the first payload, up to a wheel tick more. */
+#define OPTIMISTIC_WAIT_MS 100
+/* The CONNECT request line and headers, anything longer is refused. */
+#define HTTP_REQUEST_MAX 8192
 
 /* A connection is modeled as an abstraction on top of two simple state
  * machines, one for reading and one for writing.  Either state machine
@@ -48,10 +68,17 @@ enum tunnel_stage {
     tunnel_stage_handshake_auth,   /* Wait for client authentication data. */
     tunnel_stage_handshake_replied,        /* Start waiting for request data. */
     tunnel_stage_s5_request,        /* Wait for request data. */
-    tunnel_stage_s5_udp_accoc,
+    tunnel_stage_s5_udp_accoc,     /* Wait for the UDP ASSOCIATE reply to go out. */
+    tunnel_stage_s5_udp_associated,  /* Hold the control connection, the association lasts while it's open. */
+    tunnel_stage_http_request,     /* Wait for the rest of an HTTP CONNECT request. */
+    tunnel_stage_optimistic_replied,  /* Success sent before connecting, see optimistic_reply. */
+    tunnel_stage_optimistic_payload,  /* Wait for the first payload to go with the SSR header. */
     tunnel_stage_tls_connecting,
     tunnel_stage_tls_first_package,
     tunnel_stage_tls_streaming,
+    tunnel_stage_acl_resolve_done,   /* Wait for the destination's DNS lookup, the ACL decides by its address. */
+    tunnel_stage_direct_connecting,  /* Wait for uv_tcp_connect() to the destination itself. */
+    tunnel_stage_direct_payload_sent,  /* The payload sent ahead of the reply went out. */
     tunnel_stage_resolve_ssr_server_host_done,       /* Wait for upstream hostname DNS lookup to complete. */
     tunnel_stage_connecting_ssr_server,      /* Wait for uv_tcp_connect() to complete. */
     tunnel_stage_ssr_auth_sent,
@@ -59,15 +86,51 @@ enum tunnel_stage {
     tunnel_stage_ssr_receipt_of_feedback_sent,
     tunnel_stage_auth_complition_done,      /* Connected. Start piping data. */
     tunnel_stage_streaming,            /* Connected. Pipe data back and forth. */
+    tunnel_stage_mux_streaming,        /* A stream of a mux session. */
     tunnel_stage_kill,             /* Tear down session. */
 };
 
+/* Span names of the stages, see tunnel_trace_stage(). */
+static const char *tunnel_stage_names[] = {
+    "handshake", "handshake_auth", "handshake_replied", "s5_request", "s5_udp_accoc",
+    "s5_udp_associated", "http_request", "optimistic_replied", "optimistic_payload", "tls_connecting",
+    "tls_first_package", "tls_streaming", "acl_resolve_done", "direct_connecting",
+    "direct_payload_sent", "resolve_ssr_server_host_done", "connecting_ssr_server",
+    "ssr_auth_sent", "ssr_waiting_feedback", "ssr_receipt_of_feedback_sent",
+    "auth_complition_done", "streaming", "mux_streaming", "kill",
+};
+
+/* What the client speaks on |incoming|, told apart by the first bytes or the destination. */
+enum inbound_kind {
+    inbound_socks5,
+    inbound_http_connect,
+    inbound_transparent,  /* Sent by iptables REDIRECT or TPROXY, nothing to negotiate. */
+    inbound_forward,  /* To tunnel_address, whatever the client speaks is payload. */
+};
+
 struct client_ctx {
     struct server_env_t *env; // __weak_ptr
     struct tunnel_cipher_ctx *cipher;
     struct buffer_t *init_pkg;
     s5_ctx *parser;  /* The SOCKS protocol parser. */
     enum tunnel_stage stage;
+    enum inbound_kind inbound;
+    struct buffer_t *http_request;  /* The CONNECT request read so far. */
+    bool s5_request_ready;  /* The request came in one segment with the greeting, parsed already. */
+    struct tunnel_ctx *tunnel;  /* Backlink for |optimistic_wait|. */
+    bool optimistic;  /* No reply is owed, success went out already or the client never asks. */
+    struct timer_wheel_entry optimistic_wait;
+    uint64_t connect_start;  /* uv_hrtime() of the connect to the SSR server, for its score. */
+    bool direct;  /* Bypassed by the ACL, |outgoing| is the destination itself. */
+    bool sniffing;  /* The ACL waits on the first payload for the name in it. */
+    bool muxed;
+    struct mux_stream *mux_stream;  /* NULL once either side closed it. */
+    struct buffer_t *mux_pending;  /* Stream data waiting for |incoming| to be writable. */
+    size_t mux_in_flight;  /* Bytes of the write on |incoming|, credited once it completes. */
+    bool mux_read_paused;  /* The stream's window is used up. */
+    struct admission_entry admission;
+    size_t _incoming_read_size;  /* Adapted while streaming, see socket_adapt_read_size(). The server's
+                                  * side stays at SSR_BUFF_SIZE, what the client's decrypt takes at once. */
 };
 
 static struct buffer_t * initial_package_create(const s5_ctx *parser);
@@ -76,74 +139,198 @@ static void do_handshake(struct tunnel_ctx *tunnel);
 static void do_handshake_auth(struct tunnel_ctx *tunnel);
 static void do_wait_s5_request(struct tunnel_ctx *tunnel);
 static void do_parse_s5_request(struct tunnel_ctx *tunnel);
+static void do_s5_udp_associated(struct tunnel_ctx *tunnel);
+static void do_s5_request_exec(struct tunnel_ctx *tunnel);
+static void do_http_request(struct tunnel_ctx *tunnel);
+static void do_http_reply_error(struct tunnel_ctx *tunnel, const char *status);
+static void do_tcp_connect_request(struct tunnel_ctx *tunnel);
+static void do_acl_route(struct tunnel_ctx *tunnel, bool timed_out);
+static int do_acl_sniff(struct tunnel_ctx *tunnel, char *name, size_t size, bool timed_out);
+static bool set_destination_name(struct tunnel_ctx *tunnel, const char *name);
+static void do_acl_resolve_done(struct tunnel_ctx *tunnel);
+static void do_direct_connect(struct tunnel_ctx *tunnel);
+static void do_direct_connect_done(struct tunnel_ctx *tunnel);
+static void do_direct_payload_sent(struct tunnel_ctx *tunnel);
+static void do_proxy_connect_request(struct tunnel_ctx *tunnel);
+static void do_optimistic_replied(struct tunnel_ctx *tunnel);
+static void do_optimistic_payload(struct tunnel_ctx *tunnel);
+static void do_connect_ssr_server_start(struct tunnel_ctx *tunnel);
+static void do_socks5_reply_error(struct tunnel_ctx *tunnel, const char *reply);
 static void do_resolve_ssr_server_host_aftercare(struct tunnel_ctx *tunnel);
 static void do_connect_ssr_server(struct tunnel_ctx *tunnel);
 static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel);
 static void do_ssr_auth_sent(struct tunnel_ctx *tunnel);
 static bool do_ssr_receipt_for_feedback(struct tunnel_ctx *tunnel);
 static void do_socks5_reply_success(struct tunnel_ctx *tunnel);
+static void do_streaming_start(struct tunnel_ctx *tunnel);
 static void do_launch_streaming(struct tunnel_ctx *tunnel);
-static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size);
+static struct buffer_t * tunnel_extract_data(struct socket_ctx *socket);
 static void tunnel_dying(struct tunnel_ctx *tunnel);
+static void tunnel_admission_streaming(struct client_ctx *ctx);
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_outgoing_connected_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_getaddrinfo_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void tunnel_getaddrinfo_result(struct tunnel_ctx *tunnel, struct socket_ctx *socket, int status, const union sockaddr_universal *addrs, size_t count);
 static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void tunnel_idle_trim(struct tunnel_ctx *tunnel);
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
 static void tunnel_tls_do_launch_streaming(struct tunnel_ctx *tunnel);
 static void tunnel_tls_client_incoming_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_tls_on_connection_established(struct tunnel_ctx *tunnel);
 static void tunnel_tls_on_data_received(struct tunnel_ctx *tunnel, const uint8_t *data, size_t size);
 static void tunnel_tls_on_shutting_down(struct tunnel_ctx *tunnel);
+static void tunnel_mux_do_launch_streaming(struct tunnel_ctx *tunnel);
+static void tunnel_mux_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void tunnel_mux_on_data(void *p, const uint8_t *data, size_t size);
+static void tunnel_mux_on_window(void *p);
+static void tunnel_mux_on_close(void *p, bool reset);
+
+static const struct mux_stream_callbacks mux_stream_cb = {
+    &tunnel_mux_on_data,
+    &tunnel_mux_on_window,
+    &tunnel_mux_on_close,
+};
 
 static bool can_auth_none(const uv_tcp_t *lx, const struct tunnel_ctx *cx);
 static bool can_auth_passwd(const uv_tcp_t *lx, const struct tunnel_ctx *cx);
 static bool can_access(const uv_tcp_t *lx, const struct tunnel_ctx *cx, const struct sockaddr *addr);
+static bool transparent_destination(struct tunnel_ctx *tunnel, struct socks5_address *dest);
+static void optimistic_wait_expire_cb(struct timer_wheel_entry *entry);
+static void report_ssr_server(struct tunnel_ctx *tunnel, bool reachable);
 
-static bool init_done_cb(struct tunnel_ctx *tunnel, void *p) {
-    struct server_env_t *env = (struct server_env_t *)p;
-
-    struct client_ctx *ctx = (struct client_ctx *) calloc(1, sizeof(struct client_ctx));
+/* |dest| when the destination is known before the client speaks. */
+static bool client_ctx_setup(struct tunnel_ctx *tunnel, struct server_env_t *env, const struct socks5_address *dest) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
     ctx->env = env;
-    tunnel->data = ctx;
+    ctx->tunnel = tunnel;
+    ctx->_incoming_read_size = SSR_BUFF_SIZE;
+    tunnel->stats = env->tunnel_stats;
+    tunnel->handles = env->tunnel_handles;
+    tunnel->resolver = env->resolver;
+    tunnel->write_queue_high = env->config->write_queue_high_watermark;
+    tunnel->write_queue_low = env->config->write_queue_low_watermark;
+    if (tunnel->write_queue_low > tunnel->write_queue_high) {
+        tunnel->write_queue_low = tunnel->write_queue_high;
+    }
+    tunnel->fast_open = env->config->fast_open;
+    if (socket_tuning_is_default(&env->config->socket) == false) {
+        tunnel->socket_tuning = &env->config->socket;
+    }
+    tunnel->notsent_lowat = env->config->socket.notsent_lowat;
+    tunnel->stage_timeout = env->config->handshake_timeout;
+    tunnel->linger_timeout = env->config->linger_timeout;
+    tunnel->fair_queue = env->fair_queue;
+    tunnel->coalescer = env->read_coalescer;
+    tunnel->watchdog = env->watchdog;
+    tunnel->trace_id = tunnel_trace_sample(env->trace);
+    if (tunnel->trace_id) {
+        tunnel->trace = env->trace;
+    }
 
     tunnel->tunnel_dying = &tunnel_dying;
     tunnel->tunnel_timeout_expire_done = &tunnel_timeout_expire_done;
     tunnel->tunnel_outgoing_connected_done = &tunnel_outgoing_connected_done;
     tunnel->tunnel_read_done = &tunnel_read_done;
     tunnel->tunnel_getaddrinfo_done = &tunnel_getaddrinfo_done;
+    tunnel->tunnel_getaddrinfo_result = &tunnel_getaddrinfo_result;
     tunnel->tunnel_write_done = &tunnel_write_done;
+    tunnel->tunnel_idle_trim = &tunnel_idle_trim;
     tunnel->tunnel_get_alloc_size = &tunnel_get_alloc_size;
     tunnel->tunnel_extract_data = &tunnel_extract_data;
     tunnel->tunnel_tls_on_connection_established = &tunnel_tls_on_connection_established;
     tunnel->tunnel_tls_on_data_received = &tunnel_tls_on_data_received;
     tunnel->tunnel_tls_on_shutting_down = &tunnel_tls_on_shutting_down;
 
-    cstl_set_container_add(ctx->env->tunnel_set, tunnel);
+    tunnel_list_add(&ctx->env->tunnel_list, tunnel);
+    if (env->admission) {
+        admission_tunnel_opened(env->admission, &ctx->admission, tunnel);
+    }
 
-    ctx->parser = (s5_ctx *)calloc(1, sizeof(s5_ctx));
+    ctx->parser = (s5_ctx *)(ctx + 1);  /* Trails client_ctx in the tunnel block. */
     s5_init(ctx->parser);
     ctx->cipher = NULL;
     ctx->stage = tunnel_stage_handshake;
 
+    if (dest) {
+        *tunnel->desired_addr = *dest;
+        ctx->inbound = inbound_forward;
+    } else if (env->config->transparent_proxy && transparent_destination(tunnel, tunnel->desired_addr)) {
+        ctx->inbound = inbound_transparent;
+    }
+    if (ctx->inbound == inbound_transparent || ctx->inbound == inbound_forward) {
+        // The destination is known, no round trips before connecting. The read
+        // tunnel_initialize() starts brings the first payload, if the client speaks first.
+        // init_pkg waits for it, or for the wait to run out, see client_dest_package().
+        ctx->optimistic = true;
+        timer_wheel_entry_init(&ctx->optimistic_wait, &optimistic_wait_expire_cb);
+        timer_wheel_schedule(env->timer_wheel, &ctx->optimistic_wait, OPTIMISTIC_WAIT_MS);
+        ctx->stage = tunnel_stage_optimistic_payload;
+    }
+    if (tunnel->trace) {
+        tunnel_trace_stage(tunnel, tunnel_stage_names[ctx->stage]);
+    }
+
     return true;
 }
 
-void client_tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout) {
-    uv_loop_t *loop = lx->loop;
-    struct server_env_t *env = (struct server_env_t *)loop->data;
+static bool init_done_cb(struct tunnel_ctx *tunnel, void *p) {
+    struct server_env_t *env = (struct server_env_t *)p;
+    return client_ctx_setup(tunnel, env, env->tunnel_dest);
+}
+
+struct client_flow {
+    struct server_env_t *env;
+    const struct socks5_address *dest;
+};
+
+static bool flow_init_done_cb(struct tunnel_ctx *tunnel, void *p) {
+    struct client_flow *flow = (struct client_flow *)p;
+    return client_ctx_setup(tunnel, flow->env, flow->dest);
+}
 
-    tunnel_initialize(lx, idle_timeout, &init_done_cb, env);
+void client_tunnel_initialize(struct server_env_t *env, uv_tcp_t *lx) {
+    tunnel_initialize(lx, env->config->idle_timeout, env->read_buffer_pool, env->timer_wheel, sizeof(struct client_ctx) + sizeof(s5_ctx), &init_done_cb, env);
 }
 
-static void _do_shutdown_tunnel(const void *obj, void *p) {
-    tunnel_shutdown((struct tunnel_ctx *)obj);
+int client_tunnel_adopt(struct server_env_t *env, uv_tcp_t *lx, uv_os_sock_t sock, const struct socks5_address *dest) {
+    struct client_flow flow = { env, dest };
+    return tunnel_adopt(lx, sock, env->config->idle_timeout, env->read_buffer_pool, env->timer_wheel, sizeof(struct client_ctx) + sizeof(s5_ctx), &flow_init_done_cb, &flow);
+}
+
+static void _do_shutdown_tunnel(struct tunnel_ctx *tunnel, void *p) {
+    tunnel_shutdown(tunnel);
     (void)p;
 }
 
 void client_shutdown(struct server_env_t *env) {
-    cstl_set_container_traverse(env->tunnel_set, &_do_shutdown_tunnel, NULL);
+    mux_cli_destroy(env->mux_cli);
+    env->mux_cli = NULL;
+    warm_pool_destroy(env->warm_pool);
+    env->warm_pool = NULL;
+    server_probe_destroy(env->server_probe);
+    env->server_probe = NULL;
+    server_group_destroy(env->server_group);
+    env->server_group = NULL;
+    tunnel_list_traverse(env->tunnel_list, &_do_shutdown_tunnel, NULL);
+    // Before the fair queue, the held reads may still be handed to it.
+    read_coalescer_release(env->read_coalescer);
+    env->read_coalescer = NULL;
+    fair_queue_release(env->fair_queue);
+    env->fair_queue = NULL;
+    loop_watchdog_dump(env->watchdog);
+    loop_watchdog_release(env->watchdog);
+    env->watchdog = NULL;
+    tunnel_trace_shutdown(env->trace);
+    admission_shutdown(env->admission);
+    timer_wheel_release(env->timer_wheel);
+    env->timer_wheel = NULL;
+    remote_pool_destroy(env->remote_pool);
+    env->remote_pool = NULL;
+    tls_cli_pool_destroy(env->tls_cli_pool);
+    env->tls_cli_pool = NULL;
+    resolv_shutdown(env->resolver);
+    env->resolver = NULL;
 }
 
 static struct buffer_t * initial_package_create(const s5_ctx *parser) {
@@ -216,7 +403,29 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     case tunnel_stage_s5_udp_accoc:
         ASSERT(incoming->wrstate == socket_done);
         incoming->wrstate = socket_stop;
-        tunnel_shutdown(tunnel);
+        do_s5_udp_associated(tunnel);
+        break;
+    case tunnel_stage_s5_udp_associated:
+        // Nothing is meant to come, whatever does is dropped.
+        ASSERT(incoming->rdstate == socket_done);
+        incoming->rdstate = socket_stop;
+        socket_read(incoming, false);
+        break;
+    case tunnel_stage_http_request:
+        ASSERT(incoming->rdstate == socket_done);
+        incoming->rdstate = socket_stop;
+        do_http_request(tunnel);
+        break;
+    case tunnel_stage_acl_resolve_done:
+        do_acl_resolve_done(tunnel);
+        break;
+    case tunnel_stage_direct_connecting:
+        do_direct_connect_done(tunnel);
+        break;
+    case tunnel_stage_direct_payload_sent:
+        ASSERT(outgoing->wrstate == socket_done);
+        outgoing->wrstate = socket_stop;
+        do_direct_payload_sent(tunnel);
         break;
     case tunnel_stage_resolve_ssr_server_host_done:
         do_resolve_ssr_server_host_aftercare(tunnel);
@@ -241,20 +450,29 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
         outgoing->wrstate = socket_stop;
         do_socks5_reply_success(tunnel);
         break;
+    case tunnel_stage_optimistic_replied:
+        ASSERT(incoming->wrstate == socket_done);
+        incoming->wrstate = socket_stop;
+        do_optimistic_replied(tunnel);
+        break;
+    case tunnel_stage_optimistic_payload:
+        ASSERT(incoming->rdstate == socket_done);
+        incoming->rdstate = socket_stop;
+        do_optimistic_payload(tunnel);
+        break;
     case tunnel_stage_auth_complition_done:
         ASSERT(incoming->wrstate == socket_done);
         incoming->wrstate = socket_stop;
-        if (config->over_tls_enable) {
-            tunnel_tls_do_launch_streaming(tunnel);
-        } else {
-            do_launch_streaming(tunnel);
-        }
+        do_streaming_start(tunnel);
         break;
     case tunnel_stage_tls_streaming:
         tunnel_tls_client_incoming_streaming(tunnel, socket);
         break;
     case tunnel_stage_streaming:
-        tunnel_traditional_streaming(tunnel, socket);
+        tunnel_streaming(tunnel, socket);
+        break;
+    case tunnel_stage_mux_streaming:
+        tunnel_mux_streaming(tunnel, socket);
         break;
     case tunnel_stage_kill:
         tunnel_shutdown(tunnel);
@@ -262,6 +480,9 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     default:
         UNREACHABLE();
     }
+    if (tunnel->trace) {
+        tunnel_trace_stage(tunnel, tunnel_stage_names[ctx->stage]);
+    }
 }
 
 static void do_handshake(struct tunnel_ctx *tunnel) {
@@ -284,6 +505,12 @@ static void do_handshake(struct tunnel_ctx *tunnel) {
 
     data = (uint8_t *)incoming->buf->base;
     size = (size_t)incoming->result;
+    if (parser->state == s5_state_version && size > 0 && data[0] != 5) {
+        // Not SOCKS5, an HTTP CONNECT request then.
+        ctx->inbound = inbound_http_connect;
+        do_http_request(tunnel);
+        return;
+    }
     err = s5_parse(parser, &data, &size);
     if (err == s5_ok) {
         socket_read(incoming, true);
@@ -291,16 +518,6 @@ static void do_handshake(struct tunnel_ctx *tunnel) {
         return;
     }
 
-    if (size != 0) {
-        /* Could allow a round-trip saving shortcut here if the requested auth
-        * method is s5_auth_none (provided unauthenticated traffic is allowed.)
-        * Requires client support however.
-        */
-        pr_err("junk in handshake");
-        tunnel_shutdown(tunnel);
-        return;
-    }
-
     if (err != s5_auth_select) {
         pr_err("handshake error: %s", s5_strerror(err));
         tunnel_shutdown(tunnel);
@@ -310,11 +527,31 @@ static void do_handshake(struct tunnel_ctx *tunnel) {
     methods = s5_auth_methods(parser);
     if ((methods & s5_auth_none) && can_auth_none(tunnel->listener, tunnel)) {
         s5_select_auth(parser, s5_auth_none);
+        if (size != 0) {
+            // A client that doesn't wait for the method reply, the request follows in the
+            // same segment. Parse it now, saving the read of do_wait_s5_request().
+            if (size > 3) {
+                socks5_address_parse(data + 3, size - 3, tunnel->desired_addr);
+            }
+            err = s5_parse(parser, &data, &size);
+            if (size != 0 || (err != s5_ok && err != s5_exec_cmd)) {
+                pr_err("junk in handshake");
+                tunnel_shutdown(tunnel);
+                return;
+            }
+            ctx->s5_request_ready = (err == s5_exec_cmd);
+        }
         socket_write(incoming, "\5\0", 2);  /* No auth required. */
         ctx->stage = tunnel_stage_handshake_replied;
         return;
     }
 
+    if (size != 0) {
+        pr_err("junk in handshake");
+        tunnel_shutdown(tunnel);
+        return;
+    }
+
     if ((methods & s5_auth_passwd) && can_auth_passwd(tunnel->listener, tunnel)) {
         /* TODO(bnoordhuis) Implement username/password auth. */
         tunnel_shutdown(tunnel);
@@ -344,6 +581,10 @@ static void do_wait_s5_request(struct tunnel_ctx *tunnel) {
         return;
     }
 
+    if (ctx->s5_request_ready) {
+        do_s5_request_exec(tunnel);
+        return;
+    }
     socket_read(incoming, true);
     ctx->stage = tunnel_stage_s5_request;
 }
@@ -394,6 +635,23 @@ static void do_parse_s5_request(struct tunnel_ctx *tunnel) {
         return;
     }
 
+    do_s5_request_exec(tunnel);
+}
+
+/* |parser| holds a complete request. */
+static void do_s5_request_exec(struct tunnel_ctx *tunnel) {
+    struct socket_ctx *incoming = tunnel->incoming;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    s5_ctx *parser = ctx->parser;
+    struct server_env_t *env = ctx->env;
+    struct server_config *config = env->config;
+
+    ASSERT(incoming->rdstate == socket_stop);
+    ASSERT(incoming->wrstate == socket_stop);
+    ASSERT(outgoing->rdstate == socket_stop);
+    ASSERT(outgoing->wrstate == socket_stop);
+
     if (parser->cmd == s5_cmd_tcp_bind) {
         /* Not supported but relatively straightforward to implement. */
         pr_warn("BIND requests are not supported.");
@@ -402,10 +660,26 @@ static void do_parse_s5_request(struct tunnel_ctx *tunnel) {
     }
 
     if (parser->cmd == s5_cmd_udp_assoc) {
-        // UDP ASSOCIATE requests
-        size_t len = incoming->buf->len;
-        uint8_t *buf = build_udp_assoc_package(config->udp, config->listen_host, config->listen_port,
-            (uint8_t *)incoming->buf->base, &len);
+        // UDP ASSOCIATE requests. The relay shares the port of the listener,
+        // the reply names the address the client reached it at, not a wildcard.
+        uint8_t reply[32];
+        size_t len = sizeof(reply);
+        union sockaddr_universal local = { 0 };
+        int local_len = sizeof(local);
+        char host[INET6_ADDRSTRLEN] = { 0 };
+        const char *bound_host = config->listen_host;
+        int bound_port = config->listen_port;
+        uint8_t *buf;
+        if (uv_tcp_getsockname(&incoming->handle.tcp, &local.addr, &local_len) == 0) {
+            universal_address_unmap(&local);
+            bound_host = universal_address_to_string(&local, host, sizeof(host));
+            bound_port = universal_address_port(&local);
+        }
+        buf = build_udp_assoc_package(config->udp, bound_host, bound_port, reply, &len);
+        if (buf == NULL) {
+            tunnel_shutdown(tunnel);
+            return;
+        }
         socket_write(incoming, buf, len);
         ctx->stage = tunnel_stage_s5_udp_accoc;
         return;
@@ -414,27 +688,557 @@ static void do_parse_s5_request(struct tunnel_ctx *tunnel) {
     ASSERT(parser->cmd == s5_cmd_tcp_connect);
 
     ctx->init_pkg = initial_package_create(parser);
-    ctx->cipher = tunnel_cipher_create(ctx->env, 1452);
+    do_tcp_connect_request(tunnel);
+}
+
+/*
+ * RFC 1928: the association ends when the TCP connection that asked for
+ * it does, so that is held open with no idle timeout until the client
+ * closes it. The datagrams themselves go through the UDP relay of the
+ * listener and expire there on their own.
+ */
+static void do_s5_udp_associated(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+
+    if (ctx->env->config->udp == false) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    tunnel_admission_streaming(ctx);
+    ctx->stage = tunnel_stage_s5_udp_associated;
+    socket_read(incoming, false);
+}
+
+/* "host:port", or "[v6]:port", of a CONNECT request line. */
+static bool http_connect_target(const char *target, size_t len, struct socks5_address *addr) {
+    char host[0x100];
+    const char *colon = NULL;
+    const char *iter;
+    size_t host_len;
+    unsigned long port = 0;
+
+    for (iter = target + len; iter > target; --iter) {
+        if (iter[-1] == ':') {
+            colon = iter - 1;
+            break;
+        }
+    }
+    if (colon == NULL || colon + 1 == target + len) {
+        return false;
+    }
+    for (iter = colon + 1; iter < target + len; ++iter) {
+        if (*iter < '0' || *iter > '9' || (port = port * 10 + (unsigned long)(*iter - '0')) > 0xFFFF) {
+            return false;
+        }
+    }
+    host_len = (size_t)(colon - target);
+    if (host_len >= 2 && target[0] == '[' && colon[-1] == ']') {
+        ++target;
+        host_len -= 2;
+    }
+    if (port == 0 || host_len == 0 || host_len >= sizeof(host)) {
+        return false;
+    }
+    memcpy(host, target, host_len);
+    host[host_len] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    if (uv_inet_pton(AF_INET, host, &addr->addr.ipv4) == 0) {
+        addr->addr_type = SOCKS5_ADDRTYPE_IPV4;
+    } else if (uv_inet_pton(AF_INET6, host, &addr->addr.ipv6) == 0) {
+        addr->addr_type = SOCKS5_ADDRTYPE_IPV6;
+    } else {
+        addr->addr_type = SOCKS5_ADDRTYPE_DOMAINNAME;
+        memcpy(addr->addr.domainname, host, host_len + 1);
+    }
+    addr->port = (uint16_t)port;
+    return true;
+}
+
+/* Everything up to the blank line, read in as many segments as it takes. */
+static void do_http_request(struct tunnel_ctx *tunnel) {
+    struct socket_ctx *incoming = tunnel->incoming;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct buffer_t *req;
+    const char *head, *target, *target_end, *line_end;
+    size_t len, end = 0, i;
+
+    ASSERT(incoming->rdstate == socket_stop);
+    ASSERT(incoming->wrstate == socket_stop);
+
+    if (ctx->http_request == NULL) {
+        ctx->http_request = buffer_create(SSR_BUFF_SIZE);
+    }
+    req = ctx->http_request;
+    buffer_concatenate(req, (const uint8_t *)incoming->buf->base, (size_t)incoming->result);
+    head = (const char *)req->buffer;
+    len = req->len;
+
+    for (i = 4; i <= len; ++i) {
+        if (memcmp(head + i - 4, "\r\n\r\n", 4) == 0) {
+            end = i;
+            break;
+        }
+    }
+    if (end == 0) {
+        if (len >= HTTP_REQUEST_MAX) {
+            pr_err("HTTP request too long");
+            do_http_reply_error(tunnel, "HTTP/1.1 431 Request Header Fields Too Large");
+            return;
+        }
+        socket_read(incoming, true);
+        ctx->stage = tunnel_stage_http_request;  /* Need more data. */
+        return;
+    }
+
+    if (len < 8 || memcmp(head, "CONNECT ", 8) != 0) {
+        // Plain requests to proxy would need the HTTP parsing of a real proxy.
+        do_http_reply_error(tunnel, "HTTP/1.1 405 Method Not Allowed\r\nAllow: CONNECT");
+        return;
+    }
+    line_end = (const char *)memchr(head, '\r', end);
+    target = head + 8;
+    target_end = (const char *)memchr(target, ' ', (size_t)(line_end - target));
+    if (target_end == NULL || http_connect_target(target, (size_t)(target_end - target), tunnel->desired_addr) == false) {
+        pr_err("bad HTTP CONNECT request");
+        do_http_reply_error(tunnel, "HTTP/1.1 400 Bad Request");
+        return;
+    }
+
+    ctx->init_pkg = buffer_create(SSR_BUFF_SIZE);
+    socks5_address_binary(tunnel->desired_addr, ctx->init_pkg->buffer, SSR_BUFF_SIZE);
+    ctx->init_pkg->len = socks5_address_size(tunnel->desired_addr);
+    if (len > end) {
+        // Sent without waiting for the reply, it goes with the SSR header.
+        if (ctx->init_pkg->len + (len - end) > SSR_BUFF_SIZE) {
+            do_http_reply_error(tunnel, "HTTP/1.1 400 Bad Request");
+            return;
+        }
+        buffer_concatenate(ctx->init_pkg, req->buffer + end, len - end);
+    }
+    buffer_release(req);
+    ctx->http_request = NULL;
+
+    do_tcp_connect_request(tunnel);
+}
+
+/* |status| without the line break, the connection closes after it. */
+static void do_http_reply_error(struct tunnel_ctx *tunnel, const char *status) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    char reply[128];
+    int len = snprintf(reply, sizeof(reply), "%s\r\nConnection: close\r\n\r\n", status);
+
+    socket_write(tunnel->incoming, reply, (size_t)len);
+    ctx->stage = tunnel_stage_kill;
+}
+
+/* |init_pkg| holds the SSR header, maybe with the first payload after it. */
+static void do_tcp_connect_request(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+
+    tunnel_mark_phase(tunnel, tunnel_phase_handshake);
+
+    if (ctx->env->fake_dns && tunnel->desired_addr->addr_type == SOCKS5_ADDRTYPE_IPV4) {
+        char name[0x0100];
+        int found = fake_dns_lookup(ctx->env->fake_dns, &tunnel->desired_addr->addr.ipv4, name, sizeof(name));
+        if (found < 0) {
+            // Recycled since the client was told, or from before a restart.
+            pr_warn("stale fake address, no name for it");
+            do_socks5_reply_error(tunnel, "\5\4\0\1\0\0\0\0\0\0");
+            return;
+        }
+        if (found > 0) {
+            set_destination_name(tunnel, name);
+        }
+    }
+
+    if (ctx->env->config->acl) {
+        do_acl_route(tunnel, false);
+        return;
+    }
+    do_proxy_connect_request(tunnel);
+}
+
+/*
+ * The rules of ss-local: a listed name decides, otherwise the address it
+ * resolves to. An address to port 80 or 443 goes by the name in its first
+ * payload if that is listed, else by the address itself, no lookup either
+ * way. |timed_out| when the payload waited for didn't come.
+ */
+static void do_acl_route(struct tunnel_ctx *tunnel, bool timed_out) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    struct socks5_address *dest = tunnel->desired_addr;
+    char host[0x0100 + 1] = { 0 };
+    char name[0x0100] = { 0 };
+    int match;
+
+    if (dest->addr_type != SOCKS5_ADDRTYPE_DOMAINNAME && (dest->port == 80 || dest->port == 443)) {
+        int len = do_acl_sniff(tunnel, name, sizeof(name), timed_out);
+        if (len == SNIFF_NEED_MORE) {
+            return;
+        }
+        if (len > 0) {
+            if (outbound_block_match_host(name) == 1) {
+                pr_warn("outbound blocked %s", name);
+                do_socks5_reply_error(tunnel, "\5\2\0\1\0\0\0\0\0\0");
+                return;
+            }
+            match = acl_match_host(name);
+            if (match > 0) {
+                set_destination_name(tunnel, name);
+                do_proxy_connect_request(tunnel);
+                return;
+            }
+            if (match < 0) {
+                socks5_address_to_universal(dest, &outgoing->addr);
+                do_direct_connect(tunnel);
+                return;
+            }
+        } else {
+            name[0] = '\0';
+        }
+    }
+
+    socks5_address_to_string(dest, host, sizeof(host));
+    if (outbound_block_match_host(host) == 1) {
+        pr_warn("outbound blocked %s", host);
+        /* Send a 'Connection not allowed by ruleset' reply. */
+        do_socks5_reply_error(tunnel, "\5\2\0\1\0\0\0\0\0\0");
+        return;
+    }
+    match = acl_match_host(host);
+    if (match > 0) {
+        set_destination_name(tunnel, name);
+        do_proxy_connect_request(tunnel);
+        return;
+    }
+    if (dest->addr_type == SOCKS5_ADDRTYPE_DOMAINNAME) {
+        // Bypassed already when the name is listed, else up to its address.
+        ctx->direct = (match < 0);
+        outgoing->addr.addr4.sin_port = htons(dest->port);
+        tunnel->stage_timeout = ctx->env->config->connect_timeout;
+        socket_getaddrinfo(outgoing, host);
+        ctx->stage = tunnel_stage_acl_resolve_done;
+        return;
+    }
+    if (match < 0 || get_acl_mode() == BLACK_LIST) {
+        socks5_address_to_universal(dest, &outgoing->addr);
+        do_direct_connect(tunnel);
+        return;
+    }
+    set_destination_name(tunnel, name);
+    do_proxy_connect_request(tunnel);
+}
+
+/*
+ * The name in the payload after the header of |init_pkg|, SNIFF_NEED_MORE
+ * while waiting for it. A SOCKS5 client sends nothing before the reply, so
+ * that goes out first, as with optimistic_reply.
+ */
+static int do_acl_sniff(struct tunnel_ctx *tunnel, char *name, size_t size, bool timed_out) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct buffer_t *init_pkg = ctx->init_pkg;
+    size_t head_len = get_s5_head_size(init_pkg->buffer, init_pkg->len, init_pkg->len);
+    const uint8_t *payload = init_pkg->buffer + head_len;
+    size_t len = (init_pkg->len > head_len) ? init_pkg->len - head_len : 0;
+    int ret;
+
+    ctx->sniffing = false;
+    if (len == 0 && timed_out == false && ctx->optimistic == false && ctx->inbound == inbound_socks5) {
+        do_socks5_reply_success(tunnel);
+        ctx->optimistic = true;
+        ctx->sniffing = true;
+        ctx->stage = tunnel_stage_optimistic_replied;
+        return SNIFF_NEED_MORE;
+    }
+    if (tunnel->desired_addr->port == 443) {
+        ret = sniff_tls_server_name(payload, len, name, size);
+    } else {
+        ret = sniff_http_host(payload, len, name, size);
+    }
+    if (ret == SNIFF_NEED_MORE && len > 0 && timed_out == false && ctx->optimistic && init_pkg->len < SSR_BUFF_SIZE) {
+        // Split over segments, a ClientHello with a big key share is.
+        ctx->sniffing = true;
+        socket_read(tunnel->incoming, false);
+        timer_wheel_entry_init(&ctx->optimistic_wait, &optimistic_wait_expire_cb);
+        timer_wheel_schedule(tunnel->timer_wheel, &ctx->optimistic_wait, OPTIMISTIC_WAIT_MS);
+        ctx->stage = tunnel_stage_optimistic_payload;
+        return SNIFF_NEED_MORE;
+    }
+    return (ret == SNIFF_NEED_MORE) ? SNIFF_NONE : ret;
+}
+
+/*
+ * Proxied by |name|, a sniffed or fake DNS one, so the SSR server connects
+ * to that as ss-local does. False when it's empty or doesn't fit.
+ */
+static bool set_destination_name(struct tunnel_ctx *tunnel, const char *name) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socks5_address *dest = tunnel->desired_addr;
+    struct buffer_t *init_pkg = ctx->init_pkg;
+    size_t head_len, name_len = strlen(name);
+    struct buffer_t *rebuilt;
+
+    if (name_len == 0) {
+        return false;
+    }
+    head_len = get_s5_head_size(init_pkg->buffer, init_pkg->len, init_pkg->len);
+    if (head_len > init_pkg->len || init_pkg->len - head_len + name_len + 4 > SSR_BUFF_SIZE) {
+        return false;
+    }
+    dest->addr_type = SOCKS5_ADDRTYPE_DOMAINNAME;
+    memcpy(dest->addr.domainname, name, name_len + 1);
+
+    rebuilt = buffer_create(SSR_BUFF_SIZE);
+    socks5_address_binary(dest, rebuilt->buffer, SSR_BUFF_SIZE);
+    rebuilt->len = socks5_address_size(dest);
+    buffer_concatenate(rebuilt, init_pkg->buffer + head_len, init_pkg->len - head_len);
+    buffer_release(init_pkg);
+    ctx->init_pkg = rebuilt;
+    return true;
+}
+
+static void do_acl_resolve_done(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    char ip[INET6_ADDRSTRLEN + 1] = { 0 };
+    int match;
+
+    if (outgoing->result < 0) {
+        pr_err("lookup error for \"%s\": %s",
+            tunnel->desired_addr->addr.domainname,
+            uv_strerror((int)outgoing->result));
+        /* Send back a 'Host unreachable' reply. */
+        do_socks5_reply_error(tunnel, "\5\4\0\1\0\0\0\0\0\0");
+        return;
+    }
+    if (ctx->direct == false) {
+        universal_address_to_string(&outgoing->addr, ip, sizeof(ip));
+        if (outbound_block_match_host(ip) == 1) {
+            pr_warn("outbound blocked %s", ip);
+            do_socks5_reply_error(tunnel, "\5\2\0\1\0\0\0\0\0\0");
+            return;
+        }
+        match = acl_match_host(ip);
+        if (match > 0 || (match == 0 && get_acl_mode() != BLACK_LIST)) {
+            // The destination's candidates must not race the SSR server's.
+            socket_set_candidates(outgoing, &outgoing->addr, 1);
+            do_proxy_connect_request(tunnel);
+            return;
+        }
+    }
+    do_direct_connect(tunnel);
+}
+
+/* |outgoing| holds the destination's address, or its candidates. */
+static void do_direct_connect(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    int err;
+
+    if (!can_access(tunnel->listener, tunnel, &outgoing->addr.addr)) {
+        pr_warn("connection not allowed by ruleset");
+        /* Send a 'Connection not allowed by ruleset' reply. */
+        do_socks5_reply_error(tunnel, "\5\2\0\1\0\0\0\0\0\0");
+        return;
+    }
+
+    ctx->direct = true;
+    tunnel_mark_phase(tunnel, tunnel_phase_resolve);
+    tunnel->stage_timeout = ctx->env->config->connect_timeout;
+    err = socket_connect(outgoing);
+    if (err != 0) {
+        pr_err("connect error: %s", uv_strerror(err));
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    ctx->stage = tunnel_stage_direct_connecting;
+}
+
+static void do_direct_connect_done(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    struct buffer_t *init_pkg = ctx->init_pkg;
+    size_t head_len;
+
+    ASSERT(outgoing->rdstate == socket_stop);
+    ASSERT(outgoing->wrstate == socket_stop);
+
+    if (outgoing->result != 0) {
+        socket_dump_error_info("direct connection", outgoing);
+        /* Send a 'Connection refused' reply. */
+        do_socks5_reply_error(tunnel, "\5\5\0\1\0\0\0\0\0\0");
+        return;
+    }
+    tunnel_mark_phase(tunnel, tunnel_phase_connect);
+    tunnel->stage_timeout = ctx->env->config->handshake_timeout;
+
+    head_len = get_s5_head_size(init_pkg->buffer, init_pkg->len, init_pkg->len);
+    if (init_pkg->len > head_len) {
+        // Sent ahead of the reply, by HTTP CONNECT or a transparent client.
+        socket_write(outgoing, init_pkg->buffer + head_len, init_pkg->len - head_len);
+        ctx->stage = tunnel_stage_direct_payload_sent;
+        return;
+    }
+    do_socks5_reply_success(tunnel);
+}
+
+static void do_direct_payload_sent(struct tunnel_ctx *tunnel) {
+    struct socket_ctx *outgoing = tunnel->outgoing;
+
+    if (outgoing->result < 0) {
+        pr_err("write error: %s", uv_strerror((int)outgoing->result));
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    do_socks5_reply_success(tunnel);
+}
+
+static void do_proxy_connect_request(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct server_env_t *env = ctx->env;
+    struct server_config *config = env->config;
 
     {
-        struct obfs_t *protocol = ctx->cipher->protocol;
-        struct obfs_t *obfs = ctx->cipher->obfs;
-        struct server_info_t *info;
-        info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
-        if (info) {
-            info->buffer_size = SSR_BUFF_SIZE;
-            info->head_len = (int) get_s5_head_size(ctx->init_pkg->buffer, ctx->init_pkg->len, 30);
+        // A stream opens with the header alone, the payload is stream data.
+        struct buffer_t *init_pkg = ctx->init_pkg;
+        size_t head_len = get_s5_head_size(init_pkg->buffer, init_pkg->len, init_pkg->len);
+        struct buffer_t *target = buffer_create_from(init_pkg->buffer, head_len < init_pkg->len ? head_len : init_pkg->len);
+        ctx->mux_stream = mux_cli_open(env->mux_cli, target, &mux_stream_cb, tunnel);
+        buffer_release(target);
+        if (ctx->mux_stream && init_pkg->len > head_len) {
+            mux_stream_send(ctx->mux_stream, init_pkg->buffer + head_len, init_pkg->len - head_len);
         }
     }
+    if (ctx->mux_stream) {
+        // The session is connected, or will be. Reply right away.
+        ctx->muxed = true;
+        do_socks5_reply_success(tunnel);
+        return;
+    }
 
     if (config->over_tls_enable) {
         ctx->stage = tunnel_stage_tls_connecting;
-        tls_client_launch(tunnel, config);
+        tls_client_launch(tunnel, env);
+        return;
+    }
+    if (config->optimistic_reply && ctx->optimistic == false) {
+        do_socks5_reply_success(tunnel);
+        ctx->optimistic = true;
+        ctx->stage = tunnel_stage_optimistic_replied;
+        return;
+    }
+    do_connect_ssr_server_start(tunnel);
+}
+
+/* The SSR header of the destination known on accept, made once something is to go out. */
+static void client_dest_package(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    if (ctx->init_pkg == NULL) {
+        ctx->init_pkg = buffer_create(SSR_BUFF_SIZE);
+        socks5_address_binary(tunnel->desired_addr, ctx->init_pkg->buffer, SSR_BUFF_SIZE);
+        ctx->init_pkg->len = socks5_address_size(tunnel->desired_addr);
+    }
+}
+
+/* Made on the first connection to the server that will carry the tunnel, not for the ones that fail before. */
+static void client_cipher_prepare(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct obfs_t *protocol, *obfs;
+    struct server_info_t *info;
+
+    if (ctx->cipher) {
+        return;
+    }
+    ctx->cipher = tunnel_cipher_create(ctx->env, 1452);
+    ctx->cipher->trace = tunnel->trace;
+    ctx->cipher->trace_id = tunnel->trace_id;
+
+    protocol = ctx->cipher->protocol;
+    obfs = ctx->cipher->obfs;
+    info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
+    if (info) {
+        info->buffer_size = SSR_BUFF_SIZE;
+        info->head_len = (int) get_s5_head_size(ctx->init_pkg->buffer, ctx->init_pkg->len, 30);
+    }
+}
+
+static void optimistic_wait_expire_cb(struct timer_wheel_entry *entry) {
+    struct client_ctx *ctx = CONTAINER_OF(entry, struct client_ctx, optimistic_wait);
+    struct tunnel_ctx *tunnel = ctx->tunnel;
+
+    if (tunnel->terminated || ctx->stage != tunnel_stage_optimistic_payload) {
+        return;
+    }
+    // Nothing yet, the server speaks first. Connect with the bare header.
+    socket_read_stop(tunnel->incoming);
+    client_dest_package(tunnel);
+    if (ctx->sniffing) {
+        do_acl_route(tunnel, true);
+    } else if (ctx->inbound == inbound_transparent || ctx->inbound == inbound_forward) {
+        do_tcp_connect_request(tunnel);
+    } else {
+        do_connect_ssr_server_start(tunnel);
+    }
+}
+
+static void do_optimistic_replied(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+
+    if (incoming->result < 0) {
+        pr_err("write error: %s", uv_strerror((int)incoming->result));
+        tunnel_shutdown(tunnel);
         return;
-    } else
+    }
+    // The wait has its own short timer, not the idle timeout.
+    socket_read(incoming, false);
+    timer_wheel_entry_init(&ctx->optimistic_wait, &optimistic_wait_expire_cb);
+    timer_wheel_schedule(tunnel->timer_wheel, &ctx->optimistic_wait, OPTIMISTIC_WAIT_MS);
+    ctx->stage = tunnel_stage_optimistic_payload;
+}
+
+static void do_optimistic_payload(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+
+    timer_wheel_cancel(&ctx->optimistic_wait);
+    client_dest_package(tunnel);
+    // tunnel_get_alloc_size() keeps the header and the payload in one SSR_BUFF_SIZE.
+    buffer_concatenate(ctx->init_pkg, (const uint8_t *)incoming->buf->base, (size_t)incoming->result);
+    if (ctx->sniffing) {
+        do_acl_route(tunnel, false);
+    } else if (ctx->inbound == inbound_transparent || ctx->inbound == inbound_forward) {
+        do_tcp_connect_request(tunnel);
+    } else {
+        do_connect_ssr_server_start(tunnel);
+    }
+}
+
+static void do_connect_ssr_server_start(struct tunnel_ctx *tunnel) {
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct server_env_t *env = ctx->env;
+    struct server_config *config = env->config;
+
+    tunnel->stage_timeout = config->connect_timeout;
     {
         union sockaddr_universal remote_addr = { 0 };
+        union sockaddr_universal addrs[REMOTE_POOL_MAX_ADDRS];
+        size_t count = env->server_group ?
+            server_group_candidates(env->server_group, tunnel->desired_addr, addrs, REMOTE_POOL_MAX_ADDRS) :
+            remote_pool_candidates(env->remote_pool, addrs, REMOTE_POOL_MAX_ADDRS);
+        if (count > 0) {
+            socket_set_candidates(outgoing, addrs, count);
+            do_connect_ssr_server(tunnel);
+            return;
+        }
+        // Only before the pool's first answer, or for a name it can't resolve.
         if (convert_universal_address(config->remote_host, config->remote_port, &remote_addr) != 0) {
+            // Every candidate the resolver hands back carries this port.
+            outgoing->addr.addr4.sin_port = htons(config->remote_port);
             socket_getaddrinfo(outgoing, config->remote_host);
             ctx->stage = tunnel_stage_resolve_ssr_server_host_done;
             return;
@@ -464,22 +1268,12 @@ static void do_resolve_ssr_server_host_aftercare(struct tunnel_ctx *tunnel) {
             config->remote_host,
             uv_strerror((int)outgoing->result));
         /* Send back a 'Host unreachable' reply. */
-        socket_write(incoming, "\5\4\0\1\0\0\0\0\0\0", 10);
-        ctx->stage = tunnel_stage_kill;
+        do_socks5_reply_error(tunnel, "\5\4\0\1\0\0\0\0\0\0");
         return;
     }
 
-    /* Don't make assumptions about the offset of sin_port/sin6_port. */
-    switch (outgoing->addr.addr.sa_family) {
-    case AF_INET:
-        outgoing->addr.addr4.sin_port = htons(config->remote_port);
-        break;
-    case AF_INET6:
-        outgoing->addr.addr6.sin6_port = htons(config->remote_port);
-        break;
-    default:
-        UNREACHABLE();
-    }
+    ASSERT(outgoing->addr.addr.sa_family == AF_INET || outgoing->addr.addr.sa_family == AF_INET6);
+    universal_address_set_port(&outgoing->addr, config->remote_port);
 
     do_connect_ssr_server(tunnel);
 }
@@ -500,11 +1294,26 @@ static void do_connect_ssr_server(struct tunnel_ctx *tunnel) {
     if (!can_access(tunnel->listener, tunnel, &outgoing->addr.addr)) {
         pr_warn("connection not allowed by ruleset");
         /* Send a 'Connection not allowed by ruleset' reply. */
-        socket_write(incoming, "\5\2\0\1\0\0\0\0\0\0", 10);
-        ctx->stage = tunnel_stage_kill;
+        do_socks5_reply_error(tunnel, "\5\2\0\1\0\0\0\0\0\0");
+        return;
+    }
+
+    tunnel_mark_phase(tunnel, tunnel_phase_resolve);
+    ctx->connect_start = uv_hrtime();
+
+    // Warm connections go to remote_host, not to the server the policy picked.
+    if (server_group_member(ctx->env->server_group, &outgoing->addr) <= 0 &&
+        warm_pool_take(ctx->env->warm_pool, outgoing))
+    {
+        // Connected already, the SSR header goes out right away.
+        ctx->stage = tunnel_stage_connecting_ssr_server;
+        outgoing->result = 0;
+        do_connect_ssr_server_done(tunnel);
         return;
     }
 
+    // Only to the server, it's the one that can take the subflows over WiFi and LTE.
+    tunnel->mptcp = config->mptcp;
     err = socket_connect(outgoing);
     if (err != 0) {
         pr_err("connect error: %s", uv_strerror(err));
@@ -527,21 +1336,23 @@ static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel) {
 
     if (outgoing->result == 0) {
         struct buffer_t *tmp = buffer_clone(ctx->init_pkg);
+        tunnel_mark_phase(tunnel, tunnel_phase_connect);
+        tunnel->stage_timeout = ctx->env->config->handshake_timeout;
+        report_ssr_server(tunnel, true);
+        client_cipher_prepare(tunnel);
         if (ssr_ok != tunnel_cipher_client_encrypt(ctx->cipher, tmp)) {
             buffer_release(tmp);
             tunnel_shutdown(tunnel);
             return;
         }
-        socket_write(outgoing, tmp->buffer, tmp->len);
-        buffer_release(tmp);
+        socket_write_buffer(outgoing, tmp);
 
         ctx->stage = tunnel_stage_ssr_auth_sent;
         return;
     } else {
         socket_dump_error_info("upstream connection", outgoing);
         /* Send a 'Connection refused' reply. */
-        socket_write(incoming, "\5\5\0\1\0\0\0\0\0\0", 10);
-        ctx->stage = tunnel_stage_kill;
+        do_socks5_reply_error(tunnel, "\5\5\0\1\0\0\0\0\0\0");
         return;
     }
 
@@ -600,9 +1411,8 @@ static bool do_ssr_receipt_for_feedback(struct tunnel_ctx *tunnel) {
     ASSERT(buf->len == 0);
 
     if (feedback) {
-        socket_write(outgoing, feedback->buffer, feedback->len);
+        socket_write_buffer(outgoing, feedback);
         ctx->stage = tunnel_stage_ssr_receipt_of_feedback_sent;
-        buffer_release(feedback);
         done = true;
     }
 
@@ -610,12 +1420,41 @@ static bool do_ssr_receipt_for_feedback(struct tunnel_ctx *tunnel) {
     return done;
 }
 
+/* |reply| is one of the 10 byte SOCKS5 failures, HTTP clients get a 502. */
+static void do_socks5_reply_error(struct tunnel_ctx *tunnel, const char *reply) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+
+    if (ctx->optimistic) {
+        // Success went out already, a reset is all that's left to say.
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    if (ctx->inbound == inbound_http_connect) {
+        do_http_reply_error(tunnel, "HTTP/1.1 502 Bad Gateway");
+        return;
+    }
+    socket_write(tunnel->incoming, reply, 10);
+    ctx->stage = tunnel_stage_kill;
+}
+
 static void do_socks5_reply_success(struct tunnel_ctx *tunnel) {
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
     struct socket_ctx *incoming = tunnel->incoming;
     struct socket_ctx *outgoing = tunnel->outgoing;
     uint8_t *buf;
     struct buffer_t *init_pkg = ctx->init_pkg;
+
+    if (ctx->optimistic) {
+        // Replied before connecting, or nothing to reply. Straight on to streaming.
+        do_streaming_start(tunnel);
+        return;
+    }
+    if (ctx->inbound == inbound_http_connect) {
+        static const char established[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+        socket_write(incoming, established, sizeof(established) - 1);
+        ctx->stage = tunnel_stage_auth_complition_done;
+        return;
+    }
     buf = (uint8_t *)calloc(3 + init_pkg->len, sizeof(uint8_t));
 
     ASSERT(incoming->rdstate == socket_stop);
@@ -632,6 +1471,22 @@ static void do_socks5_reply_success(struct tunnel_ctx *tunnel) {
     ctx->stage = tunnel_stage_auth_complition_done;
 }
 
+/* The reply, if any, is out. */
+static void do_streaming_start(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+
+    tunnel->stage_timeout = 0;
+    if (ctx->direct) {
+        do_launch_streaming(tunnel);
+    } else if (ctx->env->config->over_tls_enable) {
+        tunnel_tls_do_launch_streaming(tunnel);
+    } else if (ctx->muxed) {
+        tunnel_mux_do_launch_streaming(tunnel);
+    } else {
+        do_launch_streaming(tunnel);
+    }
+}
+
 static void do_launch_streaming(struct tunnel_ctx *tunnel) {
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
     struct socket_ctx *incoming = tunnel->incoming;
@@ -651,22 +1506,26 @@ static void do_launch_streaming(struct tunnel_ctx *tunnel) {
     socket_read(incoming, false);
     socket_read(outgoing, true);
     ctx->stage = tunnel_stage_streaming;
+    tunnel_admission_streaming(ctx);
 }
 
-static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size) {
+static struct buffer_t * tunnel_extract_data(struct socket_ctx *socket) {
     struct tunnel_ctx *tunnel = socket->tunnel;
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
     struct tunnel_cipher_ctx *cipher_ctx = ctx->cipher;
     enum ssr_error error = ssr_error_client_decode;
     struct buffer_t *buf = NULL;
-    uint8_t *result = NULL;
 
-    if (socket==NULL || allocator==NULL || size==NULL) {
-        return result;
+    if (ctx->direct) {
+        // Bypassed, passed on as it is.
+        return buffer_create_from((uint8_t *)socket->buf->base, (size_t)socket->result);
     }
-    *size = 0;
-
-    buf = buffer_create_from((uint8_t *)socket->buf->base, (size_t)socket->result);
+    if (socket == tunnel->incoming) {
+        buf = buffer_create_with_headroom(tunnel_cipher_headroom(cipher_ctx), max((size_t)socket->result, (size_t)SSR_BUFF_SIZE));
+    } else {
+        buf = buffer_create(SSR_BUFF_SIZE);
+    }
+    buffer_store(buf, (uint8_t *)socket->buf->base, (size_t)socket->result);
 
     if (socket == tunnel->incoming) {
         error = tunnel_cipher_client_encrypt(cipher_ctx, buf);
@@ -681,27 +1540,61 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
         ASSERT(false);
     }
 
-    if (error == ssr_ok) {
-        size_t len = buf->len;
-        *size = len;
-        result = (uint8_t *)allocator(len + 1);
-        memcpy(result, buf->buffer, len);
+    if (error != ssr_ok) {
+        buffer_release(buf);
+        buf = NULL;
     }
-
-    buffer_release(buf);
-    return result;
+    return buf;
 }
 
 static void tunnel_dying(struct tunnel_ctx *tunnel) {
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
 
-    cstl_set_container_remove(ctx->env->tunnel_set, tunnel);
+    tunnel_list_remove(&ctx->env->tunnel_list, tunnel);
+    if (ctx->admission.counted) {
+        admission_tunnel_closed(ctx->env->admission, &ctx->admission);
+    }
+    timer_wheel_cancel(&ctx->optimistic_wait);
+    if (ctx->mux_stream) {
+        mux_stream_close(ctx->mux_stream, false);
+        ctx->mux_stream = NULL;
+    }
+    buffer_release(ctx->mux_pending);
+    if (ctx->stage == tunnel_stage_connecting_ssr_server && tunnel->outgoing->result < 0) {
+        // Refused or timed out, the next tunnels lead with another address.
+        report_ssr_server(tunnel, false);
+    }
     if (ctx->cipher) {
         tunnel_cipher_release(ctx->cipher);
     }
     buffer_release(ctx->init_pkg);
-    free(ctx->parser);
-    free(ctx);
+    buffer_release(ctx->http_request);
+}
+
+/* Past the handshake, no longer shed when the loop is overloaded. */
+static void tunnel_admission_streaming(struct client_ctx *ctx) {
+    if (ctx->admission.handshaking) {
+        admission_tunnel_authenticated(ctx->env->admission, &ctx->admission);
+    }
+}
+
+static void tunnel_idle_trim(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    tunnel_cipher_trim(ctx->cipher);
+    if (tunnel->tls_ctx) {
+        tls_client_trim(tunnel);
+    }
+}
+
+static void report_ssr_server(struct tunnel_ctx *tunnel, bool reachable) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    const union sockaddr_universal *addr = &tunnel->outgoing->addr;
+
+    if (ctx->env->server_group) {
+        server_group_report(ctx->env->server_group, addr, reachable, (uv_hrtime() - ctx->connect_start) / 1000);
+    } else {
+        remote_pool_report(ctx->env->remote_pool, addr, reachable);
+    }
 }
 
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
@@ -714,6 +1607,10 @@ static void tunnel_outgoing_connected_done(struct tunnel_ctx *tunnel, struct soc
 }
 
 static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    if (ctx->stage == tunnel_stage_streaming && socket == tunnel->incoming) {
+        socket_adapt_read_size(&ctx->_incoming_read_size, socket, SSR_BUFF_SIZE, TCP_READ_SIZE_MAX);
+    }
     do_next(tunnel, socket);
 }
 
@@ -721,14 +1618,28 @@ static void tunnel_getaddrinfo_done(struct tunnel_ctx *tunnel, struct socket_ctx
     do_next(tunnel, socket);
 }
 
+static void tunnel_getaddrinfo_result(struct tunnel_ctx *tunnel, struct socket_ctx *socket, int status, const union sockaddr_universal *addrs, size_t count) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    (void)socket;
+    // Not the destinations the ACL resolves, only the SSR server's addresses.
+    if (status == 0 && ctx->stage == tunnel_stage_resolve_ssr_server_host_done) {
+        remote_pool_store(ctx->env->remote_pool, addrs, count);
+    }
+}
+
 static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     do_next(tunnel, socket);
 }
 
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size) {
-    (void)tunnel;
-    (void)socket;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
     (void)suggested_size;
+    if (ctx->stage == tunnel_stage_optimistic_payload && socket == tunnel->incoming) {
+        return SSR_BUFF_SIZE - (ctx->init_pkg ? ctx->init_pkg->len : socks5_address_size(tunnel->desired_addr));
+    }
+    if (ctx->stage == tunnel_stage_streaming && socket == tunnel->incoming) {
+        return ctx->_incoming_read_size;
+    }
     return SSR_BUFF_SIZE;
 }
 
@@ -748,6 +1659,7 @@ static void tunnel_tls_do_launch_streaming(struct tunnel_ctx *tunnel) {
     } else {
         socket_read(incoming, true);
         ctx->stage = tunnel_stage_tls_streaming;
+        tunnel_admission_streaming(ctx);
     }
 }
 
@@ -763,17 +1675,16 @@ void tunnel_tls_client_incoming_streaming(struct tunnel_ctx *tunnel, struct sock
     else if (socket->rdstate == socket_done) {
         socket->rdstate = socket_stop;
         {
-            size_t len = 0;
-            uint8_t *buf = NULL;
+            struct buffer_t *buf = NULL;
             ASSERT(tunnel->tunnel_extract_data);
-            buf = tunnel->tunnel_extract_data(socket, &malloc, &len);
+            buf = tunnel->tunnel_extract_data(socket);
             if (buf /* && size > 0 */) {
                 ASSERT(tunnel->tunnel_tls_send_data);
-                tunnel->tunnel_tls_send_data(tunnel, buf, len);
+                tunnel->tunnel_tls_send_data(tunnel, buf->buffer, buf->len);
             } else {
                 tls_client_shutdown(tunnel);
             }
-            free(buf);
+            buffer_release(buf);
         }
         socket_read(socket, false);
     }
@@ -793,8 +1704,10 @@ static void tunnel_tls_on_connection_established(struct tunnel_ctx *tunnel) {
     ASSERT(outgoing->wrstate == socket_stop);
 
     ASSERT (tunnel->tunnel_tls_send_data);
+    tunnel_mark_phase(tunnel, tunnel_phase_connect);
     {
         struct buffer_t *tmp = buffer_clone(ctx->init_pkg);
+        client_cipher_prepare(tunnel);
         if (ssr_ok != tunnel_cipher_client_encrypt(ctx->cipher, tmp)) {
             tls_client_shutdown(tunnel);
         } else {
@@ -873,3 +1786,172 @@ static bool can_access(const uv_tcp_t *lx, const struct tunnel_ctx *cx, const st
 
     return false;
 }
+
+static bool transparent_destination(struct tunnel_ctx *tunnel, struct socks5_address *dest) {
+#if defined(__linux__)
+    // Where the client meant to go before REDIRECT or TPROXY brought it here.
+    union sockaddr_universal local = { 0 }, original = { 0 };
+    int len = sizeof(local);
+    socklen_t size = sizeof(original);
+    uv_os_fd_t fd;
+    uint16_t port;
+
+    if (uv_tcp_getsockname(&tunnel->incoming->handle.tcp, &local.addr, &len) != 0 ||
+        uv_fileno((uv_handle_t *)&tunnel->incoming->handle.tcp, &fd) != 0)
+    {
+        return false;
+    }
+    if (getsockopt(fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, &original, &size) != 0) {
+        size = sizeof(original);
+        if (getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &original, &size) != 0) {
+            original = local;  /* No NAT, TPROXY keeps it as the local address. */
+        }
+    }
+    // A dual-stack listener has IPv4 ones mapped, compared and passed on as IPv4.
+    universal_address_unmap(&local);
+    universal_address_unmap(&original);
+    port = universal_address_port(&original);
+    if (port == get_socket_port(tunnel->listener) && original.addr.sa_family == local.addr.sa_family &&
+        (original.addr.sa_family == AF_INET ?
+            original.addr4.sin_addr.s_addr == local.addr4.sin_addr.s_addr :
+            memcmp(&original.addr6.sin6_addr, &local.addr6.sin6_addr, sizeof(struct in6_addr)) == 0))
+    {
+        return false;  /* Made to the listener itself, SOCKS5 or HTTP. */
+    }
+
+    memset(dest, 0, sizeof(*dest));
+    if (original.addr.sa_family == AF_INET) {
+        dest->addr_type = SOCKS5_ADDRTYPE_IPV4;
+        dest->addr.ipv4 = original.addr4.sin_addr;
+    } else if (original.addr.sa_family == AF_INET6) {
+        dest->addr_type = SOCKS5_ADDRTYPE_IPV6;
+        dest->addr.ipv6 = original.addr6.sin6_addr;
+    } else {
+        return false;
+    }
+    dest->port = port;
+    return true;
+#else
+    (void)tunnel;
+    (void)dest;
+    return false;
+#endif // defined(__linux__)
+}
+
+static bool tunnel_mux_write_pending(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct buffer_t *pending = ctx->mux_pending;
+
+    if (pending == NULL || pending->len == 0) {
+        return false;
+    }
+    ctx->mux_pending = NULL;
+    ctx->mux_in_flight = pending->len;
+    socket_write_buffer(tunnel->incoming, pending);
+    return true;
+}
+
+static void tunnel_mux_do_launch_streaming(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+
+    ASSERT(incoming->rdstate == socket_stop);
+    ASSERT(incoming->wrstate == socket_stop);
+
+    if (incoming->result < 0) {
+        pr_err("write error: %s", uv_strerror((int)incoming->result));
+        tunnel_shutdown(tunnel);
+        return;
+    }
+
+    ctx->stage = tunnel_stage_mux_streaming;
+    tunnel_admission_streaming(ctx);
+    if (tunnel_mux_write_pending(tunnel) == false && ctx->mux_stream == NULL) {
+        tunnel_shutdown(tunnel);  /* FIN before the reply went out, nothing left. */
+        return;
+    }
+    if (ctx->mux_stream) {
+        socket_read(incoming, false);
+    }
+}
+
+static void tunnel_mux_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+
+    ASSERT(socket == tunnel->incoming);
+
+    if (socket->wrstate == socket_done) {
+        socket->wrstate = socket_stop;
+        if (ctx->mux_stream) {
+            mux_stream_consumed(ctx->mux_stream, ctx->mux_in_flight);
+        }
+        ctx->mux_in_flight = 0;
+        if (tunnel_mux_write_pending(tunnel) == false && ctx->mux_stream == NULL) {
+            tunnel_shutdown(tunnel);  /* The peer's FIN, and its data is out. */
+            return;
+        }
+    }
+    if (socket->rdstate == socket_done) {
+        socket->rdstate = socket_stop;
+        if (ctx->mux_stream == NULL) {
+            return;
+        }
+        if (mux_stream_send(ctx->mux_stream, (const uint8_t *)socket->buf->base, (size_t)socket->result)) {
+            socket_read(socket, false);
+        } else {
+            ctx->mux_read_paused = true;
+        }
+    }
+}
+
+static void tunnel_mux_on_data(void *p, const uint8_t *data, size_t size) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)p;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+
+    if (tunnel->terminated) {
+        return;
+    }
+    if (ctx->stage == tunnel_stage_mux_streaming && incoming->wrstate == socket_stop && ctx->mux_pending == NULL) {
+        ctx->mux_in_flight = size;
+        socket_write(incoming, data, size);
+        return;
+    }
+    // Behind the SOCKS reply or the write in flight.
+    if (ctx->mux_pending == NULL) {
+        ctx->mux_pending = buffer_create(size);
+    }
+    buffer_concatenate(ctx->mux_pending, data, size);
+}
+
+static void tunnel_mux_on_window(void *p) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)p;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+
+    if (tunnel->terminated || ctx->mux_read_paused == false) {
+        return;
+    }
+    ctx->mux_read_paused = false;
+    socket_read(tunnel->incoming, false);
+}
+
+static void tunnel_mux_on_close(void *p, bool reset) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)p;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+
+    ctx->mux_stream = NULL;
+    if (tunnel->terminated) {
+        return;
+    }
+    if (reset) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    if (ctx->stage == tunnel_stage_mux_streaming && incoming->wrstate == socket_stop &&
+        tunnel_mux_write_pending(tunnel) == false)
+    {
+        tunnel_shutdown(tunnel);
+    }
+    // Otherwise the write completion finishes the tunnel once the data is out.
+}
@@ -42,9 +42,12 @@
 #include "obfs.h"
 
 struct server_env_t;
+struct socks5_address;
 
 /* client.c */
-void client_tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout);
+void client_tunnel_initialize(struct server_env_t *env, uv_tcp_t *lx);
+/* A flow already connected to the application, to |dest|: no SOCKS5 to parse, as with tunnel_address. */
+int client_tunnel_adopt(struct server_env_t *env, uv_tcp_t *lx, uv_os_sock_t sock, const struct socks5_address *dest);
 void client_shutdown(struct server_env_t *env);
 
 /* getopt.c */
@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fake_dns.h"
+#include "common.h"
+#include "dump_info.h"
+#include "uthash.h"
+
+#define DNS_HEADER_LEN  12
+#define DNS_PACKET_MAX  512
+#define DNS_NAME_MAX    253
+#define DNS_TYPE_A      1
+#define DNS_CLASS_IN    1
+#define DNS_RCODE_NOTIMP 4
+
+struct fake_name {
+    UT_hash_handle hh;
+    uint32_t index;
+    char name[DNS_NAME_MAX + 1];
+};
+
+struct fake_dns {
+    uv_mutex_t lock;
+    uint32_t base;  /* The network, host order. Addresses are base + 1 + index. */
+    uint32_t mask;
+    uint32_t capacity;
+    uint32_t next;  /* The slot handed out next, the oldest once all are taken. */
+    struct fake_name *names;
+    struct fake_name **slots;
+};
+
+struct fake_dns_server {
+    uv_udp_t udp;
+    struct fake_dns *dns;
+    char packet[DNS_PACKET_MAX];
+};
+
+struct fake_dns * fake_dns_create(const char *range) {
+    char addr[INET_ADDRSTRLEN];
+    const char *slash;
+    struct in_addr net;
+    struct fake_dns *dns;
+    uint32_t hosts;
+    int prefix;
+
+    if (range == NULL) {
+        range = DEFAULT_FAKE_IP_RANGE;
+    }
+    slash = strchr(range, '/');
+    if (slash == NULL || (size_t)(slash - range) >= sizeof(addr)) {
+        return NULL;
+    }
+    memcpy(addr, range, (size_t)(slash - range));
+    addr[slash - range] = '\0';
+    prefix = atoi(slash + 1);
+    // Room for the network, the broadcast and at least two names.
+    if (uv_inet_pton(AF_INET, addr, &net) != 0 || prefix < 8 || prefix > 30) {
+        return NULL;
+    }
+
+    dns = (struct fake_dns *) calloc(1, sizeof(*dns));
+    dns->mask = UINT32_MAX << (32 - prefix);
+    dns->base = ntohl(net.s_addr) & dns->mask;
+    hosts = ~dns->mask - 1;
+    dns->capacity = (hosts < FAKE_DNS_MAX_NAMES) ? hosts : FAKE_DNS_MAX_NAMES;
+    dns->slots = (struct fake_name **) calloc(dns->capacity, sizeof(dns->slots[0]));
+    VERIFY(0 == uv_mutex_init(&dns->lock));
+    return dns;
+}
+
+void fake_dns_destroy(struct fake_dns *dns) {
+    uint32_t n;
+    if (dns == NULL) {
+        return;
+    }
+    HASH_CLEAR(hh, dns->names);
+    for (n = 0; n < dns->capacity; ++n) {
+        free(dns->slots[n]);
+    }
+    free(dns->slots);
+    uv_mutex_destroy(&dns->lock);
+    free(dns);
+}
+
+/* The address of |name|, it gets the next slot if it has none yet. */
+static uint32_t fake_dns_assign(struct fake_dns *dns, const char *name) {
+    struct fake_name *entry;
+    uint32_t index;
+
+    uv_mutex_lock(&dns->lock);
+    HASH_FIND_STR(dns->names, name, entry);
+    if (entry == NULL) {
+        index = dns->next;
+        dns->next = (dns->next + 1) % dns->capacity;
+        entry = dns->slots[index];
+        if (entry) {
+            HASH_DEL(dns->names, entry);
+        } else {
+            entry = (struct fake_name *) calloc(1, sizeof(*entry));
+            dns->slots[index] = entry;
+        }
+        entry->index = index;
+        strcpy(entry->name, name);
+        HASH_ADD_STR(dns->names, name, entry);
+    }
+    index = entry->index;
+    uv_mutex_unlock(&dns->lock);
+    return dns->base + 1 + index;
+}
+
+int fake_dns_lookup(struct fake_dns *dns, const struct in_addr *addr, char *name, size_t size) {
+    uint32_t key = ntohl(addr->s_addr);
+    uint32_t index;
+    int found = -1;
+
+    if (dns == NULL || (key & dns->mask) != dns->base) {
+        return 0;
+    }
+    index = key - dns->base - 1;
+    uv_mutex_lock(&dns->lock);
+    if (index < dns->capacity && dns->slots[index] && strlen(dns->slots[index]->name) < size) {
+        strcpy(name, dns->slots[index]->name);
+        found = 1;
+    }
+    uv_mutex_unlock(&dns->lock);
+    return found;
+}
+
+/*
+ * The question's name, lower case and dotted, into |name|. Its end in the
+ * packet is returned, 0 for a malformed or compressed one.
+ */
+static size_t parse_question_name(const uint8_t *packet, size_t len, char *name) {
+    size_t pos = DNS_HEADER_LEN, out = 0;
+
+    while (pos < len) {
+        size_t label = packet[pos++], i;
+        if (label == 0) {
+            name[out] = '\0';
+            return pos;
+        }
+        if (label > 63 || pos + label > len || out + label + 1 > DNS_NAME_MAX + 1) {
+            return 0;
+        }
+        if (out) {
+            name[out++] = '.';
+        }
+        for (i = 0; i < label; ++i) {
+            uint8_t c = packet[pos + i];
+            if (c <= ' ' || c >= 0x7f || c == '.') {
+                return 0;
+            }
+            name[out++] = (char)((c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c);
+        }
+        pos += label;
+    }
+    return 0;
+}
+
+static void put16(uint8_t *p, unsigned int v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+/* The reply to |query| into |reply|, its length, 0 for none. */
+static size_t fake_dns_answer(struct fake_dns *dns, const uint8_t *query, size_t len, uint8_t *reply) {
+    char name[DNS_NAME_MAX + 1];
+    unsigned int opcode, qtype, qclass;
+    size_t end;
+
+    if (len < DNS_HEADER_LEN || (query[2] & 0x80)) {
+        return 0;  /* Not a query. */
+    }
+    memcpy(reply, query, DNS_HEADER_LEN);
+    reply[2] = (uint8_t)(0x80 | (query[2] & 0x79));  /* QR, the opcode and RD. */
+    reply[3] = 0x80;  /* RA. */
+    memset(reply + 4, 0, DNS_HEADER_LEN - 4);
+
+    opcode = (query[2] >> 3) & 0x0f;
+    if (opcode != 0) {
+        reply[3] |= DNS_RCODE_NOTIMP;
+        return DNS_HEADER_LEN;
+    }
+    if (query[4] != 0 || query[5] != 1) {
+        return 0;
+    }
+    end = parse_question_name(query, len, name);
+    if (end == 0 || end + 4 > len) {
+        return 0;
+    }
+    qtype = ((unsigned int)query[end] << 8) | query[end + 1];
+    qclass = ((unsigned int)query[end + 2] << 8) | query[end + 3];
+    end += 4;
+
+    // The question goes back as it came, EDNS and the rest are dropped.
+    memcpy(reply + DNS_HEADER_LEN, query + DNS_HEADER_LEN, end - DNS_HEADER_LEN);
+    put16(reply + 4, 1);
+    if (qtype != DNS_TYPE_A || qclass != DNS_CLASS_IN || name[0] == '\0') {
+        return end;  /* AAAA and the rest, no records, so clients use the A. */
+    }
+    {
+        uint32_t addr = fake_dns_assign(dns, name);
+        uint8_t *rr = reply + end;
+        put16(rr, 0xc000 | DNS_HEADER_LEN);  /* The name, pointing at the question's. */
+        put16(rr + 2, DNS_TYPE_A);
+        put16(rr + 4, DNS_CLASS_IN);
+        put16(rr + 6, 0);
+        put16(rr + 8, FAKE_DNS_TTL);
+        put16(rr + 10, 4);
+        put16(rr + 12, addr >> 16);
+        put16(rr + 14, addr & 0xffff);
+        put16(reply + 6, 1);
+        return end + 16;
+    }
+}
+
+static void fake_dns_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct fake_dns_server *server = CONTAINER_OF(handle, struct fake_dns_server, udp);
+    (void)suggested_size;
+    *buf = uv_buf_init(server->packet, sizeof(server->packet));
+}
+
+static void fake_dns_recv_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+    struct fake_dns_server *server = CONTAINER_OF(handle, struct fake_dns_server, udp);
+    uint8_t reply[DNS_PACKET_MAX + 16];
+    uv_buf_t out;
+    size_t len;
+
+    if (nread <= 0 || addr == NULL || (flags & UV_UDP_PARTIAL)) {
+        return;
+    }
+    len = fake_dns_answer(server->dns, (const uint8_t *)buf->base, (size_t)nread, reply);
+    if (len == 0) {
+        return;
+    }
+    // Lost when the socket is full, the client asks again.
+    out = uv_buf_init((char *)reply, (unsigned int)len);
+    (void)uv_udp_try_send(handle, &out, 1, addr);
+}
+
+static void fake_dns_close_done_cb(uv_handle_t *handle) {
+    free(CONTAINER_OF(handle, struct fake_dns_server, udp));
+}
+
+struct fake_dns_server * fake_dns_server_create(uv_loop_t *loop, struct fake_dns *dns, const union sockaddr_universal *addr) {
+    struct fake_dns_server *server;
+    int err;
+
+    server = (struct fake_dns_server *) calloc(1, sizeof(*server));
+    server->dns = dns;
+    VERIFY(0 == uv_udp_init(loop, &server->udp));
+    err = uv_udp_bind(&server->udp, &addr->addr, 0);
+    if (err == 0) {
+        err = uv_udp_recv_start(&server->udp, fake_dns_alloc_cb, fake_dns_recv_cb);
+    }
+    if (err != 0) {
+        pr_err("fake dns: %s", uv_strerror(err));
+        uv_close((uv_handle_t *)&server->udp, fake_dns_close_done_cb);
+        return NULL;
+    }
+    return server;
+}
+
+void fake_dns_server_shutdown(struct fake_dns_server *server) {
+    if (server) {
+        uv_udp_recv_stop(&server->udp);
+        uv_close((uv_handle_t *)&server->udp, fake_dns_close_done_cb);
+    }
+}
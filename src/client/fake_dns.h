@@ -0,0 +1,41 @@
+#ifndef __FAKE_DNS_H__
+#define __FAKE_DNS_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+#include "sockaddr_universal.h"
+
+struct fake_dns;
+struct fake_dns_server;
+
+/*
+ * A DNS responder that answers every A query with an address of its own
+ * range and remembers which name it stands for, so a connection to that
+ * address goes to the SSR server by name and the name resolves next to
+ * the exit. Addresses are handed out in turn, the oldest name gives its
+ * address up once the range is used up; FAKE_DNS_TTL keeps clients from
+ * holding on to one that long. Other queries get an empty answer.
+ * One table for all of ssr-client's loops, it takes a lock.
+ */
+
+#define DEFAULT_FAKE_IP_RANGE "198.18.0.0/15"  /* RFC 2544, never routed. */
+#define FAKE_DNS_MAX_NAMES    65536
+#define FAKE_DNS_TTL          1  /* Seconds. */
+
+/* |range| an IPv4 CIDR, NULL for DEFAULT_FAKE_IP_RANGE. NULL if it's invalid. */
+struct fake_dns * fake_dns_create(const char *range);
+/* After every server is shut down and no loop looks up any more. */
+void fake_dns_destroy(struct fake_dns *dns);
+/*
+ * The name |addr| was handed out for, into |name|. 1 when found, 0 for an
+ * address outside the range, -1 for one of it that isn't, or no longer is.
+ */
+int fake_dns_lookup(struct fake_dns *dns, const struct in_addr *addr, char *name, size_t size);
+
+/* Answers on UDP |addr| with |loop|, NULL if it can't bind. */
+struct fake_dns_server * fake_dns_server_create(uv_loop_t *loop, struct fake_dns *dns, const union sockaddr_universal *addr);
+void fake_dns_server_shutdown(struct fake_dns_server *server);
+
+#endif // __FAKE_DNS_H__
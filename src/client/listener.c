@@ -21,6 +21,7 @@
 
 #include "defs.h"
 //#include <netinet/in.h>  /* INET6_ADDRSTRLEN */
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include "dump_info.h"
@@ -28,8 +29,24 @@
 #include "ssr_executive.h"
 #include "ssr_client_api.h"
 #include "common.h"
+#include "buffer_pool.h"
+#include "ssr_alloc.h"
+#include "metrics.h"
+#include "tunnel_trace.h"
+#include "jconf.h"
+#include "resolv.h"
+#include "remote_pool.h"
+#include "tls_cli.h"
+#include "mux_cli.h"
+#include "warm_pool.h"
+#include "server_group.h"
+#include "server_probe.h"
+#include "acl.h"
+#include "admission.h"
+#include "fake_dns.h"
 #if UDP_RELAY_ENABLE
 #include "udprelay.h"
+#include "udp_stream_cli.h"
 #endif // UDP_RELAY_ENABLE
 
 #ifndef INET6_ADDRSTRLEN
@@ -37,19 +54,50 @@
 #endif
 
 struct udp_listener_ctx_t;
+struct udp_stream_cli;
 
 struct listener_t {
     uv_tcp_t *tcp_server;
     struct udp_listener_ctx_t *udp_server;
+    struct udp_stream_cli *udp_stream;
+    struct fake_dns_server *fake_dns;
+    char tunnel_host[0x100];  /* The relay's tunnel address points here, see client_udp_start(). */
+    char tunnel_port[8];
+    bool parked;  /* A connection came before the warm-up was done, it waits in the listener. */
 };
 
 struct ssr_client_state {
     struct server_env_t *env;
+    uv_loop_t *loop;
+    uv_thread_t thread;
+
+    /* The first loop resolves the listen address and watches signals. Extra
+     * workers bind the same addresses with SO_REUSEPORT, each with its own
+     * server_env_t, and are told to quit through |quit_async|. */
+    uv_async_t *quit_async;
+    struct ssr_client_state **workers;
+    size_t workers_count;
+    union sockaddr_universal *bind_addrs;
+    size_t worker_index;  /* 0 for the first loop. */
 
     uv_signal_t *sigint_watcher;
     uv_signal_t *sigterm_watcher;
 
     bool shutting_down;
+    bool library;  /* Made by ssr_client_create(), on the caller's loop. */
+    struct client_retired_env *retired;  /* Configs swapped out, serving their tunnels to the end. */
+    struct tunnel_stats *retired_stats;  /* Counts of the retired configs released so far. */
+    uv_timer_t *reaper;  /* Library only, releases the retired configs and the instance. */
+    bool drained;  /* Destroying, nothing was left at the last reap. */
+    bool resolving;  /* The listen address is being looked up. */
+    bool acl_user;  /* Counted in client_acl_users. */
+    bool ready;  /* The cipher is made, connections are taken. */
+    uv_work_t *warm_up;  /* With fast_start, makes the cipher and the acl on the thread pool. */
+    int warm_up_err;
+    void(*stopped)(void *p);
+    void *stopped_p;
+    struct metrics_server *metrics;  /* The first loop's, with metrics_address, reads every worker's counters. */
+    uv_file trace_file;  /* The first loop's, with trace_file, the workers' traces write to it too. */
     
     int listener_count;
     struct listener_t *listeners;
@@ -58,67 +106,298 @@ struct ssr_client_state {
     void *ptr;
 };
 
+/* A config swapped out by ssr_client_swap_config(), kept until its tunnels are gone. */
+struct client_retired_env {
+    struct server_env_t *env;
+    bool shut_down;  /* client_shutdown() done, released at the next reap. */
+    struct client_retired_env *next;
+};
+
+#define CLIENT_REAP_MS  1000
+#define LISTEN_HOST_MAX_ADDRS  16  /* Listeners for the addresses of listen_host, the rest are ignored. */
+
+static int client_acl_users = 0;  /* Library instances with an acl, the first loads it and the last frees it. */
+
 static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *addrs);
+/* On the first loop, the workers' counters read as they go. */
+static void client_metrics_collect_cb(void *p, struct metrics_writer *w) {
+    struct ssr_client_state *state = (struct ssr_client_state *)p;
+    struct tunnel_stats *total = tunnel_stats_create();
+    struct buffer_pool_stats pool = { 0 };
+    struct ssr_alloc_stats alloc[ssr_alloc_kind_max];
+    char labels[64];
+    size_t n;
+
+    for (n = 0; n <= state->workers_count; ++n) {
+        struct server_env_t *env = (n == 0) ? state->env : state->workers[n - 1]->env;
+        struct buffer_pool_stats stats = { 0 };
+        tunnel_stats_merge(total, env->tunnel_stats);
+        buffer_pool_get_stats(env->read_buffer_pool, &stats);
+        pool.hits += stats.hits;
+        pool.misses += stats.misses;
+        pool.oversized += stats.oversized;
+        pool.outstanding += stats.outstanding;
+        pool.cached += stats.cached;
+        pool.scratch += stats.scratch;
+        pool.detached += stats.detached;
+    }
+
+    metrics_family(w, "ssr_tunnels_accepted_total", "counter", "Tunnels accepted.");
+    metrics_sample(w, "ssr_tunnels_accepted_total", NULL, total->tunnels_accepted);
+    metrics_family(w, "ssr_tunnels_active", "gauge", "Tunnels open.");
+    metrics_sample(w, "ssr_tunnels_active", NULL, total->tunnels_accepted - total->tunnels_closed);
+    metrics_family(w, "ssr_bytes_total", "counter", "Bytes read, from the applications (incoming) and the server (outgoing).");
+    metrics_sample(w, "ssr_bytes_total", "direction=\"incoming\"", total->bytes_incoming);
+    metrics_sample(w, "ssr_bytes_total", "direction=\"outgoing\"", total->bytes_outgoing);
+    metrics_family(w, "ssr_compression_bytes_total", "counter", "Tunnel data through the compression stage (plain) and on the wire (wire), of closed tunnels.");
+    metrics_sample(w, "ssr_compression_bytes_total", "stage=\"plain\"", total->compression_plain);
+    metrics_sample(w, "ssr_compression_bytes_total", "stage=\"wire\"", total->compression_wire);
+
+    metrics_family(w, "ssr_buffer_pool_requests_total", "counter", "Read buffers asked of the pools.");
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"hit\"", pool.hits);
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"miss\"", pool.misses);
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"oversized\"", pool.oversized);
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"scratch\"", pool.scratch);
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"detached\"", pool.detached);
+    metrics_family(w, "ssr_buffer_pool_blocks", "gauge", "Read buffers handed out and cached.");
+    metrics_sample(w, "ssr_buffer_pool_blocks", "state=\"outstanding\"", pool.outstanding);
+    metrics_sample(w, "ssr_buffer_pool_blocks", "state=\"cached\"", pool.cached);
+
+    ssr_alloc_get_stats(alloc);
+    metrics_family(w, "ssr_alloc_bytes", "gauge", "Heap memory held, by what it is for.");
+    for (n = 0; n < ssr_alloc_kind_max; ++n) {
+        snprintf(labels, sizeof(labels), "subsystem=\"%s\"", ssr_alloc_kind_name((enum ssr_alloc_kind)n));
+        metrics_sample(w, "ssr_alloc_bytes", labels, (uint64_t)(alloc[n].bytes > 0 ? alloc[n].bytes : 0));
+    }
+    metrics_family(w, "ssr_allocations_total", "counter", "Heap blocks allocated, by what they are for.");
+    for (n = 0; n < ssr_alloc_kind_max; ++n) {
+        snprintf(labels, sizeof(labels), "subsystem=\"%s\"", ssr_alloc_kind_name((enum ssr_alloc_kind)n));
+        metrics_sample(w, "ssr_allocations_total", labels, alloc[n].allocations);
+    }
+
+    metrics_family(w, "ssr_tunnel_latency_seconds", "histogram", "Time from accepting a tunnel to each phase.");
+    for (n = 0; n < tunnel_phase_max; ++n) {
+        size_t at;
+        snprintf(labels, sizeof(labels), "phase=\"%s\"", tunnel_stats_phase_name((enum tunnel_stats_phase)n));
+        for (at = 0; labels[at]; ++at) {
+            labels[at] = (labels[at] == ' ') ? '_' : labels[at];
+        }
+        metrics_histogram(w, "ssr_tunnel_latency_seconds", labels, &total->latency[n]);
+    }
+    metrics_stage_times(w, total);
+    metrics_census(w);
+
+    tunnel_stats_destroy(total);
+}
+
 static void listen_incoming_connection_cb(uv_stream_t *server, int status);
+static void client_accept(uv_stream_t *server);
 static void signal_quit(uv_signal_t* handle, int signum);
+static int listener_bind(struct ssr_client_state *state, struct listener_t *listener, const union sockaddr_universal *addr, bool reuse_port, bool transparent, int cpu, const char **what);
+static struct server_env_t * client_env_create(struct ssr_client_state *state, uv_loop_t *loop, struct server_config *cf, uv_file trace_file, bool lazy);
+static int client_resolve_listen_host(struct ssr_client_state *state);
+static void client_warm_up_start(struct ssr_client_state *state);
+static void client_listeners_start(struct ssr_client_state *state);
+#if UDP_RELAY_ENABLE
+static void client_udp_start(struct ssr_client_state *state, struct listener_t *listener, uint16_t port);
+static void client_udp_stop(struct listener_t *listener);
+#endif // UDP_RELAY_ENABLE
+static void client_reaper_cb(uv_timer_t *handle);
+static void client_worker_pin(struct ssr_client_state *state);
+static void client_workers_start(struct ssr_client_state *state, struct server_config *cf);
+static void client_worker_thread(void *arg);
+static void client_worker_quit_async_cb(uv_async_t *handle);
+static void client_worker_destroy(struct ssr_client_state *state);
+static void client_metrics_collect_cb(void *p, struct metrics_writer *w);
 
-int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ssr_client_state *state, void *p), void *p) {
-    uv_loop_t * loop = NULL;
+/* The env of |cf| on |loop|. The first loop's makes the fake DNS, the workers share it.
+ * A |lazy| one has no cipher yet, see client_warm_up_start(). */
+static struct server_env_t * client_env_create(struct ssr_client_state *state, uv_loop_t *loop, struct server_config *cf, uv_file trace_file, bool lazy) {
+    struct server_env_t *env = lazy ? ssr_cipher_env_create_lazy(cf, state) : ssr_cipher_env_create(cf, state);
+    if (state->worker_index == 0 && state->env == NULL && cf->fake_dns_port) {
+        env->fake_dns = fake_dns_create(cf->fake_ip_range);
+        if (env->fake_dns == NULL) {
+            pr_err("invalid fake_ip_range %s", cf->fake_ip_range);
+        }
+    }
+    if (cf->tunnel_address) {
+        env->tunnel_dest = (struct socks5_address *) calloc(1, sizeof(struct socks5_address));
+        if (socks5_address_from_host_port(cf->tunnel_address, env->tunnel_dest) == false) {
+            pr_err("tunnel_address %s is not host:port", cf->tunnel_address);
+            object_safe_free((void **)&env->tunnel_dest);
+        }
+    }
+    env->timer_wheel = timer_wheel_create(loop, TIMER_WHEEL_TICK_MS);
+    env->fair_queue = fair_queue_create(loop, cf->fair_queue_quantum);
+    env->read_coalescer = read_coalescer_create(loop, cf->coalesce_reads_below);
+    env->watchdog = loop_watchdog_create(loop, cf->loop_stall_ms);
+    env->trace = tunnel_trace_create(loop, trace_file, cf->trace_sample, (unsigned int)state->worker_index);
+    env->admission = admission_create(loop, cf, env->tunnel_stats, client_accept);
+    env->resolver = resolv_init(loop, cf->nameservers, cf->ipv6_first);
+    if (cf->over_tls_enable == false) {
+        env->remote_pool = remote_pool_create(loop, env->resolver, cf->remote_host, cf->remote_port);
+        env->server_group = server_group_create(loop, env->resolver, cf, env->remote_pool);
+        env->mux_cli = mux_cli_create(loop, env);
+        env->warm_pool = warm_pool_create(loop, env);
+        // A lazy env's waits for its cipher, see client_warm_up_done_cb().
+        env->server_probe = lazy ? NULL : server_probe_create(loop, env);
+    } else {
+        env->tls_cli_pool = tls_cli_pool_create(loop, cf, env->read_buffer_pool);
+    }
+    return env;
+}
+
+/* Resolves the address of the interface that we should bind to.
+ * The getaddrinfo callback starts the server and everything else. */
+static int client_resolve_listen_host(struct ssr_client_state *state) {
     struct addrinfo hints;
-    struct ssr_client_state *state;
-    int err;
     uv_getaddrinfo_t *req;
+    int err;
 
-    loop = (uv_loop_t *) calloc(1, sizeof(uv_loop_t));
-    uv_loop_init(loop);
-
-    state = (struct ssr_client_state *) calloc(1, sizeof(*state));
-    state->listeners = NULL;
-    state->env = ssr_cipher_env_create(cf, state);
-    state->feedback_state = feedback_state;
-    state->ptr = p;
-
-    loop->data = state->env;
-
-    /* Resolve the address of the interface that we should bind to.
-    * The getaddrinfo callback starts the server and everything else.
-    */
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
 
     req = (uv_getaddrinfo_t *)calloc(1, sizeof(*req));
+    req->data = state;
 
-    err = uv_getaddrinfo(loop, req, getaddrinfo_done_cb, cf->listen_host, NULL, &hints);
+    state->resolving = true;
+    err = uv_getaddrinfo(state->loop, req, getaddrinfo_done_cb, state->env->config->listen_host, NULL, &hints);
     if (err != 0) {
+        state->resolving = false;
         pr_err("getaddrinfo: %s", uv_strerror(err));
+        free(req);
         if (state->feedback_state) {
             state->feedback_state(state, state->ptr);
         }
+    }
+    return err;
+}
+
+static void client_warm_up_work_cb(uv_work_t *req) {
+    struct ssr_client_state *state = (struct ssr_client_state *)req->data;
+    const struct server_config *cf = state->env->config;
+
+    ssr_cipher_env_prepare(state->env);
+    // A library instance loads it at once, it's shared with the others.
+    if (cf->acl && state->library == false) {
+        state->warm_up_err = init_acl(cf->acl);
+    }
+}
+
+static void client_warm_up_done_cb(uv_work_t *req, int status) {
+    struct ssr_client_state *state = (struct ssr_client_state *)req->data;
+    const struct server_config *cf = state->env->config;
+
+    (void)status;
+    free(req);
+    state->warm_up = NULL;
+
+    if (state->warm_up_err != 0) {
+        pr_err("failed to load the acl %s", cf->acl);
+        ssr_run_loop_shutdown(state);
+        return;
+    }
+    if (cf->acl && state->library == false) {
+        pr_info("acl loaded from %s", cf->acl);
+    }
+    state->ready = true;
+    if (state->shutting_down == false && state->env->server_group) {
+        state->env->server_probe = server_probe_create(state->loop, state->env);
+    }
+    if (state->shutting_down == false && state->bind_addrs) {
+        client_listeners_start(state);
+    }
+}
+
+/* With fast_start the listeners are bound while the thread pool makes the
+ * cipher and the acl, the connections that come meanwhile are parked. Not
+ * started on failure, the loop then closes the listeners and the env isn't
+ * touched by another thread. */
+static void client_warm_up_start(struct ssr_client_state *state) {
+    uv_work_t *req = (uv_work_t *)calloc(1, sizeof(*req));
+    req->data = state;
+    state->warm_up = req;
+    VERIFY(0 == uv_queue_work(state->loop, req, client_warm_up_work_cb, client_warm_up_done_cb));
+}
+
+int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ssr_client_state *state, void *p), void *p) {
+    uv_loop_t * loop = NULL;
+    struct ssr_client_state *state;
+    int err;
+
+    if (cf->acl && cf->fast_start == false) {
+        // Before any loop runs, the workers share it read only.
+        if (init_acl(cf->acl) != 0) {
+            pr_err("failed to load the acl %s", cf->acl);
+            return -1;
+        }
+        pr_info("acl loaded from %s", cf->acl);
+    }
+
+    loop = (uv_loop_t *) calloc(1, sizeof(uv_loop_t));
+    uv_loop_init(loop);
+
+    state = (struct ssr_client_state *) calloc(1, sizeof(*state));
+    state->loop = loop;
+    state->listeners = NULL;
+    state->feedback_state = feedback_state;
+    state->ptr = p;
+    state->trace_file = (cf->trace_file && cf->trace_sample) ? tunnel_trace_open(cf->trace_file) : -1;
+    state->env = client_env_create(state, loop, cf, state->trace_file, cf->fast_start);
+    state->ready = (cf->fast_start == false);
+    loop->data = state->env;
+
+    err = client_resolve_listen_host(state);
+    if (err != 0) {
         return err;
     }
+    if (state->ready == false) {
+        client_warm_up_start(state);
+    }
 
     // Setup signal handler
     state->sigint_watcher = (uv_signal_t *) calloc(1, sizeof(uv_signal_t));
     uv_signal_init(loop, state->sigint_watcher);
+    state->sigint_watcher->data = state;
     uv_signal_start(state->sigint_watcher, signal_quit, SIGINT);
 
     state->sigterm_watcher = (uv_signal_t *) calloc(1, sizeof(uv_signal_t));
     uv_signal_init(loop, state->sigterm_watcher);
+    state->sigterm_watcher->data = state;
     uv_signal_start(state->sigterm_watcher, signal_quit, SIGTERM);
 
+    if (cf->metrics_address) {
+        state->metrics = metrics_server_create(loop, cf->metrics_address, client_metrics_collect_cb, state);
+    }
+
     /* Start the event loop.  Control continues in getaddrinfo_done_cb(). */
+    client_worker_pin(state);
     err = uv_run(loop, UV_RUN_DEFAULT);
     if (err != 0) {
         pr_err("uv_run: %s", uv_strerror(err));
     }
 
+    if (state->workers) {
+        size_t n;
+        for (n = 0; n < state->workers_count; ++n) {
+            uv_thread_join(&state->workers[n]->thread);
+            client_worker_destroy(state->workers[n]);
+        }
+        free(state->workers);
+    }
+
+    // Every loop is done with it, and its servers closed with the main loop.
+    fake_dns_destroy(state->env->fake_dns);
+    admission_destroy(state->env->admission);
     ssr_cipher_env_release(state->env);
+    tunnel_trace_close(state->trace_file);
 
     if (state->listeners) {
         free(state->listeners);
     }
+    free(state->bind_addrs);
 
     free(state->sigint_watcher);
     free(state->sigterm_watcher);
@@ -126,6 +405,10 @@ int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ss
     free(state);
 
     free(loop);
+
+    if (cf->acl) {
+        free_acl();
+    }
     
     return err;
 }
@@ -144,33 +427,61 @@ void ssr_run_loop_shutdown(struct ssr_client_state *state) {
     }
     state->shutting_down = true;
 
-    uv_signal_stop(state->sigint_watcher);
-    uv_signal_stop(state->sigterm_watcher);
+    if (state->sigint_watcher) {
+        uv_signal_stop(state->sigint_watcher);
+    }
+    if (state->sigterm_watcher) {
+        uv_signal_stop(state->sigterm_watcher);
+    }
+    if (state->quit_async) {
+        uv_close((uv_handle_t *)state->quit_async, NULL);
+    }
+    metrics_server_shutdown(state->metrics);
+    state->metrics = NULL;
+    if (state->workers) {
+        size_t n;
+        for (n = 0; n < state->workers_count; ++n) {
+            uv_async_send(state->workers[n]->quit_async);
+        }
+    }
 
     if (state->listeners && state->listener_count) {
         size_t n = 0;
         for (n = 0; n < (size_t) state->listener_count; ++n) {
-            struct udp_listener_ctx_t *udp_server;
             struct listener_t *listener = state->listeners + n;
 
             uv_tcp_t *tcp_server = listener->tcp_server;
             if (tcp_server) {
                 uv_close((uv_handle_t *)tcp_server, tcp_close_done_cb);
+                listener->tcp_server = NULL;
             }
 
 #if UDP_RELAY_ENABLE
-            udp_server = listener->udp_server;
-            if (udp_server) {
-                udprelay_shutdown(udp_server);
-            }
+            client_udp_stop(listener);
 #endif // UDP_RELAY_ENABLE
+
+            fake_dns_server_shutdown(listener->fake_dns);
+            listener->fake_dns = NULL;
         }
     }
 
     client_shutdown(state->env);
+    {
+        struct client_retired_env *r;
+        for (r = state->retired; r; r = r->next) {
+            if (r->shut_down == false) {
+                client_shutdown(r->env);
+                r->shut_down = true;
+            }
+        }
+    }
+
+    tunnel_stats_dump(state->env->tunnel_stats);
 
-    pr_info(" ");
-    pr_info("terminated.\n");
+    if (state->quit_async == NULL && state->library == false) {
+        pr_info(" ");
+        pr_info("terminated.\n");
+    }
 }
 
 int ssr_get_listen_socket_fd(struct ssr_client_state *state) {
@@ -181,30 +492,264 @@ int ssr_get_listen_socket_fd(struct ssr_client_state *state) {
     return uv_stream_fd(state->listeners[0].tcp_server);
 }
 
+struct ssr_client_state * ssr_client_create(uv_loop_t *loop, struct server_config *cf, void(*feedback_state)(struct ssr_client_state *state, void *p), void *p) {
+    struct ssr_client_state *state;
+
+    if (cf->acl && __sync_fetch_and_add(&client_acl_users, 1) == 0) {
+        if (init_acl(cf->acl) != 0) {
+            pr_err("failed to load the acl %s", cf->acl);
+            __sync_fetch_and_sub(&client_acl_users, 1);
+            config_release(cf);
+            return NULL;
+        }
+        pr_info("acl loaded from %s", cf->acl);
+    }
+
+    state = (struct ssr_client_state *) calloc(1, sizeof(*state));
+    state->loop = loop;
+    state->library = true;
+    state->acl_user = (cf->acl != NULL);
+    state->feedback_state = feedback_state;
+    state->ptr = p;
+    state->trace_file = (cf->trace_file && cf->trace_sample) ? tunnel_trace_open(cf->trace_file) : -1;
+    state->env = client_env_create(state, loop, cf, state->trace_file, cf->fast_start);
+    state->ready = (cf->fast_start == false);
+    state->retired_stats = tunnel_stats_create();
+
+    state->reaper = (uv_timer_t *) calloc(1, sizeof(uv_timer_t));
+    VERIFY(0 == uv_timer_init(loop, state->reaper));
+    state->reaper->data = state;
+    VERIFY(0 == uv_timer_start(state->reaper, client_reaper_cb, CLIENT_REAP_MS, CLIENT_REAP_MS));
+    uv_unref((uv_handle_t *)state->reaper);
+
+    if (cf->metrics_address) {
+        state->metrics = metrics_server_create(loop, cf->metrics_address, client_metrics_collect_cb, state);
+    }
+    if (client_resolve_listen_host(state) != 0) {
+        ssr_client_destroy(state, NULL, NULL);
+        return NULL;
+    }
+    if (state->ready == false) {
+        client_warm_up_start(state);
+    }
+    return state;
+}
+
+static bool client_config_str_equal(const char *a, const char *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+int ssr_client_swap_config(struct ssr_client_state *state, struct server_config *cf) {
+    const struct server_config *old = state->env->config;
+    struct client_retired_env *retired;
+    struct server_env_t *env;
+    int n;
+
+    if (state->library == false || state->shutting_down) {
+        return UV_EINVAL;
+    }
+    if (state->warm_up) {
+        // The thread pool is still making the env's cipher.
+        return UV_EBUSY;
+    }
+    if (client_config_str_equal(cf->listen_host, old->listen_host) == false ||
+        cf->listen_port != old->listen_port ||
+        cf->udp != old->udp ||
+        cf->transparent_proxy != old->transparent_proxy ||
+        cf->fake_dns_port != old->fake_dns_port ||
+        client_config_str_equal(cf->tunnel_address, old->tunnel_address) == false ||
+        client_config_str_equal(cf->fake_ip_range, old->fake_ip_range) == false)
+    {
+        return UV_EINVAL;
+    }
+
+    env = client_env_create(state, state->loop, cf, state->trace_file, false);
+    env->fake_dns = state->env->fake_dns;
+
+    retired = (struct client_retired_env *) calloc(1, sizeof(*retired));
+    retired->env = state->env;
+    retired->next = state->retired;
+    state->retired = retired;
+    // The listeners find the env through the state, the next tunnel gets this one.
+    state->env = env;
+
+#if UDP_RELAY_ENABLE
+    for (n = 0; n < state->listener_count; ++n) {
+        struct listener_t *listener = state->listeners + n;
+        if (listener->udp_server) {
+            uint16_t port = universal_address_port(&state->bind_addrs[n]);
+            // Its associations are cut, the applications send again.
+            client_udp_stop(listener);
+            client_udp_start(state, listener, port);
+        }
+    }
+#else
+    (void)n;
+#endif // UDP_RELAY_ENABLE
+    return 0;
+}
+
+void ssr_client_get_stats(const struct ssr_client_state *state, struct ssr_client_stats *stats) {
+    struct tunnel_stats *total = tunnel_stats_create();
+    const struct client_retired_env *r;
+
+    memset(stats, 0, sizeof(*stats));
+    tunnel_stats_merge(total, state->env->tunnel_stats);
+    if (state->retired_stats) {
+        tunnel_stats_merge(total, state->retired_stats);
+    }
+    for (r = state->retired; r; r = r->next) {
+        tunnel_stats_merge(total, r->env->tunnel_stats);
+        stats->configs_retiring++;
+    }
+    stats->tunnels_accepted = total->tunnels_accepted;
+    stats->tunnels_active = total->tunnels_accepted - total->tunnels_closed;
+    stats->bytes_incoming = total->bytes_incoming;
+    stats->bytes_outgoing = total->bytes_outgoing;
+    tunnel_stats_destroy(total);
+}
+
+int ssr_client_open_flow(struct ssr_client_state *state, uv_os_sock_t sock, const char *host_port) {
+    struct socks5_address dest;
+
+    if (state->shutting_down || state->listener_count == 0 || state->listeners[0].tcp_server == NULL) {
+        return UV_EINVAL;
+    }
+    if (state->ready == false) {
+        return UV_EAGAIN;
+    }
+    if (host_port == NULL || socks5_address_from_host_port(host_port, &dest) == false) {
+        return UV_EINVAL;
+    }
+    return client_tunnel_adopt(state->env, state->listeners[0].tcp_server, sock, &dest);
+}
+
+void ssr_client_destroy(struct ssr_client_state *state, void(*stopped)(void *p), void *p) {
+    if (state == NULL || state->library == false) {
+        return;
+    }
+    state->stopped = stopped;
+    state->stopped_p = p;
+    state->drained = false;
+    ssr_run_loop_shutdown(state);
+    // Freed by the reaper once the tunnels and handles are gone.
+    uv_ref((uv_handle_t *)state->reaper);
+}
+
+static void client_env_release(struct server_env_t *env) {
+    struct server_config *cf = env->config;
+    admission_destroy(env->admission);
+    ssr_cipher_env_release(env);
+    config_release(cf);
+}
+
+static void client_reaper_close_done_cb(uv_handle_t *handle) {
+    struct ssr_client_state *state = (struct ssr_client_state *)handle->data;
+    void(*stopped)(void *p) = state->stopped;
+    void *stopped_p = state->stopped_p;
+    if (state->acl_user && __sync_sub_and_fetch(&client_acl_users, 1) == 0) {
+        free_acl();
+    }
+    fake_dns_destroy(state->env->fake_dns);
+    client_env_release(state->env);
+    tunnel_trace_close(state->trace_file);
+    tunnel_stats_destroy(state->retired_stats);
+    free(state->listeners);
+    free(state->bind_addrs);
+    free(state->reaper);
+    free(state);
+
+    if (stopped) {
+        stopped(stopped_p);
+    }
+}
+
+/* A retired config is shut down once its last tunnel is gone, and released
+ * one reap later, when what that closed has called back. The instance goes
+ * the same way once it's destroyed. */
+static void client_reaper_cb(uv_timer_t *handle) {
+    struct ssr_client_state *state = (struct ssr_client_state *)handle->data;
+    struct client_retired_env **link = &state->retired;
+
+    while (*link) {
+        struct client_retired_env *r = *link;
+        if (r->env->tunnel_list != NULL) {
+            link = &r->next;
+        } else if (r->shut_down == false) {
+            client_shutdown(r->env);
+            r->shut_down = true;
+            link = &r->next;
+        } else {
+            *link = r->next;
+            tunnel_stats_merge(state->retired_stats, r->env->tunnel_stats);
+            client_env_release(r->env);
+            free(r);
+        }
+    }
+
+    if (state->shutting_down == false || state->resolving || state->warm_up || state->retired || state->env->tunnel_list) {
+        return;
+    }
+    if (state->drained == false) {
+        state->drained = true;
+        return;
+    }
+    uv_close((uv_handle_t *)handle, client_reaper_close_done_cb);
+}
+
+/* The distinct addresses of |ai|. A wildcard [::] takes IPv4 as well, on a
+ * dual-stack socket, so a 0.0.0.0 beside it is left out instead of holding
+ * a second listener, and its UDP relay, for the same clients. */
+static size_t listen_addresses_from_addrinfo(const struct addrinfo *ai, union sockaddr_universal *addrs, size_t max) {
+    size_t count = universal_addresses_from_addrinfo(ai, addrs, max);
+    size_t index, kept = 0;
+    bool any6 = false;
+
+    for (index = 0; index < count; ++index) {
+        if (addrs[index].addr.sa_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&addrs[index].addr6.sin6_addr)) {
+            any6 = true;
+        }
+    }
+    for (index = 0; index < count; ++index) {
+        if (any6 && addrs[index].addr.sa_family == AF_INET && addrs[index].addr4.sin_addr.s_addr == htonl(INADDR_ANY)) {
+            continue;
+        }
+        addrs[kept++] = addrs[index];
+    }
+    return kept;
+}
+
 /* Bind a server to each address that getaddrinfo() reported. */
 static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *addrs) {
     char addrbuf[INET6_ADDRSTRLEN + 1];
-    unsigned int ipv4_naddrs;
-    unsigned int ipv6_naddrs;
+    union sockaddr_universal candidates[LISTEN_HOST_MAX_ADDRS];
     struct ssr_client_state *state;
     struct server_env_t *env;
     const struct server_config *cf;
-    struct addrinfo *ai;
     const void *addrv = NULL;
     const char *what;
     uv_loop_t *loop;
-    unsigned int n;
+    size_t count, n;
     int err;
     union sockaddr_universal s = { 0 };
 
     loop = req->loop;
 
-    env = (struct server_env_t *) loop->data;
-    state = (struct ssr_client_state *) env->data;
+    state = (struct ssr_client_state *) req->data;
     ASSERT(state);
+    env = state->env;
     cf = env->config;
 
     free(req);
+    state->resolving = false;
+
+    if (state->shutting_down) {
+        uv_freeaddrinfo(addrs);
+        return;
+    }
 
     if (status < 0) {
         pr_err("getaddrinfo(\"%s\"): %s", cf->listen_host, uv_strerror(status));
@@ -215,46 +760,26 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
         return;
     }
 
-    ipv4_naddrs = 0;
-    ipv6_naddrs = 0;
-    for (ai = addrs; ai != NULL; ai = ai->ai_next) {
-        if (ai->ai_family == AF_INET) {
-            ipv4_naddrs += 1;
-        } else if (ai->ai_family == AF_INET6) {
-            ipv6_naddrs += 1;
-        }
-    }
+    count = listen_addresses_from_addrinfo(addrs, candidates, sizeof(candidates) / sizeof(candidates[0]));
+    uv_freeaddrinfo(addrs);
 
-    if (ipv4_naddrs == 0 && ipv6_naddrs == 0) {
+    if (count == 0) {
         pr_err("%s has no IPv4/6 addresses", cf->listen_host);
-        uv_freeaddrinfo(addrs);
         return;
     }
 
-    state->listener_count = (ipv4_naddrs + ipv6_naddrs);
+    state->listener_count = (int)count;
     state->listeners = (struct listener_t *) calloc(state->listener_count, sizeof(state->listeners[0]));
+    state->bind_addrs = (union sockaddr_universal *) calloc(state->listener_count, sizeof(state->bind_addrs[0]));
 
-    n = 0;
-    for (ai = addrs; ai != NULL; ai = ai->ai_next) {
+    for (n = 0; n < count; ++n) {
         struct listener_t *listener;
         uv_tcp_t *tcp_server;
         uint16_t port;
 
-        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) {
-            continue;
-        }
-
-        if (ai->ai_family == AF_INET) {
-            s.addr4 = *(const struct sockaddr_in *) ai->ai_addr;
-            s.addr4.sin_port = htons(cf->listen_port);
-            addrv = &s.addr4.sin_addr;
-        } else if (ai->ai_family == AF_INET6) {
-            s.addr6 = *(const struct sockaddr_in6 *) ai->ai_addr;
-            s.addr6.sin6_port = htons(cf->listen_port);
-            addrv = &s.addr6.sin6_addr;
-        } else {
-            UNREACHABLE();
-        }
+        s = candidates[n];
+        universal_address_set_port(&s, cf->listen_port);
+        addrv = (s.addr.sa_family == AF_INET6) ? (const void *)&s.addr6.sin6_addr : (const void *)&s.addr4.sin_addr;
 
         if (uv_inet_ntop(s.addr.sa_family, addrv, addrbuf, sizeof(addrbuf)) != 0) {
             UNREACHABLE();
@@ -262,17 +787,9 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
 
         listener = state->listeners + n;
 
-        listener->tcp_server = (uv_tcp_t *)calloc(1, sizeof(listener->tcp_server[0]));
+        err = listener_bind(state, listener, &s, (state->library == false && cf->workers > 1), cf->transparent_proxy,
+            socket_tuning_worker_cpu(&cf->socket, 0), &what);
         tcp_server = listener->tcp_server;
-        VERIFY(0 == uv_tcp_init(loop, tcp_server));
-
-        what = "uv_tcp_bind";
-        err = uv_tcp_bind(tcp_server, &s.addr, 0);
-        if (err == 0) {
-            // https://unix.stackexchange.com/questions/180492/is-it-possible-to-connect-to-tcp-port-0
-            what = "uv_listen";
-            err = uv_listen((uv_stream_t *)tcp_server, 128, listen_incoming_connection_cb);
-        }
 
         if (state->feedback_state) {
             state->feedback_state(state, state->ptr);
@@ -288,32 +805,281 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
 
         pr_info("listening on     %s:%hu\n", addrbuf, port);
 
+        // Workers share the actually bound port, it may have been picked by the system.
+        universal_address_set_port(&s, port);
+        state->bind_addrs[n] = s;
+
+        if (state->env->fake_dns) {
+            union sockaddr_universal dns_addr = s;
+            universal_address_set_port(&dns_addr, cf->fake_dns_port);
+            listener->fake_dns = fake_dns_server_create(loop, state->env->fake_dns, &dns_addr);
+            if (listener->fake_dns) {
+                pr_info("fake dns on      %s:%hu\n", addrbuf, cf->fake_dns_port);
+            }
+        }
+
+    }
+
+    if (state->shutting_down == false && state->ready) {
+        client_listeners_start(state);
+    }
+}
+
+/* Bound and warmed up, what needs the cipher starts: the UDP relays, the
+ * parked connections and the workers. */
+static void client_listeners_start(struct ssr_client_state *state) {
+    const struct server_config *cf = state->env->config;
+    int n;
+
+    for (n = 0; n < state->listener_count; ++n) {
+        struct listener_t *listener = state->listeners + n;
+#if UDP_RELAY_ENABLE
+        const union sockaddr_universal *addr = state->bind_addrs + n;
+        client_udp_start(state, listener, universal_address_port(addr));
+#endif // UDP_RELAY_ENABLE
+        if (listener->parked) {
+            // The others waited in the backlog, libuv polls the listener again now.
+            listener->parked = false;
+            client_accept((uv_stream_t *)listener->tcp_server);
+        }
+    }
+
+    if (state->library == false && cf->workers > 1) {
+        client_workers_start(state, (struct server_config *)cf);
+    }
+}
+
 #if UDP_RELAY_ENABLE
-        if (cf->udp) {
-            union sockaddr_universal remote_addr = { 0 };
-            convert_universal_address(cf->remote_host, cf->remote_port, &remote_addr);
-
-            listener->udp_server = udprelay_begin(loop,
-                cf->listen_host, port,
-                &remote_addr,
-                NULL, 0, cf->idle_timeout,
-                state->env->cipher,
-                cf->protocol, cf->protocol_param);
+static void client_udp_start(struct ssr_client_state *state, struct listener_t *listener, uint16_t port) {
+    const struct server_config *cf = state->env->config;
+    const struct socks5_address *dest = state->env->tunnel_dest;
+    union sockaddr_universal remote_addr = { 0 };
+    struct ss_host_port tunnel_addr = { 0 };
+
+    if (cf->udp == false) {
+        return;
+    }
+    convert_universal_address(cf->remote_host, cf->remote_port, &remote_addr);
+    if (dest) {
+        // Plain datagrams in, like the TCP port, so a DNS forward works too.
+        socks5_address_to_string(dest, listener->tunnel_host, sizeof(listener->tunnel_host));
+        snprintf(listener->tunnel_port, sizeof(listener->tunnel_port), "%hu", dest->port);
+        tunnel_addr.host = listener->tunnel_host;
+        tunnel_addr.port = listener->tunnel_port;
+    }
+
+    listener->udp_server = udprelay_begin(state->loop,
+        cf->listen_host, port,
+        &remote_addr,
+        dest ? &tunnel_addr : NULL, 0, cf->idle_timeout,
+        state->env->cipher,
+        cf->protocol, cf->protocol_param);
+    if (listener->udp_server && cf->transparent_proxy) {
+        int err = udprelay_enable_transparent(listener->udp_server);
+        if (err != 0) {
+            // SOCKS5 UDP still works, as does TCP with REDIRECT.
+            pr_warn("UDP TPROXY on port %hu: %s", port, uv_strerror(err));
         }
+    }
+    // A TLS front has no UDP port, so over TLS implies the stream.
+    if (listener->udp_server && (cf->udp_over_tcp || cf->over_tls_enable)) {
+        listener->udp_stream = udp_stream_cli_create(state->loop, (struct server_config *)cf, listener->udp_server);
+    }
+}
+
+static void client_udp_stop(struct listener_t *listener) {
+    // the stream goes first, it holds the relay as a weak pointer
+    udp_stream_cli_shutdown(listener->udp_stream);
+    listener->udp_stream = NULL;
+    udprelay_shutdown(listener->udp_server);
+    listener->udp_server = NULL;
+}
 #endif // UDP_RELAY_ENABLE
 
-        n += 1;
+static int listener_bind(struct ssr_client_state *state, struct listener_t *listener, const union sockaddr_universal *addr, bool reuse_port, bool transparent, int cpu, const char **what) {
+    const struct socket_tuning *tuning = &state->env->config->socket;
+    uv_tcp_t *tcp_server;
+    int err;
+
+    listener->tcp_server = (uv_tcp_t *)calloc(1, sizeof(listener->tcp_server[0]));
+    tcp_server = listener->tcp_server;
+    VERIFY(0 == uv_tcp_init_ex(state->loop, tcp_server, addr->addr.sa_family));
+    tcp_server->data = state;
+
+#if defined(SO_REUSEPORT)
+    if (reuse_port) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        int on = 1;
+        *what = "SO_REUSEPORT";
+        err = uv_fileno((uv_handle_t *)tcp_server, &fd);
+        if (err != 0) {
+            return err;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&on, sizeof(on)) != 0) {
+            return uv_translate_sys_error(errno);
+        }
     }
+#else
+    (void)reuse_port;
+#endif // defined(SO_REUSEPORT)
 
-    uv_freeaddrinfo(addrs);
+#if defined(IP_TRANSPARENT) && defined(IPV6_TRANSPARENT)
+    if (transparent) {
+        // For TPROXY. Without CAP_NET_ADMIN only REDIRECT works, not fatal.
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        int on = 1;
+        bool v6 = (addr->addr.sa_family == AF_INET6);
+        if (uv_fileno((uv_handle_t *)tcp_server, &fd) == 0 &&
+            setsockopt(fd, v6 ? SOL_IPV6 : SOL_IP, v6 ? IPV6_TRANSPARENT : IP_TRANSPARENT, &on, sizeof(on)) != 0)
+        {
+            pr_warn("IP_TRANSPARENT: %s", strerror(errno));
+        }
+    }
+#else
+    (void)transparent;
+#endif // defined(IP_TRANSPARENT) && defined(IPV6_TRANSPARENT)
+
+    if (socket_tuning_is_default(tuning) == false) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        if (uv_fileno((uv_handle_t *)tcp_server, &fd) != 0 ||
+            socket_tuning_apply_listener(tuning, (int)fd, cpu) != 0)
+        {
+            pr_warn("some socket options are not available");
+        }
+    }
+
+    *what = "uv_tcp_bind";
+    err = uv_tcp_bind(tcp_server, &addr->addr, 0);
+    if (err == 0) {
+        // https://unix.stackexchange.com/questions/180492/is-it-possible-to-connect-to-tcp-port-0
+        *what = "uv_listen";
+        err = uv_listen((uv_stream_t *)tcp_server, 128, listen_incoming_connection_cb);
+    }
+    if (err == 0 && tuning->defer_accept > 0) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        if (uv_fileno((uv_handle_t *)tcp_server, &fd) != 0 ||
+            socket_tuning_apply_accept(tuning, (int)fd) != 0)
+        {
+            pr_warn("deferred accept is not available");
+        }
+    }
+    return err;
+}
+
+static void client_workers_start(struct ssr_client_state *state, struct server_config *cf) {
+#if defined(SO_REUSEPORT)
+    size_t n;
+
+    state->workers_count = cf->workers - 1;
+    state->workers = (struct ssr_client_state **) calloc(state->workers_count, sizeof(state->workers[0]));
+
+    for (n = 0; n < state->workers_count; ++n) {
+        struct ssr_client_state *worker;
+        uv_loop_t *loop = (uv_loop_t *) calloc(1, sizeof(uv_loop_t));
+        uv_loop_init(loop);
+
+        worker = (struct ssr_client_state *) calloc(1, sizeof(*worker));
+        worker->loop = loop;
+        worker->worker_index = n + 1;
+        worker->env = client_env_create(worker, loop, cf, state->trace_file, false);
+        worker->ready = true;
+        loop->data = worker->env;
+        worker->env->fake_dns = state->env->fake_dns;
+
+        worker->listener_count = state->listener_count;
+        worker->listeners = (struct listener_t *) calloc(worker->listener_count, sizeof(worker->listeners[0]));
+        worker->bind_addrs = (union sockaddr_universal *) calloc(worker->listener_count, sizeof(worker->bind_addrs[0]));
+        memcpy(worker->bind_addrs, state->bind_addrs, worker->listener_count * sizeof(worker->bind_addrs[0]));
+
+        worker->quit_async = (uv_async_t *) calloc(1, sizeof(uv_async_t));
+        VERIFY(0 == uv_async_init(loop, worker->quit_async, client_worker_quit_async_cb));
+        worker->quit_async->data = worker;
+
+        state->workers[n] = worker;
+        VERIFY(0 == uv_thread_create(&worker->thread, client_worker_thread, worker));
+    }
+#else
+    (void)state; (void)cf;
+    pr_warn("SO_REUSEPORT is not supported on this platform, running a single worker");
+#endif // defined(SO_REUSEPORT)
+}
+
+static void client_worker_thread(void *arg) {
+    struct ssr_client_state *state = (struct ssr_client_state *)arg;
+    const struct server_config *cf = state->env->config;
+    int n;
+
+    client_worker_pin(state);
+    for (n = 0; n < state->listener_count; ++n) {
+        const char *what = NULL;
+        int err = listener_bind(state, state->listeners + n, state->bind_addrs + n, true, cf->transparent_proxy,
+            socket_tuning_worker_cpu(&cf->socket, state->worker_index), &what);
+        if (err != 0) {
+            pr_err("worker %s: %s", what, uv_strerror(err));
+        }
+    }
+
+    uv_run(state->loop, UV_RUN_DEFAULT);
+}
+
+/* With incoming_cpu, onto the CPU its listeners take the connections of. */
+static void client_worker_pin(struct ssr_client_state *state) {
+    int cpu = socket_tuning_worker_cpu(&state->env->config->socket, state->worker_index);
+    if (cpu >= 0 && socket_tuning_pin_thread(cpu) != 0) {
+        pr_warn("worker %zu not pinned to CPU %d", state->worker_index, cpu);
+    }
+}
+
+static void client_worker_quit_async_cb(uv_async_t *handle) {
+    ssr_run_loop_shutdown((struct ssr_client_state *)handle->data);
+}
+
+static void client_worker_destroy(struct ssr_client_state *state) {
+    admission_destroy(state->env->admission);
+    ssr_cipher_env_release(state->env);
+    free(state->listeners);
+    free(state->bind_addrs);
+    free(state->quit_async);
+    uv_loop_close(state->loop);
+    free(state->loop);
+    free(state);
 }
 
 static void listen_incoming_connection_cb(uv_stream_t *server, int status) {
-    uv_loop_t *loop = server->loop;
-    struct server_env_t *env = (struct server_env_t *)loop->data;
+    struct ssr_client_state *state = (struct ssr_client_state *)server->data;
 
     VERIFY(status == 0);
-    client_tunnel_initialize((uv_tcp_t *)server, env->config->idle_timeout);
+    if (state->ready == false) {
+        // Not accepted, libuv stops polling the listener until it is.
+        int n;
+        for (n = 0; n < state->listener_count; ++n) {
+            if ((uv_stream_t *)state->listeners[n].tcp_server == server) {
+                state->listeners[n].parked = true;
+            }
+        }
+        return;
+    }
+    client_accept(server);
+}
+
+/* Also admission control's resume_cb, for a connection it held back. */
+static void client_accept(uv_stream_t *server) {
+    struct ssr_client_state *state = (struct ssr_client_state *)server->data;
+    // The current config's env, after a swap the tunnels open before keep theirs.
+    struct server_env_t *env = state->env;
+
+    if (env->admission) {
+        switch (admission_check(env->admission, server)) {
+        case admission_reject:
+            admission_turn_away(server);
+            return;
+        case admission_defer:
+            return;  /* libuv stops watching |server| until it's accepted. */
+        default:
+            break;
+        }
+    }
+    client_tunnel_initialize(env, (uv_tcp_t *)server);
 }
 
 static void signal_quit(uv_signal_t* handle, int signum) {
@@ -324,11 +1090,9 @@ static void signal_quit(uv_signal_t* handle, int signum) {
     case SIGUSR1:
 #endif
     {
-        struct server_env_t *env;
         struct ssr_client_state *state;
         ASSERT(handle);
-        env = (struct server_env_t *)handle->loop->data;
-        state = (struct ssr_client_state *)env->data;
+        state = (struct ssr_client_state *)handle->data;
         ASSERT(state);
         ssr_run_loop_shutdown(state);
     }
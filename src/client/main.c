@@ -27,9 +27,12 @@
 #include "dump_info.h"
 #include "common.h"
 #include "ssr_executive.h"
+#include "ssr_qr_code.h"
+#include "server_group.h"
 #include "ssr_client_api.h"
 #include "cmd_line_parser.h"
 #include "daemon_wrapper.h"
+#include "ssr_alloc.h"
 
 #if HAVE_UNISTD_H
 #include <unistd.h>  /* getopt */
@@ -40,12 +43,15 @@ static void usage(void);
 struct ssr_client_state *g_state = NULL;
 void feedback_state(struct ssr_client_state *state, void *p);
 void print_remote_info(const struct server_config *config);
+static void load_subscription(struct server_config *config);
 
 int main(int argc, char **argv) {
     struct server_config *config = NULL;
     int err = -1;
     struct cmd_line_info *cmds = NULL;
 
+    ssr_alloc_install_cork();
+
     do {
         set_app_name(argv[0]);
 
@@ -75,15 +81,24 @@ int main(int argc, char **argv) {
             break;
         }
 
+        if (config->subscription) {
+            load_subscription(config);
+        }
+
         if (cmds->daemon_flag) {
             char param[257] = { 0 };
             sprintf(param, "-c \"%s\"", cmds->cfg_file);
             daemon_wrapper(argv[0], param);
         }
 
+        dump_info_set_json(config->log_json);
         print_remote_info(config);
 
+        if (config->log_async) {
+            dump_info_start_async();
+        }
         ssr_run_loop_begin(config, &feedback_state, NULL);
+        dump_info_stop_async();
         g_state = NULL;
 
         err = 0;
@@ -100,6 +115,26 @@ int main(int argc, char **argv) {
     return 0;
 }
 
+static void load_subscription(struct server_config *config) {
+    struct ssr_subscription *sub;
+    size_t len = 0, added;
+    char *text = config_file_read(config->subscription, &len);
+    if (text == NULL) {
+        pr_err("subscription %s can't be read", config->subscription);
+        return;
+    }
+    sub = ssr_subscription_decode(text, len);
+    free(text);
+    if (sub == NULL) {
+        return;
+    }
+    // remote_host is the group's first member.
+    added = ssr_subscription_add_servers(sub, config, SERVER_GROUP_MAX - 1);
+    pr_info("subscription     %u links, %u servers added, %u lines skipped",
+            (unsigned)sub->count, (unsigned)added, (unsigned)sub->skipped);
+    ssr_subscription_release(sub);
+}
+
 void print_remote_info(const struct server_config *config) {
     char remote_host[256] = { 0 };
     char password[256] = { 0 };
@@ -137,9 +172,52 @@ void print_remote_info(const struct server_config *config) {
         pr_warn("over TLS         %s", config->over_tls_enable ? "yes" : "no");
         pr_info("over TLS domain  %s", config->over_tls_server_domain);
         pr_info("over TLS path    %s", config->over_tls_path);
+        pr_info("over TLS stream  %s", config->over_tls_streaming ? "WebSocket" : "no");
+        pr_info("over TLS spares  %d", config->over_tls_spare_connections);
         pr_info(" ");
     }
-    pr_info("udp relay        %s\n", config->udp ? "yes" : "no");
+    if (config->servers_count > 0 && config->over_tls_enable == false) {
+        static const char *policies[] = { "least latency", "weighted", "hash" };
+        pr_info("servers          %u more, %s", (unsigned)config->servers_count, policies[config->server_policy]);
+        if (config->probe_interval > 0) {
+            pr_info("server probes    every %us%s%s", config->probe_interval / MILLISECONDS_PER_SECOND,
+                config->probe_target ? " to " : "", config->probe_target ? config->probe_target : "");
+        }
+    }
+    if (config->mux_sessions > 0 && config->over_tls_enable == false) {
+        pr_info("mux sessions     %d", config->mux_sessions);
+    }
+    if (config->transport == server_transport_kcp && config->over_tls_enable == false) {
+        pr_info("transport        KCP port %hu, window %u, FEC %u+%u",
+            config->kcp_port ? config->kcp_port : config->remote_port, config->kcp_window,
+            config->kcp_fec_parity ? config->kcp_fec_data : 0, config->kcp_fec_parity);
+    }
+    if (config->warm_connections > 0 && config->over_tls_enable == false) {
+        pr_info("warm connections %d", config->warm_connections);
+    }
+    if (config->optimistic_reply && config->over_tls_enable == false) {
+        pr_info("optimistic reply yes");
+    }
+    if (config->transparent_proxy) {
+        pr_info("transparent      yes");
+    }
+    if (config->tunnel_address) {
+        pr_info("tunnel to        %s", config->tunnel_address);
+    }
+    if (config->fast_open) {
+        pr_info("TCP fast open    yes");
+    }
+    if (config->mptcp) {
+        pr_info("Multipath TCP    yes");
+    }
+    if (strcmp(ssr_alloc_backend(), "system") != 0) {
+        pr_info("allocator        %s", ssr_alloc_backend());
+    }
+    pr_info("udp relay        %s", config->udp ? "yes" : "no");
+    if (config->udp && (config->udp_over_tcp || config->over_tls_enable)) {
+        pr_info("udp over         %s", config->over_tls_enable ? "TLS" : "TCP");
+    }
+    pr_info(" ");
 }
 
 void feedback_state(struct ssr_client_state *state, void *p) {
@@ -0,0 +1,460 @@
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif // !defined(_WIN32)
+#include "mux_cli.h"
+#include "common.h"
+#include "dump_info.h"
+#include "ssr_executive.h"
+#include "ssrbuffer.h"
+#include "buffer_pool.h"
+#include "obfs.h"
+#include "obfsutil.h"
+#include "remote_pool.h"
+#include "sockaddr_universal.h"
+#include "kcp_transport.h"
+#include "socket_tuning.h"
+
+struct mux_cli_session {
+    struct mux_cli *mux;
+    struct mux_session *session;
+    struct tunnel_cipher_ctx *cipher;
+    struct kcp_session *kcp;  /* With the KCP transport, instead of |tcp|. */
+    uv_tcp_t tcp;
+    uv_connect_t connect_req;
+    uv_timer_t timer;  /* Idle checks, or the deferred teardown after a failed write. */
+    union sockaddr_universal addr;
+    struct buffer_pool *buffer_pool;
+    int handles;
+    size_t writes;  /* uv_write() requests in flight. */
+    bool kcp_blocked;  /* Its send queue is full. */
+    bool ready;  /* Handshake sent and, where the protocol wants one, answered. */
+    bool received;  /* Frames came back, the server speaks mux. */
+    bool idle;
+    bool broken;
+    bool dead;
+    struct mux_cli_session *next;
+};
+
+struct mux_cli {
+    uv_loop_t *loop;
+    struct server_env_t *env;
+    size_t target;
+    uint64_t retry_at;
+    struct mux_cli_session *sessions;
+    struct kcp_endpoint *kcp;  /* With the KCP transport, made with the first session. */
+};
+
+struct mux_cli_write {
+    uv_write_t req;
+    struct buffer_t *buf;
+};
+
+static bool session_send(void *p, const struct buffer_t *frames);
+static void session_kcp_on_data(void *p, const uint8_t *data, size_t size);
+static void session_kcp_on_writable(void *p);
+static void session_kcp_on_close(void *p);
+
+static const struct mux_session_callbacks session_callbacks = {
+    &session_send,
+    NULL,
+};
+
+static const struct kcp_session_callbacks session_kcp_callbacks = {
+    &session_kcp_on_data,
+    &session_kcp_on_writable,
+    &session_kcp_on_close,
+};
+
+static void session_close_done_cb(uv_handle_t *handle) {
+    struct mux_cli_session *s = (struct mux_cli_session *)handle->data;
+    if (--s->handles == 0) {
+        if (s->cipher) {
+            tunnel_cipher_release(s->cipher);
+        }
+        free(s);
+    }
+}
+
+static void session_fail(struct mux_cli_session *s) {
+    struct mux_cli *mux = s->mux;
+    struct mux_cli_session **link;
+
+    if (s->dead) {
+        return;
+    }
+    s->dead = true;
+    for (link = &mux->sessions; *link; link = &(*link)->next) {
+        if (*link == s) {
+            *link = s->next;
+            break;
+        }
+    }
+    if (s->received == false) {
+        // Unreachable, or a server without mux. Tunnels connect directly for a while.
+        mux->retry_at = uv_now(mux->loop) + MUX_CLI_RETRY_MS;
+    }
+    mux_session_destroy(s->session);
+    s->session = NULL;
+
+    uv_timer_stop(&s->timer);
+    uv_close((uv_handle_t *)&s->timer, session_close_done_cb);
+    if (s->kcp) {
+        kcp_session_close(s->kcp);
+        s->kcp = NULL;
+    }
+    if (s->mux->kcp == NULL) {
+        uv_close((uv_handle_t *)&s->tcp, session_close_done_cb);
+    }
+}
+
+static void session_timer_cb(uv_timer_t *handle) {
+    struct mux_cli_session *s = (struct mux_cli_session *)handle->data;
+    if (s->broken) {
+        session_fail(s);
+        return;
+    }
+    // Two checks in a row without a stream.
+    if (mux_session_stream_count(s->session) == 0) {
+        if (s->idle) {
+            session_fail(s);
+            return;
+        }
+        s->idle = true;
+    } else {
+        s->idle = false;
+    }
+}
+
+static void session_write_done_cb(uv_write_t *req, int status) {
+    struct mux_cli_write *wr = CONTAINER_OF(req, struct mux_cli_write, req);
+    struct mux_cli_session *s = (struct mux_cli_session *)req->data;
+
+    buffer_release(wr->buf);
+    free(wr);
+    s->writes--;
+    if (s->dead) {
+        return;
+    }
+    if (status < 0) {
+        pr_err("mux session write failed: %s", uv_strerror(status));
+        session_fail(s);
+        return;
+    }
+    if (s->writes == 0) {
+        mux_session_flush(s->session);
+    }
+}
+
+/* Takes over |buf|. */
+static void session_write(struct mux_cli_session *s, struct buffer_t *buf) {
+    struct mux_cli_write *wr;
+    uv_buf_t o = uv_buf_init((char *)buf->buffer, (unsigned int)buf->len);
+
+    if (s->kcp) {
+        if (kcp_session_send(s->kcp, buf->buffer, buf->len) == false) {
+            s->kcp_blocked = true;
+        }
+        buffer_release(buf);
+        return;
+    }
+    wr = (struct mux_cli_write *)calloc(1, sizeof(*wr));
+    wr->buf = buf;
+    wr->req.data = s;
+    if (uv_write(&wr->req, (uv_stream_t *)&s->tcp, &o, 1, session_write_done_cb) != 0) {
+        buffer_release(buf);
+        free(wr);
+        // May be inside mux_session_feed(), tear down from the loop instead.
+        s->broken = true;
+        uv_timer_start(&s->timer, session_timer_cb, 0, 0);
+        return;
+    }
+    s->writes++;
+}
+
+static bool session_send(void *p, const struct buffer_t *frames) {
+    struct mux_cli_session *s = (struct mux_cli_session *)p;
+    struct buffer_t *out;
+    size_t offset = 0;
+
+    if (s->dead || s->broken) {
+        return true;  /* Dropped with the session. */
+    }
+    if (s->ready == false || s->writes > 0 || s->kcp_blocked) {
+        return false;  /* Goes out with the next flush, batched. */
+    }
+    out = buffer_create(frames->len + SSR_BUFF_SIZE);
+    while (offset < frames->len) {
+        // Protocol plugins expect reads of at most SSR_BUFF_SIZE.
+        size_t chunk = frames->len - offset;
+        struct buffer_t *piece;
+        if (chunk > SSR_BUFF_SIZE) {
+            chunk = SSR_BUFF_SIZE;
+        }
+        piece = buffer_create_with_headroom(tunnel_cipher_headroom(s->cipher), chunk);
+        buffer_store(piece, frames->buffer + offset, chunk);
+        if (tunnel_cipher_client_encrypt(s->cipher, piece) != ssr_ok) {
+            buffer_release(piece);
+            buffer_release(out);
+            s->broken = true;
+            uv_timer_start(&s->timer, session_timer_cb, 0, 0);
+            return true;
+        }
+        buffer_concatenate2(out, piece);
+        buffer_release(piece);
+        offset += chunk;
+    }
+    session_write(s, out);
+    return true;
+}
+
+static void session_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct mux_cli_session *s = (struct mux_cli_session *)handle->data;
+    (void)suggested_size;
+    *buf = uv_buf_init((char *)buffer_pool_alloc(s->buffer_pool, SSR_BUFF_SIZE), SSR_BUFF_SIZE);
+}
+
+/* What the server sent, still ciphered. */
+static void session_receive(struct mux_cli_session *s, const uint8_t *bytes, size_t size) {
+    struct buffer_t *data, *feedback = NULL;
+    bool ok;
+
+    data = buffer_create_from(bytes, size);
+    if (tunnel_cipher_client_decrypt(s->cipher, data, &feedback) != ssr_ok) {
+        buffer_release(data);
+        session_fail(s);
+        return;
+    }
+    if (feedback) {
+        session_write(s, feedback);
+        s->ready = true;
+    }
+    ok = true;
+    if (data->len > 0) {
+        s->received = true;
+        ok = mux_session_feed(s->session, data->buffer, data->len);
+    } else {
+        mux_session_flush(s->session);
+    }
+    buffer_release(data);
+    if (ok == false) {
+        pr_err("mux session: malformed frame");
+        session_fail(s);
+    }
+}
+
+static void session_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct mux_cli_session *s = (struct mux_cli_session *)stream->data;
+    struct buffer_pool *pool = s->buffer_pool;
+
+    if (s->dead || nread == 0) {
+        // Nothing.
+    } else if (nread < 0) {
+        if (nread != UV_EOF) {
+            pr_err("mux session read failed: %s", uv_strerror((int)nread));
+        }
+        session_fail(s);
+    } else {
+        session_receive(s, (const uint8_t *)buf->base, (size_t)nread);
+    }
+    if (buf->base) {
+        buffer_pool_free(pool, buf->base);
+    }
+}
+
+static void session_kcp_on_data(void *p, const uint8_t *data, size_t size) {
+    struct mux_cli_session *s = (struct mux_cli_session *)p;
+    if (s->dead == false) {
+        session_receive(s, data, size);
+    }
+}
+
+static void session_kcp_on_writable(void *p) {
+    struct mux_cli_session *s = (struct mux_cli_session *)p;
+    if (s->dead == false && s->kcp_blocked) {
+        s->kcp_blocked = false;
+        mux_session_flush(s->session);
+    }
+}
+
+static void session_kcp_on_close(void *p) {
+    struct mux_cli_session *s = (struct mux_cli_session *)p;
+    s->kcp = NULL;
+    session_fail(s);
+}
+
+/* Connected, or on KCP right away: the SSR handshake. */
+static void session_start(struct mux_cli_session *s) {
+    struct server_env_t *env = s->mux->env;
+    struct buffer_t *init_pkg;
+    struct server_info_t *info;
+    uint8_t *iter;
+    size_t len = strlen(MUX_SESSION_HOST);
+
+    // The SSR header of a tunnel, to the name the server answers with frames.
+    init_pkg = buffer_create(SSR_BUFF_SIZE);
+    iter = init_pkg->buffer;
+    *iter++ = 3;  /* Domain name. */
+    *iter++ = (uint8_t)len;
+    memcpy(iter, MUX_SESSION_HOST, len);
+    iter += len;
+    *iter++ = (uint8_t)(MUX_SESSION_PORT >> 8);
+    *iter++ = (uint8_t)MUX_SESSION_PORT;
+    init_pkg->len = (size_t)(iter - init_pkg->buffer);
+
+    s->cipher = tunnel_cipher_create(env, 1452);
+    info = s->cipher->protocol ? s->cipher->protocol->get_server_info(s->cipher->protocol) :
+        (s->cipher->obfs ? s->cipher->obfs->get_server_info(s->cipher->obfs) : NULL);
+    if (info) {
+        info->buffer_size = SSR_BUFF_SIZE;
+        info->head_len = (int) get_s5_head_size(init_pkg->buffer, init_pkg->len, 30);
+    }
+    if (tunnel_cipher_client_encrypt(s->cipher, init_pkg) != ssr_ok) {
+        buffer_release(init_pkg);
+        session_fail(s);
+        return;
+    }
+    session_write(s, init_pkg);
+    if (s->kcp == NULL) {
+        uv_read_start((uv_stream_t *)&s->tcp, session_alloc_cb, session_read_cb);
+    }
+
+    if (tunnel_cipher_client_need_feedback(s->cipher) == false) {
+        // Frames follow the header, session_write_done_cb() flushes them.
+        s->ready = true;
+    }
+}
+
+static void session_connect_done_cb(uv_connect_t *req, int status) {
+    struct mux_cli_session *s = CONTAINER_OF(req, struct mux_cli_session, connect_req);
+
+    if (s->dead) {
+        return;
+    }
+    remote_pool_report(s->mux->env->remote_pool, &s->addr, status == 0);
+    if (status < 0) {
+        pr_err("mux session connect failed: %s", uv_strerror(status));
+        session_fail(s);
+        return;
+    }
+    session_start(s);
+}
+
+static struct mux_cli_session * session_create(struct mux_cli *mux) {
+    struct server_config *config = mux->env->config;
+    union sockaddr_universal addr;
+    struct mux_cli_session *s;
+
+    if (remote_pool_candidates(mux->env->remote_pool, &addr, 1) == 0 &&
+        convert_universal_address(config->remote_host, config->remote_port, &addr) != 0)
+    {
+        return NULL;  /* Not resolved yet. */
+    }
+
+    if (config->transport == server_transport_kcp) {
+        if (config->kcp_port) {
+            addr.addr4.sin_port = htons(config->kcp_port);
+        }
+        if (mux->kcp == NULL) {
+            mux->kcp = kcp_endpoint_create(mux->loop, config, &addr, NULL, NULL);
+            if (mux->kcp == NULL) {
+                return NULL;
+            }
+        }
+    }
+
+    s = (struct mux_cli_session *) calloc(1, sizeof(*s));
+    s->mux = mux;
+    s->addr = addr;
+    s->buffer_pool = mux->env->read_buffer_pool;
+    uv_timer_init(mux->loop, &s->timer);
+    s->timer.data = s;
+    s->handles = 1;
+    s->session = mux_session_create(true, &session_callbacks, s);
+    s->next = mux->sessions;
+    mux->sessions = s;
+
+    if (mux->kcp) {
+        // No connect on UDP, the handshake opens the conversation.
+        s->kcp = kcp_session_open(mux->kcp, &addr, &session_kcp_callbacks, s);
+        if (s->kcp == NULL) {
+            session_fail(s);
+            return NULL;
+        }
+        session_start(s);
+    } else {
+        uv_tcp_init(mux->loop, &s->tcp);
+#if !defined(_WIN32)
+        if (config->mptcp) {
+            int fd = socket_tuning_mptcp_socket(addr.addr.sa_family);
+            if (fd >= 0 && uv_tcp_open(&s->tcp, fd) != 0) {
+                close(fd);  // uv_tcp_connect() makes an ordinary one.
+            }
+        }
+#endif // !defined(_WIN32)
+        s->tcp.data = s;
+        s->handles++;
+        if (uv_tcp_connect(&s->connect_req, &s->tcp, &addr.addr, session_connect_done_cb) != 0) {
+            session_fail(s);
+            return NULL;
+        }
+    }
+    if (s->dead) {
+        return NULL;
+    }
+    uv_timer_start(&s->timer, session_timer_cb, MUX_CLI_IDLE_MS, MUX_CLI_IDLE_MS);
+    return s;
+}
+
+struct mux_cli * mux_cli_create(uv_loop_t *loop, struct server_env_t *env) {
+    struct mux_cli *mux;
+
+    if (env->config->mux_sessions <= 0 && env->config->transport != server_transport_kcp) {
+        return NULL;
+    }
+    mux = (struct mux_cli *) calloc(1, sizeof(*mux));
+    mux->loop = loop;
+    mux->env = env;
+    mux->target = env->config->mux_sessions > 0 ? (size_t)env->config->mux_sessions : 1;
+    return mux;
+}
+
+void mux_cli_destroy(struct mux_cli *mux) {
+    if (mux == NULL) {
+        return;
+    }
+    while (mux->sessions) {
+        session_fail(mux->sessions);
+    }
+    kcp_endpoint_release(mux->kcp);
+    free(mux);
+}
+
+struct mux_stream * mux_cli_open(struct mux_cli *mux, const struct buffer_t *target, const struct mux_stream_callbacks *cb, void *p) {
+    struct mux_cli_session *s, *best = NULL;
+    size_t count = 0;
+
+    if (mux == NULL) {
+        return NULL;
+    }
+    for (s = mux->sessions; s; s = s->next) {
+        if (best == NULL || mux_session_stream_count(s->session) < mux_session_stream_count(best->session)) {
+            best = s;
+        }
+        ++count;
+    }
+    if (count < mux->target && uv_now(mux->loop) >= mux->retry_at &&
+        (best == NULL || mux_session_stream_count(best->session) > 0))
+    {
+        s = session_create(mux);
+        if (s) {
+            best = s;
+        }
+    }
+    if (best == NULL) {
+        return NULL;
+    }
+    // NULL once it's full, the tunnel then connects directly.
+    return mux_stream_open(best->session, target->buffer, target->len, cb, p);
+}
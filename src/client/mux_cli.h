@@ -0,0 +1,28 @@
+#ifndef __MUX_CLI_H__
+#define __MUX_CLI_H__ 1
+
+#include <uv.h>
+#include "mux.h"
+
+struct server_env_t;
+struct buffer_t;
+struct mux_cli;
+
+/*
+ * Up to mux_sessions connections to the SSR server per loop, each carrying
+ * MUX_SESSION_MAX_STREAMS tunnels. A new tunnel goes to the session with
+ * the fewest streams, or opens another one while there are fewer than
+ * configured. A session without streams for MUX_CLI_IDLE_MS is closed.
+ */
+
+#define MUX_CLI_IDLE_MS (30 * 1000)
+#define MUX_CLI_RETRY_MS (10 * 1000)  /* After a session the server never answered. */
+
+/* NULL when mux_sessions is 0. Needs env->remote_pool or a literal remote_host. */
+struct mux_cli * mux_cli_create(uv_loop_t *loop, struct server_env_t *env);
+/* Every stream gets on_close() with |reset| set. */
+void mux_cli_destroy(struct mux_cli *mux);
+/* |target| is the SSR header of the tunnel. NULL means connect it directly. */
+struct mux_stream * mux_cli_open(struct mux_cli *mux, const struct buffer_t *target, const struct mux_stream_callbacks *cb, void *p);
+
+#endif // __MUX_CLI_H__
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+#include "remote_pool.h"
+#include "resolv.h"
+#include "common.h"
+#include "dump_info.h"
+
+#define REMOTE_POOL_HOST_MAX 255
+
+struct remote_entry {
+    union sockaddr_universal addr;
+    uint64_t down_until;  /* uv_now() until which a tunnel failed to connect. */
+};
+
+struct remote_pool {
+    uv_loop_t *loop;
+    struct resolv_ctx *resolver;
+    struct resolv_query *query;
+    uv_getaddrinfo_t req;  /* Without a resolver. */
+    uv_timer_t refresh_timer;
+    int pending;  /* The timer handle and a running uv_getaddrinfo(). */
+    bool released;
+    uint16_t port;  /* Network order. */
+    size_t next;  /* Rotates the reachable addresses. */
+    size_t count;
+    struct remote_entry entries[REMOTE_POOL_MAX_ADDRS];
+    char host[REMOTE_POOL_HOST_MAX + 1];
+};
+
+static void pool_resolve(struct remote_pool *pool);
+
+static void pool_release(struct remote_pool *pool) {
+    if (--pool->pending == 0) {
+        free(pool);
+    }
+}
+
+static bool same_address(const union sockaddr_universal *a, const union sockaddr_universal *b) {
+    if (a->addr.sa_family != b->addr.sa_family) {
+        return false;
+    }
+    if (a->addr.sa_family == AF_INET) {
+        return memcmp(&a->addr4.sin_addr, &b->addr4.sin_addr, sizeof(a->addr4.sin_addr)) == 0;
+    }
+    return memcmp(&a->addr6.sin6_addr, &b->addr6.sin6_addr, sizeof(a->addr6.sin6_addr)) == 0;
+}
+
+static struct remote_entry * pool_find(struct remote_pool *pool, const union sockaddr_universal *addr) {
+    size_t index;
+    for (index = 0; index < pool->count; ++index) {
+        if (same_address(&pool->entries[index].addr, addr)) {
+            return &pool->entries[index];
+        }
+    }
+    return NULL;
+}
+
+static void refresh_timer_cb(uv_timer_t *handle) {
+    pool_resolve((struct remote_pool *)handle->data);
+}
+
+static void pool_resolve_done(struct remote_pool *pool, int status, const union sockaddr_universal *addrs, size_t count) {
+    if (status == 0 && count > 0) {
+        remote_pool_store(pool, addrs, count);
+    } else {
+        // A stale list beats none, the addresses rarely all move at once.
+        pr_warn("resolving \"%s\" failed: %s", pool->host, uv_strerror(status ? status : UV_EAI_NODATA));
+    }
+    uv_timer_start(&pool->refresh_timer, refresh_timer_cb, pool->count ? REMOTE_POOL_REFRESH_MS : REMOTE_POOL_RETRY_MS, 0);
+}
+
+static void pool_resolv_cb(int status, const union sockaddr_universal *addrs, size_t count, void *data) {
+    struct remote_pool *pool = (struct remote_pool *)data;
+    pool->query = NULL;
+    pool_resolve_done(pool, status, addrs, count);
+}
+
+static void pool_getaddrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai) {
+    struct remote_pool *pool = CONTAINER_OF(req, struct remote_pool, req);
+    union sockaddr_universal addrs[REMOTE_POOL_MAX_ADDRS];
+    size_t count = 0;
+
+    if (status == 0) {
+        count = universal_addresses_from_addrinfo(ai, addrs, REMOTE_POOL_MAX_ADDRS);
+    }
+    if (ai) {
+        uv_freeaddrinfo(ai);
+    }
+    if (pool->released == false) {
+        pool_resolve_done(pool, status, addrs, count);
+    }
+    pool_release(pool);
+}
+
+static void pool_resolve(struct remote_pool *pool) {
+    struct addrinfo hints;
+
+    if (pool->resolver) {
+        pool->query = resolv_query(pool->resolver, pool->host, pool->port, pool_resolv_cb, pool);
+        if (pool->query == NULL) {
+            uv_timer_start(&pool->refresh_timer, refresh_timer_cb, REMOTE_POOL_RETRY_MS, 0);
+        }
+        return;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (uv_getaddrinfo(pool->loop, &pool->req, pool_getaddrinfo_cb, pool->host, NULL, &hints) == 0) {
+        pool->pending++;
+    } else {
+        uv_timer_start(&pool->refresh_timer, refresh_timer_cb, REMOTE_POOL_RETRY_MS, 0);
+    }
+}
+
+struct remote_pool * remote_pool_create(uv_loop_t *loop, struct resolv_ctx *resolver, const char *host, uint16_t port) {
+    union sockaddr_universal literal;
+    struct remote_pool *pool;
+
+    if (host == NULL || host[0] == '\0' || strlen(host) > REMOTE_POOL_HOST_MAX) {
+        return NULL;
+    }
+    if (convert_universal_address(host, port, &literal) == 0) {
+        return NULL;  /* Nothing to resolve. */
+    }
+    pool = (struct remote_pool *) calloc(1, sizeof(*pool));
+    pool->loop = loop;
+    pool->resolver = resolver;
+    pool->port = htons(port);
+    strcpy(pool->host, host);
+    uv_timer_init(loop, &pool->refresh_timer);
+    pool->refresh_timer.data = pool;
+    pool->pending = 1;
+
+    pool_resolve(pool);
+    return pool;
+}
+
+static void refresh_timer_close_done_cb(uv_handle_t *handle) {
+    pool_release((struct remote_pool *)handle->data);
+}
+
+void remote_pool_destroy(struct remote_pool *pool) {
+    if (pool == NULL || pool->released) {
+        return;
+    }
+    pool->released = true;
+    if (pool->query) {
+        resolv_cancel(pool->query);
+        pool->query = NULL;
+    }
+    if (pool->pending > 1) {
+        uv_cancel((uv_req_t *)&pool->req);
+    }
+    uv_timer_stop(&pool->refresh_timer);
+    uv_close((uv_handle_t *)&pool->refresh_timer, refresh_timer_close_done_cb);
+}
+
+size_t remote_pool_candidates(struct remote_pool *pool, union sockaddr_universal *addrs, size_t max) {
+    uint64_t now;
+    size_t index, n = 0;
+    int pass;
+
+    if (pool == NULL || pool->released || pool->count == 0) {
+        return 0;
+    }
+    now = uv_now(pool->loop);
+    for (pass = 0; pass < 2; ++pass) {
+        for (index = 0; index < pool->count && n < max; ++index) {
+            const struct remote_entry *entry = &pool->entries[(pool->next + index) % pool->count];
+            if ((entry->down_until <= now) == (pass == 0)) {
+                addrs[n++] = entry->addr;
+            }
+        }
+    }
+    pool->next = (pool->next + 1) % pool->count;
+    return n;
+}
+
+void remote_pool_store(struct remote_pool *pool, const union sockaddr_universal *addrs, size_t count) {
+    struct remote_entry entries[REMOTE_POOL_MAX_ADDRS];
+    size_t index;
+
+    if (pool == NULL || pool->released || count == 0) {
+        return;
+    }
+    if (count > REMOTE_POOL_MAX_ADDRS) {
+        count = REMOTE_POOL_MAX_ADDRS;
+    }
+    for (index = 0; index < count; ++index) {
+        const struct remote_entry *old = pool_find(pool, &addrs[index]);
+        entries[index].addr = addrs[index];
+        entries[index].addr.addr4.sin_port = pool->port;
+        entries[index].down_until = old ? old->down_until : 0;
+    }
+    memcpy(pool->entries, entries, count * sizeof(entries[0]));
+    pool->count = count;
+    pool->next %= count;
+}
+
+void remote_pool_report(struct remote_pool *pool, const union sockaddr_universal *addr, bool reachable) {
+    struct remote_entry *entry;
+
+    if (pool == NULL || pool->released || (entry = pool_find(pool, addr)) == NULL) {
+        return;
+    }
+    entry->down_until = reachable ? 0 : uv_now(pool->loop) + REMOTE_POOL_DOWN_MS;
+}
+
+bool remote_pool_contains(struct remote_pool *pool, const union sockaddr_universal *addr) {
+    return pool && pool->released == false && pool_find(pool, addr) != NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef __REMOTE_POOL_H__
+#define __REMOTE_POOL_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+#include "sockaddr_universal.h"
+
+struct resolv_ctx;
+struct remote_pool;
+
+/*
+ * The addresses of the SSR server, resolved in the background so tunnels
+ * connect without a DNS step of their own. The name is resolved again
+ * every REMOTE_POOL_REFRESH_MS, a failed lookup keeps the old list. An
+ * address a tunnel couldn't connect to sorts last for REMOTE_POOL_DOWN_MS.
+ * One pool per uv_loop_t.
+ */
+
+#define REMOTE_POOL_MAX_ADDRS 8
+#define REMOTE_POOL_REFRESH_MS (60 * 1000)
+#define REMOTE_POOL_RETRY_MS (5 * 1000)  /* While the pool is empty. */
+#define REMOTE_POOL_DOWN_MS (30 * 1000)
+
+/* NULL for a |host| that's an address literal. |resolver| may be NULL, the pool then uses uv_getaddrinfo(). */
+struct remote_pool * remote_pool_create(uv_loop_t *loop, struct resolv_ctx *resolver, const char *host, uint16_t port);
+/* Call before the resolver is shut down. */
+void remote_pool_destroy(struct remote_pool *pool);
+/* Reachable addresses first, rotated per call, ports set. 0 while nothing resolved yet. */
+size_t remote_pool_candidates(struct remote_pool *pool, union sockaddr_universal *addrs, size_t max);
+/* Replaces the list with a fresh answer, |addrs| from a tunnel's own lookup. */
+void remote_pool_store(struct remote_pool *pool, const union sockaddr_universal *addrs, size_t count);
+void remote_pool_report(struct remote_pool *pool, const union sockaddr_universal *addr, bool reachable);
+/* |addr| is in the list, its port aside. */
+bool remote_pool_contains(struct remote_pool *pool, const union sockaddr_universal *addr);
+
+#endif // __REMOTE_POOL_H__
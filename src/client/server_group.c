@@ -0,0 +1,331 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "server_group.h"
+#include "remote_pool.h"
+#include "ssr_executive.h"
+#include "common.h"
+#include "dump_info.h"
+
+#define SERVER_GROUP_DOWN_RANK (UINT64_C(1) << 63)
+
+struct server_member {
+    const char *host;  /* The config's. */
+    uint16_t port;
+    int weight;
+    int64_t current;  /* Smooth weighted round robin. */
+    bool literal;
+    union sockaddr_universal addr;  /* Of a literal host. */
+    struct remote_pool *pool;
+    bool own_pool;
+    uint64_t latency_usec;  /* Moving average of connect times, 0 before the first. */
+    unsigned int failures;  /* Since the last connect. */
+    unsigned int loss;  /* Moving average of the failed share of connects, in 1/1024ths. */
+    uint64_t down_until;
+    uint64_t up_since;  /* Back from being down, it takes its full share SERVER_GROUP_SLOW_START_MS later. */
+};
+
+struct server_group {
+    uv_loop_t *loop;
+    enum server_policy policy;
+    size_t count;
+    struct server_member members[SERVER_GROUP_MAX];
+};
+
+static void member_init(struct server_member *m, uv_loop_t *loop, struct resolv_ctx *resolver, const char *host, uint16_t port, int weight) {
+    m->host = host;
+    m->port = port;
+    m->weight = (weight > 0) ? weight : 1;
+    if (convert_universal_address(host, port, &m->addr) == 0) {
+        m->literal = true;
+    } else {
+        m->pool = remote_pool_create(loop, resolver, host, port);
+        m->own_pool = true;
+    }
+}
+
+struct server_group * server_group_create(uv_loop_t *loop, struct resolv_ctx *resolver, const struct server_config *config, struct remote_pool *primary) {
+    struct server_group *group;
+    size_t index;
+
+    if (config->servers_count == 0) {
+        return NULL;
+    }
+    group = (struct server_group *) calloc(1, sizeof(*group));
+    group->loop = loop;
+    group->policy = config->server_policy;
+
+    group->members[0].host = config->remote_host;
+    group->members[0].port = config->remote_port;
+    group->members[0].weight = 1;
+    group->members[0].pool = primary;
+    group->members[0].literal = (convert_universal_address(config->remote_host, config->remote_port, &group->members[0].addr) == 0);
+    group->count = 1;
+
+    for (index = 0; index < config->servers_count && group->count < SERVER_GROUP_MAX; ++index) {
+        const struct server_group_entry *entry = &config->servers[index];
+        member_init(&group->members[group->count++], loop, resolver, entry->host, entry->port, entry->weight);
+    }
+    if (index < config->servers_count) {
+        pr_warn("only the first %d servers are used", SERVER_GROUP_MAX);
+    }
+    return group;
+}
+
+void server_group_destroy(struct server_group *group) {
+    size_t index;
+
+    if (group == NULL) {
+        return;
+    }
+    for (index = 0; index < group->count; ++index) {
+        if (group->members[index].own_pool) {
+            remote_pool_destroy(group->members[index].pool);
+        }
+    }
+    free(group);
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (size--) {
+        hash = (hash ^ *p++) * UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+/* Rendezvous hashing, a server leaving moves only the sites it had. */
+static uint64_t member_hash(const struct server_member *m, const struct socks5_address *dest) {
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    switch (dest->addr_type) {
+    case SOCKS5_ADDRTYPE_IPV4:
+        hash = fnv1a(hash, &dest->addr.ipv4, sizeof(dest->addr.ipv4));
+        break;
+    case SOCKS5_ADDRTYPE_IPV6:
+        hash = fnv1a(hash, &dest->addr.ipv6, sizeof(dest->addr.ipv6));
+        break;
+    case SOCKS5_ADDRTYPE_DOMAINNAME:
+        hash = fnv1a(hash, dest->addr.domainname, strlen(dest->addr.domainname));
+        break;
+    default:
+        break;
+    }
+    hash = fnv1a(hash, m->host, strlen(m->host));
+    hash = fnv1a(hash, &m->port, sizeof(m->port));
+    // FNV-1a ends weak in the high bits, mix them in.
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/*
+ * Weighted rendezvous: the lowest rank is the highest weight / -ln(u), u
+ * the hash as a number in (0, 1), so each server takes a share of the
+ * sites by its weight. With equal weights it orders as the hash alone.
+ */
+static uint64_t member_rank(const struct server_member *m, const struct socks5_address *dest, double weight) {
+    double u = ((double)(member_hash(m, dest) >> 11) + 0.5) / 9007199254740992.0;
+    double score = weight / -log(u);
+    uint64_t bits;
+    memcpy(&bits, &score, sizeof(bits));
+    // Positive doubles order as their bits, under SERVER_GROUP_DOWN_RANK.
+    return ~bits >> 1;
+}
+
+/* The part of its share a server back from being down takes, 1 once it's through slow start. */
+static double member_ramp(const struct server_member *m, uint64_t now) {
+    if (m->up_since == 0 || now >= m->up_since + SERVER_GROUP_SLOW_START_MS) {
+        return 1.0;
+    }
+    if (now <= m->up_since) {
+        return 1.0 / 16;
+    }
+    return 1.0 / 16 + (15.0 / 16) * (double)(now - m->up_since) / SERVER_GROUP_SLOW_START_MS;
+}
+
+/* Fills |order| best first. */
+static void group_order(struct server_group *group, const struct socks5_address *dest, size_t *order) {
+    uint64_t rank[SERVER_GROUP_MAX];
+    uint64_t now = uv_now(group->loop);
+    struct server_member *chosen = NULL;
+    int64_t total = 0;
+    size_t index, j;
+
+    if (group->policy == server_policy_weighted) {
+        for (index = 0; index < group->count; ++index) {
+            struct server_member *m = &group->members[index];
+            int64_t weight = (int64_t)(m->weight * 16 * member_ramp(m, now));
+            if (m->down_until > now) {
+                continue;
+            }
+            m->current += weight;
+            total += weight;
+            if (chosen == NULL || m->current > chosen->current) {
+                chosen = m;
+            }
+        }
+        if (chosen) {
+            chosen->current -= total;
+        }
+    }
+
+    for (index = 0; index < group->count; ++index) {
+        const struct server_member *m = &group->members[index];
+        double ramp = member_ramp(m, now);
+        double score;
+        switch (group->policy) {
+        case server_policy_weighted:
+            rank[index] = (m == chosen) ? 0 : (uint64_t)(INT32_MAX - m->weight) + 1;
+            break;
+        case server_policy_hash:
+            // Its sites come back as the ramp passes their hash, not all at once.
+            rank[index] = dest ? member_rank(m, dest, m->weight * ramp) : (uint64_t)index;
+            break;
+        default:
+            // A quarter of the connects failing counts as a connect time more, slow start as up to 16 times slower.
+            score = (double)m->latency_usec * (1 + m->failures) * (1 + 4.0 * m->loss / 1024) / ramp;
+            rank[index] = (score < (double)(SERVER_GROUP_DOWN_RANK >> 1)) ? (uint64_t)score : (SERVER_GROUP_DOWN_RANK >> 1);
+            break;
+        }
+        if (m->down_until > now) {
+            rank[index] = SERVER_GROUP_DOWN_RANK | m->failures;
+        }
+        order[index] = index;
+    }
+    for (index = 1; index < group->count; ++index) {
+        size_t key = order[index];
+        for (j = index; j > 0 && rank[order[j - 1]] > rank[key]; --j) {
+            order[j] = order[j - 1];
+        }
+        order[j] = key;
+    }
+}
+
+size_t server_group_candidates(struct server_group *group, const struct socks5_address *dest, union sockaddr_universal *addrs, size_t max) {
+    size_t order[SERVER_GROUP_MAX];
+    size_t index, n = 0;
+
+    if (group == NULL) {
+        return 0;
+    }
+    group_order(group, dest, order);
+    for (index = 0; index < group->count && n < max; ++index) {
+        struct server_member *m = &group->members[order[index]];
+        size_t room = max - n;
+        if (room > SERVER_GROUP_ADDRS_PER_SERVER && index + 1 < group->count) {
+            room = SERVER_GROUP_ADDRS_PER_SERVER;
+        }
+        if (m->literal) {
+            addrs[n++] = m->addr;
+        } else {
+            n += remote_pool_candidates(m->pool, addrs + n, room);
+        }
+    }
+    return n;
+}
+
+static bool member_has(const struct server_member *m, const union sockaddr_universal *addr) {
+    if (addr->addr4.sin_port != htons(m->port)) {
+        return false;
+    }
+    if (m->literal == false) {
+        return remote_pool_contains(m->pool, addr);
+    }
+    if (addr->addr.sa_family != m->addr.addr.sa_family) {
+        return false;
+    }
+    if (addr->addr.sa_family == AF_INET) {
+        return memcmp(&addr->addr4.sin_addr, &m->addr.addr4.sin_addr, sizeof(struct in_addr)) == 0;
+    }
+    return memcmp(&addr->addr6.sin6_addr, &m->addr.addr6.sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+size_t server_group_count(struct server_group *group) {
+    return group ? group->count : 0;
+}
+
+bool server_group_address(struct server_group *group, size_t index, union sockaddr_universal *addr) {
+    const struct server_member *m;
+
+    if (group == NULL || index >= group->count) {
+        return false;
+    }
+    m = &group->members[index];
+    if (m->literal) {
+        *addr = m->addr;
+        return true;
+    }
+    return remote_pool_candidates(m->pool, addr, 1) == 1;
+}
+
+int server_group_member(struct server_group *group, const union sockaddr_universal *addr) {
+    size_t index;
+
+    if (group == NULL) {
+        return -1;
+    }
+    for (index = 0; index < group->count; ++index) {
+        if (member_has(&group->members[index], addr)) {
+            return (int)index;
+        }
+    }
+    return -1;
+}
+
+/* Whether |m| connects that much slower than the median of the servers up, of at least SERVER_GROUP_OUTLIER_MIN. */
+static bool group_outlier(const struct server_group *group, const struct server_member *m, uint64_t now) {
+    uint64_t latency[SERVER_GROUP_MAX];
+    size_t index, j, n = 0;
+
+    for (index = 0; index < group->count; ++index) {
+        const struct server_member *other = &group->members[index];
+        uint64_t key = other->latency_usec;
+        if (key == 0 || (other != m && other->down_until > now)) {
+            continue;
+        }
+        for (j = n++; j > 0 && latency[j - 1] > key; --j) {
+            latency[j] = latency[j - 1];
+        }
+        latency[j] = key;
+    }
+    if (n < SERVER_GROUP_OUTLIER_MIN) {
+        return false;
+    }
+    return m->latency_usec > latency[n / 2] * SERVER_GROUP_OUTLIER_FACTOR + SERVER_GROUP_OUTLIER_SLACK_USEC;
+}
+
+void server_group_report(struct server_group *group, const union sockaddr_universal *addr, bool reachable, uint64_t usec) {
+    struct server_member *m;
+    int index = server_group_member(group, addr);
+    uint64_t now;
+
+    if (index < 0) {
+        return;
+    }
+    m = &group->members[index];
+    now = uv_now(group->loop);
+    remote_pool_report(m->pool, addr, reachable);
+    m->loss = (m->loss * 7 + (reachable ? 0 : 1024)) / 8;
+    if (reachable == false) {
+        m->failures++;
+        m->down_until = now + SERVER_GROUP_DOWN_MS;
+        m->up_since = m->down_until;
+        return;
+    }
+    m->failures = 0;
+    // An eighth of each new sample, one slow connect doesn't swing the choice.
+    m->latency_usec = m->latency_usec ? (m->latency_usec * 7 + usec) / 8 : (usec ? usec : 1);
+    if (group_outlier(group, m, now)) {
+        if (m->down_until <= now) {
+            pr_warn("server %s:%hu ejected, connects take %llums", m->host, m->port, (unsigned long long)(m->latency_usec / 1000));
+        }
+        m->down_until = now + SERVER_GROUP_DOWN_MS;
+        m->up_since = m->down_until;
+    } else if (m->down_until) {
+        // Back before its time was up, slow start from now.
+        m->up_since = (m->down_until > now) ? now : m->up_since;
+        m->down_until = 0;
+    }
+}
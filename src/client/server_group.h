@@ -0,0 +1,53 @@
+#ifndef __SERVER_GROUP_H__
+#define __SERVER_GROUP_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+#include "sockaddr_universal.h"
+
+struct resolv_ctx;
+struct remote_pool;
+struct server_config;
+struct server_group;
+
+/*
+ * remote_host and the configured servers, scored as tunnels connect
+ * through them, and server_probe.h's probes: moving averages of the
+ * connect times and of the failed share of connects, and the failures
+ * since the last success. A server that failed, or whose connects take
+ * SERVER_GROUP_OUTLIER_FACTOR times the median of the others, sorts last
+ * for SERVER_GROUP_DOWN_MS or until it's back to normal. Back, it takes
+ * a part of its share growing over SERVER_GROUP_SLOW_START_MS, so a
+ * recovering server isn't swamped at once. The candidates of a tunnel are the addresses of
+ * every server, best first by server_policy, so the connect race moves
+ * on to the next server once one refuses or stalls. server_policy_hash
+ * ranks by weighted rendezvous hashing of the destination: a server
+ * added or removed moves only its share of the sites, and while one is
+ * down its sites go to their second choice and come back after.
+ * One group per uv_loop_t.
+ */
+
+#define SERVER_GROUP_MAX 16
+#define SERVER_GROUP_ADDRS_PER_SERVER 2  /* Leaves room in the race for the other servers. */
+#define SERVER_GROUP_DOWN_MS (30 * 1000)
+#define SERVER_GROUP_SLOW_START_MS (30 * 1000)
+#define SERVER_GROUP_OUTLIER_FACTOR 3
+#define SERVER_GROUP_OUTLIER_SLACK_USEC 20000  /* Besides, a few ms more on a LAN is no outlier. */
+#define SERVER_GROUP_OUTLIER_MIN 3  /* Servers with connect times up, a median of fewer tells nothing. */
+
+/* NULL without servers. |primary| is remote_host's pool, it stays the caller's. */
+struct server_group * server_group_create(uv_loop_t *loop, struct resolv_ctx *resolver, const struct server_config *config, struct remote_pool *primary);
+/* Call before the resolver is shut down. */
+void server_group_destroy(struct server_group *group);
+/* Ports set. |dest| only matters to server_policy_hash, may be NULL. 0 while nothing resolved yet. */
+size_t server_group_candidates(struct server_group *group, const struct socks5_address *dest, union sockaddr_universal *addrs, size_t max);
+size_t server_group_count(struct server_group *group);
+/* An address of server |index|, port set, false while it's not resolved. */
+bool server_group_address(struct server_group *group, size_t index, union sockaddr_universal *addr);
+/* Index of the server |addr| belongs to, 0 is remote_host, -1 for none. */
+int server_group_member(struct server_group *group, const union sockaddr_universal *addr);
+/* |usec| the connect took, when |reachable|. */
+void server_group_report(struct server_group *group, const union sockaddr_universal *addr, bool reachable, uint64_t usec);
+
+#endif // __SERVER_GROUP_H__
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "server_probe.h"
+#include "server_group.h"
+#include "ssr_executive.h"
+#include "ssrbuffer.h"
+#include "obfs.h"
+#include "obfsutil.h"
+#include "common.h"
+#include "dump_info.h"
+
+struct probe_conn {
+    struct server_probe *probe;
+    size_t member;
+    union sockaddr_universal addr;
+    uv_tcp_t tcp;
+    uv_timer_t timer;
+    uv_connect_t connect_req;
+    uint64_t start;
+    uint64_t connect_usec;
+    struct tunnel_cipher_ctx *cipher;  /* With a probe_target, once connected. */
+    bool done;
+    int open_handles;
+    char buf[SSR_BUFF_SIZE];
+};
+
+struct probe_write {
+    uv_write_t req;
+    struct buffer_t *data;
+};
+
+struct server_probe {
+    uv_loop_t *loop;
+    struct server_env_t *env;
+    uv_timer_t round_timer;
+    uint64_t timeout;
+    struct buffer_t *request;  /* The target's address and "HEAD /", NULL without a probe_target. */
+    struct probe_conn *conns[SERVER_GROUP_MAX];  /* In flight, by server. */
+    size_t open_handles;  /* The round timer's and those of the probes, freed when the last one closes after destroy. */
+    bool released;
+};
+
+static void _probe_handle_closed(struct server_probe *probe) {
+    if (--probe->open_handles == 0 && probe->released) {
+        buffer_release(probe->request);
+        free(probe);
+    }
+}
+
+static void _probe_round_close_done_cb(uv_handle_t *handle) {
+    _probe_handle_closed(CONTAINER_OF(handle, struct server_probe, round_timer));
+}
+
+static void _probe_conn_close_done_cb(uv_handle_t *handle) {
+    struct probe_conn *conn = (struct probe_conn *)handle->data;
+    struct server_probe *probe = conn->probe;
+
+    if (--conn->open_handles == 0) {
+        free(conn);
+    }
+    _probe_handle_closed(probe);
+}
+
+static void _probe_finish(struct probe_conn *conn, bool reachable) {
+    struct server_probe *probe = conn->probe;
+
+    if (conn->done) {
+        return;
+    }
+    conn->done = true;
+    if (probe->released == false) {
+        server_group_report(probe->env->server_group, &conn->addr, reachable, conn->connect_usec);
+    }
+    probe->conns[conn->member] = NULL;
+    if (conn->cipher) {
+        tunnel_cipher_release(conn->cipher);
+        conn->cipher = NULL;
+    }
+    uv_close((uv_handle_t *)&conn->tcp, _probe_conn_close_done_cb);
+    uv_close((uv_handle_t *)&conn->timer, _probe_conn_close_done_cb);
+}
+
+static void _probe_timeout_cb(uv_timer_t *handle) {
+    _probe_finish((struct probe_conn *)handle->data, false);
+}
+
+static void _probe_write_done_cb(uv_write_t *req, int status) {
+    struct probe_write *w = CONTAINER_OF(req, struct probe_write, req);
+    struct probe_conn *conn = (struct probe_conn *)req->handle->data;
+
+    buffer_release(w->data);
+    free(w);
+    if (status < 0) {
+        _probe_finish(conn, false);
+    }
+}
+
+/* Takes |data|. */
+static bool _probe_write(struct probe_conn *conn, struct buffer_t *data) {
+    struct probe_write *w = (struct probe_write *) calloc(1, sizeof(*w));
+    uv_buf_t buf = uv_buf_init((char *)data->buffer, (unsigned int)data->len);
+
+    w->data = data;
+    if (uv_write(&w->req, (uv_stream_t *)&conn->tcp, &buf, 1, _probe_write_done_cb) != 0) {
+        buffer_release(data);
+        free(w);
+        return false;
+    }
+    return true;
+}
+
+static void _probe_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct probe_conn *conn = (struct probe_conn *)handle->data;
+    (void)suggested_size;
+    *buf = uv_buf_init(conn->buf, sizeof(conn->buf));
+}
+
+static void _probe_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct probe_conn *conn = (struct probe_conn *)stream->data;
+    struct buffer_t *data, *feedback = NULL;
+    bool answered;
+
+    if (conn->done || nread == 0) {
+        return;
+    }
+    if (nread < 0) {
+        // Closed before the target said a thing: a bad password, or no way to the target.
+        _probe_finish(conn, false);
+        return;
+    }
+    data = buffer_create_from((uint8_t *)buf->base, (size_t)nread);
+    if (tunnel_cipher_client_decrypt(conn->cipher, data, &feedback) != ssr_ok) {
+        buffer_release(data);
+        buffer_release(feedback);
+        _probe_finish(conn, false);
+        return;
+    }
+    answered = (data->len > 0);
+    buffer_release(data);
+    if (feedback && _probe_write(conn, feedback) == false) {
+        _probe_finish(conn, false);
+        return;
+    }
+    if (answered) {
+        _probe_finish(conn, true);
+    }
+}
+
+/* The handshake a tunnel to the target would make, see do_proxy_connect_request(). */
+static bool _probe_handshake(struct probe_conn *conn) {
+    struct server_probe *probe = conn->probe;
+    struct buffer_t *data = buffer_clone(probe->request);
+    struct server_info_t *info;
+
+    conn->cipher = tunnel_cipher_create(probe->env, 1452);
+    info = conn->cipher->protocol ? conn->cipher->protocol->get_server_info(conn->cipher->protocol) :
+        (conn->cipher->obfs ? conn->cipher->obfs->get_server_info(conn->cipher->obfs) : NULL);
+    if (info) {
+        info->buffer_size = SSR_BUFF_SIZE;
+        info->head_len = (int) get_s5_head_size(data->buffer, data->len, 30);
+    }
+    if (tunnel_cipher_client_encrypt(conn->cipher, data) != ssr_ok) {
+        buffer_release(data);
+        return false;
+    }
+    if (_probe_write(conn, data) == false) {
+        return false;
+    }
+    return uv_read_start((uv_stream_t *)&conn->tcp, _probe_alloc_cb, _probe_read_cb) == 0;
+}
+
+static void _probe_connect_done_cb(uv_connect_t *req, int status) {
+    struct probe_conn *conn = CONTAINER_OF(req, struct probe_conn, connect_req);
+    struct server_probe *probe = conn->probe;
+
+    if (conn->done) {
+        return;
+    }
+    if (status < 0) {
+        _probe_finish(conn, false);
+        return;
+    }
+    conn->connect_usec = (uv_hrtime() - conn->start) / 1000;
+    if (probe->request == NULL) {
+        _probe_finish(conn, true);
+    } else if (_probe_handshake(conn) == false) {
+        _probe_finish(conn, false);
+    }
+}
+
+static void _probe_start(struct server_probe *probe, size_t member) {
+    union sockaddr_universal addr;
+    struct probe_conn *conn;
+
+    if (probe->conns[member] || server_group_address(probe->env->server_group, member, &addr) == false) {
+        return;
+    }
+    conn = (struct probe_conn *) calloc(1, sizeof(*conn));
+    conn->probe = probe;
+    conn->member = member;
+    conn->addr = addr;
+    VERIFY(0 == uv_tcp_init(probe->loop, &conn->tcp));
+    VERIFY(0 == uv_timer_init(probe->loop, &conn->timer));
+    conn->tcp.data = conn;
+    conn->timer.data = conn;
+    conn->open_handles = 2;
+    probe->open_handles += 2;
+    probe->conns[member] = conn;
+    conn->start = uv_hrtime();
+    uv_timer_start(&conn->timer, _probe_timeout_cb, probe->timeout, 0);
+    if (uv_tcp_connect(&conn->connect_req, &conn->tcp, &addr.addr, _probe_connect_done_cb) != 0) {
+        _probe_finish(conn, false);
+    }
+}
+
+static void _probe_round_cb(uv_timer_t *handle) {
+    struct server_probe *probe = CONTAINER_OF(handle, struct server_probe, round_timer);
+    size_t index, count = server_group_count(probe->env->server_group);
+
+    for (index = 0; index < count; ++index) {
+        _probe_start(probe, index);
+    }
+}
+
+struct server_probe * server_probe_create(uv_loop_t *loop, struct server_env_t *env) {
+    struct server_config *config = env->config;
+    struct server_probe *probe;
+
+    if (env->server_group == NULL || config->probe_interval == 0) {
+        return NULL;
+    }
+    probe = (struct server_probe *) calloc(1, sizeof(*probe));
+    probe->loop = loop;
+    probe->env = env;
+    probe->timeout = config->connect_timeout ? config->connect_timeout : DEFAULT_CONNECT_TIMEOUT;
+    if (config->probe_target) {
+        struct socks5_address target;
+        char host[0x0100 + 1] = { 0 };
+        if (socks5_address_from_host_port(config->probe_target, &target) == false) {
+            pr_err("probe_target %s is not host:port, probing connects only", config->probe_target);
+        } else {
+            size_t len = socks5_address_size(&target);
+            probe->request = buffer_create(SSR_BUFF_SIZE);
+            socks5_address_binary(&target, probe->request->buffer, probe->request->capacity);
+            socks5_address_to_string(&target, host, sizeof(host));
+            probe->request->len = len + (size_t)snprintf((char *)probe->request->buffer + len, probe->request->capacity - len,
+                "HEAD / HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", host);
+        }
+    }
+    VERIFY(0 == uv_timer_init(loop, &probe->round_timer));
+    VERIFY(0 == uv_timer_start(&probe->round_timer, _probe_round_cb, 0, config->probe_interval));
+    uv_unref((uv_handle_t *)&probe->round_timer);
+    probe->open_handles = 1;
+    return probe;
+}
+
+void server_probe_destroy(struct server_probe *probe) {
+    size_t index;
+
+    if (probe == NULL || probe->released) {
+        return;
+    }
+    probe->released = true;
+    for (index = 0; index < SERVER_GROUP_MAX; ++index) {
+        if (probe->conns[index]) {
+            _probe_finish(probe->conns[index], false);
+        }
+    }
+    uv_close((uv_handle_t *)&probe->round_timer, _probe_round_close_done_cb);
+}
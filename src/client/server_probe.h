@@ -0,0 +1,28 @@
+#ifndef __SERVER_PROBE_H__
+#define __SERVER_PROBE_H__ 1
+
+#include <uv.h>
+
+struct server_env_t;
+struct server_probe;
+
+/*
+ * Every probe_interval each server of the loop's server group is probed
+ * in the background, so one that went down or slow is found before a
+ * tunnel has to fail on it. A probe connects; with a probe_target it then
+ * goes through a whole SSR handshake like a tunnel's, the same cipher,
+ * protocol and obfs, asks the target for "HEAD /" and waits for the first
+ * byte of the reply. The connect time, or the failure of either step,
+ * goes to server_group_report() as a tunnel's would, which keeps the
+ * scores, ejects the outliers and slow starts the servers back. Without a
+ * probe_target only the connect is probed: a server with a wrong password
+ * or a dead upstream passes. A server still probed from the round before
+ * is skipped, a probe longer than connect_timeout fails.
+ */
+
+/* NULL without env->server_group or probe_interval. With the cipher of |env| made. */
+struct server_probe * server_probe_create(uv_loop_t *loop, struct server_env_t *env);
+/* Before the server group goes. */
+void server_probe_destroy(struct server_probe *probe);
+
+#endif // __SERVER_PROBE_H__
@@ -5,6 +5,9 @@
 #ifndef SHADOWSOCKSR_NATIVE_SSR_CLIENT_API_H
 #define SHADOWSOCKSR_NATIVE_SSR_CLIENT_API_H
 
+#include <stdint.h>
+#include <uv.h>
+
 struct server_config;
 struct ssr_client_state;
 
@@ -13,6 +16,42 @@ int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ss
 void ssr_run_loop_shutdown(struct ssr_client_state *state);
 int ssr_get_listen_socket_fd(struct ssr_client_state *state);
 
+/*
+ * The client as a library, on a loop the caller runs. Instances may share
+ * a loop or have one each, an instance is only called from its loop's
+ * thread and none of these calls block. It listens once the listen host is
+ * resolved, |feedback_state| is called then as with ssr_run_loop_begin().
+ * Workers and signals are left to the caller. The acl is process wide,
+ * loaded by the first instance that has one and freed with the last.
+ */
+struct ssr_client_stats {
+    uint64_t tunnels_accepted;
+    uint64_t tunnels_active;
+    uint64_t bytes_incoming;  /* Read from the applications. */
+    uint64_t bytes_outgoing;  /* Read from the server. */
+    unsigned int configs_retiring;  /* Swapped out configs still serving their tunnels. */
+};
+
+/* Takes |cf| over, even on failure, it's config_release()d once no tunnel uses it. NULL if it can't start. */
+struct ssr_client_state * ssr_client_create(uv_loop_t *loop, struct server_config *cf, void(*feedback_state)(struct ssr_client_state *state, void *p), void *p);
+/* New tunnels use |cf| from now on, the open ones finish with the config
+ * they started with. The UDP relay restarts with |cf|. Takes |cf| over on
+ * success. UV_EINVAL if the listen address, udp, transparent_proxy or the
+ * fake DNS settings differ, those need a new instance. UV_EBUSY while
+ * fast_start is still making the first config's cipher. */
+int ssr_client_swap_config(struct ssr_client_state *state, struct server_config *cf);
+/* Summed over every config the instance has served. */
+void ssr_client_get_stats(const struct ssr_client_state *state, struct ssr_client_stats *stats);
+/* Tunnels |sock|, a stream already connected to the application, to
+ * |host_port| ("host:port" or "[v6]:port") as tunnel_address would: no
+ * SOCKS5 and no loopback connection, for a tun2socks layer that hands its
+ * flows over, one end of a socketpair each. |sock| is the tunnel's from
+ * then on, unless an error is returned: UV_EAGAIN until |feedback_state|
+ * has been called, UV_EINVAL for a bad |host_port|, or uv_tcp_open()'s. */
+int ssr_client_open_flow(struct ssr_client_state *state, uv_os_sock_t sock, const char *host_port);
+/* Closes the listeners and the tunnels. |stopped| is called once all is freed, the loop has to run until then. */
+void ssr_client_destroy(struct ssr_client_state *state, void(*stopped)(void *p), void *p);
+
 void set_app_name(const char *name);
 void set_dump_info_callback(void(*callback)(const char *info, void *p), void *p);
 
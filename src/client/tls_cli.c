@@ -16,6 +16,7 @@
 #include "tunnel.h"
 #include "tls_cli.h"
 #include "ssrbuffer.h"
+#include "buffer_pool.h"
 #include <uv.h>
 #include <uv-mbed/uv-mbed.h>
 
@@ -24,6 +25,8 @@
 #include <string.h>
 #include <assert.h>
 #include "ssrutils.h"
+#include "encrypt.h"
+#include "base64.h"
 
 #define GET_REQUEST_FORMAT ""                                                               \
     "POST %s HTTP/1.1\r\n"                                                                  \
@@ -40,13 +43,57 @@
 
 #define MAX_REQUEST_SIZE      0x8000
 
+/* Streaming mode: one WebSocket upgrade per connection, RFC 6455 frames after it. */
+#define WS_REQUEST_FORMAT ""                                                                \
+    "GET %s HTTP/1.1\r\n"                                                                   \
+    "Host: %s:%d\r\n"                                                                       \
+    "User-Agent: Mozilla/5.0 (Windows NT 5.1; rv:52.0) Gecko/20100101 Firefox/52.0\r\n"     \
+    "Upgrade: websocket\r\n"                                                                \
+    "Connection: Upgrade\r\n"                                                               \
+    "Sec-WebSocket-Key: %s\r\n"                                                             \
+    "Sec-WebSocket-Version: 13\r\n"                                                         \
+    "\r\n"                                                                                  \
+
+#define HTTP_HEADER_END "\r\n\r\n"
+#define WS_FRAME_HEADER_MAX 14  /* Client frames, 64 bit length and mask. */
+#define WS_FRAME_PAYLOAD_MAX 0x1000000
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+
+/* Below the idle timeout a web server gives a connection without a request. */
+#define TLS_CLI_SPARE_MAX_AGE_MS (30 * 1000)
+
 struct tls_cli_ctx {
-    struct tunnel_ctx *tunnel; /* weak pointer */
+    struct tunnel_ctx *tunnel; /* weak pointer, NULL while a spare */
     struct server_config *config; /* weak pointer */
+    struct buffer_pool *buffer_pool;
     uv_mbed_t *mbed;
+    struct tls_cli_pool *pool;  /* Set until a tunnel takes the spare. */
+    struct tls_cli_ctx *next_spare;
+    bool connected;
+    uint64_t connected_at;
     bool header_parsed;
     size_t file_size;
     size_t progress_size;
+    bool closing;
+    bool streaming;  /* over_tls_streaming. */
+    bool upgraded;  /* The server answered the upgrade with 101. */
+    struct buffer_t *rx;  /* Streaming input not parsed yet. */
+    uint8_t *tx;  /* Scratch for masked frames. */
+    size_t tx_capacity;
+};
+
+struct tls_cli_pool {
+    uv_loop_t *loop;
+    struct server_config *config;
+    struct buffer_pool *buffer_pool;
+    size_t target;
+    size_t pending;  /* Spares connecting or connected. */
+    struct tls_cli_ctx *spares;  /* Connected, oldest first. */
+    bool released;
 };
 
 static void tunnel_tls_send_data(struct tunnel_ctx *tunnel, const uint8_t *data, size_t size);
@@ -57,12 +104,135 @@ static void _mbed_data_received_cb(uv_mbed_t *mbed, ssize_t nread, uv_buf_t* buf
 static void _tls_cli_send_data(struct tls_cli_ctx *, const uint8_t *data, size_t size);
 static void _mbed_write_done_cb(uv_mbed_t *mbed, int status, void *p);
 static void _mbed_close_done_cb(uv_mbed_t *mbed, void *p);
+static void _tls_cli_close(struct tls_cli_ctx *ctx);
+static void _ws_send_upgrade(struct tls_cli_ctx *ctx);
+static void _ws_send_frame(struct tls_cli_ctx *ctx, uint8_t opcode, const uint8_t *data, size_t size);
+static void _ws_on_data(struct tls_cli_ctx *ctx, uint8_t *data, size_t size);
 
-void tls_client_launch(struct tunnel_ctx *tunnel, struct server_config *config) {
-    uv_loop_t *loop = tunnel->listener->loop;
+// uv_mbed_init() builds the mbedTLS config, RNG and trust store of its own handle,
+// uv-mbed takes no shared one. Spares from tls_cli_pool do that work off the tunnel's path.
+static struct tls_cli_ctx * _tls_cli_ctx_create(uv_loop_t *loop, struct server_config *config, struct buffer_pool *buffer_pool) {
     struct tls_cli_ctx *ctx = (struct tls_cli_ctx *)calloc(1, sizeof(*ctx));
     ctx->mbed = uv_mbed_init(loop, NULL, 0);
     ctx->config = config;
+    ctx->buffer_pool = buffer_pool;
+    ctx->streaming = config->over_tls_streaming;
+    if (ctx->streaming) {
+        ctx->rx = buffer_create(0);
+    }
+    return ctx;
+}
+
+static void _tls_cli_pool_free_when_idle(struct tls_cli_pool *pool) {
+    if (pool->released && pool->pending == 0) {
+        free(pool);
+    }
+}
+
+static void _tls_cli_pool_unlink(struct tls_cli_pool *pool, struct tls_cli_ctx *ctx) {
+    struct tls_cli_ctx **link;
+    for (link = &pool->spares; *link; link = &(*link)->next_spare) {
+        if (*link == ctx) {
+            *link = ctx->next_spare;
+            ctx->next_spare = NULL;
+            return;
+        }
+    }
+}
+
+static void _tls_cli_pool_fill(struct tls_cli_pool *pool) {
+    while (pool->released == false && pool->pending < pool->target) {
+        struct tls_cli_ctx *ctx = _tls_cli_ctx_create(pool->loop, pool->config, pool->buffer_pool);
+        ctx->pool = pool;
+        pool->pending++;
+        uv_mbed_connect(ctx->mbed, pool->config->remote_host, pool->config->remote_port, _mbed_connect_done_cb, ctx);
+    }
+}
+
+/* The oldest spare still young enough for the server to keep, detached from the pool. */
+static struct tls_cli_ctx * _tls_cli_pool_take(struct tls_cli_pool *pool) {
+    struct tls_cli_ctx *ctx;
+    uint64_t now;
+
+    if (pool == NULL || pool->released) {
+        return NULL;
+    }
+    now = uv_now(pool->loop);
+    while ((ctx = pool->spares) != NULL) {
+        pool->spares = ctx->next_spare;
+        ctx->next_spare = NULL;
+        if (now - ctx->connected_at < TLS_CLI_SPARE_MAX_AGE_MS) {
+            ctx->pool = NULL;
+            pool->pending--;
+            break;
+        }
+        _tls_cli_close(ctx);
+    }
+    // Only a taken spare is replaced, an unreachable server costs one attempt per tunnel.
+    _tls_cli_pool_fill(pool);
+    return ctx;
+}
+
+struct tls_cli_pool * tls_cli_pool_create(uv_loop_t *loop, struct server_config *config, struct buffer_pool *buffer_pool) {
+    struct tls_cli_pool *pool;
+
+    if (config->over_tls_spare_connections <= 0) {
+        return NULL;
+    }
+    pool = (struct tls_cli_pool *)calloc(1, sizeof(*pool));
+    pool->loop = loop;
+    pool->config = config;
+    pool->buffer_pool = buffer_pool;
+    pool->target = (size_t)config->over_tls_spare_connections;
+    _tls_cli_pool_fill(pool);
+    return pool;
+}
+
+void tls_cli_pool_destroy(struct tls_cli_pool *pool) {
+    struct tls_cli_ctx *ctx;
+
+    if (pool == NULL || pool->released) {
+        return;
+    }
+    pool->released = true;
+    while ((ctx = pool->spares) != NULL) {
+        pool->spares = ctx->next_spare;
+        ctx->next_spare = NULL;
+        _tls_cli_close(ctx);
+    }
+    // Spares still connecting close from _mbed_connect_done_cb().
+    _tls_cli_pool_free_when_idle(pool);
+}
+
+static void _tls_cli_connected(struct tls_cli_ctx *ctx) {
+    struct tunnel_ctx *tunnel = ctx->tunnel;
+
+    if (ctx->streaming) {
+        // Established once the upgrade is answered.
+        _ws_send_upgrade(ctx);
+        return;
+    }
+
+    if (tunnel->tunnel_tls_on_connection_established) {
+        tunnel->tunnel_tls_on_connection_established(tunnel);
+    }
+}
+
+void tls_client_launch(struct tunnel_ctx *tunnel, struct server_env_t *env) {
+    uv_loop_t *loop = tunnel->listener->loop;
+    struct server_config *config = env->config;
+    struct tls_cli_ctx *ctx = _tls_cli_pool_take(env->tls_cli_pool);
+
+    if (ctx) {
+        // Handshake done already, and the connection is being read.
+        ctx->tunnel = tunnel;
+        tunnel->tls_ctx = ctx;
+        tunnel->tunnel_tls_send_data = &tunnel_tls_send_data;
+        _tls_cli_connected(ctx);
+        return;
+    }
+
+    ctx = _tls_cli_ctx_create(loop, config, tunnel->buffer_pool);
     ctx->tunnel = tunnel;
 
     tunnel->tls_ctx = ctx;
@@ -72,42 +242,98 @@ void tls_client_launch(struct tunnel_ctx *tunnel, struct server_config *config)
 }
 
 void tls_client_shutdown(struct tunnel_ctx *tunnel) {
+    _tls_cli_close(tunnel->tls_ctx);
+}
+
+void tls_client_trim(struct tunnel_ctx *tunnel) {
     struct tls_cli_ctx *ctx = tunnel->tls_ctx;
+    if (ctx == NULL) {
+        return;
+    }
+    buffer_trim(ctx->rx);
+    // Nothing points into it between frames, see _ws_send_frame().
+    free(ctx->tx);
+    ctx->tx = NULL;
+    ctx->tx_capacity = 0;
+}
+
+static void _tls_cli_close(struct tls_cli_ctx *ctx) {
+    if (ctx->closing) {
+        return;
+    }
+    ctx->closing = true;
+    if (ctx->pool) {
+        _tls_cli_pool_unlink(ctx->pool, ctx);
+    }
     uv_mbed_close(ctx->mbed, _mbed_close_done_cb, ctx);
 }
 
 static void _mbed_connect_done_cb(uv_mbed_t* mbed, int status, void *p) {
     struct tls_cli_ctx *ctx = (struct tls_cli_ctx *)p;
-    struct tunnel_ctx *tunnel = ctx->tunnel;
+    struct tls_cli_pool *pool = ctx->pool;
+    struct loop_watchdog *dog = ctx->tunnel ? ctx->tunnel->watchdog : NULL;
+    uint64_t begun;
 
     if (status < 0) {
         fprintf(stderr, "connect failed: %d: %s\n", status, uv_strerror(status));
-        uv_mbed_close(mbed, _mbed_close_done_cb, p);
+        _tls_cli_close(ctx);
+        return;
+    }
+    if (pool && pool->released) {
+        _tls_cli_close(ctx);
         return;
     }
 
+    // A spare reads too, so a close from the server is noticed while it waits.
     uv_mbed_read(mbed, _mbed_alloc_done_cb, _mbed_data_received_cb, p);
 
-    if (tunnel->tunnel_tls_on_connection_established) {
-        tunnel->tunnel_tls_on_connection_established(tunnel);
+    if (pool) {
+        struct tls_cli_ctx **link = &pool->spares;
+        while (*link) {
+            link = &(*link)->next_spare;
+        }
+        *link = ctx;
+        ctx->connected = true;
+        ctx->connected_at = uv_now(pool->loop);
+        return;
     }
+
+    begun = loop_watchdog_begin(dog);
+    _tls_cli_connected(ctx);
+    loop_watchdog_end(dog, loop_work_tls, begun);
 }
 
 static void _mbed_alloc_done_cb(uv_mbed_t *mbed, size_t suggested_size, uv_buf_t *buf, void *p) {
-    char *base = (char *) calloc(suggested_size, sizeof(char));
+    struct tls_cli_ctx *ctx = (struct tls_cli_ctx *)p;
+    // One byte over, for the terminator _mbed_data_received_cb() puts after the data.
+    char *base = (char *) buffer_pool_alloc(ctx->buffer_pool, suggested_size + 1);
     *buf = uv_buf_init(base, suggested_size);
 }
 
 static void _mbed_data_received_cb(uv_mbed_t *mbed, ssize_t nread, uv_buf_t* buf, void *p) {
     struct tls_cli_ctx *ctx = (struct tls_cli_ctx *)p;
     struct tunnel_ctx *tunnel = ctx->tunnel;
+    struct loop_watchdog *dog = tunnel ? tunnel->watchdog : NULL;
+    uint64_t begun = loop_watchdog_begin(dog);
     assert(ctx->mbed == mbed);
-    if (nread > 0) {
+    if (tunnel == NULL) {
+        // Nothing is due on a spare, whatever arrives ends it.
+        if (nread != 0) {
+            _tls_cli_close(ctx);
+        }
+    } else if (nread > 0 && ctx->streaming) {
+        if (ctx->closing == false) {
+            _ws_on_data(ctx, (uint8_t *)buf->base, (size_t)nread);
+        }
+    } else if (nread > 0) {
         char *ptmp = (char *)buf->base;
         size_t len0 = (size_t)nread;
         if (ctx->header_parsed == false) {
 #define GET_REQUEST_END "\r\n\r\n"
-            char *px = strstr((char *)buf->base, GET_REQUEST_END);
+            char *px;
+            // Terminated for strstr(), the block has room for it.
+            buf->base[nread] = '\0';
+            px = strstr((char *)buf->base, GET_REQUEST_END);
             if (px != NULL) {
                 ptmp = px + strlen(GET_REQUEST_END);
                 len0 = len0 - (size_t)(ptmp - buf->base);
@@ -132,21 +358,30 @@ static void _mbed_data_received_cb(uv_mbed_t *mbed, ssize_t nread, uv_buf_t* buf
         } else {
             pr_err("read error %ld: %s\n", nread, uv_strerror((int) nread));
         }
-        uv_mbed_close(mbed, _mbed_close_done_cb, p);
+        _tls_cli_close(ctx);
     }
 
-    free(buf->base);
+    buffer_pool_free(ctx->buffer_pool, buf->base);
+    loop_watchdog_end(dog, loop_work_tls, begun);
+}
+
+int tls_cli_request_header(const struct server_config *config, size_t content_length, char *buf, size_t size) {
+    return mbedtls_snprintf(buf, size, GET_REQUEST_FORMAT,
+        config->over_tls_path, config->over_tls_server_domain, config->remote_port, (int)content_length);
 }
 
 static void _tls_cli_send_data(struct tls_cli_ctx *ctx, const uint8_t *data, size_t size) {
-    struct server_config *config = ctx->config;
-    const char *url_path = config->over_tls_path;
-    const char *domain = config->over_tls_server_domain;
-    unsigned short domain_port = config->remote_port;
     uv_buf_t o;
-    uint8_t *buf = (uint8_t *)calloc(MAX_REQUEST_SIZE + 1, sizeof(*buf));
-    int len = mbedtls_snprintf((char *)buf, MAX_REQUEST_SIZE, GET_REQUEST_FORMAT,
-        url_path, domain, domain_port, (int)size);
+    uint8_t *buf;
+    int len;
+
+    if (ctx->streaming) {
+        _ws_send_frame(ctx, WS_OP_BINARY, data, size);
+        return;
+    }
+
+    buf = (uint8_t *)calloc(MAX_REQUEST_SIZE + 1, sizeof(*buf));
+    len = tls_cli_request_header(ctx->config, size, (char *)buf, MAX_REQUEST_SIZE);
 
     if (data && size) {
         memcpy(buf + len, data, size);
@@ -164,7 +399,7 @@ static void _mbed_write_done_cb(uv_mbed_t *mbed, int status, void *p) {
     assert(ctx->mbed == mbed);
     if (status < 0) {
         pr_err("write failed: %d: %s\n", status, uv_strerror(status));
-        uv_mbed_close(mbed, _mbed_close_done_cb, p);
+        _tls_cli_close(ctx);
     } else {
         pr_info("request sent %d\n", status);
     }
@@ -173,17 +408,225 @@ static void _mbed_write_done_cb(uv_mbed_t *mbed, int status, void *p) {
 static void _mbed_close_done_cb(uv_mbed_t *mbed, void *p) {
     struct tls_cli_ctx *ctx = (struct tls_cli_ctx *)p;
     struct tunnel_ctx *tunnel = ctx->tunnel;
+    struct tls_cli_pool *pool = ctx->pool;
     assert(mbed == ctx->mbed);
 
-    if (tunnel->tunnel_tls_on_shutting_down) {
+    if (tunnel && tunnel->tunnel_tls_on_shutting_down) {
         tunnel->tunnel_tls_on_shutting_down(tunnel);
     }
 
     uv_mbed_free(mbed);
+    buffer_release(ctx->rx);
+    free(ctx->tx);
     free(ctx);
+
+    if (pool) {
+        pool->pending--;
+        _tls_cli_pool_free_when_idle(pool);
+    }
 }
 
 static void tunnel_tls_send_data(struct tunnel_ctx *tunnel, const uint8_t *data, size_t size) {
     struct tls_cli_ctx *ctx = tunnel->tls_ctx;
     _tls_cli_send_data(ctx, data, size);
 }
+
+static void _ws_send_upgrade(struct tls_cli_ctx *ctx) {
+    const struct server_config *config = ctx->config;
+    unsigned char nonce[16];
+    unsigned char key[32] = { 0 };
+    char request[MAX_REQUEST_SIZE];
+    uv_buf_t o;
+    int len;
+
+    rand_bytes(nonce, sizeof(nonce));
+    std_base64_encode(nonce, (int)sizeof(nonce), key);
+    len = mbedtls_snprintf(request, sizeof(request), WS_REQUEST_FORMAT,
+        config->over_tls_path, config->over_tls_server_domain, config->remote_port, (char *)key);
+    o = uv_buf_init(request, (unsigned int)len);
+    uv_mbed_write(ctx->mbed, &o, &_mbed_write_done_cb, ctx);
+}
+
+/* |src| XOR the repeated |mask| into |dst|, a word at a time, the two may be the same. */
+static void _ws_mask(uint8_t *dst, const uint8_t *src, size_t size, const uint8_t *mask) {
+    uint8_t key8[8];
+    uint64_t key, word;
+    size_t index = 0;
+
+    memcpy(key8, mask, 4);
+    memcpy(key8 + 4, mask, 4);
+    memcpy(&key, key8, sizeof(key));
+    for (; index + sizeof(word) <= size; index += sizeof(word)) {
+        memcpy(&word, src + index, sizeof(word));
+        word ^= key;
+        memcpy(dst + index, &word, sizeof(word));
+    }
+    for (; index < size; ++index) {
+        dst[index] = src[index] ^ mask[index & 3];
+    }
+}
+
+static void _ws_send_frame(struct tls_cli_ctx *ctx, uint8_t opcode, const uint8_t *data, size_t size) {
+    size_t header = 2, index;
+    uint8_t *frame, *mask, *payload;
+    uv_buf_t o;
+
+    if (size > 0xFFFF) {
+        header += 8;
+    } else if (size >= 126) {
+        header += 2;
+    }
+    if (ctx->tx_capacity < header + 4 + size) {
+        ctx->tx_capacity = header + 4 + size;
+        ctx->tx = (uint8_t *)realloc(ctx->tx, ctx->tx_capacity);
+    }
+    frame = ctx->tx;
+    frame[0] = (uint8_t)(0x80 | opcode);  /* FIN */
+    if (size > 0xFFFF) {
+        frame[1] = 0x80 | 127;
+        for (index = 0; index < 8; ++index) {
+            frame[2 + index] = (uint8_t)((uint64_t)size >> (56 - 8 * index));
+        }
+    } else if (size >= 126) {
+        frame[1] = 0x80 | 126;
+        frame[2] = (uint8_t)(size >> 8);
+        frame[3] = (uint8_t)size;
+    } else {
+        frame[1] = (uint8_t)(0x80 | size);
+    }
+    // Client frames must be masked, a proxy in between would drop them otherwise.
+    mask = frame + header;
+    rand_bytes(mask, 4);
+    payload = mask + 4;
+    _ws_mask(payload, data, size, mask);
+
+    // uv_mbed_write() encrypts into its own buffer before returning.
+    o = uv_buf_init((char *)frame, (unsigned int)(header + 4 + size));
+    uv_mbed_write(ctx->mbed, &o, &_mbed_write_done_cb, ctx);
+}
+
+/* Delivers the complete frames at the head of |data|, returns the bytes they took. */
+static size_t _ws_consume(struct tls_cli_ctx *ctx, uint8_t *data, size_t size) {
+    struct tunnel_ctx *tunnel = ctx->tunnel;
+    size_t used = 0;
+
+    while (ctx->closing == false && size - used >= 2) {
+        uint8_t *p = data + used;
+        size_t avail = size - used, header = 2, length = p[1] & 0x7F, index;
+        uint8_t opcode = p[0] & 0x0F;
+        bool masked = (p[1] & 0x80) != 0;
+        uint8_t *payload;
+
+        if (length == 126) {
+            if (avail < 4) {
+                break;
+            }
+            length = ((size_t)p[2] << 8) | p[3];
+            header = 4;
+        } else if (length == 127) {
+            uint64_t length64 = 0;
+            if (avail < 10) {
+                break;
+            }
+            for (index = 0; index < 8; ++index) {
+                length64 = (length64 << 8) | p[2 + index];
+            }
+            if (length64 > WS_FRAME_PAYLOAD_MAX) {
+                pr_err("over TLS frame of %llu bytes", (unsigned long long)length64);
+                _tls_cli_close(ctx);
+                break;
+            }
+            length = (size_t)length64;
+            header = 10;
+        }
+        if (masked) {
+            header += 4;
+        }
+        if (avail < header + length) {
+            break;
+        }
+        payload = p + header;
+        if (masked) {
+            _ws_mask(payload, payload, length, p + header - 4);
+        }
+        used += header + length;
+
+        switch (opcode) {
+        case WS_OP_CONTINUATION:
+        case WS_OP_TEXT:
+        case WS_OP_BINARY:
+            if (length > 0 && tunnel->tunnel_tls_on_data_received) {
+                tunnel->tunnel_tls_on_data_received(tunnel, payload, length);
+            }
+            break;
+        case WS_OP_CLOSE:
+            _tls_cli_close(ctx);
+            break;
+        case WS_OP_PING:
+            _ws_send_frame(ctx, 0xA, payload, length);
+            break;
+        default:
+            break;  /* Pong and reserved opcodes. */
+        }
+    }
+    return used;
+}
+
+static size_t _http_header_size(const uint8_t *data, size_t size) {
+    size_t index, end_len = strlen(HTTP_HEADER_END);
+    for (index = 0; index + end_len <= size; ++index) {
+        if (memcmp(data + index, HTTP_HEADER_END, end_len) == 0) {
+            return index + end_len;
+        }
+    }
+    return 0;
+}
+
+static void _ws_on_data(struct tls_cli_ctx *ctx, uint8_t *data, size_t size) {
+    struct buffer_t *rx = ctx->rx;
+    struct tunnel_ctx *tunnel = ctx->tunnel;
+    size_t used;
+
+    if (ctx->upgraded && rx->len == 0) {
+        // The common case, frames straight from the read buffer.
+        used = _ws_consume(ctx, data, size);
+        if (ctx->closing == false && used < size) {
+            buffer_concatenate(rx, data + used, size - used);
+        }
+        return;
+    }
+    buffer_concatenate(rx, data, size);
+
+    if (ctx->upgraded == false) {
+        size_t header = _http_header_size(rx->buffer, rx->len);
+        const uint8_t *status;
+        if (header == 0) {
+            if (rx->len > MAX_REQUEST_SIZE) {
+                pr_err("over TLS upgrade reply too long");
+                _tls_cli_close(ctx);
+            }
+            return;
+        }
+        status = (const uint8_t *)memchr(rx->buffer, ' ', header);
+        if (status == NULL || memcmp(status + 1, "101", 3) != 0) {
+            pr_err("over TLS upgrade refused: %.*s", (int)strcspn((const char *)rx->buffer, "\r\n"), (const char *)rx->buffer);
+            _tls_cli_close(ctx);
+            return;
+        }
+        buffer_shorten(rx, header, rx->len - header);
+        ctx->upgraded = true;
+        ctx->header_parsed = true;
+
+        if (tunnel->tunnel_tls_on_connection_established) {
+            tunnel->tunnel_tls_on_connection_established(tunnel);
+        }
+        if (ctx->closing) {
+            return;
+        }
+    }
+
+    used = _ws_consume(ctx, rx->buffer, rx->len);
+    if (ctx->closing == false) {
+        buffer_shorten(rx, used, rx->len - used);
+    }
+}
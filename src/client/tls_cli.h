@@ -1,10 +1,27 @@
 #ifndef __TLS_CLI_H__
 #define __TLS_CLI_H__ 1
 
+#include <stddef.h>
+#include <uv.h>
+
 struct tunnel_ctx;
 struct server_config;
+struct server_env_t;
+struct buffer_pool;
+struct tls_cli_pool;
 
-void tls_client_launch(struct tunnel_ctx *tunnel, struct server_config *config);
+void tls_client_launch(struct tunnel_ctx *tunnel, struct server_env_t *env);
 void tls_client_shutdown(struct tunnel_ctx *tunnel);
+/* Frees the streaming scratch space of an idle tunnel, it is grown back as data flows. */
+void tls_client_trim(struct tunnel_ctx *tunnel);
+/*
+ * Handshakes done ahead of the tunnels that need them, over_tls_spare_connections
+ * per loop. A tunnel takes one and the pool opens a replacement. NULL when the
+ * option is 0.
+ */
+struct tls_cli_pool * tls_cli_pool_create(uv_loop_t *loop, struct server_config *config, struct buffer_pool *buffer_pool);
+void tls_cli_pool_destroy(struct tls_cli_pool *pool);
+/* The HTTP request that opens an over TLS stream, returns its length. */
+int tls_cli_request_header(const struct server_config *config, size_t content_length, char *buf, size_t size);
 
 #endif // __TLS_CLI_H__
@@ -0,0 +1,447 @@
+#include <uv.h>
+#include <uv-mbed/uv-mbed.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+#include "common.h"
+#include "dump_info.h"
+#include "sockaddr_universal.h"
+#include "ssr_executive.h"
+#include "ssrbuffer.h"
+#include "udprelay.h"
+#include "udp_stream.h"
+#include "tls_cli.h"
+#include "udp_stream_cli.h"
+#include "socket_tuning.h"
+
+#define UDP_STREAM_BACKLOG_MAX      (256 * 1024) /* Frames held while connecting. */
+#define UDP_STREAM_WRITES_MAX       256 /* Writes in flight before datagrams are dropped. */
+#define UDP_STREAM_RETRY_MS         1000
+#define UDP_STREAM_HTTP_HEADER_MAX  0x2000
+#define UDP_STREAM_REQUEST_MAX      0x400
+
+enum udp_stream_state {
+    udp_stream_idle,
+    udp_stream_connecting,
+    udp_stream_connected,
+    udp_stream_closing,
+};
+
+struct udp_stream_cli {
+    uv_loop_t *loop;
+    struct server_config *config; /* weak pointer */
+    struct udp_listener_ctx_t *udp_server; /* weak pointer */
+    enum udp_stream_state state;
+    bool over_tls;
+    bool released;
+    int ref_count; /* The owner and every pending callback hold one. */
+    uv_getaddrinfo_t resolver;
+    uv_connect_t connect_req;
+    uv_tcp_t *tcp;
+    uv_mbed_t *mbed;
+    struct buffer_t *backlog; /* Frames sent once the stream is up. */
+    size_t writes_pending;
+    bool header_parsed; /* The HTTP response header was skipped, over TLS only. */
+    struct buffer_t *http_header;
+    struct udp_stream_decoder decoder;
+    uint64_t retry_after; /* uv_now() before which a failed stream is not retried. */
+    char read_buf[UDP_STREAM_FRAME_HEAD + UDP_STREAM_MAX_DATAGRAM];
+};
+
+struct udp_stream_write_req {
+    uv_write_t req;
+    struct buffer_t *buf;
+};
+
+static void stream_send_cb(void *p, uint32_t assoc_id, const uint8_t *data, size_t len);
+static void stream_connect(struct udp_stream_cli *cli);
+static void stream_fail(struct udp_stream_cli *cli, const char *what, int status);
+static void stream_close(struct udp_stream_cli *cli);
+static void stream_write(struct udp_stream_cli *cli, struct buffer_t *buf);
+static void stream_on_data(struct udp_stream_cli *cli, const uint8_t *data, size_t len);
+
+static void stream_add_ref(struct udp_stream_cli *cli) {
+    ++cli->ref_count;
+}
+
+static void stream_release(struct udp_stream_cli *cli) {
+    if (--cli->ref_count > 0) {
+        return;
+    }
+    udp_stream_decoder_release(&cli->decoder);
+    buffer_release(cli->backlog);
+    buffer_release(cli->http_header);
+    free(cli);
+}
+
+struct udp_stream_cli * udp_stream_cli_create(uv_loop_t *loop, struct server_config *config, struct udp_listener_ctx_t *udp_server) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *) calloc(1, sizeof(*cli));
+    cli->loop = loop;
+    cli->config = config;
+    cli->udp_server = udp_server;
+    cli->over_tls = config->over_tls_enable;
+    cli->ref_count = 1;
+    cli->state = udp_stream_idle;
+    cli->backlog = buffer_create(0);
+    udp_stream_decoder_init(&cli->decoder);
+
+    udprelay_set_stream(udp_server, &stream_send_cb, cli);
+    return cli;
+}
+
+void udp_stream_cli_shutdown(struct udp_stream_cli *cli) {
+    if (cli == NULL || cli->released) {
+        return;
+    }
+    cli->released = true;
+    udprelay_set_stream(cli->udp_server, NULL, NULL);
+    cli->udp_server = NULL;
+    stream_close(cli);
+    stream_release(cli);
+}
+
+static void stream_send_cb(void *p, uint32_t assoc_id, const uint8_t *data, size_t len) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)p;
+
+    if (cli->released) {
+        return;
+    }
+    if (cli->state == udp_stream_connected) {
+        struct buffer_t *frame;
+        // A stalled stream drops datagrams like a congested link would.
+        if (cli->writes_pending >= UDP_STREAM_WRITES_MAX) {
+            return;
+        }
+        frame = buffer_create(UDP_STREAM_FRAME_HEAD + len);
+        if (udp_stream_frame_append(frame, assoc_id, data, len)) {
+            stream_write(cli, frame);
+        }
+        buffer_release(frame);
+        return;
+    }
+    if (cli->backlog->len + UDP_STREAM_FRAME_HEAD + len > UDP_STREAM_BACKLOG_MAX) {
+        return;
+    }
+    udp_stream_frame_append(cli->backlog, assoc_id, data, len);
+    if (cli->state == udp_stream_idle) {
+        if (uv_now(cli->loop) < cli->retry_after) {
+            buffer_reset(cli->backlog);
+            return;
+        }
+        stream_connect(cli);
+    }
+}
+
+// Magic, queued frames and, over TLS, the HTTP request in front.
+static void stream_send_preamble(struct udp_stream_cli *cli) {
+    size_t content_len = UDP_STREAM_MAGIC_LEN + cli->backlog->len;
+    struct buffer_t *buf = buffer_create(UDP_STREAM_REQUEST_MAX + content_len);
+
+    if (cli->over_tls) {
+        char header[UDP_STREAM_REQUEST_MAX];
+        int len = tls_cli_request_header(cli->config, content_len, header, sizeof(header));
+        if (len > 0 && (size_t)len < sizeof(header)) {
+            buffer_concatenate(buf, (uint8_t *)header, (size_t)len);
+        }
+    }
+    buffer_concatenate(buf, (const uint8_t *)UDP_STREAM_MAGIC, UDP_STREAM_MAGIC_LEN);
+    buffer_concatenate2(buf, cli->backlog);
+    buffer_reset(cli->backlog);
+
+    stream_write(cli, buf);
+    buffer_release(buf);
+}
+
+static void tcp_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)handle->data;
+    (void)suggested_size;
+    *buf = uv_buf_init(cli->read_buf, sizeof(cli->read_buf));
+}
+
+static void tcp_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)stream->data;
+    if (nread > 0) {
+        stream_on_data(cli, (const uint8_t *)buf->base, (size_t)nread);
+    } else if (nread < 0) {
+        stream_fail(cli, "read", (int)nread);
+    }
+}
+
+static void tcp_connect_cb(uv_connect_t *req, int status) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)req->data;
+
+    if (cli->state == udp_stream_connecting) {
+        if (status < 0) {
+            stream_fail(cli, "connect", status);
+        } else {
+            cli->state = udp_stream_connected;
+            uv_read_start((uv_stream_t *)cli->tcp, tcp_alloc_cb, tcp_read_cb);
+            stream_send_preamble(cli);
+        }
+    }
+    stream_release(cli);
+}
+
+static void tcp_resolve_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)req->data;
+
+    if (cli->state != udp_stream_connecting) {
+        // shut down meanwhile
+    } else if (status < 0 || ai == NULL) {
+        stream_fail(cli, "lookup", status);
+    } else {
+        union sockaddr_universal addr = { 0 };
+        int err;
+        memcpy(&addr, ai->ai_addr, ((size_t)ai->ai_addrlen < sizeof(addr)) ? (size_t)ai->ai_addrlen : sizeof(addr));
+        if (addr.addr.sa_family == AF_INET6) {
+            addr.addr6.sin6_port = htons(cli->config->remote_port);
+        } else {
+            addr.addr4.sin_port = htons(cli->config->remote_port);
+        }
+        cli->tcp = (uv_tcp_t *) calloc(1, sizeof(uv_tcp_t));
+        uv_tcp_init(cli->loop, cli->tcp);
+#if !defined(_WIN32)
+        if (cli->config->mptcp) {
+            int fd = socket_tuning_mptcp_socket(addr.addr.sa_family);
+            if (fd >= 0 && uv_tcp_open(cli->tcp, fd) != 0) {
+                close(fd);  // uv_tcp_connect() makes an ordinary one.
+            }
+        }
+#endif // !defined(_WIN32)
+        cli->tcp->data = cli;
+        uv_tcp_nodelay(cli->tcp, 1);
+        cli->connect_req.data = cli;
+        err = uv_tcp_connect(&cli->connect_req, cli->tcp, &addr.addr, tcp_connect_cb);
+        if (err == 0) {
+            stream_add_ref(cli);
+        } else {
+            stream_fail(cli, "connect", err);
+        }
+    }
+    uv_freeaddrinfo(ai);
+    stream_release(cli);
+}
+
+static void mbed_alloc_cb(uv_mbed_t *mbed, size_t suggested_size, uv_buf_t *buf, void *p) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)p;
+    (void)mbed; (void)suggested_size;
+    *buf = uv_buf_init(cli->read_buf, sizeof(cli->read_buf));
+}
+
+static void mbed_read_cb(uv_mbed_t *mbed, ssize_t nread, uv_buf_t *buf, void *p) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)p;
+    (void)mbed;
+    if (nread > 0) {
+        stream_on_data(cli, (const uint8_t *)buf->base, (size_t)nread);
+    } else if (nread < 0) {
+        stream_fail(cli, "read", (int)nread);
+    }
+}
+
+static void mbed_connect_cb(uv_mbed_t *mbed, int status, void *p) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)p;
+
+    if (cli->state == udp_stream_connecting) {
+        if (status < 0) {
+            stream_fail(cli, "connect", status);
+        } else {
+            cli->state = udp_stream_connected;
+            uv_mbed_read(mbed, mbed_alloc_cb, mbed_read_cb, cli);
+            stream_send_preamble(cli);
+        }
+    }
+    stream_release(cli);
+}
+
+static void stream_connect(struct udp_stream_cli *cli) {
+    const char *host = cli->config->remote_host;
+
+    assert(cli->state == udp_stream_idle);
+    cli->state = udp_stream_connecting;
+    cli->header_parsed = !cli->over_tls;
+    cli->writes_pending = 0;
+    udp_stream_decoder_release(&cli->decoder);
+    udp_stream_decoder_init(&cli->decoder);
+
+    if (cli->over_tls) {
+        cli->mbed = uv_mbed_init(cli->loop, NULL, 0);
+        stream_add_ref(cli);
+        uv_mbed_connect(cli->mbed, host, cli->config->remote_port, mbed_connect_cb, cli);
+    } else {
+        struct addrinfo hints = { 0 };
+        int err;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        cli->resolver.data = cli;
+        err = uv_getaddrinfo(cli->loop, &cli->resolver, tcp_resolve_cb, host, NULL, &hints);
+        if (err == 0) {
+            stream_add_ref(cli);
+        } else {
+            stream_fail(cli, "lookup", err);
+        }
+    }
+}
+
+static void tcp_write_done_cb(uv_write_t *req, int status) {
+    struct udp_stream_write_req *wr = CONTAINER_OF(req, struct udp_stream_write_req, req);
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)req->data;
+
+    buffer_release(wr->buf);
+    free(wr);
+    --cli->writes_pending;
+    if (status < 0 && status != UV_ECANCELED && cli->state == udp_stream_connected) {
+        stream_fail(cli, "write", status);
+    }
+    stream_release(cli);
+}
+
+static void mbed_write_done_cb(uv_mbed_t *mbed, int status, void *p) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)p;
+    (void)mbed;
+    --cli->writes_pending;
+    if (status < 0 && cli->state == udp_stream_connected) {
+        stream_fail(cli, "write", status);
+    }
+    stream_release(cli);
+}
+
+static void stream_write(struct udp_stream_cli *cli, struct buffer_t *buf) {
+    uv_buf_t o = uv_buf_init((char *)buf->buffer, (unsigned int)buf->len);
+    int err;
+
+    if (cli->over_tls) {
+        // uv_mbed_write() encrypts into its own buffer before returning.
+        err = uv_mbed_write(cli->mbed, &o, &mbed_write_done_cb, cli);
+    } else {
+        struct udp_stream_write_req *wr = (struct udp_stream_write_req *) calloc(1, sizeof(*wr));
+        buffer_add_ref(buf);
+        wr->buf = buf;
+        wr->req.data = cli;
+        err = uv_write(&wr->req, (uv_stream_t *)cli->tcp, &o, 1, tcp_write_done_cb);
+        if (err != 0) {
+            buffer_release(buf);
+            free(wr);
+        }
+    }
+    if (err != 0) {
+        stream_fail(cli, "write", err);
+        return;
+    }
+    ++cli->writes_pending;
+    stream_add_ref(cli);
+}
+
+static void stream_frame_cb(void *p, uint32_t assoc_id, const uint8_t *data, size_t len) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)p;
+    if (cli->udp_server) {
+        udprelay_stream_deliver(cli->udp_server, assoc_id, data, len);
+    }
+}
+
+static void stream_on_data(struct udp_stream_cli *cli, const uint8_t *data, size_t len) {
+#define HTTP_HEADER_END "\r\n\r\n"
+    if (cli->released || cli->state != udp_stream_connected) {
+        return;
+    }
+    if (cli->header_parsed == false) {
+        const uint8_t *px;
+        size_t scanned, end;
+        if (cli->http_header == NULL) {
+            cli->http_header = buffer_create(0);
+        }
+        scanned = cli->http_header->len;
+        buffer_concatenate(cli->http_header, data, len);
+        px = cli->http_header->buffer;
+        // back up in case the terminator straddles two reads
+        scanned = (scanned > 3) ? scanned - 3 : 0;
+        for (end = scanned; end + 4 <= cli->http_header->len; ++end) {
+            if (memcmp(px + end, HTTP_HEADER_END, 4) == 0) {
+                break;
+            }
+        }
+        if (end + 4 > cli->http_header->len) {
+            if (cli->http_header->len > UDP_STREAM_HTTP_HEADER_MAX) {
+                stream_fail(cli, "response header", UV_EPROTO);
+            }
+            return;
+        }
+        cli->header_parsed = true;
+        end += 4;
+        if (udp_stream_decoder_feed(&cli->decoder, px + end, cli->http_header->len - end, &stream_frame_cb, cli) == false) {
+            stream_fail(cli, "framing", UV_EPROTO);
+        }
+        buffer_release(cli->http_header);
+        cli->http_header = NULL;
+        return;
+    }
+    if (udp_stream_decoder_feed(&cli->decoder, data, len, &stream_frame_cb, cli) == false) {
+        stream_fail(cli, "framing", UV_EPROTO);
+    }
+#undef HTTP_HEADER_END
+}
+
+static void stream_fail(struct udp_stream_cli *cli, const char *what, int status) {
+    if (cli->released) {
+        return;
+    }
+    if (status == UV_EOF) {
+        pr_info("udp stream closed by the server");
+    } else {
+        pr_err("udp stream %s error: %s", what, uv_strerror(status));
+    }
+    if (cli->state == udp_stream_connecting) {
+        cli->retry_after = uv_now(cli->loop) + UDP_STREAM_RETRY_MS;
+    }
+    buffer_reset(cli->backlog);
+    stream_close(cli);
+}
+
+static void tcp_close_done_cb(uv_handle_t *handle) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)handle->data;
+    free(handle);
+    if (cli->state == udp_stream_closing) {
+        cli->state = udp_stream_idle;
+    }
+    stream_release(cli);
+}
+
+static void mbed_close_done_cb(uv_mbed_t *mbed, void *p) {
+    struct udp_stream_cli *cli = (struct udp_stream_cli *)p;
+    uv_mbed_free(mbed);
+    if (cli->state == udp_stream_closing) {
+        cli->state = udp_stream_idle;
+    }
+    stream_release(cli);
+}
+
+static void stream_close(struct udp_stream_cli *cli) {
+    buffer_release(cli->http_header);
+    cli->http_header = NULL;
+
+    if (cli->tcp) {
+        uv_tcp_t *tcp = cli->tcp;
+        cli->tcp = NULL;
+        cli->state = udp_stream_closing;
+        stream_add_ref(cli);
+        uv_close((uv_handle_t *)tcp, tcp_close_done_cb);
+    } else if (cli->mbed) {
+        uv_mbed_t *mbed = cli->mbed;
+        cli->mbed = NULL;
+        cli->state = udp_stream_closing;
+        stream_add_ref(cli);
+        uv_mbed_close(mbed, mbed_close_done_cb, cli);
+    } else if (cli->state == udp_stream_connecting) {
+        // Still resolving, the callback sees the state and bails out.
+        uv_cancel((uv_req_t *)&cli->resolver);
+        cli->state = udp_stream_idle;
+    } else {
+        cli->state = udp_stream_idle;
+    }
+}
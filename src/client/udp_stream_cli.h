@@ -0,0 +1,19 @@
+#ifndef __UDP_STREAM_CLI_H__
+#define __UDP_STREAM_CLI_H__ 1
+
+#include <uv.h>
+
+struct server_config;
+struct udp_listener_ctx_t;
+struct udp_stream_cli;
+
+/*
+ * Carries the datagrams of |udp_server| to the SSR server on one TCP
+ * connection, or on TLS when over_tls_enable is set, for networks that
+ * throttle or drop UDP. The stream is opened on the first datagram and
+ * reopened on demand after it drops.
+ */
+struct udp_stream_cli * udp_stream_cli_create(uv_loop_t *loop, struct server_config *config, struct udp_listener_ctx_t *udp_server);
+void udp_stream_cli_shutdown(struct udp_stream_cli *cli);
+
+#endif // __UDP_STREAM_CLI_H__
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+#include "warm_pool.h"
+#include "common.h"
+#include "ssr_executive.h"
+#include "tunnel.h"
+#include "remote_pool.h"
+#include "sockaddr_universal.h"
+#include "socket_tuning.h"
+
+struct warm_conn {
+    struct warm_pool *pool;
+    uv_tcp_t tcp;
+    uv_connect_t connect_req;
+    union sockaddr_universal addr;
+    uint64_t connected_at;
+    bool connected;
+    struct warm_conn *next;
+};
+
+struct warm_pool {
+    uv_loop_t *loop;
+    struct server_env_t *env;
+    size_t target;
+    struct warm_conn *conns;  /* Connected or still connecting. */
+    size_t count;
+    size_t open_handles;  /* Freed when the last one closes after destroy. */
+    bool released;
+    char sink[64];  /* The server says nothing first, anything read ends the connection. */
+};
+
+static void _warm_conn_close_done_cb(uv_handle_t *handle) {
+    struct warm_conn *conn = (struct warm_conn *)handle->data;
+    struct warm_pool *pool = conn->pool;
+
+    free(conn);
+    if (--pool->open_handles == 0 && pool->released) {
+        free(pool);
+    }
+}
+
+static void _warm_conn_close(struct warm_conn *conn) {
+    struct warm_pool *pool = conn->pool;
+    struct warm_conn **link;
+
+    for (link = &pool->conns; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            pool->count--;
+            break;
+        }
+    }
+    uv_close((uv_handle_t *)&conn->tcp, _warm_conn_close_done_cb);
+}
+
+static void _warm_conn_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct warm_conn *conn = (struct warm_conn *)handle->data;
+    (void)suggested_size;
+    *buf = uv_buf_init(conn->pool->sink, sizeof(conn->pool->sink));
+}
+
+static void _warm_conn_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct warm_conn *conn = (struct warm_conn *)stream->data;
+    (void)buf;
+    if (nread != 0) {
+        _warm_conn_close(conn);
+    }
+}
+
+static void _warm_conn_connect_done_cb(uv_connect_t *req, int status) {
+    struct warm_conn *conn = CONTAINER_OF(req, struct warm_conn, connect_req);
+    struct warm_pool *pool = conn->pool;
+
+    if (pool->released || uv_is_closing((uv_handle_t *)&conn->tcp)) {
+        return;
+    }
+    remote_pool_report(pool->env->remote_pool, &conn->addr, status == 0);
+    if (status < 0) {
+        // Not refilled here, an unreachable server costs one attempt per tunnel.
+        _warm_conn_close(conn);
+        return;
+    }
+    conn->connected = true;
+    conn->connected_at = uv_now(pool->loop);
+    uv_read_start((uv_stream_t *)&conn->tcp, _warm_conn_alloc_cb, _warm_conn_read_cb);
+}
+
+static void _warm_pool_fill(struct warm_pool *pool) {
+    struct server_config *config = pool->env->config;
+
+    while (pool->count < pool->target) {
+        union sockaddr_universal addr;
+        struct warm_conn *conn;
+
+        if (remote_pool_candidates(pool->env->remote_pool, &addr, 1) == 0 &&
+            convert_universal_address(config->remote_host, config->remote_port, &addr) != 0)
+        {
+            return;  /* Not resolved yet. */
+        }
+        conn = (struct warm_conn *) calloc(1, sizeof(*conn));
+        conn->pool = pool;
+        conn->addr = addr;
+        uv_tcp_init(pool->loop, &conn->tcp);
+#if !defined(_WIN32)
+        if (config->mptcp) {
+            int fd = socket_tuning_mptcp_socket(addr.addr.sa_family);
+            if (fd >= 0 && uv_tcp_open(&conn->tcp, fd) != 0) {
+                close(fd);  // uv_tcp_connect() makes an ordinary one.
+            }
+        }
+#endif // !defined(_WIN32)
+        conn->tcp.data = conn;
+        conn->next = pool->conns;
+        pool->conns = conn;
+        pool->count++;
+        pool->open_handles++;
+        if (uv_tcp_connect(&conn->connect_req, &conn->tcp, &addr.addr, _warm_conn_connect_done_cb) != 0) {
+            _warm_conn_close(conn);
+            return;
+        }
+    }
+}
+
+struct warm_pool * warm_pool_create(uv_loop_t *loop, struct server_env_t *env) {
+    struct warm_pool *pool;
+
+#if defined(_WIN32)
+    // No dup() to hand a descriptor over to the tunnel's own handle.
+    return NULL;
+#endif
+    if (env->config->warm_connections <= 0) {
+        return NULL;
+    }
+    pool = (struct warm_pool *) calloc(1, sizeof(*pool));
+    pool->loop = loop;
+    pool->env = env;
+    pool->target = (size_t)env->config->warm_connections;
+    _warm_pool_fill(pool);
+    return pool;
+}
+
+void warm_pool_destroy(struct warm_pool *pool) {
+    if (pool == NULL || pool->released) {
+        return;
+    }
+    pool->released = true;
+    while (pool->conns) {
+        _warm_conn_close(pool->conns);
+    }
+    if (pool->open_handles == 0) {
+        free(pool);
+    }
+}
+
+bool warm_pool_take(struct warm_pool *pool, struct socket_ctx *c) {
+    struct warm_conn *conn, *next;
+    bool taken = false;
+    uint64_t now;
+
+    if (pool == NULL || pool->released) {
+        return false;
+    }
+    now = uv_now(pool->loop);
+    for (conn = pool->conns; conn && taken == false; conn = next) {
+        next = conn->next;
+        if (conn->connected == false) {
+            continue;
+        }
+        if (now - conn->connected_at < WARM_POOL_MAX_AGE_MS) {
+#if !defined(_WIN32)
+            uv_os_fd_t fd;
+            if (uv_fileno((uv_handle_t *)&conn->tcp, &fd) == 0) {
+                // The pooled handle closes its own descriptor, keep a duplicate.
+                fd = dup(fd);
+                if (fd >= 0 && uv_tcp_open(&c->handle.tcp, fd) == 0) {
+                    c->addr = conn->addr;
+                    taken = true;
+                } else if (fd >= 0) {
+                    close(fd);
+                }
+            }
+#endif
+        }
+        _warm_conn_close(conn);
+    }
+    _warm_pool_fill(pool);
+    return taken;
+}
@@ -0,0 +1,27 @@
+#ifndef __WARM_POOL_H__
+#define __WARM_POOL_H__ 1
+
+#include <stdbool.h>
+#include <uv.h>
+
+struct server_env_t;
+struct socket_ctx;
+struct warm_pool;
+
+/*
+ * Up to warm_connections TCP connections to the SSR server per loop,
+ * connected ahead of the tunnels that take them. A taken connection is
+ * replaced right away, one older than WARM_POOL_MAX_AGE_MS or closed by
+ * the server is dropped. Over TLS, over_tls_spare_connections does the
+ * same with the handshake done as well.
+ */
+
+#define WARM_POOL_MAX_AGE_MS (30 * 1000)  /* Below ssr-server's idle timeout for a silent client. */
+
+/* NULL when warm_connections is 0, and on Windows. Needs env->remote_pool or a literal remote_host. */
+struct warm_pool * warm_pool_create(uv_loop_t *loop, struct server_env_t *env);
+void warm_pool_destroy(struct warm_pool *pool);
+/* Hands a connection over to |c|, its address in c->addr. false means connect as usual. */
+bool warm_pool_take(struct warm_pool *pool, struct socket_ctx *c);
+
+#endif // __WARM_POOL_H__
@@ -1,7 +1,15 @@
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <json-c/json.h>
 #include "config_json.h"
+#include "json_stream.h"
 #include "ssr_executive.h"
+#include "ssr_user_table.h"
+#include "ssr_replay_window.h"
+#include "dns_cache.h"
+#include "kcp_transport.h"
 
 bool json_iter_extract_object(const char *key, const struct json_object_iter *iter, const struct json_object **value) {
     bool result = false;
@@ -67,6 +75,30 @@ bool json_iter_extract_int(const char *key, const struct json_object_iter *iter,
     return result;
 }
 
+bool json_iter_extract_double(const char *key, const struct json_object_iter *iter, double *value) {
+    bool result = false;
+    do {
+        struct json_object *val;
+        enum json_type type;
+
+        if (key == NULL || iter == NULL || value == NULL) {
+            break;
+        }
+        *value = 0.0;
+        if (strcmp(iter->key, key) != 0) {
+            break;
+        }
+        val = iter->val;
+        type = json_object_get_type(val);
+        if (json_type_double != type && json_type_int != type) {
+            break;
+        }
+        *value = json_object_get_double(val);
+        result = true;
+    } while (0);
+    return result;
+}
+
 bool json_iter_extract_bool(const char *key, const struct json_object_iter *iter, bool *value) {
     bool result = false;
     do {
@@ -88,13 +120,166 @@ bool json_iter_extract_bool(const char *key, const struct json_object_iter *iter
     return result;
 }
 
+/* The whole of |file|, NUL terminated, NULL if it can't be read. */
+char * config_file_read(const char *file, size_t *len) {
+    FILE *f = fopen(file, "rb");
+    char *text = NULL;
+    long size;
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        text = (char *) malloc((size_t)size + 1);
+        if (text && fread(text, 1, (size_t)size, f) == (size_t)size) {
+            text[size] = '\0';
+            *len = (size_t)size;
+        } else {
+            free(text);
+            text = NULL;
+        }
+    }
+    fclose(f);
+    return text;
+}
+
+/* "uid": "password" or "uid": { "password": "...", "max_connections": n, "max_connection_rate": n a second, "quota": bytes, "expires": unix time,
+ * "previous_password": "...", "previous_expires": unix time }, the stream is past the object's '{'. */
+static bool config_users_load(struct json_stream *s, struct ssr_user_table *users) {
+    char *password = NULL, *previous = NULL;
+    bool result = false;
+
+    for (;;) {
+        enum json_token token = json_stream_next(s);
+        unsigned long uid;
+        unsigned int max_connections = 0, max_rate = 0;
+        double quota = 0.0, expires = 0.0, previous_expires = 0.0;
+        char *end = NULL;
+        bool valid;
+
+        if (token == json_token_object_end) {
+            result = true;
+            break;
+        }
+        if (token != json_token_string) {
+            break;
+        }
+        uid = strtoul(s->str, &end, 10);
+        valid = (end != s->str && *end == '\0');
+
+        token = json_stream_next(s);
+        if (token == json_token_string) {
+            password = strdup(s->str);
+        } else if (token == json_token_object_begin) {
+            while ((token = json_stream_next(s)) == json_token_string) {
+                enum json_token value;
+                char key[32];
+                snprintf(key, sizeof(key), "%s", s->str);
+                value = json_stream_next(s);
+                if (strcmp(key, "password") == 0 && value == json_token_string) {
+                    free(password);
+                    password = strdup(s->str);
+                } else if (strcmp(key, "max_connections") == 0 && value == json_token_number) {
+                    max_connections = (s->number > 0.0) ? (unsigned int)s->number : 0;
+                } else if (strcmp(key, "max_connection_rate") == 0 && value == json_token_number) {
+                    max_rate = (s->number > 0.0) ? (unsigned int)s->number : 0;
+                } else if (strcmp(key, "quota") == 0 && value == json_token_number) {
+                    quota = s->number;
+                } else if (strcmp(key, "expires") == 0 && value == json_token_number) {
+                    expires = s->number;
+                } else if (strcmp(key, "previous_password") == 0 && value == json_token_string) {
+                    free(previous);
+                    previous = strdup(s->str);
+                } else if (strcmp(key, "previous_expires") == 0 && value == json_token_number) {
+                    previous_expires = s->number;
+                } else if (json_stream_skip(s, value) == false) {
+                    token = json_token_error;
+                    break;
+                }
+            }
+            if (token != json_token_object_end) {
+                break;
+            }
+        } else if (json_stream_skip(s, token) == false) {
+            break;
+        }
+        if (valid && password) {
+            ssr_user_table_add(users, (uint32_t)uid, password, max_connections, max_rate,
+                (quota > 0.0) ? (uint64_t)quota : 0, (expires > 0.0) ? (uint64_t)expires : 0);
+            if (previous) {
+                ssr_user_table_set_previous(users, (uint32_t)uid, previous,
+                    (previous_expires > 0.0) ? (uint64_t)previous_expires : 0);
+            }
+        }
+        free(password);
+        free(previous);
+        password = NULL;
+        previous = NULL;
+    }
+    free(password);
+    free(previous);
+    return result;
+}
+
+/*
+ * The users go from the text straight into the table, and their object is
+ * blanked out to "{}" so json-c builds a DOM of the other settings only.
+ */
+static bool config_users_extract(char *text, size_t len, struct server_config *config) {
+    struct json_stream s;
+    bool result = true;
+
+    json_stream_init(&s, text, len);
+    if (json_stream_next(&s) != json_token_object_begin) {
+        json_stream_free(&s);
+        return true;  // Not ours to report, json-c tells what's wrong.
+    }
+    for (;;) {
+        enum json_token token = json_stream_next(&s);
+        bool users;
+        if (token == json_token_object_end) {
+            break;
+        }
+        if (token != json_token_string) {
+            result = false;
+            break;
+        }
+        users = (strcmp(s.str, "users") == 0);
+        token = json_stream_next(&s);
+        if (users && token == json_token_object_begin) {
+            size_t begin = s.token_start;
+            if (config->users == NULL) {
+                config->users = ssr_user_table_create();
+            }
+            if (config_users_load(&s, config->users) == false) {
+                result = false;
+                break;
+            }
+            memset(text + begin, ' ', s.pos - begin);
+            text[begin] = '{';
+            text[begin + 1] = '}';
+        } else if (json_stream_skip(&s, token) == false) {
+            result = false;
+            break;
+        }
+    }
+    json_stream_free(&s);
+    return result;
+}
+
 bool parse_config_file(const char *file, struct server_config *config) {
     bool result = false;
     json_object *jso = NULL;
+    char *text = NULL;
+    size_t len = 0;
     do {
         struct json_object_iter iter = { NULL };
+        double obj_double = 0.0;
 
-        jso = json_object_from_file(file);
+        text = config_file_read(file, &len);
+        if (text == NULL || config_users_extract(text, len, config) == false) {
+            break;
+        }
+        jso = json_tokener_parse(text);
         if (jso == NULL) {
             break;
         }
@@ -147,6 +332,14 @@ bool parse_config_file(const char *file, struct server_config *config) {
                 string_safe_assign(&config->obfs_param, obj_str);
                 continue;
             }
+            if (json_iter_extract_bool("adaptive_padding", &iter, &obj_bool)) {
+                config->adaptive_padding = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_string("compression", &iter, &obj_str)) {
+                config->compression = stream_compression_from_name(obj_str);
+                continue;
+            }
             if (json_iter_extract_bool("over_tls_enable", &iter, &obj_bool)) {
                 config->over_tls_enable = obj_bool;
                 continue;
@@ -167,22 +360,457 @@ bool parse_config_file(const char *file, struct server_config *config) {
                         string_safe_assign(&config->over_tls_root_cert_file, obj_str2);
                         continue;
                     }
+                    if (json_iter_extract_bool("streaming", &iter2, &obj_bool)) {
+                        config->over_tls_streaming = obj_bool;
+                        continue;
+                    }
+                    if (json_iter_extract_int("spare_connections", &iter2, &obj_int)) {
+                        config->over_tls_spare_connections = obj_int;
+                        continue;
+                    }
+                    if (json_iter_extract_int("listen_port", &iter2, &obj_int)) {
+                        config->over_tls_listen_port = (obj_int > 0 && obj_int <= 0xFFFF) ? (unsigned short)obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_string("cert_file", &iter2, &obj_str2)) {
+                        string_safe_assign(&config->over_tls_cert_file, obj_str2);
+                        continue;
+                    }
+                    if (json_iter_extract_string("key_file", &iter2, &obj_str2)) {
+                        string_safe_assign(&config->over_tls_key_file, obj_str2);
+                        continue;
+                    }
+                    if (json_iter_extract_string("fallback", &iter2, &obj_str2)) {
+                        string_safe_assign(&config->over_tls_fallback, obj_str2);
+                        continue;
+                    }
+                }
+                continue;
+            }
+            if (json_iter_extract_object("admission", &iter, &obj_obj)) {
+                struct json_object_iter iter2 = { NULL };
+                json_object_object_foreachC(obj_obj, iter2) {
+                    if (json_iter_extract_int("max_tunnels", &iter2, &obj_int)) {
+                        config->admission_max_tunnels = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("max_handshakes", &iter2, &obj_int)) {
+                        config->admission_max_handshakes = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("accept_batch", &iter2, &obj_int)) {
+                        config->admission_accept_batch = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("max_loop_lag_ms", &iter2, &obj_int)) {
+                        config->admission_max_loop_lag = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("max_memory_mb", &iter2, &obj_int)) {
+                        config->admission_max_memory = (obj_int > 0) ? (size_t)obj_int * 1024 * 1024 : 0;
+                        continue;
+                    }
+                }
+                continue;
+            }
+            if (json_iter_extract_object("rate_limit", &iter, &obj_obj)) {
+                struct json_object_iter iter2 = { NULL };
+                json_object_object_foreachC(obj_obj, iter2) {
+                    if (json_iter_extract_int("global", &iter2, &obj_int)) {
+                        config->rate_limit_global = (obj_int > 0) ? (size_t)obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("port", &iter2, &obj_int)) {
+                        config->rate_limit_port = (obj_int > 0) ? (size_t)obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("tunnel", &iter2, &obj_int)) {
+                        config->rate_limit_tunnel = (obj_int > 0) ? (size_t)obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("over_quota", &iter2, &obj_int)) {
+                        config->rate_limit_over_quota = (obj_int > 0) ? (size_t)obj_int : 0;
+                        continue;
+                    }
+                }
+                continue;
+            }
+            if (json_iter_extract_object("socket", &iter, &obj_obj)) {
+                struct socket_tuning *tuning = &config->socket;
+                struct json_object_iter iter2 = { NULL };
+                json_object_object_foreachC(obj_obj, iter2) {
+                    const char *obj_str2 = NULL;
+                    if (json_iter_extract_int("busy_poll", &iter2, &obj_int)) {
+                        tuning->busy_poll = obj_int;
+                        continue;
+                    }
+                    if (json_iter_extract_bool("nodelay", &iter2, &obj_bool)) {
+                        tuning->nodelay = obj_bool ? 1 : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("notsent_lowat", &iter2, &obj_int)) {
+                        tuning->notsent_lowat = obj_int;
+                        continue;
+                    }
+                    if (json_iter_extract_int("sndbuf", &iter2, &obj_int)) {
+                        tuning->sndbuf = obj_int;
+                        continue;
+                    }
+                    if (json_iter_extract_int("rcvbuf", &iter2, &obj_int)) {
+                        tuning->rcvbuf = obj_int;
+                        continue;
+                    }
+                    if (json_iter_extract_string("congestion", &iter2, &obj_str2)) {
+                        snprintf(tuning->congestion, sizeof(tuning->congestion), "%s", obj_str2 ? obj_str2 : "");
+                        continue;
+                    }
+                    if (json_iter_extract_bool("incoming_cpu", &iter2, &obj_bool)) {
+                        tuning->incoming_cpu = obj_bool;
+                        continue;
+                    }
+                    if (json_iter_extract_int("defer_accept", &iter2, &obj_int)) {
+                        tuning->defer_accept = (obj_int > 0) ? obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("keepalive_idle", &iter2, &obj_int)) {
+                        tuning->keepalive_idle = (obj_int > 0) ? obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("keepalive_interval", &iter2, &obj_int)) {
+                        tuning->keepalive_interval = (obj_int > 0) ? obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("keepalive_count", &iter2, &obj_int)) {
+                        tuning->keepalive_count = (obj_int > 0) ? obj_int : 0;
+                        continue;
+                    }
+                    if (json_iter_extract_int("user_timeout", &iter2, &obj_int)) {
+                        tuning->user_timeout = (obj_int > 0) ? obj_int : 0;
+                        continue;
+                    }
                 }
                 continue;
             }
+            if (json_iter_extract_int("mux_sessions", &iter, &obj_int)) {
+                config->mux_sessions = (obj_int > 0) ? obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_string("transport", &iter, &obj_str)) {
+                config->transport = (obj_str && strcmp(obj_str, "kcp") == 0) ? server_transport_kcp : server_transport_tcp;
+                continue;
+            }
+            if (json_iter_extract_int("kcp_port", &iter, &obj_int)) {
+                config->kcp_port = (obj_int > 0 && obj_int <= 0xFFFF) ? (unsigned short)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("kcp_window", &iter, &obj_int)) {
+                config->kcp_window = (obj_int > 0 && obj_int <= 0xFFFF) ? (unsigned int)obj_int : DEFAULT_KCP_WINDOW;
+                continue;
+            }
+            if (json_iter_extract_int("kcp_fec_data", &iter, &obj_int)) {
+                config->kcp_fec_data = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("kcp_fec_parity", &iter, &obj_int)) {
+                config->kcp_fec_parity = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("warm_connections", &iter, &obj_int)) {
+                config->warm_connections = (obj_int > 0) ? obj_int : 0;
+                continue;
+            }
             if (json_iter_extract_int("timeout", &iter, &obj_int)) {
                 config->idle_timeout = obj_int * MILLISECONDS_PER_SECOND;
                 continue;
             }
+            if (json_iter_extract_int("handshake_timeout", &iter, &obj_int)) {
+                config->handshake_timeout = (obj_int > 0) ? (unsigned int)obj_int * MILLISECONDS_PER_SECOND : 0;
+                continue;
+            }
+            if (json_iter_extract_int("connect_timeout", &iter, &obj_int)) {
+                config->connect_timeout = (obj_int > 0) ? (unsigned int)obj_int * MILLISECONDS_PER_SECOND : 0;
+                continue;
+            }
+            if (json_iter_extract_int("linger_timeout", &iter, &obj_int)) {
+                config->linger_timeout = (obj_int > 0) ? (unsigned int)obj_int * MILLISECONDS_PER_SECOND : 0;
+                continue;
+            }
+            if (json_iter_extract_int("handshake_deadline", &iter, &obj_int)) {
+                config->handshake_deadline = (obj_int > 0) ? (unsigned int)obj_int * MILLISECONDS_PER_SECOND : 0;
+                continue;
+            }
+            if (json_iter_extract_int("handshake_min_rate", &iter, &obj_int)) {
+                config->handshake_min_rate = (obj_int > 0) ? (size_t)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("fair_queue_quantum", &iter, &obj_int)) {
+                config->fair_queue_quantum = (obj_int > 0) ? (size_t)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("coalesce_reads_below", &iter, &obj_int)) {
+                config->coalesce_reads_below = (obj_int > 0) ? (size_t)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("loop_stall_ms", &iter, &obj_int)) {
+                config->loop_stall_ms = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("write_queue_high_watermark", &iter, &obj_int)) {
+                config->write_queue_high_watermark = (obj_int > 0) ? (size_t)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("write_queue_low_watermark", &iter, &obj_int)) {
+                config->write_queue_low_watermark = (obj_int > 0) ? (size_t)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("workers", &iter, &obj_int)) {
+                config->workers = (obj_int > 0) ? (unsigned int)obj_int : 1;
+                continue;
+            }
+            if (json_iter_extract_int("worker_balance_lag_ms", &iter, &obj_int)) {
+                config->worker_balance_lag_ms = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("memory_budget_mb", &iter, &obj_int)) {
+                config->memory_budget = (obj_int > 0) ? (size_t)obj_int * 1024 * 1024 : 0;
+                continue;
+            }
+            if (json_iter_extract_int("crypto_workers", &iter, &obj_int)) {
+                config->crypto_workers = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("replay_filter_capacity", &iter, &obj_int)) {
+                config->replay_filter_capacity = (obj_int > 0) ? (size_t)obj_int : DEFAULT_REPLAY_FILTER_CAPACITY;
+                continue;
+            }
+            if (json_iter_extract_double("replay_filter_error_rate", &iter, &obj_double)) {
+                config->replay_filter_error_rate = (obj_double > 0.0 && obj_double < 1.0) ? obj_double : DEFAULT_REPLAY_FILTER_ERROR_RATE;
+                continue;
+            }
+            if (json_iter_extract_int("replay_window_clients", &iter, &obj_int)) {
+                config->replay_window_clients = (obj_int > 0) ? (size_t)obj_int : DEFAULT_REPLAY_WINDOW_CLIENTS;
+                continue;
+            }
+            if (json_iter_extract_string("nameserver", &iter, &obj_str)) {
+                string_safe_assign(&config->nameservers, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("acl", &iter, &obj_str)) {
+                string_safe_assign(&config->acl, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("manager_address", &iter, &obj_str)) {
+                string_safe_assign(&config->manager_address, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("metrics_address", &iter, &obj_str)) {
+                string_safe_assign(&config->metrics_address, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("upgrade_socket", &iter, &obj_str)) {
+                string_safe_assign(&config->upgrade_socket, obj_str);
+                continue;
+            }
+            if (json_iter_extract_int("fake_dns_port", &iter, &obj_int)) {
+                config->fake_dns_port = (obj_int > 0 && obj_int <= 65535) ? (unsigned short)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_string("fake_ip_range", &iter, &obj_str)) {
+                string_safe_assign(&config->fake_ip_range, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("tunnel_address", &iter, &obj_str)) {
+                string_safe_assign(&config->tunnel_address, obj_str);
+                continue;
+            }
+            if (json_iter_extract_bool("shared_read_buffer", &iter, &obj_bool)) {
+                config->shared_read_buffer = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("numa", &iter, &obj_bool)) {
+                config->numa = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("hugepages", &iter, &obj_bool)) {
+                config->hugepages = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("fast_start", &iter, &obj_bool)) {
+                config->fast_start = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("log_async", &iter, &obj_bool)) {
+                config->log_async = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("log_json", &iter, &obj_bool)) {
+                config->log_json = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_string("users_file", &iter, &obj_str)) {
+                string_safe_assign(&config->users_file, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("trace_file", &iter, &obj_str)) {
+                string_safe_assign(&config->trace_file, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("flow_export", &iter, &obj_str)) {
+                string_safe_assign(&config->flow_export, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("cluster_listen", &iter, &obj_str)) {
+                string_safe_assign(&config->cluster_listen, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("cluster_peers", &iter, &obj_str)) {
+                string_safe_assign(&config->cluster_peers, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("cluster_key", &iter, &obj_str)) {
+                string_safe_assign(&config->cluster_key, obj_str);
+                continue;
+            }
+            if (json_iter_extract_int("cluster_interval", &iter, &obj_int)) {
+                config->cluster_interval = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("trace_sample", &iter, &obj_int)) {
+                config->trace_sample = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_string("shape_file", &iter, &obj_str)) {
+                string_safe_assign(&config->shape_file, obj_str);
+                continue;
+            }
+            if (json_iter_extract_int("shape_sample", &iter, &obj_int)) {
+                config->shape_sample = (obj_int > 0) ? (unsigned int)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_bool("optimistic_reply", &iter, &obj_bool)) {
+                config->optimistic_reply = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("transparent_proxy", &iter, &obj_bool)) {
+                config->transparent_proxy = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("fast_open", &iter, &obj_bool)) {
+                config->fast_open = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("mptcp", &iter, &obj_bool)) {
+                config->mptcp = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_string("egress_addresses", &iter, &obj_str)) {
+                string_safe_assign(&config->egress_addresses, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("upstream_proxy", &iter, &obj_str)) {
+                string_safe_assign(&config->upstream_proxy, obj_str);
+                continue;
+            }
+            if (json_iter_extract_int("upstream_proxy_idle", &iter, &obj_int)) {
+                config->upstream_proxy_idle = (obj_int > 0) ? obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_string("egress_policy", &iter, &obj_str)) {
+                config->egress_policy = (obj_str && strcmp(obj_str, "hash") == 0) ? egress_policy_hash : egress_policy_round_robin;
+                continue;
+            }
+            if (json_iter_extract_bool("sockmap_relay", &iter, &obj_bool)) {
+                config->sockmap_relay = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_bool("ipv6_first", &iter, &obj_bool)) {
+                config->ipv6_first = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_int("dns_cache_capacity", &iter, &obj_int)) {
+                config->dns_cache_capacity = (obj_int > 0) ? (size_t)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("heavy_hitters", &iter, &obj_int)) {
+                config->heavy_hitters = (obj_int > 0) ? (size_t)obj_int : 0;
+                continue;
+            }
+            if (json_iter_extract_int("dns_cache_ttl", &iter, &obj_int)) {
+                config->dns_cache_ttl = (obj_int > 0) ? (unsigned int)obj_int * MILLISECONDS_PER_SECOND : DEFAULT_DNS_CACHE_TTL;
+                continue;
+            }
             if (json_iter_extract_bool("udp", &iter, &obj_bool)) {
                 config->udp = obj_bool;
                 continue;
             }
+            if (json_iter_extract_bool("udp_over_tcp", &iter, &obj_bool)) {
+                config->udp_over_tcp = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_string("subscription", &iter, &obj_str)) {
+                string_safe_assign(&config->subscription, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("server_policy", &iter, &obj_str)) {
+                if (strcmp(obj_str, "weighted") == 0) {
+                    config->server_policy = server_policy_weighted;
+                } else if (strcmp(obj_str, "hash") == 0) {
+                    config->server_policy = server_policy_hash;
+                } else {
+                    config->server_policy = server_policy_least_latency;
+                }
+                continue;
+            }
+            if (json_iter_extract_int("probe_interval", &iter, &obj_int)) {
+                config->probe_interval = (obj_int > 0) ? (unsigned int)obj_int * MILLISECONDS_PER_SECOND : 0;
+                continue;
+            }
+            if (json_iter_extract_string("probe_target", &iter, &obj_str)) {
+                string_safe_assign(&config->probe_target, obj_str);
+                continue;
+            }
+            if (strcmp(iter.key, "servers") == 0 && json_type_array == json_object_get_type(iter.val)) {
+                // [ { "server": "...", "server_port": n, "weight": n }, ... ]
+                size_t index, count = (size_t)json_object_array_length(iter.val);
+                config->servers = (struct server_group_entry *) realloc(config->servers,
+                    (config->servers_count + count) * sizeof(config->servers[0]));
+                for (index = 0; index < count; ++index) {
+                    struct json_object *item = json_object_array_get_idx(iter.val, index);
+                    struct json_object_iter iter2 = { NULL };
+                    struct server_group_entry entry = { NULL, 0, 1 };
+                    if (json_type_object != json_object_get_type(item)) {
+                        continue;
+                    }
+                    json_object_object_foreachC(item, iter2) {
+                        const char *obj_str2 = NULL;
+                        int obj_int2 = 0;
+                        if (json_iter_extract_string("server", &iter2, &obj_str2)) {
+                            string_safe_assign(&entry.host, obj_str2);
+                            continue;
+                        }
+                        if (json_iter_extract_int("server_port", &iter2, &obj_int2)) {
+                            entry.port = (unsigned short)obj_int2;
+                            continue;
+                        }
+                        if (json_iter_extract_int("weight", &iter2, &obj_int2)) {
+                            entry.weight = (obj_int2 > 0) ? obj_int2 : 1;
+                            continue;
+                        }
+                    }
+                    if (entry.host == NULL || entry.port == 0) {
+                        object_safe_free((void **)&entry.host);
+                        continue;
+                    }
+                    config->servers[config->servers_count++] = entry;
+                }
+                continue;
+            }
         }
         result = true;
     } while (0);
     if (jso) {
         json_object_put(jso);
     }
+    free(text);
     return result;
 }
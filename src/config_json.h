@@ -2,9 +2,12 @@
 #define __config_json_h__ 1
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct server_config;
 
 bool parse_config_file(const char *file, struct server_config *config);
+/* The whole of |file| NUL terminated, free() it. NULL if it can't be read. */
+char * config_file_read(const char *file, size_t *len);
 
 #endif // !defined(__config_json_h__)
@@ -0,0 +1,82 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "cpu_features.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#define CPU_FEATURES_X86 1
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CPU_FEATURES_ARM64 1
+#endif
+
+static unsigned int probe(void) {
+    unsigned int result = 0;
+#if defined(CPU_FEATURES_X86)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        if (ecx & bit_AES) { result |= cpu_feature_aes; }
+        if (ecx & bit_PCLMUL) { result |= cpu_feature_pclmul; }
+        if (ecx & bit_SSE4_1) { result |= cpu_feature_sse41; }
+        if (ecx & bit_SSSE3) { result |= cpu_feature_ssse3; }
+    }
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if (ebx & (1u << 5)) { result |= cpu_feature_avx2; }
+        if (ebx & (1u << 29)) { result |= cpu_feature_sha1 | cpu_feature_sha2; }
+    }
+#elif defined(CPU_FEATURES_ARM64)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    if (hwcap & HWCAP_AES) { result |= cpu_feature_aes; }
+    if (hwcap & HWCAP_PMULL) { result |= cpu_feature_pclmul; }
+    if (hwcap & HWCAP_SHA1) { result |= cpu_feature_sha1; }
+    if (hwcap & HWCAP_SHA2) { result |= cpu_feature_sha2; }
+    if (hwcap & HWCAP_CRC32) { result |= cpu_feature_crc32; }
+#endif
+    return result;
+}
+
+unsigned int cpu_features(void) {
+    static bool probed = false;
+    static unsigned int features = 0;
+    if (!probed) {
+        features = probe();
+        probed = true;
+    }
+    return features;
+}
+
+const char * cpu_features_describe(char *buf, size_t size) {
+    static const struct { unsigned int bit; const char *name; } names[] = {
+        { cpu_feature_aes, "aes" },
+        { cpu_feature_pclmul, "pclmul" },
+        { cpu_feature_sha1, "sha1" },
+        { cpu_feature_sha2, "sha2" },
+        { cpu_feature_avx2, "avx2" },
+        { cpu_feature_crc32, "crc32" },
+        { cpu_feature_sse41, "sse4.1" },
+        { cpu_feature_ssse3, "ssse3" },
+    };
+    unsigned int features = cpu_features();
+    size_t i, len = 0;
+
+    if (buf == NULL || size == 0) {
+        return buf;
+    }
+    buf[0] = '\0';
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (features & names[i].bit) {
+            int n = snprintf(buf + len, size - len, "%s%s", len ? " " : "", names[i].name);
+            if (n < 0 || (size_t)n >= size - len) {
+                break;
+            }
+            len += (size_t)n;
+        }
+    }
+    if (len == 0) {
+        snprintf(buf, size, "none");
+    }
+    return buf;
+}
@@ -0,0 +1,26 @@
+#if !defined(__cpu_features_h__)
+#define __cpu_features_h__ 1
+
+#include <stddef.h>
+
+/*
+ * CPU features probed once at startup. The crypto backends pick their own
+ * AES/SHA kernels from the same CPUID / HWCAP bits; the kernels we own
+ * (CRC32, adler32) are dispatched on them here.
+ */
+
+enum cpu_feature {
+    cpu_feature_aes     = (1 << 0),  /* AES-NI, or the ARMv8 AES instructions. */
+    cpu_feature_pclmul  = (1 << 1),  /* PCLMULQDQ, or ARMv8 PMULL. */
+    cpu_feature_sha1    = (1 << 2),  /* SHA-NI, or the ARMv8 SHA1 instructions. */
+    cpu_feature_sha2    = (1 << 3),
+    cpu_feature_avx2    = (1 << 4),
+    cpu_feature_crc32   = (1 << 5),  /* ARMv8 CRC32; the x86 one is CRC32C only. */
+    cpu_feature_sse41   = (1 << 6),
+    cpu_feature_ssse3   = (1 << 7),
+};
+
+unsigned int cpu_features(void);
+const char * cpu_features_describe(char *buf, size_t size);
+
+#endif // __cpu_features_h__
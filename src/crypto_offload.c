@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "crypto_offload.h"
+#include "common.h"
+
+#define CRYPTO_OFFLOAD_MASK (CRYPTO_OFFLOAD_QUEUE - 1)
+
+/* Single producer, single consumer. Only the producer writes |head| and
+ * only the consumer |tail|, the fill level is kept by the loop. */
+struct crypto_offload_ring {
+    struct crypto_offload_job *jobs[CRYPTO_OFFLOAD_QUEUE];
+    unsigned int head;
+    unsigned int tail;
+};
+
+struct crypto_offload_lane {
+    struct crypto_offload *co;
+    uv_thread_t thread;
+    uv_sem_t wake;  /* Posted once per job, and once to stop. */
+    struct crypto_offload_ring todo;  /* Loop to worker. */
+    struct crypto_offload_ring done;  /* Worker to loop. */
+    unsigned int in_flight;  /* Submitted to |todo| and not yet taken from |done|, by the loop. */
+    struct crypto_offload_job *waiting_first;  /* Submitted while the rings were full, by the loop. */
+    struct crypto_offload_job *waiting_last;
+};
+
+struct crypto_offload {
+    uv_async_t async;
+    bool stopping;
+    unsigned int lane_count;
+    unsigned int next_lane;
+    struct crypto_offload_lane *lanes;
+};
+
+static void crypto_offload_push(struct crypto_offload_ring *ring, struct crypto_offload_job *job) {
+    unsigned int head = ring->head;
+    ring->jobs[head & CRYPTO_OFFLOAD_MASK] = job;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static struct crypto_offload_job * crypto_offload_pop(struct crypto_offload_ring *ring) {
+    unsigned int tail = ring->tail;
+    struct crypto_offload_job *job;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    job = ring->jobs[tail & CRYPTO_OFFLOAD_MASK];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return job;
+}
+
+static void crypto_offload_worker(void *arg) {
+    struct crypto_offload_lane *lane = (struct crypto_offload_lane *)arg;
+    for (;;) {
+        struct crypto_offload_job *job;
+        uv_sem_wait(&lane->wake);
+        job = crypto_offload_pop(&lane->todo);
+        if (job == NULL) {
+            // The stop is posted after every job, so they are all done.
+            if (__atomic_load_n(&lane->co->stopping, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            continue;
+        }
+        job->work_cb(job);
+        crypto_offload_push(&lane->done, job);
+        uv_async_send(&lane->co->async);
+    }
+}
+
+/* Hands the waiting jobs to the worker while there is room. */
+static void crypto_offload_feed(struct crypto_offload_lane *lane) {
+    while (lane->waiting_first && lane->in_flight < CRYPTO_OFFLOAD_QUEUE) {
+        struct crypto_offload_job *job = lane->waiting_first;
+        lane->waiting_first = job->next;
+        if (lane->waiting_first == NULL) {
+            lane->waiting_last = NULL;
+        }
+        job->next = NULL;
+        lane->in_flight++;
+        crypto_offload_push(&lane->todo, job);
+        uv_sem_post(&lane->wake);
+    }
+}
+
+static void crypto_offload_complete(struct crypto_offload *co) {
+    unsigned int i;
+    for (i = 0; i < co->lane_count; ++i) {
+        struct crypto_offload_lane *lane = &co->lanes[i];
+        struct crypto_offload_job *job;
+        while ((job = crypto_offload_pop(&lane->done)) != NULL) {
+            lane->in_flight--;
+            job->done_cb(job);
+        }
+        if (co->stopping == false) {
+            crypto_offload_feed(lane);
+        }
+    }
+}
+
+static void crypto_offload_async_cb(uv_async_t *handle) {
+    crypto_offload_complete(CONTAINER_OF(handle, struct crypto_offload, async));
+}
+
+static void crypto_offload_close_done_cb(uv_handle_t *handle) {
+    struct crypto_offload *co = CONTAINER_OF(handle, struct crypto_offload, async);
+    free(co->lanes);
+    free(co);
+}
+
+struct crypto_offload * crypto_offload_create(uv_loop_t *loop, unsigned int workers) {
+    struct crypto_offload *co;
+    unsigned int i;
+
+    if (workers == 0) {
+        return NULL;
+    }
+    co = (struct crypto_offload *) calloc(1, sizeof(*co));
+    co->lanes = (struct crypto_offload_lane *) calloc(workers, sizeof(struct crypto_offload_lane));
+    if (co->lanes == NULL) {
+        free(co);
+        return NULL;
+    }
+    for (i = 0; i < workers; ++i) {
+        struct crypto_offload_lane *lane = &co->lanes[co->lane_count];
+        lane->co = co;
+        VERIFY(0 == uv_sem_init(&lane->wake, 0));
+        if (uv_thread_create(&lane->thread, crypto_offload_worker, lane) != 0) {
+            uv_sem_destroy(&lane->wake);
+            break;
+        }
+        co->lane_count++;
+    }
+    if (co->lane_count == 0) {
+        free(co->lanes);
+        free(co);
+        return NULL;
+    }
+    VERIFY(0 == uv_async_init(loop, &co->async, crypto_offload_async_cb));
+    // Only a job in flight should keep the loop alive, and those belong to live tunnels.
+    uv_unref((uv_handle_t *)&co->async);
+    return co;
+}
+
+void crypto_offload_release(struct crypto_offload *co) {
+    unsigned int i;
+    if (co == NULL) {
+        return;
+    }
+    __atomic_store_n(&co->stopping, true, __ATOMIC_RELEASE);
+    for (i = 0; i < co->lane_count; ++i) {
+        uv_sem_post(&co->lanes[i].wake);
+    }
+    for (i = 0; i < co->lane_count; ++i) {
+        uv_thread_join(&co->lanes[i].thread);
+        uv_sem_destroy(&co->lanes[i].wake);
+    }
+    crypto_offload_complete(co);
+    // Those that never got to a worker run here, still in order.
+    for (i = 0; i < co->lane_count; ++i) {
+        struct crypto_offload_lane *lane = &co->lanes[i];
+        while (lane->waiting_first) {
+            struct crypto_offload_job *job = lane->waiting_first;
+            lane->waiting_first = job->next;
+            job->work_cb(job);
+            job->done_cb(job);
+        }
+        lane->waiting_last = NULL;
+    }
+    uv_close((uv_handle_t *)&co->async, crypto_offload_close_done_cb);
+}
+
+unsigned int crypto_offload_lane(struct crypto_offload *co) {
+    unsigned int lane = co->next_lane;
+    co->next_lane = (co->next_lane + 1) % co->lane_count;
+    return lane;
+}
+
+void crypto_offload_submit(struct crypto_offload *co, unsigned int lane_index, struct crypto_offload_job *job) {
+    struct crypto_offload_lane *lane = &co->lanes[lane_index % co->lane_count];
+    ASSERT(co->stopping == false);
+    job->next = NULL;
+    if (lane->waiting_last) {
+        lane->waiting_last->next = job;
+    } else {
+        lane->waiting_first = job;
+    }
+    lane->waiting_last = job;
+    crypto_offload_feed(lane);
+}
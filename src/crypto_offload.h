@@ -0,0 +1,40 @@
+#if !defined(__crypto_offload_h__)
+#define __crypto_offload_h__ 1
+
+#include <stdbool.h>
+#include <uv.h>
+
+/*
+ * Worker threads that run the cipher of one loop's bulk reads, so a
+ * single tunnel isn't held to the loop's core. Each worker is a lane with
+ * a ring of jobs from the loop and a ring of finished ones back, both
+ * single producer and single consumer, no locks. A tunnel direction keeps
+ * to one lane: its jobs run and come back in the order they were
+ * submitted, while the other direction runs on another lane. Finished
+ * jobs wake the loop through a uv_async_t and complete there. A job's
+ * work may only touch what is its own. Not thread safe: one per
+ * uv_loop_t, submitted to and completed on its thread.
+ */
+
+#define CRYPTO_OFFLOAD_MIN_BYTES  (16 * 1024)  /* Smaller reads aren't worth the trip to a worker. */
+#define CRYPTO_OFFLOAD_QUEUE      256  /* Jobs in a lane's rings, a power of two. More wait on the loop. */
+
+struct crypto_offload;
+
+struct crypto_offload_job {
+    struct crypto_offload_job *next;  /* While waiting for room in its lane. */
+    void(*work_cb)(struct crypto_offload_job *job);  /* On the worker. */
+    void(*done_cb)(struct crypto_offload_job *job);  /* Back on the loop. */
+};
+
+/* NULL without |workers| or if no thread starts. */
+struct crypto_offload * crypto_offload_create(uv_loop_t *loop, unsigned int workers);
+/* Lets the workers finish what they were given and completes it all on the
+ * loop, then closes the handle, it's freed once closed. */
+void crypto_offload_release(struct crypto_offload *co);
+/* The lane for a new tunnel direction, round robin. */
+unsigned int crypto_offload_lane(struct crypto_offload *co);
+/* |job| runs after those submitted to |lane| before it, done_cb follows on the loop. */
+void crypto_offload_submit(struct crypto_offload *co, unsigned int lane, struct crypto_offload_job *job);
+
+#endif // !defined(__crypto_offload_h__)
@@ -0,0 +1,269 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dns_cache.h"
+#include "cache.h"
+#include "common.h"
+#include "resolv.h"
+#include "ssr_alloc.h"
+
+#define DNS_CACHE_HOST_MAX 255
+
+struct dns_entry {
+    uint64_t expire_at;  /* uv_now() */
+    unsigned int hits;
+    bool refreshing;
+    size_t next;  /* Round robin start of the next lookup. */
+    size_t count;  /* 0 for a name that failed to resolve. */
+    union sockaddr_universal addrs[1];
+};
+
+struct dns_refresh {
+    uv_getaddrinfo_t req;
+    struct resolv_query *query;  /* Set when it went through the resolver. */
+    struct dns_cache *cache;
+    struct dns_refresh *prev;
+    struct dns_refresh *next;
+    char host[DNS_CACHE_HOST_MAX + 1];
+};
+
+struct dns_cache {
+    uv_loop_t *loop;
+    struct resolv_ctx *resolver;
+    struct cache *entries;
+    uint64_t ttl_ms;
+    uint64_t negative_ttl_ms;
+    struct dns_refresh *refreshes;  /* Pending background lookups. */
+    bool released;
+};
+
+/* With room for one address at least, a failure's too. */
+static size_t dns_entry_size(size_t count) {
+    return sizeof(struct dns_entry) + ((count > 1) ? (count - 1) : 0) * sizeof(union sockaddr_universal);
+}
+
+static void dns_entry_free_cb(void *key, void *element) {
+    (void)key;
+    ssr_census_remove(ssr_census_dns_entries, dns_entry_size(((struct dns_entry *)element)->count));
+    ssr_free(ssr_alloc_dns, element);
+}
+
+static size_t dns_cache_key(const char *host, char key[DNS_CACHE_HOST_MAX + 1]) {
+    size_t len = 0;
+    while (host[len] != '\0') {
+        if (len >= DNS_CACHE_HOST_MAX) {
+            return 0;
+        }
+        key[len] = (char) tolower((unsigned char) host[len]);
+        ++len;
+    }
+    // A trailing dot names the same host.
+    if (len > 1 && key[len - 1] == '.') {
+        --len;
+    }
+    key[len] = '\0';
+    return len;
+}
+
+static struct dns_entry * dns_entry_find(struct dns_cache *cache, char *key, size_t len) {
+    struct dns_entry *entry = NULL;
+    cache_lookup(cache->entries, key, len, (void *)&entry);
+    return entry;
+}
+
+static void dns_cache_put(struct dns_cache *cache, char *key, size_t len, struct dns_entry *entry, uint64_t ttl_ms) {
+    struct dns_entry *old = dns_entry_find(cache, key, len);
+    if (old) {
+        entry->hits = old->hits;
+        cache_remove(cache->entries, key, len);
+    }
+    entry->expire_at = uv_now(cache->loop) + ttl_ms;
+    ssr_census_add(ssr_census_dns_entries, dns_entry_size(entry->count));
+    cache_insert(cache->entries, key, len, entry);
+}
+
+static void dns_cache_free_when_idle(struct dns_cache *cache) {
+    if (cache->released && cache->refreshes == NULL) {
+        cache_delete(cache->entries, 0);
+        ssr_free(ssr_alloc_dns, cache);
+    }
+}
+
+static void dns_refresh_unlink(struct dns_refresh *refresh) {
+    struct dns_cache *cache = refresh->cache;
+    if (refresh->prev) {
+        refresh->prev->next = refresh->next;
+    } else {
+        cache->refreshes = refresh->next;
+    }
+    if (refresh->next) {
+        refresh->next->prev = refresh->prev;
+    }
+}
+
+static void dns_refresh_done(struct dns_refresh *refresh, int status, const union sockaddr_universal *addrs, size_t count) {
+    struct dns_cache *cache = refresh->cache;
+
+    dns_refresh_unlink(refresh);
+
+    if (cache->released == false) {
+        if (status == 0 && count > 0) {
+            dns_cache_store(cache, refresh->host, addrs, count);
+        } else {
+            // Keep serving what we had, a later hit retries.
+            char key[DNS_CACHE_HOST_MAX + 1];
+            size_t len = dns_cache_key(refresh->host, key);
+            struct dns_entry *entry = dns_entry_find(cache, key, len);
+            if (entry) {
+                entry->refreshing = false;
+            }
+        }
+    }
+    ssr_free(ssr_alloc_dns, refresh);
+    dns_cache_free_when_idle(cache);
+}
+
+static void dns_refresh_resolv_cb(int status, const union sockaddr_universal *addrs, size_t count, void *data) {
+    dns_refresh_done((struct dns_refresh *)data, status, addrs, count);
+}
+
+static void dns_refresh_getaddrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai) {
+    struct dns_refresh *refresh = CONTAINER_OF(req, struct dns_refresh, req);
+    union sockaddr_universal addrs[DNS_CACHE_MAX_ADDRS];
+    size_t count = 0;
+
+    if (status == 0) {
+        count = universal_addresses_from_addrinfo(ai, addrs, DNS_CACHE_MAX_ADDRS);
+    }
+    if (ai) {
+        uv_freeaddrinfo(ai);
+    }
+    dns_refresh_done(refresh, status, addrs, count);
+}
+
+static void dns_refresh_start(struct dns_cache *cache, const char *key, struct dns_entry *entry) {
+    struct dns_refresh *refresh;
+
+    refresh = (struct dns_refresh *) ssr_calloc(ssr_alloc_dns, 1, sizeof(*refresh));
+    refresh->cache = cache;
+    strcpy(refresh->host, key);
+
+    if (cache->resolver) {
+        refresh->query = resolv_query(cache->resolver, refresh->host, 0, dns_refresh_resolv_cb, refresh);
+        if (refresh->query == NULL) {
+            ssr_free(ssr_alloc_dns, refresh);
+            return;
+        }
+    } else {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if (uv_getaddrinfo(cache->loop, &refresh->req, dns_refresh_getaddrinfo_cb, refresh->host, NULL, &hints) != 0) {
+            ssr_free(ssr_alloc_dns, refresh);
+            return;
+        }
+    }
+    refresh->next = cache->refreshes;
+    if (cache->refreshes) {
+        cache->refreshes->prev = refresh;
+    }
+    cache->refreshes = refresh;
+    entry->refreshing = true;
+}
+
+struct dns_cache * dns_cache_create(uv_loop_t *loop, struct resolv_ctx *resolver, size_t capacity, uint64_t ttl_ms, uint64_t negative_ttl_ms) {
+    struct dns_cache *cache = (struct dns_cache *) ssr_calloc(ssr_alloc_dns, 1, sizeof(*cache));
+    cache->loop = loop;
+    cache->resolver = resolver;
+    cache->ttl_ms = ttl_ms;
+    cache->negative_ttl_ms = negative_ttl_ms;
+    cache_create(&cache->entries, capacity ? capacity : DEFAULT_DNS_CACHE_CAPACITY, dns_entry_free_cb);
+    return cache;
+}
+
+void dns_cache_destroy(struct dns_cache *cache) {
+    struct dns_refresh *refresh, *next;
+    if (cache == NULL || cache->released) {
+        return;
+    }
+    cache->released = true;
+    for (refresh = cache->refreshes; refresh; refresh = next) {
+        next = refresh->next;
+        if (refresh->query) {
+            resolv_cancel(refresh->query);
+            dns_refresh_unlink(refresh);
+            ssr_free(ssr_alloc_dns, refresh);
+        } else {
+            uv_cancel((uv_req_t *)&refresh->req);
+        }
+    }
+    dns_cache_free_when_idle(cache);
+}
+
+int dns_cache_lookup(struct dns_cache *cache, const char *host, union sockaddr_universal *addrs, size_t max) {
+    char key[DNS_CACHE_HOST_MAX + 1];
+    struct dns_entry *entry;
+    uint64_t now;
+    size_t len, index;
+
+    if (cache == NULL || cache->released || (len = dns_cache_key(host, key)) == 0) {
+        return 0;
+    }
+    if ((entry = dns_entry_find(cache, key, len)) == NULL) {
+        return 0;
+    }
+    now = uv_now(cache->loop);
+    if (now >= entry->expire_at) {
+        cache_remove(cache->entries, key, len);
+        return 0;
+    }
+    if (entry->count == 0) {
+        return -1;
+    }
+
+    entry->hits++;
+    if (entry->hits >= 2 && entry->refreshing == false && entry->expire_at - now <= cache->ttl_ms / 4) {
+        dns_refresh_start(cache, key, entry);
+    }
+
+    if (max > entry->count) {
+        max = entry->count;
+    }
+    for (index = 0; index < max; ++index) {
+        addrs[index] = entry->addrs[(entry->next + index) % entry->count];
+    }
+    entry->next = (entry->next + 1) % entry->count;
+    return (int) max;
+}
+
+void dns_cache_store(struct dns_cache *cache, const char *host, const union sockaddr_universal *addrs, size_t count) {
+    char key[DNS_CACHE_HOST_MAX + 1];
+    struct dns_entry *entry;
+    size_t len, index;
+
+    if (cache == NULL || cache->released || count == 0 || (len = dns_cache_key(host, key)) == 0) {
+        return;
+    }
+    if (count > DNS_CACHE_MAX_ADDRS) {
+        count = DNS_CACHE_MAX_ADDRS;
+    }
+    entry = (struct dns_entry *) ssr_calloc(ssr_alloc_dns, 1, dns_entry_size(count));
+    for (index = 0; index < count; ++index) {
+        entry->addrs[index] = addrs[index];
+        entry->addrs[index].addr4.sin_port = 0;
+    }
+    entry->count = count;
+    dns_cache_put(cache, key, len, entry, cache->ttl_ms);
+}
+
+void dns_cache_store_failure(struct dns_cache *cache, const char *host) {
+    char key[DNS_CACHE_HOST_MAX + 1];
+    size_t len;
+
+    if (cache == NULL || cache->released || cache->negative_ttl_ms == 0 || (len = dns_cache_key(host, key)) == 0) {
+        return;
+    }
+    dns_cache_put(cache, key, len, (struct dns_entry *) ssr_calloc(ssr_alloc_dns, 1, dns_entry_size(0)), cache->negative_ttl_ms);
+}
@@ -0,0 +1,40 @@
+#if !defined(__dns_cache_h__)
+#define __dns_cache_h__ 1
+
+#include <stddef.h>
+#include <uv.h>
+#include "sockaddr_universal.h"
+
+/*
+ * ssr-server's host name cache. Every entry keeps all the A and AAAA
+ * records of one name, handed out round robin, and lives for a fixed TTL
+ * since getaddrinfo reports none. Names that don't exist are remembered
+ * for a shorter while. Entries looked up more than once are refreshed in
+ * the background during the last quarter of their life, so a busy name
+ * never goes cold. When it is full, an entry not looked up since the
+ * CLOCK hand last passed makes room. Not thread safe: one cache per
+ * worker loop.
+ */
+
+#define DEFAULT_DNS_CACHE_CAPACITY      4096
+#define DEFAULT_DNS_CACHE_TTL           (60 * 1000)  /* ms */
+#define DEFAULT_DNS_CACHE_NEGATIVE_TTL  (10 * 1000)  /* ms */
+#define DNS_CACHE_MAX_ADDRS             8
+
+struct dns_cache;
+struct resolv_ctx;
+
+/* Refreshes go through |resolver|, uv_getaddrinfo() when it's NULL. */
+struct dns_cache * dns_cache_create(uv_loop_t *loop, struct resolv_ctx *resolver, size_t capacity, uint64_t ttl_ms, uint64_t negative_ttl_ms);
+/* Pending refreshes are abandoned, the cache is freed once they are done. */
+void dns_cache_destroy(struct dns_cache *cache);
+/*
+ * Copies up to |max| addresses of |host|, port 0, the first one rotating
+ * between calls. Returns their count, 0 when |host| isn't cached and -1
+ * when it failed to resolve recently.
+ */
+int dns_cache_lookup(struct dns_cache *cache, const char *host, union sockaddr_universal *addrs, size_t max);
+void dns_cache_store(struct dns_cache *cache, const char *host, const union sockaddr_universal *addrs, size_t count);
+void dns_cache_store_failure(struct dns_cache *cache, const char *host);
+
+#endif // !defined(__dns_cache_h__)
@@ -0,0 +1,581 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include <uv-mbed/uv-mbed.h>
+#include <udns.h>
+#include "dns_tls.h"
+#include "ssrbuffer.h"
+#include "ssrutils.h"
+#include "ssr_alloc.h"
+
+#define DNS_TLS_HOST_MAX 255
+#define DNS_TLS_SWEEP_MS 1000
+#define DNS_TLS_DOWN_MS (10 * 1000)  /* An upstream that refused a connection is skipped this long. */
+#define DNS_TLS_READ_SIZE 4096
+
+enum dns_tls_conn_state {
+    dns_tls_idle,
+    dns_tls_connecting,
+    dns_tls_ready,
+    dns_tls_closing,
+};
+
+struct dns_tls_conn {
+    struct dns_tls *tls;
+    char host[DNS_TLS_HOST_MAX + 1];
+    int port;
+    enum dns_tls_conn_state state;
+    uv_mbed_t *mbed;
+    struct buffer_t *rbuf;  /* Partial answers. */
+    uint64_t last_read;
+    uint64_t down_until;
+    size_t inflight;
+    struct dns_tls_query *queries;  /* Sent, or waiting for the handshake. */
+    char read_buf[DNS_TLS_READ_SIZE];
+};
+
+struct dns_tls_query {
+    struct dns_tls *tls;
+    struct dns_tls_query **head;  /* The list it's on. */
+    struct dns_tls_query *prev;
+    struct dns_tls_query *next;
+    dns_tls_query_cb cb;
+    void *data;
+    uint16_t id;
+    int qtype;
+    bool sent;
+    unsigned int tries;
+    uint64_t sent_at;
+    uint64_t deadline;
+    dnsc_t dn[DNS_MAXDN];
+};
+
+struct dns_tls {
+    uv_loop_t *loop;
+    struct dns_tls_conn conns[DNS_TLS_MAX_UPSTREAMS];
+    size_t count;
+    size_t next;  /* Round robin among equally loaded upstreams. */
+    uint16_t next_id;
+    struct dns_tls_query *failing;  /* Given up on, callbacks pending. */
+    uv_timer_t sweep_timer;
+    int ref_count;  /* Open handles and outstanding uv_mbed callbacks. */
+    bool released;
+};
+
+static void conn_connect(struct dns_tls_conn *conn);
+static void conn_close(struct dns_tls_conn *conn);
+static void query_dispatch(struct dns_tls_query *query);
+
+static void tls_add_ref(struct dns_tls *tls) {
+    tls->ref_count++;
+}
+
+static void tls_release(struct dns_tls *tls) {
+    size_t index;
+    if (--tls->ref_count > 0) {
+        return;
+    }
+    for (index = 0; index < tls->count; ++index) {
+        buffer_release(tls->conns[index].rbuf);
+    }
+    ssr_free(ssr_alloc_dns, tls);
+}
+
+static void query_link(struct dns_tls_query **head, struct dns_tls_query *query) {
+    query->head = head;
+    query->prev = NULL;
+    query->next = *head;
+    if (*head) {
+        (*head)->prev = query;
+    }
+    *head = query;
+}
+
+static void query_unlink(struct dns_tls_query *query) {
+    if (query->head == NULL) {
+        return;
+    }
+    if (query->prev) {
+        query->prev->next = query->next;
+    } else {
+        *query->head = query->next;
+    }
+    if (query->next) {
+        query->next->prev = query->prev;
+    }
+    query->head = NULL;
+    query->prev = query->next = NULL;
+}
+
+static struct dns_tls_conn * query_conn(struct dns_tls_query *query) {
+    size_t index;
+    for (index = 0; index < query->tls->count; ++index) {
+        if (query->head == &query->tls->conns[index].queries) {
+            return &query->tls->conns[index];
+        }
+    }
+    return NULL;
+}
+
+/* Detaches |query| from its connection, it stops counting as in flight there. */
+static void query_detach(struct dns_tls_query *query) {
+    struct dns_tls_conn *conn = query_conn(query);
+    if (conn && query->sent) {
+        conn->inflight--;
+    }
+    query->sent = false;
+    query_unlink(query);
+}
+
+/* Runs the callbacks of everything moved to tls->failing, a callback may cancel any of them. */
+static void tls_run_failing(struct dns_tls *tls, int status) {
+    struct dns_tls_query *query;
+    while ((query = tls->failing) != NULL) {
+        query_unlink(query);
+        query->cb(status, NULL, query->data);
+        ssr_free(ssr_alloc_dns, query);
+    }
+}
+
+/* Another upstream gets |query|, unless each had its chance. */
+static void query_retry(struct dns_tls_query *query) {
+    struct dns_tls *tls = query->tls;
+    query_detach(query);
+    if (++query->tries > tls->count) {
+        query_link(&tls->failing, query);
+    } else {
+        query_dispatch(query);
+    }
+}
+
+static void mbed_write_done_cb(uv_mbed_t *mbed, int status, void *p) {
+    struct dns_tls_conn *conn = (struct dns_tls_conn *)p;
+    struct dns_tls *tls = conn->tls;
+    if (status < 0 && conn->mbed == mbed && conn->state == dns_tls_ready) {
+        LOGE("DNS over TLS write to %s failed: %s", conn->host, uv_strerror(status));
+        conn_close(conn);
+    }
+    tls_release(tls);
+}
+
+static void query_send(struct dns_tls_conn *conn, struct dns_tls_query *query) {
+    uint8_t frame[2 + DNS_HSIZE + DNS_MAXDN + 4];
+    uint8_t *p = frame + 2 + DNS_HSIZE;
+    unsigned int dnlen = dns_dnlen(query->dn);
+    uv_buf_t o;
+
+    memset(frame, 0, 2 + DNS_HSIZE);
+    dns_put16(frame + 2 + DNS_H_QID, query->id);
+    frame[2 + DNS_H_F1] = DNS_HF1_RD;
+    dns_put16(frame + 2 + 4, 1);  /* qdcount */
+    memcpy(p, query->dn, dnlen);
+    p = dns_put16(p + dnlen, (unsigned)query->qtype);
+    p = dns_put16(p, DNS_C_IN);
+    dns_put16(frame, (unsigned)(p - frame - 2));
+
+    // uv_mbed_write() encrypts into its own buffer before returning.
+    o = uv_buf_init((char *)frame, (unsigned int)(p - frame));
+    if (uv_mbed_write(conn->mbed, &o, mbed_write_done_cb, conn) != 0) {
+        // Resent once the connection is back.
+        conn_close(conn);
+        return;
+    }
+    tls_add_ref(conn->tls);
+    query->sent = true;
+    query->sent_at = uv_now(conn->tls->loop);
+    conn->inflight++;
+}
+
+static void conn_send_pending(struct dns_tls_conn *conn) {
+    struct dns_tls_query *query;
+    for (query = conn->queries; query && conn->state == dns_tls_ready; query = query->next) {
+        if (query->sent == false) {
+            query_send(conn, query);
+        }
+    }
+}
+
+static struct dns_tls_conn * tls_pick(struct dns_tls *tls) {
+    uint64_t now = uv_now(tls->loop);
+    struct dns_tls_conn *best = NULL;
+    size_t index, pick = 0;
+
+    for (index = 0; index < tls->count; ++index) {
+        size_t at = (tls->next + index) % tls->count;
+        struct dns_tls_conn *conn = &tls->conns[at];
+        bool down = conn->down_until > now;
+        if (best == NULL
+            || ((best->down_until > now) && !down)
+            || ((best->down_until > now) == down && conn->inflight < best->inflight)) {
+            best = conn;
+            pick = at;
+        }
+    }
+    tls->next = (pick + 1) % tls->count;
+    return best;
+}
+
+static void query_dispatch(struct dns_tls_query *query) {
+    struct dns_tls_conn *conn = tls_pick(query->tls);
+
+    query_link(&conn->queries, query);
+    switch (conn->state) {
+    case dns_tls_ready:
+        query_send(conn, query);
+        break;
+    case dns_tls_idle:
+        conn_connect(conn);
+        break;
+    default:
+        break;  /* Sent once connected. */
+    }
+}
+
+/* Gives every query of |conn| to another upstream, then closes it. */
+static void conn_fail(struct dns_tls_conn *conn) {
+    struct dns_tls *tls = conn->tls;
+    struct dns_tls_query *moving = NULL, *query;
+
+    while ((query = conn->queries) != NULL) {
+        query_detach(query);
+        query_link(&moving, query);
+    }
+    conn_close(conn);
+    while ((query = moving) != NULL) {
+        query_unlink(query);
+        query_retry(query);
+    }
+    tls_run_failing(tls, DNS_E_TEMPFAIL);
+}
+
+static void mbed_close_done_cb(uv_mbed_t *mbed, void *p) {
+    struct dns_tls_conn *conn = (struct dns_tls_conn *)p;
+    struct dns_tls *tls = conn->tls;
+
+    uv_mbed_free(mbed);
+    if (conn->state == dns_tls_closing) {
+        conn->state = dns_tls_idle;
+        if (tls->released == false && conn->queries) {
+            if (conn->down_until > uv_now(tls->loop)) {
+                conn_fail(conn);
+            } else {
+                conn_connect(conn);
+            }
+        }
+    }
+    tls_release(tls);
+}
+
+static void conn_close(struct dns_tls_conn *conn) {
+    struct dns_tls_query *query;
+    uv_mbed_t *mbed = conn->mbed;
+
+    for (query = conn->queries; query; query = query->next) {
+        query->sent = false;
+    }
+    conn->inflight = 0;
+    buffer_reset(conn->rbuf);
+    if (mbed == NULL) {
+        return;
+    }
+    conn->mbed = NULL;
+    conn->state = dns_tls_closing;
+    tls_add_ref(conn->tls);
+    uv_mbed_close(mbed, mbed_close_done_cb, conn);
+}
+
+/* Unlinks and returns the query |pkt| answers, |*status| and |*result| as udns would report them. */
+static struct dns_tls_query * conn_answer(struct dns_tls_conn *conn, dnscc_t *pkt, dnscc_t *end, int *status, void **result) {
+    dnsc_t dn[DNS_MAXDN];
+    dnscc_t *cur = dns_payload(pkt);
+    struct dns_tls_query *query;
+    int qtype;
+
+    if (end - pkt < DNS_HSIZE || !dns_qr(pkt) || dns_numqd(pkt) != 1) {
+        return NULL;
+    }
+    if (dns_getdn(pkt, &cur, end, dn, sizeof(dn)) <= 0 || end - cur < 4) {
+        return NULL;
+    }
+    qtype = (int)dns_get16(cur);
+    for (query = conn->queries; query; query = query->next) {
+        if (query->sent && query->id == dns_qid(pkt) && query->qtype == qtype && dns_dnequal(query->dn, dn)) {
+            break;
+        }
+    }
+    if (query == NULL) {
+        return NULL;
+    }
+    query_detach(query);
+
+    *result = NULL;
+    switch (dns_rcode(pkt)) {
+    case DNS_R_NOERROR:
+        if (dns_tc(pkt)) {
+            break;
+        }
+        if (dns_numan(pkt) == 0) {
+            *status = DNS_E_NODATA;
+        } else {
+            int r = (qtype == DNS_T_A ? dns_parse_a4 : dns_parse_a6)(query->dn, pkt, cur, end, result);
+            *status = r < 0 ? r : 0;
+            if (r < 0) {
+                *result = NULL;
+            }
+        }
+        return query;
+    case DNS_R_NXDOMAIN:
+        *status = DNS_E_NXDOMAIN;
+        return query;
+    default:
+        break;
+    }
+    // SERVFAIL, REFUSED and the like, another upstream may know better.
+    query_retry(query);
+    return NULL;
+}
+
+static void conn_on_data(struct dns_tls_conn *conn, const uint8_t *data, size_t len) {
+    struct dns_tls *tls = conn->tls;
+    struct buffer_t *rbuf = conn->rbuf;
+
+    conn->last_read = uv_now(tls->loop);
+    buffer_concatenate(rbuf, data, len);
+
+    while (conn->state == dns_tls_ready && rbuf->len >= 2) {
+        size_t size = dns_get16(rbuf->buffer);
+        struct dns_tls_query *query;
+        void *result = NULL;
+        int status = DNS_E_TEMPFAIL;
+
+        if (rbuf->len < size + 2) {
+            break;
+        }
+        query = conn_answer(conn, rbuf->buffer + 2, rbuf->buffer + 2 + size, &status, &result);
+        buffer_shorten(rbuf, size + 2, rbuf->len - size - 2);
+        if (query) {
+            query->cb(status, result, query->data);
+            ssr_free(ssr_alloc_dns, query);
+        }
+        tls_run_failing(tls, DNS_E_TEMPFAIL);
+    }
+}
+
+static void mbed_alloc_cb(uv_mbed_t *mbed, size_t suggested_size, uv_buf_t *buf, void *p) {
+    struct dns_tls_conn *conn = (struct dns_tls_conn *)p;
+    (void)mbed; (void)suggested_size;
+    *buf = uv_buf_init(conn->read_buf, sizeof(conn->read_buf));
+}
+
+static void mbed_read_cb(uv_mbed_t *mbed, ssize_t nread, uv_buf_t *buf, void *p) {
+    struct dns_tls_conn *conn = (struct dns_tls_conn *)p;
+
+    if (conn->mbed != mbed || conn->state != dns_tls_ready) {
+        return;
+    }
+    if (nread > 0) {
+        conn_on_data(conn, (const uint8_t *)buf->base, (size_t)nread);
+    } else if (nread < 0) {
+        // Upstreams drop idle connections, only the queries on it care.
+        if (nread != UV_EOF) {
+            LOGE("DNS over TLS read from %s failed: %s", conn->host, uv_strerror((int)nread));
+        }
+        conn_fail(conn);
+    }
+}
+
+static void mbed_connect_done_cb(uv_mbed_t *mbed, int status, void *p) {
+    struct dns_tls_conn *conn = (struct dns_tls_conn *)p;
+    struct dns_tls *tls = conn->tls;
+
+    if (conn->mbed == mbed && conn->state == dns_tls_connecting) {
+        if (status < 0) {
+            LOGE("DNS over TLS connect to %s failed: %s", conn->host, uv_strerror(status));
+            conn->down_until = uv_now(tls->loop) + DNS_TLS_DOWN_MS;
+            conn_fail(conn);
+        } else {
+            conn->state = dns_tls_ready;
+            conn->down_until = 0;
+            conn->last_read = uv_now(tls->loop);
+            uv_mbed_read(mbed, mbed_alloc_cb, mbed_read_cb, conn);
+            conn_send_pending(conn);
+        }
+    }
+    tls_release(tls);
+}
+
+static void conn_connect(struct dns_tls_conn *conn) {
+    struct dns_tls *tls = conn->tls;
+
+    conn->state = dns_tls_connecting;
+    conn->mbed = uv_mbed_init(tls->loop, NULL, 0);
+    tls_add_ref(tls);
+    if (uv_mbed_connect(conn->mbed, conn->host, conn->port, mbed_connect_done_cb, conn) != 0) {
+        // The queries move on once it's closed, never from under dns_tls_submit().
+        tls_release(tls);
+        conn->down_until = uv_now(tls->loop) + DNS_TLS_DOWN_MS;
+        conn_close(conn);
+    }
+}
+
+static void sweep_timer_cb(uv_timer_t *handle) {
+    struct dns_tls *tls = (struct dns_tls *)handle->data;
+    uint64_t now = uv_now(tls->loop);
+    bool pending = false;
+    size_t index;
+
+    for (index = 0; index < tls->count; ++index) {
+        struct dns_tls_conn *conn = &tls->conns[index];
+        struct dns_tls_query *query, *next;
+        bool stalled = false;
+
+        for (query = conn->queries; query; query = next) {
+            next = query->next;
+            if (query->deadline > now) {
+                pending = true;
+                continue;
+            }
+            if (query->sent && conn->last_read < query->sent_at) {
+                stalled = true;
+            }
+            query_detach(query);
+            query_link(&tls->failing, query);
+        }
+        if (stalled && conn->state == dns_tls_ready) {
+            // Nothing came back since, don't trust the connection.
+            conn_close(conn);
+        }
+    }
+    if (pending == false) {
+        uv_timer_stop(handle);
+    }
+    tls_run_failing(tls, DNS_E_TEMPFAIL);
+}
+
+static void sweep_close_done_cb(uv_handle_t *handle) {
+    tls_release((struct dns_tls *)handle->data);
+}
+
+static bool parse_upstream(const char *item, size_t len, struct dns_tls_conn *conn) {
+    const char *port = NULL;
+    size_t host_len = len;
+
+    if (len > 0 && item[0] == '[') {
+        const char *close = memchr(item, ']', len);
+        if (close == NULL) {
+            return false;
+        }
+        ++item;
+        host_len = (size_t)(close - item);
+        if ((size_t)(close + 1 - (item - 1)) < len && close[1] == ':') {
+            port = close + 2;
+        }
+    } else {
+        const char *colon = memchr(item, ':', len);
+        if (colon && memchr(colon + 1, ':', len - (size_t)(colon + 1 - item)) == NULL) {
+            host_len = (size_t)(colon - item);
+            port = colon + 1;
+        }
+    }
+    if (host_len == 0 || host_len > DNS_TLS_HOST_MAX) {
+        return false;
+    }
+    memcpy(conn->host, item, host_len);
+    conn->host[host_len] = '\0';
+    conn->port = port ? atoi(port) : DNS_TLS_PORT;
+    return conn->port > 0 && conn->port <= 65535;
+}
+
+struct dns_tls * dns_tls_create(uv_loop_t *loop, const char *upstreams) {
+    struct dns_tls *tls;
+    const char *iter = upstreams;
+    size_t index;
+
+    if (upstreams == NULL) {
+        return NULL;
+    }
+    tls = (struct dns_tls *) ssr_calloc(ssr_alloc_dns, 1, sizeof(*tls));
+    tls->loop = loop;
+    iter += strspn(iter, ", ");
+    while (*iter && tls->count < DNS_TLS_MAX_UPSTREAMS) {
+        size_t len = strcspn(iter, ", ");
+        struct dns_tls_conn *conn = &tls->conns[tls->count];
+        if (parse_upstream(iter, len, conn)) {
+            conn->tls = tls;
+            conn->rbuf = buffer_create(DNS_TLS_READ_SIZE);
+            tls->count++;
+        } else {
+            LOGE("invalid DNS over TLS upstream %.*s", (int)len, iter);
+            memset(conn, 0, sizeof(*conn));
+        }
+        iter += len;
+        iter += strspn(iter, ", ");
+    }
+    if (tls->count == 0) {
+        ssr_free(ssr_alloc_dns, tls);
+        return NULL;
+    }
+    tls->next_id = (uint16_t)uv_hrtime();
+    uv_timer_init(loop, &tls->sweep_timer);
+    tls->sweep_timer.data = tls;
+    tls->ref_count = 1;
+
+    // Warm up, the first lookups shouldn't pay for the handshakes.
+    for (index = 0; index < tls->count; ++index) {
+        conn_connect(&tls->conns[index]);
+    }
+    return tls;
+}
+
+void dns_tls_destroy(struct dns_tls *tls) {
+    size_t index;
+
+    if (tls == NULL || tls->released) {
+        return;
+    }
+    tls->released = true;
+    for (index = 0; index < tls->count; ++index) {
+        struct dns_tls_conn *conn = &tls->conns[index];
+        struct dns_tls_query *query;
+        while ((query = conn->queries) != NULL) {
+            query_detach(query);
+            ssr_free(ssr_alloc_dns, query);
+        }
+        conn_close(conn);
+    }
+    uv_timer_stop(&tls->sweep_timer);
+    uv_close((uv_handle_t *)&tls->sweep_timer, sweep_close_done_cb);
+}
+
+struct dns_tls_query * dns_tls_submit(struct dns_tls *tls, const char *name, int qtype, dns_tls_query_cb cb, void *data) {
+    struct dns_tls_query *query;
+
+    if (tls == NULL || tls->released || cb == NULL) {
+        return NULL;
+    }
+    query = (struct dns_tls_query *) ssr_calloc(ssr_alloc_dns, 1, sizeof(*query));
+    if (dns_sptodn(name, query->dn, sizeof(query->dn)) <= 0) {
+        ssr_free(ssr_alloc_dns, query);
+        return NULL;
+    }
+    query->tls = tls;
+    query->cb = cb;
+    query->data = data;
+    query->qtype = qtype;
+    query->id = tls->next_id++;
+    query->deadline = uv_now(tls->loop) + DNS_TLS_QUERY_TIMEOUT_MS;
+
+    if (!uv_is_active((uv_handle_t *)&tls->sweep_timer)) {
+        uv_timer_start(&tls->sweep_timer, sweep_timer_cb, DNS_TLS_SWEEP_MS, DNS_TLS_SWEEP_MS);
+    }
+    query_dispatch(query);
+    return query;
+}
+
+void dns_tls_cancel(struct dns_tls_query *query) {
+    if (query == NULL) {
+        return;
+    }
+    query_detach(query);
+    ssr_free(ssr_alloc_dns, query);
+}
@@ -0,0 +1,37 @@
+#if !defined(__dns_tls_h__)
+#define __dns_tls_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <uv.h>
+
+/*
+ * DNS over TLS (RFC 7858) to a fixed set of upstreams. Each upstream keeps
+ * one warm connection and pipelines every query on it, answers are matched
+ * by id, so one handshake serves all the lookups of a loop. Queries go to
+ * the upstream with the fewest in flight. A dropped connection is reopened
+ * on demand and the queries it carried move to the next upstream.
+ * One dns_tls per uv_loop_t.
+ */
+
+#define DNS_TLS_PORT 853
+#define DNS_TLS_MAX_UPSTREAMS 4
+#define DNS_TLS_QUERY_TIMEOUT_MS (5 * 1000)
+
+struct dns_tls;
+struct dns_tls_query;
+
+/* |result| is the struct dns_rr_a4 or dns_rr_a6 of udns, the callee frees it.
+ * NULL with |status| a DNS_E_* code otherwise. */
+typedef void (*dns_tls_query_cb)(int status, void *result, void *data);
+
+/* |upstreams| is a comma separated list of host[:port], NULL if none is usable. */
+struct dns_tls * dns_tls_create(uv_loop_t *loop, const char *upstreams);
+/* Drops the pending queries without a callback, the memory goes once the connections are closed. */
+void dns_tls_destroy(struct dns_tls *tls);
+/* |qtype| is DNS_T_A or DNS_T_AAAA. NULL when |name| isn't a valid domain name. */
+struct dns_tls_query * dns_tls_submit(struct dns_tls *tls, const char *name, int qtype, dns_tls_query_cb cb, void *data);
+/* |cb| won't run. */
+void dns_tls_cancel(struct dns_tls_query *query);
+
+#endif // !defined(__dns_tls_h__)
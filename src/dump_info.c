@@ -2,10 +2,22 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <uv.h>
 
 #include "dump_info.h"
 #include "text_in_color.h"
 
+#define DUMP_LINE_MAX       1024
+#define DUMP_RING_SLOTS     128  /* Messages queued per thread, a power of two. */
+#define DUMP_WRITER_IDLE_NS (50 * 1000 * 1000)  /* The writer looks at the rings at least this often. */
+
+#if defined(_MSC_VER)
+# define DUMP_THREAD_LOCAL __declspec(thread)
+#else
+# define DUMP_THREAD_LOCAL __thread
+#endif
+
 char progname[512 + 1] = __FILE__;  /* Reset in main(). */
 
 void set_app_name(const char *name) {
@@ -42,37 +54,83 @@ typedef enum dump_level {
     dump_level_max,
 } dump_level;
 
-static void pr_do(FILE *stream, dump_level level, const char *fmt, va_list ap);
+/* One thread's queue, it only moves |head| and the writer only |tail|. */
+struct dump_entry {
+    dump_level level;
+    uint64_t time;
+    char text[DUMP_LINE_MAX];
+};
+
+struct dump_ring {
+    struct dump_ring *next;  /* Rings are never freed, a thread's stays for the next one. */
+    unsigned int head;
+    unsigned int tail;
+    uint64_t dropped;
+    struct dump_entry entries[DUMP_RING_SLOTS];
+};
+
+static bool dump_json = false;
+static bool dump_async = false;
+static int dump_stopping = 0;
+static struct dump_ring *dump_rings = NULL;
+static DUMP_THREAD_LOCAL struct dump_ring *dump_own_ring = NULL;
+static uv_thread_t dump_writer;
+static uv_mutex_t dump_writer_lock;
+static uv_cond_t dump_writer_cond;
 
-void pr_info(const char *fmt, ...) {
+static void pr_do(dump_level level, struct dump_site *site, const char *fmt, va_list ap);
+
+void (pr_info)(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    pr_do(stdout, dump_level_info, fmt, ap);
+    pr_do(dump_level_info, NULL, fmt, ap);
     va_end(ap);
 }
 
-void pr_warn(const char *fmt, ...) {
+void pr_warn_at(struct dump_site *site, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    pr_do(stderr, dump_level_warn, fmt, ap);
+    pr_do(dump_level_warn, site, fmt, ap);
     va_end(ap);
 }
 
-void pr_err(const char *fmt, ...) {
+void pr_err_at(struct dump_site *site, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    pr_do(stderr, dump_level_error, fmt, ap);
+    pr_do(dump_level_error, site, fmt, ap);
     va_end(ap);
 }
 
-static void pr_do(FILE *stream, dump_level level, const char *fmt, va_list ap) {
-    static const int size = 1024;
-    char *fmtbuf = (char *) calloc(size, sizeof(fmtbuf[0]));
-    char *p;
+void dump_info_set_json(bool json) {
+    dump_json = json;
+}
+
+/* Appends |text| to |out| as the inside of a JSON string. */
+static size_t json_escape(char *out, size_t size, const char *text) {
+    size_t len = 0;
+    for (; *text && len + 7 < size; ++text) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') {
+            out[len++] = '\\';
+            out[len++] = (char)c;
+        } else if (c == '\n') {
+            out[len++] = '\\';
+            out[len++] = 'n';
+        } else if (c < 0x20) {
+            len += (size_t)sprintf(out + len, "\\u%04x", c);
+        } else {
+            out[len++] = (char)c;
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static void dump_write(dump_level level, uint64_t when, const char *text) {
+    char line[DUMP_LINE_MAX * 2 + 128];
+    FILE *stream = (level == dump_level_info) ? stdout : stderr;
     const char *label = NULL;
     enum text_color color = text_color_white;
-    vsnprintf(fmtbuf, size, fmt, ap);
-    p = (char *) calloc(size * 2, sizeof(*p));
 
 #define DUMP_LEVEL_ENUM(item, info_text, txt_color) case (item): label = (info_text); color=txt_color; break;
     switch (level) {
@@ -81,14 +139,172 @@ static void pr_do(FILE *stream, dump_level level, const char *fmt, va_list ap) {
     }
 #undef DUMP_LEVEL_ENUM
 
+    if (dump_json) {
+        int len = snprintf(line, sizeof(line), "{\"time\":%llu,\"app\":\"%s\",\"level\":\"%s\",\"message\":\"",
+            (unsigned long long)when, get_app_name(), label + (label[0] == ' '));
+        json_escape(line + len, sizeof(line) - (size_t)len - 3, text);
+        strcat(line, "\"}\n");
+        if (info_callback) {
+            info_callback(line, info_callback_p);
+        } else {
+            fputs(line, stream);
+            fflush(stream);
+        }
+        return;
+    }
+
     if (info_callback) {
-        sprintf(p, "%s:%s: %s\n", get_app_name(), label, fmtbuf);
-        info_callback(p, info_callback_p);
+        snprintf(line, sizeof(line), "%s:%s: %s\n", get_app_name(), label, text);
+        info_callback(line, info_callback_p);
     } else {
         fprintf(stream, "%s:%s: ", get_app_name(), label);
-        sprintf(p, "%s\n", fmtbuf);
-        print_text_in_color(stream, p, color);
+        snprintf(line, sizeof(line), "%s\n", text);
+        print_text_in_color(stream, line, color);
+    }
+}
+
+/* False when |site| already wrote its share this second. */
+static bool dump_site_pass(struct dump_site *site, unsigned int *suppressed) {
+    uint64_t now;
+    *suppressed = 0;
+    if (site == NULL) {
+        return true;
+    }
+    now = (uint64_t)time(NULL);
+    if (site->window != now) {
+        *suppressed = site->suppressed;
+        site->window = now;
+        site->count = 0;
+        site->suppressed = 0;
+    }
+    if (++site->count > DUMP_SITE_BURST) {
+        site->suppressed++;
+        return false;
+    }
+    return true;
+}
+
+static struct dump_ring * dump_ring_of_thread(void) {
+    struct dump_ring *ring = dump_own_ring;
+    if (ring == NULL) {
+        ring = (struct dump_ring *) calloc(1, sizeof(*ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        do {
+            ring->next = dump_rings;
+        } while (!__sync_bool_compare_and_swap(&dump_rings, ring->next, ring));
+        dump_own_ring = ring;
+    }
+    return ring;
+}
+
+static void pr_do(dump_level level, struct dump_site *site, const char *fmt, va_list ap) {
+    char text[DUMP_LINE_MAX];
+    unsigned int suppressed = 0;
+    struct dump_ring *ring;
+    int len;
+
+    if (dump_site_pass(site, &suppressed) == false) {
+        return;
+    }
+    len = vsnprintf(text, sizeof(text), fmt, ap);
+    if (len < 0) {
+        return;
+    }
+    if (suppressed && (size_t)len < sizeof(text)) {
+        snprintf(text + len, sizeof(text) - (size_t)len, " (%u more suppressed)", suppressed);
+    }
+
+    if (__atomic_load_n(&dump_async, __ATOMIC_ACQUIRE) == false || (ring = dump_ring_of_thread()) == NULL) {
+        dump_write(level, (uint64_t)time(NULL), text);
+        return;
+    }
+    {
+        unsigned int head = ring->head;
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        struct dump_entry *entry;
+        if (head - tail >= DUMP_RING_SLOTS) {
+            __sync_fetch_and_add(&ring->dropped, 1);
+            return;
+        }
+        entry = &ring->entries[head & (DUMP_RING_SLOTS - 1)];
+        entry->level = level;
+        entry->time = (uint64_t)time(NULL);
+        memcpy(entry->text, text, sizeof(text));
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    uv_cond_signal(&dump_writer_cond);
+}
+
+/* Writes what the rings hold, returns how many were written. */
+static size_t dump_drain(void) {
+    struct dump_ring *ring;
+    size_t written = 0;
+    for (ring = __atomic_load_n(&dump_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        unsigned int tail = ring->tail;
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t dropped;
+        for (; tail != head; ++tail, ++written) {
+            const struct dump_entry *entry = &ring->entries[tail & (DUMP_RING_SLOTS - 1)];
+            dump_write(entry->level, entry->time, entry->text);
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+        if ((dropped = __sync_lock_test_and_set(&ring->dropped, 0)) != 0) {
+            char text[64];
+            snprintf(text, sizeof(text), "%llu messages dropped, the log queue was full", (unsigned long long)dropped);
+            dump_write(dump_level_warn, (uint64_t)time(NULL), text);
+            ++written;
+        }
+    }
+    return written;
+}
+
+static void dump_writer_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        int stopping = __atomic_load_n(&dump_stopping, __ATOMIC_ACQUIRE);
+        if (dump_drain() != 0) {
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+        uv_mutex_lock(&dump_writer_lock);
+        (void)uv_cond_timedwait(&dump_writer_cond, &dump_writer_lock, DUMP_WRITER_IDLE_NS);
+        uv_mutex_unlock(&dump_writer_lock);
+    }
+}
+
+void dump_info_start_async(void) {
+    if (dump_async) {
+        return;
+    }
+    if (uv_mutex_init(&dump_writer_lock) != 0) {
+        return;
+    }
+    if (uv_cond_init(&dump_writer_cond) != 0) {
+        uv_mutex_destroy(&dump_writer_lock);
+        return;
+    }
+    dump_stopping = 0;
+    if (uv_thread_create(&dump_writer, dump_writer_thread, NULL) != 0) {
+        uv_cond_destroy(&dump_writer_cond);
+        uv_mutex_destroy(&dump_writer_lock);
+        return;
+    }
+    __atomic_store_n(&dump_async, true, __ATOMIC_RELEASE);
+}
+
+void dump_info_stop_async(void) {
+    if (dump_async == false) {
+        return;
     }
-    free(p);
-    free(fmtbuf);
+    // Messages made from here on are written in place, the writer drains the rest.
+    __atomic_store_n(&dump_async, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&dump_stopping, 1, __ATOMIC_RELEASE);
+    uv_cond_signal(&dump_writer_cond);
+    uv_thread_join(&dump_writer);
+    uv_cond_destroy(&dump_writer_cond);
+    uv_mutex_destroy(&dump_writer_lock);
 }
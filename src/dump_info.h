@@ -1,18 +1,61 @@
 #if !defined(__dump_info_h__)
 #define __dump_info_h__ 1
 
+#include <stdbool.h>
+#include <stdint.h>
+
 void set_app_name(const char *name);
 const char *get_app_name(void);
 void set_dump_info_callback(void(*callback)(const char *info, void *p), void *p);
 
+/*
+ * From dump_info_start_async() on, messages are formatted by the caller
+ * into a ring of its thread and written by a background thread, so a loop
+ * never waits on stderr or a pipe. A ring that is full drops the message
+ * and the writer tells how many were dropped. A callback set is called
+ * on the writer then. Without it, messages are written where they are made.
+ */
+void dump_info_start_async(void);
+/* Once the threads that log are done, writes what is still queued and joins the writer. */
+void dump_info_stop_async(void);
+/* One JSON object per line, {"time":...,"app":...,"level":...,"message":...}. */
+void dump_info_set_json(bool json);
+
+#if !defined(DUMP_LEVEL_MIN)
+#define DUMP_LEVEL_MIN 0  /* 0 info, 1 warn, 2 error. Calls below it are compiled out. */
+#endif
+
+#define DUMP_SITE_BURST 10  /* Messages a pr_warn or pr_err call writes per second, the rest are counted. */
+
+/* The rate limit of one pr_warn or pr_err call. Updated without locks,
+ * threads sharing a site may miscount a little. */
+struct dump_site {
+    uint64_t window;  /* time() of the second being counted. */
+    unsigned int count;
+    unsigned int suppressed;
+};
+
 #if defined(__GNUC__)
 # define ATTRIBUTE_FORMAT_PRINTF(a, b) __attribute__((format(printf, a, b)))
 #else
 # define ATTRIBUTE_FORMAT_PRINTF(a, b)
 #endif
 void pr_info(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
-void pr_warn(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
-void pr_err(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
+/* |site| may be NULL for no rate limit. */
+void pr_warn_at(struct dump_site *site, const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(2, 3);
+void pr_err_at(struct dump_site *site, const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(2, 3);
+
+#if DUMP_LEVEL_MIN > 0
+#define pr_info(...) do { if (0) { pr_info(__VA_ARGS__); } } while (0)
+#endif
+
+#if DUMP_LEVEL_MIN > 1
+#define pr_warn(...) do { if (0) { pr_warn_at(NULL, __VA_ARGS__); } } while (0)
+#else
+#define pr_warn(...) do { static struct dump_site _dump_site; pr_warn_at(&_dump_site, __VA_ARGS__); } while (0)
+#endif
+
+#define pr_err(...) do { static struct dump_site _dump_site; pr_err_at(&_dump_site, __VA_ARGS__); } while (0)
 
 #if !defined(NDEBUG)
 #define PRINT_INFO(format, ...) \
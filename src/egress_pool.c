@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <uv.h>
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif // !defined(_WIN32)
+#include "egress_pool.h"
+#include "dump_info.h"
+
+#if !defined(IFNAMSIZ)
+#define IFNAMSIZ 16
+#endif
+
+struct egress_entry {
+    int family;  /* AF_UNSPEC for an interface. */
+    union sockaddr_universal addr;
+    char ifname[IFNAMSIZ];
+};
+
+struct egress_pool {
+    enum egress_policy policy;
+    struct egress_entry entries[EGRESS_POOL_MAX];
+    size_t count;
+    size_t v4[EGRESS_POOL_MAX];  /* Of |entries|, what an IPv4 destination can take, */
+    size_t v4_count;
+    size_t v6[EGRESS_POOL_MAX];  /* and an IPv6 one. */
+    size_t v6_count;
+    uint32_t turns[EGRESS_POOL_SLOTS];
+};
+
+static bool egress_entry_parse(const char *text, struct egress_entry *entry) {
+    memset(entry, 0, sizeof(*entry));
+    if (uv_ip4_addr(text, 0, &entry->addr.addr4) == 0) {
+        entry->family = AF_INET;
+        return true;
+    }
+    if (uv_ip6_addr(text, 0, &entry->addr.addr6) == 0) {
+        entry->family = AF_INET6;
+        return true;
+    }
+#if defined(SO_BINDTODEVICE)
+    if (strlen(text) < IFNAMSIZ) {
+        entry->family = AF_UNSPEC;
+        strcpy(entry->ifname, text);
+        return true;
+    }
+#endif // defined(SO_BINDTODEVICE)
+    return false;
+}
+
+/* An address the host doesn't have would fail every connect, it's dropped up front. */
+static bool egress_entry_usable(const struct egress_entry *entry) {
+#if !defined(_WIN32)
+    int fd, error;
+    if (entry->family == AF_UNSPEC) {
+        return if_nametoindex(entry->ifname) != 0;
+    }
+    if ((fd = socket(entry->family, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        return false;
+    }
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+    {
+        int on = 1;
+        (void)setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+    }
+#endif // defined(IP_BIND_ADDRESS_NO_PORT)
+    error = bind(fd, &entry->addr.addr, (entry->family == AF_INET6) ? sizeof(entry->addr.addr6) : sizeof(entry->addr.addr4));
+    close(fd);
+    return error == 0;
+#else
+    (void)entry;
+    return true;
+#endif // !defined(_WIN32)
+}
+
+struct egress_pool * egress_pool_create(const char *addresses, enum egress_policy policy) {
+    struct egress_pool *pool;
+    char *list, *token, *saveptr = NULL;
+
+    if (addresses == NULL || addresses[0] == '\0') {
+        return NULL;
+    }
+    pool = (struct egress_pool *) calloc(1, sizeof(*pool));
+    pool->policy = policy;
+    list = strdup(addresses);
+    for (token = strtok_r(list, ", \t", &saveptr); token; token = strtok_r(NULL, ", \t", &saveptr)) {
+        struct egress_entry *entry = &pool->entries[pool->count];
+        if (pool->count == EGRESS_POOL_MAX) {
+            pr_warn("egress addresses past the first %d ignored", EGRESS_POOL_MAX);
+            break;
+        }
+        if (egress_entry_parse(token, entry) == false) {
+            pr_warn("egress address \"%s\" is neither an address nor an interface", token);
+            continue;
+        }
+        if (egress_entry_usable(entry) == false) {
+            pr_warn("egress address \"%s\" is not on this host", token);
+            continue;
+        }
+        if (entry->family != AF_INET6) {
+            pool->v4[pool->v4_count++] = pool->count;
+        }
+        if (entry->family != AF_INET) {
+            pool->v6[pool->v6_count++] = pool->count;
+        }
+        pool->count++;
+    }
+    free(list);
+    if (pool->count == 0) {
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void egress_pool_destroy(struct egress_pool *pool) {
+    free(pool);
+}
+
+size_t egress_pool_count(const struct egress_pool *pool) {
+    return pool ? pool->count : 0;
+}
+
+/* FNV-1a of the destination's address, its port left out so a site's
+ * ports share one turn or one entry. */
+static uint32_t egress_dest_hash(const union sockaddr_universal *dest) {
+    const uint8_t *data;
+    size_t size, index;
+    uint32_t hash = 2166136261u;
+
+    if (dest->addr.sa_family == AF_INET6) {
+        data = (const uint8_t *)&dest->addr6.sin6_addr;
+        size = sizeof(dest->addr6.sin6_addr);
+    } else {
+        data = (const uint8_t *)&dest->addr4.sin_addr;
+        size = sizeof(dest->addr4.sin_addr);
+    }
+    for (index = 0; index < size; ++index) {
+        hash = (hash ^ data[index]) * 16777619u;
+    }
+    return hash;
+}
+
+int egress_pool_bind(struct egress_pool *pool, int fd, const union sockaddr_universal *dest) {
+#if !defined(_WIN32)
+    const size_t *candidates = pool->v4;
+    size_t count = pool->v4_count;
+    const struct egress_entry *entry;
+    uint32_t hash;
+
+    if (dest->addr.sa_family == AF_INET6) {
+        candidates = pool->v6;
+        count = pool->v6_count;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    hash = egress_dest_hash(dest);
+    if (pool->policy == egress_policy_hash) {
+        entry = &pool->entries[candidates[hash % count]];
+    } else {
+        entry = &pool->entries[candidates[pool->turns[hash % EGRESS_POOL_SLOTS]++ % count]];
+    }
+
+    if (entry->family == AF_UNSPEC) {
+#if defined(SO_BINDTODEVICE)
+        if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, entry->ifname, (socklen_t)strlen(entry->ifname)) != 0) {
+            return -errno;
+        }
+#endif // defined(SO_BINDTODEVICE)
+        return 0;
+    }
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+    {
+        // Without it bind() reserves the port for every destination, capping the address at the ephemeral range.
+        int on = 1;
+        (void)setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+    }
+#endif // defined(IP_BIND_ADDRESS_NO_PORT)
+    if (bind(fd, &entry->addr.addr, (entry->family == AF_INET6) ? sizeof(entry->addr.addr6) : sizeof(entry->addr.addr4)) != 0) {
+        return -errno;
+    }
+#else
+    (void)pool; (void)fd; (void)dest;
+#endif // !defined(_WIN32)
+    return 0;
+}
@@ -0,0 +1,39 @@
+#if !defined(__egress_pool_h__)
+#define __egress_pool_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "sockaddr_universal.h"
+
+/*
+ * ssr-server's source addresses for its outgoing connections, the
+ * egress_addresses of the config. One exit address reaches a destination
+ * from some 28k ephemeral ports at most, and popular destinations rate
+ * limit per address, so a busy server spreads its connections over
+ * several. round_robin hands the connections to one destination the
+ * addresses in turn, hash keeps each destination on one address, for
+ * sites that tie a session to it. An entry that isn't an address names an
+ * interface, bound with SO_BINDTODEVICE for either family. With
+ * IP_BIND_ADDRESS_NO_PORT the port is picked at connect(), per 4-tuple,
+ * instead of at bind(), per address. Not thread safe: one per uv_loop_t.
+ */
+
+#define EGRESS_POOL_MAX    64
+#define EGRESS_POOL_SLOTS  1024  /* Round robin counters, destinations sharing one only share the turn. */
+
+enum egress_policy {
+    egress_policy_round_robin,
+    egress_policy_hash,
+};
+
+struct egress_pool;
+
+/* From |addresses|, comma separated. NULL without a usable entry. */
+struct egress_pool * egress_pool_create(const char *addresses, enum egress_policy policy);
+void egress_pool_destroy(struct egress_pool *pool);
+size_t egress_pool_count(const struct egress_pool *pool);
+/* Binds |fd|, a TCP socket not connected yet, to the entry for |dest|.
+ * 0 when it was bound or nothing fits |dest|'s family, else -errno. */
+int egress_pool_bind(struct egress_pool *pool, int fd, const union sockaddr_universal *dest);
+
+#endif // !defined(__egress_pool_h__)
@@ -22,6 +22,9 @@
 
 #include <stdint.h>
 #include <ctype.h>
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -35,6 +38,7 @@
 typedef EVP_CIPHER cipher_core_t;
 typedef EVP_CIPHER_CTX cipher_core_ctx_t;
 typedef EVP_MD digest_type_t;
+typedef EVP_CIPHER_CTX aead_core_ctx_t;
 #define MAX_KEY_LENGTH EVP_MAX_KEY_LENGTH
 #define MAX_IV_LENGTH EVP_MAX_IV_LENGTH
 #define MAX_MD_SIZE EVP_MAX_MD_SIZE
@@ -63,9 +67,11 @@ typedef EVP_MD digest_type_t;
 
 #include <mbedtls/cipher.h>
 #include <mbedtls/md.h>
+#include <mbedtls/gcm.h>
 typedef mbedtls_cipher_info_t cipher_core_t;
 typedef mbedtls_cipher_context_t cipher_core_ctx_t;
 typedef mbedtls_md_info_t digest_type_t;
+typedef mbedtls_gcm_context aead_core_ctx_t;
 #define MAX_KEY_LENGTH 64
 #define MAX_IV_LENGTH MBEDTLS_MAX_IV_LENGTH
 #define MAX_MD_SIZE MBEDTLS_MD_MAX_SIZE
@@ -83,13 +89,23 @@ typedef mbedtls_md_info_t digest_type_t;
 #include <arpa/inet.h>
 #endif
 
-#include "cache.h"
+#include "cpu_features.h"
 #include "encrypt.h"
+#include "ppbloom.h"
 #include "ssrutils.h"
 #include "ssrbuffer.h"
 
 #define OFFSET_ROL(p, o) ((uint64_t)(*(p + o)) << (8 * o))
 
+/* Released contexts kept keyed per direction, so a new one only sets the IV. */
+#define CIPHER_KEYED_POOL_SIZE 32
+
+#if defined(USE_CRYPTO_OPENSSL)
+typedef MD5_CTX key_md5_state_t;
+#elif defined(USE_CRYPTO_MBEDTLS)
+typedef mbedtls_md5_context key_md5_state_t;
+#endif
+
 struct cipher_env_t {
     uint8_t *enc_table;
     uint8_t *dec_table;
@@ -97,7 +113,12 @@ struct cipher_env_t {
     int enc_key_len;
     int enc_iv_len;
     enum ss_cipher_type enc_method;
-    struct cache *iv_cache;
+    struct ppbloom *iv_filter; /* Replay filter, created on first use unless set. */
+    bool iv_filter_off;        /* The protocol plugin detects replays itself. */
+    cipher_core_ctx_t *keyed_pool[2][CIPHER_KEYED_POOL_SIZE]; /* [encrypt] */
+    size_t keyed_count[2];
+    cipher_core_ctx_t *keyed_template[2]; /* [encrypt], copied when the pool is empty. */
+    key_md5_state_t key_md5;              /* enc_key absorbed, rc4-md5 methods only. */
 };
 
 struct cipher_wrapper {
@@ -106,15 +127,35 @@ struct cipher_wrapper {
     size_t key_len;
 };
 
+struct rc4_state {
+    uint8_t s[256];
+    uint8_t i, j;
+};
+
 struct cipher_ctx_t {
     cipher_core_ctx_t *core_ctx;
     uint8_t iv[MAX_IV_LENGTH];
+    bool encrypt;
+    bool keyed; /* Key schedule installed, set_iv only replaces the IV. */
+    bool rc4;   /* rc4 family, runs on rc4_state instead of core_ctx. */
+    struct rc4_state rc4_state;
+};
+
+struct aead_ctx_t {
+    uint8_t salt[AEAD_MAX_SALT_LENGTH];
+    uint8_t subkey[MAX_KEY_LENGTH];
+    uint8_t nonce[AEAD_MAX_NONCE_LENGTH]; /* Little endian, bumped after every seal/open. */
+    aead_core_ctx_t *gcm;                 /* Keyed with subkey, GCM methods only. */
+    struct buffer_t *pending;             /* Ciphertext short of a whole chunk. */
+    size_t chunk_len;                     /* Payload length read for the next chunk, 0 if none yet. */
 };
 
 struct enc_ctx {
     uint8_t init;
     uint64_t counter;
     struct cipher_ctx_t cipher_ctx;
+    uint8_t stream[SODIUM_BLOCK_SIZE]; /* Keystream of the block counter is in. */
+    struct aead_ctx_t *aead;           /* AEAD methods only. */
 };
 
 #ifdef USE_CRYPTO_MBEDTLS
@@ -143,6 +184,10 @@ struct enc_ctx {
     V(ss_cipher_salsa20,            "salsa20"               )   \
     V(ss_cipher_chacha20,           "chacha20"              )   \
     V(ss_cipher_chacha20ietf,       "chacha20-ietf"         )   \
+    V(ss_cipher_aes_128_gcm,        "AES-128-GCM"           )   \
+    V(ss_cipher_aes_256_gcm,        "AES-256-GCM"           )   \
+    V(ss_cipher_chacha20ietf_poly1305,  "chacha20-ietf-poly1305"    )   \
+    V(ss_cipher_xchacha20ietf_poly1305, "xchacha20-ietf-poly1305"   )   \
 
 static const char *
 ss_mbedtls_cipher_name_by_type(enum ss_cipher_type index)
@@ -173,8 +218,47 @@ void dump(const char *tag, const uint8_t *text, size_t len) {
     printf("\n");
 }
 
+/*
+ * Both backends select their AES and SHA1 code paths from CPUID / HWCAP
+ * themselves; these report which one this CPU ends up on.
+ */
+const char * ss_crypto_aes_kernel(void) {
+    unsigned int features = cpu_features();
+    if ((features & cpu_feature_aes) == 0) {
+        return "generic";
+    }
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(USE_CRYPTO_MBEDTLS) && !defined(MBEDTLS_AESNI_C)
+    return "generic";
+#else
+    return "aes-ni";
+#endif
+#elif defined(__aarch64__)
+#if defined(USE_CRYPTO_MBEDTLS) && !defined(MBEDTLS_AESCE_C)
+    return "generic";
+#else
+    return "armv8";
+#endif
+#else
+    return "generic";
+#endif
+}
+
+const char * ss_crypto_sha1_kernel(void) {
+#if defined(USE_CRYPTO_OPENSSL)
+    if (cpu_features() & cpu_feature_sha1) {
+#if defined(__aarch64__)
+        return "armv8";
+#else
+        return "sha-ni";
+#endif
+    }
+#endif
+    return "generic"; // mbed TLS has no accelerated SHA1.
+}
+
 size_t ss_max_iv_length(void) {
-    return MAX_IV_LENGTH;
+    return max(MAX_IV_LENGTH, AEAD_MAX_SALT_LENGTH);
 }
 
 size_t ss_max_key_length(void) {
@@ -454,8 +538,81 @@ bytes_to_key(const struct cipher_wrapper *cipher, const digest_type_t *md,
 #endif
 }
 
+/*
+ * Per-thread ChaCha20 pool seeded from the OS. Every refill rekeys from
+ * the first block of its own output and served bytes are wiped, so the
+ * pool never reveals what it handed out. Large requests bypass it.
+ */
+#define RAND_POOL_SIZE   4096
+#define RAND_POOL_DIRECT 512
+
+struct rand_pool {
+    uint8_t key[crypto_stream_chacha20_KEYBYTES];
+    uint8_t bytes[RAND_POOL_SIZE];
+    size_t left;
+    unsigned int generation;
+};
+
+static SS_THREAD_LOCAL struct rand_pool rand_pool;
+static unsigned int rand_pool_generation = 1; /* Bumped in forked children. */
+
+#if !defined(_WIN32)
+static void
+rand_pool_atfork_child(void)
+{
+    rand_pool_generation++;
+}
+
+static void
+rand_pool_register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, rand_pool_atfork_child);
+}
+#endif
+
+static void
+rand_pool_refill(struct rand_pool *pool)
+{
+    static const uint8_t nonce[crypto_stream_chacha20_NONCEBYTES] = { 0 };
+
+    if (pool->generation != rand_pool_generation) {
+#if !defined(_WIN32)
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once(&once, rand_pool_register_atfork);
+#endif
+        randombytes_buf(pool->key, sizeof(pool->key));
+        pool->generation = rand_pool_generation;
+    }
+    crypto_stream_chacha20(pool->bytes, sizeof(pool->bytes), nonce, pool->key);
+    memcpy(pool->key, pool->bytes, sizeof(pool->key));
+    sodium_memzero(pool->bytes, sizeof(pool->key));
+    pool->left = sizeof(pool->bytes) - sizeof(pool->key);
+}
+
 void rand_bytes(uint8_t *output, size_t len) {
-    randombytes_buf(output, (size_t)len);
+    struct rand_pool *pool = &rand_pool;
+
+    if (len > RAND_POOL_DIRECT) {
+        randombytes_buf(output, len);
+        return;
+    }
+    if (pool->generation != rand_pool_generation) {
+        pool->left = 0;
+    }
+    while (len > 0) {
+        uint8_t *from;
+        size_t n;
+        if (pool->left == 0) {
+            rand_pool_refill(pool);
+        }
+        n = min(len, pool->left);
+        from = pool->bytes + sizeof(pool->bytes) - pool->left;
+        memcpy(output, from, n);
+        sodium_memzero(from, n);
+        pool->left -= n;
+        output += n;
+        len -= n;
+    }
 }
 
 int rand_integer(void) {
@@ -507,6 +664,77 @@ get_digest_type(const char *digest)
 #endif
 }
 
+/*
+ * RC4 is done here rather than in the crypto library: OpenSSL 3 only has
+ * it in the legacy provider and mbed TLS 3 dropped it altogether.
+ */
+static bool
+cipher_is_rc4(enum ss_cipher_type method)
+{
+    return (method >= ss_cipher_rc4 && method <= ss_cipher_rc4_md5);
+}
+
+static void
+rc4_setup(struct rc4_state *state, const uint8_t *key, size_t key_len)
+{
+    uint8_t *s = state->s;
+    uint8_t j = 0, t;
+    size_t i;
+
+    for (i = 0; i < 256; ++i) {
+        s[i] = (uint8_t)i;
+    }
+    for (i = 0; i < 256; ++i) {
+        j = (uint8_t)(j + s[i] + key[i % key_len]);
+        t = s[i];
+        s[i] = s[j];
+        s[j] = t;
+    }
+    state->i = 0;
+    state->j = 0;
+}
+
+#define RC4_STEP(k)                                \
+    do {                                           \
+        i = (uint8_t)(i + 1);                      \
+        a = s[i];                                  \
+        j = (uint8_t)(j + a);                      \
+        b = s[j];                                  \
+        s[i] = b;                                  \
+        s[j] = a;                                  \
+        output[k] = input[k] ^ s[(uint8_t)(a + b)]; \
+    } while (0)
+
+/* Keeps i and j in registers and runs four bytes per iteration. */
+static void
+rc4_crypt(struct rc4_state *state, uint8_t *output, const uint8_t *input, size_t len)
+{
+    uint8_t *s = state->s;
+    uint8_t i = state->i, j = state->j, a, b;
+
+    for (; len >= 4; len -= 4, input += 4, output += 4) {
+        RC4_STEP(0);
+        RC4_STEP(1);
+        RC4_STEP(2);
+        RC4_STEP(3);
+    }
+    for (; len > 0; --len, ++input, ++output) {
+        RC4_STEP(0);
+    }
+    state->i = i;
+    state->j = j;
+}
+
+#undef RC4_STEP
+
+/* The key of rc4 and rc4-md5 carries the stream state or depends on the IV,
+ * so only the block cipher modes can be kept keyed between uses. */
+static bool
+cipher_context_reusable(enum ss_cipher_type method)
+{
+    return (method > ss_cipher_rc4_md5 && method < ss_cipher_salsa20);
+}
+
 void
 cipher_context_init(struct cipher_env_t *env, struct cipher_ctx_t *ctx, bool encrypt)
 {
@@ -514,12 +742,38 @@ cipher_context_init(struct cipher_env_t *env, struct cipher_ctx_t *ctx, bool enc
     const char *cipherName;
     cipher_core_ctx_t *core_ctx;
     enum ss_cipher_type method = env->enc_method;
+    size_t *count = &env->keyed_count[encrypt ? 1 : 0];
 
+    ctx->encrypt = encrypt;
+    ctx->keyed = false;
+    ctx->rc4 = cipher_is_rc4(method);
+
+    if (ctx->rc4) {
+        ctx->core_ctx = NULL;
+        return;
+    }
     if (method >= ss_cipher_salsa20) {
 //        enc_iv_len = ss_cipher_iv_size(method);
         return;
     }
 
+    if (*count > 0) {
+        ctx->core_ctx = env->keyed_pool[encrypt ? 1 : 0][--(*count)];
+        ctx->keyed = true;
+        return;
+    }
+#if defined(USE_CRYPTO_OPENSSL)
+    if (env->keyed_template[encrypt ? 1 : 0] != NULL) {
+        ctx->core_ctx = EVP_CIPHER_CTX_new();
+        if (ctx->core_ctx == NULL
+            || !EVP_CIPHER_CTX_copy(ctx->core_ctx, env->keyed_template[encrypt ? 1 : 0])) {
+            FATAL("Cannot copy cipher context");
+        }
+        ctx->keyed = true;
+        return;
+    }
+#endif
+
     cipherName = ss_cipher_name_of_type(method);
     if (cipherName == NULL) {
         return;
@@ -568,6 +822,7 @@ cipher_context_set_iv(struct cipher_env_t *env, struct cipher_ctx_t *ctx, uint8_
                       int enc)
 {
     const unsigned char *true_key;
+    unsigned char rc4_key[MD5_BYTES];
     cipher_core_ctx_t *core_ctx;
 
     if (iv == NULL) {
@@ -584,26 +839,38 @@ cipher_context_set_iv(struct cipher_env_t *env, struct cipher_ctx_t *ctx, uint8_
     }
 
     if (env->enc_method == ss_cipher_rc4_md5 || env->enc_method == ss_cipher_rc4_md5_6) {
-        unsigned char key_iv[32];
-        memcpy(key_iv, env->enc_key, 16);
-        memcpy(key_iv + 16, iv, iv_len);
-        true_key = enc_md5(key_iv, 16 + iv_len, NULL);
+        key_md5_state_t md5 = env->key_md5;
+#if defined(USE_CRYPTO_OPENSSL)
+        MD5_Update(&md5, iv, iv_len);
+        MD5_Final(rc4_key, &md5);
+#elif defined(USE_CRYPTO_MBEDTLS)
+        mbedtls_md5_update_ret(&md5, iv, iv_len);
+        mbedtls_md5_finish_ret(&md5, rc4_key);
+#endif
+        true_key = rc4_key;
         iv_len   = 0;
     } else {
         true_key = env->enc_key;
     }
+    if (ctx->rc4) {
+        rc4_setup(&ctx->rc4_state, true_key, (size_t)env->enc_key_len);
+        return;
+    }
     core_ctx = ctx->core_ctx;
     if (core_ctx == NULL) {
         LOGE("cipher_context_set_iv(): Cipher context is null");
         return;
     }
+    if (ctx->keyed) {
+        true_key = NULL;
+    }
 #if defined(USE_CRYPTO_OPENSSL)
     if (!EVP_CipherInit_ex(core_ctx, NULL, NULL, true_key, iv, enc)) {
         EVP_CIPHER_CTX_cleanup(core_ctx);
         FATAL("Cannot set key and IV");
     }
 #elif defined(USE_CRYPTO_MBEDTLS)
-    if (mbedtls_cipher_setkey(core_ctx, true_key, env->enc_key_len * 8, enc) != 0) {
+    if (true_key != NULL && mbedtls_cipher_setkey(core_ctx, true_key, env->enc_key_len * 8, enc) != 0) {
         mbedtls_cipher_free(core_ctx);
         FATAL("Cannot set mbed TLS cipher key");
     }
@@ -617,24 +884,53 @@ cipher_context_set_iv(struct cipher_env_t *env, struct cipher_ctx_t *ctx, uint8_
         FATAL("Cannot finalize mbed TLS cipher context");
     }
 #endif
+    ctx->keyed = cipher_context_reusable(env->enc_method);
+#if defined(USE_CRYPTO_OPENSSL)
+    if (ctx->keyed && env->keyed_template[enc ? 1 : 0] == NULL) {
+        cipher_core_ctx_t *template = EVP_CIPHER_CTX_new();
+        if (template != NULL && !EVP_CIPHER_CTX_copy(template, core_ctx)) {
+            EVP_CIPHER_CTX_free(template);
+            template = NULL;
+        }
+        env->keyed_template[enc ? 1 : 0] = template;
+    }
+#endif
 
 #ifdef SHOW_DUMP
     dump("IV", (char *)iv, (int)iv_len);
 #endif
 }
 
+static void
+cipher_core_ctx_free(cipher_core_ctx_t *core_ctx)
+{
+#if defined(USE_CRYPTO_OPENSSL)
+    EVP_CIPHER_CTX_free(core_ctx);
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_cipher_free(core_ctx);
+    free(core_ctx);
+#endif
+}
+
 void
 cipher_context_release(struct cipher_env_t *env, struct cipher_ctx_t *ctx)
 {
+    size_t *count = &env->keyed_count[ctx->encrypt ? 1 : 0];
+
+    if (ctx->rc4) {
+        sodium_memzero(&ctx->rc4_state, sizeof(ctx->rc4_state));
+        return;
+    }
     if (env->enc_method >= ss_cipher_salsa20) {
         return;
     }
-#if defined(USE_CRYPTO_OPENSSL)
-    EVP_CIPHER_CTX_free(ctx->core_ctx);
-#elif defined(USE_CRYPTO_MBEDTLS)
-    mbedtls_cipher_free(ctx->core_ctx);
-    safe_free(ctx->core_ctx);
-#endif
+    if (ctx->keyed && ctx->core_ctx && *count < CIPHER_KEYED_POOL_SIZE) {
+        env->keyed_pool[ctx->encrypt ? 1 : 0][(*count)++] = ctx->core_ctx;
+        ctx->core_ctx = NULL;
+        return;
+    }
+    cipher_core_ctx_free(ctx->core_ctx);
+    ctx->core_ctx = NULL;
 }
 
 static int
@@ -642,6 +938,11 @@ cipher_context_update(struct cipher_ctx_t *ctx, uint8_t *output, size_t *olen,
                       const uint8_t *input, size_t ilen)
 {
     cipher_core_ctx_t *core_ctx = ctx->core_ctx;
+    if (ctx->rc4) {
+        rc4_crypt(&ctx->rc4_state, output, input, ilen);
+        *olen = ilen;
+        return 1;
+    }
 #if defined(USE_CRYPTO_OPENSSL)
     int err = 0, tlen = (int)*olen;
     err = EVP_CipherUpdate(core_ctx, (unsigned char *)output, &tlen,
@@ -710,6 +1011,153 @@ ss_sha1_hash_func(uint8_t *auth, const uint8_t *msg, size_t msg_len)
     return 0;
 }
 
+#define HMAC_BLOCK_SIZE 64   /* MD5 and SHA1 alike. */
+
+#if defined(USE_CRYPTO_OPENSSL)
+union hmac_digest_state {
+    MD5_CTX md5;
+    SHA_CTX sha1;
+};
+#endif
+
+/*
+ * HMAC with the ipad/opad blocks of the last key already hashed in. The
+ * auth_* protocols keep one per connection; a MAC under a key that did
+ * not change since the previous call only hashes the message and the
+ * inner digest.
+ */
+struct ss_hmac_ctx {
+    enum ss_hmac_digest digest;
+    size_t key_len;
+    uint8_t key[HMAC_BLOCK_SIZE];
+    bool keyed;
+#if defined(USE_CRYPTO_OPENSSL)
+    union hmac_digest_state inner, outer;
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_md_context_t inner, outer, work;
+#endif
+};
+
+static size_t
+hmac_digest_size(enum ss_hmac_digest digest)
+{
+    return (digest == ss_hmac_sha1) ? SHA1_BYTES : MD5_BYTES;
+}
+
+struct ss_hmac_ctx *
+ss_hmac_ctx_create(enum ss_hmac_digest digest)
+{
+    struct ss_hmac_ctx *ctx = (struct ss_hmac_ctx *)calloc(1, sizeof(*ctx));
+    ctx->digest = digest;
+#if defined(USE_CRYPTO_MBEDTLS)
+    {
+        const mbedtls_md_info_t *info = mbedtls_md_info_from_type((digest == ss_hmac_sha1) ? MBEDTLS_MD_SHA1 : MBEDTLS_MD_MD5);
+        mbedtls_md_init(&ctx->inner);
+        mbedtls_md_init(&ctx->outer);
+        mbedtls_md_init(&ctx->work);
+        if (mbedtls_md_setup(&ctx->inner, info, 0) || mbedtls_md_setup(&ctx->outer, info, 0)
+            || mbedtls_md_setup(&ctx->work, info, 0)) {
+            FATAL("Cannot initialize mbed TLS digest");
+        }
+    }
+#endif
+    return ctx;
+}
+
+void
+ss_hmac_ctx_destroy(struct ss_hmac_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+#if defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_md_free(&ctx->inner);
+    mbedtls_md_free(&ctx->outer);
+    mbedtls_md_free(&ctx->work);
+#endif
+    sodium_memzero(ctx, sizeof(*ctx));
+    free(ctx);
+}
+
+static void
+hmac_ctx_set_key(struct ss_hmac_ctx *ctx, const struct buffer_t *key)
+{
+    uint8_t ipad[HMAC_BLOCK_SIZE], opad[HMAC_BLOCK_SIZE];
+    size_t i;
+
+    memcpy(ctx->key, key->buffer, key->len);
+    ctx->key_len = key->len;
+    memset(ipad, 0x36, sizeof(ipad));
+    memset(opad, 0x5c, sizeof(opad));
+    for (i = 0; i < key->len; ++i) {
+        ipad[i] ^= key->buffer[i];
+        opad[i] ^= key->buffer[i];
+    }
+#if defined(USE_CRYPTO_OPENSSL)
+    if (ctx->digest == ss_hmac_sha1) {
+        SHA1_Init(&ctx->inner.sha1);
+        SHA1_Update(&ctx->inner.sha1, ipad, sizeof(ipad));
+        SHA1_Init(&ctx->outer.sha1);
+        SHA1_Update(&ctx->outer.sha1, opad, sizeof(opad));
+    } else {
+        MD5_Init(&ctx->inner.md5);
+        MD5_Update(&ctx->inner.md5, ipad, sizeof(ipad));
+        MD5_Init(&ctx->outer.md5);
+        MD5_Update(&ctx->outer.md5, opad, sizeof(opad));
+    }
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_md_starts(&ctx->inner);
+    mbedtls_md_update(&ctx->inner, ipad, sizeof(ipad));
+    mbedtls_md_starts(&ctx->outer);
+    mbedtls_md_update(&ctx->outer, opad, sizeof(opad));
+#endif
+    sodium_memzero(ipad, sizeof(ipad));
+    sodium_memzero(opad, sizeof(opad));
+    ctx->keyed = true;
+}
+
+size_t
+ss_hmac_ctx_compute(struct ss_hmac_ctx *ctx, uint8_t *auth, const struct buffer_t *msg, const struct buffer_t *key)
+{
+    uint8_t inner[SHA1_BYTES];
+    size_t size = hmac_digest_size(ctx->digest);
+
+    if (key->len > HMAC_BLOCK_SIZE) {
+        // Never the case for the protocol keys, hand it to the one-shot path.
+        return (ctx->digest == ss_hmac_sha1) ? ss_sha1_hmac_with_key(auth, msg, key)
+                                             : ss_md5_hmac_with_key(auth, msg, key);
+    }
+    if (!ctx->keyed || ctx->key_len != key->len || memcmp(ctx->key, key->buffer, key->len) != 0) {
+        hmac_ctx_set_key(ctx, key);
+    }
+#if defined(USE_CRYPTO_OPENSSL)
+    if (ctx->digest == ss_hmac_sha1) {
+        SHA_CTX work = ctx->inner.sha1;
+        SHA1_Update(&work, msg->buffer, msg->len);
+        SHA1_Final(inner, &work);
+        work = ctx->outer.sha1;
+        SHA1_Update(&work, inner, size);
+        SHA1_Final(inner, &work);
+    } else {
+        MD5_CTX work = ctx->inner.md5;
+        MD5_Update(&work, msg->buffer, msg->len);
+        MD5_Final(inner, &work);
+        work = ctx->outer.md5;
+        MD5_Update(&work, inner, size);
+        MD5_Final(inner, &work);
+    }
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_md_clone(&ctx->work, &ctx->inner);
+    mbedtls_md_update(&ctx->work, msg->buffer, msg->len);
+    mbedtls_md_finish(&ctx->work, inner);
+    mbedtls_md_clone(&ctx->work, &ctx->outer);
+    mbedtls_md_update(&ctx->work, inner, size);
+    mbedtls_md_finish(&ctx->work, inner);
+#endif
+    memcpy(auth, inner, size);
+    return 0;
+}
+
 size_t ss_aes_128_cbc_encrypt(size_t length, const uint8_t *plain_text, uint8_t *out_data, const uint8_t key[16])
 {
     unsigned char iv[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
@@ -743,10 +1191,543 @@ size_t ss_aes_128_cbc_decrypt(size_t length, const uint8_t *cipher_text, uint8_t
     return 0;
 }
 
+struct ss_aes_128_ctx {
+    bool encrypt;
+#if defined(USE_CRYPTO_OPENSSL)
+    AES_KEY aes;
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_aes_context aes;
+#endif
+};
+
+struct ss_aes_128_ctx *
+ss_aes_128_ctx_create(const uint8_t key[16], bool encrypt)
+{
+    struct ss_aes_128_ctx *ctx = (struct ss_aes_128_ctx *)calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->encrypt = encrypt;
+#if defined(USE_CRYPTO_OPENSSL)
+    if (encrypt) {
+        AES_set_encrypt_key(key, 128, &ctx->aes);
+    } else {
+        AES_set_decrypt_key(key, 128, &ctx->aes);
+    }
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_aes_init(&ctx->aes);
+    if (encrypt) {
+        mbedtls_aes_setkey_enc(&ctx->aes, key, 128);
+    } else {
+        mbedtls_aes_setkey_dec(&ctx->aes, key, 128);
+    }
+#endif
+    return ctx;
+}
+
+void
+ss_aes_128_ctx_destroy(struct ss_aes_128_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+#if defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_aes_free(&ctx->aes);
+#endif
+    sodium_memzero(ctx, sizeof(*ctx));
+    free(ctx);
+}
+
+size_t
+ss_aes_128_ctx_cbc(struct ss_aes_128_ctx *ctx, size_t length, const uint8_t *in_data, uint8_t *out_data)
+{
+    unsigned char iv[16] = { 0 };
+
+#if defined(USE_CRYPTO_OPENSSL)
+    AES_cbc_encrypt(in_data, out_data, length, &ctx->aes, iv, ctx->encrypt ? AES_ENCRYPT : AES_DECRYPT);
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_aes_crypt_cbc(&ctx->aes, ctx->encrypt ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT, length, iv, in_data, out_data);
+#endif
+    return 0;
+}
+
+/*
+ * AEAD methods, framed as in shadowsocks: the stream starts with a random
+ * salt, the subkey is HKDF-SHA1(key, salt, "ss-subkey"), and every chunk is
+ * [sealed 2-byte payload length][sealed payload], each with its own tag.
+ * A datagram is [salt][sealed payload] under a zero nonce.
+ */
+bool
+cipher_is_aead(enum ss_cipher_type method)
+{
+    return (method >= ss_cipher_aes_128_gcm && method < ss_cipher_max);
+}
+
+static size_t
+aead_nonce_length(enum ss_cipher_type method)
+{
+    return (method == ss_cipher_xchacha20ietf_poly1305) ? 24 : 12;
+}
+
+static void
+aead_hkdf_sha1(const uint8_t *salt, size_t salt_len, const uint8_t *ikm, size_t ikm_len,
+               uint8_t *okm, size_t okm_len)
+{
+    static const char info[] = "ss-subkey";
+    uint8_t prk[SHA1_BYTES];
+    uint8_t block[SHA1_BYTES + sizeof(info)];
+    uint8_t t[SHA1_BYTES];
+    size_t t_len = 0, done = 0;
+    uint8_t counter = 1;
+
+    BUFFER_CONSTANT_INSTANCE(salt_buf, salt, salt_len);
+    BUFFER_CONSTANT_INSTANCE(ikm_buf, ikm, ikm_len);
+    ss_sha1_hmac_with_key(prk, ikm_buf, salt_buf);
+
+    while (done < okm_len) {
+        size_t n;
+        BUFFER_CONSTANT_INSTANCE(prk_buf, prk, sizeof(prk));
+        memcpy(block, t, t_len);
+        memcpy(block + t_len, info, sizeof(info) - 1);
+        block[t_len + sizeof(info) - 1] = counter++;
+        {
+            BUFFER_CONSTANT_INSTANCE(msg, block, t_len + sizeof(info));
+            ss_sha1_hmac_with_key(t, msg, prk_buf);
+        }
+        t_len = SHA1_BYTES;
+        n = min(okm_len - done, SHA1_BYTES);
+        memcpy(okm + done, t, n);
+        done += n;
+    }
+    sodium_memzero(prk, sizeof(prk));
+    sodium_memzero(t, sizeof(t));
+}
+
+static void
+aead_nonce_increment(uint8_t *nonce, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if (++nonce[i] != 0) {
+            break;
+        }
+    }
+}
+
+static void
+aead_gcm_free(aead_core_ctx_t *gcm)
+{
+    if (gcm == NULL) {
+        return;
+    }
+#if defined(USE_CRYPTO_OPENSSL)
+    EVP_CIPHER_CTX_free(gcm);
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_gcm_free(gcm);
+    free(gcm);
+#endif
+}
+
+static aead_core_ctx_t *
+aead_gcm_create(enum ss_cipher_type method, const uint8_t *key, size_t key_len)
+{
+    aead_core_ctx_t *gcm;
+#if defined(USE_CRYPTO_OPENSSL)
+    const EVP_CIPHER *cipher = (method == ss_cipher_aes_128_gcm) ? EVP_aes_128_gcm() : EVP_aes_256_gcm();
+    gcm = EVP_CIPHER_CTX_new();
+    if (!EVP_CipherInit_ex(gcm, cipher, NULL, key, NULL, 1)) {
+        FATAL("Cannot initialize AES-GCM");
+    }
+#elif defined(USE_CRYPTO_MBEDTLS)
+    (void)method;
+    gcm = (aead_core_ctx_t *) calloc(1, sizeof(aead_core_ctx_t));
+    mbedtls_gcm_init(gcm);
+    if (mbedtls_gcm_setkey(gcm, MBEDTLS_CIPHER_ID_AES, key, (unsigned int)key_len * 8) != 0) {
+        FATAL("Cannot set mbed TLS GCM key");
+    }
+#endif
+    (void)key_len;
+    return gcm;
+}
+
+/* Starts a salt: derives the subkey and rewinds the nonce. */
+static void
+aead_ctx_set_salt(struct cipher_env_t *env, struct aead_ctx_t *aead, const uint8_t *salt)
+{
+    size_t salt_len = (size_t)env->enc_iv_len;
+    size_t key_len = (size_t)env->enc_key_len;
+
+    memmove(aead->salt, salt, salt_len);
+    aead_hkdf_sha1(aead->salt, salt_len, env->enc_key, key_len, aead->subkey, key_len);
+    sodium_memzero(aead->nonce, sizeof(aead->nonce));
+    aead_gcm_free(aead->gcm);
+    aead->gcm = NULL;
+    if (env->enc_method <= ss_cipher_aes_256_gcm) {
+        aead->gcm = aead_gcm_create(env->enc_method, aead->subkey, key_len);
+    }
+}
+
+static void
+aead_ctx_clear(struct aead_ctx_t *aead)
+{
+    aead_gcm_free(aead->gcm);
+    buffer_release(aead->pending);
+    sodium_memzero(aead, sizeof(*aead));
+}
+
+/* Writes len + AEAD_TAG_LENGTH bytes to |out|, which must not overlap |in|. */
+static int
+aead_seal(struct cipher_env_t *env, struct aead_ctx_t *aead, uint8_t *out, const uint8_t *in, size_t len)
+{
+    enum ss_cipher_type method = env->enc_method;
+    unsigned long long clen = 0;
+    int err = -1;
+
+    switch (method) {
+    case ss_cipher_aes_128_gcm:
+    case ss_cipher_aes_256_gcm:
+    {
+#if defined(USE_CRYPTO_OPENSSL)
+        int olen = 0, flen = 0;
+        if (EVP_CipherInit_ex(aead->gcm, NULL, NULL, NULL, aead->nonce, 1)
+            && EVP_CipherUpdate(aead->gcm, out, &olen, in, (int)len)
+            && EVP_CipherFinal_ex(aead->gcm, out + olen, &flen)
+            && EVP_CIPHER_CTX_ctrl(aead->gcm, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_LENGTH, out + len))
+        {
+            err = 0;
+        }
+#elif defined(USE_CRYPTO_MBEDTLS)
+        err = mbedtls_gcm_crypt_and_tag(aead->gcm, MBEDTLS_GCM_ENCRYPT, len,
+                                        aead->nonce, aead_nonce_length(method), NULL, 0,
+                                        in, out, AEAD_TAG_LENGTH, out + len) ? -1 : 0;
+#endif
+        break;
+    }
+    case ss_cipher_chacha20ietf_poly1305:
+        err = crypto_aead_chacha20poly1305_ietf_encrypt(out, &clen, in, len, NULL, 0,
+                                                        NULL, aead->nonce, aead->subkey);
+        break;
+    case ss_cipher_xchacha20ietf_poly1305:
+        err = crypto_aead_xchacha20poly1305_ietf_encrypt(out, &clen, in, len, NULL, 0,
+                                                         NULL, aead->nonce, aead->subkey);
+        break;
+    default:
+        break;
+    }
+    aead_nonce_increment(aead->nonce, aead_nonce_length(method));
+    return err;
+}
+
+/* Reads len + AEAD_TAG_LENGTH bytes from |in|, writes len bytes to |out|. */
+static int
+aead_open(struct cipher_env_t *env, struct aead_ctx_t *aead, uint8_t *out, const uint8_t *in, size_t len)
+{
+    enum ss_cipher_type method = env->enc_method;
+    unsigned long long mlen = 0;
+    int err = -1;
+
+    switch (method) {
+    case ss_cipher_aes_128_gcm:
+    case ss_cipher_aes_256_gcm:
+    {
+#if defined(USE_CRYPTO_OPENSSL)
+        int olen = 0, flen = 0;
+        if (EVP_CipherInit_ex(aead->gcm, NULL, NULL, NULL, aead->nonce, 0)
+            && EVP_CipherUpdate(aead->gcm, out, &olen, in, (int)len)
+            && EVP_CIPHER_CTX_ctrl(aead->gcm, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_LENGTH, (void *)(in + len))
+            && EVP_CipherFinal_ex(aead->gcm, out + olen, &flen) > 0)
+        {
+            err = 0;
+        }
+#elif defined(USE_CRYPTO_MBEDTLS)
+        err = mbedtls_gcm_auth_decrypt(aead->gcm, len, aead->nonce, aead_nonce_length(method),
+                                       NULL, 0, in + len, AEAD_TAG_LENGTH, in, out) ? -1 : 0;
+#endif
+        break;
+    }
+    case ss_cipher_chacha20ietf_poly1305:
+        err = crypto_aead_chacha20poly1305_ietf_decrypt(out, &mlen, NULL, in, len + AEAD_TAG_LENGTH,
+                                                        NULL, 0, aead->nonce, aead->subkey);
+        break;
+    case ss_cipher_xchacha20ietf_poly1305:
+        err = crypto_aead_xchacha20poly1305_ietf_decrypt(out, &mlen, NULL, in, len + AEAD_TAG_LENGTH,
+                                                         NULL, 0, aead->nonce, aead->subkey);
+        break;
+    default:
+        break;
+    }
+    aead_nonce_increment(aead->nonce, aead_nonce_length(method));
+    return err;
+}
+
+static int
+aead_encrypt(struct cipher_env_t *env, struct buffer_t *plain, struct enc_ctx *ctx, size_t capacity)
+{
+    struct aead_ctx_t *aead = ctx->aead;
+    size_t salt_len = 0;
+    size_t chunks = (plain->len + AEAD_CHUNK_SIZE_MASK - 1) / AEAD_CHUNK_SIZE_MASK;
+    size_t offset = 0, out_len;
+    struct buffer_t *out;
+    int err = 0;
+
+    if (!ctx->init) {
+        salt_len = (size_t)env->enc_iv_len;
+        aead_ctx_set_salt(env, aead, aead->salt);
+    }
+    out = buffer_create(max(salt_len + plain->len + chunks * AEAD_CHUNK_OVERHEAD, capacity));
+    memcpy(out->buffer, aead->salt, salt_len);
+    out_len = salt_len;
+
+    while (offset < plain->len) {
+        size_t n = min(plain->len - offset, AEAD_CHUNK_SIZE_MASK);
+        uint8_t len_buf[AEAD_CHUNK_LEN_SIZE] = { (uint8_t)(n >> 8), (uint8_t)n };
+        if (aead_seal(env, aead, out->buffer + out_len, len_buf, sizeof(len_buf)) != 0) {
+            err = -1;
+            break;
+        }
+        out_len += sizeof(len_buf) + AEAD_TAG_LENGTH;
+        if (aead_seal(env, aead, out->buffer + out_len, plain->buffer + offset, n) != 0) {
+            err = -1;
+            break;
+        }
+        out_len += n + AEAD_TAG_LENGTH;
+        offset += n;
+    }
+    if (err == 0) {
+        ctx->init = 1;
+        out->len = out_len;
+        buffer_replace(plain, out);
+        buffer_realloc(plain, capacity);
+    }
+    buffer_release(out);
+    return err;
+}
+
+static int
+aead_decrypt(struct cipher_env_t *env, struct buffer_t *cipher, struct enc_ctx *ctx, size_t capacity)
+{
+    struct aead_ctx_t *aead = ctx->aead;
+    struct buffer_t *pending;
+    struct buffer_t *out;
+    size_t offset = 0;
+    int err = 0;
+
+    if (aead->pending == NULL) {
+        aead->pending = buffer_create(max(cipher->len, SODIUM_BLOCK_SIZE));
+    }
+    pending = aead->pending;
+    buffer_concatenate2(pending, cipher);
+
+    if (!ctx->init) {
+        size_t salt_len = (size_t)env->enc_iv_len;
+        if (pending->len < salt_len) {
+            buffer_reset(cipher);
+            return 0;
+        }
+        if (env->iv_filter == NULL && !env->iv_filter_off) {
+            env->iv_filter = ppbloom_create(IV_FILTER_DEFAULT_ENTRIES, IV_FILTER_DEFAULT_ERROR);
+        }
+        if (env->iv_filter && ppbloom_check_add(env->iv_filter, pending->buffer, salt_len)) {
+            return -1;
+        }
+        aead_ctx_set_salt(env, aead, pending->buffer);
+        offset = salt_len;
+        ctx->init = 1;
+    }
+
+    out = buffer_create(max(pending->len, capacity));
+    for (;;) {
+        size_t avail = pending->len - offset;
+        if (aead->chunk_len == 0) {
+            uint8_t len_buf[AEAD_CHUNK_LEN_SIZE];
+            if (avail < AEAD_CHUNK_LEN_SIZE + AEAD_TAG_LENGTH) {
+                break;
+            }
+            if (aead_open(env, aead, len_buf, pending->buffer + offset, sizeof(len_buf)) != 0) {
+                err = -1;
+                break;
+            }
+            aead->chunk_len = ((size_t)len_buf[0] << 8) | len_buf[1];
+            if (aead->chunk_len == 0 || aead->chunk_len > AEAD_CHUNK_SIZE_MASK) {
+                err = -1;
+                break;
+            }
+            offset += AEAD_CHUNK_LEN_SIZE + AEAD_TAG_LENGTH;
+            continue;
+        }
+        if (avail < aead->chunk_len + AEAD_TAG_LENGTH) {
+            break;
+        }
+        if (aead_open(env, aead, out->buffer + out->len, pending->buffer + offset, aead->chunk_len) != 0) {
+            err = -1;
+            break;
+        }
+        out->len += aead->chunk_len;
+        offset += aead->chunk_len + AEAD_TAG_LENGTH;
+        aead->chunk_len = 0;
+    }
+    if (err == 0) {
+        buffer_shorten(pending, offset, pending->len - offset);
+        buffer_replace(cipher, out);
+        buffer_realloc(cipher, capacity);
+    }
+    buffer_release(out);
+    return err;
+}
+
+static int
+aead_encrypt_all(struct cipher_env_t *env, struct buffer_t *plain, size_t capacity)
+{
+    struct aead_ctx_t aead = { { 0 } };
+    size_t salt_len = (size_t)env->enc_iv_len;
+    struct buffer_t *out = buffer_create(max(salt_len + plain->len + AEAD_TAG_LENGTH, capacity));
+    int err;
+
+    rand_bytes(aead.salt, salt_len);
+    aead_ctx_set_salt(env, &aead, aead.salt);
+    memcpy(out->buffer, aead.salt, salt_len);
+    err = aead_seal(env, &aead, out->buffer + salt_len, plain->buffer, plain->len);
+    if (err == 0) {
+        out->len = salt_len + plain->len + AEAD_TAG_LENGTH;
+        buffer_replace(plain, out);
+        buffer_realloc(plain, capacity);
+    }
+    aead_ctx_clear(&aead);
+    buffer_release(out);
+    return err;
+}
+
+static int
+aead_decrypt_all(struct cipher_env_t *env, struct buffer_t *cipher, size_t capacity)
+{
+    struct aead_ctx_t aead = { { 0 } };
+    size_t salt_len = (size_t)env->enc_iv_len;
+    struct buffer_t *out;
+    size_t len;
+    int err;
+
+    if (cipher->len <= salt_len + AEAD_TAG_LENGTH) {
+        return -1;
+    }
+    len = cipher->len - salt_len - AEAD_TAG_LENGTH;
+    out = buffer_create(max(len, capacity));
+    aead_ctx_set_salt(env, &aead, cipher->buffer);
+    err = aead_open(env, &aead, out->buffer, cipher->buffer + salt_len, len);
+    if (err == 0) {
+        out->len = len;
+        buffer_replace(cipher, out);
+        buffer_realloc(cipher, capacity);
+    }
+    aead_ctx_clear(&aead);
+    buffer_release(out);
+    return err;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define TABLE_HAVE_AVX2 1
+#include <immintrin.h>
+
+/*
+ * Looks up 32 bytes at a time: the low nibble indexes each of the 16
+ * table rows with a byte shuffle, and the high nibble selects which row's
+ * result is kept. Handles whole 32-byte blocks and returns their length.
+ */
+__attribute__((target("avx2")))
+static size_t
+table_substitute_avx2(const uint8_t table[256], uint8_t *data, size_t len)
+{
+    __m256i rows[16];
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t done = 0;
+    int k;
+
+    for (k = 0; k < 16; ++k) {
+        __m128i row = _mm_loadu_si128((const __m128i *)(table + 16 * k));
+        rows[k] = _mm256_broadcastsi128_si256(row);
+    }
+    for (; done + 32 <= len; done += 32) {
+        __m256i v  = _mm256_loadu_si256((const __m256i *)(data + done));
+        __m256i lo = _mm256_and_si256(v, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        __m256i r  = _mm256_setzero_si256();
+        for (k = 0; k < 16; ++k) {
+            __m256i hit = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)k));
+            r = _mm256_or_si256(r, _mm256_and_si256(hit, _mm256_shuffle_epi8(rows[k], lo)));
+        }
+        _mm256_storeu_si256((__m256i *)(data + done), r);
+    }
+    return done;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define TABLE_HAVE_NEON 1
+#include <arm_neon.h>
+
+/*
+ * TBL takes a 64-byte table, so the 256 entries are four lookups; TBX
+ * leaves the lanes whose index falls outside its quarter untouched.
+ */
+static size_t
+table_substitute_neon(const uint8_t table[256], uint8_t *data, size_t len)
+{
+    const uint8x16x4_t t0 = vld1q_u8_x4(table);
+    const uint8x16x4_t t1 = vld1q_u8_x4(table + 64);
+    const uint8x16x4_t t2 = vld1q_u8_x4(table + 128);
+    const uint8x16x4_t t3 = vld1q_u8_x4(table + 192);
+    const uint8x16_t quarter = vdupq_n_u8(64);
+    size_t done = 0;
+
+    for (; done + 16 <= len; done += 16) {
+        uint8x16_t v = vld1q_u8(data + done);
+        uint8x16_t r = vqtbl4q_u8(t0, v);
+        v = vsubq_u8(v, quarter);
+        r = vqtbx4q_u8(r, t1, v);
+        v = vsubq_u8(v, quarter);
+        r = vqtbx4q_u8(r, t2, v);
+        v = vsubq_u8(v, quarter);
+        r = vqtbx4q_u8(r, t3, v);
+        vst1q_u8(data + done, r);
+    }
+    return done;
+}
+#endif
+
+/* Maps every byte of |data| through |table| in place. */
+static void
+table_substitute(const uint8_t table[256], uint8_t *data, size_t len)
+{
+    size_t i = 0;
+
+#if defined(TABLE_HAVE_AVX2)
+    if (cpu_features() & cpu_feature_avx2) {
+        i = table_substitute_avx2(table, data, len);
+    }
+#elif defined(TABLE_HAVE_NEON)
+    i = table_substitute_neon(table, data, len);
+#endif
+    for (; i + 8 <= len; i += 8) {
+        data[i]     = table[data[i]];
+        data[i + 1] = table[data[i + 1]];
+        data[i + 2] = table[data[i + 2]];
+        data[i + 3] = table[data[i + 3]];
+        data[i + 4] = table[data[i + 4]];
+        data[i + 5] = table[data[i + 5]];
+        data[i + 6] = table[data[i + 6]];
+        data[i + 7] = table[data[i + 7]];
+    }
+    for (; i < len; ++i) {
+        data[i] = table[data[i]];
+    }
+}
+
 int
 ss_encrypt_all(struct cipher_env_t *env, struct buffer_t *plain, size_t capacity)
 {
     enum ss_cipher_type method = env->enc_method;
+    if (cipher_is_aead(method)) {
+        return aead_encrypt_all(env, plain, capacity);
+    }
     if (method > ss_cipher_table) {
         size_t iv_len;
         int err;
@@ -798,89 +1779,129 @@ ss_encrypt_all(struct cipher_env_t *env, struct buffer_t *plain, size_t capacity
         return 0;
     } else {
         if (env->enc_method == ss_cipher_table) {
-            uint8_t *begin = plain->buffer;
-            uint8_t *ptr   = plain->buffer;
-            while (ptr < begin + plain->len) {
-                *ptr = env->enc_table[(uint8_t)*ptr];
-                ptr++;
-            }
+            table_substitute(env->enc_table, plain->buffer, plain->len);
         }
 
         return 0;
     }
 }
 
+/*
+ * Runs the salsa20/chacha20 keystream over |data| in place, continuing at
+ * ctx->counter. The unused part of the last keystream block is kept in
+ * ctx->stream, so a chunk that starts mid-block consumes it without a
+ * libsodium call, and a short chunk is copied into a padded stack buffer
+ * so the rest of it takes a single call.
+ */
+static void
+crypto_stream_xor_inplace(struct cipher_env_t *env, struct enc_ctx *ctx, uint8_t *data, size_t len)
+{
+    size_t padding = (size_t)(ctx->counter % SODIUM_BLOCK_SIZE);
+    uint64_t ic = ctx->counter / SODIUM_BLOCK_SIZE;
+    size_t head = 0, rest, full, tail, i;
+
+    if (padding) {
+        head = min(len, SODIUM_BLOCK_SIZE - padding);
+        for (i = 0; i < head; ++i) {
+            data[i] ^= ctx->stream[padding + i];
+        }
+        ic++;
+    }
+    ctx->counter += len;
+    if (len == head) {
+        return;
+    }
+    data += head;
+    rest = len - head;
+    full = rest - rest % SODIUM_BLOCK_SIZE;
+    tail = rest - full;
+
+    if (rest <= SODIUM_SHORT_CHUNK) {
+        uint8_t chunk[SODIUM_SHORT_CHUNK];
+        size_t span = full + (tail ? SODIUM_BLOCK_SIZE : 0);
+        memcpy(chunk, data, rest);
+        sodium_memzero(chunk + rest, span - rest);
+        crypto_stream_xor_ic(chunk, chunk, (uint64_t)span,
+                             (const uint8_t *)ctx->cipher_ctx.iv, ic,
+                             env->enc_key, env->enc_method);
+        memcpy(data, chunk, rest);
+        if (tail) {
+            memcpy(ctx->stream, chunk + full, SODIUM_BLOCK_SIZE);
+        }
+        return;
+    }
+
+    if (full) {
+        crypto_stream_xor_ic(data, data, (uint64_t)full,
+                             (const uint8_t *)ctx->cipher_ctx.iv, ic,
+                             env->enc_key, env->enc_method);
+    }
+    if (tail) {
+        memcpy(ctx->stream, data + full, tail);
+        sodium_memzero(ctx->stream + tail, SODIUM_BLOCK_SIZE - tail);
+        crypto_stream_xor_ic(ctx->stream, ctx->stream, SODIUM_BLOCK_SIZE,
+                             (const uint8_t *)ctx->cipher_ctx.iv, ic + full / SODIUM_BLOCK_SIZE,
+                             env->enc_key, env->enc_method);
+        memcpy(data + full, ctx->stream, tail);
+    }
+}
+
+/*
+ * Every method in SS_CIPHER_MAP is a stream, CFB or CTR mode, so the
+ * output length equals the input length and the backends may write over
+ * their input.
+ */
+static int
+cipher_context_update_inplace(struct cipher_ctx_t *ctx, uint8_t *data, size_t len)
+{
+    size_t olen = len;
+    if (!cipher_context_update(ctx, data, &olen, data, len)) {
+        return 0;
+    }
+    return olen == len;
+}
+
 int
 ss_encrypt(struct cipher_env_t *env, struct buffer_t *plain, struct enc_ctx *ctx, size_t capacity)
 {
+    if (ctx != NULL && ctx->aead != NULL) {
+        return aead_encrypt(env, plain, ctx, capacity);
+    }
     if (ctx != NULL) {
-        int err       = 1;
         size_t iv_len = 0;
-        struct buffer_t *cipher;
-        if (!ctx->init) {
-            iv_len = (size_t)env->enc_iv_len;
-        }
-
-        cipher = buffer_create(max(iv_len + plain->len, capacity));
-        cipher->len = plain->len;
+        size_t len = plain->len;
+        uint8_t *data;
 
         if (!ctx->init) {
+            iv_len = (size_t)env->enc_iv_len;
             cipher_context_set_iv(env, &ctx->cipher_ctx, ctx->cipher_ctx.iv, iv_len, 1);
-            memcpy(cipher->buffer, ctx->cipher_ctx.iv, iv_len);
+            // Lands in the headroom when the caller reserved some.
+            buffer_prepend(plain, ctx->cipher_ctx.iv, iv_len);
             ctx->counter = 0;
             ctx->init    = 1;
         }
+        buffer_realloc(plain, capacity);
+        data = plain->buffer + iv_len;
+
+#ifdef SHOW_DUMP
+        dump("PLAIN", data, (int)len);
+#endif
 
         if (env->enc_method >= ss_cipher_salsa20) {
-            size_t padding = (size_t)(ctx->counter % SODIUM_BLOCK_SIZE);
-            buffer_realloc(cipher, max(iv_len + (padding + cipher->len) * 2, capacity));
-            if (padding) {
-                buffer_realloc(plain, max(plain->len + padding, capacity));
-                memmove(plain->buffer + padding, plain->buffer, plain->len);
-                sodium_memzero(plain->buffer, padding);
-            }
-            crypto_stream_xor_ic((uint8_t *)(cipher->buffer + iv_len),
-                                 (const uint8_t *)plain->buffer,
-                                 ((uint64_t)plain->len + padding),
-                                 (const uint8_t *)ctx->cipher_ctx.iv,
-                                 ctx->counter / SODIUM_BLOCK_SIZE, env->enc_key,
-                                 env->enc_method);
-            ctx->counter += plain->len;
-            if (padding) {
-                memmove(cipher->buffer + iv_len,
-                        cipher->buffer + iv_len + padding, cipher->len);
-            }
-        } else {
-            err =
-                cipher_context_update(&ctx->cipher_ctx,
-                                      (uint8_t *)(cipher->buffer + iv_len),
-                                      &cipher->len, (const uint8_t *)plain->buffer,
-                                      plain->len);
-            if (!err) {
-                buffer_release(cipher);
-                return -1;
-            }
+            crypto_stream_xor_inplace(env, ctx, data, len);
+        } else if (!cipher_context_update_inplace(&ctx->cipher_ctx, data, len)) {
+            return -1;
         }
 
 #ifdef SHOW_DUMP
-        dump("PLAIN", plain->buffer, (int)plain->len);
-        dump("CIPHER", cipher->buffer + iv_len, (int)cipher->len);
+        dump("CIPHER", data, (int)len);
 #endif
 
-        buffer_realloc(plain, max(iv_len + cipher->len, capacity));
-        memcpy(plain->buffer, cipher->buffer, iv_len + cipher->len);
-        plain->len = iv_len + cipher->len;
-
-        buffer_release(cipher);
+        plain->len = iv_len + len;
         return 0;
     } else {
         if (env->enc_method == ss_cipher_table) {
-            uint8_t *begin = plain->buffer;
-            uint8_t *ptr   = plain->buffer;
-            while (ptr < begin + plain->len) {
-                *ptr = env->enc_table[(uint8_t)*ptr];
-                ptr++;
-            }
+            table_substitute(env->enc_table, plain->buffer, plain->len);
         }
         return 0;
     }
@@ -890,6 +1911,9 @@ int
 ss_decrypt_all(struct cipher_env_t *env, struct buffer_t *cipher, size_t capacity)
 {
     enum ss_cipher_type method = env->enc_method;
+    if (cipher_is_aead(method)) {
+        return aead_decrypt_all(env, cipher, capacity);
+    }
     if (method > ss_cipher_table) {
         size_t iv_len = (size_t)env->enc_iv_len;
         int ret       = 1;
@@ -941,12 +1965,7 @@ ss_decrypt_all(struct cipher_env_t *env, struct buffer_t *cipher, size_t capacit
         return 0;
     } else {
         if (method == ss_cipher_table) {
-            uint8_t *begin = cipher->buffer;
-            uint8_t *ptr   = cipher->buffer;
-            while (ptr < begin + cipher->len) {
-                *ptr = env->dec_table[(uint8_t)*ptr];
-                ptr++;
-            }
+            table_substitute(env->dec_table, cipher->buffer, cipher->len);
         }
 
         return 0;
@@ -956,17 +1975,20 @@ ss_decrypt_all(struct cipher_env_t *env, struct buffer_t *cipher, size_t capacit
 int
 ss_decrypt(struct cipher_env_t *env, struct buffer_t *cipher, struct enc_ctx *ctx, size_t capacity)
 {
+    if (ctx != NULL && ctx->aead != NULL) {
+        return aead_decrypt(env, cipher, ctx, capacity);
+    }
     if (ctx != NULL) {
         size_t iv_len = 0;
-        int err       = 1;
-
-        struct buffer_t *plain = buffer_create(max(cipher->len, capacity));
-        plain->len = cipher->len;
+        size_t len;
+        uint8_t *data;
 
         if (!ctx->init) {
             uint8_t iv[MAX_IV_LENGTH];
-            iv_len      = (size_t)env->enc_iv_len;
-            plain->len -= iv_len;
+            iv_len = (size_t)env->enc_iv_len;
+            if (cipher->len < iv_len) {
+                return -1;
+            }
 
             memcpy(iv, cipher->buffer, iv_len);
             cipher_context_set_iv(env, &ctx->cipher_ctx, iv, iv_len, 0);
@@ -974,69 +1996,64 @@ ss_decrypt(struct cipher_env_t *env, struct buffer_t *cipher, struct enc_ctx *ct
             ctx->init    = 1;
 
             if (env->enc_method > ss_cipher_rc4) {
-                if (cache_key_exist(env->iv_cache, (char *)iv, iv_len)) {
+                if (env->iv_filter == NULL && !env->iv_filter_off) {
+                    env->iv_filter = ppbloom_create(IV_FILTER_DEFAULT_ENTRIES, IV_FILTER_DEFAULT_ERROR);
+                }
+                if (env->iv_filter && ppbloom_check_add(env->iv_filter, iv, iv_len)) {
                     return -1;
-                } else {
-                    cache_insert(env->iv_cache, (char *)iv, iv_len, NULL);
                 }
             }
         }
+        data = cipher->buffer + iv_len;
+        len = cipher->len - iv_len;
 
         if (env->enc_method >= ss_cipher_salsa20) {
-            size_t padding = (size_t)(ctx->counter % SODIUM_BLOCK_SIZE);
-            buffer_realloc(plain, max((plain->len + padding) * 2, capacity));
-
-            if (padding) {
-                buffer_realloc(cipher, max(cipher->len + padding, capacity));
-                memmove(cipher->buffer + iv_len + padding, cipher->buffer + iv_len,
-                        cipher->len - iv_len);
-                sodium_memzero(cipher->buffer + iv_len, padding);
-            }
-            crypto_stream_xor_ic((uint8_t *)plain->buffer,
-                                 (const uint8_t *)(cipher->buffer + iv_len),
-                                 ((uint64_t)cipher->len - iv_len + padding),
-                                 (const uint8_t *)ctx->cipher_ctx.iv,
-                                 ctx->counter / SODIUM_BLOCK_SIZE, env->enc_key,
-                                 env->enc_method);
-            ctx->counter += cipher->len - iv_len;
-            if (padding) {
-                memmove(plain->buffer, plain->buffer + padding, plain->len);
-            }
-        } else {
-            err = cipher_context_update(&ctx->cipher_ctx, (uint8_t *)plain->buffer, &plain->len,
-                                        (const uint8_t *)(cipher->buffer + iv_len),
-                                        cipher->len - iv_len);
-        }
-
-        if (!err) {
-            buffer_release(plain);
+            crypto_stream_xor_inplace(env, ctx, data, len);
+        } else if (!cipher_context_update_inplace(&ctx->cipher_ctx, data, len)) {
             return -1;
         }
 
 #ifdef SHOW_DUMP
-        dump("PLAIN", plain->buffer, (int)plain->len);
-        dump("CIPHER", cipher->buffer + iv_len, (int)(cipher->len - iv_len));
+        dump("PLAIN", data, (int)len);
 #endif
 
-        buffer_realloc(cipher, max(plain->len, capacity));
-        memcpy(cipher->buffer, plain->buffer, plain->len);
-        cipher->len = plain->len;
-
-        buffer_release(plain);
+        buffer_consume(cipher, iv_len);
+        buffer_realloc(cipher, capacity);
         return 0;
     } else {
-        if(env->enc_method == ss_cipher_table) {
-            uint8_t *begin = cipher->buffer;
-            uint8_t *ptr   = cipher->buffer;
-            while (ptr < begin + cipher->len) {
-                *ptr = env->dec_table[(uint8_t)*ptr];
-                ptr++;
-            }
+        if (env->enc_method == ss_cipher_table) {
+            table_substitute(env->dec_table, cipher->buffer, cipher->len);
         }
         return 0;
     }
 }
 
+size_t
+ss_encrypt_batch(struct cipher_env_t *env, struct enc_batch_item *items, size_t count, size_t capacity)
+{
+    size_t i, failed = 0;
+    for (i = 0; i < count; ++i) {
+        items[i].result = ss_encrypt(env, items[i].data, items[i].ctx, capacity);
+        if (items[i].result != 0) {
+            ++failed;
+        }
+    }
+    return failed;
+}
+
+size_t
+ss_decrypt_batch(struct cipher_env_t *env, struct enc_batch_item *items, size_t count, size_t capacity)
+{
+    size_t i, failed = 0;
+    for (i = 0; i < count; ++i) {
+        items[i].result = ss_decrypt(env, items[i].data, items[i].ctx, capacity);
+        if (items[i].result != 0) {
+            ++failed;
+        }
+    }
+    return failed;
+}
+
 int
 ss_encrypt_buffer(struct cipher_env_t *env, struct enc_ctx *ctx, char *in, size_t in_size, char *out, size_t *out_size)
 {
@@ -1069,14 +2086,28 @@ ss_decrypt_buffer(struct cipher_env_t *env, struct enc_ctx *ctx, char *in, size_
 }
 
 const uint8_t * enc_ctx_get_iv(const struct enc_ctx *ctx) {
+    if (ctx && ctx->aead) {
+        return ctx->aead->salt;
+    }
     return ctx->cipher_ctx.iv;
 }
 
+bool enc_ctx_started(const struct enc_ctx *ctx) {
+    return ctx == NULL || ctx->init != 0;
+}
+
 struct enc_ctx *
 enc_ctx_new_instance(struct cipher_env_t *env, bool encrypt)
 {
     struct enc_ctx *ctx = (struct enc_ctx *)calloc(1, sizeof(struct enc_ctx));
     sodium_memzero(ctx, sizeof(struct enc_ctx));
+    if (cipher_is_aead(env->enc_method)) {
+        ctx->aead = (struct aead_ctx_t *)calloc(1, sizeof(struct aead_ctx_t));
+        if (encrypt) {
+            rand_bytes(ctx->aead->salt, env->enc_iv_len);
+        }
+        return ctx;
+    }
     cipher_context_init(env, &ctx->cipher_ctx, encrypt);
 
     if (encrypt) {
@@ -1091,6 +2122,12 @@ enc_ctx_release_instance(struct cipher_env_t *env, struct enc_ctx *ctx)
     if (env==NULL || ctx==NULL) {
         return;
     }
+    if (ctx->aead) {
+        aead_ctx_clear(ctx->aead);
+        free(ctx->aead);
+        free(ctx);
+        return;
+    }
     cipher_context_release(env, &ctx->cipher_ctx);
     free(ctx);
 }
@@ -1139,6 +2176,25 @@ enc_table_init(struct cipher_env_t * env, enum ss_cipher_type method, const char
     env->enc_method = method;
 }
 
+static void
+crypto_global_init_once(void)
+{
+#if defined(USE_CRYPTO_OPENSSL)
+    OpenSSL_add_all_algorithms();
+#endif
+    // Initialize sodium for random generator
+    if (sodium_init() == -1) {
+        FATAL("Failed to initialize sodium");
+    }
+}
+
+void
+crypto_global_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, crypto_global_init_once);
+}
+
 void
 enc_key_init(struct cipher_env_t *env, enum ss_cipher_type method, const char *pass)
 {
@@ -1150,21 +2206,11 @@ enc_key_init(struct cipher_env_t *env, enum ss_cipher_type method, const char *p
         return;
     }
 
-    // Initialize cache
-    cache_create(&env->iv_cache, 256, NULL);
-
-#if defined(USE_CRYPTO_OPENSSL)
-    OpenSSL_add_all_algorithms();
-#endif
+    crypto_global_init();
 
     cipher = (struct cipher_wrapper *)calloc(1, sizeof(struct cipher_wrapper));
 
-    // Initialize sodium for random generator
-    if (sodium_init() == -1) {
-        FATAL("Failed to initialize sodium");
-    }
-
-    if (method == ss_cipher_salsa20 || method == ss_cipher_chacha20 || method == ss_cipher_chacha20ietf) {
+    if (method >= ss_cipher_salsa20 || cipher_is_rc4(method)) {
 #if defined(USE_CRYPTO_OPENSSL)
         cipher->core    = NULL;
         cipher->key_len = (size_t) ss_cipher_key_size(method);
@@ -1200,6 +2246,14 @@ enc_key_init(struct cipher_env_t *env, enum ss_cipher_type method, const char *p
         FATAL("Cannot generate key and IV");
     }
     if (method == ss_cipher_rc4_md5 || method == ss_cipher_rc4_md5_6) {
+#if defined(USE_CRYPTO_OPENSSL)
+        MD5_Init(&env->key_md5);
+        MD5_Update(&env->key_md5, env->enc_key, MD5_BYTES);
+#elif defined(USE_CRYPTO_MBEDTLS)
+        mbedtls_md5_init(&env->key_md5);
+        mbedtls_md5_starts_ret(&env->key_md5);
+        mbedtls_md5_update_ret(&env->key_md5, env->enc_key, MD5_BYTES);
+#endif
         env->enc_iv_len = ss_cipher_iv_size(method);
     } else {
         env->enc_iv_len = cipher_iv_size(cipher);
@@ -1229,18 +2283,47 @@ enum ss_cipher_type cipher_env_enc_method(const struct cipher_env_t *env) {
 void
 cipher_env_release(struct cipher_env_t *env)
 {
+    size_t i;
     if (env == NULL) {
         return;
     }
     if (env->enc_method == ss_cipher_table) {
         safe_free(env->enc_table);
         safe_free(env->dec_table);
-    } else {
-        cache_delete(env->iv_cache, 0);
     }
+    for (i = 0; i < 2; ++i) {
+        while (env->keyed_count[i] > 0) {
+            cipher_core_ctx_free(env->keyed_pool[i][--env->keyed_count[i]]);
+        }
+        if (env->keyed_template[i] != NULL) {
+            cipher_core_ctx_free(env->keyed_template[i]);
+        }
+    }
+#if defined(USE_CRYPTO_MBEDTLS)
+    if (env->enc_method == ss_cipher_rc4_md5 || env->enc_method == ss_cipher_rc4_md5_6) {
+        mbedtls_md5_free(&env->key_md5);
+    }
+#endif
+    ppbloom_release(env->iv_filter);
     free(env);
 }
 
+void
+cipher_env_set_replay_filter(struct cipher_env_t *env, struct ppbloom *filter)
+{
+    ppbloom_add_ref(filter);
+    ppbloom_release(env->iv_filter);
+    env->iv_filter = filter;
+}
+
+void
+cipher_env_disable_replay_filter(struct cipher_env_t *env)
+{
+    ppbloom_release(env->iv_filter);
+    env->iv_filter = NULL;
+    env->iv_filter_off = true;
+}
+
 struct buffer_t * cipher_simple_update_data(const char *key, const char *method, bool encrypt, const struct buffer_t *data) {
     struct cipher_env_t *cipher = cipher_env_new_instance(key, method);
     struct enc_ctx *ctx = enc_ctx_new_instance(cipher, encrypt);
@@ -46,6 +46,20 @@
 #endif
 
 #define SODIUM_BLOCK_SIZE   64
+/* Chunks up to this size take a single libsodium call. */
+#define SODIUM_SHORT_CHUNK  (8 * SODIUM_BLOCK_SIZE)
+
+/* AEAD framing, see cipher_is_aead(). */
+#define AEAD_TAG_LENGTH         16
+#define AEAD_MAX_SALT_LENGTH    32
+#define AEAD_MAX_NONCE_LENGTH   24
+#define AEAD_CHUNK_SIZE_MASK    0x3FFF
+#define AEAD_CHUNK_LEN_SIZE     2
+#define AEAD_CHUNK_OVERHEAD     (AEAD_CHUNK_LEN_SIZE + 2 * AEAD_TAG_LENGTH)
+
+/* Replay filter for cipher environments that were not given one. */
+#define IV_FILTER_DEFAULT_ENTRIES   10000
+#define IV_FILTER_DEFAULT_ERROR     1e-6
 
 #define ADDRTYPE_MASK 0xEF
 
@@ -61,9 +75,13 @@ struct buffer_t;
 
 struct cipher_env_t;
 struct enc_ctx;
+struct ppbloom;
 
 void dump(const char *tag, const uint8_t *text, size_t len);
 
+const char * ss_crypto_aes_kernel(void);
+const char * ss_crypto_sha1_kernel(void);
+
 size_t ss_max_iv_length(void);
 size_t ss_max_key_length(void);
 
@@ -77,11 +95,31 @@ int ss_decrypt_all(struct cipher_env_t* env, struct buffer_t *ciphertext, size_t
 int ss_encrypt(struct cipher_env_t* env, struct buffer_t *plaintext, struct enc_ctx *ctx, size_t capacity);
 int ss_decrypt(struct cipher_env_t* env, struct buffer_t *ciphertext, struct enc_ctx *ctx, size_t capacity);
 
+/* One chunk of a batch, result holds what ss_encrypt/ss_decrypt returned. */
+struct enc_batch_item {
+    struct enc_ctx *ctx;
+    struct buffer_t *data;
+    int result;
+};
+
+/* Runs the chunks collected in one loop iteration back to back. Returns the number that failed. */
+size_t ss_encrypt_batch(struct cipher_env_t *env, struct enc_batch_item *items, size_t count, size_t capacity);
+size_t ss_decrypt_batch(struct cipher_env_t *env, struct enc_batch_item *items, size_t count, size_t capacity);
+
+/* sodium_init() and the crypto library's tables, once per process and from any thread.
+ * A first sodium_init() may wait for the kernel's entropy at boot. */
+void crypto_global_init(void);
 struct cipher_env_t * cipher_env_new_instance(const char *pass, const char *method);
 enum ss_cipher_type cipher_env_enc_method(const struct cipher_env_t *env);
+bool cipher_is_aead(enum ss_cipher_type method);
 void cipher_env_release(struct cipher_env_t *env);
+void cipher_env_set_replay_filter(struct cipher_env_t *env, struct ppbloom *filter);
+/* For protocols that reject replayed handshakes on their own, see ssr_replay_window.h. */
+void cipher_env_disable_replay_filter(struct cipher_env_t *env);
 
 const uint8_t * enc_ctx_get_iv(const struct enc_ctx *ctx);
+/* Past its IV or salt, a NULL |ctx| always is. From then on a call only touches |ctx| and reads its env. */
+bool enc_ctx_started(const struct enc_ctx *ctx);
 
 struct enc_ctx * enc_ctx_new_instance(struct cipher_env_t *env, bool encrypt);
 void enc_ctx_release_instance(struct cipher_env_t* env, struct enc_ctx *ctx);
@@ -94,8 +132,22 @@ size_t ss_md5_hmac_with_key(uint8_t auth[MD5_BYTES], const struct buffer_t *msg,
 size_t ss_md5_hash_func(uint8_t *auth, const uint8_t *msg, size_t msg_len);
 size_t ss_sha1_hmac_with_key(uint8_t auth[SHA1_BYTES], const struct buffer_t *msg, const struct buffer_t *key);
 size_t ss_sha1_hash_func(uint8_t *auth, const uint8_t *msg, size_t msg_len);
+
+/* Keyed HMAC state reused across calls while the key stays the same. */
+enum ss_hmac_digest { ss_hmac_md5, ss_hmac_sha1 };
+struct ss_hmac_ctx;
+struct ss_hmac_ctx * ss_hmac_ctx_create(enum ss_hmac_digest digest);
+void ss_hmac_ctx_destroy(struct ss_hmac_ctx *ctx);
+size_t ss_hmac_ctx_compute(struct ss_hmac_ctx *ctx, uint8_t *auth, const struct buffer_t *msg, const struct buffer_t *key);
+
 size_t ss_aes_128_cbc_encrypt(size_t length, const uint8_t *plain_text, uint8_t *out_data, const uint8_t key[16]);
 size_t ss_aes_128_cbc_decrypt(size_t length, const uint8_t *cipher_text, uint8_t *out_data, const uint8_t key[16]);
+
+/* An AES-128 key expanded once for one direction, then used for CBC under a zero IV as above. */
+struct ss_aes_128_ctx;
+struct ss_aes_128_ctx * ss_aes_128_ctx_create(const uint8_t key[16], bool encrypt);
+void ss_aes_128_ctx_destroy(struct ss_aes_128_ctx *ctx);
+size_t ss_aes_128_ctx_cbc(struct ss_aes_128_ctx *ctx, size_t length, const uint8_t *in_data, uint8_t *out_data);
 int ss_encrypt_buffer(struct cipher_env_t *env, struct enc_ctx *ctx, char *in, size_t in_size, char *out, size_t *out_size);
 int ss_decrypt_buffer(struct cipher_env_t *env, struct enc_ctx *ctx, char *in, size_t in_size, char *out, size_t *out_size);
 
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include "fair_queue.h"
+#include "common.h"
+
+struct fair_queue_lane {
+    struct fair_queue_entry *head;
+    struct fair_queue_entry *tail;
+    size_t count;
+};
+
+struct fair_queue {
+    uv_check_t check;  /* Runs a round after each poll phase. */
+    uv_idle_t idle;  /* Keeps the poll from blocking while work is queued. */
+    size_t quantum;
+    struct fair_queue_lane priority;
+    struct fair_queue_lane bulk;
+    int open_handles;
+};
+
+static void lane_push(struct fair_queue_lane *lane, struct fair_queue_entry *entry) {
+    entry->next = NULL;
+    if (lane->tail) {
+        lane->tail->next = entry;
+    } else {
+        lane->head = entry;
+    }
+    lane->tail = entry;
+    lane->count++;
+}
+
+static struct fair_queue_entry * lane_pop(struct fair_queue_lane *lane) {
+    struct fair_queue_entry *entry = lane->head;
+    if (entry) {
+        lane->head = entry->next;
+        if (lane->head == NULL) {
+            lane->tail = NULL;
+        }
+        entry->next = NULL;
+        lane->count--;
+    }
+    return entry;
+}
+
+static void fair_queue_run(struct fair_queue_entry *entry) {
+    entry->queued = false;
+    entry->deficit = 0;  /* Its queue is empty now. */
+    entry->run_cb(entry);
+}
+
+/* Work submitted meanwhile waits for the next round. */
+static void fair_queue_round(struct fair_queue *queue) {
+    size_t n = queue->priority.count;
+    while (n-- > 0) {
+        fair_queue_run(lane_pop(&queue->priority));
+    }
+    if (queue->bulk.count == 1 && queue->priority.count == 0) {
+        fair_queue_run(lane_pop(&queue->bulk));  /* Nobody to be fair to. */
+        return;
+    }
+    n = queue->bulk.count;
+    while (n-- > 0) {
+        struct fair_queue_entry *entry = lane_pop(&queue->bulk);
+        entry->deficit += queue->quantum;
+        if (entry->deficit >= entry->cost) {
+            fair_queue_run(entry);
+        } else {
+            lane_push(&queue->bulk, entry);
+        }
+    }
+}
+
+static void fair_queue_check_cb(uv_check_t *handle) {
+    struct fair_queue *queue = CONTAINER_OF(handle, struct fair_queue, check);
+    fair_queue_round(queue);
+    if (queue->priority.count == 0 && queue->bulk.count == 0) {
+        uv_idle_stop(&queue->idle);
+    }
+}
+
+static void fair_queue_idle_cb(uv_idle_t *handle) {
+    (void)handle;
+}
+
+struct fair_queue * fair_queue_create(uv_loop_t *loop, size_t quantum) {
+    struct fair_queue *queue;
+    if (quantum == 0) {
+        return NULL;
+    }
+    queue = (struct fair_queue *) calloc(1, sizeof(*queue));
+    queue->quantum = quantum;
+    VERIFY(0 == uv_check_init(loop, &queue->check));
+    VERIFY(0 == uv_idle_init(loop, &queue->idle));
+    queue->open_handles = 2;
+    VERIFY(0 == uv_check_start(&queue->check, fair_queue_check_cb));
+    // Only the idle handle holds the loop, the check handle doesn't.
+    uv_unref((uv_handle_t *)&queue->check);
+    return queue;
+}
+
+static void fair_queue_close_done_cb(uv_handle_t *handle) {
+    struct fair_queue *queue = (struct fair_queue *)handle->data;
+    if (--queue->open_handles == 0) {
+        free(queue);
+    }
+}
+
+void fair_queue_release(struct fair_queue *queue) {
+    struct fair_queue_entry *entry;
+    if (queue == NULL) {
+        return;
+    }
+    while ((entry = lane_pop(&queue->priority)) || (entry = lane_pop(&queue->bulk))) {
+        fair_queue_run(entry);
+    }
+    queue->check.data = queue;
+    queue->idle.data = queue;
+    uv_close((uv_handle_t *)&queue->check, fair_queue_close_done_cb);
+    uv_close((uv_handle_t *)&queue->idle, fair_queue_close_done_cb);
+}
+
+void fair_queue_entry_init(struct fair_queue_entry *entry, void(*run_cb)(struct fair_queue_entry *entry)) {
+    entry->next = NULL;
+    entry->cost = 0;
+    entry->deficit = 0;
+    entry->queued = false;
+    entry->window_start = 0;
+    entry->window_bytes = 0;
+    entry->run_cb = run_cb;
+}
+
+void fair_queue_submit(struct fair_queue *queue, struct fair_queue_entry *entry, size_t cost) {
+    uint64_t now = uv_now(queue->check.loop);
+
+    ASSERT(entry->queued == false);
+    if (now - entry->window_start >= FAIR_QUEUE_WINDOW_MS) {
+        entry->window_start = now;
+        entry->window_bytes = 0;
+    }
+    entry->window_bytes += cost;
+    entry->cost = cost;
+    entry->queued = true;
+    if (cost <= FAIR_QUEUE_SMALL_COST && entry->window_bytes <= FAIR_QUEUE_QUIET_BYTES) {
+        lane_push(&queue->priority, entry);
+    } else {
+        lane_push(&queue->bulk, entry);
+    }
+    uv_idle_start(&queue->idle, fair_queue_idle_cb);
+}
@@ -0,0 +1,42 @@
+#if !defined(__fair_queue_h__)
+#define __fair_queue_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * Deficit round robin over the work of one loop's flows. Work is submitted
+ * with its cost in bytes and runs after the loop's poll phase: a flow
+ * earns |quantum| per round and its work runs once it has earned the
+ * cost, so a flow moving big chunks gets a turn every few rounds while the
+ * others get theirs every round. Small work of a flow that has been quiet
+ * goes in a priority lane, run first each round. A flow has at most one
+ * piece queued. Not thread safe: one per uv_loop_t.
+ */
+
+#define FAIR_QUEUE_SMALL_COST   2048  /* At most this, the priority lane, */
+#define FAIR_QUEUE_QUIET_BYTES  (64 * 1024)  /* if the flow moved less than this */
+#define FAIR_QUEUE_WINDOW_MS    1000  /* in the current window. */
+
+struct fair_queue;
+
+struct fair_queue_entry {
+    struct fair_queue_entry *next;
+    size_t cost;
+    size_t deficit;
+    bool queued;
+    uint64_t window_start;
+    size_t window_bytes;
+    void(*run_cb)(struct fair_queue_entry *entry);
+};
+
+/* NULL without a |quantum|. */
+struct fair_queue * fair_queue_create(uv_loop_t *loop, size_t quantum);
+/* Runs what is still queued and closes the handles, it's freed once they're closed. */
+void fair_queue_release(struct fair_queue *queue);
+void fair_queue_entry_init(struct fair_queue_entry *entry, void(*run_cb)(struct fair_queue_entry *entry));
+void fair_queue_submit(struct fair_queue *queue, struct fair_queue_entry *entry, size_t cost);
+
+#endif // !defined(__fair_queue_h__)
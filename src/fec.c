@@ -0,0 +1,398 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "fec.h"
+
+#define FEC_TYPE_DATA    0xf1
+#define FEC_TYPE_PARITY  0xf2
+#define FEC_SEQID_SIZE   6  /* SEQID and TYPE, SIZE belongs to the shard. */
+
+struct fec_encoder {
+    unsigned int data;
+    unsigned int parity;
+    size_t mtu;
+    size_t slot_size;  /* FEC_HEADER + mtu. */
+    uint32_t seqid;
+    uint32_t seqid_limit;  /* A multiple of the group size, so a wrap keeps groups aligned. */
+    unsigned int count;  /* Data shards of the open group. */
+    size_t longest;  /* Of their shards, SIZE included. */
+    size_t *lens;
+    uint8_t *slots;  /* The group's data datagrams, header and all. */
+    uint8_t *out;
+};
+
+struct fec_group {
+    bool used;
+    bool done;  /* Every data shard went out, received or rebuilt. */
+    uint32_t id;
+    unsigned int received;
+    unsigned int data_received;
+    uint8_t *present;
+    size_t *lens;
+    uint8_t *shards;  /* SIZE and PAYLOAD, or parity. */
+};
+
+struct fec_decoder {
+    unsigned int data;
+    unsigned int parity;
+    unsigned int total;
+    size_t shard_size;
+    uint64_t recovered;
+    struct fec_group groups[FEC_DECODE_GROUPS];
+    unsigned int *rows;  /* The shards a rebuild uses. */
+    uint8_t *matrix;
+    uint8_t *inverse;
+    uint8_t *out;
+};
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uv_once_t gf_once = UV_ONCE_INIT;
+
+static void gf_init(void) {
+    unsigned int x = 1, i;
+    for (i = 0; i < 255; ++i) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+    for (i = 255; i < 512; ++i) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return (a && b) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/* dst ^= c * src */
+static void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    size_t i;
+    if (c == 0) {
+        return;
+    }
+    if (c == 1) {
+        for (i = 0; i < len; ++i) {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+    for (i = 0; i < len; ++i) {
+        if (src[i]) {
+            dst[i] ^= gf_exp[gf_log[c] + gf_log[src[i]]];
+        }
+    }
+}
+
+/* Of parity shard |row| for data shard |col|, a Cauchy matrix whose x are
+ * past the data indices, so every square part of it can be inverted. */
+static uint8_t fec_coefficient(unsigned int data, unsigned int row, unsigned int col) {
+    return gf_inv((uint8_t)((data + row) ^ col));
+}
+
+static void fec_put16(uint8_t *ptr, uint16_t v) {
+    ptr[0] = (uint8_t)v;
+    ptr[1] = (uint8_t)(v >> 8);
+}
+
+static void fec_put32(uint8_t *ptr, uint32_t v) {
+    ptr[0] = (uint8_t)v;
+    ptr[1] = (uint8_t)(v >> 8);
+    ptr[2] = (uint8_t)(v >> 16);
+    ptr[3] = (uint8_t)(v >> 24);
+}
+
+static uint16_t fec_get16(const uint8_t *ptr) {
+    return (uint16_t)(ptr[0] | (ptr[1] << 8));
+}
+
+static uint32_t fec_get32(const uint8_t *ptr) {
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static bool fec_valid(unsigned int data, unsigned int parity, size_t mtu) {
+    return data > 0 && parity > 0 && data + parity <= FEC_MAX_SHARDS && mtu > 0 && mtu <= 0xFFFF;
+}
+
+struct fec_encoder * fec_encoder_create(unsigned int data, unsigned int parity, size_t mtu) {
+    struct fec_encoder *enc;
+
+    if (fec_valid(data, parity, mtu) == false) {
+        return NULL;
+    }
+    uv_once(&gf_once, gf_init);
+    enc = (struct fec_encoder *) calloc(1, sizeof(*enc));
+    enc->data = data;
+    enc->parity = parity;
+    enc->mtu = mtu;
+    enc->slot_size = FEC_HEADER + mtu;
+    enc->seqid_limit = (UINT32_MAX / (data + parity)) * (data + parity);
+    enc->lens = (size_t *) calloc(data, sizeof(size_t));
+    enc->slots = (uint8_t *) calloc(data, enc->slot_size);
+    enc->out = (uint8_t *) calloc(1, enc->slot_size);
+    return enc;
+}
+
+void fec_encoder_release(struct fec_encoder *enc) {
+    if (enc == NULL) {
+        return;
+    }
+    free(enc->lens);
+    free(enc->slots);
+    free(enc->out);
+    free(enc);
+}
+
+static void fec_encoder_next_seqid(struct fec_encoder *enc, uint8_t *header, uint16_t type) {
+    fec_put32(header, enc->seqid);
+    fec_put16(header + 4, type);
+    if (++enc->seqid == enc->seqid_limit) {
+        enc->seqid = 0;
+    }
+}
+
+void fec_encoder_encode(struct fec_encoder *enc, const uint8_t *payload, size_t len, fec_emit_cb emit, void *p) {
+    uint8_t *slot;
+    unsigned int i, j;
+
+    if (len > enc->mtu) {
+        return;
+    }
+    slot = enc->slots + enc->count * enc->slot_size;
+    fec_encoder_next_seqid(enc, slot, FEC_TYPE_DATA);
+    fec_put16(slot + FEC_SEQID_SIZE, (uint16_t)len);
+    memcpy(slot + FEC_HEADER, payload, len);
+    emit(p, slot, FEC_HEADER + len);
+
+    enc->lens[enc->count] = 2 + len;
+    if (enc->lens[enc->count] > enc->longest) {
+        enc->longest = enc->lens[enc->count];
+    }
+    if (++enc->count < enc->data) {
+        return;
+    }
+
+    // Shorter shards count as zero padded.
+    for (j = 0; j < enc->data; ++j) {
+        uint8_t *shard = enc->slots + j * enc->slot_size + FEC_SEQID_SIZE;
+        memset(shard + enc->lens[j], 0, enc->longest - enc->lens[j]);
+    }
+    for (i = 0; i < enc->parity; ++i) {
+        memset(enc->out + FEC_SEQID_SIZE, 0, enc->longest);
+        for (j = 0; j < enc->data; ++j) {
+            gf_mul_add(enc->out + FEC_SEQID_SIZE, enc->slots + j * enc->slot_size + FEC_SEQID_SIZE,
+                fec_coefficient(enc->data, i, j), enc->longest);
+        }
+        fec_encoder_next_seqid(enc, enc->out, FEC_TYPE_PARITY);
+        emit(p, enc->out, FEC_SEQID_SIZE + enc->longest);
+    }
+    enc->count = 0;
+    enc->longest = 0;
+}
+
+struct fec_decoder * fec_decoder_create(unsigned int data, unsigned int parity, size_t mtu) {
+    struct fec_decoder *dec;
+    size_t i;
+
+    if (fec_valid(data, parity, mtu) == false) {
+        return NULL;
+    }
+    uv_once(&gf_once, gf_init);
+    dec = (struct fec_decoder *) calloc(1, sizeof(*dec));
+    dec->data = data;
+    dec->parity = parity;
+    dec->total = data + parity;
+    dec->shard_size = 2 + mtu;
+    for (i = 0; i < FEC_DECODE_GROUPS; ++i) {
+        struct fec_group *group = &dec->groups[i];
+        group->present = (uint8_t *) calloc(dec->total, 1);
+        group->lens = (size_t *) calloc(dec->total, sizeof(size_t));
+        group->shards = (uint8_t *) calloc(dec->total, dec->shard_size);
+    }
+    dec->rows = (unsigned int *) calloc(data, sizeof(unsigned int));
+    dec->matrix = (uint8_t *) calloc((size_t)data * data, 1);
+    dec->inverse = (uint8_t *) calloc((size_t)data * data, 1);
+    dec->out = (uint8_t *) calloc(1, dec->shard_size);
+    return dec;
+}
+
+void fec_decoder_release(struct fec_decoder *dec) {
+    size_t i;
+    if (dec == NULL) {
+        return;
+    }
+    for (i = 0; i < FEC_DECODE_GROUPS; ++i) {
+        free(dec->groups[i].present);
+        free(dec->groups[i].lens);
+        free(dec->groups[i].shards);
+    }
+    free(dec->rows);
+    free(dec->matrix);
+    free(dec->inverse);
+    free(dec->out);
+    free(dec);
+}
+
+uint64_t fec_decoder_recovered(const struct fec_decoder *dec) {
+    return dec->recovered;
+}
+
+/* Gauss-Jordan over GF(2^8), false if |m| is singular, which a Cauchy code never is. */
+static bool fec_invert(uint8_t *m, uint8_t *inv, unsigned int n) {
+    unsigned int col, row, k;
+
+    memset(inv, 0, (size_t)n * n);
+    for (k = 0; k < n; ++k) {
+        inv[k * n + k] = 1;
+    }
+    for (col = 0; col < n; ++col) {
+        uint8_t scale;
+        for (row = col; row < n && m[row * n + col] == 0; ++row) {
+        }
+        if (row == n) {
+            return false;
+        }
+        if (row != col) {
+            for (k = 0; k < n; ++k) {
+                uint8_t t = m[row * n + k];
+                m[row * n + k] = m[col * n + k];
+                m[col * n + k] = t;
+                t = inv[row * n + k];
+                inv[row * n + k] = inv[col * n + k];
+                inv[col * n + k] = t;
+            }
+        }
+        scale = gf_inv(m[col * n + col]);
+        for (k = 0; k < n; ++k) {
+            m[col * n + k] = gf_mul(m[col * n + k], scale);
+            inv[col * n + k] = gf_mul(inv[col * n + k], scale);
+        }
+        for (row = 0; row < n; ++row) {
+            uint8_t factor = m[row * n + col];
+            if (row == col || factor == 0) {
+                continue;
+            }
+            for (k = 0; k < n; ++k) {
+                m[row * n + k] ^= gf_mul(factor, m[col * n + k]);
+                inv[row * n + k] ^= gf_mul(factor, inv[col * n + k]);
+            }
+        }
+    }
+    return true;
+}
+
+static void fec_rebuild(struct fec_decoder *dec, struct fec_group *group, fec_emit_cb emit, void *p) {
+    unsigned int n = dec->data, used = 0, index, j;
+    size_t longest = 0;
+
+    // Data shards as they came, parity for the rest.
+    for (index = 0; index < dec->total && used < n; ++index) {
+        if (group->present[index]) {
+            dec->rows[used++] = index;
+            if (group->lens[index] > longest) {
+                longest = group->lens[index];
+            }
+        }
+    }
+    for (j = 0; j < used; ++j) {
+        uint8_t *shard = group->shards + dec->rows[j] * dec->shard_size;
+        memset(shard + group->lens[dec->rows[j]], 0, longest - group->lens[dec->rows[j]]);
+    }
+    for (j = 0; j < n; ++j) {
+        uint8_t *row = dec->matrix + j * n;
+        unsigned int col;
+        if (dec->rows[j] < n) {
+            memset(row, 0, n);
+            row[dec->rows[j]] = 1;
+        } else {
+            for (col = 0; col < n; ++col) {
+                row[col] = fec_coefficient(n, dec->rows[j] - n, col);
+            }
+        }
+    }
+    if (fec_invert(dec->matrix, dec->inverse, n) == false) {
+        return;
+    }
+    for (index = 0; index < n; ++index) {
+        size_t size;
+        if (group->present[index]) {
+            continue;
+        }
+        memset(dec->out, 0, longest);
+        for (j = 0; j < n; ++j) {
+            gf_mul_add(dec->out, group->shards + dec->rows[j] * dec->shard_size, dec->inverse[index * n + j], longest);
+        }
+        size = fec_get16(dec->out);
+        if (size + 2 <= longest) {
+            dec->recovered++;
+            emit(p, dec->out + 2, size);
+        }
+    }
+}
+
+bool fec_decoder_decode(struct fec_decoder *dec, const uint8_t *datagram, size_t len, fec_emit_cb emit, void *p) {
+    struct fec_group *group;
+    uint32_t seqid, id;
+    unsigned int index;
+    uint16_t type;
+    const uint8_t *shard;
+    size_t shard_len;
+
+    if (len < FEC_SEQID_SIZE) {
+        return false;
+    }
+    seqid = fec_get32(datagram);
+    type = fec_get16(datagram + 4);
+    shard = datagram + FEC_SEQID_SIZE;
+    shard_len = len - FEC_SEQID_SIZE;
+    id = seqid / dec->total;
+    index = seqid % dec->total;
+    if (shard_len > dec->shard_size) {
+        return false;
+    }
+    if (type == FEC_TYPE_DATA) {
+        if (index >= dec->data || shard_len < 2 || fec_get16(shard) != shard_len - 2) {
+            return false;
+        }
+        emit(p, shard + 2, shard_len - 2);
+    } else if (type != FEC_TYPE_PARITY || index < dec->data) {
+        return false;
+    }
+
+    group = &dec->groups[id % FEC_DECODE_GROUPS];
+    if (group->used == false || group->id != id) {
+        if (group->used && (int32_t)(id - group->id) < 0) {
+            return true;  /* Later than its group. */
+        }
+        group->used = true;
+        group->done = false;
+        group->id = id;
+        group->received = 0;
+        group->data_received = 0;
+        memset(group->present, 0, dec->total);
+    }
+    if (group->done || group->present[index]) {
+        return true;
+    }
+    memcpy(group->shards + index * dec->shard_size, shard, shard_len);
+    group->lens[index] = shard_len;
+    group->present[index] = 1;
+    group->received++;
+    if (index < dec->data) {
+        group->data_received++;
+    }
+    if (group->data_received == dec->data) {
+        group->done = true;
+    } else if (group->received >= dec->data) {
+        fec_rebuild(dec, group, emit, p);
+        group->done = true;
+    }
+    return true;
+}
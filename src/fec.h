@@ -0,0 +1,53 @@
+#if !defined(__fec_h__)
+#define __fec_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Forward error correction of datagrams, Reed-Solomon over GF(2^8). Every
+ * |data| datagrams sent are followed by |parity| more, and a receiver
+ * that got any |data| of the group rebuilds those lost without a round
+ * trip. Each datagram gains a header, in little endian:
+ *
+ *    +-------+------+------+---------+
+ *    | SEQID | TYPE | SIZE | PAYLOAD |
+ *    +-------+------+------+---------+
+ *    |   4   |  2   |  2   |  SIZE   |
+ *    +-------+------+------+---------+
+ *
+ * SEQID counts the datagrams of both types, its group is SEQID divided by
+ * |data| + |parity| and its shard the remainder. A parity shard covers
+ * SIZE and PAYLOAD of the data shards zero padded to the longest, so a
+ * rebuilt one knows its size. Parity is a systematic Cauchy code, any
+ * |data| shards of a group are enough. A group cut short by a pause in
+ * traffic gets no parity. Not thread safe.
+ */
+
+#define FEC_HEADER        8
+#define FEC_MAX_SHARDS    255
+#define FEC_DECODE_GROUPS 8  /* Groups still open to a late shard. */
+
+struct fec_encoder;
+struct fec_decoder;
+
+/* Once per datagram to go out, or rebuilt and delivered. */
+typedef void(*fec_emit_cb)(void *p, const uint8_t *data, size_t len);
+
+/* NULL unless 0 < |data| and 0 < |parity| and their sum is at most
+ * FEC_MAX_SHARDS. |mtu| bounds the payloads. */
+struct fec_encoder * fec_encoder_create(unsigned int data, unsigned int parity, size_t mtu);
+void fec_encoder_release(struct fec_encoder *enc);
+/* Emits |payload| with its header, and the group's parity once it's full. */
+void fec_encoder_encode(struct fec_encoder *enc, const uint8_t *payload, size_t len, fec_emit_cb emit, void *p);
+
+struct fec_decoder * fec_decoder_create(unsigned int data, unsigned int parity, size_t mtu);
+void fec_decoder_release(struct fec_decoder *dec);
+/* Emits the payload of a data shard, and those the shard made rebuildable.
+ * false if |datagram| isn't one. */
+bool fec_decoder_decode(struct fec_decoder *dec, const uint8_t *datagram, size_t len, fec_emit_cb emit, void *p);
+/* Data shards rebuilt so far, for the statistics. */
+uint64_t fec_decoder_recovered(const struct fec_decoder *dec);
+
+#endif // !defined(__fec_h__)
@@ -0,0 +1,489 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include "flow_export.h"
+#include "dump_info.h"
+#include "common.h"
+
+#define FLOW_EXPORT_TEXT_MAX    (64 * 1024)  /* JSON lines written at once. */
+#define FLOW_IPFIX_MESSAGE_MAX  1400  /* Bytes of a datagram, under a typical path MTU. */
+#define FLOW_IPFIX_VERSION      10
+#define FLOW_IPFIX_TEMPLATE_V4  256
+#define FLOW_IPFIX_TEMPLATE_V6  257
+#define FLOW_IPFIX_VARIABLE     65535
+#define FLOW_EXPORT_PATH_MAX    104  /* Of a Unix socket, the smallest sun_path around. */
+
+enum flow_target {
+    flow_target_file,
+    flow_target_unix,
+    flow_target_ipfix,
+};
+
+struct flow_ring {
+    struct flow_exporter *fe;
+    unsigned int head;  /* Moved by the loop, */
+    unsigned int tail;  /* by the writer. */
+    uint64_t dropped;
+    struct flow_ring *next;
+    struct flow_record records[FLOW_EXPORT_RING_SLOTS];
+};
+
+struct flow_exporter {
+    enum flow_target target;
+    char path[FLOW_EXPORT_PATH_MAX];
+    FILE *file;
+    int fd;  /* The Unix or the UDP socket, -1 while not open. */
+    union sockaddr_universal collector;
+    uint32_t sequence;  /* IPFIX data records sent so far. */
+
+    struct flow_ring *rings;
+    uv_thread_t writer;
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    int stopping;
+
+    uint64_t exported;  /* Written by the writer only. */
+    uint64_t failed;
+
+    uint8_t *out;  /* The batch being put together, */
+    size_t out_len;
+    size_t out_records;  /* and the records in it. */
+    size_t set_at;  /* IPFIX, offset of the open data set's header, 0 for none. */
+    uint16_t set_template;
+};
+
+/* |value| as the inside of a JSON string. */
+static size_t flow_json_string(char *out, size_t size, const char *value) {
+    size_t len = 0;
+    for (; *value && len + 7 < size; ++value) {
+        unsigned char c = (unsigned char)*value;
+        if (c == '"' || c == '\\') {
+            out[len++] = '\\';
+            out[len++] = (char)c;
+        } else if (c < 0x20) {
+            len += (size_t)snprintf(out + len, size - len, "\\u%04x", c);
+        } else {
+            out[len++] = (char)c;
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static size_t flow_json_line(const struct flow_record *r, char *line, size_t size) {
+    char destination[sizeof(r->destination) * 6];
+    char target[INET6_ADDRSTRLEN] = { 0 };
+    char user[16] = "null";
+    int len;
+
+    flow_json_string(destination, sizeof(destination), r->destination);
+    if (r->target.addr.sa_family) {
+        universal_address_to_string(&r->target, target, sizeof(target));
+    }
+    if (r->has_user) {
+        snprintf(user, sizeof(user), "%u", (unsigned int)r->uid);
+    }
+    len = snprintf(line, size,
+        "{\"start\":%llu,\"end\":%llu,\"user\":%s,\"destination\":\"%s\",\"port\":%u,\"target\":\"%s\","
+        "\"bytes_incoming\":%llu,\"bytes_outgoing\":%llu,\"protocol\":\"%s\",\"obfs\":\"%s\"}\n",
+        (unsigned long long)r->start_ms, (unsigned long long)r->end_ms, user, destination,
+        (unsigned int)r->port, target, (unsigned long long)r->bytes_incoming,
+        (unsigned long long)r->bytes_outgoing, r->protocol, r->obfs);
+    return (len > 0 && (size_t)len < size) ? (size_t)len : 0;
+}
+
+static uint8_t * flow_put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v;
+    return p + 2;
+}
+
+static uint8_t * flow_put32(uint8_t *p, uint32_t v) {
+    p = flow_put16(p, (uint16_t)(v >> 16));
+    return flow_put16(p, (uint16_t)v);
+}
+
+static uint8_t * flow_put64(uint8_t *p, uint64_t v) {
+    p = flow_put32(p, (uint32_t)(v >> 32));
+    return flow_put32(p, (uint32_t)v);
+}
+
+/* The template set both kinds of data records refer to, sent in every message as UDP may lose any. */
+static size_t flow_ipfix_templates(uint8_t *out) {
+    static const uint16_t fields[][2] = {
+        { 152, 8 },  /* flowStartMilliseconds */
+        { 153, 8 },  /* flowEndMilliseconds */
+        { 231, 8 },  /* initiatorOctets */
+        { 232, 8 },  /* responderOctets */
+        { 0, 0 },    /* destinationIPv4Address or destinationIPv6Address */
+        { 11, 2 },   /* destinationTransportPort */
+        { 4, 1 },    /* protocolIdentifier */
+        { 371, FLOW_IPFIX_VARIABLE },  /* userName, the uid */
+    };
+    size_t count = sizeof(fields) / sizeof(fields[0]);
+    uint8_t *p = out + 4;
+    int family;
+    size_t index;
+
+    for (family = 0; family < 2; ++family) {
+        p = flow_put16(p, family ? FLOW_IPFIX_TEMPLATE_V6 : FLOW_IPFIX_TEMPLATE_V4);
+        p = flow_put16(p, (uint16_t)count);
+        for (index = 0; index < count; ++index) {
+            if (fields[index][0] == 0) {
+                p = flow_put16(p, family ? 28 : 12);
+                p = flow_put16(p, family ? 16 : 4);
+            } else {
+                p = flow_put16(p, fields[index][0]);
+                p = flow_put16(p, fields[index][1]);
+            }
+        }
+    }
+    flow_put16(out, 2);
+    flow_put16(out + 2, (uint16_t)(p - out));
+    return (size_t)(p - out);
+}
+
+static void flow_ipfix_start(struct flow_exporter *fe) {
+    fe->out_len = 16;
+    fe->out_len += flow_ipfix_templates(fe->out + fe->out_len);
+    fe->set_at = 0;
+}
+
+static void flow_ipfix_close_set(struct flow_exporter *fe) {
+    if (fe->set_at) {
+        flow_put16(fe->out + fe->set_at + 2, (uint16_t)(fe->out_len - fe->set_at));
+        fe->set_at = 0;
+    }
+}
+
+static size_t flow_ipfix_record(const struct flow_record *r, uint8_t *out, uint16_t *template_id) {
+    bool v6 = (r->target.addr.sa_family == AF_INET6);
+    uint16_t port = r->port;
+    char user[16] = "";
+    size_t user_len = 0;
+    uint8_t *p = out;
+
+    p = flow_put64(p, r->start_ms);
+    p = flow_put64(p, r->end_ms);
+    p = flow_put64(p, r->bytes_incoming);
+    p = flow_put64(p, r->bytes_outgoing);
+    if (v6) {
+        memcpy(p, &r->target.addr6.sin6_addr, 16); p += 16;
+        port = ntohs(r->target.addr6.sin6_port);
+    } else if (r->target.addr.sa_family == AF_INET) {
+        memcpy(p, &r->target.addr4.sin_addr, 4); p += 4;
+        port = ntohs(r->target.addr4.sin_port);
+    } else {
+        memset(p, 0, 4); p += 4;
+    }
+    p = flow_put16(p, port);
+    *p++ = 6;  /* TCP */
+    if (r->has_user) {
+        user_len = (size_t)snprintf(user, sizeof(user), "%u", (unsigned int)r->uid);
+    }
+    *p++ = (uint8_t)user_len;
+    memcpy(p, user, user_len); p += user_len;
+    *template_id = v6 ? FLOW_IPFIX_TEMPLATE_V6 : FLOW_IPFIX_TEMPLATE_V4;
+    return (size_t)(p - out);
+}
+
+#if !defined(_WIN32)
+static bool flow_write_all(int fd, const uint8_t *data, size_t len) {
+    while (len) {
+#if defined(MSG_NOSIGNAL)
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+#else
+        ssize_t n = write(fd, data, len);
+#endif
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n; len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool flow_unix_connect(struct flow_exporter *fe) {
+    struct sockaddr_un addr;
+    if (fe->fd >= 0) {
+        return true;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, fe->path, sizeof(addr.sun_path) - 1);
+    if ((fe->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return false;
+    }
+#if defined(SO_NOSIGPIPE)
+    {
+        int opt = 1;
+        setsockopt(fe->fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+    }
+#endif
+    if (connect(fe->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fe->fd);
+        fe->fd = -1;
+        return false;
+    }
+    return true;
+}
+#endif // !defined(_WIN32)
+
+/* Sends the batch put together, counting its records as exported or failed. */
+static void flow_flush(struct flow_exporter *fe) {
+    bool done = false;
+
+    if (fe->out_records == 0) {
+        return;
+    }
+    switch (fe->target) {
+    case flow_target_file:
+        done = fwrite(fe->out, 1, fe->out_len, fe->file) == fe->out_len && fflush(fe->file) == 0;
+        break;
+#if !defined(_WIN32)
+    case flow_target_unix:
+        done = flow_unix_connect(fe) && flow_write_all(fe->fd, fe->out, fe->out_len);
+        if (done == false && fe->fd >= 0) {
+            // The reader went away, the next batch connects again.
+            close(fe->fd);
+            fe->fd = -1;
+        }
+        break;
+    case flow_target_ipfix: {
+        uv_timeval64_t now;
+        flow_ipfix_close_set(fe);
+        uv_gettimeofday(&now);
+        flow_put16(fe->out, FLOW_IPFIX_VERSION);
+        flow_put16(fe->out + 2, (uint16_t)fe->out_len);
+        flow_put32(fe->out + 4, (uint32_t)now.tv_sec);
+        flow_put32(fe->out + 8, fe->sequence);
+        flow_put32(fe->out + 12, 0);  /* Observation domain. */
+        done = sendto(fe->fd, fe->out, fe->out_len, 0, &fe->collector.addr,
+            (fe->collector.addr.sa_family == AF_INET6) ? sizeof(fe->collector.addr6) : sizeof(fe->collector.addr4)) == (ssize_t)fe->out_len;
+        fe->sequence += (uint32_t)fe->out_records;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+    if (done) {
+        __sync_add_and_fetch(&fe->exported, fe->out_records);
+    } else {
+        __sync_add_and_fetch(&fe->failed, fe->out_records);
+    }
+    fe->out_len = 0;
+    fe->out_records = 0;
+    if (fe->target == flow_target_ipfix) {
+        flow_ipfix_start(fe);
+    }
+}
+
+static void flow_add(struct flow_exporter *fe, const struct flow_record *record) {
+    if (fe->target == flow_target_ipfix) {
+        uint8_t data[128];
+        uint16_t template_id;
+        size_t len = flow_ipfix_record(record, data, &template_id);
+        size_t need = len + ((fe->set_at && fe->set_template == template_id) ? 0 : 4);
+        if (fe->out_len + need > FLOW_IPFIX_MESSAGE_MAX) {
+            flow_flush(fe);
+            need = len + 4;
+        }
+        if (need > len) {
+            flow_ipfix_close_set(fe);
+            fe->set_at = fe->out_len;
+            fe->set_template = template_id;
+            flow_put16(fe->out + fe->out_len, template_id);
+            fe->out_len += 4;
+        }
+        memcpy(fe->out + fe->out_len, data, len);
+        fe->out_len += len;
+    } else {
+        char line[2048];
+        size_t len = flow_json_line(record, line, sizeof(line));
+        if (len == 0) {
+            __sync_add_and_fetch(&fe->failed, 1);
+            return;
+        }
+        if (fe->out_len + len > FLOW_EXPORT_TEXT_MAX) {
+            flow_flush(fe);
+        }
+        memcpy(fe->out + fe->out_len, line, len);
+        fe->out_len += len;
+    }
+    fe->out_records++;
+}
+
+/* Sends what the rings hold, returns how many records were taken. */
+static size_t flow_drain(struct flow_exporter *fe) {
+    struct flow_ring *ring;
+    size_t taken = 0;
+
+    for (ring = __atomic_load_n(&fe->rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        unsigned int tail = ring->tail;
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; ++tail, ++taken) {
+            flow_add(fe, &ring->records[tail & (FLOW_EXPORT_RING_SLOTS - 1)]);
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    flow_flush(fe);
+    return taken;
+}
+
+static void flow_writer_thread(void *arg) {
+    struct flow_exporter *fe = (struct flow_exporter *)arg;
+    for (;;) {
+        int stopping = __atomic_load_n(&fe->stopping, __ATOMIC_ACQUIRE);
+        if (flow_drain(fe) != 0) {
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+        uv_mutex_lock(&fe->lock);
+        (void)uv_cond_timedwait(&fe->cond, &fe->lock, (uint64_t)FLOW_EXPORT_FLUSH_MS * 1000000);
+        uv_mutex_unlock(&fe->lock);
+    }
+}
+
+/* Opens the file or the socket of |target|, false with the reason logged. */
+static bool flow_open(struct flow_exporter *fe, const char *target) {
+    if (strncmp(target, "file:", 5) == 0) {
+        fe->target = flow_target_file;
+        if ((fe->file = fopen(target + 5, "ab")) == NULL) {
+            pr_err("flow_export %s: %s", target + 5, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+#if !defined(_WIN32)
+    if (strncmp(target, "unix:", 5) == 0 && strlen(target + 5) < sizeof(fe->path)) {
+        fe->target = flow_target_unix;
+        strcpy(fe->path, target + 5);
+        if (flow_unix_connect(fe) == false) {
+            pr_warn("flow_export %s: %s, connecting again with the first records", fe->path, strerror(errno));
+        }
+        return true;
+    }
+    if (strncmp(target, "ipfix:", 6) == 0) {
+        struct socks5_address s5addr;
+        fe->target = flow_target_ipfix;
+        if (socks5_address_from_host_port(target + 6, &s5addr) == false ||
+            socks5_address_to_universal(&s5addr, &fe->collector) == false)
+        {
+            pr_err("flow_export %s is not ipfix:address:port", target);
+            return false;
+        }
+        if ((fe->fd = socket(fe->collector.addr.sa_family, SOCK_DGRAM, 0)) < 0) {
+            pr_err("flow_export %s: %s", target, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+#endif
+    pr_err("flow_export %s is none of file:path, unix:path or ipfix:address:port", target);
+    return false;
+}
+
+struct flow_exporter * flow_exporter_create(const char *target) {
+    struct flow_exporter *fe;
+
+    if (target == NULL) {
+        return NULL;
+    }
+    fe = (struct flow_exporter *) calloc(1, sizeof(*fe));
+    fe->fd = -1;
+    if (flow_open(fe, target) == false) {
+        free(fe);
+        return NULL;
+    }
+    fe->out = (uint8_t *) malloc(FLOW_EXPORT_TEXT_MAX);
+    if (fe->target == flow_target_ipfix) {
+        flow_ipfix_start(fe);
+    }
+    uv_mutex_init(&fe->lock);
+    uv_cond_init(&fe->cond);
+    VERIFY(0 == uv_thread_create(&fe->writer, flow_writer_thread, fe));
+    return fe;
+}
+
+void flow_exporter_destroy(struct flow_exporter *fe) {
+    struct flow_ring *ring;
+    if (fe == NULL) {
+        return;
+    }
+    __atomic_store_n(&fe->stopping, 1, __ATOMIC_RELEASE);
+    uv_cond_signal(&fe->cond);
+    uv_thread_join(&fe->writer);
+    uv_cond_destroy(&fe->cond);
+    uv_mutex_destroy(&fe->lock);
+
+    while ((ring = fe->rings) != NULL) {
+        fe->rings = ring->next;
+        free(ring);
+    }
+    if (fe->file) {
+        fclose(fe->file);
+    }
+#if !defined(_WIN32)
+    if (fe->fd >= 0) {
+        close(fe->fd);
+    }
+#endif
+    free(fe->out);
+    free(fe);
+}
+
+struct flow_ring * flow_exporter_ring(struct flow_exporter *fe) {
+    struct flow_ring *ring;
+    if (fe == NULL) {
+        return NULL;
+    }
+    ring = (struct flow_ring *) calloc(1, sizeof(*ring));
+    ring->fe = fe;
+    do {
+        ring->next = fe->rings;
+    } while (!__sync_bool_compare_and_swap(&fe->rings, ring->next, ring));
+    return ring;
+}
+
+void flow_exporter_get_stats(struct flow_exporter *fe, struct flow_export_stats *stats) {
+    struct flow_ring *ring;
+    memset(stats, 0, sizeof(*stats));
+    if (fe == NULL) {
+        return;
+    }
+    stats->exported = __sync_add_and_fetch(&fe->exported, 0);
+    stats->failed = __sync_add_and_fetch(&fe->failed, 0);
+    for (ring = __atomic_load_n(&fe->rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+}
+
+void flow_ring_record(struct flow_ring *ring, const struct flow_record *record) {
+    unsigned int head, tail;
+    if (ring == NULL) {
+        return;
+    }
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= FLOW_EXPORT_RING_SLOTS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring->records[head & (FLOW_EXPORT_RING_SLOTS - 1)] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    if (head + 1 - tail == FLOW_EXPORT_BATCH) {
+        uv_cond_signal(&ring->fe->cond);
+    }
+}
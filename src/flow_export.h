@@ -0,0 +1,61 @@
+#if !defined(__flow_export_h__)
+#define __flow_export_h__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sockaddr_universal.h"
+
+/*
+ * A record of every closed tunnel for accounting. A loop copies the
+ * record into a ring of its own and goes on, a background thread batches
+ * what the rings hold to the target of flow_export, sent every
+ * FLOW_EXPORT_FLUSH_MS or sooner once a ring holds FLOW_EXPORT_BATCH:
+ *
+ *   file:/path           JSON lines appended to the file
+ *   unix:/path           JSON lines to a Unix stream socket, reconnected as needed
+ *   ipfix:host:port      IPFIX (RFC 7011) over UDP, the templates in every message
+ *
+ * A full ring drops the record and counts it, a loop never waits on the
+ * target. Records that fail to go out are counted as failed.
+ */
+
+#define FLOW_EXPORT_RING_SLOTS   1024  /* Per loop, a power of two. */
+#define FLOW_EXPORT_BATCH        64
+#define FLOW_EXPORT_FLUSH_MS     1000
+#define FLOW_EXPORT_NAME_MAX     32
+
+struct flow_exporter;
+struct flow_ring;
+
+struct flow_record {
+    uint64_t start_ms;  /* Unix time. */
+    uint64_t end_ms;
+    uint64_t bytes_incoming;  /* From the client. */
+    uint64_t bytes_outgoing;  /* From the target. */
+    union sockaddr_universal target;  /* Connected to, port included. Family 0 when it never got that far. */
+    uint16_t port;  /* As the client named it. */
+    bool has_user;
+    uint32_t uid;
+    char destination[0x0100];  /* As the client named it, host or address, empty before it did. */
+    char protocol[FLOW_EXPORT_NAME_MAX];
+    char obfs[FLOW_EXPORT_NAME_MAX];
+};
+
+struct flow_export_stats {
+    uint64_t exported;
+    uint64_t dropped;  /* Found a full ring. */
+    uint64_t failed;  /* Lost writing to the target. */
+};
+
+/* Starts the writer thread. NULL, with the reason logged, for a |target| it can't use. */
+struct flow_exporter * flow_exporter_create(const char *target);
+/* Once the loops are gone, writes what the rings still hold and frees them. */
+void flow_exporter_destroy(struct flow_exporter *fe);
+/* A ring for the loop that will call flow_ring_record() with it, freed with |fe|. */
+struct flow_ring * flow_exporter_ring(struct flow_exporter *fe);
+void flow_exporter_get_stats(struct flow_exporter *fe, struct flow_export_stats *stats);
+
+/* Queues a copy of |record|, dropped when the ring is full. */
+void flow_ring_record(struct flow_ring *ring, const struct flow_record *record);
+
+#endif // !defined(__flow_export_h__)
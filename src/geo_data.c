@@ -0,0 +1,893 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "geo_data.h"
+#include "ssrutils.h"
+
+#define MMDB_METADATA_MARKER     "\xab\xcd\xefMaxMind.com"
+#define MMDB_METADATA_MAX        (128 * 1024)  /* From the end of the file, where the marker is looked for. */
+#define MMDB_DATA_SEPARATOR      16
+#define MMDB_MAX_DEPTH           32
+#define MMDB_BAD                 SIZE_MAX
+
+#define GEOSITE_BYTE_ORDER       0x01020304
+
+enum mmdb_type {
+    mmdb_extended = 0,
+    mmdb_pointer = 1,
+    mmdb_utf8 = 2,
+    mmdb_double = 3,
+    mmdb_bytes = 4,
+    mmdb_uint16 = 5,
+    mmdb_uint32 = 6,
+    mmdb_map = 7,
+    mmdb_int32 = 8,
+    mmdb_uint64 = 9,
+    mmdb_uint128 = 10,
+    mmdb_array = 11,
+    mmdb_container = 12,
+    mmdb_end_marker = 13,
+    mmdb_boolean = 14,
+    mmdb_float = 15,
+};
+
+/* A field of the data section, or of the metadata. */
+struct mmdb_section {
+    const uint8_t *base;
+    size_t size;
+};
+
+struct mmdb_value {
+    int type;
+    size_t size;  /* Bytes of a scalar, pairs of a map, items of an array. */
+    size_t payload;  /* Offset of what follows the control bytes. */
+};
+
+struct geoip_db {
+    void *map;
+    size_t map_size;
+    uint32_t node_count;
+    unsigned int record_size;  /* Bits, 24, 28 or 32. */
+    unsigned int ip_version;
+    uint32_t ipv4_start;  /* The node of ::/96 in an IPv6 tree. */
+    struct mmdb_section data;
+};
+
+struct geosite_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t count;
+    uint64_t size;
+};
+
+struct geosite_category {
+    uint64_t name;  /* Offsets of strings, or of arrays of them. */
+    uint64_t full_offset;
+    uint64_t full_count;
+    uint64_t domain_offset;
+    uint64_t domain_count;
+    uint64_t keyword_offset;
+    uint64_t keyword_count;
+};
+
+struct geosite_db {
+    void *map;
+    size_t map_size;
+    const struct geosite_category *categories;
+    uint32_t count;
+};
+
+static void * map_file(const char *path, size_t *size) {
+    void *map = NULL;
+#if defined(_WIN32)
+    FILE *f = fopen(path, "rb");
+    long len;
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        map = malloc((size_t)len);
+        if (map != NULL && fread(map, 1, (size_t)len, f) != (size_t)len) {
+            free(map);
+            map = NULL;
+        }
+        *size = (size_t)len;
+    }
+    fclose(f);
+#else
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        map = (map == MAP_FAILED) ? NULL : map;
+        *size = (size_t)st.st_size;
+    }
+    close(fd);
+#endif
+    return map;
+}
+
+static void unmap_file(void *map, size_t size) {
+    if (map == NULL) {
+        return;
+    }
+#if defined(_WIN32)
+    (void)size;
+    free(map);
+#else
+    munmap(map, size);
+#endif
+}
+
+/* The value at |offset| of |s|, a pointer followed when |follow|. Returns the offset past it, MMDB_BAD if it's broken. */
+static size_t mmdb_read(const struct mmdb_section *s, size_t offset, struct mmdb_value *v, int follow) {
+    const uint8_t *p = s->base;
+    size_t size;
+    uint8_t ctrl;
+    int type;
+
+    if (offset >= s->size) {
+        return MMDB_BAD;
+    }
+    ctrl = p[offset++];
+    type = ctrl >> 5;
+    if (type == mmdb_pointer) {
+        size_t bytes = ((ctrl >> 3) & 3) + 1, target = 0, i;
+        static const size_t bias[4] = { 0, 2048, 526336, 0 };
+        if (offset + bytes > s->size) {
+            return MMDB_BAD;
+        }
+        target = (bytes == 4) ? 0 : (ctrl & 7);
+        for (i = 0; i < bytes; ++i) {
+            target = (target << 8) | p[offset + i];
+        }
+        target += bias[bytes - 1];
+        if (follow) {
+            // A pointer to a pointer is not valid.
+            if (target >= s->size || (p[target] >> 5) == mmdb_pointer || mmdb_read(s, target, v, 0) == MMDB_BAD) {
+                return MMDB_BAD;
+            }
+        } else {
+            v->type = mmdb_pointer;
+            v->size = 0;
+            v->payload = target;
+        }
+        return offset + bytes;
+    }
+    if (type == mmdb_extended) {
+        if (offset >= s->size) {
+            return MMDB_BAD;
+        }
+        type = 7 + p[offset++];
+    }
+    size = ctrl & 0x1f;
+    if (size >= 29) {
+        size_t bytes = size - 28, extra = 0, i;
+        static const size_t bias[4] = { 0, 29, 285, 65821 };
+        if (offset + bytes > s->size) {
+            return MMDB_BAD;
+        }
+        for (i = 0; i < bytes; ++i) {
+            extra = (extra << 8) | p[offset + i];
+        }
+        size = bias[bytes] + extra;
+        offset += bytes;
+    }
+    v->type = type;
+    v->size = size;
+    v->payload = offset;
+    switch (type) {
+    case mmdb_map:
+    case mmdb_array:
+    case mmdb_boolean:
+        return offset;  /* Maps and arrays are walked by their reader. */
+    case mmdb_double:
+        size = 8;
+        break;
+    case mmdb_float:
+        size = 4;
+        break;
+    default:
+        break;
+    }
+    return (size <= s->size - offset) ? offset + size : MMDB_BAD;
+}
+
+/* The offset past the value at |offset|, pointed to things left where they are. */
+static size_t mmdb_skip(const struct mmdb_section *s, size_t offset, int depth) {
+    struct mmdb_value v;
+    size_t next = mmdb_read(s, offset, &v, 0), i;
+
+    if (next == MMDB_BAD || depth > MMDB_MAX_DEPTH) {
+        return MMDB_BAD;
+    }
+    if (v.type == mmdb_map || v.type == mmdb_array) {
+        size_t items = (v.type == mmdb_map) ? v.size * 2 : v.size;
+        for (i = 0; i < items && next != MMDB_BAD; ++i) {
+            next = mmdb_skip(s, next, depth + 1);
+        }
+    }
+    return next;
+}
+
+/* The offset of the value of |key| in the map at |offset|, MMDB_BAD when it has none. */
+static size_t mmdb_map_get(const struct mmdb_section *s, size_t offset, const char *key) {
+    size_t key_len = strlen(key), i, next;
+    struct mmdb_value map, k;
+
+    if (mmdb_read(s, offset, &map, 1) == MMDB_BAD || map.type != mmdb_map) {
+        return MMDB_BAD;
+    }
+    next = map.payload;
+    for (i = 0; i < map.size; ++i) {
+        size_t value = mmdb_read(s, next, &k, 1);
+        if (value == MMDB_BAD || k.type != mmdb_utf8) {
+            return MMDB_BAD;
+        }
+        if (k.size == key_len && memcmp(s->base + k.payload, key, key_len) == 0) {
+            return value;
+        }
+        next = mmdb_skip(s, value, 0);
+        if (next == MMDB_BAD) {
+            return MMDB_BAD;
+        }
+    }
+    return MMDB_BAD;
+}
+
+static bool mmdb_unsigned(const struct mmdb_section *s, size_t offset, uint64_t *result) {
+    struct mmdb_value v;
+    size_t i;
+
+    if (offset == MMDB_BAD || mmdb_read(s, offset, &v, 1) == MMDB_BAD
+        || (v.type != mmdb_uint16 && v.type != mmdb_uint32 && v.type != mmdb_uint64) || v.size > 8) {
+        return false;
+    }
+    *result = 0;
+    for (i = 0; i < v.size; ++i) {
+        *result = (*result << 8) | s->base[v.payload + i];
+    }
+    return true;
+}
+
+static uint32_t mmdb_record(const struct geoip_db *db, uint32_t node, int bit) {
+    const uint8_t *p = (const uint8_t *)db->map + (size_t)node * db->record_size / 4;
+
+    switch (db->record_size) {
+    case 24:
+        p += bit ? 3 : 0;
+        return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    case 28:
+        if (bit) {
+            return ((uint32_t)(p[3] & 0x0f) << 24) | ((uint32_t)p[4] << 16) | ((uint32_t)p[5] << 8) | p[6];
+        }
+        return ((uint32_t)(p[3] & 0xf0) << 20) | ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    default:
+        p += bit ? 4 : 0;
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+}
+
+struct geoip_db * geoip_db_open(const char *path) {
+    static const char marker[] = MMDB_METADATA_MARKER;
+    size_t marker_len = sizeof(marker) - 1, at, tree_size;
+    struct mmdb_section meta;
+    struct geoip_db *db;
+    uint64_t value;
+    size_t i;
+
+    db = (struct geoip_db *) calloc(1, sizeof(*db));
+    if (db == NULL) {
+        return NULL;
+    }
+    db->map = map_file(path, &db->map_size);
+    if (db->map == NULL) {
+        LOGE("geoip %s: can't read it", path);
+        free(db);
+        return NULL;
+    }
+    // The metadata follows the last marker.
+    at = MMDB_BAD;
+    for (i = db->map_size >= marker_len ? db->map_size - marker_len + 1 : 0; i-- > 0 && db->map_size - i <= MMDB_METADATA_MAX; ) {
+        if (memcmp((const uint8_t *)db->map + i, marker, marker_len) == 0) {
+            at = i;
+            break;
+        }
+    }
+    if (at == MMDB_BAD) {
+        LOGE("geoip %s: not a MaxMind DB", path);
+        geoip_db_close(db);
+        return NULL;
+    }
+    meta.base = (const uint8_t *)db->map + at + marker_len;
+    meta.size = db->map_size - at - marker_len;
+    if (!mmdb_unsigned(&meta, mmdb_map_get(&meta, 0, "node_count"), &value) || value >= UINT32_MAX) {
+        goto invalid;
+    }
+    db->node_count = (uint32_t)value;
+    if (!mmdb_unsigned(&meta, mmdb_map_get(&meta, 0, "record_size"), &value) || (value != 24 && value != 28 && value != 32)) {
+        goto invalid;
+    }
+    db->record_size = (unsigned int)value;
+    if (!mmdb_unsigned(&meta, mmdb_map_get(&meta, 0, "ip_version"), &value) || (value != 4 && value != 6)) {
+        goto invalid;
+    }
+    db->ip_version = (unsigned int)value;
+    tree_size = (size_t)db->node_count * db->record_size / 4;
+    if (tree_size + MMDB_DATA_SEPARATOR > at) {
+        goto invalid;
+    }
+    db->data.base = (const uint8_t *)db->map + tree_size + MMDB_DATA_SEPARATOR;
+    db->data.size = at - tree_size - MMDB_DATA_SEPARATOR;
+    if (db->ip_version == 6) {
+        uint32_t node = 0;
+        for (i = 0; i < 96 && node < db->node_count; ++i) {
+            node = mmdb_record(db, node, 0);
+        }
+        db->ipv4_start = node;
+    }
+    return db;
+
+invalid:
+    LOGE("geoip %s: broken MaxMind DB metadata", path);
+    geoip_db_close(db);
+    return NULL;
+}
+
+void geoip_db_close(struct geoip_db *db) {
+    if (db == NULL) {
+        return;
+    }
+    unmap_file(db->map, db->map_size);
+    free(db);
+}
+
+bool geoip_db_country(const struct geoip_db *db, int version, const uint8_t *addr, char code[3]) {
+    static const char *const paths[] = { "country", "registered_country" };
+    uint32_t node;
+    size_t record, i, bits;
+
+    if (db == NULL || (version == 6 && db->ip_version == 4)) {
+        return false;
+    }
+    node = (version == 4) ? db->ipv4_start : 0;
+    bits = (version == 4) ? 32 : 128;
+    for (i = 0; i < bits && node < db->node_count; ++i) {
+        node = mmdb_record(db, node, (addr[i >> 3] >> (7 - (i & 7))) & 1);
+    }
+    if (node <= db->node_count) {
+        return false;  /* Not in the tree, or ran out of bits. */
+    }
+    record = (size_t)(node - db->node_count) - MMDB_DATA_SEPARATOR;
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+        size_t country = mmdb_map_get(&db->data, record, paths[i]);
+        struct mmdb_value v;
+        if (country == MMDB_BAD) {
+            continue;
+        }
+        country = mmdb_map_get(&db->data, country, "iso_code");
+        if (country != MMDB_BAD && mmdb_read(&db->data, country, &v, 1) != MMDB_BAD
+            && v.type == mmdb_utf8 && v.size == 2) {
+            code[0] = (char)toupper(db->data.base[v.payload]);
+            code[1] = (char)toupper(db->data.base[v.payload + 1]);
+            code[2] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool geosite_string(const uint8_t *base, size_t size, uint64_t offset) {
+    return offset >= sizeof(struct geosite_header) && offset < size
+           && memchr(base + offset, '\0', size - (size_t)offset) != NULL;
+}
+
+static bool geosite_strings(const uint8_t *base, size_t size, uint64_t offset, uint64_t count) {
+    const uint64_t *strings = (const uint64_t *)(base + offset);
+    uint64_t i;
+
+    if (offset % 8 != 0 || offset > size || count > (size - offset) / sizeof(uint64_t)) {
+        return false;
+    }
+    for (i = 0; i < count; ++i) {
+        if (!geosite_string(base, size, strings[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct geosite_db * geosite_db_open(const char *path) {
+    const struct geosite_header *header;
+    struct geosite_db *db;
+    const uint8_t *base;
+    uint32_t i;
+
+    db = (struct geosite_db *) calloc(1, sizeof(*db));
+    if (db == NULL) {
+        return NULL;
+    }
+    db->map = map_file(path, &db->map_size);
+    if (db->map == NULL) {
+        LOGE("geosite %s: can't read it", path);
+        free(db);
+        return NULL;
+    }
+    base = (const uint8_t *)db->map;
+    header = (const struct geosite_header *)base;
+    if (db->map_size < sizeof(*header) || memcmp(header->magic, GEOSITE_MAGIC, sizeof(header->magic)) != 0
+        || header->byte_order != GEOSITE_BYTE_ORDER || header->size != db->map_size
+        || header->count > (db->map_size - sizeof(*header)) / sizeof(struct geosite_category)) {
+        goto invalid;
+    }
+    db->categories = (const struct geosite_category *)(base + sizeof(*header));
+    db->count = header->count;
+    // Every offset is checked once here, lookups trust them.
+    for (i = 0; i < db->count; ++i) {
+        const struct geosite_category *c = &db->categories[i];
+        if (!geosite_string(base, db->map_size, c->name)
+            || !geosite_strings(base, db->map_size, c->full_offset, c->full_count)
+            || !geosite_strings(base, db->map_size, c->domain_offset, c->domain_count)
+            || !geosite_strings(base, db->map_size, c->keyword_offset, c->keyword_count)) {
+            goto invalid;
+        }
+    }
+    return db;
+
+invalid:
+    LOGE("geosite %s: not made by geosite_compile(), or broken", path);
+    geosite_db_close(db);
+    return NULL;
+}
+
+void geosite_db_close(struct geosite_db *db) {
+    if (db == NULL) {
+        return;
+    }
+    unmap_file(db->map, db->map_size);
+    free(db);
+}
+
+static const char * geosite_at(const struct geosite_db *db, uint64_t offset) {
+    return (const char *)db->map + offset;
+}
+
+static int strcmp_lower(const char *a, const char *b) {
+    while (*a && tolower((unsigned char)*a) == *b) {
+        a++;
+        b++;
+    }
+    return tolower((unsigned char)*a) - (unsigned char)*b;
+}
+
+int geosite_db_category(const struct geosite_db *db, const char *name) {
+    uint32_t low = 0, high;
+
+    if (db == NULL) {
+        return -1;
+    }
+    high = db->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        int order = strcmp_lower(name, geosite_at(db, db->categories[mid].name));
+        if (order == 0) {
+            return (int)mid;
+        }
+        if (order < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return -1;
+}
+
+/* |name| of |len| bytes among the sorted strings at |offset|. */
+static bool geosite_find(const struct geosite_db *db, uint64_t offset, uint64_t count, const char *name, size_t len) {
+    const uint64_t *strings = (const uint64_t *)((const uint8_t *)db->map + offset);
+    uint64_t low = 0, high = count;
+
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        const char *s = geosite_at(db, strings[mid]);
+        int order = strncmp(name, s, len);
+        if (order == 0) {
+            order = (s[len] == '\0') ? 0 : -1;
+        }
+        if (order == 0) {
+            return true;
+        }
+        if (order < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return false;
+}
+
+bool geosite_db_match(const struct geosite_db *db, int category, const char *host, size_t host_len) {
+    const struct geosite_category *c;
+    size_t at;
+    uint64_t i;
+
+    if (db == NULL || category < 0 || (uint32_t)category >= db->count) {
+        return false;
+    }
+    c = &db->categories[category];
+    if (geosite_find(db, c->full_offset, c->full_count, host, host_len)) {
+        return true;
+    }
+    // The host itself, then each parent domain.
+    for (at = 0; at < host_len; ++at) {
+        if ((at == 0 || host[at - 1] == '.')
+            && geosite_find(db, c->domain_offset, c->domain_count, host + at, host_len - at)) {
+            return true;
+        }
+    }
+    for (i = 0; i < c->keyword_count; ++i) {
+        const uint64_t *strings = (const uint64_t *)((const uint8_t *)db->map + c->keyword_offset);
+        if (strstr(host, geosite_at(db, strings[i])) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * geosite.dat is a protobuf GeoSiteList: GeoSite entry = 1, each with
+ * string country_code = 1 and Domain domain = 2, each with Type type = 1
+ * and string value = 2.
+ */
+enum geosite_domain_type {
+    geosite_plain = 0,  /* A keyword. */
+    geosite_regex = 1,
+    geosite_domain = 2,
+    geosite_full = 3,
+};
+
+struct pb_field {
+    uint32_t number;
+    uint32_t wire;
+    uint64_t value;  /* A varint, or the length of |data|. */
+    const uint8_t *data;
+};
+
+static bool pb_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    unsigned int shift = 0;
+    *value = 0;
+    while (*p < end && shift < 64) {
+        uint8_t byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+static bool pb_next(const uint8_t **p, const uint8_t *end, struct pb_field *field) {
+    uint64_t key;
+
+    if (!pb_varint(p, end, &key)) {
+        return false;
+    }
+    field->number = (uint32_t)(key >> 3);
+    field->wire = (uint32_t)(key & 7);
+    field->data = NULL;
+    switch (field->wire) {
+    case 0:
+        return pb_varint(p, end, &field->value);
+    case 1:
+    case 5:
+        field->value = (field->wire == 1) ? 8 : 4;
+        break;
+    case 2:
+        if (!pb_varint(p, end, &field->value)) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+    if (field->value > (uint64_t)(end - *p)) {
+        return false;
+    }
+    field->data = *p;
+    *p += field->value;
+    return true;
+}
+
+struct geosite_name {
+    const uint8_t *data;
+    size_t len;
+};
+
+struct geosite_list {
+    struct geosite_name *names;
+    size_t count;
+    size_t capacity;
+};
+
+struct geosite_source {
+    struct geosite_name name;
+    struct geosite_list lists[3];  /* Full, domain and keyword. */
+};
+
+static int geosite_name_compare(const void *a, const void *b) {
+    const struct geosite_name *x = (const struct geosite_name *)a, *y = (const struct geosite_name *)b;
+    size_t i, len = (x->len < y->len) ? x->len : y->len;
+    // As strcmp() of the lower case strings, what the lookups search with.
+    for (i = 0; i < len; ++i) {
+        int order = tolower(x->data[i]) - tolower(y->data[i]);
+        if (order != 0) {
+            return order;
+        }
+    }
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+static int geosite_source_compare(const void *a, const void *b) {
+    return geosite_name_compare(&((const struct geosite_source *)a)->name, &((const struct geosite_source *)b)->name);
+}
+
+static bool geosite_list_add(struct geosite_list *list, const uint8_t *data, size_t len) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        struct geosite_name *names = (struct geosite_name *) realloc(list->names, capacity * sizeof(*names));
+        if (names == NULL) {
+            return false;
+        }
+        list->names = names;
+        list->capacity = capacity;
+    }
+    list->names[list->count].data = data;
+    list->names[list->count].len = len;
+    list->count++;
+    return true;
+}
+
+/* Reads one GeoSite into |source|, false if it's malformed. */
+static bool geosite_parse_site(const uint8_t *p, const uint8_t *end, struct geosite_source *source, size_t *regexes) {
+    struct pb_field field;
+
+    while (p < end) {
+        const uint8_t *q, *q_end;
+        uint64_t type = geosite_plain;
+        struct geosite_name value = { NULL, 0 };
+        int list;
+
+        if (!pb_next(&p, end, &field)) {
+            return false;
+        }
+        if (field.number == 1 && field.wire == 2) {
+            source->name.data = field.data;
+            source->name.len = (size_t)field.value;
+            continue;
+        }
+        if (field.number != 2 || field.wire != 2) {
+            continue;
+        }
+        for (q = field.data, q_end = field.data + field.value; q < q_end; ) {
+            struct pb_field inner;
+            if (!pb_next(&q, q_end, &inner)) {
+                return false;
+            }
+            if (inner.number == 1 && inner.wire == 0) {
+                type = inner.value;
+            } else if (inner.number == 2 && inner.wire == 2) {
+                value.data = inner.data;
+                value.len = (size_t)inner.value;
+            }
+        }
+        switch (type) {
+        case geosite_full:
+            list = 0;
+            break;
+        case geosite_domain:
+            list = 1;
+            break;
+        case geosite_plain:
+            list = 2;
+            break;
+        default:
+            (*regexes)++;
+            continue;
+        }
+        if (value.len > 0 && memchr(value.data, '\0', value.len) == NULL
+            && !geosite_list_add(&source->lists[list], value.data, value.len)) {
+            return false;
+        }
+    }
+    return source->name.len > 0;
+}
+
+struct geosite_writer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* Offset of |len| bytes, |data| or zeroes, at the next multiple of |align|; 0 when out of memory. */
+static uint64_t geosite_put(struct geosite_writer *w, const void *data, size_t len, size_t align) {
+    size_t offset = (w->size + align - 1) / align * align;
+
+    if (offset + len > w->capacity) {
+        size_t capacity = w->capacity ? w->capacity : 4096;
+        uint8_t *grown;
+        while (capacity < offset + len) {
+            capacity *= 2;
+        }
+        grown = (uint8_t *) realloc(w->data, capacity);
+        if (grown == NULL) {
+            return 0;
+        }
+        w->data = grown;
+        w->capacity = capacity;
+    }
+    memset(w->data + w->size, 0, offset - w->size);
+    if (data != NULL) {
+        memcpy(w->data + offset, data, len);
+    } else {
+        memset(w->data + offset, 0, len);
+    }
+    w->size = offset + len;
+    return offset;
+}
+
+/* A lower case, NUL-terminated copy of |name|. */
+static uint64_t geosite_put_name(struct geosite_writer *w, const struct geosite_name *name) {
+    uint64_t offset = geosite_put(w, NULL, name->len + 1, 1);
+    size_t i;
+    if (offset != 0) {
+        for (i = 0; i < name->len; ++i) {
+            w->data[offset + i] = (uint8_t)tolower(name->data[i]);
+        }
+    }
+    return offset;
+}
+
+/* The strings of |list| sorted, then the array of their offsets, whose offset is returned. */
+static uint64_t geosite_put_list(struct geosite_writer *w, struct geosite_list *list) {
+    uint64_t *offsets, array;
+    size_t i, unique = 0;
+
+    if (list->count > 1) {
+        qsort(list->names, list->count, sizeof(list->names[0]), geosite_name_compare);
+    }
+    offsets = (uint64_t *) malloc((list->count + 1) * sizeof(*offsets));
+    if (offsets == NULL) {
+        return 0;
+    }
+    for (i = 0; i < list->count; ++i) {
+        if (unique > 0 && geosite_name_compare(&list->names[unique - 1], &list->names[i]) == 0) {
+            continue;
+        }
+        list->names[unique] = list->names[i];
+        offsets[unique] = geosite_put_name(w, &list->names[i]);
+        if (offsets[unique++] == 0) {
+            free(offsets);
+            return 0;
+        }
+    }
+    list->count = unique;
+    array = geosite_put(w, offsets, unique * sizeof(*offsets), 8);
+    free(offsets);
+    return array;
+}
+
+static int geosite_write(struct geosite_source *sources, size_t count, FILE *f) {
+    struct geosite_writer w = { NULL, 0, 0 };
+    struct geosite_header header;
+    uint64_t categories;
+    size_t i;
+    int ok = 1;
+
+    geosite_put(&w, NULL, sizeof(header), 8);
+    categories = geosite_put(&w, NULL, count * sizeof(struct geosite_category), 8);
+    if (w.data == NULL || categories == 0) {
+        free(w.data);
+        return -1;
+    }
+    for (i = 0; i < count && ok; ++i) {
+        struct geosite_category c;
+        memset(&c, 0, sizeof(c));
+        c.name = geosite_put_name(&w, &sources[i].name);
+        c.full_offset = geosite_put_list(&w, &sources[i].lists[0]);
+        c.full_count = sources[i].lists[0].count;
+        c.domain_offset = geosite_put_list(&w, &sources[i].lists[1]);
+        c.domain_count = sources[i].lists[1].count;
+        c.keyword_offset = geosite_put_list(&w, &sources[i].lists[2]);
+        c.keyword_count = sources[i].lists[2].count;
+        ok = (c.name && c.full_offset && c.domain_offset && c.keyword_offset);
+        // The buffer may have moved, address the record by offset.
+        memcpy(w.data + categories + i * sizeof(c), &c, sizeof(c));
+    }
+    if (ok) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, GEOSITE_MAGIC, sizeof(header.magic));
+        header.byte_order = GEOSITE_BYTE_ORDER;
+        header.count = (uint32_t)count;
+        header.size = w.size;
+        memcpy(w.data, &header, sizeof(header));
+        ok = (fwrite(w.data, 1, w.size, f) == w.size);
+    }
+    free(w.data);
+    return ok ? 0 : -1;
+}
+
+int geosite_compile(const char *path, const char *output) {
+    struct geosite_source *sources = NULL;
+    size_t count = 0, capacity = 0, regexes = 0, size = 0, i;
+    const uint8_t *p, *end;
+    void *map;
+    FILE *f;
+    int ret = -1;
+
+    map = map_file(path, &size);
+    if (map == NULL) {
+        LOGE("geosite %s: can't read it", path);
+        return -1;
+    }
+    for (p = (const uint8_t *)map, end = p + size; p < end; ) {
+        struct pb_field field;
+        if (!pb_next(&p, end, &field)) {
+            LOGE("geosite %s: not a geosite.dat", path);
+            goto done;
+        }
+        if (field.number != 1 || field.wire != 2) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t grown = capacity ? capacity * 2 : 256;
+            struct geosite_source *more = (struct geosite_source *) realloc(sources, grown * sizeof(*more));
+            if (more == NULL) {
+                goto done;
+            }
+            sources = more;
+            capacity = grown;
+        }
+        memset(&sources[count], 0, sizeof(sources[count]));
+        if (!geosite_parse_site(field.data, field.data + field.value, &sources[count++], &regexes)) {
+            LOGE("geosite %s: not a geosite.dat", path);
+            goto done;
+        }
+    }
+    qsort(sources, count, sizeof(*sources), geosite_source_compare);
+
+    f = fopen(output, "wb");
+    if (f == NULL) {
+        LOGE("Invalid output path.");
+        goto done;
+    }
+    ret = geosite_write(sources, count, f);
+    if (fclose(f) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        LOGE("Failed to write the geosite file.");
+    } else if (regexes > 0) {
+        LOGI("geosite %s: %u regex entries left out", path, (unsigned int)regexes);
+    }
+
+done:
+    for (i = 0; i < count; ++i) {
+        free(sources[i].lists[0].names);
+        free(sources[i].lists[1].names);
+        free(sources[i].lists[2].names);
+    }
+    free(sources);
+    unmap_file(map, size);
+    return ret;
+}
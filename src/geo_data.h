@@ -0,0 +1,45 @@
+#if !defined(__geo_data_h__)
+#define __geo_data_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * What the geoip: and geosite: rules of an ACL look up, read in place
+ * from a mapped file with nothing built at load.
+ *
+ * A geoip_db is a MaxMind DB (.mmdb) of countries, GeoLite2-Country or
+ * the like: a lookup walks the search tree bit by bit, then reads
+ * country.iso_code, or registered_country.iso_code, of the record found.
+ *
+ * A geosite_db is what geosite_compile() makes of a V2Ray geosite.dat:
+ * per category, sorted by name, the sorted "full:" and "domain:" names and
+ * the keywords, in host byte order like acl_compile()'s. A lookup is a
+ * binary search per label of the host. Regex entries are left out.
+ *
+ * Neither changes once open, any thread may look up.
+ */
+
+#define GEOSITE_MAGIC "SSRGEO\0\1"
+
+struct geoip_db;
+struct geosite_db;
+
+/* NULL, the reason logged, if |path| isn't a MaxMind DB. */
+struct geoip_db * geoip_db_open(const char *path);
+void geoip_db_close(struct geoip_db *db);
+/* Upper case ISO 3166 code into |code|, false when |addr| has none. |version| is 4 or 6, |addr| in network byte order. */
+bool geoip_db_country(const struct geoip_db *db, int version, const uint8_t *addr, char code[3]);
+
+struct geosite_db * geosite_db_open(const char *path);
+void geosite_db_close(struct geosite_db *db);
+/* The category |name|, case insensitive, -1 when there's none. */
+int geosite_db_category(const struct geosite_db *db, const char *name);
+/* |host| lower case. */
+bool geosite_db_match(const struct geosite_db *db, int category, const char *host, size_t host_len);
+
+/* Writes the geosite.dat at |path| as a geosite_db to |output|. */
+int geosite_compile(const char *path, const char *output);
+
+#endif // !defined(__geo_data_h__)
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include "handle_table.h"
+
+#define HANDLE_TABLE_INITIAL_SLOTS  256
+#define HANDLE_TABLE_NO_SLOT        UINT32_MAX
+
+struct handle_slot {
+    void *obj;  /* NULL while free. */
+    uint32_t generation;  /* Odd while in use, so no handle is 0. */
+    uint32_t next_free;
+};
+
+struct handle_table {
+    struct handle_slot *slots;
+    uint32_t capacity;
+    uint32_t used;  /* Slots handed out at least once. */
+    uint32_t free_head;
+};
+
+struct handle_table * handle_table_create(void) {
+    struct handle_table *table = (struct handle_table *) calloc(1, sizeof(*table));
+    if (table) {
+        table->free_head = HANDLE_TABLE_NO_SLOT;
+    }
+    return table;
+}
+
+void handle_table_destroy(struct handle_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    free(table->slots);
+    free(table);
+}
+
+handle_t handle_table_add(struct handle_table *table, void *obj) {
+    struct handle_slot *slot;
+    uint32_t index;
+
+    if (table == NULL || obj == NULL) {
+        return 0;
+    }
+    if (table->free_head != HANDLE_TABLE_NO_SLOT) {
+        index = table->free_head;
+        table->free_head = table->slots[index].next_free;
+    } else {
+        if (table->used == table->capacity) {
+            // Slots are found by index, so moving them is harmless.
+            uint32_t capacity = table->capacity ? table->capacity * 2 : HANDLE_TABLE_INITIAL_SLOTS;
+            struct handle_slot *slots;
+            if (capacity <= table->capacity || capacity == HANDLE_TABLE_NO_SLOT) {
+                return 0;
+            }
+            slots = (struct handle_slot *) realloc(table->slots, capacity * sizeof(struct handle_slot));
+            if (slots == NULL) {
+                return 0;
+            }
+            table->slots = slots;
+            table->capacity = capacity;
+        }
+        index = table->used++;
+        table->slots[index].generation = 0;
+    }
+    slot = &table->slots[index];
+    slot->obj = obj;
+    slot->generation++;
+    slot->next_free = HANDLE_TABLE_NO_SLOT;
+    return ((handle_t)slot->generation << 32) | index;
+}
+
+static struct handle_slot * handle_table_slot(const struct handle_table *table, handle_t handle) {
+    uint32_t index = (uint32_t)handle;
+    struct handle_slot *slot;
+    if (table == NULL || index >= table->used) {
+        return NULL;
+    }
+    slot = &table->slots[index];
+    return (slot->obj && slot->generation == (uint32_t)(handle >> 32)) ? slot : NULL;
+}
+
+void * handle_table_get(const struct handle_table *table, handle_t handle) {
+    struct handle_slot *slot = handle_table_slot(table, handle);
+    return slot ? slot->obj : NULL;
+}
+
+void handle_table_remove(struct handle_table *table, handle_t handle) {
+    struct handle_slot *slot = handle_table_slot(table, handle);
+    if (slot == NULL) {
+        return;
+    }
+    slot->obj = NULL;
+    slot->generation++;  // Even while free, a wrap is 2^31 reuses of one slot away.
+    slot->next_free = table->free_head;
+    table->free_head = (uint32_t)(slot - table->slots);
+}
@@ -0,0 +1,30 @@
+#if !defined(__handle_table_h__)
+#define __handle_table_h__ 1
+
+#include <stdint.h>
+
+/*
+ * Generation-indexed handles to objects of one loop. A handle is a slot
+ * number in its low 32 bits and the slot's generation in its high 32, the
+ * generation moves on when the slot is freed. Work that outlives a
+ * callback keeps the handle instead of a pointer and a reference, and
+ * handle_table_get() tells in O(1) whether the object is still there.
+ * Freed slots are reused first, the table only grows. 0 is never a
+ * handle. Not thread safe: one per uv_loop_t, a worker thread hands its
+ * handle back to the loop to look it up.
+ */
+
+typedef uint64_t handle_t;
+
+struct handle_table;
+
+struct handle_table * handle_table_create(void);
+void handle_table_destroy(struct handle_table *table);
+/* 0 if |obj| is NULL or the table can't grow. */
+handle_t handle_table_add(struct handle_table *table, void *obj);
+/* NULL once |handle| is removed, or if it never was one of |table|. */
+void * handle_table_get(const struct handle_table *table, handle_t handle);
+/* Stale handles are ignored. */
+void handle_table_remove(struct handle_table *table, handle_t handle);
+
+#endif // !defined(__handle_table_h__)
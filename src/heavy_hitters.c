@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "heavy_hitters.h"
+
+struct hh_counter {
+    struct heavy_hitter item;
+    uint32_t hash;
+    size_t heap_at;
+};
+
+struct heavy_hitters {
+    uv_mutex_t lock;
+    size_t capacity;
+    size_t count;  /* Counters in use, all of them once the stream had |capacity| keys. */
+    struct hh_counter *counters;
+    size_t *heap;  /* Of counter indexes, the smallest count first. */
+    uint32_t *index;  /* Open addressed by key hash, a counter index + 1 or 0 when free. */
+    size_t index_mask;
+};
+
+static uint32_t hh_hash(const char *key) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    while (*key) {
+        hash = (hash ^ (uint8_t)*key++) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t hh_find(const struct heavy_hitters *hh, const char *key, uint32_t hash) {
+    size_t at = hash & hh->index_mask;
+    while (hh->index[at]) {
+        const struct hh_counter *c = &hh->counters[hh->index[at] - 1];
+        if (c->hash == hash && strcmp(c->item.key, key) == 0) {
+            break;
+        }
+        at = (at + 1) & hh->index_mask;
+    }
+    return at;
+}
+
+/* Empties the slot at |at| and shifts back the entries of its run that may no longer be found. */
+static void hh_unindex(struct heavy_hitters *hh, size_t at) {
+    size_t next = at;
+    hh->index[at] = 0;
+    for (;;) {
+        size_t home;
+        next = (next + 1) & hh->index_mask;
+        if (hh->index[next] == 0) {
+            break;
+        }
+        home = hh->counters[hh->index[next] - 1].hash & hh->index_mask;
+        // Stays unless its home lies cyclically after the hole.
+        if ((next > at) ? (home <= at || home > next) : (home <= at && home > next)) {
+            hh->index[at] = hh->index[next];
+            hh->index[next] = 0;
+            at = next;
+        }
+    }
+}
+
+static void hh_heap_swap(struct heavy_hitters *hh, size_t a, size_t b) {
+    size_t counter = hh->heap[a];
+    hh->heap[a] = hh->heap[b];
+    hh->heap[b] = counter;
+    hh->counters[hh->heap[a]].heap_at = a;
+    hh->counters[hh->heap[b]].heap_at = b;
+}
+
+static uint64_t hh_heap_count(const struct heavy_hitters *hh, size_t at) {
+    return hh->counters[hh->heap[at]].item.count;
+}
+
+static void hh_sift_up(struct heavy_hitters *hh, size_t at) {
+    while (at > 0 && hh_heap_count(hh, (at - 1) / 2) > hh_heap_count(hh, at)) {
+        hh_heap_swap(hh, at, (at - 1) / 2);
+        at = (at - 1) / 2;
+    }
+}
+
+static void hh_sift_down(struct heavy_hitters *hh, size_t at) {
+    for (;;) {
+        size_t smallest = at, child = 2 * at + 1;
+        if (child < hh->count && hh_heap_count(hh, child) < hh_heap_count(hh, smallest)) {
+            smallest = child;
+        }
+        if (child + 1 < hh->count && hh_heap_count(hh, child + 1) < hh_heap_count(hh, smallest)) {
+            smallest = child + 1;
+        }
+        if (smallest == at) {
+            break;
+        }
+        hh_heap_swap(hh, at, smallest);
+        at = smallest;
+    }
+}
+
+struct heavy_hitters * heavy_hitters_create(size_t capacity) {
+    struct heavy_hitters *hh;
+    size_t slots = 1;
+
+    if (capacity == 0) {
+        return NULL;
+    }
+    while (slots < capacity * 2) {
+        slots <<= 1;
+    }
+    hh = (struct heavy_hitters *) calloc(1, sizeof(*hh));
+    hh->capacity = capacity;
+    hh->counters = (struct hh_counter *) calloc(capacity, sizeof(hh->counters[0]));
+    hh->heap = (size_t *) calloc(capacity, sizeof(hh->heap[0]));
+    hh->index = (uint32_t *) calloc(slots, sizeof(hh->index[0]));
+    hh->index_mask = slots - 1;
+    uv_mutex_init(&hh->lock);
+    return hh;
+}
+
+void heavy_hitters_destroy(struct heavy_hitters *hh) {
+    if (hh == NULL) {
+        return;
+    }
+    uv_mutex_destroy(&hh->lock);
+    free(hh->counters);
+    free(hh->heap);
+    free(hh->index);
+    free(hh);
+}
+
+static void hh_add(struct heavy_hitters *hh, const char *key, uint64_t weight, uint64_t error) {
+    char cut[HEAVY_HITTERS_KEY_MAX + 1];
+    struct hh_counter *c;
+    uint32_t hash;
+    size_t at, counter;
+
+    strncpy(cut, key, HEAVY_HITTERS_KEY_MAX);
+    cut[HEAVY_HITTERS_KEY_MAX] = '\0';
+    hash = hh_hash(cut);
+    at = hh_find(hh, cut, hash);
+
+    if (hh->index[at]) {
+        c = &hh->counters[hh->index[at] - 1];
+        c->item.count += weight;
+        c->item.error += error;
+        hh_sift_down(hh, c->heap_at);
+        return;
+    }
+    if (hh->count < hh->capacity) {
+        counter = hh->count++;
+        c = &hh->counters[counter];
+        c->item.count = weight;
+        c->item.error = error;
+        c->heap_at = counter;
+        hh->heap[counter] = counter;
+    } else {
+        // The smallest counter goes to the new key, its count the error bound.
+        uint64_t floor;
+        counter = hh->heap[0];
+        c = &hh->counters[counter];
+        hh_unindex(hh, hh_find(hh, c->item.key, c->hash));
+        at = hh_find(hh, cut, hash);
+        floor = c->item.count;
+        c->item.count = floor + weight;
+        c->item.error = floor + error;
+    }
+    memcpy(c->item.key, cut, sizeof(cut));
+    c->hash = hash;
+    hh->index[at] = (uint32_t)counter + 1;
+    hh_sift_up(hh, c->heap_at);
+    hh_sift_down(hh, c->heap_at);
+}
+
+void heavy_hitters_add(struct heavy_hitters *hh, const char *key, uint64_t weight) {
+    if (hh == NULL || key == NULL || weight == 0) {
+        return;
+    }
+    uv_mutex_lock(&hh->lock);
+    hh_add(hh, key, weight, 0);
+    uv_mutex_unlock(&hh->lock);
+}
+
+static int hh_compare(const void *a, const void *b) {
+    uint64_t x = ((const struct heavy_hitter *)a)->count;
+    uint64_t y = ((const struct heavy_hitter *)b)->count;
+    return (x < y) - (x > y);
+}
+
+size_t heavy_hitters_snapshot(struct heavy_hitters *hh, struct heavy_hitter *out, size_t max) {
+    struct heavy_hitter *items;
+    size_t index, count;
+    if (hh == NULL || out == NULL || max == 0) {
+        return 0;
+    }
+    items = (struct heavy_hitter *) calloc(hh->capacity, sizeof(items[0]));
+    uv_mutex_lock(&hh->lock);
+    count = hh->count;
+    for (index = 0; index < count; ++index) {
+        items[index] = hh->counters[index].item;
+    }
+    uv_mutex_unlock(&hh->lock);
+    qsort(items, count, sizeof(items[0]), hh_compare);
+    count = (count < max) ? count : max;
+    memcpy(out, items, count * sizeof(items[0]));
+    free(items);
+    return count;
+}
+
+void heavy_hitters_merge(struct heavy_hitters *into, struct heavy_hitters *from) {
+    struct heavy_hitter *items;
+    size_t count, index;
+    if (into == NULL || from == NULL || into == from) {
+        return;
+    }
+    // Copied out first, the two locks are never held together.
+    items = (struct heavy_hitter *) calloc(from->capacity, sizeof(items[0]));
+    count = heavy_hitters_snapshot(from, items, from->capacity);
+    uv_mutex_lock(&into->lock);
+    for (index = 0; index < count; ++index) {
+        hh_add(into, items[index].key, items[index].count, items[index].error);
+    }
+    uv_mutex_unlock(&into->lock);
+    free(items);
+}
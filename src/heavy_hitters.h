@@ -0,0 +1,38 @@
+#if !defined(__heavy_hitters_h__)
+#define __heavy_hitters_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The heaviest keys of a stream in fixed memory, a space-saving sketch.
+ * It holds |capacity| counters. A key already counted adds its weight, a
+ * new one takes over the smallest counter and starts from its count, which
+ * becomes the new key's error. Any key heavier than total / capacity is
+ * sure to be held, every count is over by at most its error. An index of
+ * the keys finds a counter and a min-heap the smallest one, so an update
+ * never allocates and costs at worst log2(capacity) swaps. Locked inside:
+ * a loop adds to it while the metrics scrape of another one reads it.
+ */
+
+#define HEAVY_HITTERS_KEY_MAX            255
+#define DEFAULT_HEAVY_HITTERS_CAPACITY   32
+
+struct heavy_hitters;
+
+struct heavy_hitter {
+    char key[HEAVY_HITTERS_KEY_MAX + 1];
+    uint64_t count;
+    uint64_t error;  /* At most this much of |count| may belong to keys it replaced. */
+};
+
+struct heavy_hitters * heavy_hitters_create(size_t capacity);
+void heavy_hitters_destroy(struct heavy_hitters *hh);
+/* A longer |key| is cut to HEAVY_HITTERS_KEY_MAX. */
+void heavy_hitters_add(struct heavy_hitters *hh, const char *key, uint64_t weight);
+/* Adds every counter of |from| to |into|, errors included, to sum up the loops. */
+void heavy_hitters_merge(struct heavy_hitters *into, struct heavy_hitters *from);
+/* Copies up to |max| counters to |out|, heaviest first. Returns their count. */
+size_t heavy_hitters_snapshot(struct heavy_hitters *hh, struct heavy_hitter *out, size_t max);
+
+#endif // !defined(__heavy_hitters_h__)
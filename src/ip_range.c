@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ip_range.h"
+
+struct ipv4_range {
+    uint32_t first;
+    uint32_t last;
+};
+
+struct u128 {
+    uint64_t hi;
+    uint64_t lo;
+};
+
+struct ipv6_range {
+    struct u128 first;
+    struct u128 last;
+};
+
+struct ip_range_set {
+    struct ipv4_range *v4;
+    size_t v4_count;
+    size_t v4_capacity;  /* 0 while |v4| is borrowed. */
+    bool v4_sorted;
+    struct ipv6_range *v6;
+    size_t v6_count;
+    size_t v6_capacity;
+    bool v6_sorted;
+};
+
+static bool grow(void **array, size_t *capacity, size_t count, size_t size) {
+    size_t wanted;
+    void *grown;
+    if (count < *capacity) {
+        return true;
+    }
+    wanted = *capacity ? *capacity * 2 : (count ? count * 2 : 64);
+    if (*capacity == 0 && count > 0) {
+        // A borrowed array, copied on the first change.
+        grown = malloc(wanted * size);
+        if (grown) {
+            memcpy(grown, *array, count * size);
+        }
+    } else {
+        grown = realloc(*array, wanted * size);
+    }
+    if (grown == NULL) {
+        return false;
+    }
+    *array = grown;
+    *capacity = wanted;
+    return true;
+}
+
+static uint32_t ipv4_key(const uint8_t addr[4]) {
+    return ((uint32_t)addr[0] << 24) | ((uint32_t)addr[1] << 16) | ((uint32_t)addr[2] << 8) | addr[3];
+}
+
+static struct u128 ipv6_key(const uint8_t addr[16]) {
+    struct u128 key = { 0, 0 };
+    int i;
+    for (i = 0; i < 8; ++i) {
+        key.hi = (key.hi << 8) | addr[i];
+        key.lo = (key.lo << 8) | addr[8 + i];
+    }
+    return key;
+}
+
+static int u128_cmp(struct u128 a, struct u128 b) {
+    if (a.hi != b.hi) {
+        return (a.hi < b.hi) ? -1 : 1;
+    }
+    if (a.lo != b.lo) {
+        return (a.lo < b.lo) ? -1 : 1;
+    }
+    return 0;
+}
+
+static struct u128 u128_add(struct u128 a, int64_t n) {
+    uint64_t lo = a.lo + (uint64_t)n;
+    if (n > 0 && lo < a.lo) {
+        a.hi++;
+    } else if (n < 0 && lo > a.lo) {
+        a.hi--;
+    }
+    a.lo = lo;
+    return a;
+}
+
+/* Mask of the host part of a |prefix| long network, both halves. */
+static struct u128 u128_host_mask(int prefix) {
+    struct u128 mask;
+    if (prefix <= 0) {
+        mask.hi = mask.lo = UINT64_MAX;
+    } else if (prefix < 64) {
+        mask.hi = UINT64_MAX >> prefix;
+        mask.lo = UINT64_MAX;
+    } else if (prefix < 128) {
+        mask.hi = 0;
+        mask.lo = (prefix == 64) ? UINT64_MAX : (UINT64_MAX >> (prefix - 64));
+    } else {
+        mask.hi = mask.lo = 0;
+    }
+    return mask;
+}
+
+struct ip_range_set * ip_range_set_create(void) {
+    struct ip_range_set *set = (struct ip_range_set *) calloc(1, sizeof(*set));
+    if (set) {
+        set->v4_sorted = set->v6_sorted = true;
+    }
+    return set;
+}
+
+struct ip_range_set * ip_range_set_create_static(const void *v4, size_t v4_count, const void *v6, size_t v6_count) {
+    struct ip_range_set *set = ip_range_set_create();
+    if (set) {
+        // Empty ones stay NULL, grow() would realloc() them.
+        set->v4 = v4_count ? (struct ipv4_range *)v4 : NULL;
+        set->v4_count = v4_count;
+        set->v6 = v6_count ? (struct ipv6_range *)v6 : NULL;
+        set->v6_count = v6_count;
+    }
+    return set;
+}
+
+void ip_range_set_destroy(struct ip_range_set *set) {
+    if (set == NULL) {
+        return;
+    }
+    if (set->v4_capacity) {
+        free(set->v4);
+    }
+    if (set->v6_capacity) {
+        free(set->v6);
+    }
+    free(set);
+}
+
+void ip_range_set_add_ipv4(struct ip_range_set *set, const uint8_t addr[4], int cidr) {
+    uint32_t key = ipv4_key(addr);
+    uint32_t host = (cidr < 0 || cidr >= 32) ? 0 : (cidr == 0 ? UINT32_MAX : (UINT32_MAX >> cidr));
+    struct ipv4_range *range;
+
+    if (!grow((void **)&set->v4, &set->v4_capacity, set->v4_count, sizeof(*set->v4))) {
+        return;
+    }
+    range = &set->v4[set->v4_count++];
+    range->first = key & ~host;
+    range->last = key | host;
+    set->v4_sorted = false;
+}
+
+void ip_range_set_add_ipv6(struct ip_range_set *set, const uint8_t addr[16], int cidr) {
+    struct u128 key = ipv6_key(addr);
+    struct u128 host = u128_host_mask(cidr < 0 ? 128 : cidr);
+    struct ipv6_range *range;
+
+    if (!grow((void **)&set->v6, &set->v6_capacity, set->v6_count, sizeof(*set->v6))) {
+        return;
+    }
+    range = &set->v6[set->v6_count++];
+    range->first.hi = key.hi & ~host.hi;
+    range->first.lo = key.lo & ~host.lo;
+    range->last.hi = key.hi | host.hi;
+    range->last.lo = key.lo | host.lo;
+    set->v6_sorted = false;
+}
+
+static int ipv4_range_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct ipv4_range *)a)->first;
+    uint32_t y = ((const struct ipv4_range *)b)->first;
+    return (x < y) ? -1 : (x > y);
+}
+
+static int ipv6_range_cmp(const void *a, const void *b) {
+    return u128_cmp(((const struct ipv6_range *)a)->first, ((const struct ipv6_range *)b)->first);
+}
+
+/* Sorts and joins overlapping or adjacent ranges. */
+static void ipv4_compile(struct ip_range_set *set) {
+    size_t i, n = 0;
+    if (set->v4_sorted) {
+        return;
+    }
+    qsort(set->v4, set->v4_count, sizeof(*set->v4), ipv4_range_cmp);
+    for (i = 0; i < set->v4_count; ++i) {
+        struct ipv4_range *prev = n ? &set->v4[n - 1] : NULL;
+        if (prev && (prev->last == UINT32_MAX || set->v4[i].first <= prev->last + 1)) {
+            if (set->v4[i].last > prev->last) {
+                prev->last = set->v4[i].last;
+            }
+        } else {
+            set->v4[n++] = set->v4[i];
+        }
+    }
+    set->v4_count = n;
+    set->v4_sorted = true;
+}
+
+static void ipv6_compile(struct ip_range_set *set) {
+    static const struct u128 max = { UINT64_MAX, UINT64_MAX };
+    size_t i, n = 0;
+    if (set->v6_sorted) {
+        return;
+    }
+    qsort(set->v6, set->v6_count, sizeof(*set->v6), ipv6_range_cmp);
+    for (i = 0; i < set->v6_count; ++i) {
+        struct ipv6_range *prev = n ? &set->v6[n - 1] : NULL;
+        if (prev && (u128_cmp(prev->last, max) == 0 || u128_cmp(set->v6[i].first, u128_add(prev->last, 1)) <= 0)) {
+            if (u128_cmp(set->v6[i].last, prev->last) > 0) {
+                prev->last = set->v6[i].last;
+            }
+        } else {
+            set->v6[n++] = set->v6[i];
+        }
+    }
+    set->v6_count = n;
+    set->v6_sorted = true;
+}
+
+/* Index of the range holding |key|, -1 for none. */
+static ptrdiff_t ipv4_find(const struct ip_range_set *set, uint32_t key) {
+    size_t lo = 0, hi = set->v4_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->v4[mid].last < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < set->v4_count && set->v4[lo].first <= key) ? (ptrdiff_t)lo : -1;
+}
+
+static ptrdiff_t ipv6_find(const struct ip_range_set *set, struct u128 key) {
+    size_t lo = 0, hi = set->v6_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (u128_cmp(set->v6[mid].last, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < set->v6_count && u128_cmp(set->v6[lo].first, key) <= 0) ? (ptrdiff_t)lo : -1;
+}
+
+bool ip_range_set_contains_ipv4(struct ip_range_set *set, const uint8_t addr[4]) {
+    if (set == NULL) {
+        return false;
+    }
+    ipv4_compile(set);
+    return ipv4_find(set, ipv4_key(addr)) >= 0;
+}
+
+bool ip_range_set_contains_ipv6(struct ip_range_set *set, const uint8_t addr[16]) {
+    if (set == NULL) {
+        return false;
+    }
+    ipv6_compile(set);
+    return ipv6_find(set, ipv6_key(addr)) >= 0;
+}
+
+void ip_range_set_remove_ipv4(struct ip_range_set *set, const uint8_t addr[4]) {
+    uint32_t key = ipv4_key(addr);
+    struct ipv4_range *range;
+    ptrdiff_t index;
+
+    ipv4_compile(set);
+    index = ipv4_find(set, key);
+    if (index < 0 || !grow((void **)&set->v4, &set->v4_capacity, set->v4_count, sizeof(*set->v4))) {
+        return;
+    }
+    range = &set->v4[index];
+    if (range->first == key && range->last == key) {
+        memmove(range, range + 1, (set->v4_count - (size_t)index - 1) * sizeof(*range));
+        set->v4_count--;
+    } else if (range->first == key) {
+        range->first++;
+    } else if (range->last == key) {
+        range->last--;
+    } else {
+        // Split in two, the sort order holds. grow() above left room.
+        memmove(range + 2, range + 1, (set->v4_count - (size_t)index - 1) * sizeof(*range));
+        set->v4_count++;
+        range[1].first = key + 1;
+        range[1].last = range->last;
+        range->last = key - 1;
+    }
+}
+
+void ip_range_set_remove_ipv6(struct ip_range_set *set, const uint8_t addr[16]) {
+    struct u128 key = ipv6_key(addr);
+    struct ipv6_range *range;
+    ptrdiff_t index;
+    bool at_first, at_last;
+
+    ipv6_compile(set);
+    index = ipv6_find(set, key);
+    if (index < 0 || !grow((void **)&set->v6, &set->v6_capacity, set->v6_count, sizeof(*set->v6))) {
+        return;
+    }
+    range = &set->v6[index];
+    at_first = (u128_cmp(range->first, key) == 0);
+    at_last = (u128_cmp(range->last, key) == 0);
+    if (at_first && at_last) {
+        memmove(range, range + 1, (set->v6_count - (size_t)index - 1) * sizeof(*range));
+        set->v6_count--;
+    } else if (at_first) {
+        range->first = u128_add(key, 1);
+    } else if (at_last) {
+        range->last = u128_add(key, -1);
+    } else {
+        memmove(range + 2, range + 1, (set->v6_count - (size_t)index - 1) * sizeof(*range));
+        set->v6_count++;
+        range[1].first = u128_add(key, 1);
+        range[1].last = range->last;
+        range->last = u128_add(key, -1);
+    }
+}
+
+void ip_range_set_compile(struct ip_range_set *set) {
+    if (set) {
+        ipv4_compile(set);
+        ipv6_compile(set);
+    }
+}
+
+size_t ip_range_set_ipv4(struct ip_range_set *set, const void **ranges) {
+    ipv4_compile(set);
+    *ranges = set->v4;
+    return set->v4_count;
+}
+
+size_t ip_range_set_ipv6(struct ip_range_set *set, const void **ranges) {
+    ipv6_compile(set);
+    *ranges = set->v6;
+    return set->v6_count;
+}
@@ -0,0 +1,41 @@
+#if !defined(__ip_range_h__)
+#define __ip_range_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The addresses of one ACL list as sorted, disjoint [first, last] ranges,
+ * one array per family. A lookup is a binary search over contiguous
+ * memory, where the BDD of libipset chases pointers per bit. Adding
+ * appends, the ranges are sorted and merged again on the next lookup.
+ * Addresses are in network byte order, a |cidr| of -1 is a single one.
+ */
+
+#define IP_RANGE_IPV4_SIZE 8   /* Two uint32_t, first and last. */
+#define IP_RANGE_IPV6_SIZE 32  /* Two pairs of uint64_t, high half first. */
+
+struct ip_range_set;
+
+struct ip_range_set * ip_range_set_create(void);
+/*
+ * Over the sorted arrays ip_range_set_ipv4() and ip_range_set_ipv6()
+ * handed out, e.g. mapped from a file. They are read in place and only
+ * copied once the set changes, so they must outlive it.
+ */
+struct ip_range_set * ip_range_set_create_static(const void *v4, size_t v4_count, const void *v6, size_t v6_count);
+void ip_range_set_destroy(struct ip_range_set *set);
+void ip_range_set_add_ipv4(struct ip_range_set *set, const uint8_t addr[4], int cidr);
+void ip_range_set_add_ipv6(struct ip_range_set *set, const uint8_t addr[16], int cidr);
+void ip_range_set_remove_ipv4(struct ip_range_set *set, const uint8_t addr[4]);
+void ip_range_set_remove_ipv6(struct ip_range_set *set, const uint8_t addr[16]);
+bool ip_range_set_contains_ipv4(struct ip_range_set *set, const uint8_t addr[4]);
+bool ip_range_set_contains_ipv6(struct ip_range_set *set, const uint8_t addr[16]);
+/* Sorts and merges now, lookups after it only read the set. */
+void ip_range_set_compile(struct ip_range_set *set);
+/* The ranges sorted and merged, host byte order, the count is returned. */
+size_t ip_range_set_ipv4(struct ip_range_set *set, const void **ranges);
+size_t ip_range_set_ipv6(struct ip_range_set *set, const void **ranges);
+
+#endif // !defined(__ip_range_h__)
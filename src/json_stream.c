@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_stream.h"
+
+void json_stream_init(struct json_stream *s, const char *text, size_t len) {
+    memset(s, 0, sizeof(*s));
+    s->text = text;
+    s->len = len;
+}
+
+void json_stream_free(struct json_stream *s) {
+    free(s->str);
+    s->str = NULL;
+    s->str_capacity = 0;
+}
+
+static bool json_stream_put(struct json_stream *s, const char *bytes, size_t count) {
+    if (s->str_len + count + 1 > s->str_capacity) {
+        size_t capacity = s->str_capacity ? s->str_capacity : 64;
+        char *str;
+        while (s->str_len + count + 1 > capacity) {
+            capacity *= 2;
+        }
+        str = (char *) realloc(s->str, capacity);
+        if (str == NULL) {
+            return false;
+        }
+        s->str = str;
+        s->str_capacity = capacity;
+    }
+    memcpy(s->str + s->str_len, bytes, count);
+    s->str_len += count;
+    s->str[s->str_len] = '\0';
+    return true;
+}
+
+/* Whitespace, separators and comments. */
+static void json_stream_skip_space(struct json_stream *s) {
+    while (s->pos < s->len) {
+        char c = s->text[s->pos];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',' || c == ':') {
+            s->pos++;
+        } else if (c == '/' && s->pos + 1 < s->len && s->text[s->pos + 1] == '/') {
+            while (s->pos < s->len && s->text[s->pos] != '\n') {
+                s->pos++;
+            }
+        } else if (c == '/' && s->pos + 1 < s->len && s->text[s->pos + 1] == '*') {
+            const char *end = NULL;
+            size_t at;
+            for (at = s->pos + 2; at + 1 < s->len; ++at) {
+                if (s->text[at] == '*' && s->text[at + 1] == '/') {
+                    end = s->text + at;
+                    break;
+                }
+            }
+            s->pos = end ? (size_t)(end - s->text) + 2 : s->len;
+        } else {
+            break;
+        }
+    }
+}
+
+static int json_stream_hex(const char *p) {
+    int value = 0, i;
+    for (i = 0; i < 4; ++i) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return value;
+}
+
+static bool json_stream_put_utf8(struct json_stream *s, uint32_t cp) {
+    char out[4];
+    size_t n;
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    } else {
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    return json_stream_put(s, out, n);
+}
+
+static enum json_token json_stream_string(struct json_stream *s) {
+    s->pos++;  // The opening quote.
+    s->str_len = 0;
+    if (json_stream_put(s, "", 0) == false) {
+        return json_token_error;
+    }
+    while (s->pos < s->len) {
+        size_t run = s->pos;
+        char c;
+        // Copy the plain bytes in one go, most strings have no escapes.
+        while (run < s->len && s->text[run] != '"' && s->text[run] != '\\') {
+            run++;
+        }
+        if (run > s->pos && json_stream_put(s, s->text + s->pos, run - s->pos) == false) {
+            return json_token_error;
+        }
+        s->pos = run;
+        if (s->pos >= s->len) {
+            break;
+        }
+        if (s->text[s->pos] == '"') {
+            s->pos++;
+            return json_token_string;
+        }
+        if (++s->pos >= s->len) {
+            break;
+        }
+        c = s->text[s->pos++];
+        switch (c) {
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case '"': case '\\': case '/': break;
+        case 'u':
+        {
+            int hi, lo;
+            uint32_t cp;
+            if (s->pos + 4 > s->len || (hi = json_stream_hex(s->text + s->pos)) < 0) {
+                return json_token_error;
+            }
+            s->pos += 4;
+            cp = (uint32_t)hi;
+            if (hi >= 0xD800 && hi <= 0xDBFF && s->pos + 6 <= s->len &&
+                s->text[s->pos] == '\\' && s->text[s->pos + 1] == 'u' &&
+                (lo = json_stream_hex(s->text + s->pos + 2)) >= 0xDC00 && lo <= 0xDFFF)
+            {
+                cp = 0x10000 + (((uint32_t)hi - 0xD800) << 10) + ((uint32_t)lo - 0xDC00);
+                s->pos += 6;
+            }
+            if (json_stream_put_utf8(s, cp) == false) {
+                return json_token_error;
+            }
+            continue;
+        }
+        default:
+            return json_token_error;
+        }
+        if (json_stream_put(s, &c, 1) == false) {
+            return json_token_error;
+        }
+    }
+    return json_token_error;
+}
+
+static enum json_token json_stream_word(struct json_stream *s, const char *word, enum json_token token) {
+    size_t n = strlen(word);
+    if (s->len - s->pos < n || memcmp(s->text + s->pos, word, n) != 0) {
+        return json_token_error;
+    }
+    s->pos += n;
+    return token;
+}
+
+enum json_token json_stream_next(struct json_stream *s) {
+    char c;
+    json_stream_skip_space(s);
+    s->token_start = s->pos;
+    if (s->pos >= s->len) {
+        return json_token_end;
+    }
+    c = s->text[s->pos];
+    switch (c) {
+    case '{': s->pos++; return json_token_object_begin;
+    case '}': s->pos++; return json_token_object_end;
+    case '[': s->pos++; return json_token_array_begin;
+    case ']': s->pos++; return json_token_array_end;
+    case '"': return json_stream_string(s);
+    case 't': return json_stream_word(s, "true", json_token_true);
+    case 'f': return json_stream_word(s, "false", json_token_false);
+    case 'n': return json_stream_word(s, "null", json_token_null);
+    default:
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            char number[64];
+            size_t n = 0;
+            char *end = NULL;
+            while (s->pos + n < s->len && n + 1 < sizeof(number) && strchr("+-.0123456789eE", s->text[s->pos + n])) {
+                number[n] = s->text[s->pos + n];
+                n++;
+            }
+            number[n] = '\0';
+            s->number = strtod(number, &end);
+            if (end == number) {
+                return json_token_error;
+            }
+            s->pos += (size_t)(end - number);
+            return json_token_number;
+        }
+        return json_token_error;
+    }
+}
+
+bool json_stream_skip(struct json_stream *s, enum json_token first) {
+    int depth = 0;
+    enum json_token token = first;
+    for (;;) {
+        switch (token) {
+        case json_token_object_begin:
+        case json_token_array_begin:
+            depth++;
+            break;
+        case json_token_object_end:
+        case json_token_array_end:
+            depth--;
+            break;
+        case json_token_error:
+        case json_token_end:
+            return false;
+        default:
+            break;
+        }
+        if (depth <= 0) {
+            return depth == 0;
+        }
+        token = json_stream_next(s);
+    }
+}
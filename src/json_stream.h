@@ -0,0 +1,47 @@
+#if !defined(__json_stream_h__)
+#define __json_stream_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A pull parser over JSON text in memory. Tokens are handed out as they
+ * are read and nothing is built, so a config with tens of thousands of
+ * users is loaded in one pass without a DOM. ':' and ',' are taken as
+ * separators and not checked, comments are skipped as json-c does. The
+ * last string is unescaped into a buffer of the stream, it's valid until
+ * the next token. Not thread safe: one per caller.
+ */
+
+enum json_token {
+    json_token_error,
+    json_token_end,
+    json_token_object_begin,
+    json_token_object_end,
+    json_token_array_begin,
+    json_token_array_end,
+    json_token_string,  /* A key or a value, in |str|. */
+    json_token_number,  /* In |number|. */
+    json_token_true,
+    json_token_false,
+    json_token_null,
+};
+
+struct json_stream {
+    const char *text;
+    size_t len;
+    size_t pos;
+    size_t token_start;  /* Offset of the last token's first byte. */
+    char *str;
+    size_t str_len;
+    size_t str_capacity;
+    double number;
+};
+
+void json_stream_init(struct json_stream *s, const char *text, size_t len);
+void json_stream_free(struct json_stream *s);
+enum json_token json_stream_next(struct json_stream *s);
+/* Reads past the rest of the value |first| began, false on malformed text. */
+bool json_stream_skip(struct json_stream *s, enum json_token first);
+
+#endif // !defined(__json_stream_h__)
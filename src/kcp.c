@@ -0,0 +1,537 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kcp.h"
+
+#define KCP_CMD_PUSH  81
+#define KCP_CMD_ACK   82
+#define KCP_CMD_WASK  83  /* Asks for the window. */
+#define KCP_CMD_WINS  84  /* Tells it. */
+#define KCP_CMD_RST   85
+
+#define KCP_RTO_INITIAL     200
+#define KCP_PROBE_INIT_MS   3000  /* Between asks for a closed window, growing by half. */
+#define KCP_PROBE_LIMIT_MS  120000
+
+struct kcp_segment {
+    struct kcp_segment *prev;
+    struct kcp_segment *next;
+    uint32_t sn;
+    uint32_t ts;
+    uint32_t resend_at;
+    uint32_t rto;
+    uint32_t fastack;
+    uint32_t xmit;
+    size_t len;
+    uint8_t data[1];
+};
+
+struct kcp_list {
+    struct kcp_segment *first;
+    struct kcp_segment *last;
+    size_t count;
+};
+
+struct kcp {
+    uint32_t conv;
+    size_t mtu;
+    size_t mss;
+    unsigned int snd_wnd;
+    unsigned int rcv_wnd;
+    unsigned int rmt_wnd;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    int32_t srtt;
+    int32_t rttvar;
+    uint32_t rto;
+    struct kcp_list snd_queue;  /* Not yet given a sequence number. */
+    struct kcp_list snd_buf;  /* In flight, by sequence number. */
+    struct kcp_list rcv_buf;  /* Out of order, by sequence number. */
+    struct kcp_list rcv_queue;  /* In order, for kcp_recv(). */
+    size_t rcv_offset;  /* Read of rcv_queue.first. */
+    uint32_t *acks;  /* Pairs of sn and ts owed an ACK. */
+    size_t ack_count;
+    size_t ack_capacity;
+    bool ask_window;
+    bool tell_window;
+    uint32_t probe_at;
+    uint32_t probe_wait;
+    bool dead;
+    bool reset;
+    uint64_t retransmits;
+    kcp_output_cb output;
+    void *p;
+    size_t out_len;
+    uint8_t *out;
+};
+
+static int32_t kcp_diff(uint32_t later, uint32_t earlier) {
+    return (int32_t)(later - earlier);
+}
+
+static void kcp_put16(uint8_t *ptr, uint16_t v) {
+    ptr[0] = (uint8_t)v;
+    ptr[1] = (uint8_t)(v >> 8);
+}
+
+static void kcp_put32(uint8_t *ptr, uint32_t v) {
+    ptr[0] = (uint8_t)v;
+    ptr[1] = (uint8_t)(v >> 8);
+    ptr[2] = (uint8_t)(v >> 16);
+    ptr[3] = (uint8_t)(v >> 24);
+}
+
+static uint16_t kcp_get16(const uint8_t *ptr) {
+    return (uint16_t)(ptr[0] | (ptr[1] << 8));
+}
+
+static uint32_t kcp_get32(const uint8_t *ptr) {
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static void kcp_encode(uint8_t *ptr, uint32_t conv, uint8_t cmd, uint16_t wnd, uint32_t ts, uint32_t sn, uint32_t una, uint32_t len) {
+    kcp_put32(ptr, conv);
+    ptr[4] = cmd;
+    ptr[5] = 0;
+    kcp_put16(ptr + 6, wnd);
+    kcp_put32(ptr + 8, ts);
+    kcp_put32(ptr + 12, sn);
+    kcp_put32(ptr + 16, una);
+    kcp_put32(ptr + 20, len);
+}
+
+static struct kcp_segment * kcp_segment_create(size_t capacity) {
+    return (struct kcp_segment *) calloc(1, sizeof(struct kcp_segment) + capacity);
+}
+
+/* After |pos|, or first when it's NULL. */
+static void kcp_list_insert_after(struct kcp_list *list, struct kcp_segment *pos, struct kcp_segment *seg) {
+    seg->prev = pos;
+    seg->next = pos ? pos->next : list->first;
+    if (seg->next) {
+        seg->next->prev = seg;
+    } else {
+        list->last = seg;
+    }
+    if (pos) {
+        pos->next = seg;
+    } else {
+        list->first = seg;
+    }
+    list->count++;
+}
+
+static void kcp_list_remove(struct kcp_list *list, struct kcp_segment *seg) {
+    if (seg->prev) {
+        seg->prev->next = seg->next;
+    } else {
+        list->first = seg->next;
+    }
+    if (seg->next) {
+        seg->next->prev = seg->prev;
+    } else {
+        list->last = seg->prev;
+    }
+    seg->prev = seg->next = NULL;
+    list->count--;
+}
+
+static void kcp_list_clear(struct kcp_list *list) {
+    while (list->first) {
+        struct kcp_segment *seg = list->first;
+        kcp_list_remove(list, seg);
+        free(seg);
+    }
+}
+
+struct kcp * kcp_create(uint32_t conv, size_t mtu, unsigned int window, kcp_output_cb output, void *p) {
+    struct kcp *kcp;
+
+    if (mtu <= KCP_OVERHEAD || window == 0 || window > 0xFFFF) {
+        return NULL;
+    }
+    kcp = (struct kcp *) calloc(1, sizeof(*kcp));
+    kcp->out = (uint8_t *) malloc(mtu);
+    kcp->conv = conv;
+    kcp->mtu = mtu;
+    kcp->mss = mtu - KCP_OVERHEAD;
+    kcp->snd_wnd = kcp->rcv_wnd = window;
+    kcp->rmt_wnd = window;
+    kcp->rto = KCP_RTO_INITIAL;
+    kcp->output = output;
+    kcp->p = p;
+    return kcp;
+}
+
+void kcp_release(struct kcp *kcp) {
+    if (kcp == NULL) {
+        return;
+    }
+    kcp_list_clear(&kcp->snd_queue);
+    kcp_list_clear(&kcp->snd_buf);
+    kcp_list_clear(&kcp->rcv_buf);
+    kcp_list_clear(&kcp->rcv_queue);
+    free(kcp->acks);
+    free(kcp->out);
+    free(kcp);
+}
+
+bool kcp_peek_conv(const uint8_t *data, size_t len, uint32_t *conv) {
+    if (len < KCP_OVERHEAD) {
+        return false;
+    }
+    *conv = kcp_get32(data);
+    return true;
+}
+
+bool kcp_peek_opening(const uint8_t *data, size_t len, unsigned int window) {
+    while (len >= KCP_OVERHEAD) {
+        uint32_t seglen = kcp_get32(data + 20);
+        if (data[4] == KCP_CMD_PUSH && kcp_get32(data + 12) < window) {
+            return true;
+        }
+        if (seglen > len - KCP_OVERHEAD) {
+            break;
+        }
+        data += KCP_OVERHEAD + seglen;
+        len -= KCP_OVERHEAD + seglen;
+    }
+    return false;
+}
+
+size_t kcp_build_reset(uint32_t conv, uint8_t *out, size_t size) {
+    if (size < KCP_OVERHEAD) {
+        return 0;
+    }
+    kcp_encode(out, conv, KCP_CMD_RST, 0, 0, 0, 0, 0);
+    return KCP_OVERHEAD;
+}
+
+void kcp_send(struct kcp *kcp, const uint8_t *data, size_t len) {
+    struct kcp_segment *tail = kcp->snd_queue.last;
+
+    // Stream mode, top up the last segment first.
+    if (tail && tail->len < kcp->mss) {
+        size_t room = kcp->mss - tail->len;
+        size_t chunk = len < room ? len : room;
+        memcpy(tail->data + tail->len, data, chunk);
+        tail->len += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    while (len > 0) {
+        size_t chunk = len < kcp->mss ? len : kcp->mss;
+        struct kcp_segment *seg = kcp_segment_create(kcp->mss);
+        memcpy(seg->data, data, chunk);
+        seg->len = chunk;
+        kcp_list_insert_after(&kcp->snd_queue, kcp->snd_queue.last, seg);
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+static void kcp_update_rtt(struct kcp *kcp, int32_t rtt) {
+    int32_t rto;
+    if (kcp->srtt == 0) {
+        kcp->srtt = rtt;
+        kcp->rttvar = rtt / 2;
+    } else {
+        int32_t delta = rtt > kcp->srtt ? rtt - kcp->srtt : kcp->srtt - rtt;
+        kcp->rttvar = (3 * kcp->rttvar + delta) / 4;
+        kcp->srtt = (7 * kcp->srtt + rtt) / 8;
+        if (kcp->srtt < 1) {
+            kcp->srtt = 1;
+        }
+    }
+    rto = kcp->srtt + (4 * kcp->rttvar > KCP_INTERVAL_MS ? 4 * kcp->rttvar : KCP_INTERVAL_MS);
+    if (rto < KCP_RTO_MIN) {
+        rto = KCP_RTO_MIN;
+    } else if (rto > KCP_RTO_MAX) {
+        rto = KCP_RTO_MAX;
+    }
+    kcp->rto = (uint32_t)rto;
+}
+
+static void kcp_shrink_buf(struct kcp *kcp) {
+    kcp->snd_una = kcp->snd_buf.first ? kcp->snd_buf.first->sn : kcp->snd_nxt;
+}
+
+static void kcp_parse_una(struct kcp *kcp, uint32_t una) {
+    while (kcp->snd_buf.first && kcp_diff(una, kcp->snd_buf.first->sn) > 0) {
+        struct kcp_segment *seg = kcp->snd_buf.first;
+        kcp_list_remove(&kcp->snd_buf, seg);
+        free(seg);
+    }
+}
+
+static void kcp_parse_ack(struct kcp *kcp, uint32_t sn) {
+    struct kcp_segment *seg;
+    if (kcp_diff(sn, kcp->snd_una) < 0 || kcp_diff(sn, kcp->snd_nxt) >= 0) {
+        return;
+    }
+    for (seg = kcp->snd_buf.first; seg; seg = seg->next) {
+        if (seg->sn == sn) {
+            kcp_list_remove(&kcp->snd_buf, seg);
+            free(seg);
+            break;
+        }
+        if (kcp_diff(sn, seg->sn) < 0) {
+            break;
+        }
+    }
+}
+
+static void kcp_parse_fastack(struct kcp *kcp, uint32_t sn) {
+    struct kcp_segment *seg;
+    for (seg = kcp->snd_buf.first; seg && kcp_diff(sn, seg->sn) > 0; seg = seg->next) {
+        seg->fastack++;
+    }
+}
+
+static void kcp_ack_push(struct kcp *kcp, uint32_t sn, uint32_t ts) {
+    if (kcp->ack_count == kcp->ack_capacity) {
+        size_t capacity = kcp->ack_capacity ? kcp->ack_capacity * 2 : 64;
+        uint32_t *acks = (uint32_t *) realloc(kcp->acks, capacity * 2 * sizeof(uint32_t));
+        if (acks == NULL) {
+            return;  /* The peer sends it again. */
+        }
+        kcp->acks = acks;
+        kcp->ack_capacity = capacity;
+    }
+    kcp->acks[kcp->ack_count * 2] = sn;
+    kcp->acks[kcp->ack_count * 2 + 1] = ts;
+    kcp->ack_count++;
+}
+
+/* In order segments move on to rcv_queue while it has room. */
+static void kcp_move_ready(struct kcp *kcp) {
+    while (kcp->rcv_buf.first && kcp->rcv_buf.first->sn == kcp->rcv_nxt && kcp->rcv_queue.count < kcp->rcv_wnd) {
+        struct kcp_segment *seg = kcp->rcv_buf.first;
+        kcp_list_remove(&kcp->rcv_buf, seg);
+        kcp_list_insert_after(&kcp->rcv_queue, kcp->rcv_queue.last, seg);
+        kcp->rcv_nxt++;
+    }
+}
+
+static void kcp_parse_data(struct kcp *kcp, uint32_t sn, const uint8_t *data, size_t len) {
+    struct kcp_segment *pos, *seg;
+
+    // Most arrive in order, look from the back.
+    for (pos = kcp->rcv_buf.last; pos; pos = pos->prev) {
+        if (pos->sn == sn) {
+            return;
+        }
+        if (kcp_diff(sn, pos->sn) > 0) {
+            break;
+        }
+    }
+    seg = kcp_segment_create(len);
+    seg->sn = sn;
+    seg->len = len;
+    memcpy(seg->data, data, len);
+    kcp_list_insert_after(&kcp->rcv_buf, pos, seg);
+    kcp_move_ready(kcp);
+}
+
+bool kcp_input(struct kcp *kcp, const uint8_t *data, size_t len, uint32_t now) {
+    bool acked = false;
+    uint32_t maxack = 0;
+
+    while (len >= KCP_OVERHEAD) {
+        uint8_t cmd = data[4];
+        uint16_t wnd = kcp_get16(data + 6);
+        uint32_t ts = kcp_get32(data + 8);
+        uint32_t sn = kcp_get32(data + 12);
+        uint32_t una = kcp_get32(data + 16);
+        uint32_t seglen = kcp_get32(data + 20);
+
+        if (kcp_get32(data) != kcp->conv || seglen > len - KCP_OVERHEAD ||
+            cmd < KCP_CMD_PUSH || cmd > KCP_CMD_RST)
+        {
+            return false;
+        }
+        data += KCP_OVERHEAD;
+        len -= KCP_OVERHEAD;
+        if (cmd == KCP_CMD_RST) {
+            kcp->reset = true;
+            return true;
+        }
+
+        kcp->rmt_wnd = wnd;
+        kcp_parse_una(kcp, una);
+        kcp_shrink_buf(kcp);
+        switch (cmd) {
+        case KCP_CMD_ACK:
+            if (kcp_diff(now, ts) >= 0) {
+                kcp_update_rtt(kcp, kcp_diff(now, ts));
+            }
+            kcp_parse_ack(kcp, sn);
+            kcp_shrink_buf(kcp);
+            if (acked == false || kcp_diff(sn, maxack) > 0) {
+                acked = true;
+                maxack = sn;
+            }
+            break;
+        case KCP_CMD_PUSH:
+            if (kcp_diff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
+                kcp_ack_push(kcp, sn, ts);
+                if (kcp_diff(sn, kcp->rcv_nxt) >= 0) {
+                    kcp_parse_data(kcp, sn, data, seglen);
+                }
+            }
+            break;
+        case KCP_CMD_WASK:
+            kcp->tell_window = true;
+            break;
+        default:
+            break;
+        }
+        data += seglen;
+        len -= seglen;
+    }
+    if (acked) {
+        kcp_parse_fastack(kcp, maxack);
+    }
+    return len == 0;
+}
+
+size_t kcp_recv(struct kcp *kcp, uint8_t *buf, size_t size) {
+    bool was_full = kcp->rcv_queue.count >= kcp->rcv_wnd;
+    size_t copied = 0;
+
+    while (copied < size && kcp->rcv_queue.first) {
+        struct kcp_segment *seg = kcp->rcv_queue.first;
+        size_t chunk = seg->len - kcp->rcv_offset;
+        if (chunk > size - copied) {
+            chunk = size - copied;
+        }
+        memcpy(buf + copied, seg->data + kcp->rcv_offset, chunk);
+        copied += chunk;
+        kcp->rcv_offset += chunk;
+        if (kcp->rcv_offset == seg->len) {
+            kcp_list_remove(&kcp->rcv_queue, seg);
+            free(seg);
+            kcp->rcv_offset = 0;
+        }
+    }
+    kcp_move_ready(kcp);
+    if (was_full && kcp->rcv_queue.count < kcp->rcv_wnd) {
+        // The peer stopped at our closed window, it needn't wait for its probe.
+        kcp->tell_window = true;
+    }
+    return copied;
+}
+
+static uint8_t * kcp_out_reserve(struct kcp *kcp, size_t need) {
+    if (kcp->out_len + need > kcp->mtu) {
+        kcp->output(kcp->p, kcp->out, kcp->out_len);
+        kcp->out_len = 0;
+    }
+    return kcp->out + kcp->out_len;
+}
+
+static void kcp_out_command(struct kcp *kcp, uint8_t cmd, uint16_t wnd, uint32_t ts, uint32_t sn) {
+    uint8_t *ptr = kcp_out_reserve(kcp, KCP_OVERHEAD);
+    kcp_encode(ptr, kcp->conv, cmd, wnd, ts, sn, kcp->rcv_nxt, 0);
+    kcp->out_len += KCP_OVERHEAD;
+}
+
+void kcp_flush(struct kcp *kcp, uint32_t now) {
+    uint16_t wnd = (uint16_t)(kcp->rcv_queue.count < kcp->rcv_wnd ? kcp->rcv_wnd - kcp->rcv_queue.count : 0);
+    unsigned int cwnd = kcp->snd_wnd < kcp->rmt_wnd ? kcp->snd_wnd : kcp->rmt_wnd;
+    struct kcp_segment *seg;
+    size_t index;
+
+    for (index = 0; index < kcp->ack_count; ++index) {
+        kcp_out_command(kcp, KCP_CMD_ACK, wnd, kcp->acks[index * 2 + 1], kcp->acks[index * 2]);
+    }
+    kcp->ack_count = 0;
+
+    if (kcp->rmt_wnd == 0) {
+        if (kcp->probe_wait == 0) {
+            kcp->probe_wait = KCP_PROBE_INIT_MS;
+            kcp->probe_at = now + kcp->probe_wait;
+        } else if (kcp_diff(now, kcp->probe_at) >= 0) {
+            kcp->probe_wait += kcp->probe_wait / 2;
+            if (kcp->probe_wait > KCP_PROBE_LIMIT_MS) {
+                kcp->probe_wait = KCP_PROBE_LIMIT_MS;
+            }
+            kcp->probe_at = now + kcp->probe_wait;
+            kcp->ask_window = true;
+        }
+    } else {
+        kcp->probe_wait = 0;
+    }
+    if (kcp->ask_window) {
+        kcp_out_command(kcp, KCP_CMD_WASK, wnd, 0, 0);
+        kcp->ask_window = false;
+    }
+    if (kcp->tell_window) {
+        kcp_out_command(kcp, KCP_CMD_WINS, wnd, 0, 0);
+        kcp->tell_window = false;
+    }
+
+    while (kcp->snd_queue.first && kcp_diff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
+        seg = kcp->snd_queue.first;
+        kcp_list_remove(&kcp->snd_queue, seg);
+        seg->sn = kcp->snd_nxt++;
+        kcp_list_insert_after(&kcp->snd_buf, kcp->snd_buf.last, seg);
+    }
+
+    for (seg = kcp->snd_buf.first; seg; seg = seg->next) {
+        uint8_t *ptr;
+        if (seg->xmit == 0) {
+            seg->rto = kcp->rto;
+        } else if (kcp_diff(now, seg->resend_at) >= 0) {
+            seg->rto += kcp->rto / 2;
+            if (seg->rto > KCP_RTO_MAX) {
+                seg->rto = KCP_RTO_MAX;
+            }
+            kcp->retransmits++;
+        } else if (seg->fastack >= KCP_FAST_RESEND) {
+            kcp->retransmits++;
+        } else {
+            continue;
+        }
+        seg->xmit++;
+        seg->fastack = 0;
+        seg->ts = now;
+        seg->resend_at = now + seg->rto;
+        if (seg->xmit >= KCP_DEAD_LINK) {
+            kcp->dead = true;
+        }
+        ptr = kcp_out_reserve(kcp, KCP_OVERHEAD + seg->len);
+        kcp_encode(ptr, kcp->conv, KCP_CMD_PUSH, wnd, seg->ts, seg->sn, kcp->rcv_nxt, (uint32_t)seg->len);
+        memcpy(ptr + KCP_OVERHEAD, seg->data, seg->len);
+        kcp->out_len += KCP_OVERHEAD + seg->len;
+    }
+
+    if (kcp->out_len > 0) {
+        kcp->output(kcp->p, kcp->out, kcp->out_len);
+        kcp->out_len = 0;
+    }
+}
+
+void kcp_keepalive(struct kcp *kcp) {
+    kcp->tell_window = true;
+}
+
+size_t kcp_waiting(const struct kcp *kcp) {
+    return kcp->snd_buf.count + kcp->snd_queue.count;
+}
+
+bool kcp_busy(const struct kcp *kcp) {
+    return kcp->snd_buf.count || kcp->snd_queue.count || kcp->ack_count || kcp->ask_window || kcp->tell_window;
+}
+
+bool kcp_dead(const struct kcp *kcp) {
+    return kcp->dead || kcp->reset;
+}
+
+bool kcp_reset_by_peer(const struct kcp *kcp) {
+    return kcp->reset;
+}
+
+uint64_t kcp_retransmits(const struct kcp *kcp) {
+    return kcp->retransmits;
+}
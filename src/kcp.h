@@ -0,0 +1,73 @@
+#if !defined(__kcp_h__)
+#define __kcp_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A reliable, ordered byte stream over datagrams, after KCP. Every segment
+ * carries a 24 byte header, in little endian:
+ *
+ *    +------+-----+---+-----+----+----+-----+-----+------+
+ *    | CONV | CMD | 0 | WND | TS | SN | UNA | LEN | DATA |
+ *    +------+-----+---+-----+----+----+-----+-----+------+
+ *    |  4   |  1  | 1 |  2  | 4  | 4  |  4  |  4  | LEN  |
+ *    +------+-----+---+-----+----+----+-----+-----+------+
+ *
+ * Every segment is acknowledged on its own and UNA acknowledges all before
+ * it, so a loss costs the lost segment only. A segment is sent again after
+ * its RTO, which grows by half rather than doubling, or once
+ * KCP_FAST_RESEND later ones were acknowledged. There is no congestion
+ * window: the sender keeps to its window and the receiver's, which is
+ * what a lossy long link needs and what makes it unfair to TCP. RST ends
+ * a conversation the peer doesn't know. Pure, the caller owns the clock,
+ * the socket and the timer.
+ */
+
+#define KCP_OVERHEAD     24
+#define KCP_INTERVAL_MS  10  /* How often kcp_flush() wants calling while there is something in flight. */
+#define KCP_RTO_MIN      30
+#define KCP_RTO_MAX      60000
+#define KCP_FAST_RESEND  2
+#define KCP_DEAD_LINK    20  /* Sends of one segment before the link counts as lost. */
+
+struct kcp;
+
+/* One datagram of segments to go out. */
+typedef void(*kcp_output_cb)(void *p, const uint8_t *data, size_t len);
+
+/* |mtu| bounds the datagrams, |window| the segments in flight each way. */
+struct kcp * kcp_create(uint32_t conv, size_t mtu, unsigned int window, kcp_output_cb output, void *p);
+void kcp_release(struct kcp *kcp);
+
+/* The conversation of a datagram, false if it's too short to be one. */
+bool kcp_peek_conv(const uint8_t *data, size_t len, uint32_t *conv);
+/* Whether a datagram to an unknown conversation may open it: a PUSH
+ * within the first window. */
+bool kcp_peek_opening(const uint8_t *data, size_t len, unsigned int window);
+/* A datagram telling the peer |conv| is gone, for kcp_output_cb. */
+size_t kcp_build_reset(uint32_t conv, uint8_t *out, size_t size);
+
+/* Always queues |data|. */
+void kcp_send(struct kcp *kcp, const uint8_t *data, size_t len);
+/* A datagram from the peer, false if it's malformed. */
+bool kcp_input(struct kcp *kcp, const uint8_t *data, size_t len, uint32_t now);
+/* Copies up to |size| bytes of the stream in order, 0 when there are none. */
+size_t kcp_recv(struct kcp *kcp, uint8_t *buf, size_t size);
+/* Sends the acknowledgements, what the windows allow and what is due again. */
+void kcp_flush(struct kcp *kcp, uint32_t now);
+/* Tells the peer our window, so an idle conversation isn't taken for gone. */
+void kcp_keepalive(struct kcp *kcp);
+
+/* Segments queued or in flight. */
+size_t kcp_waiting(const struct kcp *kcp);
+/* Something sent is not yet acknowledged, or an acknowledgement is owed. */
+bool kcp_busy(const struct kcp *kcp);
+/* A segment went KCP_DEAD_LINK times without an acknowledgement, or the peer reset. */
+bool kcp_dead(const struct kcp *kcp);
+bool kcp_reset_by_peer(const struct kcp *kcp);
+/* Segments sent again, for the statistics. */
+uint64_t kcp_retransmits(const struct kcp *kcp);
+
+#endif // !defined(__kcp_h__)
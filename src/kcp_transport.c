@@ -0,0 +1,497 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kcp_transport.h"
+#include "kcp.h"
+#include "fec.h"
+#include "common.h"
+#include "dump_info.h"
+#include "ssr_executive.h"
+#include "sockaddr_universal.h"
+#include "uthash.h"
+
+#define KCP_DATAGRAM_MAX  0x10000
+
+struct kcp_peer_key {
+    uint16_t family;
+    uint16_t port;
+    uint8_t addr[16];
+};
+
+struct kcp_peer {
+    struct kcp_peer_key key;
+    union sockaddr_universal addr;
+    struct kcp_endpoint *ep;
+    struct fec_encoder *enc;  /* NULL without FEC. */
+    struct fec_decoder *dec;
+    struct kcp_session *sessions;  /* By conv. */
+    UT_hash_handle hh;
+};
+
+struct kcp_session {
+    uint32_t conv;
+    struct kcp_peer *peer;
+    struct kcp *kcp;
+    const struct kcp_session_callbacks *cb;
+    void *p;
+    uint64_t last_input;
+    uint64_t last_output;
+    int busy;  /* In its callbacks, it's freed once they return. */
+    bool closed;
+    bool paused;
+    bool delivering;
+    bool want_writable;
+    struct kcp_session *prev;  /* Of the endpoint's list the timer walks. */
+    struct kcp_session *next;
+    UT_hash_handle hh;
+};
+
+struct kcp_endpoint {
+    uv_loop_t *loop;
+    uv_udp_t udp;
+    uv_timer_t timer;
+    int handles;
+    bool timer_running;
+    int family;
+    unsigned int window;
+    unsigned int fec_data;
+    unsigned int fec_parity;
+    size_t mtu;  /* Of the KCP segments, the FEC header is beyond. */
+    kcp_accept_cb accept_cb;  /* NULL on a client. */
+    void *accept_p;
+    uint32_t next_conv;
+    struct kcp_peer *peers;
+    struct kcp_session *sessions;
+    struct kcp_session *cursor;  /* The next session the timer looks at. */
+    uint64_t retransmits;  /* Of the sessions gone. */
+    uint64_t recovered;  /* Of the peers gone. */
+    uint8_t recv_buf[KCP_DATAGRAM_MAX];
+    uint8_t data_buf[KCP_DATAGRAM_MAX];
+};
+
+static void kcp_peer_key_from(const struct sockaddr *sa, struct kcp_peer_key *key) {
+    memset(key, 0, sizeof(*key));
+    key->family = sa->sa_family;
+    if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)sa;
+        key->port = addr6->sin6_port;
+        memcpy(key->addr, &addr6->sin6_addr, 16);
+    } else {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *)sa;
+        key->port = addr4->sin_port;
+        memcpy(key->addr, &addr4->sin_addr, 4);
+    }
+}
+
+static void kcp_peer_send(void *p, const uint8_t *data, size_t len) {
+    struct kcp_peer *peer = (struct kcp_peer *)p;
+    uv_buf_t buf = uv_buf_init((char *)data, (unsigned int)len);
+    // A full socket buffer is loss like any other, the ARQ sends it again.
+    uv_udp_try_send(&peer->ep->udp, &buf, 1, &peer->addr.addr);
+}
+
+static struct kcp_peer * kcp_peer_get(struct kcp_endpoint *ep, const struct sockaddr *sa, bool create) {
+    struct kcp_peer_key key;
+    struct kcp_peer *peer = NULL;
+
+    kcp_peer_key_from(sa, &key);
+    HASH_FIND(hh, ep->peers, &key, sizeof(key), peer);
+    if (peer || create == false) {
+        return peer;
+    }
+    peer = (struct kcp_peer *) calloc(1, sizeof(*peer));
+    peer->key = key;
+    memcpy(&peer->addr, sa, sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    peer->ep = ep;
+    if (ep->fec_parity > 0) {
+        peer->enc = fec_encoder_create(ep->fec_data, ep->fec_parity, ep->mtu);
+        peer->dec = fec_decoder_create(ep->fec_data, ep->fec_parity, ep->mtu);
+    }
+    HASH_ADD(hh, ep->peers, key, sizeof(peer->key), peer);
+    return peer;
+}
+
+static void kcp_peer_free(struct kcp_endpoint *ep, struct kcp_peer *peer) {
+    ASSERT(peer->sessions == NULL);
+    HASH_DEL(ep->peers, peer);
+    if (peer->dec) {
+        ep->recovered += fec_decoder_recovered(peer->dec);
+    }
+    fec_encoder_release(peer->enc);
+    fec_decoder_release(peer->dec);
+    free(peer);
+}
+
+static void kcp_session_output(void *p, const uint8_t *data, size_t len) {
+    struct kcp_session *s = (struct kcp_session *)p;
+    struct kcp_peer *peer = s->peer;
+    if (peer->enc) {
+        fec_encoder_encode(peer->enc, data, len, kcp_peer_send, peer);
+    } else {
+        kcp_peer_send(peer, data, len);
+    }
+}
+
+static void kcp_timer_cb(uv_timer_t *handle);
+
+static void kcp_timer_ensure(struct kcp_endpoint *ep) {
+    if (ep->timer_running == false) {
+        ep->timer_running = true;
+        uv_timer_start(&ep->timer, kcp_timer_cb, KCP_INTERVAL_MS, KCP_INTERVAL_MS);
+    }
+}
+
+static struct kcp_session * kcp_session_create(struct kcp_peer *peer, uint32_t conv) {
+    struct kcp_endpoint *ep = peer->ep;
+    struct kcp_session *s = (struct kcp_session *) calloc(1, sizeof(*s));
+
+    s->kcp = kcp_create(conv, ep->mtu, ep->window, kcp_session_output, s);
+    if (s->kcp == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->conv = conv;
+    s->peer = peer;
+    s->last_input = s->last_output = uv_now(ep->loop);
+    HASH_ADD(hh, peer->sessions, conv, sizeof(s->conv), s);
+    s->next = ep->sessions;
+    if (ep->sessions) {
+        ep->sessions->prev = s;
+    }
+    ep->sessions = s;
+    kcp_timer_ensure(ep);
+    return s;
+}
+
+static void kcp_session_free(struct kcp_session *s) {
+    struct kcp_endpoint *ep = s->peer->ep;
+    ep->retransmits += kcp_retransmits(s->kcp);
+    kcp_release(s->kcp);
+    free(s);
+}
+
+/* Off the peer and the endpoint, the peer itself goes with the timer. */
+static void kcp_session_unlink(struct kcp_session *s) {
+    struct kcp_endpoint *ep = s->peer->ep;
+
+    s->closed = true;
+    HASH_DEL(s->peer->sessions, s);
+    if (ep->cursor == s) {
+        ep->cursor = s->next;
+    }
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        ep->sessions = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->prev = s->next = NULL;
+}
+
+static void kcp_session_put(struct kcp_session *s) {
+    if (--s->busy == 0 && s->closed) {
+        kcp_session_free(s);
+    }
+}
+
+/* Gone without the user asking, it's told. */
+static void kcp_session_drop(struct kcp_session *s) {
+    kcp_session_unlink(s);
+    s->busy++;
+    if (s->cb && s->cb->on_close) {
+        s->cb->on_close(s->p);
+    }
+    kcp_session_put(s);
+}
+
+static void kcp_session_deliver(struct kcp_session *s) {
+    struct kcp_endpoint *ep = s->peer->ep;
+
+    if (s->delivering) {
+        return;
+    }
+    s->delivering = true;
+    s->busy++;
+    while (s->closed == false && s->paused == false) {
+        size_t n = kcp_recv(s->kcp, ep->data_buf, sizeof(ep->data_buf));
+        if (n == 0) {
+            break;
+        }
+        if (s->cb && s->cb->on_data) {
+            s->cb->on_data(s->p, ep->data_buf, n);
+        }
+    }
+    s->delivering = false;
+    kcp_session_put(s);
+}
+
+static void kcp_peer_input(void *p, const uint8_t *data, size_t len) {
+    struct kcp_peer *peer = (struct kcp_peer *)p;
+    struct kcp_endpoint *ep = peer->ep;
+    struct kcp_session *s = NULL;
+    uint32_t conv;
+
+    if (kcp_peek_conv(data, len, &conv) == false) {
+        return;
+    }
+    HASH_FIND(hh, peer->sessions, &conv, sizeof(conv), s);
+    if (s == NULL) {
+        if (ep->accept_cb && kcp_peek_opening(data, len, ep->window)) {
+            s = kcp_session_create(peer, conv);
+            if (s == NULL) {
+                return;
+            }
+            s->busy++;
+            ep->accept_cb(ep->accept_p, s, &peer->addr);
+            if (s->closed) {
+                kcp_session_put(s);
+                return;
+            }
+            s->busy--;
+        } else if (kcp_peek_opening(data, len, UINT32_MAX)) {
+            // Data for a conversation that's gone, over here at least.
+            uint8_t reset[KCP_OVERHEAD];
+            size_t n = kcp_build_reset(conv, reset, sizeof(reset));
+            kcp_peer_send(peer, reset, n);
+            return;
+        } else {
+            return;
+        }
+    }
+    if (kcp_input(s->kcp, data, len, (uint32_t)uv_now(ep->loop)) == false) {
+        return;
+    }
+    s->last_input = uv_now(ep->loop);
+    if (kcp_reset_by_peer(s->kcp)) {
+        kcp_session_drop(s);
+        return;
+    }
+    kcp_session_deliver(s);
+    kcp_timer_ensure(ep);
+}
+
+static void kcp_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct kcp_endpoint *ep = CONTAINER_OF(handle, struct kcp_endpoint, udp);
+    (void)suggested_size;
+    *buf = uv_buf_init((char *)ep->recv_buf, sizeof(ep->recv_buf));
+}
+
+static void kcp_recv_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+    struct kcp_endpoint *ep = CONTAINER_OF(handle, struct kcp_endpoint, udp);
+    struct kcp_peer *peer;
+
+    if (nread <= 0 || addr == NULL || (flags & UV_UDP_PARTIAL)) {
+        return;
+    }
+    // A client only hears from the servers it opened sessions to.
+    peer = kcp_peer_get(ep, addr, ep->accept_cb != NULL);
+    if (peer == NULL) {
+        return;
+    }
+    if (peer->dec) {
+        fec_decoder_decode(peer->dec, (const uint8_t *)buf->base, (size_t)nread, kcp_peer_input, peer);
+    } else {
+        kcp_peer_input(peer, (const uint8_t *)buf->base, (size_t)nread);
+    }
+    if (peer->sessions == NULL) {
+        kcp_timer_ensure(ep);  /* Reaps it. */
+    }
+}
+
+static void kcp_session_tick(struct kcp_session *s, uint64_t now) {
+    if (now - s->last_input >= KCP_SESSION_TIMEOUT_MS) {
+        kcp_session_drop(s);
+        return;
+    }
+    if (kcp_busy(s->kcp) == false && now - s->last_output >= KCP_KEEPALIVE_MS) {
+        kcp_keepalive(s->kcp);
+    }
+    if (kcp_busy(s->kcp)) {
+        kcp_flush(s->kcp, (uint32_t)now);
+        s->last_output = now;
+    }
+    if (kcp_dead(s->kcp)) {
+        kcp_session_drop(s);
+        return;
+    }
+    kcp_session_deliver(s);
+    if (s->closed == false && s->want_writable && kcp_waiting(s->kcp) < s->peer->ep->window) {
+        s->want_writable = false;
+        s->busy++;
+        if (s->cb && s->cb->on_writable) {
+            s->cb->on_writable(s->p);
+        }
+        kcp_session_put(s);
+    }
+}
+
+static void kcp_timer_cb(uv_timer_t *handle) {
+    struct kcp_endpoint *ep = CONTAINER_OF(handle, struct kcp_endpoint, timer);
+    uint64_t now = uv_now(ep->loop);
+    struct kcp_peer *peer, *tmp;
+    struct kcp_session *s;
+
+    for (s = ep->sessions; s; s = ep->cursor) {
+        ep->cursor = s->next;
+        kcp_session_tick(s, now);
+    }
+    ep->cursor = NULL;
+
+    HASH_ITER(hh, ep->peers, peer, tmp) {
+        if (peer->sessions == NULL) {
+            kcp_peer_free(ep, peer);
+        }
+    }
+    if (ep->sessions == NULL) {
+        uv_timer_stop(&ep->timer);
+        ep->timer_running = false;
+    }
+}
+
+struct kcp_endpoint * kcp_endpoint_create(uv_loop_t *loop, const struct server_config *config,
+    const union sockaddr_universal *addr, kcp_accept_cb accept_cb, void *p)
+{
+    struct kcp_endpoint *ep = (struct kcp_endpoint *) calloc(1, sizeof(*ep));
+    union sockaddr_universal bind_addr;
+    int error;
+
+    ep->loop = loop;
+    ep->family = addr->addr.sa_family;
+    ep->window = config->kcp_window ? config->kcp_window : DEFAULT_KCP_WINDOW;
+    ep->fec_data = config->kcp_fec_data;
+    ep->fec_parity = config->kcp_fec_parity;
+    if (ep->fec_data == 0 || ep->fec_data + ep->fec_parity > FEC_MAX_SHARDS) {
+        ep->fec_parity = 0;
+    }
+    ep->mtu = KCP_TRANSPORT_MTU - (ep->fec_parity ? FEC_HEADER : 0);
+    ep->accept_cb = accept_cb;
+    ep->accept_p = p;
+    ep->next_conv = (uint32_t)(uv_hrtime() ^ (uint64_t)(uintptr_t)ep);
+
+    if (accept_cb) {
+        bind_addr = *addr;
+    } else {
+        memset(&bind_addr, 0, sizeof(bind_addr));
+        bind_addr.addr.sa_family = addr->addr.sa_family;
+    }
+    uv_udp_init(loop, &ep->udp);
+    uv_timer_init(loop, &ep->timer);
+    ep->handles = 2;
+    error = uv_udp_bind(&ep->udp, &bind_addr.addr, 0);
+    if (error == 0) {
+        error = uv_udp_recv_start(&ep->udp, kcp_alloc_cb, kcp_recv_cb);
+    }
+    if (error != 0) {
+        pr_err("kcp: bind failed: %s", uv_strerror(error));
+        kcp_endpoint_release(ep);
+        return NULL;
+    }
+    {
+        int size = KCP_SOCKET_BUFFER;
+        uv_send_buffer_size((uv_handle_t *)&ep->udp, &size);
+        size = KCP_SOCKET_BUFFER;
+        uv_recv_buffer_size((uv_handle_t *)&ep->udp, &size);
+    }
+    return ep;
+}
+
+static void kcp_close_done_cb(uv_handle_t *handle) {
+    struct kcp_endpoint *ep = (struct kcp_endpoint *)handle->data;
+    struct kcp_peer *peer, *tmp;
+
+    if (--ep->handles > 0) {
+        return;
+    }
+    HASH_ITER(hh, ep->peers, peer, tmp) {
+        kcp_peer_free(ep, peer);
+    }
+    if (ep->retransmits || ep->recovered) {
+        pr_info("kcp: %llu segments sent again, %llu datagrams rebuilt by FEC",
+            (unsigned long long)ep->retransmits, (unsigned long long)ep->recovered);
+    }
+    free(ep);
+}
+
+void kcp_endpoint_release(struct kcp_endpoint *ep) {
+    if (ep == NULL) {
+        return;
+    }
+    while (ep->sessions) {
+        kcp_session_drop(ep->sessions);
+    }
+    uv_timer_stop(&ep->timer);
+    ep->udp.data = ep->timer.data = ep;
+    uv_close((uv_handle_t *)&ep->udp, kcp_close_done_cb);
+    uv_close((uv_handle_t *)&ep->timer, kcp_close_done_cb);
+}
+
+struct kcp_session * kcp_session_open(struct kcp_endpoint *ep, const union sockaddr_universal *peer,
+    const struct kcp_session_callbacks *cb, void *p)
+{
+    struct kcp_peer *kp;
+    struct kcp_session *s = NULL;
+
+    if (peer->addr.sa_family != ep->family) {
+        return NULL;
+    }
+    kp = kcp_peer_get(ep, &peer->addr, true);
+    // The server knows conversations by peer and conv, skip one still open here.
+    do {
+        ep->next_conv++;
+        HASH_FIND(hh, kp->sessions, &ep->next_conv, sizeof(ep->next_conv), s);
+    } while (s);
+    s = kcp_session_create(kp, ep->next_conv);
+    if (s) {
+        kcp_session_set_callbacks(s, cb, p);
+    }
+    return s;
+}
+
+void kcp_session_set_callbacks(struct kcp_session *session, const struct kcp_session_callbacks *cb, void *p) {
+    session->cb = cb;
+    session->p = p;
+}
+
+bool kcp_session_send(struct kcp_session *session, const uint8_t *data, size_t size) {
+    struct kcp_endpoint *ep = session->peer->ep;
+    uint64_t now = uv_now(ep->loop);
+
+    if (session->closed) {
+        return true;
+    }
+    kcp_send(session->kcp, data, size);
+    // Out now as far as the windows go, the timer takes care of the rest.
+    kcp_flush(session->kcp, (uint32_t)now);
+    session->last_output = now;
+    kcp_timer_ensure(ep);
+    if (kcp_waiting(session->kcp) >= 2 * (size_t)ep->window) {
+        session->want_writable = true;
+        return false;
+    }
+    return true;
+}
+
+void kcp_session_pause(struct kcp_session *session, bool paused) {
+    session->paused = paused;
+    if (paused == false && session->closed == false) {
+        kcp_session_deliver(session);
+        // The window it reopens is told with the next flush.
+        kcp_timer_ensure(session->peer->ep);
+    }
+}
+
+void kcp_session_close(struct kcp_session *session) {
+    uint8_t reset[KCP_OVERHEAD];
+    size_t n;
+
+    if (session->closed) {
+        return;
+    }
+    n = kcp_build_reset(session->conv, reset, sizeof(reset));
+    kcp_session_output(session, reset, n);
+    kcp_session_unlink(session);
+    if (session->busy == 0) {
+        kcp_session_free(session);
+    }
+}
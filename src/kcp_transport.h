@@ -0,0 +1,65 @@
+#if !defined(__kcp_transport_h__)
+#define __kcp_transport_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * KCP conversations, see kcp.h, over one UDP socket, with forward error
+ * correction, see fec.h, per peer when kcp_fec_parity is set. A session is
+ * a byte stream to a peer; the sessions to one peer share its FEC groups.
+ * One timer per endpoint flushes the acknowledgements and what is due
+ * again every KCP_INTERVAL_MS while a session has something in flight.
+ * A session nothing came from for KCP_SESSION_TIMEOUT_MS is gone, idle
+ * ones keep each other alive every KCP_KEEPALIVE_MS. Not thread safe: one
+ * per uv_loop_t.
+ */
+
+#define KCP_TRANSPORT_MTU       1400  /* UDP payload, below common path MTUs with room for IPv6 and PPPoE. */
+#define KCP_SESSION_TIMEOUT_MS  (60 * 1000)
+#define KCP_KEEPALIVE_MS        (10 * 1000)
+#define KCP_SOCKET_BUFFER       (4 * 1024 * 1024)
+#define DEFAULT_KCP_WINDOW      512  /* Segments. */
+#define DEFAULT_KCP_FEC_DATA    10
+#define DEFAULT_KCP_FEC_PARITY  3
+
+union sockaddr_universal;
+struct server_config;
+struct kcp_endpoint;
+struct kcp_session;
+
+struct kcp_session_callbacks {
+    void (*on_data)(void *p, const uint8_t *data, size_t size);
+    /* What was queued went out far enough after kcp_session_send() returned false. */
+    void (*on_writable)(void *p);
+    /* The peer reset it, stopped answering, or the endpoint went. The session is freed. */
+    void (*on_close)(void *p);
+};
+
+/* A new conversation from |peer|. Call kcp_session_set_callbacks() before returning. */
+typedef void(*kcp_accept_cb)(void *p, struct kcp_session *session, const union sockaddr_universal *peer);
+
+/* With kcp_window, kcp_fec_data and kcp_fec_parity of |config|. A client
+ * endpoint binds an ephemeral port of |addr|'s family, a server one binds
+ * |addr| and hands the conversations peers open to |accept_cb|. NULL if
+ * the socket can't be bound. */
+struct kcp_endpoint * kcp_endpoint_create(uv_loop_t *loop, const struct server_config *config,
+    const union sockaddr_universal *addr, kcp_accept_cb accept_cb, void *p);
+/* Every session left gets on_close(). Not from within a callback. */
+void kcp_endpoint_release(struct kcp_endpoint *ep);
+
+/* Client side. NULL if |peer| is of another family than the endpoint. */
+struct kcp_session * kcp_session_open(struct kcp_endpoint *ep, const union sockaddr_universal *peer,
+    const struct kcp_session_callbacks *cb, void *p);
+void kcp_session_set_callbacks(struct kcp_session *session, const struct kcp_session_callbacks *cb, void *p);
+/* Always queues |data|, false once twice the window waits to go out. */
+bool kcp_session_send(struct kcp_session *session, const uint8_t *data, size_t size);
+/* A paused session takes nothing off its receive queue, the peer's sending
+ * stops at the window. */
+void kcp_session_pause(struct kcp_session *session, bool paused);
+/* Resets it on the peer. The session is freed, no callback follows. */
+void kcp_session_close(struct kcp_session *session);
+
+#endif // !defined(__kcp_transport_h__)
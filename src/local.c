@@ -80,6 +80,9 @@
 #include "ssrbuffer.h"
 #include "sockaddr_universal.h"
 #include "ssr_executive.h"
+#ifdef ANDROID
+#include "android.h"
+#endif
 
 #ifndef LIB_ONLY
 #ifdef __APPLE__
@@ -109,6 +112,7 @@ uint64_t tx    = 0;
 uint64_t rx    = 0;
 ev_tstamp last = 0;
 char *prefix;
+static struct protect_channel *protect_channel;
 #endif
 
 #include "includeobfs.h" // I don't want to modify makefile
@@ -131,8 +135,13 @@ static void local_send_cb(uv_write_t* req, int status);
 static void local_send_data(struct local_t *local, char *data, unsigned int size);
 static void remote_recv_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf0);
 static void remote_send_data(struct remote_t *remote);
+static void remote_connect(struct remote_t *remote);
 static void remote_connected_cb(uv_connect_t* req, int status);
-static void remote_timeout_cb(uv_timer_t *handle);
+#ifdef ANDROID
+static int remote_needs_protect(struct remote_t *remote);
+static void remote_protected_cb(void *p, int status);
+#endif
+static void remote_timeout_cb(struct timer_wheel_entry *entry);
 
 static struct remote_t *remote_object_with_addr(struct listener_t *listener, struct sockaddr *addr);
 static void remote_destroy(struct remote_t *remote);
@@ -142,7 +151,7 @@ static void local_close_and_free(struct local_t *local);
 
 static void tunnel_close_and_free(struct remote_t *remote, struct local_t *local);
 
-static struct remote_t * remote_new_object(uv_loop_t *loop, int timeout);
+static struct remote_t * remote_new_object(uv_loop_t *loop, struct timer_wheel *timer_wheel, int timeout, int family);
 static struct local_t * local_new_object(struct listener_t *listener);
 
 static struct listener_t *current_listener;
@@ -438,33 +447,16 @@ local_recv_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf0)
             }
 #endif
             if (!remote->connected) {
-                uv_connect_t *connect;
-                struct sockaddr *addr;
+                local_read_stop(local);
 #ifdef ANDROID
-                if (vpn) {
-                    int not_protect = 0;
-                    if (remote->direct_addr.addr.ss_family == AF_INET) {
-                        struct sockaddr_in *s = (struct sockaddr_in *)&remote->direct_addr.addr;
-                        if (s->sin_addr.s_addr == inet_addr("127.0.0.1")) {
-                            not_protect = 1;
-                        }
-                    }
-                    if (!not_protect) {
-                        if (protect_socket(remote->fd) == -1) {
-                            SS_ERROR("protect_socket");
-                            tunnel_close_and_free(remote, local);
-                            return;
-                        }
-                    }
+                if (vpn && remote_needs_protect(remote)) {
+                    // The connect goes on in remote_protected_cb.
+                    remote->protect = protect_channel_submit(protect_channel,
+                        uv_stream_fd(&remote->socket), remote_protected_cb, remote);
+                    return;
                 }
 #endif
-                local_read_stop(local);
-
-                connect = (uv_connect_t *)calloc(1, sizeof(uv_connect_t));
-                connect->data = remote;
-
-                addr = (struct sockaddr*)&(remote->addr);
-                uv_tcp_connect(connect, &remote->socket, addr, remote_connected_cb);
+                remote_connect(remote);
                 return;
             } else {
                 if (remote->buf->len == 0) {
@@ -806,11 +798,7 @@ local_recv_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf0)
                 }
                 // SSR beg
                 memset(&server_info, 0, sizeof(struct server_info_t));
-                if (server_env->hostname) {
-                    strcpy(server_info.host, server_env->hostname);
-                } else {
-                    strcpy(server_info.host, server_env->host);
-                }
+                server_info.host = server_env->hostname ? server_env->hostname : server_env->host;
                 if (verbose) {
                     LOGI("struct server_info_t host %s", server_info.host);
                 }
@@ -898,6 +886,46 @@ stat_update_cb()
 }
 #endif
 
+static void
+remote_connect(struct remote_t *remote)
+{
+    uv_connect_t *connect = (uv_connect_t *)calloc(1, sizeof(uv_connect_t));
+    connect->data = remote;
+    uv_tcp_connect(connect, &remote->socket, (struct sockaddr*)&(remote->addr), remote_connected_cb);
+}
+
+#ifdef ANDROID
+static int
+remote_needs_protect(struct remote_t *remote)
+{
+    if (remote->addr.ss_family == AF_INET) {
+        struct sockaddr_in *s = (struct sockaddr_in *)&remote->addr;
+        if (s->sin_addr.s_addr == inet_addr("127.0.0.1")) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+remote_protected_cb(void *p, int status)
+{
+    struct remote_t *remote = (struct remote_t *)p;
+    struct local_t *local = remote->local;
+
+    remote->protect = NULL;
+    if (local==NULL || local->dying || remote->dying) {
+        return;
+    }
+    if (status < 0) {
+        LOGE("protect_socket: %s", uv_strerror(status));
+        tunnel_close_and_free(remote, local);
+        return;
+    }
+    remote_connect(remote);
+}
+#endif
+
 static void
 remote_connected_cb(uv_connect_t* req, int status)
 {
@@ -916,7 +944,7 @@ remote_connected_cb(uv_connect_t* req, int status)
     if (status == 0) {
         remote->connected = true;
 
-        uv_timer_start(&remote->recv_ctx->watcher, remote_timeout_cb, remote->recv_ctx->watcher_interval, 0);
+        timer_wheel_schedule(remote->timer_wheel, &remote->recv_ctx->watcher, remote->recv_ctx->watcher_interval);
         uv_read_start((uv_stream_t *)&remote->socket, on_alloc, remote_recv_cb);
 
         remote_send_data(remote);
@@ -927,10 +955,10 @@ remote_connected_cb(uv_connect_t* req, int status)
 }
 
 static void
-remote_timeout_cb(uv_timer_t *handle)
+remote_timeout_cb(struct timer_wheel_entry *entry)
 {
     struct remote_ctx_t *remote_ctx
-        = cork_container_of(handle, struct remote_ctx_t, watcher);
+        = cork_container_of(entry, struct remote_ctx_t, watcher);
 
     struct remote_t *remote = remote_ctx->remote;
     struct local_t *local = remote->local;
@@ -967,7 +995,7 @@ remote_recv_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf0)
         return;
     }
 
-    uv_timer_start(&remote->recv_ctx->watcher, remote_timeout_cb, remote->recv_ctx->watcher_interval, 0);
+    timer_wheel_schedule(remote->timer_wheel, &remote->recv_ctx->watcher, remote->recv_ctx->watcher_interval);
 
 #ifdef ANDROID
     stat_update_cb();
@@ -1049,7 +1077,7 @@ remote_send_cb(uv_write_t* req, int status)
         return;
     }
 
-    uv_timer_stop(&remote->send_ctx->watcher);
+    timer_wheel_cancel(&remote->send_ctx->watcher);
 
     if (status != 0) {
         tunnel_close_and_free(remote, local);
@@ -1068,7 +1096,7 @@ remote_send_data(struct remote_t *remote)
     write_req->data = remote;
 
     uv_write(write_req, (uv_stream_t *)&remote->socket, &tmp, 1, remote_send_cb);
-    uv_timer_start(&remote->send_ctx->watcher, remote_timeout_cb, remote->send_ctx->watcher_interval, 0);
+    timer_wheel_schedule(remote->timer_wheel, &remote->send_ctx->watcher, remote->send_ctx->watcher_interval);
 }
 
 static void 
@@ -1084,12 +1112,14 @@ local_send_data(struct local_t *local, char *data, unsigned int size)
 
 
 static struct remote_t *
-remote_new_object(uv_loop_t *loop, int timeout)
+remote_new_object(uv_loop_t *loop, struct timer_wheel *timer_wheel, int timeout, int family)
 {
     struct remote_t *remote = (struct remote_t *)calloc(1, sizeof(struct remote_t));
     int timeMax;
 
-    uv_tcp_init(loop, &remote->socket);
+    // With the socket made up front, its fd can be set up before the connect.
+    uv_tcp_init_ex(loop, &remote->socket, (unsigned int)family);
+    remote->timer_wheel         = timer_wheel;
 
     remote->buf                 = buffer_create(SSR_BUFF_SIZE);
     remote->recv_ctx            = (struct remote_ctx_t *)calloc(1, sizeof(struct remote_ctx_t));
@@ -1098,10 +1128,10 @@ remote_new_object(uv_loop_t *loop, int timeout)
     remote->send_ctx->remote    = remote;
 
     timeMax = min(CONNECT_TIMEOUT_MAX * MILLISECONDS_PER_SECOND, timeout);
-    uv_timer_init(loop, &remote->send_ctx->watcher);
+    timer_wheel_entry_init(&remote->send_ctx->watcher, remote_timeout_cb);
     remote->send_ctx->watcher_interval = (uint64_t) timeMax;
 
-    uv_timer_init(loop, &remote->recv_ctx->watcher);
+    timer_wheel_entry_init(&remote->recv_ctx->watcher, remote_timeout_cb);
     remote->recv_ctx->watcher_interval = (uint64_t) timeout;
 
     return remote;
@@ -1139,13 +1169,12 @@ remote_close_and_free(struct remote_t *remote)
     if (remote != NULL) {
         remote->dying = true;
 
-        remote->send_ctx->watcher.data = remote;
-        uv_close((uv_handle_t *)&remote->send_ctx->watcher, remote_close_done_cb);
-        ++remote->ref_count;
-
-        remote->recv_ctx->watcher.data = remote;
-        uv_close((uv_handle_t *)&remote->recv_ctx->watcher, remote_close_done_cb);
-        ++remote->ref_count;
+#ifdef ANDROID
+        protect_channel_cancel(remote->protect);
+        remote->protect = NULL;
+#endif
+        timer_wheel_cancel(&remote->send_ctx->watcher);
+        timer_wheel_cancel(&remote->recv_ctx->watcher);
 
         uv_read_stop((uv_stream_t *)&remote->socket);
         remote->socket.data = remote;
@@ -1273,7 +1302,7 @@ static struct remote_t *
 remote_object_with_addr(struct listener_t *listener, struct sockaddr *addr)
 {
     uv_loop_t *loop = listener->socket.loop;
-    struct remote_t *remote = remote_new_object(loop, listener->timeout);
+    struct remote_t *remote = remote_new_object(loop, listener->timer_wheel, listener->timeout, addr->sa_family);
 
 #ifdef SET_INTERFACE
     if (listener->iface) {
@@ -1302,6 +1331,13 @@ signal_cb(uv_signal_t* handle, int signum)
             keep_resolving = 0;
             uv_stop(handle->loop);
             break;
+#ifndef __MINGW32__
+        case SIGHUP:
+            if (acl) {
+                acl_reload(handle->loop);
+            }
+            break;
+#endif
         default:
             assert(0);
             break;
@@ -1733,6 +1769,9 @@ int ssr_local_main_loop(const struct server_config *config, void(*feedback_state
     uv_loop_t *loop;
     uv_signal_t sigint_watcher;
     uv_signal_t sigterm_watcher;
+#ifndef __MINGW32__
+    uv_signal_t sighup_watcher;
+#endif
     struct listener_t *listen_ctx;
     uv_tcp_t *listener_socket;
     int listenfd;
@@ -1844,12 +1883,24 @@ int ssr_local_main_loop(const struct server_config *config, void(*feedback_state
     current_listener = listener;
 
     loop = uv_default_loop();
+    listener->timer_wheel = timer_wheel_create(loop, TIMER_WHEEL_TICK_MS);
+#ifdef ANDROID
+    if (vpn) {
+        char path[257];
+        sprintf(path, "%s/protect_path", prefix);
+        protect_channel = protect_channel_create(loop, path);
+    }
+#endif
 
     // Setup signal handler
     uv_signal_init(loop, &sigint_watcher);
     uv_signal_init(loop, &sigterm_watcher);
     uv_signal_start(&sigint_watcher, signal_cb, SIGINT);
     uv_signal_start(&sigterm_watcher, signal_cb, SIGTERM);
+#ifndef __MINGW32__
+    uv_signal_init(loop, &sighup_watcher);
+    uv_signal_start(&sighup_watcher, signal_cb, SIGHUP);
+#endif
 
     listen_ctx = current_listener;
 
@@ -1928,6 +1979,11 @@ int ssr_local_main_loop(const struct server_config *config, void(*feedback_state
     {
         // uv_stop(listener_socket->loop);
         free_connections(); // after this, all inactive listener should be released already, so we only need to release the current_listener
+        timer_wheel_release(current_listener->timer_wheel);
+#ifdef ANDROID
+        protect_channel_release(protect_channel);
+        protect_channel = NULL;
+#endif
         listener_release(current_listener);
     }
 
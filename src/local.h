@@ -28,6 +28,7 @@
 
 #include "encrypt.h"
 #include "jconf.h"
+#include "timer_wheel.h"
 #include "protocol.h"
 
 #include "common.h"
@@ -51,13 +52,14 @@ struct listener_t {
     char *iface;
     int timeout;
     int mptcp;
+    struct timer_wheel *timer_wheel;  /* The connections' timeouts, one tick timer for all of them. */
 
     size_t server_num;
     struct server_env_t servers[MAX_SERVER_NUM];
 };
 
 struct remote_ctx_t {
-    uv_timer_t watcher;
+    struct timer_wheel_entry watcher;
     uint64_t watcher_interval;
 
     struct remote_t *remote; // __weak_ptr
@@ -70,9 +72,13 @@ struct remote_t {
     struct remote_ctx_t *send_ctx;
     bool connected;
     struct local_t *local;  // __weak_ptr
+    struct timer_wheel *timer_wheel;  // __weak_ptr
 
     struct sockaddr_storage addr;
     size_t addr_len;
+#ifdef ANDROID
+    struct protect_request *protect;  /* While the VpnService protects the socket. */
+#endif
 
     int ref_count;
     bool dying;
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "loop_watchdog.h"
+#include "common.h"
+#include "dump_info.h"
+
+#define NS_PER_MS 1000000ull
+
+static const char *loop_work_names[loop_work_max + 1] = { "read", "resolve", "tls", "other" };
+
+struct loop_watchdog {
+    uv_prepare_t prepare;  /* Ends an iteration, before the poll blocks. */
+    uv_check_t check;  /* After the poll phase. */
+    uv_timer_t timer;
+    int open_handles;
+    uint64_t stall_ns;
+    uint64_t check_at;  /* uv_hrtime() of the last check, 0 before the first. */
+    uint64_t woke_at;  /* The first work after the last prepare, 0 for none yet. */
+    uint64_t timer_due;  /* uv_now() the timer is due. */
+    unsigned int depth;
+    uint64_t work_ns[loop_work_max];  /* Of the iteration going on. */
+    uint64_t last_warn;
+    uint64_t suppressed;
+    uint64_t stalls[loop_work_max + 1];  /* By the work that took the most, the last unmarked. */
+    uint64_t iterations[LOOP_WATCHDOG_BUCKETS];
+    uint64_t drifts[LOOP_WATCHDOG_BUCKETS];
+    uint64_t worst_iteration_ns;
+    uint64_t worst_drift_ms;
+};
+
+static size_t bucket_of(uint64_t ms) {
+    size_t index = 0;
+    while (ms && index < LOOP_WATCHDOG_BUCKETS - 1) {
+        ms >>= 1;
+        ++index;
+    }
+    return index;
+}
+
+static void loop_watchdog_stalled(struct loop_watchdog *dog, uint64_t busy, uint64_t now) {
+    uint64_t marked = 0, most = 0;
+    size_t work, culprit = loop_work_max;
+
+    for (work = 0; work < loop_work_max; ++work) {
+        marked += dog->work_ns[work];
+        if (dog->work_ns[work] > most) {
+            most = dog->work_ns[work];
+            culprit = work;
+        }
+    }
+    if (busy > marked && busy - marked > most) {
+        culprit = loop_work_max;
+    }
+    ++dog->stalls[culprit];
+
+    if (dog->last_warn && now - dog->last_warn < LOOP_WATCHDOG_WARN_MS * NS_PER_MS) {
+        ++dog->suppressed;
+        return;
+    }
+    pr_warn("loop stalled %llu ms, read %llu ms, resolve %llu ms, tls %llu ms, other %llu ms, %llu more since the last",
+        (unsigned long long)(busy / NS_PER_MS),
+        (unsigned long long)(dog->work_ns[loop_work_read] / NS_PER_MS),
+        (unsigned long long)(dog->work_ns[loop_work_resolve] / NS_PER_MS),
+        (unsigned long long)(dog->work_ns[loop_work_tls] / NS_PER_MS),
+        (unsigned long long)((busy > marked ? busy - marked : 0) / NS_PER_MS),
+        (unsigned long long)dog->suppressed);
+    dog->last_warn = now;
+    dog->suppressed = 0;
+}
+
+static void loop_watchdog_prepare_cb(uv_prepare_t *handle) {
+    struct loop_watchdog *dog = CONTAINER_OF(handle, struct loop_watchdog, prepare);
+    uint64_t now = uv_hrtime();
+
+    if (dog->check_at) {
+        // Work that ran before the check, in the poll phase, started the iteration.
+        uint64_t start = (dog->woke_at && dog->woke_at < dog->check_at) ? dog->woke_at : dog->check_at;
+        uint64_t busy = (now > start) ? now - start : 0;
+        ++dog->iterations[bucket_of(busy / NS_PER_MS)];
+        if (busy > dog->worst_iteration_ns) {
+            dog->worst_iteration_ns = busy;
+        }
+        if (busy >= dog->stall_ns) {
+            loop_watchdog_stalled(dog, busy, now);
+        }
+    }
+    dog->woke_at = 0;
+    memset(dog->work_ns, 0, sizeof(dog->work_ns));
+}
+
+static void loop_watchdog_check_cb(uv_check_t *handle) {
+    struct loop_watchdog *dog = CONTAINER_OF(handle, struct loop_watchdog, check);
+    dog->check_at = uv_hrtime();
+}
+
+static void loop_watchdog_timer_cb(uv_timer_t *handle) {
+    struct loop_watchdog *dog = CONTAINER_OF(handle, struct loop_watchdog, timer);
+    uint64_t now = uv_now(handle->loop);
+    uint64_t drift = (now > dog->timer_due) ? now - dog->timer_due : 0;
+
+    ++dog->drifts[bucket_of(drift)];
+    if (drift > dog->worst_drift_ms) {
+        dog->worst_drift_ms = drift;
+    }
+    dog->timer_due = now + LOOP_WATCHDOG_DRIFT_MS;
+}
+
+struct loop_watchdog * loop_watchdog_create(uv_loop_t *loop, unsigned int stall_ms) {
+    struct loop_watchdog *dog;
+    if (stall_ms == 0) {
+        return NULL;
+    }
+    dog = (struct loop_watchdog *) calloc(1, sizeof(*dog));
+    dog->stall_ns = (uint64_t)stall_ms * NS_PER_MS;
+    VERIFY(0 == uv_prepare_init(loop, &dog->prepare));
+    VERIFY(0 == uv_check_init(loop, &dog->check));
+    VERIFY(0 == uv_timer_init(loop, &dog->timer));
+    dog->open_handles = 3;
+    VERIFY(0 == uv_prepare_start(&dog->prepare, loop_watchdog_prepare_cb));
+    VERIFY(0 == uv_check_start(&dog->check, loop_watchdog_check_cb));
+    dog->timer_due = uv_now(loop) + LOOP_WATCHDOG_DRIFT_MS;
+    VERIFY(0 == uv_timer_start(&dog->timer, loop_watchdog_timer_cb, LOOP_WATCHDOG_DRIFT_MS, LOOP_WATCHDOG_DRIFT_MS));
+    // None of them holds the loop.
+    uv_unref((uv_handle_t *)&dog->prepare);
+    uv_unref((uv_handle_t *)&dog->check);
+    uv_unref((uv_handle_t *)&dog->timer);
+    return dog;
+}
+
+static void loop_watchdog_close_done_cb(uv_handle_t *handle) {
+    struct loop_watchdog *dog = (struct loop_watchdog *)handle->data;
+    if (--dog->open_handles == 0) {
+        free(dog);
+    }
+}
+
+void loop_watchdog_release(struct loop_watchdog *dog) {
+    if (dog == NULL) {
+        return;
+    }
+    dog->prepare.data = dog;
+    dog->check.data = dog;
+    dog->timer.data = dog;
+    uv_close((uv_handle_t *)&dog->prepare, loop_watchdog_close_done_cb);
+    uv_close((uv_handle_t *)&dog->check, loop_watchdog_close_done_cb);
+    uv_close((uv_handle_t *)&dog->timer, loop_watchdog_close_done_cb);
+}
+
+uint64_t loop_watchdog_begin(struct loop_watchdog *dog) {
+    uint64_t now;
+    if (dog == NULL || dog->depth++) {
+        return 0;
+    }
+    now = uv_hrtime();
+    if (dog->woke_at == 0) {
+        dog->woke_at = now;
+    }
+    return now;
+}
+
+void loop_watchdog_end(struct loop_watchdog *dog, enum loop_work work, uint64_t begun) {
+    if (dog == NULL) {
+        return;
+    }
+    --dog->depth;
+    if (begun) {
+        dog->work_ns[work] += uv_hrtime() - begun;
+    }
+}
+
+static void histogram_dump(const char *title, const uint64_t *buckets, uint64_t worst_ms) {
+    char line[512];
+    size_t index, len;
+
+    len = (size_t)snprintf(line, sizeof(line), "%s max %llu ms", title, (unsigned long long)worst_ms);
+    for (index = 0; index < LOOP_WATCHDOG_BUCKETS && len < sizeof(line); ++index) {
+        if (buckets[index] == 0) {
+            continue;
+        }
+        if (index == LOOP_WATCHDOG_BUCKETS - 1) {
+            len += (size_t)snprintf(line + len, sizeof(line) - len, ", >=%u ms %llu",
+                1u << (index - 1), (unsigned long long)buckets[index]);
+        } else {
+            len += (size_t)snprintf(line + len, sizeof(line) - len, ", <%u ms %llu",
+                1u << index, (unsigned long long)buckets[index]);
+        }
+    }
+    pr_info("%s", line);
+}
+
+void loop_watchdog_dump(const struct loop_watchdog *dog) {
+    if (dog == NULL) {
+        return;
+    }
+    histogram_dump("loop iterations ", dog->iterations, dog->worst_iteration_ns / NS_PER_MS);
+    histogram_dump("loop timer lag  ", dog->drifts, dog->worst_drift_ms);
+    pr_info("loop stalls      over %llu ms, %s %llu, %s %llu, %s %llu, %s %llu",
+        (unsigned long long)(dog->stall_ns / NS_PER_MS),
+        loop_work_names[loop_work_read], (unsigned long long)dog->stalls[loop_work_read],
+        loop_work_names[loop_work_resolve], (unsigned long long)dog->stalls[loop_work_resolve],
+        loop_work_names[loop_work_tls], (unsigned long long)dog->stalls[loop_work_tls],
+        loop_work_names[loop_work_max], (unsigned long long)dog->stalls[loop_work_max]);
+}
@@ -0,0 +1,40 @@
+#if !defined(__loop_watchdog_h__)
+#define __loop_watchdog_h__ 1
+
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * Timing of one loop. A prepare and a check handle bracket the poll phase,
+ * the time from its first work to the next prepare is the iteration's busy
+ * time. A timer measures how late the loop gets to it. Both go into
+ * histograms in milliseconds by powers of two. An iteration busy for at
+ * least |stall_ms| is reported with what took its time, the callbacks
+ * marked with loop_watchdog_begin() and loop_watchdog_end(), the rest is
+ * "other". Not thread safe: one per uv_loop_t.
+ */
+
+#define LOOP_WATCHDOG_BUCKETS   12    /* Below 1 ms, below 2 ms, ..., 1024 ms and more. */
+#define LOOP_WATCHDOG_DRIFT_MS  250   /* Period of the timer whose lateness is measured. */
+#define LOOP_WATCHDOG_WARN_MS   1000  /* At most one stall report per this, the rest are counted. */
+
+enum loop_work {
+    loop_work_read,     /* A tunnel's read, its decrypt, encrypt and write. */
+    loop_work_resolve,  /* A getaddrinfo or udns answer. */
+    loop_work_tls,      /* Data of a TLS connection, its handshake included. */
+    loop_work_max,
+};
+
+struct loop_watchdog;
+
+/* NULL without a |stall_ms|. */
+struct loop_watchdog * loop_watchdog_create(uv_loop_t *loop, unsigned int stall_ms);
+/* Closes the handles, it's freed once they're closed. */
+void loop_watchdog_release(struct loop_watchdog *dog);
+/* The start of a callback's work, for loop_watchdog_end(). Nested work counts as the outer one's. */
+uint64_t loop_watchdog_begin(struct loop_watchdog *dog);
+void loop_watchdog_end(struct loop_watchdog *dog, enum loop_work work, uint64_t begun);
+/* The histograms and the stalls, with pr_info(). */
+void loop_watchdog_dump(const struct loop_watchdog *dog);
+
+#endif // !defined(__loop_watchdog_h__)
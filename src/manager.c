@@ -78,6 +78,7 @@ char *working_dir    = NULL;
 int working_dir_size = 0;
 
 static struct cork_hash_table *server_table;
+static struct traffic_shm *traffic_shm;
 
 #ifndef __MINGW32__
 static int
@@ -130,6 +131,10 @@ construct_command_line(struct manager_ctx *manager, struct server_t *server)
              executable, manager->method, manager->manager_address,
              working_dir, server->port, working_dir, server->port);
 
+    if (server->slot != NULL) {
+        int len = strlen(cmd);
+        snprintf(cmd + len, BUF_SIZE - len, " --traffic-file %s/.shadowsocks_traffic", working_dir);
+    }
     if (manager->acl != NULL) {
         int len = strlen(cmd);
         snprintf(cmd + len, BUF_SIZE - len, " --acl %s", manager->acl);
@@ -306,6 +311,7 @@ add_server(struct manager_ctx *manager, struct server_t *server)
 {
     bool new = false;
     cork_hash_table_put(server_table, (void *)server->port, (void *)server, &new, NULL, NULL);
+    server->slot = traffic_shm_assign(traffic_shm, server->port);
 
     char *cmd = construct_command_line(manager, server);
     if (system(cmd) == -1) {
@@ -367,6 +373,7 @@ remove_server(char *prefix, char *port)
     cork_hash_table_delete(server_table, (void *)port, (void **)&old_port, (void **)&old_server);
 
     if (old_server != NULL) {
+        traffic_shm_release(old_server->slot);
         ss_free(old_server);
     }
 
@@ -479,7 +486,8 @@ manager_recv_cb(EV_P_ ev_io *w, int revents)
                 }
                 memset(buf, 0, BUF_SIZE);
             } else {
-                sprintf(buf + pos, "\"%s\":%" PRIu64 ",", server->port, server->traffic);
+                uint64_t traffic = server->slot ? traffic_slot_read(server->slot) : server->traffic;
+                sprintf(buf + pos, "\"%s\":%" PRIu64 ",", server->port, traffic);
             }
         }
 
@@ -883,6 +891,13 @@ main(int argc, char **argv)
 
     server_table = cork_string_hash_table_new(MAX_PORT_NUM, 0);
 
+    char traffic_path[PATH_MAX];
+    snprintf(traffic_path, sizeof(traffic_path), "%s/.shadowsocks_traffic", working_dir);
+    traffic_shm = traffic_shm_create(traffic_path);
+    if (traffic_shm == NULL) {
+        LOGE("unable to create %s, servers send stat messages", traffic_path);
+    }
+
     if (conf != NULL) {
         for (i = 0; i < conf->server_new_1.server_num; i++) {
             struct server_t *server = ss_malloc(sizeof(struct server_t));
@@ -959,6 +974,7 @@ main(int argc, char **argv)
 
     ev_signal_stop(EV_DEFAULT, &sigint_watcher);
     ev_signal_stop(EV_DEFAULT, &sigterm_watcher);
+    traffic_shm_close(traffic_shm);
     ss_free(working_dir);
 
     return 0;
@@ -28,6 +28,7 @@
 #include <libcork/ds.h>
 
 #include "jconf.h"
+#include "traffic_shm.h"
 
 #include "common.h"
 
@@ -58,6 +59,7 @@ struct server_t {
     char port[8];
     char password[128];
     uint64_t traffic;
+    struct traffic_slot *slot; /* Live counter the server adds to, NULL for stat messages. */
 };
 
 #endif // _MANAGER_H
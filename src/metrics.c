@@ -0,0 +1,364 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+#include "tunnel_stats.h"
+#include "sockaddr_universal.h"
+#include "common.h"
+#include "dump_info.h"
+#include "ssr_alloc.h"
+
+#define METRICS_CONNECTIONS_MAX  16     /* Scrapes served at once, more are closed at accept. */
+#define METRICS_REPLY_INITIAL    16384
+
+/* Bucket bounds of the latency histograms, in microseconds. */
+static const uint64_t metrics_bounds_usec[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000, 2500000, 5000000, 10000000, 30000000,
+};
+
+struct metrics_writer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+struct metrics_conn {
+    uv_tcp_t tcp;
+    uv_write_t write_req;
+    struct metrics_server *ms;
+    char request[METRICS_REQUEST_MAX];
+    size_t request_len;
+    char *reply;
+    bool answered;
+    struct metrics_conn *prev;
+    struct metrics_conn *next;
+};
+
+struct metrics_server {
+    uv_tcp_t listener;
+    metrics_collect_cb collect;
+    void *p;
+    struct metrics_conn *conns;
+    size_t conns_count;
+    int open_handles;  /* The listener and the connections, freed at 0 once shut down. */
+    bool shutting_down;
+};
+
+static void writer_printf(struct metrics_writer *w, const char *format, ...) {
+    for (;;) {
+        va_list ap;
+        int n;
+        size_t room = w->capacity - w->len;
+
+        va_start(ap, format);
+        n = vsnprintf(w->data + w->len, room, format, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < room) {
+            w->len += (size_t)n;
+            return;
+        }
+        w->capacity = (w->capacity + (size_t)n) * 2;
+        w->data = (char *) realloc(w->data, w->capacity);
+    }
+}
+
+void metrics_family(struct metrics_writer *w, const char *name, const char *type, const char *help) {
+    writer_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_sample(struct metrics_writer *w, const char *name, const char *labels, uint64_t value) {
+    if (labels && labels[0]) {
+        writer_printf(w, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    } else {
+        writer_printf(w, "%s %llu\n", name, (unsigned long long)value);
+    }
+}
+
+void metrics_sample_double(struct metrics_writer *w, const char *name, const char *labels, double value) {
+    if (labels && labels[0]) {
+        writer_printf(w, "%s{%s} %.9g\n", name, labels, value);
+    } else {
+        writer_printf(w, "%s %.9g\n", name, value);
+    }
+}
+
+void metrics_histogram(struct metrics_writer *w, const char *name, const char *labels, const struct tunnel_stats_histogram *hist) {
+    const char *comma = (labels && labels[0]) ? "," : "";
+    size_t index;
+
+    if (labels == NULL) {
+        labels = "";
+    }
+    for (index = 0; index < sizeof(metrics_bounds_usec) / sizeof(metrics_bounds_usec[0]); ++index) {
+        writer_printf(w, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, comma,
+            (double)metrics_bounds_usec[index] / 1e6,
+            (unsigned long long)tunnel_stats_count_within(hist, metrics_bounds_usec[index]));
+    }
+    writer_printf(w, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, comma, (unsigned long long)hist->count);
+    writer_printf(w, "%s_sum%s%s%s %.6f\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "", (double)hist->sum / 1e6);
+    writer_printf(w, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "", (unsigned long long)hist->count);
+}
+
+char * metrics_label_escape(const char *value, char *out, size_t size) {
+    size_t len = 0;
+    if (size == 0) {
+        return out;
+    }
+    for (; *value && len + 2 < size; ++value) {
+        if (*value == '\\' || *value == '"') {
+            out[len++] = '\\';
+            out[len++] = *value;
+        } else if (*value == '\n') {
+            out[len++] = '\\';
+            out[len++] = 'n';
+        } else {
+            out[len++] = *value;
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+void metrics_stage_times(struct metrics_writer *w, const struct tunnel_stats *stats) {
+#if defined(SSR_STAGE_TIMING)
+    char labels[2 * TUNNEL_STATS_STAGE_NAME_MAX + 64];
+    size_t index, stage;
+
+    metrics_family(w, "ssr_cipher_stage_seconds_total", "counter", "Time in each step of the tunnel ciphers, by protocol and obfs.");
+    for (index = 0; index < stats->stages_count; ++index) {
+        const struct tunnel_stage_times *times = &stats->stages[index];
+        for (stage = 0; stage < tunnel_cipher_stage_max; ++stage) {
+            snprintf(labels, sizeof(labels), "protocol=\"%s\",obfs=\"%s\",stage=\"%s\"",
+                times->protocol, times->obfs, tunnel_stats_stage_name((enum tunnel_cipher_stage)stage));
+            metrics_sample_double(w, "ssr_cipher_stage_seconds_total", labels, (double)times->nsec[stage] / 1e9);
+        }
+    }
+    metrics_family(w, "ssr_cipher_stage_calls_total", "counter", "Steps of the tunnel ciphers timed, by protocol and obfs.");
+    for (index = 0; index < stats->stages_count; ++index) {
+        const struct tunnel_stage_times *times = &stats->stages[index];
+        for (stage = 0; stage < tunnel_cipher_stage_max; ++stage) {
+            snprintf(labels, sizeof(labels), "protocol=\"%s\",obfs=\"%s\",stage=\"%s\"",
+                times->protocol, times->obfs, tunnel_stats_stage_name((enum tunnel_cipher_stage)stage));
+            metrics_sample(w, "ssr_cipher_stage_calls_total", labels, times->calls[stage]);
+        }
+    }
+#else
+    (void)w; (void)stats;
+#endif
+}
+
+void metrics_census(struct metrics_writer *w) {
+    struct ssr_census_stats census[ssr_census_kind_max];
+    char labels[64];
+    int kind;
+
+    ssr_census_get_stats(census);
+    metrics_family(w, "ssr_objects_live", "gauge", "Objects that exist now, by kind.");
+    for (kind = 0; kind < ssr_census_kind_max; ++kind) {
+        snprintf(labels, sizeof(labels), "object=\"%s\"", ssr_census_kind_name((enum ssr_census_kind)kind));
+        metrics_sample(w, "ssr_objects_live", labels, (uint64_t)(census[kind].live > 0 ? census[kind].live : 0));
+    }
+    metrics_family(w, "ssr_object_bytes", "gauge", "Memory the live objects hold by themselves, by kind.");
+    for (kind = 0; kind < ssr_census_kind_max; ++kind) {
+        snprintf(labels, sizeof(labels), "object=\"%s\"", ssr_census_kind_name((enum ssr_census_kind)kind));
+        metrics_sample(w, "ssr_object_bytes", labels, (uint64_t)(census[kind].bytes > 0 ? census[kind].bytes : 0));
+    }
+}
+
+static void metrics_server_release_handle(struct metrics_server *ms) {
+    if (--ms->open_handles == 0 && ms->shutting_down) {
+        free(ms);
+    }
+}
+
+static void metrics_conn_close_done_cb(uv_handle_t *handle) {
+    struct metrics_conn *conn = CONTAINER_OF(handle, struct metrics_conn, tcp);
+    struct metrics_server *ms = conn->ms;
+    free(conn->reply);
+    free(conn);
+    metrics_server_release_handle(ms);
+}
+
+static void metrics_conn_close(struct metrics_conn *conn) {
+    struct metrics_server *ms = conn->ms;
+    if (uv_is_closing((uv_handle_t *)&conn->tcp)) {
+        return;
+    }
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        ms->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    ms->conns_count--;
+    uv_close((uv_handle_t *)&conn->tcp, metrics_conn_close_done_cb);
+}
+
+static void metrics_write_done_cb(uv_write_t *req, int status) {
+    struct metrics_conn *conn = CONTAINER_OF(req, struct metrics_conn, write_req);
+    (void)status;
+    metrics_conn_close(conn);
+}
+
+/* "GET /metrics" and "GET /", with or without a query. */
+static bool metrics_request_wanted(const char *request) {
+    const char *path;
+    size_t len;
+    if (strncmp(request, "GET ", 4) != 0) {
+        return false;
+    }
+    path = request + 4;
+    len = strcspn(path, " ?\r\n");
+    return (len == 1 && path[0] == '/') || (len == 8 && memcmp(path, "/metrics", 8) == 0);
+}
+
+static void metrics_answer(struct metrics_conn *conn) {
+    struct metrics_server *ms = conn->ms;
+    struct metrics_writer body = { NULL, 0, 0 };
+    struct metrics_writer reply = { NULL, 0, 0 };
+    uv_buf_t buf;
+
+    conn->answered = true;
+    uv_read_stop((uv_stream_t *)&conn->tcp);
+
+    reply.capacity = 256;
+    reply.data = (char *) malloc(reply.capacity);
+    if (metrics_request_wanted(conn->request)) {
+        body.capacity = METRICS_REPLY_INITIAL;
+        body.data = (char *) malloc(body.capacity);
+        ms->collect(ms->p, &body);
+        writer_printf(&reply,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", body.len);
+        writer_printf(&reply, "%.*s", (int)body.len, body.data);
+        free(body.data);
+    } else {
+        writer_printf(&reply,
+            "HTTP/1.0 404 Not Found\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n");
+    }
+
+    conn->reply = reply.data;
+    buf = uv_buf_init(reply.data, (unsigned int)reply.len);
+    if (uv_write(&conn->write_req, (uv_stream_t *)&conn->tcp, &buf, 1, metrics_write_done_cb) != 0) {
+        metrics_conn_close(conn);
+    }
+}
+
+static void metrics_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct metrics_conn *conn = CONTAINER_OF(handle, struct metrics_conn, tcp);
+    // One byte stays free for the terminator.
+    buf->base = conn->request + conn->request_len;
+    buf->len = (unsigned int)(sizeof(conn->request) - 1 - conn->request_len);
+    (void)suggested_size;
+}
+
+static void metrics_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct metrics_conn *conn = CONTAINER_OF(stream, struct metrics_conn, tcp);
+    (void)buf;
+    if (nread == 0 || conn->answered) {
+        return;
+    }
+    if (nread < 0) {
+        metrics_conn_close(conn);
+        return;
+    }
+    conn->request_len += (size_t)nread;
+    conn->request[conn->request_len] = '\0';
+    if (strstr(conn->request, "\r\n\r\n") || strstr(conn->request, "\n\n")) {
+        metrics_answer(conn);
+    } else if (conn->request_len >= sizeof(conn->request) - 1) {
+        metrics_conn_close(conn);
+    }
+}
+
+static void metrics_connection_cb(uv_stream_t *server, int status) {
+    struct metrics_server *ms = CONTAINER_OF(server, struct metrics_server, listener);
+    struct metrics_conn *conn;
+
+    if (status != 0) {
+        return;
+    }
+    conn = (struct metrics_conn *) calloc(1, sizeof(*conn));
+    conn->ms = ms;
+    VERIFY(0 == uv_tcp_init(server->loop, &conn->tcp));
+    ms->open_handles++;
+    conn->next = ms->conns;
+    if (ms->conns) {
+        ms->conns->prev = conn;
+    }
+    ms->conns = conn;
+    ms->conns_count++;
+
+    if (uv_accept(server, (uv_stream_t *)&conn->tcp) != 0 ||
+        ms->conns_count > METRICS_CONNECTIONS_MAX ||
+        uv_read_start((uv_stream_t *)&conn->tcp, metrics_alloc_cb, metrics_read_cb) != 0)
+    {
+        metrics_conn_close(conn);
+    }
+}
+
+static void metrics_listener_close_done_cb(uv_handle_t *handle) {
+    metrics_server_release_handle(CONTAINER_OF(handle, struct metrics_server, listener));
+}
+
+struct metrics_server * metrics_server_create(uv_loop_t *loop, const char *address, metrics_collect_cb collect, void *p) {
+    union sockaddr_universal addr = { 0 };
+    struct metrics_server *ms;
+    char host[256] = { 0 };
+    const char *colon = strrchr(address, ':');
+    int err;
+
+    if (colon == NULL || (size_t)(colon - address) >= sizeof(host)) {
+        pr_err("metrics_address %s is not host:port", address);
+        return NULL;
+    }
+    memcpy(host, address, (size_t)(colon - address));
+    if (host[0] == '[') {
+        memmove(host, host + 1, strlen(host));
+        host[strlen(host) - 1] = '\0';
+    }
+    if (convert_universal_address(host, (unsigned short)atoi(colon + 1), &addr) != 0) {
+        pr_err("metrics_address %s is not host:port", address);
+        return NULL;
+    }
+
+    ms = (struct metrics_server *) calloc(1, sizeof(*ms));
+    ms->collect = collect;
+    ms->p = p;
+    VERIFY(0 == uv_tcp_init(loop, &ms->listener));
+    ms->open_handles = 1;
+    err = uv_tcp_bind(&ms->listener, &addr.addr, 0);
+    if (err == 0) {
+        err = uv_listen((uv_stream_t *)&ms->listener, 16, metrics_connection_cb);
+    }
+    if (err != 0) {
+        pr_err("metrics_address %s: %s", address, uv_strerror(err));
+        metrics_server_shutdown(ms);
+        return NULL;
+    }
+    pr_info("metrics on       http://%s/metrics", address);
+    return ms;
+}
+
+void metrics_server_shutdown(struct metrics_server *ms) {
+    if (ms == NULL || ms->shutting_down) {
+        return;
+    }
+    ms->shutting_down = true;
+    while (ms->conns) {
+        metrics_conn_close(ms->conns);
+    }
+    uv_close((uv_handle_t *)&ms->listener, metrics_listener_close_done_cb);
+}
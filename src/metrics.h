@@ -0,0 +1,47 @@
+#if !defined(__metrics_h__)
+#define __metrics_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * A scrape endpoint in the Prometheus text format, which OpenMetrics
+ * scrapers read too. It listens on one loop, answers every GET with what
+ * |collect| writes at that moment and closes the connection. Nothing is
+ * counted here: the loops keep their own plain counters and |collect| sums
+ * them up, so the data path stays free of shared atomics. A counter of
+ * another loop may be read while it's being bumped, a 64 bit load that can
+ * at worst miss the latest increment. Not thread safe: one per uv_loop_t.
+ */
+
+#define METRICS_REQUEST_MAX  4096  /* Bytes of a request's head, a longer one is dropped. */
+
+struct metrics_server;
+struct metrics_writer;
+struct tunnel_stats_histogram;
+
+typedef void (*metrics_collect_cb)(void *p, struct metrics_writer *w);
+
+/* Listens on TCP |address|, host:port. NULL if it can't. */
+struct metrics_server * metrics_server_create(uv_loop_t *loop, const char *address, metrics_collect_cb collect, void *p);
+/* Closes the listener and the connections still open, it's freed once they're closed. */
+void metrics_server_shutdown(struct metrics_server *ms);
+
+/* The # HELP and # TYPE lines of |name|, before its samples. */
+void metrics_family(struct metrics_writer *w, const char *name, const char *type, const char *help);
+/* Copies |value| to |out| with the backslashes, quotes and newlines a label value can't hold escaped. */
+char * metrics_label_escape(const char *value, char *out, size_t size);
+/* |labels| is the inside of the braces, label="value",..., or NULL. */
+void metrics_sample(struct metrics_writer *w, const char *name, const char *labels, uint64_t value);
+void metrics_sample_double(struct metrics_writer *w, const char *name, const char *labels, double value);
+/* The _bucket, _sum and _count samples of a tunnel_stats histogram, in seconds. */
+void metrics_histogram(struct metrics_writer *w, const char *name, const char *labels, const struct tunnel_stats_histogram *hist);
+
+struct tunnel_stats;
+/* ssr_cipher_stage_seconds_total and _calls_total by protocol, obfs and stage, nothing without SSR_STAGE_TIMING. */
+void metrics_stage_times(struct metrics_writer *w, const struct tunnel_stats *stats);
+/* ssr_objects_live and ssr_object_bytes, the census of ssr_alloc.h. */
+void metrics_census(struct metrics_writer *w);
+
+#endif // !defined(__metrics_h__)
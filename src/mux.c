@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include "mux.h"
+#include "ssrbuffer.h"
+
+enum mux_frame_type {
+    mux_frame_open = 1,
+    mux_frame_data = 2,
+    mux_frame_window = 3,
+    mux_frame_fin = 4,
+    mux_frame_rst = 5,
+};
+
+struct mux_stream {
+    struct mux_session *session;
+    uint32_t id;
+    int64_t send_window;  /* Bytes the peer takes before its next WINDOW. */
+    size_t unconsumed;  /* Delivered by on_data(), not consumed yet. */
+    size_t credit;  /* Consumed, not granted back yet. */
+    const struct mux_stream_callbacks *cb;
+    void *p;
+    struct mux_stream *next;
+};
+
+struct mux_session {
+    bool client;
+    const struct mux_session_callbacks *cb;
+    void *p;
+    uint32_t next_id;
+    size_t count;
+    struct mux_stream *streams;
+    struct buffer_t *tx;  /* Frames not taken by cb->send() yet. */
+    struct buffer_t *rx;  /* A partial frame. */
+};
+
+static uint32_t mux_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void mux_put32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static void mux_put_frame(struct mux_session *session, uint8_t type, uint32_t id, const uint8_t *payload, size_t size) {
+    uint8_t head[MUX_FRAME_HEAD];
+    head[0] = type;
+    mux_put32(head + 1, id);
+    head[5] = (uint8_t)(size >> 8);
+    head[6] = (uint8_t)size;
+    buffer_concatenate(session->tx, head, sizeof(head));
+    if (size > 0) {
+        buffer_concatenate(session->tx, payload, size);
+    }
+}
+
+static struct mux_stream * mux_stream_find(struct mux_session *session, uint32_t id) {
+    struct mux_stream *stream;
+    for (stream = session->streams; stream; stream = stream->next) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static struct mux_stream * mux_stream_add(struct mux_session *session, uint32_t id) {
+    struct mux_stream *stream = (struct mux_stream *) calloc(1, sizeof(*stream));
+    stream->session = session;
+    stream->id = id;
+    stream->send_window = MUX_STREAM_WINDOW;
+    stream->next = session->streams;
+    session->streams = stream;
+    session->count++;
+    return stream;
+}
+
+static void mux_stream_unlink(struct mux_stream *stream) {
+    struct mux_session *session = stream->session;
+    struct mux_stream **link;
+    for (link = &session->streams; *link; link = &(*link)->next) {
+        if (*link == stream) {
+            *link = stream->next;
+            session->count--;
+            return;
+        }
+    }
+}
+
+static void mux_stream_drop(struct mux_stream *stream, bool reset) {
+    const struct mux_stream_callbacks *cb = stream->cb;
+    void *p = stream->p;
+    mux_stream_unlink(stream);
+    free(stream);
+    if (cb && cb->on_close) {
+        cb->on_close(p, reset);
+    }
+}
+
+struct mux_session * mux_session_create(bool client, const struct mux_session_callbacks *cb, void *p) {
+    struct mux_session *session = (struct mux_session *) calloc(1, sizeof(*session));
+    session->client = client;
+    session->cb = cb;
+    session->p = p;
+    session->next_id = 1;  /* Odd, only the client opens. */
+    session->tx = buffer_create(MUX_FRAME_PAYLOAD_MAX);
+    session->rx = buffer_create(0);
+    return session;
+}
+
+void mux_session_destroy(struct mux_session *session) {
+    if (session == NULL) {
+        return;
+    }
+    while (session->streams) {
+        mux_stream_drop(session->streams, true);
+    }
+    buffer_release(session->tx);
+    buffer_release(session->rx);
+    free(session);
+}
+
+size_t mux_session_stream_count(const struct mux_session *session) {
+    return session ? session->count : 0;
+}
+
+void mux_session_flush(struct mux_session *session) {
+    if (session->tx->len == 0) {
+        return;
+    }
+    if (session->cb->send(session->p, session->tx)) {
+        session->tx->len = 0;  /* buffer_reset() would wipe the whole capacity. */
+    }
+}
+
+static bool mux_dispatch(struct mux_session *session, uint8_t type, uint32_t id, const uint8_t *payload, size_t size) {
+    struct mux_stream *stream = mux_stream_find(session, id);
+
+    switch (type) {
+    case mux_frame_open:
+        if (session->client || id == 0 || stream || session->cb->accept == NULL) {
+            return false;
+        }
+        if (session->count >= MUX_SESSION_MAX_STREAMS) {
+            mux_put_frame(session, mux_frame_rst, id, NULL, 0);
+            break;
+        }
+        stream = mux_stream_add(session, id);
+        session->cb->accept(session->p, stream, payload, size);
+        break;
+    case mux_frame_data:
+        if (stream == NULL) {
+            break;  /* Closed here already, the peer hasn't seen it yet. */
+        }
+        stream->unconsumed += size;
+        if (stream->unconsumed > 2 * MUX_STREAM_WINDOW) {
+            // The peer ignores the window, don't buffer for it.
+            mux_put_frame(session, mux_frame_rst, id, NULL, 0);
+            mux_stream_drop(stream, true);
+            break;
+        }
+        if (size > 0 && stream->cb && stream->cb->on_data) {
+            stream->cb->on_data(stream->p, payload, size);
+        }
+        break;
+    case mux_frame_window:
+        if (size != 4) {
+            return false;
+        }
+        if (stream) {
+            bool was_closed = (stream->send_window <= 0);
+            stream->send_window += mux_get32(payload);
+            if (was_closed && stream->send_window > 0 && stream->cb && stream->cb->on_window) {
+                stream->cb->on_window(stream->p);
+            }
+        }
+        break;
+    case mux_frame_fin:
+    case mux_frame_rst:
+        if (stream) {
+            mux_stream_drop(stream, type == mux_frame_rst);
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* Dispatches the complete frames at the head of |data|, returns the bytes they took. */
+static size_t mux_consume(struct mux_session *session, const uint8_t *data, size_t size, bool *ok) {
+    size_t used = 0;
+    while (size - used >= MUX_FRAME_HEAD) {
+        const uint8_t *p = data + used;
+        size_t length = ((size_t)p[5] << 8) | p[6];
+        if (size - used < MUX_FRAME_HEAD + length) {
+            break;
+        }
+        used += MUX_FRAME_HEAD + length;
+        if (mux_dispatch(session, p[0], mux_get32(p + 1), p + MUX_FRAME_HEAD, length) == false) {
+            *ok = false;
+            break;
+        }
+    }
+    return used;
+}
+
+bool mux_session_feed(struct mux_session *session, const uint8_t *data, size_t size) {
+    struct buffer_t *rx = session->rx;
+    bool ok = true;
+    size_t used;
+
+    if (rx->len == 0) {
+        used = mux_consume(session, data, size, &ok);
+        if (ok && used < size) {
+            buffer_concatenate(rx, data + used, size - used);
+        }
+    } else {
+        buffer_concatenate(rx, data, size);
+        used = mux_consume(session, rx->buffer, rx->len, &ok);
+        if (ok) {
+            buffer_shorten(rx, used, rx->len - used);
+        }
+    }
+    mux_session_flush(session);
+    return ok;
+}
+
+struct mux_stream * mux_stream_open(struct mux_session *session, const uint8_t *target, size_t size, const struct mux_stream_callbacks *cb, void *p) {
+    struct mux_stream *stream;
+
+    if (session->client == false || session->count >= MUX_SESSION_MAX_STREAMS || size > MUX_FRAME_PAYLOAD_MAX) {
+        return NULL;
+    }
+    stream = mux_stream_add(session, session->next_id);
+    session->next_id += 2;
+    stream->cb = cb;
+    stream->p = p;
+    mux_put_frame(session, mux_frame_open, stream->id, target, size);
+    mux_session_flush(session);
+    return stream;
+}
+
+void mux_stream_set_callbacks(struct mux_stream *stream, const struct mux_stream_callbacks *cb, void *p) {
+    stream->cb = cb;
+    stream->p = p;
+}
+
+bool mux_stream_send(struct mux_stream *stream, const uint8_t *data, size_t size) {
+    struct mux_session *session = stream->session;
+    size_t offset = 0;
+
+    while (offset < size) {
+        size_t chunk = size - offset;
+        if (chunk > MUX_FRAME_PAYLOAD_MAX) {
+            chunk = MUX_FRAME_PAYLOAD_MAX;
+        }
+        mux_put_frame(session, mux_frame_data, stream->id, data + offset, chunk);
+        offset += chunk;
+    }
+    stream->send_window -= (int64_t)size;
+    mux_session_flush(session);
+    return stream->send_window > 0;
+}
+
+void mux_stream_consumed(struct mux_stream *stream, size_t size) {
+    struct mux_session *session = stream->session;
+
+    stream->unconsumed = (size < stream->unconsumed) ? (stream->unconsumed - size) : 0;
+    stream->credit += size;
+    // A WINDOW per quarter window, not per write.
+    if (stream->credit >= MUX_STREAM_WINDOW / 4) {
+        uint8_t payload[4];
+        mux_put32(payload, (uint32_t)stream->credit);
+        mux_put_frame(session, mux_frame_window, stream->id, payload, sizeof(payload));
+        stream->credit = 0;
+        mux_session_flush(session);
+    }
+}
+
+void mux_stream_close(struct mux_stream *stream, bool reset) {
+    struct mux_session *session = stream->session;
+
+    mux_put_frame(session, reset ? mux_frame_rst : mux_frame_fin, stream->id, NULL, 0);
+    mux_stream_unlink(stream);
+    free(stream);
+    mux_session_flush(session);
+}
@@ -0,0 +1,69 @@
+#if !defined(__mux_h__)
+#define __mux_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Many streams over one authenticated SSR connection. The client opens the
+ * connection to MUX_SESSION_HOST, everything after that header is frames:
+ *
+ *    +------+-----------+--------+---------+
+ *    | TYPE | STREAM ID | LENGTH | PAYLOAD |
+ *    +------+-----------+--------+---------+
+ *    |  1   |     4     |   2    | LENGTH  |
+ *    +------+-----------+--------+---------+
+ *
+ * OPEN carries the target in the SSR header format, DATA the bytes of the
+ * stream, WINDOW a 4 byte credit. FIN ends a stream once its data is out,
+ * RST drops it. A sender may have MUX_STREAM_WINDOW bytes per stream the
+ * receiver hasn't written out yet, WINDOW hands back what it has, so one
+ * slow stream never stalls the others. Numbers are in network order.
+ */
+
+#define MUX_SESSION_HOST "mux.ssr-native.invalid"
+#define MUX_SESSION_PORT 9
+#define MUX_FRAME_HEAD 7
+#define MUX_FRAME_PAYLOAD_MAX 0x4000
+#define MUX_STREAM_WINDOW (256 * 1024)
+#define MUX_SESSION_MAX_STREAMS 128
+
+struct buffer_t;
+struct mux_session;
+struct mux_stream;
+
+struct mux_stream_callbacks {
+    void (*on_data)(void *p, const uint8_t *data, size_t size);
+    /* The peer granted credit again after mux_stream_send() returned false. */
+    void (*on_window)(void *p);
+    /* FIN or RST from the peer, or the session went. The stream is freed. */
+    void (*on_close)(void *p, bool reset);
+};
+
+struct mux_session_callbacks {
+    /* Frames to go out. false keeps them, mux_session_flush() offers them again with whatever came since. */
+    bool (*send)(void *p, const struct buffer_t *frames);
+    /* Server side, the peer opened |stream|. Call mux_stream_set_callbacks() before returning. */
+    void (*accept)(void *p, struct mux_stream *stream, const uint8_t *target, size_t size);
+};
+
+struct mux_session * mux_session_create(bool client, const struct mux_session_callbacks *cb, void *p);
+/* Every stream left gets on_close() with |reset| set. Not from within a callback. */
+void mux_session_destroy(struct mux_session *session);
+/* Decrypted bytes from the peer, false on a malformed frame. */
+bool mux_session_feed(struct mux_session *session, const uint8_t *data, size_t size);
+void mux_session_flush(struct mux_session *session);
+size_t mux_session_stream_count(const struct mux_session *session);
+
+/* Client side, NULL with MUX_SESSION_MAX_STREAMS open already. */
+struct mux_stream * mux_stream_open(struct mux_session *session, const uint8_t *target, size_t size, const struct mux_stream_callbacks *cb, void *p);
+void mux_stream_set_callbacks(struct mux_stream *stream, const struct mux_stream_callbacks *cb, void *p);
+/* Always queues |data|, false once the peer's window is used up. */
+bool mux_stream_send(struct mux_stream *stream, const uint8_t *data, size_t size);
+/* |size| bytes from on_data() were written out locally, the peer may send as much again. */
+void mux_stream_consumed(struct mux_stream *stream, size_t size);
+/* FIN, or RST with |reset|. The stream is freed, no callback follows. */
+void mux_stream_close(struct mux_stream *stream, bool reset);
+
+#endif // !defined(__mux_h__)
@@ -54,8 +54,28 @@
 
 extern int verbose;
 
-static const char valid_label_bytes[] =
-    "-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz";
+/* Bytes of a host name: 0 none, 1 a letter, digit or '_', 2 '-', 3 '.'. */
+#define HOSTNAME_LABEL  1
+#define HOSTNAME_HYPHEN 2
+#define HOSTNAME_DOT    3
+static const unsigned char hostname_byte_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
 /*
 #if defined(MODULE_LOCAL)
 extern int keep_resolving;
@@ -267,38 +287,39 @@ sockaddr_cmp_addr(struct sockaddr_storage *addr1,
 int
 validate_hostname(const char *hostname, size_t hostname_len)
 {
-    const char *label;
+    const unsigned char *p = (const unsigned char *)hostname;
+    size_t index, label_len = 0;
+    unsigned char prev = HOSTNAME_DOT;
+
     if (hostname == NULL)
         return 0;
 
     if (hostname_len < 1 || hostname_len > 255)
         return 0;
 
-    if (hostname[0] == '.')
-        return 0;
-
-    label = hostname;
-    while (label < hostname + hostname_len) {
-        const char *next_dot;
-        size_t label_len = hostname_len - (label - hostname);
-        next_dot = strchr(label, '.');
-        if (next_dot != NULL) {
-            label_len = next_dot - label;
-        }
-        if (label + label_len > hostname + hostname_len) {
-            return 0;
-        }
-        if (label_len > 63 || label_len < 1) {
-            return 0;
-        }
-        if (label[0] == '-' || label[label_len - 1] == '-') {
-            return 0;
-        }
-        if (strspn(label, valid_label_bytes) < label_len) {
+    // One pass, labels of 1 to 63 bytes that neither start nor end with '-'.
+    for (index = 0; index < hostname_len; ++index) {
+        unsigned char cls = hostname_byte_class[p[index]];
+        switch (cls) {
+        case HOSTNAME_LABEL:
+            if (++label_len > 63)
+                return 0;
+            break;
+        case HOSTNAME_HYPHEN:
+            if (prev == HOSTNAME_DOT || ++label_len > 63)
+                return 0;
+            break;
+        case HOSTNAME_DOT:
+            if (prev != HOSTNAME_LABEL)
+                return 0;
+            label_len = 0;
+            break;
+        default:
             return 0;
         }
-        label += label_len + 1;
+        prev = cls;
     }
 
-    return 1;
+    // A trailing dot is the root, as before.
+    return prev != HOSTNAME_HYPHEN;
 }
@@ -8,6 +8,9 @@
 #include "encrypt.h"
 #include "obfs.h"
 #include "ssrbuffer.h"
+#include "ssr_user_table.h"
+#include "ssr_replay_window.h"
+#include "ssr_alloc.h"
 #if defined(WIN32) || defined(_WIN32)
 #include <winsock2.h>
 #else
@@ -16,14 +19,13 @@
 
 struct buffer_t * auth_sha1_v4_server_pre_encrypt(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * auth_sha1_v4_server_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, bool *need_feedback);
+bool auth_aes128_sha1_server_precheck(struct obfs_t *obfs, const uint8_t *data, size_t len);
 
 static size_t auth_simple_pack_unit_size = 2000;
-typedef size_t (*hmac_with_key_func)(uint8_t auth[SHA1_BYTES], const struct buffer_t *msg, const struct buffer_t *key);
 typedef size_t (*hash_func)(uint8_t *auth, const uint8_t *msg, size_t msg_len);
 
 typedef struct _auth_simple_global_data {
-    uint8_t local_client_id[8];
-    uint32_t connection_id;
+    struct conn_id_gen ids;
 } auth_simple_global_data;
 
 typedef struct _auth_simple_local_data {
@@ -34,7 +36,7 @@ typedef struct _auth_simple_local_data {
     char * salt;
     struct buffer_t *user_key;
     char uid[4];
-    hmac_with_key_func hmac;
+    struct ss_hmac_ctx *hmac; /* Keyed state kept across chunks, see ss_hmac_ctx_compute(). */
     hash_func hash;
     int hash_len;
     size_t last_data_len;
@@ -44,18 +46,19 @@ typedef struct _auth_simple_local_data {
     int max_time_dif;
     uint32_t client_id;
     uint32_t connection_id;
+    const struct ssr_user *user; /* Server side, holds a connection slot of it. */
 } auth_simple_local_data;
 
 void
 auth_simple_local_data_init(auth_simple_local_data* local)
 {
     local->has_sent_header = 0;
-    local->recv_buffer = buffer_create(16384);
+    local->recv_buffer = buffer_create(0);
     local->recv_id = 1;
     local->pack_id = 1;
     local->salt = "";
-    local->user_key = buffer_create(SSR_BUFF_SIZE);
-    local->hmac = 0;
+    local->user_key = buffer_create(0);
+    local->hmac = NULL;
     local->hash = 0;
     local->hash_len = 0;
     local->salt = "";
@@ -67,31 +70,32 @@ auth_simple_local_data_init(auth_simple_local_data* local)
         local->extra_wait_size = (size_t) (extra_wait_size % 1024);
     }
     local->max_time_dif = 60 * 60 * 24;
+    local->user = NULL;
 }
 
 void *
 auth_simple_init_data(void)
 {
-    auth_simple_global_data *global = (auth_simple_global_data*)malloc(sizeof(auth_simple_global_data));
-    rand_bytes(global->local_client_id, 8);
-    rand_bytes((uint8_t*)&global->connection_id, 4);
-    global->connection_id &= 0xFFFFFF;
+    auth_simple_global_data *global = (auth_simple_global_data*)ssr_malloc(ssr_alloc_obfs, sizeof(auth_simple_global_data));
+    conn_id_gen_init(&global->ids);
     return global;
 }
 
 void auth_simple_new_obfs(struct obfs_t *obfs) {
     obfs->init_data = auth_simple_init_data;
+    obfs->get_overhead = get_overhead;
     obfs->need_feedback = need_feedback_false;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->trim = auth_simple_trim;
 
     obfs->client_pre_encrypt = auth_simple_client_pre_encrypt;
     obfs->client_post_decrypt = auth_simple_client_post_decrypt;
     obfs->client_udp_pre_encrypt = NULL;
     obfs->client_udp_post_decrypt = NULL;
 
-    obfs->l_data = malloc(sizeof(auth_simple_local_data));
+    obfs->l_data = ssr_malloc(ssr_alloc_obfs, sizeof(auth_simple_local_data));
     auth_simple_local_data_init((auth_simple_local_data*)obfs->l_data);
 }
 
@@ -104,6 +108,7 @@ void auth_sha1_new_obfs(struct obfs_t *obfs) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->trim = auth_simple_trim;
 
     obfs->client_pre_encrypt = auth_sha1_client_pre_encrypt;
     obfs->client_post_decrypt = auth_sha1_client_post_decrypt;
@@ -120,6 +125,7 @@ void auth_sha1_v2_new_obfs(struct obfs_t *obfs) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->trim = auth_simple_trim;
 
     obfs->client_pre_encrypt = auth_sha1_v2_client_pre_encrypt;
     obfs->client_post_decrypt = auth_sha1_v2_client_post_decrypt;
@@ -128,7 +134,7 @@ void auth_sha1_v2_new_obfs(struct obfs_t *obfs) {
 }
 
 struct obfs_t * auth_sha1_v4_new_obfs(void) {
-    struct obfs_t *obfs = (struct obfs_t *)calloc(1, sizeof(struct obfs_t));
+    struct obfs_t *obfs = (struct obfs_t *)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
     auth_simple_local_data *local;
     auth_simple_new_obfs(obfs);
 
@@ -141,6 +147,7 @@ struct obfs_t * auth_sha1_v4_new_obfs(void) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->trim = auth_simple_trim;
 
     obfs->client_pre_encrypt = auth_sha1_v4_client_pre_encrypt;
     obfs->client_post_decrypt = auth_sha1_v4_client_post_decrypt;
@@ -154,7 +161,7 @@ struct obfs_t * auth_sha1_v4_new_obfs(void) {
 }
 
 struct obfs_t * auth_aes128_md5_new_obfs(void) {
-    struct obfs_t *obfs = (struct obfs_t *)calloc(1, sizeof(struct obfs_t));
+    struct obfs_t *obfs = (struct obfs_t *)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
     auth_simple_local_data *l_data;
 
     obfs->init_data = auth_simple_init_data;
@@ -163,6 +170,8 @@ struct obfs_t * auth_aes128_md5_new_obfs(void) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->trim = auth_simple_trim;
+    obfs->get_user = auth_simple_get_user;
 
     obfs->client_pre_encrypt = auth_aes128_sha1_client_pre_encrypt;
     obfs->client_post_decrypt = auth_aes128_sha1_client_post_decrypt;
@@ -173,15 +182,16 @@ struct obfs_t * auth_aes128_md5_new_obfs(void) {
     obfs->server_encode = generic_server_encode;
     obfs->server_decode = generic_server_decode;
     obfs->server_post_decrypt = auth_aes128_sha1_server_post_decrypt;
+    obfs->server_precheck = auth_aes128_sha1_server_precheck;
     obfs->server_udp_pre_encrypt = generic_server_udp_pre_encrypt;
     obfs->server_udp_post_decrypt = generic_server_udp_post_decrypt;
 
-    obfs->l_data = malloc(sizeof(auth_simple_local_data));
+    obfs->l_data = ssr_malloc(ssr_alloc_obfs, sizeof(auth_simple_local_data));
     l_data = (auth_simple_local_data *) obfs->l_data;
 
     auth_simple_local_data_init(l_data);
 
-    l_data->hmac = ss_md5_hmac_with_key;
+    l_data->hmac = ss_hmac_ctx_create(ss_hmac_md5);
     l_data->hash = ss_md5_hash_func;
     l_data->hash_len = 16;
     l_data->salt = "auth_aes128_md5";
@@ -195,7 +205,8 @@ struct obfs_t * auth_aes128_sha1_new_obfs(void) {
 
     l_data = (auth_simple_local_data*)obfs->l_data;
 
-    l_data->hmac = ss_sha1_hmac_with_key;
+    ss_hmac_ctx_destroy(l_data->hmac);
+    l_data->hmac = ss_hmac_ctx_create(ss_hmac_sha1);
     l_data->hash = ss_sha1_hash_func;
     l_data->hash_len = 20;
     l_data->salt = "auth_aes128_sha1";
@@ -227,19 +238,35 @@ auth_simple_dispose(struct obfs_t *obfs)
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
     buffer_release(local->recv_buffer);
     buffer_release(local->user_key);
-    free(local);
+    ss_hmac_ctx_destroy(local->hmac);
+    ssr_user_table_release(obfs->server.users, local->user);
+    ssr_free(ssr_alloc_obfs, local);
     obfs->l_data = NULL;
     dispose_obfs(obfs);
 }
 
+void
+auth_simple_trim(struct obfs_t *obfs)
+{
+    auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
+    buffer_trim(local->recv_buffer);
+}
+
+const struct ssr_user *
+auth_simple_get_user(struct obfs_t *obfs)
+{
+    auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
+    return local->user;
+}
+
 static size_t
-auth_simple_pack_data(const uint8_t *data, size_t datalength, uint8_t *outdata)
+auth_simple_pack_data(char *data, size_t datalength, char *outdata)
 {
     unsigned char rand_len = (xorshift128plus() & 0xF) + 1;
     size_t out_size = (size_t)rand_len + datalength + 6;
-    outdata[0] = (uint8_t)(out_size >> 8);
-    outdata[1] = (uint8_t)(out_size);
-    outdata[2] = (uint8_t)(rand_len);
+    outdata[0] = (char)(out_size >> 8);
+    outdata[1] = (char)(out_size);
+    outdata[2] = (char)(rand_len);
     memmove(outdata + rand_len + 2, data, datalength);
     fillcrc32((unsigned char *)outdata, out_size);
     return out_size;
@@ -248,66 +275,57 @@ auth_simple_pack_data(const uint8_t *data, size_t datalength, uint8_t *outdata)
 size_t
 auth_simple_pack_auth_data(auth_simple_global_data *global, char *data, size_t datalength, char *outdata)
 {
+    uint8_t client_id[8];
+    uint32_t connection_id;
     time_t t;
     unsigned char rand_len = (xorshift128plus() & 0xF) + 1;
     size_t out_size = rand_len + datalength + 6 + 12;
     outdata[0] = (char)(out_size >> 8);
     outdata[1] = (char)(out_size);
     outdata[2] = (char)(rand_len);
-    ++global->connection_id;
-    if (global->connection_id > 0xFF000000) {
-        rand_bytes(global->local_client_id, 8);
-        rand_bytes((uint8_t*)&global->connection_id, 4);
-        global->connection_id &= 0xFFFFFF;
-    }
+    connection_id = conn_id_gen_next(&global->ids, client_id);
     t = time(NULL);
     memintcopy_lt(outdata + rand_len + 2, (uint32_t)t);
-    memmove(outdata + rand_len + 2 + 4, global->local_client_id, 4);
-    memintcopy_lt(outdata + rand_len + 2 + 8, global->connection_id);
+    memmove(outdata + rand_len + 2 + 4, client_id, 4);
+    memintcopy_lt(outdata + rand_len + 2 + 8, connection_id);
     memmove(outdata + rand_len + 2 + 12, data, datalength);
     fillcrc32((unsigned char *)outdata, (unsigned int)out_size);
     return out_size;
 }
 
-size_t
-auth_simple_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity)
+/* Starts with the auth frame until it's sent. */
+static size_t
+auth_simple_frame(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t *capacity,
+    size_t (*pack_head)(struct obfs_t *, char *, size_t, char *), size_t head_overhead,
+    size_t (*pack)(char *, size_t, char *), size_t unit_overhead, size_t tail_overhead)
 {
-    char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    char * out_buffer = (char*)malloc((size_t)(datalength * 2 + 64));
-    char * buffer = out_buffer;
-    char * data = plaindata;
-    size_t len = datalength;
-    size_t pack_len;
-    if (len > 0 && local->has_sent_header == 0) {
-        size_t head_size = get_s5_head_size((const uint8_t *)plaindata, datalength, 30);
-        if (head_size > datalength) {
-            head_size = datalength;
-        }
-        pack_len = auth_simple_pack_auth_data((auth_simple_global_data *)obfs->server.g_data, data, head_size, buffer);
-        buffer += pack_len;
-        data += head_size;
-        len -= head_size;
+    struct obfs_framing framing = { 0 };
+    framing.unit_size = auth_simple_pack_unit_size;
+    framing.unit_overhead = unit_overhead;
+    framing.tail_overhead = tail_overhead;
+    framing.pack = pack;
+    if (datalength > 0 && local->has_sent_header == 0) {
+        framing.head_size = get_s5_head_size((const uint8_t *)*pplaindata, datalength, 30);
+        framing.head_overhead = head_overhead;
+        framing.pack_head = pack_head;
         local->has_sent_header = 1;
     }
-    while ( len > auth_simple_pack_unit_size ) {
-        pack_len = auth_simple_pack_data((uint8_t *)data, auth_simple_pack_unit_size, (uint8_t *)buffer);
-        buffer += pack_len;
-        data += auth_simple_pack_unit_size;
-        len -= auth_simple_pack_unit_size;
-    }
-    if (len > 0) {
-        pack_len = auth_simple_pack_data((uint8_t *)data, len, (uint8_t *)buffer);
-        buffer += pack_len;
-    }
-    len = (int)(buffer - out_buffer);
-    if ((int)(*capacity) < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
-        plaindata = *pplaindata;
-    }
-    memmove(plaindata, out_buffer, len);
-    free(out_buffer);
-    return len;
+    return obfs_frame_in_place(obfs, &framing, pplaindata, datalength, capacity);
+}
+
+static size_t
+auth_simple_pack_head(struct obfs_t *obfs, char *data, size_t datalength, char *outdata)
+{
+    return auth_simple_pack_auth_data((auth_simple_global_data *)obfs->server.g_data, data, datalength, outdata);
+}
+
+size_t
+auth_simple_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity)
+{
+    // 16 bytes of padding at most, the 6 of length and CRC32, and 12 of auth.
+    return auth_simple_frame(obfs, pplaindata, datalength, capacity, auth_simple_pack_head, 16 + 6 + 12,
+        auth_simple_pack_data, 16 + 6, 16 + 6);
 }
 
 ssize_t
@@ -318,20 +336,21 @@ auth_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int data
     char * buffer;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
+    uint8_t * recv_buffer;
     if (local->recv_buffer->len + datalength > 16384) {
         return -1;
     }
     buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = (uint8_t *)local->recv_buffer->buffer;
 
-    out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
+    out_buffer = (char*)ssr_malloc(ssr_alloc_obfs, (size_t)local->recv_buffer->len);
     buffer = out_buffer;
     while (local->recv_buffer->len > 2) {
         int crc;
         size_t data_size;
         size_t length = (size_t)ntohs(*(uint16_t *)(recv_buffer + 0)); // ((int)recv_buffer[0] << 8) | recv_buffer[1];
         if (length >= 8192 || length < 7) {
-            free(out_buffer);
+            ssr_free(ssr_alloc_obfs, out_buffer);
             local->recv_buffer->len = 0;
             return -1;
         }
@@ -340,7 +359,7 @@ auth_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int data
         }
         crc = (int) crc32_imp((unsigned char*)recv_buffer, length);
         if (crc != -1) {
-            free(out_buffer);
+            ssr_free(ssr_alloc_obfs, out_buffer);
             local->recv_buffer->len = 0;
             return -1;
         }
@@ -351,11 +370,11 @@ auth_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int data
     }
     len = (int)(buffer - out_buffer);
     if ((int)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+        *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
         plaindata = *pplaindata;
     }
     memmove(plaindata, out_buffer, len);
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     return len;
 }
 
@@ -376,6 +395,8 @@ auth_sha1_pack_data(char *data, size_t datalength, char *outdata)
 size_t
 auth_sha1_pack_auth_data(auth_simple_global_data *global, struct server_info_t *server, char *data, size_t datalength, char *outdata)
 {
+    uint8_t client_id[8];
+    uint32_t connection_id;
     time_t t;
     uint8_t hash[SHA1_BYTES];
     unsigned char rand_len = (xorshift128plus() & 0x7F) + 1;
@@ -385,61 +406,28 @@ auth_sha1_pack_auth_data(auth_simple_global_data *global, struct server_info_t *
     outdata[4] = (char)(out_size >> 8);
     outdata[5] = (char)out_size;
     outdata[6] = (char)rand_len;
-    ++global->connection_id;
-    if (global->connection_id > 0xFF000000) {
-        rand_bytes(global->local_client_id, 8);
-        rand_bytes((uint8_t*)&global->connection_id, 4);
-        global->connection_id &= 0xFFFFFF;
-    }
+    connection_id = conn_id_gen_next(&global->ids, client_id);
     t = time(NULL);
     memintcopy_lt(outdata + data_offset, (uint32_t)t);
-    memmove(outdata + data_offset + 4, global->local_client_id, 4);
-    memintcopy_lt(outdata + data_offset + 8, global->connection_id);
+    memmove(outdata + data_offset + 4, client_id, 4);
+    memintcopy_lt(outdata + data_offset + 8, connection_id);
     memmove(outdata + data_offset + 12, data, datalength);
     ss_sha1_hmac(hash, (uint8_t *)outdata, out_size - OBFS_HMAC_SHA1_LEN, server->iv, server->iv_len, server->key, server->key_len);
     memcpy(outdata + out_size - OBFS_HMAC_SHA1_LEN, hash, OBFS_HMAC_SHA1_LEN);
     return out_size;
 }
 
+static size_t
+auth_sha1_pack_head(struct obfs_t *obfs, char *data, size_t datalength, char *outdata)
+{
+    return auth_sha1_pack_auth_data((auth_simple_global_data *)obfs->server.g_data, &obfs->server, data, datalength, outdata);
+}
+
 size_t
 auth_sha1_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity)
 {
-    char *plaindata = *pplaindata;
-    auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    char * out_buffer = (char*)malloc((size_t)(datalength * 2 + 256));
-    char * buffer = out_buffer;
-    char * data = plaindata;
-    size_t len = datalength;
-    size_t pack_len;
-    if (len > 0 && local->has_sent_header == 0) {
-        size_t head_size = get_s5_head_size((const uint8_t *)plaindata, datalength, 30);
-        if (head_size > datalength) {
-            head_size = datalength;
-        }
-        pack_len = auth_sha1_pack_auth_data((auth_simple_global_data *)obfs->server.g_data, &obfs->server, data, head_size, buffer);
-        buffer += pack_len;
-        data += head_size;
-        len -= head_size;
-        local->has_sent_header = 1;
-    }
-    while ( len > auth_simple_pack_unit_size ) {
-        pack_len = auth_sha1_pack_data(data, auth_simple_pack_unit_size, buffer);
-        buffer += pack_len;
-        data += auth_simple_pack_unit_size;
-        len -= auth_simple_pack_unit_size;
-    }
-    if (len > 0) {
-        pack_len = auth_sha1_pack_data(data, len, buffer);
-        buffer += pack_len;
-    }
-    len = (int)(buffer - out_buffer);
-    if ((int)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
-        plaindata = *pplaindata;
-    }
-    memmove(plaindata, out_buffer, len);
-    free(out_buffer);
-    return len;
+    return auth_simple_frame(obfs, pplaindata, datalength, capacity, auth_sha1_pack_head, 128 + 6 + 12 + OBFS_HMAC_SHA1_LEN,
+        auth_sha1_pack_data, 16 + 6, 16 + 6);
 }
 
 ssize_t
@@ -450,21 +438,21 @@ auth_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int datale
     char * out_buffer;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
+    uint8_t * recv_buffer;
     if (local->recv_buffer->len + datalength > 16384) {
         return -1;
     }
-    memmove(recv_buffer + local->recv_buffer->len, plaindata, datalength);
-    local->recv_buffer->len += datalength;
+    buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = (uint8_t *)local->recv_buffer->buffer;
 
-    out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
+    out_buffer = (char*)ssr_malloc(ssr_alloc_obfs, (size_t)local->recv_buffer->len);
     buffer = out_buffer;
     while (local->recv_buffer->len > 2) {
         size_t pos;
         size_t data_size;
         size_t length = (size_t)ntohs(*(uint16_t *)(recv_buffer + 0)); // ((int)recv_buffer[0] << 8) | recv_buffer[1];
         if (length >= 8192 || length < 7) {
-            free(out_buffer);
+            ssr_free(ssr_alloc_obfs, out_buffer);
             local->recv_buffer->len = 0;
             return -1;
         }
@@ -472,7 +460,7 @@ auth_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int datale
             break;
         }
         if (checkadler32((unsigned char*)recv_buffer, (unsigned int)length) == false) {
-            free(out_buffer);
+            ssr_free(ssr_alloc_obfs, out_buffer);
             local->recv_buffer->len = 0;
             return -1;
         }
@@ -484,11 +472,11 @@ auth_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int datale
     }
     len = (int)(buffer - out_buffer);
     if ((int)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+        *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
         plaindata = *pplaindata;
     }
     memmove(plaindata, out_buffer, len);
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     return (ssize_t)len;
 }
 
@@ -514,17 +502,19 @@ auth_sha1_v2_pack_data(char *data, size_t datalength, char *outdata)
 size_t
 auth_sha1_v2_pack_auth_data(auth_simple_global_data *global, struct server_info_t *server, char *data, size_t datalength, char *outdata)
 {
+    uint8_t client_id[8];
+    uint32_t connection_id;
     uint8_t hash[SHA1_BYTES];
     unsigned int rand_len = (datalength > 1300 ? 0 : datalength > 400 ? (xorshift128plus() & 0x7F) : (xorshift128plus() & 0x3FF)) + 1;
     size_t data_offset = (size_t)rand_len + 4 + 2;
     size_t out_size = data_offset + datalength + 12 + OBFS_HMAC_SHA1_LEN;
     const char* salt = "auth_sha1_v2";
     int salt_len = (int) strlen(salt);
-    unsigned char *crc_salt = (unsigned char*)malloc((size_t)salt_len + server->key_len);
+    unsigned char *crc_salt = (unsigned char*)ssr_malloc(ssr_alloc_obfs, (size_t)salt_len + server->key_len);
     memcpy(crc_salt, salt, salt_len);
     memcpy(crc_salt + salt_len, server->key, server->key_len);
     fillcrc32to(crc_salt, (unsigned int)((size_t)salt_len + server->key_len), (unsigned char *)outdata);
-    free(crc_salt);
+    ssr_free(ssr_alloc_obfs, crc_salt);
     outdata[4] = (char)(out_size >> 8);
     outdata[5] = (char)out_size;
     if (rand_len < 128) {
@@ -534,60 +524,27 @@ auth_sha1_v2_pack_auth_data(auth_simple_global_data *global, struct server_info_
         outdata[7] = (char)(rand_len >> 8);
         outdata[8] = (char)rand_len;
     }
-    ++global->connection_id;
-    if (global->connection_id > 0xFF000000) {
-        rand_bytes(global->local_client_id, 8);
-        rand_bytes((uint8_t*)&global->connection_id, 4);
-        global->connection_id &= 0xFFFFFF;
-    }
-    memmove(outdata + data_offset, global->local_client_id, 8);
-    memintcopy_lt(outdata + data_offset + 8, global->connection_id);
+    connection_id = conn_id_gen_next(&global->ids, client_id);
+    memmove(outdata + data_offset, client_id, 8);
+    memintcopy_lt(outdata + data_offset + 8, connection_id);
     memmove(outdata + data_offset + 12, data, datalength);
     ss_sha1_hmac(hash, (uint8_t *)outdata, out_size - OBFS_HMAC_SHA1_LEN, server->iv, server->iv_len, server->key, server->key_len);
     memcpy(outdata + out_size - OBFS_HMAC_SHA1_LEN, hash, OBFS_HMAC_SHA1_LEN);
     return out_size;
 }
 
+static size_t
+auth_sha1_v2_pack_head(struct obfs_t *obfs, char *data, size_t datalength, char *outdata)
+{
+    return auth_sha1_v2_pack_auth_data((auth_simple_global_data *)obfs->server.g_data, &obfs->server, data, datalength, outdata);
+}
+
 size_t
 auth_sha1_v2_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity)
 {
-    char *plaindata = *pplaindata;
-    auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    auth_simple_global_data *g_data = (auth_simple_global_data *)obfs->server.g_data;
-    char * out_buffer = (char*)malloc((size_t)(datalength * 2 + (SSR_BUFF_SIZE * 2)));
-    char * buffer = out_buffer;
-    char * data = plaindata;
-    size_t len = datalength;
-    size_t pack_len;
-    if (len > 0 && local->has_sent_header == 0) {
-        size_t head_size = get_s5_head_size((const uint8_t *)plaindata, datalength, 30);
-        if (head_size > datalength) {
-            head_size = datalength;
-        }
-        pack_len = auth_sha1_v2_pack_auth_data(g_data, &obfs->server, data, head_size, buffer);
-        buffer += pack_len;
-        data += head_size;
-        len -= head_size;
-        local->has_sent_header = 1;
-    }
-    while ( len > auth_simple_pack_unit_size ) {
-        pack_len = auth_sha1_v2_pack_data(data, auth_simple_pack_unit_size, buffer);
-        buffer += pack_len;
-        data += auth_simple_pack_unit_size;
-        len -= auth_simple_pack_unit_size;
-    }
-    if (len > 0) {
-        pack_len = auth_sha1_v2_pack_data(data, len, buffer);
-        buffer += pack_len;
-    }
-    len = (int)(buffer - out_buffer);
-    if ((int)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
-        plaindata = *pplaindata;
-    }
-    memmove(plaindata, out_buffer, len);
-    free(out_buffer);
-    return len;
+    // A whole unit is over 1300 bytes, it gets a single byte of padding.
+    return auth_simple_frame(obfs, pplaindata, datalength, capacity, auth_sha1_v2_pack_head, 1024 + 6 + 12 + OBFS_HMAC_SHA1_LEN,
+        auth_sha1_v2_pack_data, 1 + 6, 1024 + 6);
 }
 
 ssize_t
@@ -599,14 +556,14 @@ auth_sha1_v2_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int dat
     char * out_buffer;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
+    uint8_t * recv_buffer;
     if (local->recv_buffer->len + datalength > 16384) {
         return -1;
     }
-    memmove(recv_buffer + local->recv_buffer->len, plaindata, datalength);
-    local->recv_buffer->len += datalength;
+    buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = (uint8_t *)local->recv_buffer->buffer;
 
-    out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
+    out_buffer = (char*)ssr_malloc(ssr_alloc_obfs, (size_t)local->recv_buffer->len);
     buffer = out_buffer;
     error = 0;
     while (local->recv_buffer->len > 2) {
@@ -640,14 +597,14 @@ auth_sha1_v2_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int dat
     if (error == 0) {
         len = (int)(buffer - out_buffer);
         if ((int)*capacity < len) {
-            *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+            *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
             plaindata = *pplaindata;
         }
         memmove(plaindata, out_buffer, len);
     } else {
         len = -1;
     }
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     return (ssize_t) len;
 }
 
@@ -677,6 +634,8 @@ auth_sha1_v4_pack_data(char *data, size_t datalength, char *outdata)
 size_t
 auth_sha1_v4_pack_auth_data(auth_simple_global_data *global, struct server_info_t *server, char *data, size_t datalength, char *outdata)
 {
+    uint8_t client_id[8];
+    uint32_t connection_id;
     uint8_t hash[SHA1_BYTES];
     time_t t;
     unsigned int rand_len = (datalength > 1300 ? 0 : datalength > 400 ? (xorshift128plus() & 0x7F) : (xorshift128plus() & 0x3FF)) + 1;
@@ -684,14 +643,14 @@ auth_sha1_v4_pack_auth_data(auth_simple_global_data *global, struct server_info_
     size_t out_size = data_offset + datalength + 12 + OBFS_HMAC_SHA1_LEN;
     const char* salt = "auth_sha1_v4";
     size_t salt_len = (size_t)strlen(salt);
-    unsigned char *crc_salt = (unsigned char*)malloc((size_t)salt_len + server->key_len + 2);
+    unsigned char *crc_salt = (unsigned char*)ssr_malloc(ssr_alloc_obfs, (size_t)salt_len + server->key_len + 2);
     crc_salt[0] = (unsigned char)(outdata[0] = (char)(out_size >> 8));
     crc_salt[1] = (unsigned char)(outdata[1] = (char)out_size);
 
     memcpy(crc_salt + 2, salt, salt_len);
     memcpy(crc_salt + salt_len + 2, server->key, server->key_len);
     fillcrc32to(crc_salt, (unsigned int)((size_t)salt_len + server->key_len + 2), (unsigned char *)outdata + 2);
-    free(crc_salt);
+    ssr_free(ssr_alloc_obfs, crc_salt);
     if (rand_len < 128) {
         outdata[6] = (char)rand_len;
     } else {
@@ -699,62 +658,28 @@ auth_sha1_v4_pack_auth_data(auth_simple_global_data *global, struct server_info_
         outdata[7] = (char)(rand_len >> 8);
         outdata[8] = (char)rand_len;
     }
-    ++global->connection_id;
-    if (global->connection_id > 0xFF000000) {
-        rand_bytes(global->local_client_id, 8);
-        rand_bytes((uint8_t*)&global->connection_id, 4);
-        global->connection_id &= 0xFFFFFF;
-    }
+    connection_id = conn_id_gen_next(&global->ids, client_id);
     t = time(NULL);
     memintcopy_lt(outdata + data_offset, (uint32_t)t);
-    memmove(outdata + data_offset + 4, global->local_client_id, 4);
-    memintcopy_lt(outdata + data_offset + 8, global->connection_id);
+    memmove(outdata + data_offset + 4, client_id, 4);
+    memintcopy_lt(outdata + data_offset + 8, connection_id);
     memmove(outdata + data_offset + 12, data, datalength);
     ss_sha1_hmac(hash, (uint8_t *)outdata, out_size - OBFS_HMAC_SHA1_LEN, server->iv, server->iv_len, server->key, server->key_len);
     memcpy(outdata + out_size - OBFS_HMAC_SHA1_LEN, hash, OBFS_HMAC_SHA1_LEN);
     return out_size;
 }
 
+static size_t
+auth_sha1_v4_pack_head(struct obfs_t *obfs, char *data, size_t datalength, char *outdata)
+{
+    return auth_sha1_v4_pack_auth_data((auth_simple_global_data *)obfs->server.g_data, &obfs->server, data, datalength, outdata);
+}
+
 size_t
 auth_sha1_v4_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity)
 {
-    char *plaindata = *pplaindata;
-    auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    auth_simple_global_data *g_data = (auth_simple_global_data *)obfs->server.g_data;
-    char * out_buffer = (char*)malloc((size_t)(datalength * 2 + (SSR_BUFF_SIZE * 2)));
-    char * buffer = out_buffer;
-    char * data = plaindata;
-    size_t len = datalength;
-    size_t pack_len;
-    if (len > 0 && local->has_sent_header == 0) {
-        size_t head_size = get_s5_head_size((const uint8_t *)plaindata, datalength, 30);
-        if (head_size > datalength) {
-            head_size = datalength;
-        }
-        pack_len = auth_sha1_v4_pack_auth_data(g_data, &obfs->server, data, head_size, buffer);
-        buffer += pack_len;
-        data += head_size;
-        len -= head_size;
-        local->has_sent_header = 1;
-    }
-    while ( len > auth_simple_pack_unit_size ) {
-        pack_len = auth_sha1_v4_pack_data(data, auth_simple_pack_unit_size, buffer);
-        buffer += pack_len;
-        data += auth_simple_pack_unit_size;
-        len -= auth_simple_pack_unit_size;
-    }
-    if (len > 0) {
-        pack_len = auth_sha1_v4_pack_data(data, len, buffer);
-        buffer += pack_len;
-    }
-    len = (int)(buffer - out_buffer);
-    if ((int)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
-        plaindata = *pplaindata;
-    }
-    memmove(plaindata, out_buffer, len);
-    free(out_buffer);
-    return len;
+    return auth_simple_frame(obfs, pplaindata, datalength, capacity, auth_sha1_v4_pack_head, 1024 + 6 + 12 + OBFS_HMAC_SHA1_LEN,
+        auth_sha1_v4_pack_data, 1 + 8, 1024 + 8);
 }
 
 ssize_t
@@ -766,14 +691,14 @@ auth_sha1_v4_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int dat
     char * out_buffer;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
+    uint8_t * recv_buffer;
     if (local->recv_buffer->len + datalength > 16384) {
         return -1;
     }
-    memmove(recv_buffer + local->recv_buffer->len, plaindata, datalength);
-    local->recv_buffer->len += datalength;
+    buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = (uint8_t *)local->recv_buffer->buffer;
 
-    out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
+    out_buffer = (char*)ssr_malloc(ssr_alloc_obfs, (size_t)local->recv_buffer->len);
     buffer = out_buffer;
     error = 0;
     while (local->recv_buffer->len > 4) {
@@ -814,14 +739,14 @@ auth_sha1_v4_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int dat
     if (error == 0) {
         len = (int)(buffer - out_buffer);
         if ((int)*capacity < len) {
-            *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+            *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
             plaindata = *pplaindata;
         }
         memmove(plaindata, out_buffer, len);
     } else {
         len = -1;
     }
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     return (ssize_t)len;
 }
 
@@ -1014,22 +939,22 @@ auth_aes128_sha1_pack_data(uint8_t *data, size_t datalength, size_t fulldataleng
     outdata[0] = (uint8_t)out_size;
     outdata[1] = (uint8_t)(out_size >> 8);
     key_len = (uint8_t)(local->user_key->len + 4);
-    key = (uint8_t*)malloc(key_len);
+    key = (uint8_t*)ssr_malloc(ssr_alloc_obfs, key_len);
     memcpy(key, local->user_key->buffer, local->user_key->len);
     memintcopy_lt(key + key_len - 4, local->pack_id);
 
     {
-        uint8_t * rnd_data = (uint8_t *) malloc(rand_len * sizeof(uint8_t));
+        uint8_t * rnd_data = (uint8_t *) ssr_malloc(ssr_alloc_obfs, rand_len * sizeof(uint8_t));
         rand_bytes(rnd_data, (int)rand_len);
         memcpy(outdata + 4, rnd_data, rand_len);
-        free(rnd_data);
+        ssr_free(ssr_alloc_obfs, rnd_data);
     }
 
     {
         uint8_t hash[20];
         BUFFER_CONSTANT_INSTANCE(_msg, outdata, 2);
         BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
-        local->hmac(hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
         memcpy(outdata + 2, hash, 2);
     }
 
@@ -1046,10 +971,10 @@ auth_aes128_sha1_pack_data(uint8_t *data, size_t datalength, size_t fulldataleng
         uint8_t hash[20];
         BUFFER_CONSTANT_INSTANCE(_msg, outdata, out_size - 4);
         BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
-        local->hmac(hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
         memcpy(outdata + out_size - 4, hash, 4);
     }
-    free(key);
+    ssr_free(ssr_alloc_obfs, key);
 
     return out_size;
 }
@@ -1057,6 +982,8 @@ auth_aes128_sha1_pack_data(uint8_t *data, size_t datalength, size_t fulldataleng
 static size_t
 auth_aes128_sha1_pack_auth_data(auth_simple_global_data *global, struct server_info_t *server, auth_simple_local_data *local, const uint8_t *data, size_t datalength, uint8_t *outdata)
 {
+    uint8_t client_id[8];
+    uint32_t connection_id;
     time_t t;
     unsigned int rand_len = (datalength > 400 ? (xorshift128plus() & 0x1FF) : (xorshift128plus() & 0x3FF));
     size_t data_offset = (size_t)rand_len + 16 + 4 + 4 + 7;
@@ -1066,28 +993,23 @@ auth_aes128_sha1_pack_auth_data(auth_simple_global_data *global, struct server_i
     uint8_t encrypt[24 + 1] = { 0 };
     uint8_t encrypt_data[16] = { 0 };
 
-    uint8_t *key = (uint8_t*)malloc(server->iv_len + server->key_len);
+    uint8_t *key = (uint8_t*)ssr_malloc(ssr_alloc_obfs, server->iv_len + server->key_len);
     uint8_t key_len = (uint8_t)(server->iv_len + server->key_len);
     memcpy(key, server->iv, server->iv_len);
     memcpy(key + server->iv_len, server->key, server->key_len);
 
     {
-        uint8_t *rnd_data = (uint8_t *) malloc(rand_len * sizeof(uint8_t));
+        uint8_t *rnd_data = (uint8_t *) ssr_malloc(ssr_alloc_obfs, rand_len * sizeof(uint8_t));
         rand_bytes(rnd_data, (int)rand_len);
         memcpy(outdata + data_offset - rand_len, rnd_data, rand_len);
-        free(rnd_data);
+        ssr_free(ssr_alloc_obfs, rnd_data);
     }
 
-    ++global->connection_id;
-    if (global->connection_id > 0xFF000000) {
-        rand_bytes(global->local_client_id, 8);
-        rand_bytes((uint8_t*)&global->connection_id, 4);
-        global->connection_id &= 0xFFFFFF;
-    }
+    connection_id = conn_id_gen_next(&global->ids, client_id);
     t = time(NULL);
     memintcopy_lt(encrypt, (uint32_t)t);
-    memcpy(encrypt + 4, global->local_client_id, 4);
-    memintcopy_lt(encrypt + 8, global->connection_id);
+    memcpy(encrypt + 4, client_id, 4);
+    memintcopy_lt(encrypt + 8, connection_id);
 #if 1
     encrypt[12] = (char)out_size;
     encrypt[13] = (char)(out_size >> 8);
@@ -1142,7 +1064,7 @@ auth_aes128_sha1_pack_auth_data(auth_simple_global_data *global, struct server_i
         uint8_t hash[20];
         BUFFER_CONSTANT_INSTANCE(_msg, encrypt, 20);
         BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
-        local->hmac(hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
         memcpy(encrypt + 20, hash, 4);
     }
 
@@ -1151,7 +1073,7 @@ auth_aes128_sha1_pack_auth_data(auth_simple_global_data *global, struct server_i
         BUFFER_CONSTANT_INSTANCE(_msg, outdata, 1);
         BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
         rand_bytes((uint8_t*)outdata, 1);
-        local->hmac(hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
         memcpy(outdata + 1, hash, 6);
     }
 
@@ -1161,10 +1083,10 @@ auth_aes128_sha1_pack_auth_data(auth_simple_global_data *global, struct server_i
     {
         uint8_t hash[20];
         BUFFER_CONSTANT_INSTANCE(_msg, outdata, out_size - 4);
-        local->hmac(hash, _msg, local->user_key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, local->user_key);
         memmove(outdata + out_size - 4, hash, 4);
     }
-    free(key);
+    ssr_free(ssr_alloc_obfs, key);
 
     return out_size;
 }
@@ -1175,7 +1097,7 @@ auth_aes128_sha1_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size
     uint8_t *plaindata = (uint8_t *)(*pplaindata);
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
     auth_simple_global_data *g_data = (auth_simple_global_data *)obfs->server.g_data;
-    uint8_t * out_buffer = (uint8_t *)calloc((size_t)(datalength * 2 + (SSR_BUFF_SIZE * 2)), sizeof(uint8_t));
+    uint8_t * out_buffer = (uint8_t *)ssr_calloc(ssr_alloc_obfs, (size_t)(datalength * 2 + (SSR_BUFF_SIZE * 2)), sizeof(uint8_t));
     uint8_t * buffer = out_buffer;
     uint8_t * data = plaindata;
     size_t len = datalength;
@@ -1203,12 +1125,12 @@ auth_aes128_sha1_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size
     }
     len = (size_t)(buffer - out_buffer);
     if ((size_t)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+        *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
         plaindata = (uint8_t *)*pplaindata;
     }
     local->last_data_len = datalength;
     memmove(plaindata, out_buffer, len);
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     return len;
 }
 
@@ -1224,18 +1146,18 @@ auth_aes128_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
     //struct server_info_t *server = (struct server_info_t *)&obfs->server;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
+    uint8_t * recv_buffer;
     if (local->recv_buffer->len + datalength > 16384) {
         return -1;
     }
-    memmove(recv_buffer + local->recv_buffer->len, plaindata, datalength);
-    local->recv_buffer->len += datalength;
+    buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = (uint8_t *)local->recv_buffer->buffer;
 
     key_len = local->user_key->len + 4;
-    key = (uint8_t*)malloc((size_t)key_len);
+    key = (uint8_t*)ssr_malloc(ssr_alloc_obfs, (size_t)key_len);
     memcpy(key, local->user_key->buffer, local->user_key->len);
 
-    out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
+    out_buffer = (char*)ssr_malloc(ssr_alloc_obfs, (size_t)local->recv_buffer->len);
     buffer = out_buffer;
     while (local->recv_buffer->len > 4) {
         size_t length;
@@ -1247,7 +1169,7 @@ auth_aes128_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int
             uint8_t hash[20];
             BUFFER_CONSTANT_INSTANCE(_msg, recv_buffer, 2);
             BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
-            local->hmac(hash, _msg, _key);
+            ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
 
             if (memcmp(hash, recv_buffer + 2, 2)) {
                 local->recv_buffer->len = 0;
@@ -1270,7 +1192,7 @@ auth_aes128_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int
             uint8_t hash[20];
             BUFFER_CONSTANT_INSTANCE(_msg, recv_buffer, length - 4);
             BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
-            local->hmac(hash, _msg, _key);
+            ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
             if (memcmp(hash, recv_buffer + length - 4, 4)) {
                 local->recv_buffer->len = 0;
                 error = 1;
@@ -1293,15 +1215,15 @@ auth_aes128_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int
     if (error == 0) {
         len = (int)(buffer - out_buffer);
         if ((int)*capacity < len) {
-            *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+            *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
             plaindata = *pplaindata;
         }
         memmove(plaindata, out_buffer, len);
     } else {
         len = -1;
     }
-    free(out_buffer);
-    free(key);
+    ssr_free(ssr_alloc_obfs, out_buffer);
+    ssr_free(ssr_alloc_obfs, key);
     return (ssize_t)len;
 }
 
@@ -1311,7 +1233,7 @@ auth_aes128_sha1_client_udp_pre_encrypt(struct obfs_t *obfs, char **pplaindata,
     size_t outlength;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * out_buffer = (uint8_t *)malloc((datalength + 8));
+    uint8_t * out_buffer = (uint8_t *)ssr_malloc(ssr_alloc_obfs, (datalength + 8));
 
     if (local->user_key->len == 0) {
         if(obfs->server.param != NULL && obfs->server.param[0] != 0) {
@@ -1345,16 +1267,16 @@ auth_aes128_sha1_client_udp_pre_encrypt(struct obfs_t *obfs, char **pplaindata,
     {
         uint8_t hash[20];
         BUFFER_CONSTANT_INSTANCE(_msg, out_buffer, (int)(outlength - 4));
-        local->hmac(hash, _msg, local->user_key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, local->user_key);
         memmove(out_buffer + outlength - 4, hash, 4);
     }
 
     if (*capacity < outlength) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (outlength * 2));
+        *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (outlength * 2));
         plaindata = *pplaindata;
     }
     memmove(plaindata, out_buffer, outlength);
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     return (ssize_t)outlength;
 }
 
@@ -1373,7 +1295,7 @@ auth_aes128_sha1_client_udp_post_decrypt(struct obfs_t *obfs, char **pplaindata,
     {
         BUFFER_CONSTANT_INSTANCE(_msg, plaindata, (int)(datalength - 4));
         BUFFER_CONSTANT_INSTANCE(_key, obfs->server.key, (int)obfs->server.key_len);
-        local->hmac(hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
     }
     if (memcmp(hash, plaindata + datalength - 4, 4)) {
         return 0;
@@ -1388,7 +1310,7 @@ struct buffer_t * auth_aes128_sha1_server_pre_encrypt(struct obfs_t *obfs, const
     struct buffer_t *buf2 = buffer_clone(buf);
     size_t ogn_data_len = buf2->len;
 
-    uint8_t * out_buffer = (uint8_t *)calloc((size_t)(ogn_data_len * 2 + (SSR_BUFF_SIZE * 2)), sizeof(uint8_t));
+    uint8_t * out_buffer = (uint8_t *)ssr_calloc(ssr_alloc_obfs, (size_t)(ogn_data_len * 2 + (SSR_BUFF_SIZE * 2)), sizeof(uint8_t));
     uint8_t * buffer = out_buffer;
 
     size_t pack_len;
@@ -1404,7 +1326,7 @@ struct buffer_t * auth_aes128_sha1_server_pre_encrypt(struct obfs_t *obfs, const
         buffer += pack_len;
     }
     ret = buffer_create_from(out_buffer, buffer-out_buffer);
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     buffer_release(buf2);
     return ret;
 }
@@ -1419,6 +1341,62 @@ struct buffer_t * auth_aes128_sha1_server_decode(struct obfs_t *obfs, const stru
     return generic_server_decode(obfs, buf, need_decrypt, need_feedback);
 }
 
+/* The first check of server_post_decrypt(): a random byte and 6 of its HMAC keyed with the IV and the key. */
+bool auth_aes128_sha1_server_precheck(struct obfs_t *obfs, const uint8_t *data, size_t len) {
+    auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
+    uint8_t sha1data[SHA1_BYTES + 1] = { 0 };
+    struct buffer_t *mac_key;
+
+    if (len < 7) {
+        return true;
+    }
+    mac_key = buffer_create_from(obfs->server.recv_iv, obfs->server.recv_iv_len);
+    buffer_concatenate(mac_key, obfs->server.key, obfs->server.key_len);
+    {
+        BUFFER_CONSTANT_INSTANCE(_msg, data, 1);
+        ss_hmac_ctx_compute(local->hmac, sha1data, _msg, mac_key);
+    }
+    buffer_release(mac_key);
+    return memcmp(sha1data, data + 1, 6) == 0;
+}
+
+/*
+ * Decrypts the header into |head| with the key of |password|, or with
+ * user_key as it is when NULL, and checks it: 1 when the checksum over the
+ * |*length| bytes it gives matches, 0 when they haven't all come yet.
+ */
+static int auth_aes128_head_open(auth_simple_local_data *local, const char *password, uint8_t *head, size_t *length) {
+    uint8_t sha1data[SHA1_BYTES + 1] = { 0 };
+    uint8_t enc_key[16] = { 0 };
+    struct buffer_t *key;
+    size_t b64len;
+
+    if (password) {
+        uint8_t hash[SHA1_BYTES + 1] = { 0 };
+        local->hash(hash, (uint8_t *)password, strlen(password));
+        buffer_store(local->user_key, hash, (size_t)local->hash_len);
+    }
+    b64len = (size_t) std_base64_encode_len((int) local->user_key->len);
+    key = buffer_create(b64len + 1);
+    key->len = (size_t) std_base64_encode(local->user_key->buffer, (int)local->user_key->len, key->buffer);
+    buffer_concatenate(key, (uint8_t *)local->salt, strlen(local->salt));
+    bytes_to_key_with_size(key->buffer, key->len, enc_key, sizeof(enc_key));
+    buffer_release(key);
+
+    ss_aes_128_cbc_decrypt(16, local->recv_buffer->buffer+11, head, enc_key);
+
+    *length = (size_t) ( *((uint16_t *)(head + 12)) ); // TODO: ntohs
+    if (local->recv_buffer->len < *length) {
+        return 0;
+    }
+    {
+        BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer, *length-4);
+        ss_hmac_ctx_compute(local->hmac, sha1data, _msg, local->user_key);
+    }
+    // '%s: checksum error, data %s'
+    return (memcmp(sha1data, local->recv_buffer->buffer + *length-4, 4) == 0) ? 1 : -1;
+}
+
 struct buffer_t * auth_aes128_sha1_server_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, bool *need_feedback) {
     struct buffer_t *out_buf = NULL;
     struct buffer_t *mac_key = NULL;
@@ -1438,13 +1416,15 @@ struct buffer_t * auth_aes128_sha1_server_post_decrypt(struct obfs_t *obfs, stru
         uint32_t connection_id;
         uint16_t rnd_len;
         int time_diff;
+        const struct ssr_user *user = NULL;
+        int opened;
 
         struct buffer_t *head;
         size_t len = local->recv_buffer->len;
         if ((len >= 7) || (len==2 || len==3)) {
             size_t recv_len = min(len, 7);
             BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer, 1);
-            local->hmac(sha1data, _msg, mac_key);
+            ss_hmac_ctx_compute(local->hmac, sha1data, _msg, mac_key);
             if (memcmp(sha1data, local->recv_buffer->buffer+1, recv_len - 1) != 0) {
                 return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
             }
@@ -1455,7 +1435,7 @@ struct buffer_t * auth_aes128_sha1_server_post_decrypt(struct obfs_t *obfs, stru
         }
         {
             BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer+7, 20);
-            local->hmac(sha1data, _msg, mac_key);
+            ss_hmac_ctx_compute(local->hmac, sha1data, _msg, mac_key);
         }
         if (memcmp(sha1data, local->recv_buffer->buffer+27, 4) != 0) {
             // '%s data incorrect auth HMAC-SHA1 from %s:%d, data %s'
@@ -1466,52 +1446,65 @@ struct buffer_t * auth_aes128_sha1_server_post_decrypt(struct obfs_t *obfs, stru
             return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
         }
 
-        // TODO https://github.com/ShadowsocksR-Live/shadowsocksr/blob/manyuser/shadowsocks/obfsplugin/auth.py#L670
-        buffer_store(local->user_key, obfs->server.key, obfs->server.key_len);
-
-        {
-            uint8_t enc_key[16] = { 0 };
-            uint8_t in_data[32 + 1] = { 0 };
-            struct buffer_t *user_key = local->user_key;
-            size_t b64len = (size_t) std_base64_encode_len((int) user_key->len);
-            struct buffer_t *key = buffer_create(b64len + 1);
-            key->len = (size_t) std_base64_encode(user_key->buffer, (int)user_key->len, key->buffer);
-            buffer_concatenate(key, (uint8_t *)local->salt, strlen(local->salt));
-
-            bytes_to_key_with_size(key->buffer, key->len, enc_key, sizeof(enc_key));
-
-            head = buffer_create(16);
-            head->len = 16;
-            ss_aes_128_cbc_decrypt(16, local->recv_buffer->buffer+11, head->buffer, enc_key);
-
-            buffer_release(key);
+        head = buffer_create(16);
+        head->len = 16;
+        // https://github.com/ShadowsocksR-Live/shadowsocksr/blob/manyuser/shadowsocks/obfsplugin/auth.py#L670
+        if (ssr_user_table_count(obfs->server.users) == 0) {
+            buffer_store(local->user_key, obfs->server.key, obfs->server.key_len);
+            opened = auth_aes128_head_open(local, NULL, head->buffer, &length);
+        } else {
+            const char *old;
+            uint32_t uid = *((uint32_t *)(local->recv_buffer->buffer + 7)); // TODO: ntohl
+            user = ssr_user_table_find(obfs->server.users, uid);
+            if (user == NULL) {
+                // unknown uid on a multi-user port
+                buffer_release(head);
+                return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
+            }
+            opened = auth_aes128_head_open(local, ssr_user_password(obfs->server.users, user), head->buffer, &length);
+            if (opened != 1 && (old = ssr_user_previous_password(obfs->server.users, user)) != NULL) {
+                // A client not told of the new password yet.
+                size_t old_length;
+                int old_opened = auth_aes128_head_open(local, old, head->buffer, &old_length);
+                if (old_opened == 1 || opened == -1) {
+                    opened = old_opened;
+                    length = old_length;
+                }
+            }
         }
-
-        length = (size_t) ( *((uint16_t *)(head->buffer + 12)) ); // TODO: ntohs
-        if (local->recv_buffer->len < length) {
+        if (opened == 0) {
             if (need_feedback) { *need_feedback = false; }
             // TODO: Waiting for the next packet
+            buffer_release(head);
             return buffer_create(1);
         }
+        if (opened == -1) {
+            buffer_release(head);
+            return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
+        }
 
         utc_time = (uint32_t) (*((uint32_t *)(head->buffer + 0))); // TODO: ntohl
         client_id = (uint32_t) (*((uint32_t *)(head->buffer + 4))); // TODO: ntohl
         connection_id = (uint32_t) (*((uint32_t *)(head->buffer + 8))); // TODO: ntohl
         rnd_len = (uint16_t) (*((uint16_t *)(head->buffer + 14))); // TODO: ntohs
-        {
-            BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer, length-4);
-            local->hmac(sha1data, _msg, local->user_key);
-        }
-        if (memcmp(sha1data, local->recv_buffer->buffer+length-4, 4) != 0) {
-            // '%s: checksum error, data %s'
-            return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
-        }
         time_diff = abs((int)time(NULL) - (int)utc_time);
         if (time_diff > local->max_time_dif) {
             // '%s: wrong timestamp, time_dif %d, data %s'
             return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
         }
-        // if self.server_info.data.insert(self.user_id, client_id, connection_id):
+        if (!ssr_replay_table_check_add(obfs->server.replay_windows,
+                *((uint32_t *)(local->recv_buffer->buffer + 7)), client_id, connection_id))
+        {
+            // '%s: replay attack, client_id %08x connection_id %d'
+            return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
+        }
+        if (user != NULL) {
+            if (!ssr_user_table_acquire(obfs->server.users, user)) {
+                // '%s: uid %d over its connection limit or rate'
+                return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
+            }
+            local->user = user;
+        }
         {
             size_t len;
             local->has_recv_header = true;
@@ -1534,7 +1527,7 @@ struct buffer_t * auth_aes128_sha1_server_post_decrypt(struct obfs_t *obfs, stru
         buffer_concatenate(mac_key, (uint8_t *)&recv_id, sizeof(recv_id));
         {
             BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer, 2);
-            local->hmac(sha1data, _msg, mac_key);
+            ss_hmac_ctx_compute(local->hmac, sha1data, _msg, mac_key);
         }
         if (memcmp(sha1data, local->recv_buffer->buffer+2, 2) != 0) {
             // '%s: wrong crc'
@@ -1551,7 +1544,7 @@ struct buffer_t * auth_aes128_sha1_server_post_decrypt(struct obfs_t *obfs, stru
         }
         {
             BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer, length-4);
-            local->hmac(sha1data, _msg, mac_key);
+            ss_hmac_ctx_compute(local->hmac, sha1data, _msg, mac_key);
         }
         if (memcmp(sha1data, local->recv_buffer->buffer + length-4, 4) != 0) {
             // '%s: checksum error, data %s'
@@ -12,9 +12,15 @@
 #include "ssrbuffer.h"
 #include "obfs.h"
 #include "auth_chain.h"
+#include "ssr_user_table.h"
+#include "ssr_replay_window.h"
+#include "ssr_alloc.h"
 
 void auth_chain_a_dispose(struct obfs_t *obfs);
+void auth_chain_a_trim(struct obfs_t *obfs);
+const struct ssr_user * auth_chain_a_get_user(struct obfs_t *obfs);
 void * auth_chain_a_init_data(void);
+void auth_chain_a_dispose_data(void *data);
 size_t auth_chain_a_get_overhead(struct obfs_t *obfs);
 void auth_chain_a_set_server_info(struct obfs_t *obfs, struct server_info_t *server);
 
@@ -25,6 +31,7 @@ ssize_t auth_chain_a_client_udp_post_decrypt(struct obfs_t *obfs, char **pplaind
 
 struct buffer_t * auth_chain_a_server_pre_encrypt(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, bool *need_feedback);
+bool auth_chain_a_server_precheck(struct obfs_t *obfs, const uint8_t *data, size_t len);
 
 #if defined(_MSC_VER) && (_MSC_VER < 1800)
 
@@ -129,7 +136,7 @@ void i64_memcpy(uint8_t* target, uint8_t* source)
 
 void shift128plus_init_from_bin(struct shift128plus_ctx *ctx, uint8_t *bin, int bin_size) {
     uint8_t fill_bin[16] = {0};
-    memcpy(fill_bin, bin, bin_size);
+    memcpy(fill_bin, bin, min((size_t)bin_size, sizeof(fill_bin)));
     if (*(uint8_t*)(&g_endian_test) == 1) {
         memcpy(ctx, fill_bin, 16);
     } else {
@@ -156,9 +163,52 @@ void shift128plus_init_from_bin_datalen(struct shift128plus_ctx *ctx, const uint
     }
 }
 
+#define AUTH_CHAIN_HEAD_KEYS        64  /* Header keys a loop keeps, by uid. */
+#define AUTH_CHAIN_HEAD_SECRET_MAX  64  /* Longer user keys are derived every time. */
+
+/*
+ * Adaptive padding. The client asks with a flag in the reserved byte 14 of
+ * the auth header, old servers ignore it. A server that grants it sets the
+ * top bit of the tcp_mss in its first frame, which old clients never see as
+ * they never ask. From then on, once the server's frames have carried
+ * AUTH_CHAIN_FULL_PADDING_BYTES, a frame that is full, unit_len bytes, or
+ * follows a full one, the body and the tail of a bulk write, takes the
+ * variant's least padding. Lone small frames keep theirs. Both ends see the
+ * same frames so they agree on which those are. The client's frames keep
+ * their padding: the server couldn't tell where the client learned of the
+ * grant.
+ */
+#define AUTH_CHAIN_HEAD_ADAPTIVE_PADDING  0x01
+#define AUTH_CHAIN_MSS_ADAPTIVE_PADDING   0x8000
+#define AUTH_CHAIN_FULL_PADDING_BYTES     (64 * 1024)
+
+/*
+ * The AES key of the 16-byte auth header is bytes_to_key(base64(user key)
+ * + salt), the same for every connection of a user. It's kept expanded,
+ * keyed by the user key itself, so a replaced password never hits.
+ */
+struct auth_chain_head_key {
+    const char *salt;
+    bool encrypt;
+    size_t secret_len;
+    uint8_t secret[AUTH_CHAIN_HEAD_SECRET_MAX];
+    struct ss_aes_128_ctx *aes;
+};
+
 struct auth_chain_global_data {
-    uint8_t local_client_id[4];
-    uint32_t connection_id;
+    struct conn_id_gen ids;
+    struct auth_chain_head_key head_keys[AUTH_CHAIN_HEAD_KEYS];
+};
+
+/*
+ * Dense index over a sorted data_size_list: pos[key] is the index of the
+ * first entry >= key, keys beyond the last entry map to the list length.
+ * Built on first use after the list changes.
+ */
+struct data_size_lookup {
+    uint8_t *pos;
+    size_t   size;
+    bool     dirty;
 };
 
 struct auth_chain_b_context {
@@ -166,12 +216,15 @@ struct auth_chain_b_context {
     size_t  data_size_list_length;
     int    *data_size_list2;
     size_t  data_size_list2_length;
+    struct data_size_lookup lookup;
+    struct data_size_lookup lookup2;
     void *subclass_context;
 };
 
 struct auth_chain_c_context {
     int    *data_size_list0;
     size_t  data_size_list0_length;
+    struct data_size_lookup lookup0;
     void *subclass_context;
 };
 
@@ -186,6 +239,7 @@ struct auth_chain_a_context {
     struct buffer_t *user_key;
     char uid[4];
     int last_data_len;
+    struct ss_hmac_ctx *hmac; /* Keyed HMAC-MD5 state kept across chunks. */
     uint8_t last_client_hash[16];
     uint8_t last_server_hash[16];
     struct shift128plus_ctx random_client;
@@ -194,66 +248,128 @@ struct auth_chain_a_context {
     struct enc_ctx *encrypt_ctx;
     struct enc_ctx *decrypt_ctx;
     uint32_t user_id_num;
+    const struct ssr_user *user; /* Server side, holds a connection slot of it. */
     uint16_t client_over_head;
     size_t unit_len;
     int max_time_dif;
     uint32_t client_id;
     uint32_t connection_id;
+    bool adaptive_padding; /* Granted, see AUTH_CHAIN_HEAD_ADAPTIVE_PADDING. */
+    uint64_t server_data_bytes; /* Payload of the server's frames so far, counted alike by both ends. */
+    bool server_frame_full; /* The server's last frame was of unit_len. */
 
     // rnd_data_len
     unsigned int (*get_tcp_rand_len)(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
+    unsigned int (*get_tcp_bulk_rand_len)(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
     void *subclass_context;
 };
 
 void auth_chain_a_context_init(struct obfs_t *obfs, struct auth_chain_a_context *local) {
     local->obfs = obfs;
     local->has_sent_header = 0;
-    local->recv_buffer = buffer_create(16384);
+    local->recv_buffer = buffer_create(0);
     local->recv_id = 1;
     local->pack_id = 1;
     local->salt = "";
-    local->user_key = buffer_create(SSR_BUFF_SIZE);
+    local->user_key = buffer_create(0);
+    local->hmac = ss_hmac_ctx_create(ss_hmac_md5);
     memset(&local->random_client, 0, sizeof(local->random_client));
     memset(&local->random_server, 0, sizeof(local->random_server));
     local->encrypt_ctx = NULL;
     local->decrypt_ctx = NULL;
     local->get_tcp_rand_len = NULL;
+    local->get_tcp_bulk_rand_len = NULL;
     local->subclass_context = NULL;
     local->max_time_dif = 60 * 60 * 24; // time dif (second) setting
 }
 
 unsigned int auth_chain_a_get_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
+unsigned int auth_chain_a_get_bulk_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
 unsigned int get_rand_start_pos(int rand_len, struct shift128plus_ctx *random);
+unsigned int get_server_rand_len(struct auth_chain_a_context *local, int datalength);
 
 int data_size_list_compare(const void *a, const void *b) {
     return (*(int *)a - *(int *)b);
 }
 
 void * auth_chain_a_init_data(void) {
-    struct auth_chain_global_data *global = (struct auth_chain_global_data*)malloc(sizeof(struct auth_chain_global_data));
-    rand_bytes(global->local_client_id, 4);
-    rand_bytes((uint8_t*)(&global->connection_id), 4);
-    global->connection_id &= 0xFFFFFF;
+    struct auth_chain_global_data *global = (struct auth_chain_global_data*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct auth_chain_global_data));
+    conn_id_gen_init(&global->ids);
     return global;
 }
 
+void auth_chain_a_dispose_data(void *data) {
+    struct auth_chain_global_data *global = (struct auth_chain_global_data *)data;
+    size_t i;
+    for (i = 0; i < AUTH_CHAIN_HEAD_KEYS; ++i) {
+        ss_aes_128_ctx_destroy(global->head_keys[i].aes);
+    }
+    ssr_free(ssr_alloc_obfs, global);
+}
+
+/* CBC of the 16-byte auth header under the key of |user_key| and |salt|. */
+static void auth_chain_head_crypt(struct auth_chain_global_data *global, uint32_t slot, const char *salt,
+    const struct buffer_t *user_key, bool encrypt, const uint8_t in[16], uint8_t out[16])
+{
+    struct auth_chain_head_key *entry = global ? &global->head_keys[slot % AUTH_CHAIN_HEAD_KEYS] : NULL;
+    size_t b64len = (size_t) std_base64_encode_len((int) user_key->len);
+    size_t salt_len = strlen(salt);
+    uint8_t enc_key[16];
+    uint8_t *key;
+
+    if (entry && entry->aes && entry->salt == salt && entry->encrypt == encrypt &&
+        entry->secret_len == user_key->len && memcmp(entry->secret, user_key->buffer, user_key->len) == 0)
+    {
+        ss_aes_128_ctx_cbc(entry->aes, 16, in, out);
+        return;
+    }
+
+    key = (uint8_t *)ssr_calloc(ssr_alloc_obfs, b64len + salt_len, sizeof(uint8_t));
+    b64len = (size_t) std_base64_encode(user_key->buffer, (int)user_key->len, key);
+    memcpy(key + b64len, salt, salt_len);
+    bytes_to_key_with_size(key, b64len + salt_len, enc_key, 16);
+    ssr_free(ssr_alloc_obfs, key);
+
+    if (entry && user_key->len <= AUTH_CHAIN_HEAD_SECRET_MAX) {
+        ss_aes_128_ctx_destroy(entry->aes);
+        entry->aes = ss_aes_128_ctx_create(enc_key, encrypt);
+        entry->salt = salt;
+        entry->encrypt = encrypt;
+        entry->secret_len = user_key->len;
+        memcpy(entry->secret, user_key->buffer, user_key->len);
+        if (entry->aes) {
+            ss_aes_128_ctx_cbc(entry->aes, 16, in, out);
+            return;
+        }
+    }
+    if (encrypt) {
+        ss_aes_128_cbc_encrypt(16, in, out, enc_key);
+    } else {
+        ss_aes_128_cbc_decrypt(16, in, out, enc_key);
+    }
+}
+
 struct obfs_t * auth_chain_a_new_obfs(void) {
-    struct obfs_t * obfs = (struct obfs_t*)calloc(1, sizeof(struct obfs_t));
+    struct obfs_t * obfs = (struct obfs_t*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
     struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)
-        calloc(1, sizeof(struct auth_chain_a_context));
+        ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct auth_chain_a_context));
 
     auth_chain_a_context_init(obfs, auth_chain_a);
     auth_chain_a->salt = "auth_chain_a";
     auth_chain_a->get_tcp_rand_len = auth_chain_a_get_rand_len;
+    auth_chain_a->get_tcp_bulk_rand_len = auth_chain_a_get_bulk_rand_len;
 
     obfs->l_data = auth_chain_a;
 
     obfs->init_data = auth_chain_a_init_data;
+    obfs->dispose_data = auth_chain_a_dispose_data;
     obfs->get_overhead = auth_chain_a_get_overhead;
     obfs->need_feedback = need_feedback_true;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = auth_chain_a_set_server_info;
     obfs->dispose = auth_chain_a_dispose;
+    obfs->trim = auth_chain_a_trim;
+    obfs->get_user = auth_chain_a_get_user;
 
     obfs->client_pre_encrypt = auth_chain_a_client_pre_encrypt;
     obfs->client_post_decrypt = auth_chain_a_client_post_decrypt;
@@ -262,6 +378,7 @@ struct obfs_t * auth_chain_a_new_obfs(void) {
 
     obfs->server_pre_encrypt = auth_chain_a_server_pre_encrypt;
     obfs->server_post_decrypt = auth_chain_a_server_post_decrypt;
+    obfs->server_precheck = auth_chain_a_server_precheck;
 
     return obfs;
 }
@@ -270,16 +387,28 @@ size_t auth_chain_a_get_overhead(struct obfs_t *obfs) {
     return 4;
 }
 
+void auth_chain_a_trim(struct obfs_t *obfs) {
+    struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    buffer_trim(local->recv_buffer);
+}
+
+const struct ssr_user * auth_chain_a_get_user(struct obfs_t *obfs) {
+    struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    return local->user;
+}
+
 void auth_chain_a_dispose(struct obfs_t *obfs) {
     struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
     buffer_release(local->recv_buffer);
     buffer_release(local->user_key);
+    ss_hmac_ctx_destroy(local->hmac);
+    ssr_user_table_release(obfs->server.users, local->user);
     if (local->cipher) {
         enc_ctx_release_instance(local->cipher, local->encrypt_ctx);
         enc_ctx_release_instance(local->cipher, local->decrypt_ctx);
         cipher_env_release(local->cipher);
     }
-    free(local);
+    ssr_free(ssr_alloc_obfs, local);
     obfs->l_data = NULL;
     dispose_obfs(obfs);
 }
@@ -310,16 +439,30 @@ unsigned int auth_chain_a_get_rand_len(struct auth_chain_a_context *local, int d
     return shift128plus_next(random) % 1021;
 }
 
+/* What auth_chain_a gives its largest frames. */
+unsigned int auth_chain_a_get_bulk_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]) {
+    (void)local;
+    if (datalength > 1440) {
+        return 0;
+    }
+    shift128plus_init_from_bin_datalen(random, last_hash, 16, datalength);
+    return shift128plus_next(random) % 31;
+}
+
 struct buffer_t * auth_chain_a_rnd_data(struct obfs_t * obfs, 
     const struct buffer_t *buf, struct shift128plus_ctx *random, 
     const uint8_t last_hash[16])
 {
     struct auth_chain_a_context *local = (struct auth_chain_a_context *) obfs->l_data;
     struct server_info_t *server = &obfs->server;
-    size_t rand_len = local->get_tcp_rand_len(local, (int) buf->len, random, last_hash);
-    struct buffer_t *rnd_data_buf = buffer_create(rand_len);
+    size_t rand_len;
+    struct buffer_t *rnd_data_buf;
     struct buffer_t *ret = NULL;
 
+    // Only the server's frames come here, they may be bulk ones.
+    assert(random == &local->random_server && last_hash == local->last_server_hash);
+    rand_len = get_server_rand_len(local, (int) buf->len);
+    rnd_data_buf = buffer_create(rand_len);
     rand_bytes(rnd_data_buf->buffer, (int)rand_len);
     rnd_data_buf->len = rand_len;
 
@@ -343,23 +486,34 @@ struct buffer_t * auth_chain_a_rnd_data(struct obfs_t * obfs,
     return ret;
 }
 
-size_t auth_chain_find_pos(int *arr, size_t length, int key) {
-    size_t low = 0;
-    size_t high = length - 1;
-    size_t middle = -1;
-
-    if (key > arr[high]) {
-        return length;
-    }
-    while (low < high) {
-        middle = (low + high) / 2;
-        if (key > arr[middle]) {
-            low = middle + 1;
-        } else if (key <= arr[middle]) {
-            high = middle;
+static size_t data_size_lookup_pos(struct data_size_lookup *lookup, const int *arr, size_t length, int key) {
+    if (lookup->dirty) {
+        size_t i, j = 0;
+        // list values are < 1440 and lengths stay below 256
+        lookup->size = (size_t)arr[length - 1] + 1;
+        lookup->pos = (uint8_t *) ssr_realloc(ssr_alloc_obfs, lookup->pos, lookup->size);
+        for (i = 0; i < lookup->size; ++i) {
+            while ((size_t)arr[j] < i) {
+                ++j;
+            }
+            lookup->pos[i] = (uint8_t) j;
         }
+        lookup->dirty = false;
+    }
+    if (key < 0) {
+        return 0;
+    }
+    if ((size_t)key >= lookup->size) {
+        return length;
     }
-    return low;
+    return lookup->pos[key];
+}
+
+static void data_size_lookup_release(struct data_size_lookup *lookup) {
+    ssr_free(ssr_alloc_obfs, lookup->pos);
+    lookup->pos = NULL;
+    lookup->size = 0;
+    lookup->dirty = false;
 }
 
 unsigned int udp_get_rand_len(struct shift128plus_ctx *random, uint8_t last_hash[16]) {
@@ -379,6 +533,11 @@ unsigned int get_client_rand_len(struct auth_chain_a_context *local, size_t data
 }
 
 unsigned int get_server_rand_len(struct auth_chain_a_context *local, int datalength) {
+    if (local->adaptive_padding && local->server_data_bytes >= AUTH_CHAIN_FULL_PADDING_BYTES
+        && (local->server_frame_full || (size_t)datalength == local->unit_len))
+    {
+        return local->get_tcp_bulk_rand_len(local, datalength, &local->random_server, local->last_server_hash);
+    }
     return local->get_tcp_rand_len(local, datalength, &local->random_server, local->last_server_hash);
 }
 
@@ -394,7 +553,7 @@ size_t auth_chain_a_pack_client_data(struct obfs_t *obfs, char *data, size_t dat
     outdata[1] = (char)((uint8_t)(datalength >> 8) ^ local->last_client_hash[15]);
 
     {
-        uint8_t * rnd_data = (uint8_t *) malloc(rand_len * sizeof(uint8_t));
+        uint8_t * rnd_data = (uint8_t *) ssr_malloc(ssr_alloc_obfs, rand_len * sizeof(uint8_t));
         rand_bytes(rnd_data, (int)rand_len);
         if (datalength > 0) {
             unsigned int start_pos = get_rand_start_pos((int)rand_len, &local->random_client);
@@ -406,21 +565,21 @@ size_t auth_chain_a_pack_client_data(struct obfs_t *obfs, char *data, size_t dat
         } else {
             memcpy(outdata + 2, rnd_data, rand_len);
         }
-        free(rnd_data);
+        ssr_free(ssr_alloc_obfs, rnd_data);
     }
 
     key_len = (uint8_t)(local->user_key->len + 4);
-    key = (uint8_t *) malloc(key_len * sizeof(uint8_t));
+    key = (uint8_t *) ssr_malloc(ssr_alloc_obfs, key_len * sizeof(uint8_t));
     memcpy(key, local->user_key->buffer, local->user_key->len);
     memintcopy_lt(key + key_len - 4, local->pack_id);
     ++local->pack_id;
     {
         BUFFER_CONSTANT_INSTANCE(_msg, outdata, out_size);
         BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
-        ss_md5_hmac_with_key(local->last_client_hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, local->last_client_hash, _msg, _key);
     }
     memcpy(outdata + out_size, local->last_client_hash, 2);
-    free(key);
+    ssr_free(ssr_alloc_obfs, key);
     return out_size + 2;
 }
 
@@ -436,15 +595,17 @@ struct buffer_t * auth_chain_a_pack_server_data(struct obfs_t *obfs, const struc
 
     {
         size_t out_len = 0;
-        uint8_t *buffer = (uint8_t *)calloc(buf->len + 4, sizeof(uint8_t));
+        uint8_t *buffer = (uint8_t *)ssr_calloc(ssr_alloc_obfs, buf->len + 4, sizeof(uint8_t));
         ss_encrypt_buffer(local->cipher, local->encrypt_ctx,
             (char*)buf->buffer, (size_t)buf->len, 
             (char *)buffer, &out_len);
         in_buf = buffer_create_from(buffer, out_len);
-        free(buffer);
+        ssr_free(ssr_alloc_obfs, buffer);
     }
 
     data = auth_chain_a_rnd_data(obfs, in_buf, &local->random_server, local->last_server_hash);
+    local->server_data_bytes += in_buf->len;
+    local->server_frame_full = (in_buf->len == local->unit_len);
 
     pack_id = local->pack_id; // TODO: htonl
     mac_key = buffer_clone(local->user_key);
@@ -457,7 +618,7 @@ struct buffer_t * auth_chain_a_pack_server_data(struct obfs_t *obfs, const struc
         uint16_t length3 = length; // TODO: htons
         buffer_insert(data, 0, (uint8_t *)&length3, sizeof(length3));
     }
-    ss_md5_hmac_with_key(local->last_server_hash, data, mac_key);
+    ss_hmac_ctx_compute(local->hmac, local->last_server_hash, data, mac_key);
     buffer_concatenate(data, local->last_server_hash, 2);
 
     buffer_release(mac_key);
@@ -468,6 +629,8 @@ struct buffer_t * auth_chain_a_pack_server_data(struct obfs_t *obfs, const struc
 }
 
 size_t auth_chain_a_pack_auth_data(struct obfs_t *obfs, char *data, size_t datalength, char *outdata) {
+    uint8_t client_id[8];
+    uint32_t connection_id;
     struct server_info_t *server = &obfs->server;
     struct auth_chain_global_data *global = (struct auth_chain_global_data *)obfs->server.g_data;
     struct auth_chain_a_context *local = (struct auth_chain_a_context *) obfs->l_data;
@@ -481,25 +644,20 @@ size_t auth_chain_a_pack_auth_data(struct obfs_t *obfs, char *data, size_t datal
     time_t t;
     char password[256] = {0};
 
-    ++global->connection_id;
-    if (global->connection_id > 0xFF000000) {
-        rand_bytes(global->local_client_id, 8);
-        rand_bytes((uint8_t*)(&global->connection_id), 4);
-        global->connection_id &= 0xFFFFFF;
-    }
+    connection_id = conn_id_gen_next(&global->ids, client_id);
 
     key_len = (uint8_t)(server->iv_len + server->key_len);
-    key = (uint8_t *) malloc(key_len * sizeof(uint8_t));
+    key = (uint8_t *) ssr_malloc(ssr_alloc_obfs, key_len * sizeof(uint8_t));
     memcpy(key, server->iv, server->iv_len);
     memcpy(key + server->iv_len, server->key, server->key_len);
 
     t = time(NULL);
     memintcopy_lt(encrypt, (uint32_t)t);
-    memcpy(encrypt + 4, global->local_client_id, 4);
-    memintcopy_lt(encrypt + 8, global->connection_id);
+    memcpy(encrypt + 4, client_id, 4);
+    memintcopy_lt(encrypt + 8, connection_id);
     encrypt[12] = (uint8_t)server->overhead;
     encrypt[13] = (uint8_t)(server->overhead >> 8);
-    encrypt[14] = 0;
+    encrypt[14] = server->adaptive_padding ? AUTH_CHAIN_HEAD_ADAPTIVE_PADDING : 0;
     encrypt[15] = 0;
 
     // first 12 bytes
@@ -507,20 +665,15 @@ size_t auth_chain_a_pack_auth_data(struct obfs_t *obfs, char *data, size_t datal
         BUFFER_CONSTANT_INSTANCE(_msg, outdata, 4);
         BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
         rand_bytes((uint8_t*)outdata, 4);
-        ss_md5_hmac_with_key(local->last_client_hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, local->last_client_hash, _msg, _key);
         memcpy(outdata + 4, local->last_client_hash, 8);
     }
 
-    free(key); key = NULL;
+    ssr_free(ssr_alloc_obfs, key); key = NULL;
 
     // uid & 16 bytes auth data
     {
         uint8_t encrypt_data[16];
-        size_t enc_key_len;
-        uint8_t enc_key[16];
-        size_t base64_len;
-        size_t salt_len;
-        uint8_t encrypt_key_base64[256] = {0};
         int i = 0;
         uint8_t uid[4];
         if (local->user_key->len == 0) {
@@ -548,21 +701,14 @@ size_t auth_chain_a_pack_auth_data(struct obfs_t *obfs, char *data, size_t datal
             uid[i] = (uint8_t)local->uid[i] ^ local->last_client_hash[8 + i];
         }
 
-        std_base64_encode(local->user_key->buffer, (int)local->user_key->len, encrypt_key_base64);
-        salt_len = strlen(salt);
-        base64_len = (local->user_key->len + 2) / 3 * 4;
-        memcpy(encrypt_key_base64 + base64_len, salt, salt_len);
-
-        enc_key_len = base64_len + salt_len;
-        bytes_to_key_with_size(encrypt_key_base64, (size_t)enc_key_len, (uint8_t*)enc_key, 16);
-        ss_aes_128_cbc_encrypt(16, encrypt, encrypt_data, enc_key);
+        auth_chain_head_crypt(global, 0, salt, local->user_key, true, encrypt, encrypt_data);
         memcpy(encrypt, uid, 4);
         memcpy(encrypt + 4, encrypt_data, 16);
     }
     // final HMAC
     {
         BUFFER_CONSTANT_INSTANCE(_msg, encrypt, 20);
-        ss_md5_hmac_with_key(local->last_server_hash, _msg, local->user_key);
+        ss_hmac_ctx_compute(local->hmac, local->last_server_hash, _msg, local->user_key);
         memcpy(outdata + 12, encrypt, 20);
         memcpy(outdata + 12 + 20, local->last_server_hash, 4);
     }
@@ -582,7 +728,7 @@ size_t auth_chain_a_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, s
     char *plaindata = *pplaindata;
     struct server_info_t *server = (struct server_info_t *)&obfs->server;
     struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
-    char * out_buffer = (char*)malloc((size_t)(datalength * 2 + (SSR_BUFF_SIZE * 2)));
+    char * out_buffer = (char*)ssr_malloc(ssr_alloc_obfs, (size_t)(datalength * 2 + (SSR_BUFF_SIZE * 2)));
     char * buffer = out_buffer;
     char * data = plaindata;
     size_t len = datalength;
@@ -612,16 +758,34 @@ size_t auth_chain_a_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, s
     }
     len = (size_t)(buffer - out_buffer);
     if ((size_t)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+        *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
         // TODO check realloc failed
         plaindata = *pplaindata;
     }
     local->last_data_len = (int) datalength;
     memmove(plaindata, out_buffer, len);
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     return len;
 }
 
+/*
+ * Copies a frame payload to |out| and decrypts it there. The rc4 stream
+ * of auth_chain has no IV, so the payload is decrypted in place without
+ * the intermediate buffers of ss_decrypt_buffer().
+ */
+static bool auth_chain_decrypt_frame(struct auth_chain_a_context *local, uint8_t *out, const uint8_t *in, size_t len) {
+    memmove(out, in, len);
+    {
+        BUFFER_CONSTANT_INSTANCE(_frame, out, len);
+        return ss_decrypt(local->cipher, _frame, local->decrypt_ctx, len) == 0 && _frame->len == len;
+    }
+}
+
+/*
+ * Frames are parsed behind a read cursor: each one is consumed from the
+ * head of recv_buffer without moving the rest, and only the incomplete
+ * tail left at the end of the call is moved back to the start.
+ */
 ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int datalength, size_t* capacity) {
     int len;
     char *plaindata = *pplaindata;
@@ -639,10 +803,10 @@ ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata,
     buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
 
     key_len = local->user_key->len + 4;
-    key = (uint8_t*)malloc((size_t)key_len);
+    key = (uint8_t*)ssr_malloc(ssr_alloc_obfs, (size_t)key_len);
     memcpy(key, local->user_key->buffer, local->user_key->len);
 
-    out_buffer = (uint8_t *)malloc((size_t)local->recv_buffer->len);
+    out_buffer = (uint8_t *)ssr_malloc(ssr_alloc_obfs, (size_t)local->recv_buffer->len);
     buffer = out_buffer;
     while (local->recv_buffer->len > 4) {
         uint8_t hash[16];
@@ -669,7 +833,7 @@ ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata,
         {
             BUFFER_CONSTANT_INSTANCE(_msg, recv_buffer, len - 2);
             BUFFER_CONSTANT_INSTANCE(_key, key, key_len);
-            ss_md5_hmac_with_key(hash, _msg, _key);
+            ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
         }
         if (memcmp(hash, recv_buffer + len - 2, 2)) {
             local->recv_buffer->len = 0;
@@ -682,30 +846,43 @@ ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata,
         } else {
             pos = 2;
         }
-        ss_decrypt_buffer(local->cipher, local->decrypt_ctx,
-                (char*)recv_buffer + pos, (size_t)data_len, (char *)buffer, &out_len);
+        if (!auth_chain_decrypt_frame(local, buffer, recv_buffer + pos, (size_t)data_len)) {
+            local->recv_buffer->len = 0;
+            error = 1;
+            break;
+        }
+        out_len = (size_t)data_len;
 
         if (local->recv_id == 1) {
             server->tcp_mss = (uint16_t)(buffer[0] | (buffer[1] << 8));
+            if (server->adaptive_padding && (server->tcp_mss & AUTH_CHAIN_MSS_ADAPTIVE_PADDING)) {
+                server->tcp_mss &= ~AUTH_CHAIN_MSS_ADAPTIVE_PADDING;
+                local->adaptive_padding = true;
+            }
+            // The server's frames are cut to what it took for our overhead.
+            local->unit_len = server->tcp_mss - server->overhead;
             memmove(buffer, buffer + 2, out_len -= 2);
         }
+        local->server_data_bytes += (size_t)data_len;
+        local->server_frame_full = ((size_t)data_len == local->unit_len);
         memcpy(local->last_server_hash, hash, 16);
         ++local->recv_id;
         buffer += out_len;
-        buffer_shorten(local->recv_buffer, len, local->recv_buffer->len - len);
+        buffer_consume(local->recv_buffer, len);
     }
+    buffer_drop_head(local->recv_buffer);
     if (error == 0) {
         len = (int)(buffer - out_buffer);
         if ((int)*capacity < len) {
-            *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+            *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
             plaindata = *pplaindata;
         }
         memmove(plaindata, out_buffer, len);
     } else {
         len = -1;
     }
-    free(out_buffer);
-    free(key);
+    ssr_free(ssr_alloc_obfs, out_buffer);
+    ssr_free(ssr_alloc_obfs, key);
     return (ssize_t)len;
 }
 
@@ -713,7 +890,7 @@ ssize_t auth_chain_a_client_udp_pre_encrypt(struct obfs_t *obfs, char **pplainda
     char *plaindata = *pplaindata;
     struct server_info_t *server = (struct server_info_t *)&obfs->server;
     struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
-    uint8_t *out_buffer = (uint8_t *) malloc((datalength + (SSR_BUFF_SIZE / 2)) * sizeof(uint8_t));
+    uint8_t *out_buffer = (uint8_t *) ssr_malloc(ssr_alloc_obfs, (datalength + (SSR_BUFF_SIZE / 2)) * sizeof(uint8_t));
     uint8_t auth_data[3];
     uint8_t hash[16];
     int rand_len;
@@ -748,10 +925,10 @@ ssize_t auth_chain_a_client_udp_pre_encrypt(struct obfs_t *obfs, char **pplainda
     {
         BUFFER_CONSTANT_INSTANCE(_msg, auth_data, 3);
         BUFFER_CONSTANT_INSTANCE(_key, server->key, server->key_len);
-        ss_md5_hmac_with_key(hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
     }
     rand_len = (int) udp_get_rand_len(&local->random_client, hash);
-    rnd_data = (uint8_t *) malloc((size_t)rand_len * sizeof(uint8_t));
+    rnd_data = (uint8_t *) ssr_malloc(ssr_alloc_obfs, (size_t)rand_len * sizeof(uint8_t));
     rand_bytes(rnd_data, (int)rand_len);
     outlength = datalength + rand_len + 8;
 
@@ -782,18 +959,18 @@ ssize_t auth_chain_a_client_udp_pre_encrypt(struct obfs_t *obfs, char **pplainda
     memmove(out_buffer + outlength - 5, uid, 4);
     {
         BUFFER_CONSTANT_INSTANCE(_msg, out_buffer, (int)(outlength - 1));
-        ss_md5_hmac_with_key(hash, _msg, local->user_key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, local->user_key);
     }
     memmove(out_buffer + outlength - 1, hash, 1);
 
     if (*capacity < outlength) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (outlength * 2));
+        *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (outlength * 2));
         plaindata = *pplaindata;
     }
     memmove(plaindata, out_buffer, outlength);
 
-    free(out_buffer);
-    free(rnd_data);
+    ssr_free(ssr_alloc_obfs, out_buffer);
+    ssr_free(ssr_alloc_obfs, rnd_data);
 
     return (ssize_t)outlength;
 }
@@ -813,7 +990,7 @@ ssize_t auth_chain_a_client_udp_post_decrypt(struct obfs_t *obfs, char **pplaind
 
     {
         BUFFER_CONSTANT_INSTANCE(_msg, plaindata, (int)(datalength - 1));
-        ss_md5_hmac_with_key(hash, _msg, local->user_key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, local->user_key);
     }
     if (*hash != ((uint8_t*)plaindata)[datalength - 1]) {
         return 0;
@@ -821,7 +998,7 @@ ssize_t auth_chain_a_client_udp_post_decrypt(struct obfs_t *obfs, char **pplaind
     {
         BUFFER_CONSTANT_INSTANCE(_msg, plaindata + datalength - 8, 7);
         BUFFER_CONSTANT_INSTANCE(_key, server->key, server->key_len);
-        ss_md5_hmac_with_key(hash, _msg, _key);
+        ss_hmac_ctx_compute(local->hmac, hash, _msg, _key);
     }
     rand_len = (int)udp_get_rand_len(&local->random_server, hash);
     outlength = datalength - rand_len - 8;
@@ -857,6 +1034,9 @@ struct buffer_t * auth_chain_a_server_pre_encrypt(struct obfs_t *obfs, const str
     struct buffer_t *ret = buffer_create(SSR_BUFF_SIZE);
     if (local->pack_id == 1) {
         uint16_t tcp_mss = server->tcp_mss; // TODO: htons
+        if (local->adaptive_padding) {
+            tcp_mss |= AUTH_CHAIN_MSS_ADAPTIVE_PADDING;
+        }
         tmp_buf = buffer_create_from((const uint8_t *)&tcp_mss, sizeof(uint16_t));
         buffer_concatenate2(tmp_buf, buf);
         local->unit_len = server->tcp_mss - local->client_over_head;
@@ -881,6 +1061,30 @@ struct buffer_t * auth_chain_a_server_pre_encrypt(struct obfs_t *obfs, const str
     return ret;
 }
 
+/*
+ * The first check of server_post_decrypt() alone: 4 random bytes and 8
+ * of their HMAC-MD5 keyed with the IV and the key, before the rest of
+ * the packet is decrypted. The keyed state stays for the full check.
+ */
+bool auth_chain_a_server_precheck(struct obfs_t *obfs, const uint8_t *data, size_t len) {
+    struct server_info_t *server = (struct server_info_t *)&obfs->server;
+    struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    uint8_t md5data[16 + 1] = { 0 };
+    struct buffer_t *mac_key;
+
+    if (len < 12) {
+        return true;
+    }
+    mac_key = buffer_create_from(server->recv_iv, server->recv_iv_len);
+    buffer_concatenate(mac_key, server->key, server->key_len);
+    {
+        BUFFER_CONSTANT_INSTANCE(_msg, data, 4);
+        ss_hmac_ctx_compute(local->hmac, md5data, _msg, mac_key);
+    }
+    buffer_release(mac_key);
+    return memcmp(md5data, data + 4, 8) == 0;
+}
+
 struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, bool *need_feedback) {
     struct server_info_t *server = (struct server_info_t *)&obfs->server;
     struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
@@ -901,6 +1105,8 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         uint32_t connection_id = 0;
         int time_diff;
         uint8_t *password = NULL;
+        const struct ssr_user *user = NULL;
+        bool previous = false;
 
         if (len>=12 || len==7 || len==8) {
             size_t recv_len = min(len, 12);
@@ -908,7 +1114,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
             buffer_concatenate(mac_key, server->key, server->key_len);
             {
                 BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer, 4);
-                ss_md5_hmac_with_key(md5data, _msg, mac_key);
+                ss_hmac_ctx_compute(local->hmac, md5data, _msg, mac_key);
             }
             buffer_release(mac_key);
             if (memcmp(md5data, local->recv_buffer->buffer+4, recv_len-4) != 0) {
@@ -924,11 +1130,31 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         uid = uid ^ (*((uint32_t *)(md5data + 8))); // TODO: ntohl
         local->user_id_num = uid;
 
-        buffer_store(local->user_key, server->key, server->key_len);
+        if (ssr_user_table_count(server->users) == 0) {
+            buffer_store(local->user_key, server->key, server->key_len);
+        } else {
+            const char *password;
+            user = ssr_user_table_find(server->users, uid);
+            if (user == NULL) {
+                // unknown uid on a multi-user port
+                return out_buf;
+            }
+            password = ssr_user_password(server->users, user);
+            buffer_store(local->user_key, (const uint8_t *)password, strlen(password));
+        }
 
         {
             BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer + 12, 20);
-            ss_md5_hmac_with_key(md5data, _msg, local->user_key);
+            ss_hmac_ctx_compute(local->hmac, md5data, _msg, local->user_key);
+            if (memcmp(md5data, local->recv_buffer->buffer+32, 4) != 0 && user != NULL) {
+                // A client not told of the new password yet.
+                const char *old = ssr_user_previous_password(server->users, user);
+                if (old != NULL) {
+                    buffer_store(local->user_key, (const uint8_t *)old, strlen(old));
+                    ss_hmac_ctx_compute(local->hmac, md5data, _msg, local->user_key);
+                    previous = true;
+                }
+            }
         }
         if (memcmp(md5data, local->recv_buffer->buffer+32, 4) != 0) {
             // logging.error('%s data incorrect auth HMAC-MD5 from %s:%d, data %s' % (self.no_compatible_method, self.server_info.client, self.server_info.client_port, binascii.hexlify(self.recv_buf)))
@@ -936,18 +1162,12 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         }
 
         memcpy(local->last_server_hash, md5data, 16);
-        {
-            uint8_t enc_key[16 + 1] = { 0 };
-            size_t b64len = (size_t) std_base64_encode_len((int) local->user_key->len);
-            size_t salt_len = strlen(local->salt);
-            uint8_t *key = (uint8_t *)calloc(b64len + salt_len, sizeof(uint8_t));
-            std_base64_encode(local->user_key->buffer, (int)local->user_key->len, key);
-            strcat((char *)key, local->salt);
-            bytes_to_key_with_size(key, strlen((char *)key), enc_key, 16);
-            ss_aes_128_cbc_decrypt(16, local->recv_buffer->buffer+16, head, enc_key);
-            free(key);
-        }
+        // The previous password's header key in a slot of its own, not to evict the current one's.
+        auth_chain_head_crypt((struct auth_chain_global_data *)server->g_data,
+            (user != NULL) ? uid + (previous ? AUTH_CHAIN_HEAD_KEYS / 2 : 0) : 0,
+            local->salt, local->user_key, false, local->recv_buffer->buffer + 16, head);
         local->client_over_head = (uint16_t) (*((uint16_t *)(head + 12))); // TODO: ntohs
+        local->adaptive_padding = server->adaptive_padding && (head[14] & AUTH_CHAIN_HEAD_ADAPTIVE_PADDING);
 
         utc_time = (uint32_t) (*((uint32_t *)(head + 0))); // TODO: ntohl
         client_id = (uint32_t) (*((uint32_t *)(head + 4))); // TODO: ntohl
@@ -958,17 +1178,28 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
             // logging.info('%s: wrong timestamp, time_dif %d, data %s' % (self.no_compatible_method, time_dif, binascii.hexlify(head)))
             return out_buf;
         }
+        if (!ssr_replay_table_check_add(server->replay_windows, uid, client_id, connection_id)) {
+            // logging.info('%s: replay attack, client_id %08x connection_id %d' % (self.no_compatible_method, client_id, connection_id))
+            return out_buf;
+        }
+        if (user != NULL) {
+            if (!ssr_user_table_acquire(server->users, user)) {
+                // logging.info('%s: uid %d over its connection limit or rate' % (self.no_compatible_method, uid))
+                return out_buf;
+            }
+            local->user = user;
+        }
 
         local->client_id = client_id;
         local->connection_id = connection_id;
         {
             size_t b64len1 = (size_t) std_base64_encode_len((int) local->user_key->len);
             size_t b64len2 = (size_t) std_base64_encode_len((int) sizeof(local->last_client_hash));
-            password = (uint8_t *)calloc(b64len1 + b64len2, sizeof(uint8_t));
+            password = (uint8_t *)ssr_calloc(ssr_alloc_obfs, b64len1 + b64len2, sizeof(uint8_t));
             b64len1 = std_base64_encode(local->user_key->buffer, (int)local->user_key->len, password);
             b64len2 = std_base64_encode(local->last_client_hash, (int)sizeof(local->last_client_hash), password + b64len1);
         }
-        buffer_shorten(local->recv_buffer, 36, local->recv_buffer->len - 36);
+        buffer_consume(local->recv_buffer, 36);
         local->has_recv_header = true;
         if (need_feedback) { *need_feedback = true; }
 
@@ -976,12 +1207,12 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         local->cipher = cipher_env_new_instance((char *)password, "rc4");
         local->encrypt_ctx = enc_ctx_new_instance(local->cipher, true);
         local->decrypt_ctx = enc_ctx_new_instance(local->cipher, false);
-        free(password);
+        ssr_free(ssr_alloc_obfs, password);
     }
 
     mac_key2 = buffer_create(SSR_BUFF_SIZE);
 
-    while (local->recv_buffer->len) {
+    while (local->recv_buffer->len > 4) {
         uint16_t data_len = 0;
         size_t rand_len = 0;
         size_t length = 0;
@@ -1010,7 +1241,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         }
         {
             BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer, length + 2);
-            ss_md5_hmac_with_key(client_hash, _msg, mac_key2);
+            ss_hmac_ctx_compute(local->hmac, client_hash, _msg, mac_key2);
         }
         if (memcmp(client_hash, local->recv_buffer->buffer+length+2, 2) != 0) {
             // logging.info('%s: checksum error, data %s' % (self.no_compatible_method, binascii.hexlify(self.recv_buf[:length])))
@@ -1031,22 +1262,21 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
             pos = 2;
         }
 
-        {
-            size_t out_len = 0;
-            char *buffer = (char *)calloc(local->recv_buffer->len, sizeof(char));
-            ss_decrypt_buffer(local->cipher, local->decrypt_ctx,
-                (char*)local->recv_buffer->buffer + pos, (size_t)data_len, 
-                (char *)buffer, &out_len);
-            buffer_concatenate(out_buf, (uint8_t *)buffer, out_len);
-            free(buffer);
+        buffer_realloc(out_buf, out_buf->len + data_len);
+        if (!auth_chain_decrypt_frame(local, out_buf->buffer + out_buf->len, local->recv_buffer->buffer + pos, data_len)) {
+            buffer_reset(local->recv_buffer);
+            buffer_release(out_buf); out_buf = NULL;
+            break;
         }
+        out_buf->len += data_len;
         memcpy(local->last_client_hash, client_hash, 16);
-        buffer_shorten(local->recv_buffer, length + 4, local->recv_buffer->len - (length + 4));
+        buffer_consume(local->recv_buffer, length + 4);
 
         if (data_len == 0) {
             if (need_feedback) { *need_feedback = true; }
         }
     }
+    buffer_drop_head(local->recv_buffer);
     buffer_release(mac_key2);
     return out_buf;
 }
@@ -1055,6 +1285,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
 //============================= auth_chain_b ==================================
 
 unsigned int auth_chain_b_get_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
+unsigned int auth_chain_b_get_bulk_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
 void auth_chain_b_set_server_info(struct obfs_t *obfs, struct server_info_t *server);
 void auth_chain_b_dispose(struct obfs_t *obfs);
 
@@ -1064,7 +1295,8 @@ struct obfs_t * auth_chain_b_new_obfs(void) {
 
     auth_chain_a->salt = "auth_chain_b";
     auth_chain_a->get_tcp_rand_len = auth_chain_b_get_rand_len;
-    auth_chain_a->subclass_context = calloc(1, sizeof(struct auth_chain_b_context));
+    auth_chain_a->get_tcp_bulk_rand_len = auth_chain_b_get_bulk_rand_len;
+    auth_chain_a->subclass_context = ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct auth_chain_b_context));
 
     obfs->set_server_info = auth_chain_b_set_server_info;
     obfs->dispose = auth_chain_b_dispose;
@@ -1078,16 +1310,18 @@ void auth_chain_b_dispose(struct obfs_t *obfs) {
     auth_chain_a->subclass_context = NULL;
     if (auth_chain_b != NULL) {
         if (auth_chain_b->data_size_list != NULL) {
-            free(auth_chain_b->data_size_list);
+            ssr_free(ssr_alloc_obfs, auth_chain_b->data_size_list);
             auth_chain_b->data_size_list = NULL;
             auth_chain_b->data_size_list_length = 0;
         }
         if (auth_chain_b->data_size_list2 != NULL) {
-            free(auth_chain_b->data_size_list2);
+            ssr_free(ssr_alloc_obfs, auth_chain_b->data_size_list2);
             auth_chain_b->data_size_list2 = NULL;
             auth_chain_b->data_size_list2_length = 0;
         }
-        free(auth_chain_b);
+        data_size_lookup_release(&auth_chain_b->lookup);
+        data_size_lookup_release(&auth_chain_b->lookup2);
+        ssr_free(ssr_alloc_obfs, auth_chain_b);
     }
     auth_chain_a_dispose(obfs);
 }
@@ -1098,11 +1332,11 @@ void auth_chain_b_init_data_size(struct obfs_t *obfs) {
     struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
     struct auth_chain_b_context *auth_chain_b = (struct auth_chain_b_context *)auth_chain_a->subclass_context;
 
-    struct shift128plus_ctx *random = (struct shift128plus_ctx *) calloc(1, sizeof(struct shift128plus_ctx));
+    struct shift128plus_ctx *random = (struct shift128plus_ctx *) ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct shift128plus_ctx));
 
     shift128plus_init_from_bin(random, server->key, 16);
     auth_chain_b->data_size_list_length = shift128plus_next(random) % 8 + 4;
-    auth_chain_b->data_size_list = (int *)calloc(auth_chain_b->data_size_list_length, sizeof(auth_chain_b->data_size_list[0]));
+    auth_chain_b->data_size_list = (int *)ssr_calloc(ssr_alloc_obfs, auth_chain_b->data_size_list_length, sizeof(auth_chain_b->data_size_list[0]));
     for (i = 0; i < auth_chain_b->data_size_list_length; i++) {
         auth_chain_b->data_size_list[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
     }
@@ -1114,7 +1348,7 @@ void auth_chain_b_init_data_size(struct obfs_t *obfs) {
         );
 
     auth_chain_b->data_size_list2_length = shift128plus_next(random) % 16 + 8;
-    auth_chain_b->data_size_list2 = (int *)calloc(auth_chain_b->data_size_list2_length, sizeof(auth_chain_b->data_size_list2[0]));
+    auth_chain_b->data_size_list2 = (int *)ssr_calloc(ssr_alloc_obfs, auth_chain_b->data_size_list2_length, sizeof(auth_chain_b->data_size_list2[0]));
     for (i = 0; i < auth_chain_b->data_size_list2_length; i++) {
         auth_chain_b->data_size_list2[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
     }
@@ -1124,8 +1358,10 @@ void auth_chain_b_init_data_size(struct obfs_t *obfs) {
         sizeof(auth_chain_b->data_size_list2[0]),
         data_size_list_compare
         );
+    auth_chain_b->lookup.dirty = true;
+    auth_chain_b->lookup2.dirty = true;
 
-    free(random);
+    ssr_free(ssr_alloc_obfs, random);
 }
 
 void auth_chain_b_set_server_info(struct obfs_t *obfs, struct server_info_t *server) {
@@ -1148,13 +1384,13 @@ unsigned int auth_chain_b_get_rand_len(struct auth_chain_a_context *local, int d
 
     shift128plus_init_from_bin_datalen(random, last_hash, 16, datalength);
 
-    pos = auth_chain_find_pos(auth_chain_b->data_size_list, auth_chain_b->data_size_list_length, datalength + overhead);
+    pos = data_size_lookup_pos(&auth_chain_b->lookup, auth_chain_b->data_size_list, auth_chain_b->data_size_list_length, datalength + overhead);
     final_pos = pos + shift128plus_next(random) % auth_chain_b->data_size_list_length;
     if (final_pos < auth_chain_b->data_size_list_length) {
         return auth_chain_b->data_size_list[final_pos] - datalength - overhead;
     }
 
-    pos2 = auth_chain_find_pos(auth_chain_b->data_size_list2, auth_chain_b->data_size_list2_length, datalength + overhead);
+    pos2 = data_size_lookup_pos(&auth_chain_b->lookup2, auth_chain_b->data_size_list2, auth_chain_b->data_size_list2_length, datalength + overhead);
     final_pos2 = pos2 + shift128plus_next(random) % auth_chain_b->data_size_list2_length;
     if (final_pos2 < auth_chain_b->data_size_list2_length) {
         return auth_chain_b->data_size_list2[final_pos2] - datalength - overhead;
@@ -1175,10 +1411,25 @@ unsigned int auth_chain_b_get_rand_len(struct auth_chain_a_context *local, int d
     return shift128plus_next(random) % 1021;
 }
 
+// The smallest size in data_size_list that holds the frame, none beyond it.
+unsigned int auth_chain_b_get_bulk_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]) {
+    uint16_t overhead = local->obfs->server.overhead;
+    struct auth_chain_b_context *auth_chain_b = (struct auth_chain_b_context *)local->subclass_context;
+    size_t pos;
+
+    shift128plus_init_from_bin_datalen(random, last_hash, 16, datalength);
+    pos = data_size_lookup_pos(&auth_chain_b->lookup, auth_chain_b->data_size_list, auth_chain_b->data_size_list_length, datalength + overhead);
+    if (pos < auth_chain_b->data_size_list_length) {
+        return auth_chain_b->data_size_list[pos] - datalength - overhead;
+    }
+    return 0;
+}
+
 
 //============================= auth_chain_c ==================================
 
 unsigned int auth_chain_c_get_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
+unsigned int auth_chain_e_get_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
 void auth_chain_c_set_server_info(struct obfs_t *obfs, struct server_info_t *server);
 void auth_chain_c_dispose(struct obfs_t *obfs);
 
@@ -1188,7 +1439,9 @@ struct obfs_t * auth_chain_c_new_obfs(void) {
 
     auth_chain_a->salt = "auth_chain_c";
     auth_chain_a->get_tcp_rand_len = auth_chain_c_get_rand_len;
-    auth_chain_a->subclass_context = calloc(1, sizeof(struct auth_chain_c_context));
+    // auth_chain_e pads every frame the least its data_size_list0 allows.
+    auth_chain_a->get_tcp_bulk_rand_len = auth_chain_e_get_rand_len;
+    auth_chain_a->subclass_context = ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct auth_chain_c_context));
 
     obfs->set_server_info = auth_chain_c_set_server_info;
     obfs->dispose = auth_chain_c_dispose;
@@ -1202,11 +1455,12 @@ void auth_chain_c_dispose(struct obfs_t *obfs) {
     auth_chain_a->subclass_context = NULL;
     if (auth_chain_c != NULL) {
         if (auth_chain_c->data_size_list0 != NULL) {
-            free(auth_chain_c->data_size_list0);
+            ssr_free(ssr_alloc_obfs, auth_chain_c->data_size_list0);
             auth_chain_c->data_size_list0 = NULL;
             auth_chain_c->data_size_list0_length = 0;
         }
-        free(auth_chain_c);
+        data_size_lookup_release(&auth_chain_c->lookup0);
+        ssr_free(ssr_alloc_obfs, auth_chain_c);
     }
     auth_chain_a_dispose(obfs);
 }
@@ -1218,11 +1472,11 @@ void auth_chain_c_init_data_size(struct obfs_t *obfs) {
     struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
     struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
 
-    struct shift128plus_ctx *random = (struct shift128plus_ctx *) calloc(1, sizeof(struct shift128plus_ctx));
+    struct shift128plus_ctx *random = (struct shift128plus_ctx *) ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct shift128plus_ctx));
 
     shift128plus_init_from_bin(random, server->key, 16);
     auth_chain_c->data_size_list0_length = shift128plus_next(random) % (8 + 16) + (4 + 8);
-    auth_chain_c->data_size_list0 = (int *)malloc(auth_chain_c->data_size_list0_length * sizeof(int));
+    auth_chain_c->data_size_list0 = (int *)ssr_malloc(ssr_alloc_obfs, auth_chain_c->data_size_list0_length * sizeof(int));
     for (i = 0; i < auth_chain_c->data_size_list0_length; i++) {
         auth_chain_c->data_size_list0[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
     }
@@ -1232,8 +1486,9 @@ void auth_chain_c_init_data_size(struct obfs_t *obfs) {
         sizeof(int),
         data_size_list_compare
         );
+    auth_chain_c->lookup0.dirty = true;
 
-    free(random);
+    ssr_free(ssr_alloc_obfs, random);
 }
 
 void auth_chain_c_set_server_info(struct obfs_t *obfs, struct server_info_t *server) {
@@ -1264,7 +1519,7 @@ unsigned int auth_chain_c_get_rand_len(struct auth_chain_a_context *local, int d
         return shift128plus_next(random) % 1021;
     }
 
-    pos = auth_chain_find_pos(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
+    pos = data_size_lookup_pos(&auth_chain_c->lookup0, auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
     // random select a size in the leftover data_size_list0
     final_pos = pos + shift128plus_next(random) % (auth_chain_c->data_size_list0_length - pos);
     return auth_chain_c->data_size_list0[final_pos] - other_data_size;
@@ -1310,11 +1565,11 @@ void auth_chain_d_init_data_size(struct obfs_t *obfs) {
     struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
     struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
 
-    struct shift128plus_ctx *random = (struct shift128plus_ctx *)calloc(1, sizeof(struct shift128plus_ctx));
+    struct shift128plus_ctx *random = (struct shift128plus_ctx *)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct shift128plus_ctx));
 
     shift128plus_init_from_bin(random, server->key, 16);
     auth_chain_c->data_size_list0_length = shift128plus_next(random) % (8 + 16) + (4 + 8);
-    auth_chain_c->data_size_list0 = (int *)malloc(AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE * sizeof(int));
+    auth_chain_c->data_size_list0 = (int *)ssr_malloc(ssr_alloc_obfs, AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE * sizeof(int));
     for (i = 0; i < auth_chain_c->data_size_list0_length; i++) {
         auth_chain_c->data_size_list0[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
     }
@@ -1330,8 +1585,9 @@ void auth_chain_d_init_data_size(struct obfs_t *obfs) {
         qsort(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length,
             sizeof(auth_chain_c->data_size_list0[0]), data_size_list_compare);
     }
+    auth_chain_c->lookup0.dirty = true;
 
-    free(random);
+    ssr_free(ssr_alloc_obfs, random);
 }
 
 void auth_chain_d_set_server_info(struct obfs_t *obfs, struct server_info_t *server) {
@@ -1355,7 +1611,7 @@ unsigned int auth_chain_d_get_rand_len(struct auth_chain_a_context *local, int d
     }
 
     shift128plus_init_from_bin_datalen(random, last_hash, 16, datalength);
-    pos = auth_chain_find_pos(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
+    pos = data_size_lookup_pos(&auth_chain_c->lookup0, auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
     // random select a size in the leftover data_size_list0
     final_pos = pos + shift128plus_next(random) % (auth_chain_c->data_size_list0_length - pos);
     return auth_chain_c->data_size_list0[final_pos] - other_data_size;
@@ -1398,7 +1654,7 @@ unsigned int auth_chain_e_get_rand_len(struct auth_chain_a_context *local, int d
     }
 
     // use the mini size in the data_size_list0
-    pos = auth_chain_find_pos(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
+    pos = data_size_lookup_pos(&auth_chain_c->lookup0, auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
     return auth_chain_c->data_size_list0[pos] - other_data_size;
 }
 
@@ -1423,8 +1679,8 @@ static void auth_chain_f_init_data_size(struct obfs_t *obfs, const uint8_t *key_
     struct server_info_t *server = &obfs->server;
     struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
     struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
-    struct shift128plus_ctx *random = (struct shift128plus_ctx *)malloc(sizeof(struct shift128plus_ctx));
-    uint8_t *newKey = (uint8_t *)malloc(sizeof(uint8_t) * server->key_len);
+    struct shift128plus_ctx *random = (struct shift128plus_ctx *)ssr_malloc(ssr_alloc_obfs, sizeof(struct shift128plus_ctx));
+    uint8_t *newKey = (uint8_t *)ssr_malloc(ssr_alloc_obfs, sizeof(uint8_t) * server->key_len);
     size_t len;
     size_t old_len;
 
@@ -1433,12 +1689,12 @@ static void auth_chain_f_init_data_size(struct obfs_t *obfs, const uint8_t *key_
         newKey[i] ^= key_change_datetime_key_bytes[i];
     }
     shift128plus_init_from_bin(random, newKey, server->key_len);
-    free(newKey);
+    ssr_free(ssr_alloc_obfs, newKey);
     newKey = NULL;
 
     auth_chain_c->data_size_list0_length = shift128plus_next(random) % (8 + 16) + (4 + 8);
     len = max(AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE, auth_chain_c->data_size_list0_length);
-    auth_chain_c->data_size_list0 = (int *) calloc(len, sizeof(auth_chain_c->data_size_list0[0]));
+    auth_chain_c->data_size_list0 = (int *) ssr_calloc(ssr_alloc_obfs, len, sizeof(auth_chain_c->data_size_list0[0]));
     for (i = 0; i < auth_chain_c->data_size_list0_length; i++) {
         auth_chain_c->data_size_list0[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
     }
@@ -1460,8 +1716,9 @@ static void auth_chain_f_init_data_size(struct obfs_t *obfs, const uint8_t *key_
             data_size_list_compare
             );
     }
+    auth_chain_c->lookup0.dirty = true;
 
-    free(random);
+    ssr_free(ssr_alloc_obfs, random);
 }
 
 void auth_chain_f_set_server_info(struct obfs_t *obfs, struct server_info_t *server) {
@@ -1492,7 +1749,7 @@ void auth_chain_f_set_server_info(struct obfs_t *obfs, struct server_info_t *ser
         }
     }
 
-    key_change_datetime_key_bytes = (uint8_t *)malloc(sizeof(uint8_t) * 8);
+    key_change_datetime_key_bytes = (uint8_t *)ssr_malloc(ssr_alloc_obfs, sizeof(uint8_t) * 8);
     key_change_datetime_key = (uint64_t)(time(NULL)) / key_change_interval;
     for (i = 7; i >= 0; --i) {
         key_change_datetime_key_bytes[7 - i] = (uint8_t)((key_change_datetime_key >> (8 * i)) & 0xFF);
@@ -1500,6 +1757,6 @@ void auth_chain_f_set_server_info(struct obfs_t *obfs, struct server_info_t *ser
 
     auth_chain_f_init_data_size(obfs, key_change_datetime_key_bytes);
 
-    free(key_change_datetime_key_bytes);
+    ssr_free(ssr_alloc_obfs, key_change_datetime_key_bytes);
     key_change_datetime_key_bytes = NULL;
 }
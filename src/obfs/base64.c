@@ -82,6 +82,8 @@
 /* Base64 encoder/decoder. Originally Apache file ap_base64.c
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -110,6 +112,283 @@ static const unsigned char pr2six[256] =
     64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64
 };
 
+/* pr2six with '-' and '_' as well, and marks for padding and whitespace. */
+#define ANY_SIX_SPACE 0xFE
+#define ANY_SIX_PAD   0xFD
+#define XX 0xFF
+#define SP ANY_SIX_SPACE
+#define PD ANY_SIX_PAD
+static const unsigned char any_six[256] =
+{
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, SP, SP, XX, XX, SP, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    SP, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, 62, XX, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, PD, XX, XX,
+    XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, 63,
+    XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX
+};
+#undef XX
+#undef SP
+#undef PD
+
+static const unsigned char basis_64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const unsigned char basis_url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+//
+// Vector kernels. Each handles whole blocks from the start of its input
+// and returns how much it took, the scalar loops finish the rest. Decoding
+// takes either alphabet and stops before a block holding anything else,
+// padding and line breaks included; encoding is told the alphabet.
+//
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BASE64_HAVE_X86 1
+#include <immintrin.h>
+
+/* The six bits of each character of |v|, |valid| lanes are those of either alphabet. */
+__attribute__((target("ssse3")))
+static __m128i base64_six_ssse3(__m128i v, __m128i *valid) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i s62 = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')), _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+    __m128i s63 = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    *valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(s62, s63)));
+    return _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_sub_epi8(v, _mm_set1_epi8('A'))),
+                     _mm_and_si128(lower, _mm_sub_epi8(v, _mm_set1_epi8('a' - 26)))),
+        _mm_or_si128(_mm_and_si128(digit, _mm_add_epi8(v, _mm_set1_epi8(52 - '0'))),
+                     _mm_or_si128(_mm_and_si128(s62, _mm_set1_epi8(62)), _mm_and_si128(s63, _mm_set1_epi8(63)))));
+}
+
+__attribute__((target("avx2")))
+static __m256i base64_six_avx2(__m256i v, __m256i *valid) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i s62 = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')));
+    __m256i s63 = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    *valid = _mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, _mm256_or_si256(s62, s63)));
+    return _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(upper, _mm256_sub_epi8(v, _mm256_set1_epi8('A'))),
+                        _mm256_and_si256(lower, _mm256_sub_epi8(v, _mm256_set1_epi8('a' - 26)))),
+        _mm256_or_si256(_mm256_and_si256(digit, _mm256_add_epi8(v, _mm256_set1_epi8(52 - '0'))),
+                        _mm256_or_si256(_mm256_and_si256(s62, _mm256_set1_epi8(62)), _mm256_and_si256(s63, _mm256_set1_epi8(63)))));
+}
+
+/*
+ * 16 characters at a time, packed as Wojciech Mula's decoder does: two
+ * multiply-adds join the four sextets of each lane, a shuffle drops the
+ * empty byte.
+ */
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(const unsigned char *src, size_t len, unsigned char *dst) {
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t done = 0;
+
+    for (; done + 16 <= len; done += 16, dst += 12) {
+        __m128i valid;
+        __m128i six = base64_six_ssse3(_mm_loadu_si128((const __m128i *)(src + done)), &valid);
+        uint32_t tail;
+        if (_mm_movemask_epi8(valid) != 0xFFFF) {
+            break;
+        }
+        six = _mm_maddubs_epi16(six, _mm_set1_epi32(0x01400140));
+        six = _mm_madd_epi16(six, _mm_set1_epi32(0x00011000));
+        six = _mm_shuffle_epi8(six, pack);
+        _mm_storel_epi64((__m128i *)dst, six);
+        tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(six, 8));
+        memcpy(dst + 8, &tail, sizeof(tail));
+    }
+    return done;
+}
+
+/* The same on both lanes, whose 12 bytes a cross lane permute then joins. */
+__attribute__((target("avx2")))
+static size_t base64_decode_avx2(const unsigned char *src, size_t len, unsigned char *dst) {
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t done = 0;
+
+    for (; done + 32 <= len; done += 32, dst += 24) {
+        __m256i valid;
+        __m256i six = base64_six_avx2(_mm256_loadu_si256((const __m256i *)(src + done)), &valid);
+        if (_mm256_movemask_epi8(valid) != -1) {
+            break;
+        }
+        six = _mm256_maddubs_epi16(six, _mm256_set1_epi32(0x01400140));
+        six = _mm256_madd_epi16(six, _mm256_set1_epi32(0x00011000));
+        six = _mm256_shuffle_epi8(six, pack);
+        six = _mm256_permutevar8x32_epi32(six, join);
+        _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(six));
+        _mm_storel_epi64((__m128i *)(dst + 16), _mm256_extracti128_si256(six, 1));
+    }
+    return done;
+}
+
+/*
+ * Mula's encoder, 12 bytes at a time: a shuffle spreads each 3 bytes over
+ * a 32-bit lane, two multiplies bring the four sextets to the bottom of
+ * their bytes, and a 16 entry table adds the offset of each sextet's
+ * character range. Reads 16 bytes.
+ */
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(const unsigned char *src, size_t len, unsigned char *dst, const unsigned char *basis) {
+    const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, (char)(basis[62] - 62), (char)(basis[63] - 63), 'A', 0, 0);
+    size_t done = 0;
+
+    for (; done + 16 <= len; done += 12, dst += 16) {
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + done)), spread);
+        __m128i six = _mm_or_si128(
+            _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040)),
+            _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010)));
+        __m128i range = _mm_subs_epu8(six, _mm_set1_epi8(51));
+        range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), six), _mm_set1_epi8(13)));
+        _mm_storeu_si128((__m128i *)dst, _mm_add_epi8(six, _mm_shuffle_epi8(offsets, range)));
+    }
+    return done;
+}
+
+/* 24 bytes at a time, the upper lane loads from 12 bytes on. Reads 28 bytes. */
+__attribute__((target("avx2")))
+static size_t base64_encode_avx2(const unsigned char *src, size_t len, unsigned char *dst, const unsigned char *basis) {
+    const __m256i spread = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_broadcastsi128_si256(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, (char)(basis[62] - 62),
+        (char)(basis[63] - 63), 'A', 0, 0));
+    size_t done = 0;
+
+    for (; done + 28 <= len; done += 24, dst += 32) {
+        __m256i in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + done))),
+            _mm_loadu_si128((const __m128i *)(src + done + 12)), 1);
+        __m256i six, range;
+        in = _mm256_shuffle_epi8(in, spread);
+        six = _mm256_or_si256(
+            _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040)),
+            _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010)));
+        range = _mm256_subs_epu8(six, _mm256_set1_epi8(51));
+        range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), six), _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i *)dst, _mm256_add_epi8(six, _mm256_shuffle_epi8(offsets, range)));
+    }
+    return done;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define BASE64_HAVE_NEON 1
+#include <arm_neon.h>
+
+static uint8x16_t base64_six_neon(uint8x16_t v, uint8x16_t *valid) {
+    uint8x16_t upper = vandq_u8(vcgeq_u8(v, vdupq_n_u8('A')), vcleq_u8(v, vdupq_n_u8('Z')));
+    uint8x16_t lower = vandq_u8(vcgeq_u8(v, vdupq_n_u8('a')), vcleq_u8(v, vdupq_n_u8('z')));
+    uint8x16_t digit = vandq_u8(vcgeq_u8(v, vdupq_n_u8('0')), vcleq_u8(v, vdupq_n_u8('9')));
+    uint8x16_t s62 = vorrq_u8(vceqq_u8(v, vdupq_n_u8('+')), vceqq_u8(v, vdupq_n_u8('-')));
+    uint8x16_t s63 = vorrq_u8(vceqq_u8(v, vdupq_n_u8('/')), vceqq_u8(v, vdupq_n_u8('_')));
+    *valid = vandq_u8(*valid, vorrq_u8(vorrq_u8(upper, lower), vorrq_u8(digit, vorrq_u8(s62, s63))));
+    return vorrq_u8(
+        vorrq_u8(vandq_u8(upper, vsubq_u8(v, vdupq_n_u8('A'))), vandq_u8(lower, vsubq_u8(v, vdupq_n_u8('a' - 26)))),
+        vorrq_u8(vandq_u8(digit, vaddq_u8(v, vdupq_n_u8(52 - '0'))),
+                 vorrq_u8(vandq_u8(s62, vdupq_n_u8(62)), vandq_u8(s63, vdupq_n_u8(63)))));
+}
+
+/* LD4 splits 64 characters by their place in the quad, ST3 interleaves the 48 bytes back. */
+static size_t base64_decode_neon(const unsigned char *src, size_t len, unsigned char *dst) {
+    size_t done = 0;
+
+    for (; done + 64 <= len; done += 64, dst += 48) {
+        uint8x16x4_t in = vld4q_u8(src + done);
+        uint8x16_t valid = vdupq_n_u8(0xFF);
+        uint8x16_t a = base64_six_neon(in.val[0], &valid);
+        uint8x16_t b = base64_six_neon(in.val[1], &valid);
+        uint8x16_t c = base64_six_neon(in.val[2], &valid);
+        uint8x16_t d = base64_six_neon(in.val[3], &valid);
+        uint8x16x3_t out;
+        if (vminvq_u8(valid) != 0xFF) {
+            break;
+        }
+        out.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+        out.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+        out.val[2] = vorrq_u8(vshlq_n_u8(c, 6), d);
+        vst3q_u8(dst, out);
+    }
+    return done;
+}
+
+/* LD3 then the sextets, TBL looks the 64 characters up, ST4 interleaves them. */
+static size_t base64_encode_neon(const unsigned char *src, size_t len, unsigned char *dst, const unsigned char *basis) {
+    const uint8x16x4_t table = vld1q_u8_x4(basis);
+    const uint8x16_t mask = vdupq_n_u8(0x3F);
+    size_t done = 0;
+
+    for (; done + 48 <= len; done += 48, dst += 64) {
+        uint8x16x3_t in = vld3q_u8(src + done);
+        uint8x16x4_t out;
+        out.val[0] = vshrq_n_u8(in.val[0], 2);
+        out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask);
+        out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask);
+        out.val[3] = vandq_u8(in.val[2], mask);
+        out.val[0] = vqtbl4q_u8(table, out.val[0]);
+        out.val[1] = vqtbl4q_u8(table, out.val[1]);
+        out.val[2] = vqtbl4q_u8(table, out.val[2]);
+        out.val[3] = vqtbl4q_u8(table, out.val[3]);
+        vst4q_u8(dst, out);
+    }
+    return done;
+}
+#endif
+
+/* Whole blocks of |len| characters, a multiple of 4 of them decoded. */
+static size_t base64_decode_blocks(const unsigned char *src, size_t len, unsigned char *dst) {
+#if defined(BASE64_HAVE_X86)
+    if (__builtin_cpu_supports("avx2")) {
+        size_t done = base64_decode_avx2(src, len, dst);
+        return done + base64_decode_ssse3(src + done, len - done, dst + done / 4 * 3);
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return base64_decode_ssse3(src, len, dst);
+    }
+#elif defined(BASE64_HAVE_NEON)
+    return base64_decode_neon(src, len, dst);
+#endif
+    (void)src; (void)len; (void)dst;
+    return 0;
+}
+
+/* Whole blocks of |len| bytes, a multiple of 3 of them encoded. */
+static size_t base64_encode_blocks(const unsigned char *src, size_t len, unsigned char *dst, const unsigned char *basis) {
+#if defined(BASE64_HAVE_X86)
+    if (__builtin_cpu_supports("avx2")) {
+        size_t done = base64_encode_avx2(src, len, dst, basis);
+        return done + base64_encode_ssse3(src + done, len - done, dst + done / 3 * 4, basis);
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return base64_encode_ssse3(src, len, dst, basis);
+    }
+#elif defined(BASE64_HAVE_NEON)
+    return base64_encode_neon(src, len, dst, basis);
+#endif
+    (void)src; (void)len; (void)dst; (void)basis;
+    return 0;
+}
+
 int std_base64_decode_len(const unsigned char *bufcoded)
 {
     int nbytesdecoded;
@@ -140,6 +419,13 @@ int std_base64_decode(const unsigned char *bufcoded, unsigned char *bufplain)
     bufout = (unsigned char *) bufplain;
     bufin = (const unsigned char *) bufcoded;
 
+    if (nprbytes > 4) {
+        /* At least one character is left to the tail below, as the loop does. */
+        size_t done = base64_decode_blocks(bufin, (size_t)nprbytes - 1, bufout);
+        bufin += done;
+        bufout += done / 4 * 3;
+        nprbytes -= (int)done;
+    }
     while (nprbytes > 4) {
         *(bufout++) = (unsigned char) (pr2six[*bufin] << 2 | pr2six[bufin[1]] >> 4);
         *(bufout++) = (unsigned char) (pr2six[bufin[1]] << 4 | pr2six[bufin[2]] >> 2);
@@ -164,119 +450,127 @@ int std_base64_decode(const unsigned char *bufcoded, unsigned char *bufplain)
     return nbytesdecoded;
 }
 
-static const unsigned char basis_64[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
 int std_base64_encode_len(volatile int len)
 {
     return (((len + 2) / 3) * 4) + 1;
 }
 
-int std_base64_encode(const unsigned char *string, int len, unsigned char *encoded)
+static int base64_encode_basis(const unsigned char *string, int len, unsigned char *encoded,
+    const unsigned char *basis, bool padding)
 {
     int i;
     unsigned char *p;
 
-    p = encoded;
-    for (i = 0; i < len - 2; i += 3) {
-        *p++ = basis_64[(string[i] >> 2) & 0x3F];
-        *p++ = basis_64[((string[i] & 0x3) << 4) | ((int) (string[i + 1] & 0xF0) >> 4)];
-        *p++ = basis_64[((string[i + 1] & 0xF) << 2) | ((int) (string[i + 2] & 0xC0) >> 6)];
-        *p++ = basis_64[string[i + 2] & 0x3F];
+    i = (len > 0) ? (int)base64_encode_blocks(string, (size_t)len, encoded, basis) : 0;
+    p = encoded + i / 3 * 4;
+    for (; i < len - 2; i += 3) {
+        *p++ = basis[(string[i] >> 2) & 0x3F];
+        *p++ = basis[((string[i] & 0x3) << 4) | ((int) (string[i + 1] & 0xF0) >> 4)];
+        *p++ = basis[((string[i + 1] & 0xF) << 2) | ((int) (string[i + 2] & 0xC0) >> 6)];
+        *p++ = basis[string[i + 2] & 0x3F];
     }
     if (i < len) {
-        *p++ = basis_64[(string[i] >> 2) & 0x3F];
+        *p++ = basis[(string[i] >> 2) & 0x3F];
         if (i == (len - 1)) {
-            *p++ = basis_64[((string[i] & 0x3) << 4)];
-            *p++ = '=';
+            *p++ = basis[((string[i] & 0x3) << 4)];
+            if (padding) {
+                *p++ = '=';
+            }
         }
         else {
-            *p++ = basis_64[((string[i] & 0x3) << 4) | ((int) (string[i + 1] & 0xF0) >> 4)];
-            *p++ = basis_64[((string[i + 1] & 0xF) << 2)];
+            *p++ = basis[((string[i] & 0x3) << 4) | ((int) (string[i + 1] & 0xF0) >> 4)];
+            *p++ = basis[((string[i + 1] & 0xF) << 2)];
+        }
+        if (padding) {
+            *p++ = '=';
         }
-        *p++ = '=';
     }
 
     *p = '\0'; // *p++ = '\0';
     return (int)(p - encoded);
 }
 
+int std_base64_encode(const unsigned char *string, int len, unsigned char *encoded)
+{
+    return base64_encode_basis(string, len, encoded, basis_64, true);
+}
+
 //
 // https://en.wikipedia.org/wiki/Base64#URL_applications
 //
 
-static void str_replace_char(unsigned char *str, unsigned char old_char, unsigned char new_char);
-static void str_url_safe_base64_to_std_base64(unsigned char *coded_src);
+/* Characters up to the first one outside both alphabets. */
+static size_t any_base64_prefix(const unsigned char *coded_src) {
+    const unsigned char *p = coded_src;
+    while (any_six[*p] < 64) {
+        ++p;
+    }
+    return (size_t)(p - coded_src);
+}
 
 int url_safe_base64_encode_len(int len) {
     return std_base64_encode_len(len);
 }
 
 int url_safe_base64_encode(const unsigned char *plain_src, int len_plain_src, unsigned char *coded_dst) {
-    std_base64_encode(plain_src, len_plain_src, coded_dst);
-    str_replace_char(coded_dst, '+', '-');
-    str_replace_char(coded_dst, '/', '_');
-    str_replace_char(coded_dst, '=', 0);
-    return (int) strlen((const char *)coded_dst);
+    return base64_encode_basis(plain_src, len_plain_src, coded_dst, basis_url, false);
 }
 
 int url_safe_base64_decode_len(const unsigned char *coded_src) {
-    int result;
-    size_t len = strlen((const char *)coded_src);
-    unsigned char *new_buf = (unsigned char *) calloc(len + 4, sizeof(new_buf[0]));
-    memcpy(new_buf, coded_src, len);
-    
-    str_url_safe_base64_to_std_base64(new_buf);
-    result = std_base64_decode_len(new_buf);
-    free(new_buf);
-    return result;
+    size_t nprbytes = any_base64_prefix(coded_src);
+    return (int)(((nprbytes + 3) / 4) * 3) + 1;
 }
 
 int url_safe_base64_decode(const unsigned char *coded_src, unsigned char *plain_dst) {
+    size_t nprbytes = any_base64_prefix(coded_src);
     int result;
-    size_t len = strlen((const char *)coded_src);
-    unsigned char *new_buf = (unsigned char *) calloc(len + 4, sizeof(new_buf[0]));
-    memcpy(new_buf, coded_src, len);
-    
-    str_url_safe_base64_to_std_base64(new_buf);
-    result = std_base64_decode(new_buf, plain_dst);
-    free(new_buf);
+    assert(nprbytes % 4 != 1);
+    result = any_base64_decode(coded_src, (int)nprbytes, plain_dst);
+    plain_dst[result] = '\0';
     return result;
 }
 
-static void str_replace_char(unsigned char *str, unsigned char old_char, unsigned char new_char) {
-    for (;; str++) {
-        if (!*str) {
-            break;
-        }
-        if (*str == old_char) {
-            *str = new_char;
-        }
-    }
-}
-
-static void str_url_safe_base64_to_std_base64(unsigned char *coded_src) {
-    size_t len;
-
-    str_replace_char(coded_src, '-', '+');
-    str_replace_char(coded_src, '_', '/');
+//
+// Both alphabets at once, for subscriptions: no copy, no strlen, and the
+// bulk of the text in vector blocks where the CPU can.
+//
 
-    len = strlen((const char *)coded_src);
+int any_base64_decode(const unsigned char *coded_src, int len, unsigned char *plain_dst) {
+    size_t i = 0, n = (len > 0) ? (size_t)len : 0, out = 0;
+    uint32_t acc = 0;
+    int quad = 0;
 
-    switch (len % 4) {
-        case 1:
-            assert(0);
-            break;
-        case 2:
-            coded_src[len] = '=';
-            coded_src[len+1] = '=';
-            coded_src[len+2] = 0;
-            break;
-        case 3:
-            coded_src[len] = '=';
-            coded_src[len+1] = 0;
-            break;
-        default:
+    while (i < n) {
+        unsigned char six;
+        if (quad == 0) {
+            size_t done = base64_decode_blocks(coded_src + i, n - i, plain_dst + out);
+            if (done) {
+                i += done;
+                out += done / 4 * 3;
+                continue;
+            }
+        }
+        six = any_six[coded_src[i++]];
+        if (six < 64) {
+            acc = (acc << 6) | six;
+            if (++quad == 4) {
+                plain_dst[out++] = (unsigned char)(acc >> 16);
+                plain_dst[out++] = (unsigned char)(acc >> 8);
+                plain_dst[out++] = (unsigned char)acc;
+                quad = 0;
+                acc = 0;
+            }
+        } else if (six == ANY_SIX_PAD) {
             break;
+        } else if (six != ANY_SIX_SPACE) {
+            return -1;
+        }
+    }
+    if (quad == 2) {
+        plain_dst[out++] = (unsigned char)(acc >> 4);
+    } else if (quad == 3) {
+        plain_dst[out++] = (unsigned char)(acc >> 10);
+        plain_dst[out++] = (unsigned char)(acc >> 2);
     }
+    return (int)out;
 }
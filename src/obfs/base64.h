@@ -99,6 +99,11 @@ int url_safe_base64_encode(const unsigned char *plain_src, int len_plain_src, un
 int url_safe_base64_decode_len(const unsigned char *coded_src);
 int url_safe_base64_decode(const unsigned char *coded_src, unsigned char *plain_dst);
 
+/* Standard or URL safe, padded or not, whitespace skipped; decodes up to
+ * the first '='. |plain_dst| may be |coded_src|. No terminating NUL.
+ * Returns the bytes written, -1 on a character outside base64. */
+int any_base64_decode(const unsigned char *coded_src, int len, unsigned char *plain_dst);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,49 +1,214 @@
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "crc32.h"
+#include "cpu_features.h"
 
-static uint32_t crc32_table[256] = {0};
+/* crc32_table[0] is the classic byte table, the others feed the slicing-by-8 loop. */
+static uint32_t crc32_table[8][256] = { {0} };
 static bool crc32_table_init = false;
 
+typedef uint32_t (*crc32_kernel_fn)(uint32_t crc, const unsigned char *buffer, size_t size);
+
+static uint32_t crc32_bytewise(uint32_t crc, const unsigned char *buffer, size_t size) {
+    while (size--) {
+        crc = crc32_table[0][(crc ^ *buffer++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t crc32_sliced(uint32_t crc, const unsigned char *buffer, size_t size) {
+    while (size >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8)
+            | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24));
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF]
+            ^ crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24]
+            ^ crc32_table[3][buffer[4]] ^ crc32_table[2][buffer[5]]
+            ^ crc32_table[1][buffer[6]] ^ crc32_table[0][buffer[7]];
+        buffer += 8;
+        size -= 8;
+    }
+    return crc32_bytewise(crc, buffer, size);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32_HAVE_PCLMUL 1
+#include <immintrin.h>
+
+/*
+ * Folds 64 bytes at a time with carry-less multiplies, then Barrett
+ * reduces to 32 bits; the constants are those of Intel's "Fast CRC
+ * Computation Using PCLMULQDQ" paper for the reflected 0xEDB88320
+ * polynomial. Takes whole 16-byte blocks, at least four of them.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_blocks(uint32_t crc, const unsigned char *buffer, size_t size) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buffer + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buffer + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buffer + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buffer + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    buffer += 64;
+    size -= 64;
+
+    x0 = k1k2;
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buffer + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buffer + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buffer + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buffer + 0x30)));
+        buffer += 64;
+        size -= 64;
+    }
+
+    /* Fold the four lanes into one. */
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (size >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buffer)), x5);
+        buffer += 16;
+        size -= 16;
+    }
+
+    /* 128 to 64 bits. */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits. */
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buffer, size_t size) {
+    if (size >= 64) {
+        size_t blocks = size & ~(size_t)15;
+        crc = crc32_pclmul_blocks(crc, buffer, blocks);
+        buffer += blocks;
+        size -= blocks;
+    }
+    return crc32_sliced(crc, buffer, size);
+}
+#endif
+
+#if defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32_HAVE_ARMV8 1
+/* The ARMv8 CRC32 instructions use the same reflected 0xEDB88320 polynomial. */
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char *buffer, size_t size) {
+    while (size >= 8) {
+        uint64_t v;
+        memcpy(&v, buffer, sizeof(v));
+        __asm__(".arch_extension crc\n\tcrc32x %w0, %w0, %x1" : "+r"(crc) : "r"(v));
+        buffer += 8;
+        size -= 8;
+    }
+    while (size--) {
+        __asm__(".arch_extension crc\n\tcrc32b %w0, %w0, %w1" : "+r"(crc) : "r"((uint32_t)*buffer++));
+    }
+    return crc;
+}
+#endif
+
+static crc32_kernel_fn crc32_kernel = crc32_sliced;
+static const char *crc32_kernel_text = "slicing-by-8";
+
 void init_crc32_table(void) {
     uint32_t c, i, j;
     if (crc32_table_init) {
         return;
     }
-    if (crc32_table[0] == 0) {
-        for (i = 0; i < 256; i++) {
-            c = i;
-            for (j = 0; j < 8; j++) {
-                if (c & 1) {
-                    c = 0xedb88320L ^ (c >> 1);
-                } else {
-                    c = c >> 1;
-                }
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            if (c & 1) {
+                c = 0xedb88320L ^ (c >> 1);
+            } else {
+                c = c >> 1;
             }
-            crc32_table[i] = c;
+        }
+        crc32_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc32_table[j][i] = crc32_table[0][crc32_table[j - 1][i] & 0xFF] ^ (crc32_table[j - 1][i] >> 8);
+        }
+    }
+#if defined(CRC32_HAVE_PCLMUL)
+    if ((cpu_features() & cpu_feature_pclmul) && (cpu_features() & cpu_feature_sse41)) {
+        crc32_kernel = crc32_pclmul;
+        crc32_kernel_text = "pclmul";
+    }
+#endif
+#if defined(CRC32_HAVE_ARMV8)
+    if (cpu_features() & cpu_feature_crc32) {
+        crc32_kernel = crc32_armv8;
+        crc32_kernel_text = "armv8";
+    }
+#endif
+    {
+        /* Never trust a kernel that disagrees with the reference. */
+        unsigned char probe[256 + 7];
+        for (i = 0; i < sizeof(probe); i++) {
+            probe[i] = (unsigned char)(i * 131 + 7);
+        }
+        if (crc32_kernel(0xFFFFFFFF, probe, sizeof(probe)) != crc32_bytewise(0xFFFFFFFF, probe, sizeof(probe))) {
+            crc32_kernel = crc32_sliced;
+            crc32_kernel_text = "slicing-by-8";
         }
     }
     crc32_table_init = true;
 }
 
+uint32_t crc32_reference(const unsigned char *buffer, size_t size) {
+    init_crc32_table();
+    return crc32_bytewise(0xFFFFFFFF, buffer, size) ^ 0xFFFFFFFF;
+}
+
+const char * crc32_kernel_name(void) {
+    init_crc32_table();
+    return crc32_kernel_text;
+}
+
 uint32_t crc32_imp(unsigned char *buffer, size_t size) {
-    uint32_t crc = 0xFFFFFFFF;
-    size_t i;
     init_crc32_table();
-    for (i = 0; i < size; i++) {
-        crc = crc32_table[(crc ^ buffer[i]) & 0xFF] ^ (crc >> 8);
-    }
-    return crc ^ 0xFFFFFFFF;
+    return crc32_kernel(0xFFFFFFFF, buffer, size) ^ 0xFFFFFFFF;
 }
 
 void fillcrc32to(unsigned char *buffer, size_t size, unsigned char *outbuffer) {
-    uint32_t crc = 0xFFFFFFFF;
-    size_t i;
-    init_crc32_table();
-    for (i = 0; i < size; i++) {
-        crc = crc32_table[(crc ^ buffer[i]) & 0xff] ^ (crc >> 8);
-    }
-    crc ^= 0xFFFFFFFF;
+    uint32_t crc = crc32_imp(buffer, size);
     outbuffer[0] = (unsigned char)crc;
     outbuffer[1] = (unsigned char)(crc >> 8);
     outbuffer[2] = (unsigned char)(crc >> 16);
@@ -51,13 +216,10 @@ void fillcrc32to(unsigned char *buffer, size_t size, unsigned char *outbuffer) {
 }
 
 void fillcrc32(unsigned char *buffer, size_t size) {
-    uint32_t crc = 0xFFFFFFFF;
-    size_t i;
-    init_crc32_table();
+    uint32_t crc;
     size -= 4;
-    for (i = 0; i < size; i++) {
-        crc = crc32_table[(crc ^ buffer[i]) & 0xff] ^ (crc >> 8);
-    }
+    init_crc32_table();
+    crc = crc32_kernel(0xFFFFFFFF, buffer, size);
     buffer += size;
     buffer[0] = (unsigned char)crc;
     buffer[1] = (unsigned char)(crc >> 8);
@@ -65,29 +227,103 @@ void fillcrc32(unsigned char *buffer, size_t size) {
     buffer[3] = (unsigned char)(crc >> 24);
 }
 
-void adler32_short(unsigned char *buffer, size_t size, uint32_t *a, uint32_t *b) {
-    size_t i = 0;
-    for (i = 0; i < size; i++) {
-        *a += buffer[i];
-        *b += *a;
+#define ADLER32_BASE 65521
+#define ADLER32_NMAX 5552  /* Bytes before the sums can overflow 32 bits. */
+
+static uint32_t adler32_scalar(uint32_t adler, const unsigned char *buffer, size_t size) {
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (size > 0) {
+        size_t n = (size < ADLER32_NMAX) ? size : ADLER32_NMAX;
+        size -= n;
+        while (n--) {
+            a += *buffer++;
+            b += a;
+        }
+        a %= ADLER32_BASE;
+        b %= ADLER32_BASE;
+    }
+    return (b << 16) | a;
+}
+
+#if defined(CRC32_HAVE_PCLMUL)
+#define ADLER32_HAVE_SSSE3 1
+/*
+ * 32 bytes a step: psadbw sums them into a, pmaddubsw weighs them 32..1
+ * into b, and a as it was before the step is added up apart, to go into b
+ * times 32 once the run is over. NMAX bytes a run, as the scalar loop.
+ */
+__attribute__((target("ssse3")))
+static uint32_t adler32_ssse3(uint32_t adler, const unsigned char *buffer, size_t size) {
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    size_t blocks = size / 32;
+
+    size -= blocks * 32;
+    while (blocks > 0) {
+        size_t n = (blocks < ADLER32_NMAX / 32) ? blocks : ADLER32_NMAX / 32;
+        __m128i v_ps = _mm_set_epi32(0, 0, 0, (int)(a * n));
+        __m128i v_b = _mm_set_epi32(0, 0, 0, (int)b);
+        __m128i v_a = zero;
+        blocks -= n;
+        do {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i *)buffer);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i *)(buffer + 16));
+            v_ps = _mm_add_epi32(v_ps, v_a);
+            v_a = _mm_add_epi32(v_a, _mm_sad_epu8(bytes1, zero));
+            v_b = _mm_add_epi32(v_b, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            v_a = _mm_add_epi32(v_a, _mm_sad_epu8(bytes2, zero));
+            v_b = _mm_add_epi32(v_b, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            buffer += 32;
+        } while (--n);
+        v_b = _mm_add_epi32(v_b, _mm_slli_epi32(v_ps, 5));
+
+        v_a = _mm_add_epi32(v_a, _mm_shuffle_epi32(v_a, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_a = _mm_add_epi32(v_a, _mm_shuffle_epi32(v_a, _MM_SHUFFLE(1, 0, 3, 2)));
+        a += (uint32_t)_mm_cvtsi128_si32(v_a);
+        v_b = _mm_add_epi32(v_b, _mm_shuffle_epi32(v_b, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_b = _mm_add_epi32(v_b, _mm_shuffle_epi32(v_b, _MM_SHUFFLE(1, 0, 3, 2)));
+        b = (uint32_t)_mm_cvtsi128_si32(v_b);
+        a %= ADLER32_BASE;
+        b %= ADLER32_BASE;
     }
-    *a %= 65521;
-    *b %= 65521;
+    return adler32_scalar((b << 16) | a, buffer, size);
 }
+#endif
 
-#define NMAX 5552
-uint32_t adler32(unsigned char *buffer, size_t size) {
-    uint32_t a = 1;
-    uint32_t b = 0;
-    while ( size >= NMAX ) {
-        adler32_short(buffer, NMAX, &a, &b);
-        buffer += NMAX;
-        size -= NMAX;
+static crc32_kernel_fn adler32_kernel = adler32_scalar;
+static const char *adler32_kernel_text = "scalar";
+static bool adler32_kernel_init = false;
+
+static uint32_t adler32(unsigned char *buffer, size_t size) {
+    if (!adler32_kernel_init) {
+#if defined(ADLER32_HAVE_SSSE3)
+        unsigned char probe[ADLER32_NMAX + 300];
+        size_t i;
+        for (i = 0; i < sizeof(probe); i++) {
+            probe[i] = (unsigned char)(255 - (i * 131 + 7) % 7);
+        }
+        if ((cpu_features() & cpu_feature_ssse3) &&
+            adler32_ssse3(1, probe, sizeof(probe)) == adler32_scalar(1, probe, sizeof(probe))) {
+            adler32_kernel = adler32_ssse3;
+            adler32_kernel_text = "ssse3";
+        }
+#endif
+        adler32_kernel_init = true;
     }
-    adler32_short(buffer, size, &a, &b);
-    return (b << 16) + a;
+    return adler32_kernel(1, buffer, size);
+}
+
+uint32_t adler32_reference(const unsigned char *buffer, size_t size) {
+    return adler32_scalar(1, buffer, size);
+}
+
+const char * adler32_kernel_name(void) {
+    adler32(NULL, 0);
+    return adler32_kernel_text;
 }
-#undef NMAX
 
 void filladler32(unsigned char *buffer, size_t size) {
     uint32_t checksum;
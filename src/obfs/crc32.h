@@ -9,10 +9,20 @@ void init_crc32_table(void);
 
 uint32_t crc32_imp(unsigned char *buffer, size_t size);
 
+/* Byte-at-a-time table loop the dispatched kernels are checked against. */
+uint32_t crc32_reference(const unsigned char *buffer, size_t size);
+
+const char * crc32_kernel_name(void);
+
 void fillcrc32to(unsigned char *buffer, size_t size, unsigned char *outbuffer);
 
 void fillcrc32(unsigned char *buffer, size_t size);
 
+/* The auth_sha1* checksum, scalar, that the dispatched kernel is checked against. */
+uint32_t adler32_reference(const unsigned char *buffer, size_t size);
+
+const char * adler32_kernel_name(void);
+
 void filladler32(unsigned char *buffer, size_t size);
 
 bool checkadler32(unsigned char *buffer, size_t size);
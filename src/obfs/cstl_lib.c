@@ -23,6 +23,7 @@
  ** ** ** ** ** ** ** ** ** ** ** ** ** ** ** ** ** ** ** ** **/
 
 #include "cstl_lib.h"
+#include "ssr_alloc.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -61,21 +62,21 @@ cstl_array_check_and_grow(struct cstl_array* pArray) {
         size_t size;
         pArray->capacity = 2 * pArray->capacity;
         size = pArray->capacity * sizeof(struct cstl_object*);
-        pArray->pElements = (struct cstl_object**) realloc(pArray->pElements, size);
+        pArray->pElements = (struct cstl_object**) ssr_realloc(ssr_alloc_obfs, pArray->pElements, size);
     }
     return pArray;
 }
 
 struct cstl_array*
 cstl_array_new(size_t array_size, cstl_compare fn_c, cstl_destroy fn_d) {
-    struct cstl_array* pArray = (struct cstl_array*)calloc(1, sizeof(struct cstl_array));
+    struct cstl_array* pArray = (struct cstl_array*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_array));
     if (!pArray) {
         return (struct cstl_array*)0;
     }
     pArray->capacity = array_size < 8 ? 8 : array_size;
-    pArray->pElements = (struct cstl_object**) calloc(pArray->capacity, sizeof(struct cstl_object*));
+    pArray->pElements = (struct cstl_object**) ssr_calloc(ssr_alloc_obfs, pArray->capacity, sizeof(struct cstl_object*));
     if (!pArray->pElements) {
-        free(pArray);
+        ssr_free(ssr_alloc_obfs, pArray);
         return (struct cstl_array*)0;
     }
     pArray->compare_fn = fn_c;
@@ -234,8 +235,8 @@ cstl_array_delete(struct cstl_array* pArray) {
     for (i = 0; i < pArray->count; i++) {
         cstl_object_delete(pArray->pElements[i]);
     }
-    free(pArray->pElements);
-    free(pArray);
+    ssr_free(ssr_alloc_obfs, pArray->pElements);
+    ssr_free(ssr_alloc_obfs, pArray);
     return rc;
 }
 
@@ -270,7 +271,7 @@ cstl_array_replace_value(struct cstl_iterator *pIterator, void* elem, size_t ele
 
 struct cstl_iterator*
 cstl_array_new_iterator(struct cstl_array* pArray) {
-    struct cstl_iterator *itr = (struct cstl_iterator*) calloc(1, sizeof(struct cstl_iterator));
+    struct cstl_iterator *itr = (struct cstl_iterator*) ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_iterator));
     itr->next = cstl_array_get_next;
     itr->current_value = cstl_array_get_value;
     itr->replace_current_value = cstl_array_replace_value;
@@ -281,7 +282,7 @@ cstl_array_new_iterator(struct cstl_array* pArray) {
 
 void
 cstl_array_delete_iterator(struct cstl_iterator* pItr) {
-    free(pItr);
+    ssr_free(ssr_alloc_obfs, pItr);
 }
 
 
@@ -317,18 +318,18 @@ cstl_deque_grow(struct cstl_deque* pDeq) {
     size_t size;
     pDeq->capacity = pDeq->capacity * 2;
     size = pDeq->capacity * sizeof(struct cstl_object*);
-    pDeq->pElements = (struct cstl_object**) realloc(pDeq->pElements, size);
+    pDeq->pElements = (struct cstl_object**) ssr_realloc(ssr_alloc_obfs, pDeq->pElements, size);
     return pDeq;
 }
 
 struct cstl_deque*
 cstl_deque_new(size_t deq_size, cstl_compare fn_c, cstl_destroy fn_d) {
-    struct cstl_deque* pDeq = (struct cstl_deque*)calloc(1, sizeof(struct cstl_deque));
+    struct cstl_deque* pDeq = (struct cstl_deque*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_deque));
     if (pDeq == (struct cstl_deque*)0) {
         return (struct cstl_deque*)0;
     }
     pDeq->capacity = deq_size < 8 ? 8 : deq_size;
-    pDeq->pElements = (struct cstl_object**) calloc(pDeq->capacity, sizeof(struct cstl_object*));
+    pDeq->pElements = (struct cstl_object**) ssr_calloc(ssr_alloc_obfs, pDeq->capacity, sizeof(struct cstl_object*));
 
     if (pDeq == (struct cstl_deque*)0) {
         return (struct cstl_deque*)0;
@@ -474,8 +475,8 @@ cstl_deque_delete(struct cstl_deque* pDeq) {
     for (i = pDeq->head + 1; i < pDeq->tail; i++) {
         cstl_object_delete(pDeq->pElements[i]);
     }
-    free(pDeq->pElements);
-    free(pDeq);
+    ssr_free(ssr_alloc_obfs, pDeq->pElements);
+    ssr_free(ssr_alloc_obfs, pDeq);
 
     return CSTL_ERROR_SUCCESS;
 }
@@ -513,7 +514,7 @@ cstl_deque_replace_value(struct cstl_iterator *pIterator, void* elem, size_t ele
 
 struct cstl_iterator*
 cstl_deque_new_iterator(struct cstl_deque* pDeq) {
-    struct cstl_iterator *itr = (struct cstl_iterator*) calloc(1, sizeof(struct cstl_iterator));
+    struct cstl_iterator *itr = (struct cstl_iterator*) ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_iterator));
     itr->next = cstl_deque_get_next;
     itr->current_value = cstl_deque_get_value;
     itr->replace_current_value = cstl_deque_replace_value;
@@ -524,7 +525,7 @@ cstl_deque_new_iterator(struct cstl_deque* pDeq) {
 
 void
 cstl_deque_delete_iterator(struct cstl_iterator* pItr) {
-    free(pItr);
+    ssr_free(ssr_alloc_obfs, pItr);
 }
 
 
@@ -537,7 +538,7 @@ struct cstl_map {
 
 struct cstl_map*
 cstl_map_new(cstl_compare fn_c_k, cstl_destroy fn_k_d, cstl_destroy fn_v_d) {
-    struct cstl_map* pMap = (struct cstl_map*)calloc(1, sizeof(struct cstl_map));
+    struct cstl_map* pMap = (struct cstl_map*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_map));
     if (pMap == (struct cstl_map*)0) {
         return (struct cstl_map*)0;
     }
@@ -619,7 +620,7 @@ cstl_map_remove(struct cstl_map* pMap, const void* key) {
         }
         cstl_object_delete(node->value);
 
-        free(node);
+        ssr_free(ssr_alloc_obfs, node);
     }
     return rc;
 }
@@ -643,7 +644,7 @@ cstl_map_delete(struct cstl_map* x) {
     cstl_error rc = CSTL_ERROR_SUCCESS;
     if (x != (struct cstl_map*)0) {
         rc = cstl_rb_delete(x->root);
-        free(x);
+        ssr_free(ssr_alloc_obfs, x);
     }
     return rc;
 }
@@ -697,7 +698,7 @@ cstl_map_replace_value(struct cstl_iterator *pIterator, void* elem, size_t elem_
 
 struct cstl_iterator*
 cstl_map_new_iterator(struct cstl_map* pMap) {
-    struct cstl_iterator *itr = (struct cstl_iterator*)calloc(1, sizeof(struct cstl_iterator));
+    struct cstl_iterator *itr = (struct cstl_iterator*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_iterator));
     itr->next = cstl_map_get_next;
     itr->current_key = cstl_map_get_key;
     itr->current_value = cstl_map_get_value;
@@ -710,7 +711,7 @@ cstl_map_new_iterator(struct cstl_map* pMap) {
 
 void
 cstl_map_delete_iterator(struct cstl_iterator* pItr) {
-    free(pItr);
+    ssr_free(ssr_alloc_obfs, pItr);
 }
 
 
@@ -721,6 +722,11 @@ cstl_map_delete_iterator(struct cstl_iterator* pItr) {
 
 #define rb_sentinel &pTree->sentinel
 
+/*
+ * The red-black properties checked over the whole tree after every insert
+ * and remove, O(n) each: only for work on the tree itself.
+ */
+#if defined(CSTL_RB_DEBUG)
 static void debug_verify_properties(struct cstl_rb*);
 static void debug_verify_property_1(struct cstl_rb*, struct cstl_rb_node*);
 static void debug_verify_property_2(struct cstl_rb*, struct cstl_rb_node*);
@@ -728,6 +734,9 @@ static int debug_node_color(struct cstl_rb*, struct cstl_rb_node* n);
 static void debug_verify_property_4(struct cstl_rb*, struct cstl_rb_node*);
 static void debug_verify_property_5(struct cstl_rb*, struct cstl_rb_node*);
 static void debug_verify_property_5_helper(struct cstl_rb*, struct cstl_rb_node*, int, int*);
+#else
+#define debug_verify_properties(pTree) ((void)0)
+#endif // defined(CSTL_RB_DEBUG)
 
 static void
 __left_rotate(struct cstl_rb* pTree, struct cstl_rb_node* x) {
@@ -782,7 +791,7 @@ __right_rotate(struct cstl_rb* pTree, struct cstl_rb_node* x) {
 
 struct cstl_rb*
 cstl_rb_new(cstl_compare fn_c, cstl_destroy fn_ed, cstl_destroy fn_vd) {
-    struct cstl_rb* pTree = (struct cstl_rb*)calloc(1, sizeof(struct cstl_rb));
+    struct cstl_rb* pTree = (struct cstl_rb*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_rb));
     if (pTree == (struct cstl_rb*)0) {
         return (struct cstl_rb*)0;
     }
@@ -864,7 +873,7 @@ cstl_rb_insert(struct cstl_rb* pTree, const void* k, size_t key_size, const void
     struct cstl_rb_node* y;
     struct cstl_rb_node* z;
 
-    x = (struct cstl_rb_node*)calloc(1, sizeof(struct cstl_rb_node));
+    x = (struct cstl_rb_node*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_rb_node));
     if (x == (struct cstl_rb_node*)0) {
         return CSTL_ERROR_MEMORY;
     }
@@ -889,7 +898,7 @@ cstl_rb_insert(struct cstl_rb* pTree, const void* k, size_t key_size, const void
         if (c == 0) {
             cstl_object_delete(x->key);
             cstl_object_delete(x->value);
-            free(x);
+            ssr_free(ssr_alloc_obfs, x);
             return CSTL_RBTREE_KEY_DUPLICATE;
         }
         z = y;
@@ -1072,19 +1081,19 @@ cstl_rb_delete(struct cstl_rb* pTree) {
             if (z->parent) {
                 z = z->parent;
                 if (z->left != rb_sentinel) {
-                    free(z->left);
+                    ssr_free(ssr_alloc_obfs, z->left);
                     z->left = rb_sentinel;
                 } else if (z->right != rb_sentinel) {
-                    free(z->right);
+                    ssr_free(ssr_alloc_obfs, z->right);
                     z->right = rb_sentinel;
                 }
             } else {
-                free(z);
+                ssr_free(ssr_alloc_obfs, z);
                 z = rb_sentinel;
             }
         }
     }
-    free(pTree);
+    ssr_free(ssr_alloc_obfs, pTree);
     return rc;
 }
 
@@ -1156,6 +1165,7 @@ cstl_rb_get_next(struct cstl_rb* pTree, struct cstl_rb_node**current, struct cst
     return (struct cstl_rb_node*)0;
 } */
 
+#if defined(CSTL_RB_DEBUG)
 void debug_verify_properties(struct cstl_rb* t) {
     debug_verify_property_1(t, t->root);
     debug_verify_property_2(t, t->root);
@@ -1209,6 +1219,7 @@ void debug_verify_property_5_helper(struct cstl_rb* pTree, struct cstl_rb_node*
     debug_verify_property_5_helper(pTree, n->left, black_count, path_black_count);
     debug_verify_property_5_helper(pTree, n->right, black_count, path_black_count);
 }
+#endif // defined(CSTL_RB_DEBUG)
 
 
 // c_set.c
@@ -1220,7 +1231,7 @@ struct cstl_set {
 
 struct cstl_set*
 cstl_set_new(cstl_compare fn_c, cstl_destroy fn_d) {
-    struct cstl_set* pSet = (struct cstl_set*)calloc(1, sizeof(struct cstl_set));
+    struct cstl_set* pSet = (struct cstl_set*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_set));
     if (pSet == (struct cstl_set*)0) {
         return (struct cstl_set*)0;
     }
@@ -1271,7 +1282,7 @@ cstl_set_remove(struct cstl_set* pSet, void* key) {
         }
         cstl_object_delete(node->key);
 
-        free(node);
+        ssr_free(ssr_alloc_obfs, node);
     }
     return rc;
 }
@@ -1294,7 +1305,7 @@ cstl_set_delete(struct cstl_set* x) {
     cstl_error rc = CSTL_ERROR_SUCCESS;
     if (x != (struct cstl_set*)0) {
         rc = cstl_rb_delete(x->root);
-        free(x);
+        ssr_free(ssr_alloc_obfs, x);
     }
     return rc;
 }
@@ -1333,7 +1344,7 @@ cstl_set_get_value(struct cstl_iterator *pIterator) {
 
 struct cstl_iterator*
 cstl_set_new_iterator(struct cstl_set* pSet) {
-    struct cstl_iterator *itr = (struct cstl_iterator*) calloc(1, sizeof(struct cstl_iterator));
+    struct cstl_iterator *itr = (struct cstl_iterator*) ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_iterator));
     itr->next = cstl_set_get_next;
     itr->current_key = cstl_set_get_key;
     itr->current_value = cstl_set_get_value;
@@ -1345,7 +1356,7 @@ cstl_set_new_iterator(struct cstl_set* pSet) {
 
 void
 cstl_set_delete_iterator(struct cstl_iterator* pItr) {
-    free(pItr);
+    ssr_free(ssr_alloc_obfs, pItr);
 }
 
 
@@ -1365,7 +1376,7 @@ struct cstl_list {
 
 struct cstl_list*
 cstl_list_new(cstl_destroy fn_d, cstl_compare fn_c) {
-    struct cstl_list* pList = (struct cstl_list*)calloc(1, sizeof(struct cstl_list));
+    struct cstl_list* pList = (struct cstl_list*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_list));
     pList->head = (struct cstl_list_node*)0;
     pList->destruct_fn = fn_d;
     pList->compare_key_fn = fn_c;
@@ -1380,7 +1391,7 @@ size_t cstl_list_count(struct cstl_list* pList) {
 void
 cstl_list_destroy(struct cstl_list* pList) {
     cstl_list_clear(pList);
-    free(pList);
+    ssr_free(ssr_alloc_obfs, pList);
 }
 
 void cstl_list_clear(struct cstl_list* pList) {
@@ -1404,7 +1415,7 @@ __cstl_slist_remove(struct cstl_list* pList, struct cstl_list_node* pSlistNode)
     }
     cstl_object_delete(pSlistNode->elem);
 
-    free(pSlistNode);
+    ssr_free(ssr_alloc_obfs, pSlistNode);
 }
 
 void
@@ -1443,11 +1454,11 @@ cstl_list_insert(struct cstl_list* pList, size_t pos, void* elem, size_t elem_si
         pos = pList->size;
     }
 
-    new_node = (struct cstl_list_node*)calloc(1, sizeof(struct cstl_list_node));
+    new_node = (struct cstl_list_node*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_list_node));
     new_node->next = (struct cstl_list_node*)0;
     new_node->elem = cstl_object_new(elem, elem_size);
     if (!new_node->elem) {
-        free(new_node);
+        ssr_free(ssr_alloc_obfs, new_node);
         return CSTL_SLIST_INSERT_FAILED;
     }
 
@@ -1548,7 +1559,7 @@ cstl_list_replace_value(struct cstl_iterator *pIterator, void* elem, size_t elem
 
 struct cstl_iterator*
 cstl_list_new_iterator(struct cstl_list* pList) {
-    struct cstl_iterator *itr = (struct cstl_iterator*) calloc(1, sizeof(struct cstl_iterator));
+    struct cstl_iterator *itr = (struct cstl_iterator*) ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_iterator));
     itr->next = cstl_list_get_next;
     itr->current_value = cstl_list_get_value;
     itr->replace_current_value = cstl_list_replace_value;
@@ -1560,7 +1571,7 @@ cstl_list_new_iterator(struct cstl_list* pList) {
 
 void
 cstl_list_delete_iterator(struct cstl_iterator* pItr) {
-    free(pItr);
+    ssr_free(ssr_alloc_obfs, pItr);
 }
 
 
@@ -1582,7 +1593,7 @@ char * cstl_strdup(const char *ptr) {
 #ifdef WIN32
     return _strdup(ptr);
 #else
-    return strdup(ptr);
+    return ssr_strdup(ssr_alloc_obfs, ptr);
 #endif
 }
 
@@ -1593,14 +1604,14 @@ struct cstl_object {
 
 struct cstl_object*
 cstl_object_new(const void* inObject, size_t obj_size) {
-    struct cstl_object* tmp = (struct cstl_object*)calloc(1, sizeof(struct cstl_object));
+    struct cstl_object* tmp = (struct cstl_object*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct cstl_object));
     if (!tmp) {
         return (struct cstl_object*)0;
     }
     tmp->size = obj_size;
-    tmp->raw_data = (void*)calloc(obj_size, sizeof(char));
+    tmp->raw_data = (void*)ssr_calloc(ssr_alloc_obfs, obj_size, sizeof(char));
     if (!tmp->raw_data) {
-        free(tmp);
+        ssr_free(ssr_alloc_obfs, tmp);
         return (struct cstl_object*)0;
     }
     memcpy(tmp->raw_data, inObject, obj_size);
@@ -1613,15 +1624,15 @@ const void * cstl_object_get_data(struct cstl_object *inObject) {
 
 void
 cstl_object_replace_raw(struct cstl_object* current_object, const void* elem, size_t elem_size) {
-    free(current_object->raw_data);
-    current_object->raw_data = (void*)calloc(elem_size, sizeof(char));
+    ssr_free(ssr_alloc_obfs, current_object->raw_data);
+    current_object->raw_data = (void*)ssr_calloc(ssr_alloc_obfs, elem_size, sizeof(char));
     memcpy(current_object->raw_data, elem, elem_size);
 }
 
 void
 cstl_object_delete(struct cstl_object* inObject) {
     if (inObject) {
-        free(inObject->raw_data);
-        free(inObject);
+        ssr_free(ssr_alloc_obfs, inObject->raw_data);
+        ssr_free(ssr_alloc_obfs, inObject);
     }
 }
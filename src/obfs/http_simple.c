@@ -3,19 +3,21 @@
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
-#include <ctype.h>
 
 #include "http_simple.h"
 #include "obfsutil.h"
 #include "obfs.h"
 #include "ssrbuffer.h"
 #include "encrypt.h"
+#include "ssr_alloc.h"
 
 struct buffer_t * http_simple_client_encode(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * http_simple_client_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *needsendback);
 
 struct buffer_t * http_simple_server_encode(struct obfs_t *obfs, const struct buffer_t *buf);
+bool http_simple_server_encode_segments(struct obfs_t *obfs, struct buffer_t *buf, struct buffer_segments *segs);
 struct buffer_t * http_simple_server_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback);
+bool http_simple_server_precheck(struct obfs_t *obfs, const uint8_t *data, size_t len);
 
 struct buffer_t * http_post_client_encode(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * http_mix_client_encode(struct obfs_t *obfs, const struct buffer_t *buf);
@@ -47,39 +49,64 @@ static const char *request_path[] = {
 
 static int g_useragent_index = -1;
 
+#define HTTP_SIMPLE_MAX_HOSTS 128
+#define HTTP_SIMPLE_BOUNDARY_LEN 32
+
+// The fake request rendered once per server from obfs_param, only the
+// path, the Host pick and the POST boundary change per connection.
+struct http_simple_global_data {
+    bool ready;
+    size_t host_num;
+    uint16_t host_offset[HTTP_SIMPLE_MAX_HOSTS];
+    uint16_t host_len[HTTP_SIMPLE_MAX_HOSTS];
+    char hosts[SSR_BUFF_SIZE];          // "Host: name[:port]\r\n" lines back to back.
+    size_t get_tail_len;
+    char get_tail[SSR_BUFF_SIZE];       // Everything after the Host line.
+    size_t post_tail_len;
+    size_t post_boundary;               // Offset of the boundary slot in post_tail, 0 for none.
+    char post_tail[SSR_BUFF_SIZE];
+};
+
 struct http_simple_local_data {
     int has_sent_header;
     int has_recv_header;
-    struct buffer_t *encode_buffer;
     struct buffer_t *recv_buffer;
+    size_t header_scanned;  // Bytes of recv_buffer already searched for the header end.
 };
 
 void http_simple_local_data_init(struct http_simple_local_data *local) {
     local->has_sent_header = 0;
     local->has_recv_header = 0;
-    local->encode_buffer = buffer_create(SSR_BUFF_SIZE);
-    local->recv_buffer = buffer_create(SSR_BUFF_SIZE);
+    local->recv_buffer = buffer_create(0);
+    local->header_scanned = 0;
 
     if (g_useragent_index == -1) {
         g_useragent_index = xorshift128plus() % (sizeof(g_useragent) / sizeof(*g_useragent));
     }
 }
 
+void * http_simple_init_data(void) {
+    return ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct http_simple_global_data));
+}
+
 struct obfs_t * http_simple_new_obfs(void) {
-    struct obfs_t * obfs = (struct obfs_t *)calloc(1, sizeof(struct obfs_t));
-    obfs->init_data = init_data;
+    struct obfs_t * obfs = (struct obfs_t *)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
+    obfs->init_data = http_simple_init_data;
     obfs->get_overhead = get_overhead;
     obfs->need_feedback = need_feedback_false;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = http_simple_dispose;
+    obfs->trim = http_simple_trim;
     obfs->client_encode = http_simple_client_encode;
     obfs->client_decode = http_simple_client_decode;
 
     obfs->server_encode = http_simple_server_encode;
+    obfs->server_encode_segments = http_simple_server_encode_segments;
     obfs->server_decode = http_simple_server_decode;
+    obfs->server_precheck = http_simple_server_precheck;
 
-    obfs->l_data = malloc(sizeof(struct http_simple_local_data));
+    obfs->l_data = ssr_malloc(ssr_alloc_obfs, sizeof(struct http_simple_local_data));
     http_simple_local_data_init((struct http_simple_local_data*)obfs->l_data);
 
     return obfs;
@@ -99,30 +126,72 @@ struct obfs_t * http_mix_new_obfs(void) {
 
 void http_simple_dispose(struct obfs_t *obfs) {
     struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
-    buffer_release(local->encode_buffer);
     buffer_release(local->recv_buffer);
-    free(local);
+    ssr_free(ssr_alloc_obfs, local);
     dispose_obfs(obfs);
 }
 
+void http_simple_trim(struct obfs_t *obfs) {
+    struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
+    buffer_trim(local->recv_buffer);
+}
+
 char http_simple_hex(char c) {
     if (c < 10) return c + '0';
     return c - 10 + 'a';
 }
 
+// Nibble value plus one for every hex digit, zero for anything else.
+static const uint8_t hex_table[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
 // Converts a hex character to its integer value
 uint8_t from_hex(uint8_t ch) {
-    return isdigit((int)ch) ? ch - '0' : (uint8_t)tolower((int)ch) - 'a' + 10;
+    return (uint8_t)(hex_table[ch] - 1);
 }
 
-struct buffer_t * get_data_from_http_header(const uint8_t *buf) {
+// Bounded strstr. memchr is vectorized by the C library, so only the
+// positions holding the first byte of |needle| get a full compare.
+static const uint8_t * http_simple_find(const uint8_t *data, size_t len, const char *needle, size_t needle_len) {
+    const uint8_t *iter = data;
+    const uint8_t *last;
+    if (needle_len == 0 || len < needle_len) {
+        return NULL;
+    }
+    last = data + len - needle_len + 1;
+    while (iter < last) {
+        iter = (const uint8_t *) memchr(iter, needle[0], (size_t)(last - iter));
+        if (iter == NULL) {
+            break;
+        }
+        if (memcmp(iter, needle, needle_len) == 0) {
+            return iter;
+        }
+        ++iter;
+    }
+    return NULL;
+}
+
+struct buffer_t * get_data_from_http_header(const uint8_t *buf, size_t len) {
     struct buffer_t *ret = buffer_create(SSR_BUFF_SIZE);
-    const uint8_t *iter = (uint8_t *) strchr((char *)buf, '%');
-    uint8_t *target = ret->buffer;
-    while(iter) {
-        *target++ = from_hex(iter[1]) << 4 | from_hex(iter[2]);
+    const uint8_t *end = buf + len;
+    const uint8_t *iter = (const uint8_t *) memchr(buf, '%', len);
+    uint8_t *target;
+    buffer_realloc(ret, len / 3 + 1);
+    target = ret->buffer;
+    while (iter && end - iter >= 3) {
+        uint8_t hi = hex_table[iter[1]];
+        uint8_t lo = hex_table[iter[2]];
+        if (hi == 0 || lo == 0) {
+            break;
+        }
+        *target++ = (uint8_t)((hi - 1) << 4 | (lo - 1));
         iter += 3;
-        if (*iter != '%') {
+        if (iter == end || *iter != '%') {
             break;
         }
     }
@@ -130,95 +199,50 @@ struct buffer_t * get_data_from_http_header(const uint8_t *buf) {
     return ret;
 }
 
-void get_host_from_http_header(const uint8_t *buf, char host_port[128]) {
+void get_host_from_http_header(const uint8_t *buf, size_t len, char host_port[128]) {
     static const char *hoststr = "Host: ";
     static const char *crlf = "\r\n";
-    struct buffer_t *ret = buffer_create(SSR_BUFF_SIZE);
-    const uint8_t *iter = (uint8_t *) strstr((char *)buf, hoststr);
+    const uint8_t *end = buf + len;
+    const uint8_t *iter = http_simple_find(buf, len, hoststr, strlen(hoststr));
     if(iter) {
-        const uint8_t *end = NULL;
+        const uint8_t *host_end = NULL;
         iter += strlen(hoststr);
-        end = (const uint8_t *) strstr((const char *)iter, crlf);
-        if (end) {
-            size_t len = end - iter;
-            memmove(host_port, iter, len);
-            host_port[len] = 0;
+        host_end = http_simple_find(iter, (size_t)(end - iter), crlf, strlen(crlf));
+        if (host_end) {
+            size_t host_len = (size_t)(host_end - iter);
+            if (host_len > 127) {
+                host_len = 127;
+            }
+            memmove(host_port, iter, host_len);
+            host_port[host_len] = 0;
         }
     }
 }
 
-void http_simple_encode_head(struct http_simple_local_data *local, const uint8_t *data, size_t datalength) {
-    size_t pos = 0;
-    uint8_t *buffer;
-    buffer_realloc(local->encode_buffer, (size_t)(datalength * 3 + 1));
-    buffer = (uint8_t *) local->encode_buffer->buffer;
-    for (; pos < datalength; ++pos) {
-        buffer[pos * 3] = '%';
-        buffer[pos * 3 + 1] = http_simple_hex(((unsigned char)data[pos] >> 4));
-        buffer[pos * 3 + 2] = http_simple_hex(data[pos] & 0xF);
-    }
-    buffer[pos * 3] = 0;
-    local->encode_buffer->len = pos * 3;
-}
-
-struct buffer_t * fake_request_data(const char *url_encoded_data) {
-    struct buffer_t *ret = buffer_create(SSR_BUFF_SIZE);
-    size_t arr_size = sizeof(request_path)/sizeof(request_path[0]);
-    size_t index = 0;
-    const char *ptr;
-    index = (rand_integer() % (arr_size / 2)) * 2;
-
-    ptr = request_path[index];
-    buffer_concatenate(ret, (const uint8_t *)ptr, strlen(ptr));
-
-    ptr = url_encoded_data;
-    buffer_concatenate(ret, (const uint8_t *)ptr, strlen(ptr));
-
-    ptr = request_path[index + 1];
-    buffer_concatenate(ret, (const uint8_t *)ptr, strlen(ptr));
-
-    return ret;
-}
-
-struct buffer_t * http_simple_client_encode(struct obfs_t *obfs, const struct buffer_t *buf) {
-    const uint8_t *encryptdata = buf->buffer;
-    size_t datalength = buf->len;
-    struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
+static void http_simple_render_template(struct http_simple_global_data *global, const struct server_info_t *server) {
     char hosts[(SSR_BUFF_SIZE / 2)];
-    char * phost[128];
-    int host_num = 0;
+    char * phost[HTTP_SIMPLE_MAX_HOSTS];
+    char body_buffer[SSR_BUFF_SIZE];
+    bool has_body = false;
+    size_t host_num = 0;
+    size_t used = 0;
+    size_t i;
     int pos;
-    char hostport[128];
-    size_t head_size;
-    size_t outlength;
-    char * out_buffer;
-    char * body_buffer = NULL;
-    struct buffer_t *fake_path = NULL;
-    struct buffer_t *result = NULL;
+    int len;
 
-    if (local->has_sent_header) {
-        return buffer_clone(buf);
-    }
-    head_size = (size_t)obfs->server.head_len + (xorshift128plus() & 0x3F);
-    out_buffer = (char*)malloc((size_t)(datalength + SSR_BUFF_SIZE));
-    if ((size_t)head_size > datalength) {
-        head_size = datalength;
-    }
-    http_simple_encode_head(local, encryptdata, head_size);
-    if (obfs->server.param && strlen(obfs->server.param) == 0) {
-        obfs->server.param = NULL;
-    }
-    strncpy(hosts, obfs->server.param ? obfs->server.param : obfs->server.host, sizeof hosts);
+    strncpy(hosts, (server->param && strlen(server->param) > 0) ? server->param : server->host, sizeof hosts - 1);
+    hosts[sizeof hosts - 1] = 0;
     phost[host_num++] = hosts;
     for (pos = 0; hosts[pos]; ++pos) {
         if (hosts[pos] == ',') {
-            phost[host_num++] = &hosts[pos + 1];
+            if (host_num < HTTP_SIMPLE_MAX_HOSTS) {
+                phost[host_num++] = &hosts[pos + 1];
+            }
             hosts[pos] = 0;
         } else if (hosts[pos] == '#') {
             char * body_pointer = &hosts[pos + 1];
-            char * p;
+            char * p = body_buffer;
             int trans_char = 0;
-            p = body_buffer = (char*)malloc(SSR_BUFF_SIZE);
             for ( ; *body_pointer; ++body_pointer) {
                 if (trans_char) {
                     if (*body_pointer == '\\' ) {
@@ -244,29 +268,39 @@ struct buffer_t * http_simple_client_encode(struct obfs_t *obfs, const struct bu
             }
             *p = 0;
             hosts[pos] = 0;
+            has_body = true;
             break;
         }
     }
-    host_num = (int)(xorshift128plus() % (uint64_t)host_num);
-    if (obfs->server.port == 80) {
-        sprintf(hostport, "%s", phost[host_num]);
-    } else {
-        sprintf(hostport, "%s:%d", phost[host_num], obfs->server.port);
+
+    for (i = 0; i < host_num; ++i) {
+        if (server->port == 80) {
+            len = snprintf(global->hosts + used, sizeof(global->hosts) - used, "Host: %s\r\n", phost[i]);
+        } else {
+            len = snprintf(global->hosts + used, sizeof(global->hosts) - used, "Host: %s:%d\r\n", phost[i], server->port);
+        }
+        if (len < 0 || (size_t)len >= sizeof(global->hosts) - used) {
+            break;
+        }
+        global->host_offset[i] = (uint16_t)used;
+        global->host_len[i] = (uint16_t)len;
+        used += (size_t)len;
     }
-    fake_path = fake_request_data((char *)local->encode_buffer->buffer);
-
-    if (body_buffer) {
-        sprintf(out_buffer,
-            "GET /%s HTTP/1.1\r\n"
-            "Host: %s\r\n"
-            "%s\r\n\r\n",
-            (char *)fake_path->buffer,
-            hostport,
-            body_buffer);
+    global->host_num = i > 0 ? i : 1;
+
+    if (has_body) {
+        snprintf(global->get_tail, sizeof(global->get_tail), "%s\r\n\r\n", body_buffer);
+        global->get_tail_len = strlen(global->get_tail);
+        memcpy(global->post_tail, global->get_tail, global->get_tail_len);
+        global->post_tail_len = global->get_tail_len;
+        global->post_boundary = 0;
     } else {
-        sprintf(out_buffer,
-            "GET /%s HTTP/1.1\r\n"
-            "Host: %s\r\n"
+        static const char *post_tail2 =
+            "\r\n"
+            "DNT: 1\r\n"
+            "Connection: keep-alive\r\n"
+            "\r\n";
+        snprintf(global->get_tail, sizeof(global->get_tail),
             "User-Agent: %s\r\n"
             "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
             "Accept-Language: en-US,en;q=0.8\r\n"
@@ -274,35 +308,102 @@ struct buffer_t * http_simple_client_encode(struct obfs_t *obfs, const struct bu
             "DNT: 1\r\n"
             "Connection: keep-alive\r\n"
             "\r\n",
-            (char *)fake_path->buffer,
-            hostport,
-            g_useragent[g_useragent_index]
-            );
+            g_useragent[g_useragent_index]);
+        global->get_tail_len = strlen(global->get_tail);
+
+        snprintf(global->post_tail, sizeof(global->post_tail),
+            "User-Agent: %s\r\n"
+            "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+            "Accept-Language: en-US,en;q=0.8\r\n"
+            "Accept-Encoding: gzip, deflate\r\n"
+            "Content-Type: multipart/form-data; boundary=",
+            g_useragent[g_useragent_index]);
+        global->post_boundary = strlen(global->post_tail);
+        memset(global->post_tail + global->post_boundary, 'A', HTTP_SIMPLE_BOUNDARY_LEN);
+        memcpy(global->post_tail + global->post_boundary + HTTP_SIMPLE_BOUNDARY_LEN, post_tail2, strlen(post_tail2) + 1);
+        global->post_tail_len = strlen(global->post_tail);
     }
-    //LOGI("http header: %s", out_buffer);
-    outlength = strlen(out_buffer);
-    memmove(out_buffer + outlength, encryptdata + head_size, datalength - (size_t)head_size);
-    outlength += datalength - head_size;
+    global->ready = true;
+}
+
+static struct buffer_t * http_simple_render_request(struct obfs_t *obfs, const struct buffer_t *buf, bool post) {
+    static const char *boundary_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    static const char *version = " HTTP/1.1\r\n";
+    struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
+    struct http_simple_global_data *global = (struct http_simple_global_data*)obfs->server.g_data;
+    struct http_simple_global_data *scratch = NULL;
+    const char *method = post ? "POST /" : "GET /";
+    const char *path_begin, *path_end, *tail;
+    size_t tail_len, head_size, index, host, pos, outlength;
+    struct buffer_t *result;
+    uint8_t *out;
+
+    if (local->has_sent_header) {
+        return buffer_clone(buf);
+    }
+    if (global == NULL) {
+        global = scratch = (struct http_simple_global_data*) ssr_calloc(ssr_alloc_obfs, 1, sizeof(*scratch));
+    }
+    if (global->ready == false) {
+        http_simple_render_template(global, &obfs->server);
+    }
+
+    head_size = (size_t)obfs->server.head_len + (xorshift128plus() & 0x3F);
+    if (head_size > buf->len) {
+        head_size = buf->len;
+    }
+    index = (rand_integer() % (ARRAY_SIZE(request_path) / 2)) * 2;
+    path_begin = request_path[index];
+    path_end = request_path[index + 1];
+    host = (size_t)(xorshift128plus() % (uint64_t)global->host_num);
+    tail = post ? global->post_tail : global->get_tail;
+    tail_len = post ? global->post_tail_len : global->get_tail_len;
+
+    outlength = strlen(method) + strlen(path_begin) + head_size * 3 + strlen(path_end) + strlen(version)
+        + global->host_len[host] + tail_len + (buf->len - head_size);
+    result = buffer_create(outlength);
+    out = result->buffer;
+
+    memcpy(out, method, strlen(method)); out += strlen(method);
+    memcpy(out, path_begin, strlen(path_begin)); out += strlen(path_begin);
+    for (pos = 0; pos < head_size; ++pos) {
+        *out++ = '%';
+        *out++ = (uint8_t)http_simple_hex((char)(buf->buffer[pos] >> 4));
+        *out++ = (uint8_t)http_simple_hex((char)(buf->buffer[pos] & 0xF));
+    }
+    memcpy(out, path_end, strlen(path_end)); out += strlen(path_end);
+    memcpy(out, version, strlen(version)); out += strlen(version);
+    memcpy(out, global->hosts + global->host_offset[host], global->host_len[host]); out += global->host_len[host];
+    memcpy(out, tail, tail_len);
+    if (post && global->post_boundary) {
+        for (pos = 0; pos < HTTP_SIMPLE_BOUNDARY_LEN; ++pos) {
+            out[global->post_boundary + pos] = (uint8_t)boundary_chars[rand_integer() % 62];
+        }
+    }
+    out += tail_len;
+    memcpy(out, buf->buffer + head_size, buf->len - head_size);
+    result->len = outlength;
+
     local->has_sent_header = 1;
-    result = buffer_create_from((uint8_t *)out_buffer, outlength);
-    free(out_buffer);
-    if (body_buffer != NULL)
-        free(body_buffer);
-    buffer_release(fake_path);
+    ssr_free(ssr_alloc_obfs, scratch);
     return result;
 }
 
+struct buffer_t * http_simple_client_encode(struct obfs_t *obfs, const struct buffer_t *buf) {
+    return http_simple_render_request(obfs, buf, false);
+}
+
 struct buffer_t * http_simple_client_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *needsendback) {
     struct buffer_t *result = buffer_clone(buf);
-    char *encryptdata = (char *) result->buffer;
+    const uint8_t *encryptdata = result->buffer;
     struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
-    char* data_begin;
+    const uint8_t *data_begin;
 
     *needsendback = false;
     if (local->has_recv_header) {
         return result;
     }
-    data_begin = strstr(encryptdata, "\r\n\r\n");
+    data_begin = http_simple_find(encryptdata, result->len, "\r\n\r\n", 4);
     if (data_begin) {
         size_t outlength;
         data_begin += 4;
@@ -315,27 +416,32 @@ struct buffer_t * http_simple_client_decode(struct obfs_t *obfs, const struct bu
     return result;
 }
 
+static void http_simple_server_header(struct buffer_t *header) {
+    static const char *header1 = "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-Encoding: gzip\r\nContent-Type: text/html\r\nDate: ";
+    static const char *header2 = "\r\nServer: nginx\r\nVary: Accept-Encoding\r\n\r\n";
+
+    buffer_store(header, (const uint8_t *)header1, strlen(header1));
+    {
+        time_t t = time(NULL);
+        struct tm *tmp = gmtime(&t);
+        char current[128] = { 0 };
+        strftime(current, sizeof(current), "%a, %d %b %Y %H:%M:%S GMT", tmp);
+
+        buffer_concatenate(header, (uint8_t *)current, strlen(current));
+    }
+    buffer_concatenate(header, (const uint8_t *)header2, strlen(header2));
+}
+
 struct buffer_t * http_simple_server_encode(struct obfs_t *obfs, const struct buffer_t *buf) {
     struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
     struct buffer_t *header = buffer_create(SSR_BUFF_SIZE);
-    static const char *header1 = "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-Encoding: gzip\r\nContent-Type: text/html\r\nDate: ";
-    static const char *header2 = "\r\nServer: nginx\r\nVary: Accept-Encoding\r\n\r\n";
     do {
         if (local->has_sent_header) {
             buffer_concatenate2(header, buf);
             break;
         }
 
-        buffer_store(header, (const uint8_t *)header1, strlen(header1));
-        {
-            time_t t = time(NULL);
-            struct tm *tmp = gmtime(&t);
-            char current[128] = { 0 };
-            strftime(current, sizeof(current), "%a, %d %b %Y %H:%M:%S GMT", tmp);
-
-            buffer_concatenate(header, (uint8_t *)current, strlen(current));
-        }
-        buffer_concatenate(header, (const uint8_t *)header2, strlen(header2));
+        http_simple_server_header(header);
         buffer_concatenate2(header, buf);
 
         local->has_sent_header = true;
@@ -343,18 +449,33 @@ struct buffer_t * http_simple_server_encode(struct obfs_t *obfs, const struct bu
     return header;
 }
 
+bool http_simple_server_encode_segments(struct obfs_t *obfs, struct buffer_t *buf, struct buffer_segments *segs) {
+    struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
+    if (local->has_sent_header == false) {
+        struct buffer_t *header = buffer_create(SSR_BUFF_SIZE);
+        http_simple_server_header(header);
+        buffer_segments_append_data(segs, header->buffer, header->len);
+        buffer_release(header);
+
+        local->has_sent_header = true;
+    }
+    buffer_segments_append_buffer(segs, buf, 0, buf->len);
+    return true;
+}
+
+static const char *http_simple_methods[] = {
+    "GET ",
+    "POST ",
+};
+
 bool match_http_header(struct buffer_t *buf) {
     bool result = false;
-    static char * header[] = {
-        "GET ",
-        "POST ",
-    };
     int i = 0;
     if (buf==NULL || buf->len==0) {
         return result;
     }
-    for(i=0; i< sizeof(header)/sizeof(header[0]); ++i) {
-        if (memcmp(header[i], buf->buffer, strlen(header[i])) == 0) {
+    for(i=0; i< sizeof(http_simple_methods)/sizeof(http_simple_methods[0]); ++i) {
+        if (memcmp(http_simple_methods[i], buf->buffer, strlen(http_simple_methods[i])) == 0) {
             result = true;
             break;
         }
@@ -362,12 +483,25 @@ bool match_http_header(struct buffer_t *buf) {
     return result;
 }
 
+// What server_decode() would turn down as not http, told from the method alone.
+bool http_simple_server_precheck(struct obfs_t *obfs, const uint8_t *data, size_t len) {
+    int i = 0;
+    (void)obfs;
+    for(i=0; i< sizeof(http_simple_methods)/sizeof(http_simple_methods[0]); ++i) {
+        if (memcmp(http_simple_methods[i], data, min(len, strlen(http_simple_methods[i]))) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 struct buffer_t * http_simple_server_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback) {
     struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
     static const char *crlfcrlf = "\r\n\r\n";
     struct buffer_t *ret = buffer_create(SSR_BUFF_SIZE);
-    struct buffer_t *in_buf = NULL;
-    uint8_t *real_data = NULL;
+    struct buffer_t *in_buf = local->recv_buffer;
+    const uint8_t *real_data = NULL;
+    size_t from = 0;
     size_t len = 0;
     char host_port[128] = { 0 };
     do {
@@ -378,43 +512,49 @@ struct buffer_t * http_simple_server_decode(struct obfs_t *obfs, const struct bu
             break;
         }
 
-        local->has_recv_header = true;
-
-        buffer_concatenate2(local->recv_buffer, buf);
-        in_buf = buffer_clone(local->recv_buffer);
+        buffer_concatenate2(in_buf, buf);
         if (in_buf->len <= 10) {
             break;
         }
         if (match_http_header(in_buf) == false) {
             // logging.debug('http_simple: not match begin')
-            buffer_reset(local->recv_buffer);
+            local->has_recv_header = true;
+            buffer_reset(in_buf);
             break;
         }
         if (in_buf->len > 65536) {
             // logging.warn('http_simple: over size')
-            buffer_reset(local->recv_buffer);
+            local->has_recv_header = true;
+            buffer_reset(in_buf);
             if (need_decrypt) { *need_decrypt = false; }
             break;
         }
-        real_data = (uint8_t *) strstr((char *)in_buf->buffer, crlfcrlf);
+        // Resume where the previous read stopped, backing off in case
+        // the terminator straddles the two reads.
+        if (local->header_scanned > strlen(crlfcrlf) - 1) {
+            from = local->header_scanned - (strlen(crlfcrlf) - 1);
+        }
+        real_data = http_simple_find(in_buf->buffer + from, in_buf->len - from, crlfcrlf, strlen(crlfcrlf));
         if (real_data == NULL) {
+            local->header_scanned = in_buf->len;
             break;
         }
-        *real_data = 0;
-        real_data += strlen(crlfcrlf);
+        local->has_recv_header = true;
 
         buffer_release(ret);
-        ret = get_data_from_http_header(in_buf->buffer);
-        get_host_from_http_header(in_buf->buffer, host_port);
+        ret = get_data_from_http_header(in_buf->buffer, (size_t)(real_data - in_buf->buffer));
+        get_host_from_http_header(in_buf->buffer, (size_t)(real_data - in_buf->buffer) + 2, host_port);
 
         // TODO: check obfs_param
         // if host_port and self.server_info.obfs_param: 
         //     ....
 
-        len = (in_buf->buffer + in_buf->len - real_data);
+        real_data += strlen(crlfcrlf);
+        len = (size_t)(in_buf->buffer + in_buf->len - real_data);
         if (len > 0) {
             buffer_concatenate(ret, real_data, len);
         }
+        buffer_reset(in_buf);
 
         if (ret->len < 13) {
             // not_match_return
@@ -423,137 +563,11 @@ struct buffer_t * http_simple_server_decode(struct obfs_t *obfs, const struct bu
         }
 
     } while(0);
-    buffer_release(in_buf);
     return ret;
 }
 
-void boundary(char result[])
-{
-    char *str = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
-    int i,lstr;
-    char ss[3] = {0};
-    lstr = (int)strlen(str);
-    srand((unsigned int)time((time_t *)NULL));
-    for(i = 0; i < 32; ++i)
-    {
-        sprintf(ss, "%c", str[(rand_integer()%lstr)]);
-        strcat(result, ss);
-    }
-}
-
 struct buffer_t * http_post_client_encode(struct obfs_t *obfs, const struct buffer_t *buf) {
-    const uint8_t *encryptdata = buf->buffer;
-    size_t datalength = buf->len;
-    struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
-    char hosts[(SSR_BUFF_SIZE / 2)];
-    char * phost[128];
-    int host_num = 0;
-    int pos;
-    char hostport[128];
-    size_t head_size;
-    size_t outlength;
-    char * out_buffer;
-    char * body_buffer = NULL;
-    struct buffer_t *fake_path = NULL;
-    struct buffer_t *result = NULL;
-
-    if (local->has_sent_header) {
-        return buffer_clone(buf);
-    }
-    head_size = (size_t)obfs->server.head_len + (xorshift128plus() & 0x3F);
-    out_buffer = (char*)malloc((size_t)(datalength + (SSR_BUFF_SIZE * 2)));
-    if ((size_t)head_size > datalength)
-        head_size = datalength;
-    http_simple_encode_head(local, encryptdata, head_size);
-    if (obfs->server.param && strlen(obfs->server.param) == 0)
-        obfs->server.param = NULL;
-    strncpy(hosts, obfs->server.param ? obfs->server.param : obfs->server.host, sizeof hosts);
-    phost[host_num++] = hosts;
-    for (pos = 0; hosts[pos]; ++pos) {
-        if (hosts[pos] == ',') {
-            phost[host_num++] = &hosts[pos + 1];
-            hosts[pos] = 0;
-        } else if (hosts[pos] == '#') {
-            char * body_pointer = &hosts[pos + 1];
-            char * p;
-            int trans_char = 0;
-            p = body_buffer = (char*)malloc(SSR_BUFF_SIZE);
-            for ( ; *body_pointer; ++body_pointer) {
-                if (trans_char) {
-                    if (*body_pointer == '\\' ) {
-                        *p = '\\';
-                    } else if (*body_pointer == 'n' ) {
-                        *p = '\r';
-                        *++p = '\n';
-                    } else {
-                        *p = '\\';
-                        *++p = *body_pointer;
-                    }
-                    trans_char = 0;
-                } else {
-                    if (*body_pointer == '\\') {
-                        trans_char = 1;
-                        continue;
-                    } else if (*body_pointer == '\n') {
-                        *p++ = '\r';
-                    }
-                    *p = *body_pointer;
-                }
-                ++p;
-            }
-            *p = 0;
-            hosts[pos] = 0;
-            break;
-        }
-    }
-    host_num = (int)(xorshift128plus() % (uint64_t)host_num);
-    if (obfs->server.port == 80) {
-        snprintf(hostport, sizeof(hostport), "%s", phost[host_num]);
-    } else {
-        snprintf(hostport, sizeof(hostport), "%s:%d", phost[host_num], obfs->server.port);
-    }
-
-    fake_path = fake_request_data((char *)local->encode_buffer->buffer);
-
-    if (body_buffer) {
-        snprintf(out_buffer, SSR_BUFF_SIZE,
-            "POST /%s HTTP/1.1\r\n"
-            "Host: %s\r\n"
-            "%s\r\n\r\n",
-            (char *)fake_path->buffer,
-            hostport,
-            body_buffer);
-    } else {
-        char result[33] = {0};
-        boundary(result);
-        snprintf(out_buffer, SSR_BUFF_SIZE,
-            "POST /%s HTTP/1.1\r\n"
-            "Host: %s\r\n"
-            "User-Agent: %s\r\n"
-            "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
-            "Accept-Language: en-US,en;q=0.8\r\n"
-            "Accept-Encoding: gzip, deflate\r\n"
-            "Content-Type: multipart/form-data; boundary=%s\r\n"
-            "DNT: 1\r\n"
-            "Connection: keep-alive\r\n"
-            "\r\n",
-            (char *)fake_path->buffer,
-            hostport,
-            g_useragent[g_useragent_index],
-            result
-            );
-    }
-    //LOGI("http header: %s", out_buffer);
-    outlength = strlen(out_buffer);
-    memmove(out_buffer + outlength, encryptdata + head_size, datalength - head_size);
-    outlength += datalength - head_size;
-    local->has_sent_header = 1;
-    result = buffer_create_from((uint8_t *)out_buffer, outlength);
-    free(out_buffer);
-    if (body_buffer != NULL)
-        free(body_buffer);
-    buffer_release(fake_path);
-    return result;
+    return http_simple_render_request(obfs, buf, true);
 }
 
 struct buffer_t * http_mix_client_encode(struct obfs_t *obfs, const struct buffer_t *buf) {
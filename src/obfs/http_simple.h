@@ -14,6 +14,7 @@ struct obfs_t;
 
 struct obfs_t * http_simple_new_obfs(void);
 void http_simple_dispose(struct obfs_t *obfs);
+void http_simple_trim(struct obfs_t *obfs);
 
 struct obfs_t * http_post_new_obfs(void);
 
@@ -15,11 +15,12 @@ void rand_bytes(uint8_t *output, size_t len);
 
 #include "encrypt.h"
 #include "ssrbuffer.h"
+#include "ssr_alloc.h"
 
 void *
 init_data(void)
 {
-    return malloc(1);
+    return ssr_malloc(ssr_alloc_obfs, 1);
 }
 
 size_t
@@ -56,6 +57,11 @@ struct buffer_t * generic_server_encode(struct obfs_t *obfs, const struct buffer
     return buffer_clone(buf);
 }
 
+bool generic_server_encode_segments(struct obfs_t *obfs, struct buffer_t *buf, struct buffer_segments *segs) {
+    buffer_segments_append_buffer(segs, buf, 0, buf->len);
+    return true;
+}
+
 struct buffer_t * generic_server_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback) {
     if (need_decrypt) { *need_decrypt = true; }
     if (need_feedback) { *need_feedback = false; }
@@ -79,7 +85,7 @@ bool generic_server_udp_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf,
 void
 dispose_obfs(struct obfs_t *obfs)
 {
-    free(obfs);
+    ssr_free(ssr_alloc_obfs, obfs);
 }
 
 struct obfs_t *
@@ -115,32 +121,32 @@ new_obfs_instance(const char *plugin_name)
         return http_mix_new_obfs();
     } else if (ssr_obfs_tls_1_2_ticket_auth == obfs_type) {
         // tls1.2_ticket_auth
-        struct obfs_t * plugin = (struct obfs_t*)calloc(1, sizeof(struct obfs_t));
+        struct obfs_t * plugin = (struct obfs_t*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
         tls12_ticket_auth_new_obfs(plugin);
         return plugin;
     } else if (ssr_obfs_tls_1_2_ticket_fastauth == obfs_type) {
         // tls1.2_ticket_fastauth
-        struct obfs_t * plugin = (struct obfs_t*)calloc(1, sizeof(struct obfs_t));
+        struct obfs_t * plugin = (struct obfs_t*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
         tls12_ticket_fastauth_new_obfs(plugin);
         return plugin;
     } else if (ssr_protocol_verify_simple == protocol_type) {
         // verify_simple
-        struct obfs_t * plugin = (struct obfs_t*)calloc(1, sizeof(struct obfs_t));
+        struct obfs_t * plugin = (struct obfs_t*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
         verify_simple_new_obfs(plugin);
         return plugin;
     } else if (ssr_protocol_auth_simple == protocol_type) {
         // auth_simple
-        struct obfs_t * plugin = (struct obfs_t*)calloc(1, sizeof(struct obfs_t));
+        struct obfs_t * plugin = (struct obfs_t*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
         auth_simple_new_obfs(plugin);
         return plugin;
     } else if (ssr_protocol_auth_sha1 == protocol_type) {
         // auth_sha1
-        struct obfs_t * plugin = (struct obfs_t*)calloc(1, sizeof(struct obfs_t));
+        struct obfs_t * plugin = (struct obfs_t*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
         auth_sha1_new_obfs(plugin);
         return plugin;
     } else if (ssr_protocol_auth_sha1_v2 == protocol_type) {
         // auth_sha1_v2
-        struct obfs_t *plugin = (struct obfs_t*)calloc(1, sizeof(struct obfs_t));
+        struct obfs_t *plugin = (struct obfs_t*)ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct obfs_t));
         auth_sha1_v2_new_obfs(plugin);
         return plugin;
     } else if (ssr_protocol_auth_sha1_v4 == protocol_type) {
@@ -21,17 +21,32 @@
 #define SSR_BUFF_SIZE 2048
 #endif // !SSR_BUFF_SIZE
 
+// Largest IV or AEAD salt of any method, checked against ss_max_iv_length().
+#define OBFS_MAX_IV_LENGTH 32
+
+// Most of the decrypted stream a protocol's server_precheck() is shown.
+#define OBFS_PRECHECK_MAX 12
+
 struct buffer_t;
+struct buffer_segments;
 struct cipher_env_t;
+struct ssr_user_table;
+struct ssr_user;
+struct ssr_replay_table;
 
+/*
+ * Every tunnel carries two copies, one for the obfs and one for the
+ * protocol. The strings and the key only point into the server env and
+ * its config, which outlive all the tunnels created from them.
+ */
 struct server_info_t {
-    char host[256];
+    const char *host;
     uint16_t port;
     char *param;
     void *g_data;
     const uint8_t *iv;
     size_t iv_len;
-    uint8_t recv_iv[256];
+    uint8_t recv_iv[OBFS_MAX_IV_LENGTH];
     size_t recv_iv_len;
     uint8_t *key;
     uint16_t key_len;
@@ -40,6 +55,9 @@ struct server_info_t {
     uint16_t overhead;
     uint32_t buffer_size;
     struct cipher_env_t *cipher_env;
+    struct ssr_user_table *users; /* Server side, NULL for a single user. */
+    struct ssr_replay_table *replay_windows; /* Server side, NULL when not checked. */
+    bool adaptive_padding; /* Client asks for, server grants, less padding on bulk frames where the protocol can. */
 };
 
 struct obfs_t {
@@ -47,11 +65,17 @@ struct obfs_t {
     void *l_data;
 
     void * (*init_data)(void);
+    // optional, releases what init_data() returned when it holds more than one block.
+    void (*dispose_data)(void *data);
     size_t (*get_overhead)(struct obfs_t *obfs);
     bool (*need_feedback)(struct obfs_t *obfs);
     struct server_info_t * (*get_server_info)(struct obfs_t *obfs);
     void (*set_server_info)(struct obfs_t *obfs, struct server_info_t *server);
     void (*dispose)(struct obfs_t *obfs);
+    // optional, shrinks what the instance buffered to what it still holds.
+    void (*trim)(struct obfs_t *obfs);
+    // optional, server side, the account the handshake named, NULL before it or on a single-user port.
+    const struct ssr_user * (*get_user)(struct obfs_t *obfs);
 
     size_t (*client_pre_encrypt)(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity);
     ssize_t (*client_post_decrypt)(struct obfs_t *obfs, char **pplaindata, int datalength, size_t* capacity);
@@ -66,7 +90,13 @@ struct obfs_t {
     struct buffer_t * (*server_post_decrypt)(struct obfs_t *obfs, struct buffer_t *buf, bool *need_feedback);
 
     struct buffer_t * (*server_encode)(struct obfs_t *obfs, const struct buffer_t *buf);
+    // optional, appends the encoded output to |segs| referencing |buf| instead of copying it.
+    bool (*server_encode_segments)(struct obfs_t *obfs, struct buffer_t *buf, struct buffer_segments *segs);
     struct buffer_t * (*server_decode)(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback);
+    // optional, server side, false when the first bytes can't open a handshake, without decoding them:
+    // an obfs sees the first packet as received, a protocol the first bytes of the decrypted stream.
+    // Fewer bytes than it checks pass, the full decode has the last word.
+    bool (*server_precheck)(struct obfs_t *obfs, const uint8_t *data, size_t len);
 
     bool (*server_udp_pre_encrypt)(struct obfs_t *obfs, struct buffer_t *buf);
     bool (*server_udp_post_decrypt)(struct obfs_t *obfs, struct buffer_t *buf, uint32_t *uid);
@@ -86,6 +116,7 @@ void dispose_obfs(struct obfs_t *obfs);
 
 struct buffer_t * generic_server_pre_encrypt(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * generic_server_encode(struct obfs_t *obfs, const struct buffer_t *buf);
+bool generic_server_encode_segments(struct obfs_t *obfs, struct buffer_t *buf, struct buffer_segments *segs);
 struct buffer_t * generic_server_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback);
 struct buffer_t * generic_server_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, bool *need_feedback);
 bool generic_server_udp_pre_encrypt(struct obfs_t *obfs, struct buffer_t *buf);
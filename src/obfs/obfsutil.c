@@ -1,12 +1,14 @@
 #include <stdint.h>
-#include <time.h>
-#if !defined(_WIN32) && !defined(WIN32)
-#include <sys/time.h>
+#include <string.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
 #endif
 
 #include "obfsutil.h"
 #include "encrypt.h"
 #include "ssrbuffer.h"
+#include "ssrutils.h"
+#include "ssr_alloc.h"
 
 size_t get_s5_head_size(const uint8_t *plaindata, size_t size, size_t def_size) {
     if (plaindata == NULL || size < 2) {
@@ -20,21 +22,27 @@ size_t get_s5_head_size(const uint8_t *plaindata, size_t size, size_t def_size)
     }
 }
 
-static int shift128plus_init_flag = 0;
-static uint64_t shift128plus_s[2] = {0x10000000, 0xFFFFFFFF};
+// one generator per thread, ssr-server may run several event loops.
+// Only picks padding lengths, so it is seeded once and never rekeyed.
+static SS_THREAD_LOCAL int shift128plus_init_flag = 0;
+static SS_THREAD_LOCAL uint64_t shift128plus_s[2] = {0x10000000, 0xFFFFFFFF};
 
 void init_shift128plus(void) {
     if (shift128plus_init_flag == 0) {
-        uint32_t seed = (uint32_t)time(NULL);
         shift128plus_init_flag = 1;
-        shift128plus_s[0] = seed | 0x100000000L;
-        shift128plus_s[1] = ((uint64_t)seed << 32) | 0x1;
+        do {
+            rand_bytes((uint8_t *)shift128plus_s, sizeof(shift128plus_s));
+        } while (shift128plus_s[0] == 0 && shift128plus_s[1] == 0);
     }
 }
 
 uint64_t xorshift128plus(void) {
-    uint64_t x = shift128plus_s[0];
-    uint64_t const y = shift128plus_s[1];
+    uint64_t x, y;
+    if (shift128plus_init_flag == 0) {
+        init_shift128plus();
+    }
+    x = shift128plus_s[0];
+    y = shift128plus_s[1];
     shift128plus_s[0] = y;
     x ^= x << 23; // a
     x ^= x >> 17; // b
@@ -47,7 +55,7 @@ size_t ss_md5_hmac(uint8_t *auth, const uint8_t *msg, size_t msg_len, const uint
 {
     size_t result;
     size_t len = ss_max_iv_length() + ss_max_key_length();
-    uint8_t *auth_key = (uint8_t *) calloc(len, sizeof(auth_key[0]));
+    uint8_t *auth_key = (uint8_t *) ssr_calloc(ssr_alloc_obfs, len, sizeof(auth_key[0]));
     memcpy(auth_key, iv, enc_iv_len);
     memcpy(auth_key + enc_iv_len, enc_key, enc_key_len);
     {
@@ -55,7 +63,7 @@ size_t ss_md5_hmac(uint8_t *auth, const uint8_t *msg, size_t msg_len, const uint
         BUFFER_CONSTANT_INSTANCE(_key, auth_key, enc_iv_len + enc_key_len);
         result = ss_md5_hmac_with_key(auth, _msg, _key);
     }
-    free(auth_key);
+    ssr_free(ssr_alloc_obfs, auth_key);
     return result;
 }
 
@@ -63,7 +71,7 @@ size_t ss_sha1_hmac(uint8_t auth[20], const uint8_t *msg, size_t msg_len, const
 {
     size_t result;
     size_t len = ss_max_iv_length() + ss_max_key_length();
-    uint8_t *auth_key = (uint8_t *) calloc(len, sizeof(auth_key[0]));
+    uint8_t *auth_key = (uint8_t *) ssr_calloc(ssr_alloc_obfs, len, sizeof(auth_key[0]));
     memcpy(auth_key, iv, iv_len);
     memcpy(auth_key + iv_len, key, key_len);
     {
@@ -71,7 +79,7 @@ size_t ss_sha1_hmac(uint8_t auth[20], const uint8_t *msg, size_t msg_len, const
         BUFFER_CONSTANT_INSTANCE(_key, auth_key, iv_len + key_len);
         result = ss_sha1_hmac_with_key(auth, _msg, _key);
     }
-    free(auth_key);
+    ssr_free(ssr_alloc_obfs, auth_key);
     return result;
 }
 
@@ -82,3 +90,75 @@ void memintcopy_lt(void *mem, uint32_t val) {
     ((uint8_t *)mem)[3] = (uint8_t)(val >> 24);
 }
 
+size_t obfs_frame_in_place(struct obfs_t *obfs, const struct obfs_framing *framing, char **pplaindata, size_t datalength, size_t *capacity) {
+    size_t head = (framing->head_size < datalength) ? framing->head_size : datalength;
+    size_t rest = datalength - head;
+    size_t slack = (head ? framing->head_overhead : 0);
+    char *data, *out;
+
+    if (rest > 0) {
+        slack += (rest - 1) / framing->unit_size * framing->unit_overhead + framing->tail_overhead;
+    }
+    if (*capacity < datalength + slack) {
+        *pplaindata = (char *)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (datalength + slack) * 2);
+    }
+    // Every frame ends by |slack| at most past the data it framed.
+    out = *pplaindata;
+    data = out + slack;
+    memmove(data, out, datalength);
+    if (head > 0) {
+        out += framing->pack_head(obfs, data, head, out);
+        data += head;
+    }
+    while (rest > framing->unit_size) {
+        out += framing->pack(data, framing->unit_size, out);
+        data += framing->unit_size;
+        rest -= framing->unit_size;
+    }
+    if (rest > 0) {
+        out += framing->pack(data, rest, out);
+    }
+    return (size_t)(out - *pplaindata);
+}
+
+
+#if defined(_MSC_VER)
+#define CAS64(ptr, expected, desired) \
+    ((uint64_t)_InterlockedCompareExchange64((volatile __int64 *)(ptr), (__int64)(desired), (__int64)(expected)))
+#else
+#define CAS64(ptr, expected, desired) __sync_val_compare_and_swap((ptr), (expected), (desired))
+#endif
+
+static uint64_t conn_id_gen_fresh(void) {
+    uint32_t head, conn;
+    rand_bytes((uint8_t *)&head, sizeof(head));
+    rand_bytes((uint8_t *)&conn, sizeof(conn));
+    return ((uint64_t)head << 32) | (conn & 0xFFFFFF);
+}
+
+void conn_id_gen_init(struct conn_id_gen *gen) {
+    rand_bytes(gen->client_id_tail, sizeof(gen->client_id_tail));
+    gen->state = conn_id_gen_fresh();
+}
+
+uint32_t conn_id_gen_next(struct conn_id_gen *gen, uint8_t client_id[8]) {
+    uint64_t old = gen->state; // a torn read only costs one more round
+    uint64_t next, seen;
+    uint32_t head;
+    for (;;) {
+        next = old + 1;
+        if ((uint32_t)next > 0xFF000000) {
+            // counter is used up, roll over to a new client id
+            next = conn_id_gen_fresh();
+        }
+        seen = CAS64(&gen->state, old, next);
+        if (seen == old) {
+            break;
+        }
+        old = seen;
+    }
+    head = (uint32_t)(next >> 32);
+    memcpy(client_id, &head, sizeof(head));
+    memcpy(client_id + 4, gen->client_id_tail, sizeof(gen->client_id_tail));
+    return (uint32_t)next;
+}
@@ -1,6 +1,7 @@
 #ifndef _OBFS_OBFSUTIL_H
 #define _OBFS_OBFSUTIL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 size_t get_s5_head_size(const uint8_t *plaindata, size_t size, size_t def_size);
@@ -15,4 +16,39 @@ size_t ss_sha1_hmac(uint8_t auth[20], const uint8_t *msg, size_t msg_len, const
 
 void memintcopy_lt(void *mem, uint32_t val);
 
+struct obfs_t;
+
+/*
+ * The framing of the legacy protocols, verify_simple and auth_simple to
+ * auth_sha1_v4, done in the caller's buffer: the data is moved up by the
+ * most the frames can add, then packed forward, no frame reaching the data
+ * it has yet to read. One copy of the data and no scratch buffer.
+ */
+struct obfs_framing {
+    size_t unit_size;        /* Of the data of a frame. */
+    size_t head_size;        /* Of the first frame's data, made by pack_head(). 0 when there's none. */
+    size_t head_overhead;    /* The most pack_head() adds. */
+    size_t unit_overhead;    /* The most pack() adds to |unit_size| bytes. */
+    size_t tail_overhead;    /* And to the fewer of the last frame. */
+    size_t (*pack_head)(struct obfs_t *obfs, char *data, size_t datalength, char *outdata);
+    size_t (*pack)(char *data, size_t datalength, char *outdata);
+};
+
+/* Frames the |datalength| bytes of *pplaindata, growing it when they need more than |capacity|. */
+size_t obfs_frame_in_place(struct obfs_t *obfs, const struct obfs_framing *framing, char **pplaindata, size_t datalength, size_t *capacity);
+
+/*
+ * Client id and connection id allocation for the auth_* handshakes. The
+ * rolling half of the client id and the connection counter share one
+ * 64-bit word advanced with compare-and-swap, so a generator can be
+ * shared by any number of loops without a lock.
+ */
+struct conn_id_gen {
+    volatile uint64_t state;
+    uint8_t client_id_tail[4];
+};
+
+void conn_id_gen_init(struct conn_id_gen *gen);
+uint32_t conn_id_gen_next(struct conn_id_gen *gen, uint8_t client_id[8]);
+
 #endif // _OBFS_OBFSUTIL_H
@@ -16,25 +16,40 @@
 #include "encrypt.h"
 #include "ssrbuffer.h"
 #include "ssr_executive.h"
+#include "ssr_alloc.h"
 
 BUFFER_CONSTANT_INSTANCE(tls_version, "\x03\x03", 2);
 
+#define TLS12_TICKET_CACHE_SIZE 128
+#define TLS12_TICKET_LIFETIME (60 * 60)
+
+struct tls12_ticket_cache_entry {
+    uint8_t client_id[32];
+    time_t expire;
+};
+
 struct tls12_ticket_auth_global_data {
     uint8_t local_client_id[32];
+    // client side, the server granted us a session ticket good until then.
+    time_t ticket_expire;
+    // server side, fastauth clients that completed a handshake recently.
+    struct tls12_ticket_cache_entry tickets[TLS12_TICKET_CACHE_SIZE];
 };
 
 struct tls12_ticket_auth_local_data {
     int handshake_status;
-    struct buffer_t *send_buffer;
     struct buffer_t *recv_buffer;
     struct buffer_t *client_id;
     struct cstl_list *data_sent_buffer;
     uint32_t max_time_dif;
     int send_id;
     bool fastauth;
+    bool ticket; // server side, grant the client a session ticket
 };
 
 void tls12_ticket_auth_dispose(struct obfs_t *obfs);
+void tls12_ticket_auth_trim(struct obfs_t *obfs);
+bool tls12_ticket_auth_need_feedback(struct obfs_t *obfs);
 
 struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * tls12_ticket_auth_client_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *needsendback);
@@ -43,11 +58,122 @@ size_t tls12_ticket_auth_get_overhead(struct obfs_t *obfs);
 
 struct buffer_t * tls12_ticket_auth_server_pre_encrypt(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * tls12_ticket_auth_server_encode(struct obfs_t *obfs, const struct buffer_t *buf);
+bool tls12_ticket_auth_server_encode_segments(struct obfs_t *obfs, struct buffer_t *buf, struct buffer_segments *segs);
 struct buffer_t * tls12_ticket_auth_server_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback);
+bool tls12_ticket_auth_server_precheck(struct obfs_t *obfs, const uint8_t *data, size_t len);
 struct buffer_t * tls12_ticket_auth_server_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, bool *need_feedback);
 bool tls12_ticket_auth_server_udp_pre_encrypt(struct obfs_t *obfs, struct buffer_t *buf);
 bool tls12_ticket_auth_server_udp_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, uint32_t *uid);
 
+#define TLS_RECORD_HEADER_LEN 5
+
+/*
+ * Deframes application data records (17 03 03 length payload) from |buf|
+ * into |result|. Whole records are parsed in place in |buf| and each
+ * payload is copied once, straight into |result|. Only a record split
+ * across reads is kept in |pending|, which is completed from the next
+ * read. The first |magic_len| header bytes must match.
+ * Returns false on anything that is not an application data record.
+ */
+static bool tls12_ticket_auth_deframe(struct buffer_t *pending, const struct buffer_t *buf, size_t magic_len, struct buffer_t *result) {
+    static const uint8_t magic[] = { 0x17, 0x03, 0x03 };
+    const uint8_t *data = buf->buffer;
+    size_t left = buf->len;
+    size_t size;
+
+    buffer_realloc(result, result->len + pending->len + left);
+
+    while (pending->len > 0) {
+        size_t take;
+        if (pending->len < TLS_RECORD_HEADER_LEN) {
+            take = min(TLS_RECORD_HEADER_LEN - pending->len, left);
+            buffer_concatenate(pending, data, take);
+            data += take; left -= take;
+            if (pending->len < TLS_RECORD_HEADER_LEN) {
+                return true;
+            }
+        }
+        if (memcmp(pending->buffer, magic, magic_len) != 0) {
+            return false;
+        }
+        size = (size_t) ntohs(*((uint16_t *)(pending->buffer + 3)));
+        if (pending->len < TLS_RECORD_HEADER_LEN + size) {
+            take = min(TLS_RECORD_HEADER_LEN + size - pending->len, left);
+            buffer_concatenate(pending, data, take);
+            data += take; left -= take;
+            if (pending->len < TLS_RECORD_HEADER_LEN + size) {
+                return true;
+            }
+        }
+        buffer_concatenate(result, pending->buffer + TLS_RECORD_HEADER_LEN, size);
+        // more than one record is only left over from the handshake
+        buffer_shorten(pending, TLS_RECORD_HEADER_LEN + size, pending->len - (TLS_RECORD_HEADER_LEN + size));
+    }
+
+    while (left >= TLS_RECORD_HEADER_LEN) {
+        if (memcmp(data, magic, magic_len) != 0) {
+            return false;
+        }
+        size = (size_t) ntohs(*((uint16_t *)(data + 3)));
+        if (left < TLS_RECORD_HEADER_LEN + size) {
+            break;
+        }
+        memcpy(result->buffer + result->len, data + TLS_RECORD_HEADER_LEN, size);
+        result->len += size;
+        data += TLS_RECORD_HEADER_LEN + size;
+        left -= TLS_RECORD_HEADER_LEN + size;
+    }
+    if (left > 0) {
+        if (memcmp(data, magic, min(left, magic_len)) != 0) {
+            return false;
+        }
+        buffer_store(pending, data, left);
+    }
+    return true;
+}
+
+static bool tls12_ticket_cache_lookup(struct tls12_ticket_auth_global_data *global, const uint8_t client_id[32]) {
+    time_t now = time(NULL);
+    size_t i;
+    for (i = 0; i < TLS12_TICKET_CACHE_SIZE; ++i) {
+        struct tls12_ticket_cache_entry *entry = global->tickets + i;
+        if (entry->expire > now && memcmp(entry->client_id, client_id, 32) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void tls12_ticket_cache_insert(struct tls12_ticket_auth_global_data *global, const uint8_t client_id[32]) {
+    struct tls12_ticket_cache_entry *victim = global->tickets;
+    size_t i;
+    for (i = 0; i < TLS12_TICKET_CACHE_SIZE; ++i) {
+        struct tls12_ticket_cache_entry *entry = global->tickets + i;
+        if (memcmp(entry->client_id, client_id, 32) == 0) {
+            victim = entry;
+            break;
+        }
+        // expired entries have the oldest stamps, reuse them first.
+        if (entry->expire < victim->expire) {
+            victim = entry;
+        }
+    }
+    memcpy(victim->client_id, client_id, 32);
+    victim->expire = time(NULL) + TLS12_TICKET_LIFETIME;
+}
+
+/* Looks for a NewSessionTicket message in the server's handshake records. */
+static bool tls12_ticket_auth_has_ticket(const uint8_t *records, size_t len) {
+    size_t pos = 0;
+    while (pos + TLS_RECORD_HEADER_LEN < len) {
+        if (records[pos] == 0x16 && records[pos + TLS_RECORD_HEADER_LEN] == 0x04) {
+            return true;
+        }
+        pos += TLS_RECORD_HEADER_LEN + (size_t) ntohs(*((uint16_t *)(records + pos + 3)));
+    }
+    return false;
+}
+
 static void free_element(void* ptr) {
     struct buffer_t *p = *((struct buffer_t**)ptr);
     buffer_release(p);
@@ -61,17 +187,17 @@ static int compare_element(const void *left, const void *right) {
 
 static void tls12_ticket_auth_local_data_init(struct tls12_ticket_auth_local_data* local) {
     local->handshake_status = 0;
-    local->send_buffer = buffer_create(SSR_BUFF_SIZE);
-    local->recv_buffer = buffer_create(SSR_BUFF_SIZE);
-    local->client_id = buffer_create(SSR_BUFF_SIZE);
+    local->recv_buffer = buffer_create(0);
+    local->client_id = buffer_create(32);
     local->max_time_dif = 60 * 60 *24; // time dif (second) setting
     local->send_id = 0;
     local->fastauth = false;
+    local->ticket = false;
     local->data_sent_buffer = obj_list_create(compare_element, free_element);
 }
 
 void * tls12_ticket_auth_init_data(void) {
-    struct tls12_ticket_auth_global_data *global = (struct tls12_ticket_auth_global_data*) malloc(sizeof(struct tls12_ticket_auth_global_data));
+    struct tls12_ticket_auth_global_data *global = (struct tls12_ticket_auth_global_data*) ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct tls12_ticket_auth_global_data));
     rand_bytes(global->local_client_id, sizeof(global->local_client_id));
     return global;
 }
@@ -80,22 +206,25 @@ void tls12_ticket_auth_new_obfs(struct obfs_t * obfs) {
     struct tls12_ticket_auth_local_data *l_data = NULL;
     obfs->init_data = tls12_ticket_auth_init_data;
     obfs->get_overhead = tls12_ticket_auth_get_overhead;
-    obfs->need_feedback = need_feedback_true;
+    obfs->need_feedback = tls12_ticket_auth_need_feedback;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = tls12_ticket_auth_dispose;
+    obfs->trim = tls12_ticket_auth_trim;
 
     obfs->client_encode = tls12_ticket_auth_client_encode;
     obfs->client_decode = tls12_ticket_auth_client_decode;
 
     obfs->server_pre_encrypt = tls12_ticket_auth_server_pre_encrypt;
     obfs->server_encode = tls12_ticket_auth_server_encode;
+    obfs->server_encode_segments = tls12_ticket_auth_server_encode_segments;
     obfs->server_decode = tls12_ticket_auth_server_decode;
+    obfs->server_precheck = tls12_ticket_auth_server_precheck;
     obfs->server_post_decrypt = tls12_ticket_auth_server_post_decrypt;
     obfs->server_udp_pre_encrypt = generic_server_udp_pre_encrypt;
     obfs->server_udp_post_decrypt = generic_server_udp_post_decrypt;
 
-    l_data = (struct tls12_ticket_auth_local_data *) calloc(1, sizeof(struct tls12_ticket_auth_local_data));
+    l_data = (struct tls12_ticket_auth_local_data *) ssr_calloc(ssr_alloc_obfs, 1, sizeof(struct tls12_ticket_auth_local_data));
     tls12_ticket_auth_local_data_init(l_data);
     obfs->l_data = l_data;
 }
@@ -104,16 +233,26 @@ size_t tls12_ticket_auth_get_overhead(struct obfs_t *obfs) {
     return 5;
 }
 
+bool tls12_ticket_auth_need_feedback(struct obfs_t *obfs) {
+    struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
+    // a resumed client already sent its Finished along with the ClientHello.
+    return (local->handshake_status & 4) == 0;
+}
+
 void tls12_ticket_auth_dispose(struct obfs_t *obfs) {
     struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
-    buffer_release(local->send_buffer);
     buffer_release(local->recv_buffer);
     buffer_release(local->client_id);
     obj_list_destroy(local->data_sent_buffer);
-    free(local);
+    ssr_free(ssr_alloc_obfs, local);
     dispose_obfs(obfs);
 }
 
+void tls12_ticket_auth_trim(struct obfs_t *obfs) {
+    struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
+    buffer_trim(local->recv_buffer);
+}
+
 static void tls12_sha1_hmac(struct obfs_t *obfs,
                             const struct buffer_t *client_id,
                             const struct buffer_t *msg,
@@ -121,14 +260,14 @@ static void tls12_sha1_hmac(struct obfs_t *obfs,
 {
     size_t id_size = client_id->len;
     size_t key_size = obfs->server.key_len;
-    uint8_t *key = (uint8_t*)malloc(key_size + id_size);
+    uint8_t *key = (uint8_t*)ssr_malloc(ssr_alloc_obfs, key_size + id_size);
     memcpy(key, obfs->server.key, key_size);
     memcpy(key + key_size, client_id->buffer, id_size);
     {
         BUFFER_CONSTANT_INSTANCE(_key, key, (key_size + id_size));
         ss_sha1_hmac_with_key(digest, msg, _key);
     }
-    free(key);
+    ssr_free(ssr_alloc_obfs, key);
 }
 
 struct buffer_t * tls12_ticket_auth_sni(const char *url0) {
@@ -168,15 +307,58 @@ static int tls12_ticket_pack_auth_data(struct obfs_t *obfs, const struct buffer_
     return out_size;
 }
 
+#define TLS12_RECORD_DRAWS  32  /* Record sizes drawn per rand_bytes() call. */
+
+/* An application data record of |len| bytes of |data| written at |out|, the bytes it took. */
+static size_t _pack_record(uint8_t *out, const uint8_t *data, size_t len) {
+    memcpy(out, "\x17\x03\x03", 3);
+    out[3] = (uint8_t)(len >> 8);
+    out[4] = (uint8_t)len;
+    memcpy(out + 5, data, len);
+    return 5 + len;
+}
+
 static struct buffer_t * _pack_data(const uint8_t *encryptdata, size_t len) {
     struct buffer_t *result = buffer_create(5 + len);
-    uint8_t *iter = result->buffer;
+    result->len = _pack_record(result->buffer, encryptdata, len);
+    return result;
+}
 
-    memmove(iter, "\x17\x03\x03", 3);  iter += 3;
-    *((uint16_t *)(iter)) = htons((uint16_t)len);  iter += sizeof(uint16_t);
-    memcpy(iter, encryptdata, len);  iter += len;
+static size_t _next_draw(uint16_t draws[TLS12_RECORD_DRAWS], size_t *drawn) {
+    if (*drawn == TLS12_RECORD_DRAWS) {
+        rand_bytes((uint8_t *)draws, TLS12_RECORD_DRAWS * sizeof(draws[0]));
+        *drawn = 0;
+    }
+    return draws[(*drawn)++];
+}
 
-    result->len = iter - result->buffer;
+/*
+ * All of |encryptdata| cut into records in one pass, headers and slices
+ * written straight into a buffer sized for the most records it can take:
+ * short ones while |short_records|, up to 4 KiB ones above SSR_BUFF_SIZE.
+ */
+static struct buffer_t * _pack_records(const uint8_t *encryptdata, size_t datalength, bool short_records) {
+    // Records are 64 bytes and up, each with a 5 bytes header.
+    struct buffer_t *result = buffer_create(max((size_t)SSR_BUFF_SIZE, datalength + 5 * (datalength / 64 + 1)));
+    uint16_t draws[TLS12_RECORD_DRAWS];
+    size_t drawn = TLS12_RECORD_DRAWS;
+    size_t start = 0;
+
+    while (short_records && datalength - start > 256) {
+        size_t len = _next_draw(draws, &drawn) % 512 + 64;
+        if (len > datalength - start) { len = datalength - start; }
+        result->len += _pack_record(result->buffer + result->len, encryptdata + start, len);
+        start += len;
+    }
+    while (datalength - start > SSR_BUFF_SIZE) {
+        size_t len = _next_draw(draws, &drawn) % 4096 + 100;
+        if (len > datalength - start) { len = datalength - start; }
+        result->len += _pack_record(result->buffer + result->len, encryptdata + start, len);
+        start += len;
+    }
+    if (datalength - start > 0) {
+        result->len += _pack_record(result->buffer + result->len, encryptdata + start, datalength - start);
+    }
     return result;
 }
 
@@ -189,32 +371,10 @@ struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const str
     if (local->handshake_status == -1) {
         return buffer_clone(buf);
     }
-    result = buffer_create(SSR_BUFF_SIZE);
     if ((local->handshake_status & 4) == 4) {
-        size_t start = 0;
-        while (local->send_id <=4 && datalength - start > 256) {
-            struct buffer_t *tmp = NULL;
-            size_t len = (size_t)rand_integer() % 512 + 64;
-            if (len > datalength - start) { len = datalength - start; }
-            tmp = _pack_data(encryptdata + start, len);
-            buffer_concatenate2(result, tmp); buffer_release(tmp);
-            start += len;
-        }
-        while (datalength - start > SSR_BUFF_SIZE) {
-            struct buffer_t *tmp = NULL;
-            size_t len = (size_t)rand_integer() % 4096 + 100;
-            if (len > datalength - start) { len = datalength - start; }
-            tmp = _pack_data(encryptdata + start, len);
-            buffer_concatenate2(result, tmp); buffer_release(tmp);
-            start += len;
-        }
-        if (datalength - start > 0) {
-            struct buffer_t *tmp = NULL;
-            tmp = _pack_data(encryptdata + start, datalength - start);
-            buffer_concatenate2(result, tmp); buffer_release(tmp);
-        }
-        return result;
+        return _pack_records(encryptdata, datalength, local->send_id <= 4);
     }
+    result = buffer_create(SSR_BUFF_SIZE);
     if (datalength > 0) {
         struct buffer_t *tmp = _pack_data(encryptdata, datalength);
         size_t pos = obj_list_size(local->data_sent_buffer);
@@ -225,7 +385,7 @@ struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const str
             size_t finish_len_set[] = { 32, /* 40, 64, */ };
             int index = rand_integer() % (ARRAY_SIZE(finish_len_set));
             size_t finish_len = finish_len_set[index];
-            uint8_t *rnd = (uint8_t *)calloc(finish_len - 10, sizeof(*rnd));
+            uint8_t *rnd = (uint8_t *)ssr_calloc(ssr_alloc_obfs, finish_len - 10, sizeof(*rnd));
 #define CSTR_DECL(name, len, str) const char* (name) = (str); const size_t (len) = (sizeof(str) - 1)
             CSTR_DECL(handshake_finish, handshake_finish_len, "\x14\x03\x03\x00\x01\x01\x16\x03\x03");
 #undef CSTR_DECL
@@ -241,7 +401,7 @@ struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const str
 
             rand_bytes(rnd, finish_len - 10);
             buffer_concatenate(hmac_data, rnd, finish_len - 10);
-            free(rnd);
+            ssr_free(ssr_alloc_obfs, rnd);
 
             tls12_sha1_hmac(obfs, client_id, hmac_data, hash);
             buffer_concatenate(hmac_data, hash, 10);
@@ -273,7 +433,7 @@ struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const str
 #undef CSTR_DECL
 
         char *hosts = NULL;
-        char *param = NULL;
+        const char *param = NULL;
         char *phost[128] = { NULL };
         size_t host_num = 0;
         size_t pos;
@@ -298,7 +458,7 @@ struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const str
         } else {
             param = obfs->server.host;
         }
-        hosts = (char *) calloc(strlen(param)+1, sizeof(*hosts));
+        hosts = (char *) ssr_calloc(ssr_alloc_obfs, strlen(param)+1, sizeof(*hosts));
         strcpy(hosts, param);
         phost[host_num++] = hosts;
         for (pos = 0; hosts[pos]; ++pos) {
@@ -310,20 +470,20 @@ struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const str
         host_num = (size_t)rand_integer() % host_num;
         sni = tls12_ticket_auth_sni(phost[host_num]);
         buffer_concatenate2(ext_buf, sni); // <====
-        free(hosts);
+        ssr_free(ssr_alloc_obfs, hosts);
         buffer_release(sni);
 
         buffer_concatenate(ext_buf, (uint8_t *)tls_data2, tls_data2_len);
         {
             size_t ticket_size = (32 + rand_integer() % (196 - 32)) * 2;
             uint16_t size = htons((uint16_t)ticket_size);
-            uint8_t *ticket = (uint8_t *)calloc(ticket_size + 1, sizeof(*ticket));
+            uint8_t *ticket = (uint8_t *)ssr_calloc(ssr_alloc_obfs, ticket_size + 1, sizeof(*ticket));
 
             rand_bytes(ticket, ticket_size);
             buffer_concatenate(ext_buf, (uint8_t *)&size, sizeof(size));
             buffer_concatenate(ext_buf, ticket, ticket_size);
 
-            free(ticket);
+            ssr_free(ssr_alloc_obfs, ticket);
         }
         buffer_concatenate(ext_buf, (uint8_t *)tls_data3, tls_data3_len);
         temp = htons((uint16_t)ext_buf->len);
@@ -352,6 +512,13 @@ struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const str
 
         local->handshake_status |= 1;
 
+        if (local->fastauth && global->ticket_expire > time(NULL)) {
+            // resume, send the Finished and queued data right behind the ClientHello.
+            BUFFER_CONSTANT_INSTANCE(empty, "", 0);
+            struct buffer_t *tmp = tls12_ticket_auth_client_encode(obfs, empty);
+            buffer_concatenate2(result, tmp); buffer_release(tmp);
+        }
+
         return result;
     }
 }
@@ -362,24 +529,14 @@ struct buffer_t * tls12_ticket_auth_client_decode(struct obfs_t *obfs, const str
     struct tls12_ticket_auth_global_data *global = (struct tls12_ticket_auth_global_data*)obfs->server.g_data;
 
     *needsendback = false;
-    buffer_concatenate2(local->recv_buffer, buf);
 
     if ((local->handshake_status & 8) == 8) {
-        while (local->recv_buffer->len > 5) {
-            size_t size;
-            if (local->recv_buffer->buffer[0] != 0x17) {
-                buffer_release(result); result = NULL;
-                return result;
-            }
-            size = (size_t)ntohs(*((uint16_t *)(local->recv_buffer->buffer + 3)));
-            if (size + 5 > local->recv_buffer->len) {
-                break;
-            }
-            buffer_concatenate(result, local->recv_buffer->buffer + 5, size);
-            buffer_shorten(local->recv_buffer, 5 + size, local->recv_buffer->len - (5 + size));
+        if (!tls12_ticket_auth_deframe(local->recv_buffer, buf, 1, result)) {
+            buffer_release(result); result = NULL;
         }
         return result;
     }
+    buffer_concatenate2(local->recv_buffer, buf);
     if (local->recv_buffer->len < 11 + 32 + 1 + 32) {
         buffer_reset(result);
         return result;
@@ -426,6 +583,9 @@ struct buffer_t * tls12_ticket_auth_client_decode(struct obfs_t *obfs, const str
                 }
             }
         }
+        if (local->fastauth && tls12_ticket_auth_has_ticket(local->recv_buffer->buffer, headerlength)) {
+            global->ticket_expire = time(NULL) + TLS12_TICKET_LIFETIME;
+        }
         buffer_shorten(local->recv_buffer, headerlength, local->recv_buffer->len - headerlength);
 
         local->handshake_status |= 8;
@@ -433,7 +593,8 @@ struct buffer_t * tls12_ticket_auth_client_decode(struct obfs_t *obfs, const str
         buffer_release(result);
         result = tls12_ticket_auth_client_decode(obfs, empty, needsendback);
 
-        *needsendback = true;
+        // nothing is left to send back if the Finished went out with the ClientHello.
+        *needsendback = ((local->handshake_status & 4) == 0);
         return result;
     }
 }
@@ -466,7 +627,7 @@ struct buffer_t * tls12_ticket_auth_server_encode(struct obfs_t *obfs, const str
             buffer_concatenate(ret, (uint8_t *)&size2, sizeof(size2));
             buffer_concatenate(ret, input->buffer, size);
 
-            buffer_shorten(input, size, input->len - size);
+            buffer_consume(input, size);
         }
         if (input->len > 0) {
             size2 = htons((uint16_t)input->len);
@@ -515,7 +676,7 @@ struct buffer_t * tls12_ticket_auth_server_encode(struct obfs_t *obfs, const str
 
         srand((unsigned int)time((time_t *)NULL));
 
-        if ((rand_integer() % 8) < 1) {
+        if (local->ticket || (rand_integer() % 8) < 1) {
             rand_bytes(rand_buf, 2);
             size = (size_t)((ntohs(*((uint16_t *)rand_buf)) % 164) * 2 + 64);
             rand_bytes(rand_buf, (int)size);
@@ -567,6 +728,48 @@ struct buffer_t * tls12_ticket_auth_server_encode(struct obfs_t *obfs, const str
     }
 }
 
+bool tls12_ticket_auth_server_encode_segments(struct obfs_t *obfs, struct buffer_t *buf, struct buffer_segments *segs) {
+    struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
+    uint8_t rand_buf[2] = { 0 };
+    uint8_t header[5] = { 0x17, 0x03, 0x03, 0, 0 };
+    size_t offset = 0;
+    size_t size = 0;
+    uint16_t size2 = 0;
+
+    if (local->handshake_status == -1) {
+        buffer_segments_append_buffer(segs, buf, 0, buf->len);
+        return true;
+    }
+    if ((local->handshake_status & 8) != 8) {
+        // the handshake happens once per connection, the flat encoder is good enough.
+        struct buffer_t *tmp = tls12_ticket_auth_server_encode(obfs, buf);
+        buffer_segments_append_buffer(segs, tmp, 0, tmp->len);
+        buffer_release(tmp);
+        return true;
+    }
+
+    // same framing as tls12_ticket_auth_server_encode, but the application data
+    // records only reference the payload.
+    while ((buf->len - offset) > SSR_BUFF_SIZE) {
+        rand_bytes(rand_buf, 2);
+        size = min((size_t)ntohs(*((uint16_t *)rand_buf)) % 4096 + 100, buf->len - offset);
+        size2 = htons((uint16_t)size);
+        memcpy(header + 3, &size2, sizeof(size2));
+
+        buffer_segments_append_data(segs, header, sizeof(header));
+        buffer_segments_append_buffer(segs, buf, offset, size);
+        offset += size;
+    }
+    if (buf->len > offset) {
+        size2 = htons((uint16_t)(buf->len - offset));
+        memcpy(header + 3, &size2, sizeof(size2));
+
+        buffer_segments_append_data(segs, header, sizeof(header));
+        buffer_segments_append_buffer(segs, buf, offset, buf->len - offset);
+    }
+    return true;
+}
+
 struct buffer_t * decode_error_return(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback) {
     struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
     struct tls12_ticket_auth_global_data *global = (struct tls12_ticket_auth_global_data*)obfs->server.g_data;
@@ -590,6 +793,42 @@ struct buffer_t * decode_error_return(struct obfs_t *obfs, const struct buffer_t
     return buffer_clone(buf);
 }
 
+#define TLS_CLIENT_HELLO_MIN 71     /* Handshake header, version, random, and a 32 byte session id after its length. */
+#define TLS_RECORD_MAX       16384  /* RFC 5246, 6.2.1. */
+
+/*
+ * The framing of the ClientHello server_decode() expects, by offset:
+ * 16 03 01, the record length, 01 00 and the handshake length, the record
+ * length less 4, 03 03, the random and the session id length, 32 or more.
+ * No copy and no HMAC-SHA1, as far as the first packet goes.
+ */
+bool tls12_ticket_auth_server_precheck(struct obfs_t *obfs, const uint8_t *data, size_t len) {
+    static const uint8_t record[] = { 0x16, 0x03, 0x01 };
+    size_t record_len;
+    (void)obfs;
+
+    if (memcmp(data, record, min(len, sizeof(record))) != 0) {
+        return false;
+    }
+    if (len < TLS_RECORD_HEADER_LEN) {
+        return true;
+    }
+    record_len = ((size_t)data[3] << 8) | data[4];
+    if (record_len < TLS_CLIENT_HELLO_MIN || record_len > TLS_RECORD_MAX) {
+        return false;
+    }
+    if ((len > 5 && data[5] != 0x01) || (len > 6 && data[6] != 0x00)) {
+        return false;
+    }
+    if (len > 8 && (((size_t)data[7] << 8) | data[8]) != record_len - 4) {
+        return false;
+    }
+    if (len > 9 && memcmp(data + 9, tls_version->buffer, min(len - 9, tls_version->len)) != 0) {
+        return false;
+    }
+    return len <= 43 || data[43] >= 32;
+}
+
 struct buffer_t * tls12_ticket_auth_server_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback) {
     struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
     struct tls12_ticket_auth_global_data *global = (struct tls12_ticket_auth_global_data*)obfs->server.g_data;
@@ -608,24 +847,9 @@ struct buffer_t * tls12_ticket_auth_server_decode(struct obfs_t *obfs, const str
     }
     if ((local->handshake_status & 4) == 4) {
         result = buffer_create(SSR_BUFF_SIZE);
-        buffer_concatenate2(local->recv_buffer, buf);
-        while (local->recv_buffer->len > 5) {
-            uint8_t *beginning = local->recv_buffer->buffer;
-            size_t size = 0;
-            size_t thunk_size = 0;
-            if (memcmp(beginning, "\x17\x03\x03", 3) != 0) {
-                buffer_release(result); result = NULL;
-                return result;
-            }
-            size = (size_t) ntohs( *((uint16_t *)(beginning+3)) ); // uint16_t
-            thunk_size = size + 5;
-            if (local->recv_buffer->len < thunk_size) {
-                break;
-            }
-            buffer_concatenate(result, beginning + 5, size);
-
-            buffer_shorten(local->recv_buffer, thunk_size, local->recv_buffer->len - thunk_size);
-         }
+        if (!tls12_ticket_auth_deframe(local->recv_buffer, buf, 3, result)) {
+            buffer_release(result); result = NULL;
+        }
         return result;
     }
     if ((local->handshake_status & 1) == 1) {
@@ -702,6 +926,10 @@ struct buffer_t * tls12_ticket_auth_server_decode(struct obfs_t *obfs, const str
 
         local->handshake_status |= 4;
 
+        if (local->fastauth && local->client_id->len == 32) {
+            tls12_ticket_cache_insert(global, local->client_id->buffer);
+        }
+
         return tls12_ticket_auth_server_decode(obfs, empty_buf, need_decrypt, need_feedback);
     }
     do {
@@ -785,6 +1013,9 @@ struct buffer_t * tls12_ticket_auth_server_decode(struct obfs_t *obfs, const str
             result = decode_error_return(obfs, ogn_buf, need_decrypt, need_feedback);
             break;
         }
+        if (local->fastauth && local->client_id->len == 32) {
+            local->ticket = tls12_ticket_cache_lookup(global, local->client_id->buffer);
+        }
         //if self.server_info.data.client_data.get(verifyid[:22]):
         //    logging.info("replay attack detect, id = %s" % (binascii.hexlify(verifyid)))
         //    return self.decode_error_return(ogn_buf)
@@ -5,6 +5,7 @@
 #include "crc32.h"
 #include "obfs.h"
 #include "encrypt.h"
+#include "ssr_alloc.h"
 
 static int verify_simple_pack_unit_size = 2000;
 
@@ -14,12 +15,13 @@ typedef struct verify_simple_local_data {
 }verify_simple_local_data;
 
 void verify_simple_local_data_init(verify_simple_local_data* local) {
-    local->recv_buffer = (char*)malloc(16384);
+    local->recv_buffer = (char*)ssr_malloc(ssr_alloc_obfs, 16384);
     local->recv_buffer_size = 0;
 }
 
 void verify_simple_new_obfs(struct obfs_t * obfs) {
     obfs->init_data = init_data;
+    obfs->get_overhead = get_overhead;
     obfs->need_feedback = need_feedback_false;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
@@ -30,24 +32,25 @@ void verify_simple_new_obfs(struct obfs_t * obfs) {
     obfs->client_udp_pre_encrypt = NULL;
     obfs->client_udp_post_decrypt = NULL;
 
-    obfs->l_data = malloc(sizeof(verify_simple_local_data));
+    obfs->l_data = ssr_malloc(ssr_alloc_obfs, sizeof(verify_simple_local_data));
     verify_simple_local_data_init((verify_simple_local_data*)obfs->l_data);
 }
 
 void verify_simple_dispose(struct obfs_t *obfs) {
     verify_simple_local_data *local = (verify_simple_local_data*)obfs->l_data;
     if (local->recv_buffer != NULL) {
-        free(local->recv_buffer);
+        ssr_free(ssr_alloc_obfs, local->recv_buffer);
         local->recv_buffer = NULL;
     }
-    free(local);
+    ssr_free(ssr_alloc_obfs, local);
     obfs->l_data = NULL;
     dispose_obfs(obfs);
 }
 
-int verify_simple_pack_data(char *data, int datalength, char *outdata) {
+/* Adds 22 bytes at most. */
+static size_t verify_simple_pack_data(char *data, size_t datalength, char *outdata) {
     unsigned char rand_len = (xorshift128plus() & 0xF) + 1;
-    int out_size = rand_len + datalength + 6;
+    size_t out_size = rand_len + datalength + 6;
     outdata[0] = (char)(out_size >> 8);
     outdata[1] = (char)out_size;
     rand_bytes((uint8_t *)outdata + 2, rand_len); // note: first byte is the length.
@@ -58,31 +61,12 @@ int verify_simple_pack_data(char *data, int datalength, char *outdata) {
 }
 
 size_t verify_simple_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t *capacity) {
-    char *plaindata = *pplaindata;
-    //verify_simple_local_data *local = (verify_simple_local_data*)obfs->l_data;
-    char * out_buffer = (char*)malloc((size_t)(datalength * 2 + 32));
-    char * buffer = out_buffer;
-    char * data = plaindata;
-    int len = (int) datalength;
-    int pack_len;
-    while ( len > verify_simple_pack_unit_size ) {
-        pack_len = verify_simple_pack_data(data, verify_simple_pack_unit_size, buffer);
-        buffer += pack_len;
-        data += verify_simple_pack_unit_size;
-        len -= verify_simple_pack_unit_size;
-    }
-    if (len > 0) {
-        pack_len = verify_simple_pack_data(data, len, buffer);
-        buffer += pack_len;
-    }
-    len = (int)(buffer - out_buffer);
-    if ((int)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
-        plaindata = *pplaindata;
-    }
-    memmove(plaindata, out_buffer, len);
-    free(out_buffer);
-    return len;
+    struct obfs_framing framing = { 0 };
+    framing.unit_size = (size_t)verify_simple_pack_unit_size;
+    framing.unit_overhead = 22;
+    framing.tail_overhead = 22;
+    framing.pack = verify_simple_pack_data;
+    return obfs_frame_in_place(obfs, &framing, pplaindata, datalength, capacity);
 }
 
 ssize_t verify_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int datalength, size_t *capacity) {
@@ -98,7 +82,7 @@ ssize_t verify_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata
     memmove(recv_buffer + local->recv_buffer_size, plaindata, datalength);
     local->recv_buffer_size += datalength;
 
-    out_buffer = (char*)malloc((size_t)local->recv_buffer_size);
+    out_buffer = (char*)ssr_malloc(ssr_alloc_obfs, (size_t)local->recv_buffer_size);
     buffer = out_buffer;
     while (local->recv_buffer_size > 2) {
         int length = ((int)recv_buffer[0] << 8) | recv_buffer[1];
@@ -106,7 +90,7 @@ ssize_t verify_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata
         int data_size;
 
         if (length >= 8192 || length < 7) {
-            free(out_buffer);
+            ssr_free(ssr_alloc_obfs, out_buffer);
             local->recv_buffer_size = 0;
             return -1;
         }
@@ -115,7 +99,7 @@ ssize_t verify_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata
 
         crc = (int)crc32_imp((unsigned char*)recv_buffer, (unsigned int)length);
         if (crc != -1) {
-            free(out_buffer);
+            ssr_free(ssr_alloc_obfs, out_buffer);
             local->recv_buffer_size = 0;
             return -1;
         }
@@ -126,11 +110,11 @@ ssize_t verify_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata
     }
     len = (int)(buffer - out_buffer);
     if ((int)*capacity < len) {
-        *pplaindata = (char*)realloc(*pplaindata, *capacity = (size_t)(len * 2));
+        *pplaindata = (char*)ssr_realloc(ssr_alloc_buffers, *pplaindata, *capacity = (size_t)(len * 2));
         plaindata = *pplaindata;
     }
     memmove(plaindata, out_buffer, len);
-    free(out_buffer);
+    ssr_free(ssr_alloc_obfs, out_buffer);
     return len;
 }
 
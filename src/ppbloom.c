@@ -0,0 +1,206 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "ppbloom.h"
+
+#define PPBLOOM_MIN_ENTRIES     1024
+#define PPBLOOM_MAX_HASHES      32
+
+struct ppbloom {
+    uv_mutex_t lock;
+    int ref_count;
+    size_t entries;     /* Insertions before the filters swap. */
+    size_t bits;        /* Per filter, a multiple of 64. */
+    unsigned int hashes;
+    size_t count;       /* Insertions into the active filter. */
+    int current;
+    uint64_t *filter[2];
+    struct ppbloom_hash *journal;  /* With ppbloom_journal(), items recorded since it was last taken. */
+    size_t journal_count;
+    size_t journal_capacity;
+    uint64_t journal_dropped;
+};
+
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Two independent 64-bit hashes, the k probes are derived by double hashing. */
+static void hash2(const void *data, size_t len, uint64_t *h1, uint64_t *h2) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t a = 0xcbf29ce484222325ULL;
+    uint64_t b = 0x84222325cbf29ce4ULL ^ (uint64_t)len;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        a = (a ^ p[i]) * 0x100000001b3ULL;
+        b = (b + p[i]) * 0x9e3779b97f4a7c15ULL;
+    }
+    *h1 = mix64(a);
+    *h2 = mix64(b) | 1;
+}
+
+static bool filter_test(const struct ppbloom *bloom, const uint64_t *filter, uint64_t h1, uint64_t h2) {
+    unsigned int i;
+    for (i = 0; i < bloom->hashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % bloom->bits;
+        if ((filter[bit >> 6] & (1ULL << (bit & 63))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void filter_set(const struct ppbloom *bloom, uint64_t *filter, uint64_t h1, uint64_t h2) {
+    unsigned int i;
+    for (i = 0; i < bloom->hashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % bloom->bits;
+        filter[bit >> 6] |= (1ULL << (bit & 63));
+    }
+}
+
+struct ppbloom * ppbloom_create(size_t entries, double error) {
+    struct ppbloom *bloom;
+    double ln2 = log(2.0);
+    double bits;
+
+    if (entries < PPBLOOM_MIN_ENTRIES) {
+        entries = PPBLOOM_MIN_ENTRIES;
+    }
+    if (error <= 0.0 || error >= 1.0) {
+        error = 1e-6;
+    }
+    bloom = (struct ppbloom *) calloc(1, sizeof(*bloom));
+    // Lookups consult both filters, so each gets half the error budget.
+    bits = ceil(-(double)entries * log(error / 2) / (ln2 * ln2));
+    bloom->bits = ((size_t)bits + 63) & ~(size_t)63;
+    bloom->hashes = (unsigned int) ceil(ln2 * (double)bloom->bits / (double)entries);
+    if (bloom->hashes < 1) {
+        bloom->hashes = 1;
+    } else if (bloom->hashes > PPBLOOM_MAX_HASHES) {
+        bloom->hashes = PPBLOOM_MAX_HASHES;
+    }
+    bloom->entries = entries;
+    bloom->filter[0] = (uint64_t *) calloc(bloom->bits / 64, sizeof(uint64_t));
+    bloom->filter[1] = (uint64_t *) calloc(bloom->bits / 64, sizeof(uint64_t));
+    bloom->ref_count = 1;
+    uv_mutex_init(&bloom->lock);
+    return bloom;
+}
+
+void ppbloom_add_ref(struct ppbloom *bloom) {
+    if (bloom) {
+        uv_mutex_lock(&bloom->lock);
+        bloom->ref_count++;
+        uv_mutex_unlock(&bloom->lock);
+    }
+}
+
+void ppbloom_release(struct ppbloom *bloom) {
+    int ref_count;
+    if (bloom == NULL) {
+        return;
+    }
+    uv_mutex_lock(&bloom->lock);
+    ref_count = --bloom->ref_count;
+    uv_mutex_unlock(&bloom->lock);
+    if (ref_count > 0) {
+        return;
+    }
+    uv_mutex_destroy(&bloom->lock);
+    free(bloom->filter[0]);
+    free(bloom->filter[1]);
+    free(bloom->journal);
+    free(bloom);
+}
+
+/* Under the lock, true when it was there already. */
+static bool bloom_check_add(struct ppbloom *bloom, uint64_t h1, uint64_t h2) {
+    if (filter_test(bloom, bloom->filter[bloom->current], h1, h2)
+        || filter_test(bloom, bloom->filter[!bloom->current], h1, h2)) {
+        return true;
+    }
+    if (bloom->count >= bloom->entries) {
+        bloom->current = !bloom->current;
+        memset(bloom->filter[bloom->current], 0, bloom->bits / 8);
+        bloom->count = 0;
+    }
+    filter_set(bloom, bloom->filter[bloom->current], h1, h2);
+    bloom->count++;
+    return false;
+}
+
+bool ppbloom_check_add(struct ppbloom *bloom, const void *data, size_t len) {
+    uint64_t h1, h2;
+    bool seen;
+    hash2(data, len, &h1, &h2);
+
+    uv_mutex_lock(&bloom->lock);
+    seen = bloom_check_add(bloom, h1, h2);
+    if (seen == false && bloom->journal) {
+        if (bloom->journal_count < bloom->journal_capacity) {
+            bloom->journal[bloom->journal_count].h1 = h1;
+            bloom->journal[bloom->journal_count].h2 = h2;
+            bloom->journal_count++;
+        } else {
+            bloom->journal_dropped++;
+        }
+    }
+    uv_mutex_unlock(&bloom->lock);
+    return seen;
+}
+
+void ppbloom_journal(struct ppbloom *bloom, size_t capacity) {
+    struct ppbloom_hash *journal = NULL;
+    if (bloom == NULL) {
+        return;
+    }
+    if (capacity) {
+        journal = (struct ppbloom_hash *) calloc(capacity, sizeof(*journal));
+    }
+    uv_mutex_lock(&bloom->lock);
+    free(bloom->journal);
+    bloom->journal = journal;
+    bloom->journal_capacity = journal ? capacity : 0;
+    bloom->journal_count = 0;
+    uv_mutex_unlock(&bloom->lock);
+}
+
+size_t ppbloom_take_journal(struct ppbloom *bloom, struct ppbloom_hash *out, size_t max, uint64_t *dropped) {
+    size_t count;
+    if (bloom == NULL) {
+        return 0;
+    }
+    uv_mutex_lock(&bloom->lock);
+    count = (bloom->journal_count < max) ? bloom->journal_count : max;
+    if (count) {
+        memcpy(out, bloom->journal, count * sizeof(*out));
+        bloom->journal_count -= count;
+        memmove(bloom->journal, bloom->journal + count, bloom->journal_count * sizeof(*out));
+    }
+    if (dropped) {
+        *dropped += bloom->journal_dropped;
+    }
+    bloom->journal_dropped = 0;
+    uv_mutex_unlock(&bloom->lock);
+    return count;
+}
+
+void ppbloom_merge(struct ppbloom *bloom, const struct ppbloom_hash *hashes, size_t count) {
+    size_t i;
+    if (bloom == NULL) {
+        return;
+    }
+    uv_mutex_lock(&bloom->lock);
+    for (i = 0; i < count; ++i) {
+        // The probes need h2 odd, whatever came over the wire.
+        (void)bloom_check_add(bloom, hashes[i].h1, hashes[i].h2 | 1);
+    }
+    uv_mutex_unlock(&bloom->lock);
+}
@@ -0,0 +1,43 @@
+#if !defined(__ppbloom_h__)
+#define __ppbloom_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ping-pong Bloom filter for IV replay detection. Two fixed size filters
+ * take turns: new IVs go into the active one, lookups consult both, and
+ * once the active one holds |entries| items the older one is wiped and
+ * becomes active. Every IV seen within the last |entries| insertions is
+ * therefore remembered, with at most |error| false positives, in memory
+ * allocated once at creation. Thread safe and reference counted so that
+ * all worker loops of one server can share a single instance.
+ */
+
+struct ppbloom;
+
+/* What an item is probed by, whatever the size of the filter. */
+struct ppbloom_hash {
+    uint64_t h1;
+    uint64_t h2;
+};
+
+struct ppbloom * ppbloom_create(size_t entries, double error);
+void ppbloom_add_ref(struct ppbloom *bloom);
+void ppbloom_release(struct ppbloom *bloom);
+/* Returns true when |data| was seen before, otherwise records it. */
+bool ppbloom_check_add(struct ppbloom *bloom, const void *data, size_t len);
+
+/*
+ * For ssr_cluster: the hashes of up to |capacity| items ppbloom_check_add()
+ * records are kept until ppbloom_take_journal() takes them, those past
+ * |capacity| only counted.
+ */
+void ppbloom_journal(struct ppbloom *bloom, size_t capacity);
+/* Moves up to |max| journaled hashes to |out|, the count, adding those dropped since to |*dropped|. */
+size_t ppbloom_take_journal(struct ppbloom *bloom, struct ppbloom_hash *out, size_t max, uint64_t *dropped);
+/* Records items another process saw, not journaled. */
+void ppbloom_merge(struct ppbloom *bloom, const struct ppbloom_hash *hashes, size_t count);
+
+#endif // !defined(__ppbloom_h__)
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "ptr_map.h"
+
+#define PTR_MAP_MIN_CAPACITY  16
+
+struct ptr_map_slot {
+    const void *key;  /* NULL while empty. */
+    void *value;
+};
+
+struct ptr_map {
+    struct ptr_map_slot *slots;
+    size_t mask;  /* Slot count less one, the count is a power of two. */
+    unsigned int shift;  /* 64 less the bits of the slot count. */
+    size_t count;
+};
+
+/* Fibonacci hashing, the high bits of the product spread aligned addresses well. */
+static size_t ptr_map_home(const struct ptr_map *map, const void *key) {
+    return (size_t)(((uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ull) >> map->shift);
+}
+
+/* How far the key in |index| sits from its home slot. */
+static size_t ptr_map_distance(const struct ptr_map *map, size_t index) {
+    return (index - ptr_map_home(map, map->slots[index].key)) & map->mask;
+}
+
+static bool ptr_map_alloc(struct ptr_map *map, size_t slot_count) {
+    unsigned int bits = 0;
+    map->slots = (struct ptr_map_slot *) calloc(slot_count, sizeof(struct ptr_map_slot));
+    if (map->slots == NULL) {
+        return false;
+    }
+    while (((size_t)1 << bits) < slot_count) {
+        bits++;
+    }
+    map->mask = slot_count - 1;
+    map->shift = 64 - bits;
+    map->count = 0;
+    return true;
+}
+
+static void ptr_map_place(struct ptr_map *map, const void *key, void *value) {
+    size_t index = ptr_map_home(map, key);
+    size_t distance = 0;
+    for (;;) {
+        struct ptr_map_slot *slot = &map->slots[index];
+        size_t other;
+        if (slot->key == NULL) {
+            slot->key = key;
+            slot->value = value;
+            map->count++;
+            return;
+        }
+        // Robin Hood: the key further from home takes the slot, the richer one moves on.
+        other = ptr_map_distance(map, index);
+        if (other < distance) {
+            struct ptr_map_slot evicted = *slot;
+            slot->key = key;
+            slot->value = value;
+            key = evicted.key;
+            value = evicted.value;
+            distance = other;
+        }
+        index = (index + 1) & map->mask;
+        distance++;
+    }
+}
+
+static bool ptr_map_grow(struct ptr_map *map) {
+    struct ptr_map_slot *old_slots = map->slots;
+    size_t old_count = map->mask + 1;
+    size_t i;
+    if (ptr_map_alloc(map, old_count * 2) == false) {
+        map->slots = old_slots;
+        return false;
+    }
+    for (i = 0; i < old_count; ++i) {
+        if (old_slots[i].key) {
+            ptr_map_place(map, old_slots[i].key, old_slots[i].value);
+        }
+    }
+    free(old_slots);
+    return true;
+}
+
+/* The slot holding |key|, or -1. The scan stops at the first key closer to its home than |key| would be. */
+static long ptr_map_lookup(const struct ptr_map *map, const void *key) {
+    size_t index = ptr_map_home(map, key);
+    size_t distance = 0;
+    while (map->slots[index].key != NULL && ptr_map_distance(map, index) >= distance) {
+        if (map->slots[index].key == key) {
+            return (long)index;
+        }
+        index = (index + 1) & map->mask;
+        distance++;
+    }
+    return -1;
+}
+
+struct ptr_map * ptr_map_create(size_t capacity) {
+    struct ptr_map *map = (struct ptr_map *) calloc(1, sizeof(*map));
+    size_t slot_count = PTR_MAP_MIN_CAPACITY;
+    if (map == NULL) {
+        return NULL;
+    }
+    // Kept at most 3/4 full.
+    while (slot_count / 4 * 3 < capacity) {
+        slot_count *= 2;
+    }
+    if (ptr_map_alloc(map, slot_count) == false) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void ptr_map_destroy(struct ptr_map *map) {
+    if (map == NULL) {
+        return;
+    }
+    free(map->slots);
+    free(map);
+}
+
+bool ptr_map_insert(struct ptr_map *map, const void *key, void *value) {
+    if (key == NULL || ptr_map_lookup(map, key) >= 0) {
+        return false;
+    }
+    if ((map->count + 1) * 4 > (map->mask + 1) * 3 && ptr_map_grow(map) == false) {
+        return false;
+    }
+    ptr_map_place(map, key, value);
+    return true;
+}
+
+bool ptr_map_contains(const struct ptr_map *map, const void *key) {
+    return ptr_map_lookup(map, key) >= 0;
+}
+
+void * ptr_map_find(const struct ptr_map *map, const void *key) {
+    long index = ptr_map_lookup(map, key);
+    return (index >= 0) ? map->slots[index].value : NULL;
+}
+
+bool ptr_map_remove(struct ptr_map *map, const void *key) {
+    long found = ptr_map_lookup(map, key);
+    size_t index, next;
+    if (found < 0) {
+        return false;
+    }
+    // Shift the rest of the run back a slot, it ends at an empty slot or a key at home.
+    index = (size_t)found;
+    next = (index + 1) & map->mask;
+    while (map->slots[next].key != NULL && ptr_map_distance(map, next) != 0) {
+        map->slots[index] = map->slots[next];
+        index = next;
+        next = (next + 1) & map->mask;
+    }
+    map->slots[index].key = NULL;
+    map->slots[index].value = NULL;
+    map->count--;
+    return true;
+}
+
+size_t ptr_map_count(const struct ptr_map *map) {
+    return map->count;
+}
+
+const void * ptr_map_any(const struct ptr_map *map) {
+    size_t i;
+    if (map->count == 0) {
+        return NULL;
+    }
+    for (i = 0; i <= map->mask; ++i) {
+        if (map->slots[i].key) {
+            return map->slots[i].key;
+        }
+    }
+    return NULL;
+}
+
+void ptr_map_traverse(const struct ptr_map *map, void(*fn)(const void *key, void *value, void *p), void *p) {
+    size_t i;
+    if (map == NULL || fn == NULL) {
+        return;
+    }
+    for (i = 0; i <= map->mask; ++i) {
+        if (map->slots[i].key) {
+            fn(map->slots[i].key, map->slots[i].value, p);
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#if !defined(__ptr_map_h__)
+#define __ptr_map_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A hash map from pointers to pointers, open addressed with Robin Hood
+ * probing. Keys and values sit inline in one power-of-two array of slots,
+ * so an insert allocates nothing until the table grows and a lookup is a
+ * multiply and a short linear scan, where a cstl_set mallocs a node per
+ * element and walks a tree through compare callbacks. Removal shifts the
+ * run back, no tombstones. Keys are compared by address and can't be NULL.
+ * Not thread safe: one per uv_loop_t.
+ */
+
+struct ptr_map;
+
+/* Room for |capacity| entries before the first growth, 0 for a default. */
+struct ptr_map * ptr_map_create(size_t capacity);
+void ptr_map_destroy(struct ptr_map *map);
+/* false if |key| is already in or the table can't grow. */
+bool ptr_map_insert(struct ptr_map *map, const void *key, void *value);
+bool ptr_map_contains(const struct ptr_map *map, const void *key);
+/* NULL if |key| isn't in. */
+void * ptr_map_find(const struct ptr_map *map, const void *key);
+/* false if |key| isn't in. */
+bool ptr_map_remove(struct ptr_map *map, const void *key);
+size_t ptr_map_count(const struct ptr_map *map);
+/* Some key of the map, NULL if it's empty. To drain a map whose entries remove themselves. */
+const void * ptr_map_any(const struct ptr_map *map);
+/* |fn| must not change the map. */
+void ptr_map_traverse(const struct ptr_map *map, void(*fn)(const void *key, void *value, void *p), void *p);
+
+#endif // !defined(__ptr_map_h__)
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include "rate_limit.h"
+
+static void rate_limit_setup(struct rate_limit *rl, uint64_t rate, struct rate_limit *parent) {
+    rl->parent = parent;
+    rl->rate = rate;
+    rl->burst = (int64_t)(rate * RATE_LIMIT_BURST_MS / 1000);
+    rl->tokens = rl->burst;
+    rl->last = 0;
+}
+
+void rate_limit_init(struct rate_limit *rl, uint64_t rate, struct rate_limit *parent) {
+    rate_limit_setup(rl, rate, parent);
+    rl->shared = false;
+}
+
+struct rate_limit * rate_limit_create(uint64_t rate, struct rate_limit *parent) {
+    struct rate_limit *rl;
+    if (rate == 0) {
+        return NULL;
+    }
+    rl = (struct rate_limit *) calloc(1, sizeof(*rl));
+    rate_limit_setup(rl, rate, parent);
+    rl->shared = true;
+    uv_mutex_init(&rl->lock);
+    return rl;
+}
+
+void rate_limit_destroy(struct rate_limit *rl) {
+    if (rl == NULL) {
+        return;
+    }
+    if (rl->shared) {
+        uv_mutex_destroy(&rl->lock);
+    }
+    free(rl);
+}
+
+static void rate_limit_refill(struct rate_limit *rl, uint64_t now) {
+    if (rl->last == 0) {
+        rl->last = now;  /* The first look, it starts full. */
+    } else if (now > rl->last) {
+        rl->tokens += (int64_t)(rl->rate * (now - rl->last) / 1000);
+        rl->last = now;
+        if (rl->tokens > rl->burst) {
+            rl->tokens = rl->burst;
+        }
+    }
+}
+
+void rate_limit_charge(struct rate_limit *rl, size_t bytes, uint64_t now) {
+    for (; rl; rl = rl->parent) {
+        if (rl->rate == 0) {
+            continue;
+        }
+        if (rl->shared) {
+            uv_mutex_lock(&rl->lock);
+        }
+        rate_limit_refill(rl, now);
+        rl->tokens -= (int64_t)bytes;
+        if (rl->shared) {
+            uv_mutex_unlock(&rl->lock);
+        }
+    }
+}
+
+uint64_t rate_limit_delay(struct rate_limit *rl, uint64_t now) {
+    uint64_t delay = 0;
+    for (; rl; rl = rl->parent) {
+        int64_t tokens;
+        if (rl->rate == 0) {
+            continue;
+        }
+        if (rl->shared) {
+            uv_mutex_lock(&rl->lock);
+        }
+        rate_limit_refill(rl, now);
+        tokens = rl->tokens;
+        if (rl->shared) {
+            uv_mutex_unlock(&rl->lock);
+        }
+        if (tokens < 0) {
+            uint64_t wait = ((uint64_t)(-tokens) * 1000 + rl->rate - 1) / rl->rate;
+            if (wait > delay) {
+                delay = wait;
+            }
+        }
+    }
+    return delay;
+}
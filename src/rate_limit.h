@@ -0,0 +1,41 @@
+#if !defined(__rate_limit_h__)
+#define __rate_limit_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * Token buckets in a hierarchy, a tunnel's under its port's under the
+ * server's. Reads are charged after the fact, the tokens go negative, and
+ * the next read waits until every level is out of debt again. A level is
+ * refilled lazily when it's looked at, nothing runs in between. Shared
+ * levels are locked, they serve every worker loop. Times are uv_now()
+ * milliseconds.
+ */
+
+#define RATE_LIMIT_BURST_MS 250  /* A level holds this much of its rate. */
+
+struct rate_limit {
+    struct rate_limit *parent;  /* The next level up, NULL at the top. */
+    uint64_t rate;  /* Bytes per second, 0 only passes to |parent|. */
+    int64_t burst;
+    int64_t tokens;  /* Negative when in debt. */
+    uint64_t last;  /* When it was last refilled. */
+    bool shared;
+    uv_mutex_t lock;  /* Only if |shared|. */
+};
+
+/* A level of one loop, nothing to release. */
+void rate_limit_init(struct rate_limit *rl, uint64_t rate, struct rate_limit *parent);
+/* A level any loop may charge, NULL without a |rate|. */
+struct rate_limit * rate_limit_create(uint64_t rate, struct rate_limit *parent);
+void rate_limit_destroy(struct rate_limit *rl);
+
+/* Takes |bytes| from |rl| and every level above it. */
+void rate_limit_charge(struct rate_limit *rl, size_t bytes, uint64_t now);
+/* Milliseconds until the next read may go, 0 for right away. */
+uint64_t rate_limit_delay(struct rate_limit *rl, uint64_t now);
+
+#endif // !defined(__rate_limit_h__)
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include "read_coalesce.h"
+#include "common.h"
+
+struct read_coalescer {
+    uv_check_t check;  /* Runs the held reads after each poll phase. */
+    uv_idle_t idle;  /* Keeps the poll from blocking while reads are held. */
+    size_t below;
+    struct read_coalesce_entry *head;
+    struct read_coalesce_entry *tail;
+    int open_handles;
+};
+
+static struct read_coalesce_entry * read_coalescer_pop(struct read_coalescer *coalescer) {
+    struct read_coalesce_entry *entry = coalescer->head;
+    if (entry) {
+        coalescer->head = entry->next;
+        if (coalescer->head == NULL) {
+            coalescer->tail = NULL;
+        }
+        entry->next = NULL;
+        entry->queued = false;
+    }
+    return entry;
+}
+
+static void read_coalescer_check_cb(uv_check_t *handle) {
+    struct read_coalescer *coalescer = CONTAINER_OF(handle, struct read_coalescer, check);
+    struct read_coalesce_entry *last = coalescer->tail;
+    struct read_coalesce_entry *entry;
+
+    if (last == NULL) {
+        return;
+    }
+    // Those submitted by the run_cbs wait for the next iteration, so they get theirs too.
+    do {
+        entry = read_coalescer_pop(coalescer);
+        entry->run_cb(entry);
+    } while (entry != last);
+    if (coalescer->head == NULL) {
+        uv_idle_stop(&coalescer->idle);
+    }
+}
+
+static void read_coalescer_idle_cb(uv_idle_t *handle) {
+    (void)handle;
+}
+
+struct read_coalescer * read_coalescer_create(uv_loop_t *loop, size_t below) {
+    struct read_coalescer *coalescer;
+    if (below == 0) {
+        return NULL;
+    }
+    coalescer = (struct read_coalescer *) calloc(1, sizeof(*coalescer));
+    coalescer->below = below;
+    VERIFY(0 == uv_check_init(loop, &coalescer->check));
+    VERIFY(0 == uv_idle_init(loop, &coalescer->idle));
+    coalescer->open_handles = 2;
+    VERIFY(0 == uv_check_start(&coalescer->check, read_coalescer_check_cb));
+    // Only the idle handle holds the loop, the check handle doesn't.
+    uv_unref((uv_handle_t *)&coalescer->check);
+    return coalescer;
+}
+
+static void read_coalescer_close_done_cb(uv_handle_t *handle) {
+    struct read_coalescer *coalescer = (struct read_coalescer *)handle->data;
+    if (--coalescer->open_handles == 0) {
+        free(coalescer);
+    }
+}
+
+void read_coalescer_release(struct read_coalescer *coalescer) {
+    struct read_coalesce_entry *entry;
+    if (coalescer == NULL) {
+        return;
+    }
+    while ((entry = read_coalescer_pop(coalescer))) {
+        entry->run_cb(entry);
+    }
+    coalescer->check.data = coalescer;
+    coalescer->idle.data = coalescer;
+    uv_close((uv_handle_t *)&coalescer->check, read_coalescer_close_done_cb);
+    uv_close((uv_handle_t *)&coalescer->idle, read_coalescer_close_done_cb);
+}
+
+size_t read_coalescer_below(const struct read_coalescer *coalescer) {
+    return coalescer->below;
+}
+
+void read_coalesce_entry_init(struct read_coalesce_entry *entry, void(*run_cb)(struct read_coalesce_entry *entry)) {
+    entry->next = NULL;
+    entry->queued = false;
+    entry->run_cb = run_cb;
+}
+
+void read_coalescer_submit(struct read_coalescer *coalescer, struct read_coalesce_entry *entry) {
+    ASSERT(entry->queued == false);
+    entry->next = NULL;
+    entry->queued = true;
+    if (coalescer->tail) {
+        coalescer->tail->next = entry;
+    } else {
+        coalescer->head = entry;
+    }
+    coalescer->tail = entry;
+    uv_idle_start(&coalescer->idle, read_coalescer_idle_cb);
+}
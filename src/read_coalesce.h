@@ -0,0 +1,34 @@
+#if !defined(__read_coalesce_h__)
+#define __read_coalesce_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <uv.h>
+
+/*
+ * Small reads held to the end of their loop iteration. A chatty peer's
+ * messages each became a frame of their own, with the protocol's HMAC and
+ * padding on every one and as often a segment; held until after the poll
+ * phase, whatever else of that peer arrived meanwhile joins them in one.
+ * Entries run in the order they were submitted, those submitted while a
+ * round runs wait for the next. Not thread safe: one per uv_loop_t.
+ */
+
+struct read_coalescer;
+
+struct read_coalesce_entry {
+    struct read_coalesce_entry *next;
+    bool queued;
+    void(*run_cb)(struct read_coalesce_entry *entry);
+};
+
+/* NULL without |below|. */
+struct read_coalescer * read_coalescer_create(uv_loop_t *loop, size_t below);
+/* Runs what is still queued and closes the handles, it's freed once they're closed. */
+void read_coalescer_release(struct read_coalescer *coalescer);
+/* Reads smaller than this are held. */
+size_t read_coalescer_below(const struct read_coalescer *coalescer);
+void read_coalesce_entry_init(struct read_coalesce_entry *entry, void(*run_cb)(struct read_coalesce_entry *entry));
+void read_coalescer_submit(struct read_coalescer *coalescer, struct read_coalesce_entry *entry);
+
+#endif // !defined(__read_coalesce_h__)
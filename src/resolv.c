@@ -28,218 +28,447 @@
 #include "config.h"
 #endif
 
-#include <stdio.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <uv.h>
 #include <udns.h>
 
-#ifdef __MINGW32__
-#include "win32.h"
-#else
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <errno.h>
-#include <unistd.h>
-#endif
-
 #include "resolv.h"
+#include "dns_tls.h"
 #include "ssrutils.h"
-#include "netutils.h"
+#include "uthash.h"
+#include "common.h"
+#include "ssr_alloc.h"
 
 /*
  * Implement DNS resolution interface using libudns
  */
 
-struct resolv_query {
-    void (*client_cb)(struct sockaddr *, void *);
-    void (*client_free_cb)(void *);
-    void *client_cb_data;
+#define RESOLV_HOST_MAX 255
+#define RESOLV_TLS_PREFIX "tls://"
+#define RESOLV_CACHE_CAPACITY 1024
+#define RESOLV_CACHE_MAX_TTL  3600 /* Seconds, longer record TTLs are cut to this. */
+
+struct resolv_ctx {
+    uv_loop_t *loop;
+    struct dns_ctx *dns;
+    struct dns_tls *tls; /* Instead of |dns| with tls:// nameservers. */
+    uv_poll_t io_watcher;
+    uv_timer_t timeout_watcher;
+    uv_timer_t ready_watcher; /* Completes |ready| on the next loop iteration. */
+    int handles_open;
+    bool ipv6_first;
+    bool released;
+    struct resolv_lookup *lookups; /* In flight, one per host name. */
+    struct resolv_lookup *ready; /* Answered from |answers|, waiting for |ready_watcher|. */
+    struct resolv_answer *answers; /* Least recently used first. */
+    size_t answers_count;
+};
+
+/* The addresses of a name udns or DNS over TLS resolved, kept for the records' TTL. */
+struct resolv_answer {
+    uint64_t expire; /* uv_now() of the loop. */
+    struct in_addr addrs4[RESOLV_MAX_ADDRS];
+    size_t count4;
+    struct in6_addr addrs6[RESOLV_MAX_ADDRS];
+    size_t count6;
+    UT_hash_handle hh;
+    char host[RESOLV_HOST_MAX + 1];
+};
+
+/* The A and AAAA requests of one name, shared by every waiting query. */
+struct resolv_lookup {
+    struct resolv_ctx *ctx;
     struct dns_query *queries[2];
-    size_t response_count;
-    struct sockaddr **responses;
+    struct dns_tls_query *tls_queries[2];
+    int dns_status[2];
+    uv_getaddrinfo_t req; /* Instead of |queries| when udns couldn't be opened. */
+    bool abandoned; /* Out of the table, |req| frees it once it's done. */
+    bool finishing;
+    bool cached; /* On the context's |ready| list, no requests out. */
+    struct resolv_lookup *next_ready;
+    uint32_t ttl; /* Lowest of the answers' records, seconds. */
+    struct in_addr addrs4[RESOLV_MAX_ADDRS];
+    size_t count4;
+    struct in6_addr addrs6[RESOLV_MAX_ADDRS];
+    size_t count6;
+    struct resolv_query *waiters;
+    UT_hash_handle hh;
+    char host[RESOLV_HOST_MAX + 1];
+};
+
+struct resolv_query {
+    struct resolv_lookup *lookup;
+    resolv_query_cb cb;
+    void *data;
     uint16_t port;
+    struct resolv_query *prev;
+    struct resolv_query *next;
 };
 
-extern int verbose;
-
-static struct ev_io resolv_io_watcher;
-static struct ev_timer resolv_timeout_watcher;
-static const int MODE_IPV4_ONLY  = 0;
-static const int MODE_IPV6_ONLY  = 1;
-static const int MODE_IPV4_FIRST = 2;
-static const int MODE_IPV6_FIRST = 3;
-static int resolv_mode           = 0;
-
-static void resolv_sock_cb(struct uv_loop_s *, struct ev_io *, int);
-static void resolv_timeout_cb(struct uv_loop_s *, struct ev_timer *, int);
-static void dns_query_v4_cb(struct dns_ctx *, struct dns_rr_a4 *, void *);
-static void dns_query_v6_cb(struct dns_ctx *, struct dns_rr_a6 *, void *);
-static void dns_timer_setup_cb(struct dns_ctx *, int, void *);
-static void process_client_callback(struct resolv_query *);
-static inline int all_queries_are_null(struct resolv_query *);
-static struct sockaddr *choose_ipv4_first(struct resolv_query *);
-static struct sockaddr *choose_ipv6_first(struct resolv_query *);
-static struct sockaddr *choose_any(struct resolv_query *);
-
-int
-resolv_init(struct uv_loop_s *loop, char **nameservers, int nameserver_num, int ipv6first)
+static void resolv_io_cb(uv_poll_t *handle, int status, int events);
+static void resolv_timeout_cb(uv_timer_t *handle);
+static void dns_timer_setup_cb(struct dns_ctx *dns, int timeout, void *data);
+static void dns_query_v4_cb(struct dns_ctx *dns, struct dns_rr_a4 *result, void *data);
+static void dns_query_v6_cb(struct dns_ctx *dns, struct dns_rr_a6 *result, void *data);
+static void tls_query_v4_cb(int status, void *result, void *data);
+static void tls_query_v6_cb(int status, void *result, void *data);
+static void lookup_getaddrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai);
+static void lookup_finish(struct resolv_lookup *lookup, int status);
+static void resolv_ready_cb(uv_timer_t *handle);
+static bool answer_lookup(struct resolv_ctx *ctx, struct resolv_lookup *lookup);
+static void answer_store(struct resolv_ctx *ctx, const struct resolv_lookup *lookup);
+
+static int
+dns_status_to_uv(const int status[2])
 {
-    if (ipv6first)
-        resolv_mode = MODE_IPV6_FIRST;
-    else
-        resolv_mode = MODE_IPV4_FIRST;
-
-    struct dns_ctx *ctx = &dns_defctx;
-    if (nameservers == NULL) {
-        /* Nameservers not specified, use system resolver config */
-        dns_init(ctx, 0);
-    } else {
-        dns_reset(ctx);
-
-        for (int i = 0; i < nameserver_num; i++) {
-            char *server = nameservers[i];
-            dns_add_serv(ctx, server);
-        }
+    // NXDOMAIN from either family is definite, NODATA only from both.
+    if (status[0] == DNS_E_NXDOMAIN || status[1] == DNS_E_NXDOMAIN) {
+        return UV_EAI_NONAME;
+    }
+    if (status[0] == DNS_E_NODATA && status[1] == DNS_E_NODATA) {
+        return UV_EAI_NODATA;
     }
+    switch (status[0] != DNS_E_NODATA ? status[0] : status[1]) {
+    case DNS_E_NXDOMAIN:
+        return UV_EAI_NONAME;
+    case DNS_E_NODATA:
+        return UV_EAI_NODATA;
+    case DNS_E_TEMPFAIL:
+        return UV_EAI_AGAIN;
+    case DNS_E_NOMEM:
+        return UV_EAI_MEMORY;
+    default:
+        return UV_EAI_FAIL;
+    }
+}
 
-    int sockfd = dns_open(ctx);
-    if (sockfd < 0) {
-        FATAL("Failed to open DNS resolver socket");
+struct resolv_ctx *
+resolv_init(uv_loop_t *loop, const char *nameservers, bool ipv6_first)
+{
+    static bool defctx_ready = false;
+    struct resolv_ctx *ctx;
+    struct dns_ctx *dns;
+    int sockfd;
+
+    if (defctx_ready == false) {
+        // The template of every context, it reads /etc/resolv.conf once.
+        dns_init(NULL, 0);
+        defctx_ready = true;
     }
 
-    if (nameserver_num == 1 && nameservers != NULL) {
-        if (strncmp("127.0.0.1", nameservers[0], 9) == 0
-            || strncmp("::1", nameservers[0], 3) == 0) {
-            if (verbose) {
-                LOGI("bind UDP resolver to %s", nameservers[0]);
+    dns = dns_new(NULL);
+    if (dns == NULL) {
+        return NULL;
+    }
+    ctx = (struct resolv_ctx *)ssr_calloc(ssr_alloc_dns, 1, sizeof(*ctx));
+    ctx->loop = loop;
+    ctx->ipv6_first = ipv6_first;
+    uv_timer_init(loop, &ctx->timeout_watcher);
+    ctx->timeout_watcher.data = ctx;
+    uv_timer_init(loop, &ctx->ready_watcher);
+    ctx->ready_watcher.data = ctx;
+    ctx->handles_open = 2;
+
+    if (nameservers && nameservers[0]) {
+        const char *iter = nameservers;
+        char tls_servers[256] = { 0 };
+        dns_add_serv(dns, NULL);
+        while (*iter) {
+            char server[64] = { 0 };
+            size_t len = strcspn(iter, ", ");
+            if (len > strlen(RESOLV_TLS_PREFIX) && strncmp(iter, RESOLV_TLS_PREFIX, strlen(RESOLV_TLS_PREFIX)) == 0) {
+                size_t used = strlen(tls_servers);
+                len -= strlen(RESOLV_TLS_PREFIX);
+                iter += strlen(RESOLV_TLS_PREFIX);
+                if (used + len + 2 < sizeof(tls_servers)) {
+                    if (used) {
+                        tls_servers[used++] = ',';
+                    }
+                    memcpy(tls_servers + used, iter, len);
+                }
+            } else if (len > 0 && len < sizeof(server)) {
+                memcpy(server, iter, len);
+                if (dns_add_serv(dns, server) < 0) {
+                    LOGE("invalid nameserver %s", server);
+                }
+            }
+            iter += len;
+            iter += strspn(iter, ", ");
+        }
+        if (tls_servers[0]) {
+            // Every lookup goes to the encrypted upstreams, plain ones would leak them.
+            ctx->tls = dns_tls_create(loop, tls_servers);
+            if (ctx->tls) {
+                dns_free(dns);
+                return ctx;
             }
-            if (bind_to_address(sockfd, nameservers[0]) == -1)
-                SS_ERROR("bind_to_address");
+            LOGE("no usable DNS over TLS upstream in %s", nameservers);
         }
     }
 
-#ifdef __MINGW32__
-    setnonblocking(sockfd);
+    sockfd = dns_open(dns);
+    if (sockfd < 0) {
+        // Lookups are still shared, they just take a thread pool slot each.
+        LOGE("Failed to open DNS resolver socket, falling back to getaddrinfo");
+        dns_free(dns);
+        return ctx;
+    }
+    ctx->dns = dns;
+
+#if defined(_WIN32)
+    uv_poll_init_socket(loop, &ctx->io_watcher, (uv_os_sock_t)sockfd);
 #else
-    int flags = fcntl(sockfd, F_GETFL, 0);
-    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    uv_poll_init(loop, &ctx->io_watcher, sockfd);
 #endif
+    ctx->io_watcher.data = ctx;
+    ctx->handles_open++;
 
-    ev_io_init(&resolv_io_watcher, resolv_sock_cb, sockfd, EV_READ);
-    resolv_io_watcher.data = ctx;
+    uv_poll_start(&ctx->io_watcher, UV_READABLE, resolv_io_cb);
+    dns_set_tmcbck(dns, dns_timer_setup_cb, ctx);
 
-    ev_io_start(loop, &resolv_io_watcher);
-
-    ev_timer_init(&resolv_timeout_watcher, resolv_timeout_cb, 0.0, 0.0);
-    resolv_timeout_watcher.data = ctx;
+    return ctx;
+}
 
-    dns_set_tmcbck(ctx, dns_timer_setup_cb, loop);
+static void
+resolv_close_done_cb(uv_handle_t *handle)
+{
+    struct resolv_ctx *ctx = (struct resolv_ctx *)handle->data;
+    if (--ctx->handles_open == 0) {
+        ssr_free(ssr_alloc_dns, ctx);
+    }
+}
 
-    return sockfd;
+/* Cancels the A and AAAA requests still out on udns or DNS over TLS. */
+static void
+lookup_drop_requests(struct resolv_lookup *lookup)
+{
+    struct resolv_ctx *ctx = lookup->ctx;
+    size_t i;
+
+    for (i = 0; i < sizeof(lookup->queries) / sizeof(lookup->queries[0]); i++) {
+        if (lookup->queries[i] != NULL) {
+            dns_cancel(ctx->dns, lookup->queries[i]);
+            free(lookup->queries[i]);
+            lookup->queries[i] = NULL;
+        }
+        if (lookup->tls_queries[i] != NULL) {
+            dns_tls_cancel(lookup->tls_queries[i]);
+            lookup->tls_queries[i] = NULL;
+        }
+    }
 }
 
 void
-resolv_shutdown(struct uv_loop_s *loop)
+resolv_shutdown(struct resolv_ctx *ctx)
 {
-    struct dns_ctx *ctx = (struct dns_ctx *)resolv_io_watcher.data;
+    struct resolv_lookup *lookup;
+    struct resolv_answer *answer, *tmp;
 
-    ev_io_stop(loop, &resolv_io_watcher);
+    if (ctx == NULL || ctx->released) {
+        return;
+    }
+    ctx->released = true;
 
-    if (ev_is_active(&resolv_timeout_watcher)) {
-        ev_timer_stop(loop, &resolv_timeout_watcher);
+    if (ctx->dns) {
+        uv_poll_stop(&ctx->io_watcher);
+        dns_set_tmcbck(ctx->dns, NULL, NULL);
+    }
+    uv_timer_stop(&ctx->timeout_watcher);
+    uv_timer_stop(&ctx->ready_watcher);
+    ctx->ready = NULL;  /* Those are in |lookups| too. */
+
+    while ((lookup = ctx->lookups) != NULL) {
+        lookup->count4 = lookup->count6 = 0;
+        if (ctx->dns == NULL && ctx->tls == NULL && lookup->cached == false) {
+            uv_cancel((uv_req_t *)&lookup->req);
+            lookup->abandoned = true;
+            lookup_finish(lookup, UV_ECANCELED);
+            continue;
+        }
+        lookup_drop_requests(lookup);
+        lookup_finish(lookup, UV_ECANCELED);
+        ssr_free(ssr_alloc_dns, lookup);
     }
 
-    dns_close(ctx);
+    if (ctx->tls) {
+        dns_tls_destroy(ctx->tls);
+        ctx->tls = NULL;
+    }
+    if (ctx->dns) {
+        dns_free(ctx->dns);
+        ctx->dns = NULL;
+        uv_close((uv_handle_t *)&ctx->io_watcher, resolv_close_done_cb);
+    }
+    uv_close((uv_handle_t *)&ctx->timeout_watcher, resolv_close_done_cb);
+    uv_close((uv_handle_t *)&ctx->ready_watcher, resolv_close_done_cb);
+
+    HASH_ITER(hh, ctx->answers, answer, tmp) {
+        HASH_DEL(ctx->answers, answer);
+        ssr_free(ssr_alloc_dns, answer);
+    }
+    ctx->answers_count = 0;
 }
 
 struct resolv_query *
-resolv_query(const char *hostname, void (*client_cb)(struct sockaddr *, void *),
-             void (*client_free_cb)(void *), void *client_cb_data,
-             uint16_t port)
+resolv_query(struct resolv_ctx *ctx, const char *hostname, uint16_t port,
+             resolv_query_cb cb, void *data)
 {
-    struct dns_ctx *ctx = (struct dns_ctx *)resolv_io_watcher.data;
-
-    /*
-     * Wrap udns's call back in our own
-     */
-    struct resolv_query *cb_data = ss_malloc(sizeof(struct resolv_query));
-    if (cb_data == NULL) {
-        LOGE("Failed to allocate memory for DNS query callback data.");
+    struct resolv_lookup *lookup = NULL;
+    struct resolv_query *query;
+    char host[RESOLV_HOST_MAX + 1];
+    size_t len;
+
+    if (ctx == NULL || ctx->released || cb == NULL) {
         return NULL;
     }
-    memset(cb_data, 0, sizeof(struct resolv_query));
-
-    cb_data->client_cb      = client_cb;
-    cb_data->client_free_cb = client_free_cb;
-    cb_data->client_cb_data = client_cb_data;
-    memset(cb_data->queries, 0, sizeof(cb_data->queries));
-    cb_data->response_count = 0;
-    cb_data->responses      = NULL;
-    cb_data->port           = port;
-
-    /* Submit A and AAAA queries */
-    if (resolv_mode != MODE_IPV6_ONLY) {
-        cb_data->queries[0] = dns_submit_a4(ctx,
-                                            hostname, 0,
-                                            dns_query_v4_cb, cb_data);
-        if (cb_data->queries[0] == NULL) {
-            LOGE("Failed to submit DNS query: %s",
-                 dns_strerror(dns_status(ctx)));
+    for (len = 0; hostname[len]; len++) {
+        if (len >= RESOLV_HOST_MAX) {
+            return NULL;
         }
+        host[len] = (char)tolower((unsigned char)hostname[len]);
+    }
+    host[len] = '\0';
+    if (len == 0) {
+        return NULL;
     }
 
-    if (resolv_mode != MODE_IPV4_ONLY) {
-        cb_data->queries[1] = dns_submit_a6(ctx,
-                                            hostname, 0,
-                                            dns_query_v6_cb, cb_data);
-        if (cb_data->queries[1] == NULL) {
-            LOGE("Failed to submit DNS query: %s",
-                 dns_strerror(dns_status(ctx)));
+    HASH_FIND_STR(ctx->lookups, host, lookup);
+    if (lookup == NULL) {
+        lookup = (struct resolv_lookup *)ssr_calloc(ssr_alloc_dns, 1, sizeof(*lookup));
+        lookup->ctx = ctx;
+        lookup->ttl = UINT32_MAX;
+        memcpy(lookup->host, host, len + 1);
+
+        if (answer_lookup(ctx, lookup)) {
+            // Never from within resolv_query(), the caller doesn't hold the handle yet.
+            lookup->cached = true;
+            lookup->next_ready = ctx->ready;
+            ctx->ready = lookup;
+            uv_timer_start(&ctx->ready_watcher, resolv_ready_cb, 0, 0);
+            HASH_ADD_STR(ctx->lookups, host, lookup);
+            goto attach;
         }
-    }
 
-    if (all_queries_are_null(cb_data)) {
-        if (cb_data->client_free_cb != NULL) {
-            cb_data->client_free_cb(cb_data->client_cb_data);
+        if (ctx->tls) {
+            lookup->tls_queries[0] = dns_tls_submit(ctx->tls, lookup->host, DNS_T_A, tls_query_v4_cb, lookup);
+            lookup->tls_queries[1] = dns_tls_submit(ctx->tls, lookup->host, DNS_T_AAAA, tls_query_v6_cb, lookup);
+            if (lookup->tls_queries[0] == NULL || lookup->tls_queries[1] == NULL) {
+                dns_tls_cancel(lookup->tls_queries[0]);
+                dns_tls_cancel(lookup->tls_queries[1]);
+                ssr_free(ssr_alloc_dns, lookup);
+                return NULL;
+            }
+            HASH_ADD_STR(ctx->lookups, host, lookup);
+            goto attach;
         }
-        ss_free(cb_data);
+
+        if (ctx->dns == NULL) {
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_protocol = IPPROTO_TCP;
+            if (uv_getaddrinfo(ctx->loop, &lookup->req, lookup_getaddrinfo_cb, lookup->host, NULL, &hints) != 0) {
+                ssr_free(ssr_alloc_dns, lookup);
+                return NULL;
+            }
+            HASH_ADD_STR(ctx->lookups, host, lookup);
+            goto attach;
+        }
+
+        /* Submit A and AAAA queries */
+        lookup->queries[0] = dns_submit_a4(ctx->dns, lookup->host, 0, dns_query_v4_cb, lookup);
+        lookup->queries[1] = dns_submit_a6(ctx->dns, lookup->host, 0, dns_query_v6_cb, lookup);
+        if (lookup->queries[0] == NULL || lookup->queries[1] == NULL) {
+            LOGE("Failed to submit DNS query: %s", dns_strerror(dns_status(ctx->dns)));
+            lookup->dns_status[0] = lookup->queries[0] ? 0 : DNS_E_TEMPFAIL;
+            lookup->dns_status[1] = lookup->queries[1] ? 0 : DNS_E_TEMPFAIL;
+            if (lookup->queries[0] == NULL && lookup->queries[1] == NULL) {
+                ssr_free(ssr_alloc_dns, lookup);
+                return NULL;
+            }
+        }
+        HASH_ADD_STR(ctx->lookups, host, lookup);
+    }
+
+attach:
+    query = (struct resolv_query *)ssr_calloc(ssr_alloc_dns, 1, sizeof(*query));
+    query->lookup = lookup;
+    query->cb = cb;
+    query->data = data;
+    query->port = port;
+    query->next = lookup->waiters;
+    if (lookup->waiters) {
+        lookup->waiters->prev = query;
     }
+    lookup->waiters = query;
 
-    return cb_data;
+    return query;
 }
 
 void
-resolv_cancel(struct resolv_query *query_handle)
+resolv_cancel(struct resolv_query *query)
 {
-    struct resolv_query *cb_data = (struct resolv_query *)query_handle;
-    struct dns_ctx *ctx         = (struct dns_ctx *)resolv_io_watcher.data;
-
-    for (int i = 0; i < sizeof(cb_data->queries) / sizeof(cb_data->queries[0]);
-         i++)
-        if (cb_data->queries[i] != NULL) {
-            dns_cancel(ctx, cb_data->queries[i]);
-            ss_free(cb_data->queries[i]);
-        }
+    struct resolv_lookup *lookup;
 
-    if (cb_data->client_free_cb != NULL) {
-        cb_data->client_free_cb(cb_data->client_cb_data);
+    if (query == NULL) {
+        return;
     }
+    lookup = query->lookup;
 
-    ss_free(cb_data);
+    if (query->prev) {
+        query->prev->next = query->next;
+    } else {
+        lookup->waiters = query->next;
+    }
+    if (query->next) {
+        query->next->prev = query->prev;
+    }
+    ssr_free(ssr_alloc_dns, query);
+
+    if (lookup->waiters == NULL && lookup->finishing == false && lookup->cached == false) {
+        // Nobody is waiting any more, drop the requests.
+        struct resolv_ctx *ctx = lookup->ctx;
+        if (ctx->dns == NULL && ctx->tls == NULL) {
+            HASH_DEL(ctx->lookups, lookup);
+            lookup->abandoned = true;
+            uv_cancel((uv_req_t *)&lookup->req);
+            return;
+        }
+        lookup_drop_requests(lookup);
+        HASH_DEL(ctx->lookups, lookup);
+        ssr_free(ssr_alloc_dns, lookup);
+    }
 }
 
 /*
  * DNS UDP socket activity callback
  */
 static void
-resolv_sock_cb(struct uv_loop_s *loop, struct ev_io *w, int revents)
+resolv_io_cb(uv_poll_t *handle, int status, int events)
 {
-    struct dns_ctx *ctx = (struct dns_ctx *)w->data;
+    struct resolv_ctx *ctx = (struct resolv_ctx *)handle->data;
 
-    if (revents & EV_READ) {
-        dns_ioevent(ctx, ev_now(loop));
+    if (status == 0 && (events & UV_READABLE)) {
+        dns_ioevent(ctx->dns, 0);
+    }
+}
+
+static void
+lookup_query_done(struct resolv_lookup *lookup, size_t index, int status)
+{
+    lookup->queries[index] = NULL; /* mark the query as being completed */
+    lookup->tls_queries[index] = NULL;
+    lookup->dns_status[index] = status;
+
+    /* Once all queries have completed, call client callback */
+    if (lookup->queries[0] == NULL && lookup->queries[1] == NULL
+        && lookup->tls_queries[0] == NULL && lookup->tls_queries[1] == NULL) {
+        answer_store(lookup->ctx, lookup);
+        lookup_finish(lookup, dns_status_to_uv(lookup->dns_status));
+        ssr_free(ssr_alloc_dns, lookup);
     }
 }
 
@@ -247,198 +476,227 @@ resolv_sock_cb(struct uv_loop_s *loop, struct ev_io *w, int revents)
  * Wrapper for client callback we provide to udns
  */
 static void
-dns_query_v4_cb(struct dns_ctx *ctx, struct dns_rr_a4 *result, void *data)
+lookup_a4_done(struct resolv_lookup *lookup, struct dns_rr_a4 *result, int status)
 {
-    struct resolv_query *cb_data = (struct resolv_query *)data;
+    if (result != NULL) {
+        int i;
+        for (i = 0; i < result->dnsa4_nrr && lookup->count4 < RESOLV_MAX_ADDRS; i++) {
+            lookup->addrs4[lookup->count4++] = result->dnsa4_addr[i];
+        }
+        if (result->dnsa4_nrr > 0 && (uint32_t)result->dnsa4_ttl < lookup->ttl) {
+            lookup->ttl = (uint32_t)result->dnsa4_ttl;
+        }
+        free(result);
+    }
+    lookup_query_done(lookup, 0, result ? 0 : status);
+}
 
-    if (result == NULL) {
-        if (verbose) {
-            LOGI("IPv4 resolv: %s", dns_strerror(dns_status(ctx)));
+static void
+lookup_a6_done(struct resolv_lookup *lookup, struct dns_rr_a6 *result, int status)
+{
+    if (result != NULL) {
+        int i;
+        for (i = 0; i < result->dnsa6_nrr && lookup->count6 < RESOLV_MAX_ADDRS; i++) {
+            lookup->addrs6[lookup->count6++] = result->dnsa6_addr[i];
         }
-    } else if (result->dnsa4_nrr > 0) {
-        struct sockaddr **new_responses = ss_realloc(cb_data->responses,
-                                                     (cb_data->response_count +
-                                                      result->dnsa4_nrr) *
-                                                     sizeof(struct sockaddr *));
-        if (new_responses == NULL) {
-            LOGE("Failed to allocate memory for additional DNS responses");
-        } else {
-            cb_data->responses = new_responses;
-
-            for (int i = 0; i < result->dnsa4_nrr; i++) {
-                struct sockaddr_in *sa = ss_malloc(sizeof(struct sockaddr_in));
-                memset(sa, 0, sizeof(struct sockaddr_in));
-                sa->sin_family = AF_INET;
-                sa->sin_port   = cb_data->port;
-                sa->sin_addr   = result->dnsa4_addr[i];
-
-                cb_data->responses[cb_data->response_count] =
-                    (struct sockaddr *)sa;
-                if (cb_data->responses[cb_data->response_count] == NULL) {
-                    LOGE(
-                        "Failed to allocate memory for DNS query result address");
-                } else {
-                    cb_data->response_count++;
-                }
-            }
+        if (result->dnsa6_nrr > 0 && (uint32_t)result->dnsa6_ttl < lookup->ttl) {
+            lookup->ttl = (uint32_t)result->dnsa6_ttl;
         }
+        free(result);
     }
+    lookup_query_done(lookup, 1, result ? 0 : status);
+}
 
-    ss_free(result);
-    cb_data->queries[0] = NULL; /* mark A query as being completed */
+static void
+dns_query_v4_cb(struct dns_ctx *dns, struct dns_rr_a4 *result, void *data)
+{
+    lookup_a4_done((struct resolv_lookup *)data, result, dns_status(dns));
+}
 
-    /* Once all queries have completed, call client callback */
-    if (all_queries_are_null(cb_data)) {
-        return process_client_callback(cb_data);
-    }
+static void
+dns_query_v6_cb(struct dns_ctx *dns, struct dns_rr_a6 *result, void *data)
+{
+    lookup_a6_done((struct resolv_lookup *)data, result, dns_status(dns));
 }
 
 static void
-dns_query_v6_cb(struct dns_ctx *ctx, struct dns_rr_a6 *result, void *data)
+tls_query_v4_cb(int status, void *result, void *data)
 {
-    struct resolv_query *cb_data = (struct resolv_query *)data;
+    lookup_a4_done((struct resolv_lookup *)data, (struct dns_rr_a4 *)result, status);
+}
 
-    if (result == NULL) {
-        if (verbose) {
-            LOGI("IPv6 resolv: %s", dns_strerror(dns_status(ctx)));
-        }
-    } else if (result->dnsa6_nrr > 0) {
-        struct sockaddr **new_responses = ss_realloc(cb_data->responses,
-                                                     (cb_data->response_count +
-                                                      result->dnsa6_nrr) *
-                                                     sizeof(struct sockaddr *));
-        if (new_responses == NULL) {
-            LOGE("Failed to allocate memory for additional DNS responses");
+static void
+tls_query_v6_cb(int status, void *result, void *data)
+{
+    lookup_a6_done((struct resolv_lookup *)data, (struct dns_rr_a6 *)result, status);
+}
+
+static size_t
+lookup_addresses(const struct resolv_lookup *lookup, bool ipv6_first, uint16_t port,
+                 union sockaddr_universal *addrs)
+{
+    size_t count = 0, i, pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        if ((pass == 0) == ipv6_first) {
+            for (i = 0; i < lookup->count6; i++, count++) {
+                memset(&addrs[count], 0, sizeof(addrs[count]));
+                addrs[count].addr6.sin6_family = AF_INET6;
+                addrs[count].addr6.sin6_port = port;
+                addrs[count].addr6.sin6_addr = lookup->addrs6[i];
+            }
         } else {
-            cb_data->responses = new_responses;
-
-            for (int i = 0; i < result->dnsa6_nrr; i++) {
-                struct sockaddr_in6 *sa = ss_malloc(sizeof(struct sockaddr_in6));
-                memset(sa, 0, sizeof(struct sockaddr_in6));
-                sa->sin6_family = AF_INET6;
-                sa->sin6_port   = cb_data->port;
-                sa->sin6_addr   = result->dnsa6_addr[i];
-
-                cb_data->responses[cb_data->response_count] =
-                    (struct sockaddr *)sa;
-                if (cb_data->responses[cb_data->response_count] == NULL) {
-                    LOGE(
-                        "Failed to allocate memory for DNS query result address");
-                } else {
-                    cb_data->response_count++;
-                }
+            for (i = 0; i < lookup->count4; i++, count++) {
+                memset(&addrs[count], 0, sizeof(addrs[count]));
+                addrs[count].addr4.sin_family = AF_INET;
+                addrs[count].addr4.sin_port = port;
+                addrs[count].addr4.sin_addr = lookup->addrs4[i];
             }
         }
     }
+    return count;
+}
 
-    ss_free(result);
-    cb_data->queries[1] = NULL; /* mark AAAA query as being completed */
-
-    /* Once all queries have completed, call client callback */
-    if (all_queries_are_null(cb_data)) {
-        return process_client_callback(cb_data);
+static void
+lookup_getaddrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai)
+{
+    struct resolv_lookup *lookup = CONTAINER_OF(req, struct resolv_lookup, req);
+    const struct addrinfo *iter;
+
+    if (lookup->abandoned == false) {
+        for (iter = ai; status == 0 && iter; iter = iter->ai_next) {
+            if (iter->ai_family == AF_INET && lookup->count4 < RESOLV_MAX_ADDRS) {
+                lookup->addrs4[lookup->count4++] = ((const struct sockaddr_in *)iter->ai_addr)->sin_addr;
+            } else if (iter->ai_family == AF_INET6 && lookup->count6 < RESOLV_MAX_ADDRS) {
+                lookup->addrs6[lookup->count6++] = ((const struct sockaddr_in6 *)iter->ai_addr)->sin6_addr;
+            }
+        }
+        lookup_finish(lookup, status ? status : UV_EAI_NODATA);
     }
+    if (ai) {
+        uv_freeaddrinfo(ai);
+    }
+    ssr_free(ssr_alloc_dns, lookup);
 }
 
 /*
- * Called once all queries have been completed
+ * Called once all queries have been completed, the caller frees |lookup|.
+ * |status| applies when no address came back.
  */
 static void
-process_client_callback(struct resolv_query *cb_data)
+lookup_finish(struct resolv_lookup *lookup, int status)
 {
-    struct sockaddr *best_address = NULL;
-
-    if (resolv_mode == MODE_IPV4_FIRST) {
-        best_address = choose_ipv4_first(cb_data);
-    } else if (resolv_mode == MODE_IPV6_FIRST) {
-        best_address = choose_ipv6_first(cb_data);
-    } else {
-        best_address = choose_any(cb_data);
-    }
-
-    cb_data->client_cb(best_address, cb_data->client_cb_data);
-
-    for (int i = 0; i < cb_data->response_count; i++)
-        ss_free(cb_data->responses[i]);
-
-    ss_free(cb_data->responses);
-    if (cb_data->client_free_cb != NULL) {
-        cb_data->client_free_cb(cb_data->client_cb_data);
+    struct resolv_ctx *ctx = lookup->ctx;
+    struct resolv_query *query;
+    union sockaddr_universal addrs[RESOLV_MAX_ADDRS * 2];
+
+    // A callback may query the same name again, it starts afresh.
+    HASH_DEL(ctx->lookups, lookup);
+    lookup->finishing = true;
+
+    while ((query = lookup->waiters) != NULL) {
+        size_t count = lookup_addresses(lookup, ctx->ipv6_first, query->port, addrs);
+        lookup->waiters = query->next;
+        if (lookup->waiters) {
+            lookup->waiters->prev = NULL;
+        }
+        query->cb(count ? 0 : status, addrs, count, query->data);
+        ssr_free(ssr_alloc_dns, query);
     }
-    ss_free(cb_data);
 }
 
-static struct sockaddr *
-choose_ipv4_first(struct resolv_query *cb_data)
+static void
+resolv_ready_cb(uv_timer_t *handle)
 {
-    for (int i = 0; i < cb_data->response_count; i++)
-        if (cb_data->responses[i]->sa_family == AF_INET) {
-            return cb_data->responses[i];
-        }
-
-    return choose_any(cb_data);
+    struct resolv_ctx *ctx = (struct resolv_ctx *)handle->data;
+    struct resolv_lookup *lookup = ctx->ready;
+
+    // Callbacks may query again, a cached name goes on a fresh list.
+    ctx->ready = NULL;
+    while (lookup != NULL) {
+        struct resolv_lookup *next = lookup->next_ready;
+        lookup_finish(lookup, UV_EAI_NODATA);
+        ssr_free(ssr_alloc_dns, lookup);
+        lookup = next;
+    }
 }
 
-static struct sockaddr *
-choose_ipv6_first(struct resolv_query *cb_data)
+/* Fills |lookup| with the cached addresses of its name, false if there are none or they expired. */
+static bool
+answer_lookup(struct resolv_ctx *ctx, struct resolv_lookup *lookup)
 {
-    for (int i = 0; i < cb_data->response_count; i++)
-        if (cb_data->responses[i]->sa_family == AF_INET6) {
-            return cb_data->responses[i];
-        }
+    struct resolv_answer *answer = NULL;
+
+    HASH_FIND_STR(ctx->answers, lookup->host, answer);
+    if (answer == NULL) {
+        return false;
+    }
+    HASH_DEL(ctx->answers, answer);
+    if (answer->expire <= uv_now(ctx->loop)) {
+        ctx->answers_count--;
+        ssr_free(ssr_alloc_dns, answer);
+        return false;
+    }
+    HASH_ADD_STR(ctx->answers, host, answer);  /* Now the most recently used. */
 
-    return choose_any(cb_data);
+    memcpy(lookup->addrs4, answer->addrs4, answer->count4 * sizeof(answer->addrs4[0]));
+    lookup->count4 = answer->count4;
+    memcpy(lookup->addrs6, answer->addrs6, answer->count6 * sizeof(answer->addrs6[0]));
+    lookup->count6 = answer->count6;
+    return true;
 }
 
-static struct sockaddr *
-choose_any(struct resolv_query *cb_data)
+/* Keeps what |lookup| got until its records expire. Failures aren't kept, nor are TTLs of 0. */
+static void
+answer_store(struct resolv_ctx *ctx, const struct resolv_lookup *lookup)
 {
-    if (cb_data->response_count >= 1) {
-        return cb_data->responses[0];
-    }
+    struct resolv_answer *answer = NULL;
+    uint32_t ttl = lookup->ttl < RESOLV_CACHE_MAX_TTL ? lookup->ttl : RESOLV_CACHE_MAX_TTL;
 
-    return NULL;
+    if (lookup->count4 + lookup->count6 == 0 || ttl == 0) {
+        return;
+    }
+    HASH_FIND_STR(ctx->answers, lookup->host, answer);
+    if (answer != NULL) {
+        HASH_DEL(ctx->answers, answer);
+    } else if (ctx->answers_count >= RESOLV_CACHE_CAPACITY) {
+        answer = ctx->answers;  /* The least recently used, reused. */
+        HASH_DEL(ctx->answers, answer);
+    } else {
+        answer = (struct resolv_answer *)ssr_malloc(ssr_alloc_dns, sizeof(*answer));
+        ctx->answers_count++;
+    }
+    answer->expire = uv_now(ctx->loop) + (uint64_t)ttl * 1000;
+    memcpy(answer->addrs4, lookup->addrs4, lookup->count4 * sizeof(lookup->addrs4[0]));
+    answer->count4 = lookup->count4;
+    memcpy(answer->addrs6, lookup->addrs6, lookup->count6 * sizeof(lookup->addrs6[0]));
+    answer->count6 = lookup->count6;
+    strcpy(answer->host, lookup->host);
+    HASH_ADD_STR(ctx->answers, host, answer);
 }
 
 /*
  * DNS timeout callback
  */
 static void
-resolv_timeout_cb(struct uv_loop_s *loop, struct ev_timer *w, int revents)
+resolv_timeout_cb(uv_timer_t *handle)
 {
-    struct dns_ctx *ctx = (struct dns_ctx *)w->data;
+    struct resolv_ctx *ctx = (struct resolv_ctx *)handle->data;
 
-    if (revents & EV_TIMER) {
-        dns_timeouts(ctx, 30, ev_now(loop));
-    }
+    dns_timeouts(ctx->dns, -1, 0);
 }
 
 /*
  * Callback to setup DNS timeout callback
  */
 static void
-dns_timer_setup_cb(struct dns_ctx *ctx, int timeout, void *data)
+dns_timer_setup_cb(struct dns_ctx *dns, int timeout, void *data)
 {
-    struct uv_loop_s *loop = (struct uv_loop_s *)data;
+    struct resolv_ctx *ctx = (struct resolv_ctx *)data;
 
-    if (ev_is_active(&resolv_timeout_watcher)) {
-        ev_timer_stop(loop, &resolv_timeout_watcher);
-    }
+    uv_timer_stop(&ctx->timeout_watcher);
 
-    if (ctx != NULL && timeout >= 0) {
-        ev_timer_set(&resolv_timeout_watcher, timeout, 0.0);
-        ev_timer_start(loop, &resolv_timeout_watcher);
+    if (dns != NULL && timeout >= 0) {
+        uv_timer_start(&ctx->timeout_watcher, resolv_timeout_cb, (uint64_t)timeout * 1000, 0);
     }
 }
-
-static inline int
-all_queries_are_null(struct resolv_query *cb_data)
-{
-    int result = 1;
-
-    for (int i = 0; i < sizeof(cb_data->queries) / sizeof(cb_data->queries[0]);
-         i++)
-        result = result && cb_data->queries[i] == NULL;
-
-    return result;
-}
@@ -30,23 +30,41 @@
 #include "config.h"
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <uv.h>
+#include "sockaddr_universal.h"
 
-#ifdef __MINGW32__
-#include "win32.h"
-#else
-#include <sys/socket.h>
-#endif
+/*
+ * Non-blocking A/AAAA resolution with libudns, driven by the loop through a
+ * uv_poll_t on the resolver's UDP socket instead of libuv's thread pool.
+ * One resolv_ctx per loop, create them on one thread before the loops run.
+ * Concurrent queries for the same name share a single pair of DNS requests.
+ * Their answers are kept for the records' TTL, a name asked again within it
+ * completes on the next loop iteration without a request.
+ * Without a usable nameserver socket a name costs one uv_getaddrinfo()
+ * instead, shared the same way but not kept, as it reports no TTL.
+ * Nameservers given as tls://host[:port] take every lookup over DNS over
+ * TLS instead, see dns_tls.h.
+ */
 
-struct uv_loop_s;
+#define RESOLV_MAX_ADDRS 8  /* Per address family. */
+
+struct resolv_ctx;
 struct resolv_query;
 
-int resolv_init(struct uv_loop_s *, char **, int, int);
-struct resolv_query * resolv_query(const char *hostname,
-                                   void (*client_cb)(struct sockaddr *, void *),
-                                   void (*client_free_cb)(void *),
-                                   void *client_cb_data, uint16_t port);
-void resolv_cancel(struct resolv_query *);
-void resolv_shutdown(struct uv_loop_s *);
+/* |addrs| holds the preferred family first, |port| set. |status| is 0 or a UV_EAI_* code. */
+typedef void (*resolv_query_cb)(int status, const union sockaddr_universal *addrs, size_t count, void *data);
+
+/* |nameservers| is a comma separated list, NULL or "" reads the system resolver config. */
+struct resolv_ctx * resolv_init(uv_loop_t *loop, const char *nameservers, bool ipv6_first);
+/* Pending queries complete with UV_ECANCELED, the context is freed once its handles are closed. */
+void resolv_shutdown(struct resolv_ctx *ctx);
+/* NULL when the query couldn't be submitted. The handle is gone once |cb| runs. */
+struct resolv_query * resolv_query(struct resolv_ctx *ctx, const char *hostname, uint16_t port,
+                                   resolv_query_cb cb, void *data);
+/* |cb| won't run. */
+void resolv_cancel(struct resolv_query *query);
 
 #endif
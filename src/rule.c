@@ -29,8 +29,11 @@
 #include "config.h"
 #endif
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <uv.h>
 
 #ifdef __MINGW32__
 extern void ss_error(const char *s);
@@ -39,6 +42,9 @@ extern void ss_error(const char *s);
 #include "rule.h"
 #include "ssrutils.h"
 
+#define RULE_COMPILE_SHARE   32  /* Patterns worth one more compiling thread. */
+#define RULE_COMPILE_THREADS 8
+
 static void free_rule(rule_t *);
 
 rule_t *
@@ -74,42 +80,483 @@ accept_rule_arg(rule_t *rule, const char *arg)
 }
 
 void
-add_rule(struct cork_dllist *rules, rule_t *rule)
+init_rule_set(rule_set_t *set)
+{
+    cork_dllist_init(&set->rules);
+    cork_dllist_init(&set->regexes);
+    cork_dllist_init(&set->keywords);
+    set->exact  = cork_string_hash_table_new(0, 0);
+    set->suffix = cork_string_hash_table_new(0, 0);
+}
+
+static void
+free_rule_batches(rule_set_t *set)
+{
+    while (set->batches != NULL) {
+        struct rule_batch *batch = set->batches;
+        size_t i;
+        set->batches = batch->next;
+        // Back to one pcre_exec() each.
+        for (i = 0; i < batch->count; i++) {
+            batch->rules[i]->batched = 0;
+            cork_dllist_add(&set->regexes, &batch->rules[i]->scanned);
+        }
+#ifdef PCRE_STUDY_JIT_COMPILE
+        pcre_free_study(batch->extra);
+#else
+        pcre_free(batch->extra);
+#endif
+        pcre_free(batch->pattern_re);
+        free(batch);
+    }
+}
+
+void
+free_rule_set(rule_set_t *set)
+{
+    struct cork_dllist_item *iter;
+    free_rule_batches(set);
+    while ((iter = cork_dllist_head(&set->rules)) != NULL) {
+        rule_t *rule = cork_container_of(iter, rule_t, entries);
+        remove_rule(set, rule);
+    }
+    if (set->exact != NULL) {
+        cork_hash_table_free(set->exact);
+        set->exact = NULL;
+    }
+    if (set->suffix != NULL) {
+        cork_hash_table_free(set->suffix);
+        set->suffix = NULL;
+    }
+}
+
+static struct cork_hash_table *
+rule_table(const rule_set_t *set, const rule_t *rule)
+{
+    switch (rule->kind) {
+    case RULE_EXACT:
+        return set->exact;
+    case RULE_SUFFIX:
+        return set->suffix;
+    default:
+        return NULL;
+    }
+}
+
+void
+add_rule(rule_set_t *set, rule_t *rule)
+{
+    struct cork_hash_table *table = rule_table(set, rule);
+
+    cork_dllist_add(&set->rules, &rule->entries);
+    if (table != NULL) {
+        // A duplicate stays owned by the list, the first one answers.
+        if (cork_hash_table_get(table, rule->literal) == NULL) {
+            cork_hash_table_put(table, rule->literal, rule, NULL, NULL, NULL);
+        }
+    } else if (rule->kind == RULE_KEYWORD) {
+        cork_dllist_add(&set->keywords, &rule->scanned);
+    } else {
+        cork_dllist_add(&set->regexes, &rule->scanned);
+    }
+}
+
+/*
+ * Unescapes [begin, end) into a plain domain or keyword, NULL when it
+ * holds anything but letters, digits, '-', '_' and "\.".
+ */
+static char *
+rule_literal(const char *begin, const char *end)
+{
+    char *literal, *out;
+
+    if (begin >= end) {
+        return NULL;
+    }
+    literal = out = malloc((size_t)(end - begin) + 1);
+    if (literal == NULL) {
+        return NULL;
+    }
+    while (begin < end) {
+        char c = *begin++;
+        if (c == '\\' && begin < end && *begin == '.') {
+            *out++ = *begin++;
+        } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                   (c >= '0' && c <= '9') || c == '-' || c == '_') {
+            *out++ = c;
+        } else {
+            free(literal);
+            return NULL;
+        }
+    }
+    *out = '\0';
+    return literal;
+}
+
+static void
+classify_rule(rule_t *rule)
 {
-    cork_dllist_add(rules, &rule->entries);
+    static const char suffix_anchor[] = "(^|\\.)";
+    const char *pattern = rule->pattern;
+    const char *end     = pattern + strlen(pattern);
+    bool anchored_end   = (end > pattern && end[-1] == '$');
+
+    if (anchored_end && strncmp(pattern, suffix_anchor, sizeof(suffix_anchor) - 1) == 0) {
+        rule->literal = rule_literal(pattern + sizeof(suffix_anchor) - 1, end - 1);
+        rule->kind    = RULE_SUFFIX;
+    } else if (anchored_end && pattern[0] == '^') {
+        rule->literal = rule_literal(pattern + 1, end - 1);
+        rule->kind    = RULE_EXACT;
+    } else {
+        rule->literal = rule_literal(pattern, end);
+        rule->kind    = RULE_KEYWORD;
+    }
+    if (rule->literal == NULL) {
+        rule->kind = RULE_REGEX;
+    }
 }
 
 int
 init_rule(rule_t *rule)
 {
+    if (rule->pattern == NULL) {
+        return 0;
+    }
+    if (rule->literal == NULL && rule->pattern_re == NULL) {
+        classify_rule(rule);
+    }
+    return 1;
+}
+
+static void
+compile_rule(rule_t *rule)
+{
+    const char *reerr;
+    int reerroffset;
+
+    rule->pattern_re =
+        pcre_compile(rule->pattern, 0, &reerr, &reerroffset, NULL);
     if (rule->pattern_re == NULL) {
-        const char *reerr;
-        int reerroffset;
+        LOGE("Regex compilation of \"%s\" failed: %s, offset %d",
+             rule->pattern, reerr, reerroffset);
+    }
+}
+
+/* Jobs 0 to |count| - 1, each taken by whichever thread comes first. */
+struct rule_compile_jobs {
+    void (*run)(struct rule_compile_jobs *jobs, size_t index);
+    size_t count;
+    size_t next;
+    rule_t **rules;
+    struct rule_batch **batches;
+    size_t *batch_sizes;
+};
 
-        rule->pattern_re =
-            pcre_compile(rule->pattern, 0, &reerr, &reerroffset, NULL);
-        if (rule->pattern_re == NULL) {
-            LOGE("Regex compilation of \"%s\" failed: %s, offset %d",
-                 rule->pattern, reerr, reerroffset);
-            return 0;
+static void
+rule_compile_worker(void *arg)
+{
+    struct rule_compile_jobs *jobs = (struct rule_compile_jobs *)arg;
+    size_t index;
+
+    while ((index = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->count) {
+        jobs->run(jobs, index);
+    }
+}
+
+/* Runs every job, on this thread and on as many more as the jobs and the cores justify. */
+static void
+rule_compile_parallel(struct rule_compile_jobs *jobs)
+{
+    uv_thread_t threads[RULE_COMPILE_THREADS - 1];
+    size_t wanted = jobs->count / RULE_COMPILE_SHARE, started = 0, i;
+    size_t cores  = (size_t)uv_available_parallelism();
+
+    if (wanted > cores) {
+        wanted = cores;
+    }
+    for (; started + 1 < wanted && started < sizeof(threads) / sizeof(threads[0]); started++) {
+        if (uv_thread_create(&threads[started], rule_compile_worker, jobs) != 0) {
+            break;
         }
     }
+    rule_compile_worker(jobs);
+    // Joined, what the jobs wrote is visible here.
+    for (i = 0; i < started; i++) {
+        uv_thread_join(&threads[i]);
+    }
+}
 
-    return 1;
+static void
+compile_rule_job(struct rule_compile_jobs *jobs, size_t index)
+{
+    compile_rule(jobs->rules[index]);
+}
+
+/* Capture groups of |rule|, -1 when it can't be joined with others. */
+static int
+rule_capture_count(const rule_t *rule)
+{
+    int captures = 0, backrefs = 0;
+
+    if (rule->pattern_re == NULL
+        || pcre_fullinfo(rule->pattern_re, NULL, PCRE_INFO_CAPTURECOUNT, &captures) != 0
+        || pcre_fullinfo(rule->pattern_re, NULL, PCRE_INFO_BACKREFMAX, &backrefs) != 0) {
+        return -1;
+    }
+    // \1 would point at another rule's group once renumbered.
+    return (backrefs > 0) ? -1 : captures;
+}
+
+static struct rule_batch *
+compile_rule_batch(rule_t **rules, size_t count)
+{
+    struct rule_batch *batch;
+    size_t i, size = 1;
+    char *pattern, *out;
+    const char *reerr;
+    int reerroffset, group = 1;
+
+    for (i = 0; i < count; i++) {
+        size += strlen(rules[i]->pattern) + 3;
+    }
+    batch   = calloc(1, sizeof(*batch));
+    pattern = malloc(size);
+    if (batch == NULL || pattern == NULL) {
+        free(batch);
+        free(pattern);
+        return NULL;
+    }
+    out = pattern;
+    for (i = 0; i < count; i++) {
+        size_t len = strlen(rules[i]->pattern);
+        if (i > 0) {
+            *out++ = '|';
+        }
+        *out++ = '(';
+        memcpy(out, rules[i]->pattern, len);
+        out  += len;
+        *out++ = ')';
+        batch->rules[i]  = rules[i];
+        batch->groups[i] = group;
+        group += 1 + rule_capture_count(rules[i]);
+    }
+    *out = '\0';
+    batch->count        = count;
+    batch->ovector_size = group * 3;
+
+    batch->pattern_re = pcre_compile(pattern, 0, &reerr, &reerroffset, NULL);
+    free(pattern);
+    if (batch->pattern_re == NULL) {
+        // Something like an unterminated \Q or (?x) comment, it stays on its own.
+        free(batch);
+        return NULL;
+    }
+#ifdef PCRE_STUDY_JIT_COMPILE
+    batch->extra = pcre_study(batch->pattern_re, PCRE_STUDY_JIT_COMPILE, &reerr);
+#else
+    batch->extra = pcre_study(batch->pattern_re, 0, &reerr);
+#endif
+    return batch;
+}
+
+static void
+add_rule_batch(rule_set_t *set, struct rule_batch *batch)
+{
+    size_t i;
+
+    if (batch == NULL) {
+        return;
+    }
+    for (i = 0; i < batch->count; i++) {
+        batch->rules[i]->batched = 1;
+        cork_dllist_remove(&batch->rules[i]->scanned);
+    }
+    batch->next  = set->batches;
+    set->batches = batch;
+}
+
+static void
+compile_rule_batch_job(struct rule_compile_jobs *jobs, size_t index)
+{
+    rule_t **rules = jobs->rules + index * RULE_BATCH_MAX;
+    jobs->batches[index] = compile_rule_batch(rules, jobs->batch_sizes[index]);
+}
+
+void
+compile_rule_sets(rule_set_t *sets, size_t count)
+{
+    struct rule_compile_jobs jobs;
+    struct cork_dllist_item *curr, *next;
+    size_t regexes = 0, batches = 0, i;
+    size_t *set_batches;
+
+    for (i = 0; i < count; i++) {
+        free_rule_batches(&sets[i]);
+        cork_dllist_foreach_void(&sets[i].regexes, curr, next) {
+            regexes++;
+        }
+    }
+    if (regexes == 0) {
+        return;
+    }
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.rules       = malloc(regexes * sizeof(rule_t *) + RULE_BATCH_MAX * count * sizeof(rule_t *));
+    jobs.batches     = calloc(regexes / 2 + count, sizeof(struct rule_batch *));
+    jobs.batch_sizes = calloc(regexes / 2 + count, sizeof(size_t));
+    set_batches      = calloc(count, sizeof(size_t));
+    if (jobs.rules == NULL || jobs.batches == NULL || jobs.batch_sizes == NULL || set_batches == NULL) {
+        goto done;
+    }
+
+    // Each regex on its own first, a batch needs to know its capture groups.
+    for (i = 0; i < count; i++) {
+        cork_dllist_foreach_void(&sets[i].regexes, curr, next) {
+            rule_t *rule = cork_container_of(curr, rule_t, scanned);
+            if (rule->pattern_re == NULL) {
+                jobs.rules[jobs.count++] = rule;
+            }
+        }
+    }
+    jobs.run = compile_rule_job;
+    rule_compile_parallel(&jobs);
+
+    // Then the batches, in slots of RULE_BATCH_MAX rules. A lone rule isn't worth one.
+    for (i = 0; i < count; i++) {
+        size_t pending = 0;
+        cork_dllist_foreach_void(&sets[i].regexes, curr, next) {
+            rule_t *rule = cork_container_of(curr, rule_t, scanned);
+            if (rule_capture_count(rule) < 0) {
+                continue;
+            }
+            jobs.rules[batches * RULE_BATCH_MAX + pending++] = rule;
+            if (pending == RULE_BATCH_MAX) {
+                jobs.batch_sizes[batches++] = pending;
+                set_batches[i]++;
+                pending = 0;
+            }
+        }
+        if (pending > 1) {
+            jobs.batch_sizes[batches++] = pending;
+            set_batches[i]++;
+        }
+    }
+    jobs.run   = compile_rule_batch_job;
+    jobs.count = batches;
+    jobs.next  = 0;
+    rule_compile_parallel(&jobs);
+
+    batches = 0;
+    for (i = 0; i < count; i++) {
+        size_t j;
+        for (j = 0; j < set_batches[i]; j++) {
+            add_rule_batch(&sets[i], jobs.batches[batches++]);
+        }
+    }
+
+done:
+    free(jobs.rules);
+    free(jobs.batches);
+    free(jobs.batch_sizes);
+    free(set_batches);
+}
+
+void
+compile_rule_set(rule_set_t *set)
+{
+    compile_rule_sets(set, 1);
+}
+
+static rule_t *
+lookup_literal(const rule_set_t *set, const char *host)
+{
+    struct cork_dllist_item *curr, *next;
+    const char *label;
+    rule_t *rule;
+
+    rule = cork_hash_table_get(set->exact, host);
+    if (rule != NULL) {
+        return rule;
+    }
+    // example.com, then com, for a.example.com.
+    for (label = host; label != NULL; label = strchr(label, '.')) {
+        if (*label == '.') {
+            label++;
+        }
+        rule = cork_hash_table_get(set->suffix, label);
+        if (rule != NULL) {
+            return rule;
+        }
+    }
+    cork_dllist_foreach_void(&set->keywords, curr, next) {
+        rule = cork_container_of(curr, rule_t, scanned);
+        if (strstr(host, rule->literal) != NULL) {
+            return rule;
+        }
+    }
+    return NULL;
 }
 
 rule_t *
-lookup_rule(const struct cork_dllist *rules, const char *name, size_t name_len)
+lookup_rule(const rule_set_t *set, const char *name, size_t name_len)
 {
     struct cork_dllist_item *curr, *next;
+    const struct rule_batch *batch;
+    rule_t *rule = NULL;
 
     if (name == NULL) {
         name     = "";
         name_len = 0;
     }
 
-    cork_dllist_foreach_void(rules, curr, next) {
-        rule_t *rule = cork_container_of(curr, rule_t, entries);
+    if (name_len > 0) {
+        char local[256];
+        char *host = (name_len < sizeof(local)) ? local : malloc(name_len + 1);
+        if (host != NULL) {
+            memcpy(host, name, name_len);
+            host[name_len] = '\0';
+            rule = lookup_literal(set, host);
+            if (host != local) {
+                free(host);
+            }
+            if (rule != NULL) {
+                return rule;
+            }
+        }
+    }
+
+    for (batch = set->batches; batch != NULL; batch = batch->next) {
+        int ovector[RULE_BATCH_MAX * 6 + 3];  /* One group per rule and one of its own. */
+        int *ov = ovector;
+        size_t i;
+        if (batch->ovector_size > (int)(sizeof(ovector) / sizeof(ovector[0]))) {
+            ov = malloc(sizeof(int) * (size_t)batch->ovector_size);
+            if (ov == NULL) {
+                continue;
+            }
+        }
+        rule = NULL;
+        if (pcre_exec(batch->pattern_re, batch->extra,
+                      name, (int)name_len, 0, 0, ov, batch->ovector_size) >= 0) {
+            // The one alternative that matched has its group set.
+            for (i = 0; i < batch->count && rule == NULL; i++) {
+                if (ov[batch->groups[i] * 2] >= 0) {
+                    rule = batch->rules[i];
+                }
+            }
+            if (rule == NULL) {
+                rule = batch->rules[0];
+            }
+        }
+        if (ov != ovector) {
+            free(ov);
+        }
+        if (rule != NULL) {
+            return rule;
+        }
+    }
+
+    cork_dllist_foreach_void(&set->regexes, curr, next) {
+        rule = cork_container_of(curr, rule_t, scanned);
         if (pcre_exec(rule->pattern_re, NULL,
                       name, (int)name_len, 0, 0, NULL, 0) >= 0)
             return rule;
@@ -119,9 +566,21 @@ lookup_rule(const struct cork_dllist *rules, const char *name, size_t name_len)
 }
 
 void
-remove_rule(rule_t *rule)
+remove_rule(rule_set_t *set, rule_t *rule)
 {
+    struct cork_hash_table *table = rule_table(set, rule);
+
+    if (rule->batched) {
+        free_rule_batches(set);
+    }
     cork_dllist_remove(&rule->entries);
+    if (table != NULL) {
+        if (cork_hash_table_get(table, rule->literal) == rule) {
+            cork_hash_table_delete(table, rule->literal, NULL, NULL);
+        }
+    } else {
+        cork_dllist_remove(&rule->scanned);
+    }
     free_rule(rule);
 }
 
@@ -131,7 +590,10 @@ free_rule(rule_t *rule)
     if (rule == NULL)
         return;
 
-    safe_free(rule->pattern);
+    if (!rule->borrowed) {
+        safe_free(rule->pattern);
+        safe_free(rule->literal);
+    }
     if (rule->pattern_re != NULL)
         pcre_free(rule->pattern_re);
     safe_free(rule);
@@ -39,19 +39,66 @@
 //#include <pcre/pcre.h>
 //#endif
 
+enum rule_kind {
+    RULE_REGEX,   /* Anything else, run with PCRE. */
+    RULE_EXACT,   /* ^example\.com$ */
+    RULE_SUFFIX,  /* (^|\.)example\.com$ */
+    RULE_KEYWORD, /* example, no metacharacters */
+};
+
 typedef struct rule {
     char *pattern;
 
     /* Runtime fields */
+    enum rule_kind kind;
+    char *literal;  /* Unescaped domain or keyword, when not RULE_REGEX. */
     pcre *pattern_re;
 
+    int batched;  /* Matched through a rule_batch, off the regex list. */
+    int borrowed; /* pattern and literal point into a mapped ACL file. */
+
     struct cork_dllist_item entries;
+    struct cork_dllist_item scanned;  /* On the regex or keyword list. */
 } rule_t;
 
-void add_rule(struct cork_dllist *, rule_t *);
+#define RULE_BATCH_MAX 256  /* Patterns per alternation, PCRE caps the compiled size. */
+
+/* Up to RULE_BATCH_MAX regexes joined into one (p1)|(p2)|... pattern. */
+struct rule_batch {
+    pcre *pattern_re;
+    pcre_extra *extra;  /* JIT code, where available. */
+    size_t count;
+    rule_t *rules[RULE_BATCH_MAX];
+    int groups[RULE_BATCH_MAX];  /* Capture group wrapping each rule. */
+    int ovector_size;
+    struct rule_batch *next;
+};
+
+/*
+ * The rules of one ACL section. Exact and suffix domains are looked up in
+ * hash tables, one probe per label of the name, and keywords with
+ * strstr(). Only the patterns of no common shape are left to PCRE.
+ */
+typedef struct rule_set {
+    struct cork_dllist rules;     /* Every rule, owned. */
+    struct cork_dllist regexes;
+    struct cork_dllist keywords;
+    struct cork_hash_table *exact;   /* literal -> rule_t */
+    struct cork_hash_table *suffix;
+    struct rule_batch *batches;
+} rule_set_t;
+
+void init_rule_set(rule_set_t *);
+void free_rule_set(rule_set_t *);
+/* Once every rule is added, joins the regexes so a lookup runs ~1/RULE_BATCH_MAX of the pcre_exec() calls. */
+/* Compiles the regexes of |count| sets and joins them into batches, spread over threads. */
+void compile_rule_sets(rule_set_t *sets, size_t count);
+void compile_rule_set(rule_set_t *);
+void add_rule(rule_set_t *, rule_t *);
+/* Classifies the rule, a regex is compiled by compile_rule_sets(). */
 int init_rule(rule_t *);
-rule_t *lookup_rule(const struct cork_dllist *, const char *, size_t);
-void remove_rule(rule_t *);
+rule_t *lookup_rule(const rule_set_t *, const char *, size_t);
+void remove_rule(rule_set_t *, rule_t *);
 rule_t *new_rule();
 int accept_rule_arg(rule_t *, const char *);
 
@@ -62,6 +62,7 @@
 #include "utils.h"
 #include "acl.h"
 #include "server.h"
+#include "traffic_shm.h"
 
 #ifndef EAGAIN
 #define EAGAIN EWOULDBLOCK
@@ -122,8 +123,11 @@ static int server_conn = 0;
 static char *bind_address    = NULL;
 static char *server_port     = NULL;
 static char *manager_address = NULL;
+static char *traffic_file    = NULL;
 uint64_t tx                  = 0;
 uint64_t rx                  = 0;
+static struct traffic_shm *traffic_shm   = NULL;
+static struct traffic_slot *traffic_slot = NULL;
 ev_timer stat_update_watcher;
 ev_timer block_list_watcher;
 
@@ -631,6 +635,9 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     }
 
     tx += r;
+    if (traffic_slot != NULL) {
+        traffic_slot_add(traffic_slot, r);
+    }
 
     if (server->stage == STAGE_ERROR) {
         server->buf->len = 0;
@@ -1110,6 +1117,9 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     }
 
     rx += r;
+    if (traffic_slot != NULL) {
+        traffic_slot_add(traffic_slot, r);
+    }
 
     server->buf->len = r;
     int err = ss_encrypt(&cipher_env, server->buf, server->e_ctx, BUF_SIZE);
@@ -1496,6 +1506,7 @@ main(int argc, char **argv)
         { "acl",             required_argument, 0, 0 },
         { "manager-address", required_argument, 0, 0 },
         { "mtu",             required_argument, 0, 0 },
+        { "traffic-file",    required_argument, 0, 0 },
         { "help",            no_argument,       0, 0 },
 #ifdef __linux__
         { "mptcp",           no_argument,       0, 0 },
@@ -1523,12 +1534,14 @@ main(int argc, char **argv)
                 mtu = atoi(optarg);
                 LOGI("set MTU to %d", mtu);
             } else if (option_index == 4) {
+                traffic_file = optarg;
+            } else if (option_index == 5) {
                 usage();
                 exit(EXIT_SUCCESS);
-            } else if (option_index == 5) {
+            } else if (option_index == 6) {
                 mptcp = 1;
                 LOGI("enable multipath TCP");
-            } else if (option_index == 6) {
+            } else if (option_index == 7) {
                 firewall = 1;
                 LOGI("enable firewall rules");
             }
@@ -1801,7 +1814,16 @@ main(int argc, char **argv)
             LOGI("listening at %s:%s", host ? host : "*", server_port);
     }
 
-    if (manager_address != NULL) {
+    if (traffic_file != NULL) {
+        traffic_shm  = traffic_shm_open(traffic_file);
+        traffic_slot = traffic_shm_find(traffic_shm, server_port);
+        if (traffic_slot == NULL) {
+            LOGE("no traffic slot for port %s in %s", server_port, traffic_file);
+        }
+    }
+
+    // A manager without the shared counters still gets stat messages.
+    if (manager_address != NULL && traffic_slot == NULL) {
         ev_timer_init(&stat_update_watcher, stat_update_cb, UPDATE_INTERVAL, UPDATE_INTERVAL);
         ev_timer_start(EV_DEFAULT, &stat_update_watcher);
     }
@@ -1839,9 +1861,10 @@ main(int argc, char **argv)
     // Free block list
     free_block_list();
 
-    if (manager_address != NULL) {
+    if (manager_address != NULL && traffic_slot == NULL) {
         ev_timer_stop(EV_DEFAULT, &stat_update_watcher);
     }
+    traffic_shm_close(traffic_shm);
     ev_timer_stop(EV_DEFAULT, &block_list_watcher);
 
     // Clean up
@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "handoff.h"
+#include "common.h"
+#include "dump_info.h"
+
+#if !defined(_WIN32)
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define HANDOFF_MAGIC "SSRH"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+#if !defined(MSG_CMSG_CLOEXEC)
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+/* What goes with the descriptors. */
+struct handoff_header {
+    char magic[4];
+    uint32_t count;
+};
+
+struct handoff {
+    uv_pipe_t pipe;
+    char *path;
+    handoff_collect_cb collect_cb;
+    handoff_sent_cb sent_cb;
+    void *p;
+};
+
+static int handoff_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return UV_ENAMETOOLONG;
+    }
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+size_t handoff_receive(const char *path, int *fds, size_t max) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_LISTENERS_MAX)];
+    } control;
+    struct handoff_header header = { { 0 } };
+    struct iovec iov = { &header, sizeof(header) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sockaddr_un addr;
+    struct timeval tv = { HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000 };
+    size_t count = 0;
+    ssize_t n;
+    char byte;
+    int sock;
+
+    if (handoff_address(path, &addr) != 0 || (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return 0;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        // Nothing serves it, the first start.
+        close(sock);
+        return 0;
+    }
+    (void)setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        pr_err("no listeners from %s: %s", path, strerror(errno));
+        close(sock);
+        return 0;
+    }
+    {
+        // It hangs up once it let go of the rest, the manager's port.
+        ssize_t r;
+        while ((r = recv(sock, &byte, 1, 0)) > 0 || (r < 0 && errno == EINTR)) {
+        }
+    }
+    close(sock);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        const int *passed = (const int *)CMSG_DATA(cmsg);
+        size_t index, passed_count;
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        passed_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (index = 0; index < passed_count; ++index) {
+            if (count < max) {
+                fds[count++] = passed[index];
+            } else {
+                close(passed[index]);
+            }
+        }
+    }
+    if ((size_t)n != sizeof(header) || memcmp(header.magic, HANDOFF_MAGIC, sizeof(header.magic)) != 0 ||
+        ntohl(header.count) != count || (msg.msg_flags & MSG_CTRUNC))
+    {
+        pr_err("unexpected handoff from %s, starting afresh", path);
+        while (count) {
+            close(fds[--count]);
+        }
+    }
+    return count;
+}
+
+void handoff_discard(const int *fds, size_t count) {
+    while (count) {
+        close(fds[--count]);
+    }
+}
+
+static int handoff_send(int sock, const int *fds, size_t count) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_LISTENERS_MAX)];
+    } control;
+    struct handoff_header header;
+    struct iovec iov = { &header, sizeof(header) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    if (count == 0 || count > HANDOFF_LISTENERS_MAX) {
+        return UV_EINVAL;
+    }
+    memcpy(header.magic, HANDOFF_MAGIC, sizeof(header.magic));
+    header.count = htonl((uint32_t)count);
+
+    memset(&control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    // A fresh connection's buffer takes it whole.
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return -errno;
+    }
+    return ((size_t)n == sizeof(header)) ? 0 : UV_EIO;
+}
+
+static void handoff_peer_close_done_cb(uv_handle_t *handle) {
+    free(handle);
+}
+
+static void handoff_connection_cb(uv_stream_t *server, int status) {
+    struct handoff *handoff = CONTAINER_OF(server, struct handoff, pipe);
+    int fds[HANDOFF_LISTENERS_MAX];
+    uv_os_fd_t fd = (uv_os_fd_t)-1;
+    uv_pipe_t *peer;
+    int error;
+
+    if (status != 0) {
+        return;
+    }
+    peer = (uv_pipe_t *) calloc(1, sizeof(*peer));
+    VERIFY(0 == uv_pipe_init(server->loop, peer, 0));
+    error = uv_accept(server, (uv_stream_t *)peer);
+    if (error == 0) {
+        error = uv_fileno((uv_handle_t *)peer, &fd);
+    }
+    if (error == 0) {
+        error = handoff_send((int)fd, fds, handoff->collect_cb(handoff->p, fds, HANDOFF_LISTENERS_MAX));
+    }
+    // The successor goes on once this hangs up, after the owner is done.
+    handoff->sent_cb(handoff->p, error);
+    uv_close((uv_handle_t *)peer, handoff_peer_close_done_cb);
+}
+
+struct handoff * handoff_serve(uv_loop_t *loop, const char *path, handoff_collect_cb collect_cb, handoff_sent_cb sent_cb, void *p) {
+    struct sockaddr_un addr;
+    struct handoff *handoff;
+    int sock, error = 0;
+
+    if ((error = handoff_address(path, &addr)) == 0) {
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            error = -errno;
+        } else {
+            (void)unlink(path);
+            if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                error = -errno;
+                close(sock);
+            }
+        }
+    }
+    if (error != 0) {
+        pr_err("upgrade_socket %s: %s", path, uv_strerror(error));
+        return NULL;
+    }
+
+    handoff = (struct handoff *) calloc(1, sizeof(*handoff));
+    handoff->path = strdup(path);
+    handoff->collect_cb = collect_cb;
+    handoff->sent_cb = sent_cb;
+    handoff->p = p;
+    VERIFY(0 == uv_pipe_init(loop, &handoff->pipe, 0));
+    // Opened rather than bound, so closing it leaves the path to the successor.
+    error = uv_pipe_open(&handoff->pipe, sock);
+    if (error != 0) {
+        close(sock);
+    } else {
+        error = uv_listen((uv_stream_t *)&handoff->pipe, 1, handoff_connection_cb);
+    }
+    if (error != 0) {
+        pr_err("upgrade_socket %s: %s", path, uv_strerror(error));
+        handoff_shutdown(handoff, true);
+        return NULL;
+    }
+    return handoff;
+}
+
+static void handoff_close_done_cb(uv_handle_t *handle) {
+    struct handoff *handoff = CONTAINER_OF(handle, struct handoff, pipe);
+    free(handoff->path);
+    free(handoff);
+}
+
+void handoff_shutdown(struct handoff *handoff, bool unlink_path) {
+    if (handoff == NULL) {
+        return;
+    }
+    if (unlink_path) {
+        (void)unlink(handoff->path);
+    }
+    uv_close((uv_handle_t *)&handoff->pipe, handoff_close_done_cb);
+}
+
+#else
+
+size_t handoff_receive(const char *path, int *fds, size_t max) {
+    (void)path; (void)fds; (void)max;
+    return 0;
+}
+
+void handoff_discard(const int *fds, size_t count) {
+    (void)fds; (void)count;
+}
+
+struct handoff * handoff_serve(uv_loop_t *loop, const char *path, handoff_collect_cb collect_cb, handoff_sent_cb sent_cb, void *p) {
+    (void)loop; (void)collect_cb; (void)sent_cb; (void)p;
+    pr_warn("upgrade_socket %s: not supported on this platform", path);
+    return NULL;
+}
+
+void handoff_shutdown(struct handoff *handoff, bool unlink_path) {
+    (void)handoff; (void)unlink_path;
+}
+
+#endif // !defined(_WIN32)
@@ -0,0 +1,39 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <uv.h>
+
+/*
+ * Listening sockets passed from a running ssr-server to its successor over
+ * a Unix socket, with SCM_RIGHTS. The successor connects to the path
+ * before it listens and is sent the descriptors at once, the connections
+ * in their queues are then its to accept. The running one closes its own
+ * copies and serves its tunnels until they're done. POSIX only.
+ */
+
+#define HANDOFF_LISTENERS_MAX   64
+#define HANDOFF_TIMEOUT_MS      5000  /* Of the successor's wait for the descriptors. */
+
+/*
+ * The listeners of the server on |path| into |fds|, at most |max|, blocking.
+ * Their number, 0 when there's none there, or it sent nothing.
+ */
+size_t handoff_receive(const char *path, int *fds, size_t max);
+/* Closes received descriptors left unused. */
+void handoff_discard(const int *fds, size_t count);
+
+struct handoff;
+
+/* The descriptors to pass into |fds|, their number. */
+typedef size_t (*handoff_collect_cb)(void *p, int *fds, size_t max);
+/* After they were passed, |status| 0, or failed to be. The successor waits for it. */
+typedef void (*handoff_sent_cb)(void *p, int status);
+
+/* Waits for a successor on |path|, replacing a socket left there. NULL if it can't. */
+struct handoff * handoff_serve(uv_loop_t *loop, const char *path, handoff_collect_cb collect_cb, handoff_sent_cb sent_cb, void *p);
+/* |unlink_path| false once a successor owns the path. */
+void handoff_shutdown(struct handoff *handoff, bool unlink_path);
+
+#endif // __HANDOFF_H__
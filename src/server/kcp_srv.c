@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kcp_srv.h"
+#include "kcp_transport.h"
+#include "common.h"
+#include "dump_info.h"
+#include "ssr_executive.h"
+#include "ssrbuffer.h"
+#include "buffer_pool.h"
+#include "sockaddr_universal.h"
+
+struct kcp_srv_conn;
+
+struct kcp_srv {
+    uv_loop_t *loop;
+    struct kcp_endpoint *ep;
+    struct buffer_pool *buffer_pool;
+    union sockaddr_universal listener;
+    struct kcp_srv_conn *conns;
+};
+
+struct kcp_srv_conn {
+    struct kcp_srv *srv;
+    struct kcp_session *session;  /* NULL once it's gone. */
+    uv_tcp_t tcp;
+    uv_connect_t connect_req;
+    struct buffer_t *pending;  /* From the client before the connect finished. */
+    size_t writing;  /* Bytes of the writes in flight. */
+    bool connected;
+    bool read_paused;  /* The conversation's send queue is full. */
+    bool closing;
+    struct kcp_srv_conn *prev;
+    struct kcp_srv_conn *next;
+};
+
+struct kcp_srv_write {
+    uv_write_t req;
+    struct buffer_t *buf;
+    struct kcp_srv_conn *conn;
+};
+
+static void conn_on_data(void *p, const uint8_t *data, size_t size);
+static void conn_on_writable(void *p);
+static void conn_on_close(void *p);
+
+static const struct kcp_session_callbacks conn_callbacks = {
+    &conn_on_data,
+    &conn_on_writable,
+    &conn_on_close,
+};
+
+static void conn_close_done_cb(uv_handle_t *handle) {
+    struct kcp_srv_conn *conn = (struct kcp_srv_conn *)handle->data;
+    buffer_release(conn->pending);
+    free(conn);
+}
+
+static void conn_close(struct kcp_srv_conn *conn) {
+    struct kcp_srv *srv = conn->srv;
+
+    if (conn->closing) {
+        return;
+    }
+    conn->closing = true;
+    if (conn->session) {
+        kcp_session_close(conn->session);
+        conn->session = NULL;
+    }
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        srv->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    uv_close((uv_handle_t *)&conn->tcp, conn_close_done_cb);
+}
+
+static void conn_write_done_cb(uv_write_t *req, int status) {
+    struct kcp_srv_write *wr = CONTAINER_OF(req, struct kcp_srv_write, req);
+    struct kcp_srv_conn *conn = wr->conn;
+
+    conn->writing -= wr->buf->len;
+    buffer_release(wr->buf);
+    free(wr);
+    if (conn->closing) {
+        return;
+    }
+    if (status < 0) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->session && conn->writing < KCP_SRV_WRITE_HIGH / 2) {
+        kcp_session_pause(conn->session, false);
+    }
+}
+
+/* Takes over |buf|. */
+static void conn_write(struct kcp_srv_conn *conn, struct buffer_t *buf) {
+    struct kcp_srv_write *wr = (struct kcp_srv_write *)calloc(1, sizeof(*wr));
+    uv_buf_t o = uv_buf_init((char *)buf->buffer, (unsigned int)buf->len);
+
+    wr->buf = buf;
+    wr->conn = conn;
+    if (uv_write(&wr->req, (uv_stream_t *)&conn->tcp, &o, 1, conn_write_done_cb) != 0) {
+        buffer_release(buf);
+        free(wr);
+        conn_close(conn);
+        return;
+    }
+    conn->writing += buf->len;
+    if (conn->session && conn->writing >= KCP_SRV_WRITE_HIGH) {
+        kcp_session_pause(conn->session, true);
+    }
+}
+
+static void conn_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct kcp_srv_conn *conn = (struct kcp_srv_conn *)handle->data;
+    (void)suggested_size;
+    *buf = uv_buf_init((char *)buffer_pool_alloc(conn->srv->buffer_pool, SSR_BUFF_SIZE), SSR_BUFF_SIZE);
+}
+
+static void conn_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct kcp_srv_conn *conn = (struct kcp_srv_conn *)stream->data;
+    struct buffer_pool *pool = conn->srv->buffer_pool;
+
+    if (conn->closing || nread == 0) {
+        // Nothing.
+    } else if (nread < 0) {
+        // The server ends a mux session once it's done with it, or on an error.
+        conn_close(conn);
+    } else if (kcp_session_send(conn->session, (const uint8_t *)buf->base, (size_t)nread) == false) {
+        uv_read_stop(stream);
+        conn->read_paused = true;
+    }
+    if (buf->base) {
+        buffer_pool_free(pool, buf->base);
+    }
+}
+
+static void conn_connect_done_cb(uv_connect_t *req, int status) {
+    struct kcp_srv_conn *conn = CONTAINER_OF(req, struct kcp_srv_conn, connect_req);
+
+    if (conn->closing) {
+        return;
+    }
+    if (status < 0) {
+        pr_err("kcp: connecting to the listener failed: %s", uv_strerror(status));
+        conn_close(conn);
+        return;
+    }
+    conn->connected = true;
+    if (conn->pending) {
+        struct buffer_t *pending = conn->pending;
+        conn->pending = NULL;
+        conn_write(conn, pending);
+    }
+    if (conn->closing == false) {
+        uv_read_start((uv_stream_t *)&conn->tcp, conn_alloc_cb, conn_read_cb);
+    }
+}
+
+static void conn_on_data(void *p, const uint8_t *data, size_t size) {
+    struct kcp_srv_conn *conn = (struct kcp_srv_conn *)p;
+
+    if (conn->closing) {
+        return;
+    }
+    if (conn->connected == false) {
+        if (conn->pending == NULL) {
+            conn->pending = buffer_create(size);
+        }
+        buffer_concatenate(conn->pending, data, size);
+        if (conn->pending->len >= KCP_SRV_WRITE_HIGH) {
+            kcp_session_pause(conn->session, true);
+        }
+        return;
+    }
+    conn_write(conn, buffer_create_from(data, size));
+}
+
+static void conn_on_writable(void *p) {
+    struct kcp_srv_conn *conn = (struct kcp_srv_conn *)p;
+
+    if (conn->closing || conn->read_paused == false) {
+        return;
+    }
+    conn->read_paused = false;
+    uv_read_start((uv_stream_t *)&conn->tcp, conn_alloc_cb, conn_read_cb);
+}
+
+static void conn_on_close(void *p) {
+    struct kcp_srv_conn *conn = (struct kcp_srv_conn *)p;
+    conn->session = NULL;
+    conn_close(conn);
+}
+
+static void kcp_srv_accept(void *p, struct kcp_session *session, const union sockaddr_universal *peer) {
+    struct kcp_srv *srv = (struct kcp_srv *)p;
+    struct kcp_srv_conn *conn = (struct kcp_srv_conn *) calloc(1, sizeof(*conn));
+    (void)peer;
+
+    conn->srv = srv;
+    conn->session = session;
+    kcp_session_set_callbacks(session, &conn_callbacks, conn);
+    uv_tcp_init(srv->loop, &conn->tcp);
+    conn->tcp.data = conn;
+    uv_tcp_nodelay(&conn->tcp, 1);
+    conn->next = srv->conns;
+    if (srv->conns) {
+        srv->conns->prev = conn;
+    }
+    srv->conns = conn;
+    if (uv_tcp_connect(&conn->connect_req, &conn->tcp, &srv->listener.addr, conn_connect_done_cb) != 0) {
+        conn_close(conn);
+    }
+}
+
+struct kcp_srv * kcp_srv_create(uv_loop_t *loop, struct server_env_t *env) {
+    struct server_config *config = env->config;
+    union sockaddr_universal addr = { 0 };
+    struct kcp_srv *srv;
+
+    if (config->kcp_port == 0) {
+        return NULL;
+    }
+    srv = (struct kcp_srv *) calloc(1, sizeof(*srv));
+    srv->loop = loop;
+    srv->buffer_pool = env->read_buffer_pool;
+    // Where listener_start() binds, every IPv4 address.
+    srv->listener.addr4.sin_family = AF_INET;
+    srv->listener.addr4.sin_port = htons(config->listen_port);
+    srv->listener.addr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    addr.addr4.sin_family = AF_INET;
+    addr.addr4.sin_port = htons(config->kcp_port);
+    addr.addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+    srv->ep = kcp_endpoint_create(loop, config, &addr, kcp_srv_accept, srv);
+    if (srv->ep == NULL) {
+        free(srv);
+        return NULL;
+    }
+    return srv;
+}
+
+void kcp_srv_shutdown(struct kcp_srv *srv) {
+    if (srv == NULL) {
+        return;
+    }
+    while (srv->conns) {
+        conn_close(srv->conns);
+    }
+    kcp_endpoint_release(srv->ep);
+    free(srv);
+}
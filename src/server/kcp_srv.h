@@ -0,0 +1,24 @@
+#ifndef __KCP_SRV_H__
+#define __KCP_SRV_H__ 1
+
+#include <uv.h>
+
+struct server_env_t;
+struct kcp_srv;
+
+/*
+ * The server end of the KCP transport on kcp_port. Every conversation a
+ * client opens is bridged to this worker's own TCP listener over
+ * loopback, so it meets the protocol, obfs, cipher and mux handling of
+ * any TCP connection. Those tunnels see the loopback address as the
+ * client's.
+ */
+
+#define KCP_SRV_WRITE_HIGH (256 * 1024)  /* Bytes to the listener in flight, beyond them the conversation waits. */
+
+/* NULL without kcp_port, or if it can't be bound. */
+struct kcp_srv * kcp_srv_create(uv_loop_t *loop, struct server_env_t *env);
+/* Resets the conversations and closes their connections. */
+void kcp_srv_shutdown(struct kcp_srv *srv);
+
+#endif // __KCP_SRV_H__
@@ -0,0 +1,332 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "loop_balance.h"
+#include "tunnel_stats.h"
+#include "common.h"
+#include "dump_info.h"
+
+#if !defined(_WIN32)
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct loop_load {
+    struct loop_balance *balance;
+    const struct tunnel_stats *stats;  // __weak_ptr
+    loop_balance_adopt_cb adopt_cb;
+    void *p;
+    uv_timer_t *sample;
+    uv_async_t *wake;
+    uint64_t sample_due;
+    uint64_t sampled_at;
+    uint64_t bytes_seen;
+
+    /* Written by the loop, read by any. */
+    uint64_t lag_ms;
+    uint64_t byte_rate;
+    uint64_t handed;
+    uint64_t taken;
+
+    uv_mutex_t lock;
+    int attached;  /* Under |lock|, read without it by the others' picks. */
+    uv_os_sock_t *queue;  /* Under |lock|. */
+    size_t queue_count;
+};
+
+struct loop_balance {
+    unsigned int lag_ms;
+    size_t count;
+    struct loop_load *loads;
+};
+
+static uint64_t load_read(const uint64_t *value) {
+    return __sync_add_and_fetch((uint64_t *)value, 0);
+}
+
+static void load_write(uint64_t *value, uint64_t v) {
+    (void)__sync_lock_test_and_set(value, v);
+}
+
+static void loop_balance_close_done_cb(uv_handle_t *handle) {
+    free(handle);
+}
+
+static void loop_balance_close_all(uv_os_sock_t *socks, size_t count) {
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        close(socks[i]);
+    }
+}
+
+static void loop_balance_sample_cb(uv_timer_t *handle) {
+    struct loop_load *load = (struct loop_load *)handle->data;
+    uint64_t now = uv_now(handle->loop);
+    uint64_t lag = (now > load->sample_due) ? now - load->sample_due : 0;
+    uint64_t bytes = load->stats ? load->stats->bytes_incoming + load->stats->bytes_outgoing : 0;
+    uint64_t elapsed = (now > load->sampled_at) ? now - load->sampled_at : 1;
+
+    // A quarter of the new sample, one slow turn doesn't send everything away.
+    load_write(&load->lag_ms, (load_read(&load->lag_ms) * 3 + lag) / 4);
+    load_write(&load->byte_rate, (bytes - load->bytes_seen) * 1000 / elapsed);
+    load->bytes_seen = bytes;
+    load->sampled_at = now;
+    load->sample_due = now + LOOP_BALANCE_PERIOD_MS;
+}
+
+static void loop_balance_wake_cb(uv_async_t *handle) {
+    struct loop_load *load = (struct loop_load *)handle->data;
+    uv_os_sock_t *queue;
+    size_t count, i;
+
+    uv_mutex_lock(&load->lock);
+    queue = load->queue;
+    count = load->queue_count;
+    load->queue = NULL;
+    load->queue_count = 0;
+    uv_mutex_unlock(&load->lock);
+
+    for (i = 0; i < count; ++i) {
+        if (load->adopt_cb(load->p, queue[i]) != 0) {
+            close(queue[i]);
+            continue;
+        }
+        load_write(&load->taken, load->taken + 1);
+    }
+    free(queue);
+}
+
+/* The least loaded loop for a new connection of |index|, |index| itself when it keeps it. */
+static size_t loop_balance_pick(struct loop_balance *balance, size_t index) {
+    uint64_t lag = load_read(&balance->loads[index].lag_ms);
+    uint64_t best_lag, best_rate = UINT64_MAX;
+    size_t best = index, i;
+
+    if (lag < balance->lag_ms) {
+        return index;
+    }
+    // Only to a loop at most half as late, or the connections bounce.
+    best_lag = lag / 2;
+    for (i = 0; i < balance->count; ++i) {
+        struct loop_load *load = &balance->loads[i];
+        uint64_t l, r;
+        if (i == index || __sync_add_and_fetch(&load->attached, 0) == 0) {
+            continue;
+        }
+        l = load_read(&load->lag_ms);
+        r = load_read(&load->byte_rate);
+        if (l < best_lag || (l == best_lag && r < best_rate)) {
+            best = i;
+            best_lag = l;
+            best_rate = r;
+        }
+    }
+    return best;
+}
+
+/* The connection waiting on |listener| as a socket of its own. */
+static int loop_balance_accept(uv_stream_t *listener, uv_os_sock_t *sock) {
+    uv_tcp_t *tcp = (uv_tcp_t *) calloc(1, sizeof(*tcp));
+    uv_os_fd_t fd;
+    int err;
+
+    VERIFY(0 == uv_tcp_init(listener->loop, tcp));
+    err = uv_accept(listener, (uv_stream_t *)tcp);
+    if (err == 0) {
+        err = uv_fileno((uv_handle_t *)tcp, &fd);
+    }
+    if (err == 0) {
+        // The handle belongs to this loop, what's handed on is a copy of it.
+        int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (copy < 0) {
+            err = uv_translate_sys_error(errno);
+        } else {
+            *sock = (uv_os_sock_t)copy;
+        }
+    }
+    uv_close((uv_handle_t *)tcp, loop_balance_close_done_cb);
+    return err;
+}
+
+static bool loop_balance_queue(struct loop_load *load, uv_os_sock_t sock) {
+    bool queued = false;
+    uv_mutex_lock(&load->lock);
+    if (load->attached && load->queue_count < LOOP_BALANCE_QUEUE_MAX) {
+        if (load->queue == NULL) {
+            load->queue = (uv_os_sock_t *) malloc(LOOP_BALANCE_QUEUE_MAX * sizeof(*load->queue));
+        }
+        load->queue[load->queue_count++] = sock;
+        // Under the lock, the handle isn't closed while it's sent.
+        uv_async_send(load->wake);
+        queued = true;
+    }
+    uv_mutex_unlock(&load->lock);
+    return queued;
+}
+
+struct loop_balance * loop_balance_create(size_t loops, unsigned int lag_ms) {
+    struct loop_balance *balance;
+    size_t i;
+
+    if (loops < 2 || lag_ms == 0) {
+        return NULL;
+    }
+    balance = (struct loop_balance *) calloc(1, sizeof(*balance));
+    balance->lag_ms = lag_ms;
+    balance->count = loops;
+    balance->loads = (struct loop_load *) calloc(loops, sizeof(*balance->loads));
+    for (i = 0; i < loops; ++i) {
+        balance->loads[i].balance = balance;
+        VERIFY(0 == uv_mutex_init(&balance->loads[i].lock));
+    }
+    return balance;
+}
+
+void loop_balance_destroy(struct loop_balance *balance) {
+    size_t i;
+    if (balance == NULL) {
+        return;
+    }
+    for (i = 0; i < balance->count; ++i) {
+        struct loop_load *load = &balance->loads[i];
+        ASSERT(load->attached == 0);
+        loop_balance_close_all(load->queue, load->queue_count);
+        free(load->queue);
+        uv_mutex_destroy(&load->lock);
+    }
+    free(balance->loads);
+    free(balance);
+}
+
+void loop_balance_attach(struct loop_balance *balance, size_t index, uv_loop_t *loop, const struct tunnel_stats *stats, loop_balance_adopt_cb adopt_cb, void *p) {
+    struct loop_load *load;
+    if (balance == NULL) {
+        return;
+    }
+    ASSERT(index < balance->count);
+    load = &balance->loads[index];
+    load->stats = stats;
+    load->adopt_cb = adopt_cb;
+    load->p = p;
+    load->bytes_seen = stats ? stats->bytes_incoming + stats->bytes_outgoing : 0;
+    load->sampled_at = uv_now(loop);
+    load->sample_due = load->sampled_at + LOOP_BALANCE_PERIOD_MS;
+
+    load->sample = (uv_timer_t *) calloc(1, sizeof(*load->sample));
+    VERIFY(0 == uv_timer_init(loop, load->sample));
+    load->sample->data = load;
+    VERIFY(0 == uv_timer_start(load->sample, loop_balance_sample_cb, LOOP_BALANCE_PERIOD_MS, LOOP_BALANCE_PERIOD_MS));
+    uv_unref((uv_handle_t *)load->sample);
+
+    load->wake = (uv_async_t *) calloc(1, sizeof(*load->wake));
+    VERIFY(0 == uv_async_init(loop, load->wake, loop_balance_wake_cb));
+    load->wake->data = load;
+    uv_unref((uv_handle_t *)load->wake);
+
+    uv_mutex_lock(&load->lock);
+    load->attached = 1;
+    uv_mutex_unlock(&load->lock);
+}
+
+void loop_balance_detach(struct loop_balance *balance, size_t index) {
+    struct loop_load *load;
+    uv_os_sock_t *queue;
+    size_t count;
+
+    if (balance == NULL) {
+        return;
+    }
+    load = &balance->loads[index];
+    uv_mutex_lock(&load->lock);
+    if (load->attached == 0) {
+        uv_mutex_unlock(&load->lock);
+        return;
+    }
+    load->attached = 0;
+    queue = load->queue;
+    count = load->queue_count;
+    load->queue = NULL;
+    load->queue_count = 0;
+    uv_mutex_unlock(&load->lock);
+
+    // Their clients retry, as after any reset.
+    loop_balance_close_all(queue, count);
+    free(queue);
+    uv_close((uv_handle_t *)load->sample, loop_balance_close_done_cb);
+    uv_close((uv_handle_t *)load->wake, loop_balance_close_done_cb);
+    load->sample = NULL;
+    load->wake = NULL;
+}
+
+bool loop_balance_steer(struct loop_balance *balance, size_t index, uv_stream_t *listener) {
+    struct loop_load *self;
+    uv_os_sock_t sock;
+    size_t target;
+    int err;
+
+    if (balance == NULL) {
+        return false;
+    }
+    self = &balance->loads[index];
+    target = loop_balance_pick(balance, index);
+    if (target == index) {
+        return false;
+    }
+    if ((err = loop_balance_accept(listener, &sock)) != 0) {
+        pr_warn("loop balance: accept: %s", uv_strerror(err));
+        return true;
+    }
+    if (loop_balance_queue(&balance->loads[target], sock)) {
+        load_write(&self->handed, self->handed + 1);
+        return true;
+    }
+    if (self->adopt_cb(self->p, sock) != 0) {
+        close(sock);
+    }
+    return true;
+}
+
+void loop_balance_get_stats(const struct loop_balance *balance, size_t index, struct loop_balance_stats *stats) {
+    const struct loop_load *load;
+    memset(stats, 0, sizeof(*stats));
+    if (balance == NULL) {
+        return;
+    }
+    load = &balance->loads[index];
+    stats->lag_ms = load_read(&load->lag_ms);
+    stats->byte_rate = load_read(&load->byte_rate);
+    stats->handed = load_read(&load->handed);
+    stats->taken = load_read(&load->taken);
+}
+
+#else
+
+struct loop_balance * loop_balance_create(size_t loops, unsigned int lag_ms) {
+    (void)loops; (void)lag_ms;
+    return NULL;
+}
+
+void loop_balance_destroy(struct loop_balance *balance) {
+    (void)balance;
+}
+
+void loop_balance_attach(struct loop_balance *balance, size_t index, uv_loop_t *loop, const struct tunnel_stats *stats, loop_balance_adopt_cb adopt_cb, void *p) {
+    (void)balance; (void)index; (void)loop; (void)stats; (void)adopt_cb; (void)p;
+}
+
+void loop_balance_detach(struct loop_balance *balance, size_t index) {
+    (void)balance; (void)index;
+}
+
+bool loop_balance_steer(struct loop_balance *balance, size_t index, uv_stream_t *listener) {
+    (void)balance; (void)index; (void)listener;
+    return false;
+}
+
+void loop_balance_get_stats(const struct loop_balance *balance, size_t index, struct loop_balance_stats *stats) {
+    (void)balance; (void)index;
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif // !defined(_WIN32)
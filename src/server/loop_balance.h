@@ -0,0 +1,55 @@
+#ifndef __LOOP_BALANCE_H__
+#define __LOOP_BALANCE_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * New connections of an overloaded ssr-server worker taken in by the least
+ * loaded one. Every loop samples itself on a timer, how late the timer
+ * fires and the bytes its tunnels moved, and publishes both. A loop whose
+ * lag passes |lag_ms| accepts a new connection as a bare socket and queues
+ * it to a loop at most half as late, the one with the fewest bytes moving
+ * among the least late; that loop is woken through a uv_async_t and makes
+ * a tunnel of it. Nothing of the tunnel exists before. The workers share
+ * one process, so the descriptor itself goes, no pipe in between. The
+ * samples are read without a lock, each loop's queue is under its own.
+ * POSIX only.
+ */
+
+#define LOOP_BALANCE_PERIOD_MS  100   /* Of each loop's sample. */
+#define LOOP_BALANCE_QUEUE_MAX  256   /* Sockets waiting on one loop, past it they stay where they were accepted. */
+
+struct loop_balance;
+struct tunnel_stats;
+
+/* Makes a tunnel of |sock| on its loop, an error and it's closed. */
+typedef int (*loop_balance_adopt_cb)(void *p, uv_os_sock_t sock);
+
+struct loop_balance_stats {
+    uint64_t lag_ms;      /* Smoothed timer lag. */
+    uint64_t byte_rate;   /* Per second, both ways, over the last sample. */
+    uint64_t handed;      /* Connections accepted here and sent away. */
+    uint64_t taken;       /* Sent here and made tunnels of. */
+};
+
+/* For |loops| loops, NULL with fewer than two, or no |lag_ms|. */
+struct loop_balance * loop_balance_create(size_t loops, unsigned int lag_ms);
+/* Once every loop is detached and has run its handles' close callbacks. */
+void loop_balance_destroy(struct loop_balance *balance);
+/* Before |loop| runs. |stats| is read for its byte counts on the loop's thread. */
+void loop_balance_attach(struct loop_balance *balance, size_t index, uv_loop_t *loop, const struct tunnel_stats *stats, loop_balance_adopt_cb adopt_cb, void *p);
+/* On the loop's thread, it takes no more; the sockets still queued to it are closed. */
+void loop_balance_detach(struct loop_balance *balance, size_t index);
+/*
+ * For a connection waiting on |listener| of loop |index|. True when it was
+ * accepted and handed on, or adopted on the spot when that failed; false
+ * when the loop isn't overloaded, or no other has room, it's the caller's.
+ */
+bool loop_balance_steer(struct loop_balance *balance, size_t index, uv_stream_t *listener);
+/* Of loop |index|, from any thread. */
+void loop_balance_get_stats(const struct loop_balance *balance, size_t index, struct loop_balance_stats *stats);
+
+#endif // __LOOP_BALANCE_H__
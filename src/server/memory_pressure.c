@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include "memory_pressure.h"
+#include "buffer_pool.h"
+#include "ssr_alloc.h"
+#include "tunnel.h"
+#include "tunnel_stats.h"
+#include "common.h"
+#include "dump_info.h"
+
+struct memory_pressure {
+    size_t budget;
+    unsigned int idle_timeout;
+    unsigned int current;  /* The idle timeout of the last period. */
+    struct buffer_pool *pool;  // __weak_ptr
+    struct tunnel_stats *stats;  // __weak_ptr, may be NULL
+    memory_pressure_walk_cb walk_cb;
+    void *p;
+    uv_timer_t timer;
+    bool closed;
+    bool pressed;  /* Past half the budget at the last period. */
+
+    /* Of the period's sweep. */
+    uint64_t now;
+    bool evicting;
+    struct tunnel_ctx **idle;
+    size_t idle_count;
+    size_t idle_capacity;
+};
+
+static size_t memory_pressure_used(void) {
+    struct ssr_alloc_stats stats[ssr_alloc_kind_max];
+    int64_t used;
+    ssr_alloc_get_stats(stats);
+    used = stats[ssr_alloc_buffers].bytes + stats[ssr_alloc_tunnels].bytes + stats[ssr_alloc_obfs].bytes;
+    return (used > 0) ? (size_t)used : 0;
+}
+
+/* From idle_timeout at half the budget down to the floor at the budget. */
+static unsigned int memory_pressure_timeout(const struct memory_pressure *mp, size_t used) {
+    size_t soft = mp->budget / 2;
+    unsigned int floor = (mp->idle_timeout < MEMORY_PRESSURE_MIN_IDLE_MS) ? mp->idle_timeout : MEMORY_PRESSURE_MIN_IDLE_MS;
+    uint64_t above;
+
+    if (used <= soft) {
+        return mp->idle_timeout;
+    }
+    above = (uint64_t)(((used < mp->budget) ? used : mp->budget) - soft);
+    return mp->idle_timeout - (unsigned int)((uint64_t)(mp->idle_timeout - floor) * above / (mp->budget - soft));
+}
+
+static void memory_pressure_reclaim(struct memory_pressure *mp, struct tunnel_ctx *tunnel) {
+    if (mp->stats) {
+        mp->stats->tunnels_reclaimed++;
+    }
+    tunnel_shutdown(tunnel);
+}
+
+static void memory_pressure_sweep_cb(struct tunnel_ctx *tunnel, void *arg) {
+    struct memory_pressure *mp = (struct memory_pressure *)arg;
+    uint64_t idle;
+
+    if (tunnel->terminated || tunnel->kernel_relay) {
+        return;
+    }
+    idle = (mp->now > tunnel->active_at) ? mp->now - tunnel->active_at : 0;
+    if (idle < MEMORY_PRESSURE_QUIET_MS) {
+        return;
+    }
+    if (idle >= mp->current) {
+        memory_pressure_reclaim(mp, tunnel);
+        return;
+    }
+    tunnel_trim_now(tunnel);
+    if (mp->evicting) {
+        if (mp->idle_count == mp->idle_capacity) {
+            size_t capacity = mp->idle_capacity ? mp->idle_capacity * 2 : 64;
+            struct tunnel_ctx **idle_list = (struct tunnel_ctx **) realloc(mp->idle, capacity * sizeof(*idle_list));
+            if (idle_list == NULL) {
+                return;
+            }
+            mp->idle = idle_list;
+            mp->idle_capacity = capacity;
+        }
+        mp->idle[mp->idle_count++] = tunnel;
+    }
+}
+
+static int memory_pressure_compare(const void *a, const void *b) {
+    const struct tunnel_ctx *x = *(struct tunnel_ctx * const *)a;
+    const struct tunnel_ctx *y = *(struct tunnel_ctx * const *)b;
+    return (x->active_at > y->active_at) - (x->active_at < y->active_at);
+}
+
+static void memory_pressure_timer_cb(uv_timer_t *handle) {
+    struct memory_pressure *mp = CONTAINER_OF(handle, struct memory_pressure, timer);
+    size_t used = memory_pressure_used(), i, n;
+    bool pressed = (used > mp->budget / 2);
+
+    mp->current = memory_pressure_timeout(mp, used);
+    if (pressed != mp->pressed) {
+        mp->pressed = pressed;
+        if (pressed) {
+            pr_warn("memory pressure, %zu of %zu bytes, idle tunnels trimmed and closed after %u ms", used, mp->budget, mp->current);
+        } else {
+            pr_info("memory pressure eased, %zu of %zu bytes", used, mp->budget);
+        }
+    }
+    if (pressed == false) {
+        return;
+    }
+
+    // What's cached goes first, it serves no tunnel.
+    buffer_pool_trim(mp->pool);
+    mp->now = uv_now(handle->loop);
+    mp->evicting = (used > mp->budget);
+    mp->idle_count = 0;
+    mp->walk_cb(mp->p, memory_pressure_sweep_cb, mp);
+    if (mp->idle_count == 0) {
+        return;
+    }
+    // The longest idle first, the ones least likely to be used again.
+    qsort(mp->idle, mp->idle_count, sizeof(*mp->idle), memory_pressure_compare);
+    n = (mp->idle_count < MEMORY_PRESSURE_EVICT_BATCH) ? mp->idle_count : MEMORY_PRESSURE_EVICT_BATCH;
+    for (i = 0; i < n; ++i) {
+        if (mp->idle[i]->terminated == false) {
+            memory_pressure_reclaim(mp, mp->idle[i]);
+        }
+    }
+    mp->idle_count = 0;
+}
+
+struct memory_pressure * memory_pressure_create(uv_loop_t *loop, size_t budget, unsigned int idle_timeout, struct buffer_pool *pool,
+                                                struct tunnel_stats *stats, memory_pressure_walk_cb walk_cb, void *p)
+{
+    struct memory_pressure *mp;
+    if (budget == 0) {
+        return NULL;
+    }
+    mp = (struct memory_pressure *) calloc(1, sizeof(*mp));
+    mp->budget = budget;
+    mp->idle_timeout = idle_timeout;
+    mp->current = idle_timeout;
+    mp->pool = pool;
+    mp->stats = stats;
+    mp->walk_cb = walk_cb;
+    mp->p = p;
+    VERIFY(0 == uv_timer_init(loop, &mp->timer));
+    VERIFY(0 == uv_timer_start(&mp->timer, memory_pressure_timer_cb, MEMORY_PRESSURE_PERIOD_MS, MEMORY_PRESSURE_PERIOD_MS));
+    uv_unref((uv_handle_t *)&mp->timer);
+    return mp;
+}
+
+void memory_pressure_shutdown(struct memory_pressure *mp) {
+    if (mp == NULL || mp->closed) {
+        return;
+    }
+    mp->closed = true;
+    uv_close((uv_handle_t *)&mp->timer, NULL);
+}
+
+void memory_pressure_destroy(struct memory_pressure *mp) {
+    if (mp == NULL) {
+        return;
+    }
+    free(mp->idle);
+    free(mp);
+}
+
+unsigned int memory_pressure_idle_timeout(const struct memory_pressure *mp) {
+    return mp ? mp->current : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __MEMORY_PRESSURE_H__
+#define __MEMORY_PRESSURE_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * ssr-server's idle tunnels given up as memory runs short, so a surge
+ * slows the quiet ones down instead of the process being killed. Every
+ * MEMORY_PRESSURE_PERIOD_MS a loop weighs what the allocator counts for
+ * the tunnels, read buffers and tunnel blocks, the tunnels' own and the
+ * obfs plugins', against memory_budget. Up to half of it nothing changes.
+ * Past half the loop's pool frees its cached blocks, the tunnels quiet
+ * for MEMORY_PRESSURE_QUIET_MS trim their buffers, and the idle timeout
+ * shrinks in step with the memory, from idle_timeout down to
+ * MEMORY_PRESSURE_MIN_IDLE_MS at the budget; a tunnel idle that long is
+ * closed. Over the budget the longest idle of the quiet ones are closed
+ * as well, MEMORY_PRESSURE_EVICT_BATCH a period, until it's back under.
+ * Tunnels the kernel relays hold no buffers and are left alone. The count
+ * is the process's, each worker acts on it with its own tunnels. Not
+ * thread safe: one per uv_loop_t.
+ */
+
+#define MEMORY_PRESSURE_PERIOD_MS    1000
+#define MEMORY_PRESSURE_QUIET_MS     1000  /* Without traffic, before a tunnel counts as idle. */
+#define MEMORY_PRESSURE_MIN_IDLE_MS  (5 * 1000)
+#define MEMORY_PRESSURE_EVICT_BATCH  64  /* Idle tunnels closed per period while over the budget. */
+
+struct tunnel_ctx;
+struct tunnel_stats;
+struct buffer_pool;
+struct memory_pressure;
+
+/* Calls |fn| with |arg| for each of the loop's tunnels, |fn| may shut them down. */
+typedef void (*memory_pressure_walk_cb)(void *p, void(*fn)(struct tunnel_ctx *tunnel, void *arg), void *arg);
+
+/* NULL without |budget|. */
+struct memory_pressure * memory_pressure_create(uv_loop_t *loop, size_t budget, unsigned int idle_timeout, struct buffer_pool *pool,
+                                                struct tunnel_stats *stats, memory_pressure_walk_cb walk_cb, void *p);
+/* Closes the timer, it's gone once the loop has run. */
+void memory_pressure_shutdown(struct memory_pressure *mp);
+/* After the loop has ended. */
+void memory_pressure_destroy(struct memory_pressure *mp);
+/* As of the last period, idle_timeout while there's no pressure. */
+unsigned int memory_pressure_idle_timeout(const struct memory_pressure *mp);
+
+#endif // __MEMORY_PRESSURE_H__
@@ -0,0 +1,358 @@
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif // !defined(_WIN32)
+#include "mux_srv.h"
+#include "mux.h"
+#include "common.h"
+#include "dump_info.h"
+#include "netutils.h"
+#include "ssr_executive.h"
+#include "ssrbuffer.h"
+#include "buffer_pool.h"
+#include "sockaddr_universal.h"
+#include "dns_cache.h"
+#include "tunnel_stats.h"
+#include "resolv.h"
+#include "acl.h"
+#include "egress_pool.h"
+
+struct mux_srv_stream {
+    struct mux_stream *stream;  /* NULL once either side closed it. */
+    struct buffer_pool *buffer_pool;
+    struct dns_cache *dns_cache;
+    struct egress_pool *egress_pool;
+    struct resolv_query *query;
+    uv_getaddrinfo_t addrinfo_req;
+    uv_connect_t connect_req;
+    uv_tcp_t tcp;
+    struct buffer_t *pending;  /* From the client before the connect finished. */
+    struct socks5_address target;
+    bool acl;  /* Outbound blocking by the config's ACL. */
+    int refs;  /* The handle, and a uv_getaddrinfo() in flight. */
+    size_t writes;
+    bool connected;
+    bool paused;  /* The client's window is used up. */
+    bool closing;
+};
+
+struct mux_srv_write {
+    uv_write_t req;
+    struct buffer_t *buf;
+    struct mux_srv_stream *s;
+};
+
+static void stream_on_data(void *p, const uint8_t *data, size_t size);
+static void stream_on_window(void *p);
+static void stream_on_close(void *p, bool reset);
+
+static const struct mux_stream_callbacks stream_callbacks = {
+    &stream_on_data,
+    &stream_on_window,
+    &stream_on_close,
+};
+
+static void stream_release(struct mux_srv_stream *s) {
+    if (--s->refs == 0) {
+        buffer_release(s->pending);
+        free(s);
+    }
+}
+
+static void stream_close_done_cb(uv_handle_t *handle) {
+    stream_release((struct mux_srv_stream *)handle->data);
+}
+
+static void stream_close(struct mux_srv_stream *s, bool reset) {
+    if (s->closing) {
+        return;
+    }
+    s->closing = true;
+    if (s->query) {
+        resolv_cancel(s->query);
+        s->query = NULL;
+    }
+    if (s->refs > 1) {
+        uv_cancel((uv_req_t *)&s->addrinfo_req);
+    }
+    if (s->stream) {
+        mux_stream_close(s->stream, reset);
+        s->stream = NULL;
+    }
+    uv_close((uv_handle_t *)&s->tcp, stream_close_done_cb);
+}
+
+/* Both directions are over once the client's FIN and its data went out. */
+static void stream_finish_if_done(struct mux_srv_stream *s) {
+    if (s->stream == NULL && s->writes == 0 && s->pending == NULL) {
+        stream_close(s, false);
+    }
+}
+
+static void stream_write_done_cb(uv_write_t *req, int status) {
+    struct mux_srv_write *wr = CONTAINER_OF(req, struct mux_srv_write, req);
+    struct mux_srv_stream *s = wr->s;
+    size_t size = wr->buf->len;
+
+    buffer_release(wr->buf);
+    free(wr);
+    s->writes--;
+    if (s->closing) {
+        return;
+    }
+    if (status < 0) {
+        stream_close(s, true);
+        return;
+    }
+    if (s->stream) {
+        mux_stream_consumed(s->stream, size);
+    }
+    stream_finish_if_done(s);
+}
+
+/* Takes over |buf|. */
+static void stream_write(struct mux_srv_stream *s, struct buffer_t *buf) {
+    struct mux_srv_write *wr = (struct mux_srv_write *)calloc(1, sizeof(*wr));
+    uv_buf_t o = uv_buf_init((char *)buf->buffer, (unsigned int)buf->len);
+
+    wr->buf = buf;
+    wr->s = s;
+    if (uv_write(&wr->req, (uv_stream_t *)&s->tcp, &o, 1, stream_write_done_cb) != 0) {
+        buffer_release(buf);
+        free(wr);
+        stream_close(s, true);
+        return;
+    }
+    s->writes++;
+}
+
+static void stream_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct mux_srv_stream *s = (struct mux_srv_stream *)handle->data;
+    (void)suggested_size;
+    *buf = uv_buf_init((char *)buffer_pool_alloc(s->buffer_pool, MUX_FRAME_PAYLOAD_MAX), MUX_FRAME_PAYLOAD_MAX);
+}
+
+static void stream_read_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf) {
+    struct mux_srv_stream *s = (struct mux_srv_stream *)handle->data;
+
+    if (s->closing || nread == 0) {
+        // Nothing.
+    } else if (nread < 0) {
+        uv_read_stop(handle);
+        if (s->stream) {
+            mux_stream_close(s->stream, nread != UV_EOF);
+            s->stream = NULL;
+        }
+        // Let what the client sent before go out first.
+        stream_finish_if_done(s);
+    } else if (s->stream) {
+        if (mux_stream_send(s->stream, (const uint8_t *)buf->base, (size_t)nread) == false) {
+            uv_read_stop(handle);
+            s->paused = true;
+        }
+    }
+    if (buf->base) {
+        buffer_pool_free(s->buffer_pool, buf->base);
+    }
+}
+
+static void stream_connect_done_cb(uv_connect_t *req, int status) {
+    struct mux_srv_stream *s = CONTAINER_OF(req, struct mux_srv_stream, connect_req);
+
+    if (s->closing) {
+        return;
+    }
+    if (status < 0) {
+        stream_close(s, true);
+        return;
+    }
+    s->connected = true;
+    if (s->pending) {
+        struct buffer_t *pending = s->pending;
+        s->pending = NULL;
+        stream_write(s, pending);
+    }
+    if (s->stream && s->closing == false) {
+        uv_read_start((uv_stream_t *)&s->tcp, stream_alloc_cb, stream_read_cb);
+    }
+}
+
+static void stream_connect(struct mux_srv_stream *s, const union sockaddr_universal *addr) {
+    if (s->acl) {
+        char ip[INET6_ADDRSTRLEN + 1] = { 0 };
+        if (outbound_block_match_host(universal_address_to_string(addr, ip, sizeof(ip))) == 1) {
+            stream_close(s, true);
+            return;
+        }
+    }
+#if !defined(_WIN32)
+    if (s->egress_pool) {
+        int fd = socket(addr->addr.sa_family, SOCK_STREAM, IPPROTO_TCP);
+        if (fd >= 0) {
+            (void)egress_pool_bind(s->egress_pool, fd, addr);
+            if (uv_tcp_open(&s->tcp, fd) != 0) {
+                close(fd);
+            }
+        }
+    }
+#endif // !defined(_WIN32)
+    if (uv_tcp_connect(&s->connect_req, &s->tcp, &addr->addr, stream_connect_done_cb) != 0) {
+        stream_close(s, true);
+    }
+}
+
+static void stream_resolved(struct mux_srv_stream *s, int status, const union sockaddr_universal *addrs, size_t count) {
+    const char *host = s->target.addr.domainname;
+
+    if (status == 0 && count > 0) {
+        dns_cache_store(s->dns_cache, host, addrs, count);
+        stream_connect(s, &addrs[0]);
+        return;
+    }
+    if (status == UV_EAI_NONAME || status == UV_EAI_NODATA) {
+        dns_cache_store_failure(s->dns_cache, host);
+    }
+    stream_close(s, true);
+}
+
+static void stream_resolv_cb(int status, const union sockaddr_universal *addrs, size_t count, void *data) {
+    struct mux_srv_stream *s = (struct mux_srv_stream *)data;
+    s->query = NULL;
+    stream_resolved(s, status, addrs, count);
+}
+
+static void stream_getaddrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai) {
+    struct mux_srv_stream *s = CONTAINER_OF(req, struct mux_srv_stream, addrinfo_req);
+    union sockaddr_universal addrs[DNS_CACHE_MAX_ADDRS];
+    size_t count = 0, index;
+
+    if (status == 0) {
+        count = universal_addresses_from_addrinfo(ai, addrs, DNS_CACHE_MAX_ADDRS);
+        for (index = 0; index < count; ++index) {
+            addrs[index].addr4.sin_port = htons(s->target.port);
+        }
+    }
+    if (ai) {
+        uv_freeaddrinfo(ai);
+    }
+    if (s->closing == false) {
+        stream_resolved(s, status, addrs, count);
+    }
+    stream_release(s);
+}
+
+static void stream_on_data(void *p, const uint8_t *data, size_t size) {
+    struct mux_srv_stream *s = (struct mux_srv_stream *)p;
+
+    if (s->closing) {
+        return;
+    }
+    if (s->connected == false) {
+        if (s->pending == NULL) {
+            s->pending = buffer_create(size);
+        }
+        buffer_concatenate(s->pending, data, size);
+        return;
+    }
+    stream_write(s, buffer_create_from(data, size));
+}
+
+static void stream_on_window(void *p) {
+    struct mux_srv_stream *s = (struct mux_srv_stream *)p;
+
+    if (s->closing || s->paused == false) {
+        return;
+    }
+    s->paused = false;
+    uv_read_start((uv_stream_t *)&s->tcp, stream_alloc_cb, stream_read_cb);
+}
+
+static void stream_on_close(void *p, bool reset) {
+    struct mux_srv_stream *s = (struct mux_srv_stream *)p;
+
+    s->stream = NULL;
+    if (reset) {
+        stream_close(s, true);
+    } else if (s->closing == false) {
+        stream_finish_if_done(s);
+    }
+}
+
+void mux_srv_stream_accept(uv_loop_t *loop, struct server_env_t *env, struct dns_cache *cache,
+                           struct mux_stream *stream, const uint8_t *target, size_t size)
+{
+    struct mux_srv_stream *s;
+    union sockaddr_universal addr;
+    const char *host;
+    uint16_t port;
+
+    s = (struct mux_srv_stream *) calloc(1, sizeof(*s));
+    if (socks5_address_parse(target, size, &s->target) == false) {
+        free(s);
+        mux_stream_close(stream, true);
+        return;
+    }
+    s->stream = stream;
+    s->buffer_pool = env->read_buffer_pool;
+    s->dns_cache = cache;
+    s->egress_pool = env->egress_pool;
+    s->acl = (env->config->acl != NULL);
+    s->refs = 1;
+    uv_tcp_init(loop, &s->tcp);
+    s->tcp.data = s;
+    mux_stream_set_callbacks(stream, &stream_callbacks, s);
+
+    host = s->target.addr.domainname;
+    port = s->target.port;
+    if (s->acl && s->target.addr_type == SOCKS5_ADDRTYPE_DOMAINNAME && outbound_block_match_host(host) == 1) {
+        stream_close(s, true);
+        return;
+    }
+    if (socks5_address_to_universal(&s->target, &addr) ||
+        uv_ip4_addr(host, port, &addr.addr4) == 0 ||
+        uv_ip6_addr(host, port, &addr.addr6) == 0)
+    {
+        stream_connect(s, &addr);
+        return;
+    }
+
+    {
+        union sockaddr_universal addrs[1];
+        int found = dns_cache_lookup(cache, host, addrs, 1);
+        if (cache) {
+            tunnel_stats_count_dns_cache(env->tunnel_stats, found);
+        }
+        if (found < 0) {
+            stream_close(s, true);
+            return;
+        }
+        if (found > 0) {
+            addrs[0].addr4.sin_port = htons(port);
+            stream_connect(s, &addrs[0]);
+            return;
+        }
+    }
+
+    if (!validate_hostname(host, strlen(host))) {
+        stream_close(s, true);
+        return;
+    }
+    if (env->resolver) {
+        s->query = resolv_query(env->resolver, host, htons(port), stream_resolv_cb, s);
+        if (s->query == NULL) {
+            stream_close(s, true);
+        }
+    } else {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if (uv_getaddrinfo(loop, &s->addrinfo_req, stream_getaddrinfo_cb, host, NULL, &hints) == 0) {
+            s->refs++;
+        } else {
+            stream_close(s, true);
+        }
+    }
+}
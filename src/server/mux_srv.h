@@ -0,0 +1,20 @@
+#ifndef __MUX_SRV_H__
+#define __MUX_SRV_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+struct server_env_t;
+struct dns_cache;
+struct mux_stream;
+
+/*
+ * Connects a stream the client opened on a mux session to |target|, an SSR
+ * header, and relays it both ways. Everything it opens belongs to the
+ * stream and is closed with it. |cache| may be NULL.
+ */
+void mux_srv_stream_accept(uv_loop_t *loop, struct server_env_t *env, struct dns_cache *cache,
+                           struct mux_stream *stream, const uint8_t *target, size_t size);
+
+#endif // __MUX_SRV_H__
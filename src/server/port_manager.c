@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <json-c/json.h>
+#include "port_manager.h"
+#include "sockaddr_universal.h"
+#include "common.h"
+#include "dump_info.h"
+#include "uthash.h"
+#include "ssr_alloc.h"
+#include "ssr_user_table.h"
+
+#define PORT_MANAGER_REQUEST_MAX 65536  /* A users delta of a thousand or so. */
+#define PORT_MANAGER_REPLY_MAX   8192  /* A longer stat is sent in pieces. */
+
+struct port_entry {
+    UT_hash_handle hh;
+    uint16_t port;
+    struct managed_port *managed;
+};
+
+struct port_manager {
+    uv_udp_t udp;
+    struct server_config *config;  // __weak_ptr
+    port_manager_cb cb;
+    void *p;
+    struct port_entry *ports;
+    char request[PORT_MANAGER_REQUEST_MAX];
+};
+
+struct managed_port * managed_port_retain(struct managed_port *port) {
+    __sync_add_and_fetch(&port->refs, 1);
+    return port;
+}
+
+void managed_port_release(struct managed_port *port) {
+    if (port && __sync_sub_and_fetch(&port->refs, 1) == 0) {
+        free(port->config.password);
+        rate_limit_destroy(port->rate_limit);
+        free(port);
+    }
+}
+
+void managed_port_add_traffic(struct managed_port *port, uint64_t bytes) {
+    __sync_fetch_and_add(&port->traffic, bytes);
+}
+
+static void reply(struct port_manager *pm, const struct sockaddr *addr, const char *msg, size_t len) {
+    uv_buf_t buf = uv_buf_init((char *)msg, (unsigned int)len);
+    (void)uv_udp_try_send(&pm->udp, &buf, 1, addr);
+}
+
+static void remove_port(struct port_manager *pm, struct port_entry *entry) {
+    HASH_DEL(pm->ports, entry);
+    pm->cb(pm->p, entry->managed, false);
+    managed_port_release(entry->managed);
+    free(entry);
+}
+
+/* The server_port of |data|, a number or a string of one, 0 for none. */
+static uint16_t request_port(struct json_object *data) {
+    struct json_object *value = NULL;
+    int port = 0;
+    if (json_object_object_get_ex(data, "server_port", &value)) {
+        port = json_object_is_type(value, json_type_string) ? atoi(json_object_get_string(value)) : json_object_get_int(value);
+    }
+    return (port > 0 && port <= 65535) ? (uint16_t)port : 0;
+}
+
+static bool do_add(struct port_manager *pm, struct json_object *data) {
+    struct json_object *value = NULL;
+    struct managed_port *managed;
+    struct port_entry *entry = NULL;
+    const char *password;
+    uint16_t port = request_port(data);
+
+    if (port == 0 || port == pm->config->listen_port ||
+        json_object_object_get_ex(data, "password", &value) == false ||
+        (password = json_object_get_string(value)) == NULL || password[0] == '\0')
+    {
+        return false;
+    }
+    HASH_FIND(hh, pm->ports, &port, sizeof(port), entry);
+    if (entry) {
+        // A new password, as ss-manager restarts the server for it.
+        remove_port(pm, entry);
+    }
+
+    managed = (struct managed_port *) calloc(1, sizeof(*managed));
+    managed->port = port;
+    managed->config = *pm->config;
+    managed->config.listen_port = port;
+    managed->config.password = strdup(password);
+    managed->config.users = NULL;  /* The accounts are the configured port's. */
+    managed->refs = 1;
+
+    entry = (struct port_entry *) calloc(1, sizeof(*entry));
+    entry->port = port;
+    entry->managed = managed;
+    HASH_ADD(hh, pm->ports, port, sizeof(entry->port), entry);
+    pm->cb(pm->p, managed, true);
+    pr_info("port %hu added", port);
+    return true;
+}
+
+static bool do_remove(struct port_manager *pm, struct json_object *data) {
+    struct port_entry *entry = NULL;
+    uint16_t port = request_port(data);
+
+    HASH_FIND(hh, pm->ports, &port, sizeof(port), entry);
+    if (entry == NULL) {
+        return false;
+    }
+    remove_port(pm, entry);
+    pr_info("port %hu removed", port);
+    return true;
+}
+
+static void do_ping(struct port_manager *pm, const struct sockaddr *addr) {
+    char buf[PORT_MANAGER_REPLY_MAX];
+    struct port_entry *entry, *tmp;
+    size_t len = (size_t)sprintf(buf, "stat: {");
+
+    HASH_ITER(hh, pm->ports, entry, tmp) {
+        uint64_t traffic = __sync_add_and_fetch(&entry->managed->traffic, 0);
+        char item[40];
+        int n = snprintf(item, sizeof(item), "\"%hu\":%llu,", entry->port, (unsigned long long)traffic);
+        if (len + (size_t)n + 1 > sizeof(buf)) {
+            buf[len - 1] = '}';
+            reply(pm, addr, buf, len);
+            len = (size_t)sprintf(buf, "stat: {");
+        }
+        memcpy(buf + len, item, (size_t)n);
+        len += (size_t)n;
+    }
+    if (buf[len - 1] == ',') {
+        buf[len - 1] = '}';
+    } else {
+        buf[len++] = '}';
+    }
+    reply(pm, addr, buf, len);
+}
+
+/* census: {"tunnels": {"live": N, "bytes": N}, ..., "heap": {"buffers": N, ...}} */
+static void do_census(struct port_manager *pm, const struct sockaddr *addr) {
+    char buf[PORT_MANAGER_REPLY_MAX];
+    struct ssr_census_stats census[ssr_census_kind_max];
+    struct ssr_alloc_stats alloc[ssr_alloc_kind_max];
+    size_t len = (size_t)sprintf(buf, "census: {");
+    int kind;
+
+    ssr_census_get_stats(census);
+    ssr_alloc_get_stats(alloc);
+    for (kind = 0; kind < ssr_census_kind_max; ++kind) {
+        len += (size_t)sprintf(buf + len, "\"%s\":{\"live\":%lld,\"bytes\":%lld},",
+            ssr_census_kind_name((enum ssr_census_kind)kind), (long long)census[kind].live, (long long)census[kind].bytes);
+    }
+    len += (size_t)sprintf(buf + len, "\"heap\":{");
+    for (kind = 0; kind < ssr_alloc_kind_max; ++kind) {
+        len += (size_t)sprintf(buf + len, "\"%s\":%lld%s",
+            ssr_alloc_kind_name((enum ssr_alloc_kind)kind), (long long)alloc[kind].bytes, (kind + 1 < ssr_alloc_kind_max) ? "," : "");
+    }
+    len += (size_t)sprintf(buf + len, "}}");
+    reply(pm, addr, buf, len);
+}
+
+/* The uid of a key of "add", false when it isn't one. */
+static bool delta_uid(const char *key, uint32_t *uid) {
+    char *end = NULL;
+    unsigned long value = strtoul(key, &end, 10);
+    if (end == key || *end != '\0' || value > UINT32_MAX) {
+        return false;
+    }
+    *uid = (uint32_t)value;
+    return true;
+}
+
+/* "uid": "password" or "uid": {"password": "...", "max_connections": n, "max_connection_rate": n, "quota": bytes, "expires": unix time,
+ * "previous_password": "...", "previous_expires": unix time}, as in the config. */
+static bool delta_add(struct ssr_user_table *users, const char *key, struct json_object *value, bool apply) {
+    struct json_object *field = NULL;
+    const char *password = NULL, *previous = NULL;
+    unsigned int max_connections = 0, max_rate = 0;
+    int64_t quota = 0, expires = 0, previous_expires = 0;
+    uint32_t uid;
+
+    if (delta_uid(key, &uid) == false) {
+        return false;
+    }
+    if (json_object_is_type(value, json_type_string)) {
+        password = json_object_get_string(value);
+    } else if (json_object_is_type(value, json_type_object)) {
+        if (json_object_object_get_ex(value, "password", &field)) {
+            password = json_object_get_string(field);
+        }
+        if (json_object_object_get_ex(value, "max_connections", &field)) {
+            max_connections = (json_object_get_int(field) > 0) ? (unsigned int)json_object_get_int(field) : 0;
+        }
+        if (json_object_object_get_ex(value, "max_connection_rate", &field)) {
+            max_rate = (json_object_get_int(field) > 0) ? (unsigned int)json_object_get_int(field) : 0;
+        }
+        if (json_object_object_get_ex(value, "quota", &field)) {
+            quota = json_object_get_int64(field);
+        }
+        if (json_object_object_get_ex(value, "expires", &field)) {
+            expires = json_object_get_int64(field);
+        }
+        if (json_object_object_get_ex(value, "previous_password", &field)) {
+            previous = json_object_get_string(field);
+        }
+        if (json_object_object_get_ex(value, "previous_expires", &field)) {
+            previous_expires = json_object_get_int64(field);
+        }
+    }
+    if (password == NULL || password[0] == '\0') {
+        return false;
+    }
+    if (apply == false) {
+        return true;
+    }
+    if (ssr_user_table_add(users, uid, password, max_connections, max_rate,
+        (quota > 0) ? (uint64_t)quota : 0, (expires > 0) ? (uint64_t)expires : 0) == false)
+    {
+        return false;
+    }
+    return (previous == NULL || previous[0] == '\0')
+        || ssr_user_table_set_previous(users, uid, previous, (previous_expires > 0) ? (uint64_t)previous_expires : 0);
+}
+
+/* Checks every change of the delta, then with |apply| makes them. */
+static bool delta_walk(struct ssr_user_table *users, struct json_object *add, struct json_object *remove, bool apply) {
+    size_t index, count;
+    if (add) {
+        json_object_object_foreach(add, key, value) {
+            if (delta_add(users, key, value, apply) == false) {
+                return false;
+            }
+        }
+    }
+    count = remove ? json_object_array_length(remove) : 0;
+    for (index = 0; index < count; ++index) {
+        struct json_object *item = json_object_array_get_idx(remove, index);
+        int64_t uid = json_object_get_int64(item);
+        if (json_object_is_type(item, json_type_int) == false || uid < 0 || uid > UINT32_MAX) {
+            return false;
+        }
+        if (apply) {
+            ssr_user_table_remove(users, (uint32_t)uid);  // One that's gone already is no error.
+        }
+    }
+    return true;
+}
+
+/*
+ * users: {"version": N, "add": {"uid": ..., ...}, "remove": [uid, ...]},
+ * applied when N is one past the table's version, answered with where
+ * the table is either way: users: {"version": N, "count": N}. Without a
+ * version it only asks.
+ */
+static bool do_users(struct port_manager *pm, struct json_object *data, const struct sockaddr *addr) {
+    struct ssr_user_table *users = pm->config->users;
+    struct json_object *value = NULL, *add = NULL, *remove = NULL;
+    uint64_t version = ssr_user_table_version(users);
+    char buf[96];
+    int len;
+
+    if (users == NULL) {
+        return false;
+    }
+    if (data && json_object_object_get_ex(data, "version", &value)) {
+        if (ssr_user_table_writable(users) == false) {
+            return false;  // Mapped from users_file, the file is the other processes' too.
+        }
+        int64_t next = json_object_get_int64(value);
+        if ((json_object_object_get_ex(data, "add", &add) && !json_object_is_type(add, json_type_object)) ||
+            (json_object_object_get_ex(data, "remove", &remove) && !json_object_is_type(remove, json_type_array)))
+        {
+            return false;
+        }
+        if (next > 0 && (uint64_t)next == version + 1) {
+            if (delta_walk(users, add, remove, false) == false || delta_walk(users, add, remove, true) == false) {
+                // Out of memory half way, the panel sends the same version again.
+                return false;
+            }
+            ssr_user_table_set_version(users, (uint64_t)next);
+            version = (uint64_t)next;
+            pr_info("users version %llu, %u users", (unsigned long long)version, (unsigned int)ssr_user_table_count(users));
+        }
+    }
+    len = snprintf(buf, sizeof(buf), "users: {\"version\":%llu,\"count\":%llu}",
+        (unsigned long long)version, (unsigned long long)ssr_user_table_count(users));
+    reply(pm, addr, buf, (size_t)len);
+    return true;
+}
+
+static void port_manager_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct port_manager *pm = CONTAINER_OF(handle, struct port_manager, udp);
+    (void)suggested_size;
+    *buf = uv_buf_init(pm->request, sizeof(pm->request) - 1);
+}
+
+static void port_manager_recv_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+    struct port_manager *pm = CONTAINER_OF(handle, struct port_manager, udp);
+    struct json_object *data = NULL;
+    char *request = buf->base, *colon;
+    bool ok = false;
+
+    if (nread <= 0 || addr == NULL || (flags & UV_UDP_PARTIAL)) {
+        return;
+    }
+    // ss-manager's clients send a NUL or a line break after it.
+    while (nread > 0 && (request[nread - 1] == '\0' || request[nread - 1] == '\n' || request[nread - 1] == '\r')) {
+        --nread;
+    }
+    request[nread] = '\0';
+    colon = strchr(request, ':');
+    if (colon) {
+        *colon = '\0';
+        data = json_tokener_parse(colon + 1);
+    }
+
+    if (strcmp(request, "ping") == 0) {
+        do_ping(pm, addr);
+        ok = true;
+    } else if (strcmp(request, "census") == 0) {
+        do_census(pm, addr);
+        ok = true;
+    } else if (strcmp(request, "users") == 0) {
+        ok = do_users(pm, data, addr);
+    } else if (data && strcmp(request, "add") == 0) {
+        if ((ok = do_add(pm, data))) {
+            reply(pm, addr, "ok", 2);
+        }
+    } else if (data && strcmp(request, "remove") == 0) {
+        if ((ok = do_remove(pm, data))) {
+            reply(pm, addr, "ok", 2);
+        }
+    }
+    if (ok == false) {
+        reply(pm, addr, "err", 3);
+    }
+    json_object_put(data);
+}
+
+static void port_manager_close_done_cb(uv_handle_t *handle) {
+    free(CONTAINER_OF(handle, struct port_manager, udp));
+}
+
+struct port_manager * port_manager_create(uv_loop_t *loop, const char *address, struct server_config *config, port_manager_cb cb, void *p) {
+    union sockaddr_universal addr = { 0 };
+    struct port_manager *pm;
+    char host[256] = { 0 };
+    const char *colon = strrchr(address, ':');
+    int err;
+
+    if (colon == NULL || (size_t)(colon - address) >= sizeof(host)) {
+        pr_err("manager_address %s is not host:port", address);
+        return NULL;
+    }
+    memcpy(host, address, (size_t)(colon - address));
+    if (host[0] == '[') {
+        memmove(host, host + 1, strlen(host));
+        host[strlen(host) - 1] = '\0';
+    }
+    if (convert_universal_address(host, (unsigned short)atoi(colon + 1), &addr) != 0) {
+        pr_err("manager_address %s is not host:port", address);
+        return NULL;
+    }
+
+    pm = (struct port_manager *) calloc(1, sizeof(*pm));
+    pm->config = config;
+    pm->cb = cb;
+    pm->p = p;
+    VERIFY(0 == uv_udp_init(loop, &pm->udp));
+    err = uv_udp_bind(&pm->udp, &addr.addr, 0);
+    if (err == 0) {
+        err = uv_udp_recv_start(&pm->udp, port_manager_alloc_cb, port_manager_recv_cb);
+    }
+    if (err != 0) {
+        pr_err("manager_address %s: %s", address, uv_strerror(err));
+        uv_close((uv_handle_t *)&pm->udp, port_manager_close_done_cb);
+        return NULL;
+    }
+    pr_info("manager on       %s", address);
+    return pm;
+}
+
+void port_manager_shutdown(struct port_manager *pm) {
+    struct port_entry *entry, *tmp;
+    if (pm == NULL) {
+        return;
+    }
+    HASH_ITER(hh, pm->ports, entry, tmp) {
+        HASH_DEL(pm->ports, entry);
+        managed_port_release(entry->managed);
+        free(entry);
+    }
+    uv_udp_recv_stop(&pm->udp);
+    uv_close((uv_handle_t *)&pm->udp, port_manager_close_done_cb);
+}
@@ -0,0 +1,46 @@
+#ifndef __PORT_MANAGER_H__
+#define __PORT_MANAGER_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+#include "ssr_executive.h"
+#include "rate_limit.h"
+
+/*
+ * Ports added and removed at run time through the datagrams ss-manager
+ * takes: "add: {"server_port": N, "password": "..."}", "remove: {...}"
+ * and "ping", answered with "stat: {"N": bytes, ...}". "census" answers
+ * with the live objects and heap bytes of ssr_alloc.h, "census: {...}",
+ * to tell what grows when memory creeps. "users: {...}" patches the
+ * configured port's users in place with a numbered delta from a panel,
+ * so a change costs what it changes and not a reload, see do_users().
+ * Every port is one more listener on each worker of this process, with
+ * the configured method, protocol and obfs, sharing its loops, pools, DNS
+ * cache and ACL. A port lives until it is removed and every worker let
+ * go of it.
+ */
+
+struct managed_port {
+    uint16_t port;
+    struct server_config config;  /* The configured one with this port and password, read only. */
+    uint64_t traffic;  /* Bytes both ways, added to by any worker. */
+    struct rate_limit *rate_limit;  /* Of this port, the owner's, may be NULL. Released with it. */
+    int refs;
+};
+
+struct port_manager;
+
+/* On the manager's loop, |added| false for a removal. */
+typedef void (*port_manager_cb)(void *p, struct managed_port *port, bool added);
+
+/* Listens on UDP |address|, host:port. NULL if it can't. */
+struct port_manager * port_manager_create(uv_loop_t *loop, const char *address, struct server_config *config, port_manager_cb cb, void *p);
+/* Forgets the ports, those still held live on until released. */
+void port_manager_shutdown(struct port_manager *pm);
+
+struct managed_port * managed_port_retain(struct managed_port *port);
+void managed_port_release(struct managed_port *port);
+void managed_port_add_traffic(struct managed_port *port, uint64_t bytes);
+
+#endif // __PORT_MANAGER_H__
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <time.h>
+#include <errno.h>
 
 #include "common.h"
 #include "dump_info.h"
@@ -16,22 +17,124 @@
 #include "tunnel.h"
 #include "daemon_wrapper.h"
 #include "cmd_line_parser.h"
+#include "buffer_pool.h"
+#include "cpu_features.h"
+#include "encrypt.h"
+#include "ppbloom.h"
+#include "crc32.h"
+#include "ssr_user_table.h"
+#include "ssr_replay_window.h"
+#include "dns_cache.h"
+#include "resolv.h"
+#include "mux.h"
+#include "mux_srv.h"
+#include "kcp_srv.h"
+#include "tls_srv.h"
+#include "acl.h"
+#include "port_manager.h"
+#include "sockmap_relay.h"
+#include "socket_tuning.h"
+#include "admission.h"
+#include "handoff.h"
+#include "loop_balance.h"
+#include "upstream_proxy.h"
+#include "memory_pressure.h"
+#include "metrics.h"
+#include "tunnel_trace.h"
+#include "tunnel_shape.h"
+#include "crypto_offload.h"
+#include "ssr_alloc.h"
+#include "heavy_hitters.h"
+#include "flow_export.h"
+#include "ssr_cluster.h"
 
 #ifndef SSR_MAX_CONN
 #define SSR_MAX_CONN 1024
+#define SOCKMAP_RELAY_PAIRS 16384  /* Tunnels per worker, the ones beyond are spliced. */
 #endif
 
+#define SERVER_DRAIN_CHECK_MS 1000  /* How often a draining worker looks for its last tunnel. */
+/* Raw bytes a first packet has at the least, the IV and an IPv4 address, whatever the obfs and protocol add. */
+#define SERVER_PREAUTH_MIN(env) (enc_get_iv_len((env)->cipher) + 7)
+
+/* The top lists of heavy_hitters, kept as tunnels close. */
+enum server_top {
+    server_top_destination_bytes,
+    server_top_destination_connections,
+    server_top_user_bytes,
+    server_top_user_connections,
+    server_top_max,
+};
+
 struct ssr_server_state {
     struct server_env_t *env;
+    uv_loop_t *loop;
+    uv_thread_t thread;
+    size_t worker_index;
+
+    /* Only the first worker watches signals, the others are told to quit through |quit_async|. */
+    uv_async_t *quit_async;
+    struct ssr_server_state **workers;
+    size_t workers_count;
 
     uv_signal_t *sigint_watcher;
     uv_signal_t *sigterm_watcher;
 
     bool shutting_down;
+    int quit_requested;  /* By the first worker, over a pending drain. */
+    int drain_requested;  /* By the first worker, read by |quit_async|. */
+
+    /* With upgrade_socket. The first worker passes every worker's listener to
+     * a successor, then they all stop accepting and serve their tunnels until
+     * the last one is gone. */
+    struct handoff *handoff;
+    bool draining;
+    int drained;  /* Set once, read by the first worker. */
+    uv_timer_t *drain_timer;
 
     uv_tcp_t *tcp_listener;
     struct udp_listener_ctx_t *udp_listener;
-    struct cstl_map *resolved_ips;
+    struct dns_cache *dns_cache;  /* Per worker, so never locked. */
+    struct upstream_proxy *upstream;  /* With upstream_proxy, this worker's idle connections to it. */
+    struct tcp_mss_cache mss_cache;  /* Of this worker's listeners. */
+    struct sockmap_relay *sockmap;  /* With sockmap_relay, NULL where the kernel refused it. */
+    struct kcp_srv *kcp_srv;  /* The first worker's, with kcp_port. */
+    struct tls_srv *tls_srv;  /* With over_tls_listen_port, every worker's. */
+    struct rate_limit *rate_limit_global;  /* Shared by the workers, NULL without a limit. */
+    struct rate_limit *rate_limit_port;  /* Of the configured port, under the global one. */
+    struct admission *admission;  /* Of all this worker's listeners, NULL without limits. */
+    struct loop_balance *balance;  /* Shared by the workers, with worker_balance_lag_ms. */
+    struct memory_pressure *memory_pressure;  /* With memory_budget, over this worker's tunnels. */
+    struct ssr_user_shard *user_shard;  /* With users, this worker's byte counts of them. */
+    struct metrics_server *metrics;  /* The first worker's, with metrics_address, reads every worker's counters. */
+    struct heavy_hitters *top[server_top_max];  /* With metrics_address and heavy_hitters, this worker's. */
+    struct flow_exporter *flow_exporter;  /* The first worker's, with flow_export, read for the metrics. */
+    struct flow_ring *flows;  /* With flow_export, this worker's ring of closed tunnels. */
+    struct ssr_cluster *cluster;  /* The first worker's, with cluster_listen, read for the metrics. */
+
+    /* With manager_address. The first worker takes the commands and queues
+     * them to every worker, each opens the port on its own loop. */
+    struct port_manager *port_manager;
+    struct ppbloom *replay_filter;  /* For the ports' ciphers, NULL with replay windows. */
+    uv_async_t *ports_async;
+    uv_mutex_t ports_lock;
+    struct port_change *ports_pending;  /* Under |ports_lock|, oldest first. */
+    struct server_port *ports;
+};
+
+struct port_change {
+    struct managed_port *port;
+    bool added;
+    struct port_change *next;
+};
+
+/* A managed port on one worker, kept until its last tunnel is gone. */
+struct server_port {
+    struct managed_port *managed;
+    struct server_env_t *env;
+    uv_tcp_t *listener;
+    bool removed;
+    struct server_port *next;
 };
 
 enum tunnel_stage {
@@ -41,27 +144,76 @@ enum tunnel_stage {
     tunnel_stage_confirm_done,
     tunnel_stage_resolve_host = 4,  /* Resolve the hostname             */
     tunnel_stage_connect_host,
+    tunnel_stage_upstream_reply,  /* The egress proxy's answer to the request */
     tunnel_stage_launch_streaming,
     tunnel_stage_streaming,  /* Stream between client and server */
+    tunnel_stage_mux,  /* Frames of many streams from one client */
+};
+
+/* Span names of the stages, see tunnel_trace_stage(). */
+static const char *tunnel_stage_names[] = {
+    "initial", "receipt_done", "client_feedback", "confirm_done",
+    "resolve_host", "connect_host", "upstream_reply", "launch_streaming", "streaming", "mux",
 };
 
 struct server_ctx {
     struct server_env_t *env; // __weak_ptr
     struct tunnel_cipher_ctx *cipher;
-    struct buffer_t *init_pkg;
+    struct buffer_t *init_pkg;  /* NULL until needed: the raw first reads until there are SERVER_PREAUTH_MIN, then the decoded init package. */
+    struct mux_session *mux;
     enum tunnel_stage stage;
     size_t _tcp_mss;
     size_t _overhead;
-    size_t _recv_buffer_size;
-    size_t _recv_d_max_size;
+    size_t _header_offset;  /* Of the SOCKS5 address in init_pkg, see pre_parse_header(). */
+    size_t _incoming_read_size;  /* Adapted while streaming, see socket_adapt_read_size(). */
+    size_t _outgoing_read_size;
+    struct admission_entry admission;
+    const struct ssr_user *user;  /* The account the handshake named, NULL on a single-user port. */
+    uint64_t bytes_incoming;  /* Read from the client, for the top lists and flow_export. */
+    uint64_t bytes_outgoing;  /* Read from the target. */
+    struct tunnel_shape_record *shape;  /* Its reads, when shape_file samples it. */
+    bool over_quota;  /* Throttled with rate_limit_over_quota since. */
+    bool upstream_greeted;  /* A pooled connection to the egress proxy, SOCKS5's login done. */
+    struct upstream_reply upstream;  /* How far the egress proxy's replies got. */
+    bool crypto_lanes_set;
+    unsigned int crypto_lanes[2];  /* Of the incoming and the outgoing reads, see tunnel_extract_offload(). */
 };
 
-struct address_timestamp {
-    union sockaddr_universal address;
-    time_t timestamp;
+/* A read of a streaming tunnel on its way through a crypto worker. */
+struct server_crypt_job {
+    struct crypto_offload_job job;
+    struct tunnel_ctx *tunnel;  /* Held by tunnel.c until tunnel_offload_done(). */
+    struct socket_ctx *socket;
+    struct tunnel_cipher_ctx *cipher;
+    bool encrypt;
+    struct buffer_t *data;
+    struct buffer_t *out;
+    uint64_t begin;
+    uint64_t end;
 };
 
+static bool server_users_map(struct server_config *config);
 static int ssr_server_run_loop(struct server_config *config);
+static struct ssr_server_state * ssr_server_worker_create(struct server_config *config, struct ppbloom *replay_filter, struct ssr_replay_table *replay_windows, size_t worker_index, bool reuse_port, int listener_fd);
+static void ssr_server_worker_destroy(struct ssr_server_state *state);
+static void ssr_server_worker_thread(void *arg);
+static void ssr_server_quit_async_cb(uv_async_t *handle);
+static int listener_init(uv_loop_t *loop, uv_tcp_t *listener, const struct server_config *config);
+static int listener_start(uv_tcp_t *listener, int family, const struct server_config *config, uint16_t port, bool reuse_port, int cpu, const char **what);
+static int listener_adopt(uv_tcp_t *listener, int fd, const char **what);
+static size_t server_handoff_collect_cb(void *p, int *fds, size_t max);
+static void server_handoff_sent_cb(void *p, int status);
+static void ssr_server_drain(struct ssr_server_state *state);
+static void ssr_server_drain_timer_cb(uv_timer_t *handle);
+static void ssr_server_worker_pin(struct ssr_server_state *state);
+static int ssr_server_worker_node(const struct server_config *config, size_t worker_index);
+static void server_metrics_collect_cb(void *p, struct metrics_writer *w);
+static void ports_changed_cb(void *p, struct managed_port *port, bool added);
+static void ports_async_cb(uv_async_t *handle);
+static void server_port_open(struct ssr_server_state *state, struct managed_port *managed);
+static void server_port_close(struct server_port *port);
+static void server_port_stop_listening(struct server_port *port);
+static void server_ports_collect(struct ssr_server_state *state);
 void ssr_server_shutdown(struct ssr_server_state *state);
 
 void server_tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout);
@@ -69,18 +221,30 @@ void server_shutdown(struct server_env_t *env);
 
 void signal_quit_cb(uv_signal_t *handle, int signum);
 void tunnel_incoming_connection_established_cb(uv_stream_t *server, int status);
+static void server_accept(uv_stream_t *server);
+static int server_balance_adopt_cb(void *p, uv_os_sock_t sock);
+static void server_memory_walk_cb(void *p, void(*fn)(struct tunnel_ctx *tunnel, void *arg), void *arg);
 
 static void tunnel_dying(struct tunnel_ctx *tunnel);
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_outgoing_connected_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_getaddrinfo_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void tunnel_getaddrinfo_result(struct tunnel_ctx *tunnel, struct socket_ctx *socket, int status, const union sockaddr_universal *addrs, size_t count);
 static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void tunnel_spliced(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t len);
+static void server_top_count(struct tunnel_ctx *tunnel);
+static void server_flow_record(struct tunnel_ctx *tunnel);
+static void tunnel_idle_trim(struct tunnel_ctx *tunnel);
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
-static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size);
+static struct buffer_t * tunnel_extract_data(struct socket_ctx *socket);
+static struct buffer_segments * tunnel_extract_segments(struct socket_ctx *socket);
+static bool tunnel_extract_offload(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 
 static bool is_incoming_ip_legal(struct tunnel_ctx *tunnel);
-static bool is_header_complete(const struct buffer_t *buf);
+static void server_handshake_report(struct tunnel_ctx *tunnel, enum tunnel_handshake_failure failure, int err_level);
+static void server_handshake_failed(struct tunnel_ctx *tunnel, enum tunnel_handshake_failure failure);
+static bool tunnel_charge_user(struct tunnel_ctx *tunnel, size_t bytes);
 static size_t _get_read_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
 static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *incoming);
 static void do_prepare_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
@@ -90,10 +254,12 @@ static void do_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void do_resolve_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void do_connect_host_start(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void do_connect_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void do_upstream_connect(struct tunnel_ctx *tunnel);
+static void do_upstream_request(struct tunnel_ctx *tunnel);
+static void do_upstream_reply(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void do_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
-
-static int resolved_ips_compare_key(const void *left, const void *right);
-static void resolved_ips_destroy_object(void *obj);
+static void do_mux_session_start(struct tunnel_ctx *tunnel, struct socket_ctx *incoming);
+static void do_mux_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 
 void print_server_info(const struct server_config *config);
 static void usage(void);
@@ -109,6 +275,8 @@ int main(int argc, char * const argv[]) {
     _CrtSetBreakAlloc(64);
 #endif // __MEM_CHECK__
 
+    ssr_alloc_install_cork();
+
     do {
         set_app_name(argv[0]);
 
@@ -133,6 +301,10 @@ int main(int argc, char * const argv[]) {
 
         config_change_for_server(config);
 
+        if (server_users_map(config) == false) {
+            break;
+        }
+
 #ifndef UDP_RELAY_ENABLE
         config->udp = false;
 #endif // UDP_RELAY_ENABLE
@@ -147,9 +319,14 @@ int main(int argc, char * const argv[]) {
             daemon_wrapper(argv[0], param);
         }
 
+        dump_info_set_json(config->log_json);
         print_server_info(config);
 
+        if (config->log_async) {
+            dump_info_start_async();
+        }
         ssr_server_run_loop(config);
+        dump_info_stop_async();
 
         err = 0;
     } while (0);
@@ -167,43 +344,338 @@ int main(int argc, char * const argv[]) {
     return 0;
 }
 
+/* With users_file, the users are written there and used from the mapped
+ * file, so the processes of a host share one copy of them. */
+static bool server_users_map(struct server_config *config) {
+    struct ssr_user_table *mapped;
+    if (config->users_file == NULL) {
+        return true;
+    }
+    if (ssr_user_table_count(config->users) > 0) {
+        if (ssr_user_table_write(config->users, config->users_file) == false) {
+            pr_err("can't write the users to \"%s\"", config->users_file);
+            return false;
+        }
+    }
+    mapped = ssr_user_table_map(config->users_file);
+    if (mapped == NULL) {
+        pr_err("\"%s\" is not a users file", config->users_file);
+        return false;
+    }
+    ssr_user_table_destroy(config->users);
+    config->users = mapped;
+    return true;
+}
+
+static bool protocol_has_replay_windows(const char *protocol) {
+    if (protocol == NULL) {
+        return false;
+    }
+    switch (ssr_protocol_type_of_name(protocol)) {
+    case ssr_protocol_auth_aes128_md5:
+    case ssr_protocol_auth_aes128_sha1:
+    case ssr_protocol_auth_chain_a:
+    case ssr_protocol_auth_chain_b:
+    case ssr_protocol_auth_chain_c:
+    case ssr_protocol_auth_chain_d:
+    case ssr_protocol_auth_chain_e:
+    case ssr_protocol_auth_chain_f:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* method none, protocol origin and obfs plain, the relayed bytes are the client's. */
+static bool pipeline_is_identity(const struct server_config *config) {
+    return config->method && ss_cipher_type_of_name(config->method) == ss_cipher_none &&
+        (config->protocol == NULL || ssr_protocol_type_of_name(config->protocol) == ssr_protocol_origin) &&
+        (config->obfs == NULL || ssr_obfs_type_of_name(config->obfs) == ssr_obfs_plain);
+}
+
 static int ssr_server_run_loop(struct server_config *config) {
+    struct ssr_server_state **workers = NULL;
+    size_t count = (config->workers > 0) ? config->workers : 1;
+    size_t index;
+    int r = 0;
+    struct ppbloom *replay_filter = NULL;
+    struct ssr_replay_table *replay_windows = NULL;
+    struct rate_limit *rate_global = NULL, *rate_port = NULL;
+    struct loop_balance *balance = NULL;
+    int inherited[HANDOFF_LISTENERS_MAX];
+    size_t inherited_count = 0;
+    uv_file trace_file = -1;
+    uv_file shape_file = -1;
+    struct flow_exporter *flow_exporter = NULL;
+    struct ssr_cluster *cluster = NULL;
+
+#if !defined(SO_REUSEPORT)
+    if (count > 1) {
+        pr_warn("SO_REUSEPORT is not supported on this platform, running a single worker");
+        count = 1;
+    }
+#endif // !defined(SO_REUSEPORT)
+
+    if (config->acl) {
+        // Before the workers start, they share it read only.
+        if (init_acl(config->acl) != 0) {
+            pr_err("failed to load the acl %s", config->acl);
+            return -1;
+        }
+        pr_info("acl loaded from %s", config->acl);
+    }
+    // Shared by the workers, every failed handshake counts against its source address.
+    init_block_list(0);
+
+    if (protocol_has_replay_windows(config->protocol)) {
+        // the protocol rejects replayed handshakes by client and connection id
+        replay_windows = ssr_replay_table_create(config->replay_window_clients);
+    } else {
+        replay_filter = ppbloom_create(config->replay_filter_capacity, config->replay_filter_error_rate);
+    }
+
+    if (config->upgrade_socket) {
+        // Before anything listens, the running server's listeners and their queues.
+        inherited_count = handoff_receive(config->upgrade_socket, inherited, HANDOFF_LISTENERS_MAX);
+        if (inherited_count) {
+            pr_info("took over %u listeners through %s", (unsigned int)inherited_count, config->upgrade_socket);
+        }
+    }
+
+    workers = (struct ssr_server_state **) calloc(count, sizeof(*workers));
+    for (index = 0; index < count; ++index) {
+        int listener_fd = (index < inherited_count) ? inherited[index] : -1;
+        workers[index] = ssr_server_worker_create(config, replay_filter, replay_windows, index, (count > 1), listener_fd);
+        if (workers[index] == NULL) {
+            break;
+        }
+    }
+    {
+        // Those no worker took, the connections queued on them are reset.
+        size_t used = (index < count) ? index + 1 : count;
+        if (used < inherited_count) {
+            pr_warn("%u listeners taken over but not used", (unsigned int)(inherited_count - used));
+            handoff_discard(inherited + used, inherited_count - used);
+        }
+    }
+
+    if (index == count) {
+        struct ssr_server_state *primary = workers[0];
+        rate_global = rate_limit_create(config->rate_limit_global, NULL);
+        rate_port = rate_limit_create(config->rate_limit_port, rate_global);
+        primary->workers = workers;
+        primary->workers_count = count;
+        balance = loop_balance_create(count, config->worker_balance_lag_ms);
+#if UDP_RELAY_ENABLE
+        if (primary->udp_listener && count > 1) {
+            int err = udprelay_steer_by_source(primary->udp_listener, count);
+            if (err != 0) {
+                pr_warn("UDP sources not kept to one worker: %s", uv_strerror(err));
+            }
+        }
+#endif // UDP_RELAY_ENABLE
+        if (config->trace_file && config->trace_sample) {
+            trace_file = tunnel_trace_open(config->trace_file);
+        }
+        if (config->shape_file && config->shape_sample) {
+            shape_file = tunnel_shape_open(config->shape_file);
+        }
+        if (config->flow_export) {
+            flow_exporter = flow_exporter_create(config->flow_export);
+            primary->flow_exporter = flow_exporter;
+        }
+        if (config->cluster_listen) {
+            struct ssr_cluster_options options = { 0 };
+            options.listen = config->cluster_listen;
+            options.peers = config->cluster_peers;
+            options.key = config->cluster_key;
+            options.interval = config->cluster_interval;
+            cluster = ssr_cluster_create(&options, replay_filter, replay_windows, config->users);
+            primary->cluster = cluster;
+        }
+        for (index = 0; index < count; ++index) {
+            workers[index]->rate_limit_global = rate_global;
+            workers[index]->rate_limit_port = rate_port;
+            workers[index]->flows = flow_exporter ? flow_exporter_ring(flow_exporter) : NULL;
+            workers[index]->env->trace = tunnel_trace_create(workers[index]->loop, trace_file, config->trace_sample, (unsigned int)index);
+            workers[index]->env->shape = tunnel_shape_create(workers[index]->loop, shape_file, config->shape_sample);
+            workers[index]->balance = balance;
+            loop_balance_attach(balance, index, workers[index]->loop, workers[index]->env->tunnel_stats, server_balance_adopt_cb, workers[index]);
+        }
+        if (config->metrics_address) {
+            primary->metrics = metrics_server_create(primary->loop, config->metrics_address, server_metrics_collect_cb, primary);
+        }
+        if (config->upgrade_socket) {
+            primary->handoff = handoff_serve(primary->loop, config->upgrade_socket,
+                server_handoff_collect_cb, server_handoff_sent_cb, primary);
+        }
+
+        for (index = 1; index < count; ++index) {
+            VERIFY(0 == uv_thread_create(&workers[index]->thread, ssr_server_worker_thread, workers[index]));
+        }
+
+        ssr_server_worker_pin(primary);
+        r = uv_run(primary->loop, UV_RUN_DEFAULT);
+
+        for (index = 1; index < count; ++index) {
+            uv_thread_join(&workers[index]->thread);
+        }
+    } else {
+        r = -1;
+    }
+
+    for (index = 0; index < count; ++index) {
+        ssr_server_worker_destroy(workers[index]);
+    }
+    free(workers);
+    loop_balance_destroy(balance);
+    tunnel_trace_close(trace_file);
+    tunnel_shape_close(shape_file);
+    // With the loops gone, what the rings still hold goes out.
+    flow_exporter_destroy(flow_exporter);
+    // After the managed ports, theirs hang under the global one.
+    rate_limit_destroy(rate_port);
+    rate_limit_destroy(rate_global);
+
+    // Before what it journals on and adds to.
+    ssr_cluster_destroy(cluster);
+    ppbloom_release(replay_filter);
+    ssr_replay_table_destroy(replay_windows);
+
+    if (config->acl) {
+        free_acl();
+    }
+    free_block_list();
+
+    return r;
+}
+
+/* Every worker owns a loop, a server_env_t with its own tunnel set, cipher
+ * and protocol/obfs global data, plus a listener sharing the port through
+ * SO_REUSEPORT, so the kernel spreads incoming connections between them.
+ * Only the replay detection is shared, a replay may land on any worker. */
+static struct ssr_server_state * ssr_server_worker_create(struct server_config *config, struct ppbloom *replay_filter, struct ssr_replay_table *replay_windows, size_t worker_index, bool reuse_port, int listener_fd) {
     uv_loop_t *loop = NULL;
     struct ssr_server_state *state = NULL;
-    int r = 0;
 
     loop = (uv_loop_t *) calloc(1, sizeof(uv_loop_t));
     uv_loop_init(loop);
 
     state = (struct ssr_server_state *) calloc(1, sizeof(*state));
+    state->loop = loop;
+    state->worker_index = worker_index;
     state->env = ssr_cipher_env_create(config, state);
+    if (config->numa || config->hugepages) {
+        // Mapped on first use, by then the worker runs on its node.
+        buffer_pool_use_slabs(state->env->read_buffer_pool, config->hugepages, ssr_server_worker_node(config, worker_index));
+    }
+    if (replay_windows) {
+        cipher_env_disable_replay_filter(state->env->cipher);
+        state->env->replay_windows = replay_windows;
+    } else {
+        cipher_env_set_replay_filter(state->env->cipher, replay_filter);
+    }
     loop->data = state->env;
+    state->env->timer_wheel = timer_wheel_create(loop, TIMER_WHEEL_TICK_MS);
+    state->env->fair_queue = fair_queue_create(loop, config->fair_queue_quantum);
+    state->env->read_coalescer = read_coalescer_create(loop, config->coalesce_reads_below);
+    state->env->crypto_offload = crypto_offload_create(loop, config->crypto_workers);
+    state->env->egress_pool = egress_pool_create(config->egress_addresses, config->egress_policy);
+    if (config->egress_addresses && state->env->egress_pool == NULL && worker_index == 0) {
+        pr_warn("no usable egress address, connecting from the system's choice");
+    }
+    if (config->crypto_workers && state->env->crypto_offload == NULL) {
+        pr_warn("crypto workers unavailable, ciphering on the loop");
+    }
+    state->env->watchdog = loop_watchdog_create(loop, config->loop_stall_ms);
+    state->env->resolver = resolv_init(loop, config->nameservers, config->ipv6_first);
+    if (state->env->resolver == NULL) {
+        pr_warn("udns resolver unavailable, resolving on the thread pool");
+    }
+
+    if (config->dns_cache_capacity) {
+        state->dns_cache = dns_cache_create(loop, state->env->resolver, config->dns_cache_capacity, config->dns_cache_ttl, DEFAULT_DNS_CACHE_NEGATIVE_TTL);
+    }
+    state->admission = admission_create(loop, config, state->env->tunnel_stats, server_accept);
+    state->memory_pressure = memory_pressure_create(loop, config->memory_budget, config->idle_timeout, state->env->read_buffer_pool,
+        state->env->tunnel_stats, server_memory_walk_cb, state);
+    if (config->upstream_proxy) {
+        // Every tunnel is to go through it, none connects directly instead.
+        state->upstream = upstream_proxy_create(loop, config->upstream_proxy, config->upstream_proxy_idle);
+        if (state->upstream == NULL) {
+            ssr_server_worker_destroy(state);
+            return NULL;
+        }
+    }
+    state->user_shard = ssr_user_shard_create(config->users);
+    if (config->metrics_address) {
+        size_t top;
+        for (top = 0; top < server_top_max; ++top) {
+            state->top[top] = heavy_hitters_create(config->heavy_hitters);
+        }
+    }
 
     {
-        union sockaddr_universal addr = { 0 };
+        const char *what = NULL;
         int error;
         uv_tcp_t *listener = (uv_tcp_t *) calloc(1, sizeof(uv_tcp_t));
 
-        uv_tcp_init(loop, listener);
+        state->tcp_listener = listener;
+        if (listener_fd >= 0) {
+            uv_tcp_init(loop, listener);
+            error = listener_adopt(listener, listener_fd, &what);
+        } else {
+            int family = listener_init(loop, listener, config);
+            error = listener_start(listener, family, config, config->listen_port, reuse_port,
+                socket_tuning_worker_cpu(&config->socket, worker_index), &what);
+        }
+        if (error != 0) {
+            fprintf(stderr, "Error on %s for worker %u: %s.\n", what, (unsigned int)worker_index, uv_strerror(error));
+            ssr_server_worker_destroy(state);
+            return NULL;
+        }
+    }
 
-        addr.addr4.sin_family = AF_INET;
-        addr.addr4.sin_port = htons(config->listen_port);
-        addr.addr4.sin_addr.s_addr = htonl(INADDR_ANY);
-        uv_tcp_bind(listener, &addr.addr, 0);
+#if UDP_RELAY_ENABLE
+    if (config->udp) {
+        // Every address, like the TCP listener; its associations are the worker's own.
+        state->udp_listener = udprelay_begin(loop, NULL, config->listen_port, reuse_port,
+            0, (int)config->idle_timeout, state->env->cipher, config->protocol, config->protocol_param);
+    }
+#endif // UDP_RELAY_ENABLE
 
-        error = uv_listen((uv_stream_t *)listener, SSR_MAX_CONN, tunnel_incoming_connection_established_cb);
+    if (config->kcp_port && worker_index == 0) {
+        state->kcp_srv = kcp_srv_create(loop, state->env);
+        if (state->kcp_srv == NULL) {
+            pr_warn("KCP transport unavailable on port %hu", config->kcp_port);
+        }
+    }
 
-        if (error != 0) {
-            return fprintf(stderr, "Error on listening: %s.\n", uv_strerror(error));
+    if (config->over_tls_listen_port) {
+        state->tls_srv = tls_srv_create(loop, state->env);
+        if (state->tls_srv == NULL && worker_index == 0) {
+            pr_warn("over TLS unavailable on port %hu", config->over_tls_listen_port);
         }
-        state->tcp_listener = listener;
+    }
 
-        state->resolved_ips = obj_map_create(resolved_ips_compare_key,
-                                             resolved_ips_destroy_object,
-                                             resolved_ips_destroy_object);
+    if (config->sockmap_relay) {
+        state->sockmap = sockmap_relay_create(SOCKMAP_RELAY_PAIRS);
+        if (state->sockmap == NULL && worker_index == 0) {
+            pr_warn("sockmap relay unavailable, splicing instead");
+        }
     }
 
-    {
+    state->replay_filter = replay_filter;
+    if (config->manager_address) {
+        VERIFY(0 == uv_mutex_init(&state->ports_lock));
+        state->ports_async = (uv_async_t *)calloc(1, sizeof(uv_async_t));
+        uv_async_init(loop, state->ports_async, ports_async_cb);
+        if (worker_index == 0) {
+            state->port_manager = port_manager_create(loop, config->manager_address, config, ports_changed_cb, state);
+        }
+    }
+
+    if (worker_index == 0) {
         // Setup signal handler
         state->sigint_watcher = (uv_signal_t *)calloc(1, sizeof(uv_signal_t));
         uv_signal_init(loop, state->sigint_watcher);
@@ -212,30 +684,649 @@ static int ssr_server_run_loop(struct server_config *config) {
         state->sigterm_watcher = (uv_signal_t *)calloc(1, sizeof(uv_signal_t));
         uv_signal_init(loop, state->sigterm_watcher);
         uv_signal_start(state->sigterm_watcher, signal_quit_cb, SIGTERM);
+    } else {
+        state->quit_async = (uv_async_t *)calloc(1, sizeof(uv_async_t));
+        uv_async_init(loop, state->quit_async, ssr_server_quit_async_cb);
     }
 
-    r = uv_run(loop, UV_RUN_DEFAULT);
+    return state;
+}
 
-    {
-        ssr_cipher_env_release(state->env);
+static void ssr_server_worker_destroy(struct ssr_server_state *state) {
+    size_t index;
+    if (state == NULL) {
+        return;
+    }
+    if (state->shutting_down == false) {
+        // Never ran, let the loop close what was set up so far.
+        ssr_server_shutdown(state);
+        uv_run(state->loop, UV_RUN_DEFAULT);
+    }
+
+    server_ports_collect(state);
+    ASSERT(state->ports == NULL);
+    if (state->ports_async) {
+        while (state->ports_pending) {
+            struct port_change *change = state->ports_pending;
+            state->ports_pending = change->next;
+            managed_port_release(change->port);
+            free(change);
+        }
+        uv_mutex_destroy(&state->ports_lock);
+        free(state->ports_async);
+    }
+
+    egress_pool_destroy(state->env->egress_pool);
+    ssr_cipher_env_release(state->env);
+    admission_destroy(state->admission);
+    memory_pressure_destroy(state->memory_pressure);
+    sockmap_relay_destroy(state->sockmap);
+    ssr_user_shard_destroy(state->user_shard);
+    for (index = 0; index < server_top_max; ++index) {
+        heavy_hitters_destroy(state->top[index]);
+    }
+
+    free(state->sigint_watcher);
+    free(state->sigterm_watcher);
+    free(state->quit_async);
+    free(state->drain_timer);
+
+    uv_loop_close(state->loop);
+    free(state->loop);
 
-        free(state->sigint_watcher);
-        free(state->sigterm_watcher);
+    free(state);
+}
 
-        obj_map_destroy(state->resolved_ips);
+static void ssr_server_worker_thread(void *arg) {
+    struct ssr_server_state *state = (struct ssr_server_state *)arg;
+    ssr_server_worker_pin(state);
+    uv_run(state->loop, UV_RUN_DEFAULT);
+}
 
-        free(state);
+/* With incoming_cpu, onto the CPU its listener takes the connections of,
+ * with numa, onto the CPUs of its node. */
+static void ssr_server_worker_pin(struct ssr_server_state *state) {
+    const struct server_config *config = state->env->config;
+    int cpu = socket_tuning_worker_cpu(&config->socket, state->worker_index);
+    int node = ssr_server_worker_node(config, state->worker_index);
+    if (cpu >= 0 && socket_tuning_pin_thread(cpu) != 0) {
+        pr_warn("worker %u not pinned to CPU %d.", (unsigned int)state->worker_index, cpu);
+    } else if (node >= 0 && socket_tuning_pin_node(node) != 0) {
+        pr_warn("worker %u not pinned to NUMA node %d.", (unsigned int)state->worker_index, node);
     }
+}
 
-    free(loop);
+/* The NUMA node of worker |worker_index|, -1 without numa, on a single
+ * node host, or with incoming_cpu, whose CPU decides it. */
+static int ssr_server_worker_node(const struct server_config *config, size_t worker_index) {
+    int nodes;
+    if (config->numa == false || config->socket.incoming_cpu) {
+        return -1;
+    }
+    nodes = socket_tuning_numa_nodes();
+    return (nodes > 1) ? (int)(worker_index % (size_t)nodes) : -1;
+}
 
-    return r;
+/* Every worker's list |top| summed up, heaviest first. */
+static void server_metrics_top(struct ssr_server_state *primary, struct metrics_writer *w, enum server_top top) {
+    static const char *names[server_top_max] = {
+        "ssr_top_destination_bytes", "ssr_top_destination_connections", "ssr_top_user_bytes", "ssr_top_user_connections",
+    };
+    static const char *helps[server_top_max] = {
+        "Bytes both ways of the heaviest targets of closed tunnels, estimates that may run high.",
+        "Closed tunnels to the heaviest targets, estimates that may run high.",
+        "Bytes both ways of the heaviest users of closed tunnels, estimates that may run high.",
+        "Closed tunnels of the heaviest users, estimates that may run high.",
+    };
+    size_t capacity = primary->env->config->heavy_hitters;
+    struct heavy_hitters *total = heavy_hitters_create(capacity);
+    struct heavy_hitter *items = (struct heavy_hitter *) calloc(capacity, sizeof(items[0]));
+    char value[2 * HEAVY_HITTERS_KEY_MAX + 1];
+    char labels[2 * HEAVY_HITTERS_KEY_MAX + 32];
+    size_t index, count;
+
+    for (index = 0; index < primary->workers_count; ++index) {
+        heavy_hitters_merge(total, primary->workers[index]->top[top]);
+    }
+    count = heavy_hitters_snapshot(total, items, capacity);
+    metrics_family(w, names[top], "gauge", helps[top]);
+    for (index = 0; index < count; ++index) {
+        bool user = (top == server_top_user_bytes || top == server_top_user_connections);
+        snprintf(labels, sizeof(labels), "%s=\"%s\"", user ? "uid" : "destination",
+            metrics_label_escape(items[index].key, value, sizeof(value)));
+        metrics_sample(w, names[top], labels, items[index].count);
+    }
+    free(items);
+    heavy_hitters_destroy(total);
+}
+
+static void server_metrics_user_cb(const struct ssr_user *user, const struct ssr_user_usage *usage, void *p) {
+    char labels[32];
+    sprintf(labels, "uid=\"%u\"", (unsigned int)user->uid);
+    metrics_sample((struct metrics_writer *)p, "ssr_user_connections", labels, usage->connections);
+    metrics_sample((struct metrics_writer *)p, "ssr_user_bytes_total", labels, __sync_add_and_fetch((uint64_t *)&usage->traffic, 0));
+}
+
+/* On the first worker's loop, the others' counters read as they go. */
+static void server_metrics_collect_cb(void *p, struct metrics_writer *w) {
+    struct ssr_server_state *primary = (struct ssr_server_state *)p;
+    const struct server_config *config = primary->env->config;
+    struct tunnel_stats *total = tunnel_stats_create();
+    struct buffer_pool_stats pool = { 0 };
+    struct ssr_alloc_stats alloc[ssr_alloc_kind_max];
+    struct udprelay_stats udp = { 0 };
+    struct server_port *port;
+    char labels[256];
+    size_t index;
+
+    for (index = 0; index < primary->workers_count; ++index) {
+        struct server_env_t *env = primary->workers[index]->env;
+        struct buffer_pool_stats stats = { 0 };
+        tunnel_stats_merge(total, env->tunnel_stats);
+        udprelay_stats_add(primary->workers[index]->udp_listener, &udp);
+        buffer_pool_get_stats(env->read_buffer_pool, &stats);
+        pool.hits += stats.hits;
+        pool.misses += stats.misses;
+        pool.oversized += stats.oversized;
+        pool.outstanding += stats.outstanding;
+        pool.cached += stats.cached;
+        pool.scratch += stats.scratch;
+        pool.detached += stats.detached;
+    }
+
+    metrics_family(w, "ssr_tunnels_accepted_total", "counter", "Tunnels accepted.");
+    metrics_sample(w, "ssr_tunnels_accepted_total", NULL, total->tunnels_accepted);
+    metrics_family(w, "ssr_tunnels_active", "gauge", "Tunnels open.");
+    metrics_sample(w, "ssr_tunnels_active", NULL, total->tunnels_accepted - total->tunnels_closed);
+    metrics_family(w, "ssr_tunnels_refused_total", "counter", "Connections turned away by admission control or the block list.");
+    metrics_sample(w, "ssr_tunnels_refused_total", "reason=\"rejected\"", total->tunnels_rejected);
+    metrics_sample(w, "ssr_tunnels_refused_total", "reason=\"shed\"", total->tunnels_shed);
+    metrics_sample(w, "ssr_tunnels_refused_total", "reason=\"blocked\"", total->tunnels_blocked);
+    if (primary->memory_pressure) {
+        metrics_family(w, "ssr_tunnels_reclaimed_total", "counter", "Idle tunnels closed early under memory pressure.");
+        metrics_sample(w, "ssr_tunnels_reclaimed_total", NULL, total->tunnels_reclaimed);
+        metrics_family(w, "ssr_idle_timeout_ms", "gauge", "Idle timeout as shortened by memory pressure.");
+        metrics_sample(w, "ssr_idle_timeout_ms", NULL, memory_pressure_idle_timeout(primary->memory_pressure));
+    }
+    metrics_family(w, "ssr_bytes_total", "counter", "Bytes read, from the clients (incoming) and the targets (outgoing).");
+    metrics_sample(w, "ssr_bytes_total", "direction=\"incoming\"", total->bytes_incoming);
+    metrics_sample(w, "ssr_bytes_total", "direction=\"outgoing\"", total->bytes_outgoing);
+    metrics_family(w, "ssr_compression_bytes_total", "counter", "Tunnel data through the compression stage (plain) and on the wire (wire), of closed tunnels.");
+    metrics_sample(w, "ssr_compression_bytes_total", "stage=\"plain\"", total->compression_plain);
+    metrics_sample(w, "ssr_compression_bytes_total", "stage=\"wire\"", total->compression_wire);
+
+    metrics_family(w, "ssr_handshake_failures_total", "counter", "Tunnels closed in the SSR handshake.");
+    for (index = 0; index < tunnel_handshake_failure_max; ++index) {
+        snprintf(labels, sizeof(labels), "protocol=\"%s\",obfs=\"%s\",reason=\"%s\"",
+            config->protocol ? config->protocol : "origin", config->obfs ? config->obfs : "plain",
+            tunnel_stats_handshake_failure_name((enum tunnel_handshake_failure)index));
+        metrics_sample(w, "ssr_handshake_failures_total", labels, total->handshake_failures[index]);
+    }
+
+    if (config->udp) {
+        metrics_family(w, "ssr_udp_associations_active", "gauge", "UDP associations open, over the workers.");
+        metrics_sample(w, "ssr_udp_associations_active", NULL, udp.associations_opened - udp.associations_closed);
+        metrics_family(w, "ssr_udp_associations_total", "counter", "UDP associations opened.");
+        metrics_sample(w, "ssr_udp_associations_total", NULL, udp.associations_opened);
+        metrics_family(w, "ssr_udp_packets_total", "counter", "Datagrams from the clients (incoming) and relayed back to them (outgoing).");
+        metrics_sample(w, "ssr_udp_packets_total", "direction=\"incoming\"", udp.packets_in);
+        metrics_sample(w, "ssr_udp_packets_total", "direction=\"outgoing\"", udp.packets_out);
+        metrics_family(w, "ssr_udp_bytes_total", "counter", "Bytes of those datagrams, as on the wire.");
+        metrics_sample(w, "ssr_udp_bytes_total", "direction=\"incoming\"", udp.bytes_in);
+        metrics_sample(w, "ssr_udp_bytes_total", "direction=\"outgoing\"", udp.bytes_out);
+    }
+
+    if (primary->balance) {
+        struct loop_balance_stats load;
+        metrics_family(w, "ssr_worker_loop_lag_ms", "gauge", "Smoothed timer lag of each worker's loop.");
+        for (index = 0; index < primary->workers_count; ++index) {
+            loop_balance_get_stats(primary->balance, index, &load);
+            snprintf(labels, sizeof(labels), "worker=\"%u\"", (unsigned int)index);
+            metrics_sample(w, "ssr_worker_loop_lag_ms", labels, load.lag_ms);
+        }
+        metrics_family(w, "ssr_worker_byte_rate", "gauge", "Bytes per second each worker's tunnels move, both ways.");
+        for (index = 0; index < primary->workers_count; ++index) {
+            loop_balance_get_stats(primary->balance, index, &load);
+            snprintf(labels, sizeof(labels), "worker=\"%u\"", (unsigned int)index);
+            metrics_sample(w, "ssr_worker_byte_rate", labels, load.byte_rate);
+        }
+        metrics_family(w, "ssr_worker_tunnels_moved_total", "counter", "New connections sent off an overloaded worker (out) and taken in by another (in).");
+        for (index = 0; index < primary->workers_count; ++index) {
+            loop_balance_get_stats(primary->balance, index, &load);
+            snprintf(labels, sizeof(labels), "worker=\"%u\",direction=\"out\"", (unsigned int)index);
+            metrics_sample(w, "ssr_worker_tunnels_moved_total", labels, load.handed);
+            snprintf(labels, sizeof(labels), "worker=\"%u\",direction=\"in\"", (unsigned int)index);
+            metrics_sample(w, "ssr_worker_tunnels_moved_total", labels, load.taken);
+        }
+    }
+
+    metrics_family(w, "ssr_dns_cache_lookups_total", "counter", "Host names looked up in the DNS cache.");
+    metrics_sample(w, "ssr_dns_cache_lookups_total", "result=\"hit\"", total->dns_cache_hits);
+    metrics_sample(w, "ssr_dns_cache_lookups_total", "result=\"miss\"", total->dns_cache_misses);
+    metrics_sample(w, "ssr_dns_cache_lookups_total", "result=\"failure\"", total->dns_cache_failures);
+
+    metrics_family(w, "ssr_buffer_pool_requests_total", "counter", "Read buffers asked of the pools.");
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"hit\"", pool.hits);
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"miss\"", pool.misses);
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"oversized\"", pool.oversized);
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"scratch\"", pool.scratch);
+    metrics_sample(w, "ssr_buffer_pool_requests_total", "result=\"detached\"", pool.detached);
+    metrics_family(w, "ssr_buffer_pool_blocks", "gauge", "Read buffers handed out and cached.");
+    metrics_sample(w, "ssr_buffer_pool_blocks", "state=\"outstanding\"", pool.outstanding);
+    metrics_sample(w, "ssr_buffer_pool_blocks", "state=\"cached\"", pool.cached);
+
+    ssr_alloc_get_stats(alloc);
+    metrics_family(w, "ssr_alloc_bytes", "gauge", "Heap memory held, by what it is for.");
+    for (index = 0; index < ssr_alloc_kind_max; ++index) {
+        snprintf(labels, sizeof(labels), "subsystem=\"%s\"", ssr_alloc_kind_name((enum ssr_alloc_kind)index));
+        metrics_sample(w, "ssr_alloc_bytes", labels, (uint64_t)(alloc[index].bytes > 0 ? alloc[index].bytes : 0));
+    }
+    metrics_family(w, "ssr_allocations_total", "counter", "Heap blocks allocated, by what they are for.");
+    for (index = 0; index < ssr_alloc_kind_max; ++index) {
+        snprintf(labels, sizeof(labels), "subsystem=\"%s\"", ssr_alloc_kind_name((enum ssr_alloc_kind)index));
+        metrics_sample(w, "ssr_allocations_total", labels, alloc[index].allocations);
+    }
+
+    metrics_family(w, "ssr_tunnel_latency_seconds", "histogram", "Time from accepting a tunnel to each phase.");
+    for (index = 0; index < tunnel_phase_max; ++index) {
+        const char *name = tunnel_stats_phase_name((enum tunnel_stats_phase)index);
+        size_t at;
+        snprintf(labels, sizeof(labels), "phase=\"%s\"", name);
+        for (at = 0; labels[at]; ++at) {
+            labels[at] = (labels[at] == ' ') ? '_' : labels[at];
+        }
+        metrics_histogram(w, "ssr_tunnel_latency_seconds", labels, &total->latency[index]);
+    }
+    metrics_stage_times(w, total);
+    metrics_census(w);
+
+    if (primary->ports) {
+        metrics_family(w, "ssr_port_bytes_total", "counter", "Bytes both ways of each port added by the manager.");
+        for (port = primary->ports; port; port = port->next) {
+            if (port->removed == false) {
+                snprintf(labels, sizeof(labels), "port=\"%u\"", (unsigned int)port->managed->port);
+                metrics_sample(w, "ssr_port_bytes_total", labels, port->managed->traffic);
+            }
+        }
+    }
+
+    if (primary->top[0]) {
+        for (index = 0; index < server_top_max; ++index) {
+            server_metrics_top(primary, w, (enum server_top)index);
+        }
+    }
+
+    if (primary->flow_exporter) {
+        struct flow_export_stats flows = { 0 };
+        flow_exporter_get_stats(primary->flow_exporter, &flows);
+        metrics_family(w, "ssr_flow_records_total", "counter", "Records of closed tunnels for flow_export.");
+        metrics_sample(w, "ssr_flow_records_total", "result=\"exported\"", flows.exported);
+        metrics_sample(w, "ssr_flow_records_total", "result=\"dropped\"", flows.dropped);
+        metrics_sample(w, "ssr_flow_records_total", "result=\"failed\"", flows.failed);
+    }
+
+    if (primary->cluster) {
+        struct ssr_cluster_stats cluster = { 0 };
+        ssr_cluster_get_stats(primary->cluster, &cluster);
+        metrics_family(w, "ssr_cluster_datagrams_total", "counter", "Datagrams of cluster_listen.");
+        metrics_sample(w, "ssr_cluster_datagrams_total", "dir=\"sent\"", cluster.sent);
+        metrics_sample(w, "ssr_cluster_datagrams_total", "dir=\"received\"", cluster.received);
+        metrics_sample(w, "ssr_cluster_datagrams_total", "dir=\"rejected\"", cluster.rejected);
+        metrics_family(w, "ssr_cluster_dropped_total", "counter", "Replay entries that never went out to the peers.");
+        metrics_sample(w, "ssr_cluster_dropped_total", NULL, cluster.dropped);
+        metrics_family(w, "ssr_cluster_peers_heard", "gauge", "Peers heard from lately.");
+        metrics_sample(w, "ssr_cluster_peers_heard", NULL, cluster.peers_heard);
+    }
+
+    if (ssr_user_table_count(config->users) > 0) {
+        metrics_family(w, "ssr_user_connections", "gauge", "Tunnels open of each user.");
+        metrics_family(w, "ssr_user_bytes_total", "counter", "Bytes both ways of each user, up to a second late.");
+        ssr_user_table_traverse(config->users, server_metrics_user_cb, w);
+    }
+
+    tunnel_stats_destroy(total);
+}
+
+static void ssr_server_quit_async_cb(uv_async_t *handle) {
+    struct server_env_t *env = (struct server_env_t *)handle->loop->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+    if (__sync_add_and_fetch(&state->quit_requested, 0) == 0 &&
+        __sync_lock_test_and_set(&state->drain_requested, 0))
+    {
+        ssr_server_drain(state);
+        return;
+    }
+    ssr_server_shutdown(state);
 }
 
 static void listener_close_done_cb(uv_handle_t* handle) {
     free((void *)((uv_tcp_t *)handle));
 }
 
+/* The socket exists before listener_start() so its options can be set ahead of the bind.
+ * IPv6 where the host has it, one dual-stack socket takes the IPv4 clients as well,
+ * else IPv4. Returns the family. */
+static int listener_init(uv_loop_t *loop, uv_tcp_t *listener, const struct server_config *config) {
+#if defined(__linux__)
+    if (config->mptcp) {
+        int family = AF_INET6;
+        int fd = socket_tuning_mptcp_socket(family);
+        if (fd == -EAFNOSUPPORT) {
+            fd = socket_tuning_mptcp_socket(family = AF_INET);
+        }
+        if (fd >= 0) {
+            uv_tcp_init(loop, listener);
+            VERIFY(0 == uv_tcp_open(listener, fd));
+            return family;
+        }
+        pr_warn("Multipath TCP not available, listening with TCP.");
+    }
+#else
+    (void)config;
+#endif // defined(__linux__)
+    if (uv_tcp_init_ex(loop, listener, AF_INET6) == 0) {
+        return AF_INET6;
+    }
+    VERIFY(0 == uv_tcp_init_ex(loop, listener, AF_INET));
+    return AF_INET;
+}
+
+/* Binds |listener|, of |family|, to |port| of every address and listens, |what| names the step that failed.
+ * |cpu| is its SO_INCOMING_CPU, -1 for none. */
+static int listener_start(uv_tcp_t *listener, int family, const struct server_config *config, uint16_t port, bool reuse_port, int cpu, const char **what) {
+    union sockaddr_universal addr = { 0 };
+    int error;
+
+#if defined(SO_REUSEPORT)
+    if (reuse_port) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        int on = 1;
+        *what = "setting SO_REUSEPORT";
+        if ((error = uv_fileno((uv_handle_t *)listener, &fd)) != 0) {
+            return error;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            return -errno;
+        }
+    }
+#else
+    (void)reuse_port;
+#endif // defined(SO_REUSEPORT)
+
+    if (socket_tuning_is_default(&config->socket) == false) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        if (uv_fileno((uv_handle_t *)listener, &fd) != 0 ||
+            socket_tuning_apply_listener(&config->socket, (int)fd, cpu) != 0)
+        {
+            pr_warn("Some socket options not available on port %hu.", port);
+        }
+    }
+
+    if (family == AF_INET6) {
+        // [::] without UV_TCP_IPV6ONLY, libuv clears IPV6_V6ONLY so IPv4 comes in mapped.
+        addr.addr6.sin6_family = AF_INET6;
+        addr.addr6.sin6_addr = in6addr_any;
+    } else {
+        addr.addr4.sin_family = AF_INET;
+        addr.addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    universal_address_set_port(&addr, port);
+    *what = "binding";
+    if ((error = uv_tcp_bind(listener, &addr.addr, 0)) != 0) {
+        return error;
+    }
+
+#if defined(TCP_FASTOPEN)
+    if (config->fast_open) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        int qlen = SSR_MAX_CONN;
+        if (uv_fileno((uv_handle_t *)listener, &fd) != 0 ||
+            setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) != 0)
+        {
+            // Clients then complete an ordinary handshake.
+            pr_warn("TCP Fast Open not available on port %hu.", port);
+        }
+    }
+#else
+    (void)config;
+#endif // defined(TCP_FASTOPEN)
+
+    *what = "listening";
+    if ((error = uv_listen((uv_stream_t *)listener, SSR_MAX_CONN, tunnel_incoming_connection_established_cb)) != 0) {
+        return error;
+    }
+
+    if (config->socket.defer_accept > 0) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        if (uv_fileno((uv_handle_t *)listener, &fd) != 0 ||
+            socket_tuning_apply_accept(&config->socket, (int)fd) != 0)
+        {
+            pr_warn("Deferred accept not available on port %hu.", port);
+        }
+    }
+    return 0;
+}
+
+/* Listens on |fd|, passed over by the server this one replaces, options and all. */
+static int listener_adopt(uv_tcp_t *listener, int fd, const char **what) {
+    int error;
+    *what = "taking over the listener";
+    if ((error = uv_tcp_open(listener, (uv_os_sock_t)fd)) != 0) {
+        handoff_discard(&fd, 1);
+        return error;
+    }
+    *what = "listening";
+    return uv_listen((uv_stream_t *)listener, SSR_MAX_CONN, tunnel_incoming_connection_established_cb);
+}
+
+/* Every worker's listener, the successor's worker N takes worker N's. */
+static size_t server_handoff_collect_cb(void *p, int *fds, size_t max) {
+    struct ssr_server_state *primary = (struct ssr_server_state *)p;
+    size_t index, count = 0;
+
+    for (index = 0; index < primary->workers_count && count < max; ++index) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        uv_tcp_t *listener = primary->workers[index]->tcp_listener;
+        if (listener && uv_fileno((uv_handle_t *)listener, &fd) == 0) {
+            fds[count++] = (int)fd;
+        }
+    }
+    return count;
+}
+
+static void server_handoff_sent_cb(void *p, int status) {
+    struct ssr_server_state *primary = (struct ssr_server_state *)p;
+    size_t index;
+
+    if (status != 0) {
+        pr_err("passing the listeners failed: %s", uv_strerror(status));
+        return;
+    }
+    pr_info("listeners passed to the new server, draining");
+    // The path is the successor's now, and so is the manager's port.
+    handoff_shutdown(primary->handoff, false);
+    primary->handoff = NULL;
+    port_manager_shutdown(primary->port_manager);
+    primary->port_manager = NULL;
+
+    for (index = 1; index < primary->workers_count; ++index) {
+        __sync_lock_test_and_set(&primary->workers[index]->drain_requested, 1);
+        uv_async_send(primary->workers[index]->quit_async);
+    }
+    ssr_server_drain(primary);
+}
+
+/* Stops accepting, the tunnels go on until they're done or idle out. */
+static void ssr_server_drain(struct ssr_server_state *state) {
+    struct server_port *port;
+
+    if (state->draining || state->shutting_down) {
+        return;
+    }
+    state->draining = true;
+    loop_balance_detach(state->balance, state->worker_index);
+    if (state->tcp_listener) {
+        admission_forget_listener(state->admission, (uv_stream_t *)state->tcp_listener);
+        uv_close((uv_handle_t *)state->tcp_listener, listener_close_done_cb);
+        state->tcp_listener = NULL;
+    }
+    // Its conversations can't be handed over, they reconnect to the successor.
+    kcp_srv_shutdown(state->kcp_srv);
+    state->kcp_srv = NULL;
+    // The successor binds the port beside it, connections open end with their tunnels.
+    tls_srv_stop_listening(state->tls_srv);
+    for (port = state->ports; port; port = port->next) {
+        server_port_stop_listening(port);
+    }
+
+    state->drain_timer = (uv_timer_t *) calloc(1, sizeof(uv_timer_t));
+    VERIFY(0 == uv_timer_init(state->loop, state->drain_timer));
+    VERIFY(0 == uv_timer_start(state->drain_timer, ssr_server_drain_timer_cb, SERVER_DRAIN_CHECK_MS, SERVER_DRAIN_CHECK_MS));
+}
+
+static void ssr_server_drain_timer_cb(uv_timer_t *handle) {
+    struct server_env_t *env = (struct server_env_t *)handle->loop->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+    size_t index;
+
+    server_ports_collect(state);
+    if (env->tunnel_list == NULL && state->ports == NULL) {
+        __sync_lock_test_and_set(&state->drained, 1);
+    }
+    // The first worker quits them all once each is drained.
+    if (state->worker_index != 0 || __sync_add_and_fetch(&state->drained, 0) == 0) {
+        return;
+    }
+    for (index = 1; index < state->workers_count; ++index) {
+        if (__sync_add_and_fetch(&state->workers[index]->drained, 0) == 0) {
+            return;
+        }
+    }
+    pr_info("tunnels drained, quitting");
+    ssr_server_shutdown(state);
+}
+
+/* On the first worker, every worker gets the change, itself included. */
+static void ports_changed_cb(void *p, struct managed_port *port, bool added) {
+    struct ssr_server_state *primary = (struct ssr_server_state *)p;
+    size_t index;
+
+    if (added) {
+        port->rate_limit = rate_limit_create(port->config.rate_limit_port, primary->rate_limit_global);
+    }
+    for (index = 0; index < primary->workers_count; ++index) {
+        struct ssr_server_state *worker = primary->workers[index];
+        struct port_change *change = (struct port_change *) calloc(1, sizeof(*change));
+        struct port_change **tail;
+
+        change->port = managed_port_retain(port);
+        change->added = added;
+        uv_mutex_lock(&worker->ports_lock);
+        for (tail = &worker->ports_pending; *tail; tail = &(*tail)->next) {
+        }
+        *tail = change;
+        uv_mutex_unlock(&worker->ports_lock);
+        uv_async_send(worker->ports_async);
+    }
+}
+
+static void ports_async_cb(uv_async_t *handle) {
+    struct server_env_t *env = (struct server_env_t *)handle->loop->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+    struct port_change *changes;
+
+    uv_mutex_lock(&state->ports_lock);
+    changes = state->ports_pending;
+    state->ports_pending = NULL;
+    uv_mutex_unlock(&state->ports_lock);
+
+    while (changes) {
+        struct port_change *change = changes;
+        changes = change->next;
+        if (state->shutting_down == false) {
+            if (change->added) {
+                server_port_open(state, managed_port_retain(change->port));
+            } else {
+                struct server_port *port;
+                for (port = state->ports; port; port = port->next) {
+                    if (port->managed == change->port && port->removed == false) {
+                        server_port_close(port);
+                        break;
+                    }
+                }
+            }
+        }
+        managed_port_release(change->port);
+        free(change);
+    }
+    server_ports_collect(state);
+}
+
+/* Takes a reference of |managed|. */
+static void server_port_open(struct ssr_server_state *state, struct managed_port *managed) {
+    struct server_port *port = (struct server_port *) calloc(1, sizeof(*port));
+    struct server_config *config = state->env->config;
+    const char *what = NULL;
+    int family, error;
+
+    port->managed = managed;
+    port->env = ssr_cipher_env_create_shared(&managed->config, state->env);
+    port->env->managed_port = managed;
+    if (state->replay_filter) {
+        cipher_env_set_replay_filter(port->env->cipher, state->replay_filter);
+    } else {
+        cipher_env_disable_replay_filter(port->env->cipher);
+    }
+    port->listener = (uv_tcp_t *) calloc(1, sizeof(uv_tcp_t));
+    family = listener_init(state->loop, port->listener, config);
+    port->listener->data = port;
+    port->next = state->ports;
+    state->ports = port;
+
+    error = listener_start(port->listener, family, config, managed->port, (config->workers > 1),
+        socket_tuning_worker_cpu(&config->socket, state->worker_index), &what);
+    if (error != 0) {
+        pr_err("port %hu, %s: %s", managed->port, what, uv_strerror(error));
+        server_port_close(port);
+    }
+}
+
+static void _do_shutdown_port_tunnel(struct tunnel_ctx *tunnel, void *p) {
+    tunnel_shutdown(tunnel);
+    (void)p;
+}
+
+/* Its tunnels go on, server_ports_collect() frees it after the last. */
+static void server_port_stop_listening(struct server_port *port) {
+    port->removed = true;
+    if (port->listener) {
+        admission_forget_listener(((struct ssr_server_state *)port->env->data)->admission, (uv_stream_t *)port->listener);
+        uv_close((uv_handle_t *)port->listener, listener_close_done_cb);
+        port->listener = NULL;
+    }
+}
+
+/* Its tunnels are shut down, server_ports_collect() frees it after the last. */
+static void server_port_close(struct server_port *port) {
+    server_port_stop_listening(port);
+    tunnel_list_traverse(port->env->tunnel_list, &_do_shutdown_port_tunnel, NULL);
+}
+
+static void server_ports_collect(struct ssr_server_state *state) {
+    struct server_port **link = &state->ports;
+    while (*link) {
+        struct server_port *port = *link;
+        if (port->removed == false || port->env->tunnel_list != NULL) {
+            link = &port->next;
+            continue;
+        }
+        *link = port->next;
+        ssr_cipher_env_release(port->env);
+        managed_port_release(port->managed);
+        free(port);
+    }
+}
+
 void ssr_server_shutdown(struct ssr_server_state *state) {
     if (state == NULL) {
         return;
@@ -246,65 +1337,192 @@ void ssr_server_shutdown(struct ssr_server_state *state) {
     }
     state->shutting_down = true;
 
-    uv_signal_stop(state->sigint_watcher);
-    uv_signal_stop(state->sigterm_watcher);
+    if (state->sigint_watcher) {
+        uv_signal_stop(state->sigint_watcher);
+        uv_close((uv_handle_t *)state->sigint_watcher, NULL);
+    }
+    if (state->sigterm_watcher) {
+        uv_signal_stop(state->sigterm_watcher);
+        uv_close((uv_handle_t *)state->sigterm_watcher, NULL);
+    }
+    if (state->quit_async) {
+        uv_close((uv_handle_t *)state->quit_async, NULL);
+    }
+    if (state->drain_timer) {
+        uv_close((uv_handle_t *)state->drain_timer, NULL);
+    }
+    handoff_shutdown(state->handoff, true);
+    state->handoff = NULL;
+    metrics_server_shutdown(state->metrics);
+    state->metrics = NULL;
+
+    {
+        size_t index;
+        for (index = 1; index < state->workers_count; ++index) {
+            __sync_lock_test_and_set(&state->workers[index]->quit_requested, 1);
+            uv_async_send(state->workers[index]->quit_async);
+        }
+    }
 
+    admission_shutdown(state->admission);
+    memory_pressure_shutdown(state->memory_pressure);
+    loop_balance_detach(state->balance, state->worker_index);
+    upstream_proxy_destroy(state->upstream);
+    state->upstream = NULL;
+    kcp_srv_shutdown(state->kcp_srv);
+    state->kcp_srv = NULL;
+    tls_srv_shutdown(state->tls_srv);
+    state->tls_srv = NULL;
     if (state->tcp_listener) {
         uv_close((uv_handle_t *)state->tcp_listener, listener_close_done_cb);
     }
 
+    port_manager_shutdown(state->port_manager);
+    state->port_manager = NULL;
+    if (state->ports_async) {
+        struct server_port *port;
+        uv_close((uv_handle_t *)state->ports_async, NULL);
+        for (port = state->ports; port; port = port->next) {
+            server_port_close(port);
+        }
+    }
+
 #if UDP_RELAY_ENABLE
     if (state->udp_listener) {
-        // udprelay_shutdown(state->udp_listener);
+        udprelay_shutdown(state->udp_listener);
+        state->udp_listener = NULL;
     }
 #endif // UDP_RELAY_ENABLE
 
     server_shutdown(state->env);
 
-    pr_info("\n");
-    pr_info("terminated.\n");
+    dns_cache_destroy(state->dns_cache);
+    state->dns_cache = NULL;
+
+    {
+        struct buffer_pool_stats stats = { 0 };
+        buffer_pool_get_stats(state->env->read_buffer_pool, &stats);
+        pr_info("read buffer pool hits %llu, misses %llu, oversized %llu",
+            (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+            (unsigned long long)stats.oversized);
+    }
+
+    tunnel_stats_dump(state->env->tunnel_stats);
+
+    if (state->worker_index == 0) {
+        pr_info("\n");
+        pr_info("terminated.\n");
+    }
 }
 
 bool _init_done_cb(struct tunnel_ctx *tunnel, void *p) {
     struct server_env_t *env = (struct server_env_t *)p;
 
-    struct server_ctx *ctx = (struct server_ctx *) calloc(1, sizeof(*ctx));
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
     ctx->env = env;
-    ctx->init_pkg = buffer_create(SSR_BUFF_SIZE);
-    ctx->_recv_buffer_size = TCP_BUF_SIZE_MAX;
-    tunnel->data = ctx;
+    ctx->_incoming_read_size = SSR_BUFF_SIZE;
+    ctx->_outgoing_read_size = SSR_BUFF_SIZE;
+    tunnel->stats = env->tunnel_stats;
+    tunnel->handles = env->tunnel_handles;
+    tunnel->resolver = env->resolver;
+    tunnel->write_queue_high = env->config->write_queue_high_watermark;
+    tunnel->write_queue_low = env->config->write_queue_low_watermark;
+    if (tunnel->write_queue_low > tunnel->write_queue_high) {
+        tunnel->write_queue_low = tunnel->write_queue_high;
+    }
+    if (socket_tuning_is_default(&env->config->socket) == false) {
+        tunnel->socket_tuning = &env->config->socket;
+    }
+    tunnel->notsent_lowat = env->config->socket.notsent_lowat;
+    tunnel->stage_timeout = env->config->handshake_timeout;
+    tunnel_deadline_start(tunnel, env->config->handshake_deadline, env->config->handshake_min_rate);
+    tunnel->linger_timeout = env->config->linger_timeout;
+    tunnel->egress_pool = env->egress_pool;
+    tunnel->fair_queue = env->fair_queue;
+    tunnel->coalescer = env->read_coalescer;
+    tunnel->watchdog = env->watchdog;
+    tunnel->trace_id = tunnel_trace_sample(env->trace);
+    if (tunnel->trace_id) {
+        tunnel->trace = env->trace;
+    }
+    ctx->shape = tunnel_shape_begin(env->shape, tunnel->accept_time);
+    {
+        struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+        struct rate_limit *parent = env->managed_port ? env->managed_port->rate_limit : state->rate_limit_port;
+        if (parent == NULL) {
+            parent = state->rate_limit_global;
+        }
+        if (parent || env->config->rate_limit_tunnel) {
+            rate_limit_init(&tunnel->rate_limit, env->config->rate_limit_tunnel, parent);
+            tunnel->rate_limited = true;
+        }
+    }
 
     tunnel->tunnel_dying = &tunnel_dying;
     tunnel->tunnel_timeout_expire_done = &tunnel_timeout_expire_done;
     tunnel->tunnel_outgoing_connected_done = &tunnel_outgoing_connected_done;
     tunnel->tunnel_read_done = &tunnel_read_done;
     tunnel->tunnel_getaddrinfo_done = &tunnel_getaddrinfo_done;
+    tunnel->tunnel_getaddrinfo_result = &tunnel_getaddrinfo_result;
     tunnel->tunnel_write_done = &tunnel_write_done;
+    tunnel->tunnel_idle_trim = &tunnel_idle_trim;
+    tunnel->tunnel_spliced = &tunnel_spliced;
     tunnel->tunnel_get_alloc_size = &tunnel_get_alloc_size;
     tunnel->tunnel_extract_data = &tunnel_extract_data;
+    tunnel->tunnel_extract_segments = &tunnel_extract_segments;
+    if (env->crypto_offload) {
+        tunnel->tunnel_extract_offload = &tunnel_extract_offload;
+    }
 
-    cstl_set_container_add(ctx->env->tunnel_set, tunnel);
+    tunnel_list_add(&ctx->env->tunnel_list, tunnel);
+    {
+        struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+        if (state->admission) {
+            admission_tunnel_opened(state->admission, &ctx->admission, tunnel);
+        }
+    }
 
     ctx->cipher = NULL;
     ctx->stage = tunnel_stage_initial;
+    if (tunnel->trace) {
+        tunnel_trace_stage(tunnel, tunnel_stage_names[ctx->stage]);
+    }
 
     return is_incoming_ip_legal(tunnel);
 }
 
 void server_tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout) {
     uv_loop_t *loop = listener->loop;
-    struct server_env_t *env = (struct server_env_t *)loop->data;
+    struct server_port *port = (struct server_port *)listener->data;
+    struct server_env_t *env = port ? port->env : (struct server_env_t *)loop->data;
 
-    tunnel_initialize(listener, idle_timeout, &_init_done_cb, env);
+    tunnel_initialize(listener, idle_timeout, env->read_buffer_pool, env->timer_wheel, sizeof(struct server_ctx), &_init_done_cb, env);
 }
 
-static void _do_shutdown_tunnel(const void *obj, void *p) {
-    tunnel_shutdown((struct tunnel_ctx *)obj);
+static void _do_shutdown_tunnel(struct tunnel_ctx *tunnel, void *p) {
+    tunnel_shutdown(tunnel);
     (void)p;
 }
 
 void server_shutdown(struct server_env_t *env) {
-    cstl_set_container_traverse(env->tunnel_set, &_do_shutdown_tunnel, NULL);
+    tunnel_list_traverse(env->tunnel_list, &_do_shutdown_tunnel, NULL);
+    // What the workers still hold comes back to the tunnels just shut down.
+    crypto_offload_release(env->crypto_offload);
+    env->crypto_offload = NULL;
+    // Before the fair queue, the held reads may still be handed to it.
+    read_coalescer_release(env->read_coalescer);
+    env->read_coalescer = NULL;
+    fair_queue_release(env->fair_queue);
+    env->fair_queue = NULL;
+    loop_watchdog_dump(env->watchdog);
+    loop_watchdog_release(env->watchdog);
+    env->watchdog = NULL;
+    tunnel_trace_shutdown(env->trace);
+    tunnel_shape_shutdown(env->shape);
+    timer_wheel_release(env->timer_wheel);
+    env->timer_wheel = NULL;
+    resolv_shutdown(env->resolver);
+    env->resolver = NULL;
 }
 
 void signal_quit_cb(uv_signal_t *handle, int signum) {
@@ -330,22 +1548,142 @@ void signal_quit_cb(uv_signal_t *handle, int signum) {
 }
 
 void tunnel_incoming_connection_established_cb(uv_stream_t *server, int status) {
-    uv_loop_t *loop = server->loop;
-    struct server_env_t *env = (struct server_env_t *)loop->data;
-
     VERIFY(status == 0);
+    server_accept(server);
+}
+
+/* Also admission control's resume_cb, for a connection it held back. */
+static void server_accept(uv_stream_t *server) {
+    struct server_env_t *env = (struct server_env_t *)server->loop->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+
+    // An overloaded worker's new connections of the configured port go to a calmer one.
+    if (server == (uv_stream_t *)state->tcp_listener &&
+        loop_balance_steer(state->balance, state->worker_index, server))
+    {
+        return;
+    }
+    if (state->admission) {
+        switch (admission_check(state->admission, server)) {
+        case admission_reject:
+            admission_turn_away(server);
+            return;
+        case admission_defer:
+            return;  /* libuv stops watching |server| until it's accepted. */
+        default:
+            break;
+        }
+    }
     server_tunnel_initialize((uv_tcp_t *)server, env->config->idle_timeout);
 }
 
+/* A connection another worker accepted, onto this one's listener as if accepted here. */
+static int server_balance_adopt_cb(void *p, uv_os_sock_t sock) {
+    struct ssr_server_state *state = (struct ssr_server_state *)p;
+    struct server_env_t *env = state->env;
+
+    if (state->tcp_listener == NULL) {
+        return UV_ECANCELED;
+    }
+    // The worker it was steered off didn't check it against any limit.
+    if (state->admission && admission_check_accepted(state->admission) == false) {
+        return UV_EBUSY;
+    }
+    return tunnel_adopt(state->tcp_listener, sock, env->config->idle_timeout, env->read_buffer_pool, env->timer_wheel,
+        sizeof(struct server_ctx), &_init_done_cb, env);
+}
+
+/* The tunnels of the configured port and of the managed ones. */
+static void server_memory_walk_cb(void *p, void(*fn)(struct tunnel_ctx *tunnel, void *arg), void *arg) {
+    struct ssr_server_state *state = (struct ssr_server_state *)p;
+    struct server_port *port;
+
+    tunnel_list_traverse(state->env->tunnel_list, fn, arg);
+    for (port = state->ports; port; port = port->next) {
+        tunnel_list_traverse(port->env->tunnel_list, fn, arg);
+    }
+}
+
 static void tunnel_dying(struct tunnel_ctx *tunnel) {
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
 
-    cstl_set_container_remove(ctx->env->tunnel_set, tunnel);
+    tunnel_list_remove(&ctx->env->tunnel_list, tunnel);
+    if (ctx->admission.counted) {
+        admission_tunnel_closed(((struct ssr_server_state *)ctx->env->data)->admission, &ctx->admission);
+    }
+    server_top_count(tunnel);
+    server_flow_record(tunnel);
+    tunnel_shape_end(ctx->env->shape, ctx->shape, tunnel_stage_names[ctx->stage]);
+    ctx->shape = NULL;
     if (ctx->cipher) {
         tunnel_cipher_release(ctx->cipher);
     }
     buffer_release(ctx->init_pkg);
-    free(ctx);
+    mux_session_destroy(ctx->mux);
+    if (ctx->env->managed_port && ctx->env->tunnel_list == NULL) {
+        // Maybe the last of a removed port.
+        server_ports_collect((struct ssr_server_state *)ctx->env->data);
+    }
+}
+
+/* The closing tunnel's target and user into its worker's top lists, a target once it was parsed. */
+static void server_top_count(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    char key[HEAVY_HITTERS_KEY_MAX + 1];
+    uint64_t bytes = ctx->bytes_incoming + ctx->bytes_outgoing;
+
+    if (state->top[0] == NULL) {
+        return;
+    }
+    if (socks5_address_to_string(tunnel->desired_addr, key, sizeof(key))) {
+        heavy_hitters_add(state->top[server_top_destination_bytes], key, bytes);
+        heavy_hitters_add(state->top[server_top_destination_connections], key, 1);
+    }
+    if (ctx->user) {
+        sprintf(key, "%u", (unsigned int)ctx->user->uid);
+        heavy_hitters_add(state->top[server_top_user_bytes], key, bytes);
+        heavy_hitters_add(state->top[server_top_user_connections], key, 1);
+    }
+}
+
+/* The closing tunnel into its worker's ring of flow_export, the wall clock start back-dated by its age. */
+static void server_flow_record(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    const struct server_config *config = ctx->env->config;
+    struct flow_record record;
+    uv_timeval64_t now;
+    uint64_t age_ms;
+
+    if (state->flows == NULL) {
+        return;
+    }
+    memset(&record, 0, sizeof(record));
+    uv_gettimeofday(&now);
+    record.end_ms = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_usec / 1000;
+    age_ms = (uv_hrtime() - tunnel->accept_time) / 1000000;
+    record.start_ms = (age_ms < record.end_ms) ? record.end_ms - age_ms : record.end_ms;
+    record.bytes_incoming = ctx->bytes_incoming;
+    record.bytes_outgoing = ctx->bytes_outgoing;
+    if (socks5_address_to_string(tunnel->desired_addr, record.destination, sizeof(record.destination))) {
+        record.port = tunnel->desired_addr->port;
+    }
+    if (tunnel->outgoing) {
+        record.target = tunnel->outgoing->addr;
+    }
+    if (ctx->user) {
+        record.has_user = true;
+        record.uid = (uint32_t)ctx->user->uid;
+    }
+    strncpy(record.protocol, config->protocol ? config->protocol : "origin", sizeof(record.protocol) - 1);
+    strncpy(record.obfs, config->obfs ? config->obfs : "plain", sizeof(record.obfs) - 1);
+    flow_ring_record(state->flows, &record);
+}
+
+static void tunnel_idle_trim(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    tunnel_cipher_trim(ctx->cipher);
 }
 
 static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
@@ -388,16 +1726,25 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     case tunnel_stage_connect_host:
         do_connect_host_done(tunnel, socket);
         break;
+    case tunnel_stage_upstream_reply:
+        do_upstream_reply(tunnel, socket);
+        break;
     case tunnel_stage_launch_streaming:
         do_launch_streaming(tunnel, socket);
         break;
     case tunnel_stage_streaming:
-        tunnel_traditional_streaming(tunnel, socket);
+        tunnel_streaming(tunnel, socket);
+        break;
+    case tunnel_stage_mux:
+        do_mux_streaming(tunnel, socket);
         break;
     default:
         UNREACHABLE();
         break;
     }
+    if (tunnel->trace) {
+        tunnel_trace_stage(tunnel, tunnel_stage_names[ctx->stage]);
+    }
 }
 
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
@@ -405,7 +1752,8 @@ static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_
     struct socket_ctx *incoming = tunnel->incoming;
     if (incoming == socket) {
         if (ctx->stage < tunnel_stage_resolve_host) {
-            // report_addr(server->fd, SUSPICIOUS); // collect MALICIOUS IPs.
+            // A stage timer, the deadline or a trickle, tunnel.c shuts it down.
+            server_handshake_report(tunnel, tunnel_handshake_timeout, SUSPICIOUS);
         }
     }
 }
@@ -415,6 +1763,23 @@ static void tunnel_outgoing_connected_done(struct tunnel_ctx *tunnel, struct soc
 }
 
 static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    if (socket->result > 0) {
+        *((socket == tunnel->incoming) ? &ctx->bytes_incoming : &ctx->bytes_outgoing) += (uint64_t)socket->result;
+        if (ctx->shape) {
+            tunnel_shape_read(ctx->shape, socket != tunnel->incoming, uv_hrtime(), (size_t)socket->result);
+        }
+    }
+    if (ctx->env->managed_port && socket->result > 0) {
+        managed_port_add_traffic(ctx->env->managed_port, (uint64_t)socket->result);
+    }
+    if (ctx->user && socket->result > 0 && tunnel_charge_user(tunnel, (size_t)socket->result) == false) {
+        return;
+    }
+    if (ctx->stage == tunnel_stage_streaming) {
+        socket_adapt_read_size((socket == tunnel->incoming) ? &ctx->_incoming_read_size : &ctx->_outgoing_read_size, socket,
+            SSR_BUFF_SIZE, TCP_READ_SIZE_MAX);
+    }
     do_next(tunnel, socket);
 }
 
@@ -422,82 +1787,130 @@ static void tunnel_getaddrinfo_done(struct tunnel_ctx *tunnel, struct socket_ctx
     do_next(tunnel, socket);
 }
 
+static void tunnel_getaddrinfo_result(struct tunnel_ctx *tunnel, struct socket_ctx *socket, int status, const union sockaddr_universal *addrs, size_t count) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    const char *host = tunnel->desired_addr->addr.domainname;
+    (void)socket;
+    if (status == 0) {
+        dns_cache_store(state->dns_cache, host, addrs, count);
+    } else if (status == UV_EAI_NONAME || status == UV_EAI_NODATA) {
+        // Only a definite answer is remembered, a timeout may pass.
+        dns_cache_store_failure(state->dns_cache, host);
+    }
+}
+
 static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     do_next(tunnel, socket);
 }
 
+static void tunnel_spliced(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t len) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    *((socket == tunnel->incoming) ? &ctx->bytes_incoming : &ctx->bytes_outgoing) += (uint64_t)len;
+    if (ctx->shape) {
+        tunnel_shape_read(ctx->shape, socket != tunnel->incoming, uv_hrtime(), len);
+    }
+    if (ctx->env->managed_port) {
+        managed_port_add_traffic(ctx->env->managed_port, (uint64_t)len);
+    }
+}
+
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size) {
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
     if (socket == tunnel->incoming) {
-        return TCP_BUF_SIZE_MAX;
+        // The handshake and the mux frames still come in whole.
+        return (ctx->stage == tunnel_stage_streaming) ? ctx->_incoming_read_size : TCP_BUF_SIZE_MAX;
     } else if (socket == tunnel->outgoing) {
-        return _get_read_size(tunnel, socket, ctx->_recv_buffer_size);
+        return _get_read_size(tunnel, socket, ctx->_outgoing_read_size);
     } else {
         ASSERT(false);
     }
     return suggested_size;
 }
 
+/* The client's address as text, false when the socket has none. */
+static bool server_peer_name(struct tunnel_ctx *tunnel, char *name, size_t size) {
+    union sockaddr_universal peer = { 0 };
+    int len = sizeof(peer);
+
+    if (uv_tcp_getpeername(&tunnel->incoming->handle.tcp, &peer.addr, &len) != 0) {
+        return false;
+    }
+    universal_address_unmap(&peer);  // Of a dual-stack listener.
+    universal_address_to_string(&peer, name, size);
+    return name[0] != '\0';
+}
+
+/* An address that failed more than MAX_TRIES handshakes lately is closed on accept. */
 static bool is_incoming_ip_legal(struct tunnel_ctx *tunnel) {
-    uv_tcp_t *tcp = &tunnel->incoming->handle.tcp;
-    // TODO: check incoming ip.
+    char peer[INET6_ADDRSTRLEN] = { 0 };
+
+    if (server_peer_name(tunnel, peer, sizeof(peer)) && check_block_list(peer)) {
+        if (tunnel->stats) {
+            tunnel->stats->tunnels_blocked++;
+        }
+        return false;
+    }
     return true;
 }
 
-static bool is_legal_header(const struct buffer_t *buf) {
-    bool result = false;
-    enum SOCKS5_ADDRTYPE addr_type;
-    do {
-        if (buf == NULL) {
-            break;
-        }
-        addr_type = (enum SOCKS5_ADDRTYPE) buf->buffer[0];
-        switch (addr_type) {
-        case SOCKS5_ADDRTYPE_IPV4:
-        case SOCKS5_ADDRTYPE_DOMAINNAME:
-        case SOCKS5_ADDRTYPE_IPV6:
-            result = true;
-            break;
-        default:
-            break;
-        }
-    } while (0);
-    return result;
+/* Closes a tunnel whose first packets were turned down, and counts them against its source address. */
+static void server_handshake_report(struct tunnel_ctx *tunnel, enum tunnel_handshake_failure failure, int err_level) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    char peer[INET6_ADDRSTRLEN] = { 0 };
+
+    ctx->env->tunnel_stats->handshake_failures[failure]++;
+    if (server_peer_name(tunnel, peer, sizeof(peer))) {
+        update_block_list(peer, err_level);
+    }
+}
+
+static void server_handshake_failed(struct tunnel_ctx *tunnel, enum tunnel_handshake_failure failure) {
+    server_handshake_report(tunnel, failure, MALFORMED);
+    tunnel_shutdown(tunnel);
 }
 
-static bool is_header_complete(const struct buffer_t *buf) {
-    struct socks5_address addr;
-    return socks5_address_parse(buf->buffer, buf->len, &addr);
+/* Counts |bytes| of the tunnel's user, false when that closed the tunnel. */
+static bool tunnel_charge_user(struct tunnel_ctx *tunnel, size_t bytes) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    size_t rate = ctx->env->config->rate_limit_over_quota;
+
+    switch (ssr_user_shard_add(state->user_shard, ctx->user, bytes, uv_now(state->loop))) {
+    case ssr_user_ok:
+        return true;
+    case ssr_user_over_quota:
+        if (rate) {
+            if (ctx->over_quota == false) {
+                ctx->over_quota = true;
+                rate_limit_init(&tunnel->rate_limit, rate, tunnel->rate_limited ? tunnel->rate_limit.parent : NULL);
+                tunnel->rate_limited = true;
+            }
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    tunnel_shutdown(tunnel);
+    return false;
 }
 
 static size_t _get_read_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size) {
     // https://github.com/ShadowsocksR-Live/shadowsocksr/blob/manyuser/shadowsocks/tcprelay.py#L812
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
-    size_t buffer_size;
     size_t frame_size;
-    int fd = 0;
+    (void)socket;
     if (ctx->_overhead) {
-        return suggested_size;
-    }
-    fd = uv_stream_fd(&socket->handle.tcp);
-    {
-    char *tmp = (char *)calloc(suggested_size + 1, sizeof(*tmp));
-    buffer_size = (size_t) recv(fd, tmp, (int)suggested_size, MSG_PEEK);
-    if (buffer_size == 0) { buffer_size = suggested_size; }
-    free(tmp);
+        // Room for the protocol's framing, the packed output stays within the read size.
+        return (suggested_size > ctx->_overhead * 2) ? suggested_size - ctx->_overhead : suggested_size;
     }
-    frame_size = ctx->_tcp_mss - ctx->_overhead;
-
-    buffer_size = min(buffer_size, ctx->_recv_d_max_size);
-    ctx->_recv_d_max_size = min(ctx->_recv_d_max_size + frame_size, TCP_BUF_SIZE_MAX);
-
-    if (buffer_size == suggested_size) {
-        return buffer_size;
+    // Whole frames, so the obfs padding lines up with the segments.
+    frame_size = ctx->_tcp_mss;
+    if (frame_size && suggested_size > frame_size) {
+        suggested_size = (suggested_size / frame_size) * frame_size;
     }
-    if (buffer_size > frame_size) {
-        buffer_size = (buffer_size / frame_size) * frame_size;
-    }
-    return buffer_size;
+    return suggested_size;
 }
 
 static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *incoming) {
@@ -506,8 +1919,10 @@ static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *incomi
     struct buffer_t *confirm = NULL;
     struct buffer_t *result = NULL;
     do {
-        BUFFER_CONSTANT_INSTANCE(buf, incoming->buf->base, incoming->result);
-        size_t tcp_mss = _update_tcp_mss(incoming);
+        const uint8_t *data = (const uint8_t *)incoming->buf->base;
+        size_t len = (incoming->result > 0) ? (size_t)incoming->result : 0;
+        size_t need = SERVER_PREAUTH_MIN(ctx->env);
+        size_t tcp_mss;
 
         ASSERT(incoming == tunnel->incoming);
 
@@ -516,25 +1931,68 @@ static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *incomi
             break;
         }
 
+        if (ctx->init_pkg || len < need) {
+            // Too short to be any first packet: kept raw, the cipher, obfs
+            // and protocol aren't made for it until the rest is here.
+            if (ctx->init_pkg == NULL) {
+                ctx->init_pkg = buffer_create(SSR_BUFF_SIZE);
+            }
+            buffer_concatenate(ctx->init_pkg, data, len);
+            if (ctx->init_pkg->len < need) {
+                socket_read(incoming, true);
+                break;
+            }
+            data = ctx->init_pkg->buffer;
+            len = ctx->init_pkg->len;
+        }
+
+        tcp_mss = tcp_mss_cached(&((struct ssr_server_state *)ctx->env->data)->mss_cache, incoming);
         ASSERT(ctx->cipher == NULL);
         ctx->cipher = tunnel_cipher_create(ctx->env, tcp_mss);
+        ctx->cipher->trace = tunnel->trace;
+        ctx->cipher->trace_id = tunnel->trace_id;
         ctx->_tcp_mss = tcp_mss;
 
-        result = tunnel_cipher_server_decrypt(ctx->cipher, buf, &receipt, &confirm);
+        {
+            BUFFER_CONSTANT_INSTANCE(buf, data, len);
+            result = tunnel_cipher_server_decrypt(ctx->cipher, buf, &receipt, &confirm);
+        }
 
-        if (receipt) {
+        if (result == NULL) {
+            server_handshake_failed(tunnel, ctx->cipher->precheck_failed ? tunnel_handshake_precheck : tunnel_handshake_decode);
+            break;
+        }
+
+        // Over the raw reads kept, if any.
+        if (ctx->init_pkg == NULL) {
+            ctx->init_pkg = buffer_create(SSR_BUFF_SIZE);
+        }
+        buffer_replace(ctx->init_pkg, result);
+
+        if (receipt && result->len == 0) {
             ASSERT(confirm == NULL);
-            socket_write(incoming, receipt->buffer, receipt->len);
+            socket_write_buffer(incoming, receipt);
+            receipt = NULL;
             ctx->stage = tunnel_stage_receipt_done;
             break;
         }
 
-        ASSERT(result /* && result->len!=0 */);
-        buffer_replace(ctx->init_pkg, result);
+        if (receipt) {
+            // The data came along with the handshake (tls1.2_ticket_fastauth
+            // resuming with a ticket), answer it and parse what is here.
+            if (confirm) {
+                buffer_concatenate2(receipt, confirm);
+            }
+            socket_write_buffer(incoming, receipt);
+            receipt = NULL;
+            ctx->stage = tunnel_stage_confirm_done;
+            break;
+        }
 
         if (confirm) {
             ASSERT(receipt == NULL);
-            socket_write(incoming, confirm->buffer, confirm->len);
+            socket_write_buffer(incoming, confirm);
+            confirm = NULL;
             ctx->stage = tunnel_stage_confirm_done;
             break;
         }
@@ -548,6 +2006,12 @@ static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *incomi
     buffer_release(result);
 }
 
+/*
+ * The first packet is checked in one pass: the framing is skipped by
+ * offset, and the SOCKS5 address, its type and its length, is parsed
+ * into desired_addr once for do_parse(). The payload is moved to the
+ * front of init_pkg only there, in one go.
+ */
 static void do_prepare_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
     struct buffer_t *init_pkg = ctx->init_pkg;
@@ -555,29 +2019,36 @@ static void do_prepare_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socke
         struct server_info_t *info;
         struct obfs_t *protocol = NULL;
         struct obfs_t *obfs = NULL;
+        const uint8_t *header;
+        size_t header_len;
 
         protocol = ctx->cipher->protocol;
         obfs = ctx->cipher->obfs;
 
-        pre_parse_header(init_pkg);
+        ctx->_header_offset = pre_parse_header(init_pkg);
+        header = init_pkg->buffer + ctx->_header_offset;
+        header_len = init_pkg->len - ctx->_header_offset;
 
         info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
         if (info) {
-            info->head_len = (int) get_s5_head_size(init_pkg->buffer, init_pkg->len, 30);
+            info->head_len = (int) get_s5_head_size(header, header_len, 30);
             ctx->_overhead = info->overhead;
-            ctx->_recv_buffer_size = info->buffer_size;
         }
-        ctx->_recv_d_max_size = TCP_BUF_SIZE_MAX;
 
-        if (is_legal_header(init_pkg) == false) {
+        memset(tunnel->desired_addr, 0, sizeof(*tunnel->desired_addr));
+        if (socks5_address_parse(header, header_len, tunnel->desired_addr) == false) {
             // report_addr(server->fd, MALFORMED);
+            ctx->env->tunnel_stats->handshake_failures[tunnel_handshake_header]++;
             tunnel_shutdown(tunnel);
             break;
         }
 
-        if (is_header_complete(init_pkg) == false) {
-            tunnel_shutdown(tunnel);
-            break;
+        if (protocol && protocol->get_user) {
+            // Looked up once here, the streaming path only follows the pointer.
+            ctx->user = protocol->get_user(protocol);
+            if (ctx->user && tunnel_charge_user(tunnel, 0) == false) {
+                break;
+            }
         }
 
         do_parse(tunnel, socket);
@@ -602,14 +2073,15 @@ static void do_client_feedback(struct tunnel_ctx *tunnel, struct socket_ctx *inc
         result = tunnel_cipher_server_decrypt(ctx->cipher, buf, &receipt, &confirm);
         ASSERT(receipt == NULL);
         if (result==NULL || result->len==0) {
-            tunnel_shutdown(tunnel);
+            server_handshake_failed(tunnel, ctx->cipher->precheck_failed ? tunnel_handshake_precheck : tunnel_handshake_decode);
             break;
         }
 
         buffer_concatenate2(ctx->init_pkg, result);
 
         if (confirm) {
-            socket_write(incoming, confirm->buffer, confirm->len);
+            socket_write_buffer(incoming, confirm);
+            confirm = NULL;
             ctx->stage = tunnel_stage_confirm_done;
             break;
         }
@@ -658,48 +2130,81 @@ static void do_parse(struct tunnel_ctx *tunnel, struct socket_ctx *incoming) {
 
     ASSERT(incoming == tunnel->incoming);
 
-    // get remote addr and port
+    // Parsed by do_prepare_parse().
     s5addr = tunnel->desired_addr;
-    memset(s5addr, 0, sizeof(*s5addr));
-    if (socks5_address_parse(init_pkg->buffer, init_pkg->len, s5addr) == false) {
-        // report_addr(server->fd, MALFORMED);
-        tunnel_shutdown(tunnel);
-        return;
+
+    tunnel_mark_phase(tunnel, tunnel_phase_handshake);
+    if (ctx->admission.handshaking) {
+        admission_tunnel_authenticated(((struct ssr_server_state *)ctx->env->data)->admission, &ctx->admission);
     }
 
-    offset = socks5_address_size(s5addr);
+    offset = ctx->_header_offset + socks5_address_size(s5addr);
     buffer_shorten(init_pkg, offset, init_pkg->len - offset);
 
     host = s5addr->addr.domainname;
 
-    if (socks5_address_to_universal(s5addr, &target) == false) {
-        ASSERT(s5addr->addr_type == SOCKS5_ADDRTYPE_DOMAINNAME);
+    if (s5addr->addr_type == SOCKS5_ADDRTYPE_DOMAINNAME && strcmp(host, MUX_SESSION_HOST) == 0) {
+        do_mux_session_start(tunnel, incoming);
+        return;
+    }
 
-        if (uv_ip4_addr(host, s5addr->port, &target.addr4) != 0) {
-            if (uv_ip6_addr(host, s5addr->port, &target.addr6) != 0) {
-                ipFound = false;
-            }
+    if (ctx->env->config->acl) {
+        char name[0x0100 + 1] = { 0 };
+        if (outbound_block_match_host(socks5_address_to_string(s5addr, name, sizeof(name))) == 1) {
+            pr_warn("outbound blocked %s", name);
+            tunnel_shutdown(tunnel);
+            return;
         }
     }
 
-    if (ipFound == false) {
-        struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
-        struct address_timestamp **addr = NULL;
-        addr = (struct address_timestamp **)obj_map_find(state->resolved_ips, &host);
-        if (addr && *addr) {
-            target = (*addr)->address;
-            target.addr4.sin_port = htons(s5addr->port);
+    if (socks5_address_to_universal(s5addr, &target) == false) {
+        ASSERT(s5addr->addr_type == SOCKS5_ADDRTYPE_DOMAINNAME);
+
+        // An address in the name field. Only a name that could be one is tried.
+        ipFound = false;
+        if (host[0] >= '0' && host[0] <= '9' && uv_ip4_addr(host, s5addr->port, &target.addr4) == 0) {
             ipFound = true;
+        } else if (strchr(host, ':') && uv_ip6_addr(host, s5addr->port, &target.addr6) == 0) {
+            ipFound = true;
+        }
+        if (ipFound == false && !validate_hostname(host, strlen(host))) {
+            // report_addr(server->fd, MALFORMED);
+            tunnel_shutdown(tunnel);
+            return;
         }
     }
 
+    if (ctx->env->config->upstream_proxy) {
+        // The egress proxy resolves the name, and is the one to connect.
+        do_connect_host_start(tunnel, outgoing);
+        return;
+    }
+
     if (ipFound == false) {
-        if (!validate_hostname(host, strlen(host))) {
-            // report_addr(server->fd, MALFORMED);
+        struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+        union sockaddr_universal addrs[DNS_CACHE_MAX_ADDRS];
+        int found = dns_cache_lookup(state->dns_cache, host, addrs, DNS_CACHE_MAX_ADDRS);
+        if (state->dns_cache) {
+            tunnel_stats_count_dns_cache(ctx->env->tunnel_stats, found);
+        }
+        if (found < 0) {
             tunnel_shutdown(tunnel);
             return;
         }
+        if (found > 0) {
+            int index;
+            for (index = 0; index < found; ++index) {
+                universal_address_set_port(&addrs[index], s5addr->port);
+            }
+            socket_set_candidates(outgoing, addrs, (size_t)found);
+            do_connect_host_start(tunnel, outgoing);
+            return;
+        }
+    }
+
+    if (ipFound == false) {
         ctx->stage = tunnel_stage_resolve_host;
+        tunnel->stage_timeout = ctx->env->config->connect_timeout;
         outgoing->addr.addr4.sin_port = htons(s5addr->port);
         socket_getaddrinfo(outgoing, host);
     } else {
@@ -712,8 +2217,6 @@ static void do_resolve_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *s
     struct socket_ctx *incoming;
     struct socket_ctx *outgoing;
 
-    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
-
     incoming = tunnel->incoming;
     outgoing = tunnel->outgoing;
     ASSERT(outgoing == socket);
@@ -727,19 +2230,6 @@ static void do_resolve_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *s
         return;
     }
 
-    {
-        char *host = tunnel->desired_addr->addr.domainname;
-        struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
-        if (obj_map_exists(state->resolved_ips, &host) == false) {
-            struct address_timestamp *addr = NULL;
-            addr = (struct address_timestamp *)calloc(1, sizeof(struct address_timestamp));
-            addr->address = outgoing->addr;
-            addr->timestamp = time(NULL);
-            host = strdup(host);
-            obj_map_add(state->resolved_ips, &host, sizeof(void *), &addr, sizeof(void *));
-        }
-    }
-
     do_connect_host_start(tunnel, socket);
 }
 
@@ -756,7 +2246,25 @@ static void do_connect_host_start(struct tunnel_ctx *tunnel, struct socket_ctx *
     ASSERT(outgoing->rdstate == socket_stop);
     ASSERT(outgoing->wrstate == socket_stop);
 
+    tunnel_mark_phase(tunnel, tunnel_phase_resolve);
+
+    if (ctx->env->config->upstream_proxy) {
+        do_upstream_connect(tunnel);
+        return;
+    }
+
+    if (ctx->env->config->acl) {
+        // A name passed do_parse(), the address it resolved to may still be listed.
+        char ip[INET6_ADDRSTRLEN + 1] = { 0 };
+        if (outbound_block_match_host(universal_address_to_string(&outgoing->addr, ip, sizeof(ip))) == 1) {
+            pr_warn("outbound blocked %s", ip);
+            tunnel_shutdown(tunnel);
+            return;
+        }
+    }
+
     ctx->stage = tunnel_stage_connect_host;
+    tunnel->stage_timeout = ctx->env->config->connect_timeout;
     err = socket_connect(outgoing);
 
     if (err != 0) {
@@ -783,6 +2291,13 @@ static void do_connect_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *s
 
     if (outgoing->result == 0) {
         struct buffer_t *init_pkg = ctx->init_pkg;
+        tunnel_mark_phase(tunnel, tunnel_phase_connect);
+        tunnel->stage_timeout = 0;
+        tunnel_deadline_stop(tunnel);
+        if (ctx->env->config->upstream_proxy) {
+            do_upstream_request(tunnel);
+            return;
+        }
         if (init_pkg->len > 0) {
             socket_write(outgoing, init_pkg->buffer, init_pkg->len);
             ctx->stage = tunnel_stage_launch_streaming;
@@ -798,6 +2313,121 @@ static void do_connect_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *s
     }
 }
 
+/* To the egress proxy, over a connection of its pool when there's one. */
+static void do_upstream_connect(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    int err;
+
+    if (state->upstream == NULL) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    ctx->stage = tunnel_stage_connect_host;
+    tunnel->stage_timeout = ctx->env->config->connect_timeout;
+    outgoing->addr = *upstream_proxy_address(state->upstream);
+    if (upstream_proxy_take(state->upstream, &outgoing->handle.tcp)) {
+        ctx->upstream_greeted = true;
+        outgoing->result = 0;
+        do_connect_host_done(tunnel, outgoing);
+        return;
+    }
+    err = socket_connect(outgoing);
+    if (err != 0) {
+        pr_err("connect error: %s", uv_strerror(err));
+        tunnel_shutdown(tunnel);
+    }
+}
+
+/* The request and the first payload in one write, the proxy passes the payload on once it's connected. */
+static void do_upstream_request(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    uint8_t request[UPSTREAM_PROXY_HTTP_MAX];
+    struct buffer_t *buf;
+    size_t len = 0;
+
+    if (state->upstream) {
+        len = upstream_proxy_request(state->upstream, ctx->upstream_greeted, tunnel->desired_addr,
+            request, sizeof(request), &ctx->upstream);
+    }
+    if (len == 0) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    buf = buffer_create(len + ctx->init_pkg->len);
+    buffer_store(buf, request, len);
+    buffer_concatenate2(buf, ctx->init_pkg);
+    ctx->stage = tunnel_stage_upstream_reply;
+    socket_write_buffer(outgoing, buf);
+    socket_read(outgoing, true);
+}
+
+/*
+ * The request written and the replies read, in either order. Bytes of the
+ * destination that came with the last reply go to the client first, the
+ * outgoing reads start once they're written.
+ */
+static void do_upstream_reply(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+
+    if (socket == incoming) {
+        ASSERT(incoming->wrstate == socket_done);
+        incoming->wrstate = socket_stop;
+    } else if (outgoing->wrstate == socket_done) {
+        outgoing->wrstate = socket_stop;
+        if (outgoing->result < 0) {
+            pr_err("write error: %s", uv_strerror((int)outgoing->result));
+            tunnel_shutdown(tunnel);
+            return;
+        }
+    } else {
+        size_t used = 0, rest;
+        int r;
+
+        ASSERT(outgoing->rdstate == socket_done);
+        outgoing->rdstate = socket_stop;
+        r = upstream_reply_feed(&ctx->upstream, (const uint8_t *)outgoing->buf->base, (size_t)outgoing->result, &used);
+        if (r < 0) {
+            char name[0x0100 + 1] = { 0 };
+            pr_warn("upstream proxy refused %s", socks5_address_to_string(tunnel->desired_addr, name, sizeof(name)));
+            tunnel_shutdown(tunnel);
+            return;
+        }
+        if (r == 0) {
+            socket_read(outgoing, true);
+            return;
+        }
+        rest = (size_t)outgoing->result - used;
+        if (rest > 0) {
+            struct buffer_t *buf;
+            memmove(outgoing->buf->base, outgoing->buf->base + used, rest);
+            outgoing->result = (ssize_t)rest;
+            if ((buf = tunnel_extract_data(outgoing)) == NULL) {
+                tunnel_shutdown(tunnel);
+                return;
+            }
+            socket_write_buffer(incoming, buf);
+        }
+    }
+
+    if (upstream_reply_done(&ctx->upstream) == false || outgoing->wrstate != socket_stop) {
+        return;
+    }
+    if (incoming->wrstate == socket_busy) {
+        // The destination's first bytes are on their way, tunnel_streaming() reads on when they're out.
+        ctx->stage = tunnel_stage_streaming;
+        socket_read(incoming, false);
+        return;
+    }
+    outgoing->wrstate = socket_done;
+    do_launch_streaming(tunnel, outgoing);
+}
+
 static void do_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
     struct socket_ctx *incoming;
@@ -819,23 +2449,127 @@ static void do_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *so
         return;
     }
 
+    ctx->stage = tunnel_stage_streaming;
+    // Nothing to decrypt or encrypt, so the kernel can move the bytes itself,
+    // only without a rate limit, the kernel wouldn't keep it.
+    if (pipeline_is_identity(ctx->env->config) && tunnel->rate_limited == false) {
+        struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+        if (tunnel_sockmap_streaming(tunnel, state->sockmap) || tunnel_splice_streaming(tunnel)) {
+            return;
+        }
+    }
     socket_read(incoming, false);
     socket_read(outgoing, true);
-    ctx->stage = tunnel_stage_streaming;
 }
 
-static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size) {
+static bool tunnel_mux_send(void *p, const struct buffer_t *frames) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)p;
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+    struct buffer_t *out;
+    size_t offset = 0;
+
+    if (tunnel->terminated) {
+        return true;  /* Dropped with the tunnel. */
+    }
+    if (incoming->wrstate != socket_stop) {
+        return false;  /* do_mux_streaming() flushes once the write is done. */
+    }
+    out = buffer_create(frames->len + SSR_BUFF_SIZE);
+    while (offset < frames->len) {
+        size_t chunk = frames->len - offset;
+        struct buffer_t *piece;
+        if (chunk > TCP_BUF_SIZE_MAX) {
+            chunk = TCP_BUF_SIZE_MAX;
+        }
+        {
+            BUFFER_CONSTANT_INSTANCE(src, frames->buffer + offset, chunk);
+            piece = tunnel_cipher_server_encrypt(ctx->cipher, src);
+        }
+        if (piece) {
+            buffer_concatenate2(out, piece);
+            buffer_release(piece);
+        }
+        offset += chunk;
+    }
+    socket_write_buffer(incoming, out);
+    return true;
+}
+
+static void tunnel_mux_accept(void *p, struct mux_stream *stream, const uint8_t *target, size_t size) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)p;
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+
+    mux_srv_stream_accept(state->loop, ctx->env, state->dns_cache, stream, target, size);
+}
+
+static const struct mux_session_callbacks mux_callbacks = {
+    &tunnel_mux_send,
+    &tunnel_mux_accept,
+};
+
+static void do_mux_session_start(struct tunnel_ctx *tunnel, struct socket_ctx *incoming) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct buffer_t *init_pkg = ctx->init_pkg;
+
+    ASSERT(incoming->rdstate == socket_stop);
+    ASSERT(incoming->wrstate == socket_stop);
+
+    tunnel_mark_phase(tunnel, tunnel_phase_connect);
+    tunnel->stage_timeout = 0;
+    tunnel_deadline_stop(tunnel);
+    ctx->mux = mux_session_create(false, &mux_callbacks, tunnel);
+    ctx->stage = tunnel_stage_mux;
+    if (init_pkg->len > 0 && mux_session_feed(ctx->mux, init_pkg->buffer, init_pkg->len) == false) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    // The session lives as long as the client keeps it, no idle timeout.
+    socket_read(incoming, false);
+}
+
+static void do_mux_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+    struct buffer_t *buf;
+    bool ok;
+
+    ASSERT(incoming == socket);
+    if (incoming->wrstate == socket_done) {
+        incoming->wrstate = socket_stop;
+        if (incoming->result < 0) {
+            tunnel_shutdown(tunnel);
+            return;
+        }
+        mux_session_flush(ctx->mux);
+        return;
+    }
+
+    ASSERT(incoming->rdstate == socket_done);
+    incoming->rdstate = socket_stop;
+    buf = tunnel_extract_data(incoming);
+    if (buf == NULL) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    ok = (buf->len == 0) || mux_session_feed(ctx->mux, buf->buffer, buf->len);
+    buffer_release(buf);
+    if (ok == false) {
+        pr_err("mux session: malformed frame");
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    if (tunnel->terminated == false) {
+        socket_read(incoming, false);
+    }
+}
+
+static struct buffer_t * tunnel_extract_data(struct socket_ctx *socket) {
     struct tunnel_ctx *tunnel = socket->tunnel;
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
     struct tunnel_cipher_ctx *cipher_ctx = ctx->cipher;
-    enum ssr_error error = ssr_error_client_decode;
     struct buffer_t *buf = NULL;
-    uint8_t *result = NULL;
-
-    if (socket==NULL || allocator==NULL || size==NULL) {
-        return result;
-    }
-    *size = 0;
 
     {
         BUFFER_CONSTANT_INSTANCE(src, socket->buf->base, socket->result);
@@ -852,31 +2586,74 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
         }
     }
 
-    if (buf) {
-        size_t len = buf->len;
-        *size = len;
-        result = (uint8_t *)allocator(len + 1);
-        memcpy(result, buf->buffer, len);
+    return buf;
+}
 
-        buffer_release(buf);
-    }
+static struct buffer_segments * tunnel_extract_segments(struct socket_ctx *socket) {
+    struct tunnel_ctx *tunnel = socket->tunnel;
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    BUFFER_CONSTANT_INSTANCE(src, socket->buf->base, socket->result);
+    // The target's data only, its obfs framing headers go out as separate segments in front of the payload.
+    ASSERT(socket == tunnel->outgoing);
+    return tunnel_cipher_server_encrypt_segments(ctx->cipher, src);
+}
 
-    return result;
+static void server_crypt_work_cb(struct crypto_offload_job *job) {
+    struct server_crypt_job *crypt = CONTAINER_OF(job, struct server_crypt_job, job);
+    crypt->begin = uv_hrtime();
+    crypt->out = tunnel_cipher_server_crypt_offloaded(crypt->cipher, crypt->data, crypt->encrypt);
+    crypt->end = uv_hrtime();
 }
 
-static int resolved_ips_compare_key(const void *left, const void *right) {
-    char *l = *(char **)left;
-    char *r = *(char **)right;
-    return strcmp(l, r);
+static void server_crypt_done_cb(struct crypto_offload_job *job) {
+    struct server_crypt_job *crypt = CONTAINER_OF(job, struct server_crypt_job, job);
+    struct tunnel_ctx *tunnel = crypt->tunnel;
+    if (tunnel->trace) {
+        tunnel_trace_span(tunnel->trace, tunnel->trace_id, crypt->encrypt ? "server_encrypt offloaded" : "server_decrypt offloaded",
+            crypt->begin, crypt->end, crypt->data->len);
+    }
+    buffer_release(crypt->data);
+    tunnel_offload_done(tunnel, crypt->socket, crypt->out);
+    free(crypt);
 }
 
-static void resolved_ips_destroy_object(void *obj) {
-    if (obj) {
-        void *str = *((void **)obj);
-        if (str) {
-            free(str);
-        }
+/*
+ * Hands a bulk read to the loop's crypto workers. Only a tunnel without
+ * protocol and obfs plugins qualifies, those keep state both directions
+ * share, and only once both IVs went through, the first decrypt checks the
+ * loop's replay filter. After one read of a socket is out, its later ones
+ * follow it whatever their size, so the other end gets them in order.
+ */
+static bool tunnel_extract_offload(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct crypto_offload *co = ctx->env->crypto_offload;
+    struct server_crypt_job *crypt;
+    int direction = (socket == tunnel->outgoing) ? 1 : 0;
+
+    if (co == NULL || ctx->stage != tunnel_stage_streaming || ctx->cipher == NULL) {
+        return false;
+    }
+    if (socket->offloaded == 0 &&
+        ((size_t)socket->result < CRYPTO_OFFLOAD_MIN_BYTES || tunnel_cipher_server_offloadable(ctx->cipher) == false))
+    {
+        return false;
+    }
+    if (ctx->crypto_lanes_set == false) {
+        ctx->crypto_lanes[0] = crypto_offload_lane(co);
+        ctx->crypto_lanes[1] = crypto_offload_lane(co);
+        ctx->crypto_lanes_set = true;
     }
+    crypt = (struct server_crypt_job *) calloc(1, sizeof(*crypt));
+    crypt->job.work_cb = &server_crypt_work_cb;
+    crypt->job.done_cb = &server_crypt_done_cb;
+    crypt->tunnel = tunnel;
+    crypt->socket = socket;
+    crypt->cipher = ctx->cipher;
+    crypt->encrypt = (direction == 1);
+    // The read buffer is reused as soon as this returns.
+    crypt->data = buffer_create_from((const uint8_t *)socket->buf->base, (size_t)socket->result);
+    crypto_offload_submit(co, ctx->crypto_lanes[direction], &crypt->job);
+    return true;
 }
 
 void print_server_info(const struct server_config *config) {
@@ -892,7 +2669,94 @@ void print_server_info(const struct server_config *config) {
     if (config->obfs_param && strlen(config->obfs_param)) {
         pr_info("obfs_param       %s", config->obfs_param);
     }
-    pr_info("udp relay        %s\n", config->udp ? "yes" : "no");
+    if (config->workers > 1) {
+        pr_info("workers          %u", config->workers);
+    }
+    if (config->crypto_workers > 0) {
+        pr_info("crypto workers   %u per loop, reads of %u bytes and up", config->crypto_workers, (unsigned int)CRYPTO_OFFLOAD_MIN_BYTES);
+    }
+    if (ssr_user_table_count(config->users) > 0) {
+        pr_info("users            %zu", ssr_user_table_count(config->users));
+    }
+    if (config->users_file) {
+        pr_info("users file       %s", config->users_file);
+    }
+    if (config->fast_open) {
+        pr_info("TCP fast open    yes");
+    }
+    if (config->mptcp) {
+        pr_info("Multipath TCP    yes");
+    }
+    if (strcmp(ssr_alloc_backend(), "system") != 0) {
+        pr_info("allocator        %s", ssr_alloc_backend());
+    }
+    if (config->numa || config->hugepages) {
+        pr_info("buffer memory    %s%s%s", config->numa ? "NUMA local" : "",
+            (config->numa && config->hugepages) ? ", " : "", config->hugepages ? "hugepages" : "");
+    }
+    if (config->egress_addresses) {
+        pr_info("egress           %s, %s", config->egress_addresses,
+            config->egress_policy == egress_policy_hash ? "hash" : "round robin");
+    }
+    if (config->upstream_proxy) {
+        // Not the login.
+        const char *at = strrchr(config->upstream_proxy, '@');
+        pr_info("upstream proxy   %s%s, %d idle per worker", at ? "..." : config->upstream_proxy, at ? at : "",
+            config->upstream_proxy_idle);
+    }
+    if (config->kcp_port) {
+        pr_info("KCP port         %hu, window %u, FEC %u+%u", config->kcp_port, config->kcp_window,
+            config->kcp_fec_parity ? config->kcp_fec_data : 0, config->kcp_fec_parity);
+    }
+    if (config->over_tls_listen_port) {
+        pr_info("over TLS port    %hu, path %s", config->over_tls_listen_port, config->over_tls_path ? config->over_tls_path : "/");
+        pr_info("TLS fallback     %s", config->over_tls_fallback ? config->over_tls_fallback : "none, 404");
+    }
+    if (config->sockmap_relay) {
+        pr_info("sockmap relay    yes");
+    }
+    if (config->admission_max_tunnels || config->admission_max_handshakes) {
+        pr_info("admission        tunnels %u, handshakes %u per worker",
+            config->admission_max_tunnels, config->admission_max_handshakes);
+    }
+    if (config->memory_budget) {
+        pr_info("memory budget    %zu MiB, idle tunnels closed sooner past half of it", config->memory_budget / (1024 * 1024));
+    }
+    if (config->upgrade_socket) {
+        pr_info("upgrade socket   %s", config->upgrade_socket);
+    }
+    if (config->loop_stall_ms) {
+        pr_info("loop stalls      reported over %u ms", config->loop_stall_ms);
+    }
+    if (config->workers > 1 && config->worker_balance_lag_ms) {
+        pr_info("worker balance   new connections moved off a loop late by %u ms", config->worker_balance_lag_ms);
+    }
+    if (config->rate_limit_global || config->rate_limit_port || config->rate_limit_tunnel || config->rate_limit_over_quota) {
+        pr_info("rate limit       global %zu, port %zu, tunnel %zu, over quota %zu bytes/s",
+            config->rate_limit_global, config->rate_limit_port, config->rate_limit_tunnel, config->rate_limit_over_quota);
+    }
+    if (socket_tuning_is_default(&config->socket) == false) {
+        const struct socket_tuning *t = &config->socket;
+        pr_info("socket options   busy_poll %d, nodelay %d, notsent_lowat %d, sndbuf %d, rcvbuf %d, congestion %s, incoming_cpu %s, defer_accept %d",
+            t->busy_poll, t->nodelay, t->notsent_lowat, t->sndbuf, t->rcvbuf,
+            t->congestion[0] ? t->congestion : "default", t->incoming_cpu ? "yes" : "no", t->defer_accept);
+        if (t->keepalive_idle > 0 || t->user_timeout > 0) {
+            pr_info("dead peers       keepalive %d s, interval %d s, count %d, user timeout %d ms",
+                t->keepalive_idle, t->keepalive_interval, t->keepalive_count, t->user_timeout);
+        }
+    }
+    pr_info("timeouts         handshake %u, connect %u, linger %u, idle %u s",
+        config->handshake_timeout / MILLISECONDS_PER_SECOND, config->connect_timeout / MILLISECONDS_PER_SECOND,
+        config->linger_timeout / MILLISECONDS_PER_SECOND, config->idle_timeout / MILLISECONDS_PER_SECOND);
+    pr_info("handshake limit  %u s in all, %zu bytes/s at the least",
+        config->handshake_deadline / MILLISECONDS_PER_SECOND, config->handshake_min_rate);
+    pr_info("udp relay        %s", config->udp ? "yes" : "no");
+    {
+        char features[64];
+        pr_info("cpu features     %s", cpu_features_describe(features, sizeof(features)));
+        pr_info("crypto kernels   aes %s, sha1 %s, crc32 %s, adler32 %s\n",
+            ss_crypto_aes_kernel(), ss_crypto_sha1_kernel(), crc32_kernel_name(), adler32_kernel_name());
+    }
 }
 
 static void usage(void) {
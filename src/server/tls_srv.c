@@ -0,0 +1,958 @@
+#include <mbedtls/config.h>
+#include <mbedtls/platform.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/sha1.h>
+#include <mbedtls/error.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "tls_srv.h"
+#include "common.h"
+#include "dump_info.h"
+#include "ssr_executive.h"
+#include "ssrbuffer.h"
+#include "buffer_pool.h"
+#include "sockaddr_universal.h"
+#include "base64.h"
+
+#ifndef SSR_MAX_CONN
+#define SSR_MAX_CONN 1024
+#endif
+
+#define HTTP_HEADER_END "\r\n\r\n"
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_FRAME_PAYLOAD_MAX 0x1000000
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+#define WS_RESPONSE_FORMAT ""                                                               \
+    "HTTP/1.1 101 Switching Protocols\r\n"                                                  \
+    "Upgrade: websocket\r\n"                                                                \
+    "Connection: Upgrade\r\n"                                                               \
+    "Sec-WebSocket-Accept: %s\r\n"                                                          \
+    "\r\n"                                                                                  \
+
+/* The body runs until the connection ends, tls_cli.c reads it as one stream. */
+#define POST_RESPONSE ""                                                                    \
+    "HTTP/1.1 200 OK\r\n"                                                                   \
+    "Content-Type: application/octet-stream\r\n"                                            \
+    "Cache-Control: no-store\r\n"                                                           \
+    "Connection: close\r\n"                                                                 \
+    "\r\n"                                                                                  \
+
+#define NOT_FOUND_RESPONSE ""                                                               \
+    "HTTP/1.1 404 Not Found\r\n"                                                            \
+    "Content-Type: text/html\r\n"                                                           \
+    "Content-Length: 0\r\n"                                                                 \
+    "Connection: close\r\n"                                                                 \
+    "\r\n"                                                                                  \
+
+enum tls_srv_mode {
+    tls_srv_request,  /* Handshake, then the first request. */
+    tls_srv_websocket,  /* Frames both ways after the 101. */
+    tls_srv_post,  /* A POST per client write, the answer one body. */
+    tls_srv_fallback,  /* Bytes as they are, both ways. */
+    tls_srv_refused,  /* Answered, closing once that is out. */
+};
+
+struct tls_srv_conn;
+
+struct tls_srv {
+    uv_loop_t *loop;
+    const struct server_config *config;
+    const char *path;  /* over_tls_path, "/" without one. */
+    struct buffer_pool *buffer_pool;
+    uv_tcp_t *listener;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_x509_crt cert;
+    mbedtls_pk_context key;
+    mbedtls_ssl_config conf;
+    union sockaddr_universal ssr_listener;
+    union sockaddr_universal fallback;
+    bool has_fallback;
+    uint8_t plain[MBEDTLS_SSL_MAX_CONTENT_LEN];  /* Scratch, of one record. */
+    struct buffer_t *tx;  /* Scratch for frames to the clients. */
+    struct tls_srv_conn *conns;
+};
+
+struct tls_srv_conn {
+    struct tls_srv *srv;
+    uv_tcp_t incoming;
+    uv_tcp_t outgoing;
+    uv_timer_t timer;
+    uv_connect_t connect_req;
+    int handles;  /* Open of the three above. */
+    mbedtls_ssl_context ssl;
+    struct buffer_t *cipher_in;  /* Read from the client, */
+    size_t cipher_in_used;  /* this many of them taken by mbedTLS. */
+    struct buffer_t *cipher_out;  /* Records mbedTLS made, not written yet. */
+    struct buffer_t *rx;  /* Plain text not parsed yet. */
+    struct buffer_t *pending;  /* For |outgoing| before it's connected. */
+    enum tls_srv_mode mode;
+    bool handshaked;
+    bool connected;
+    size_t body_left;  /* Of the POST being read. */
+    size_t incoming_writing;  /* Bytes of the writes in flight. */
+    size_t outgoing_writing;
+    bool incoming_paused;  /* |outgoing| has too much in flight. */
+    bool outgoing_paused;
+    bool finishing;  /* Close once |incoming_writing| is out. */
+    bool closing;
+    struct tls_srv_conn *prev;
+    struct tls_srv_conn *next;
+};
+
+struct tls_srv_write {
+    uv_write_t req;
+    struct buffer_t *buf;
+    struct tls_srv_conn *conn;
+};
+
+static void conn_on_plain(struct tls_srv_conn *conn, const uint8_t *data, size_t size);
+static void incoming_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+static void incoming_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+static void outgoing_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+static void outgoing_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+static void conn_close_done_cb(uv_handle_t *handle) {
+    struct tls_srv_conn *conn = (struct tls_srv_conn *)handle->data;
+    if (--conn->handles > 0) {
+        return;
+    }
+    buffer_release(conn->cipher_in);
+    buffer_release(conn->cipher_out);
+    buffer_release(conn->rx);
+    buffer_release(conn->pending);
+    free(conn);
+}
+
+static void conn_close(struct tls_srv_conn *conn) {
+    struct tls_srv *srv = conn->srv;
+
+    if (conn->closing) {
+        return;
+    }
+    conn->closing = true;
+    // Nothing runs mbedTLS past this point, and tls_srv_shutdown() frees its config next.
+    mbedtls_ssl_free(&conn->ssl);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        srv->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    uv_close((uv_handle_t *)&conn->incoming, conn_close_done_cb);
+    uv_close((uv_handle_t *)&conn->outgoing, conn_close_done_cb);
+    uv_close((uv_handle_t *)&conn->timer, conn_close_done_cb);
+}
+
+static void incoming_write_done_cb(uv_write_t *req, int status) {
+    struct tls_srv_write *wr = CONTAINER_OF(req, struct tls_srv_write, req);
+    struct tls_srv_conn *conn = wr->conn;
+
+    conn->incoming_writing -= wr->buf->len;
+    buffer_release(wr->buf);
+    free(wr);
+    if (conn->closing) {
+        return;
+    }
+    if (status < 0 || (conn->finishing && conn->incoming_writing == 0)) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->outgoing_paused && conn->incoming_writing < TLS_SRV_WRITE_HIGH / 2) {
+        conn->outgoing_paused = false;
+        uv_read_start((uv_stream_t *)&conn->outgoing, outgoing_alloc_cb, outgoing_read_cb);
+    }
+}
+
+/* Writes out the records mbedTLS made so far. */
+static void conn_flush(struct tls_srv_conn *conn) {
+    struct tls_srv_write *wr;
+    uv_buf_t o;
+
+    if (conn->closing || conn->cipher_out->len == 0) {
+        return;
+    }
+    wr = (struct tls_srv_write *)calloc(1, sizeof(*wr));
+    wr->buf = conn->cipher_out;
+    wr->conn = conn;
+    conn->cipher_out = buffer_create(SSR_BUFF_SIZE);
+    o = uv_buf_init((char *)wr->buf->buffer, (unsigned int)wr->buf->len);
+    if (uv_write(&wr->req, (uv_stream_t *)&conn->incoming, &o, 1, incoming_write_done_cb) != 0) {
+        buffer_release(wr->buf);
+        free(wr);
+        conn_close(conn);
+        return;
+    }
+    conn->incoming_writing += wr->buf->len;
+    if (conn->connected && conn->outgoing_paused == false && conn->incoming_writing >= TLS_SRV_WRITE_HIGH) {
+        conn->outgoing_paused = true;
+        uv_read_stop((uv_stream_t *)&conn->outgoing);
+    }
+}
+
+/* Encrypts |data| into |cipher_out|, conn_flush() sends it. */
+static void conn_tls_write(struct tls_srv_conn *conn, const uint8_t *data, size_t size) {
+    while (conn->closing == false && size > 0) {
+        int ret = mbedtls_ssl_write(&conn->ssl, data, size);
+        if (ret < 0) {
+            // The BIO never blocks, see bio_send().
+            conn_close(conn);
+            return;
+        }
+        data += ret;
+        size -= (size_t)ret;
+    }
+}
+
+/* Closes once what's queued to the client is out. */
+static void conn_finish(struct tls_srv_conn *conn) {
+    if (conn->closing || conn->finishing) {
+        return;
+    }
+    if (conn->handshaked) {
+        mbedtls_ssl_close_notify(&conn->ssl);
+    }
+    conn_flush(conn);
+    conn->finishing = true;
+    if (conn->closing == false && conn->incoming_writing == 0) {
+        conn_close(conn);
+    }
+}
+
+static void outgoing_write_done_cb(uv_write_t *req, int status) {
+    struct tls_srv_write *wr = CONTAINER_OF(req, struct tls_srv_write, req);
+    struct tls_srv_conn *conn = wr->conn;
+
+    conn->outgoing_writing -= wr->buf->len;
+    buffer_release(wr->buf);
+    free(wr);
+    if (conn->closing) {
+        return;
+    }
+    if (status < 0) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->incoming_paused && conn->outgoing_writing < TLS_SRV_WRITE_HIGH / 2) {
+        conn->incoming_paused = false;
+        uv_read_start((uv_stream_t *)&conn->incoming, incoming_alloc_cb, incoming_read_cb);
+    }
+}
+
+/* Takes over |buf|. */
+static void outgoing_write(struct tls_srv_conn *conn, struct buffer_t *buf) {
+    struct tls_srv_write *wr = (struct tls_srv_write *)calloc(1, sizeof(*wr));
+    uv_buf_t o = uv_buf_init((char *)buf->buffer, (unsigned int)buf->len);
+
+    wr->buf = buf;
+    wr->conn = conn;
+    if (uv_write(&wr->req, (uv_stream_t *)&conn->outgoing, &o, 1, outgoing_write_done_cb) != 0) {
+        buffer_release(buf);
+        free(wr);
+        conn_close(conn);
+        return;
+    }
+    conn->outgoing_writing += buf->len;
+    if (conn->incoming_paused == false && conn->outgoing_writing >= TLS_SRV_WRITE_HIGH) {
+        conn->incoming_paused = true;
+        uv_read_stop((uv_stream_t *)&conn->incoming);
+    }
+}
+
+/* Plain text for the listener or the fallback, queued until it's connected. */
+static void conn_forward(struct tls_srv_conn *conn, const uint8_t *data, size_t size) {
+    if (conn->closing || size == 0) {
+        return;
+    }
+    if (conn->connected == false) {
+        if (conn->pending == NULL) {
+            conn->pending = buffer_create(size);
+        }
+        buffer_concatenate(conn->pending, data, size);
+        return;
+    }
+    outgoing_write(conn, buffer_create_from(data, size));
+}
+
+static void outgoing_connect_done_cb(uv_connect_t *req, int status) {
+    struct tls_srv_conn *conn = CONTAINER_OF(req, struct tls_srv_conn, connect_req);
+
+    if (conn->closing) {
+        return;
+    }
+    if (status < 0) {
+        pr_err("over TLS: connecting to the %s failed: %s",
+            conn->mode == tls_srv_fallback ? "fallback" : "listener", uv_strerror(status));
+        conn_close(conn);
+        return;
+    }
+    conn->connected = true;
+    if (conn->pending) {
+        struct buffer_t *pending = conn->pending;
+        conn->pending = NULL;
+        outgoing_write(conn, pending);
+    }
+    if (conn->closing == false) {
+        conn->outgoing_paused = conn->incoming_writing >= TLS_SRV_WRITE_HIGH;
+        if (conn->outgoing_paused == false) {
+            uv_read_start((uv_stream_t *)&conn->outgoing, outgoing_alloc_cb, outgoing_read_cb);
+        }
+    }
+}
+
+static void conn_connect(struct tls_srv_conn *conn, const union sockaddr_universal *addr) {
+    uv_timer_stop(&conn->timer);
+    if (uv_tcp_connect(&conn->connect_req, &conn->outgoing, &addr->addr, outgoing_connect_done_cb) != 0) {
+        conn_close(conn);
+    }
+}
+
+static void ws_send_frame(struct tls_srv_conn *conn, uint8_t opcode, const uint8_t *data, size_t size) {
+    struct buffer_t *tx = conn->srv->tx;
+    uint8_t header[10];
+    size_t header_len = 2, index;
+
+    header[0] = (uint8_t)(0x80 | opcode);  /* FIN */
+    if (size > 0xFFFF) {
+        header[1] = 127;
+        for (index = 0; index < 8; ++index) {
+            header[2 + index] = (uint8_t)((uint64_t)size >> (56 - 8 * index));
+        }
+        header_len += 8;
+    } else if (size >= 126) {
+        header[1] = 126;
+        header[2] = (uint8_t)(size >> 8);
+        header[3] = (uint8_t)size;
+        header_len += 2;
+    } else {
+        header[1] = (uint8_t)size;
+    }
+    // Server frames go unmasked. One record for header and payload.
+    buffer_store(tx, header, header_len);
+    buffer_concatenate(tx, data, size);
+    conn_tls_write(conn, tx->buffer, tx->len);
+    tx->len = 0;
+}
+
+/* |src| XOR the repeated |mask| into |dst|, the two may be the same. */
+static void ws_unmask(uint8_t *data, size_t size, const uint8_t *mask) {
+    uint8_t key8[8];
+    uint64_t key, word;
+    size_t index = 0;
+
+    memcpy(key8, mask, 4);
+    memcpy(key8 + 4, mask, 4);
+    memcpy(&key, key8, sizeof(key));
+    for (; index + sizeof(word) <= size; index += sizeof(word)) {
+        memcpy(&word, data + index, sizeof(word));
+        word ^= key;
+        memcpy(data + index, &word, sizeof(word));
+    }
+    for (; index < size; ++index) {
+        data[index] ^= mask[index & 3];
+    }
+}
+
+/* Forwards the complete frames at the head of |data|, returns the bytes they took. */
+static size_t ws_consume(struct tls_srv_conn *conn, uint8_t *data, size_t size) {
+    size_t used = 0;
+
+    while (conn->closing == false && conn->finishing == false && size - used >= 2) {
+        uint8_t *p = data + used;
+        size_t avail = size - used, header = 2, length = p[1] & 0x7F, index;
+        uint8_t opcode = p[0] & 0x0F;
+        uint8_t *payload;
+
+        if ((p[1] & 0x80) == 0) {
+            // RFC 6455 5.1, the server closes on an unmasked client frame.
+            conn_finish(conn);
+            break;
+        }
+        if (length == 126) {
+            if (avail < 4) {
+                break;
+            }
+            length = ((size_t)p[2] << 8) | p[3];
+            header = 4;
+        } else if (length == 127) {
+            uint64_t length64 = 0;
+            if (avail < 10) {
+                break;
+            }
+            for (index = 0; index < 8; ++index) {
+                length64 = (length64 << 8) | p[2 + index];
+            }
+            if (length64 > WS_FRAME_PAYLOAD_MAX) {
+                pr_err("over TLS frame of %llu bytes", (unsigned long long)length64);
+                conn_close(conn);
+                break;
+            }
+            length = (size_t)length64;
+            header = 10;
+        }
+        header += 4;
+        if (avail < header + length) {
+            break;
+        }
+        payload = p + header;
+        ws_unmask(payload, length, p + header - 4);
+        used += header + length;
+
+        switch (opcode) {
+        case WS_OP_CONTINUATION:
+        case WS_OP_TEXT:
+        case WS_OP_BINARY:
+            conn_forward(conn, payload, length);
+            break;
+        case WS_OP_CLOSE:
+            ws_send_frame(conn, WS_OP_CLOSE, NULL, 0);
+            conn_finish(conn);
+            break;
+        case WS_OP_PING:
+            ws_send_frame(conn, WS_OP_PONG, payload, length);
+            break;
+        default:
+            break;  /* Pong and reserved opcodes. */
+        }
+    }
+    return used;
+}
+
+static size_t http_header_size(const uint8_t *data, size_t size) {
+    size_t index, end_len = strlen(HTTP_HEADER_END);
+    for (index = 0; index + end_len <= size; ++index) {
+        if (memcmp(data + index, HTTP_HEADER_END, end_len) == 0) {
+            return index + end_len;
+        }
+    }
+    return 0;
+}
+
+/* The value of header |name| in the request head |head|, trimmed, NULL without it. */
+static const char * http_header_value(const char *head, size_t head_len, const char *name, size_t *value_len) {
+    const char *end = head + head_len;
+    size_t name_len = strlen(name);
+    const char *line = (const char *)memchr(head, '\n', head_len);
+
+    while (line && ++line < end) {
+        const char *eol = (const char *)memchr(line, '\n', (size_t)(end - line));
+        const char *value;
+        if (eol == NULL) {
+            break;
+        }
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            value = line + name_len + 1;
+            while (value < eol && (*value == ' ' || *value == '\t')) {
+                ++value;
+            }
+            while (eol > value && (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t')) {
+                --eol;
+            }
+            *value_len = (size_t)(eol - value);
+            return value;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+static bool http_value_has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token), index;
+    for (index = 0; value && index + token_len <= len; ++index) {
+        if (strncasecmp(value + index, token, token_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A POST of over_tls_path, with the length of its body. */
+static bool http_is_post(const struct tls_srv_conn *conn, const char *head, size_t head_len, size_t *body) {
+    const char *path = conn->srv->path;
+    size_t path_len = strlen(path), len = 0;
+    const char *value;
+    char number[24];
+
+    if (head_len < 6 + path_len || memcmp(head, "POST ", 5) != 0 || memcmp(head + 5, path, path_len) != 0 ||
+        (head[5 + path_len] != ' ' && head[5 + path_len] != '?'))
+    {
+        return false;
+    }
+    value = http_header_value(head, head_len, "Content-Length", &len);
+    if (value == NULL || len == 0 || len >= sizeof(number)) {
+        return false;
+    }
+    memcpy(number, value, len);
+    number[len] = '\0';
+    *body = (size_t)strtoul(number, NULL, 10);
+    return true;
+}
+
+/* Answers the upgrade of over_tls_path, false if it's not one. */
+static bool ws_accept(struct tls_srv_conn *conn, const char *head, size_t head_len) {
+    const char *path = conn->srv->path;
+    size_t path_len = strlen(path), len = 0;
+    const char *value, *key;
+    unsigned char digest[20];
+    unsigned char accept[32] = { 0 };
+    char material[64 + sizeof(WS_GUID)];
+    char response[sizeof(WS_RESPONSE_FORMAT) + sizeof(accept)];
+    int response_len;
+
+    if (head_len < 5 + path_len || memcmp(head, "GET ", 4) != 0 || memcmp(head + 4, path, path_len) != 0 ||
+        (head[4 + path_len] != ' ' && head[4 + path_len] != '?'))
+    {
+        return false;
+    }
+    value = http_header_value(head, head_len, "Upgrade", &len);
+    if (http_value_has_token(value, len, "websocket") == false) {
+        return false;
+    }
+    key = http_header_value(head, head_len, "Sec-WebSocket-Key", &len);
+    if (key == NULL || len == 0 || len > 64) {
+        return false;
+    }
+    memcpy(material, key, len);
+    memcpy(material + len, WS_GUID, strlen(WS_GUID));
+    mbedtls_sha1_ret((const unsigned char *)material, len + strlen(WS_GUID), digest);
+    std_base64_encode(digest, (int)sizeof(digest), accept);
+
+    response_len = mbedtls_snprintf(response, sizeof(response), WS_RESPONSE_FORMAT, (char *)accept);
+    conn_tls_write(conn, (const uint8_t *)response, (size_t)response_len);
+    return true;
+}
+
+/* Decides on the first request, once its head is in |rx|. */
+static void conn_on_request(struct tls_srv_conn *conn) {
+    struct tls_srv *srv = conn->srv;
+    struct buffer_t *rx = conn->rx;
+    size_t head = http_header_size(rx->buffer, rx->len);
+    size_t body = 0;
+
+    if (head == 0) {
+        if (rx->len > TLS_SRV_REQUEST_MAX) {
+            conn_close(conn);
+        }
+        return;
+    }
+    if (ws_accept(conn, (const char *)rx->buffer, head)) {
+        conn->mode = tls_srv_websocket;
+        buffer_shorten(rx, head, rx->len - head);
+        conn_connect(conn, &srv->ssr_listener);
+    } else if (http_is_post(conn, (const char *)rx->buffer, head, &body)) {
+        conn->mode = tls_srv_post;
+        conn->body_left = body;
+        buffer_shorten(rx, head, rx->len - head);
+        conn_tls_write(conn, (const uint8_t *)POST_RESPONSE, strlen(POST_RESPONSE));
+        conn_connect(conn, &srv->ssr_listener);
+    } else if (srv->has_fallback) {
+        // Everything from the request on, untouched.
+        conn->mode = tls_srv_fallback;
+        conn_connect(conn, &srv->fallback);
+        conn_forward(conn, rx->buffer, rx->len);
+        rx->len = 0;
+        return;
+    } else {
+        conn->mode = tls_srv_refused;
+        conn_tls_write(conn, (const uint8_t *)NOT_FOUND_RESPONSE, strlen(NOT_FOUND_RESPONSE));
+        conn_finish(conn);
+        return;
+    }
+    // What came after the head goes the way of the mode.
+    if (conn->closing == false && rx->len > 0) {
+        struct buffer_t *rest = rx;
+        conn->rx = buffer_create(0);
+        conn_on_plain(conn, rest->buffer, rest->len);
+        buffer_release(rest);
+    }
+}
+
+/* The bodies of the POSTs one after the other, the heads dropped. */
+static void post_on_data(struct tls_srv_conn *conn, const uint8_t *data, size_t size) {
+    struct buffer_t *rx = conn->rx;
+    size_t take = min(conn->body_left, size), head;
+
+    // Bodies straight through, only heads are gathered.
+    conn_forward(conn, data, take);
+    conn->body_left -= take;
+    if (take == size) {
+        return;
+    }
+    buffer_concatenate(rx, data + take, size - take);
+    while (conn->closing == false && conn->finishing == false && conn->body_left == 0 && rx->len > 0) {
+        head = http_header_size(rx->buffer, rx->len);
+        if (head == 0) {
+            if (rx->len > TLS_SRV_REQUEST_MAX) {
+                conn_close(conn);
+            }
+            return;
+        }
+        if (http_is_post(conn, (const char *)rx->buffer, head, &conn->body_left) == false) {
+            conn_finish(conn);
+            return;
+        }
+        take = min(conn->body_left, rx->len - head);
+        conn_forward(conn, rx->buffer + head, take);
+        conn->body_left -= take;
+        buffer_shorten(rx, head + take, rx->len - head - take);
+    }
+}
+
+static void conn_on_plain(struct tls_srv_conn *conn, const uint8_t *data, size_t size) {
+    struct buffer_t *rx = conn->rx;
+    size_t used;
+
+    switch (conn->mode) {
+    case tls_srv_request:
+        buffer_concatenate(rx, data, size);
+        conn_on_request(conn);
+        break;
+    case tls_srv_websocket:
+        if (rx->len == 0) {
+            // The common case, frames straight from the record, unmasked in place.
+            used = ws_consume(conn, (uint8_t *)data, size);
+            if (conn->closing == false && used < size) {
+                buffer_concatenate(rx, data + used, size - used);
+            }
+            break;
+        }
+        buffer_concatenate(rx, data, size);
+        used = ws_consume(conn, rx->buffer, rx->len);
+        if (conn->closing == false) {
+            buffer_shorten(rx, used, rx->len - used);
+        }
+        break;
+    case tls_srv_post:
+        post_on_data(conn, data, size);
+        break;
+    case tls_srv_fallback:
+        conn_forward(conn, data, size);
+        break;
+    default:
+        break;
+    }
+}
+
+static int bio_send(void *p, const unsigned char *data, size_t len) {
+    struct tls_srv_conn *conn = (struct tls_srv_conn *)p;
+    buffer_concatenate(conn->cipher_out, data, len);
+    return (int)len;
+}
+
+static int bio_recv(void *p, unsigned char *data, size_t len) {
+    struct tls_srv_conn *conn = (struct tls_srv_conn *)p;
+    size_t avail = conn->cipher_in->len - conn->cipher_in_used;
+    if (avail == 0) {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+    len = min(len, avail);
+    memcpy(data, conn->cipher_in->buffer + conn->cipher_in_used, len);
+    conn->cipher_in_used += len;
+    return (int)len;
+}
+
+/* Runs |cipher_in| through mbedTLS, as far as it goes. */
+static void conn_on_cipher(struct tls_srv_conn *conn) {
+    struct tls_srv *srv = conn->srv;
+    int ret;
+
+    if (conn->handshaked == false) {
+        ret = mbedtls_ssl_handshake(&conn->ssl);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            conn_flush(conn);
+            return;
+        }
+        if (ret != 0) {
+            // Scanners and clients of other sites, not worth a line each.
+            conn_flush(conn);
+            conn_close(conn);
+            return;
+        }
+        conn->handshaked = true;
+    }
+    while (conn->closing == false && conn->finishing == false) {
+        ret = mbedtls_ssl_read(&conn->ssl, srv->plain, sizeof(srv->plain));
+        if (ret > 0) {
+            conn_on_plain(conn, srv->plain, (size_t)ret);
+            continue;
+        }
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            break;
+        }
+        if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            conn_finish(conn);
+        } else {
+            conn_close(conn);
+        }
+        break;
+    }
+    conn_flush(conn);
+}
+
+static void incoming_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct tls_srv_conn *conn = (struct tls_srv_conn *)handle->data;
+    *buf = uv_buf_init((char *)buffer_pool_alloc(conn->srv->buffer_pool, suggested_size), (unsigned int)suggested_size);
+}
+
+static void incoming_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct tls_srv_conn *conn = (struct tls_srv_conn *)stream->data;
+    struct buffer_pool *pool = conn->srv->buffer_pool;
+
+    if (conn->closing || nread == 0) {
+        // Nothing.
+    } else if (nread < 0) {
+        conn_close(conn);
+    } else if (conn->finishing == false) {
+        buffer_concatenate(conn->cipher_in, (const uint8_t *)buf->base, (size_t)nread);
+        conn_on_cipher(conn);
+        if (conn->closing == false) {
+            struct buffer_t *in = conn->cipher_in;
+            buffer_shorten(in, conn->cipher_in_used, in->len - conn->cipher_in_used);
+            conn->cipher_in_used = 0;
+        }
+    }
+    if (buf->base) {
+        buffer_pool_free(pool, buf->base);
+    }
+}
+
+static void outgoing_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct tls_srv_conn *conn = (struct tls_srv_conn *)handle->data;
+    *buf = uv_buf_init((char *)buffer_pool_alloc(conn->srv->buffer_pool, suggested_size), (unsigned int)suggested_size);
+}
+
+static void outgoing_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct tls_srv_conn *conn = (struct tls_srv_conn *)stream->data;
+    struct buffer_pool *pool = conn->srv->buffer_pool;
+
+    if (conn->closing || conn->finishing || nread == 0) {
+        // Nothing.
+    } else if (nread < 0) {
+        // The tunnel or the fallback is done with it.
+        if (conn->mode == tls_srv_websocket) {
+            ws_send_frame(conn, WS_OP_CLOSE, NULL, 0);
+        }
+        conn_finish(conn);
+    } else {
+        if (conn->mode == tls_srv_websocket) {
+            ws_send_frame(conn, WS_OP_BINARY, (const uint8_t *)buf->base, (size_t)nread);
+        } else {
+            conn_tls_write(conn, (const uint8_t *)buf->base, (size_t)nread);
+        }
+        conn_flush(conn);
+    }
+    if (buf->base) {
+        buffer_pool_free(pool, buf->base);
+    }
+}
+
+static void conn_timeout_cb(uv_timer_t *handle) {
+    struct tls_srv_conn *conn = (struct tls_srv_conn *)handle->data;
+    conn_close(conn);
+}
+
+static void tls_srv_connection_cb(uv_stream_t *server, int status) {
+    struct tls_srv *srv = (struct tls_srv *)server->data;
+    struct tls_srv_conn *conn;
+
+    if (status < 0) {
+        return;
+    }
+    conn = (struct tls_srv_conn *) calloc(1, sizeof(*conn));
+    conn->srv = srv;
+    uv_tcp_init(srv->loop, &conn->incoming);
+    uv_tcp_init(srv->loop, &conn->outgoing);
+    uv_timer_init(srv->loop, &conn->timer);
+    conn->incoming.data = conn;
+    conn->outgoing.data = conn;
+    conn->timer.data = conn;
+    conn->handles = 3;
+    conn->cipher_in = buffer_create(SSR_BUFF_SIZE);
+    conn->cipher_out = buffer_create(SSR_BUFF_SIZE);
+    conn->rx = buffer_create(0);
+    mbedtls_ssl_init(&conn->ssl);
+
+    conn->next = srv->conns;
+    if (srv->conns) {
+        srv->conns->prev = conn;
+    }
+    srv->conns = conn;
+
+    if (uv_accept(server, (uv_stream_t *)&conn->incoming) != 0 ||
+        mbedtls_ssl_setup(&conn->ssl, &srv->conf) != 0)
+    {
+        conn_close(conn);
+        return;
+    }
+    mbedtls_ssl_set_bio(&conn->ssl, conn, bio_send, bio_recv, NULL);
+    uv_tcp_nodelay(&conn->incoming, 1);
+    uv_tcp_nodelay(&conn->outgoing, 1);
+    uv_timer_start(&conn->timer, conn_timeout_cb, TLS_SRV_REQUEST_TIMEOUT_MS, 0);
+    uv_read_start((uv_stream_t *)&conn->incoming, incoming_alloc_cb, incoming_read_cb);
+}
+
+static void tls_srv_release(struct tls_srv *srv) {
+    mbedtls_ssl_config_free(&srv->conf);
+    mbedtls_pk_free(&srv->key);
+    mbedtls_x509_crt_free(&srv->cert);
+    mbedtls_ctr_drbg_free(&srv->ctr_drbg);
+    mbedtls_entropy_free(&srv->entropy);
+    buffer_release(srv->tx);
+    free(srv);
+}
+
+static bool tls_srv_load(struct tls_srv *srv) {
+    const struct server_config *config = srv->config;
+    static const char *alpn[] = { "http/1.1", NULL };
+    char error[128];
+    int ret;
+
+    mbedtls_entropy_init(&srv->entropy);
+    mbedtls_ctr_drbg_init(&srv->ctr_drbg);
+    mbedtls_x509_crt_init(&srv->cert);
+    mbedtls_pk_init(&srv->key);
+    mbedtls_ssl_config_init(&srv->conf);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&srv->ctr_drbg, mbedtls_entropy_func, &srv->entropy, NULL, 0)) != 0) {
+        mbedtls_strerror(ret, error, sizeof(error));
+        pr_err("over TLS: seeding the RNG failed: %s", error);
+        return false;
+    }
+    if ((ret = mbedtls_x509_crt_parse_file(&srv->cert, config->over_tls_cert_file)) != 0) {
+        mbedtls_strerror(ret, error, sizeof(error));
+        pr_err("over TLS: loading %s failed: %s", config->over_tls_cert_file, error);
+        return false;
+    }
+    if ((ret = mbedtls_pk_parse_keyfile(&srv->key, config->over_tls_key_file, NULL)) != 0) {
+        mbedtls_strerror(ret, error, sizeof(error));
+        pr_err("over TLS: loading %s failed: %s", config->over_tls_key_file, error);
+        return false;
+    }
+    if ((ret = mbedtls_ssl_config_defaults(&srv->conf, MBEDTLS_SSL_IS_SERVER,
+        MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0 ||
+        (ret = mbedtls_ssl_conf_own_cert(&srv->conf, &srv->cert, &srv->key)) != 0 ||
+        (ret = mbedtls_ssl_conf_alpn_protocols(&srv->conf, alpn)) != 0)
+    {
+        mbedtls_strerror(ret, error, sizeof(error));
+        pr_err("over TLS: %s", error);
+        return false;
+    }
+    mbedtls_ssl_conf_rng(&srv->conf, mbedtls_ctr_drbg_random, &srv->ctr_drbg);
+    mbedtls_ssl_conf_min_version(&srv->conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+    return true;
+}
+
+static int tls_srv_listen(struct tls_srv *srv, unsigned short port, const char **what) {
+    union sockaddr_universal addr = { 0 };
+    int error;
+
+    srv->listener = (uv_tcp_t *) calloc(1, sizeof(uv_tcp_t));
+    // Dual-stack like the main listener, IPv4 alone where there is no IPv6.
+    if (uv_tcp_init_ex(srv->loop, srv->listener, AF_INET6) == 0) {
+        addr.addr6.sin6_family = AF_INET6;
+        addr.addr6.sin6_addr = in6addr_any;
+    } else {
+        uv_tcp_init_ex(srv->loop, srv->listener, AF_INET);
+        addr.addr4.sin_family = AF_INET;
+        addr.addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    universal_address_set_port(&addr, port);
+    srv->listener->data = srv;
+#if defined(SO_REUSEPORT)
+    {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        int on = 1;
+        *what = "setting SO_REUSEPORT";
+        if ((error = uv_fileno((uv_handle_t *)srv->listener, &fd)) != 0) {
+            return error;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            return -errno;
+        }
+    }
+#endif // defined(SO_REUSEPORT)
+    *what = "binding";
+    if ((error = uv_tcp_bind(srv->listener, &addr.addr, 0)) != 0) {
+        return error;
+    }
+    *what = "listening";
+    return uv_listen((uv_stream_t *)srv->listener, SSR_MAX_CONN, tls_srv_connection_cb);
+}
+
+static void listener_close_done_cb(uv_handle_t *handle) {
+    free(handle);
+}
+
+struct tls_srv * tls_srv_create(uv_loop_t *loop, struct server_env_t *env) {
+    struct server_config *config = env->config;
+    struct tls_srv *srv;
+    const char *what = NULL;
+    int error;
+
+    if (config->over_tls_listen_port == 0 || config->over_tls_cert_file == NULL || config->over_tls_key_file == NULL) {
+        return NULL;
+    }
+    srv = (struct tls_srv *) calloc(1, sizeof(*srv));
+    srv->loop = loop;
+    srv->config = config;
+    srv->buffer_pool = env->read_buffer_pool;
+    srv->tx = buffer_create(SSR_BUFF_SIZE);
+    srv->path = config->over_tls_path ? config->over_tls_path : "/";
+    // Where listener_start() binds, every IPv4 address.
+    srv->ssr_listener.addr4.sin_family = AF_INET;
+    srv->ssr_listener.addr4.sin_port = htons(config->listen_port);
+    srv->ssr_listener.addr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (config->over_tls_fallback) {
+        struct socks5_address s5addr;
+        srv->has_fallback = socks5_address_from_host_port(config->over_tls_fallback, &s5addr) &&
+            socks5_address_to_universal(&s5addr, &srv->fallback);
+        if (srv->has_fallback == false) {
+            pr_warn("over TLS fallback \"%s\" is not an address and port, answering 404", config->over_tls_fallback);
+        }
+    }
+    if (tls_srv_load(srv) == false) {
+        tls_srv_release(srv);
+        return NULL;
+    }
+    if ((error = tls_srv_listen(srv, config->over_tls_listen_port, &what)) != 0) {
+        pr_err("over TLS: %s port %hu failed: %s", what, config->over_tls_listen_port, uv_strerror(error));
+        uv_close((uv_handle_t *)srv->listener, listener_close_done_cb);
+        tls_srv_release(srv);
+        return NULL;
+    }
+    return srv;
+}
+
+void tls_srv_stop_listening(struct tls_srv *srv) {
+    if (srv == NULL || srv->listener == NULL) {
+        return;
+    }
+    uv_close((uv_handle_t *)srv->listener, listener_close_done_cb);
+    srv->listener = NULL;
+}
+
+void tls_srv_shutdown(struct tls_srv *srv) {
+    if (srv == NULL) {
+        return;
+    }
+    tls_srv_stop_listening(srv);
+    while (srv->conns) {
+        conn_close(srv->conns);
+    }
+    tls_srv_release(srv);
+}
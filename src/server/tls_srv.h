@@ -0,0 +1,36 @@
+#ifndef __TLS_SRV_H__
+#define __TLS_SRV_H__ 1
+
+#include <stdbool.h>
+#include <uv.h>
+
+struct server_env_t;
+struct tls_srv;
+
+/*
+ * The server end of over_tls_enable, in place of a web server in front of
+ * ssr-server. It terminates TLS on over_tls_listen_port with mbedTLS and
+ * reads the first request of each connection. A WebSocket upgrade of
+ * over_tls_path, or a POST to it as the client sends without
+ * over_tls_streaming, is answered and its payload bridged to this
+ * worker's own TCP listener over loopback, where it meets the protocol,
+ * obfs and cipher handling of any connection. Anything else goes as it
+ * is, request included, to over_tls_fallback, so the port serves like the
+ * site it stands for. Those tunnels see the loopback address as the
+ * client's.
+ */
+
+#define TLS_SRV_WRITE_HIGH          (256 * 1024)  /* Bytes in flight to either side, beyond them the other one waits. */
+#define TLS_SRV_REQUEST_TIMEOUT_MS  (10 * 1000)  /* For the handshake and the first request together. */
+#define TLS_SRV_REQUEST_MAX         0x8000
+
+/* NULL without over_tls_listen_port and both files, or if those don't load
+ * or the port can't be bound. Bound with SO_REUSEPORT where there is one,
+ * so every worker and a successor with upgrade_socket can take it too. */
+struct tls_srv * tls_srv_create(uv_loop_t *loop, struct server_env_t *env);
+/* Takes no more connections, the ones open go on. */
+void tls_srv_stop_listening(struct tls_srv *srv);
+/* Closes the connections as well. */
+void tls_srv_shutdown(struct tls_srv *srv);
+
+#endif // __TLS_SRV_H__
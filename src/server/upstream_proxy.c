@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <netdb.h>
+#endif
+#include "upstream_proxy.h"
+#include "common.h"
+#include "dump_info.h"
+#include "base64.h"
+
+#define UPSTREAM_LOGIN_MAX  255  /* Of SOCKS5's user name and password each, RFC 1929. */
+
+enum upstream_phase {
+    upstream_phase_method,   /* SOCKS5, the method chosen. */
+    upstream_phase_login,    /* SOCKS5, the login's status. */
+    upstream_phase_request,  /* SOCKS5, the request's reply; HTTP, the status line and headers. */
+    upstream_phase_address,  /* SOCKS5, the bound address of the reply. */
+    upstream_phase_done,
+};
+
+struct upstream_conn {
+    struct upstream_proxy *proxy;
+    uv_tcp_t tcp;
+    uv_connect_t connect_req;
+    uv_write_t write_req;
+    struct upstream_reply reply;
+    uint8_t greeting[3 + 3 + 2 * UPSTREAM_LOGIN_MAX];
+    uint64_t ready_at;
+    bool ready;
+    struct upstream_conn *next;
+};
+
+struct upstream_proxy {
+    uv_loop_t *loop;
+    enum upstream_proxy_kind kind;
+    union sockaddr_universal addr;
+    char user[UPSTREAM_LOGIN_MAX + 1];
+    char password[UPSTREAM_LOGIN_MAX + 1];
+    bool login;
+    char authorization[UPSTREAM_PROXY_HTTP_MAX / 2];  /* HTTP, "Basic ..." with a login. */
+    size_t target;
+    struct upstream_conn *conns;  /* Ready or still greeting. */
+    size_t count;
+    size_t open_handles;  /* Freed when the last one closes after destroy. */
+    bool released;
+    char sink[64];  /* The greeting's replies, anything after them ends the connection. */
+};
+
+/* "scheme://[user[:pass]@]host:port", the last '@' ends the login. */
+static bool upstream_parse_url(struct upstream_proxy *proxy, const char *url, char *host, size_t host_size, char *port, size_t port_size) {
+    const char *p, *at, *colon, *end;
+    size_t len;
+
+    if (strncmp(url, "socks5://", 9) == 0) {
+        proxy->kind = upstream_proxy_socks5;
+        p = url + 9;
+    } else if (strncmp(url, "http://", 7) == 0) {
+        proxy->kind = upstream_proxy_http;
+        p = url + 7;
+    } else {
+        return false;
+    }
+    end = p + strcspn(p, "/");
+    at = NULL;
+    for (colon = p; colon < end; ++colon) {
+        if (*colon == '@') {
+            at = colon;
+        }
+    }
+    if (at) {
+        const char *sep = memchr(p, ':', (size_t)(at - p));
+        const char *user_end = sep ? sep : at;
+        if ((size_t)(user_end - p) > UPSTREAM_LOGIN_MAX || (sep && (size_t)(at - sep - 1) > UPSTREAM_LOGIN_MAX)) {
+            return false;
+        }
+        memcpy(proxy->user, p, (size_t)(user_end - p));
+        if (sep) {
+            memcpy(proxy->password, sep + 1, (size_t)(at - sep - 1));
+        }
+        proxy->login = true;
+        p = at + 1;
+    }
+    if (*p == '[') {
+        const char *close = memchr(p, ']', (size_t)(end - p));
+        if (close == NULL || close[1] != ':') {
+            return false;
+        }
+        len = (size_t)(close - p - 1);
+        if (len >= host_size) {
+            return false;
+        }
+        memcpy(host, p + 1, len);
+        host[len] = '\0';
+        colon = close + 1;
+    } else {
+        colon = NULL;
+        for (at = p; at < end; ++at) {
+            if (*at == ':') {
+                colon = at;
+            }
+        }
+        if (colon == NULL || (size_t)(colon - p) >= host_size) {
+            return false;
+        }
+        memcpy(host, p, (size_t)(colon - p));
+        host[colon - p] = '\0';
+    }
+    len = (size_t)(end - colon - 1);
+    if (len == 0 || len >= port_size) {
+        return false;
+    }
+    memcpy(port, colon + 1, len);
+    port[len] = '\0';
+    return host[0] != '\0';
+}
+
+static size_t upstream_socks5_greeting(const struct upstream_proxy *proxy, uint8_t *out) {
+    size_t n = 0, len;
+    out[n++] = 0x05;
+    out[n++] = 1;
+    out[n++] = proxy->login ? 0x02 : 0x00;
+    if (proxy->login) {
+        out[n++] = 0x01;
+        len = strlen(proxy->user);
+        out[n++] = (uint8_t)len;
+        memcpy(out + n, proxy->user, len);
+        n += len;
+        len = strlen(proxy->password);
+        out[n++] = (uint8_t)len;
+        memcpy(out + n, proxy->password, len);
+        n += len;
+    }
+    return n;
+}
+
+static void upstream_reply_init(struct upstream_reply *reply, enum upstream_proxy_kind kind, bool greeted) {
+    memset(reply, 0, sizeof(*reply));
+    reply->kind = kind;
+    reply->phase = (kind == upstream_proxy_http || greeted) ? upstream_phase_request : upstream_phase_method;
+}
+
+static int upstream_reply_socks5(struct upstream_reply *reply, uint8_t c) {
+    switch (reply->phase) {
+    case upstream_phase_method:
+        reply->head[reply->head_len++] = c;
+        if (reply->head_len < 2) {
+            return 0;
+        }
+        if (reply->head[0] != 0x05 || (reply->head[1] != 0x00 && reply->head[1] != 0x02)) {
+            return -1;
+        }
+        reply->phase = (reply->head[1] == 0x02) ? upstream_phase_login : upstream_phase_request;
+        reply->head_len = 0;
+        return 0;
+    case upstream_phase_login:
+        reply->head[reply->head_len++] = c;
+        if (reply->head_len < 2) {
+            return 0;
+        }
+        if (reply->head[1] != 0x00) {
+            return -1;
+        }
+        reply->phase = upstream_phase_request;
+        reply->head_len = 0;
+        return 0;
+    case upstream_phase_request:
+        reply->head[reply->head_len++] = c;
+        if (reply->head_len < sizeof(reply->head)) {
+            return 0;
+        }
+        if (reply->head[0] != 0x05 || reply->head[1] != 0x00) {
+            return -1;
+        }
+        // The rest of the bound address, its first byte was in the head, then the port.
+        switch (reply->head[3]) {
+        case 0x01: reply->need = 4 - 1 + 2; break;
+        case 0x04: reply->need = 16 - 1 + 2; break;
+        case 0x03: reply->need = (size_t)reply->head[4] + 2; break;
+        default: return -1;
+        }
+        reply->phase = upstream_phase_address;
+        return 0;
+    case upstream_phase_address:
+        if (--reply->need == 0) {
+            reply->phase = upstream_phase_done;
+            return 1;
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static int upstream_reply_http(struct upstream_reply *reply, uint8_t c) {
+    if (++reply->head_size > UPSTREAM_PROXY_HTTP_MAX) {
+        return -1;
+    }
+    if (reply->status_len < sizeof(reply->status) - 1) {
+        reply->status[reply->status_len++] = (char)c;
+        if (reply->status_len == sizeof(reply->status) - 1 &&
+            (strncmp(reply->status, "HTTP/1.", 7) != 0 || reply->status[9] != '2'))
+        {
+            return -1;
+        }
+    }
+    if (c == '\r') {
+        reply->crlf = (reply->crlf == 2) ? 3 : 1;
+    } else if (c == '\n' && (reply->crlf == 1 || reply->crlf == 3)) {
+        reply->crlf++;
+    } else {
+        reply->crlf = 0;
+    }
+    if (reply->crlf == 4) {
+        reply->phase = upstream_phase_done;
+        return (reply->status_len == sizeof(reply->status) - 1) ? 1 : -1;
+    }
+    return 0;
+}
+
+int upstream_reply_feed(struct upstream_reply *reply, const uint8_t *data, size_t len, size_t *used) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        int r = (reply->kind == upstream_proxy_http) ? upstream_reply_http(reply, data[i]) : upstream_reply_socks5(reply, data[i]);
+        if (r != 0) {
+            *used = i + 1;
+            return r;
+        }
+    }
+    *used = len;
+    return 0;
+}
+
+bool upstream_reply_done(const struct upstream_reply *reply) {
+    return reply->phase == upstream_phase_done;
+}
+
+size_t upstream_proxy_request(const struct upstream_proxy *proxy, bool greeted, const struct socks5_address *dest,
+                              uint8_t *out, size_t size, struct upstream_reply *reply)
+{
+    size_t n = 0;
+
+    upstream_reply_init(reply, proxy->kind, greeted);
+    if (proxy->kind == upstream_proxy_socks5) {
+        if (size < UPSTREAM_PROXY_REQUEST_MAX) {
+            return 0;
+        }
+        if (greeted == false) {
+            n = upstream_socks5_greeting(proxy, out);
+        }
+        out[n++] = 0x05;
+        out[n++] = 0x01;  /* CONNECT */
+        out[n++] = 0x00;
+        if (socks5_address_binary(dest, out + n, size - n) == NULL) {
+            return 0;
+        }
+        return n + socks5_address_size(dest);
+    } else {
+        char host[0x0100 + 1] = { 0 };
+        int len;
+        if (socks5_address_to_string(dest, host, sizeof(host)) == NULL) {
+            return 0;
+        }
+        len = snprintf((char *)out, size,
+            (dest->addr_type == SOCKS5_ADDRTYPE_IPV6) ?
+                "CONNECT [%s]:%u HTTP/1.1\r\nHost: [%s]:%u\r\n%s%s%s\r\n" :
+                "CONNECT %s:%u HTTP/1.1\r\nHost: %s:%u\r\n%s%s%s\r\n",
+            host, (unsigned int)dest->port, host, (unsigned int)dest->port,
+            proxy->login ? "Proxy-Authorization: " : "", proxy->authorization, proxy->login ? "\r\n" : "");
+        return (len > 0 && (size_t)len < size) ? (size_t)len : 0;
+    }
+}
+
+const union sockaddr_universal * upstream_proxy_address(const struct upstream_proxy *proxy) {
+    return &proxy->addr;
+}
+
+#if !defined(_WIN32)
+
+static void upstream_fill(struct upstream_proxy *proxy);
+
+static void upstream_conn_close_done_cb(uv_handle_t *handle) {
+    struct upstream_conn *conn = (struct upstream_conn *)handle->data;
+    struct upstream_proxy *proxy = conn->proxy;
+
+    free(conn);
+    if (--proxy->open_handles == 0 && proxy->released) {
+        free(proxy);
+    }
+}
+
+static void upstream_conn_close(struct upstream_conn *conn) {
+    struct upstream_proxy *proxy = conn->proxy;
+    struct upstream_conn **link;
+
+    for (link = &proxy->conns; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            proxy->count--;
+            break;
+        }
+    }
+    uv_close((uv_handle_t *)&conn->tcp, upstream_conn_close_done_cb);
+}
+
+static void upstream_conn_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct upstream_conn *conn = (struct upstream_conn *)handle->data;
+    (void)suggested_size;
+    *buf = uv_buf_init(conn->proxy->sink, sizeof(conn->proxy->sink));
+}
+
+static void upstream_conn_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct upstream_conn *conn = (struct upstream_conn *)stream->data;
+    size_t used = 0;
+
+    if (nread == 0) {
+        return;
+    }
+    if (nread < 0 || conn->ready) {
+        upstream_conn_close(conn);
+        return;
+    }
+    // Nothing but the method and the login's status, the request reply phase means greeted.
+    if (upstream_reply_feed(&conn->reply, (const uint8_t *)buf->base, (size_t)nread, &used) != 0 ||
+        used != (size_t)nread)
+    {
+        upstream_conn_close(conn);
+        return;
+    }
+    if (conn->reply.head_len > 0) {
+        upstream_conn_close(conn);  /* A reply to a request it wasn't sent. */
+        return;
+    }
+    if (conn->reply.phase == upstream_phase_request) {
+        conn->ready = true;
+        conn->ready_at = uv_now(conn->proxy->loop);
+    }
+}
+
+static void upstream_conn_write_done_cb(uv_write_t *req, int status) {
+    struct upstream_conn *conn = CONTAINER_OF(req, struct upstream_conn, write_req);
+    if (status < 0 && uv_is_closing((uv_handle_t *)&conn->tcp) == 0) {
+        upstream_conn_close(conn);
+    }
+}
+
+static void upstream_conn_connect_done_cb(uv_connect_t *req, int status) {
+    struct upstream_conn *conn = CONTAINER_OF(req, struct upstream_conn, connect_req);
+    struct upstream_proxy *proxy = conn->proxy;
+
+    if (proxy->released || uv_is_closing((uv_handle_t *)&conn->tcp)) {
+        return;
+    }
+    if (status < 0) {
+        // Not refilled here, an unreachable proxy costs one attempt per tunnel.
+        upstream_conn_close(conn);
+        return;
+    }
+    if (proxy->kind == upstream_proxy_socks5) {
+        uv_buf_t buf = uv_buf_init((char *)conn->greeting, (unsigned int)upstream_socks5_greeting(proxy, conn->greeting));
+        upstream_reply_init(&conn->reply, proxy->kind, false);
+        if (uv_write(&conn->write_req, (uv_stream_t *)&conn->tcp, &buf, 1, upstream_conn_write_done_cb) != 0) {
+            upstream_conn_close(conn);
+            return;
+        }
+    } else {
+        conn->ready = true;
+        conn->ready_at = uv_now(proxy->loop);
+    }
+    uv_read_start((uv_stream_t *)&conn->tcp, upstream_conn_alloc_cb, upstream_conn_read_cb);
+}
+
+static void upstream_fill(struct upstream_proxy *proxy) {
+    while (proxy->count < proxy->target) {
+        struct upstream_conn *conn = (struct upstream_conn *) calloc(1, sizeof(*conn));
+        conn->proxy = proxy;
+        uv_tcp_init(proxy->loop, &conn->tcp);
+        conn->tcp.data = conn;
+        conn->next = proxy->conns;
+        proxy->conns = conn;
+        proxy->count++;
+        proxy->open_handles++;
+        if (uv_tcp_connect(&conn->connect_req, &conn->tcp, &proxy->addr.addr, upstream_conn_connect_done_cb) != 0) {
+            upstream_conn_close(conn);
+            return;
+        }
+    }
+}
+
+bool upstream_proxy_take(struct upstream_proxy *proxy, uv_tcp_t *tcp) {
+    struct upstream_conn *conn, *next;
+    bool taken = false;
+    uint64_t now;
+
+    if (proxy == NULL || proxy->released) {
+        return false;
+    }
+    now = uv_now(proxy->loop);
+    for (conn = proxy->conns; conn && taken == false; conn = next) {
+        next = conn->next;
+        if (conn->ready == false) {
+            continue;
+        }
+        if (now - conn->ready_at < UPSTREAM_PROXY_MAX_AGE_MS) {
+            uv_os_fd_t fd;
+            if (uv_fileno((uv_handle_t *)&conn->tcp, &fd) == 0) {
+                // The pooled handle closes its own descriptor, keep a duplicate.
+                fd = dup(fd);
+                if (fd >= 0 && uv_tcp_open(tcp, fd) == 0) {
+                    taken = true;
+                } else if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+        upstream_conn_close(conn);
+    }
+    upstream_fill(proxy);
+    return taken;
+}
+
+#else
+
+static void upstream_fill(struct upstream_proxy *proxy) {
+    (void)proxy;
+}
+
+bool upstream_proxy_take(struct upstream_proxy *proxy, uv_tcp_t *tcp) {
+    (void)proxy; (void)tcp;
+    return false;
+}
+
+#endif // !defined(_WIN32)
+
+struct upstream_proxy * upstream_proxy_create(uv_loop_t *loop, const char *url, int idle) {
+    struct upstream_proxy *proxy;
+    char host[0x0100 + 1] = { 0 }, port[8] = { 0 };
+    struct addrinfo hints = { 0 }, *ai = NULL;
+
+    proxy = (struct upstream_proxy *) calloc(1, sizeof(*proxy));
+    proxy->loop = loop;
+    if (upstream_parse_url(proxy, url, host, sizeof(host), port, sizeof(port)) == false) {
+        pr_err("upstream_proxy %s: not socks5://[user:pass@]host:port or http://[user:pass@]host:port", url);
+        free(proxy);
+        return NULL;
+    }
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo(host, port, &hints, &ai) != 0 || ai == NULL ||
+        (ai->ai_family != AF_INET && ai->ai_family != AF_INET6))
+    {
+        pr_err("upstream_proxy %s: %s doesn't resolve", url, host);
+        if (ai) {
+            freeaddrinfo(ai);
+        }
+        free(proxy);
+        return NULL;
+    }
+    memcpy(&proxy->addr, ai->ai_addr, (size_t)ai->ai_addrlen);
+    freeaddrinfo(ai);
+
+    if (proxy->login && proxy->kind == upstream_proxy_http) {
+        char login[2 * UPSTREAM_LOGIN_MAX + 2];
+        int len = snprintf(login, sizeof(login), "%s:%s", proxy->user, proxy->password);
+        if (std_base64_encode_len(len) + 6 >= (int)sizeof(proxy->authorization)) {
+            pr_err("upstream_proxy %s: login too long", url);
+            free(proxy);
+            return NULL;
+        }
+        memcpy(proxy->authorization, "Basic ", 6);
+        std_base64_encode((const unsigned char *)login, len, (unsigned char *)proxy->authorization + 6);
+    }
+    proxy->target = (idle > 0) ? (size_t)idle : 0;
+    upstream_fill(proxy);
+    return proxy;
+}
+
+void upstream_proxy_destroy(struct upstream_proxy *proxy) {
+    if (proxy == NULL || proxy->released) {
+        return;
+    }
+    proxy->released = true;
+#if !defined(_WIN32)
+    while (proxy->conns) {
+        upstream_conn_close(proxy->conns);
+    }
+#endif
+    if (proxy->open_handles == 0) {
+        free(proxy);
+    }
+}
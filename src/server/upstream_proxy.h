@@ -0,0 +1,71 @@
+#ifndef __UPSTREAM_PROXY_H__
+#define __UPSTREAM_PROXY_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+#include "sockaddr_universal.h"
+
+/*
+ * ssr-server's outgoing connections through an egress proxy, SOCKS5 or
+ * HTTP CONNECT, from upstream_proxy "socks5://[user:pass@]host:port" or
+ * "http://[user:pass@]host:port". The proxy is given the destination as
+ * the client sent it, names are resolved there.
+ *
+ * Up to upstream_proxy_idle connections per loop are made ahead of the
+ * tunnels, over SOCKS5 with the method chosen and the login done, so a
+ * tunnel only sends its CONNECT. The request goes out in one write with
+ * the tunnel's first payload, a fresh SOCKS5 connection's greeting and
+ * login with them, the replies are read back as they come. A taken
+ * connection is replaced right away, one older than
+ * UPSTREAM_PROXY_MAX_AGE_MS or closed by the proxy is dropped.
+ */
+
+#define UPSTREAM_PROXY_MAX_AGE_MS   (15 * 1000)  /* Below what proxies wait for a request. */
+#define UPSTREAM_PROXY_REQUEST_MAX  (3 + 3 + 2 * 255 + 4 + 1 + 255 + 2)  /* SOCKS5's greeting, login and request. */
+#define UPSTREAM_PROXY_HTTP_MAX     1024  /* Bytes of an HTTP request, or of a reply's head. */
+
+enum upstream_proxy_kind {
+    upstream_proxy_socks5,
+    upstream_proxy_http,
+};
+
+struct upstream_proxy;
+
+/* Where a tunnel is in the proxy's replies. */
+struct upstream_reply {
+    enum upstream_proxy_kind kind;
+    int phase;
+    size_t need;  /* SOCKS5, bytes left of the current reply. */
+    uint8_t head[5];  /* SOCKS5, the start of the request's reply. */
+    size_t head_len;
+    char status[13];  /* HTTP, "HTTP/1.1 200" and its end. */
+    size_t status_len;
+    size_t head_size;  /* HTTP, the reply's head so far. */
+    int crlf;  /* HTTP, of the "\r\n\r\n" ending it. */
+};
+
+/* NULL, the reason logged, when |url| doesn't parse or its host doesn't resolve. On Windows, without pooling. */
+struct upstream_proxy * upstream_proxy_create(uv_loop_t *loop, const char *url, int idle);
+/* Closes the pooled connections, it's freed once they are. */
+void upstream_proxy_destroy(struct upstream_proxy *proxy);
+const union sockaddr_universal * upstream_proxy_address(const struct upstream_proxy *proxy);
+/* A pooled connection into |tcp|, false means connect to the address as usual. */
+bool upstream_proxy_take(struct upstream_proxy *proxy, uv_tcp_t *tcp);
+
+/*
+ * The request for |dest| into |out|, its length, 0 when it doesn't fit.
+ * |greeted| for a pooled connection, |reply| set up for what comes back.
+ */
+size_t upstream_proxy_request(const struct upstream_proxy *proxy, bool greeted, const struct socks5_address *dest,
+                              uint8_t *out, size_t size, struct upstream_reply *reply);
+/*
+ * Reads the replies from |data|. 1 once the proxy connected, |*used| the
+ * bytes of them, what follows is the destination's; 0 for more, -1 when
+ * the proxy refused or isn't one.
+ */
+int upstream_reply_feed(struct upstream_reply *reply, const uint8_t *data, size_t len, size_t *used);
+bool upstream_reply_done(const struct upstream_reply *reply);
+
+#endif // __UPSTREAM_PROXY_H__
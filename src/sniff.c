@@ -0,0 +1,182 @@
+#include <string.h>
+#include "sniff.h"
+
+#define TLS_HEADER_LEN            5
+#define TLS_HANDSHAKE             0x16
+#define TLS_CLIENT_HELLO          0x01
+#define TLS_EXT_SERVER_NAME       0x0000
+#define TLS_SERVER_NAME_HOST_NAME 0x00
+
+static size_t be16(const uint8_t *p) {
+    return ((size_t)p[0] << 8) | p[1];
+}
+
+static int copy_name(const uint8_t *name, size_t len, char *host, size_t size) {
+    size_t i;
+
+    if (len == 0 || len >= size) {
+        return SNIFF_NONE;
+    }
+    for (i = 0; i < len; ++i) {
+        // A host name, nothing with blanks or controls to confuse the ACL.
+        if (name[i] <= ' ' || name[i] >= 0x7f) {
+            return SNIFF_NONE;
+        }
+    }
+    memcpy(host, name, len);
+    host[len] = '\0';
+    return (int)len;
+}
+
+static int server_name_list(const uint8_t *data, size_t len, char *host, size_t size) {
+    size_t pos = 2, n;
+
+    if (len < 2 || be16(data) + 2 > len) {
+        return SNIFF_NONE;
+    }
+    while (pos + 3 <= len) {
+        n = be16(data + pos + 1);
+        if (pos + 3 + n > len) {
+            return SNIFF_NONE;
+        }
+        if (data[pos] == TLS_SERVER_NAME_HOST_NAME) {
+            return copy_name(data + pos + 3, n, host, size);
+        }
+        pos += 3 + n;
+    }
+    return SNIFF_NONE;
+}
+
+int sniff_tls_server_name(const uint8_t *data, size_t len, char *host, size_t size) {
+    size_t pos = TLS_HEADER_LEN, end, n;
+
+    if (len > 0 && data[0] != TLS_HANDSHAKE) {
+        return SNIFF_NONE;
+    }
+    if (len < TLS_HEADER_LEN) {
+        return SNIFF_NEED_MORE;
+    }
+    if (data[1] < 3) {
+        return SNIFF_NONE;  /* SSL 2.0 compatible, no extensions. */
+    }
+    end = TLS_HEADER_LEN + be16(data + 3);
+    if (len < end) {
+        return SNIFF_NEED_MORE;
+    }
+
+    /* Handshake type, length, version and random. */
+    if (pos + 38 > end || data[pos] != TLS_CLIENT_HELLO) {
+        return SNIFF_NONE;
+    }
+    pos += 38;
+    /* Session ID, cipher suites, compression methods. */
+    if (pos + 1 > end) {
+        return SNIFF_NONE;
+    }
+    pos += 1 + data[pos];
+    if (pos + 2 > end) {
+        return SNIFF_NONE;
+    }
+    pos += 2 + be16(data + pos);
+    if (pos + 1 > end) {
+        return SNIFF_NONE;
+    }
+    pos += 1 + data[pos];
+
+    if (pos + 2 > end) {
+        return SNIFF_NONE;
+    }
+    n = be16(data + pos);
+    pos += 2;
+    if (pos + n > end) {
+        return SNIFF_NONE;
+    }
+    end = pos + n;
+    while (pos + 4 <= end) {
+        size_t type = be16(data + pos);
+        n = be16(data + pos + 2);
+        pos += 4;
+        if (pos + n > end) {
+            return SNIFF_NONE;
+        }
+        if (type == TLS_EXT_SERVER_NAME) {
+            return server_name_list(data + pos, n, host, size);
+        }
+        pos += n;
+    }
+    return SNIFF_NONE;
+}
+
+static int is_host_header(const uint8_t *line, size_t len) {
+    static const char name[] = "host:";
+    size_t i;
+
+    if (len < sizeof(name) - 1) {
+        return 0;
+    }
+    for (i = 0; i < sizeof(name) - 1; ++i) {
+        uint8_t c = line[i];
+        if (c >= 'A' && c <= 'Z') {
+            c = (uint8_t)(c - 'A' + 'a');
+        }
+        if (c != (uint8_t)name[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int sniff_http_host(const uint8_t *data, size_t len, char *host, size_t size) {
+    const uint8_t *end = data + len, *line, *eol;
+    size_t i;
+
+    // A method first, upper case up to a space.
+    for (i = 0; i < len && data[i] >= 'A' && data[i] <= 'Z'; ++i) {
+    }
+    if (i == len) {
+        return SNIFF_NEED_MORE;
+    }
+    if (i == 0 || data[i] != ' ') {
+        return SNIFF_NONE;
+    }
+
+    line = (const uint8_t *)memchr(data, '\n', len);
+    while (line) {
+        const uint8_t *value, *value_end, *colon;
+
+        ++line;
+        eol = (const uint8_t *)memchr(line, '\n', (size_t)(end - line));
+        if (eol == NULL) {
+            break;
+        }
+        if (eol - line <= 1) {
+            return SNIFF_NONE;  /* The blank line, no Host. */
+        }
+        if (is_host_header(line, (size_t)(eol - line)) == 0) {
+            line = eol;
+            continue;
+        }
+        value = line + 5;
+        value_end = eol;
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            --value_end;
+        }
+        if (value < value_end && *value == '[') {
+            // An IPv6 literal, without its brackets.
+            const uint8_t *close = (const uint8_t *)memchr(value, ']', (size_t)(value_end - value));
+            if (close == NULL) {
+                return SNIFF_NONE;
+            }
+            return copy_name(value + 1, (size_t)(close - value - 1), host, size);
+        }
+        colon = (const uint8_t *)memchr(value, ':', (size_t)(value_end - value));
+        if (colon) {
+            value_end = colon;
+        }
+        return copy_name(value, (size_t)(value_end - value), host, size);
+    }
+    return SNIFF_NEED_MORE;
+}
@@ -0,0 +1,21 @@
+#if !defined(__sniff_h__)
+#define __sniff_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The host name a client names in its first bytes: the server_name of a
+ * TLS ClientHello, the Host header of an HTTP request. Read in place and
+ * copied NUL-terminated into the caller's buffer, nothing is allocated.
+ * Both return the name's length, or one of the codes below.
+ */
+
+#define SNIFF_NEED_MORE  (-1)  /* It may be one, the rest hasn't come yet. */
+#define SNIFF_NONE       (-2)  /* Not one, or one without a name. */
+
+int sniff_tls_server_name(const uint8_t *data, size_t len, char *host, size_t size);
+/* The port, if any, isn't part of it. */
+int sniff_http_host(const uint8_t *data, size_t len, char *host, size_t size);
+
+#endif // !defined(__sniff_h__)
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <memory.h>
+#include <stdlib.h>
+#include <string.h>
 #include <uv.h>
 
 #if !defined(_WIN32)
@@ -177,6 +179,43 @@ bool socks5_address_to_universal(const struct socks5_address *s5addr, union sock
     return result;
 }
 
+bool socks5_address_from_host_port(const char *host_port, struct socks5_address *addr) {
+    char host[0x0100] = { 0 };
+    const char *colon;
+    size_t host_len;
+    long port;
+    char *end = NULL;
+
+    if (host_port == NULL || addr == NULL || (colon = strrchr(host_port, ':')) == NULL) {
+        return false;
+    }
+    port = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || port <= 0 || port > 65535) {
+        return false;
+    }
+    host_len = (size_t)(colon - host_port);
+    if (host_len >= 2 && host_port[0] == '[' && host_port[host_len - 1] == ']') {
+        host_port++;
+        host_len -= 2;
+    }
+    if (host_len == 0 || host_len >= sizeof(host)) {
+        return false;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    memcpy(host, host_port, host_len);
+    addr->port = (uint16_t)port;
+    if (uv_inet_pton(AF_INET, host, &addr->addr.ipv4) == 0) {
+        addr->addr_type = SOCKS5_ADDRTYPE_IPV4;
+    } else if (uv_inet_pton(AF_INET6, host, &addr->addr.ipv6) == 0) {
+        addr->addr_type = SOCKS5_ADDRTYPE_IPV6;
+    } else {
+        memcpy(addr->addr.domainname, host, host_len);
+        addr->addr_type = SOCKS5_ADDRTYPE_DOMAINNAME;
+    }
+    return true;
+}
+
 int convert_universal_address(const char *addr_str, unsigned short port, union sockaddr_universal *addr)
 {
     struct addrinfo hints = { 0 }, *ai = NULL;
@@ -232,3 +271,56 @@ char * universal_address_to_string(const union sockaddr_universal *addr, char *a
     }
     return addr_str;
 }
+
+uint16_t universal_address_port(const union sockaddr_universal *addr) {
+    return ntohs((addr->addr.sa_family == AF_INET6) ? addr->addr6.sin6_port : addr->addr4.sin_port);
+}
+
+void universal_address_set_port(union sockaddr_universal *addr, uint16_t port) {
+    if (addr->addr.sa_family == AF_INET6) {
+        addr->addr6.sin6_port = htons(port);
+    } else {
+        addr->addr4.sin_port = htons(port);
+    }
+}
+
+bool universal_address_unmap(union sockaddr_universal *addr) {
+    struct sockaddr_in addr4 = { 0 };
+    if (addr->addr.sa_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&addr->addr6.sin6_addr)) {
+        return false;
+    }
+    addr4.sin_family = AF_INET;
+    addr4.sin_port = addr->addr6.sin6_port;
+    memcpy(&addr4.sin_addr, &addr->addr6.sin6_addr.s6_addr[12], sizeof(addr4.sin_addr));
+    memset(addr, 0, sizeof(*addr));
+    addr->addr4 = addr4;
+    return true;
+}
+
+size_t universal_addresses_from_addrinfo(const struct addrinfo *ai, union sockaddr_universal *addrs, size_t max) {
+    size_t count = 0, index;
+    for (; ai && count < max; ai = ai->ai_next) {
+        union sockaddr_universal addr = { 0 };
+        if (ai->ai_family == AF_INET) {
+            addr.addr4 = *(const struct sockaddr_in *) ai->ai_addr;
+        } else if (ai->ai_family == AF_INET6) {
+            addr.addr6 = *(const struct sockaddr_in6 *) ai->ai_addr;
+        } else {
+            continue;
+        }
+        for (index = 0; index < count; ++index) {
+            if (addrs[index].addr.sa_family != ai->ai_family) {
+                continue;
+            }
+            if (ai->ai_family == AF_INET
+                ? memcmp(&addrs[index].addr4.sin_addr, &addr.addr4.sin_addr, sizeof(struct in_addr)) == 0
+                : memcmp(&addrs[index].addr6.sin6_addr, &addr.addr6.sin6_addr, sizeof(struct in6_addr)) == 0) {
+                break;
+            }
+        }
+        if (index == count) {
+            addrs[count++] = addr;
+        }
+    }
+    return count;
+}
@@ -11,8 +11,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* IPv4 or IPv6, tagged by addr.sa_family. 28 bytes, sockaddr_storage would take
+ * 128 in every socket_ctx and candidate list for families never used here. */
 union sockaddr_universal {
-    struct sockaddr_storage addr_stor;
     struct sockaddr_in6 addr6;
     struct sockaddr_in addr4;
     struct sockaddr addr;
@@ -40,8 +41,19 @@ char * socks5_address_to_string(const struct socks5_address *addr, char *buffer,
 size_t socks5_address_size(const struct socks5_address *addr);
 uint8_t * socks5_address_binary(const struct socks5_address *addr, uint8_t *buffer, size_t size);
 bool socks5_address_to_universal(const struct socks5_address *s5addr, union sockaddr_universal *addr);
+/* From "host:port" or "[v6]:port", a literal address becomes IPV4 or IPV6, anything else a domain name. */
+bool socks5_address_from_host_port(const char *host_port, struct socks5_address *addr);
 
 int convert_universal_address(const char *addr_str, unsigned short port, union sockaddr_universal *addr);
 char * universal_address_to_string(const union sockaddr_universal *addr, char *addr_str, size_t size);
+/* The port of either family, in host order. */
+uint16_t universal_address_port(const union sockaddr_universal *addr);
+void universal_address_set_port(union sockaddr_universal *addr, uint16_t port);
+/* Turns an IPv4-mapped IPv6 address, a peer of a dual-stack socket, into the
+ * IPv4 one it stands for. False when it wasn't one. */
+bool universal_address_unmap(union sockaddr_universal *addr);
+struct addrinfo;
+/* Copies the distinct IPv4/IPv6 addresses of |ai|, up to |max|, and returns their count. */
+size_t universal_addresses_from_addrinfo(const struct addrinfo *ai, union sockaddr_universal *addrs, size_t max);
 
 #endif // !defined(__sockaddr_universal_h__)
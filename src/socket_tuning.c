@@ -0,0 +1,279 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <string.h>
+#include "socket_tuning.h"
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+#endif
+
+#if defined(__linux__) && !defined(IPPROTO_MPTCP)
+#define IPPROTO_MPTCP 262
+#endif
+
+bool socket_tuning_is_default(const struct socket_tuning *tuning) {
+    return tuning->busy_poll <= 0 && tuning->nodelay < 0 &&
+        tuning->sndbuf <= 0 && tuning->rcvbuf <= 0 && tuning->congestion[0] == '\0' &&
+        tuning->incoming_cpu == false && tuning->defer_accept <= 0 &&
+        tuning->keepalive_idle <= 0 && tuning->user_timeout <= 0;
+}
+
+#if !defined(_WIN32)
+
+static int set_int(int fd, int level, int name, int value, int *first_err) {
+    int err = setsockopt(fd, level, name, &value, sizeof(value)) ? -errno : 0;
+    if (err && *first_err == 0) {
+        *first_err = err;
+    }
+    return err;
+}
+
+int socket_tuning_apply(const struct socket_tuning *tuning, int fd) {
+    int err = 0;
+#if defined(SO_BUSY_POLL)
+    if (tuning->busy_poll > 0) {
+        set_int(fd, SOL_SOCKET, SO_BUSY_POLL, tuning->busy_poll, &err);
+    }
+#endif
+    if (tuning->nodelay >= 0) {
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, tuning->nodelay ? 1 : 0, &err);
+    }
+    // Before connect() or listen(), the window scale goes out in the SYN.
+    if (tuning->sndbuf > 0) {
+        set_int(fd, SOL_SOCKET, SO_SNDBUF, tuning->sndbuf, &err);
+    }
+    if (tuning->rcvbuf > 0) {
+        set_int(fd, SOL_SOCKET, SO_RCVBUF, tuning->rcvbuf, &err);
+    }
+    if (tuning->keepalive_idle > 0) {
+        set_int(fd, SOL_SOCKET, SO_KEEPALIVE, 1, &err);
+#if defined(TCP_KEEPIDLE)
+        set_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, tuning->keepalive_idle, &err);
+#elif defined(TCP_KEEPALIVE)
+        set_int(fd, IPPROTO_TCP, TCP_KEEPALIVE, tuning->keepalive_idle, &err);
+#endif
+#if defined(TCP_KEEPINTVL)
+        if (tuning->keepalive_interval > 0) {
+            set_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, tuning->keepalive_interval, &err);
+        }
+#endif
+#if defined(TCP_KEEPCNT)
+        if (tuning->keepalive_count > 0) {
+            set_int(fd, IPPROTO_TCP, TCP_KEEPCNT, tuning->keepalive_count, &err);
+        }
+#endif
+    }
+#if defined(TCP_USER_TIMEOUT)
+    if (tuning->user_timeout > 0) {
+        set_int(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, tuning->user_timeout, &err);
+    }
+#endif
+#if defined(TCP_CONGESTION)
+    if (tuning->congestion[0] != '\0' &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, tuning->congestion, (socklen_t)strlen(tuning->congestion)) != 0 &&
+        err == 0)
+    {
+        err = -errno;
+    }
+#endif
+    return err;
+}
+
+int socket_tuning_apply_listener(const struct socket_tuning *tuning, int fd, int cpu) {
+    int err = socket_tuning_apply(tuning, fd);
+#if defined(SO_INCOMING_CPU)
+    // Linux 6.2 and later also pick by it within a SO_REUSEPORT group.
+    if (cpu >= 0) {
+        set_int(fd, SOL_SOCKET, SO_INCOMING_CPU, cpu, &err);
+    }
+#else
+    (void)cpu;
+#endif
+    return err;
+}
+
+int socket_tuning_apply_accept(const struct socket_tuning *tuning, int fd) {
+    int err = 0;
+    if (tuning->defer_accept <= 0) {
+        return 0;
+    }
+#if defined(TCP_DEFER_ACCEPT)
+    set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, tuning->defer_accept, &err);
+#elif defined(SO_ACCEPTFILTER)
+    {
+        struct accept_filter_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        strcpy(arg.af_name, "dataready");
+        if (setsockopt(fd, SOL_SOCKET, SO_ACCEPTFILTER, &arg, sizeof(arg)) != 0) {
+            err = -errno;
+        }
+    }
+#else
+    (void)fd;
+    err = -ENOTSUP;
+#endif
+    return err;
+}
+
+int socket_tuning_mptcp_socket(int family) {
+#if defined(__linux__)
+    static int unavailable = 0;  /* Any thread may set it, all of them read it. */
+    int fd;
+    if (__sync_add_and_fetch(&unavailable, 0)) {
+        return -EPROTONOSUPPORT;
+    }
+    fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_MPTCP);
+    if (fd < 0) {
+        int err = errno;
+        // Built without it, or net.mptcp.enabled is 0.
+        if (err == EPROTONOSUPPORT || err == EINVAL || err == ENOPROTOOPT) {
+            __sync_lock_test_and_set(&unavailable, 1);
+        }
+        return -err;
+    }
+    return fd;
+#else
+    (void)family;
+    return -EPROTONOSUPPORT;
+#endif
+}
+
+int socket_tuning_worker_cpu(const struct socket_tuning *tuning, size_t index) {
+    long count;
+    if (tuning->incoming_cpu == false) {
+        return -1;
+    }
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (int)(index % (size_t)(count > 0 ? count : 1));
+}
+
+int socket_tuning_pin_thread(int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    if (cpu < 0) {
+        return -EINVAL;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+    return -ENOTSUP;
+#endif
+}
+
+#if defined(__linux__)
+/* The first line of |path|, a sysfs list such as "0-15,32-47", into |set|.
+ * The highest number in it, or -1. */
+static int numa_read_list(const char *path, cpu_set_t *set) {
+    char line[1024] = { 0 };
+    char *cursor = line;
+    int highest = -1;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        return -1;
+    }
+    if (fgets(line, sizeof(line), file) == NULL) {
+        line[0] = '\0';
+    }
+    fclose(file);
+    CPU_ZERO(set);
+    while (*cursor >= '0' && *cursor <= '9') {
+        long first = strtol(cursor, &cursor, 10), last = first;
+        if (*cursor == '-') {
+            last = strtol(cursor + 1, &cursor, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; ++first) {
+            CPU_SET((int)first, set);
+        }
+        highest = (int)last;
+        if (*cursor == ',') {
+            cursor++;
+        }
+    }
+    return highest;
+}
+#endif // defined(__linux__)
+
+int socket_tuning_numa_nodes(void) {
+#if defined(__linux__)
+    cpu_set_t nodes;
+    int highest = numa_read_list("/sys/devices/system/node/online", &nodes);
+    return highest >= 0 ? highest + 1 : 1;
+#else
+    return 1;
+#endif
+}
+
+int socket_tuning_pin_node(int node) {
+#if defined(__linux__)
+    char path[64];
+    cpu_set_t set;
+    if (node < 0) {
+        return -EINVAL;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (numa_read_list(path, &set) < 0) {
+        return -ENOENT;
+    }
+    return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)node;
+    return -ENOTSUP;
+#endif
+}
+
+#else // defined(_WIN32)
+
+int socket_tuning_apply(const struct socket_tuning *tuning, int fd) {
+    (void)tuning; (void)fd;
+    return 0;
+}
+
+int socket_tuning_apply_listener(const struct socket_tuning *tuning, int fd, int cpu) {
+    (void)tuning; (void)fd; (void)cpu;
+    return 0;
+}
+
+int socket_tuning_apply_accept(const struct socket_tuning *tuning, int fd) {
+    (void)tuning; (void)fd;
+    return 0;
+}
+
+int socket_tuning_mptcp_socket(int family) {
+    (void)family;
+    return -ENOTSUP;
+}
+
+int socket_tuning_worker_cpu(const struct socket_tuning *tuning, size_t index) {
+    (void)tuning; (void)index;
+    return -1;
+}
+
+int socket_tuning_numa_nodes(void) {
+    return 1;
+}
+
+int socket_tuning_pin_node(int node) {
+    (void)node;
+    return -ENOTSUP;
+}
+
+int socket_tuning_pin_thread(int cpu) {
+    (void)cpu;
+    return -ENOTSUP;
+}
+
+#endif // !defined(_WIN32)
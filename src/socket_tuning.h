@@ -0,0 +1,61 @@
+#if !defined(__socket_tuning_h__)
+#define __socket_tuning_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Socket options for latency sensitive deployments, the "socket" object of
+ * the config. 0 (or "") leaves the system's choice. Linux has them all, the
+ * others take what they know. A socket accepted from a tuned listener
+ * inherits its options, so only listeners and outgoing sockets are set.
+ * The keepalive and user timeout find a peer that vanished, a phone that
+ * lost its network, in seconds rather than at the idle timeout, which a
+ * long poll keeps pushing back.
+ */
+
+#define SOCKET_TUNING_CONGESTION_MAX 16  /* TCP_CA_NAME_MAX */
+
+struct socket_tuning {
+    int busy_poll;      /* SO_BUSY_POLL, microseconds a blocking read spins on the NIC queue. */
+    int nodelay;        /* TCP_NODELAY, 1 on, 0 off, -1 leaves it. */
+    int notsent_lowat;  /* TCP_NOTSENT_LOWAT of relayed sockets, see tunnel_streaming(). Not set by socket_tuning_apply(). */
+    int sndbuf;         /* SO_SNDBUF, bytes. */
+    int rcvbuf;         /* SO_RCVBUF, bytes. */
+    char congestion[SOCKET_TUNING_CONGESTION_MAX];  /* TCP_CONGESTION, such as "bbr". */
+    bool incoming_cpu;  /* Worker N runs on CPU N % count and its listener takes the connections that CPU received. */
+    int defer_accept;   /* Seconds a listener holds a connection back until its first data, 0 off, -1 the program's default. */
+    int keepalive_idle;      /* SO_KEEPALIVE with TCP_KEEPIDLE, seconds of silence before the first probe. */
+    int keepalive_interval;  /* TCP_KEEPINTVL, seconds between the probes. */
+    int keepalive_count;     /* TCP_KEEPCNT, probes unanswered before the peer is given up. */
+    int user_timeout;        /* TCP_USER_TIMEOUT, milliseconds sent data may go unacknowledged. */
+};
+
+/* Nothing to set. */
+bool socket_tuning_is_default(const struct socket_tuning *tuning);
+/* Sets every option of |tuning| on |fd|, 0 or the first error. */
+int socket_tuning_apply(const struct socket_tuning *tuning, int fd);
+/* Also SO_INCOMING_CPU to |cpu| when it is >= 0, before listen(). */
+int socket_tuning_apply_listener(const struct socket_tuning *tuning, int fd, int cpu);
+/*
+ * After listen(), defer_accept: TCP_DEFER_ACCEPT on Linux, the "dataready"
+ * accept filter on the BSDs, where it has no timeout. A silent client is
+ * still accepted once the timeout passes.
+ */
+int socket_tuning_apply_accept(const struct socket_tuning *tuning, int fd);
+
+/* A Multipath TCP socket of |family|, Linux 5.6 and up. -errno elsewhere,
+ * or once the kernel turned it down, after which the callers go straight
+ * to TCP. A peer without MPTCP gets plain TCP from it. */
+int socket_tuning_mptcp_socket(int family);
+
+/* The CPU worker |index| goes on, -1 without incoming_cpu. */
+int socket_tuning_worker_cpu(const struct socket_tuning *tuning, size_t index);
+/* Binds the calling thread to |cpu|, 0 on success. */
+int socket_tuning_pin_thread(int cpu);
+/* NUMA nodes of the host, 1 where there is no such thing. */
+int socket_tuning_numa_nodes(void);
+/* Binds the calling thread to the CPUs of |node|, 0 on success. */
+int socket_tuning_pin_node(int node);
+
+#endif // !defined(__socket_tuning_h__)
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sockmap_relay.h"
+#include "dump_info.h"
+
+#if defined(__linux__)
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+
+#if !defined(SO_COOKIE)
+#define SO_COOKIE 57
+#endif
+
+/*
+ * The socket map holds the pairs at 2 * pair and 2 * pair + 1, the peer
+ * map takes a socket's cookie to the index of the other one. A segment of
+ * a socket without a peer yet stays with it, SK_PASS.
+ */
+struct sockmap_relay {
+    int sock_map;
+    int peer_map;
+    int parser_prog;  /* Only on kernels without BPF_SK_SKB_VERDICT. */
+    int verdict_prog;
+    size_t pairs;
+    uint64_t *cookies;  /* Of the sockets in, 2 per pair, 0 for a free pair. */
+    size_t next;  /* Where the search for a free pair starts. */
+};
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr) {
+    return (int) syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_create(enum bpf_map_type type, unsigned int key_size, unsigned int value_size, unsigned int max_entries, unsigned int flags) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    attr.map_flags = flags;
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int map_update(int map, const void *key, const void *value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    attr.flags = BPF_ANY;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void map_delete(int map, const void *key) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    (void)sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int prog_load(const struct bpf_insn *insns, size_t count) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = (uint32_t)count;
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int prog_attach(int prog, int map, enum bpf_attach_type type) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd = (uint32_t)map;
+    attr.attach_bpf_fd = (uint32_t)prog;
+    attr.attach_type = type;
+    return sys_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+#define INSN(c, d, s, o, i) { (uint8_t)(c), (uint8_t)(d), (uint8_t)(s), (int16_t)(o), (int32_t)(i) }
+#define MOV64_REG(d, s)     INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)     INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)     INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define LD_MAP_FD(d, fd)    INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define LDX_W(d, s, o)      INSN(BPF_LDX | BPF_W | BPF_MEM, d, s, o, 0)
+#define STX_DW(d, s, o)     INSN(BPF_STX | BPF_DW | BPF_MEM, d, s, o, 0)
+#define JEQ_IMM(d, i, o)    INSN(BPF_JMP | BPF_JEQ | BPF_K, d, 0, o, i)
+#define CALL(f)             INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()              INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static int load_verdict(int sock_map, int peer_map) {
+    const struct bpf_insn insns[] = {
+        MOV64_REG(BPF_REG_6, BPF_REG_1),
+        CALL(BPF_FUNC_get_socket_cookie),
+        STX_DW(BPF_REG_10, BPF_REG_0, -8),
+        LD_MAP_FD(BPF_REG_1, peer_map),
+        MOV64_REG(BPF_REG_2, BPF_REG_10),
+        ADD64_IMM(BPF_REG_2, -8),
+        CALL(BPF_FUNC_map_lookup_elem),
+        JEQ_IMM(BPF_REG_0, 0, 7),
+        LDX_W(BPF_REG_3, BPF_REG_0, 0),
+        MOV64_REG(BPF_REG_1, BPF_REG_6),
+        LD_MAP_FD(BPF_REG_2, sock_map),
+        MOV64_IMM(BPF_REG_4, 0),
+        CALL(BPF_FUNC_sk_redirect_map),
+        EXIT(),
+        MOV64_IMM(BPF_REG_0, SK_PASS),
+        EXIT(),
+    };
+    return prog_load(insns, sizeof(insns) / sizeof(insns[0]));
+}
+
+/* Every segment is a message of its own. */
+static int load_parser(void) {
+    const struct bpf_insn insns[] = {
+        LDX_W(BPF_REG_0, BPF_REG_1, offsetof(struct __sk_buff, len)),
+        EXIT(),
+    };
+    return prog_load(insns, sizeof(insns) / sizeof(insns[0]));
+}
+
+struct sockmap_relay * sockmap_relay_create(size_t pairs) {
+    struct sockmap_relay *relay;
+    const char *what = NULL;
+
+    if (pairs == 0 || pairs > (UINT32_MAX / 2)) {
+        return NULL;
+    }
+    relay = (struct sockmap_relay *) calloc(1, sizeof(*relay));
+    relay->sock_map = relay->peer_map = relay->parser_prog = relay->verdict_prog = -1;
+    relay->pairs = pairs;
+    relay->cookies = (uint64_t *) calloc(pairs * 2, sizeof(relay->cookies[0]));
+
+    do {
+        relay->sock_map = map_create(BPF_MAP_TYPE_SOCKMAP, sizeof(uint32_t), sizeof(uint32_t), (unsigned int)(pairs * 2), 0);
+        if (relay->sock_map < 0) {
+            what = "socket map";
+            break;
+        }
+        // Only as large as the tunnels in it.
+        relay->peer_map = map_create(BPF_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(uint32_t), (unsigned int)(pairs * 2), BPF_F_NO_PREALLOC);
+        if (relay->peer_map < 0) {
+            what = "peer map";
+            break;
+        }
+        relay->verdict_prog = load_verdict(relay->sock_map, relay->peer_map);
+        if (relay->verdict_prog < 0) {
+            what = "verdict program";
+            break;
+        }
+        // Linux 5.13 and later take the verdict without a stream parser.
+        if (prog_attach(relay->verdict_prog, relay->sock_map, BPF_SK_SKB_VERDICT) == 0) {
+            return relay;
+        }
+        relay->parser_prog = load_parser();
+        if (relay->parser_prog < 0 ||
+            prog_attach(relay->parser_prog, relay->sock_map, BPF_SK_SKB_STREAM_PARSER) != 0 ||
+            prog_attach(relay->verdict_prog, relay->sock_map, BPF_SK_SKB_STREAM_VERDICT) != 0)
+        {
+            what = "stream programs";
+            break;
+        }
+        return relay;
+    } while (0);
+
+    pr_warn("sockmap relay: %s: %s", what, strerror(errno));
+    sockmap_relay_destroy(relay);
+    return NULL;
+}
+
+void sockmap_relay_destroy(struct sockmap_relay *relay) {
+    if (relay == NULL) {
+        return;
+    }
+    // Closing the map takes the sockets out, the programs go with it.
+    if (relay->sock_map >= 0) {
+        close(relay->sock_map);
+    }
+    if (relay->peer_map >= 0) {
+        close(relay->peer_map);
+    }
+    if (relay->verdict_prog >= 0) {
+        close(relay->verdict_prog);
+    }
+    if (relay->parser_prog >= 0) {
+        close(relay->parser_prog);
+    }
+    free(relay->cookies);
+    free(relay);
+}
+
+static uint64_t socket_cookie(int fd) {
+    uint64_t cookie = 0;
+    socklen_t len = sizeof(cookie);
+    if (getsockopt(fd, SOL_SOCKET, SO_COOKIE, &cookie, &len) != 0) {
+        return 0;
+    }
+    return cookie;
+}
+
+int sockmap_relay_add(struct sockmap_relay *relay, int fd_a, int fd_b) {
+    uint64_t cookie_a = socket_cookie(fd_a), cookie_b = socket_cookie(fd_b);
+    uint32_t index_a, index_b, value;
+    size_t n, pair;
+
+    if (cookie_a == 0 || cookie_b == 0) {
+        return -1;
+    }
+    for (n = 0; n < relay->pairs; ++n) {
+        pair = (relay->next + n) % relay->pairs;
+        if (relay->cookies[pair * 2] == 0) {
+            break;
+        }
+    }
+    if (n == relay->pairs) {
+        return -1;
+    }
+    relay->next = (pair + 1) % relay->pairs;
+    index_a = (uint32_t)(pair * 2);
+    index_b = index_a + 1;
+
+    // In this order |fd_a| is forwarded from its first segment on, only what
+    // |fd_b| gets until its peer is set stays with it.
+    value = (uint32_t)fd_b;
+    if (map_update(relay->sock_map, &index_b, &value) != 0) {
+        return -1;
+    }
+    if (map_update(relay->peer_map, &cookie_a, &index_b) != 0) {
+        map_delete(relay->sock_map, &index_b);
+        return -1;
+    }
+    value = (uint32_t)fd_a;
+    if (map_update(relay->sock_map, &index_a, &value) != 0 ||
+        map_update(relay->peer_map, &cookie_b, &index_a) != 0)
+    {
+        map_delete(relay->peer_map, &cookie_a);
+        map_delete(relay->sock_map, &index_a);
+        map_delete(relay->sock_map, &index_b);
+        return -1;
+    }
+    relay->cookies[index_a] = cookie_a;
+    relay->cookies[index_b] = cookie_b;
+    return (int)pair;
+}
+
+void sockmap_relay_remove(struct sockmap_relay *relay, int pair) {
+    uint32_t index;
+    if (relay == NULL || pair < 0 || (size_t)pair >= relay->pairs) {
+        return;
+    }
+    for (index = (uint32_t)pair * 2; index < (uint32_t)pair * 2 + 2; ++index) {
+        if (relay->cookies[index]) {
+            map_delete(relay->peer_map, &relay->cookies[index]);
+            map_delete(relay->sock_map, &index);
+            relay->cookies[index] = 0;
+        }
+    }
+}
+
+int sockmap_relay_socket_bytes(int fd, uint64_t *received, uint64_t *written) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int queued = 0;
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+        len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received) ||
+        ioctl(fd, SIOCOUTQ, &queued) != 0)
+    {
+        return -1;
+    }
+    *received = info.tcpi_bytes_received;
+    *written = info.tcpi_bytes_acked + (uint64_t)queued;
+    return 0;
+}
+
+#else
+
+struct sockmap_relay * sockmap_relay_create(size_t pairs) {
+    (void)pairs;
+    return NULL;
+}
+
+void sockmap_relay_destroy(struct sockmap_relay *relay) {
+    (void)relay;
+}
+
+int sockmap_relay_add(struct sockmap_relay *relay, int fd_a, int fd_b) {
+    (void)relay; (void)fd_a; (void)fd_b;
+    return -1;
+}
+
+void sockmap_relay_remove(struct sockmap_relay *relay, int pair) {
+    (void)relay; (void)pair;
+}
+
+int sockmap_relay_socket_bytes(int fd, uint64_t *received, uint64_t *written) {
+    (void)fd; (void)received; (void)written;
+    return -1;
+}
+
+#endif // defined(__linux__)
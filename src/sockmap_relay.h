@@ -0,0 +1,30 @@
+#if !defined(__sockmap_relay_h__)
+#define __sockmap_relay_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Kernel forwarding between pairs of TCP sockets. Both of a pair go into
+ * a BPF sockmap whose sk_skb verdict program redirects every segment to
+ * the other one's send queue, the bytes never reach user space. Linux
+ * with CAP_BPF (or CAP_SYS_ADMIN) only. Not thread safe: one per uv_loop_t.
+ */
+
+struct sockmap_relay;
+
+/* Room for |pairs| pairs, NULL where the kernel refuses the maps or programs. */
+struct sockmap_relay * sockmap_relay_create(size_t pairs);
+/* The sockets still in it go back to normal. */
+void sockmap_relay_destroy(struct sockmap_relay *relay);
+/*
+ * Forwards |fd_a| and |fd_b| to each other, both must have nothing
+ * received and unread. The pair's index, -1 when it's full or failed.
+ */
+int sockmap_relay_add(struct sockmap_relay *relay, int fd_a, int fd_b);
+void sockmap_relay_remove(struct sockmap_relay *relay, int pair);
+
+/* Bytes |fd| received, and was given to send, acknowledged or queued. 0 on success. */
+int sockmap_relay_socket_bytes(int fd, uint64_t *received, uint64_t *written);
+
+#endif // !defined(__sockmap_relay_h__)
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#elif !defined(_WIN32)
+#include <malloc.h>
+#endif
+#include <libcork/core.h>
+#include "ssr_alloc.h"
+
+#if defined(_MSC_VER)
+#define ALLOC_THREAD_LOCAL __declspec(thread)
+#else
+#define ALLOC_THREAD_LOCAL __thread
+#endif
+
+/* One per thread that ever allocated, kept past the thread's end: what it
+ * allocated may be freed by another, the two only add up together. */
+struct alloc_counters {
+    int64_t bytes[ssr_alloc_kind_max];
+    uint64_t allocations[ssr_alloc_kind_max];
+    int64_t census_live[ssr_census_kind_max];
+    int64_t census_bytes[ssr_census_kind_max];
+    struct alloc_counters *next;
+};
+
+static ALLOC_THREAD_LOCAL struct alloc_counters *own_counters = NULL;
+static struct alloc_counters *all_counters = NULL;
+static uv_mutex_t all_counters_lock;
+static uv_once_t all_counters_once = UV_ONCE_INIT;
+
+static const char *kind_names[ssr_alloc_kind_max] = {
+    "buffers",
+    "tunnels",
+    "obfs",
+    "dns",
+    "acl",
+    "other",
+};
+
+static const char *census_names[ssr_census_kind_max] = {
+    "tunnels",
+    "udp_remotes",
+    "dns_entries",
+    "cache_entries",
+    "pool_blocks",
+};
+
+static void all_counters_init(void) {
+    uv_mutex_init(&all_counters_lock);
+}
+
+static struct alloc_counters * thread_counters(void) {
+    struct alloc_counters *counters = own_counters;
+    if (counters == NULL) {
+        // Of the C library's, the one allocation the counts leave out.
+        counters = (struct alloc_counters *) calloc(1, sizeof(*counters));
+        if (counters == NULL) {
+            return NULL;
+        }
+        uv_once(&all_counters_once, all_counters_init);
+        uv_mutex_lock(&all_counters_lock);
+        counters->next = all_counters;
+        all_counters = counters;
+        uv_mutex_unlock(&all_counters_lock);
+        own_counters = counters;
+    }
+    return counters;
+}
+
+static size_t block_size(void *ptr) {
+#if defined(_WIN32)
+    return _msize(ptr);
+#elif defined(__APPLE__)
+    return malloc_size(ptr);
+#else
+    return malloc_usable_size(ptr);
+#endif
+}
+
+static void count_alloc(enum ssr_alloc_kind kind, void *ptr) {
+    struct alloc_counters *counters;
+    if (ptr && (counters = thread_counters())) {
+        counters->bytes[kind] += (int64_t) block_size(ptr);
+        counters->allocations[kind]++;
+    }
+}
+
+static void count_free(enum ssr_alloc_kind kind, void *ptr) {
+    struct alloc_counters *counters;
+    if (ptr && (counters = thread_counters())) {
+        counters->bytes[kind] -= (int64_t) block_size(ptr);
+    }
+}
+
+void * ssr_malloc(enum ssr_alloc_kind kind, size_t size) {
+    void *ptr = malloc(size);
+    count_alloc(kind, ptr);
+    return ptr;
+}
+
+void * ssr_calloc(enum ssr_alloc_kind kind, size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    count_alloc(kind, ptr);
+    return ptr;
+}
+
+void * ssr_realloc(enum ssr_alloc_kind kind, void *ptr, size_t size) {
+    size_t old_size = ptr ? block_size(ptr) : 0;
+    void *result = realloc(ptr, size);
+    struct alloc_counters *counters;
+    if (result && (counters = thread_counters())) {
+        counters->bytes[kind] += (int64_t) block_size(result) - (int64_t) old_size;
+        if (ptr == NULL) {
+            counters->allocations[kind]++;
+        }
+    }
+    return result;
+}
+
+char * ssr_strdup(enum ssr_alloc_kind kind, const char *s) {
+    size_t size = strlen(s) + 1;
+    char *copy = (char *) ssr_malloc(kind, size);
+    if (copy) {
+        memcpy(copy, s, size);
+    }
+    return copy;
+}
+
+void ssr_free(enum ssr_alloc_kind kind, void *ptr) {
+    count_free(kind, ptr);
+    free(ptr);
+}
+
+void ssr_alloc_get_stats(struct ssr_alloc_stats stats[ssr_alloc_kind_max]) {
+    struct alloc_counters *counters;
+    int kind;
+
+    memset(stats, 0, sizeof(stats[0]) * ssr_alloc_kind_max);
+    uv_once(&all_counters_once, all_counters_init);
+    uv_mutex_lock(&all_counters_lock);
+    for (counters = all_counters; counters; counters = counters->next) {
+        for (kind = 0; kind < ssr_alloc_kind_max; ++kind) {
+            // Read while the owner writes them, a sample a few blocks off.
+            stats[kind].bytes += ((volatile int64_t *)counters->bytes)[kind];
+            stats[kind].allocations += ((volatile uint64_t *)counters->allocations)[kind];
+        }
+    }
+    uv_mutex_unlock(&all_counters_lock);
+}
+
+const char * ssr_alloc_kind_name(enum ssr_alloc_kind kind) {
+    return (kind >= 0 && kind < ssr_alloc_kind_max) ? kind_names[kind] : "unknown";
+}
+
+const char * ssr_alloc_backend(void) {
+#if defined(SSR_ALLOCATOR_MIMALLOC)
+    return "mimalloc";
+#elif defined(SSR_ALLOCATOR_JEMALLOC)
+    return "jemalloc";
+#else
+    return "system";
+#endif
+}
+
+void ssr_census_add(enum ssr_census_kind kind, size_t bytes) {
+    struct alloc_counters *counters = thread_counters();
+    if (counters) {
+        counters->census_live[kind]++;
+        counters->census_bytes[kind] += (int64_t) bytes;
+    }
+}
+
+void ssr_census_remove(enum ssr_census_kind kind, size_t bytes) {
+    struct alloc_counters *counters = thread_counters();
+    if (counters) {
+        counters->census_live[kind]--;
+        counters->census_bytes[kind] -= (int64_t) bytes;
+    }
+}
+
+void ssr_census_get_stats(struct ssr_census_stats stats[ssr_census_kind_max]) {
+    struct alloc_counters *counters;
+    int kind;
+
+    memset(stats, 0, sizeof(stats[0]) * ssr_census_kind_max);
+    uv_once(&all_counters_once, all_counters_init);
+    uv_mutex_lock(&all_counters_lock);
+    for (counters = all_counters; counters; counters = counters->next) {
+        for (kind = 0; kind < ssr_census_kind_max; ++kind) {
+            stats[kind].live += ((volatile int64_t *)counters->census_live)[kind];
+            stats[kind].bytes += ((volatile int64_t *)counters->census_bytes)[kind];
+        }
+    }
+    uv_mutex_unlock(&all_counters_lock);
+}
+
+const char * ssr_census_kind_name(enum ssr_census_kind kind) {
+    return (kind >= 0 && kind < ssr_census_kind_max) ? census_names[kind] : "unknown";
+}
+
+static void * cork_shim_calloc(const struct cork_alloc *alloc, size_t count, size_t size) {
+    (void)alloc;
+    return ssr_calloc(ssr_alloc_acl, count, size);
+}
+
+static void * cork_shim_malloc(const struct cork_alloc *alloc, size_t size) {
+    (void)alloc;
+    return ssr_malloc(ssr_alloc_acl, size);
+}
+
+static void * cork_shim_realloc(const struct cork_alloc *alloc, void *ptr, size_t old_size, size_t new_size) {
+    (void)alloc; (void)old_size;
+    return ssr_realloc(ssr_alloc_acl, ptr, new_size);
+}
+
+static void cork_shim_free(const struct cork_alloc *alloc, void *ptr, size_t size) {
+    (void)alloc; (void)size;
+    ssr_free(ssr_alloc_acl, ptr);
+}
+
+void ssr_alloc_install_cork(void) {
+    struct cork_alloc *alloc = cork_alloc_new_alloc(cork_allocator);
+    // Only the x variants, libcork aborts for the others when they fail.
+    cork_alloc_set_xcalloc(alloc, cork_shim_calloc);
+    cork_alloc_set_xmalloc(alloc, cork_shim_malloc);
+    cork_alloc_set_xrealloc(alloc, cork_shim_realloc);
+    cork_alloc_set_free(alloc, cork_shim_free);
+    cork_set_allocator(alloc);
+}
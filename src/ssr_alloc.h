@@ -0,0 +1,75 @@
+#if !defined(__ssr_alloc_h__)
+#define __ssr_alloc_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Where the process's memory comes from. ssr_malloc() and the rest call
+ * the C library's, which a build with SSR_ALLOCATOR set to mimalloc or
+ * jemalloc replaces for the whole process, libuv, libcork and mbedTLS
+ * included, so a block from any of them may go to any free(). Both keep
+ * per-thread heaps, the workers don't take one lock for every buffer.
+ * Each call names what the memory is for, and the bytes held are counted
+ * per subsystem in the calling thread, summed for the metrics. A block
+ * freed through free() and not ssr_free() is only missing from the count.
+ */
+
+enum ssr_alloc_kind {
+    ssr_alloc_buffers,
+    ssr_alloc_tunnels,
+    ssr_alloc_obfs,
+    ssr_alloc_dns,
+    ssr_alloc_acl,  /* libcork, for libipset's sets. */
+    ssr_alloc_other,
+    ssr_alloc_kind_max,
+};
+
+struct ssr_alloc_stats {
+    int64_t bytes;  /* Held now, as the allocator sized the blocks. */
+    uint64_t allocations;  /* Ever. */
+};
+
+void * ssr_malloc(enum ssr_alloc_kind kind, size_t size);
+void * ssr_calloc(enum ssr_alloc_kind kind, size_t count, size_t size);
+void * ssr_realloc(enum ssr_alloc_kind kind, void *ptr, size_t size);
+char * ssr_strdup(enum ssr_alloc_kind kind, const char *s);
+void ssr_free(enum ssr_alloc_kind kind, void *ptr);
+
+/* Every thread's counts added up, |stats| indexed by ssr_alloc_kind. */
+void ssr_alloc_get_stats(struct ssr_alloc_stats stats[ssr_alloc_kind_max]);
+const char * ssr_alloc_kind_name(enum ssr_alloc_kind kind);
+/* "system", "mimalloc" or "jemalloc", what the build linked. */
+const char * ssr_alloc_backend(void);
+/* libcork's allocations through the shim. Before anything uses libcork. */
+void ssr_alloc_install_cork(void);
+
+/*
+ * A census of the objects most likely to pile up when memory creeps:
+ * each is counted where it's created and where it's freed, in the
+ * calling thread's counters like the bytes above, and summed on demand.
+ * |bytes| is what the object holds by itself, a tunnel's block or a cache
+ * entry's key, not what hangs off it.
+ */
+
+enum ssr_census_kind {
+    ssr_census_tunnels,  /* tunnel_ctx, with its sockets and owner's context. */
+    ssr_census_udp_remotes,  /* udp_remote_ctx_t, one per UDP association. */
+    ssr_census_dns_entries,  /* Resolved addresses in the DNS caches, failures included. */
+    ssr_census_cache_entries,  /* Of every cache.c cache, the DNS caches' among them. */
+    ssr_census_pool_blocks,  /* Of the buffer pools, lent out or cached. */
+    ssr_census_kind_max,
+};
+
+struct ssr_census_stats {
+    int64_t live;
+    int64_t bytes;
+};
+
+void ssr_census_add(enum ssr_census_kind kind, size_t bytes);
+void ssr_census_remove(enum ssr_census_kind kind, size_t bytes);
+/* Every thread's counts added up, |stats| indexed by ssr_census_kind. */
+void ssr_census_get_stats(struct ssr_census_stats stats[ssr_census_kind_max]);
+const char * ssr_census_kind_name(enum ssr_census_kind kind);
+
+#endif // !defined(__ssr_alloc_h__)
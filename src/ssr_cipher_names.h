@@ -15,6 +15,7 @@
 // enum ss_cipher_type
 //
 // code, name, text, iv_size, key_size
+// iv_size is the salt size of the AEAD methods, from aes-128-gcm on.
 //
 #define SS_CIPHER_MAP(V)                                                       \
     V( 0, ss_cipher_none,              "none",              0, 16)             \
@@ -40,6 +41,10 @@
     V(20, ss_cipher_salsa20,           "salsa20",           8, 32)             \
     V(21, ss_cipher_chacha20,          "chacha20",          8, 32)             \
     V(22, ss_cipher_chacha20ietf,      "chacha20-ietf",    12, 32)             \
+    V(23, ss_cipher_aes_128_gcm,       "aes-128-gcm",      16, 16)             \
+    V(24, ss_cipher_aes_256_gcm,       "aes-256-gcm",      32, 32)             \
+    V(25, ss_cipher_chacha20ietf_poly1305, "chacha20-ietf-poly1305", 32, 32)   \
+    V(26, ss_cipher_xchacha20ietf_poly1305, "xchacha20-ietf-poly1305", 32, 32) \
 
 typedef enum ss_cipher_type {
 #define SS_CIPHER_GEN(code, name, text, iv_size, key_size) name = (code),
@@ -0,0 +1,624 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#if !defined(_WIN32)
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#include "ssr_cluster.h"
+#include "ppbloom.h"
+#include "ssr_replay_window.h"
+#include "ssr_user_table.h"
+#include "sockaddr_universal.h"
+#include "ssrbuffer.h"
+#include "encrypt.h"
+#include "dump_info.h"
+#include "common.h"
+
+#define CLUSTER_MAGIC           "SSRc"
+#define CLUSTER_VERSION         1
+#define CLUSTER_DATAGRAM_MAX    1400  /* Under a typical path MTU. */
+#define CLUSTER_HEADER_SIZE     24  /* Magic, version, kind, count, incarnation, sent_ms. */
+#define CLUSTER_MAC_SIZE        16  /* Of the HMAC-SHA1 over the rest, truncated. */
+#define CLUSTER_PAYLOAD_MAX     (CLUSTER_DATAGRAM_MAX - CLUSTER_HEADER_SIZE - CLUSTER_MAC_SIZE)
+#define CLUSTER_HASH_SIZE       16  /* h1, h2. */
+#define CLUSTER_ENTRY_SIZE      12  /* uid, client_id, connection_id. */
+#define CLUSTER_TOTAL_SIZE      12  /* uid, bytes. */
+
+enum cluster_kind {
+    cluster_kind_iv_hashes = 1,
+    cluster_kind_connection_ids = 2,
+    cluster_kind_user_totals = 3,
+};
+
+struct cluster_peer {
+    union sockaddr_universal addr;
+    bool self;  /* This node's own datagrams came back from it, nothing goes there. */
+    uint64_t incarnation;  /* 0 until it's heard. */
+    uint64_t last_ms;  /* sent_ms of the latest datagram it sent. */
+    uint64_t heard_at;  /* uv_hrtime() ms of it. */
+    uint64_t *totals;  /* By ssr_user.index, the latest it sent. */
+};
+
+/* A user's total as this round read it. */
+struct cluster_user {
+    uint32_t uid;
+    bool present;
+    uint64_t total;
+};
+
+struct ssr_cluster {
+    int fd;
+    uv_thread_t thread;
+    int stopping;
+    unsigned int interval;
+    char *key;
+    size_t key_len;
+    uint64_t incarnation;  /* Random, new with every start. */
+
+    struct ppbloom *filter;
+    struct ssr_replay_table *windows;
+    struct ssr_user_table *users;
+    size_t users_count;  /* Of ssr_user_table_indexes(), what the arrays by index have room for. */
+    struct cluster_user *round_users;  /* By ssr_user.index. */
+    uint64_t *sent_totals;  /* By ssr_user.index, what went out last. */
+    size_t sync_cursor;  /* Where the unchanged totals resent in spare room go on from. */
+
+    struct cluster_peer *peers;
+    size_t peers_count;
+
+    struct ppbloom_hash *hashes;
+    struct ssr_replay_entry *entries;
+    uint8_t out[CLUSTER_DATAGRAM_MAX];
+    size_t out_count;
+    uint8_t in[CLUSTER_DATAGRAM_MAX + 1];
+
+    uint64_t sent;
+    uint64_t received;
+    uint64_t rejected;
+    uint64_t dropped;
+};
+
+#if !defined(_WIN32)
+
+static uint8_t * cluster_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+    return p + 4;
+}
+
+static uint8_t * cluster_put64(uint8_t *p, uint64_t v) {
+    p = cluster_put32(p, (uint32_t)(v >> 32));
+    return cluster_put32(p, (uint32_t)v);
+}
+
+static uint32_t cluster_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t cluster_get64(const uint8_t *p) {
+    return ((uint64_t)cluster_get32(p) << 32) | cluster_get32(p + 4);
+}
+
+static uint64_t cluster_wall_ms(void) {
+    uv_timeval64_t now;
+    uv_gettimeofday(&now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_usec / 1000;
+}
+
+static void cluster_mac(const struct ssr_cluster *c, const uint8_t *data, size_t len, uint8_t mac[SHA1_BYTES]) {
+    BUFFER_CONSTANT_INSTANCE(msg, data, len);
+    BUFFER_CONSTANT_INSTANCE(key, c->key, c->key_len);
+    ss_sha1_hmac_with_key(mac, msg, key);
+}
+
+static bool cluster_same_address(const union sockaddr_universal *a, const union sockaddr_universal *b) {
+    if (a->addr.sa_family != b->addr.sa_family) {
+        return false;
+    }
+    if (a->addr.sa_family == AF_INET) {
+        return a->addr4.sin_port == b->addr4.sin_port &&
+            memcmp(&a->addr4.sin_addr, &b->addr4.sin_addr, sizeof(a->addr4.sin_addr)) == 0;
+    }
+    return a->addr6.sin6_port == b->addr6.sin6_port &&
+        memcmp(&a->addr6.sin6_addr, &b->addr6.sin6_addr, sizeof(a->addr6.sin6_addr)) == 0;
+}
+
+static bool cluster_parse_address(const char *host_port, union sockaddr_universal *addr) {
+    struct socks5_address s5addr;
+    memset(addr, 0, sizeof(*addr));
+    return socks5_address_from_host_port(host_port, &s5addr) &&
+        s5addr.addr_type != SOCKS5_ADDRTYPE_DOMAINNAME &&
+        socks5_address_to_universal(&s5addr, addr);
+}
+
+static void cluster_start_datagram(struct ssr_cluster *c, enum cluster_kind kind) {
+    uint8_t *p = c->out;
+    memcpy(p, CLUSTER_MAGIC, 4);
+    p[4] = CLUSTER_VERSION;
+    p[5] = (uint8_t)kind;
+    c->out_count = 0;
+}
+
+/* Signs the datagram of |c->out_count| entries of |entry_size| and sends it to every peer. */
+static void cluster_send_datagram(struct ssr_cluster *c, size_t entry_size) {
+    uint8_t mac[SHA1_BYTES];
+    size_t len = CLUSTER_HEADER_SIZE + c->out_count * entry_size;
+    size_t index;
+
+    c->out[6] = (uint8_t)(c->out_count >> 8);
+    c->out[7] = (uint8_t)c->out_count;
+    cluster_put64(c->out + 8, c->incarnation);
+    cluster_put64(c->out + 16, cluster_wall_ms());
+    cluster_mac(c, c->out, len, mac);
+    memcpy(c->out + len, mac, CLUSTER_MAC_SIZE);
+    len += CLUSTER_MAC_SIZE;
+
+    for (index = 0; index < c->peers_count; ++index) {
+        const struct cluster_peer *peer = &c->peers[index];
+        socklen_t addr_len = (peer->addr.addr.sa_family == AF_INET) ? sizeof(peer->addr.addr4) : sizeof(peer->addr.addr6);
+        if (peer->self) {
+            continue;
+        }
+        if (sendto(c->fd, c->out, len, MSG_DONTWAIT, &peer->addr.addr, addr_len) == (ssize_t)len) {
+            __sync_add_and_fetch(&c->sent, 1);
+        }
+    }
+    c->out_count = 0;
+}
+
+static void cluster_round_filter(struct ssr_cluster *c) {
+    const size_t per = CLUSTER_PAYLOAD_MAX / CLUSTER_HASH_SIZE;
+    uint64_t dropped = 0;
+    size_t count, index;
+
+    count = ppbloom_take_journal(c->filter, c->hashes, per * CLUSTER_ROUND_DATAGRAMS, &dropped);
+    cluster_start_datagram(c, cluster_kind_iv_hashes);
+    for (index = 0; index < count; ++index) {
+        uint8_t *p = c->out + CLUSTER_HEADER_SIZE + c->out_count * CLUSTER_HASH_SIZE;
+        p = cluster_put64(p, c->hashes[index].h1);
+        cluster_put64(p, c->hashes[index].h2);
+        if (++c->out_count == per || index + 1 == count) {
+            cluster_send_datagram(c, CLUSTER_HASH_SIZE);
+        }
+    }
+    __sync_add_and_fetch(&c->dropped, dropped);
+}
+
+static void cluster_round_windows(struct ssr_cluster *c) {
+    const size_t per = CLUSTER_PAYLOAD_MAX / CLUSTER_ENTRY_SIZE;
+    uint64_t dropped = 0;
+    size_t count, index;
+
+    count = ssr_replay_table_take_journal(c->windows, c->entries, per * CLUSTER_ROUND_DATAGRAMS, &dropped);
+    cluster_start_datagram(c, cluster_kind_connection_ids);
+    for (index = 0; index < count; ++index) {
+        uint8_t *p = c->out + CLUSTER_HEADER_SIZE + c->out_count * CLUSTER_ENTRY_SIZE;
+        p = cluster_put32(p, c->entries[index].uid);
+        p = cluster_put32(p, c->entries[index].client_id);
+        cluster_put32(p, c->entries[index].connection_id);
+        if (++c->out_count == per || index + 1 == count) {
+            cluster_send_datagram(c, CLUSTER_ENTRY_SIZE);
+        }
+    }
+    __sync_add_and_fetch(&c->dropped, dropped);
+}
+
+static void cluster_read_user_cb(const struct ssr_user *user, const struct ssr_user_usage *usage, void *p) {
+    struct ssr_cluster *c = (struct ssr_cluster *)p;
+    if (user->index < c->users_count) {
+        struct cluster_user *u = &c->round_users[user->index];
+        u->uid = user->uid;
+        u->present = true;
+        u->total = __sync_add_and_fetch((uint64_t *)&usage->traffic, 0);
+    }
+}
+
+/* Puts |index|'s total in the datagram, false once the round has no room left. */
+static bool cluster_add_total(struct ssr_cluster *c, size_t index, size_t *datagrams) {
+    const size_t per = CLUSTER_PAYLOAD_MAX / CLUSTER_TOTAL_SIZE;
+    uint8_t *p;
+    if (*datagrams == CLUSTER_ROUND_DATAGRAMS) {
+        return false;
+    }
+    p = c->out + CLUSTER_HEADER_SIZE + c->out_count * CLUSTER_TOTAL_SIZE;
+    p = cluster_put32(p, c->round_users[index].uid);
+    cluster_put64(p, c->round_users[index].total);
+    c->sent_totals[index] = c->round_users[index].total;
+    if (++c->out_count == per) {
+        cluster_send_datagram(c, CLUSTER_TOTAL_SIZE);
+        ++*datagrams;
+    }
+    return true;
+}
+
+/* Room by index for the users the manager added since, false without the memory for it. */
+static bool cluster_fit_users(struct ssr_cluster *c) {
+    size_t count = ssr_user_table_indexes(c->users), index;
+    struct cluster_user *round_users;
+    uint64_t *sent_totals;
+
+    if (count <= c->users_count) {
+        return true;
+    }
+    if ((round_users = (struct cluster_user *) realloc(c->round_users, count * sizeof(round_users[0]))) == NULL) {
+        return false;
+    }
+    c->round_users = round_users;
+    if ((sent_totals = (uint64_t *) realloc(c->sent_totals, count * sizeof(sent_totals[0]))) == NULL) {
+        return false;
+    }
+    memset(sent_totals + c->users_count, 0, (count - c->users_count) * sizeof(sent_totals[0]));
+    c->sent_totals = sent_totals;
+    for (index = 0; index < c->peers_count; ++index) {
+        struct cluster_peer *peer = &c->peers[index];
+        uint64_t *totals;
+        if (peer->totals == NULL) {
+            continue;
+        }
+        if ((totals = (uint64_t *) realloc(peer->totals, count * sizeof(totals[0]))) == NULL) {
+            return false;
+        }
+        memset(totals + c->users_count, 0, (count - c->users_count) * sizeof(totals[0]));
+        peer->totals = totals;
+    }
+    c->users_count = count;
+    return true;
+}
+
+/* The totals that moved, then in the room left the others in turn, for peers that missed them. */
+static void cluster_round_totals(struct ssr_cluster *c) {
+    size_t datagrams = 0, index, visited;
+
+    if (cluster_fit_users(c) == false || c->users_count == 0) {
+        return;
+    }
+
+    memset(c->round_users, 0, c->users_count * sizeof(c->round_users[0]));
+    ssr_user_table_traverse(c->users, cluster_read_user_cb, c);
+    cluster_start_datagram(c, cluster_kind_user_totals);
+    for (index = 0; index < c->users_count; ++index) {
+        const struct cluster_user *u = &c->round_users[index];
+        if (u->present && u->total != c->sent_totals[index]) {
+            if (cluster_add_total(c, index, &datagrams) == false) {
+                break;
+            }
+        }
+    }
+    for (visited = 0; visited < c->users_count && datagrams < CLUSTER_ROUND_DATAGRAMS; ++visited) {
+        index = c->sync_cursor;
+        c->sync_cursor = (c->sync_cursor + 1) % c->users_count;
+        if (c->round_users[index].present && c->round_users[index].total) {
+            if (cluster_add_total(c, index, &datagrams) == false) {
+                break;
+            }
+        }
+    }
+    if (c->out_count) {
+        cluster_send_datagram(c, CLUSTER_TOTAL_SIZE);
+    }
+}
+
+static void cluster_update_user(struct ssr_cluster *c, const struct ssr_user *user) {
+    uint64_t sum = 0;
+    size_t index;
+    for (index = 0; index < c->peers_count; ++index) {
+        if (c->peers[index].totals) {
+            sum += c->peers[index].totals[user->index];
+        }
+    }
+    ssr_user_table_set_cluster_traffic(c->users, user, sum);
+}
+
+static void cluster_update_user_cb(const struct ssr_user *user, const struct ssr_user_usage *usage, void *p) {
+    struct ssr_cluster *c = (struct ssr_cluster *)p;
+    (void)usage;
+    if (user->index < c->users_count) {
+        cluster_update_user(c, user);
+    }
+}
+
+static void cluster_receive_totals(struct ssr_cluster *c, struct cluster_peer *peer, const uint8_t *p, size_t count) {
+    size_t index;
+    if (cluster_fit_users(c) == false || c->users_count == 0) {
+        return;
+    }
+    if (peer->totals == NULL) {
+        peer->totals = (uint64_t *) calloc(c->users_count, sizeof(peer->totals[0]));
+    }
+    for (index = 0; index < count; ++index, p += CLUSTER_TOTAL_SIZE) {
+        const struct ssr_user *user = ssr_user_table_find(c->users, cluster_get32(p));
+        uint64_t total = cluster_get64(p + 4);
+        // Only ever up, a datagram from before another is no news.
+        if (user && user->index < c->users_count && total > peer->totals[user->index]) {
+            peer->totals[user->index] = total;
+            cluster_update_user(c, user);
+        }
+    }
+}
+
+static struct cluster_peer * cluster_find_peer(struct ssr_cluster *c, const union sockaddr_universal *from) {
+    size_t index;
+    for (index = 0; index < c->peers_count; ++index) {
+        if (cluster_same_address(&c->peers[index].addr, from)) {
+            return &c->peers[index];
+        }
+    }
+    return NULL;
+}
+
+/* False for a datagram that is no peer's, badly signed, stale or malformed. */
+static bool cluster_receive(struct ssr_cluster *c, size_t len, union sockaddr_universal *from) {
+    static const size_t entry_sizes[] = { 0, CLUSTER_HASH_SIZE, CLUSTER_ENTRY_SIZE, CLUSTER_TOTAL_SIZE };
+    uint8_t mac[SHA1_BYTES], diff = 0;
+    const uint8_t *p = c->in;
+    struct cluster_peer *peer;
+    uint64_t incarnation, sent_ms, now_ms;
+    size_t count, index;
+    uint8_t kind;
+
+    universal_address_unmap(from);
+    if ((peer = cluster_find_peer(c, from)) == NULL) {
+        return false;
+    }
+    if (len < CLUSTER_HEADER_SIZE + CLUSTER_MAC_SIZE || memcmp(p, CLUSTER_MAGIC, 4) != 0 || p[4] != CLUSTER_VERSION) {
+        return false;
+    }
+    kind = p[5];
+    count = ((size_t)p[6] << 8) | p[7];
+    if (kind == 0 || kind >= ARRAY_SIZE(entry_sizes) ||
+        CLUSTER_HEADER_SIZE + count * entry_sizes[kind] + CLUSTER_MAC_SIZE != len) {
+        return false;
+    }
+    cluster_mac(c, p, len - CLUSTER_MAC_SIZE, mac);
+    for (index = 0; index < CLUSTER_MAC_SIZE; ++index) {
+        diff |= (uint8_t)(mac[index] ^ p[len - CLUSTER_MAC_SIZE + index]);
+    }
+    if (diff) {
+        return false;
+    }
+    incarnation = cluster_get64(p + 8);
+    sent_ms = cluster_get64(p + 16);
+    if (incarnation == c->incarnation) {
+        peer->self = true;
+        return true;
+    }
+    now_ms = cluster_wall_ms();
+    if (sent_ms + CLUSTER_MAX_AGE_MS < now_ms || sent_ms > now_ms + CLUSTER_MAX_AGE_MS) {
+        return false;
+    }
+    if (peer->incarnation != incarnation) {
+        // Restarted, or a datagram from a life before the current one.
+        if (sent_ms <= peer->last_ms) {
+            return false;
+        }
+        peer->incarnation = incarnation;
+        if (peer->totals) {
+            memset(peer->totals, 0, c->users_count * sizeof(peer->totals[0]));
+            ssr_user_table_traverse(c->users, cluster_update_user_cb, c);
+        }
+    }
+    if (sent_ms > peer->last_ms) {
+        peer->last_ms = sent_ms;
+    }
+    __atomic_store_n(&peer->heard_at, uv_hrtime() / 1000000, __ATOMIC_RELAXED);
+
+    p += CLUSTER_HEADER_SIZE;
+    switch (kind) {
+    case cluster_kind_iv_hashes:
+        for (index = 0; index < count; ++index, p += CLUSTER_HASH_SIZE) {
+            c->hashes[index].h1 = cluster_get64(p);
+            c->hashes[index].h2 = cluster_get64(p + 8);
+        }
+        ppbloom_merge(c->filter, c->hashes, count);
+        break;
+    case cluster_kind_connection_ids:
+        for (index = 0; index < count; ++index, p += CLUSTER_ENTRY_SIZE) {
+            c->entries[index].uid = cluster_get32(p);
+            c->entries[index].client_id = cluster_get32(p + 4);
+            c->entries[index].connection_id = cluster_get32(p + 8);
+        }
+        ssr_replay_table_merge(c->windows, c->entries, count);
+        break;
+    case cluster_kind_user_totals:
+        cluster_receive_totals(c, peer, p, count);
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+static void cluster_drain(struct ssr_cluster *c) {
+    for (;;) {
+        union sockaddr_universal from;
+        socklen_t from_len = sizeof(from);
+        ssize_t len = recvfrom(c->fd, c->in, sizeof(c->in), MSG_DONTWAIT, &from.addr, &from_len);
+        if (len < 0) {
+            break;
+        }
+        __sync_add_and_fetch(&c->received, 1);
+        if (cluster_receive(c, (size_t)len, &from) == false) {
+            __sync_add_and_fetch(&c->rejected, 1);
+        }
+    }
+}
+
+static void cluster_thread(void *arg) {
+    struct ssr_cluster *c = (struct ssr_cluster *)arg;
+    uint64_t next = 0;
+
+    while (__atomic_load_n(&c->stopping, __ATOMIC_ACQUIRE) == 0) {
+        struct pollfd pfd;
+        uint64_t now = uv_hrtime() / 1000000;
+        if (now >= next) {
+            uint64_t sent = __sync_add_and_fetch(&c->sent, 0);
+            if (c->filter) {
+                cluster_round_filter(c);
+            }
+            if (c->windows) {
+                cluster_round_windows(c);
+            }
+            if (c->users) {
+                cluster_round_totals(c);
+            }
+            if (__sync_add_and_fetch(&c->sent, 0) == sent) {
+                // Nothing to tell, an empty one still counts the node as heard.
+                cluster_start_datagram(c, cluster_kind_user_totals);
+                cluster_send_datagram(c, CLUSTER_TOTAL_SIZE);
+            }
+            next = now + c->interval;
+            now = uv_hrtime() / 1000000;
+        }
+        pfd.fd = c->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, (now < next) ? (int)(next - now) : 0) > 0) {
+            cluster_drain(c);
+        }
+    }
+}
+
+/* The peers of |list|, false with the reason logged for one that isn't a literal host:port. */
+static bool cluster_parse_peers(struct ssr_cluster *c, const char *list, int family) {
+    char *copy = strdup(list), *token, *saveptr = NULL;
+    bool ok = true;
+
+    c->peers = (struct cluster_peer *) calloc(CLUSTER_PEERS_MAX, sizeof(c->peers[0]));
+    for (token = strtok_r(copy, ", ", &saveptr); token; token = strtok_r(NULL, ", ", &saveptr)) {
+        struct cluster_peer *peer = &c->peers[c->peers_count];
+        if (c->peers_count == CLUSTER_PEERS_MAX) {
+            pr_err("cluster_peers: more than %d", CLUSTER_PEERS_MAX);
+            ok = false;
+            break;
+        }
+        if (cluster_parse_address(token, &peer->addr) == false || peer->addr.addr.sa_family != family) {
+            pr_err("cluster_peers: %s is not an address:port of the family of cluster_listen", token);
+            ok = false;
+            break;
+        }
+        c->peers_count++;
+    }
+    free(copy);
+    return ok && c->peers_count > 0;
+}
+
+struct ssr_cluster * ssr_cluster_create(const struct ssr_cluster_options *options,
+    struct ppbloom *filter, struct ssr_replay_table *windows, struct ssr_user_table *users)
+{
+    union sockaddr_universal listen_addr;
+    struct ssr_cluster *c;
+    socklen_t addr_len;
+
+    if (options == NULL || options->listen == NULL) {
+        return NULL;
+    }
+    if (options->peers == NULL || options->key == NULL || options->key[0] == '\0') {
+        pr_err("cluster_listen needs cluster_peers and cluster_key");
+        return NULL;
+    }
+    if (cluster_parse_address(options->listen, &listen_addr) == false) {
+        pr_err("cluster_listen %s is not an address:port", options->listen);
+        return NULL;
+    }
+    c = (struct ssr_cluster *) calloc(1, sizeof(*c));
+    c->fd = -1;
+    if (cluster_parse_peers(c, options->peers, listen_addr.addr.sa_family) == false) {
+        goto fail;
+    }
+    addr_len = (listen_addr.addr.sa_family == AF_INET) ? sizeof(listen_addr.addr4) : sizeof(listen_addr.addr6);
+    if ((c->fd = socket(listen_addr.addr.sa_family, SOCK_DGRAM, 0)) < 0 ||
+        bind(c->fd, &listen_addr.addr, addr_len) != 0)
+    {
+        pr_err("cluster_listen %s: %s", options->listen, strerror(errno));
+        goto fail;
+    }
+    c->interval = options->interval ? options->interval : CLUSTER_DEFAULT_INTERVAL_MS;
+    c->key = strdup(options->key);
+    c->key_len = strlen(options->key);
+    rand_bytes((uint8_t *)&c->incarnation, sizeof(c->incarnation));
+    c->filter = filter;
+    c->windows = windows;
+    c->users = users;
+    c->hashes = (struct ppbloom_hash *) calloc(CLUSTER_PAYLOAD_MAX / CLUSTER_HASH_SIZE * CLUSTER_ROUND_DATAGRAMS, sizeof(c->hashes[0]));
+    c->entries = (struct ssr_replay_entry *) calloc(CLUSTER_PAYLOAD_MAX / CLUSTER_ENTRY_SIZE * CLUSTER_ROUND_DATAGRAMS, sizeof(c->entries[0]));
+    // A round's worth between rounds, what comes in faster is dropped.
+    ppbloom_journal(filter, CLUSTER_PAYLOAD_MAX / CLUSTER_HASH_SIZE * CLUSTER_ROUND_DATAGRAMS);
+    ssr_replay_table_journal(windows, CLUSTER_PAYLOAD_MAX / CLUSTER_ENTRY_SIZE * CLUSTER_ROUND_DATAGRAMS);
+    VERIFY(0 == uv_thread_create(&c->thread, cluster_thread, c));
+    return c;
+
+fail:
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    free(c->peers);
+    free(c);
+    return NULL;
+}
+
+void ssr_cluster_destroy(struct ssr_cluster *cluster) {
+    size_t index;
+    if (cluster == NULL) {
+        return;
+    }
+    __atomic_store_n(&cluster->stopping, 1, __ATOMIC_RELEASE);
+    uv_thread_join(&cluster->thread);
+    ppbloom_journal(cluster->filter, 0);
+    ssr_replay_table_journal(cluster->windows, 0);
+    close(cluster->fd);
+    for (index = 0; index < cluster->peers_count; ++index) {
+        free(cluster->peers[index].totals);
+    }
+    free(cluster->peers);
+    free(cluster->round_users);
+    free(cluster->sent_totals);
+    free(cluster->hashes);
+    free(cluster->entries);
+    free(cluster->key);
+    free(cluster);
+}
+
+void ssr_cluster_get_stats(struct ssr_cluster *cluster, struct ssr_cluster_stats *stats) {
+    uint64_t now = uv_hrtime() / 1000000;
+    size_t index;
+    memset(stats, 0, sizeof(*stats));
+    if (cluster == NULL) {
+        return;
+    }
+    stats->sent = __sync_add_and_fetch(&cluster->sent, 0);
+    stats->received = __sync_add_and_fetch(&cluster->received, 0);
+    stats->rejected = __sync_add_and_fetch(&cluster->rejected, 0);
+    stats->dropped = __sync_add_and_fetch(&cluster->dropped, 0);
+    for (index = 0; index < cluster->peers_count; ++index) {
+        uint64_t heard_at = __atomic_load_n(&cluster->peers[index].heard_at, __ATOMIC_RELAXED);
+        if (heard_at && now - heard_at < (uint64_t)cluster->interval * CLUSTER_SILENT_ROUNDS) {
+            stats->peers_heard++;
+        }
+    }
+}
+
+#else
+
+struct ssr_cluster * ssr_cluster_create(const struct ssr_cluster_options *options,
+    struct ppbloom *filter, struct ssr_replay_table *windows, struct ssr_user_table *users)
+{
+    (void)filter; (void)windows; (void)users;
+    if (options && options->listen) {
+        pr_err("cluster_listen is not supported on this platform");
+    }
+    return NULL;
+}
+
+void ssr_cluster_destroy(struct ssr_cluster *cluster) {
+    (void)cluster;
+}
+
+void ssr_cluster_get_stats(struct ssr_cluster *cluster, struct ssr_cluster_stats *stats) {
+    (void)cluster;
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif // !defined(_WIN32)
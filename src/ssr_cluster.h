@@ -0,0 +1,70 @@
+#if !defined(__ssr_cluster_h__)
+#define __ssr_cluster_h__ 1
+
+#include <stdint.h>
+
+/*
+ * The nodes of one service behind DNS round-robin, where a client may land
+ * on any of them, share what keeps a user honest across them. Every
+ * cluster_interval ms a thread of its own sends each peer in cluster_peers,
+ * over UDP and signed with cluster_key:
+ *
+ *   - the hashes of the IVs the replay filter took since the last round
+ *     (see ppbloom_journal()), or with auth_chain and auth_aes128 the
+ *     connection ids the replay windows accepted;
+ *   - the running byte totals of the users whose total moved, and in the
+ *     room left those of the others in turn, for peers that missed them.
+ *
+ * A node adds what it hears to its own filter or windows, and keeps each
+ * peer's latest total per user: their sum counts against the user's quota
+ * with its own, see ssr_user_usage.cluster_traffic. Totals only grow, so
+ * a lost or reordered datagram is made good by a later one; a peer that
+ * restarts announces a new incarnation and its totals start over. It is
+ * eventually consistent, a replay or a quota overrun can get through
+ * within a round or two. A round with nothing to tell sends an empty
+ * datagram, so peers_heard tells a quiet peer from a gone one.
+ *
+ * Each kind goes out in at most CLUSTER_ROUND_DATAGRAMS datagrams per peer
+ * and round; what the journals can't hold by then is dropped and counted,
+ * user totals left out wait for the next round. The loops only append to
+ * the journals under the locks they take anyway.
+ */
+
+#define CLUSTER_DEFAULT_INTERVAL_MS 250
+#define CLUSTER_ROUND_DATAGRAMS     16
+#define CLUSTER_SILENT_ROUNDS       40  /* A peer not heard from for as long isn't counted in peers_heard. */
+#define CLUSTER_MAX_AGE_MS          30000  /* Datagrams sent longer ago, or that far ahead, are ignored. */
+#define CLUSTER_PEERS_MAX           256
+
+struct ppbloom;
+struct ssr_replay_table;
+struct ssr_user_table;
+struct ssr_cluster;
+
+struct ssr_cluster_options {
+    const char *listen;  /* host:port, a literal address. */
+    const char *peers;  /* Comma separated host:port, this node's own may be among them. */
+    const char *key;
+    unsigned int interval;  /* Ms, 0 for CLUSTER_DEFAULT_INTERVAL_MS. */
+};
+
+struct ssr_cluster_stats {
+    uint64_t sent;  /* Datagrams. */
+    uint64_t received;
+    uint64_t rejected;  /* From no peer, badly signed, stale or malformed. */
+    uint64_t dropped;  /* Journal entries that never went out. */
+    uint64_t peers_heard;
+};
+
+/*
+ * Starts the thread, journaling on |filter| or |windows|, either may be
+ * NULL, and sharing the totals of |users| if it has any. NULL, the reason
+ * logged, when the options don't make a cluster.
+ */
+struct ssr_cluster * ssr_cluster_create(const struct ssr_cluster_options *options,
+    struct ppbloom *filter, struct ssr_replay_table *windows, struct ssr_user_table *users);
+/* Before |filter|, |windows| and |users| go. */
+void ssr_cluster_destroy(struct ssr_cluster *cluster);
+void ssr_cluster_get_stats(struct ssr_cluster *cluster, struct ssr_cluster_stats *stats);
+
+#endif // !defined(__ssr_cluster_h__)
@@ -40,6 +40,35 @@
 #include "obfs.h"
 #include "crc32.h"
 #include "cstl_lib.h"
+#include "buffer_pool.h"
+#include "tunnel_stats.h"
+#include "handle_table.h"
+#include "tunnel_trace.h"
+#include "tunnel_shape.h"
+#include "ssr_user_table.h"
+#include "ssr_replay_window.h"
+#include "dns_cache.h"
+#include "heavy_hitters.h"
+#include "kcp_transport.h"
+
+#if defined(SSR_STAGE_TIMING)
+/* Runs |statement| and adds its time to |stage| of the tunnel's protocol and obfs. */
+#define TUNNEL_CIPHER_STAGE(tc, stage, statement) do {                          \
+        uint64_t stage_begin = uv_hrtime();                                     \
+        statement;                                                              \
+        tunnel_cipher_stage_add((tc), (stage), stage_begin);                    \
+    } while (0)
+
+/* Atomic, crypto_workers run the ciphers of a loop's tunnels off it. */
+static void tunnel_cipher_stage_add(const struct tunnel_cipher_ctx *tc, enum tunnel_cipher_stage stage, uint64_t begin) {
+    if (tc->stage_times) {
+        __sync_add_and_fetch(&tc->stage_times->nsec[stage], uv_hrtime() - begin);
+        __sync_add_and_fetch(&tc->stage_times->calls[stage], 1);
+    }
+}
+#else
+#define TUNNEL_CIPHER_STAGE(tc, stage, statement) do { statement; } while (0)
+#endif
 
 const char * ssr_strerror(enum ssr_error err) {
 #define SSR_ERR_GEN(_, name, errmsg) case (name): return errmsg;
@@ -75,6 +104,32 @@ struct server_config * config_create(void) {
     string_safe_assign(&config->method, DEFAULT_METHOD);
     config->listen_port = DEFAULT_BIND_PORT;
     config->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    config->handshake_timeout = DEFAULT_HANDSHAKE_TIMEOUT;
+    config->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    config->linger_timeout = DEFAULT_LINGER_TIMEOUT;
+    config->handshake_deadline = DEFAULT_HANDSHAKE_DEADLINE;
+    config->handshake_min_rate = DEFAULT_HANDSHAKE_MIN_RATE;
+    config->workers = 1;
+    config->over_tls_spare_connections = DEFAULT_OVER_TLS_SPARE_CONNECTIONS;
+    config->kcp_window = DEFAULT_KCP_WINDOW;
+    config->kcp_fec_data = DEFAULT_KCP_FEC_DATA;
+    config->kcp_fec_parity = DEFAULT_KCP_FEC_PARITY;
+    config->replay_filter_capacity = DEFAULT_REPLAY_FILTER_CAPACITY;
+    config->replay_filter_error_rate = DEFAULT_REPLAY_FILTER_ERROR_RATE;
+    config->replay_window_clients = DEFAULT_REPLAY_WINDOW_CLIENTS;
+    config->dns_cache_capacity = DEFAULT_DNS_CACHE_CAPACITY;
+    config->dns_cache_ttl = DEFAULT_DNS_CACHE_TTL;
+    config->heavy_hitters = DEFAULT_HEAVY_HITTERS_CAPACITY;
+    config->socket.nodelay = -1;
+    config->socket.defer_accept = -1;
+    config->socket.notsent_lowat = DEFAULT_NOTSENT_LOWAT;
+    config->loop_stall_ms = DEFAULT_LOOP_STALL_MS;
+    config->worker_balance_lag_ms = DEFAULT_WORKER_BALANCE_LAG_MS;
+    config->upstream_proxy_idle = DEFAULT_UPSTREAM_PROXY_IDLE;
+    config->admission_max_memory = DEFAULT_ADMISSION_MAX_MEMORY;
+    config->memory_budget = DEFAULT_MEMORY_BUDGET;
+    config->shared_read_buffer = DEFAULT_SHARED_READ_BUFFER;
+    config->log_async = true;
 
     return config;
 }
@@ -85,6 +140,12 @@ void config_release(struct server_config *cf) {
     }
     object_safe_free((void **)&cf->listen_host);
     object_safe_free((void **)&cf->remote_host);
+    while (cf->servers_count > 0) {
+        object_safe_free((void **)&cf->servers[--cf->servers_count].host);
+    }
+    object_safe_free((void **)&cf->servers);
+    object_safe_free((void **)&cf->probe_target);
+    object_safe_free((void **)&cf->subscription);
     object_safe_free((void **)&cf->password);
     object_safe_free((void **)&cf->method);
     object_safe_free((void **)&cf->protocol);
@@ -94,7 +155,27 @@ void config_release(struct server_config *cf) {
     object_safe_free((void **)&cf->over_tls_server_domain);
     object_safe_free((void **)&cf->over_tls_path);
     object_safe_free((void **)&cf->over_tls_root_cert_file);
+    object_safe_free((void **)&cf->over_tls_cert_file);
+    object_safe_free((void **)&cf->over_tls_key_file);
+    object_safe_free((void **)&cf->over_tls_fallback);
+    object_safe_free((void **)&cf->egress_addresses);
+    object_safe_free((void **)&cf->upstream_proxy);
     object_safe_free((void **)&cf->remarks);
+    object_safe_free((void **)&cf->nameservers);
+    object_safe_free((void **)&cf->acl);
+    object_safe_free((void **)&cf->fake_ip_range);
+    object_safe_free((void **)&cf->tunnel_address);
+    object_safe_free((void **)&cf->manager_address);
+    object_safe_free((void **)&cf->upgrade_socket);
+    object_safe_free((void **)&cf->metrics_address);
+    object_safe_free((void **)&cf->trace_file);
+    object_safe_free((void **)&cf->shape_file);
+    object_safe_free((void **)&cf->flow_export);
+    object_safe_free((void **)&cf->cluster_listen);
+    object_safe_free((void **)&cf->cluster_peers);
+    object_safe_free((void **)&cf->cluster_key);
+    object_safe_free((void **)&cf->users_file);
+    ssr_user_table_destroy(cf->users);
 
     object_safe_free((void **)&cf);
 }
@@ -105,34 +186,72 @@ void config_change_for_server(struct server_config *config) {
 
     config->listen_port = config->remote_port;
     config->remote_port = 0;
-}
 
-int tunnel_ctx_compare_for_c_set(const void *left, const void *right) {
-    struct tunnel_ctx *l = *(struct tunnel_ctx **)left;
-    struct tunnel_ctx *r = *(struct tunnel_ctx **)right;
-    if ( l < r ) {
-        return -1;
-    } else if ( l > r ) {
-        return 1;
-    } else {
-        return 0;
+    // SSR clients speak first, a connection is worth a wake-up once its header is in.
+    if (config->socket.defer_accept < 0) {
+        config->socket.defer_accept = DEFAULT_DEFER_ACCEPT;
     }
 }
 
 struct server_env_t * ssr_cipher_env_create(struct server_config *config, void *data) {
+    struct server_env_t *env = ssr_cipher_env_create_lazy(config, data);
+    ssr_cipher_env_prepare(env);
+    return env;
+}
+
+struct server_env_t * ssr_cipher_env_create_lazy(struct server_config *config, void *data) {
     struct server_env_t *env;
     srand((unsigned int)time(NULL));
 
     env = (struct server_env_t *) calloc(1, sizeof(struct server_env_t));
-    env->cipher = cipher_env_new_instance(config->password, config->method);
+    ASSERT(ss_max_iv_length() <= OBFS_MAX_IV_LENGTH);
     env->config = config;
     env->data = data;
+    env->users = config->users;
+
+    env->tunnel_list = NULL;
 
+    env->read_buffer_pool = buffer_pool_create(READ_BUFFER_POOL_CACHED_MAX);
+    if (config->shared_read_buffer) {
+        buffer_pool_enable_scratch(env->read_buffer_pool);
+    }
+    env->tunnel_stats = tunnel_stats_create();
+    env->tunnel_handles = handle_table_create();
+    
+    return env;
+}
+
+void ssr_cipher_env_prepare(struct server_env_t *env) {
+    const struct server_config *config = env->config;
+    if (env->cipher) {
+        return;
+    }
+    env->cipher = cipher_env_new_instance(config->password, config->method);
     // init obfs
     init_obfs(env, config->protocol, config->obfs);
+}
 
-    env->tunnel_set = cstl_set_container_create(tunnel_ctx_compare_for_c_set, NULL);
-    
+struct server_env_t * ssr_cipher_env_create_shared(struct server_config *config, struct server_env_t *host) {
+    struct server_env_t *env = (struct server_env_t *) calloc(1, sizeof(struct server_env_t));
+    env->cipher = cipher_env_new_instance(config->password, config->method);
+    env->config = config;
+    env->data = host->data;
+    env->users = config->users;
+    init_obfs(env, config->protocol, config->obfs);
+
+    env->host = host;
+    env->read_buffer_pool = host->read_buffer_pool;
+    env->tunnel_stats = host->tunnel_stats;
+    env->tunnel_handles = host->tunnel_handles;
+    env->timer_wheel = host->timer_wheel;
+    env->fair_queue = host->fair_queue;
+    env->read_coalescer = host->read_coalescer;
+    env->watchdog = host->watchdog;
+    env->trace = host->trace;
+    env->crypto_offload = host->crypto_offload;
+    env->egress_pool = host->egress_pool;
+    env->resolver = host->resolver;
+    env->replay_windows = host->replay_windows;
     return env;
 }
 
@@ -140,11 +259,28 @@ void ssr_cipher_env_release(struct server_env_t *env) {
     if (env == NULL) {
         return;
     }
+    if (env->protocol_global && env->protocol_global_dispose) {
+        env->protocol_global_dispose(env->protocol_global);
+        env->protocol_global = NULL;
+    }
+    if (env->obfs_global && env->obfs_global_dispose) {
+        env->obfs_global_dispose(env->obfs_global);
+        env->obfs_global = NULL;
+    }
     object_safe_free(&env->protocol_global);
     object_safe_free(&env->obfs_global);
     cipher_env_release(env->cipher);
+    object_safe_free((void **)&env->tunnel_dest);
+
+    ASSERT(env->tunnel_list == NULL);
 
-    cstl_set_container_destroy(env->tunnel_set);
+    if (env->host == NULL) {
+        buffer_pool_destroy(env->read_buffer_pool);
+        tunnel_stats_destroy(env->tunnel_stats);
+        handle_table_destroy(env->tunnel_handles);
+        tunnel_trace_destroy(env->trace);
+        tunnel_shape_destroy(env->shape);
+    }
     
     object_safe_free((void **)&env);
 }
@@ -154,38 +290,6 @@ bool is_completed_package(struct server_env_t *env, const uint8_t *data, size_t
     return size > (size_t)(enc_get_iv_len(env->cipher) + 1);
 }
 
-struct cstl_set * cstl_set_container_create(int(*compare_objs)(const void*,const void*), void(*destroy_obj)(void*)) {
-    return cstl_set_new(compare_objs, destroy_obj);
-}
-
-void cstl_set_container_destroy(struct cstl_set *set) {
-    cstl_set_delete(set);
-}
-
-void cstl_set_container_add(struct cstl_set *set, void *obj) {
-    ASSERT(set && obj);
-    cstl_set_insert(set, &obj, sizeof(void *));
-}
-
-void cstl_set_container_remove(struct cstl_set *set, void *obj) {
-    ASSERT(cstl_true == cstl_set_exists(set, &obj));
-    cstl_set_remove(set, &obj);
-}
-
-void cstl_set_container_traverse(struct cstl_set *set, void(*fn)(const void *obj, void *p), void *p) {
-    struct cstl_iterator *iterator;
-    const void *element;
-    if (set==NULL || fn==NULL) {
-        return;
-    }
-    iterator = cstl_set_new_iterator(set);
-    while( (element = iterator->next(iterator)) ) {
-        const void *obj = *((const void **) iterator->current_value(iterator));
-        fn(obj, p);
-    }
-    cstl_set_delete_iterator(iterator);
-}
-
 struct cstl_list * obj_list_create(int(*compare_objs)(const void*,const void*), void (*destroy_obj)(void*)) {
     return cstl_list_new(destroy_obj, compare_objs);
 }
@@ -214,68 +318,26 @@ size_t obj_list_size(struct cstl_list* pSlist) {
     return cstl_list_size(pSlist);
 }
 
-
-struct cstl_map * obj_map_create(int(*compare_key)(const void*,const void*), void (*destroy_key)(void*), void (*destroy_value)(void*)) {
-    return cstl_map_new(compare_key, destroy_key, destroy_value);
-}
-
-void obj_map_destroy(struct cstl_map *map) {
-    cstl_map_delete(map);
-}
-
-bool obj_map_add(struct cstl_map *map, void *key, size_t k_size, void *value, size_t v_size) {
-    return CSTL_ERROR_SUCCESS == cstl_map_insert(map, key, k_size, value, v_size);
-}
-
-bool obj_map_exists(struct cstl_map *map, const void *key) {
-    return cstl_map_exists(map, key) != cstl_false;
-}
-
-bool obj_map_replace(struct cstl_map *map, const void *key, const void *value, size_t v_size) {
-    return CSTL_ERROR_SUCCESS == cstl_map_replace(map, key, value, v_size);
-}
-
-void obj_map_remove(struct cstl_map *map, const void *key) {
-    cstl_map_remove(map, key);
-}
-
-const void * obj_map_find(struct cstl_map *map, const void *key) {
-    return cstl_map_find(map, key);
-}
-
-void obj_map_traverse(struct cstl_map *map, void(*fn)(const void *key, const void *value, void *p), void *p) {
-    struct cstl_iterator *iterator;
-    const void *element;
-    if (map==NULL || fn==NULL) {
-        return;
-    }
-    iterator = cstl_map_new_iterator(map);
-    while( (element = iterator->next(iterator)) ) {
-        const void *key = iterator->current_key(iterator);
-        const void *value = iterator->current_value(iterator);
-        fn(key, value, p);
-    }
-    cstl_map_delete_iterator(iterator);
-}
-
 void init_obfs(struct server_env_t *env, const char *protocol, const char *obfs) {
     struct obfs_t *protocol_plugin;
     struct obfs_t *obfs_plugin;
     protocol_plugin = new_obfs_instance(protocol);
     if (protocol_plugin) {
         env->protocol_global = protocol_plugin->init_data();
+        env->protocol_global_dispose = protocol_plugin->dispose_data;
         free_obfs_instance(protocol_plugin);
     }
 
     obfs_plugin = new_obfs_instance(obfs);
     if (obfs_plugin) {
         env->obfs_global = obfs_plugin->init_data();
+        env->obfs_global_dispose = obfs_plugin->dispose_data;
         free_obfs_instance(obfs_plugin);
     }
 }
 
 struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t tcp_mss) {
-    struct server_info_t server_info = { {0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    struct server_info_t server_info = { 0 };
 
     struct server_config *config = env->config;
 
@@ -290,9 +352,7 @@ struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t
     }
     // SSR beg
 
-    if (config->remote_host && strlen(config->remote_host)) {
-        strcpy(server_info.host, config->remote_host);
-    }
+    server_info.host = config->remote_host ? config->remote_host : "";
     server_info.port = config->remote_port;
     server_info.iv = enc_ctx_get_iv(tc->e_ctx);
     server_info.iv_len = enc_get_iv_len(env->cipher);
@@ -301,6 +361,11 @@ struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t
     server_info.tcp_mss = (uint16_t) tcp_mss;
     server_info.buffer_size = SSR_BUFF_SIZE;
     server_info.cipher_env = env->cipher;
+    server_info.users = env->users;
+    server_info.replay_windows = env->replay_windows;
+    server_info.adaptive_padding = config->adaptive_padding;
+    tc->compress = stream_compressor_create(config->compression, true);
+    tc->decompress = stream_compressor_create(config->compression, false);
     {
         server_info.param = config->obfs_param;
         server_info.g_data = env->obfs_global;
@@ -339,6 +404,10 @@ struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t
         }
     }
     // SSR end
+#if defined(SSR_STAGE_TIMING)
+    tc->stage_times = tunnel_stats_stage_times(env->tunnel_stats,
+        config->protocol ? config->protocol : "origin", config->obfs ? config->obfs : "plain");
+#endif
 
    return tc;
 }
@@ -359,9 +428,42 @@ void tunnel_cipher_release(struct tunnel_cipher_ctx *tc) {
     free_obfs_instance(tc->protocol);
     free_obfs_instance(tc->obfs);
 
+    if (env->tunnel_stats && (tc->compress || tc->decompress)) {
+        // Counted as tunnels close, the stream may have been worked on off the loop.
+        uint64_t plain, wire;
+        stream_compressor_totals(tc->compress, &plain, &wire);
+        env->tunnel_stats->compression_plain += plain;
+        env->tunnel_stats->compression_wire += wire;
+        stream_compressor_totals(tc->decompress, &plain, &wire);
+        env->tunnel_stats->compression_plain += plain;
+        env->tunnel_stats->compression_wire += wire;
+    }
+    stream_compressor_release(tc->compress);
+    stream_compressor_release(tc->decompress);
+
     free(tc);
 }
 
+void tunnel_cipher_trim(struct tunnel_cipher_ctx *tc) {
+    if (tc == NULL) {
+        return;
+    }
+    if (tc->protocol && tc->protocol->trim) {
+        tc->protocol->trim(tc->protocol);
+    }
+    if (tc->obfs && tc->obfs->trim) {
+        tc->obfs->trim(tc->obfs);
+    }
+}
+
+/* Bytes worth reserving in front of a plaintext chunk so the IV lands without a memmove. */
+size_t tunnel_cipher_headroom(const struct tunnel_cipher_ctx *tc) {
+    if (tc->protocol) {
+        return 0; // Protocol plugins frame into buffers of their own.
+    }
+    return enc_get_iv_len(tc->env->cipher);
+}
+
 bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc) {
     bool protocol = false;
     bool obfs = false;
@@ -378,32 +480,43 @@ bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc) {
 }
 
 // insert shadowsocks header
-enum ssr_error tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf) {
+static enum ssr_error _tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf) {
     int err;
     struct obfs_t *obfs_plugin;
     struct server_env_t *env = tc->env;
     // SSR beg
     struct obfs_t *protocol_plugin = tc->protocol;
+    if (tc->compress) {
+        struct buffer_t *tmp = buffer_create_with_headroom(tunnel_cipher_headroom(tc), max(buf->len, SSR_BUFF_SIZE));
+        bool done;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_compress, done = stream_compressor_update(tc->compress, buf->buffer, buf->len, tmp));
+        buffer_swap(buf, tmp); buffer_release(tmp);
+        if (done == false) {
+            return ssr_error_compression;
+        }
+    }
     ASSERT(buf->capacity >= SSR_BUFF_SIZE);
     if (protocol_plugin && protocol_plugin->client_pre_encrypt) {
-        buf->len = (size_t)protocol_plugin->client_pre_encrypt(
-            tc->protocol, (char **)&buf->buffer, (int)buf->len, &buf->capacity);
+        buffer_drop_head(buf);
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_protocol, buf->len = (size_t)protocol_plugin->client_pre_encrypt(
+            tc->protocol, (char **)&buf->buffer, (int)buf->len, &buf->capacity));
     }
-    err = ss_encrypt(env->cipher, buf, tc->e_ctx, SSR_BUFF_SIZE);
+    TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_cipher, err = ss_encrypt(env->cipher, buf, tc->e_ctx, SSR_BUFF_SIZE));
     if (err != 0) {
         return ssr_error_invalid_password;
     }
 
     obfs_plugin = tc->obfs;
     if (obfs_plugin && obfs_plugin->client_encode) {
-        struct buffer_t *tmp = obfs_plugin->client_encode(tc->obfs, buf);
-        buffer_replace(buf, tmp); buffer_release(tmp);
+        struct buffer_t *tmp;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_obfs, tmp = obfs_plugin->client_encode(tc->obfs, buf));
+        buffer_swap(buf, tmp); buffer_release(tmp);
     }
     // SSR end
     return ssr_ok;
 }
 
-enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf, struct buffer_t **feedback)
+static enum ssr_error _tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf, struct buffer_t **feedback)
 {
     struct obfs_t *protocol_plugin;
     struct server_env_t *env = tc->env;
@@ -415,11 +528,12 @@ enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct
 
     if (obfs_plugin && obfs_plugin->client_decode) {
         bool needsendback = 0;
-        struct buffer_t *result = obfs_plugin->client_decode(tc->obfs, buf, &needsendback);
+        struct buffer_t *result;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_obfs, result = obfs_plugin->client_decode(tc->obfs, buf, &needsendback));
         if (result == NULL) {
             return ssr_error_client_decode;
         }
-        buffer_replace(buf, result); buffer_release(result);
+        buffer_swap(buf, result); buffer_release(result);
         if (needsendback && obfs_plugin->client_encode) {
             BUFFER_CONSTANT_INSTANCE(empty, "", 0);
             struct buffer_t *sendback = obfs_plugin->client_encode(tc->obfs, empty);
@@ -428,55 +542,142 @@ enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct
         }
     }
     if (buf->len > 0) {
-        int err = ss_decrypt(env->cipher, buf, tc->d_ctx, SSR_BUFF_SIZE);
+        int err;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_cipher, err = ss_decrypt(env->cipher, buf, tc->d_ctx, SSR_BUFF_SIZE));
         if (err != 0) {
             return ssr_error_invalid_password;
         }
     }
     protocol_plugin = tc->protocol;
     if (protocol_plugin && protocol_plugin->client_post_decrypt) {
-        ssize_t len = protocol_plugin->client_post_decrypt(
-            tc->protocol, (char **)&buf->buffer, (int)buf->len, &buf->capacity);
+        ssize_t len;
+        buffer_drop_head(buf);
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_protocol, len = protocol_plugin->client_post_decrypt(
+            tc->protocol, (char **)&buf->buffer, (int)buf->len, &buf->capacity));
         if (len < 0) {
             return ssr_error_client_post_decrypt;
         }
         buf->len = (size_t)len;
     }
     // SSR end
+    if (tc->decompress && buf->len > 0) {
+        struct buffer_t *tmp = buffer_create(max(buf->len * 2, SSR_BUFF_SIZE));
+        bool done;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_compress, done = stream_compressor_update(tc->decompress, buf->buffer, buf->len, tmp));
+        buffer_swap(buf, tmp); buffer_release(tmp);
+        if (done == false) {
+            return ssr_error_compression;
+        }
+    }
     return ssr_ok;
 }
 
-struct buffer_t * tunnel_cipher_server_encrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf) {
+static struct buffer_t * tunnel_cipher_server_protocol_encrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf) {
     int err;
     struct server_env_t *env = tc->env;
-    struct obfs_t *obfs = tc->obfs;
     struct obfs_t *protocol = tc->protocol;
     struct buffer_t *ret = NULL;
+    struct buffer_t *packed = NULL;
+    if (tc->compress) {
+        bool done;
+        packed = buffer_create(max(buf->len, SSR_BUFF_SIZE));
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_compress, done = stream_compressor_update(tc->compress, buf->buffer, buf->len, packed));
+        if (done == false) {
+            buffer_release(packed);
+            return NULL;
+        }
+        buf = packed;
+    }
     do {
         if (protocol && protocol->server_pre_encrypt) {
-            ret = protocol->server_pre_encrypt(protocol, buf);
+            TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_protocol, ret = protocol->server_pre_encrypt(protocol, buf));
         } else {
-            ret = buffer_clone(buf);
+            ret = buffer_create_with_headroom(tunnel_cipher_headroom(tc), max(buf->len, SSR_BUFF_SIZE));
+            buffer_store(ret, buf->buffer, buf->len);
         }
         if (ret == NULL) {
             break;
         }
-        err = ss_encrypt(env->cipher, ret, tc->e_ctx, SSR_BUFF_SIZE);
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_cipher, err = ss_encrypt(env->cipher, ret, tc->e_ctx, SSR_BUFF_SIZE));
         if (err != 0) {
             ASSERT(false);
             buffer_release(ret); ret = NULL;
             break;
         }
-        if (obfs && obfs->server_encode) {
-            struct buffer_t *tmp = obfs->server_encode(obfs, ret);
-            buffer_release(ret); ret = tmp;
-        }
     } while (0);
+    buffer_release(packed);
+    return ret;
+}
+
+static struct buffer_t * _tunnel_cipher_server_encrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf) {
+    struct obfs_t *obfs = tc->obfs;
+    struct buffer_t *ret = tunnel_cipher_server_protocol_encrypt(tc, buf);
+    if (ret && obfs && obfs->server_encode) {
+        struct buffer_t *tmp;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_obfs, tmp = obfs->server_encode(obfs, ret));
+        buffer_release(ret); ret = tmp;
+    }
     return ret;
 }
 
-struct buffer_t * 
-tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc, 
+static struct buffer_segments * _tunnel_cipher_server_encrypt_segments(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf) {
+    struct obfs_t *obfs = tc->obfs;
+    struct buffer_segments *segs = NULL;
+    struct buffer_t *ret = tunnel_cipher_server_protocol_encrypt(tc, buf);
+    if (ret == NULL) {
+        return segs;
+    }
+    segs = buffer_segments_create();
+    if (obfs && obfs->server_encode_segments) {
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_obfs, obfs->server_encode_segments(obfs, ret, segs));
+    } else if (obfs && obfs->server_encode) {
+        struct buffer_t *tmp;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_obfs, tmp = obfs->server_encode(obfs, ret));
+        buffer_segments_append_buffer(segs, tmp, 0, tmp->len);
+        buffer_release(tmp);
+    } else {
+        buffer_segments_append_buffer(segs, ret, 0, ret->len);
+    }
+    buffer_release(ret);
+    return segs;
+}
+
+/*
+ * Decrypts the first bytes of the stream on their own, on the tunnel's
+ * context, and shows them to the protocol's server_precheck(). Only if it
+ * passes is the rest decrypted, in place behind them, as if in one go. An
+ * AEAD chunk only opens whole, so that one is decrypted first.
+ */
+static bool _tunnel_cipher_server_precheck(struct tunnel_cipher_ctx *tc, struct buffer_t *data) {
+    struct cipher_env_t *cipher = tc->env->cipher;
+    struct obfs_t *protocol = tc->protocol;
+    size_t iv_len = tc->d_ctx ? enc_get_iv_len(cipher) : 0;
+    size_t head_len = iv_len + OBFS_PRECHECK_MAX;
+    struct buffer_t *head;
+    bool passed;
+
+    if (cipher_is_aead(cipher_env_enc_method(cipher)) || data->len <= head_len) {
+        if (ss_decrypt(cipher, data, tc->d_ctx, max(SSR_BUFF_SIZE, data->capacity)) != 0) {
+            return false;
+        }
+        return protocol->server_precheck(protocol, data->buffer, data->len);
+    }
+    head = buffer_create_from(data->buffer, head_len);
+    passed = (ss_decrypt(cipher, head, tc->d_ctx, head_len) == 0) &&
+        protocol->server_precheck(protocol, head->buffer, head->len);
+    if (passed) {
+        // The context is started, the rest decrypts in place and nothing moves.
+        BUFFER_CONSTANT_INSTANCE(rest, data->buffer + head_len, data->len - head_len);
+        passed = (ss_decrypt(cipher, rest, tc->d_ctx, rest->capacity) == 0);
+        memcpy(data->buffer + iv_len, head->buffer, head->len);
+        buffer_consume(data, iv_len);
+    }
+    buffer_release(head);
+    return passed;
+}
+
+static struct buffer_t * 
+_tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc, 
                              const struct buffer_t *buf, 
                              struct buffer_t **receipt, 
                              struct buffer_t **confirm)
@@ -492,9 +693,18 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
     if (receipt) { *receipt = NULL; }
     if (confirm) { *confirm = NULL; }
 
+    if (tc->obfs_prechecked == false) {
+        // Junk a scanner sends is turned down here, before a thing is decoded.
+        tc->obfs_prechecked = true;
+        if (obfs && obfs->server_precheck && buf->len &&
+            obfs->server_precheck(obfs, buf->buffer, buf->len) == false) {
+            tc->precheck_failed = true;
+            return NULL;
+        }
+    }
     if (obfs && obfs->server_decode) {
         bool need_feedback = false;
-        ret = obfs->server_decode(obfs, buf, &need_decrypt, &need_feedback);
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_obfs, ret = obfs->server_decode(obfs, buf, &need_decrypt, &need_feedback));
         if (ret == NULL) {
             return NULL;
         }
@@ -502,8 +712,10 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
             if (receipt) {
                 *receipt = obfs->server_encode(obfs, empty);
             }
-            buffer_reset(ret);
-            return ret;
+            if (ret->len == 0) {
+                return ret;
+            }
+            // The client pipelined data behind its handshake, keep it.
         }
     } else {
         ret = buffer_clone(buf);
@@ -516,20 +728,32 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
             return NULL;
         }
         */
-        if (protocol && protocol->server.recv_iv[0] == 0) {
-            size_t iv_len = protocol->server.iv_len;
+        size_t iv_len = protocol ? min(protocol->server.iv_len, sizeof(protocol->server.recv_iv)) : 0;
+        if (protocol && protocol->server.recv_iv_len == 0 && ret->len >= iv_len) {
             memmove(protocol->server.recv_iv, ret->buffer, iv_len);
             protocol->server.recv_iv_len = iv_len;
         }
 
-        err = ss_decrypt(env->cipher, ret, tc->d_ctx, max(SSR_BUFF_SIZE, ret->capacity));
-        if (err != 0) {
-            return NULL;
+        if (protocol && protocol->server_precheck && tc->protocol_prechecked == false) {
+            bool passed;
+            tc->protocol_prechecked = true;
+            TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_cipher, passed = _tunnel_cipher_server_precheck(tc, ret));
+            if (passed == false) {
+                tc->precheck_failed = true;
+                buffer_release(ret);
+                return NULL;
+            }
+        } else {
+            TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_cipher, err = ss_decrypt(env->cipher, ret, tc->d_ctx, max(SSR_BUFF_SIZE, ret->capacity)));
+            if (err != 0) {
+                return NULL;
+            }
         }
     }
     if (protocol && protocol->server_post_decrypt) {
         bool feedback = false;
-        struct buffer_t *tmp = protocol->server_post_decrypt(protocol, ret, &feedback);
+        struct buffer_t *tmp;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_protocol, tmp = protocol->server_post_decrypt(protocol, ret, &feedback));
         buffer_release(ret); ret = tmp;
         if (feedback) {
             if (confirm) {
@@ -537,83 +761,133 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
             }
         }
     }
+    if (ret && ret->len && tc->decompress) {
+        struct buffer_t *tmp = buffer_create(max(ret->len * 2, SSR_BUFF_SIZE));
+        bool done;
+        TUNNEL_CIPHER_STAGE(tc, tunnel_cipher_stage_compress, done = stream_compressor_update(tc->decompress, ret->buffer, ret->len, tmp));
+        buffer_release(ret); ret = tmp;
+        if (done == false) {
+            buffer_release(ret); ret = NULL;
+        }
+    }
+    return ret;
+}
+
+/* Each cipher call of a traced tunnel is a span, the others pay a test. */
+static void tunnel_cipher_trace(const struct tunnel_cipher_ctx *tc, const char *name, uint64_t begin, size_t bytes) {
+    tunnel_trace_span(tc->trace, tc->trace_id, name, begin, uv_hrtime(), bytes);
+}
+
+enum ssr_error tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf) {
+    uint64_t begin = tc->trace ? uv_hrtime() : 0;
+    size_t len = buf->len;
+    enum ssr_error err = _tunnel_cipher_client_encrypt(tc, buf);
+    if (tc->trace) {
+        tunnel_cipher_trace(tc, "client_encrypt", begin, len);
+    }
+    return err;
+}
+
+enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf, struct buffer_t **feedback) {
+    uint64_t begin = tc->trace ? uv_hrtime() : 0;
+    size_t len = buf->len;
+    enum ssr_error err = _tunnel_cipher_client_decrypt(tc, buf, feedback);
+    if (tc->trace) {
+        tunnel_cipher_trace(tc, "client_decrypt", begin, len);
+    }
+    return err;
+}
+
+struct buffer_t * tunnel_cipher_server_encrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf) {
+    uint64_t begin = tc->trace ? uv_hrtime() : 0;
+    struct buffer_t *ret = _tunnel_cipher_server_encrypt(tc, buf);
+    if (tc->trace) {
+        tunnel_cipher_trace(tc, "server_encrypt", begin, buf->len);
+    }
     return ret;
 }
 
-bool pre_parse_header(struct buffer_t *data) {
+struct buffer_segments * tunnel_cipher_server_encrypt_segments(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf) {
+    uint64_t begin = tc->trace ? uv_hrtime() : 0;
+    struct buffer_segments *segs = _tunnel_cipher_server_encrypt_segments(tc, buf);
+    if (tc->trace) {
+        tunnel_cipher_trace(tc, "server_encrypt", begin, buf->len);
+    }
+    return segs;
+}
+
+struct buffer_t * tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf, struct buffer_t **receipt, struct buffer_t **confirm) {
+    uint64_t begin = tc->trace ? uv_hrtime() : 0;
+    struct buffer_t *ret = _tunnel_cipher_server_decrypt(tc, buf, receipt, confirm);
+    if (tc->trace) {
+        tunnel_cipher_trace(tc, ret ? "server_decrypt" : "server_decrypt failed", begin, buf->len);
+    }
+    return ret;
+}
+
+bool tunnel_cipher_server_offloadable(const struct tunnel_cipher_ctx *tc) {
+    return tc->protocol == NULL && tc->obfs == NULL &&
+        enc_ctx_started(tc->e_ctx) && enc_ctx_started(tc->d_ctx);
+}
+
+struct buffer_t * tunnel_cipher_server_crypt_offloaded(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf, bool encrypt) {
+    return encrypt ? _tunnel_cipher_server_encrypt(tc, buf) : _tunnel_cipher_server_decrypt(tc, buf, NULL, NULL);
+}
+
+size_t pre_parse_header(struct buffer_t *data) {
     uint8_t datatype = 0;
-    size_t rand_data_size = 0;
     size_t hdr_len = 0;
 
     if (data==NULL || data->buffer==NULL || data->len==0) {
-        return false;
+        return 0;
     }
 
     datatype = data->buffer[0];
 
-    if (datatype == 0x80) {
+    switch (datatype) {
+    case 0x80:
         if (data->len <= 2) {
-            return false;
-        }
-        rand_data_size = (size_t) data->buffer[1];
-        hdr_len = rand_data_size + 2;
-        if (hdr_len >= data->len) {
-            // header too short, maybe wrong password or encryption method
-            return false;
+            return 0;
         }
-
-        memmove(data->buffer, data->buffer + hdr_len, data->len - hdr_len);
-        data->len -= hdr_len;
-
-        return true;
-    }
-    if (datatype == 0x81) {
+        hdr_len = (size_t) data->buffer[1] + 2;
+        break;
+    case 0x81:
         hdr_len = 1;
-        memmove(data->buffer, data->buffer + hdr_len, data->len - hdr_len);
-        data->len -= hdr_len;
-        return true;
-    }
-    if (datatype == 0x82) {
+        break;
+    case 0x82:
         if (data->len <= 3) {
-            return false;
-        }
-        rand_data_size = (size_t) ntohs( *((uint16_t *)(data->buffer+1)) );
-        hdr_len = rand_data_size + 3;
-        if (hdr_len >= data->len) {
-            // header too short, maybe wrong password or encryption method
-            return false;
+            return 0;
         }
-        memmove(data->buffer, data->buffer + hdr_len, data->len - hdr_len);
-        data->len -= hdr_len;
-        return true;
-    }
-    if ((datatype == 0x88) || (~datatype == 0x88)) {
-        uint32_t crc = 0;
+        hdr_len = (size_t) ntohs( *((uint16_t *)(data->buffer+1)) ) + 3;
+        break;
+    case 0x88: {
         size_t data_size = 0;
         size_t start_pos = 0;
-        size_t origin_len = data->len;
         if (data->len <= (7 + 7)) {
-            return false;
+            return 0;
         }
         data_size = (size_t) ntohs( *((uint16_t *)(data->buffer+1)) );
-        crc = crc32_imp(data->buffer, data_size);
-        if (crc != 0xffffffff) {
+        if (data_size > data->len || crc32_imp(data->buffer, data_size) != 0xffffffff) {
             // uncorrect CRC32, maybe wrong password or encryption method
-            return false;
+            return 0;
         }
         start_pos = (size_t)(3 + data->buffer[3]);
-
-        data->len = data_size - (4 + start_pos);
-        memmove(data->buffer, data->buffer + start_pos, data->len);
-
-        if (data_size < origin_len) {
-            size_t len2 = origin_len - data_size;
-            memmove(data->buffer + data->len, data->buffer + data_size, len2);
-            data->len += len2;
+        if (start_pos + 4 > data_size) {
+            return 0;
         }
-        return true;
+        // The CRC sits between the frame and what followed it. Shifting the
+        // frame over it moves a few bytes instead of the whole packet.
+        memmove(data->buffer + start_pos + 4, data->buffer + start_pos, data_size - 4 - start_pos);
+        hdr_len = start_pos + 4;
+        break;
     }
-
-    return true;
+    default:
+        return 0;
+    }
+    if (hdr_len >= data->len) {
+        // header too short, maybe wrong password or encryption method
+        return 0;
+    }
+    return hdr_len;
 }
 
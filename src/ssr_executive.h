@@ -8,29 +8,156 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "socket_tuning.h"
+#include "egress_pool.h"
+#include "stream_compress.h"
 
 struct cipher_env_t;
 struct obfs_t;
 struct tunnel_ctx;
-struct cstl_set;
+struct buffer_pool;
+struct tunnel_stats;
+struct tunnel_stage_times;
+struct handle_table;
+struct ssr_user_table;
+struct resolv_ctx;
+struct remote_pool;
+struct tls_cli_pool;
+struct mux_cli;
+struct warm_pool;
+struct server_probe;
+struct server_group;
+struct fake_dns;
+struct socks5_address;
+struct managed_port;
+struct loop_watchdog;
+struct tunnel_trace;
+struct tunnel_shape;
+struct crypto_offload;
+struct admission;
+
+enum server_policy {
+    server_policy_least_latency,
+    server_policy_weighted,
+    server_policy_hash,  /* By destination, a site keeps its exit. */
+};
+
+enum server_transport {
+    server_transport_tcp,
+    server_transport_kcp,  /* Mux sessions over KCP on UDP, see kcp_transport.h. */
+};
+
+/* One of "servers", sharing method, password, protocol and obfs with remote_host. */
+struct server_group_entry {
+    char *host;
+    unsigned short port;
+    int weight;
+};
 
 struct server_config {
     char *listen_host;
     unsigned short listen_port;
     char *remote_host;
     unsigned short remote_port;
+    struct server_group_entry *servers; /* ssr-client, exits besides remote_host. */
+    size_t servers_count;
+    enum server_policy server_policy;
+    unsigned int probe_interval; /* Ms, ssr-client probes each of the servers this often, 0 disables. */
+    char *probe_target; /* host:port, probes go through a whole handshake to it instead of just connecting. */
+    char *subscription; /* ssr-client, a file of ssr:// and ss:// links whose servers matching remote_host join "servers". */
     char *password;
     char *method;
     char *protocol;
     char *protocol_param;
     char *obfs;
     char *obfs_param;
+    bool adaptive_padding; /* auth_chain bulk downloads pad less past their first bytes, when both ends set it. */
+    enum stream_compression compression; /* Of the tunnels' data ahead of the protocol, both ends must agree like on the method. */
     bool over_tls_enable;
     char *over_tls_server_domain;
     char *over_tls_path;
     char *over_tls_root_cert_file;
+    bool over_tls_streaming; /* One WebSocket upgrade, then frames, instead of an HTTP request per write. */
+    int over_tls_spare_connections; /* Handshaked connections kept ready per loop, 0 disables. */
+    unsigned short over_tls_listen_port; /* ssr-server terminates TLS itself on it, with the two files below. */
+    char *over_tls_cert_file; /* PEM chain, the server's certificate first. */
+    char *over_tls_key_file;
+    char *over_tls_fallback; /* "address:port" other requests are passed to, a 404 without it. */
+    int mux_sessions; /* ssr-client connections per loop carrying many tunnels each, 0 disables. */
+    enum server_transport transport; /* ssr-client, what the mux sessions ride on, kcp implies at least one. */
+    unsigned short kcp_port; /* UDP port of the KCP transport. ssr-server takes it when set, ssr-client defaults to remote_port. */
+    unsigned int kcp_window; /* Segments in flight each way per KCP conversation. */
+    unsigned int kcp_fec_data; /* Datagrams per FEC group, both ends must agree. */
+    unsigned int kcp_fec_parity; /* Parity datagrams per group, 0 turns FEC off. */
+    bool fast_open; /* TCP Fast Open, server listener and client connects to it. Linux only. */
+    bool mptcp; /* Multipath TCP, ssr-server's listeners and ssr-client's connections to it. Linux 5.6 and up, plain TCP otherwise. */
+    char *egress_addresses; /* ssr-server, comma separated source addresses or interfaces of its outgoing connections. */
+    enum egress_policy egress_policy; /* How a destination gets one of them. */
+    char *upstream_proxy; /* ssr-server, "socks5://[user:pass@]host:port" or "http://..." every outgoing connection goes through. */
+    int upstream_proxy_idle; /* Connections to it kept ready per loop, 0 disables. */
+    struct socket_tuning socket; /* Listeners and outgoing connections, and the worker threads with incoming_cpu. */
+    bool optimistic_reply; /* ssr-client tells SOCKS5 success before connecting, the first payload rides with the SSR header. */
+    bool transparent_proxy; /* ssr-client also takes connections iptables REDIRECT or TPROXY sent to its port, and TPROXY datagrams with udp. Linux only. */
+    int warm_connections; /* ssr-client connections per loop made before a tunnel needs one, 0 disables. */
     bool udp;
+    bool udp_over_tcp; /* The client carries UDP on a TCP stream, implied by over_tls_enable. */
     unsigned int idle_timeout; /* Connection idle timeout in ms. */
+    unsigned int handshake_timeout; /* Ms, of each step before streaming, 0 the idle timeout. */
+    unsigned int connect_timeout; /* Ms, of resolving and connecting the outgoing side, 0 likewise. */
+    unsigned int linger_timeout; /* Ms, the rest may take to go out once one side sent EOF, 0 likewise. */
+    unsigned int handshake_deadline; /* ssr-server ms from accept to streaming, however often the client sends, 0 for none. */
+    size_t handshake_min_rate; /* ssr-server bytes per second the client must average until then, 0 for any. */
+    size_t write_queue_high_watermark; /* Bytes, 0 keeps stop-and-wait streaming. */
+    size_t write_queue_low_watermark;
+    bool shared_read_buffer; /* Reads borrow one block of the loop, see buffer_pool_enable_scratch(). */
+    bool numa; /* ssr-server workers go round the NUMA nodes, each pinned to one with its large read buffers there. Linux only. */
+    bool hugepages; /* The large read buffers on 2 MiB pages, see buffer_pool_use_slabs(). */
+    size_t fair_queue_quantum; /* Bytes a tunnel's reads earn per loop round, 0 hands every read over at once. */
+    size_t coalesce_reads_below; /* Reads smaller than this wait for what else arrives in their loop iteration, 0 hands them over at once. */
+    unsigned int loop_stall_ms; /* A loop iteration busy this long is reported, 0 turns the watchdog off. */
+    size_t rate_limit_global; /* ssr-server bytes per second both ways, of all ports together, 0 for no limit. */
+    size_t rate_limit_port; /* Of each port, the configured one and every managed one. */
+    size_t rate_limit_tunnel; /* Of each connection. */
+    size_t rate_limit_over_quota; /* Of a user's connections past its quota, 0 closes them instead. */
+    unsigned int workers; /* ssr-server event loop threads. */
+    unsigned int worker_balance_lag_ms; /* Smoothed loop lag past which a worker hands new connections to a calmer one, 0 never. */
+    unsigned int crypto_workers; /* ssr-server threads per loop that run the cipher of bulk reads, 0 keeps it on the loop. */
+    unsigned int admission_max_tunnels; /* Tunnels per loop, 0 for no limit. */
+    unsigned int admission_max_handshakes; /* Of those, still before the SSR handshake, or ssr-client's before streaming. */
+    unsigned int admission_accept_batch; /* Connections a listener takes per loop turn. */
+    unsigned int admission_max_loop_lag; /* ms, beyond it handshakes are shed. */
+    size_t admission_max_memory; /* Resident bytes of the process, beyond it handshakes are shed. */
+    size_t memory_budget; /* ssr-server bytes of tunnel buffers and state, past half of it idle tunnels are trimmed and closed sooner, 0 for no budget. */
+    size_t replay_filter_capacity; /* IVs remembered for replay detection, shared by the workers. */
+    double replay_filter_error_rate;
+    size_t replay_window_clients; /* auth_chain/auth_aes128 clients tracked for replays. */
+    size_t dns_cache_capacity; /* Host names cached per ssr-server worker, 0 disables the cache. */
+    unsigned int dns_cache_ttl; /* Cached host name lifetime in ms. */
+    size_t heavy_hitters; /* ssr-server destinations and users in each top list of metrics_address, 0 keeps none. */
+    char *nameservers; /* Comma separated, tls://host[:port] entries resolve over TLS. NULL reads the system resolver config. */
+    bool ipv6_first; /* Prefer AAAA records when a name has both. */
+    bool fast_start; /* ssr-client listens first, the cipher and the ACL are made on the thread pool meanwhile. */
+    char *acl; /* ACL file, text or compiled. ssr-client bypasses and proxies by it, ssr-server blocks its outbound_block_list. */
+    unsigned short fake_dns_port; /* ssr-client answers DNS on listen_host with fake IPs it proxies by name, 0 disables. */
+    char *fake_ip_range; /* IPv4 CIDR the fake IPs come from, NULL for 198.18.0.0/15. */
+    char *tunnel_address; /* ssr-client forwards every connection to this host:port through the server, no SOCKS5, like ss-tunnel. */
+    char *manager_address; /* ssr-server takes ss-manager's add, remove and ping on this UDP host:port. */
+    char *metrics_address; /* Prometheus scrapes on this TCP host:port, the loops' counters summed up. */
+    char *upgrade_socket; /* ssr-server passes its listeners to a new one started with the same path, then drains. */
+    bool sockmap_relay; /* ssr-server forwards method none, origin, plain tunnels with a BPF sockmap. Linux only, needs CAP_BPF. */
+    bool log_async; /* Messages are written by a background thread, see dump_info_start_async(). */
+    bool log_json; /* One JSON object per message. */
+    char *trace_file; /* Spans of the sampled tunnels go here in the Chrome trace format, see tunnel_trace.h. */
+    unsigned int trace_sample; /* One in this many tunnels is traced, 0 traces none. */
+    char *shape_file; /* ssr-server records the reads of sampled tunnels here for ssr-loadgen -R, see tunnel_shape.h. */
+    unsigned int shape_sample; /* One in this many tunnels is recorded, 0 records none. */
+    char *flow_export; /* ssr-server records every closed tunnel there, file:path, unix:path or ipfix:host:port, see flow_export.h. */
+    char *cluster_listen; /* ssr-server shares replays and user traffic with its peers on this UDP host:port, see ssr_cluster.h. */
+    char *cluster_peers; /* Comma separated host:port of the nodes, this one's may be among them. */
+    char *cluster_key; /* Signs the datagrams, the same on every node. */
+    unsigned int cluster_interval; /* Ms between rounds, 0 for the default. */
+    struct ssr_user_table *users; /* Single-port multi-user accounts, ssr-server only. */
+    char *users_file; /* ssr-server writes its users here, or maps those another one wrote when it has none. */
     char *remarks;
 };
 
@@ -40,12 +167,44 @@ struct server_env_t {
 
     struct server_config *config; // __weak_ptr
     
-    struct cstl_set *tunnel_set;
+    struct tunnel_ctx *tunnel_list; /* Head of the intrusive list in tunnel.h */
+
+    struct buffer_pool *read_buffer_pool;
+
+    struct timer_wheel *timer_wheel; /* Idle timeouts of the loop's tunnels, owned by the loop's runner. */
+    struct fair_queue *fair_queue; /* Turns of the loop's tunnel reads with fair_queue_quantum, owned by the loop's runner. */
+    struct read_coalescer *read_coalescer; /* Small reads of the loop held with coalesce_reads_below, owned by the loop's runner. */
+    struct loop_watchdog *watchdog; /* Iteration and timer lag of the loop with loop_stall_ms, owned by the loop's runner. */
+    struct tunnel_trace *trace; /* Spans of the loop's sampled tunnels, NULL without trace_file and trace_sample. */
+    struct tunnel_shape *shape; /* ssr-server only, reads of the loop's sampled tunnels, NULL without shape_file and shape_sample. */
+    struct crypto_offload *crypto_offload; /* ssr-server only, crypto_workers of the loop, NULL without. */
+    struct egress_pool *egress_pool; /* ssr-server only, egress_addresses of the loop, NULL without. */
+
+    struct resolv_ctx *resolver; /* The loop's udns resolver, NULL falls back to uv_getaddrinfo(). */
+
+    struct remote_pool *remote_pool; /* ssr-client only, pre-resolved addresses of remote_host. */
+    struct tls_cli_pool *tls_cli_pool; /* ssr-client over TLS only. */
+    struct mux_cli *mux_cli; /* ssr-client with mux_sessions, not over TLS. */
+    struct warm_pool *warm_pool; /* ssr-client with warm_connections, not over TLS. */
+    struct server_group *server_group; /* ssr-client with servers, not over TLS. */
+    struct server_probe *server_probe; /* ssr-client with servers and probe_interval, not over TLS. */
+    struct admission *admission; /* ssr-client with admission limits, owned by the loop's runner. */
+    struct fake_dns *fake_dns; /* ssr-client with fake_dns_port, one for all its loops. */
+    struct socks5_address *tunnel_dest; /* ssr-client, tunnel_address parsed once, NULL without. */
+
+    struct tunnel_stats *tunnel_stats;
+    struct handle_table *tunnel_handles; /* Of the loop's tunnels, see tunnel_handle(). */
 
     struct cipher_env_t *cipher;
 
     void *protocol_global;
     void *obfs_global;
+    void (*protocol_global_dispose)(void *data); /* The plugin's dispose_data, NULL frees it. */
+    void (*obfs_global_dispose)(void *data);
+    struct ssr_user_table *users; // __weak_ptr, owned by config and shared by the workers
+    struct ssr_replay_table *replay_windows; // __weak_ptr, ssr-server only, shared by the workers
+    struct server_env_t *host; // __weak_ptr, the loop's env whose pools a managed port's env borrows
+    struct managed_port *managed_port; // __weak_ptr, ssr-server, the port of a manager's env
 };
 #endif // _LOCAL_H
 
@@ -55,6 +214,16 @@ struct tunnel_cipher_ctx {
     struct enc_ctx *d_ctx;
     struct obfs_t *protocol; // __strong_ptr
     struct obfs_t *obfs; // __strong_ptr
+    struct stream_compressor *compress; /* What we send, NULL without compression. */
+    struct stream_compressor *decompress; /* What we receive. */
+    struct tunnel_trace *trace; /* The owning tunnel's, NULL when it's not sampled. */
+    uint32_t trace_id;
+    bool obfs_prechecked; /* Server side, the obfs has seen the first packet, */
+    bool protocol_prechecked; /* and the protocol the start of the stream. */
+    bool precheck_failed; /* One of them turned it down before it was decoded. */
+#if defined(SSR_STAGE_TIMING)
+    struct tunnel_stage_times *stage_times; /* Its protocol and obfs's in the loop's tunnel_stats, NULL past the combinations kept. */
+#endif
 };
 
 #define SSR_ERR_MAP(V)                                                         \
@@ -62,6 +231,7 @@ struct tunnel_cipher_ctx {
   V(-1, ssr_error_client_decode,      "client decode error.")                  \
   V(-2, ssr_error_invalid_password,   "invalid password or cipher.")           \
   V(-3, ssr_error_client_post_decrypt,"client post decrypt error.")            \
+  V(-4, ssr_error_compression,        "compression stream error.")             \
 
 typedef enum ssr_error {
 #define SSR_ERR_GEN(code, name, _) name = code,
@@ -74,6 +244,7 @@ const char *ssr_strerror(enum ssr_error err);
 
 struct tunnel_cipher_ctx;
 struct buffer_t;
+struct buffer_segments;
 
 void object_safe_free(void **obj);
 void string_safe_assign(char **target, const char *value);
@@ -83,28 +254,62 @@ void string_safe_assign(char **target, const char *value);
 #define DEFAULT_BIND_HOST     "127.0.0.1"
 #define DEFAULT_BIND_PORT     1080
 #define DEFAULT_IDLE_TIMEOUT  (60 * MILLISECONDS_PER_SECOND)
+#define DEFAULT_HANDSHAKE_TIMEOUT  (20 * MILLISECONDS_PER_SECOND)
+#define DEFAULT_CONNECT_TIMEOUT    (10 * MILLISECONDS_PER_SECOND)
+#define DEFAULT_LINGER_TIMEOUT     (10 * MILLISECONDS_PER_SECOND)
+#define DEFAULT_HANDSHAKE_DEADLINE (30 * MILLISECONDS_PER_SECOND)
+#define DEFAULT_HANDSHAKE_MIN_RATE 32
 #define DEFAULT_METHOD        "rc4-md5"
+#define DEFAULT_OVER_TLS_SPARE_CONNECTIONS 1
+#define DEFAULT_REPLAY_FILTER_CAPACITY    1000000  /* IVs remembered by ssr-server. */
+#define DEFAULT_REPLAY_FILTER_ERROR_RATE  1e-6
+#define DEFAULT_NOTSENT_LOWAT  (128 * 1024)  /* Unsent bytes a relayed socket holds, 0 leaves the system's. */
+#define DEFAULT_LOOP_STALL_MS  100
+#define DEFAULT_WORKER_BALANCE_LAG_MS  20
+#define DEFAULT_UPSTREAM_PROXY_IDLE  4
+#define DEFAULT_DEFER_ACCEPT   5  /* Seconds, ssr-server's socket.defer_accept. */
+
+#if defined(SSR_LOW_MEMORY)
+/* iOS network extensions and small routers. Fewer idle read blocks, and
+ * connections are shed and turned away before the system kills us. */
+#define READ_BUFFER_POOL_CACHED_MAX   32
+#define DEFAULT_ADMISSION_MAX_MEMORY  (40 * 1024 * 1024)
+#define DEFAULT_MEMORY_BUDGET         (24 * 1024 * 1024)
+#define DEFAULT_SHARED_READ_BUFFER    true
+#else
+#define DEFAULT_ADMISSION_MAX_MEMORY  0
+#define DEFAULT_MEMORY_BUDGET         0
+#define DEFAULT_SHARED_READ_BUFFER    false
+#endif // defined(SSR_LOW_MEMORY)
 
 #if !defined(TCP_BUF_SIZE_MAX)
 #define TCP_BUF_SIZE_MAX 32 * 1024
 #endif
 
+#if !defined(TCP_READ_SIZE_MAX)
+#define TCP_READ_SIZE_MAX (256 * 1024)  /* Streaming reads that keep filling up grow to this. */
+#endif
+
+#if !defined(READ_BUFFER_POOL_CACHED_MAX)
+#define READ_BUFFER_POOL_CACHED_MAX 512  /* Idle blocks kept per size class. */
+#endif
+
 struct server_config * config_create(void);
 void config_release(struct server_config *cf);
 void config_change_for_server(struct server_config *config);
 
-int tunnel_ctx_compare_for_c_set(const void *left, const void *right);
 
 struct server_env_t * ssr_cipher_env_create(struct server_config *config, void *data);
+/* Without the cipher and protocol/obfs data, NULL until ssr_cipher_env_prepare(). */
+struct server_env_t * ssr_cipher_env_create_lazy(struct server_config *config, void *data);
+/* Makes the cipher and protocol/obfs data of |config|. Touches nothing of
+ * the loop, so it may run on another thread while the loop leaves them be. */
+void ssr_cipher_env_prepare(struct server_env_t *env);
+/* Its own cipher and protocol/obfs data for |config|, the rest is |host|'s and must outlive it. */
+struct server_env_t * ssr_cipher_env_create_shared(struct server_config *config, struct server_env_t *host);
 void ssr_cipher_env_release(struct server_env_t *env);
 bool is_completed_package(struct server_env_t *env, const uint8_t *data, size_t size);
 
-struct cstl_set * cstl_set_container_create(int(*compare_objs)(const void*,const void*), void(*destroy_obj)(void*));
-void cstl_set_container_destroy(struct cstl_set *set);
-void cstl_set_container_add(struct cstl_set *set, void *obj);
-void cstl_set_container_remove(struct cstl_set *set, void *obj);
-void cstl_set_container_traverse(struct cstl_set *set, void(*fn)(const void *obj, void *p), void *p);
-
 struct cstl_list;
 struct cstl_list * obj_list_create(int(*compare_objs)(const void*,const void*), void(*destroy_obj)(void*));
 void obj_list_destroy(struct cstl_list *list);
@@ -114,25 +319,27 @@ void obj_list_for_each(struct cstl_list* pSlist, void (*fn)(const void *elem, vo
 const void * obj_list_element_at(struct cstl_list* pList, size_t pos);
 size_t obj_list_size(struct cstl_list* pSlist);
 
-struct cstl_map;
-struct cstl_map * obj_map_create(int(*compare_key)(const void*,const void*), void (*destroy_key)(void*), void (*destroy_value)(void*));
-void obj_map_destroy(struct cstl_map *map);
-bool obj_map_add(struct cstl_map *map, void *key, size_t k_size, void *value, size_t v_size);
-bool obj_map_exists(struct cstl_map *map, const void *key);
-bool obj_map_replace(struct cstl_map *map, const void *key, const void *value, size_t v_size);
-void obj_map_remove(struct cstl_map *map, const void *key);
-const void * obj_map_find(struct cstl_map *map, const void *key);
-void obj_map_traverse(struct cstl_map *map, void(*fn)(const void *key, const void *value, void *p), void *p);
-
 struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t tcp_mss);
 void tunnel_cipher_release(struct tunnel_cipher_ctx *tc);
+/* Shrinks what the protocol and obfs plugins buffered, for an idle tunnel. */
+void tunnel_cipher_trim(struct tunnel_cipher_ctx *tc);
+size_t tunnel_cipher_headroom(const struct tunnel_cipher_ctx *tc);
 bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc);
 enum ssr_error tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf);
 enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf, struct buffer_t **feedback);
 
 struct buffer_t * tunnel_cipher_server_encrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf);
+struct buffer_segments * tunnel_cipher_server_encrypt_segments(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf);
 struct buffer_t * tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf, struct buffer_t **receipt, struct buffer_t **confirm);
+/* No protocol or obfs plugin and both IVs through, so a chunk only touches
+ * the direction's enc_ctx and may be run on another thread. */
+bool tunnel_cipher_server_offloadable(const struct tunnel_cipher_ctx *tc);
+/* The cipher alone, for crypto_offload.h: no trace span, no receipt or confirm. */
+struct buffer_t * tunnel_cipher_server_crypt_offloaded(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf, bool encrypt);
 
-bool pre_parse_header(struct buffer_t *data);
+/* Where the SOCKS5 address starts in the first packet, past the 0x80,
+ * 0x81, 0x82 or 0x88 framing of the older clients. 0 without one, or if
+ * it doesn't check out. Nothing before that offset is looked at again. */
+size_t pre_parse_header(struct buffer_t *data);
 
 #endif // defined(__SSR_EXECUTIVE__)
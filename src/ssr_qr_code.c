@@ -1,8 +1,11 @@
 
+#include <ctype.h>
+#include <limits.h>
 #include "base64.h"
 #include "ssr_executive.h"
 #include "ssr_cipher_names.h"
 #include "obfs.h" // for SSR_BUFF_SIZE
+#include "ssr_qr_code.h"
 
 static const char *ss_header = "ss://";
 static const char *ssr_header = "ssr://";
@@ -329,3 +332,292 @@ struct server_config * decode_ssr(const char *text) {
     
     return config;
 }
+
+//
+// Subscriptions. Every link is decoded in place within the arena, a base64
+// field never grows, so the arena is one copy of the text.
+//
+
+// Decode |len| characters at |coded| over themselves and NUL terminate them.
+static int subscription_decode_field(char *coded, size_t len) {
+    int n = any_base64_decode((const unsigned char *)coded, (int)len, (unsigned char *)coded);
+    if (n >= 0) {
+        coded[n] = '\0';
+    }
+    return n;
+}
+
+// host:port:protocol:method:obfs:base64pass/?obfsparam=...&protoparam=...&remarks=...&group=...
+static bool subscription_parse_ssr(char *text, size_t len, struct ssr_link *link) {
+    char *basic = text, *optional, *base64pass, *obfs, *method, *protocol, *port;
+
+    if (subscription_decode_field(text, len) < 0) {
+        return false;
+    }
+    optional = strchr(basic, '/');
+    if (optional != NULL) {
+        *optional++ = '\0';
+        if (*optional == '?') {
+            *optional++ = '\0';
+        }
+    }
+    if ((base64pass = strrchr(basic, ':')) == NULL) {
+        return false;
+    }
+    *base64pass++ = '\0';
+    if ((obfs = strrchr(basic, ':')) == NULL) {
+        return false;
+    }
+    *obfs++ = '\0';
+    if ((method = strrchr(basic, ':')) == NULL) {
+        return false;
+    }
+    *method++ = '\0';
+    if ((protocol = strrchr(basic, ':')) == NULL) {
+        return false;
+    }
+    *protocol++ = '\0';
+    if ((port = strrchr(basic, ':')) == NULL) {
+        return false;
+    }
+    *port++ = '\0';
+    if (subscription_decode_field(base64pass, strlen(base64pass)) < 0) {
+        return false;
+    }
+
+    link->remote_host = basic;
+    link->remote_port = (unsigned short)atoi(port);
+    link->protocol = protocol;
+    link->method = method;
+    link->obfs = obfs;
+    link->password = base64pass;
+
+    while (optional != NULL && *optional != '\0') {
+        char *next = strchr(optional, '&');
+        char *value = strchr(optional, '=');
+        const char **target = NULL;
+        if (next) {
+            *next++ = '\0';
+        }
+        if (value) {
+            *value++ = '\0';
+            if (strcmp(optional, obfsparam) == 0) {
+                target = &link->obfs_param;
+            } else if (strcmp(optional, protoparam) == 0) {
+                target = &link->protocol_param;
+            } else if (strcmp(optional, remarks) == 0) {
+                target = &link->remarks;
+            } else if (strcmp(optional, group) == 0) {
+                target = &link->group;
+            }
+            // udpport and uot aren't kept, as with ssr_qr_code_decode().
+            if (target && subscription_decode_field(value, strlen(value)) >= 0) {
+                *target = value;
+            }
+        }
+        optional = next;
+    }
+    return true;
+}
+
+// base64(method:password@hostname:port)#remarks
+static bool subscription_parse_ss(char *text, size_t len, struct ssr_link *link) {
+    char *hash = memchr(text, '#', len);
+    char *password, *port, *hostname;
+
+    if (hash != NULL) {
+        *hash++ = '\0';
+        link->remarks = hash;
+        len = (size_t)(hash - 1 - text);
+    }
+    if (strcspn(text, "@:/?") != len) {
+        // SS AEAD not support forever.
+        return false;
+    }
+    if (subscription_decode_field(text, len) < 0) {
+        return false;
+    }
+    if ((password = strchr(text, ':')) == NULL) {
+        return false;
+    }
+    *password++ = '\0';
+    if ((port = strrchr(password, ':')) == NULL) {
+        return false;
+    }
+    *port++ = '\0';
+    if ((hostname = strrchr(password, '@')) == NULL) {
+        return false;
+    }
+    *hostname++ = '\0';
+
+    link->method = text;
+    link->password = password;
+    link->remote_host = hostname;
+    link->remote_port = (unsigned short)atoi(port);
+    link->protocol = ssr_protocol_name_of_type(ssr_protocol_origin);
+    link->obfs = ssr_obfs_name_of_type(ssr_obfs_plain);
+    return true;
+}
+
+static bool subscription_link_valid(const struct ssr_link *link) {
+    return link->remote_host && *link->remote_host && link->remote_port != 0 &&
+        link->method && *link->method && link->password &&
+        link->protocol && *link->protocol && link->obfs && *link->obfs;
+}
+
+struct ssr_subscription * ssr_subscription_decode(const char *text, size_t len) {
+    struct ssr_subscription *sub;
+    size_t at = 0, plain_len, lines = 1, hdr_ssr = strlen(ssr_header), hdr_ss = strlen(ss_header);
+    char *line, *end;
+
+    if (text == NULL || len >= INT_MAX) {
+        return NULL;
+    }
+    sub = (struct ssr_subscription *) calloc(1, sizeof(*sub));
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->arena = (char *) malloc(len + 1);
+    if (sub->arena == NULL) {
+        free(sub);
+        return NULL;
+    }
+
+    while (at < len && isspace((unsigned char)text[at])) {
+        ++at;
+    }
+    if ((len - at >= hdr_ssr && strncmp(text + at, ssr_header, hdr_ssr) == 0) ||
+        (len - at >= hdr_ss && strncmp(text + at, ss_header, hdr_ss) == 0))
+    {
+        memcpy(sub->arena, text, len);
+        plain_len = len;
+    } else {
+        int n = any_base64_decode((const unsigned char *)text, (int)len, (unsigned char *)sub->arena);
+        plain_len = (n > 0) ? (size_t)n : 0;
+        sub->skipped += (n < 0) ? 1 : 0;
+    }
+    sub->arena[plain_len] = '\0';
+
+    end = sub->arena + plain_len;
+    for (line = sub->arena; (line = memchr(line, '\n', (size_t)(end - line))) != NULL; ++line) {
+        ++lines;
+    }
+    sub->links = (struct ssr_link *) calloc(lines, sizeof(sub->links[0]));
+    if (sub->links == NULL) {
+        ssr_subscription_release(sub);
+        return NULL;
+    }
+
+    for (line = sub->arena; line < end; ) {
+        char *next = memchr(line, '\n', (size_t)(end - line));
+        struct ssr_link *link = &sub->links[sub->count];
+        size_t line_len;
+        bool parsed = false;
+
+        if (next) {
+            *next++ = '\0';
+        } else {
+            next = end;
+        }
+        while (*line && isspace((unsigned char)*line)) {
+            ++line;
+        }
+        line_len = strlen(line);
+        while (line_len > 0 && isspace((unsigned char)line[line_len - 1])) {
+            line[--line_len] = '\0';
+        }
+        if (line_len == 0) {
+            line = next;
+            continue;
+        }
+        if (line_len >= hdr_ssr && strncmp(line, ssr_header, hdr_ssr) == 0) {
+            parsed = subscription_parse_ssr(line + hdr_ssr, line_len - hdr_ssr, link);
+        } else if (line_len >= hdr_ss && strncmp(line, ss_header, hdr_ss) == 0) {
+            parsed = subscription_parse_ss(line + hdr_ss, line_len - hdr_ss, link);
+        }
+        if (parsed && subscription_link_valid(link)) {
+            ++sub->count;
+        } else {
+            memset(link, 0, sizeof(*link));
+            ++sub->skipped;
+        }
+        line = next;
+    }
+    return sub;
+}
+
+void ssr_subscription_release(struct ssr_subscription *sub) {
+    if (sub == NULL) {
+        return;
+    }
+    free(sub->links);
+    free(sub->arena);
+    free(sub);
+}
+
+struct server_config * ssr_link_to_config(const struct ssr_link *link) {
+    struct server_config *config;
+    if (link == NULL) {
+        return NULL;
+    }
+    config = config_create();
+    string_safe_assign(&config->remote_host, link->remote_host);
+    config->remote_port = link->remote_port;
+    string_safe_assign(&config->method, link->method);
+    string_safe_assign(&config->password, link->password);
+    string_safe_assign(&config->protocol, link->protocol);
+    string_safe_assign(&config->protocol_param, link->protocol_param);
+    string_safe_assign(&config->obfs, link->obfs);
+    string_safe_assign(&config->obfs_param, link->obfs_param);
+    string_safe_assign(&config->remarks, link->remarks);
+    return config;
+}
+
+static bool subscription_same(const char *a, const char *b) {
+    return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+size_t ssr_subscription_add_servers(const struct ssr_subscription *sub, struct server_config *config, size_t max) {
+    size_t index, added = 0;
+
+    if (sub == NULL || config == NULL) {
+        return 0;
+    }
+    for (index = 0; index < sub->count && config->servers_count < max; ++index) {
+        const struct ssr_link *link = &sub->links[index];
+        struct server_group_entry *servers;
+        size_t k;
+
+        if (subscription_same(link->method, config->method) == false ||
+            subscription_same(link->password, config->password) == false ||
+            subscription_same(link->protocol, config->protocol) == false ||
+            subscription_same(link->protocol_param, config->protocol_param) == false ||
+            subscription_same(link->obfs, config->obfs) == false ||
+            subscription_same(link->obfs_param, config->obfs_param) == false)
+        {
+            continue;
+        }
+        if (link->remote_port == config->remote_port && subscription_same(link->remote_host, config->remote_host)) {
+            continue;
+        }
+        for (k = 0; k < config->servers_count; ++k) {
+            if (link->remote_port == config->servers[k].port && subscription_same(link->remote_host, config->servers[k].host)) {
+                break;
+            }
+        }
+        if (k < config->servers_count) {
+            continue;
+        }
+        servers = (struct server_group_entry *) realloc(config->servers, (config->servers_count + 1) * sizeof(servers[0]));
+        if (servers == NULL) {
+            break;
+        }
+        config->servers = servers;
+        servers[config->servers_count].host = strdup(link->remote_host);
+        servers[config->servers_count].port = link->remote_port;
+        servers[config->servers_count].weight = 1;
+        config->servers_count++;
+        added++;
+    }
+    return added;
+}
@@ -17,4 +17,49 @@ char * ssr_qr_code_encode(const struct server_config *config, void*(*alloc_fn)(s
 //
 struct server_config * ssr_qr_code_decode(const char *text);
 
+//
+// One link of a subscription. The strings live in the subscription's arena.
+//
+struct ssr_link {
+    const char *remote_host;
+    unsigned short remote_port;
+    const char *method;
+    const char *password;
+    const char *protocol;
+    const char *protocol_param;
+    const char *obfs;
+    const char *obfs_param;
+    const char *remarks;
+    const char *group;
+};
+
+struct ssr_subscription {
+    struct ssr_link *links;
+    size_t count;
+    size_t skipped; // Lines that aren't an ssr:// or ss:// link we can read.
+    char *arena;
+};
+
+//
+// Decode a subscription, ssr:// and ss:// links one per line, as is or
+// base64 encoded as a whole. The text is decoded once into an arena that
+// every link points into, no string is allocated on its own.
+// Note: caller must release it with ssr_subscription_release().
+//
+struct ssr_subscription * ssr_subscription_decode(const char *text, size_t len);
+void ssr_subscription_release(struct ssr_subscription *sub);
+
+//
+// A server_config of one link.
+// Note: caller must release server_config data with config_release().
+//
+struct server_config * ssr_link_to_config(const struct ssr_link *link);
+
+//
+// Add the links sharing method, password, protocol and obfs of config's
+// remote_host to its "servers", until it holds max of them. Returns the
+// number added, hosts already there are left out.
+//
+size_t ssr_subscription_add_servers(const struct ssr_subscription *sub, struct server_config *config, size_t max);
+
 #endif
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "ssr_replay_window.h"
+
+#define REPLAY_WINDOW_WORDS (REPLAY_WINDOW_BITS / 64)
+#define REPLAY_NIL ((uint32_t)-1)
+
+struct replay_client {
+    uint32_t uid;
+    uint32_t client_id;
+    uint32_t top;       /* Highest connection id seen. */
+    uint64_t bitmap[REPLAY_WINDOW_WORDS];  /* Bit id % REPLAY_WINDOW_BITS set, id was seen, for ids in the window. */
+    uint32_t hash_next;
+    uint32_t lru_prev;  /* Towards the most recently seen. */
+    uint32_t lru_next;
+};
+
+struct ssr_replay_table {
+    uv_mutex_t lock;
+    size_t capacity;
+    size_t count;
+    size_t mask;        /* Buckets minus one, buckets is a power of two. */
+    uint32_t *buckets;
+    struct replay_client *clients;
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    struct ssr_replay_entry *journal;  /* With ssr_replay_table_journal(), ids accepted since it was last taken. */
+    size_t journal_count;
+    size_t journal_capacity;
+    uint64_t journal_dropped;
+};
+
+static size_t client_hash(uint32_t uid, uint32_t client_id) {
+    uint64_t h = ((uint64_t)uid << 32) | client_id;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static void lru_unlink(struct ssr_replay_table *table, uint32_t index) {
+    struct replay_client *c = table->clients + index;
+    if (c->lru_prev != REPLAY_NIL) {
+        table->clients[c->lru_prev].lru_next = c->lru_next;
+    } else {
+        table->lru_head = c->lru_next;
+    }
+    if (c->lru_next != REPLAY_NIL) {
+        table->clients[c->lru_next].lru_prev = c->lru_prev;
+    } else {
+        table->lru_tail = c->lru_prev;
+    }
+}
+
+static void lru_push_front(struct ssr_replay_table *table, uint32_t index) {
+    struct replay_client *c = table->clients + index;
+    c->lru_prev = REPLAY_NIL;
+    c->lru_next = table->lru_head;
+    if (table->lru_head != REPLAY_NIL) {
+        table->clients[table->lru_head].lru_prev = index;
+    } else {
+        table->lru_tail = index;
+    }
+    table->lru_head = index;
+}
+
+static void hash_unlink(struct ssr_replay_table *table, uint32_t index) {
+    struct replay_client *c = table->clients + index;
+    uint32_t *link = table->buckets + (client_hash(c->uid, c->client_id) & table->mask);
+    while (*link != index) {
+        link = &table->clients[*link].hash_next;
+    }
+    *link = c->hash_next;
+}
+
+struct ssr_replay_table * ssr_replay_table_create(size_t max_clients) {
+    struct ssr_replay_table *table;
+    size_t buckets = 16;
+
+    if (max_clients == 0 || max_clients >= REPLAY_NIL) {
+        max_clients = DEFAULT_REPLAY_WINDOW_CLIENTS;
+    }
+    while (buckets < max_clients) {
+        buckets <<= 1;
+    }
+    table = (struct ssr_replay_table *) calloc(1, sizeof(*table));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->buckets = (uint32_t *) malloc(buckets * sizeof(uint32_t));
+    table->clients = (struct replay_client *) calloc(max_clients, sizeof(struct replay_client));
+    if (table->buckets == NULL || table->clients == NULL) {
+        free(table->buckets);
+        free(table->clients);
+        free(table);
+        return NULL;
+    }
+    memset(table->buckets, 0xFF, buckets * sizeof(uint32_t));
+    table->capacity = max_clients;
+    table->mask = buckets - 1;
+    table->lru_head = REPLAY_NIL;
+    table->lru_tail = REPLAY_NIL;
+    uv_mutex_init(&table->lock);
+    return table;
+}
+
+void ssr_replay_table_destroy(struct ssr_replay_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    free(table->buckets);
+    free(table->clients);
+    free(table->journal);
+    uv_mutex_destroy(&table->lock);
+    free(table);
+}
+
+static bool window_test(const struct replay_client *c, uint32_t id) {
+    id %= REPLAY_WINDOW_BITS;
+    return (c->bitmap[id / 64] & ((uint64_t)1 << (id % 64))) != 0;
+}
+
+static void window_set(struct replay_client *c, uint32_t id) {
+    id %= REPLAY_WINDOW_BITS;
+    c->bitmap[id / 64] |= ((uint64_t)1 << (id % 64));
+}
+
+static void window_reset(struct replay_client *c, uint32_t connection_id) {
+    memset(c->bitmap, 0, sizeof(c->bitmap));
+    c->top = connection_id;
+    window_set(c, connection_id);
+}
+
+static bool window_check_add(struct replay_client *c, uint32_t connection_id) {
+    uint32_t diff, id;
+    if (connection_id > c->top) {
+        diff = connection_id - c->top;
+        if (diff >= REPLAY_WINDOW_BITS) {
+            window_reset(c, connection_id);
+            return true;
+        }
+        // The bits of the ids the window moves past are reused for the new ones.
+        for (id = c->top + 1; id != connection_id; ++id) {
+            uint32_t bit = id % REPLAY_WINDOW_BITS;
+            c->bitmap[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+        }
+        c->top = connection_id;
+        window_set(c, connection_id);
+        return true;
+    }
+    diff = c->top - connection_id;
+    if (diff >= REPLAY_WINDOW_BITS || window_test(c, connection_id)) {
+        return false;
+    }
+    window_set(c, connection_id);
+    return true;
+}
+
+/* Under the lock. */
+static bool table_check_add(struct ssr_replay_table *table, uint32_t uid, uint32_t client_id, uint32_t connection_id) {
+    uint32_t *bucket;
+    uint32_t index;
+    struct replay_client *c;
+    bool ok;
+
+    bucket = table->buckets + (client_hash(uid, client_id) & table->mask);
+    for (index = *bucket; index != REPLAY_NIL; index = table->clients[index].hash_next) {
+        c = table->clients + index;
+        if (c->uid == uid && c->client_id == client_id) {
+            break;
+        }
+    }
+    if (index != REPLAY_NIL) {
+        ok = window_check_add(table->clients + index, connection_id);
+        lru_unlink(table, index);
+    } else {
+        if (table->count < table->capacity) {
+            index = (uint32_t)table->count++;
+        } else {
+            index = table->lru_tail;
+            lru_unlink(table, index);
+            hash_unlink(table, index);
+        }
+        c = table->clients + index;
+        c->uid = uid;
+        c->client_id = client_id;
+        window_reset(c, connection_id);
+        c->hash_next = *bucket;
+        *bucket = index;
+        ok = true;
+    }
+    lru_push_front(table, index);
+    return ok;
+}
+
+bool ssr_replay_table_check_add(struct ssr_replay_table *table, uint32_t uid, uint32_t client_id, uint32_t connection_id) {
+    bool ok;
+    if (table == NULL) {
+        return true;
+    }
+    uv_mutex_lock(&table->lock);
+    ok = table_check_add(table, uid, client_id, connection_id);
+    if (ok && table->journal) {
+        if (table->journal_count < table->journal_capacity) {
+            struct ssr_replay_entry *e = &table->journal[table->journal_count++];
+            e->uid = uid;
+            e->client_id = client_id;
+            e->connection_id = connection_id;
+        } else {
+            table->journal_dropped++;
+        }
+    }
+    uv_mutex_unlock(&table->lock);
+    return ok;
+}
+
+void ssr_replay_table_journal(struct ssr_replay_table *table, size_t capacity) {
+    struct ssr_replay_entry *journal = NULL;
+    if (table == NULL) {
+        return;
+    }
+    if (capacity) {
+        journal = (struct ssr_replay_entry *) calloc(capacity, sizeof(*journal));
+    }
+    uv_mutex_lock(&table->lock);
+    free(table->journal);
+    table->journal = journal;
+    table->journal_capacity = journal ? capacity : 0;
+    table->journal_count = 0;
+    uv_mutex_unlock(&table->lock);
+}
+
+size_t ssr_replay_table_take_journal(struct ssr_replay_table *table, struct ssr_replay_entry *out, size_t max, uint64_t *dropped) {
+    size_t count;
+    if (table == NULL) {
+        return 0;
+    }
+    uv_mutex_lock(&table->lock);
+    count = (table->journal_count < max) ? table->journal_count : max;
+    if (count) {
+        memcpy(out, table->journal, count * sizeof(*out));
+        table->journal_count -= count;
+        memmove(table->journal, table->journal + count, table->journal_count * sizeof(*out));
+    }
+    if (dropped) {
+        *dropped += table->journal_dropped;
+    }
+    table->journal_dropped = 0;
+    uv_mutex_unlock(&table->lock);
+    return count;
+}
+
+void ssr_replay_table_merge(struct ssr_replay_table *table, const struct ssr_replay_entry *entries, size_t count) {
+    size_t i;
+    if (table == NULL) {
+        return;
+    }
+    uv_mutex_lock(&table->lock);
+    for (i = 0; i < count; ++i) {
+        (void)table_check_add(table, entries[i].uid, entries[i].client_id, entries[i].connection_id);
+    }
+    uv_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,43 @@
+#if !defined(__ssr_replay_window_h__)
+#define __ssr_replay_window_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Server side replay detection for the auth_chain_* and auth_aes128_*
+ * handshakes. Every (uid, client_id) pair keeps an IPsec style sliding
+ * window over its connection ids: the highest id seen plus a bitmap of
+ * the REPLAY_WINDOW_BITS ids below it, 512 bytes a client. A client's
+ * loops, pools and racing connects share one id counter, so its first
+ * packets arrive well out of order; the window takes as many as the
+ * Python server does. Clients live in a bounded hash, the least recently
+ * seen one is dropped when it is full. One instance is shared by all
+ * worker loops under a lock, a replay may land on any worker.
+ */
+
+#define REPLAY_WINDOW_BITS 0x1000
+
+#define DEFAULT_REPLAY_WINDOW_CLIENTS 16384
+
+struct ssr_replay_table;
+
+struct ssr_replay_entry {
+    uint32_t uid;
+    uint32_t client_id;
+    uint32_t connection_id;
+};
+
+struct ssr_replay_table * ssr_replay_table_create(size_t max_clients);
+void ssr_replay_table_destroy(struct ssr_replay_table *table);
+/* Records |connection_id|, false when it was seen before or fell out of the window. */
+bool ssr_replay_table_check_add(struct ssr_replay_table *table, uint32_t uid, uint32_t client_id, uint32_t connection_id);
+
+/* For ssr_cluster, as ppbloom_journal(): the connection ids accepted, up to |capacity| until they're taken. */
+void ssr_replay_table_journal(struct ssr_replay_table *table, size_t capacity);
+size_t ssr_replay_table_take_journal(struct ssr_replay_table *table, struct ssr_replay_entry *out, size_t max, uint64_t *dropped);
+/* Records connection ids another process accepted, not journaled. */
+void ssr_replay_table_merge(struct ssr_replay_table *table, const struct ssr_replay_entry *entries, size_t count);
+
+#endif // !defined(__ssr_replay_window_h__)
@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uv.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "ssr_user_table.h"
+
+#define USER_TABLE_MIN_SLOTS  16
+#define USER_TABLE_MAGIC      "SSRUSERS"
+#define USER_TABLE_BYTE_ORDER 0x01020304U  /* Read back as written, or the file is from another host. */
+#define USER_TABLE_USAGE_PAGE   4096  /* Usages per page, a page never moves once the workers count into it. */
+#define USER_TABLE_USAGE_PAGES  1024  /* So at most 4M users ever. */
+
+/*
+ * The slots in use are published whole, with their size. Those a growth
+ * replaced stay on |older| until the table goes: tunnels may still hold
+ * users in them, and every later change of such a user is made to its
+ * copies too.
+ */
+struct user_slots {
+    size_t mask;              /* Slots minus one, slots is a power of two. */
+    struct ssr_user *records; /* Empty when password is 0. */
+    struct user_slots *older;
+};
+
+/* A strings block a growth replaced, for the passwords still read from it. */
+struct user_strings {
+    char *strings;
+    struct user_strings *older;
+};
+
+struct ssr_user_table {
+    uv_mutex_t lock;          /* Of the connection counts, and of every change after the workers start. */
+    size_t count;             /* Users, the removed ones left out. */
+    size_t used;              /* Slots taken, by the users and the removed ones. */
+    size_t indexes;           /* Usages handed out, every ssr_user.index is under it. */
+    uint64_t version;         /* Of the last ssr_user_table_set_version(). */
+    struct user_slots *slots;
+    char *strings;            /* The passwords, each NUL terminated. Offset 0 is an empty string. */
+    size_t strings_size;
+    size_t strings_capacity;
+    struct user_strings *older_strings;
+    struct ssr_user_usage *usage[USER_TABLE_USAGE_PAGES];  /* By ssr_user.index, always this process' own. */
+    void *map;                /* Of ssr_user_table_map(), the first |slots| and |strings| are in it. */
+    size_t map_size;
+};
+
+/* The layout ssr_user_table_write() puts out, the slots and strings follow at their offsets. */
+struct ssr_user_table_file {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t slots;
+    uint64_t slots_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct ssr_user_shard {
+    struct ssr_user_table *table;
+    size_t count;            /* Users of |table| when it was created. */
+    uint64_t *pending;       /* By ssr_user.index, bytes not added up yet. */
+    uint64_t flushed_at;     /* uv_now() of the last flush. */
+    uint64_t wall;           /* time() of the last flush, for the expiries. */
+};
+
+static struct ssr_user_usage * usage_of(const struct ssr_user_table *table, uint64_t index) {
+    return &table->usage[index / USER_TABLE_USAGE_PAGE][index % USER_TABLE_USAGE_PAGE];
+}
+
+static bool user_removed(const struct ssr_user *user) {
+    return __atomic_load_n(&user->expires, __ATOMIC_RELAXED) == SSR_USER_REMOVED;
+}
+
+static size_t uid_hash(uint32_t uid) {
+    uint32_t h = uid;
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return (size_t)h;
+}
+
+/* Linear probing, the slots are never more than half taken. A removed user keeps its slot. */
+static struct ssr_user * slot_of(const struct user_slots *slots, uint32_t uid) {
+    size_t i = uid_hash(uid) & slots->mask;
+    while (__atomic_load_n(&slots->records[i].password, __ATOMIC_ACQUIRE) != 0 && slots->records[i].uid != uid) {
+        i = (i + 1) & slots->mask;
+    }
+    return &slots->records[i];
+}
+
+static struct user_slots * slots_create(size_t count) {
+    struct user_slots *slots = (struct user_slots *) calloc(1, sizeof(*slots));
+    if (slots == NULL) {
+        return NULL;
+    }
+    slots->records = (struct ssr_user *) calloc(count, sizeof(struct ssr_user));
+    if (slots->records == NULL) {
+        free(slots);
+        return NULL;
+    }
+    slots->mask = count - 1;
+    return slots;
+}
+
+/* New slots with room for |count| users, the removed ones left behind, published over the old. */
+static bool table_grow(struct ssr_user_table *table, size_t count) {
+    struct user_slots *old = table->slots, *slots;
+    size_t size = USER_TABLE_MIN_SLOTS, i;
+
+    while (size < count * 4) {
+        size *= 2;
+    }
+    if ((slots = slots_create(size)) == NULL) {
+        return false;
+    }
+    table->used = 0;
+    for (i = 0; old && i <= old->mask; ++i) {
+        if (old->records[i].password != 0 && !user_removed(&old->records[i])) {
+            *slot_of(slots, old->records[i].uid) = old->records[i];
+            table->used++;
+        }
+    }
+    slots->older = old;
+    __atomic_store_n(&table->slots, slots, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Offset of a copy of |str| in the strings, 0 when out of memory. */
+static size_t strings_add(struct ssr_user_table *table, const char *str) {
+    size_t len = strlen(str) + 1, offset = table->strings_size;
+    if (offset + len > table->strings_capacity) {
+        size_t capacity = table->strings_capacity * 2;
+        struct user_strings *older;
+        char *grown;
+        while (capacity < offset + len) {
+            capacity *= 2;
+        }
+        grown = (char *) malloc(capacity);
+        older = (struct user_strings *) malloc(sizeof(*older));
+        if (grown == NULL || older == NULL) {
+            free(grown);
+            free(older);
+            return 0;
+        }
+        // Before any offset into the new block, a reader that has one has the block.
+        memcpy(grown, table->strings, offset);
+        older->strings = table->strings;
+        older->older = table->older_strings;
+        table->older_strings = older;
+        __atomic_store_n(&table->strings, grown, __ATOMIC_RELEASE);
+        table->strings_capacity = capacity;
+    }
+    memcpy(table->strings + offset, str, len);
+    table->strings_size += len;
+    return offset;
+}
+
+/* A usage for a new user, zeroed. Out of memory or of pages, false. */
+static bool usage_add(struct ssr_user_table *table, uint64_t *index) {
+    size_t page = table->indexes / USER_TABLE_USAGE_PAGE;
+    if (page >= USER_TABLE_USAGE_PAGES) {
+        return false;
+    }
+    if (table->usage[page] == NULL &&
+        (table->usage[page] = (struct ssr_user_usage *) calloc(USER_TABLE_USAGE_PAGE, sizeof(struct ssr_user_usage))) == NULL) {
+        return false;
+    }
+    *index = table->indexes;
+    __atomic_store_n(&table->indexes, table->indexes + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+struct ssr_user_table * ssr_user_table_create(void) {
+    struct ssr_user_table *table = (struct ssr_user_table *) calloc(1, sizeof(*table));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->strings_capacity = 256;
+    table->strings = (char *) calloc(1, table->strings_capacity);
+    table->strings_size = 1;
+    if (table->strings == NULL || !table_grow(table, 0)) {
+        free(table->strings);
+        free(table);
+        return NULL;
+    }
+    uv_mutex_init(&table->lock);
+    return table;
+}
+
+void ssr_user_table_destroy(struct ssr_user_table *table) {
+    struct user_slots *slots, *older;
+    struct user_strings *strings, *older_strings;
+    size_t page;
+
+    if (table == NULL) {
+        return;
+    }
+    for (slots = table->slots; slots; slots = older) {
+        older = slots->older;
+        if (table->map == NULL) {
+            free(slots->records);
+        }
+        free(slots);
+    }
+    if (table->map) {
+#if defined(_WIN32)
+        free(table->map);
+#else
+        munmap(table->map, table->map_size);
+#endif
+    } else {
+        free(table->strings);
+    }
+    for (strings = table->older_strings; strings; strings = older_strings) {
+        older_strings = strings->older;
+        free(strings->strings);
+        free(strings);
+    }
+    for (page = 0; page < USER_TABLE_USAGE_PAGES && table->usage[page]; ++page) {
+        free(table->usage[page]);
+    }
+    uv_mutex_destroy(&table->lock);
+    free(table);
+}
+
+/* Sets |user| to the values of |from|, the password last so a reader never sees it before the rest. A taken slot keeps its uid and index. */
+static void user_store(struct ssr_user *user, const struct ssr_user *from) {
+    if (user->password == 0) {
+        user->uid = from->uid;
+        user->index = from->index;
+    }
+    __atomic_store_n(&user->max_connections, from->max_connections, __ATOMIC_RELAXED);
+    __atomic_store_n(&user->max_rate, from->max_rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&user->quota, from->quota, __ATOMIC_RELAXED);
+    __atomic_store_n(&user->expires, from->expires, __ATOMIC_RELAXED);
+    __atomic_store_n(&user->previous_until, from->previous_until, __ATOMIC_RELAXED);
+    __atomic_store_n(&user->previous, from->previous, __ATOMIC_RELEASE);
+    __atomic_store_n(&user->password, from->password, __ATOMIC_RELEASE);
+}
+
+/* The copies of the user |from| in the slots growths replaced, for the tunnels that still hold them. */
+static void user_store_older(struct ssr_user_table *table, const struct ssr_user *from) {
+    struct user_slots *slots;
+    for (slots = table->slots->older; slots; slots = slots->older) {
+        struct ssr_user *user = slot_of(slots, from->uid);
+        if (user->password != 0 && user->index == from->index) {
+            user_store(user, from);
+        }
+    }
+}
+
+static bool table_add(struct ssr_user_table *table, uint32_t uid, const char *password, unsigned int max_connections, unsigned int max_rate, uint64_t quota, uint64_t expires) {
+    struct ssr_user *user, record;
+
+    if (password == NULL) {
+        return false;
+    }
+    user = slot_of(table->slots, uid);
+    if (user->password == 0 && (table->used + 1) * 2 > table->slots->mask + 1) {
+        if (!table_grow(table, table->count + 1)) {
+            return false;
+        }
+        user = slot_of(table->slots, uid);
+    }
+    record.uid = uid;
+    record.max_connections = max_connections;
+    record.max_rate = max_rate;
+    record.reserved = 0;
+    record.quota = quota;
+    record.expires = (expires == SSR_USER_REMOVED) ? SSR_USER_REMOVED + 1 : expires;
+    record.index = user->index;
+    record.previous = user->previous;
+    record.previous_until = user->previous_until;
+    if (user->password != 0 && !user_removed(user) && strcmp(table->strings + user->password, password) == 0) {
+        // The same password, the rotation going on, if any, goes on too.
+        record.password = user->password;
+    } else {
+        // The usage goes on, and a replaced password stays in the strings
+        // where it still works for a while.
+        if (user->password == 0 && usage_add(table, &record.index) == false) {
+            return false;
+        }
+        if ((record.password = strings_add(table, password)) == 0) {
+            return false;
+        }
+        record.previous = (user->password != 0 && !user_removed(user)) ? user->password : 0;
+        record.previous_until = record.previous ? (uint64_t)time(NULL) + SSR_USER_KEY_GRACE : 0;
+    }
+    if (user->password == 0) {
+        table->used++;
+        __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELAXED);
+    } else if (user_removed(user)) {
+        __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELAXED);
+    }
+    user_store(user, &record);
+    user_store_older(table, &record);
+    return true;
+}
+
+bool ssr_user_table_add(struct ssr_user_table *table, uint32_t uid, const char *password, unsigned int max_connections, unsigned int max_rate, uint64_t quota, uint64_t expires) {
+    bool result;
+    if (table == NULL || table->map) {
+        return false;
+    }
+    uv_mutex_lock(&table->lock);
+    result = table_add(table, uid, password, max_connections, max_rate, quota, expires);
+    uv_mutex_unlock(&table->lock);
+    return result;
+}
+
+bool ssr_user_table_set_previous(struct ssr_user_table *table, uint32_t uid, const char *password, uint64_t until) {
+    struct ssr_user *user, record;
+    if (table == NULL || table->map || password == NULL) {
+        return false;
+    }
+    uv_mutex_lock(&table->lock);
+    user = slot_of(table->slots, uid);
+    if (user->password == 0 || user_removed(user)) {
+        uv_mutex_unlock(&table->lock);
+        return false;
+    }
+    record = *user;
+    record.previous = strings_add(table, password);
+    record.previous_until = record.previous ? until : 0;
+    user_store(user, &record);
+    user_store_older(table, &record);
+    uv_mutex_unlock(&table->lock);
+    return record.previous != 0;
+}
+
+bool ssr_user_table_remove(struct ssr_user_table *table, uint32_t uid) {
+    struct ssr_user *user, record;
+    if (table == NULL || table->map) {
+        return false;
+    }
+    uv_mutex_lock(&table->lock);
+    user = slot_of(table->slots, uid);
+    if (user->password == 0 || user_removed(user)) {
+        uv_mutex_unlock(&table->lock);
+        return false;
+    }
+    record = *user;
+    record.expires = SSR_USER_REMOVED;
+    user_store(user, &record);
+    user_store_older(table, &record);
+    __atomic_store_n(&table->count, table->count - 1, __ATOMIC_RELAXED);
+    uv_mutex_unlock(&table->lock);
+    return true;
+}
+
+uint64_t ssr_user_table_version(const struct ssr_user_table *table) {
+    return table ? __atomic_load_n(&table->version, __ATOMIC_RELAXED) : 0;
+}
+
+void ssr_user_table_set_version(struct ssr_user_table *table, uint64_t version) {
+    if (table) {
+        __atomic_store_n(&table->version, version, __ATOMIC_RELAXED);
+    }
+}
+
+bool ssr_user_table_write(const struct ssr_user_table *table, const char *path) {
+    struct ssr_user_table_file header;
+    char *temp;
+    FILE *f;
+    bool ok;
+
+    if (table == NULL || path == NULL) {
+        return false;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, USER_TABLE_MAGIC, sizeof(header.magic));
+    header.byte_order = USER_TABLE_BYTE_ORDER;
+    header.record_size = (uint32_t)sizeof(struct ssr_user);
+    header.count = table->indexes;
+    header.slots = table->slots->mask + 1;
+    header.slots_offset = sizeof(header);  /* A multiple of 8. */
+    header.strings_offset = header.slots_offset + header.slots * sizeof(struct ssr_user);
+    header.strings_size = table->strings_size;
+
+    temp = (char *) malloc(strlen(path) + 32);
+    if (temp == NULL) {
+        return false;
+    }
+    sprintf(temp, "%s.%lu.tmp", path, (unsigned long)uv_os_getpid());
+    f = fopen(temp, "wb");
+    if (f == NULL) {
+        free(temp);
+        return false;
+    }
+    ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && fwrite(table->slots->records, sizeof(struct ssr_user), header.slots, f) == header.slots
+        && fwrite(table->strings, 1, table->strings_size, f) == table->strings_size;
+    ok = (fclose(f) == 0) && ok;
+#if defined(_WIN32)
+    remove(path);
+#endif
+    // Whoever maps |path| gets the old table or the new one, whole.
+    ok = ok && rename(temp, path) == 0;
+    if (!ok) {
+        remove(temp);
+    }
+    free(temp);
+    return ok;
+}
+
+static bool table_file_valid(const uint8_t *base, size_t size) {
+    const struct ssr_user_table_file *header = (const struct ssr_user_table_file *)base;
+    const struct ssr_user *slots;
+    const char *strings;
+    uint64_t i, used = 0;
+
+    if (size < sizeof(*header) || memcmp(header->magic, USER_TABLE_MAGIC, sizeof(header->magic)) != 0
+        || header->byte_order != USER_TABLE_BYTE_ORDER || header->record_size != sizeof(struct ssr_user)
+        || header->slots < USER_TABLE_MIN_SLOTS || (header->slots & (header->slots - 1)) != 0
+        || header->count > (uint64_t)USER_TABLE_USAGE_PAGE * USER_TABLE_USAGE_PAGES
+        || header->slots_offset % 8 != 0 || header->slots_offset > size
+        || header->slots > (size - header->slots_offset) / sizeof(struct ssr_user)
+        || header->strings_offset > size || header->strings_size == 0
+        || header->strings_size > size - header->strings_offset)
+    {
+        return false;
+    }
+    slots = (const struct ssr_user *)(base + header->slots_offset);
+    strings = (const char *)(base + header->strings_offset);
+    // The last password ends the strings, so none runs past them.
+    if (strings[header->strings_size - 1] != '\0') {
+        return false;
+    }
+    for (i = 0; i < header->slots; ++i) {
+        if (slots[i].password == 0) {
+            continue;
+        }
+        if (slots[i].password >= header->strings_size || slots[i].previous >= header->strings_size
+            || slots[i].index >= header->count)
+        {
+            return false;
+        }
+        used++;
+    }
+    return used * 2 <= header->slots;
+}
+
+struct ssr_user_table * ssr_user_table_map(const char *path) {
+    const struct ssr_user_table_file *header;
+    struct ssr_user_table *table;
+    FILE *f;
+    long size;
+    void *map;
+    size_t index;
+
+    if (path == NULL || (f = fopen(path, "rb")) == NULL) {
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < (long)sizeof(*header)) {
+        fclose(f);
+        return NULL;
+    }
+#if defined(_WIN32)
+    map = malloc((size_t)size);
+    if (map != NULL && (fseek(f, 0, SEEK_SET) != 0 || fread(map, 1, (size_t)size, f) != (size_t)size)) {
+        free(map);
+        map = NULL;
+    }
+    fclose(f);
+    if (map == NULL) {
+        return NULL;
+    }
+#else
+    map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    fclose(f);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+#endif
+    table = (struct ssr_user_table *) calloc(1, sizeof(*table));
+    if (table == NULL || !table_file_valid((const uint8_t *)map, (size_t)size)) {
+        free(table);
+#if defined(_WIN32)
+        free(map);
+#else
+        munmap(map, (size_t)size);
+#endif
+        return NULL;
+    }
+    header = (const struct ssr_user_table_file *)map;
+    table->map = map;
+    table->map_size = (size_t)size;
+    table->slots = (struct user_slots *) calloc(1, sizeof(*table->slots));
+    table->slots->mask = (size_t)header->slots - 1;
+    table->slots->records = (struct ssr_user *)((uint8_t *)map + header->slots_offset);
+    table->strings = (char *)map + header->strings_offset;
+    table->strings_size = (size_t)header->strings_size;
+    for (index = 0; index <= table->slots->mask; ++index) {
+        const struct ssr_user *user = &table->slots->records[index];
+        if (user->password != 0) {
+            table->used++;
+            table->count += user_removed(user) ? 0 : 1;
+        }
+    }
+    for (index = 0; index < header->count; index += USER_TABLE_USAGE_PAGE) {
+        table->usage[index / USER_TABLE_USAGE_PAGE] = (struct ssr_user_usage *) calloc(USER_TABLE_USAGE_PAGE, sizeof(struct ssr_user_usage));
+    }
+    table->indexes = (size_t)header->count;
+    uv_mutex_init(&table->lock);
+    return table;
+}
+
+size_t ssr_user_table_count(const struct ssr_user_table *table) {
+    return table ? __atomic_load_n(&table->count, __ATOMIC_RELAXED) : 0;
+}
+
+bool ssr_user_table_writable(const struct ssr_user_table *table) {
+    return table && table->map == NULL;
+}
+
+size_t ssr_user_table_indexes(const struct ssr_user_table *table) {
+    return table ? __atomic_load_n(&table->indexes, __ATOMIC_ACQUIRE) : 0;
+}
+
+const struct ssr_user * ssr_user_table_find(const struct ssr_user_table *table, uint32_t uid) {
+    const struct ssr_user *user;
+    if (table == NULL || ssr_user_table_count(table) == 0) {
+        return NULL;
+    }
+    user = slot_of(__atomic_load_n(&table->slots, __ATOMIC_ACQUIRE), uid);
+    // The empty slot the probe ended on may be another uid's by now.
+    return (__atomic_load_n(&user->password, __ATOMIC_ACQUIRE) && user->uid == uid && !user_removed(user)) ? user : NULL;
+}
+
+const char * ssr_user_password(const struct ssr_user_table *table, const struct ssr_user *user) {
+    // The offset first: the block of a later one is published before it.
+    uint64_t offset = __atomic_load_n(&user->password, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&table->strings, __ATOMIC_ACQUIRE) + offset;
+}
+
+const char * ssr_user_previous_password(const struct ssr_user_table *table, const struct ssr_user *user) {
+    uint64_t offset = __atomic_load_n(&user->previous, __ATOMIC_ACQUIRE);
+    uint64_t until = __atomic_load_n(&user->previous_until, __ATOMIC_RELAXED);
+    if (offset == 0 || (until && (uint64_t)time(NULL) >= until)) {
+        return NULL;
+    }
+    return __atomic_load_n(&table->strings, __ATOMIC_ACQUIRE) + offset;
+}
+
+void ssr_user_table_traverse(const struct ssr_user_table *table, void(*fn)(const struct ssr_user *user, const struct ssr_user_usage *usage, void *p), void *p) {
+    const struct user_slots *slots;
+    size_t i;
+    if (table == NULL || fn == NULL) {
+        return;
+    }
+    slots = __atomic_load_n(&table->slots, __ATOMIC_ACQUIRE);
+    for (i = 0; i <= slots->mask; ++i) {
+        const struct ssr_user *user = &slots->records[i];
+        if (__atomic_load_n(&user->password, __ATOMIC_ACQUIRE) != 0 && !user_removed(user)) {
+            fn(user, usage_of(table, user->index), p);
+        }
+    }
+}
+
+bool ssr_user_table_acquire(struct ssr_user_table *table, const struct ssr_user *user) {
+    struct ssr_user_usage *usage;
+    uint64_t expires;
+    unsigned int max_connections, max_rate;
+    uint64_t second;
+    bool result = false;
+    if (table == NULL || user == NULL) {
+        return false;
+    }
+    expires = __atomic_load_n(&user->expires, __ATOMIC_RELAXED);
+    if (expires && (uint64_t)time(NULL) >= expires) {
+        return false;
+    }
+    usage = usage_of(table, user->index);
+    max_connections = __atomic_load_n(&user->max_connections, __ATOMIC_RELAXED);
+    max_rate = __atomic_load_n(&user->max_rate, __ATOMIC_RELAXED);
+    second = uv_hrtime() / 1000000000;
+    uv_mutex_lock(&table->lock);
+    if (usage->rate_second != second) {
+        usage->rate_second = second;
+        usage->rate_count = 0;
+    }
+    if ((max_connections == 0 || usage->connections < max_connections) &&
+        (max_rate == 0 || usage->rate_count < max_rate))
+    {
+        usage->connections++;
+        usage->rate_count++;
+        result = true;
+    }
+    uv_mutex_unlock(&table->lock);
+    return result;
+}
+
+void ssr_user_table_release(struct ssr_user_table *table, const struct ssr_user *user) {
+    struct ssr_user_usage *usage;
+    if (table == NULL || user == NULL) {
+        return;
+    }
+    usage = usage_of(table, user->index);
+    uv_mutex_lock(&table->lock);
+    if (usage->connections > 0) {
+        usage->connections--;
+    }
+    uv_mutex_unlock(&table->lock);
+}
+
+void ssr_user_table_set_cluster_traffic(struct ssr_user_table *table, const struct ssr_user *user, uint64_t bytes) {
+    if (table == NULL || user == NULL) {
+        return;
+    }
+    __atomic_store_n(&usage_of(table, user->index)->cluster_traffic, bytes, __ATOMIC_RELAXED);
+}
+
+struct ssr_user_shard * ssr_user_shard_create(struct ssr_user_table *table) {
+    struct ssr_user_shard *shard;
+    if (table == NULL) {
+        return NULL;
+    }
+    shard = (struct ssr_user_shard *) calloc(1, sizeof(*shard));
+    shard->table = table;
+    shard->wall = (uint64_t)time(NULL);
+    return shard;
+}
+
+void ssr_user_shard_destroy(struct ssr_user_shard *shard) {
+    if (shard == NULL) {
+        return;
+    }
+    ssr_user_shard_flush(shard);
+    free(shard->pending);
+    free(shard);
+}
+
+/* Room for the users added since, false when there's no memory for it. */
+static bool shard_fit(struct ssr_user_shard *shard) {
+    size_t count = ssr_user_table_indexes(shard->table);
+    uint64_t *pending = (uint64_t *) realloc(shard->pending, count * sizeof(shard->pending[0]));
+    if (pending == NULL) {
+        return false;
+    }
+    memset(pending + shard->count, 0, (count - shard->count) * sizeof(pending[0]));
+    shard->pending = pending;
+    shard->count = count;
+    return true;
+}
+
+static void shard_flush_index(struct ssr_user_shard *shard, uint64_t index) {
+    if (shard->pending[index]) {
+        __sync_fetch_and_add(&usage_of(shard->table, index)->traffic, shard->pending[index]);
+        shard->pending[index] = 0;
+    }
+}
+
+void ssr_user_shard_flush(struct ssr_user_shard *shard) {
+    size_t i;
+    if (shard == NULL) {
+        return;
+    }
+    for (i = 0; i < shard->count; ++i) {
+        shard_flush_index(shard, i);
+    }
+    shard->wall = (uint64_t)time(NULL);
+}
+
+enum ssr_user_standing ssr_user_shard_add(struct ssr_user_shard *shard, const struct ssr_user *user, size_t bytes, uint64_t now) {
+    struct ssr_user_usage *usage;
+    uint64_t *pending, expires, quota;
+    if (shard == NULL || user == NULL || (user->index >= shard->count && shard_fit(shard) == false)) {
+        return ssr_user_ok;
+    }
+    pending = &shard->pending[user->index];
+    *pending += bytes;
+    if (now - shard->flushed_at >= SSR_USER_SHARD_FLUSH_MS) {
+        shard->flushed_at = now;
+        ssr_user_shard_flush(shard);
+    } else if (*pending >= SSR_USER_SHARD_FLUSH_BYTES) {
+        shard_flush_index(shard, user->index);
+    }
+    expires = __atomic_load_n(&user->expires, __ATOMIC_RELAXED);
+    if (expires && shard->wall >= expires) {
+        return ssr_user_expired;
+    }
+    // The other workers' held bytes, and the other nodes' unheard ones, may take it a little past the quota.
+    usage = usage_of(shard->table, user->index);
+    quota = __atomic_load_n(&user->quota, __ATOMIC_RELAXED);
+    if (quota && __atomic_load_n(&usage->traffic, __ATOMIC_RELAXED) +
+        __atomic_load_n(&usage->cluster_traffic, __ATOMIC_RELAXED) + *pending >= quota) {
+        return ssr_user_over_quota;
+    }
+    return ssr_user_ok;
+}
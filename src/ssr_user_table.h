@@ -0,0 +1,117 @@
+#if !defined(__ssr_user_table_h__)
+#define __ssr_user_table_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Server side users of the auth_chain_* and auth_aes128_* protocols, so
+ * one port can serve many accounts. Keys are looked up by uid in a flat
+ * open-addressing table built from the config before the workers start,
+ * all worker loops share one instance. The connection counts change under
+ * a lock, with the count of those opened in the current second that
+ * max_rate is held to. Traffic is counted by each worker in its own
+ * ssr_user_shard and added to the user's total now and then, so the
+ * streaming path neither locks nor looks anything up.
+ *
+ * The manager's deltas add, change and remove users while the workers
+ * read, without a lock on their side: a record is written field by field
+ * with its password last, slots and strings that outgrow their room are
+ * copied and the copy published whole, and the old ones stay until the
+ * table goes, for the tunnels holding users in them. A removed user keeps
+ * its slot, expired since SSR_USER_REMOVED, which ends its tunnels.
+ *
+ * A user whose password changes keeps the one replaced as its previous
+ * password for SSR_USER_KEY_GRACE seconds, the handshakes try it when the
+ * current one doesn't match, so clients have the time to be told.
+ *
+ * The records and their passwords hold offsets, no pointers, so a table
+ * written by ssr_user_table_write() is used in place by
+ * ssr_user_table_map(): every process of a host maps the same pages, and
+ * only the counters are its own.
+ */
+
+#define SSR_USER_SHARD_FLUSH_BYTES  (256 * 1024)  /* A user's bytes a worker holds before adding them up. */
+#define SSR_USER_SHARD_FLUSH_MS     1000  /* Or how long it holds them. */
+#define SSR_USER_REMOVED            1  /* ssr_user.expires of a removed user. */
+#define SSR_USER_KEY_GRACE          (24 * 3600)  /* Seconds a replaced password still works. */
+
+struct ssr_user {
+    uint32_t uid;
+    uint32_t max_connections;     /* 0 means no limit. */
+    uint32_t max_rate;            /* Connections opened a second, 0 means no limit. */
+    uint32_t reserved;
+    uint64_t quota;               /* Bytes both ways, 0 means no limit. */
+    uint64_t expires;             /* Unix time the account stops working, 0 means never. */
+    uint64_t password;            /* Into the table's strings, see ssr_user_password(). 0 while the slot is empty. */
+    uint64_t previous;            /* The password before, into the strings too, 0 when there's none. */
+    uint64_t previous_until;      /* Unix time |previous| stops working, 0 means at the next change. */
+    uint64_t index;               /* Of the user's usage, and of its counter in a shard. */
+};
+
+/* What one process counted of a user. */
+struct ssr_user_usage {
+    unsigned int connections;
+    unsigned int rate_count;      /* Connections opened in the second |rate_second|. */
+    uint64_t rate_second;
+    uint64_t traffic;             /* Bytes both ways the workers added up, atomically. */
+    uint64_t cluster_traffic;     /* Of the other nodes, as ssr_cluster last heard, counted against the quota too. */
+};
+
+struct ssr_user_table;
+
+struct ssr_user_table * ssr_user_table_create(void);
+void ssr_user_table_destroy(struct ssr_user_table *table);
+/* Adds |uid|, or replaces its password and limits keeping what it used. Not on a mapped table. */
+bool ssr_user_table_add(struct ssr_user_table *table, uint32_t uid, const char *password, unsigned int max_connections, unsigned int max_rate, uint64_t quota, uint64_t expires);
+/* Accepts |password| too for |uid| until |until|, as if it had been replaced. Not on a mapped table. */
+bool ssr_user_table_set_previous(struct ssr_user_table *table, uint32_t uid, const char *password, uint64_t until);
+/* False when there is no |uid|. Not on a mapped table. */
+bool ssr_user_table_remove(struct ssr_user_table *table, uint32_t uid);
+/* Of the deltas applied so far, 0 for the table of the config. */
+uint64_t ssr_user_table_version(const struct ssr_user_table *table);
+void ssr_user_table_set_version(struct ssr_user_table *table, uint64_t version);
+/* Writes the users to a new file and renames it to |path|, a process still mapping the old one keeps it. */
+bool ssr_user_table_write(const struct ssr_user_table *table, const char *path);
+/* The users |path| holds, read-only and shared with the other processes mapping it. NULL if it isn't a table. */
+struct ssr_user_table * ssr_user_table_map(const char *path);
+size_t ssr_user_table_count(const struct ssr_user_table *table);
+/* False for a mapped table, which takes no changes. */
+bool ssr_user_table_writable(const struct ssr_user_table *table);
+/* Every ssr_user.index so far is under it, the removed users' too. */
+size_t ssr_user_table_indexes(const struct ssr_user_table *table);
+const struct ssr_user * ssr_user_table_find(const struct ssr_user_table *table, uint32_t uid);
+/* auth_chain_* key, auth_aes128_* hashes it. */
+const char * ssr_user_password(const struct ssr_user_table *table, const struct ssr_user *user);
+/* The password before it, NULL when there's none or its grace is over. */
+const char * ssr_user_previous_password(const struct ssr_user_table *table, const struct ssr_user *user);
+/* Calls |fn| on every user, the counts as they are at that moment. */
+void ssr_user_table_traverse(const struct ssr_user_table *table, void(*fn)(const struct ssr_user *user, const struct ssr_user_usage *usage, void *p), void *p);
+/* Takes a connection slot of |user|, false when it is at its limit, has opened max_rate this second already, or expired. */
+bool ssr_user_table_acquire(struct ssr_user_table *table, const struct ssr_user *user);
+void ssr_user_table_release(struct ssr_user_table *table, const struct ssr_user *user);
+void ssr_user_table_set_cluster_traffic(struct ssr_user_table *table, const struct ssr_user *user, uint64_t bytes);
+
+struct ssr_user_shard;
+
+enum ssr_user_standing {
+    ssr_user_ok,
+    ssr_user_over_quota,
+    ssr_user_expired,
+};
+
+/* One per worker loop, |table| must outlive it. Users added later are taken in as they come. */
+struct ssr_user_shard * ssr_user_shard_create(struct ssr_user_table *table);
+/* Adds up what it still holds. */
+void ssr_user_shard_destroy(struct ssr_user_shard *shard);
+/*
+ * Counts |bytes| of |user| and tells whether it's over its quota or
+ * expired. |now| is uv_now() of the shard's loop, the held bytes are added
+ * up when they reach SSR_USER_SHARD_FLUSH_BYTES or every
+ * SSR_USER_SHARD_FLUSH_MS. 0 bytes only checks.
+ */
+enum ssr_user_standing ssr_user_shard_add(struct ssr_user_shard *shard, const struct ssr_user *user, size_t bytes, uint64_t now);
+void ssr_user_shard_flush(struct ssr_user_shard *shard);
+
+#endif // !defined(__ssr_user_table_h__)
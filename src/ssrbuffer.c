@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "ssrbuffer.h"
+#include "ssr_alloc.h"
 
 #ifndef max
 #define max(a, b) (((a) > (b)) ? (a) : (b))
@@ -32,6 +33,31 @@
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
+#define BUFFER_CLASS_MIN    64
+#define BUFFER_CLASS_MAX    (256 * 1024)  /* buffer_pool's biggest class, TCP_READ_SIZE_MAX. */
+#define BUFFER_CLASS_ROUND  (64 * 1024)   /* Granularity of the capacities above it. */
+
+/*
+ * The capacity a buffer of |capacity| grows to for |needed| bytes: a power
+ * of two up to BUFFER_CLASS_MAX, the same classes as buffer_pool, so
+ * appends cost a logarithmic number of realloc() calls. Above that it
+ * grows by half, rounded, not to double a big transient buffer.
+ */
+static size_t buffer_capacity_class(size_t capacity, size_t needed) {
+    size_t result = BUFFER_CLASS_MIN;
+    if (needed > BUFFER_CLASS_MAX) {
+        result = max(needed, capacity + capacity / 2);
+        if (result > SIZE_MAX - BUFFER_CLASS_ROUND) {
+            return needed;
+        }
+        return (result + BUFFER_CLASS_ROUND - 1) & ~((size_t)BUFFER_CLASS_ROUND - 1);
+    }
+    while (result < needed) {
+        result <<= 1;
+    }
+    return result;
+}
+
 void check_memory_content(struct buffer_t *buf) {
 #if __MEM_CHECK__
     static const char data[] = "\xE7\x3C\x73\xA6\x66\x43\x28\x67\xAF\xD3\x5C\xE2\x70\x80\x0D\xD7";
@@ -44,8 +70,18 @@ void check_memory_content(struct buffer_t *buf) {
 }
 
 struct buffer_t * buffer_create(size_t capacity) {
-    struct buffer_t *ptr = (struct buffer_t *) calloc(1, sizeof(struct buffer_t));
-    ptr->buffer = (uint8_t *) calloc(capacity + 1, sizeof(uint8_t));
+    struct buffer_t *ptr = (struct buffer_t *) ssr_calloc(ssr_alloc_buffers, 1, sizeof(struct buffer_t));
+    ptr->buffer = (uint8_t *) ssr_calloc(ssr_alloc_buffers, capacity + 1, sizeof(uint8_t));
+    ptr->capacity = capacity;
+    ptr->ref_count = 1;
+    return ptr;
+}
+
+struct buffer_t * buffer_create_with_headroom(size_t headroom, size_t capacity) {
+    struct buffer_t *ptr = (struct buffer_t *) ssr_calloc(ssr_alloc_buffers, 1, sizeof(struct buffer_t));
+    uint8_t *base = (uint8_t *) ssr_calloc(ssr_alloc_buffers, headroom + capacity + 1, sizeof(uint8_t));
+    ptr->buffer = base + headroom;
+    ptr->headroom = headroom;
     ptr->capacity = capacity;
     ptr->ref_count = 1;
     return ptr;
@@ -106,15 +142,29 @@ size_t buffer_realloc(struct buffer_t *ptr, size_t capacity) {
     if (ptr == NULL) {
         return real_capacity;
     }
-    real_capacity = max(capacity, ptr->capacity);
-    if (ptr->capacity < real_capacity) {
-        ptr->buffer = (uint8_t *) realloc(ptr->buffer, real_capacity + 1);
+    real_capacity = ptr->capacity;
+    if (ptr->capacity < capacity) {
+        uint8_t *base = ptr->buffer - ptr->headroom;
+        real_capacity = buffer_capacity_class(ptr->capacity, capacity);
+        base = (uint8_t *) ssr_realloc(ssr_alloc_buffers, base, ptr->headroom + real_capacity + 1);
+        ptr->buffer = base + ptr->headroom;
         ptr->buffer[real_capacity] = 0;
         ptr->capacity = real_capacity;
     }
     return real_capacity;
 }
 
+/* Makes room for |size| more bytes after the payload, returns the capacity. */
+size_t buffer_reserve(struct buffer_t *ptr, size_t size) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (size > SIZE_MAX - ptr->len) {
+        return ptr->capacity;
+    }
+    return buffer_realloc(ptr, ptr->len + size);
+}
+
 size_t buffer_store(struct buffer_t *ptr, const uint8_t *data, size_t size) {
     size_t result = 0;
     if (ptr==NULL) {
@@ -143,6 +193,23 @@ void buffer_replace(struct buffer_t *dst, const struct buffer_t *src) {
     */
 }
 
+/* Exchanges the storage of two heap buffers, reference counts stay put. */
+void buffer_swap(struct buffer_t *ptr1, struct buffer_t *ptr2) {
+    struct buffer_t tmp;
+    if (ptr1 == NULL || ptr2 == NULL || ptr1 == ptr2) {
+        return;
+    }
+    tmp = *ptr1;
+    ptr1->len = ptr2->len;
+    ptr1->capacity = ptr2->capacity;
+    ptr1->buffer = ptr2->buffer;
+    ptr1->headroom = ptr2->headroom;
+    ptr2->len = tmp.len;
+    ptr2->capacity = tmp.capacity;
+    ptr2->buffer = tmp.buffer;
+    ptr2->headroom = tmp.headroom;
+}
+
 void buffer_insert(struct buffer_t *ptr, size_t pos, const uint8_t *data, size_t size) {
     size_t result;
     if (ptr==NULL || data==NULL || size==0) {
@@ -188,6 +255,77 @@ void buffer_shorten(struct buffer_t *ptr, size_t begin, size_t len) {
     check_memory_content(ptr);
 }
 
+/* Makes sure |size| bytes can be prepended without moving the payload. */
+size_t buffer_reserve_head(struct buffer_t *ptr, size_t size) {
+    uint8_t *base;
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (ptr->headroom < size) {
+        base = (uint8_t *) ssr_calloc(ssr_alloc_buffers, size + ptr->capacity + 1, sizeof(uint8_t));
+        memcpy(base + size, ptr->buffer, ptr->len);
+        ssr_free(ssr_alloc_buffers, ptr->buffer - ptr->headroom);
+        ptr->buffer = base + size;
+        ptr->headroom = size;
+    }
+    return ptr->headroom;
+}
+
+void buffer_prepend(struct buffer_t *ptr, const uint8_t *data, size_t size) {
+    if (ptr==NULL || data==NULL || size==0) {
+        return;
+    }
+    buffer_reserve_head(ptr, size);
+    ptr->buffer -= size;
+    ptr->headroom -= size;
+    ptr->capacity += size;
+    ptr->len += size;
+    memmove(ptr->buffer, data, size);
+    check_memory_content(ptr);
+}
+
+/* Drops |size| bytes from the front in O(1), they become headroom. */
+void buffer_consume(struct buffer_t *ptr, size_t size) {
+    if (ptr==NULL || size==0) {
+        return;
+    }
+    size = min(size, ptr->len);
+    ptr->buffer += size;
+    ptr->headroom += size;
+    ptr->capacity -= size;
+    ptr->len -= size;
+}
+
+/*
+ * Moves the payload back to the start of its allocation, for code that
+ * realloc()s |buffer| itself, e.g. the char ** protocol plugin hooks.
+ */
+void buffer_drop_head(struct buffer_t *ptr) {
+    if (ptr==NULL || ptr->headroom==0) {
+        return;
+    }
+    memmove(ptr->buffer - ptr->headroom, ptr->buffer, ptr->len);
+    ptr->buffer -= ptr->headroom;
+    ptr->capacity += ptr->headroom;
+    ptr->headroom = 0;
+}
+
+/* Gives back the spare capacity, buffer_realloc() grows it again on demand. */
+void buffer_trim(struct buffer_t *ptr) {
+    uint8_t *base;
+    if (ptr == NULL || ptr->buffer == NULL || (ptr->headroom == 0 && ptr->capacity == ptr->len)) {
+        return;
+    }
+    buffer_drop_head(ptr);
+    base = (uint8_t *) ssr_realloc(ssr_alloc_buffers, ptr->buffer, ptr->len + 1);
+    if (base == NULL) {
+        return;
+    }
+    ptr->buffer = base;
+    ptr->buffer[ptr->len] = 0;
+    ptr->capacity = ptr->len;
+}
+
 void buffer_release(struct buffer_t *ptr) {
     if (ptr == NULL) {
         return;
@@ -199,8 +337,134 @@ void buffer_release(struct buffer_t *ptr) {
     ptr->len = 0;
     ptr->capacity = 0;
     if (ptr->buffer != NULL) {
-        free(ptr->buffer);
+        ssr_free(ssr_alloc_buffers, ptr->buffer - ptr->headroom);
         ptr->buffer = NULL;
     }
-    free(ptr);
+    ssr_free(ssr_alloc_buffers, ptr);
+}
+
+struct buffer_segment {
+    struct buffer_t *owner; /* NULL means the range lives in segs->storage. */
+    size_t offset;
+    size_t len;
+};
+
+struct buffer_segments {
+    struct buffer_t *storage;
+    struct buffer_segment *items;
+    size_t count;
+    size_t capacity;
+};
+
+struct buffer_segments * buffer_segments_create(void) {
+    struct buffer_segments *segs = (struct buffer_segments *) ssr_calloc(ssr_alloc_buffers, 1, sizeof(*segs));
+    segs->storage = buffer_create(64);
+    return segs;
+}
+
+void buffer_segments_release(struct buffer_segments *segs) {
+    size_t index;
+    if (segs == NULL) {
+        return;
+    }
+    for (index = 0; index < segs->count; ++index) {
+        buffer_release(segs->items[index].owner);
+    }
+    buffer_release(segs->storage);
+    ssr_free(ssr_alloc_buffers, segs->items);
+    ssr_free(ssr_alloc_buffers, segs);
+}
+
+static struct buffer_segment * buffer_segments_push(struct buffer_segments *segs) {
+    if (segs->count == segs->capacity) {
+        size_t capacity = segs->capacity ? (segs->capacity * 2) : 8;
+        segs->items = (struct buffer_segment *) ssr_realloc(ssr_alloc_buffers, segs->items, capacity * sizeof(*segs->items));
+        segs->capacity = capacity;
+    }
+    return &segs->items[segs->count++];
+}
+
+void buffer_segments_append_data(struct buffer_segments *segs, const uint8_t *data, size_t size) {
+    struct buffer_segment *last;
+    size_t offset;
+    if (segs==NULL || data==NULL || size==0) {
+        return;
+    }
+    offset = segs->storage->len;
+    buffer_concatenate(segs->storage, data, size);
+
+    last = segs->count ? &segs->items[segs->count - 1] : NULL;
+    if (last && last->owner == NULL && (last->offset + last->len) == offset) {
+        last->len += size;
+        return;
+    }
+    last = buffer_segments_push(segs);
+    last->owner = NULL;
+    last->offset = offset;
+    last->len = size;
+}
+
+void buffer_segments_append_buffer(struct buffer_segments *segs, struct buffer_t *buf, size_t offset, size_t size) {
+    struct buffer_segment *last;
+    if (segs==NULL || buf==NULL || size==0 || offset > buf->len || size > (buf->len - offset)) {
+        return;
+    }
+    if (buf->ref_count <= 0) {
+        /* Stack instances can't outlive the caller, keep a copy. */
+        buffer_segments_append_data(segs, buf->buffer + offset, size);
+        return;
+    }
+    last = segs->count ? &segs->items[segs->count - 1] : NULL;
+    if (last && last->owner == buf && (last->offset + last->len) == offset) {
+        last->len += size;
+        return;
+    }
+    buffer_add_ref(buf);
+    last = buffer_segments_push(segs);
+    last->owner = buf;
+    last->offset = offset;
+    last->len = size;
+}
+
+size_t buffer_segments_count(const struct buffer_segments *segs) {
+    return segs ? segs->count : 0;
+}
+
+size_t buffer_segments_total_len(const struct buffer_segments *segs) {
+    size_t index, total = 0;
+    if (segs == NULL) {
+        return total;
+    }
+    for (index = 0; index < segs->count; ++index) {
+        total += segs->items[index].len;
+    }
+    return total;
+}
+
+const uint8_t * buffer_segments_get(const struct buffer_segments *segs, size_t index, size_t *size) {
+    const struct buffer_segment *item;
+    const struct buffer_t *owner;
+    if (segs==NULL || index >= segs->count) {
+        if (size) { *size = 0; }
+        return NULL;
+    }
+    item = &segs->items[index];
+    owner = item->owner ? item->owner : segs->storage;
+    if (size) { *size = item->len; }
+    return owner->buffer + item->offset;
+}
+
+struct buffer_t * buffer_segments_flatten(const struct buffer_segments *segs) {
+    struct buffer_t *result;
+    size_t index;
+    if (segs == NULL) {
+        return NULL;
+    }
+    result = buffer_create(buffer_segments_total_len(segs));
+    for (index = 0; index < segs->count; ++index) {
+        size_t size = 0;
+        const uint8_t *data = buffer_segments_get(segs, index, &size);
+        buffer_concatenate(result, data, size);
+    }
+    return result;
 }
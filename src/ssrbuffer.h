@@ -37,6 +37,7 @@ struct buffer_t {
     size_t capacity;
     uint8_t *buffer;
     int ref_count;
+    size_t headroom; /* Bytes allocated in front of |buffer|, see buffer_prepend(). */
 };
 
 #define BUFFER_CONSTANT_INSTANCE(ptrName, data, data_len) \
@@ -45,18 +46,44 @@ struct buffer_t {
 
 struct buffer_t * buffer_create(size_t capacity);
 struct buffer_t * buffer_create_from(const uint8_t *data, size_t len);
+struct buffer_t * buffer_create_with_headroom(size_t headroom, size_t capacity);
 void buffer_add_ref(struct buffer_t *ptr);
 void buffer_release(struct buffer_t *ptr);
 int buffer_compare(const struct buffer_t *ptr1, const struct buffer_t *ptr2, size_t size);
 void buffer_reset(struct buffer_t *ptr);
 struct buffer_t * buffer_clone(const struct buffer_t *ptr);
+/* Grows to at least |capacity|, in power-of-two classes, never shrinks. */
 size_t buffer_realloc(struct buffer_t *ptr, size_t capacity);
+size_t buffer_reserve(struct buffer_t *ptr, size_t size);
 void buffer_insert(struct buffer_t *ptr, size_t pos, const uint8_t *data, size_t size);
 void buffer_insert2(struct buffer_t *ptr, size_t pos, const struct buffer_t *data);
 size_t buffer_store(struct buffer_t *ptr, const uint8_t *data, size_t size);
 void buffer_replace(struct buffer_t *dst, const struct buffer_t *src);
+void buffer_swap(struct buffer_t *ptr1, struct buffer_t *ptr2);
 size_t buffer_concatenate(struct buffer_t *ptr, const uint8_t *data, size_t size);
 size_t buffer_concatenate2(struct buffer_t *dst, const struct buffer_t *src);
 void buffer_shorten(struct buffer_t *ptr, size_t begin, size_t len);
+size_t buffer_reserve_head(struct buffer_t *ptr, size_t size);
+void buffer_prepend(struct buffer_t *ptr, const uint8_t *data, size_t size);
+void buffer_consume(struct buffer_t *ptr, size_t size);
+void buffer_drop_head(struct buffer_t *ptr);
+void buffer_trim(struct buffer_t *ptr);
+
+/*
+ * A list of byte ranges that are written out in order with one vectored
+ * write. Small pieces (framing headers, padding) are copied into internal
+ * storage, big payloads are only referenced, so they are never copied into
+ * a larger contiguous buffer.
+ */
+struct buffer_segments;
+
+struct buffer_segments * buffer_segments_create(void);
+void buffer_segments_release(struct buffer_segments *segs);
+void buffer_segments_append_data(struct buffer_segments *segs, const uint8_t *data, size_t size);
+void buffer_segments_append_buffer(struct buffer_segments *segs, struct buffer_t *buf, size_t offset, size_t size);
+size_t buffer_segments_count(const struct buffer_segments *segs);
+size_t buffer_segments_total_len(const struct buffer_segments *segs);
+const uint8_t * buffer_segments_get(const struct buffer_segments *segs, size_t index, size_t *size);
+struct buffer_t * buffer_segments_flatten(const struct buffer_segments *segs);
 
 #endif // __SSR_BUFFER_H__
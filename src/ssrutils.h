@@ -209,6 +209,12 @@ int set_nofile(int nofile);
 
 size_t ss_memory_size(void *ptr);
 
+#if defined(_MSC_VER)
+#define SS_THREAD_LOCAL __declspec(thread)
+#else
+#define SS_THREAD_LOCAL __thread
+#endif
+
 #define safe_free(ptr)        \
     do {                    \
         if (ptr) {          \
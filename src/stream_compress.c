@@ -0,0 +1,165 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "stream_compress.h"
+#include "ssrbuffer.h"
+
+#define STREAM_COMPRESS_WINDOW_BITS   12  /* Memory per tunnel direction, */
+#define STREAM_COMPRESS_MEM_LEVEL     5   /* about 32 KiB deflating and 11 KiB inflating. */
+#define STREAM_COMPRESS_LEVEL         6
+#define STREAM_COMPRESS_SAMPLES       256  /* Bytes looked at for the entropy of a chunk, */
+#define STREAM_COMPRESS_MAX_ENTROPY   6.5  /* bits per byte above which it's stored. */
+
+struct stream_compressor {
+    enum stream_compression method;
+    bool compress;
+    int level;  /* In effect, 0 while storing. */
+    z_stream strm;
+    uint64_t plain;
+    uint64_t wire;
+};
+
+enum stream_compression stream_compression_from_name(const char *name) {
+    if (name && (strcmp(name, "zlib") == 0 || strcmp(name, "deflate") == 0)) {
+        return stream_compression_zlib;
+    }
+    return stream_compression_none;
+}
+
+const char * stream_compression_name(enum stream_compression method) {
+    switch (method) {
+    case stream_compression_zlib:
+        return "zlib";
+    default:
+        return "none";
+    }
+}
+
+struct stream_compressor * stream_compressor_create(enum stream_compression method, bool compress) {
+    struct stream_compressor *sc;
+    int err;
+    if (method != stream_compression_zlib) {
+        return NULL;
+    }
+    sc = (struct stream_compressor *) calloc(1, sizeof(*sc));
+    sc->method = method;
+    sc->compress = compress;
+    sc->level = STREAM_COMPRESS_LEVEL;
+    if (compress) {
+        err = deflateInit2(&sc->strm, sc->level, Z_DEFLATED, -STREAM_COMPRESS_WINDOW_BITS,
+            STREAM_COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    } else {
+        err = inflateInit2(&sc->strm, -STREAM_COMPRESS_WINDOW_BITS);
+    }
+    if (err != Z_OK) {
+        free(sc);
+        return NULL;
+    }
+    return sc;
+}
+
+void stream_compressor_release(struct stream_compressor *sc) {
+    if (sc == NULL) {
+        return;
+    }
+    if (sc->compress) {
+        deflateEnd(&sc->strm);
+    } else {
+        inflateEnd(&sc->strm);
+    }
+    free(sc);
+}
+
+/* TLS records and what already is compressed or encrypted, whose bytes are near uniform. */
+static bool stream_compress_worthwhile(const uint8_t *data, size_t len) {
+    unsigned int counts[256] = { 0 };
+    size_t i, step;
+    double sum = 0;
+
+    if (len >= 3 && data[0] >= 0x14 && data[0] <= 0x17 && data[1] == 0x03 && data[2] <= 0x04) {
+        return false;
+    }
+    if (len < STREAM_COMPRESS_SAMPLES) {
+        return true;  /* Too few to judge, and cheap either way. */
+    }
+    step = len / STREAM_COMPRESS_SAMPLES;
+    for (i = 0; i < STREAM_COMPRESS_SAMPLES; ++i) {
+        counts[data[i * step]]++;
+    }
+    for (i = 0; i < 256; ++i) {
+        if (counts[i]) {
+            sum += counts[i] * log2((double)counts[i]);
+        }
+    }
+    // H = log2(n) - sum(c * log2(c)) / n
+    return (8.0 - sum / STREAM_COMPRESS_SAMPLES) <= STREAM_COMPRESS_MAX_ENTROPY;
+}
+
+static bool stream_compress_deflate(struct stream_compressor *sc, const uint8_t *data, size_t len, struct buffer_t *out) {
+    int level = stream_compress_worthwhile(data, len) ? STREAM_COMPRESS_LEVEL : Z_NO_COMPRESSION;
+    size_t start = out->len;
+
+    if (level != sc->level) {
+        // The last chunk was flushed whole, there is little if anything to emit.
+        buffer_reserve(out, 64);
+        sc->strm.next_out = out->buffer + out->len;
+        sc->strm.avail_out = (uInt)(out->capacity - out->len);
+        if (deflateParams(&sc->strm, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out->len = out->capacity - sc->strm.avail_out;
+        sc->level = level;
+    }
+    sc->strm.next_in = (Bytef *)data;
+    sc->strm.avail_in = (uInt)len;
+    do {
+        // Stored blocks cost 5 bytes each, the flush another 5.
+        buffer_reserve(out, len / 8 + 64);
+        sc->strm.next_out = out->buffer + out->len;
+        sc->strm.avail_out = (uInt)(out->capacity - out->len);
+        if (deflate(&sc->strm, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+            return false;
+        }
+        out->len = out->capacity - sc->strm.avail_out;
+    } while (sc->strm.avail_out == 0);
+    sc->plain += len;
+    sc->wire += out->len - start;
+    return true;
+}
+
+static bool stream_compress_inflate(struct stream_compressor *sc, const uint8_t *data, size_t len, struct buffer_t *out) {
+    size_t start = out->len;
+    int err;
+
+    sc->strm.next_in = (Bytef *)data;
+    sc->strm.avail_in = (uInt)len;
+    do {
+        if (out->len - start >= STREAM_COMPRESS_MAX_OUTPUT) {
+            return false;
+        }
+        buffer_reserve(out, len * 2 + 1024);
+        sc->strm.next_out = out->buffer + out->len;
+        sc->strm.avail_out = (uInt)(out->capacity - out->len);
+        err = inflate(&sc->strm, Z_SYNC_FLUSH);
+        if (err != Z_OK && err != Z_BUF_ERROR) {
+            return false;  /* Z_STREAM_END too, the peer never ends it. */
+        }
+        out->len = out->capacity - sc->strm.avail_out;
+    } while (sc->strm.avail_in > 0 || sc->strm.avail_out == 0);
+    sc->plain += out->len - start;
+    sc->wire += len;
+    return true;
+}
+
+bool stream_compressor_update(struct stream_compressor *sc, const uint8_t *data, size_t len, struct buffer_t *out) {
+    if (len == 0) {
+        return true;
+    }
+    return sc->compress ? stream_compress_deflate(sc, data, len, out) : stream_compress_inflate(sc, data, len, out);
+}
+
+void stream_compressor_totals(const struct stream_compressor *sc, uint64_t *plain, uint64_t *wire) {
+    *plain = sc ? sc->plain : 0;
+    *wire = sc ? sc->wire : 0;
+}
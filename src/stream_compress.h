@@ -0,0 +1,39 @@
+#if !defined(__stream_compress_h__)
+#define __stream_compress_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The optional compression stage of a tunnel, one stream per direction
+ * ahead of the protocol, so both ends must be set to the same method. A
+ * chunk is flushed whole, nothing waits for the next one. Chunks that
+ * look compressed already, TLS records or high entropy on a sample of
+ * their bytes, are stored instead, which costs a copy and 5 bytes. An
+ * instance is used by one thread at a time.
+ */
+
+#define STREAM_COMPRESS_MAX_OUTPUT  (4 * 1024 * 1024)  /* A chunk that inflates further is refused. */
+
+enum stream_compression {
+    stream_compression_none,
+    stream_compression_zlib,  /* Raw deflate with a 4 KiB window. */
+};
+
+struct stream_compressor;
+struct buffer_t;
+
+/* stream_compression_none for NULL and unknown names. */
+enum stream_compression stream_compression_from_name(const char *name);
+const char * stream_compression_name(enum stream_compression method);
+
+/* NULL for stream_compression_none, |compress| or decompress. */
+struct stream_compressor * stream_compressor_create(enum stream_compression method, bool compress);
+void stream_compressor_release(struct stream_compressor *sc);
+/* Appends what |data| becomes to |out|, false if the input is corrupt or over STREAM_COMPRESS_MAX_OUTPUT. */
+bool stream_compressor_update(struct stream_compressor *sc, const uint8_t *data, size_t len, struct buffer_t *out);
+/* Bytes of plaintext and of the compressed stream so far. */
+void stream_compressor_totals(const struct stream_compressor *sc, uint64_t *plain, uint64_t *wire);
+
+#endif // !defined(__stream_compress_h__)
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_SLOTS 512  /* Power of two, 51.2 s per turn at 100 ms ticks. */
+
+struct timer_wheel {
+    uv_timer_t tick_timer;
+    unsigned int tick_ms;
+    uint64_t current_tick;  /* Last tick processed. */
+    size_t armed;
+    bool released;
+    /* Sentinels of circular lists, longer timeouts wait for later turns. */
+    struct timer_wheel_entry slots[TIMER_WHEEL_SLOTS];
+};
+
+static void entry_link(struct timer_wheel_entry *head, struct timer_wheel_entry *entry) {
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static void entry_unlink(struct timer_wheel_entry *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static uint64_t wheel_now_tick(const struct timer_wheel *wheel) {
+    return uv_now(wheel->tick_timer.loop) / wheel->tick_ms;
+}
+
+static void wheel_run_slot(struct timer_wheel *wheel, struct timer_wheel_entry *slot) {
+    struct timer_wheel_entry pending;
+
+    if (slot->next == slot) {
+        return;
+    }
+    // Move the slot aside, a callback may cancel or re-arm any entry, even one still pending here.
+    pending.next = slot->next;
+    pending.prev = slot->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    slot->next = slot;
+    slot->prev = slot;
+
+    while (pending.next != &pending) {
+        struct timer_wheel_entry *entry = pending.next;
+        entry_unlink(entry);
+        if (entry->expire_tick > wheel->current_tick) {
+            entry_link(slot, entry);
+            continue;
+        }
+        wheel->armed--;
+        entry->wheel = NULL;
+        entry->expire_cb(entry);
+    }
+}
+
+static void wheel_tick_cb(uv_timer_t *handle) {
+    struct timer_wheel *wheel = (struct timer_wheel *)handle->data;
+    uint64_t now = wheel_now_tick(wheel);
+
+    // After a stall, one turn visits every entry that is due.
+    if (now - wheel->current_tick > TIMER_WHEEL_SLOTS) {
+        wheel->current_tick = now - TIMER_WHEEL_SLOTS;
+    }
+    while (wheel->current_tick < now) {
+        wheel->current_tick++;
+        wheel_run_slot(wheel, &wheel->slots[wheel->current_tick & (TIMER_WHEEL_SLOTS - 1)]);
+    }
+    if (wheel->armed == 0) {
+        uv_timer_stop(handle);
+    }
+}
+
+static void wheel_close_done_cb(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+struct timer_wheel * timer_wheel_create(uv_loop_t *loop, unsigned int tick_ms) {
+    struct timer_wheel *wheel = (struct timer_wheel *) calloc(1, sizeof(*wheel));
+    size_t index;
+
+    for (index = 0; index < TIMER_WHEEL_SLOTS; ++index) {
+        wheel->slots[index].prev = &wheel->slots[index];
+        wheel->slots[index].next = &wheel->slots[index];
+    }
+    wheel->tick_ms = tick_ms ? tick_ms : TIMER_WHEEL_TICK_MS;
+    uv_timer_init(loop, &wheel->tick_timer);
+    wheel->tick_timer.data = wheel;
+    wheel->current_tick = wheel_now_tick(wheel);
+    return wheel;
+}
+
+void timer_wheel_release(struct timer_wheel *wheel) {
+    size_t index;
+    if (wheel == NULL || wheel->released) {
+        return;
+    }
+    for (index = 0; index < TIMER_WHEEL_SLOTS; ++index) {
+        struct timer_wheel_entry *slot = &wheel->slots[index];
+        while (slot->next != slot) {
+            struct timer_wheel_entry *entry = slot->next;
+            entry_unlink(entry);
+            entry->wheel = NULL;
+        }
+    }
+    wheel->armed = 0;
+    wheel->released = true;
+    uv_timer_stop(&wheel->tick_timer);
+    uv_close((uv_handle_t *)&wheel->tick_timer, wheel_close_done_cb);
+}
+
+void timer_wheel_entry_init(struct timer_wheel_entry *entry, void(*expire_cb)(struct timer_wheel_entry *entry)) {
+    memset(entry, 0, sizeof(*entry));
+    entry->expire_cb = expire_cb;
+}
+
+void timer_wheel_schedule(struct timer_wheel *wheel, struct timer_wheel_entry *entry, uint64_t timeout_ms) {
+    uint64_t expire_tick;
+
+    if (wheel == NULL || wheel->released) {
+        return;
+    }
+    timer_wheel_cancel(entry);
+
+    if (!uv_is_active((uv_handle_t *)&wheel->tick_timer)) {
+        // The tick timer was idle, catch up without walking the slots.
+        wheel->current_tick = wheel_now_tick(wheel);
+        uv_timer_start(&wheel->tick_timer, wheel_tick_cb, wheel->tick_ms, wheel->tick_ms);
+    }
+    expire_tick = (uv_now(wheel->tick_timer.loop) + timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (expire_tick <= wheel->current_tick) {
+        expire_tick = wheel->current_tick + 1;
+    }
+    entry->expire_tick = expire_tick;
+    entry->wheel = wheel;
+    entry_link(&wheel->slots[expire_tick & (TIMER_WHEEL_SLOTS - 1)], entry);
+    wheel->armed++;
+}
+
+void timer_wheel_cancel(struct timer_wheel_entry *entry) {
+    if (entry == NULL || entry->wheel == NULL) {
+        return;
+    }
+    entry_unlink(entry);
+    entry->wheel->armed--;
+    entry->wheel = NULL;
+}
+
+bool timer_wheel_entry_armed(const struct timer_wheel_entry *entry) {
+    return entry && entry->wheel != NULL;
+}
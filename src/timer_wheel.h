@@ -0,0 +1,38 @@
+#if !defined(__timer_wheel_h__)
+#define __timer_wheel_h__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * A hashed timing wheel for idle timeouts. Every entry hangs off the slot
+ * of its expiry tick, so arming, re-arming and cancelling are O(1) where a
+ * uv_timer_t pays O(log n) in the loop's heap. A single repeating
+ * uv_timer_t per wheel advances the ticks, it only runs while entries are
+ * armed. Timeouts fire up to one tick late. Not thread safe: one wheel per
+ * uv_loop_t.
+ */
+
+#define TIMER_WHEEL_TICK_MS 100
+
+struct timer_wheel;
+
+struct timer_wheel_entry {
+    struct timer_wheel_entry *prev;  /* NULL while not armed. */
+    struct timer_wheel_entry *next;
+    struct timer_wheel *wheel;
+    uint64_t expire_tick;
+    void(*expire_cb)(struct timer_wheel_entry *entry);
+};
+
+struct timer_wheel * timer_wheel_create(uv_loop_t *loop, unsigned int tick_ms);
+/* Disarms what is left and closes the tick timer, the wheel is freed once it's closed. */
+void timer_wheel_release(struct timer_wheel *wheel);
+void timer_wheel_entry_init(struct timer_wheel_entry *entry, void(*expire_cb)(struct timer_wheel_entry *entry));
+/* (Re)arms |entry| to fire |timeout_ms| from now. */
+void timer_wheel_schedule(struct timer_wheel *wheel, struct timer_wheel_entry *entry, uint64_t timeout_ms);
+void timer_wheel_cancel(struct timer_wheel_entry *entry);
+bool timer_wheel_entry_armed(const struct timer_wheel_entry *entry);
+
+#endif // !defined(__timer_wheel_h__)
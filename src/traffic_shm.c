@@ -0,0 +1,131 @@
+/*
+ * traffic_shm.c - Traffic counters ss-server shares with ss-manager
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "traffic_shm.h"
+
+#define TRAFFIC_SHM_SIZE (TRAFFIC_SHM_SLOTS * sizeof(struct traffic_slot))
+
+struct traffic_shm {
+    struct traffic_slot *slots;
+};
+
+static struct traffic_shm *
+traffic_shm_map(const char *path, int flags)
+{
+    struct traffic_shm *shm;
+    void *map;
+    int fd = open(path, flags, S_IRUSR | S_IWUSR);
+
+    if (fd == -1) {
+        return NULL;
+    }
+    if ((flags & O_CREAT) && ftruncate(fd, (off_t)TRAFFIC_SHM_SIZE) == -1) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, TRAFFIC_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    shm        = (struct traffic_shm *)calloc(1, sizeof(*shm));
+    shm->slots = (struct traffic_slot *)map;
+    return shm;
+}
+
+struct traffic_shm *
+traffic_shm_create(const char *path)
+{
+    // Cleared, slots of a manager before this one are gone with its servers.
+    return traffic_shm_map(path, O_RDWR | O_CREAT | O_TRUNC);
+}
+
+struct traffic_shm *
+traffic_shm_open(const char *path)
+{
+    return traffic_shm_map(path, O_RDWR);
+}
+
+void
+traffic_shm_close(struct traffic_shm *shm)
+{
+    if (shm == NULL) {
+        return;
+    }
+    munmap(shm->slots, TRAFFIC_SHM_SIZE);
+    free(shm);
+}
+
+struct traffic_slot *
+traffic_shm_find(struct traffic_shm *shm, const char *port)
+{
+    int i;
+    for (i = 0; shm != NULL && i < TRAFFIC_SHM_SLOTS; i++) {
+        if (strncmp(shm->slots[i].port, port, sizeof(shm->slots[i].port)) == 0) {
+            return &shm->slots[i];
+        }
+    }
+    return NULL;
+}
+
+struct traffic_slot *
+traffic_shm_assign(struct traffic_shm *shm, const char *port)
+{
+    struct traffic_slot *slot = traffic_shm_find(shm, port);
+    if (slot == NULL) {
+        slot = traffic_shm_find(shm, "");
+    }
+    if (slot != NULL) {
+        __sync_lock_test_and_set(&slot->traffic, 0);
+        strncpy(slot->port, port, sizeof(slot->port) - 1);
+    }
+    return slot;
+}
+
+void
+traffic_shm_release(struct traffic_slot *slot)
+{
+    if (slot != NULL) {
+        memset(slot->port, 0, sizeof(slot->port));
+    }
+}
+
+uint64_t
+traffic_slot_read(const struct traffic_slot *slot)
+{
+    return __sync_add_and_fetch((uint64_t *)&slot->traffic, 0);
+}
+
+void
+traffic_slot_add(struct traffic_slot *slot, uint64_t bytes)
+{
+    __sync_fetch_and_add(&slot->traffic, bytes);
+}
@@ -0,0 +1,60 @@
+/*
+ * traffic_shm.h - Traffic counters ss-server shares with ss-manager
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRAFFIC_SHM_H
+#define _TRAFFIC_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A file the manager creates and every server it starts maps shared, one
+ * slot per port. The manager hands a slot out before starting the server,
+ * the server adds its bytes there and the manager reads them when asked,
+ * no stat messages. A slot has a cache line to itself, so servers don't
+ * contend, and an 8-byte aligned counter, so no read of it is torn.
+ */
+
+#define TRAFFIC_SHM_SLOTS 1024 /* MAX_PORT_NUM */
+
+struct traffic_slot {
+    uint64_t traffic;
+    char port[8];
+    char pad[48];
+} __attribute__((aligned(64)));
+
+struct traffic_shm;
+
+/* The manager's, created or truncated. NULL on failure. */
+struct traffic_shm *traffic_shm_create(const char *path);
+/* A server's, NULL if there is none. */
+struct traffic_shm *traffic_shm_open(const char *path);
+void traffic_shm_close(struct traffic_shm *shm);
+
+/* The manager's side. Starting from zero, NULL when all are taken. */
+struct traffic_slot *traffic_shm_assign(struct traffic_shm *shm, const char *port);
+void traffic_shm_release(struct traffic_slot *slot);
+uint64_t traffic_slot_read(const struct traffic_slot *slot);
+
+/* The server's side, the slot the manager assigned to |port|. */
+struct traffic_slot *traffic_shm_find(struct traffic_shm *shm, const char *port);
+void traffic_slot_add(struct traffic_slot *slot, uint64_t bytes);
+
+#endif // _TRAFFIC_SHM_H
@@ -19,27 +19,61 @@
  * IN THE SOFTWARE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1  /* splice(), pipe2() */
+#endif
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#endif
 #include <uv.h>
 #include "common.h"
 #include "tunnel.h"
 #include "dump_info.h"
+#include "buffer_pool.h"
+#include "ssrbuffer.h"
+#include "resolv.h"
+#include "sockmap_relay.h"
+#include "socket_tuning.h"
+#include "egress_pool.h"
+#include "ssr_alloc.h"
+
+#define SOCKET_RESOLVE_MAX_ADDRS 8
+#define CONNECT_ATTEMPT_DELAY_MS 250  /* RFC 8305 section 5. */
 
 static bool tunnel_is_dead(struct tunnel_ctx *tunnel);
 static void tunnel_add_ref(struct tunnel_ctx *tunnel);
 static void tunnel_release(struct tunnel_ctx *tunnel);
-static void socket_timer_expire_cb(uv_timer_t *handle);
+static void socket_timer_expire_cb(struct timer_wheel_entry *entry);
 static void socket_timer_start(struct socket_ctx *c);
 static void socket_timer_stop(struct socket_ctx *c);
 static void socket_connect_done_cb(uv_connect_t *req, int status);
+static void socket_connect_finish(struct socket_ctx *c, int status);
+static void connect_race_abort(struct connect_race *race);
 static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf);
+static void socket_read_eager(struct socket_ctx *c, bool check_timeout);
+static void socket_read_paced(struct socket_ctx *c, bool check_timeout);
+static void socket_rate_wait_expire_cb(struct timer_wheel_entry *entry);
+static void tunnel_deadline_expire_cb(struct timer_wheel_entry *entry);
+static bool tunnel_deadline_too_slow(struct tunnel_ctx *tunnel, size_t len);
+static void socket_fair_run_cb(struct fair_queue_entry *entry);
+static void socket_coalesce_run_cb(struct read_coalesce_entry *entry);
 static void socket_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf);
 static void socket_getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai);
+static void socket_resolv_done_cb(int status, const union sockaddr_universal *addrs, size_t count, void *data);
+static void socket_resolve_done(struct socket_ctx *c, int status, const union sockaddr_universal *addrs, size_t count);
 static void socket_write_done_cb(uv_write_t *req, int status);
+static bool socket_write_from_peer(struct tunnel_ctx *tunnel, struct socket_ctx *current_socket, struct socket_ctx *target_socket);
 static void socket_close(struct socket_ctx *c);
 static void socket_close_done_cb(uv_handle_t *handle);
+static void kernel_relay_close(struct kernel_relay *relay);
 
 int uv_stream_fd(const uv_tcp_t *handle) {
 #if defined(_WIN32)
@@ -58,7 +92,7 @@ uint16_t get_socket_port(const uv_tcp_t *tcp) {
     if (uv_tcp_getsockname(tcp, &tmp.addr, &len) != 0) {
         return 0;
     } else {
-        return ntohs(tmp.addr4.sin_port);
+        return universal_address_port(&tmp);
     }
 }
 
@@ -83,6 +117,24 @@ size_t _update_tcp_mss(struct socket_ctx *socket) {
     return _tcp_mss;
 }
 
+size_t tcp_mss_cached(struct tcp_mss_cache *cache, struct socket_ctx *socket) {
+    const uv_tcp_t *listener = socket->tunnel->listener;
+    uint64_t now = uv_now(socket->handle.handle.loop);
+    size_t index = ((uintptr_t)listener / sizeof(void *)) % TCP_MSS_CACHE_SLOTS;
+
+    if (cache == NULL) {
+        return _update_tcp_mss(socket);
+    }
+    if (cache->slots[index].listener != listener || cache->slots[index].mss == 0
+        || now - cache->slots[index].measured_at >= TCP_MSS_CACHE_REFRESH_MS)
+    {
+        cache->slots[index].listener = listener;
+        cache->slots[index].mss = _update_tcp_mss(socket);
+        cache->slots[index].measured_at = now;
+    }
+    return cache->slots[index].mss;
+}
+
 static bool tunnel_is_dead(struct tunnel_ctx *tunnel) {
     return (tunnel->terminated != false);
 }
@@ -91,67 +143,228 @@ static void tunnel_add_ref(struct tunnel_ctx *tunnel) {
     tunnel->ref_count++;
 }
 
+/* Everything a connection needs lives in one block taken from the per-loop
+ * pool, followed by |data_size| bytes for the owner's context. */
+struct tunnel_block {
+    struct tunnel_ctx tunnel;
+    struct socket_ctx incoming;
+    struct socket_ctx outgoing;
+    struct socks5_address desired_addr;
+};
+
+#define TUNNEL_BLOCK_DATA_OFFSET \
+    ((sizeof(struct tunnel_block) + sizeof(void *) * 2 - 1) & ~(sizeof(void *) * 2 - 1))
+
+/* Happy eyeballs: staggered connects to every candidate of the outgoing
+ * socket, the first to succeed hands its descriptor over to the socket. */
+struct connect_attempt {
+    uv_tcp_t tcp;
+    uv_connect_t req;
+    struct connect_race *race;
+    union sockaddr_universal addr;
+};
+
+struct connect_race {
+    struct socket_ctx *socket;  /* NULL once aborted or decided. */
+    union sockaddr_universal addrs[SOCKET_RESOLVE_MAX_ADDRS];  /* Families interleaved. */
+    size_t count;
+    size_t next;  /* Next candidate to try. */
+    size_t connecting;  /* Attempts in flight. */
+    unsigned int open_handles;  /* Freed when the last one closes. */
+    bool started;
+    int last_error;
+    uv_timer_t delay_timer;
+    struct connect_attempt attempts[SOCKET_RESOLVE_MAX_ADDRS];
+};
+
 static void tunnel_release(struct tunnel_ctx *tunnel) {
     tunnel->ref_count--;
     if (tunnel->ref_count == 0) {
+        struct tunnel_block *block = CONTAINER_OF(tunnel, struct tunnel_block, tunnel);
+        if (tunnel->stats) {
+            tunnel_mark_phase(tunnel, tunnel_phase_lifetime);
+            tunnel->stats->tunnels_closed++;
+        }
+        if (tunnel->trace) {
+            uint64_t now = uv_hrtime();
+            if (tunnel->trace_stage) {
+                tunnel_trace_span(tunnel->trace, tunnel->trace_id, tunnel->trace_stage, tunnel->trace_stage_begin, now, 0);
+            }
+            tunnel_trace_span(tunnel->trace, tunnel->trace_id, "tunnel", tunnel->accept_time, now, 0);
+        }
         if (tunnel->tunnel_dying) {
             tunnel->tunnel_dying(tunnel);
         }
+        timer_wheel_cancel(&tunnel->idle_trim);
+        handle_table_remove(tunnel->handles, tunnel->handle);
+        ssr_census_remove(ssr_census_tunnels, buffer_pool_block_size(block));
+        buffer_pool_free(tunnel->buffer_pool, block);
+    }
+}
 
-        free(tunnel->incoming);
-
-        free(tunnel->outgoing);
+static void tunnel_idle_trim_expire_cb(struct timer_wheel_entry *entry) {
+    struct tunnel_ctx *tunnel = CONTAINER_OF(entry, struct tunnel_ctx, idle_trim);
+    if (tunnel_is_dead(tunnel) == false && tunnel->tunnel_idle_trim) {
+        tunnel->tunnel_idle_trim(tunnel);
+    }
+}
 
-        free(tunnel->desired_addr);
-        free(tunnel);
+/* Traffic pushes the trim back, a busy tunnel keeps its buffers at size. */
+static void tunnel_idle_trim_rearm(struct tunnel_ctx *tunnel) {
+    tunnel->active_at = uv_now(tunnel->listener->loop);
+    if (tunnel->tunnel_idle_trim && tunnel->timer_wheel && tunnel_is_dead(tunnel) == false) {
+        timer_wheel_schedule(tunnel->timer_wheel, &tunnel->idle_trim, TUNNEL_IDLE_TRIM_MS);
     }
 }
 
-/* |incoming| has been initialized by listener.c when this is called. */
-void tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout, tunnel_init_done_cb init_done_cb, void *p) {
-    struct socket_ctx *incoming;
-    struct socket_ctx *outgoing;
+static void socket_ctx_init(struct socket_ctx *c, struct tunnel_ctx *tunnel, unsigned int idle_timeout) {
+    uv_loop_t *loop = tunnel->listener->loop;
+    c->tunnel = tunnel;
+    c->result = 0;
+    c->rdstate = socket_stop;
+    c->wrstate = socket_stop;
+    c->read_full = false;
+    c->read_eof = false;
+    c->idle_timeout = idle_timeout;
+    timer_wheel_entry_init(&c->timer_entry, socket_timer_expire_cb);
+    timer_wheel_entry_init(&c->rate_wait, socket_rate_wait_expire_cb);
+    fair_queue_entry_init(&c->fair_entry, socket_fair_run_cb);
+    read_coalesce_entry_init(&c->coalesce_entry, socket_coalesce_run_cb);
+    VERIFY(0 == uv_tcp_init(loop, &c->handle.tcp));
+}
+
+/* Accepts from |listener|, or takes |adopt| over when there's one. */
+static int tunnel_setup(uv_tcp_t *listener, const uv_os_sock_t *adopt, unsigned int idle_timeout, struct buffer_pool *pool, struct timer_wheel *wheel, size_t data_size, tunnel_init_done_cb init_done_cb, void *p) {
+    struct tunnel_block *block;
     struct tunnel_ctx *tunnel;
-    uv_loop_t *loop = listener->loop;
     bool success = false;
+    int err = 0;
+    size_t size = TUNNEL_BLOCK_DATA_OFFSET + data_size;
 
-    tunnel = (struct tunnel_ctx *) calloc(1, sizeof(*tunnel));
+    // Recycled blocks come back dirty.
+    block = (struct tunnel_block *) buffer_pool_alloc(pool, size);
+    memset(block, 0, size);
+    ssr_census_add(ssr_census_tunnels, buffer_pool_block_size(block));
 
+    tunnel = &block->tunnel;
     tunnel->listener = listener;
     tunnel->ref_count = 0;
-    tunnel->desired_addr = (struct socks5_address *)calloc(1, sizeof(struct socks5_address));
-
-    incoming = (struct socket_ctx *) calloc(1, sizeof(*incoming));
-    incoming->tunnel = tunnel;
-    incoming->result = 0;
-    incoming->rdstate = socket_stop;
-    incoming->wrstate = socket_stop;
-    incoming->idle_timeout = idle_timeout;
-    VERIFY(0 == uv_timer_init(loop, &incoming->timer_handle));
-    VERIFY(0 == uv_tcp_init(loop, &incoming->handle.tcp));
-    VERIFY(0 == uv_accept((uv_stream_t *)listener, &incoming->handle.stream));
-    tunnel->incoming = incoming;
-
-    outgoing = (struct socket_ctx *) calloc(1, sizeof(*outgoing));
-    outgoing->tunnel = tunnel;
-    outgoing->result = 0;
-    outgoing->rdstate = socket_stop;
-    outgoing->wrstate = socket_stop;
-    outgoing->idle_timeout = idle_timeout;
-    VERIFY(0 == uv_timer_init(loop, &outgoing->timer_handle));
-    VERIFY(0 == uv_tcp_init(loop, &outgoing->handle.tcp));
-    tunnel->outgoing = outgoing;
-
-    if (init_done_cb) {
+    tunnel->buffer_pool = pool;
+    tunnel->timer_wheel = wheel;
+    tunnel->accept_time = uv_hrtime();
+    tunnel->active_at = uv_now(listener->loop);
+    tunnel->desired_addr = &block->desired_addr;
+    tunnel->data = data_size ? ((uint8_t *)block + TUNNEL_BLOCK_DATA_OFFSET) : NULL;
+
+    socket_ctx_init(&block->incoming, tunnel, idle_timeout);
+    if (adopt) {
+        err = uv_tcp_open(&block->incoming.handle.tcp, *adopt);
+    } else {
+        VERIFY(0 == uv_accept((uv_stream_t *)listener, &block->incoming.handle.stream));
+    }
+    tunnel->incoming = &block->incoming;
+
+    socket_ctx_init(&block->outgoing, tunnel, idle_timeout);
+    tunnel->outgoing = &block->outgoing;
+
+    timer_wheel_entry_init(&tunnel->idle_trim, tunnel_idle_trim_expire_cb);
+    timer_wheel_entry_init(&tunnel->deadline, tunnel_deadline_expire_cb);
+
+    if (err == 0 && init_done_cb) {
         success = init_done_cb(tunnel, p);
     }
+    if (tunnel->stats) {
+        tunnel->stats->tunnels_accepted++;
+    }
 
     if (success) {
         /* Wait for the initial packet. */
-        socket_read(incoming, true);
+        socket_read(tunnel->incoming, true);
     } else {
         tunnel_shutdown(tunnel);
     }
+    return err;
+}
+
+/* |incoming| has been initialized by listener.c when this is called. */
+void tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout, struct buffer_pool *pool, struct timer_wheel *wheel, size_t data_size, tunnel_init_done_cb init_done_cb, void *p) {
+    tunnel_setup(listener, NULL, idle_timeout, pool, wheel, data_size, init_done_cb, p);
+}
+
+int tunnel_adopt(uv_tcp_t *listener, uv_os_sock_t sock, unsigned int idle_timeout, struct buffer_pool *pool, struct timer_wheel *wheel, size_t data_size, tunnel_init_done_cb init_done_cb, void *p) {
+    return tunnel_setup(listener, &sock, idle_timeout, pool, wheel, data_size, init_done_cb, p);
+}
+
+handle_t tunnel_handle(struct tunnel_ctx *tunnel) {
+    if (tunnel->handle == 0 && tunnel_is_dead(tunnel) == false) {
+        tunnel->handle = handle_table_add(tunnel->handles, tunnel);
+    }
+    return tunnel_is_dead(tunnel) ? 0 : tunnel->handle;
+}
+
+struct tunnel_ctx * tunnel_from_handle(struct handle_table *handles, handle_t handle) {
+    return (struct tunnel_ctx *) handle_table_get(handles, handle);
+}
+
+void tunnel_mark_phase(struct tunnel_ctx *tunnel, enum tunnel_stats_phase phase) {
+    unsigned int bit = 1u << phase;
+    if (tunnel->stats == NULL || (tunnel->phases_seen & bit)) {
+        return;
+    }
+    tunnel->phases_seen |= bit;
+    tunnel_stats_record(tunnel->stats, phase, (uv_hrtime() - tunnel->accept_time) / 1000);
+}
+
+void tunnel_trace_stage(struct tunnel_ctx *tunnel, const char *stage) {
+    uint64_t now;
+    if (tunnel->trace_stage == stage) {
+        return;
+    }
+    now = uv_hrtime();
+    if (tunnel->trace_stage) {
+        tunnel_trace_span(tunnel->trace, tunnel->trace_id, tunnel->trace_stage, tunnel->trace_stage_begin, now, 0);
+    }
+    tunnel->trace_stage = stage;
+    tunnel->trace_stage_begin = now;
+}
+
+void tunnel_stats_dump(const struct tunnel_stats *stats) {
+    int phase;
+    if (stats == NULL) {
+        return;
+    }
+    pr_info("tunnels accepted %llu, closed %llu, bytes in %llu, out %llu",
+        (unsigned long long)stats->tunnels_accepted, (unsigned long long)stats->tunnels_closed,
+        (unsigned long long)stats->bytes_incoming, (unsigned long long)stats->bytes_outgoing);
+    if (stats->compression_plain) {
+        pr_info("compressed %llu bytes to %llu, %.1f%%",
+            (unsigned long long)stats->compression_plain, (unsigned long long)stats->compression_wire,
+            100.0 * (double)stats->compression_wire / (double)stats->compression_plain);
+    }
+    if (stats->tunnels_rejected || stats->tunnels_shed || stats->accepts_deferred) {
+        pr_info("tunnels rejected %llu, shed %llu, accepts deferred %llu",
+            (unsigned long long)stats->tunnels_rejected, (unsigned long long)stats->tunnels_shed,
+            (unsigned long long)stats->accepts_deferred);
+    }
+    if (stats->tunnels_blocked) {
+        pr_info("tunnels blocked %llu", (unsigned long long)stats->tunnels_blocked);
+    }
+    if (stats->tunnels_reclaimed) {
+        pr_info("tunnels reclaimed under memory pressure %llu", (unsigned long long)stats->tunnels_reclaimed);
+    }
+    for (phase = 0; phase < tunnel_phase_max; ++phase) {
+        const struct tunnel_stats_histogram *hist = &stats->latency[phase];
+        if (hist->count == 0) {
+            continue;
+        }
+        pr_info("%-20s n %llu, p50 %llu us, p90 %llu us, p99 %llu us, max %llu us",
+            tunnel_stats_phase_name((enum tunnel_stats_phase)phase),
+            (unsigned long long)hist->count,
+            (unsigned long long)tunnel_stats_percentile(hist, 50.0),
+            (unsigned long long)tunnel_stats_percentile(hist, 90.0),
+            (unsigned long long)tunnel_stats_percentile(hist, 99.0),
+            (unsigned long long)hist->max);
+    }
 }
 
 void tunnel_shutdown(struct tunnel_ctx *tunnel) {
@@ -159,18 +372,92 @@ void tunnel_shutdown(struct tunnel_ctx *tunnel) {
         return;
     }
     tunnel->terminated = true;
+    handle_table_remove(tunnel->handles, tunnel->handle);
 
     /* Try to cancel the request. The callback still runs but if the
     * cancellation succeeded, it gets called with status=UV_ECANCELED.
     */
     if (tunnel->getaddrinfo_pending) {
-        uv_cancel(&tunnel->outgoing->t.req);
+        if (tunnel->resolv_query) {
+            // udns cancels synchronously, no callback follows.
+            resolv_cancel(tunnel->resolv_query);
+            tunnel->resolv_query = NULL;
+            tunnel->getaddrinfo_pending = false;
+        } else {
+            uv_cancel(&tunnel->outgoing->t.req);
+        }
+    }
+    if (tunnel->connect_race) {
+        connect_race_abort(tunnel->connect_race);
+    }
+    timer_wheel_cancel(&tunnel->idle_trim);
+    tunnel_deadline_stop(tunnel);
+    if (tunnel->kernel_relay) {
+        kernel_relay_close(tunnel->kernel_relay);
+        tunnel->kernel_relay = NULL;
     }
 
     socket_close(tunnel->incoming);
     socket_close(tunnel->outgoing);
 }
 
+bool tunnel_trim_now(struct tunnel_ctx *tunnel) {
+    if (tunnel_is_dead(tunnel) || tunnel->tunnel_idle_trim == NULL || timer_wheel_entry_armed(&tunnel->idle_trim) == false) {
+        return false;
+    }
+    timer_wheel_cancel(&tunnel->idle_trim);
+    tunnel->tunnel_idle_trim(tunnel);
+    return true;
+}
+
+/* Intrusive list, adding and removing a tunnel costs neither a lookup nor an allocation. */
+void tunnel_list_add(struct tunnel_ctx **head, struct tunnel_ctx *tunnel) {
+    ASSERT(head && tunnel);
+    ASSERT(tunnel->list_prev == NULL && tunnel->list_next == NULL && *head != tunnel);
+    tunnel->list_prev = NULL;
+    tunnel->list_next = *head;
+    if (*head) {
+        (*head)->list_prev = tunnel;
+    }
+    *head = tunnel;
+}
+
+void tunnel_list_remove(struct tunnel_ctx **head, struct tunnel_ctx *tunnel) {
+    ASSERT(head && tunnel);
+    if (tunnel->list_prev) {
+        tunnel->list_prev->list_next = tunnel->list_next;
+    } else {
+        ASSERT(*head == tunnel);
+        *head = tunnel->list_next;
+    }
+    if (tunnel->list_next) {
+        tunnel->list_next->list_prev = tunnel->list_prev;
+    }
+    tunnel->list_prev = NULL;
+    tunnel->list_next = NULL;
+}
+
+/* |fn| may remove the tunnel it's called with. */
+void tunnel_list_traverse(struct tunnel_ctx *head, void(*fn)(struct tunnel_ctx *tunnel, void *p), void *p) {
+    struct tunnel_ctx *iter = head;
+    if (fn == NULL) {
+        return;
+    }
+    while (iter) {
+        struct tunnel_ctx *next = iter->list_next;
+        fn(iter, p);
+        iter = next;
+    }
+}
+
+size_t tunnel_list_count(const struct tunnel_ctx *head) {
+    size_t count = 0;
+    for (; head; head = head->list_next) {
+        ++count;
+    }
+    return count;
+}
+
 //
 // The logic is as follows: read when we don't write and write when we don't read.
 // That gives us back-pressure handling for free because if the peer
@@ -200,7 +487,7 @@ void tunnel_traditional_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *
             // 目标网口 的读状态如果是已停止，则开始读目标网口 .
             // 只对读取 出网口 做超时断开处理, 而对读取 入网口 不处理超时 .
             // 这很重要, 否则可能数据传输不完整即被断开 .
-            socket_read(target_socket, (target_socket == tunnel->outgoing));
+            socket_read_paced(target_socket, (target_socket == tunnel->outgoing));
         }
     }
     else if (current_socket->rdstate == socket_done) {
@@ -209,18 +496,9 @@ void tunnel_traditional_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *
 
         // 目标 网口 的写状态 肯定 是 已停止, 可以再次写入了 .
         ASSERT(target_socket->wrstate == socket_stop);
-        {
-            size_t len = 0;
-            uint8_t *buf = NULL;
-            ASSERT(tunnel->tunnel_extract_data);
-            buf = tunnel->tunnel_extract_data(current_socket, &malloc, &len);
-            if (buf /* && size > 0 */) {
-                // 从当前 网口 提取数据然后写入 目标 网口 .
-                socket_write(target_socket, buf, len);
-            } else {
-                tunnel_shutdown(tunnel);
-            }
-            free(buf);
+        // 从当前 网口 提取数据然后写入 目标 网口 .
+        if (socket_write_from_peer(tunnel, current_socket, target_socket) == false) {
+            tunnel_shutdown(tunnel);
         }
     }
     else {
@@ -228,22 +506,596 @@ void tunnel_traditional_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *
     }
 }
 
+static bool socket_write_from_peer(struct tunnel_ctx *tunnel, struct socket_ctx *current_socket, struct socket_ctx *target_socket) {
+    if (tunnel->tunnel_extract_offload && tunnel->tunnel_extract_offload(tunnel, current_socket)) {
+        // The write follows in tunnel_offload_done(), the tunnel stays until then.
+        current_socket->offloaded++;
+        tunnel_add_ref(tunnel);
+        return true;
+    }
+    if (tunnel->tunnel_extract_segments && current_socket == tunnel->outgoing) {
+        struct buffer_segments *segs = tunnel->tunnel_extract_segments(current_socket);
+        if (segs == NULL) {
+            return false;
+        }
+        socket_write_segments(target_socket, segs);
+    } else {
+        struct buffer_t *buf = NULL;
+        ASSERT(tunnel->tunnel_extract_data);
+        buf = tunnel->tunnel_extract_data(current_socket);
+        if (buf == NULL) {
+            return false;
+        }
+        socket_write_buffer(target_socket, buf);
+    }
+    return true;
+}
+
+//
+// Same as tunnel_traditional_streaming(), but keeps reading while writes to
+// the other side are in flight. Once the write queue of the target socket
+// grows beyond the high watermark the source stops reading, and it resumes
+// when the queue drains below the low watermark, so TCP back-pressure still
+// reaches a peer that sends faster than we can forward.
+//
+void tunnel_pipelined_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct socket_ctx *current_socket = socket;
+    struct socket_ctx *target_socket = NULL;
+
+    ASSERT(current_socket == tunnel->incoming || current_socket == tunnel->outgoing);
+    target_socket = ((current_socket == tunnel->incoming) ? tunnel->outgoing : tunnel->incoming);
+
+    if (current_socket->rdstate == socket_done) {
+        current_socket->rdstate = socket_stop;
+
+        if (socket_write_from_peer(tunnel, current_socket, target_socket) == false) {
+            tunnel_shutdown(tunnel);
+            return;
+        }
+        if (uv_stream_get_write_queue_size(&target_socket->handle.stream) < tunnel->write_queue_high &&
+            current_socket->offloaded < TUNNEL_OFFLOAD_DEPTH)
+        {
+            socket_read_paced(current_socket, (current_socket == tunnel->outgoing));
+        }
+        // Otherwise the read is resumed from the write completion below, or from tunnel_offload_done().
+    }
+    else {
+        // A write to the current socket completed, others may still be pending.
+        ASSERT(current_socket->wrstate == socket_done || current_socket->wrstate == socket_busy);
+        if (current_socket->wrstate == socket_done) {
+            current_socket->wrstate = socket_stop;
+        }
+        if (target_socket->rdstate == socket_stop && target_socket->offloaded < TUNNEL_OFFLOAD_DEPTH &&
+            uv_stream_get_write_queue_size(&current_socket->handle.stream) <= tunnel->write_queue_low)
+        {
+            socket_read_paced(target_socket, (target_socket == tunnel->outgoing));
+        }
+    }
+}
+
+void tunnel_offload_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket, struct buffer_t *buf) {
+    struct socket_ctx *target = (socket == tunnel->incoming) ? tunnel->outgoing : tunnel->incoming;
+
+    ASSERT(socket->offloaded > 0);
+    socket->offloaded--;
+    if (tunnel_is_dead(tunnel)) {
+        buffer_release(buf);
+    } else if (buf == NULL) {
+        tunnel_shutdown(tunnel);
+    } else {
+        socket_write_buffer(target, buf);
+        // Pipelined streaming may have held the reads back for the offloaded ones.
+        if (tunnel->write_queue_high > 0 && socket->rdstate == socket_stop && socket->offloaded < TUNNEL_OFFLOAD_DEPTH &&
+            uv_stream_get_write_queue_size(&target->handle.stream) < tunnel->write_queue_high)
+        {
+            socket_read_paced(socket, (socket == tunnel->outgoing));
+        }
+    }
+    tunnel_release(tunnel);
+}
+
+//
+// Without a limit the kernel takes all a write gives it, up to a send buffer
+// that autotunes to megabytes, and a relay that reads again as soon as its
+// write is done keeps it that full, so the bytes of a quick exchange wait
+// behind seconds of a download. With TCP_NOTSENT_LOWAT the socket stops
+// taking more once that much is unsent, the data in flight doesn't count,
+// so libuv keeps the rest and the write completes only when the path takes
+// it. Both streaming modes read the other side again only then, the
+// backpressure reaches the sender, and throughput is what cwnd allows.
+//
+static void tunnel_limit_unsent(struct tunnel_ctx *tunnel) {
+#if defined(TCP_NOTSENT_LOWAT)
+    struct socket_ctx *sockets[2] = { tunnel->incoming, tunnel->outgoing };
+    int i;
+    if (tunnel->unsent_limited || tunnel->notsent_lowat <= 0) {
+        return;
+    }
+    tunnel->unsent_limited = true;
+    for (i = 0; i < 2; ++i) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        if (uv_fileno(&sockets[i]->handle.handle, &fd) == 0) {
+            (void)setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &tunnel->notsent_lowat, sizeof(tunnel->notsent_lowat));
+        }
+    }
+#else
+    (void)tunnel;
+#endif
+}
+
+void tunnel_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    tunnel_limit_unsent(tunnel);
+    if (tunnel->write_queue_high > 0) {
+        tunnel_pipelined_streaming(tunnel, socket);
+    } else {
+        tunnel_traditional_streaming(tunnel, socket);
+    }
+}
+
+#if defined(__linux__)
+
+#define SPLICE_CHUNK_SIZE  65536  /* The default pipe capacity. */
+#define SPLICE_ROUNDS_MAX  16  /* Per leg and wakeup, so one tunnel can't hold the loop. */
+#define SOCKMAP_CHECK_MS   1000  /* How often a sockmap pair's counters are read. */
+#define SOCKMAP_DRAIN_MS   100  /* The same after an EOF, until the peer was given it all. */
+
+/*
+ * One direction of a spliced tunnel: |from| into the pipe, the pipe into
+ * |to|, the bytes never leave the kernel. The pipe is only filled once it
+ * is empty, so a splice() into it that would block means |from| has
+ * nothing more for now.
+ */
+struct splice_leg {
+    struct socket_ctx *from;
+    struct socket_ctx *to;
+    int pipe[2];
+    size_t pending;  /* Bytes in the pipe. */
+    bool eof;
+};
+
+/*
+ * A tunnel whose bytes the kernel moves, with splice() or by a sockmap.
+ * libuv keeps the sockets, the relay watches a dup() of each with a
+ * uv_poll_t of its own, so the streams only need to stay idle.
+ */
+struct kernel_relay {
+    struct tunnel_ctx *tunnel;
+    int fds[2];  /* Of incoming and outgoing. */
+    uv_poll_t polls[2];
+    int open_handles;
+    struct splice_leg legs[2];  /* Incoming to outgoing, and back. No pipes with a sockmap. */
+
+    /* With a sockmap user space only sees the EOFs, the traffic, the idle
+     * timeout and the drain come from the sockets' TCP counters. */
+    struct sockmap_relay *sockmap;  // __weak_ptr
+    int pair;
+    struct timer_wheel_entry check;
+    uint64_t received0[2];  /* When the pair went in. */
+    uint64_t written0[2];
+    uint64_t received[2];  /* At the last check. */
+    uint64_t written[2];
+    uint64_t last_traffic;  /* uv_now() the counters last moved. */
+};
+
+static void kernel_relay_sockmap_check_cb(struct timer_wheel_entry *entry);
+static int kernel_relay_sockmap_update(struct kernel_relay *relay);
+
+static void kernel_relay_free(struct kernel_relay *relay) {
+    size_t i;
+    for (i = 0; i < 2; ++i) {
+        if (relay->fds[i] >= 0) {
+            close(relay->fds[i]);
+        }
+        if (relay->legs[i].pipe[0] >= 0) {
+            close(relay->legs[i].pipe[0]);
+            close(relay->legs[i].pipe[1]);
+        }
+    }
+    ssr_free(ssr_alloc_tunnels, relay);
+}
+
+/* The descriptors, and a pipe per leg with |pipes|. NULL if the tunnel can't have them. */
+static struct kernel_relay * kernel_relay_create(struct tunnel_ctx *tunnel, bool pipes) {
+    struct socket_ctx *sockets[2] = { tunnel->incoming, tunnel->outgoing };
+    struct kernel_relay *relay;
+    size_t i;
+
+    ASSERT(tunnel->kernel_relay == NULL && tunnel_is_dead(tunnel) == false);
+    for (i = 0; i < 2; ++i) {
+        ASSERT(sockets[i]->rdstate == socket_stop && sockets[i]->wrstate == socket_stop);
+        if (sockets[i]->pending_writes > 0 || sockets[i]->offloaded > 0) {
+            return NULL;
+        }
+    }
+
+    relay = (struct kernel_relay *) ssr_calloc(ssr_alloc_tunnels, 1, sizeof(*relay));
+    relay->tunnel = tunnel;
+    relay->pair = -1;
+    timer_wheel_entry_init(&relay->check, kernel_relay_sockmap_check_cb);
+    for (i = 0; i < 2; ++i) {
+        relay->fds[i] = -1;
+        relay->legs[i].pipe[0] = relay->legs[i].pipe[1] = -1;
+        relay->legs[i].from = sockets[i];
+        relay->legs[i].to = sockets[1 - i];
+    }
+    for (i = 0; i < 2; ++i) {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        if (uv_fileno(&sockets[i]->handle.handle, &fd) != 0 ||
+            (relay->fds[i] = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0 ||
+            (pipes && pipe2(relay->legs[i].pipe, O_NONBLOCK | O_CLOEXEC) != 0))
+        {
+            pr_warn("kernel relay: %s, streaming through user space", strerror(errno));
+            kernel_relay_free(relay);
+            return NULL;
+        }
+    }
+    return relay;
+}
+
+/* The tunnel takes |relay|, tunnel_shutdown() closes it. */
+static void kernel_relay_start(struct kernel_relay *relay) {
+    struct tunnel_ctx *tunnel = relay->tunnel;
+    size_t i;
+    for (i = 0; i < 2; ++i) {
+        VERIFY(0 == uv_poll_init(tunnel->listener->loop, &relay->polls[i], relay->fds[i]));
+        relay->polls[i].data = relay;
+    }
+    relay->open_handles = 2;
+    tunnel->kernel_relay = relay;
+}
+
+static void kernel_relay_close_done_cb(uv_handle_t *handle) {
+    struct kernel_relay *relay = (struct kernel_relay *) handle->data;
+    struct tunnel_ctx *tunnel = relay->tunnel;
+    if (--relay->open_handles == 0) {
+        kernel_relay_free(relay);
+    }
+    tunnel_release(tunnel);
+}
+
+static void kernel_relay_close(struct kernel_relay *relay) {
+    size_t i;
+    if (relay->sockmap) {
+        // What moved since the last check still counts.
+        (void)kernel_relay_sockmap_update(relay);
+        sockmap_relay_remove(relay->sockmap, relay->pair);
+        timer_wheel_cancel(&relay->check);
+    }
+    for (i = 0; i < 2; ++i) {
+        tunnel_add_ref(relay->tunnel);
+        uv_close((uv_handle_t *)&relay->polls[i], kernel_relay_close_done_cb);
+    }
+}
+
+static void kernel_relay_account(struct kernel_relay *relay, struct socket_ctx *from, size_t len) {
+    struct tunnel_ctx *tunnel = relay->tunnel;
+    if (tunnel->stats) {
+        if (from == tunnel->incoming) {
+            tunnel->stats->bytes_incoming += (uint64_t)len;
+        } else {
+            tunnel->stats->bytes_outgoing += (uint64_t)len;
+            tunnel_mark_phase(tunnel, tunnel_phase_first_upstream_byte);
+        }
+    }
+    if (tunnel->tunnel_spliced) {
+        tunnel->tunnel_spliced(tunnel, from, len);
+    }
+}
+
+/* Moves what it can without blocking, false once the leg is done or failed. */
+static bool splice_leg_pump(struct kernel_relay *relay, struct splice_leg *leg) {
+    int from_fd = relay->fds[(leg->from == relay->tunnel->incoming) ? 0 : 1];
+    int to_fd = relay->fds[(leg->to == relay->tunnel->incoming) ? 0 : 1];
+    int rounds;
+
+    for (rounds = 0; rounds < SPLICE_ROUNDS_MAX; ++rounds) {
+        ssize_t n;
+        if (leg->pending > 0) {
+            n = splice(leg->pipe[0], NULL, to_fd, NULL, leg->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    return true;
+                }
+                leg->to->result = uv_translate_sys_error(errno);
+                socket_dump_error_info("send data failed", leg->to);
+                return false;
+            }
+            leg->pending -= (size_t)n;
+            continue;
+        }
+        if (leg->eof) {
+            // Drained, the tunnel closes as it does on EOF after the last write.
+            return false;
+        }
+        n = splice(from_fd, NULL, leg->pipe[1], NULL, SPLICE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            leg->eof = true;
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return true;
+            }
+            leg->from->result = uv_translate_sys_error(errno);
+            socket_dump_error_info("receive data failed", leg->from);
+            return false;
+        }
+        leg->pending = (size_t)n;
+        kernel_relay_account(relay, leg->from, (size_t)n);
+        // Idle is idle both ways, not only while the outgoing side is read.
+        socket_timer_start(relay->tunnel->outgoing);
+    }
+    return true;
+}
+
+static void splice_relay_poll_cb(uv_poll_t *handle, int status, int events);
+
+/* Readable while its leg's pipe is empty, writable while the other leg's isn't. */
+static void splice_relay_watch(struct kernel_relay *relay) {
+    size_t i;
+    for (i = 0; i < 2; ++i) {
+        const struct splice_leg *out = &relay->legs[i];
+        const struct splice_leg *in = &relay->legs[1 - i];
+        int events = 0;
+        if (out->pending == 0 && out->eof == false) {
+            events |= UV_READABLE;
+        }
+        if (in->pending > 0) {
+            events |= UV_WRITABLE;
+        }
+        if (events) {
+            VERIFY(0 == uv_poll_start(&relay->polls[i], events, splice_relay_poll_cb));
+        } else {
+            uv_poll_stop(&relay->polls[i]);
+        }
+    }
+}
+
+static void splice_relay_poll_cb(uv_poll_t *handle, int status, int events) {
+    struct kernel_relay *relay = (struct kernel_relay *) handle->data;
+    struct tunnel_ctx *tunnel = relay->tunnel;
+    struct socket_ctx *c = (handle == &relay->polls[0]) ? tunnel->incoming : tunnel->outgoing;
+    size_t i;
+    (void)events;
+
+    if (tunnel_is_dead(tunnel)) {
+        return;
+    }
+    if (status < 0) {
+        c->result = status;
+        socket_dump_error_info("splice poll failed", c);
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    // Level triggered, so both legs get a go on either socket's event.
+    for (i = 0; i < 2; ++i) {
+        if (splice_leg_pump(relay, &relay->legs[i]) == false) {
+            tunnel_shutdown(tunnel);
+            return;
+        }
+    }
+    splice_relay_watch(relay);
+}
+
+bool tunnel_splice_streaming(struct tunnel_ctx *tunnel) {
+    struct kernel_relay *relay = kernel_relay_create(tunnel, true);
+    if (relay == NULL) {
+        return false;
+    }
+    tunnel_limit_unsent(tunnel);
+    kernel_relay_start(relay);
+    socket_timer_start(tunnel->outgoing);
+    splice_relay_watch(relay);
+    return true;
+}
+
+/* Reads the counters and accounts what was read, -1 on failure, 1 if anything moved. */
+static int kernel_relay_sockmap_update(struct kernel_relay *relay) {
+    int moved = 0;
+    size_t i;
+    for (i = 0; i < 2; ++i) {
+        uint64_t received = 0, written = 0;
+        if (sockmap_relay_socket_bytes(relay->fds[i], &received, &written) != 0) {
+            return -1;
+        }
+        if (relay->legs[i].eof && received > relay->received0[i]) {
+            --received;  /* The FIN is counted too. */
+        }
+        if (received > relay->received[i]) {
+            kernel_relay_account(relay, relay->legs[i].from, (size_t)(received - relay->received[i]));
+            moved = 1;
+        }
+        if (written != relay->written[i]) {
+            moved = 1;
+        }
+        relay->received[i] = received;
+        relay->written[i] = written;
+    }
+    return moved;
+}
+
+/* After an EOF, once everything read from that side was given to the other to send. */
+static bool kernel_relay_sockmap_drained(const struct kernel_relay *relay) {
+    size_t i;
+    for (i = 0; i < 2; ++i) {
+        if (relay->legs[i].eof &&
+            relay->written[1 - i] - relay->written0[1 - i] >= relay->received[i] - relay->received0[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void kernel_relay_sockmap_check(struct kernel_relay *relay) {
+    struct tunnel_ctx *tunnel = relay->tunnel;
+    uint64_t now = uv_now(tunnel->listener->loop);
+    int moved = kernel_relay_sockmap_update(relay);
+
+    if (moved < 0) {
+        tunnel->outgoing->result = uv_translate_sys_error(errno);
+        socket_dump_error_info("sockmap counters failed", tunnel->outgoing);
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    if (kernel_relay_sockmap_drained(relay)) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    if (moved) {
+        relay->last_traffic = now;
+    } else if (now - relay->last_traffic >= tunnel->outgoing->idle_timeout) {
+        tunnel->outgoing->result = UV_ETIMEDOUT;
+        if (tunnel->tunnel_timeout_expire_done) {
+            tunnel->tunnel_timeout_expire_done(tunnel, tunnel->outgoing);
+        }
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    timer_wheel_schedule(tunnel->timer_wheel, &relay->check,
+        (relay->legs[0].eof || relay->legs[1].eof) ? SOCKMAP_DRAIN_MS : SOCKMAP_CHECK_MS);
+}
+
+static void kernel_relay_sockmap_check_cb(struct timer_wheel_entry *entry) {
+    struct kernel_relay *relay = CONTAINER_OF(entry, struct kernel_relay, check);
+    if (tunnel_is_dead(relay->tunnel) == false) {
+        kernel_relay_sockmap_check(relay);
+    }
+}
+
+static void kernel_relay_sockmap_poll_cb(uv_poll_t *handle, int status, int events) {
+    struct kernel_relay *relay = (struct kernel_relay *) handle->data;
+    struct tunnel_ctx *tunnel = relay->tunnel;
+    size_t i = (handle == &relay->polls[0]) ? 0 : 1;
+    struct socket_ctx *c = relay->legs[i].from;
+    char byte;
+    ssize_t n;
+    (void)events;
+
+    if (tunnel_is_dead(tunnel)) {
+        return;
+    }
+    if (status < 0) {
+        c->result = status;
+        socket_dump_error_info("sockmap poll failed", c);
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    n = recv(relay->fds[i], &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n == 0) {
+        relay->legs[i].eof = true;
+        uv_poll_stop(handle);
+        kernel_relay_sockmap_check(relay);
+        return;
+    }
+    if (n > 0) {
+        // Only before the pair is complete can the verdict pass bytes up.
+        pr_warn("sockmap relay: data left to user space");
+    } else {
+        c->result = uv_translate_sys_error(errno);
+        socket_dump_error_info("receive data failed", c);
+    }
+    tunnel_shutdown(tunnel);
+}
+
+bool tunnel_sockmap_streaming(struct tunnel_ctx *tunnel, struct sockmap_relay *sockmap) {
+    struct kernel_relay *relay;
+    size_t i;
+
+    if (sockmap == NULL || (relay = kernel_relay_create(tunnel, false)) == NULL) {
+        return false;
+    }
+    // Bytes already received stay with their socket, they would be overtaken.
+    for (i = 0; i < 2; ++i) {
+        int queued = 0;
+        if (ioctl(relay->fds[i], FIONREAD, &queued) != 0 || queued > 0 ||
+            sockmap_relay_socket_bytes(relay->fds[i], &relay->received0[i], &relay->written0[i]) != 0)
+        {
+            kernel_relay_free(relay);
+            return false;
+        }
+        relay->received[i] = relay->received0[i];
+        relay->written[i] = relay->written0[i];
+    }
+    // Outgoing first, forwarded from its first segment on. Data the client
+    // sends in the moment before the pair is complete stays with incoming.
+    relay->pair = sockmap_relay_add(sockmap, relay->fds[1], relay->fds[0]);
+    if (relay->pair < 0) {
+        kernel_relay_free(relay);
+        return false;
+    }
+    relay->sockmap = sockmap;
+    relay->last_traffic = uv_now(tunnel->listener->loop);
+    kernel_relay_start(relay);
+
+    for (i = 0; i < 2; ++i) {
+        char byte;
+        ssize_t n = recv(relay->fds[i], &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n > 0) {
+            // Raced the insertion, what follows may already be forwarded.
+            pr_warn("sockmap relay: data arrived while pairing, closing");
+            tunnel_shutdown(tunnel);
+            return true;
+        }
+        if (n == 0) {
+            relay->legs[i].eof = true;
+        } else {
+            VERIFY(0 == uv_poll_start(&relay->polls[i], UV_READABLE, kernel_relay_sockmap_poll_cb));
+        }
+    }
+    kernel_relay_sockmap_check(relay);
+    return true;
+}
+
+#else
+
+static void kernel_relay_close(struct kernel_relay *relay) {
+    (void)relay;
+}
+
+bool tunnel_splice_streaming(struct tunnel_ctx *tunnel) {
+    (void)tunnel;
+    return false;
+}
+
+bool tunnel_sockmap_streaming(struct tunnel_ctx *tunnel, struct sockmap_relay *sockmap) {
+    (void)tunnel;
+    (void)sockmap;
+    return false;
+}
+
+#endif // defined(__linux__)
+
+/* The idle timeout, or the shorter one of the owner's stage, or of the flush after an EOF. */
+static unsigned int socket_timeout(const struct socket_ctx *c) {
+    const struct tunnel_ctx *tunnel = c->tunnel;
+    unsigned int timeout = tunnel->stage_timeout;
+    if (tunnel->shutdown_after_write && tunnel->linger_timeout) {
+        timeout = tunnel->linger_timeout;
+    }
+    return (timeout && timeout < c->idle_timeout) ? timeout : c->idle_timeout;
+}
+
 static void socket_timer_start(struct socket_ctx *c) {
-    VERIFY(0 == uv_timer_start(&c->timer_handle,
-        socket_timer_expire_cb,
-        c->idle_timeout,
-        0));
+    ASSERT(c->tunnel->timer_wheel);
+    if (tunnel_is_dead(c->tunnel)) {
+        return;
+    }
+    timer_wheel_schedule(c->tunnel->timer_wheel, &c->timer_entry, socket_timeout(c));
 }
 
 static void socket_timer_stop(struct socket_ctx *c) {
-    VERIFY(0 == uv_timer_stop(&c->timer_handle));
+    timer_wheel_cancel(&c->timer_entry);
 }
 
-static void socket_timer_expire_cb(uv_timer_t *handle) {
+static void socket_timer_expire_cb(struct timer_wheel_entry *entry) {
     struct socket_ctx *c;
     struct tunnel_ctx *tunnel;
 
-    c = CONTAINER_OF(handle, struct socket_ctx, timer_handle);
+    c = CONTAINER_OF(entry, struct socket_ctx, timer_entry);
     c->result = UV_ETIMEDOUT;
 
     tunnel = c->tunnel;
@@ -259,10 +1111,271 @@ static void socket_timer_expire_cb(uv_timer_t *handle) {
     tunnel_shutdown(tunnel);
 }
 
+void tunnel_deadline_start(struct tunnel_ctx *tunnel, unsigned int timeout, size_t min_rate) {
+    ASSERT(tunnel->timer_wheel);
+    tunnel->deadline_begin = uv_now(tunnel->listener->loop);
+    tunnel->deadline_read = 0;
+    tunnel->deadline_min_rate = min_rate;
+    if (timeout) {
+        timer_wheel_schedule(tunnel->timer_wheel, &tunnel->deadline, timeout);
+    }
+}
+
+void tunnel_deadline_stop(struct tunnel_ctx *tunnel) {
+    timer_wheel_cancel(&tunnel->deadline);
+    tunnel->deadline_min_rate = 0;
+}
+
+static void tunnel_deadline_expire(struct tunnel_ctx *tunnel) {
+    tunnel_deadline_stop(tunnel);
+    tunnel->incoming->result = UV_ETIMEDOUT;
+    if (tunnel->tunnel_timeout_expire_done) {
+        tunnel->tunnel_timeout_expire_done(tunnel, tunnel->incoming);
+    }
+    tunnel_shutdown(tunnel);
+}
+
+static void tunnel_deadline_expire_cb(struct timer_wheel_entry *entry) {
+    struct tunnel_ctx *tunnel = CONTAINER_OF(entry, struct tunnel_ctx, deadline);
+
+    if (tunnel_is_dead(tunnel) == false) {
+        tunnel_deadline_expire(tunnel);
+    }
+}
+
+/* Counts |len| read by |incoming|, true when the average since the deadline began is too low. */
+static bool tunnel_deadline_too_slow(struct tunnel_ctx *tunnel, size_t len) {
+    uint64_t elapsed;
+
+    if (tunnel->deadline_min_rate == 0) {
+        return false;
+    }
+    tunnel->deadline_read += (uint64_t)len;
+    elapsed = uv_now(tunnel->listener->loop) - tunnel->deadline_begin;
+    return elapsed >= TUNNEL_DEADLINE_GRACE_MS &&
+        tunnel->deadline_read * 1000 < (uint64_t)tunnel->deadline_min_rate * elapsed;
+}
+
+static void connect_race_close_done_cb(uv_handle_t *handle) {
+    struct connect_race *race = (struct connect_race *)handle->data;
+    if (--race->open_handles == 0) {
+        ssr_free(ssr_alloc_tunnels, race);
+    }
+}
+
+static void connect_race_close(struct connect_race *race, uv_handle_t *handle) {
+    if (uv_is_closing(handle) == 0) {
+        handle->data = race;
+        uv_close(handle, connect_race_close_done_cb);
+    }
+}
+
+/* Detaches |race| from its tunnel and closes every handle it still holds. */
+static void connect_race_abort(struct connect_race *race) {
+    size_t index;
+    struct socket_ctx *c = race->socket;
+
+    if (c) {
+        c->tunnel->connect_race = NULL;
+        race->socket = NULL;
+    }
+    if (race->started == false) {
+        ssr_free(ssr_alloc_tunnels, race);
+        return;
+    }
+    uv_timer_stop(&race->delay_timer);
+    connect_race_close(race, (uv_handle_t *)&race->delay_timer);
+    for (index = 0; index < race->next; ++index) {
+        connect_race_close(race, (uv_handle_t *)&race->attempts[index].tcp);
+    }
+}
+
+static void connect_race_done(struct connect_race *race, struct connect_attempt *winner) {
+    struct socket_ctx *c = race->socket;
+    int status = race->last_error;
+
+    if (winner) {
+#if !defined(_WIN32)
+        uv_os_fd_t fd;
+        status = uv_fileno((uv_handle_t *)&winner->tcp, &fd);
+        if (status == 0) {
+            // The attempt's handle closes its own descriptor, keep a duplicate.
+            fd = dup(fd);
+            status = (fd < 0) ? uv_translate_sys_error(errno) : uv_tcp_open(&c->handle.tcp, fd);
+            if (status != 0 && fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+        c->addr = winner->addr;
+    }
+    connect_race_abort(race);
+    socket_connect_finish(c, status);
+}
+
+static void connect_race_delay_cb(uv_timer_t *handle);
+static void connect_race_connect_cb(uv_connect_t *req, int status);
+
+/* Gives |tcp| a socket of its own before connect(), Multipath TCP with |mptcp|, with TCP_FASTOPEN_CONNECT
+ * so connect() returns at once and the first write goes out in the SYN,
+ * with the options of |socket_tuning|, and bound to the source address
+ * |egress_pool| picks for |addr|. Where that fails the handle is left
+ * alone and uv_tcp_connect() makes an ordinary socket. */
+static void socket_prepare_outgoing(struct tunnel_ctx *tunnel, uv_tcp_t *tcp, const union sockaddr_universal *addr) {
+#if !defined(_WIN32)
+    int fd;
+    if (tunnel->fast_open == false && tunnel->socket_tuning == NULL && tunnel->egress_pool == NULL && tunnel->mptcp == false) {
+        return;
+    }
+    fd = tunnel->mptcp ? socket_tuning_mptcp_socket(addr->addr.sa_family) : -1;
+    if (fd < 0) {
+        fd = socket(addr->addr.sa_family, SOCK_STREAM, IPPROTO_TCP);
+    }
+    if (fd < 0) {
+        return;
+    }
+#if defined(TCP_FASTOPEN_CONNECT)
+    if (tunnel->fast_open) {
+        int on = 1;
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+    }
+#endif
+    if (tunnel->socket_tuning) {
+        (void)socket_tuning_apply(tunnel->socket_tuning, fd);
+    }
+    if (tunnel->egress_pool) {
+        // The connect still goes out, from the address the system picks.
+        (void)egress_pool_bind(tunnel->egress_pool, fd, addr);
+    }
+    if (uv_tcp_open(tcp, fd) != 0) {
+        close(fd);
+    }
+#else
+    (void)tunnel; (void)tcp; (void)addr;
+#endif
+}
+
+/* Starts the next candidate, returns 0 as long as one is in flight. */
+static int connect_race_attempt_next(struct connect_race *race) {
+    uv_loop_t *loop = race->socket->tunnel->listener->loop;
+
+    while (race->next < race->count) {
+        struct connect_attempt *attempt = &race->attempts[race->next];
+        int err;
+
+        attempt->race = race;
+        attempt->addr = race->addrs[race->next];
+        race->next++;
+        VERIFY(0 == uv_tcp_init(loop, &attempt->tcp));
+        race->open_handles++;
+        socket_prepare_outgoing(race->socket->tunnel, &attempt->tcp, &attempt->addr);
+
+        err = uv_tcp_connect(&attempt->req, &attempt->tcp, &attempt->addr.addr, connect_race_connect_cb);
+        if (err != 0) {
+            race->last_error = err;
+            connect_race_close(race, (uv_handle_t *)&attempt->tcp);
+            continue;
+        }
+        race->connecting++;
+        if (race->next < race->count) {
+            uv_timer_start(&race->delay_timer, connect_race_delay_cb, CONNECT_ATTEMPT_DELAY_MS, 0);
+        }
+        return 0;
+    }
+    return race->connecting ? 0 : race->last_error;
+}
+
+static void connect_race_delay_cb(uv_timer_t *handle) {
+    struct connect_race *race = CONTAINER_OF(handle, struct connect_race, delay_timer);
+    connect_race_attempt_next(race);
+}
+
+static void connect_race_connect_cb(uv_connect_t *req, int status) {
+    struct connect_attempt *attempt = CONTAINER_OF(req, struct connect_attempt, req);
+    struct connect_race *race = attempt->race;
+
+    race->connecting--;
+    if (race->socket == NULL) {
+        return;  /* Aborted, the handle is closing. */
+    }
+    if (status == 0) {
+        connect_race_done(race, attempt);
+        return;
+    }
+    race->last_error = status;
+    connect_race_close(race, (uv_handle_t *)&attempt->tcp);
+
+    // A failure doesn't wait out the delay.
+    uv_timer_stop(&race->delay_timer);
+    if (connect_race_attempt_next(race) != 0) {
+        connect_race_done(race, NULL);
+    }
+}
+
+#if !defined(_WIN32)
+static size_t interleave_families(const union sockaddr_universal *addrs, size_t count, union sockaddr_universal *out) {
+    size_t first = 0, second = 0, n = 0;
+    int preferred = addrs[0].addr.sa_family;
+
+    while (n < count) {
+        while (first < count && addrs[first].addr.sa_family != preferred) {
+            ++first;
+        }
+        if (first < count) {
+            out[n++] = addrs[first++];
+        }
+        while (second < count && addrs[second].addr.sa_family == preferred) {
+            ++second;
+        }
+        if (second < count) {
+            out[n++] = addrs[second++];
+        }
+    }
+    return n;
+}
+#endif
+
+void socket_set_candidates(struct socket_ctx *c, const union sockaddr_universal *addrs, size_t count) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+
+    ASSERT(count > 0);
+    c->addr = addrs[0];
+
+    if (tunnel->connect_race) {
+        connect_race_abort(tunnel->connect_race);
+    }
+#if !defined(_WIN32)
+    if (count > 1 && c == tunnel->outgoing) {
+        struct connect_race *race = (struct connect_race *) ssr_calloc(ssr_alloc_tunnels, 1, sizeof(*race));
+        if (count > SOCKET_RESOLVE_MAX_ADDRS) {
+            count = SOCKET_RESOLVE_MAX_ADDRS;
+        }
+        race->socket = c;
+        race->count = interleave_families(addrs, count, race->addrs);
+        tunnel->connect_race = race;
+    }
+#endif
+}
+
 /* Assumes that c->t.sa contains a valid AF_INET or AF_INET6 address. */
 int socket_connect(struct socket_ctx *c) {
+    struct connect_race *race = c->tunnel->connect_race;
+
     ASSERT(c->addr.addr.sa_family == AF_INET || c->addr.addr.sa_family == AF_INET6);
     socket_timer_start(c);
+    if (c->tunnel->trace) {
+        c->tunnel->trace_connect_begin = uv_hrtime();
+    }
+
+    if (race && race->socket == c && race->started == false) {
+        race->started = true;
+        VERIFY(0 == uv_timer_init(c->tunnel->listener->loop, &race->delay_timer));
+        race->open_handles++;
+        return connect_race_attempt_next(race);
+    }
+    if (c == c->tunnel->outgoing) {
+        socket_prepare_outgoing(c->tunnel, &c->handle.tcp, &c->addr);
+    }
     return uv_tcp_connect(&c->t.connect_req,
         &c->handle.tcp,
         &c->addr.addr,
@@ -271,13 +1384,24 @@ int socket_connect(struct socket_ctx *c) {
 
 static void socket_connect_done_cb(uv_connect_t *req, int status) {
     struct socket_ctx *c;
-    struct tunnel_ctx *tunnel;
 
     c = CONTAINER_OF(req, struct socket_ctx, t.connect_req);
+    socket_connect_finish(c, status);
+}
+
+static void socket_connect_finish(struct socket_ctx *c, int status) {
+    struct tunnel_ctx *tunnel;
+
     c->result = status;
 
     tunnel = c->tunnel;
 
+    if (tunnel->trace && tunnel->trace_connect_begin) {
+        tunnel_trace_span(tunnel->trace, tunnel->trace_id, (status < 0) ? "connect failed" : "connect",
+            tunnel->trace_connect_begin, uv_hrtime(), 0);
+        tunnel->trace_connect_begin = 0;
+    }
+
     if (tunnel_is_dead(tunnel)) {
         return;
     }
@@ -303,14 +1427,135 @@ void socket_read(struct socket_ctx *c, bool check_timeout) {
     }
 }
 
+/*
+ * Reads start at |min_size|, an interactive flow never asks for more.
+ * Each read that fills its buffer doubles the next one up to |max_size|,
+ * so a bulk transfer takes fewer reads, syscalls and cipher calls. One
+ * that fills less than a quarter halves it again.
+ */
+void socket_adapt_read_size(size_t *read_size, const struct socket_ctx *c, size_t min_size, size_t max_size) {
+    size_t filled = (c->result > 0) ? (size_t)c->result : 0;
+    size_t size = c->read_size ? c->read_size : *read_size;
+
+    if (filled >= size) {
+        *read_size = (*read_size * 2 < max_size) ? *read_size * 2 : max_size;
+    } else if (filled < size / 4) {
+        *read_size = (*read_size / 2 > min_size) ? *read_size / 2 : min_size;
+    }
+}
+
+#define SOCKET_READ_SUGGESTED_SIZE 65536  /* What libuv suggests to socket_alloc_cb(). */
+
+//
+// Stop-and-wait streaming takes one chunk, writes it and only then reads
+// again, so every chunk costs a uv_read_start() and a trip through the
+// poller, even when the kernel already holds the next one. After a read
+// that filled its buffer that's likely, so this reads right away and hands
+// the data over before returning, the poller is only asked when it comes
+// up empty. Only for tunnel_traditional_streaming(), which is fine with
+// the read being done on return, no other caller expects that.
+//
+static void socket_read_eager(struct socket_ctx *c, bool check_timeout) {
+#if !defined(_WIN32)
+    struct tunnel_ctx *tunnel = c->tunnel;
+    uv_os_fd_t fd = (uv_os_fd_t)-1;
+
+    ASSERT(c->rdstate == socket_stop);
+    if (c->read_full && uv_fileno(&c->handle.handle, &fd) == 0) {
+        size_t size = SOCKET_READ_SUGGESTED_SIZE;
+        uv_buf_t buf;
+        ssize_t nread;
+
+        c->rdstate = socket_busy;
+        if (tunnel->tunnel_get_alloc_size) {
+            size = tunnel->tunnel_get_alloc_size(tunnel, c, size);
+        }
+        buf = uv_buf_init((char *)buffer_pool_alloc_scratch(tunnel->buffer_pool, size), (unsigned int)size);
+        nread = recv(fd, buf.base, buf.len, MSG_DONTWAIT);
+        if (nread > 0) {
+            // Takes |buf| back to the pool.
+            socket_read_done_cb(&c->handle.stream, nread, &buf);
+            return;
+        }
+        // Nothing yet, or EOF or an error libuv reports again.
+        buffer_pool_free(tunnel->buffer_pool, buf.base);
+        c->rdstate = socket_stop;
+        c->read_full = false;
+    }
+#endif // !defined(_WIN32)
+    socket_read(c, check_timeout);
+}
+
+//
+// The streaming reads, held back on the tunnel's timer wheel while its
+// buckets are in debt, so a limited tunnel costs no timer of its own and an
+// unlimited one a flag test. The wait is checked again when it's over, the
+// shared levels may have been drawn on meanwhile. Stop-and-wait reads go
+// eager, see socket_read_eager().
+//
+static void socket_read_paced(struct socket_ctx *c, bool check_timeout) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+
+    if (c->read_eof) {
+        return;
+    }
+    if (tunnel->rate_limited && tunnel->timer_wheel) {
+        uint64_t delay;
+        if (timer_wheel_entry_armed(&c->rate_wait)) {
+            return;
+        }
+        delay = rate_limit_delay(&tunnel->rate_limit, uv_now(tunnel->listener->loop));
+        if (delay > 0) {
+            c->rate_wait_timeout = check_timeout;
+            timer_wheel_schedule(tunnel->timer_wheel, &c->rate_wait, delay);
+            return;
+        }
+    }
+    if (tunnel->write_queue_high > 0) {
+        socket_read(c, check_timeout);
+    } else {
+        socket_read_eager(c, check_timeout);
+    }
+}
+
+static void socket_rate_wait_expire_cb(struct timer_wheel_entry *entry) {
+    struct socket_ctx *c = CONTAINER_OF(entry, struct socket_ctx, rate_wait);
+    if (tunnel_is_dead(c->tunnel) == false && c->rdstate == socket_stop) {
+        socket_read_paced(c, c->rate_wait_timeout);
+    }
+}
+
+static void socket_read_account(struct socket_ctx *c, size_t len) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+
+    if (tunnel->stats) {
+        if (c == tunnel->incoming) {
+            tunnel->stats->bytes_incoming += (uint64_t)len;
+            tunnel_mark_phase(tunnel, tunnel_phase_first_byte);
+        } else {
+            tunnel->stats->bytes_outgoing += (uint64_t)len;
+            tunnel_mark_phase(tunnel, tunnel_phase_first_upstream_byte);
+        }
+    }
+
+    tunnel_idle_trim_rearm(tunnel);
+    if (tunnel->rate_limited) {
+        rate_limit_charge(&tunnel->rate_limit, len, uv_now(tunnel->listener->loop));
+    }
+}
+
 static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf) {
     struct socket_ctx *c;
     struct tunnel_ctx *tunnel;
+    struct buffer_pool *pool;
+    uint64_t begun;
+
+    c = CONTAINER_OF(handle, struct socket_ctx, handle);
+    tunnel = c->tunnel;
+    pool = tunnel->buffer_pool;
 
     do {
-        c = CONTAINER_OF(handle, struct socket_ctx, handle);
         c->result = nread;
-        tunnel = c->tunnel;
 
         if (tunnel_is_dead(tunnel)) {
             break;
@@ -324,30 +1569,153 @@ static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf
             break;
         }
         if (nread < 0) {
+            struct socket_ctx *peer = (c == tunnel->incoming) ? tunnel->outgoing : tunnel->incoming;
             // http://docs.libuv.org/en/v1.x/stream.html
             if (nread != UV_EOF) {
                 socket_dump_error_info("receive data failed", c);
+            } else if (peer->pending_writes > 0 || c->offloaded > 0) {
+                // Let the data already queued to the peer go out first, but
+                // no longer than the linger, a peer that stopped taking it
+                // would hold the tunnel for a whole idle timeout.
+                c->rdstate = socket_stop;
+                c->read_eof = true;
+                tunnel->shutdown_after_write = true;
+                socket_timer_start(peer);
+                break;
             }
             tunnel_shutdown(tunnel);
             break;
         }
 
+        socket_read_account(c, (size_t)nread);
+        if (c == tunnel->incoming && tunnel_deadline_too_slow(tunnel, (size_t)nread)) {
+            tunnel_deadline_expire(tunnel);
+            break;
+        }
+
+        c->read_full = ((size_t)nread == buf->len);
+        c->read_size = buf->len;
+        if (tunnel->coalescer && (size_t)nread < read_coalescer_below(tunnel->coalescer)) {
+            // Held with room for what else comes this iteration, the tunnel stays until it's out.
+            char *kept = (char *)buffer_pool_alloc(pool, buf->len);
+            memcpy(kept, buf->base, (size_t)nread);
+            c->coalesce_buf = uv_buf_init(kept, buf->len);
+            c->coalesce_held = (size_t)nread;
+            tunnel_add_ref(tunnel);
+            read_coalescer_submit(tunnel->coalescer, &c->coalesce_entry);
+            break;
+        }
+        if (tunnel->fair_queue) {
+            // The data waits with the socket, the tunnel stays until it's had its turn.
+            // Out of the scratch block, that's for the next read.
+            char *kept = (char *)buffer_pool_detach(pool, buf->base, (size_t)nread);
+            if (kept == NULL) {
+                tunnel_shutdown(tunnel);
+                return;
+            }
+            c->fair_buf = uv_buf_init(kept, (unsigned int)nread);
+            tunnel_add_ref(tunnel);
+            fair_queue_submit(tunnel->fair_queue, &c->fair_entry, (size_t)nread);
+            return;
+        }
         c->buf = buf;
         ASSERT(c->rdstate == socket_busy);
         c->rdstate = socket_done;
 
         ASSERT(tunnel->tunnel_read_done);
+        begun = loop_watchdog_begin(tunnel->watchdog);
         tunnel->tunnel_read_done(tunnel, c);
+        loop_watchdog_end(tunnel->watchdog, loop_work_read, begun);
     } while (0);
 
     if (buf->base) {
-        free(buf->base); // important!!!
+        buffer_pool_free(pool, buf->base); // important!!!
+    }
+    c->buf = NULL;
+}
+
+//
+// A read's turn on the fair queue. Big chunks of bulk tunnels, each a
+// decrypt, an encrypt and a write, then no longer run back to back ahead
+// of the small ones of interactive tunnels on the same loop.
+//
+static void socket_fair_run_cb(struct fair_queue_entry *entry) {
+    struct socket_ctx *c = CONTAINER_OF(entry, struct socket_ctx, fair_entry);
+    struct tunnel_ctx *tunnel = c->tunnel;
+    struct buffer_pool *pool = tunnel->buffer_pool;
+
+    if (tunnel_is_dead(tunnel) == false) {
+        uint64_t begun = loop_watchdog_begin(tunnel->watchdog);
+        c->result = (ssize_t)entry->cost;  /* A write to |c| done meanwhile set its own. */
+        c->buf = &c->fair_buf;
+        c->rdstate = socket_done;
+        ASSERT(tunnel->tunnel_read_done);
+        tunnel->tunnel_read_done(tunnel, c);
+        loop_watchdog_end(tunnel->watchdog, loop_work_read, begun);
+    }
+    buffer_pool_free(pool, c->fair_buf.base);
+    c->fair_buf = uv_buf_init(NULL, 0);
+    c->buf = NULL;
+    tunnel_release(tunnel);
+}
+
+//
+// A small read at the end of its loop iteration. What the peer sent
+// meanwhile is taken behind it without asking the poller, so the tunnel
+// frames, encrypts and writes it all once. EOF and errors are left for
+// libuv to report on the next read.
+//
+static void socket_coalesce_run_cb(struct read_coalesce_entry *entry) {
+    struct socket_ctx *c = CONTAINER_OF(entry, struct socket_ctx, coalesce_entry);
+    struct tunnel_ctx *tunnel = c->tunnel;
+    struct buffer_pool *pool = tunnel->buffer_pool;
+    char *kept = c->coalesce_buf.base;
+    size_t held = c->coalesce_held;
+
+    c->coalesce_buf = uv_buf_init(NULL, 0);
+    c->coalesce_held = 0;
+    if (tunnel_is_dead(tunnel)) {
+        buffer_pool_free(pool, kept);
+        tunnel_release(tunnel);
+        return;
+    }
+#if !defined(_WIN32)
+    {
+        uv_os_fd_t fd = (uv_os_fd_t)-1;
+        if (held < c->read_size && uv_fileno(&c->handle.handle, &fd) == 0) {
+            ssize_t more = recv(fd, kept + held, c->read_size - held, MSG_DONTWAIT);
+            if (more > 0) {
+                socket_read_account(c, (size_t)more);
+                held += (size_t)more;
+                c->read_full = (held == c->read_size);
+            }
+        }
+    }
+#endif // !defined(_WIN32)
+    if (tunnel->fair_queue) {
+        // Now it waits its turn like any other read, still holding the tunnel.
+        c->fair_buf = uv_buf_init(kept, (unsigned int)held);
+        fair_queue_submit(tunnel->fair_queue, &c->fair_entry, held);
+        return;
+    }
+    {
+        uv_buf_t buf = uv_buf_init(kept, (unsigned int)held);
+        uint64_t begun = loop_watchdog_begin(tunnel->watchdog);
+        c->result = (ssize_t)held;
+        c->buf = &buf;
+        c->rdstate = socket_done;
+        ASSERT(tunnel->tunnel_read_done);
+        tunnel->tunnel_read_done(tunnel, c);
+        loop_watchdog_end(tunnel->watchdog, loop_work_read, begun);
     }
+    buffer_pool_free(pool, kept);
     c->buf = NULL;
+    tunnel_release(tunnel);
 }
 
 void socket_read_stop(struct socket_ctx *c) {
     uv_read_stop(&c->handle.stream);
+    socket_timer_stop(c);
     c->rdstate = socket_stop;
 }
 
@@ -364,7 +1732,8 @@ static void socket_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
         size = tunnel->tunnel_get_alloc_size(tunnel, ctx, size);
     }
 
-    *buf = uv_buf_init((char *)calloc(size, sizeof(char)), (unsigned int)size);
+    // The block is handed back in socket_read_done_cb, no need to zero it.
+    *buf = uv_buf_init((char *)buffer_pool_alloc_scratch(tunnel->buffer_pool, size), (unsigned int)size);
 }
 
 void socket_getaddrinfo(struct socket_ctx *c, const char *hostname) {
@@ -375,6 +1744,18 @@ void socket_getaddrinfo(struct socket_ctx *c, const char *hostname) {
     tunnel = c->tunnel;
     loop = tunnel->listener->loop;
 
+    if (tunnel->trace) {
+        tunnel->trace_resolve_begin = uv_hrtime();
+    }
+    if (tunnel->resolver) {
+        tunnel->resolv_query = resolv_query(tunnel->resolver, hostname, c->addr.addr4.sin_port, socket_resolv_done_cb, c);
+        if (tunnel->resolv_query) {
+            socket_timer_start(c);
+            tunnel->getaddrinfo_pending = true;
+            return;
+        }
+    }
+
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -390,14 +1771,44 @@ void socket_getaddrinfo(struct socket_ctx *c, const char *hostname) {
 }
 
 static void socket_getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai) {
-    struct socket_ctx *c;
-    struct tunnel_ctx *tunnel;
+    struct socket_ctx *c = CONTAINER_OF(req, struct socket_ctx, t.addrinfo_req);
+    union sockaddr_universal addrs[SOCKET_RESOLVE_MAX_ADDRS];
+    size_t count = 0;
 
-    c = CONTAINER_OF(req, struct socket_ctx, t.addrinfo_req);
-    c->result = status;
+    if (status == 0) {
+        size_t index;
+        uint16_t port = c->addr.addr4.sin_port;
+        count = universal_addresses_from_addrinfo(ai, addrs, SOCKET_RESOLVE_MAX_ADDRS);
+        for (index = 0; index < count; ++index) {
+            addrs[index].addr4.sin_port = port;
+        }
+    }
+    if (ai) {
+        uv_freeaddrinfo(ai);
+    }
+    socket_resolve_done(c, status, addrs, count);
+}
 
-    tunnel = c->tunnel;
+static void socket_resolv_done_cb(int status, const union sockaddr_universal *addrs, size_t count, void *data) {
+    struct socket_ctx *c = (struct socket_ctx *)data;
+    c->tunnel->resolv_query = NULL;
+    socket_resolve_done(c, status, addrs, count);
+}
+
+static void socket_resolve_done(struct socket_ctx *c, int status, const union sockaddr_universal *addrs, size_t count) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+    uint64_t begun;
+
+    if (status == 0 && count == 0) {
+        status = UV_EAI_NODATA;
+    }
+    c->result = status;
     tunnel->getaddrinfo_pending = false;
+    if (tunnel->trace && tunnel->trace_resolve_begin) {
+        tunnel_trace_span(tunnel->trace, tunnel->trace_id, (status < 0) ? "resolve failed" : "resolve",
+            tunnel->trace_resolve_begin, uv_hrtime(), 0);
+        tunnel->trace_resolve_begin = 0;
+    }
 
     if (tunnel_is_dead(tunnel)) {
         return;
@@ -405,71 +1816,128 @@ static void socket_getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct
 
     socket_timer_stop(c);
 
+    begun = loop_watchdog_begin(tunnel->watchdog);
+    if (tunnel->tunnel_getaddrinfo_result && status != UV_ECANCELED) {
+        tunnel->tunnel_getaddrinfo_result(tunnel, c, status, addrs, count);
+    }
+
     if (status < 0) {
         socket_dump_error_info("resolve address failed", c);
         tunnel_shutdown(tunnel);
-        return;
-    }
+    } else {
+        // Ports are already in place.
+        socket_set_candidates(c, addrs, count);
 
-    if (status == 0) {
-        /* FIXME(bnoordhuis) Should try all addresses. */
-        uint16_t port = c->addr.addr4.sin_port;
-        if (ai->ai_family == AF_INET) {
-            c->addr.addr4 = *(const struct sockaddr_in *) ai->ai_addr;
-        } else if (ai->ai_family == AF_INET6) {
-            c->addr.addr6 = *(const struct sockaddr_in6 *) ai->ai_addr;
-        } else {
-            UNREACHABLE();
-        }
-        c->addr.addr4.sin_port = port;
+        ASSERT(tunnel->tunnel_getaddrinfo_done);
+        tunnel->tunnel_getaddrinfo_done(tunnel, c);
     }
+    loop_watchdog_end(tunnel->watchdog, loop_work_resolve, begun);
+}
+
+void socket_write(struct socket_ctx *c, const void *data, size_t len) {
+    socket_write_buffer(c, buffer_create_from((const uint8_t *)data, len));
+}
+
+struct socket_write_req {
+    uv_write_t req;
+    struct buffer_t *buffer;
+    struct buffer_segments *segments;
+};
 
-    uv_freeaddrinfo(ai);
+#define SOCKET_WRITE_INLINE_SEGMENTS 16
 
-    ASSERT(tunnel->tunnel_getaddrinfo_done);
-    tunnel->tunnel_getaddrinfo_done(tunnel, c);
+static void socket_write_bufs(struct socket_ctx *c, struct socket_write_req *wr, const uv_buf_t *bufs, unsigned int nbufs) {
+    // Only pipelined streaming queues a write while another one is in flight.
+    ASSERT(c->wrstate == socket_stop || (c->wrstate == socket_busy && c->tunnel->write_queue_high > 0));
+    c->wrstate = socket_busy;
+    c->pending_writes++;
+
+    // uv_write() keeps its own copy of |bufs|, only the memory they point to must stay alive.
+    VERIFY(0 == uv_write(&wr->req, &c->handle.stream, bufs, nbufs, socket_write_done_cb));
+    socket_timer_start(c);
 }
 
-void socket_write(struct socket_ctx *c, const void *data, size_t len) {
+/* Takes over the caller's reference to |buffer|, it's released once the write completes. */
+void socket_write_buffer(struct socket_ctx *c, struct buffer_t *buffer) {
     uv_buf_t buf;
-    struct tunnel_ctx *tunnel = c->tunnel;
-    char *write_buf = NULL;
-    uv_write_t *req;
+    struct socket_write_req *wr;
 
-    ASSERT(c->wrstate == socket_stop);
-    c->wrstate = socket_busy;
+    ASSERT(buffer);
 
     // It's okay to cast away constness here, uv_write() won't modify the memory.
-    write_buf = (char *)calloc(len + 1, sizeof(*write_buf));
-    memcpy(write_buf, data, len);
-    buf = uv_buf_init(write_buf, (unsigned int)len);
+    buf = uv_buf_init((char *)buffer->buffer, (unsigned int)buffer->len);
 
-    req = (uv_write_t *)calloc(1, sizeof(uv_write_t));
-    req->data = write_buf;
+    wr = (struct socket_write_req *)ssr_calloc(ssr_alloc_tunnels, 1, sizeof(*wr));
+    wr->buffer = buffer;
 
-    VERIFY(0 == uv_write(req, &c->handle.stream, &buf, 1, socket_write_done_cb));
-    socket_timer_start(c);
+    socket_write_bufs(c, wr, &buf, 1);
+}
+
+/* Same as socket_write_buffer(), but all segments go out in one vectored write. */
+void socket_write_segments(struct socket_ctx *c, struct buffer_segments *segs) {
+    uv_buf_t inline_bufs[SOCKET_WRITE_INLINE_SEGMENTS];
+    uv_buf_t *bufs = inline_bufs;
+    struct socket_write_req *wr;
+    size_t count, index;
+
+    ASSERT(segs);
+    count = buffer_segments_count(segs);
+    if (count > SOCKET_WRITE_INLINE_SEGMENTS) {
+        bufs = (uv_buf_t *)ssr_calloc(ssr_alloc_tunnels, count, sizeof(*bufs));
+    }
+    for (index = 0; index < count; ++index) {
+        size_t len = 0;
+        const uint8_t *data = buffer_segments_get(segs, index, &len);
+        bufs[index] = uv_buf_init((char *)data, (unsigned int)len);
+    }
+
+    if (count == 0) {
+        // uv_write() refuses an empty vector, keep the write/callback cycle going anyway.
+        bufs[0] = uv_buf_init(NULL, 0);
+        count = 1;
+    }
+
+    wr = (struct socket_write_req *)ssr_calloc(ssr_alloc_tunnels, 1, sizeof(*wr));
+    wr->segments = segs;
+
+    socket_write_bufs(c, wr, bufs, (unsigned int)count);
+
+    if (bufs != inline_bufs) {
+        ssr_free(ssr_alloc_tunnels, bufs);
+    }
+}
+
+/* Whether |c| has no write left, nor one still to come of what its peer read before an EOF. */
+static bool socket_drained(const struct socket_ctx *c) {
+    const struct socket_ctx *peer = (c == c->tunnel->incoming) ? c->tunnel->outgoing : c->tunnel->incoming;
+    return c->pending_writes == 0 && (peer->read_eof == false || peer->offloaded == 0);
 }
 
 static void socket_write_done_cb(uv_write_t *req, int status) {
     struct socket_ctx *c;
     struct tunnel_ctx *tunnel;
-    char *write_buf = NULL;
+    struct socket_write_req *wr;
 
     c = CONTAINER_OF(req->handle, struct socket_ctx, handle.stream);
 
-    VERIFY((write_buf = (char *)req->data));
-    free(write_buf);
+    wr = CONTAINER_OF(req, struct socket_write_req, req);
+    buffer_release(wr->buffer);
+    buffer_segments_release(wr->segments);
 
     c->result = status;
-    free(req);
+    ssr_free(ssr_alloc_tunnels, wr);
     tunnel = c->tunnel;
 
+    ASSERT(c->pending_writes > 0);
+    c->pending_writes--;
+
     if (tunnel_is_dead(tunnel)) {
         return;
     }
 
-    socket_timer_stop(c);
+    if (c->pending_writes == 0) {
+        socket_timer_stop(c);
+    }
 
     if (status < 0 /*status == UV_ECANCELED*/) {
         socket_dump_error_info("send data failed", c);
@@ -477,8 +1945,17 @@ static void socket_write_done_cb(uv_write_t *req, int status) {
         return;  /* Handle has been closed. */
     }
 
+    if (tunnel->shutdown_after_write && socket_drained(tunnel->incoming) && socket_drained(tunnel->outgoing)) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+
     ASSERT(c->wrstate == socket_busy);
-    c->wrstate = socket_done;
+    if (c->pending_writes == 0) {
+        c->wrstate = socket_done;
+    }
+
+    tunnel_idle_trim_rearm(tunnel);
 
     ASSERT(tunnel->tunnel_write_done);
     tunnel->tunnel_write_done(tunnel, c);
@@ -490,13 +1967,13 @@ static void socket_close(struct socket_ctx *c) {
     ASSERT(c->wrstate != socket_dead);
     c->rdstate = socket_dead;
     c->wrstate = socket_dead;
-    c->timer_handle.data = c;
     c->handle.handle.data = c;
 
+    socket_timer_stop(c);
+    timer_wheel_cancel(&c->rate_wait);
+
     tunnel_add_ref(tunnel);
     uv_close(&c->handle.handle, socket_close_done_cb);
-    tunnel_add_ref(tunnel);
-    uv_close((uv_handle_t *)&c->timer_handle, socket_close_done_cb);
 }
 
 static void socket_close_done_cb(uv_handle_t *handle) {
@@ -521,6 +1998,7 @@ void socket_dump_error_info(const char *title, struct socket_ctx *socket) {
         union sockaddr_universal tmp = { 0 };
         int len = sizeof(tmp);
         uv_tcp_getpeername(&socket->handle.tcp, &tmp.addr, &len);
+        universal_address_unmap(&tmp);  // Of a dual-stack listener.
         universal_address_to_string(&tmp, addr, sizeof(addr));
         from = "_client_";
     }
@@ -4,9 +4,26 @@
 #include <uv.h>
 #include <stdbool.h>
 #include "sockaddr_universal.h"
+#include "tunnel_stats.h"
+#include "timer_wheel.h"
+#include "rate_limit.h"
+#include "fair_queue.h"
+#include "read_coalesce.h"
+#include "loop_watchdog.h"
+#include "tunnel_trace.h"
+#include "handle_table.h"
 
 struct tunnel_ctx;
 struct buffer_t;
+struct buffer_pool;
+struct buffer_segments;
+struct resolv_ctx;
+struct resolv_query;
+struct connect_race;
+struct kernel_relay;
+struct sockmap_relay;
+struct socket_tuning;
+struct egress_pool;
 
 enum socket_state {
     socket_stop,  /* Stopped. */
@@ -21,14 +38,26 @@ struct socket_ctx {
     unsigned int idle_timeout;
     struct tunnel_ctx *tunnel;  /* Backlink to owning tunnel context. */
     ssize_t result;
+    unsigned int pending_writes;  /* uv_write() requests not completed yet. */
+    bool read_full;  /* The last read filled its buffer, more is likely queued in the kernel. */
+    bool read_eof;  /* The peer sent EOF while writes to the other side were pending, no read is started again. */
+    size_t read_size;  /* Of the last read's buffer, what it could have filled. */
+    unsigned int offloaded;  /* Reads taken by tunnel_extract_offload, not back with tunnel_offload_done() yet. */
     union {
         uv_handle_t handle;
         uv_stream_t stream;
         uv_tcp_t tcp;
         uv_udp_t udp;
     } handle;
-    uv_timer_t timer_handle;  /* For detecting timeouts. */
-                              /* We only need one of these at a time so make them share memory. */
+    struct timer_wheel_entry timer_entry;  /* For detecting timeouts, on the tunnel's timer_wheel. */
+    struct timer_wheel_entry rate_wait;  /* Holds a streaming read back while the tunnel's buckets are in debt. */
+    bool rate_wait_timeout;  /* The held read's check_timeout. */
+    struct fair_queue_entry fair_entry;  /* A read waiting for its turn on the tunnel's fair_queue, */
+    uv_buf_t fair_buf;  /* with its buffer, fair_entry.cost bytes of it read. */
+    struct read_coalesce_entry coalesce_entry;  /* A small read held on the tunnel's coalescer, */
+    uv_buf_t coalesce_buf;  /* in a block of |read_size| bytes, */
+    size_t coalesce_held;  /* this many of them read. */
+    /* We only need one of these at a time so make them share memory. */
     union {
         uv_getaddrinfo_t addrinfo_req;
         uv_connect_t connect_req;
@@ -40,24 +69,74 @@ struct socket_ctx {
 
 struct tls_cli_ctx;
 
+#define TUNNEL_IDLE_TRIM_MS (10 * 1000)  /* Quiet time before tunnel_idle_trim is called. */
+#define TUNNEL_DEADLINE_GRACE_MS 1000  /* Of a deadline, before |incoming| is held to its rate. */
+#define TUNNEL_OFFLOAD_DEPTH 8  /* Reads of a socket out with tunnel_extract_offload before it stops reading. */
+
 struct tunnel_ctx {
-    void *data;
+    void *data;  /* Owner's context, zeroed |data_size| bytes, see tunnel_initialize(). */
     bool terminated;
     bool getaddrinfo_pending;
     uv_tcp_t *listener;  /* Backlink to owning listener context. */
     struct socket_ctx *incoming;  /* Connection with the SOCKS client. */
     struct socket_ctx *outgoing;  /* Connection with upstream. */
     struct socks5_address *desired_addr;
+    struct buffer_pool *buffer_pool;  /* Per-loop read buffers and tunnel blocks, may be NULL. */
+    struct timer_wheel *timer_wheel;  /* Per-loop idle timeouts of both sockets. */
+    struct fair_queue *fair_queue;  /* Per-loop turns of the reads set by the owner, NULL hands them over at once. */
+    struct read_coalescer *coalescer;  /* Per-loop holding of small reads set by the owner, NULL hands them over at once. */
+    struct loop_watchdog *watchdog;  /* Per-loop timing of the reads and answers set by the owner, may be NULL. */
+    struct resolv_ctx *resolver;  /* Per-loop udns resolver set by the owner, NULL resolves with uv_getaddrinfo(). */
+    struct resolv_query *resolv_query;  /* Pending on |resolver|. */
+    struct connect_race *connect_race;  /* Candidates of |outgoing|, see socket_set_candidates(). */
+    size_t write_queue_high;  /* Pipelined streaming watermarks in bytes, see tunnel_pipelined_streaming(). */
+    size_t write_queue_low;
+    int notsent_lowat;  /* TCP_NOTSENT_LOWAT of both sockets once streaming starts, 0 leaves them. */
+    bool unsent_limited;  /* |notsent_lowat| is set. */
+    struct rate_limit rate_limit;  /* Both ways' reads, under the owner's levels, see rate_limit_init(). */
+    bool rate_limited;  /* Set by the owner once |rate_limit| is initialized. */
+    bool fast_open;  /* |outgoing| sends its first write with the SYN, where the system can. */
+    bool mptcp;  /* |outgoing| is a Multipath TCP socket, where the system has it. */
+    const struct socket_tuning *socket_tuning;  /* Options of |outgoing| set by the owner, may be NULL. */
+    struct egress_pool *egress_pool;  /* Per-loop source addresses of |outgoing| set by the owner, may be NULL. */
+    bool shutdown_after_write;  /* Peer sent EOF, close once the pending writes are flushed. */
+    unsigned int stage_timeout;  /* Set by the owner per stage, ms of both sockets' timers until it's 0 again for streaming. */
+    unsigned int linger_timeout;  /* Set by the owner, ms the pending writes get once |shutdown_after_write|. */
+    struct timer_wheel_entry deadline;  /* Of the owner's handshake as a whole, see tunnel_deadline_start(). */
+    uint64_t deadline_begin;  /* uv_now() when |deadline| was armed, */
+    uint64_t deadline_read;  /* bytes |incoming| read since, */
+    size_t deadline_min_rate;  /* and those it must average per second past TUNNEL_DEADLINE_GRACE_MS, 0 any. */
     int ref_count;
+    struct tunnel_ctx *list_prev;  /* Links of the owner's tunnel list, see tunnel_list_add(). */
+    struct tunnel_ctx *list_next;
+    struct tunnel_stats *stats;  /* Per-loop instrumentation set by the owner, may be NULL. */
+    uint64_t accept_time;  /* uv_hrtime() when accepted, origin of every tunnel_mark_phase(). */
+    unsigned int phases_seen;  /* Bit per tunnel_stats_phase already recorded. */
+    struct tunnel_trace *trace;  /* Per-loop spans set by the owner when sampled, NULL otherwise. */
+    uint32_t trace_id;
+    const char *trace_stage;  /* The owner's stage open since |trace_stage_begin|, see tunnel_trace_stage(). */
+    uint64_t trace_stage_begin;
+    uint64_t trace_resolve_begin;
+    uint64_t trace_connect_begin;
+    struct timer_wheel_entry idle_trim;  /* Re-armed by traffic while tunnel_idle_trim is set. */
+    uint64_t active_at;  /* uv_now() of the last read or write done, or of the accept. */
+    struct kernel_relay *kernel_relay;  /* Set by tunnel_splice_streaming() and tunnel_sockmap_streaming(). */
+    struct handle_table *handles;  /* Per-loop handles set by the owner for tunnel_handle(), may be NULL. */
+    handle_t handle;  /* 0 until tunnel_handle() is called. */
 
     void(*tunnel_dying)(struct tunnel_ctx *tunnel);
     void(*tunnel_timeout_expire_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_outgoing_connected_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_read_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_getaddrinfo_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+    void(*tunnel_getaddrinfo_result)(struct tunnel_ctx *tunnel, struct socket_ctx *socket, int status, const union sockaddr_universal *addrs, size_t count); /* Optional, sees every answer before the first address is picked. */
     void(*tunnel_write_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+    void(*tunnel_idle_trim)(struct tunnel_ctx *tunnel); /* Optional, gives back buffer memory after TUNNEL_IDLE_TRIM_MS without traffic. */
+    void(*tunnel_spliced)(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t len); /* Optional, |len| bytes read from |socket| while the kernel relays. */
     size_t(*tunnel_get_alloc_size)(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
-    uint8_t*(*tunnel_extract_data)(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size);
+    struct buffer_t*(*tunnel_extract_data)(struct socket_ctx *socket);
+    struct buffer_segments*(*tunnel_extract_segments)(struct socket_ctx *socket); /* Optional, preferred over tunnel_extract_data for the reads of |outgoing|, the side framed on its way back. */
+    bool(*tunnel_extract_offload)(struct tunnel_ctx *tunnel, struct socket_ctx *socket); /* Optional, tried first while streaming, true when it took the read to hand back with tunnel_offload_done(). */
     struct tls_cli_ctx *tls_ctx;
     void(*tunnel_tls_on_connection_established)(struct tunnel_ctx *tunnel);
     void(*tunnel_tls_send_data)(struct tunnel_ctx *tunnel, const uint8_t *data, size_t size);
@@ -69,15 +148,88 @@ int uv_stream_fd(const uv_tcp_t *handle);
 uint16_t get_socket_port(const uv_tcp_t *tcp);
 size_t _update_tcp_mss(struct socket_ctx *socket);
 
+/*
+ * The TCP MSS of a loop's accepted connections, measured on one of them
+ * per listener every TCP_MSS_CACHE_REFRESH_MS and used for the others, so
+ * a new tunnel costs no getsockopt(). The peers behind one listener share
+ * its MTU in practice, and a guess a little off only moves where frames
+ * break. Not thread safe: one per uv_loop_t.
+ */
+#define TCP_MSS_CACHE_SLOTS       8
+#define TCP_MSS_CACHE_REFRESH_MS  1000
+
+struct tcp_mss_cache {
+    struct {
+        const uv_tcp_t *listener;
+        size_t mss;
+        uint64_t measured_at;
+    } slots[TCP_MSS_CACHE_SLOTS];
+};
+
+size_t tcp_mss_cached(struct tcp_mss_cache *cache, struct socket_ctx *socket);
+
 typedef bool(*tunnel_init_done_cb)(struct tunnel_ctx *tunnel, void *p);
-void tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout, tunnel_init_done_cb init_done_cb, void *p);
+void tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout, struct buffer_pool *pool, struct timer_wheel *wheel, size_t data_size, tunnel_init_done_cb init_done_cb, void *p);
+/* As tunnel_initialize(), with |sock|, connected already, for the incoming
+ * side. |lx| still lends its loop and its address. The uv_tcp_open() error
+ * if |sock| can't be taken, the tunnel is shut down then and |sock| left to
+ * the caller. */
+int tunnel_adopt(uv_tcp_t *lx, uv_os_sock_t sock, unsigned int idle_timeout, struct buffer_pool *pool, struct timer_wheel *wheel, size_t data_size, tunnel_init_done_cb init_done_cb, void *p);
 void tunnel_shutdown(struct tunnel_ctx *tunnel);
+/* Calls tunnel_idle_trim now instead of once TUNNEL_IDLE_TRIM_MS pass,
+ * for a tunnel it's still due for since its last traffic. True if called. */
+bool tunnel_trim_now(struct tunnel_ctx *tunnel);
+/* The tunnel times out |timeout| ms from now however much it reads, or
+ * at a read of |incoming| that leaves it under |min_rate| bytes a second
+ * on average, until tunnel_deadline_stop(). Either goes through
+ * tunnel_timeout_expire_done() with |incoming|, a result of UV_ETIMEDOUT.
+ * For the handshake, against a peer that trickles a byte now and then to
+ * keep restarting the stage timer. 0 for either leaves it out. */
+void tunnel_deadline_start(struct tunnel_ctx *tunnel, unsigned int timeout, size_t min_rate);
+void tunnel_deadline_stop(struct tunnel_ctx *tunnel);
+/* For work that completes after the callback, on this loop or handed back
+ * to it: tunnel_from_handle() is NULL once the tunnel is shut down, so it
+ * needs no reference. 0 without |handles| or once the tunnel is shut down. */
+handle_t tunnel_handle(struct tunnel_ctx *tunnel);
+struct tunnel_ctx * tunnel_from_handle(struct handle_table *handles, handle_t handle);
+void tunnel_mark_phase(struct tunnel_ctx *tunnel, enum tunnel_stats_phase phase);
+/* Closes the span of the stage the tunnel was in if it's not |stage|, and
+ * opens one of |stage|. Only for a tunnel with a trace. */
+void tunnel_trace_stage(struct tunnel_ctx *tunnel, const char *stage);
+void tunnel_stats_dump(const struct tunnel_stats *stats);
+void tunnel_list_add(struct tunnel_ctx **head, struct tunnel_ctx *tunnel);
+void tunnel_list_remove(struct tunnel_ctx **head, struct tunnel_ctx *tunnel);
+void tunnel_list_traverse(struct tunnel_ctx *head, void(*fn)(struct tunnel_ctx *tunnel, void *p), void *p);
+size_t tunnel_list_count(const struct tunnel_ctx *head);
 void tunnel_traditional_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+void tunnel_pipelined_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+void tunnel_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+/* A read tunnel_extract_offload took, made into |buf| for the other socket,
+ * NULL if that failed. Called once per read taken and in their order, also
+ * after the tunnel is shut down, which holds on until then. */
+void tunnel_offload_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket, struct buffer_t *buf);
+/* Relays both ways in the kernel with splice(2), for a pipeline that leaves
+ * the bytes as they are. Linux only, false when it can't, then the caller
+ * streams as usual. Neither tunnel_read_done nor tunnel_write_done is
+ * called any more, tunnel_spliced counts the traffic. */
+bool tunnel_splice_streaming(struct tunnel_ctx *tunnel);
+/* The same through |sockmap|, user space no longer touches the bytes. The
+ * traffic is counted from the TCP counters, once a second. True also when
+ * the tunnel had to be shut down on the way. */
+bool tunnel_sockmap_streaming(struct tunnel_ctx *tunnel, struct sockmap_relay *sockmap);
+/* Sets c->addr to the first of |addrs|. The outgoing socket keeps the rest,
+ * with more than one socket_connect() races them per RFC 8305. */
+void socket_set_candidates(struct socket_ctx *c, const union sockaddr_universal *addrs, size_t count);
 int socket_connect(struct socket_ctx *c);
 void socket_read(struct socket_ctx *c, bool check_timeout);
 void socket_read_stop(struct socket_ctx *c);
+/* The owner's next streaming read size of |c| after the read just done,
+ * between |min_size| and |max_size|, see socket_adapt_read_size() in tunnel.c. */
+void socket_adapt_read_size(size_t *read_size, const struct socket_ctx *c, size_t min_size, size_t max_size);
 void socket_getaddrinfo(struct socket_ctx *c, const char *hostname);
 void socket_write(struct socket_ctx *c, const void *data, size_t len);
+void socket_write_buffer(struct socket_ctx *c, struct buffer_t *buffer);
+void socket_write_segments(struct socket_ctx *c, struct buffer_segments *segs);
 void socket_dump_error_info(const char *title, struct socket_ctx *socket);
 
 #endif // !defined(__tunnel_h__)
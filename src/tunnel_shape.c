@@ -0,0 +1,212 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tunnel_shape.h"
+#include "common.h"
+#include "dump_info.h"
+
+#define TUNNEL_SHAPE_READ_TEXT_MAX  48  /* One [dir,usec,bytes], */
+#define TUNNEL_SHAPE_HEAD_MAX       128  /* and what comes around them. */
+
+struct tunnel_shape_read {
+    uint64_t usec;
+    uint32_t bytes;
+    uint8_t dir;
+};
+
+struct tunnel_shape_record {
+    uint64_t accept_time;
+    struct tunnel_shape_read *reads;
+    size_t count;
+    size_t capacity;
+    bool truncated;
+};
+
+struct tunnel_shape {
+    uv_loop_t *loop;
+    uv_file file;
+    uv_timer_t flush_timer;
+    bool shut_down;
+    unsigned int sample;
+    unsigned int countdown;  /* Tunnels left before the next sampled one. */
+    char *pending;  /* Lines of the closed tunnels not written yet. */
+    size_t pending_len;
+    size_t pending_capacity;
+};
+
+struct tunnel_shape_write {
+    uv_fs_t req;
+    char *data;
+};
+
+static uint64_t tunnel_shape_origin = 0;  /* uv_hrtime() when the file was opened, of every start_ms. */
+
+uv_file tunnel_shape_open(const char *path) {
+    uv_fs_t req;
+    uv_file file;
+
+    if (path == NULL) {
+        return -1;
+    }
+    file = uv_fs_open(NULL, &req, path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644, NULL);
+    uv_fs_req_cleanup(&req);
+    if (file < 0) {
+        pr_err("shape_file %s: %s", path, uv_strerror(file));
+        return file;
+    }
+    tunnel_shape_origin = uv_hrtime();
+    return file;
+}
+
+void tunnel_shape_close(uv_file file) {
+    uv_fs_t req;
+    if (file < 0) {
+        return;
+    }
+    uv_fs_close(NULL, &req, file, NULL);
+    uv_fs_req_cleanup(&req);
+}
+
+static void tunnel_shape_write_done_cb(uv_fs_t *req) {
+    struct tunnel_shape_write *w = CONTAINER_OF(req, struct tunnel_shape_write, req);
+    uv_fs_req_cleanup(req);
+    free(w->data);
+    free(w);
+}
+
+/* Hands the pending lines to a write, from the thread pool while the loop runs. */
+static void tunnel_shape_flush(struct tunnel_shape *shape, bool in_place) {
+    struct tunnel_shape_write *w;
+    uv_buf_t buf;
+
+    if (shape->pending_len == 0) {
+        return;
+    }
+    w = (struct tunnel_shape_write *) calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return;
+    }
+    w->data = shape->pending;
+    buf = uv_buf_init(w->data, (unsigned int)shape->pending_len);
+    shape->pending = NULL;
+    shape->pending_len = 0;
+    shape->pending_capacity = 0;
+    if (in_place) {
+        uv_fs_write(NULL, &w->req, shape->file, &buf, 1, -1, NULL);
+        tunnel_shape_write_done_cb(&w->req);
+    } else if (uv_fs_write(shape->loop, &w->req, shape->file, &buf, 1, -1, tunnel_shape_write_done_cb) != 0) {
+        free(w->data);
+        free(w);
+    }
+}
+
+static void tunnel_shape_flush_cb(uv_timer_t *handle) {
+    tunnel_shape_flush(CONTAINER_OF(handle, struct tunnel_shape, flush_timer), false);
+}
+
+struct tunnel_shape * tunnel_shape_create(uv_loop_t *loop, uv_file file, unsigned int sample) {
+    struct tunnel_shape *shape;
+    if (file < 0 || sample == 0) {
+        return NULL;
+    }
+    shape = (struct tunnel_shape *) calloc(1, sizeof(*shape));
+    if (shape == NULL) {
+        return NULL;
+    }
+    shape->loop = loop;
+    shape->file = file;
+    shape->sample = sample;
+    shape->countdown = 1;
+    VERIFY(0 == uv_timer_init(loop, &shape->flush_timer));
+    VERIFY(0 == uv_timer_start(&shape->flush_timer, tunnel_shape_flush_cb, TUNNEL_SHAPE_FLUSH_MS, TUNNEL_SHAPE_FLUSH_MS));
+    uv_unref((uv_handle_t *)&shape->flush_timer);
+    return shape;
+}
+
+void tunnel_shape_shutdown(struct tunnel_shape *shape) {
+    if (shape == NULL || shape->shut_down) {
+        return;
+    }
+    shape->shut_down = true;
+    tunnel_shape_flush(shape, false);
+    uv_close((uv_handle_t *)&shape->flush_timer, NULL);
+}
+
+void tunnel_shape_destroy(struct tunnel_shape *shape) {
+    if (shape == NULL) {
+        return;
+    }
+    ASSERT(shape->shut_down);
+    tunnel_shape_flush(shape, true);
+    free(shape->pending);
+    free(shape);
+}
+
+struct tunnel_shape_record * tunnel_shape_begin(struct tunnel_shape *shape, uint64_t accept_time) {
+    struct tunnel_shape_record *record;
+    if (shape == NULL || --shape->countdown != 0) {
+        return NULL;
+    }
+    shape->countdown = shape->sample;
+    record = (struct tunnel_shape_record *) calloc(1, sizeof(*record));
+    if (record) {
+        record->accept_time = accept_time;
+    }
+    return record;
+}
+
+void tunnel_shape_read(struct tunnel_shape_record *record, bool from_target, uint64_t now, size_t bytes) {
+    struct tunnel_shape_read *read;
+    if (record->count == record->capacity) {
+        size_t capacity = record->capacity ? record->capacity * 2 : 16;
+        struct tunnel_shape_read *reads;
+        if (record->capacity == TUNNEL_SHAPE_READS_MAX ||
+            (reads = (struct tunnel_shape_read *) realloc(record->reads, capacity * sizeof(*reads))) == NULL) {
+            record->truncated = true;
+            return;
+        }
+        record->reads = reads;
+        record->capacity = capacity;
+    }
+    read = &record->reads[record->count++];
+    read->dir = from_target ? 1 : 0;
+    read->usec = (now > record->accept_time) ? (now - record->accept_time) / 1000 : 0;
+    read->bytes = (bytes > UINT32_MAX) ? UINT32_MAX : (uint32_t)bytes;
+}
+
+void tunnel_shape_end(struct tunnel_shape *shape, struct tunnel_shape_record *record, const char *stage) {
+    size_t need, index;
+    char *at;
+
+    if (shape == NULL || record == NULL) {
+        return;
+    }
+    need = TUNNEL_SHAPE_HEAD_MAX + record->count * TUNNEL_SHAPE_READ_TEXT_MAX;
+    if (shape->pending_len + need > shape->pending_capacity) {
+        size_t capacity = (shape->pending_capacity ? shape->pending_capacity * 2 : 64 * 1024);
+        char *pending;
+        while (capacity < shape->pending_len + need) {
+            capacity *= 2;
+        }
+        if ((pending = (char *) realloc(shape->pending, capacity)) == NULL) {
+            goto done;
+        }
+        shape->pending = pending;
+        shape->pending_capacity = capacity;
+    }
+    at = shape->pending + shape->pending_len;
+    at += sprintf(at, "{\"start_ms\":%llu,\"stage\":\"%s\",\"truncated\":%s,\"reads\":[",
+        (unsigned long long)((record->accept_time > tunnel_shape_origin) ? (record->accept_time - tunnel_shape_origin) / 1000000 : 0),
+        stage, record->truncated ? "true" : "false");
+    for (index = 0; index < record->count; ++index) {
+        const struct tunnel_shape_read *read = &record->reads[index];
+        at += sprintf(at, "%s[%u,%llu,%u]", index ? "," : "",
+            (unsigned int)read->dir, (unsigned long long)read->usec, (unsigned int)read->bytes);
+    }
+    at += sprintf(at, "]}\n");
+    shape->pending_len = (size_t)(at - shape->pending);
+done:
+    free(record->reads);
+    free(record);
+}
@@ -0,0 +1,48 @@
+#if !defined(__tunnel_shape_h__)
+#define __tunnel_shape_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * The shape of sampled tunnels, for ssr-loadgen -R to play back: every
+ * read as its direction, its time since the tunnel was accepted and its
+ * size, nothing of the payload, the addresses or the user. One in |sample|
+ * tunnels is recorded, its reads kept with it until it closes, then it
+ * becomes a JSON line in a buffer of the loop appended every
+ * TUNNEL_SHAPE_FLUSH_MS to a file the loops share:
+ *
+ *   {"start_ms":N,"stage":"streaming","truncated":false,"reads":[[dir,usec,bytes],...]}
+ *
+ * |dir| is 0 for a read from the client, 1 for one from the target,
+ * |start_ms| the tunnel's acceptance since the file was opened. Not thread
+ * safe: one per uv_loop_t.
+ */
+
+#define TUNNEL_SHAPE_READS_MAX  4096  /* Per tunnel, later reads are left out and the line marked truncated. */
+#define TUNNEL_SHAPE_FLUSH_MS   1000
+
+struct tunnel_shape;
+struct tunnel_shape_record;
+
+/* Truncates |path|, negative if it can't. */
+uv_file tunnel_shape_open(const char *path);
+/* Once the loops' shapes are destroyed. */
+void tunnel_shape_close(uv_file file);
+
+/* NULL without a |file| or a |sample|. */
+struct tunnel_shape * tunnel_shape_create(uv_loop_t *loop, uv_file file, unsigned int sample);
+/* Stops the periodic writes, tunnels are still recorded until tunnel_shape_destroy(). */
+void tunnel_shape_shutdown(struct tunnel_shape *shape);
+/* After the loop has run down, writes what's left in place. */
+void tunnel_shape_destroy(struct tunnel_shape *shape);
+
+/* A record for the next tunnel, accepted at |accept_time| (uv_hrtime()), NULL when it isn't sampled. */
+struct tunnel_shape_record * tunnel_shape_begin(struct tunnel_shape *shape, uint64_t accept_time);
+void tunnel_shape_read(struct tunnel_shape_record *record, bool from_target, uint64_t now, size_t bytes);
+/* Queues |record|'s line, |stage| the one the tunnel closed in, and frees it. */
+void tunnel_shape_end(struct tunnel_shape *shape, struct tunnel_shape_record *record, const char *stage);
+
+#endif // !defined(__tunnel_shape_h__)
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tunnel_stats.h"
+
+#define SUB_COUNT   (1 << TUNNEL_STATS_SUB_BITS)
+
+static size_t bucket_of(uint64_t value) {
+    size_t index;
+    int msb = 0;
+    uint64_t v = value;
+    if (value < SUB_COUNT) {
+        return (size_t)value;
+    }
+    while (v >>= 1) {
+        msb++;
+    }
+    index = (size_t)((msb - TUNNEL_STATS_SUB_BITS + 1) << TUNNEL_STATS_SUB_BITS)
+        + (size_t)((value >> (msb - TUNNEL_STATS_SUB_BITS)) & (SUB_COUNT - 1));
+    if (index >= TUNNEL_STATS_BUCKETS) {
+        index = TUNNEL_STATS_BUCKETS - 1;
+    }
+    return index;
+}
+
+/* The largest value that lands in |index|. */
+static uint64_t bucket_upper_bound(size_t index) {
+    int shift;
+    uint64_t sub;
+    if (index < SUB_COUNT) {
+        return (uint64_t)index;
+    }
+    shift = (int)(index >> TUNNEL_STATS_SUB_BITS) - 1;
+    sub = (uint64_t)(index & (SUB_COUNT - 1));
+    return ((SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+struct tunnel_stats * tunnel_stats_create(void) {
+    return (struct tunnel_stats *) calloc(1, sizeof(struct tunnel_stats));
+}
+
+void tunnel_stats_destroy(struct tunnel_stats *stats) {
+    free(stats);
+}
+
+void tunnel_stats_reset(struct tunnel_stats *stats) {
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+void tunnel_stats_record(struct tunnel_stats *stats, enum tunnel_stats_phase phase, uint64_t usec) {
+    struct tunnel_stats_histogram *hist;
+    if (stats == NULL || (unsigned int)phase >= (unsigned int)tunnel_phase_max) {
+        return;
+    }
+    hist = &stats->latency[phase];
+    hist->count++;
+    hist->sum += usec;
+    if (usec > hist->max) {
+        hist->max = usec;
+    }
+    hist->buckets[bucket_of(usec)]++;
+}
+
+void tunnel_stats_count_dns_cache(struct tunnel_stats *stats, int found) {
+    if (stats == NULL) {
+        return;
+    }
+    if (found > 0) {
+        stats->dns_cache_hits++;
+    } else if (found == 0) {
+        stats->dns_cache_misses++;
+    } else {
+        stats->dns_cache_failures++;
+    }
+}
+
+void tunnel_stats_merge(struct tunnel_stats *into, const struct tunnel_stats *from) {
+    size_t phase, index;
+    if (into == NULL || from == NULL) {
+        return;
+    }
+    into->tunnels_accepted += from->tunnels_accepted;
+    into->tunnels_closed += from->tunnels_closed;
+    into->tunnels_rejected += from->tunnels_rejected;
+    into->tunnels_shed += from->tunnels_shed;
+    into->accepts_deferred += from->accepts_deferred;
+    into->tunnels_blocked += from->tunnels_blocked;
+    into->tunnels_reclaimed += from->tunnels_reclaimed;
+    into->bytes_incoming += from->bytes_incoming;
+    into->bytes_outgoing += from->bytes_outgoing;
+    for (index = 0; index < tunnel_handshake_failure_max; ++index) {
+        into->handshake_failures[index] += from->handshake_failures[index];
+    }
+    into->dns_cache_hits += from->dns_cache_hits;
+    into->dns_cache_misses += from->dns_cache_misses;
+    into->dns_cache_failures += from->dns_cache_failures;
+    into->compression_plain += from->compression_plain;
+    into->compression_wire += from->compression_wire;
+    for (phase = 0; phase < tunnel_phase_max; ++phase) {
+        struct tunnel_stats_histogram *dst = &into->latency[phase];
+        const struct tunnel_stats_histogram *src = &from->latency[phase];
+        dst->count += src->count;
+        dst->sum += src->sum;
+        if (src->max > dst->max) {
+            dst->max = src->max;
+        }
+        for (index = 0; index < TUNNEL_STATS_BUCKETS; ++index) {
+            dst->buckets[index] += src->buckets[index];
+        }
+    }
+#if defined(SSR_STAGE_TIMING)
+    for (index = 0; index < ((volatile const struct tunnel_stats *)from)->stages_count; ++index) {
+        const struct tunnel_stage_times *src = &from->stages[index];
+        struct tunnel_stage_times *dst = tunnel_stats_stage_times(into, src->protocol, src->obfs);
+        size_t stage;
+        for (stage = 0; dst && stage < tunnel_cipher_stage_max; ++stage) {
+            dst->nsec[stage] += src->nsec[stage];
+            dst->calls[stage] += src->calls[stage];
+        }
+    }
+#endif
+}
+
+uint64_t tunnel_stats_percentile(const struct tunnel_stats_histogram *hist, double percentile) {
+    uint64_t rank, seen = 0;
+    size_t index;
+    if (hist == NULL || hist->count == 0) {
+        return 0;
+    }
+    if (percentile >= 100.0) {
+        return hist->max;
+    }
+    if (percentile < 0.0) {
+        percentile = 0.0;
+    }
+    rank = (uint64_t)((double)hist->count * percentile / 100.0);
+    for (index = 0; index < TUNNEL_STATS_BUCKETS; ++index) {
+        seen += hist->buckets[index];
+        if (seen > rank) {
+            uint64_t bound = bucket_upper_bound(index);
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+uint64_t tunnel_stats_count_within(const struct tunnel_stats_histogram *hist, uint64_t usec) {
+    uint64_t count = 0;
+    size_t index;
+    if (hist == NULL) {
+        return 0;
+    }
+    for (index = 0; index < TUNNEL_STATS_BUCKETS && bucket_upper_bound(index) <= usec; ++index) {
+        count += hist->buckets[index];
+    }
+    return count;
+}
+
+const char * tunnel_stats_phase_name(enum tunnel_stats_phase phase) {
+    switch (phase) {
+    case tunnel_phase_first_byte: return "first byte";
+    case tunnel_phase_handshake: return "handshake";
+    case tunnel_phase_resolve: return "resolve";
+    case tunnel_phase_connect: return "connect";
+    case tunnel_phase_first_upstream_byte: return "first upstream byte";
+    case tunnel_phase_lifetime: return "lifetime";
+    default: return "unknown";
+    }
+}
+
+#if defined(SSR_STAGE_TIMING)
+struct tunnel_stage_times * tunnel_stats_stage_times(struct tunnel_stats *stats, const char *protocol, const char *obfs) {
+    struct tunnel_stage_times *times;
+    size_t index;
+    if (stats == NULL) {
+        return NULL;
+    }
+    for (index = 0; index < stats->stages_count; ++index) {
+        times = &stats->stages[index];
+        if (strcmp(times->protocol, protocol) == 0 && strcmp(times->obfs, obfs) == 0) {
+            return times;
+        }
+    }
+    if (stats->stages_count == TUNNEL_STATS_STAGE_COMBOS) {
+        return NULL;
+    }
+    times = &stats->stages[stats->stages_count];
+    strncpy(times->protocol, protocol, sizeof(times->protocol) - 1);
+    strncpy(times->obfs, obfs, sizeof(times->obfs) - 1);
+    __sync_synchronize();
+    stats->stages_count++;
+    return times;
+}
+
+const char * tunnel_stats_stage_name(enum tunnel_cipher_stage stage) {
+    switch (stage) {
+    case tunnel_cipher_stage_obfs: return "obfs";
+    case tunnel_cipher_stage_protocol: return "protocol";
+    case tunnel_cipher_stage_cipher: return "cipher";
+    case tunnel_cipher_stage_compress: return "compress";
+    default: return "unknown";
+    }
+}
+#endif // defined(SSR_STAGE_TIMING)
+
+const char * tunnel_stats_handshake_failure_name(enum tunnel_handshake_failure failure) {
+    switch (failure) {
+    case tunnel_handshake_precheck: return "precheck";
+    case tunnel_handshake_decode: return "decode";
+    case tunnel_handshake_header: return "header";
+    case tunnel_handshake_timeout: return "timeout";
+    default: return "unknown";
+    }
+}
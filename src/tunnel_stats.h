@@ -0,0 +1,107 @@
+#if !defined(__tunnel_stats_h__)
+#define __tunnel_stats_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-loop connection counters and latency histograms. Every phase is
+ * measured from the moment the tunnel was accepted, in microseconds, and
+ * recorded into log-linear buckets (8 sub-buckets per power of two, so a
+ * percentile is accurate to within 12.5%). Not thread safe: one instance
+ * per uv_loop_t, read it from the loop thread.
+ */
+
+enum tunnel_stats_phase {
+    tunnel_phase_first_byte,           /* First byte from the incoming side. */
+    tunnel_phase_handshake,            /* Protocol / SOCKS5 header parsed. */
+    tunnel_phase_resolve,              /* Target address resolved. */
+    tunnel_phase_connect,              /* Outgoing connection established. */
+    tunnel_phase_first_upstream_byte,  /* First byte from the outgoing side. */
+    tunnel_phase_lifetime,             /* Tunnel released. */
+    tunnel_phase_max,
+};
+
+enum tunnel_handshake_failure {
+    tunnel_handshake_precheck,  /* The obfs or protocol turned the first bytes down before decoding them. */
+    tunnel_handshake_decode,  /* Obfs, cipher or protocol refused the first packets. */
+    tunnel_handshake_header,  /* The target address decrypted was malformed or cut short. */
+    tunnel_handshake_timeout,  /* The client took too long, on a stage, the whole handshake or on average. */
+    tunnel_handshake_failure_max,
+};
+
+#define TUNNEL_STATS_SUB_BITS   3
+#define TUNNEL_STATS_BUCKETS    ((40 - TUNNEL_STATS_SUB_BITS + 1) << TUNNEL_STATS_SUB_BITS)
+
+#if defined(SSR_STAGE_TIMING)
+/* The steps of the tunnel_cipher_* calls, timed with SSR_STAGE_TIMING. */
+enum tunnel_cipher_stage {
+    tunnel_cipher_stage_obfs,      /* Obfs encode and decode. */
+    tunnel_cipher_stage_protocol,  /* Protocol pre_encrypt and post_decrypt. */
+    tunnel_cipher_stage_cipher,    /* ss_encrypt() and ss_decrypt(). */
+    tunnel_cipher_stage_compress,  /* Stream compression both ways. */
+    tunnel_cipher_stage_max,
+};
+
+#define TUNNEL_STATS_STAGE_COMBOS   8
+#define TUNNEL_STATS_STAGE_NAME_MAX 32
+
+/* Time spent in each stage by the tunnels of one protocol and obfs. */
+struct tunnel_stage_times {
+    char protocol[TUNNEL_STATS_STAGE_NAME_MAX];
+    char obfs[TUNNEL_STATS_STAGE_NAME_MAX];
+    uint64_t nsec[tunnel_cipher_stage_max];
+    uint64_t calls[tunnel_cipher_stage_max];
+};
+#endif // defined(SSR_STAGE_TIMING)
+
+struct tunnel_stats_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[TUNNEL_STATS_BUCKETS];
+};
+
+struct tunnel_stats {
+    uint64_t tunnels_accepted;
+    uint64_t tunnels_closed;
+    uint64_t tunnels_rejected;  /* Turned away by admission control, */
+    uint64_t tunnels_shed;  /* shut down in the handshake under overload, */
+    uint64_t accepts_deferred;  /* or left in the accept queue for a turn. */
+    uint64_t tunnels_blocked;  /* Closed on accept, the source address failed too many handshakes. */
+    uint64_t tunnels_reclaimed;  /* Idle ones closed early under memory pressure. */
+    uint64_t bytes_incoming;  /* Read from the incoming side. */
+    uint64_t bytes_outgoing;  /* Read from the outgoing side. */
+    uint64_t handshake_failures[tunnel_handshake_failure_max];  /* ssr-server only. */
+    uint64_t dns_cache_hits;  /* ssr-server host names found cached, */
+    uint64_t dns_cache_misses;  /* not cached, */
+    uint64_t dns_cache_failures;  /* or cached as not resolving. */
+    uint64_t compression_plain;  /* Tunnel data through the compression stage, both ways, */
+    uint64_t compression_wire;  /* and what it was on the wire. Added as tunnels close. */
+    struct tunnel_stats_histogram latency[tunnel_phase_max];
+#if defined(SSR_STAGE_TIMING)
+    struct tunnel_stage_times stages[TUNNEL_STATS_STAGE_COMBOS];
+    size_t stages_count;  /* Bumped once a slot's names are written, for a reader on another loop. */
+#endif
+};
+
+struct tunnel_stats * tunnel_stats_create(void);
+void tunnel_stats_destroy(struct tunnel_stats *stats);
+void tunnel_stats_reset(struct tunnel_stats *stats);
+void tunnel_stats_record(struct tunnel_stats *stats, enum tunnel_stats_phase phase, uint64_t usec);
+/* A dns_cache_lookup() answer, |found| addresses or -1. */
+void tunnel_stats_count_dns_cache(struct tunnel_stats *stats, int found);
+/* Adds the counters and histograms of |from| to |into|, to sum up the loops. */
+void tunnel_stats_merge(struct tunnel_stats *into, const struct tunnel_stats *from);
+uint64_t tunnel_stats_percentile(const struct tunnel_stats_histogram *hist, double percentile);
+/* Samples in buckets whose values are all at most |usec|, the le of a Prometheus bucket. */
+uint64_t tunnel_stats_count_within(const struct tunnel_stats_histogram *hist, uint64_t usec);
+const char * tunnel_stats_phase_name(enum tunnel_stats_phase phase);
+const char * tunnel_stats_handshake_failure_name(enum tunnel_handshake_failure failure);
+#if defined(SSR_STAGE_TIMING)
+/* The counters of |protocol| and |obfs|, added when new. NULL once all TUNNEL_STATS_STAGE_COMBOS are taken. */
+struct tunnel_stage_times * tunnel_stats_stage_times(struct tunnel_stats *stats, const char *protocol, const char *obfs);
+const char * tunnel_stats_stage_name(enum tunnel_cipher_stage stage);
+#endif
+
+#endif // !defined(__tunnel_stats_h__)
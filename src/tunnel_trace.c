@@ -0,0 +1,205 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tunnel_trace.h"
+#include "common.h"
+#include "dump_info.h"
+
+#define TUNNEL_TRACE_LINE_MAX  256  /* A span's JSON object, its name included. */
+
+struct tunnel_trace_event {
+    const char *name;
+    uint32_t id;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t bytes;
+};
+
+struct tunnel_trace {
+    uv_loop_t *loop;
+    uv_file file;
+    uv_timer_t flush_timer;
+    bool shut_down;
+    unsigned int sample;
+    unsigned int pid;
+    unsigned int countdown;  /* Tunnels left before the next sampled one. */
+    bool named;  /* The process_name record is written. */
+    uint64_t head;  /* Spans taken. */
+    uint64_t written;  /* Spans written or overwritten. */
+    uint64_t dropped;  /* Overwritten since the last write. */
+    struct tunnel_trace_event events[TUNNEL_TRACE_EVENTS];
+};
+
+struct tunnel_trace_write {
+    uv_fs_t req;
+    char *data;
+};
+
+static uint32_t tunnel_trace_last_id = 0;  /* Shared by the loops, ids are unique in the file. */
+
+uv_file tunnel_trace_open(const char *path) {
+    static const char start[] = "[\n";
+    uv_fs_t req;
+    uv_buf_t buf;
+    uv_file file;
+
+    if (path == NULL) {
+        return -1;
+    }
+    file = uv_fs_open(NULL, &req, path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644, NULL);
+    uv_fs_req_cleanup(&req);
+    if (file < 0) {
+        pr_err("trace_file %s: %s", path, uv_strerror(file));
+        return file;
+    }
+    buf = uv_buf_init((char *)start, sizeof(start) - 1);
+    uv_fs_write(NULL, &req, file, &buf, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    return file;
+}
+
+void tunnel_trace_close(uv_file file) {
+    uv_fs_t req;
+    if (file < 0) {
+        return;
+    }
+    uv_fs_close(NULL, &req, file, NULL);
+    uv_fs_req_cleanup(&req);
+}
+
+static void tunnel_trace_write_done_cb(uv_fs_t *req) {
+    struct tunnel_trace_write *w = CONTAINER_OF(req, struct tunnel_trace_write, req);
+    uv_fs_req_cleanup(req);
+    free(w->data);
+    free(w);
+}
+
+/* Microseconds with three decimals, the unit of "ts" and "dur". */
+static int tunnel_trace_usec(char *out, size_t size, uint64_t nsec) {
+    return snprintf(out, size, "%llu.%03u", (unsigned long long)(nsec / 1000), (unsigned int)(nsec % 1000));
+}
+
+static size_t tunnel_trace_format(const struct tunnel_trace *trace, const struct tunnel_trace_event *e, char *out) {
+    char ts[32], dur[32];
+    int n;
+    tunnel_trace_usec(ts, sizeof(ts), e->begin);
+    tunnel_trace_usec(dur, sizeof(dur), (e->end > e->begin) ? (e->end - e->begin) : 0);
+    n = snprintf(out, TUNNEL_TRACE_LINE_MAX,
+        "{\"name\":\"%s\",\"cat\":\"tunnel\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%s,\"dur\":%s,\"args\":{\"bytes\":%llu}},\n",
+        e->name, trace->pid, (unsigned int)e->id, ts, dur, (unsigned long long)e->bytes);
+    return (n > 0 && n < TUNNEL_TRACE_LINE_MAX) ? (size_t)n : 0;
+}
+
+/* Appends the spans not written yet, from the thread pool while the loop runs. */
+static void tunnel_trace_flush(struct tunnel_trace *trace, bool in_place) {
+    struct tunnel_trace_write *w;
+    size_t len = 0;
+    uv_buf_t buf;
+
+    if (trace->head == trace->written && trace->dropped == 0 && trace->named) {
+        return;
+    }
+    w = (struct tunnel_trace_write *) calloc(1, sizeof(*w));
+    w->data = (char *) malloc((size_t)(trace->head - trace->written + 2) * TUNNEL_TRACE_LINE_MAX);
+    if (w->data == NULL) {
+        free(w);
+        return;
+    }
+    if (trace->named == false) {
+        len += (size_t)snprintf(w->data + len, TUNNEL_TRACE_LINE_MAX,
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"loop %u\"}},\n", trace->pid, trace->pid);
+        trace->named = true;
+    }
+    if (trace->dropped) {
+        char ts[32];
+        tunnel_trace_usec(ts, sizeof(ts), uv_hrtime());
+        len += (size_t)snprintf(w->data + len, TUNNEL_TRACE_LINE_MAX,
+            "{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"p\",\"pid\":%u,\"tid\":0,\"ts\":%s,\"args\":{\"spans\":%llu}},\n",
+            trace->pid, ts, (unsigned long long)trace->dropped);
+        trace->dropped = 0;
+    }
+    for (; trace->written != trace->head; ++trace->written) {
+        const struct tunnel_trace_event *e = &trace->events[trace->written & (TUNNEL_TRACE_EVENTS - 1)];
+        len += tunnel_trace_format(trace, e, w->data + len);
+    }
+
+    buf = uv_buf_init(w->data, (unsigned int)len);
+    if (in_place) {
+        uv_fs_write(NULL, &w->req, trace->file, &buf, 1, -1, NULL);
+        tunnel_trace_write_done_cb(&w->req);
+    } else if (uv_fs_write(trace->loop, &w->req, trace->file, &buf, 1, -1, tunnel_trace_write_done_cb) != 0) {
+        free(w->data);
+        free(w);
+    }
+}
+
+static void tunnel_trace_flush_cb(uv_timer_t *handle) {
+    tunnel_trace_flush(CONTAINER_OF(handle, struct tunnel_trace, flush_timer), false);
+}
+
+struct tunnel_trace * tunnel_trace_create(uv_loop_t *loop, uv_file file, unsigned int sample, unsigned int pid) {
+    struct tunnel_trace *trace;
+    if (file < 0 || sample == 0) {
+        return NULL;
+    }
+    trace = (struct tunnel_trace *) calloc(1, sizeof(*trace));
+    if (trace == NULL) {
+        return NULL;
+    }
+    trace->loop = loop;
+    trace->file = file;
+    trace->sample = sample;
+    trace->pid = pid;
+    trace->countdown = 1;  // The first tunnel is traced, a quiet server shows something.
+    VERIFY(0 == uv_timer_init(loop, &trace->flush_timer));
+    VERIFY(0 == uv_timer_start(&trace->flush_timer, tunnel_trace_flush_cb, TUNNEL_TRACE_FLUSH_MS, TUNNEL_TRACE_FLUSH_MS));
+    uv_unref((uv_handle_t *)&trace->flush_timer);
+    return trace;
+}
+
+void tunnel_trace_shutdown(struct tunnel_trace *trace) {
+    if (trace == NULL || trace->shut_down) {
+        return;
+    }
+    trace->shut_down = true;
+    tunnel_trace_flush(trace, false);
+    uv_close((uv_handle_t *)&trace->flush_timer, NULL);
+}
+
+void tunnel_trace_destroy(struct tunnel_trace *trace) {
+    if (trace == NULL) {
+        return;
+    }
+    ASSERT(trace->shut_down);
+    tunnel_trace_flush(trace, true);
+    free(trace);
+}
+
+uint32_t tunnel_trace_sample(struct tunnel_trace *trace) {
+    uint32_t id;
+    if (trace == NULL || --trace->countdown != 0) {
+        return 0;
+    }
+    trace->countdown = trace->sample;
+    do {
+        id = __sync_add_and_fetch(&tunnel_trace_last_id, 1);
+    } while (id == 0);
+    return id;
+}
+
+void tunnel_trace_span(struct tunnel_trace *trace, uint32_t id, const char *name, uint64_t begin, uint64_t end, uint64_t bytes) {
+    struct tunnel_trace_event *e;
+    if (trace->head - trace->written == TUNNEL_TRACE_EVENTS) {
+        trace->written++;
+        trace->dropped++;
+    }
+    e = &trace->events[trace->head & (TUNNEL_TRACE_EVENTS - 1)];
+    e->name = name;
+    e->id = id;
+    e->begin = begin;
+    e->end = end;
+    e->bytes = bytes;
+    trace->head++;
+}
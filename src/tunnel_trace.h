@@ -0,0 +1,40 @@
+#if !defined(__tunnel_trace_h__)
+#define __tunnel_trace_h__ 1
+
+#include <stdint.h>
+#include <uv.h>
+
+/*
+ * Sampled tracing of tunnels. One in |sample| tunnels gets a trace id, the
+ * others keep a NULL trace and pay a pointer test where a span would be.
+ * A sampled tunnel's stages, cipher calls, resolve and connect become spans
+ * in a ring of the loop, appended every TUNNEL_TRACE_FLUSH_MS to a file the
+ * loops share. It's the Chrome trace event format, a JSON array whose
+ * closing bracket is left out as that format allows, so the file can be
+ * opened while it grows and after a crash: chrome://tracing and Perfetto
+ * show a loop per process and a tunnel per thread. Not thread safe: one
+ * per uv_loop_t.
+ */
+
+#define TUNNEL_TRACE_EVENTS    4096  /* Spans held between writes, a power of two. Unwritten ones are overwritten. */
+#define TUNNEL_TRACE_FLUSH_MS  1000
+
+struct tunnel_trace;
+
+/* Truncates |path| and starts the array, negative if it can't. */
+uv_file tunnel_trace_open(const char *path);
+/* Once the loops' traces are destroyed. */
+void tunnel_trace_close(uv_file file);
+
+/* NULL without a |file| or a |sample|. |pid| tells the loops apart. */
+struct tunnel_trace * tunnel_trace_create(uv_loop_t *loop, uv_file file, unsigned int sample, unsigned int pid);
+/* Stops the periodic writes, spans are still taken until tunnel_trace_destroy(). */
+void tunnel_trace_shutdown(struct tunnel_trace *trace);
+/* After the loop has run down, writes what's left in place. */
+void tunnel_trace_destroy(struct tunnel_trace *trace);
+/* A trace id for the next tunnel, 0 when it isn't sampled. */
+uint32_t tunnel_trace_sample(struct tunnel_trace *trace);
+/* A span of tunnel |id|. |name| outlives the trace, times are uv_hrtime(). */
+void tunnel_trace_span(struct tunnel_trace *trace, uint32_t id, const char *name, uint64_t begin, uint64_t end, uint64_t bytes);
+
+#endif // !defined(__tunnel_trace_h__)
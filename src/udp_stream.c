@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ssrbuffer.h"
+#include "udp_stream.h"
+
+bool udp_stream_frame_append(struct buffer_t *out, uint32_t assoc_id, const uint8_t *data, size_t len) {
+    uint8_t head[UDP_STREAM_FRAME_HEAD];
+    size_t frame_len = len + 4;
+
+    if (len == 0 || len > UDP_STREAM_MAX_DATAGRAM) {
+        return false;
+    }
+    head[0] = (uint8_t)(frame_len >> 8);
+    head[1] = (uint8_t)(frame_len);
+    head[2] = (uint8_t)(assoc_id >> 24);
+    head[3] = (uint8_t)(assoc_id >> 16);
+    head[4] = (uint8_t)(assoc_id >> 8);
+    head[5] = (uint8_t)(assoc_id);
+    buffer_realloc(out, out->len + sizeof(head) + len);
+    buffer_concatenate(out, head, sizeof(head));
+    buffer_concatenate(out, data, len);
+    return true;
+}
+
+void udp_stream_decoder_init(struct udp_stream_decoder *decoder) {
+    decoder->pending = buffer_create(0);
+}
+
+void udp_stream_decoder_release(struct udp_stream_decoder *decoder) {
+    buffer_release(decoder->pending);
+    decoder->pending = NULL;
+}
+
+// Walks the whole frames in |data|, |used| gets the bytes they span.
+static bool decode_frames(const uint8_t *data, size_t len,
+    void(*frame_cb)(void *p, uint32_t assoc_id, const uint8_t *data, size_t len), void *p, size_t *used)
+{
+    size_t offset = 0;
+    while (len - offset >= UDP_STREAM_FRAME_HEAD) {
+        const uint8_t *frame = data + offset;
+        size_t frame_len = ((size_t)frame[0] << 8) | frame[1];
+        uint32_t assoc_id;
+        if (frame_len <= 4) {
+            return false;
+        }
+        if (len - offset < 2 + frame_len) {
+            break;
+        }
+        assoc_id = ((uint32_t)frame[2] << 24) | ((uint32_t)frame[3] << 16)
+            | ((uint32_t)frame[4] << 8) | frame[5];
+        frame_cb(p, assoc_id, frame + UDP_STREAM_FRAME_HEAD, frame_len - 4);
+        offset += 2 + frame_len;
+    }
+    *used = offset;
+    return true;
+}
+
+bool udp_stream_decoder_feed(struct udp_stream_decoder *decoder, const uint8_t *data, size_t len,
+    void(*frame_cb)(void *p, uint32_t assoc_id, const uint8_t *data, size_t len), void *p)
+{
+    struct buffer_t *pending = decoder->pending;
+    size_t used = 0;
+
+    if (pending->len == 0) {
+        // Common case, frames straight from the read buffer.
+        if (decode_frames(data, len, frame_cb, p, &used) == false) {
+            return false;
+        }
+        buffer_store(pending, data + used, len - used);
+        return true;
+    }
+    buffer_concatenate(pending, data, len);
+    if (decode_frames(pending->buffer, pending->len, frame_cb, p, &used) == false) {
+        return false;
+    }
+    buffer_shorten(pending, used, pending->len - used);
+    return true;
+}
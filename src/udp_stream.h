@@ -0,0 +1,42 @@
+#if !defined(__udp_stream_h__)
+#define __udp_stream_h__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Datagram framing for UDP carried over a TCP or TLS stream. The stream
+ * opens with UDP_STREAM_MAGIC, then every datagram travels as
+ *
+ * +--------+----------+-------------------------+
+ * | LENGTH | ASSOC ID |  SSR UDP packet         |
+ * +--------+----------+-------------------------+
+ * |   2    |    4     | LENGTH - 4              |
+ * +--------+----------+-------------------------+
+ *
+ * in network byte order. The packet is encrypted exactly as it would be on
+ * UDP, the association id multiplexes the client's flows on one stream.
+ */
+
+#define UDP_STREAM_MAGIC        "SSRU"
+#define UDP_STREAM_MAGIC_LEN    4
+#define UDP_STREAM_FRAME_HEAD   6
+#define UDP_STREAM_MAX_DATAGRAM (0xFFFF - 4)
+
+struct buffer_t;
+
+struct udp_stream_decoder {
+    struct buffer_t *pending;   /* Tail of a frame split across reads. */
+};
+
+/* Appends one frame to |out|, false when |len| does not fit a frame. */
+bool udp_stream_frame_append(struct buffer_t *out, uint32_t assoc_id, const uint8_t *data, size_t len);
+
+void udp_stream_decoder_init(struct udp_stream_decoder *decoder);
+void udp_stream_decoder_release(struct udp_stream_decoder *decoder);
+/* Calls |frame_cb| for every complete frame, false on a malformed stream. */
+bool udp_stream_decoder_feed(struct udp_stream_decoder *decoder, const uint8_t *data, size_t len,
+    void(*frame_cb)(void *p, uint32_t assoc_id, const uint8_t *data, size_t len), void *p);
+
+#endif // !defined(__udp_stream_h__)
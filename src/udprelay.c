@@ -20,6 +20,10 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1  /* recvmmsg() */
+#endif
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -44,6 +48,14 @@
 #include "config.h"
 #endif
 
+#if defined(MODULE_REMOTE) && defined(__linux__)
+#include <linux/filter.h>
+#endif
+
+#if defined(__linux__)
+#include <netinet/udp.h>
+#endif
+
 #if defined(HAVE_SYS_IOCTL_H) && defined(HAVE_NET_IF_H) && defined(__linux__)
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -64,6 +76,7 @@
 #include "encrypt.h"
 #include "sockaddr_universal.h"
 #include "ssrbuffer.h"
+#include "ssr_alloc.h"
 #include "jconf.h"
 
 #include "obfs/obfs.h"
@@ -75,6 +88,8 @@
 #include "common.h"
 #include "sockaddr_universal.h"
 #include "ssr_executive.h"
+#include "timer_wheel.h"
+#include "ptr_map.h"
 
 #ifdef MODULE_REMOTE
 #define MAX_UDP_CONN_NUM 512
@@ -98,6 +113,38 @@
 
 #define DEFAULT_PACKET_SIZE MAX_UDP_PACKET_SIZE // 1492 - 1 - 28 - 2 - 64 = 1397, the default MTU for UDP relay
 
+// Room for the address header, IV or salt and protocol overhead around a datagram.
+#define UDP_PACKET_SLACK SSR_BUFF_SIZE
+
+// libuv reads one datagram per 64 KiB slot, with UV_UDP_RECVMMSG a slab of
+// several slots lets one recvmmsg() fill a whole batch.
+#define UDP_RECV_SLOT_SIZE (64 * 1024)
+#define UDP_RECV_BATCH 16
+
+// Packet buffers up to an MTU sized datagram are recycled per listener,
+// larger ones are created on demand and freed after use.
+#define UDP_SMALL_PACKET_CAPACITY (1500 + UDP_PACKET_SLACK)
+#define UDP_SMALL_PACKET_CACHED 64
+
+#if defined(__linux__)
+// Linux 4.18 and later segment a send in the kernel, or the device, and
+// 5.0 and later hand over coalesced reads.
+#define UDP_GSO 1
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+// Segments must each fit the path MTU and the kernel takes at most 64 of them.
+#define UDP_GSO_SEGMENT_MAX (1500 - 40 - 8)
+#define UDP_GSO_SEGMENTS_MAX 64
+#endif
+
+// Kept in front of every packet, so the SOCKS5 and SSR address headers go on
+// and come off in place: RSV, FRAG and the longest ATYP, domain and port.
+#define UDP_PACKET_HEADROOM (3 + 1 + 1 + 255 + 2)
+
 size_t
 get_sockaddr_len(struct sockaddr *addr)
 {
@@ -109,18 +156,38 @@ get_sockaddr_len(struct sockaddr *addr)
     return 0;
 }
 
+struct udp_tproxy;
+struct udp_gso_train;
+
 struct udp_listener_ctx_t {
     uv_udp_t io;
     int timeout;
-    struct cstl_set *connections;
+    struct ptr_map *connections;    /* Every live association, to close them on shutdown. */
+    struct timer_wheel *timer_wheel;    /* Idle expiry of the associations. */
+    char *recv_slab;    /* Read buffer shared by the listener and its associations. */
+    struct buffer_t *spare_packets[UDP_SMALL_PACKET_CACHED];
+    size_t spare_count;
+    // Associations keyed by source address and destination header locally,
+    // by source address alone on the server (full cone).
+    struct cache *conn_cache;
 #ifdef MODULE_LOCAL
     union sockaddr_universal remote_addr;
     struct ss_host_port tunnel_addr;
+    char tunnel_header[UDP_PACKET_HEADROOM];    /* |tunnel_addr| as an SSR address header, built once. */
+    size_t tunnel_header_len;
+    // Set when the datagrams ride a stream to the server instead of UDP.
+    void(*stream_send)(void *p, uint32_t assoc_id, const uint8_t *data, size_t len);
+    void *stream_p;
+    struct cache *stream_assocs;    /* Associations by id, the stream tags replies with it. */
+    uint32_t next_assoc_id;
+    struct udp_tproxy *tproxy;    /* See udprelay_enable_transparent(), NULL without. */
+#endif
+#ifdef MODULE_REMOTE
+    struct resolv_ctx *resolver;  /* The loop's, see server_env_t. */
 #endif
-//#ifdef MODULE_REMOTE
-//    struct uv_loop_s *loop;
-//#endif
     struct cipher_env_t *cipher_env;
+    struct udprelay_stats stats;    /* Read from other threads as they go, see udprelay_stats_add(). */
+    struct udp_gso_train *gso;    /* NULL where the kernel can't segment. */
     // SSR
     struct obfs_t *protocol_plugin;
     void *protocol_global;
@@ -134,31 +201,38 @@ struct query_ctx {
     int addr_header_len;
     char addr_header[384];
     struct udp_listener_ctx_t *server_ctx;
-    struct udp_remote_ctx_t *remote_ctx;
 };
 #endif
 
 struct udp_remote_ctx_t {
     uv_udp_t io;
-    uv_timer_t watcher;
+    struct timer_wheel_entry watcher;
     int addr_header_len;
     char addr_header[384];
     struct sockaddr_storage src_addr;
+#ifdef MODULE_LOCAL
+    uint32_t assoc_id;  /* Stream mode only, never 0. */
+    bool transparent;  /* Came by TPROXY, replies go out from the destination it named. */
+#endif
 #ifdef MODULE_REMOTE
-    struct sockaddr_storage dst_addr;
+    bool ipv6;  /* Dual stack, IPv4 peers show up v4-mapped. */
+    struct sockaddr_storage dst_addr;   /* Last resolved domain, |addr_header| names it. */
 #endif
     struct udp_listener_ctx_t *server_ctx;
     int ref_count;
 };
 
 static void udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const struct sockaddr* addr, unsigned flags);
+static void udp_listener_datagram(struct udp_listener_ctx_t *server_ctx, const struct sockaddr_storage *src_addr, const uint8_t *data, size_t len, const struct sockaddr_storage *tproxy_dst);
 static void udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const struct sockaddr* addr, unsigned flags);
-static void udp_remote_timeout_cb(uv_timer_t* handle);
+static void udp_remote_reply(struct udp_remote_ctx_t *remote_ctx, struct buffer_t *buf, const struct sockaddr *addr);
+static void udp_remote_timeout_cb(struct timer_wheel_entry *entry);
 
 #ifdef MODULE_REMOTE
-static void query_resolve_cb(struct sockaddr *addr, void *data);
+static void query_resolve_cb(int status, const union sockaddr_universal *addrs, size_t count, void *data);
 #endif
 static void udp_remote_shutdown(struct udp_remote_ctx_t *ctx);
+static void udp_remote_expire(struct udp_remote_ctx_t *ctx);
 
 #ifdef ANDROID
 extern int log_tx_rx;
@@ -167,26 +241,264 @@ extern uint64_t rx;
 extern int vpn;
 #endif
 
-//extern int verbose;
-#ifdef MODULE_REMOTE
-extern uint64_t tx;
-extern uint64_t rx;
-#endif
-
 static size_t packet_size                            = DEFAULT_PACKET_SIZE;
-static size_t buf_size                               = DEFAULT_PACKET_SIZE * 2;
 
-static void udp_uv_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-    char *tmp = (char *) calloc(suggested_size, sizeof(char));
-    *buf = uv_buf_init(tmp, (unsigned int)suggested_size);
+/*
+ * Every datagram is copied out of the slab before its callback returns and
+ * all handles share one loop, so a single slab serves them all.
+ */
+static void udp_listener_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, io);
+    (void)suggested_size;
+    *buf = uv_buf_init(server_ctx->recv_slab, UDP_RECV_SLOT_SIZE * UDP_RECV_BATCH);
+}
+
+static void udp_remote_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct udp_remote_ctx_t *remote_ctx = CONTAINER_OF(handle, struct udp_remote_ctx_t, io);
+    (void)suggested_size;
+    *buf = uv_buf_init(remote_ctx->server_ctx->recv_slab, UDP_RECV_SLOT_SIZE);
+}
+
+static struct buffer_t * udp_packet_create(struct udp_listener_ctx_t *server_ctx, size_t size) {
+    struct buffer_t *buf;
+    if (size + UDP_PACKET_SLACK > UDP_SMALL_PACKET_CAPACITY) {
+        return buffer_create_with_headroom(UDP_PACKET_HEADROOM, size + UDP_PACKET_SLACK);
+    }
+    if (server_ctx->spare_count > 0) {
+        buf = server_ctx->spare_packets[--server_ctx->spare_count];
+        buf->len = 0;
+        return buf;
+    }
+    return buffer_create_with_headroom(UDP_PACKET_HEADROOM, UDP_SMALL_PACKET_CAPACITY);
+}
+
+static void udp_packet_release(struct udp_listener_ctx_t *server_ctx, struct buffer_t *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    // A cipher may have grown it, only ones of the original size go back,
+    // with the headers put on or taken off undone.
+    if (buf->headroom + buf->capacity == UDP_PACKET_HEADROOM + UDP_SMALL_PACKET_CAPACITY && buf->ref_count == 1
+        && server_ctx->spare_count < UDP_SMALL_PACKET_CACHED) {
+        buf->buffer = buf->buffer - buf->headroom + UDP_PACKET_HEADROOM;
+        buf->headroom = UDP_PACKET_HEADROOM;
+        buf->capacity = UDP_SMALL_PACKET_CAPACITY;
+        server_ctx->spare_packets[server_ctx->spare_count++] = buf;
+        return;
+    }
+    buffer_release(buf);
+}
+
+struct udp_send_req {
+    uv_udp_send_t req;
+    struct udp_listener_ctx_t *server_ctx;
+    struct buffer_t *buf;
+};
+
+static void udp_send_done_cb(uv_udp_send_t* req, int status) {
+    struct udp_send_req *send_req = CONTAINER_OF(req, struct udp_send_req, req);
+    (void)status;
+    udp_packet_release(send_req->server_ctx, send_req->buf);
+    ssr_free(ssr_alloc_tunnels, send_req);
+}
+
+// Takes |buf|. Sent inline when nothing is queued, else queued to libuv,
+// which flushes queued datagrams with sendmmsg() where it can.
+static void udp_send_datagram(struct udp_listener_ctx_t *server_ctx, uv_udp_t *handle, struct buffer_t *buf, const struct sockaddr *addr) {
+    uv_buf_t tmp = uv_buf_init((char *)buf->buffer, (unsigned int) buf->len);
+    int err = uv_udp_try_send(handle, &tmp, 1, addr);
+    if (err >= 0) {
+        udp_packet_release(server_ctx, buf);
+    } else if (err == UV_EAGAIN) {
+        struct udp_send_req *send_req = (struct udp_send_req *)ssr_calloc(ssr_alloc_tunnels, 1, sizeof(struct udp_send_req));
+        send_req->server_ctx = server_ctx;
+        send_req->buf = buf;
+        uv_udp_send(&send_req->req, handle, &tmp, 1, addr, udp_send_done_cb);
+    } else {
+        LOGE("[udp] sendto: %s", uv_strerror(err));
+        udp_packet_release(server_ctx, buf);
+    }
+}
+
+#ifdef UDP_GSO
+/*
+ * QUIC, video and the like send runs of equal sized datagrams to one peer.
+ * Those a loop iteration relays back to back go out in one sendmsg() with
+ * UDP_SEGMENT, split again by the kernel, or the device, at the segment
+ * size; only the last may be shorter. What's pending goes out when another
+ * peer, handle or a larger datagram comes along, or in the check phase at
+ * the end of the iteration.
+ */
+struct udp_gso_train {
+    uv_check_t flush;
+    struct udp_listener_ctx_t *server_ctx;
+    uv_udp_t *handle;    /* NULL while empty. */
+    struct sockaddr_storage addr;
+    struct buffer_t *first;    /* A lone datagram goes as it is, */
+    struct buffer_t *segments;    /* from the second on they're copied here back to back. */
+    size_t segment;
+    size_t count;
+};
+
+// Whether the kernel knows UDP_SEGMENT, an older one would send the whole
+// train as one datagram.
+static bool udp_gso_supported(uv_udp_t *handle) {
+    uv_os_fd_t fd = (uv_os_fd_t)-1;
+    int off = 0;
+    return uv_fileno((uv_handle_t *)handle, &fd) == 0
+        && setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+}
+
+static void udp_gso_close_done_cb(uv_handle_t *handle);
+
+static int udp_gso_sendmsg(struct udp_gso_train *train) {
+    char control[CMSG_SPACE(sizeof(uint16_t))] = { 0 };
+    struct iovec iov;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    uint16_t segment = (uint16_t)train->segment;
+    uv_os_fd_t fd = (uv_os_fd_t)-1;
+
+    if (uv_fileno((uv_handle_t *)train->handle, &fd) != 0) {
+        return -1;
+    }
+    iov.iov_base = train->segments->buffer;
+    iov.iov_len = train->segments->len;
+    msg.msg_name = &train->addr;
+    msg.msg_namelen = (socklen_t)get_sockaddr_len((struct sockaddr *)&train->addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    return (sendmsg(fd, &msg, MSG_DONTWAIT) < 0) ? -errno : 0;
+}
+
+static void udp_gso_flush(struct udp_gso_train *train) {
+    struct udp_listener_ctx_t *server_ctx = train->server_ctx;
+    const struct sockaddr *addr = (const struct sockaddr *)&train->addr;
+    size_t offset;
+    int err;
+
+    if (train->handle == NULL) {
+        return;
+    }
+    uv_check_stop(&train->flush);
+    if (train->count == 1) {
+        udp_send_datagram(server_ctx, train->handle, train->first, addr);
+        train->first = NULL;
+        train->handle = NULL;
+        return;
+    }
+    // Behind what libuv still queues on the handle, not ahead of it.
+    if (uv_udp_get_send_queue_count(train->handle) == 0) {
+        err = udp_gso_sendmsg(train);
+        if (err == 0) {
+            train->segments->len = 0;
+            train->handle = NULL;
+            return;
+        }
+        if (err == -EIO || err == -ENOPROTOOPT || err == -EOPNOTSUPP) {
+            // No checksum offload or the like, on every datagram from now on.
+            LOGI("[udp] UDP_SEGMENT unavailable: %s", strerror(-err));
+            server_ctx->gso = NULL;
+        }
+    }
+    // One by one then, EAGAIN queues them with libuv.
+    for (offset = 0; offset < train->segments->len; offset += train->segment) {
+        size_t len = min(train->segment, train->segments->len - offset);
+        struct buffer_t *buf = udp_packet_create(server_ctx, len);
+        memcpy(buf->buffer, train->segments->buffer + offset, len);
+        buf->len = len;
+        udp_send_datagram(server_ctx, train->handle, buf, addr);
+    }
+    train->segments->len = 0;
+    train->handle = NULL;
+    if (server_ctx->gso != train) {
+        uv_close((uv_handle_t *)&train->flush, udp_gso_close_done_cb);
+    }
+}
+
+static void udp_gso_flush_cb(uv_check_t *handle) {
+    udp_gso_flush(CONTAINER_OF(handle, struct udp_gso_train, flush));
 }
 
-static void udp_uv_release_buffer(uv_buf_t *buf) {
-    if (buf->base) {
-        free(buf->base);
-        buf->base = NULL;
+static void udp_gso_close_done_cb(uv_handle_t *handle) {
+    struct udp_gso_train *train = CONTAINER_OF(handle, struct udp_gso_train, flush);
+    buffer_release(train->segments);
+    ssr_free(ssr_alloc_tunnels, train);
+}
+
+static struct udp_gso_train * udp_gso_create(struct udp_listener_ctx_t *server_ctx) {
+    struct udp_gso_train *train;
+    if (udp_gso_supported(&server_ctx->io) == false) {
+        return NULL;
+    }
+    train = (struct udp_gso_train *) ssr_calloc(ssr_alloc_tunnels, 1, sizeof(*train));
+    train->server_ctx = server_ctx;
+    train->segments = buffer_create(MAX_UDP_PACKET_SIZE);
+    uv_check_init(server_ctx->io.loop, &train->flush);
+    return train;
+}
+
+static void udp_gso_destroy(struct udp_gso_train *train) {
+    if (train == NULL) {
+        return;
+    }
+    udp_gso_flush(train);
+    if (train->server_ctx->gso == train) {
+        train->server_ctx->gso = NULL;
+        uv_close((uv_handle_t *)&train->flush, udp_gso_close_done_cb);
+    }
+}
+#endif // UDP_GSO
+
+// Takes |buf|.
+static void udp_send_buffer(struct udp_listener_ctx_t *server_ctx, uv_udp_t *handle, struct buffer_t *buf, const struct sockaddr *addr) {
+#ifdef UDP_GSO
+    struct udp_gso_train *train = server_ctx->gso;
+    size_t addr_len = get_sockaddr_len((struct sockaddr *)addr);
+
+    if (train == NULL) {
+        udp_send_datagram(server_ctx, handle, buf, addr);
+        return;
+    }
+    if (train->handle == handle && buf->len <= train->segment && train->count < UDP_GSO_SEGMENTS_MAX
+        && memcmp(&train->addr, addr, addr_len) == 0)
+    {
+        if (train->count == 1) {
+            buffer_store(train->segments, train->first->buffer, train->first->len);
+            udp_packet_release(server_ctx, train->first);
+            train->first = NULL;
+        }
+        buffer_concatenate(train->segments, buf->buffer, buf->len);
+        train->count++;
+        if (buf->len < train->segment || train->segments->len + train->segment > MAX_UDP_PACKET_SIZE) {
+            // A short one ends it.
+            udp_gso_flush(train);
+        }
+        udp_packet_release(server_ctx, buf);
+        return;
+    }
+    udp_gso_flush(train);
+    if (server_ctx->gso == NULL || buf->len > UDP_GSO_SEGMENT_MAX) {
+        udp_send_datagram(server_ctx, handle, buf, addr);
+        return;
     }
-    buf->len = 0;
+    train->handle = handle;
+    memset(&train->addr, 0, sizeof(train->addr));
+    memcpy(&train->addr, addr, addr_len);
+    train->first = buf;
+    train->segment = buf->len;
+    train->count = 1;
+    uv_check_start(&train->flush, udp_gso_flush_cb);
+#else
+    udp_send_datagram(server_ctx, handle, buf, addr);
+#endif
 }
 
 #if defined(MODULE_REMOTE) && defined(SO_BROADCAST)
@@ -209,12 +521,65 @@ set_nosigpipe(int socket_fd)
 
 #endif
 
-#ifdef MODULE_REDIR
+#if defined(MODULE_LOCAL) && defined(__linux__)
+#define UDP_TPROXY 1
+#endif
+
+#ifdef MODULE_LOCAL
+// The SSR address header every datagram of ssr-tunnel goes under, 0 if
+// |tunnel_addr| doesn't make one.
+static size_t
+udp_tunnel_header(const struct ss_host_port *tunnel_addr, char *addr_header)
+{
+    size_t addr_header_len = 0;
+    uint16_t port_num;
+    uint16_t port_net_num;
+    union sockaddr_universal addr = { 0 };
+    size_t host_len = strlen(tunnel_addr->host);
+
+    port_num     = (uint16_t)atoi(tunnel_addr->port);
+    port_net_num = htons(port_num);
+
+    if (convert_universal_address(tunnel_addr->host, port_num, &addr) == 0) {
+        if (addr.addr4.sin_family == AF_INET) {
+            // send as IPv4
+            addr_header[addr_header_len++] = 1;
+            memcpy(addr_header + addr_header_len, &addr.addr4.sin_addr, sizeof(struct in_addr));
+            addr_header_len += sizeof(struct in_addr);
+        } else if (addr.addr4.sin_family == AF_INET6) {
+            // send as IPv6
+            addr_header[addr_header_len++] = 4;
+            memcpy(addr_header + addr_header_len, &addr.addr6.sin6_addr, sizeof(struct in6_addr));
+            addr_header_len += sizeof(struct in6_addr);
+        } else {
+            FATAL("IP parser error");
+        }
+    } else if (host_len > 0 && host_len <= 255) {
+        // send as domain
+        addr_header[addr_header_len++] = 3;
+        addr_header[addr_header_len++] = (char)host_len;
+        memcpy(addr_header + addr_header_len, tunnel_addr->host, host_len);
+        addr_header_len += host_len;
+    } else {
+        return 0;
+    }
+    memcpy(addr_header + addr_header_len, &port_net_num, 2);
+    addr_header_len += 2;
+
+    return addr_header_len;
+}
+#endif
+
+#ifdef UDP_TPROXY
 
 #ifndef IP_TRANSPARENT
 #define IP_TRANSPARENT       19
 #endif
 
+#ifndef IPV6_TRANSPARENT
+#define IPV6_TRANSPARENT     75
+#endif
+
 #ifndef IP_RECVORIGDSTADDR
 #ifdef  IP_ORIGDSTADDR
 #   define IP_RECVORIGDSTADDR   IP_ORIGDSTADDR
@@ -251,9 +616,25 @@ get_dstaddr(struct msghdr *msg, struct sockaddr_storage *dstaddr)
     return 1;
 }
 
-#endif
+// The size of each datagram UDP_GRO coalesced into |msg|, 0 if it's one.
+static size_t
+get_gro_segment(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segment = 0;
+            memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+            return (segment > 0) ? (size_t)segment : 0;
+        }
+    }
+    return 0;
+}
 
-#if defined(MODULE_REDIR) || defined(MODULE_REMOTE)
+#endif // UDP_TPROXY
+
+#if defined(UDP_TPROXY) || defined(MODULE_REMOTE)
 static size_t
 construct_udprealy_header(const struct sockaddr_storage *in_addr, char *addr_header)
 {
@@ -282,6 +663,170 @@ construct_udprealy_header(const struct sockaddr_storage *in_addr, char *addr_hea
 
 #endif
 
+#ifdef UDP_TPROXY
+
+// Replies leave from the address they answer for, one socket per such
+// address kept for the next ones. CLOCK evicts the coldest past this many.
+#define UDP_TPROXY_REPLY_SOCKETS 256
+// recvmmsg() calls per wakeup, so a flood can't hold the loop.
+#define UDP_TPROXY_RECV_ROUNDS 8
+
+struct udp_tproxy {
+    uv_poll_t poll;
+    int fd;  /* A dup() of the listener's, libuv's own stays for the SOCKS5 replies. */
+    uint16_t port;  /* The listener's, in network order. */
+    struct udp_listener_ctx_t *server_ctx;
+    struct cache *reply_sockets;  /* struct udp_tproxy_reply_socket by source address. */
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec iovs[UDP_RECV_BATCH];
+    struct sockaddr_storage src_addrs[UDP_RECV_BATCH];
+    char controls[UDP_RECV_BATCH][CMSG_SPACE(sizeof(struct sockaddr_in6)) + CMSG_SPACE(sizeof(int))];
+};
+
+struct udp_tproxy_reply_socket {
+    int fd;
+};
+
+static void udp_tproxy_reply_socket_free_cb(void *key, void *element) {
+    struct udp_tproxy_reply_socket *reply = (struct udp_tproxy_reply_socket *)element;
+    (void)key;
+    close(reply->fd);
+    ssr_free(ssr_alloc_tunnels, reply);
+}
+
+static int udp_tproxy_reply_socket_open(const struct sockaddr_storage *from) {
+    bool v6 = (from->ss_family == AF_INET6);
+    int on = 1;
+    int fd = socket(from->ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (setsockopt(fd, v6 ? SOL_IPV6 : SOL_IP, v6 ? IPV6_TRANSPARENT : IP_TRANSPARENT, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        bind(fd, (const struct sockaddr *)from, (socklen_t)get_sockaddr_len((struct sockaddr *)from)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends |buf| to |to| as if from |from|, the destination it was first sent to.
+static void udp_tproxy_reply(struct udp_tproxy *tp, const struct sockaddr_storage *from, const struct sockaddr_storage *to, const struct buffer_t *buf) {
+    struct udp_tproxy_reply_socket *reply = NULL;
+    struct sockaddr_storage dst = *to;
+    size_t key_len = get_sockaddr_len((struct sockaddr *)from);
+
+    cache_lookup(tp->reply_sockets, (char *)from, key_len, (void *)&reply);
+    if (reply == NULL) {
+        int fd = udp_tproxy_reply_socket_open(from);
+        if (fd < 0) {
+            LOGE("[udp] tproxy reply socket: %s", strerror(errno));
+            return;
+        }
+        reply = (struct udp_tproxy_reply_socket *) ssr_calloc(ssr_alloc_tunnels, 1, sizeof(*reply));
+        reply->fd = fd;
+        cache_insert(tp->reply_sockets, (char *)from, key_len, (void *)reply);
+    }
+    // A dual stack listener saw the client v4-mapped.
+    if (from->ss_family == AF_INET && to->ss_family == AF_INET6 &&
+        IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)to)->sin6_addr))
+    {
+        const struct sockaddr_in6 *to6 = (const struct sockaddr_in6 *)to;
+        struct sockaddr_in *dst4 = (struct sockaddr_in *)&dst;
+        memset(&dst, 0, sizeof(dst));
+        dst4->sin_family = AF_INET;
+        dst4->sin_port = to6->sin6_port;
+        memcpy(&dst4->sin_addr, &to6->sin6_addr.s6_addr[12], sizeof(struct in_addr));
+    }
+    if (sendto(reply->fd, buf->buffer, buf->len, 0, (struct sockaddr *)&dst, (socklen_t)get_sockaddr_len((struct sockaddr *)&dst)) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        LOGE("[udp] tproxy sendto: %s", strerror(errno));
+    }
+}
+
+static void udp_tproxy_poll_cb(uv_poll_t *handle, int status, int events) {
+    struct udp_tproxy *tp = CONTAINER_OF(handle, struct udp_tproxy, poll);
+    struct udp_listener_ctx_t *server_ctx = tp->server_ctx;
+    int round;
+
+    (void)events;
+    if (status < 0) {
+        LOGE("[udp] tproxy poll: %s", uv_strerror(status));
+        return;
+    }
+    for (round = 0; round < UDP_TPROXY_RECV_ROUNDS; ++round) {
+        int i, count;
+        for (i = 0; i < UDP_RECV_BATCH; ++i) {
+            struct msghdr *msg = &tp->msgs[i].msg_hdr;
+            tp->iovs[i].iov_base = server_ctx->recv_slab + (size_t)i * UDP_RECV_SLOT_SIZE;
+            tp->iovs[i].iov_len = UDP_RECV_SLOT_SIZE;
+            msg->msg_name = &tp->src_addrs[i];
+            msg->msg_namelen = sizeof(tp->src_addrs[i]);
+            msg->msg_iov = &tp->iovs[i];
+            msg->msg_iovlen = 1;
+            msg->msg_control = tp->controls[i];
+            msg->msg_controllen = sizeof(tp->controls[i]);
+            msg->msg_flags = 0;
+        }
+        count = recvmmsg(tp->fd, tp->msgs, UDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (count < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOGE("[udp] tproxy recvmmsg: %s", strerror(errno));
+            }
+            return;
+        }
+        for (i = 0; i < count; ++i) {
+            struct msghdr *msg = &tp->msgs[i].msg_hdr;
+            struct sockaddr_storage dst_addr = { 0 };
+            size_t len = tp->msgs[i].msg_len;
+            size_t segment = get_gro_segment(msg);
+            size_t offset;
+            bool to_listener;
+
+            if (segment == 0) {
+                segment = len;
+            }
+            if ((msg->msg_flags & MSG_TRUNC) || segment > packet_size) {
+                LOGE("[udp] tproxy recvmmsg fragmentation");
+                continue;
+            }
+            if (get_dstaddr(msg, &dst_addr)) {
+                LOGE("[udp] unable to get dest addr");
+                continue;
+            }
+            // Sent to the port itself, a SOCKS5 client's. The rest TPROXY brought.
+            to_listener = (((struct sockaddr_in *)&dst_addr)->sin_port == tp->port);
+            // Datagrams of one flow GRO coalesced, each but the last |segment| long.
+            for (offset = 0; offset < len; offset += segment) {
+                udp_listener_datagram(server_ctx, &tp->src_addrs[i], (const uint8_t *)tp->iovs[i].iov_base + offset,
+                    min(segment, len - offset), to_listener ? NULL : &dst_addr);
+            }
+        }
+        if (count < UDP_RECV_BATCH) {
+            return;
+        }
+    }
+}
+
+static void udp_tproxy_close_done_cb(uv_handle_t *handle) {
+    struct udp_tproxy *tp = CONTAINER_OF(handle, struct udp_tproxy, poll);
+    close(tp->fd);
+    ssr_free(ssr_alloc_tunnels, tp);
+}
+
+static void udp_tproxy_shutdown(struct udp_tproxy *tp) {
+    if (tp == NULL) {
+        return;
+    }
+    cache_delete(tp->reply_sockets, 0);
+    tp->reply_sockets = NULL;
+    uv_close((uv_handle_t *)&tp->poll, udp_tproxy_close_done_cb);
+}
+
+#endif // UDP_TPROXY
+
 static int
 udprelay_parse_header(const char *buf, size_t buf_len,
                       char *host, char *port, struct sockaddr_storage *storage)
@@ -428,8 +973,33 @@ int udp_create_remote_socket(bool ipv6, uv_loop_t *loop, uv_udp_t *udp) {
     return err;
 }
 
+#if defined(MODULE_REMOTE) && defined(SO_REUSEPORT)
+// The socket of one worker of many, sharing |rp| with the others'.
+static int
+udp_bind_reuse_port(uv_udp_t *udp, const struct addrinfo *rp)
+{
+    int on = 1;
+    int r;
+    int fd = socket(rp->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0
+        || bind(fd, rp->ai_addr, rp->ai_addrlen) != 0) {
+        r = -errno;
+        close(fd);
+        return r;
+    }
+    r = uv_udp_open(udp, (uv_os_sock_t)fd);
+    if (r != 0) {
+        close(fd);
+    }
+    return r;
+}
+#endif
+
 int
-udp_create_local_listener(const char *host, uint16_t port, uv_loop_t *loop, uv_udp_t *udp)
+udp_create_local_listener(const char *host, uint16_t port, bool reuse_port, uv_loop_t *loop, uv_udp_t *udp)
 {
     struct addrinfo hints = { 0 };
     struct addrinfo *result = NULL, *rp, *ipv4v6bindall;
@@ -449,7 +1019,12 @@ udp_create_local_listener(const char *host, uint16_t port, uv_loop_t *loop, uv_u
         return -1;
     }
 
+#if UV_VERSION_HEX >= 0x012800
+    // recvmmsg() batches on Linux, other platforms ignore the flag
+    uv_udp_init_ex(loop, udp, AF_UNSPEC | UV_UDP_RECVMMSG);
+#else
     uv_udp_init(loop, udp);
+#endif
 
     rp = result;
 
@@ -473,7 +1048,13 @@ udp_create_local_listener(const char *host, uint16_t port, uv_loop_t *loop, uv_u
     }
 
     for (/*rp = result*/; rp != NULL; rp = rp->ai_next) {
-        int r = uv_udp_bind(udp, rp->ai_addr, UV_UDP_REUSEADDR);
+        int r;
+#if defined(MODULE_REMOTE) && defined(SO_REUSEPORT)
+        if (reuse_port) {
+            r = udp_bind_reuse_port(udp, rp);
+        } else
+#endif
+        r = uv_udp_bind(udp, rp->ai_addr, UV_UDP_REUSEADDR);
         if (r == 0) {
             break;
         }
@@ -484,6 +1065,7 @@ udp_create_local_listener(const char *host, uint16_t port, uv_loop_t *loop, uv_u
         LOGE("[udp] cannot bind");
         return -1;
     }
+    (void)reuse_port;
 
     freeaddrinfo(result);
 
@@ -492,7 +1074,7 @@ udp_create_local_listener(const char *host, uint16_t port, uv_loop_t *loop, uv_u
 
 #ifdef MODULE_REMOTE
 struct query_ctx * new_query_ctx(char *buf, size_t len) {
-    struct query_ctx *ctx = calloc(1, sizeof(struct query_ctx));
+    struct query_ctx *ctx = ssr_calloc(ssr_alloc_tunnels, 1, sizeof(struct query_ctx));
     ctx->buf = buffer_create_from((uint8_t *)buf, len);
     return ctx;
 }
@@ -504,7 +1086,7 @@ static void close_and_free_query(struct query_ctx *ctx) {
             ctx->query = NULL;
         }
         buffer_release(ctx->buf);
-        free(ctx);
+        ssr_free(ssr_alloc_tunnels, ctx);
     }
 }
 
@@ -514,7 +1096,8 @@ static void udp_remote_close_done_cb(uv_handle_t* handle) {
     struct udp_remote_ctx_t *ctx = (struct udp_remote_ctx_t *)handle->data;
     --ctx->ref_count;
     if (ctx->ref_count <= 0) {
-        free(ctx);
+        ssr_census_remove(ssr_census_udp_remotes, sizeof(*ctx));
+        ssr_free(ssr_alloc_tunnels, ctx);
     }
 }
 
@@ -522,161 +1105,220 @@ static void udp_remote_shutdown(struct udp_remote_ctx_t *ctx) {
     if (ctx == NULL) {
         return;
     }
-    cstl_set_container_remove(ctx->server_ctx->connections, ctx);
+    if (ptr_map_remove(ctx->server_ctx->connections, ctx)) {
+        ctx->server_ctx->stats.associations_closed++;
+    }
+#ifdef MODULE_LOCAL
+    if (ctx->assoc_id != 0) {
+        cache_remove(ctx->server_ctx->stream_assocs, (char *)&ctx->assoc_id, sizeof(ctx->assoc_id));
+        ctx->assoc_id = 0;
+    }
+#endif
 
-    ctx->watcher.data = ctx;
-    uv_timer_stop(&ctx->watcher);
-    uv_close((uv_handle_t *)&ctx->watcher, udp_remote_close_done_cb);
-    ++ctx->ref_count;
+    timer_wheel_cancel(&ctx->watcher);
 
+#ifdef UDP_GSO
+    if (ctx->server_ctx->gso && ctx->server_ctx->gso->handle == &ctx->io) {
+        udp_gso_flush(ctx->server_ctx->gso);
+    }
+#endif
     uv_udp_recv_stop(&ctx->io);
     ctx->io.data = ctx;
     uv_close((uv_handle_t *)&ctx->io, udp_remote_close_done_cb);
     ++ctx->ref_count;
 }
 
-static void udp_remote_timeout_cb(uv_timer_t* handle) {
-    struct udp_remote_ctx_t *remote_ctx
-        = CONTAINER_OF(handle, struct udp_remote_ctx_t, watcher);
+#define UDP_CONN_KEY_LEN (sizeof(struct sockaddr_storage) + 512)
 
-    LOGI("[udp] connection timeout");
+static size_t
+udp_conn_key(const struct sockaddr_storage *src_addr, const char *addr_header, size_t addr_header_len, char *key)
+{
+    size_t addr_len = get_sockaddr_len((struct sockaddr *)src_addr);
+    memcpy(key, src_addr, addr_len);
+    if (addr_header_len > 0) {
+        memcpy(key + addr_len, addr_header, addr_header_len);
+    }
+    return addr_len + addr_header_len;
+}
 
-    udp_remote_shutdown(remote_ctx);
+static void udp_conn_cache_free_cb(void *key, void *element) {
+    (void)key;
+    udp_remote_shutdown((struct udp_remote_ctx_t *)element);
 }
 
-#ifdef MODULE_REMOTE
+#ifdef MODULE_LOCAL
+// The conn cache owns the associations, without a callback the cache would free them.
+static void udp_stream_assocs_free_cb(void *key, void *element) {
+    (void)key; (void)element;
+}
+#endif
 
-static void udp_remote_send_done_cb(uv_udp_send_t* req, int status) {
-    struct udp_remote_ctx_t *remote_ctx = (struct udp_remote_ctx_t *)req->data;
-    free(req);
-    if (status < 0) {
-        SS_ERROR("[udp] sendto_remote");
-        udp_remote_shutdown(remote_ctx);
-    } else {
-        /*
-        // Add to conn cache
-        char *key = hash_key(AF_UNSPEC, &remote_ctx->src_addr);
-        cache_insert(remote_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
-        // ev_io_start(EV_A_ & remote_ctx->io);
-        //ev_timer_start(EV_A_ & remote_ctx->watcher);
-        */
-    }
+// Drops the association, the conn cache owns it.
+static void udp_remote_expire(struct udp_remote_ctx_t *ctx) {
+    char key[UDP_CONN_KEY_LEN];
+#ifdef MODULE_LOCAL
+    size_t key_len = udp_conn_key(&ctx->src_addr, ctx->addr_header, (size_t)ctx->addr_header_len, key);
+#else
+    size_t key_len = udp_conn_key(&ctx->src_addr, NULL, 0, key);
+#endif
+    cache_remove(ctx->server_ctx->conn_cache, key, key_len);
 }
 
-static void query_resolve_cb(struct sockaddr *addr, void *data) {
-    struct query_ctx *query_ctx = (struct query_ctx *)data;
-    struct uv_loop_s *loop = query_ctx->server_ctx->io.loop;
-    /*
-    if (verbose) {
-        LOGI("[udp] udns resolved");
-    }
-    */
-    query_ctx->query = NULL;
+static void udp_remote_timeout_cb(struct timer_wheel_entry *entry) {
+    struct udp_remote_ctx_t *remote_ctx
+        = CONTAINER_OF(entry, struct udp_remote_ctx_t, watcher);
 
-    if (addr == NULL) {
-        LOGE("[udp] udns returned an error");
-    } else {
-        struct udp_remote_ctx_t *remote_ctx = query_ctx->remote_ctx;
-        int cache_hit            = 0;
+    LOGI("[udp] connection timeout");
 
-        /*
-        // Lookup in the conn cache
-        if (remote_ctx == NULL) {
-            char *key = hash_key(AF_UNSPEC, &query_ctx->src_addr);
-            cache_lookup(query_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)&remote_ctx);
-        }
-        */
+    udp_remote_expire(remote_ctx);
+}
 
-        if (remote_ctx == NULL) {
-            remote_ctx = calloc(1, sizeof(struct udp_remote_ctx_t));
-            bool ipv6 = (addr->sa_family == AF_INET6);
-            int remotefd = udp_create_remote_socket(ipv6, loop, &remote_ctx->io);
-            if (remotefd != -1) {
-                // setnonblocking(remotefd);
+#ifdef MODULE_REMOTE
+
+/*
+ * Full cone: one outbound socket per client source, whatever the destination.
+ * Every peer sees the same mapped port and any of them may answer through it.
+ */
+static struct udp_remote_ctx_t *
+udp_remote_create(struct udp_listener_ctx_t *server_ctx, const struct sockaddr_storage *src_addr)
+{
+    char key[UDP_CONN_KEY_LEN];
+    size_t key_len = udp_conn_key(src_addr, NULL, 0, key);
+    struct udp_remote_ctx_t *remote_ctx;
+    uv_os_fd_t remotefd;
+    bool ipv6 = true;
+
+    // A dual stack socket reaches both families, fall back to IPv4 only hosts.
+    for (;;) {
+        remote_ctx = (struct udp_remote_ctx_t *) ssr_calloc(ssr_alloc_tunnels, 1, sizeof(struct udp_remote_ctx_t));
+        ssr_census_add(ssr_census_udp_remotes, sizeof(*remote_ctx));
+        remote_ctx->ipv6 = ipv6;
+        if (udp_create_remote_socket(ipv6, server_ctx->io.loop, &remote_ctx->io) == 0) {
+            break;
+        }
+        remote_ctx->io.data = remote_ctx;
+        remote_ctx->ref_count = 1;
+        uv_close((uv_handle_t *)&remote_ctx->io, udp_remote_close_done_cb);
+        if (!ipv6) {
+            LOGE("[udp] udprelay bind() error");
+            return NULL;
+        }
+        ipv6 = false;
+    }
+    if (uv_fileno((uv_handle_t *)&remote_ctx->io, &remotefd) == 0) {
 #ifdef SO_BROADCAST
-                set_broadcast(remotefd);
+        set_broadcast((int)remotefd);
 #endif
 #ifdef SO_NOSIGPIPE
-                set_nosigpipe(remotefd);
+        set_nosigpipe((int)remotefd);
 #endif
 #ifdef IP_TOS
-                // Set QoS flag
-                int tos = 46;
-                setsockopt(remotefd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-#endif
-#ifdef SET_INTERFACE
-                if (query_ctx->server_ctx->iface) {
-                    if (setinterface(remotefd, query_ctx->server_ctx->iface) == -1)
-                        SS_ERROR("setinterface");
-                }
-#endif
-                // remote_ctx                  = new_udp_remote(remotefd, query_ctx->server_ctx);
-                remote_ctx->src_addr        = query_ctx->src_addr;
-                remote_ctx->server_ctx      = query_ctx->server_ctx;
-                remote_ctx->addr_header_len = query_ctx->addr_header_len;
-                memcpy(remote_ctx->addr_header, query_ctx->addr_header,
-                       query_ctx->addr_header_len);
-            } else {
-                SS_ERROR("[udp] bind() error");
-            }
-        } else {
-            cache_hit = 1;
+        {
+            // Set QoS flag
+            int tos = 46;
+            setsockopt((int)remotefd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
         }
-
-        if (remote_ctx != NULL) {
-            memcpy(&remote_ctx->dst_addr, addr, sizeof(struct sockaddr_storage));
-#if 0
-            size_t addr_len = get_sockaddr_len(addr);
-            int s           = sendto(remote_ctx->fd, query_ctx->buf->buffer, query_ctx->buf->len,
-                                     0, addr, addr_len);
-
-            if (s == -1) {
-                SS_ERROR("[udp] sendto_remote");
-                if (!cache_hit) {
-                    udp_remote_shutdown(remote_ctx);
-                }
-            } else {
-                if (!cache_hit) {
-                    // Add to conn cache
-                    char *key = hash_key(AF_UNSPEC, &remote_ctx->src_addr);
-                    cache_insert(query_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
-                    ev_io_start(EV_A_ & remote_ctx->io);
-                    ev_timer_start(EV_A_ & remote_ctx->watcher);
-                }
-            }
-#else
-            uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-            req->data = remote_ctx;
-            uv_buf_t tmp = uv_buf_init(query_ctx->buf->buffer, (unsigned int)query_ctx->buf->len);
-            uv_udp_send(req, &remote_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->dst_addr, udp_remote_send_done_cb);
 #endif
-        }
     }
 
-    // clean up
-    close_and_free_query(query_ctx);
-}
+    remote_ctx->server_ctx = server_ctx;
+    remote_ctx->src_addr = *src_addr;
+    timer_wheel_entry_init(&remote_ctx->watcher, udp_remote_timeout_cb);
 
-#endif
+    ptr_map_insert(server_ctx->connections, remote_ctx, remote_ctx);
+    server_ctx->stats.associations_opened++;
+    // may evict an association idle since the CLOCK hand last passed
+    cache_insert(server_ctx->conn_cache, key, key_len, (void *)remote_ctx);
 
-static void udp_send_done_cb(uv_udp_send_t* req, int status) {
-    //struct udp_listener_ctx_t *server_ctx = (struct udp_listener_ctx_t *)req->data;
-    struct buffer_t *buf = (struct buffer_t *)req->data;
-    buffer_release(buf);
-    free(req);
+    uv_udp_recv_start(&remote_ctx->io, udp_remote_alloc_buffer, udp_remote_recv_cb);
+    return remote_ctx;
 }
 
-static void
+static struct udp_remote_ctx_t *
+udp_remote_lookup(struct udp_listener_ctx_t *server_ctx, const struct sockaddr_storage *src_addr)
+{
+    char key[UDP_CONN_KEY_LEN];
+    size_t key_len = udp_conn_key(src_addr, NULL, 0, key);
+    struct udp_remote_ctx_t *remote_ctx = NULL;
+    cache_lookup(server_ctx->conn_cache, key, key_len, (void *)&remote_ctx);
+    return remote_ctx;
+}
+
+// Takes |buf|, which holds the bare payload.
+static void
+udp_remote_sendto(struct udp_remote_ctx_t *remote_ctx, struct buffer_t *buf, const struct sockaddr_storage *dst_addr)
+{
+    struct udp_listener_ctx_t *server_ctx = remote_ctx->server_ctx;
+    struct sockaddr_in6 mapped;
+
+    if (dst_addr->ss_family == AF_INET && remote_ctx->ipv6) {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *)dst_addr;
+        memset(&mapped, 0, sizeof(mapped));
+        mapped.sin6_family = AF_INET6;
+        mapped.sin6_port = addr4->sin_port;
+        mapped.sin6_addr.s6_addr[10] = 0xff;
+        mapped.sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&mapped.sin6_addr.s6_addr[12], &addr4->sin_addr, sizeof(struct in_addr));
+        udp_send_buffer(server_ctx, &remote_ctx->io, buf, (const struct sockaddr *)&mapped);
+    } else if (dst_addr->ss_family == AF_INET6 && !remote_ctx->ipv6) {
+        LOGE("[udp] no IPv6 to reach the destination");
+        udp_packet_release(server_ctx, buf);
+    } else {
+        udp_send_buffer(server_ctx, &remote_ctx->io, buf, (const struct sockaddr *)dst_addr);
+    }
+    timer_wheel_schedule(server_ctx->timer_wheel, &remote_ctx->watcher, (uint64_t)server_ctx->timeout);
+}
+
+// The peer as the client should see it, v4-mapped senders turn back into IPv4.
+static void
+udp_remote_peer_addr(const struct sockaddr *addr, struct sockaddr_storage *peer)
+{
+    const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+    memset(peer, 0, sizeof(*peer));
+    if (addr->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)peer;
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = addr6->sin6_port;
+        memcpy(&addr4->sin_addr, &addr6->sin6_addr.s6_addr[12], sizeof(struct in_addr));
+    } else {
+        memcpy(peer, addr, get_sockaddr_len((struct sockaddr *)addr));
+    }
+}
+
+static void query_resolve_cb(int status, const union sockaddr_universal *addrs, size_t count, void *data) {
+    struct query_ctx *query_ctx = (struct query_ctx *)data;
+    const struct sockaddr *addr = count ? &addrs[0].addr : NULL;
+    query_ctx->query = NULL;
+
+    if (addr == NULL) {
+        LOGE("[udp] udns returned an error: %s", uv_strerror(status));
+    } else {
+        struct udp_remote_ctx_t *remote_ctx;
+        // the association may have expired while resolving
+        remote_ctx = udp_remote_lookup(query_ctx->server_ctx, &query_ctx->src_addr);
+        if (remote_ctx != NULL) {
+            memset(&remote_ctx->dst_addr, 0, sizeof(remote_ctx->dst_addr));
+            memcpy(&remote_ctx->dst_addr, addr, get_sockaddr_len((struct sockaddr *)addr));
+            remote_ctx->addr_header_len = query_ctx->addr_header_len;
+            memcpy(remote_ctx->addr_header, query_ctx->addr_header, (size_t)query_ctx->addr_header_len);
+
+            udp_remote_sendto(remote_ctx, query_ctx->buf, &remote_ctx->dst_addr);
+            query_ctx->buf = NULL;
+        }
+    }
+
+    // clean up
+    close_and_free_query(query_ctx);
+}
+
+#endif
+
+static void
 udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const struct sockaddr* addr, unsigned flags)
 {
     struct udp_remote_ctx_t *remote_ctx = CONTAINER_OF(handle, struct udp_remote_ctx_t, io);
     struct udp_listener_ctx_t *server_ctx = remote_ctx->server_ctx;
     struct buffer_t *buf = NULL;
-    int err;
-    int len;
-    size_t remote_src_addr_len;
-
-    uv_timer_stop(&remote_ctx->watcher);
 
     // server has been closed
     if (server_ctx == NULL) {
@@ -685,6 +1327,16 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
         return;
     }
 
+    if (nread == 0 && addr == NULL) {
+        // nothing more to read
+        return;
+    }
+    if (nread < 0) {
+        LOGE("[udp] remote_recv_recvfrom: %s", uv_strerror((int)nread));
+        udp_remote_expire(remote_ctx);
+        return;
+    }
+
     if (nread == -1) {
         // error on recv, simply drop that packet
         LOGE("[udp] remote_recv_recvfrom");
@@ -694,14 +1346,37 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
         goto CLEAN_UP;
     }
 
-    buf = buffer_create(max((size_t)buf_size, (size_t)nread));
+    if (flags & UV_UDP_PARTIAL) {
+        LOGE("[udp] remote_recv_recvfrom truncated");
+        goto CLEAN_UP;
+    }
+
+    buf = udp_packet_create(server_ctx, (size_t)nread);
     memcpy(buf->buffer, buf0->base, (size_t)nread);
     buf->len = (size_t)nread;
 
-    udp_uv_release_buffer((uv_buf_t *)buf0);
+    udp_remote_reply(remote_ctx, buf, addr);
+    return;
+
+CLEAN_UP:
+    // a bad reply is dropped, the association stays
+    timer_wheel_schedule(server_ctx->timer_wheel, &remote_ctx->watcher, (uint64_t)server_ctx->timeout);
+}
+
+// Takes |buf|, one datagram the association got back from |addr|.
+static void
+udp_remote_reply(struct udp_remote_ctx_t *remote_ctx, struct buffer_t *buf, const struct sockaddr *addr)
+{
+    struct udp_listener_ctx_t *server_ctx = remote_ctx->server_ctx;
+    int err;
+    int len;
+    size_t remote_src_addr_len;
+#ifdef UDP_TPROXY
+    struct sockaddr_storage dst_addr = { 0 };
+#endif
 
 #ifdef MODULE_LOCAL
-    err = ss_decrypt_all(server_ctx->cipher_env, buf, buf_size);
+    err = ss_decrypt_all(server_ctx->cipher_env, buf, buf->capacity);
     if (err) {
         // drop the packet silently
         goto CLEAN_UP;
@@ -714,33 +1389,19 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
             buf->len = (ssize_t) protocol_plugin->client_udp_post_decrypt(protocol_plugin, (char **)&buf->buffer, buf->len, &buf->capacity);
             if ((ssize_t)buf->len < 0) {
                 LOGE("client_udp_post_decrypt");
-                udp_remote_shutdown(remote_ctx);
+                udp_packet_release(server_ctx, buf);
+                udp_remote_expire(remote_ctx);
                 return;
             }
             if (buf->len == 0) {
-                return;
+                goto CLEAN_UP;
             }
         }
     }
     // SSR end
 
-#ifdef MODULE_REDIR
-    struct sockaddr_storage dst_addr;
-    memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
-    len = udprelay_parse_header(buf->buffer, buf->len, NULL, NULL, &dst_addr);
-
-    if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
-        LOGI("[udp] ss-redir does not support domain name");
-        goto CLEAN_UP;
-    }
-
-    if (verbose) {
-        char src[SS_ADDRSTRLEN];
-        char dst[SS_ADDRSTRLEN];
-        strcpy(src, get_addr_str((struct sockaddr *)&src_addr));
-        strcpy(dst, get_addr_str((struct sockaddr *)&dst_addr));
-        LOGI("[udp] recv %s via %s", dst, src);
-    }
+#ifdef UDP_TPROXY
+    len = udprelay_parse_header((const char *)buf->buffer, buf->len, NULL, NULL, &dst_addr);
 #else
     len = udprelay_parse_header((const char *)buf->buffer, buf->len, NULL, NULL, NULL);
 #endif
@@ -753,24 +1414,29 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
 
     // server may return using a different address type other than the type we
     // have used during sending
-#if defined(MODULE_TUNNEL) || defined(MODULE_REDIR)
+#if defined(MODULE_TUNNEL)
     // Construct packet
-    buf->len -= len;
-    memmove(buf->buffer, buf->buffer + len, buf->len);
+    buffer_consume(buf, (size_t)len);
 #else
 #ifdef ANDROID
     if (r > 0 && log_tx_rx)
         rx += r;
 #endif
     // Construct packet
-    if (server_ctx->tunnel_addr.host && server_ctx->tunnel_addr.port) {
-        buf->len -= len;
-        memmove(buf->buffer, buf->buffer + len, buf->len);
+    if (server_ctx->tunnel_header_len > 0) {
+        buffer_consume(buf, (size_t)len);
+#ifdef UDP_TPROXY
+    } else if (remote_ctx->transparent) {
+        // The header names the source the reply goes out from, it can't be a domain.
+        if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
+            goto CLEAN_UP;
+        }
+        buffer_consume(buf, (size_t)len);
+#endif // UDP_TPROXY
     } else {
-        buffer_realloc(buf, max(buf->len + 3, buf_size));
-        memmove(buf->buffer + 3, buf->buffer, buf->len);
-        memset(buf->buffer, 0, 3);
-        buf->len += 3;
+        // The SSR address header is the SOCKS5 one less RSV and FRAG.
+        static const uint8_t rsv_frag[3] = { 0 };
+        buffer_prepend(buf, rsv_frag, sizeof(rsv_frag));
     }
 #endif
 
@@ -778,24 +1444,24 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
 
 #ifdef MODULE_REMOTE
 
-    rx += buf->len;
-
-    char addr_header_buf[512] = { 0 };
+    char addr_header_buf[32] = { 0 };
     char *addr_header   = remote_ctx->addr_header;
-    size_t addr_header_len = remote_ctx->addr_header_len;
-
-    if (remote_ctx->dst_addr.ss_family == AF_INET || remote_ctx->dst_addr.ss_family == AF_INET6) {
-        addr_header_len = construct_udprealy_header((const struct sockaddr_storage *)addr, addr_header_buf);
+    size_t addr_header_len = (size_t)remote_ctx->addr_header_len;
+    struct sockaddr_storage peer;
+
+    // Any peer may answer through the mapping, name the one that did. A reply
+    // from the domain the client asked for goes back under that domain.
+    udp_remote_peer_addr(addr, &peer);
+    if (remote_ctx->addr_header_len == 0
+        || sockaddr_cmp(&remote_ctx->dst_addr, &peer, sizeof(struct sockaddr_storage)) != 0) {
+        addr_header_len = construct_udprealy_header(&peer, addr_header_buf);
         addr_header     = addr_header_buf;
     }
 
     // Construct packet
-    buffer_realloc(buf, max(buf->len + addr_header_len, buf_size));
-    memmove(buf->buffer + addr_header_len, buf->buffer, buf->len);
-    memcpy(buf->buffer, addr_header, addr_header_len);
-    buf->len += addr_header_len;
+    buffer_prepend(buf, (const uint8_t *)addr_header, addr_header_len);
 
-    int err = ss_decrypt_all(server_ctx->cipher_env, buf, buf_size);
+    err = ss_encrypt_all(server_ctx->cipher_env, buf, buf->capacity);
     if (err) {
         // drop the packet silently
         goto CLEAN_UP;
@@ -811,83 +1477,34 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
     remote_src_addr_len = get_sockaddr_len((struct sockaddr *)&remote_ctx->src_addr);
     (void)remote_src_addr_len;
 
-#ifdef MODULE_REDIR
-
-    size_t remote_dst_addr_len = get_sockaddr_len((struct sockaddr *)&dst_addr);
-
-    int src_fd = socket(remote_ctx->src_addr.ss_family, SOCK_DGRAM, 0);
-    if (src_fd < 0) {
-        SS_ERROR("[udp] remote_recv_socket");
-        goto CLEAN_UP;
-    }
-    int opt = 1;
-    if (setsockopt(src_fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt))) {
-        SS_ERROR("[udp] remote_recv_setsockopt");
-        close(src_fd);
-        goto CLEAN_UP;
-    }
-    if (setsockopt(src_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        SS_ERROR("[udp] remote_recv_setsockopt");
-        close(src_fd);
-        goto CLEAN_UP;
-    }
-#ifdef IP_TOS
-    // Set QoS flag
-    int tos = 46;
-    setsockopt(src_fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-#endif
-    if (bind(src_fd, (struct sockaddr *)&dst_addr, remote_dst_addr_len) != 0) {
-        SS_ERROR("[udp] remote_recv_bind");
-        close(src_fd);
-        goto CLEAN_UP;
-    }
-
-    int s = sendto(src_fd, buf->buffer, buf->len, 0,
-                   (struct sockaddr *)&remote_ctx->src_addr, remote_src_addr_len);
-    if (s == -1) {
-        SS_ERROR("[udp] remote_recv_sendto");
-        close(src_fd);
-        goto CLEAN_UP;
-    }
-    close(src_fd);
+    server_ctx->stats.packets_out++;
+    server_ctx->stats.bytes_out += buf->len;
 
-#else
-    {
-    uv_buf_t tmp;
-    uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-    req->data = buf;
-    tmp = uv_buf_init((char *)buf->buffer, (unsigned int) buf->len);
-    uv_udp_send(req, &server_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->src_addr, udp_send_done_cb);
+#ifdef UDP_TPROXY
+    if (remote_ctx->transparent) {
+        udp_tproxy_reply(server_ctx->tproxy, &dst_addr, &remote_ctx->src_addr, buf);
+        udp_packet_release(server_ctx, buf);
+        timer_wheel_schedule(server_ctx->timer_wheel, &remote_ctx->watcher, (uint64_t)server_ctx->timeout);
+        return;
     }
-    udp_remote_shutdown(remote_ctx);
+#endif // UDP_TPROXY
+    udp_send_buffer(server_ctx, &server_ctx->io, buf, (const struct sockaddr *)&remote_ctx->src_addr);
+    timer_wheel_schedule(server_ctx->timer_wheel, &remote_ctx->watcher, (uint64_t)server_ctx->timeout);
     return;
-#endif
 
 CLEAN_UP:
 
-    udp_remote_shutdown(remote_ctx);
+    // a bad reply is dropped, the association stays
+    timer_wheel_schedule(server_ctx->timer_wheel, &remote_ctx->watcher, (uint64_t)server_ctx->timeout);
 
-    buffer_release(buf);
+    udp_packet_release(server_ctx, buf);
 }
 
 static void 
 udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const struct sockaddr* addr, unsigned flags)
 {
     struct udp_listener_ctx_t *server_ctx;
-    struct sockaddr_storage src_addr;
-    struct buffer_t *buf;
-    socklen_t src_addr_len;
-    unsigned int offset;
-    char addr_header[512] = { 0 };
-    int addr_header_len   = 0;
-    uint8_t frag = 0;
-
-    char host[257] = { 0 };
-    char port[65]  = { 0 };
-
-    struct udp_remote_ctx_t *remote_ctx = NULL;
-    const struct sockaddr *remote_addr;
-    int err;
+    struct sockaddr_storage src_addr = { 0 };
 
     if (NULL == addr) {
         return;
@@ -896,69 +1513,57 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
     server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, io);
     ASSERT(server_ctx);
 
-    src_addr = *(struct sockaddr_storage *)addr;
-
-    buf = buffer_create(max((size_t)buf_size, (size_t)nread));
-
-    src_addr_len = sizeof(src_addr);
-    offset    = 0;
-    (void)src_addr_len;
-
-#ifdef MODULE_REDIR
-    char control_buffer[64] = { 0 };
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(struct msghdr));
-    struct iovec iov[1];
-    struct sockaddr_storage dst_addr;
-    memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
-
-    msg.msg_name       = &src_addr;
-    msg.msg_namelen    = src_addr_len;
-    msg.msg_control    = control_buffer;
-    msg.msg_controllen = sizeof(control_buffer);
-
-    iov[0].iov_base = buf->buffer;
-    iov[0].iov_len  = buf_size;
-    msg.msg_iov     = iov;
-    msg.msg_iovlen  = 1;
-
-    buf->len = recvmsg(server_ctx->fd, &msg, 0);
-    if (buf->len == -1) {
-        SS_ERROR("[udp] server_recvmsg");
-        goto CLEAN_UP;
-    } else if (buf->len > packet_size) {
-        SS_ERROR("[udp] UDP server_recv_recvmsg fragmentation");
-        goto CLEAN_UP;
-    }
-
-    if (get_dstaddr(&msg, &dst_addr)) {
-        LOGE("[udp] unable to get dest addr");
-        goto CLEAN_UP;
+    if (flags & UV_UDP_PARTIAL) {
+        LOGE("[udp] server_recv_recvfrom truncated");
+        return;
     }
 
-    src_addr_len = msg.msg_namelen;
-#else
     // http://docs.libuv.org/en/v1.x/udp.html
 
     if (nread <= 0) {
         // error on recv
         // simply drop that packet
         LOGE("[udp] server_recv_recvfrom");
-        goto CLEAN_UP;
+        return;
     } else if (nread > (ssize_t) packet_size) {
         LOGE("[udp] server_recv_recvfrom fragmentation");
-        goto CLEAN_UP;
+        return;
     }
 
-    buffer_store(buf, (uint8_t *)buf0->base, nread);
+    memcpy(&src_addr, addr, get_sockaddr_len((struct sockaddr *)addr));
+    udp_listener_datagram(server_ctx, &src_addr, (const uint8_t *)buf0->base, (size_t)nread, NULL);
+}
 
-    udp_uv_release_buffer((uv_buf_t *)buf0);
+// One datagram from |src_addr|. |tproxy_dst| names where a TPROXY one was
+// headed, NULL for the SOCKS5 ones sent to the listener itself.
+static void
+udp_listener_datagram(struct udp_listener_ctx_t *server_ctx, const struct sockaddr_storage *src, const uint8_t *data, size_t len, const struct sockaddr_storage *tproxy_dst)
+{
+    struct sockaddr_storage src_addr = *src;
+    struct buffer_t *buf;
+    unsigned int offset;
+    const char *addr_header = NULL;    /* Within |buf|, never copied out. */
+    int addr_header_len   = 0;
+    uint8_t frag = 0;
+
+    char host[257] = { 0 };
+    char port[65]  = { 0 };
+
+    struct udp_remote_ctx_t *remote_ctx = NULL;
+    const struct sockaddr *remote_addr;
+    int err;
+
+    buf = udp_packet_create(server_ctx, len);
+    buffer_store(buf, data, len);
+    offset    = 0;
+    server_ctx->stats.packets_in++;
+    server_ctx->stats.bytes_in += len;
+#ifndef UDP_TPROXY
+    (void)tproxy_dst;
 #endif
 
 #ifdef MODULE_REMOTE
-    tx += buf->len;
-
-    int err = ss_decrypt_all(server_ctx->cipher_env, buf, buf_size);
+    err = ss_decrypt_all(server_ctx->cipher_env, buf, buf->capacity);
     if (err) {
         // drop the packet silently
         goto CLEAN_UP;
@@ -1004,79 +1609,25 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
      *
      */
 
-#ifdef MODULE_REDIR
-    if (verbose) {
-        char src[SS_ADDRSTRLEN];
-        char dst[SS_ADDRSTRLEN];
-        strcpy(src, get_addr_str((struct sockaddr *)&src_addr));
-        strcpy(dst, get_addr_str((struct sockaddr *)&dst_addr));
-        LOGI("[udp] redir to %s from %s", dst, src);
-    }
-
-    char addr_header[512] = { 0 };
-    size_t addr_header_len   = construct_udprealy_header(&dst_addr, addr_header);
-
-    if (addr_header_len == 0) {
-        LOGE("[udp] failed to parse tproxy addr");
-        goto CLEAN_UP;
-    }
-
-    // reconstruct the buffer
-    buffer_realloc(buf, max(buf->len + addr_header_len, buf_size));
-    memmove(buf->buffer + addr_header_len, buf->buffer, buf->len);
-    memcpy(buf->buffer, addr_header, addr_header_len);
-    buf->len += addr_header_len;
-
-#elif MODULE_LOCAL
-
-    if (server_ctx->tunnel_addr.host && server_ctx->tunnel_addr.port) {
-        uint16_t port_num;
-        uint16_t port_net_num;
-        union sockaddr_universal addr = { 0 };
-
-        strncpy(host, server_ctx->tunnel_addr.host, 256);
-        strncpy(port, server_ctx->tunnel_addr.port, 64);
-        port_num     = (uint16_t)atoi(port);
-        port_net_num = htons(port_num);
-        
-        if (convert_universal_address(host, port_num, &addr) == 0) {
-            if (addr.addr4.sin_family == AF_INET) {
-                // send as IPv4
-                struct in_addr host_addr = addr.addr4.sin_addr;
-                int host_len = sizeof(struct in_addr);
-
-                addr_header[addr_header_len++] = 1;
-                memcpy(addr_header + addr_header_len, &host_addr, host_len);
-                addr_header_len += host_len;
-            } else if (addr.addr4.sin_family == AF_INET6) {
-                // send as IPv6
-                struct in6_addr host_addr = addr.addr6.sin6_addr;
-                int host_len = sizeof(struct in6_addr);
-
-                addr_header[addr_header_len++] = 4;
-                memcpy(addr_header + addr_header_len, &host_addr, host_len);
-                addr_header_len += host_len;
-            } else {
-                FATAL("IP parser error");
-            }
-        } else {
-            // send as domain
-            int host_len = (int) strlen(host);
+#ifdef MODULE_LOCAL
 
-            addr_header[addr_header_len++] = 3;
-            addr_header[addr_header_len++] = host_len;
-            memcpy(addr_header + addr_header_len, host, host_len);
-            addr_header_len += host_len;
+#ifdef UDP_TPROXY
+    if (tproxy_dst) {
+        char tproxy_header[32];
+        addr_header_len = (int) construct_udprealy_header(tproxy_dst, tproxy_header);
+        if (addr_header_len == 0) {
+            goto CLEAN_UP;
         }
-        memcpy(addr_header + addr_header_len, &port_net_num, 2);
-        addr_header_len += 2;
-
-        // reconstruct the buffer
-        buffer_realloc(buf, max(buf->len + addr_header_len, buf_size));
-        memmove(buf->buffer + addr_header_len, buf->buffer, buf->len);
-        memcpy(buf->buffer, addr_header, addr_header_len);
-        buf->len += addr_header_len;
 
+        // into the headroom, the payload stays put
+        buffer_prepend(buf, (const uint8_t *)tproxy_header, (size_t)addr_header_len);
+        addr_header = (const char *)buf->buffer;
+    } else
+#endif // UDP_TPROXY
+    if (server_ctx->tunnel_header_len > 0) {
+        addr_header_len = (int) server_ctx->tunnel_header_len;
+        buffer_prepend(buf, (const uint8_t *)server_ctx->tunnel_header, server_ctx->tunnel_header_len);
+        addr_header = (const char *)buf->buffer;
     } else {
         struct sockaddr_storage dst_addr;
 
@@ -1090,28 +1641,24 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
             // error in parse header
             goto CLEAN_UP;
         }
-
-        memcpy(addr_header, buf->buffer + offset, (size_t) addr_header_len);
+        addr_header = (const char *)buf->buffer + offset;
     }
 #else
     // MODULE_REMOTE
-    char host[257] = { 0 };
-    char port[64] = { 0 };
     struct sockaddr_storage dst_addr = { 0 };
 
-    int addr_header_len = udprelay_parse_header(buf->buffer + offset, buf->len - offset, host, port, &dst_addr);
+    addr_header_len = udprelay_parse_header((const char *)buf->buffer + offset, buf->len - offset, host, port, &dst_addr);
     if (addr_header_len == 0) {
         // error in parse header
         goto CLEAN_UP;
     }
-
-    char *addr_header = buf->buffer + offset;
+    addr_header = (const char *)buf->buffer + offset;
 
 #endif
 
 #ifdef MODULE_LOCAL
 
-#if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
+#if !defined(MODULE_TUNNEL)
     if (frag) {
         LOGE("[udp] drop a message since frag is not 0, but %d", frag);
         goto CLEAN_UP;
@@ -1120,45 +1667,79 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 
     remote_addr = &server_ctx->remote_addr.addr;
 
+    if ((size_t)addr_header_len > sizeof(remote_ctx->addr_header)) {
+        goto CLEAN_UP;
+    }
+
     {
-        bool ipv6;
-        int remotefd;
-        remote_ctx = (struct udp_remote_ctx_t *) calloc(1, sizeof(struct udp_remote_ctx_t));
-
-        // Bind to any port
-        ipv6 = (remote_addr->sa_family == AF_INET6);
-        remotefd = udp_create_remote_socket(ipv6, server_ctx->io.loop, &remote_ctx->io);
-        if (remotefd < 0) {
-            LOGE("[udp] udprelay bind() error");
-            goto CLEAN_UP;
-        }
+        char key[UDP_CONN_KEY_LEN];
+        size_t key_len = udp_conn_key(&src_addr, addr_header, (size_t)addr_header_len, key);
+        cache_lookup(server_ctx->conn_cache, key, key_len, (void *)&remote_ctx);
 
-        // Init remote_ctx
-        remote_ctx->server_ctx = server_ctx;
-        remote_ctx->src_addr        = src_addr;
-        remote_ctx->addr_header_len = addr_header_len;
-        memcpy(remote_ctx->addr_header, addr_header, (size_t) addr_header_len);
+        if (remote_ctx == NULL) {
+            bool ipv6;
+            int remotefd;
+            remote_ctx = (struct udp_remote_ctx_t *) ssr_calloc(ssr_alloc_tunnels, 1, sizeof(struct udp_remote_ctx_t));
+            ssr_census_add(ssr_census_udp_remotes, sizeof(*remote_ctx));
+
+            if (server_ctx->stream_send) {
+                // never bound, libuv opens no socket for it
+                remotefd = uv_udp_init(server_ctx->io.loop, &remote_ctx->io);
+            } else {
+                // Bind to any port
+                ipv6 = (remote_addr->sa_family == AF_INET6);
+                remotefd = udp_create_remote_socket(ipv6, server_ctx->io.loop, &remote_ctx->io);
+            }
+            if (remotefd < 0) {
+                LOGE("[udp] udprelay bind() error");
+                remote_ctx->io.data = remote_ctx;
+                remote_ctx->ref_count = 1;
+                uv_close((uv_handle_t *)&remote_ctx->io, udp_remote_close_done_cb);
+                goto CLEAN_UP;
+            }
+
+            // Init remote_ctx
+            remote_ctx->server_ctx = server_ctx;
+            remote_ctx->src_addr        = src_addr;
+            remote_ctx->addr_header_len = addr_header_len;
+            memcpy(remote_ctx->addr_header, addr_header, (size_t) addr_header_len);
+            remote_ctx->transparent = (tproxy_dst != NULL);
 
-        uv_timer_init(server_ctx->io.loop, &remote_ctx->watcher);
+            timer_wheel_entry_init(&remote_ctx->watcher, udp_remote_timeout_cb);
 
-        cstl_set_container_add(server_ctx->connections, (void *)remote_ctx);
+            ptr_map_insert(server_ctx->connections, remote_ctx, remote_ctx);
+            server_ctx->stats.associations_opened++;
+            // may evict an association idle since the CLOCK hand last passed
+            cache_insert(server_ctx->conn_cache, key, key_len, (void *)remote_ctx);
 
-        uv_udp_recv_start(&remote_ctx->io, udp_uv_alloc_buffer, udp_remote_recv_cb);
-        uv_timer_start(&remote_ctx->watcher, udp_remote_timeout_cb, (uint64_t)server_ctx->timeout, 0);
+            if (server_ctx->stream_send) {
+                if (++server_ctx->next_assoc_id == 0) {
+                    ++server_ctx->next_assoc_id;
+                }
+                remote_ctx->assoc_id = server_ctx->next_assoc_id;
+                cache_insert(server_ctx->stream_assocs, (char *)&remote_ctx->assoc_id, sizeof(remote_ctx->assoc_id), (void *)remote_ctx);
+            } else {
+                uv_udp_recv_start(&remote_ctx->io, udp_remote_alloc_buffer, udp_remote_recv_cb);
+            }
+        }
+        timer_wheel_schedule(server_ctx->timer_wheel, &remote_ctx->watcher, (uint64_t)server_ctx->timeout);
     }
 
-    buffer_shorten(buf, offset, buf->len - offset);
+    // RSV and FRAG off, the SOCKS5 header is then the SSR one
+    buffer_consume(buf, offset);
 
     // SSR beg
     if (server_ctx->protocol_plugin) {
         struct obfs_t *protocol_plugin = server_ctx->protocol_plugin;
         if (protocol_plugin->client_udp_pre_encrypt) {
+            // It reallocs |buffer| itself when short of room, never let it with headroom in front.
+            buffer_reserve(buf, UDP_PACKET_SLACK);
             buf->len = (size_t) protocol_plugin->client_udp_pre_encrypt(protocol_plugin, (char **)&buf->buffer, buf->len, &buf->capacity);
         }
     }
     //SSR end
 
-    err = ss_encrypt_all(server_ctx->cipher_env, buf, buf->len);
+    err = ss_encrypt_all(server_ctx->cipher_env, buf, buf->capacity);
 
     if (err) {
         // drop the packet silently
@@ -1169,15 +1750,13 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         LOGE("[udp] server_recv_sendto fragmentation");
         goto CLEAN_UP;
     }
-    {
-    uv_buf_t tmp;
-    uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-    req->data = buf;
-    tmp = uv_buf_init((char *)buf->buffer, (unsigned int) buf->len);
-    uv_udp_send(req, &remote_ctx->io, &tmp, 1, remote_addr, udp_send_done_cb);
+    if (server_ctx->stream_send) {
+        server_ctx->stream_send(server_ctx->stream_p, remote_ctx->assoc_id, buf->buffer, buf->len);
+        goto CLEAN_UP;
     }
+    udp_send_buffer(server_ctx, &remote_ctx->io, buf, remote_addr);
     return;
-#if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
+#if !defined(MODULE_TUNNEL)
 #ifdef ANDROID
     if (log_tx_rx)
         tx += buf->len;
@@ -1186,111 +1765,42 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 
 #else
 
-    int cache_hit  = 0;
-    int need_query = 0;
-
     if (buf->len - addr_header_len > packet_size) {
         LOGE("[udp] server_recv_sendto fragmentation");
         goto CLEAN_UP;
     }
+    if ((size_t)addr_header_len > sizeof(remote_ctx->addr_header)) {
+        goto CLEAN_UP;
+    }
 
-    if (remote_ctx != NULL) {
-        cache_hit = 1;
-        // detect destination mismatch
-        if (remote_ctx->addr_header_len != addr_header_len
-            || memcmp(addr_header, remote_ctx->addr_header, addr_header_len) != 0) {
-            if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
-                need_query = 1;
-            }
-        } else {
-            memcpy(&dst_addr, &remote_ctx->dst_addr, sizeof(struct sockaddr_storage));
-        }
-    } else {
-        if (dst_addr.ss_family == AF_INET || dst_addr.ss_family == AF_INET6) {
-            remote_ctx = calloc(1, sizeof(struct udp_remote_ctx_t));
-
-            bool ipv6 = (dst_addr.ss_family == AF_INET6);
-            int remotefd = udp_create_remote_socket(ipv6, server_ctx->io.loop, &remote_ctx->io);
-            if (remotefd != -1) {
-                // setnonblocking(remotefd);
-#ifdef SO_BROADCAST
-                set_broadcast(remotefd);
-#endif
-#ifdef SO_NOSIGPIPE
-                set_nosigpipe(remotefd);
-#endif
-#ifdef IP_TOS
-                // Set QoS flag
-                int tos = 46;
-                setsockopt(remotefd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-#endif
-#ifdef SET_INTERFACE
-                if (server_ctx->iface) {
-                    if (setinterface(remotefd, server_ctx->iface) == -1)
-                        SS_ERROR("setinterface");
-                }
-#endif
-                remote_ctx->src_addr        = src_addr;
-                remote_ctx->server_ctx      = server_ctx;
-                remote_ctx->addr_header_len = addr_header_len;
-                memcpy(remote_ctx->addr_header, addr_header, addr_header_len);
-                memcpy(&remote_ctx->dst_addr, &dst_addr, sizeof(struct sockaddr_storage));
-            } else {
-                SS_ERROR("[udp] bind() error");
-                goto CLEAN_UP;
-            }
+    remote_ctx = udp_remote_lookup(server_ctx, &src_addr);
+    if (remote_ctx == NULL) {
+        remote_ctx = udp_remote_create(server_ctx, &src_addr);
+        if (remote_ctx == NULL) {
+            goto CLEAN_UP;
         }
     }
 
-    if (remote_ctx != NULL && !need_query) {
-        /*
-        size_t addr_len = get_sockaddr_len((struct sockaddr *)&dst_addr);
-        int s           = sendto(remote_ctx->fd, buf->buffer + addr_header_len,
-                                 buf->len - addr_header_len, 0,
-                                 (struct sockaddr *)&dst_addr, addr_len);
-
-        if (s == -1) {
-            SS_ERROR("[udp] sendto_remote");
-            if (!cache_hit) {
-                udp_remote_shutdown(remote_ctx);
-            }
-        } else {
-            if (!cache_hit) {
-                // Add to conn cache
-                remote_ctx->af = dst_addr.ss_family;
-                char *key = hash_key(remote_ctx->af, &remote_ctx->src_addr);
-                cache_insert(server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
-
-                ev_io_start(EV_A_ & remote_ctx->io);
-                ev_timer_start(EV_A_ & remote_ctx->watcher);
-            }
-        }
-        */
-        remote_ctx->dst_addr;
-        uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-        req->data = remote_ctx;
-        uv_buf_t tmp = uv_buf_init(buf->buffer + addr_header_len, (unsigned int)buf->len - addr_header_len);
-        uv_udp_send(req, &remote_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->dst_addr, udp_remote_send_done_cb);
+    if (dst_addr.ss_family == AF_INET || dst_addr.ss_family == AF_INET6) {
+        buffer_consume(buf, (size_t)addr_header_len);
+        udp_remote_sendto(remote_ctx, buf, &dst_addr);
+        return;
+    } else if (remote_ctx->addr_header_len == addr_header_len
+        && memcmp(addr_header, remote_ctx->addr_header, (size_t)addr_header_len) == 0) {
+        // same domain as last time, skip the query
+        buffer_consume(buf, (size_t)addr_header_len);
+        udp_remote_sendto(remote_ctx, buf, &remote_ctx->dst_addr);
+        return;
     } else {
-        struct addrinfo hints;
-        memset(&hints, 0, sizeof(struct addrinfo));
-        hints.ai_family   = AF_UNSPEC;
-        hints.ai_socktype = SOCK_DGRAM;
-        hints.ai_protocol = IPPROTO_UDP;
-
-        struct query_ctx *query_ctx = new_query_ctx(buf->buffer + addr_header_len,
+        struct query_ctx *query_ctx = new_query_ctx((char *)buf->buffer + addr_header_len,
                                                     buf->len - addr_header_len);
         query_ctx->server_ctx      = server_ctx;
         query_ctx->addr_header_len = addr_header_len;
         query_ctx->src_addr        = src_addr;
         memcpy(query_ctx->addr_header, addr_header, addr_header_len);
 
-        if (need_query) {
-            query_ctx->remote_ctx = remote_ctx;
-        }
-
-        struct resolv_query *query = 
-            resolv_query(host, query_resolve_cb, NULL, query_ctx, htons(atoi(port)));
+        struct resolv_query *query =
+            resolv_query(server_ctx->resolver, host, htons(atoi(port)), query_resolve_cb, query_ctx);
         if (query == NULL) {
             SS_ERROR("[udp] unable to create DNS query");
             close_and_free_query(query_ctx);
@@ -1301,7 +1811,7 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 #endif
 
 CLEAN_UP:
-    buffer_release(buf);
+    udp_packet_release(server_ctx, buf);
 }
 
 struct udp_listener_ctx_t *
@@ -1309,6 +1819,9 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
 #ifdef MODULE_LOCAL
     const union sockaddr_universal *remote_addr,
     const struct ss_host_port *tunnel_addr,
+#endif
+#ifdef MODULE_REMOTE
+    bool reuse_port,
 #endif
     int mtu, int timeout, struct cipher_env_t *cipher_env,
     const char *protocol, const char *protocol_param)
@@ -1320,27 +1833,32 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
     // Initialize MTU
     if (mtu > 0) {
         packet_size = mtu - 1 - 28 - 2 - 64;
-        buf_size    = packet_size * 2;
     }
 
     // ////////////////////////////////////////////////
     // Setup server context
 
-    server_ctx = (struct udp_listener_ctx_t *)calloc(1, sizeof(struct udp_listener_ctx_t));
+    server_ctx = (struct udp_listener_ctx_t *)ssr_calloc(ssr_alloc_tunnels, 1, sizeof(struct udp_listener_ctx_t));
 
     // Bind to port
-    serverfd = udp_create_local_listener(server_host, server_port, loop, &server_ctx->io);
+#ifndef MODULE_REMOTE
+    bool reuse_port = false;
+#endif
+    serverfd = udp_create_local_listener(server_host, server_port, reuse_port, loop, &server_ctx->io);
     if (serverfd < 0) {
         FATAL("[udp] bind() error");
     }
 
     server_ctx->cipher_env = cipher_env;
 #ifdef MODULE_REMOTE
-    //server_ctx->loop = loop;
+    server_ctx->resolver = ((struct server_env_t *)loop->data)->resolver;
 #endif
     server_ctx->timeout    = max(timeout, MIN_UDP_TIMEOUT);
-    server_ctx->connections = cstl_set_container_create(tunnel_ctx_compare_for_c_set, NULL);
+    server_ctx->connections = ptr_map_create(MAX_UDP_CONN_NUM);
+    server_ctx->timer_wheel = timer_wheel_create(loop, TIMER_WHEEL_TICK_MS);
+    cache_create(&server_ctx->conn_cache, MAX_UDP_CONN_NUM, udp_conn_cache_free_cb);
 #ifdef MODULE_LOCAL
+    cache_create(&server_ctx->stream_assocs, MAX_UDP_CONN_NUM, udp_stream_assocs_free_cb);
     server_ctx->remote_addr     = *remote_addr;
     //SSR beg
     server_ctx->protocol_plugin = new_obfs_instance(protocol);
@@ -1348,7 +1866,7 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
         server_ctx->protocol_global = server_ctx->protocol_plugin->init_data();
     }
 
-    strcpy(server_info.host, server_host);
+    server_info.host = server_host;
     server_info.port = server_port;
     server_info.g_data = server_ctx->protocol_global;
     server_info.param = (char *)protocol_param;
@@ -1361,17 +1879,28 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
     //SSR end
     if (tunnel_addr) {
         server_ctx->tunnel_addr = *tunnel_addr;
+        if (tunnel_addr->host && tunnel_addr->port) {
+            server_ctx->tunnel_header_len = udp_tunnel_header(tunnel_addr, server_ctx->tunnel_header);
+        }
     }
 #endif
 
-    uv_udp_recv_start(&server_ctx->io, udp_uv_alloc_buffer, udp_listener_recv_cb);
+#ifdef UDP_GSO
+    server_ctx->gso = udp_gso_create(server_ctx);
+#endif
+    server_ctx->recv_slab = (char *) ssr_malloc(ssr_alloc_buffers, UDP_RECV_SLOT_SIZE * UDP_RECV_BATCH);
+    uv_udp_recv_start(&server_ctx->io, udp_listener_alloc_buffer, udp_listener_recv_cb);
     
     return server_ctx;
 }
 
 static void udp_local_listener_close_done_cb(uv_handle_t* handle) {
     struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, io);
-    cstl_set_container_destroy(server_ctx->connections);
+    ptr_map_destroy(server_ctx->connections);
+    ssr_free(ssr_alloc_buffers, server_ctx->recv_slab);
+    while (server_ctx->spare_count > 0) {
+        buffer_release(server_ctx->spare_packets[--server_ctx->spare_count]);
+    }
 
 #ifdef MODULE_LOCAL
     // SSR beg
@@ -1382,18 +1911,166 @@ static void udp_local_listener_close_done_cb(uv_handle_t* handle) {
     // SSR end
 #endif
 
-    free(server_ctx);
-}
-
-void connection_release(const void *obj, void *p) {
-    (void)p;
-    udp_remote_shutdown((struct udp_remote_ctx_t *)obj);
+    ssr_free(ssr_alloc_tunnels, server_ctx);
 }
 
 void udprelay_shutdown(struct udp_listener_ctx_t *server_ctx) {
+    struct udp_remote_ctx_t *remote_ctx;
     if (server_ctx == NULL) {
         return;
     }
-    cstl_set_container_traverse(server_ctx->connections, &connection_release, NULL);
+#ifdef UDP_GSO
+    udp_gso_destroy(server_ctx->gso);
+#endif
+    cache_delete(server_ctx->conn_cache, 0);
+    server_ctx->conn_cache = NULL;
+    // Each shutdown takes its association out of the map.
+    while ((remote_ctx = (struct udp_remote_ctx_t *)ptr_map_any(server_ctx->connections)) != NULL) {
+        udp_remote_shutdown(remote_ctx);
+    }
+#ifdef MODULE_LOCAL
+    cache_delete(server_ctx->stream_assocs, 0);
+    server_ctx->stream_assocs = NULL;
+    server_ctx->stream_send = NULL;
+#ifdef UDP_TPROXY
+    udp_tproxy_shutdown(server_ctx->tproxy);
+    server_ctx->tproxy = NULL;
+#endif
+#endif
+    timer_wheel_release(server_ctx->timer_wheel);
+    server_ctx->timer_wheel = NULL;
     uv_close((uv_handle_t *)&server_ctx->io, udp_local_listener_close_done_cb);
 }
+
+void udprelay_stats_add(const struct udp_listener_ctx_t *server_ctx, struct udprelay_stats *stats) {
+    if (server_ctx == NULL) {
+        return;
+    }
+    stats->associations_opened += server_ctx->stats.associations_opened;
+    stats->associations_closed += server_ctx->stats.associations_closed;
+    stats->packets_in += server_ctx->stats.packets_in;
+    stats->packets_out += server_ctx->stats.packets_out;
+    stats->bytes_in += server_ctx->stats.bytes_in;
+    stats->bytes_out += server_ctx->stats.bytes_out;
+}
+
+#ifdef MODULE_REMOTE
+int udprelay_steer_by_source(struct udp_listener_ctx_t *server_ctx, size_t shards) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    // The skb's flow hash, of the source and destination addresses and
+    // ports, picks the socket by its place in the group.
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_RXHASH) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)shards },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { (unsigned short)(sizeof(code) / sizeof(code[0])), code };
+    uv_os_fd_t fd = (uv_os_fd_t)-1;
+    int err;
+
+    if (server_ctx == NULL || shards < 2) {
+        return UV_EINVAL;
+    }
+    if ((err = uv_fileno((uv_handle_t *)&server_ctx->io, &fd)) != 0) {
+        return err;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+        return -errno;
+    }
+    return 0;
+#else
+    (void)server_ctx;
+    (void)shards;
+    return UV_ENOTSUP;
+#endif
+}
+#endif
+
+#ifdef MODULE_LOCAL
+int udprelay_enable_transparent(struct udp_listener_ctx_t *server_ctx) {
+#ifdef UDP_TPROXY
+    struct udp_tproxy *tp;
+    union sockaddr_universal local = { 0 };
+    int local_len = sizeof(local);
+    uv_os_fd_t fd = (uv_os_fd_t)-1;
+    int on = 1;
+    int err;
+
+    if (server_ctx->tproxy) {
+        return 0;
+    }
+    if ((err = uv_fileno((uv_handle_t *)&server_ctx->io, &fd)) != 0 ||
+        (err = uv_udp_getsockname(&server_ctx->io, &local.addr, &local_len)) != 0)
+    {
+        return err;
+    }
+    // IPv4 datagrams reach a dual stack listener too, they carry the IP level ancillary data.
+    if (setsockopt(fd, SOL_IP, IP_TRANSPARENT, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_IP, IP_RECVORIGDSTADDR, &on, sizeof(on)) != 0)
+    {
+        return uv_translate_sys_error(errno);
+    }
+    if (local.addr.sa_family == AF_INET6 &&
+        (setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &on, sizeof(on)) != 0 ||
+         setsockopt(fd, SOL_IPV6, IPV6_RECVORIGDSTADDR, &on, sizeof(on)) != 0))
+    {
+        return uv_translate_sys_error(errno);
+    }
+
+    tp = (struct udp_tproxy *) ssr_calloc(ssr_alloc_tunnels, 1, sizeof(*tp));
+    tp->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (tp->fd < 0) {
+        err = uv_translate_sys_error(errno);
+        ssr_free(ssr_alloc_tunnels, tp);
+        return err;
+    }
+    // Runs of one flow come in as one read, an older kernel reads them one by one.
+    (void)setsockopt(tp->fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on));
+    if ((err = uv_poll_init(server_ctx->io.loop, &tp->poll, tp->fd)) != 0) {
+        close(tp->fd);
+        ssr_free(ssr_alloc_tunnels, tp);
+        return err;
+    }
+    tp->port = local.addr4.sin_port;  /* Where sin6_port is too. */
+    tp->server_ctx = server_ctx;
+    cache_create(&tp->reply_sockets, UDP_TPROXY_REPLY_SOCKETS, udp_tproxy_reply_socket_free_cb);
+    // libuv's reads have no ancillary data, the listener's datagrams come through |tp| from now on.
+    uv_udp_recv_stop(&server_ctx->io);
+    uv_poll_start(&tp->poll, UV_READABLE, udp_tproxy_poll_cb);
+    server_ctx->tproxy = tp;
+    return 0;
+#else
+    (void)server_ctx;
+    return UV_ENOTSUP;
+#endif // UDP_TPROXY
+}
+
+void udprelay_set_stream(struct udp_listener_ctx_t *server_ctx,
+    void(*send_cb)(void *p, uint32_t assoc_id, const uint8_t *data, size_t len), void *p)
+{
+    server_ctx->stream_send = send_cb;
+    server_ctx->stream_p = p;
+}
+
+void udprelay_stream_deliver(struct udp_listener_ctx_t *server_ctx, uint32_t assoc_id, const uint8_t *data, size_t len) {
+    struct udp_remote_ctx_t *remote_ctx = NULL;
+    struct buffer_t *buf;
+
+    if (server_ctx->stream_assocs == NULL || len == 0) {
+        return;
+    }
+    cache_lookup(server_ctx->stream_assocs, (char *)&assoc_id, sizeof(assoc_id), (void *)&remote_ctx);
+    if (remote_ctx == NULL) {
+        // expired meanwhile
+        return;
+    }
+    if (len > packet_size) {
+        LOGE("[udp] remote_recv_recvfrom fragmentation");
+        return;
+    }
+    buf = udp_packet_create(server_ctx, len);
+    memcpy(buf->buffer, data, len);
+    buf->len = len;
+    udp_remote_reply(remote_ctx, buf, NULL);
+}
+#endif
@@ -23,6 +23,8 @@
 #ifndef _UDPRELAY_H
 #define _UDPRELAY_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <uv.h>
 
 struct ss_host_port;
@@ -30,14 +32,62 @@ struct udp_listener_ctx_t;
 struct cipher_env_t;
 union sockaddr_universal;
 
+struct udprelay_stats {
+    uint64_t associations_opened;
+    uint64_t associations_closed;
+    uint64_t packets_in;  /* Datagrams from the clients, */
+    uint64_t packets_out;  /* and relayed back to them. */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+/* ssr-server runs one per worker, all on the same port with |reuse_port|. */
 struct udp_listener_ctx_t * udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
 #ifdef MODULE_LOCAL
     const union sockaddr_universal *remote_addr,
     const struct ss_host_port *tunnel_addr,
+#endif
+#ifdef MODULE_REMOTE
+    bool reuse_port,
 #endif
     int mtu, int timeout, struct cipher_env_t *cipher_env,
     const char *protocol, const char *protocol_param);
 
 void udprelay_shutdown(struct udp_listener_ctx_t *server_ctx);
 
+/* Adds the counters of |server_ctx|, NULL for none, to |stats|. Any thread may, they're read as they go. */
+void udprelay_stats_add(const struct udp_listener_ctx_t *server_ctx, struct udprelay_stats *stats);
+
+#ifdef MODULE_REMOTE
+/*
+ * Once the |shards| workers' relays are bound, in order, a classic BPF
+ * program on their reuseport group sends every datagram of a client
+ * source to the same one, the kernel's flow hash modulo |shards|, so the
+ * association stays on that worker's loop. The kernel's own choice hashes
+ * too, but moves sources around as sockets join or leave. Linux only,
+ * UV_ENOTSUP elsewhere.
+ */
+int udprelay_steer_by_source(struct udp_listener_ctx_t *server_ctx, size_t shards);
+#endif
+
+#ifdef MODULE_LOCAL
+/*
+ * Hands every encrypted datagram to |send_cb| instead of sending it over
+ * UDP, tagged with the id of its association. Replies come back through
+ * udprelay_stream_deliver() with the same id.
+ */
+void udprelay_set_stream(struct udp_listener_ctx_t *server_ctx,
+    void(*send_cb)(void *p, uint32_t assoc_id, const uint8_t *data, size_t len), void *p);
+void udprelay_stream_deliver(struct udp_listener_ctx_t *server_ctx, uint32_t assoc_id, const uint8_t *data, size_t len);
+/*
+ * Also relays the datagrams iptables TPROXY sends to the listener, each to
+ * the destination it was headed for, read in batches with recvmmsg(). The
+ * replies go out from that destination through IP_TRANSPARENT sockets, one
+ * per address, kept for the next ones. Datagrams to the listener's own
+ * port are still SOCKS5. Linux only, UV_ENOTSUP elsewhere, UV_EPERM
+ * without CAP_NET_ADMIN.
+ */
+int udprelay_enable_transparent(struct udp_listener_ctx_t *server_ctx);
+#endif
+
 #endif // _UDPRELAY_H